@@ -7,16 +7,24 @@
 #include <memory>
 
 #include "log/cert.h"
+#include "proto/binary_entries.h"
 #include "proto/cert_serializer.h"
 #include "proto/serializer.h"
+#include "util/compression.h"
+#include "util/json_stream_reader.h"
 #include "util/json_wrapper.h"
 
 using cert_trans::AsyncLogClient;
+using cert_trans::BinaryEntry;
+using cert_trans::BinaryEntryReader;
 using cert_trans::Cert;
 using cert_trans::CertChain;
+using cert_trans::JsonStreamReader;
 using cert_trans::PreCertChain;
 using cert_trans::URL;
 using cert_trans::UrlFetcher;
+using cert_trans::ZstdDecompressor;
+using cert_trans::ZstdSupported;
 using cert_trans::serialization::DeserializeResult;
 using ct::DigitallySigned;
 using ct::MerkleAuditProof;
@@ -24,8 +32,10 @@ using ct::SignedCertificateTimestamp;
 using ct::SignedTreeHead;
 using std::back_inserter;
 using std::bind;
+using std::make_pair;
 using std::move;
 using std::placeholders::_1;
+using std::placeholders::_2;
 using std::string;
 using std::to_string;
 using std::unique_ptr;
@@ -58,7 +68,12 @@ bool SanityCheck(UrlFetcher::Response* resp,
 }
 
 
+// Sent by the server with get-sth replies if it supports "newer_than".
+const char kSTHLongPollHeader[] = "X-CT-STH-Long-Poll";
+
+
 void DoneGetSTH(UrlFetcher::Response* resp, SignedTreeHead* sth,
+                std::atomic<bool>* long_polls_sth,
                 const AsyncLogClient::Callback& done, util::Task* task) {
   unique_ptr<UrlFetcher::Response> resp_deleter(CHECK_NOTNULL(resp));
   unique_ptr<util::Task> task_deleter(CHECK_NOTNULL(task));
@@ -69,6 +84,9 @@ void DoneGetSTH(UrlFetcher::Response* resp, SignedTreeHead* sth,
     return;
   }
 
+  long_polls_sth->store(resp->headers.find(kSTHLongPollHeader) !=
+                        resp->headers.end());
+
   JsonObject jresponse(resp->body);
   if (!jresponse.Ok())
     return done(AsyncLogClient::BAD_RESPONSE);
@@ -142,87 +160,47 @@ void DoneGetRoots(UrlFetcher::Response* resp, vector<unique_ptr<Cert>>* roots,
 }
 
 
-void DoneGetEntries(UrlFetcher::Response* resp,
-                    vector<AsyncLogClient::Entry>* entries,
-                    const AsyncLogClient::Callback& done, util::Task* task) {
-  unique_ptr<UrlFetcher::Response> resp_deleter(CHECK_NOTNULL(resp));
-  unique_ptr<util::Task> task_deleter(CHECK_NOTNULL(task));
-
-  if (!SanityCheck(resp, done, task)) {
-    return;
-  }
-
-  JsonObject jresponse(resp->body);
-  if (!jresponse.Ok())
-    return done(AsyncLogClient::BAD_RESPONSE);
-
-  JsonArray jentries(jresponse, "entries");
-  if (!jentries.Ok())
-    return done(AsyncLogClient::BAD_RESPONSE);
-
-  vector<AsyncLogClient::Entry> new_entries;
-  new_entries.reserve(jentries.Length());
+// Upper bound on the size of a decompressed binary get-entries
+// response, well above what a page of entries takes.
+const size_t kMaxBinaryEntriesSize = 256 << 20;
 
-  for (int n = 0; n < jentries.Length(); ++n) {
-    JsonObject entry(jentries, n);
-    if (!entry.Ok()) {
-      return done(AsyncLogClient::BAD_RESPONSE);
-    }
 
-    JsonString leaf_input(entry, "leaf_input");
-    if (!leaf_input.Ok()) {
-      return done(AsyncLogClient::BAD_RESPONSE);
-    }
+// Fills in |log_entry| from the get-entries encoding of an entry, and
+// its optional SCT (which is not standard, and only used by the log
+// internally when running in clustered mode).
+bool ParseEntry(const string& leaf_input, const string& extra_data,
+                const string* sct_data, AsyncLogClient::Entry* log_entry) {
+  if (Deserializer::DeserializeMerkleTreeLeaf(leaf_input, &log_entry->leaf) !=
+      DeserializeResult::OK) {
+    return false;
+  }
 
-    AsyncLogClient::Entry log_entry;
-    if (Deserializer::DeserializeMerkleTreeLeaf(leaf_input.FromBase64(),
-                                                &log_entry.leaf) !=
+  if (sct_data) {
+    unique_ptr<SignedCertificateTimestamp> sct(new SignedCertificateTimestamp);
+    if (Deserializer::DeserializeSCT(*sct_data, sct.get()) !=
         DeserializeResult::OK) {
-      return done(AsyncLogClient::BAD_RESPONSE);
-    }
-
-    JsonString extra_data(entry, "extra_data");
-    if (!extra_data.Ok()) {
-      return done(AsyncLogClient::BAD_RESPONSE);
-    }
-
-    // This is an optional non-standard extension, used only by the log
-    // internally when running in clustered mode.
-    JsonString sct_data(entry, "sct");
-    if (sct_data.Ok()) {
-      unique_ptr<SignedCertificateTimestamp> sct(
-          new SignedCertificateTimestamp);
-      if (Deserializer::DeserializeSCT(sct_data.FromBase64(), sct.get()) !=
-          DeserializeResult::OK) {
-        return done(AsyncLogClient::BAD_RESPONSE);
-      }
-      log_entry.sct = move(sct);
-    }
-
-    switch (log_entry.leaf.timestamped_entry().entry_type()) {
-      case ct::X509_ENTRY:
-        DeserializeX509Chain(extra_data.FromBase64(),
-                             log_entry.entry.mutable_x509_entry());
-        break;
-      case ct::PRECERT_ENTRY:
-        DeserializePrecertChainEntry(extra_data.FromBase64(),
-                                     log_entry.entry.mutable_precert_entry());
-        break;
-      case ct::X_JSON_ENTRY:
-        // nothing to do
-        break;
-      default:
-        LOG(FATAL) << "Don't understand entry type: "
-                   << log_entry.leaf.timestamped_entry().entry_type();
+      return false;
     }
-
-    new_entries.emplace_back(move(log_entry));
+    log_entry->sct = move(sct);
   }
 
-  entries->reserve(entries->size() + new_entries.size());
-  move(new_entries.begin(), new_entries.end(), back_inserter(*entries));
+  switch (log_entry->leaf.timestamped_entry().entry_type()) {
+    case ct::X509_ENTRY:
+      DeserializeX509Chain(extra_data, log_entry->entry.mutable_x509_entry());
+      break;
+    case ct::PRECERT_ENTRY:
+      DeserializePrecertChainEntry(extra_data,
+                                   log_entry->entry.mutable_precert_entry());
+      break;
+    case ct::X_JSON_ENTRY:
+      // nothing to do
+      break;
+    default:
+      LOG(FATAL) << "Don't understand entry type: "
+                 << log_entry->leaf.timestamped_entry().entry_type();
+  }
 
-  return done(AsyncLogClient::OK);
+  return true;
 }
 
 
@@ -377,22 +355,347 @@ URL NormalizeURL(const string& server_url) {
 namespace cert_trans {
 
 
+class AsyncLogClient::BinaryEntriesDecoder {
+ public:
+  explicit BinaryEntriesDecoder(UrlFetcher::Response* resp)
+      : resp_(CHECK_NOTNULL(resp)), started_(false), failed_(false) {
+  }
+
+  // Used as the UrlFetcher::BodyCallback.
+  bool Read(const char* data, size_t size);
+
+  // Whether all of the body was read and decoded without error.
+  bool Finish();
+
+  // Whether Read() found the body to be invalid.
+  bool failed() const {
+    return failed_;
+  }
+
+  vector<Entry>* entries() {
+    return &entries_;
+  }
+
+ private:
+  // Sets up decompression according to the response headers.
+  bool Start();
+
+  UrlFetcher::Response* const resp_;
+  bool started_;
+  bool failed_;
+  unique_ptr<ZstdDecompressor> decompressor_;
+  BinaryEntryReader reader_;
+  vector<Entry> entries_;
+};
+
+
+bool AsyncLogClient::BinaryEntriesDecoder::Start() {
+  started_ = true;
+  const auto encoding(resp_->headers.find("Content-Encoding"));
+  if (encoding != resp_->headers.end()) {
+    if (encoding->second != "zstd" || !ZstdSupported()) {
+      return false;
+    }
+    decompressor_.reset(new ZstdDecompressor(kMaxBinaryEntriesSize));
+  }
+  return true;
+}
+
+
+bool AsyncLogClient::BinaryEntriesDecoder::Read(const char* data,
+                                                size_t size) {
+  // The body of an error is of no interest.
+  if (resp_->status_code != HTTP_OK) {
+    return true;
+  }
+  if (failed_ || (!started_ && !Start())) {
+    failed_ = true;
+    return false;
+  }
+
+  string decompressed;
+  if (decompressor_) {
+    if (!decompressor_->Decompress(data, size, &decompressed)) {
+      failed_ = true;
+      return false;
+    }
+    data = decompressed.data();
+    size = decompressed.size();
+  }
+
+  vector<BinaryEntry> binary_entries;
+  if (reader_.Read(data, size, &binary_entries) != DeserializeResult::OK) {
+    failed_ = true;
+    return false;
+  }
+  for (const auto& binary_entry : binary_entries) {
+    Entry log_entry;
+    if (!ParseEntry(binary_entry.leaf_input, binary_entry.extra_data,
+                    binary_entry.sct.empty() ? nullptr : &binary_entry.sct,
+                    &log_entry)) {
+      failed_ = true;
+      return false;
+    }
+    entries_.emplace_back(move(log_entry));
+  }
+
+  return true;
+}
+
+
+bool AsyncLogClient::BinaryEntriesDecoder::Finish() {
+  if (failed_ || (!started_ && !Start())) {
+    return false;
+  }
+  return (!decompressor_ || decompressor_->AtFrameEnd()) &&
+         reader_.AtRecordEnd();
+}
+
+
+// Picks the entries out of a get-entries response as it is parsed,
+// decoding each one as soon as its object is complete, rather than
+// building the whole document as json-c objects first.
+class AsyncLogClient::JsonEntriesDecoder : public JsonStreamReader::Handler {
+ public:
+  explicit JsonEntriesDecoder(UrlFetcher::Response* resp)
+      : resp_(CHECK_NOTNULL(resp)),
+        reader_(this),
+        failed_(false),
+        depth_(0),
+        expect_entries_(false),
+        in_entries_(false),
+        seen_entries_(false),
+        field_(nullptr),
+        have_leaf_input_(false),
+        have_extra_data_(false),
+        have_sct_(false) {
+  }
+
+  // Used as the UrlFetcher::BodyCallback.
+  bool Read(const char* data, size_t size);
+
+  // Whether all of the body was read and decoded without error.
+  bool Finish() {
+    return !failed_ && reader_.Finish() && seen_entries_;
+  }
+
+  // Whether Read() found the body to be invalid.
+  bool failed() const {
+    return failed_;
+  }
+
+  vector<Entry>* entries() {
+    return &entries_;
+  }
+
+  bool BeginObject() override;
+  bool EndObject() override;
+  bool BeginArray() override;
+  bool EndArray() override;
+  bool Key(const string& key) override;
+  bool String(const string& value) override;
+  bool Number(const string&) override {
+    return CheckValue(Kind::SCALAR);
+  }
+  bool Boolean(bool) override {
+    return CheckValue(Kind::SCALAR);
+  }
+  bool Null() override {
+    return CheckValue(Kind::SCALAR);
+  }
+
+ private:
+  enum class Kind {
+    OBJECT,
+    ARRAY,
+    STRING,
+    SCALAR,
+  };
+
+  // Whether a value of |kind| is acceptable where it was found.
+  bool CheckValue(Kind kind);
+
+  UrlFetcher::Response* const resp_;
+  JsonStreamReader reader_;
+  bool failed_;
+  // The number of objects and arrays we are in. The response is at
+  // depth 1, the "entries" array at 2, and each entry at 3.
+  int depth_;
+  // After the "entries" key, before its value.
+  bool expect_entries_;
+  bool in_entries_;
+  bool seen_entries_;
+  // Where to decode the next value, for the fields of an entry.
+  string* field_;
+  string leaf_input_;
+  string extra_data_;
+  string sct_;
+  bool have_leaf_input_;
+  bool have_extra_data_;
+  bool have_sct_;
+  vector<Entry> entries_;
+};
+
+
+bool AsyncLogClient::JsonEntriesDecoder::Read(const char* data,
+                                              size_t size) {
+  // The body of an error is of no interest.
+  if (resp_->status_code != HTTP_OK) {
+    return true;
+  }
+  if (failed_ || !reader_.Read(data, size)) {
+    failed_ = true;
+    return false;
+  }
+  return true;
+}
+
+
+bool AsyncLogClient::JsonEntriesDecoder::CheckValue(Kind kind) {
+  if (depth_ == 0) {
+    return kind == Kind::OBJECT;
+  }
+  if (expect_entries_) {
+    expect_entries_ = false;
+    return kind == Kind::ARRAY;
+  }
+  if (in_entries_ && depth_ == 2) {
+    return kind == Kind::OBJECT;
+  }
+  if (field_) {
+    return kind == Kind::STRING;
+  }
+  return true;
+}
+
+
+bool AsyncLogClient::JsonEntriesDecoder::BeginObject() {
+  if (!CheckValue(Kind::OBJECT)) {
+    return false;
+  }
+  ++depth_;
+  if (in_entries_ && depth_ == 3) {
+    have_leaf_input_ = false;
+    have_extra_data_ = false;
+    have_sct_ = false;
+  }
+  return true;
+}
+
+
+bool AsyncLogClient::JsonEntriesDecoder::EndObject() {
+  if (in_entries_ && depth_ == 3) {
+    if (!have_leaf_input_ || !have_extra_data_) {
+      return false;
+    }
+    Entry log_entry;
+    if (!ParseEntry(leaf_input_, extra_data_, have_sct_ ? &sct_ : nullptr,
+                    &log_entry)) {
+      return false;
+    }
+    entries_.emplace_back(move(log_entry));
+  }
+  --depth_;
+  return true;
+}
+
+
+bool AsyncLogClient::JsonEntriesDecoder::BeginArray() {
+  const bool entries(expect_entries_);
+  if (!CheckValue(Kind::ARRAY)) {
+    return false;
+  }
+  ++depth_;
+  if (entries) {
+    in_entries_ = true;
+    seen_entries_ = true;
+  }
+  return true;
+}
+
+
+bool AsyncLogClient::JsonEntriesDecoder::EndArray() {
+  if (in_entries_ && depth_ == 2) {
+    in_entries_ = false;
+  }
+  --depth_;
+  return true;
+}
+
+
+bool AsyncLogClient::JsonEntriesDecoder::Key(const string& key) {
+  if (depth_ == 1 && key == "entries") {
+    // More than one would be ambiguous.
+    if (seen_entries_) {
+      return false;
+    }
+    expect_entries_ = true;
+  } else if (in_entries_ && depth_ == 3) {
+    if (key == "leaf_input") {
+      field_ = &leaf_input_;
+      have_leaf_input_ = true;
+    } else if (key == "extra_data") {
+      field_ = &extra_data_;
+      have_extra_data_ = true;
+    } else if (key == "sct") {
+      field_ = &sct_;
+      have_sct_ = true;
+    }
+  }
+  return true;
+}
+
+
+bool AsyncLogClient::JsonEntriesDecoder::String(const string& value) {
+  if (!CheckValue(Kind::STRING)) {
+    return false;
+  }
+  if (field_) {
+    // Decode errors are left for ParseEntry to find, as empty fields.
+    util::FromBase64(value.data(), value.size(), field_);
+    field_ = nullptr;
+  }
+  return true;
+}
+
+
 AsyncLogClient::AsyncLogClient(util::Executor* const executor,
                                UrlFetcher* fetcher, const string& server_url)
     : executor_(CHECK_NOTNULL(executor)),
       fetcher_(CHECK_NOTNULL(fetcher)),
-      server_url_(NormalizeURL(server_url)) {
+      server_url_(NormalizeURL(server_url)),
+      no_binary_entries_(false),
+      long_polls_sth_(false) {
 }
 
 
 void AsyncLogClient::GetSTH(SignedTreeHead* sth, const Callback& done) {
   UrlFetcher::Response* const resp(new UrlFetcher::Response);
   fetcher_->Fetch(GetURL("get-sth"), resp,
-                  new util::Task(bind(DoneGetSTH, resp, sth, done, _1),
+                  new util::Task(bind(DoneGetSTH, resp, sth, &long_polls_sth_,
+                                      done, _1),
                                  executor_));
 }
 
 
+void AsyncLogClient::GetSTHNewerThan(uint64_t newer_than, SignedTreeHead* sth,
+                                     const Callback& done) {
+  URL url(GetURL("get-sth"));
+  url.SetQuery("newer_than=" + to_string(newer_than));
+
+  UrlFetcher::Response* const resp(new UrlFetcher::Response);
+  fetcher_->Fetch(url, resp,
+                  new util::Task(bind(DoneGetSTH, resp, sth, &long_polls_sth_,
+                                      done, _1),
+                                 executor_));
+}
+
+
+bool AsyncLogClient::LongPollsSTH() const {
+  return long_polls_sth_.load();
+}
+
+
 void AsyncLogClient::GetRoots(vector<unique_ptr<Cert>>* roots,
                               const Callback& done) {
   UrlFetcher::Response* const resp(new UrlFetcher::Response);
@@ -430,14 +733,115 @@ void AsyncLogClient::InternalGetEntries(int first, int last,
     return;
   }
 
+  if (no_binary_entries_.load()) {
+    return JsonGetEntries(first, last, entries, request_scts, done);
+  }
+
+  UrlFetcher::Request req(GetURL("get-entries-binary"));
+  req.url.SetQuery("start=" + to_string(first) + "&end=" + to_string(last) +
+                   (request_scts ? "&include_scts=true" : ""));
+  if (ZstdSupported()) {
+    req.headers.insert(make_pair("Accept-Encoding", "zstd"));
+  }
+
+  UrlFetcher::Response* const resp(new UrlFetcher::Response);
+  BinaryEntriesDecoder* const decoder(new BinaryEntriesDecoder(resp));
+  // The entries are decoded as they arrive, so that neither the whole
+  // body nor its decompressed form have to be held at once.
+  fetcher_->FetchStreaming(
+      req, resp, bind(&BinaryEntriesDecoder::Read, decoder, _1, _2),
+      new util::Task(bind(&AsyncLogClient::DoneGetEntriesBinary, this, resp,
+                          decoder, first, last, entries, request_scts, done,
+                          _1),
+                     executor_));
+}
+
+
+void AsyncLogClient::JsonGetEntries(int first, int last,
+                                    vector<Entry>* entries, bool request_scts,
+                                    const Callback& done) {
   URL url(GetURL("get-entries"));
   url.SetQuery("start=" + to_string(first) + "&end=" + to_string(last) +
                (request_scts ? "&include_scts=true" : ""));
 
   UrlFetcher::Response* const resp(new UrlFetcher::Response);
-  fetcher_->Fetch(url, resp,
-                  new util::Task(bind(DoneGetEntries, resp, entries, done, _1),
-                                 executor_));
+  JsonEntriesDecoder* const decoder(new JsonEntriesDecoder(resp));
+  fetcher_->FetchStreaming(
+      UrlFetcher::Request(url), resp,
+      bind(&JsonEntriesDecoder::Read, decoder, _1, _2),
+      new util::Task(bind(&AsyncLogClient::DoneGetEntriesJson, this, resp,
+                          decoder, entries, done, _1),
+                     executor_));
+}
+
+
+void AsyncLogClient::DoneGetEntriesBinary(UrlFetcher::Response* resp,
+                                          BinaryEntriesDecoder* decoder,
+                                          int first, int last,
+                                          vector<Entry>* entries,
+                                          bool request_scts,
+                                          const Callback& done,
+                                          util::Task* task) {
+  unique_ptr<UrlFetcher::Response> resp_deleter(CHECK_NOTNULL(resp));
+  unique_ptr<BinaryEntriesDecoder> decoder_deleter(CHECK_NOTNULL(decoder));
+  unique_ptr<util::Task> task_deleter(CHECK_NOTNULL(task));
+
+  // Logs other than this implementation do not have this endpoint.
+  if (task->status().ok() && resp->status_code == HTTP_NOTFOUND) {
+    LOG(INFO) << "No binary get-entries on " << server_url_.Host()
+              << ", using the standard get-entries from now on.";
+    no_binary_entries_.store(true);
+    return JsonGetEntries(first, last, entries, request_scts, done);
+  }
+
+  // The decoder aborts the fetch when the body is not valid.
+  if (decoder->failed()) {
+    return done(BAD_RESPONSE);
+  }
+
+  if (!SanityCheck(resp, done, task)) {
+    return;
+  }
+
+  if (!decoder->Finish()) {
+    return done(BAD_RESPONSE);
+  }
+
+  vector<Entry>* const new_entries(decoder->entries());
+  entries->reserve(entries->size() + new_entries->size());
+  move(new_entries->begin(), new_entries->end(), back_inserter(*entries));
+
+  return done(OK);
+}
+
+
+void AsyncLogClient::DoneGetEntriesJson(UrlFetcher::Response* resp,
+                                        JsonEntriesDecoder* decoder,
+                                        vector<Entry>* entries,
+                                        const Callback& done,
+                                        util::Task* task) {
+  unique_ptr<UrlFetcher::Response> resp_deleter(CHECK_NOTNULL(resp));
+  unique_ptr<JsonEntriesDecoder> decoder_deleter(CHECK_NOTNULL(decoder));
+  unique_ptr<util::Task> task_deleter(CHECK_NOTNULL(task));
+
+  // The decoder aborts the fetch when the body is not valid.
+  if (decoder->failed()) {
+    return done(BAD_RESPONSE);
+  }
+
+  if (!SanityCheck(resp, done, task)) {
+    return;
+  }
+
+  if (!decoder->Finish()) {
+    return done(BAD_RESPONSE);
+  }
+
+  vector<Entry>* const new_entries(decoder->entries());
+  entries->reserve(entries->size() + new_entries->size());
+  move(new_entries->begin(), new_entries->end(), back_inserter(*entries));
+
+  return done(OK);
 }
 
 
@@ -2,6 +2,7 @@
 #define CERT_TRANS_CLIENT_ASYNC_LOG_CLIENT_H_
 
 #include <stdint.h>
+#include <atomic>
 #include <functional>
 #include <memory>
 #include <string>
@@ -57,6 +58,19 @@ class AsyncLogClient {
 
   void GetSTH(ct::SignedTreeHead* sth, const Callback& done);
 
+  // This is NON-standard, and only works with this log implementation.
+  // Like GetSTH(), but if the server supports it (see LongPollsSTH()),
+  // the reply is held until it has an STH with a timestamp later than
+  // |newer_than|, or for as long as it is willing to wait, rather than
+  // sent right away.
+  void GetSTHNewerThan(uint64_t newer_than, ct::SignedTreeHead* sth,
+                       const Callback& done);
+
+  // Whether the last get-sth reply said that the server holds replies
+  // for GetSTHNewerThan(), so that it can be called again straight
+  // away.
+  bool LongPollsSTH() const;
+
   // This does not clear "roots" before appending to it.
   void GetRoots(std::vector<std::unique_ptr<Cert>>* roots,
                 const Callback& done);
@@ -93,8 +107,26 @@ class AsyncLogClient {
  private:
   URL GetURL(const std::string& subpath) const;
 
+  // Decodes the entries of a binary get-entries response as its body
+  // arrives.
+  class BinaryEntriesDecoder;
+  // Decodes the entries of a standard get-entries response as its body
+  // arrives.
+  class JsonEntriesDecoder;
+
   void InternalGetEntries(int first, int last, std::vector<Entry>* entries,
                           bool request_scts, const Callback& done);
+  void JsonGetEntries(int first, int last, std::vector<Entry>* entries,
+                      bool request_scts, const Callback& done);
+  void DoneGetEntriesBinary(UrlFetcher::Response* resp,
+                            BinaryEntriesDecoder* decoder, int first,
+                            int last, std::vector<Entry>* entries,
+                            bool request_scts, const Callback& done,
+                            util::Task* task);
+  void DoneGetEntriesJson(UrlFetcher::Response* resp,
+                          JsonEntriesDecoder* decoder,
+                          std::vector<Entry>* entries, const Callback& done,
+                          util::Task* task);
 
   void InternalAddChain(const CertChain& cert_chain,
                         ct::SignedCertificateTimestamp* sct, bool pre_cert,
@@ -103,6 +135,10 @@ class AsyncLogClient {
   util::Executor* const executor_;
   UrlFetcher* const fetcher_;
   const URL server_url_;
+  // Set once the server turns out not to have the binary get-entries
+  // endpoint, so that we go straight to the standard one from then on.
+  std::atomic<bool> no_binary_entries_;
+  std::atomic<bool> long_polls_sth_;
 };
 
 
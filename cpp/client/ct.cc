@@ -13,14 +13,18 @@
 #include <openssl/x509.h>
 #include <openssl/x509v3.h>
 #include <stdio.h>
+#include <unistd.h>
 #include <fstream>
 #include <iostream>
 #include <memory>
+#include <mutex>
 #include <sstream>
 #include <string>
+#include <utility>
 
 #include "client/http_log_client.h"
 #include "client/ssl_client.h"
+#include "client/verified_sct_cache.h"
 #include "log/cert.h"
 #include "log/cert_submission_handler.h"
 #include "log/ct_extensions.h"
@@ -35,6 +39,7 @@
 #include "util/init.h"
 #include "util/openssl_scoped_types.h"
 #include "util/read_key.h"
+#include "util/thread_pool.h"
 #include "util/util.h"
 
 DEFINE_string(ssl_client_trusted_cert_dir, "",
@@ -43,6 +48,16 @@ DEFINE_string(ct_server_public_key, "",
               "PEM-encoded public key file of the CT log server");
 DEFINE_string(ssl_server, "", "SSL server to connect to");
 DEFINE_string(ssl_server_port, "https", "SSL server port");
+DEFINE_string(ssl_scan_hosts, "",
+              "File listing the SSL servers for the 'scan' command to "
+              "connect to, one host[:port] per line, --ssl_server_port "
+              "being the default port");
+DEFINE_int32(ssl_scan_threads, 16,
+             "Number of SSL servers the 'scan' command connects to at once");
+DEFINE_int32(ssl_scan_sct_cache_size, 100000,
+             "Number of verified SCTs the 'scan' command remembers, so "
+             "as not to check them again for other servers presenting the "
+             "same certificate");
 DEFINE_string(ct_server_submission, "",
               "Certificate chain to submit to a CT log server. "
               "The file must consist of concatenated PEM certificates.");
@@ -82,6 +97,16 @@ DEFINE_int32(get_last, 0, "Last entry to retrieve with the 'get' command");
 DEFINE_string(certificate_base, "",
               "Base name for retrieved certificates - "
               "files will be <base><entry>.<cert>.der");
+DEFINE_int32(get_batch_size, 1000,
+             "Number of entries to ask for in each get-entries request "
+             "made by the 'get_entries' and 'monitor' commands");
+DEFINE_int32(get_parallel_requests, 8,
+             "Number of get-entries requests the 'get_entries' and "
+             "'monitor' commands keep in flight at once");
+DEFINE_string(get_checkpoint, "",
+              "File in which 'get_entries' and 'monitor' record the index "
+              "of the next entry to retrieve, so that they resume from "
+              "there if restarted");
 DEFINE_uint64(timestamp, 0,
               "The timestamp to be used in the monitor actions "
               "verify_sth and confirm_tree.");
@@ -96,6 +121,7 @@ static const char kUsage[] =
     " <command> ...\n"
     "Known commands:\n"
     "connect - connect to an SSL server\n"
+    "scan - connect to many SSL servers, and report which presented SCTs\n"
     "upload - upload a submission to a CT log server\n"
     "certificate - make a superfluous proof certificate\n"
     "extension_data - convert an audit proof to TLS extension format\n"
@@ -107,6 +133,7 @@ static const char kUsage[] =
     "                them as if they were retrieved via 'connect'\n"
     "get_roots - get roots from the log\n"
     "get_entries - get entries from the log\n"
+    "monitor - follow the log, retrieving new entries as it grows\n"
     "sth - get the current STH from the log\n"
     "consistency - get and check consistency of two STHs\n"
     "Use --help to display command-line flag options\n";
@@ -127,6 +154,8 @@ using cert_trans::ScopedRSA;
 using cert_trans::ScopedX509;
 using cert_trans::ScopedX509_NAME;
 using cert_trans::TbsCertificate;
+using cert_trans::ThreadPool;
+using cert_trans::VerifiedSCTCache;
 using cert_trans::serialization::SerializeResult;
 using cert_trans::serialization::DeserializeResult;
 using ct::LogEntry;
@@ -135,6 +164,10 @@ using ct::SSLClientCTData;
 using ct::SignedCertificateTimestamp;
 using ct::SignedCertificateTimestampList;
 using ct::SignedTreeHead;
+using std::lock_guard;
+using std::move;
+using std::mutex;
+using std::pair;
 using std::shared_ptr;
 using std::string;
 using std::unique_ptr;
@@ -591,6 +624,115 @@ static SSLClient::HandshakeResult Connect() {
   return result;
 }
 
+// LogVerifiers for the 'scan' command, which are not thread-safe, for
+// each handshake to take one of and give back once done. There are
+// never more of them than handshakes at once.
+class LogVerifierPool {
+ public:
+  LogVerifierPool() = default;
+  LogVerifierPool(const LogVerifierPool&) = delete;
+  LogVerifierPool& operator=(const LogVerifierPool&) = delete;
+
+  unique_ptr<LogVerifier> Take() {
+    {
+      lock_guard<mutex> lock(lock_);
+      if (!verifiers_.empty()) {
+        unique_ptr<LogVerifier> verifier(move(verifiers_.back()));
+        verifiers_.pop_back();
+        return verifier;
+      }
+    }
+    return unique_ptr<LogVerifier>(GetLogVerifierFromFlags());
+  }
+
+  void Return(unique_ptr<LogVerifier> verifier) {
+    lock_guard<mutex> lock(lock_);
+    verifiers_.emplace_back(move(verifier));
+  }
+
+ private:
+  mutex lock_;
+  vector<unique_ptr<LogVerifier>> verifiers_;
+};
+
+static const char* HandshakeResultString(SSLClient::HandshakeResult result) {
+  switch (result) {
+    case SSLClient::OK:
+      return "OK";
+    case SSLClient::HANDSHAKE_FAILED:
+      return "HANDSHAKE_FAILED";
+    case SSLClient::SERVER_UNAVAILABLE:
+      return "SERVER_UNAVAILABLE";
+  }
+  LOG(FATAL) << "unknown HandshakeResult " << result;
+  abort();
+}
+
+// Connects to each of the servers in --ssl_scan_hosts, several at a
+// time, and prints a line with the result for each, with the number of
+// SCTs verified. SCTs already verified for another server presenting
+// the same certificate are not checked again.
+// Return values upon completion
+//  0: all handshakes ok
+//  1: some handshakes failed
+static int Scan() {
+  CHECK(!FLAGS_ssl_scan_hosts.empty()) << "Must specify --ssl_scan_hosts";
+  CHECK_GT(FLAGS_ssl_scan_threads, 0);
+  CHECK_GT(FLAGS_ssl_scan_sct_cache_size, 0);
+
+  std::ifstream in(FLAGS_ssl_scan_hosts.c_str());
+  PCHECK(in.good()) << "Could not open " << FLAGS_ssl_scan_hosts;
+  vector<pair<string, string>> hosts;
+  string line;
+  while (std::getline(in, line)) {
+    if (line.empty())
+      continue;
+    // Only a single colon separates a port, so that IPv6 addresses can
+    // be given as they are (with the default port).
+    const size_t colon(line.find(':'));
+    if (colon != string::npos && line.find(':', colon + 1) == string::npos) {
+      hosts.emplace_back(line.substr(0, colon), line.substr(colon + 1));
+    } else {
+      hosts.emplace_back(line, FLAGS_ssl_server_port);
+    }
+  }
+
+  LogVerifierPool verifiers;
+  VerifiedSCTCache sct_cache(FLAGS_ssl_scan_sct_cache_size);
+  vector<SSLClient::HandshakeResult> results(hosts.size());
+  vector<int> num_scts(hosts.size(), 0);
+  {
+    ThreadPool pool(FLAGS_ssl_scan_threads);
+    cert_trans::RunAll(&pool, hosts.size(), [&](size_t i) {
+      unique_ptr<LogVerifier> verifier(verifiers.Take());
+      SSLClient client(hosts[i].first, hosts[i].second,
+                       FLAGS_ssl_client_trusted_cert_dir, verifier.get(),
+                       &sct_cache);
+      results[i] = FLAGS_ssl_client_require_sct ? client.SSLConnectStrict()
+                                                : client.SSLConnect();
+      if (results[i] == SSLClient::OK) {
+        SSLClientCTData ct_data;
+        client.GetSSLClientCTData(&ct_data);
+        num_scts[i] = ct_data.attached_sct_info_size();
+      }
+      client.Disconnect();
+      verifiers.Return(move(verifier));
+    });
+  }
+
+  int ret = 0;
+  for (size_t i = 0; i < hosts.size(); ++i) {
+    std::cout << hosts[i].first << ":" << hosts[i].second << " "
+              << HandshakeResultString(results[i]) << " " << num_scts[i]
+              << std::endl;
+    if (results[i] != SSLClient::OK)
+      ret = 1;
+  }
+  LOG(INFO) << "Scanned " << hosts.size() << " servers, "
+            << sct_cache.size() << " distinct SCTs verified";
+  return ret;
+}
+
 enum AuditResult {
   // At least one SCT has a valid proof.
   // (Should be unusual to have more than one SCT from the same log,
@@ -630,7 +772,7 @@ static AuditResult Audit() {
     HTTPLogClient client(FLAGS_ct_server);
 
     LOG(INFO) << "info = " << ct_data.attached_sct_info(i).DebugString();
-    const StatusOr<MerkleAuditProof> proof_http(client.QueryAuditProof(
+    StatusOr<MerkleAuditProof> proof_http(client.QueryAuditProof(
         ct_data.attached_sct_info(i).merkle_leaf_hash()));
 
     if (!proof_http.status().ok()) {
@@ -638,7 +780,7 @@ static AuditResult Audit() {
       continue;
     }
 
-    MerkleAuditProof proof(proof_http.ValueOrDie());
+    MerkleAuditProof proof(move(proof_http.ValueOrDie()));
     // HTTP protocol does not supply this.
     proof.mutable_id()->set_key_id(sct_id);
 
@@ -828,7 +970,7 @@ void WrapEmbedded() {
   WriteSSLClientCTData(ct_data, FLAGS_ssl_client_ct_data_out);
 }
 
-static void WriteCertificate(const std::string& cert, int entry,
+static void WriteCertificate(const std::string& cert, int64_t entry,
                              int cert_number, const char* type) {
   std::ostringstream outname;
   outname << FLAGS_certificate_base << entry << '.' << cert_number << '.'
@@ -838,38 +980,123 @@ static void WriteCertificate(const std::string& cert, int entry,
   out << cert;
 }
 
+static void WriteEntryCertificates(const AsyncLogClient::Entry& entry,
+                                   int64_t e) {
+  if (entry.leaf.timestamped_entry().entry_type() == ct::X509_ENTRY) {
+    WriteCertificate(entry.leaf.timestamped_entry().signed_entry().x509(), e,
+                     0, "x509");
+    const ct::X509ChainEntry& x509chain = entry.entry.x509_entry();
+    for (int n = 0; n < x509chain.certificate_chain_size(); ++n)
+      WriteCertificate(x509chain.certificate_chain(n), e, n + 1, "x509");
+  } else {
+    CHECK_EQ(entry.leaf.timestamped_entry().entry_type(), ct::PRECERT_ENTRY);
+    WriteCertificate(entry.leaf.timestamped_entry()
+                         .signed_entry()
+                         .precert()
+                         .tbs_certificate(),
+                     e, 0, "pre");
+    const ct::PrecertChainEntry& precertchain = entry.entry.precert_entry();
+    for (int n = 0; n < precertchain.precertificate_chain_size(); ++n)
+      WriteCertificate(precertchain.precertificate_chain(n), e, n + 1, "x509");
+  }
+}
+
+// Returns the index recorded in --get_checkpoint, or |fallback| if
+// there is none yet.
+static int64_t ReadCheckpoint(int64_t fallback) {
+  if (FLAGS_get_checkpoint.empty()) {
+    return fallback;
+  }
+  std::ifstream in(FLAGS_get_checkpoint.c_str());
+  int64_t next;
+  if (!(in >> next)) {
+    return fallback;
+  }
+  LOG(INFO) << "Resuming from entry " << next;
+  return next;
+}
+
+// Records |next| in --get_checkpoint, replacing the file so that an
+// interrupted write never leaves a truncated checkpoint behind.
+static void WriteCheckpoint(int64_t next) {
+  if (FLAGS_get_checkpoint.empty()) {
+    return;
+  }
+  const string tmp(FLAGS_get_checkpoint + ".tmp");
+  {
+    std::ofstream out(tmp.c_str(), std::ios::trunc);
+    out << next << '\n';
+    CHECK(out.good()) << "Could not write " << tmp;
+  }
+  PCHECK(rename(tmp.c_str(), FLAGS_get_checkpoint.c_str()) == 0)
+      << "Could not rename " << tmp << " to " << FLAGS_get_checkpoint;
+}
+
+// Retrieves entries |*next| to |last|, writing out their certificates
+// and checkpointing as each batch arrives, rather than holding the
+// whole range in memory. |*next| is advanced past the entries written,
+// even if it then fails.
+static ::util::Status DownloadEntries(HTTPLogClient* client, int64_t* next,
+                                      int64_t last) {
+  return client->GetEntries(
+      *next, last, FLAGS_get_batch_size, FLAGS_get_parallel_requests,
+      [next](int64_t index, const vector<AsyncLogClient::Entry>& entries) {
+        CHECK_EQ(index, *next);
+        for (const auto& entry : entries) {
+          WriteEntryCertificates(entry, (*next)++);
+        }
+        WriteCheckpoint(*next);
+        VLOG(1) << "Retrieved entries up to " << *next - 1;
+        return true;
+      });
+}
+
 void GetEntries() {
   CHECK_NE(FLAGS_ct_server, "");
+  CHECK(!FLAGS_certificate_base.empty());
+
+  int64_t next(ReadCheckpoint(FLAGS_get_first));
+  if (next > FLAGS_get_last) {
+    LOG(INFO) << "Nothing left to retrieve";
+    return;
+  }
+
   HTTPLogClient client(FLAGS_ct_server);
-  const StatusOr<vector<AsyncLogClient::Entry>> entries(
-      client.GetEntries(FLAGS_get_first, FLAGS_get_last));
-  CHECK_EQ(entries.status(), ::util::OkStatus());
+  CHECK_EQ(DownloadEntries(&client, &next, FLAGS_get_last),
+           ::util::OkStatus());
+}
 
+// Never returns: polls the log for a new STH every
+// --monitor_sleep_time_secs, and retrieves whatever entries it adds.
+int Monitor() {
+  CHECK_NE(FLAGS_ct_server, "");
   CHECK(!FLAGS_certificate_base.empty());
 
-  int e = FLAGS_get_first;
-  for (vector<AsyncLogClient::Entry>::const_iterator
-           entry = entries.ValueOrDie().begin();
-       entry != entries.ValueOrDie().end(); ++entry, ++e) {
-    if (entry->leaf.timestamped_entry().entry_type() == ct::X509_ENTRY) {
-      WriteCertificate(entry->leaf.timestamped_entry().signed_entry().x509(),
-                       e, 0, "x509");
-      const ct::X509ChainEntry& x509chain = entry->entry.x509_entry();
-      for (int n = 0; n < x509chain.certificate_chain_size(); ++n)
-        WriteCertificate(x509chain.certificate_chain(n), e, n + 1, "x509");
-    } else {
-      CHECK_EQ(entry->leaf.timestamped_entry().entry_type(),
-               ct::PRECERT_ENTRY);
-      WriteCertificate(entry->leaf.timestamped_entry()
-                           .signed_entry()
-                           .precert()
-                           .tbs_certificate(),
-                       e, 0, "pre");
-      const ct::PrecertChainEntry& precertchain = entry->entry.precert_entry();
-      for (int n = 0; n < precertchain.precertificate_chain_size(); ++n)
-        WriteCertificate(precertchain.precertificate_chain(n), e, n + 1,
-                         "x509");
+  HTTPLogClient client(FLAGS_ct_server);
+  const unique_ptr<LogVerifier> verifier(GetLogVerifierFromFlags());
+  int64_t next(ReadCheckpoint(0));
+
+  while (true) {
+    const StatusOr<SignedTreeHead> sth(client.GetSTH());
+    // Allow for 10 seconds of clock skew
+    const uint64_t latest(((uint64_t)time(NULL) + 10) * 1000);
+    if (!sth.ok()) {
+      LOG(WARNING) << "Could not get an STH: " << sth.status();
+    } else if (verifier->VerifySignedTreeHead(sth.ValueOrDie(), 0, latest) !=
+               LogVerifier::VERIFY_OK) {
+      LOG(ERROR) << "STH does not verify:\n"
+                 << sth.ValueOrDie().DebugString();
+    } else if (sth.ValueOrDie().tree_size() > next) {
+      const int64_t last(sth.ValueOrDie().tree_size() - 1);
+      LOG(INFO) << "Retrieving entries " << next << " to " << last;
+      const ::util::Status status(DownloadEntries(&client, &next, last));
+      if (!status.ok()) {
+        // Picked up again from |next| on the next round.
+        LOG(WARNING) << "Retrieving entries failed: " << status;
+      }
     }
+
+    sleep(FLAGS_monitor_sleep_time_secs);
   }
 }
 
@@ -958,6 +1185,8 @@ int main(int argc, char** argv) {
     if ((!want_fail && result != SSLClient::OK) ||
         (want_fail && result != SSLClient::HANDSHAKE_FAILED))
       ret = 1;
+  } else if (cmd == "scan") {
+    ret = Scan();
   } else if (cmd == "upload") {
     ret = Upload();
   } else if (cmd == "audit") {
@@ -978,6 +1207,8 @@ int main(int argc, char** argv) {
     WrapEmbedded();
   } else if (cmd == "get_entries") {
     GetEntries();
+  } else if (cmd == "monitor") {
+    ret = Monitor();
   } else if (cmd == "get_roots") {
     ret = GetRoots();
   } else if (cmd == "sth") {
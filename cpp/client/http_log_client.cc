@@ -3,6 +3,8 @@
 
 #include <event2/buffer.h>
 #include <glog/logging.h>
+#include <algorithm>
+#include <deque>
 #include <functional>
 #include <memory>
 
@@ -24,6 +26,9 @@ using ct::MerkleAuditProof;
 using ct::SignedCertificateTimestamp;
 using ct::SignedTreeHead;
 using std::bind;
+using std::deque;
+using std::min;
+using std::move;
 using std::placeholders::_1;
 using std::string;
 using std::unique_ptr;
@@ -41,6 +46,19 @@ void DoneRequest(AsyncLogClient::Status status, AsyncLogClient::Status* retval,
 }
 
 
+// A range of entries requested by the parallel GetEntries().
+struct EntriesBatch {
+  EntriesBatch(int64_t f, int64_t l) : first(f), last(l) {
+  }
+
+  const int64_t first;
+  const int64_t last;
+  vector<AsyncLogClient::Entry> entries;
+  AsyncLogClient::Status status = AsyncLogClient::UNKNOWN_ERROR;
+  bool done = false;
+};
+
+
 }  // namespace
 
 HTTPLogClient::HTTPLogClient(const string& server)
@@ -107,7 +125,7 @@ StatusOr<vector<unique_ptr<Cert>>> HTTPLogClient::GetRoots() {
   }
 
   if (status == AsyncLogClient::OK) {
-    return move(roots);
+    return roots;
   }
 
   return Status::UNKNOWN;
@@ -150,7 +168,7 @@ StatusOr<vector<AsyncLogClient::Entry>> HTTPLogClient::GetEntries(int first,
   }
 
   if (status == AsyncLogClient::OK) {
-    return move(entries);
+    return entries;
   }
 
   return Status::UNKNOWN;
@@ -174,3 +192,75 @@ StatusOr<vector<string>> HTTPLogClient::GetSTHConsistency(int64_t size1,
 
   return Status::UNKNOWN;
 }
+
+
+Status HTTPLogClient::GetEntries(int64_t first, int64_t last, int batch_size,
+                                 int parallelism,
+                                 const EntriesCallback& callback) {
+  CHECK_GE(first, 0);
+  CHECK_GT(batch_size, 0);
+  CHECK_GT(parallelism, 0);
+
+  // The requests in flight, in order of the ranges they cover, so
+  // that the front one is always the next to be passed on.
+  deque<unique_ptr<EntriesBatch>> in_flight;
+  const auto start = [this](EntriesBatch* batch) {
+    client_.GetEntries(batch->first, batch->last, &batch->entries,
+                       bind(&DoneRequest, _1, &batch->status, &batch->done));
+  };
+  const size_t max_in_flight(parallelism);
+
+  Status status;
+  int64_t next(first);
+  while (status.ok() && (next <= last || !in_flight.empty())) {
+    while (next <= last && in_flight.size() < max_in_flight) {
+      in_flight.emplace_back(
+          new EntriesBatch(next, min(last, next + batch_size - 1)));
+      start(in_flight.back().get());
+      next = in_flight.back()->last + 1;
+    }
+
+    const unique_ptr<EntriesBatch> batch(move(in_flight.front()));
+    in_flight.pop_front();
+    while (!batch->done) {
+      base_->DispatchOnce();
+    }
+
+    // Ignore anything past what was asked for, the next batch has it.
+    const size_t requested(batch->last - batch->first + 1);
+    if (batch->entries.size() > requested) {
+      batch->entries.resize(requested);
+    }
+
+    if (batch->status != AsyncLogClient::OK) {
+      LOG(WARNING) << "get-entries " << batch->first << "-" << batch->last
+                   << " failed: " << batch->status;
+      status = Status(util::error::UNAVAILABLE, "get-entries failed");
+    } else if (batch->entries.empty()) {
+      // Otherwise we would keep asking for the same range forever.
+      status = Status(util::error::OUT_OF_RANGE,
+                      "log returned no entries from " +
+                          std::to_string(batch->first));
+    } else if (!callback(batch->first, batch->entries)) {
+      status = Status(util::error::ABORTED, "stopped by the callback");
+    } else {
+      const int64_t received(batch->first + batch->entries.size());
+      if (received <= batch->last) {
+        // The log returned a short page, ask for the rest of it ahead
+        // of everything else, as it comes next.
+        in_flight.emplace_front(new EntriesBatch(received, batch->last));
+        start(in_flight.front().get());
+      }
+    }
+  }
+
+  // The requests still in flight refer to their batches, so wait for
+  // them before letting those go.
+  for (const auto& batch : in_flight) {
+    while (!batch->done) {
+      base_->DispatchOnce();
+    }
+  }
+
+  return status;
+}
@@ -2,6 +2,7 @@
 #define CERT_TRANS_CLIENT_HTTP_LOG_CLIENT_H_
 
 #include <stdint.h>
+#include <functional>
 #include <memory>
 #include <string>
 
@@ -38,6 +39,23 @@ class HTTPLogClient {
   util::StatusOr<std::vector<AsyncLogClient::Entry>> GetEntries(int first,
                                                                 int last);
 
+  // Called with consecutive runs of entries, the first of which is at
+  // index |first|. Returning false stops the download.
+  typedef std::function<bool(int64_t first,
+                             const std::vector<AsyncLogClient::Entry>&)>
+      EntriesCallback;
+
+  // Fetches entries |first| to |last| (inclusive) with up to
+  // |parallelism| get-entries requests of at most |batch_size| entries
+  // each in flight at once, and passes them to |callback| in order,
+  // as soon as all the entries before them have been passed on. Short
+  // pages are followed up with a request for the rest of their range.
+  // Returns once every entry has been passed on, or as soon as a
+  // request fails or |callback| returns false, with an error saying
+  // which.
+  util::Status GetEntries(int64_t first, int64_t last, int batch_size,
+                          int parallelism, const EntriesCallback& callback);
+
  private:
   const std::unique_ptr<libevent::Base> base_;
   ThreadPool pool_;
@@ -6,6 +6,7 @@
 #include <openssl/x509.h>
 
 #include "client/client.h"
+#include "client/verified_sct_cache.h"
 #include "log/cert.h"
 #include "log/cert_submission_handler.h"
 #include "log/ct_extensions.h"
@@ -66,12 +67,19 @@ int SSLClient::ExtensionCallback(SSL*, unsigned ext_type,
   return 1;
 }
 
-// TODO(ekasper): handle Cert::Status errors.
 SSLClient::SSLClient(const string& server, const string& port,
                      const string& ca_dir, LogVerifier* verifier)
+    : SSLClient(server, port, ca_dir, verifier, nullptr) {
+  verify_args_.owned_verifier.reset(verifier);
+}
+
+// TODO(ekasper): handle Cert::Status errors.
+SSLClient::SSLClient(const string& server, const string& port,
+                     const string& ca_dir, LogVerifier* verifier,
+                     VerifiedSCTCache* sct_cache)
     : client_(server, port),
       ctx_(CHECK_NOTNULL(SSL_CTX_new(TLSv1_client_method()))),
-      verify_args_(verifier),
+      verify_args_(verifier, sct_cache),
       connected_(false) {
   // SSL_VERIFY_PEER makes the connection abort immediately
   // if verification fails.
@@ -129,6 +137,7 @@ void SSLClient::GetSSLClientCTData(SSLClientCTData* data) const {
 // static
 LogVerifier::LogVerifyResult SSLClient::VerifySCT(const string& token,
                                                   LogVerifier* verifier,
+                                                  VerifiedSCTCache* sct_cache,
                                                   SSLClientCTData* data) {
   CHECK(data->has_reconstructed_entry());
   SignedCertificateTimestamp local_sct;
@@ -137,12 +146,22 @@ LogVerifier::LogVerifyResult SSLClient::VerifySCT(const string& token,
   if (Deserializer::DeserializeSCT(token, &local_sct) != DeserializeResult::OK)
     return LogVerifier::INVALID_FORMAT;
 
+  // The cache is keyed by the serialized SCT, which covers everything
+  // the signature does, and by the leaf hash, which covers the rest of
+  // what the verifier checks. The timestamp of a verified SCT cannot go
+  // back into the future either.
   string merkle_leaf;
-  LogVerifier::LogVerifyResult result =
-      verifier->VerifySignedCertificateTimestamp(data->reconstructed_entry(),
-                                                 local_sct, &merkle_leaf);
-  if (result != LogVerifier::VERIFY_OK)
-    return result;
+  if (!sct_cache ||
+      !sct_cache->Find(data->certificate_sha256_hash(), token,
+                       &merkle_leaf)) {
+    LogVerifier::LogVerifyResult result =
+        verifier->VerifySignedCertificateTimestamp(data->reconstructed_entry(),
+                                                   local_sct, &merkle_leaf);
+    if (result != LogVerifier::VERIFY_OK)
+      return result;
+    if (sct_cache)
+      sct_cache->Insert(data->certificate_sha256_hash(), token, merkle_leaf);
+  }
   SSLClientCTData::SCTInfo* sct_info = data->add_attached_sct_info();
   sct_info->set_merkle_leaf_hash(merkle_leaf);
   sct_info->mutable_sct()->CopyFrom(local_sct);
@@ -153,7 +172,7 @@ LogVerifier::LogVerifyResult SSLClient::VerifySCT(const string& token,
 int SSLClient::VerifyCallback(X509_STORE_CTX* ctx, void* arg) {
   VerifyCallbackArgs* args = reinterpret_cast<VerifyCallbackArgs*>(arg);
   CHECK_NOTNULL(args);
-  LogVerifier* verifier(args->verifier.get());
+  LogVerifier* verifier(args->verifier);
   CHECK_NOTNULL(verifier);
 
   int vfy = X509_verify_cert(ctx);
@@ -241,8 +260,6 @@ int SSLClient::VerifyCallback(X509_STORE_CTX* ctx, void* arg) {
       args->ct_data.set_certificate_sha256_hash(
           Sha256Hasher::Sha256Digest(Serializer::LeafData(entry)));
       // Only writes the checkpoint if verification succeeds.
-      // Note: an optimized client could only verify the signature if it's
-      // a certificate it hasn't seen before.
       SignedCertificateTimestampList sct_list;
       if (Deserializer::DeserializeSCTList(serialized_scts, &sct_list) !=
           DeserializeResult::OK) {
@@ -251,7 +268,8 @@ int SSLClient::VerifyCallback(X509_STORE_CTX* ctx, void* arg) {
         LOG(INFO) << "Received " << sct_list.sct_list_size() << " SCTs";
         for (int i = 0; i < sct_list.sct_list_size(); ++i) {
           LogVerifier::LogVerifyResult result =
-              VerifySCT(sct_list.sct_list(i), verifier, &args->ct_data);
+              VerifySCT(sct_list.sct_list(i), verifier, args->sct_cache,
+                        &args->ct_data);
 
           if (result == LogVerifier::VERIFY_OK) {
             LOG(INFO) << "SCT number " << i + 1 << " verified";
@@ -14,6 +14,8 @@ class LogVerifier;
 
 namespace cert_trans {
 
+class VerifiedSCTCache;
+
 
 class SSLClient {
  public:
@@ -23,6 +25,14 @@ class SSLClient {
   SSLClient(const std::string& server, const std::string& port,
             const std::string& ca_dir, LogVerifier* verifier);
 
+  // Does not take ownership of |verifier|, nor of |sct_cache|, which
+  // may be NULL. Both must outlive the client. The verifier must not be
+  // used by anything else while a handshake is in progress, but the
+  // cache can be shared with other clients checking the same log.
+  SSLClient(const std::string& server, const std::string& port,
+            const std::string& ca_dir, LogVerifier* verifier,
+            VerifiedSCTCache* sct_cache);
+
   ~SSLClient();
   SSLClient(const SSLClient&) = delete;
   SSLClient& operator=(const SSLClient&) = delete;
@@ -48,9 +58,12 @@ class SSLClient {
 
   void GetSSLClientCTData(ct::SSLClientCTData* data) const;
 
-  // Need a static wrapper for the callback.
+  // Need a static wrapper for the callback. SCTs found in |sct_cache|
+  // (if not NULL) are not checked again, and the ones that verify are
+  // added to it.
   static LogVerifier::LogVerifyResult VerifySCT(const std::string& token,
                                                 LogVerifier* verifier,
+                                                VerifiedSCTCache* sct_cache,
                                                 ct::SSLClientCTData* data);
 
   // Custom verification callback for verifying the SCT token
@@ -78,15 +91,19 @@ class SSLClient {
   cert_trans::ScopedSSL_CTX ctx_;
   cert_trans::ScopedSSL ssl_;
   struct VerifyCallbackArgs {
-    VerifyCallbackArgs(LogVerifier* log_verifier)
+    VerifyCallbackArgs(LogVerifier* log_verifier, VerifiedSCTCache* cache)
         : verifier(log_verifier),
+          sct_cache(cache),
           sct_verified(false),
           require_sct(false),
           ct_data() {
     }
 
-    // The verifier for checking log proofs.
-    std::unique_ptr<LogVerifier> verifier;
+    // The verifier for checking log proofs, and its owner, if it is us.
+    LogVerifier* const verifier;
+    std::unique_ptr<LogVerifier> owned_verifier;
+    // SCTs already verified, if any.
+    VerifiedSCTCache* const sct_cache;
     // SCT verification result.
     bool sct_verified;
     bool require_sct;
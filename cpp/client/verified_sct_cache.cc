@@ -0,0 +1,65 @@
+#include "client/verified_sct_cache.h"
+
+#include <glog/logging.h>
+
+#include "merkletree/serial_hasher.h"
+
+using std::lock_guard;
+using std::mutex;
+using std::string;
+
+namespace cert_trans {
+
+
+VerifiedSCTCache::VerifiedSCTCache(size_t max_entries)
+    : max_entries_(max_entries) {
+  CHECK_GT(max_entries_, static_cast<size_t>(0));
+}
+
+
+bool VerifiedSCTCache::Find(const string& leaf_hash, const string& sct,
+                            string* merkle_leaf_hash) {
+  const string key(Key(leaf_hash, sct));
+  lock_guard<mutex> lock(lock_);
+  const auto it(index_.find(key));
+  if (it == index_.end()) {
+    return false;
+  }
+  entries_.splice(entries_.begin(), entries_, it->second);
+  CHECK_NOTNULL(merkle_leaf_hash)->assign(it->second->second);
+  return true;
+}
+
+
+void VerifiedSCTCache::Insert(const string& leaf_hash, const string& sct,
+                              const string& merkle_leaf_hash) {
+  const string key(Key(leaf_hash, sct));
+  lock_guard<mutex> lock(lock_);
+  const auto it(index_.find(key));
+  if (it != index_.end()) {
+    entries_.splice(entries_.begin(), entries_, it->second);
+    return;
+  }
+
+  entries_.emplace_front(key, merkle_leaf_hash);
+  index_.emplace(key, entries_.begin());
+  if (entries_.size() > max_entries_) {
+    index_.erase(entries_.back().first);
+    entries_.pop_back();
+  }
+}
+
+
+size_t VerifiedSCTCache::size() const {
+  lock_guard<mutex> lock(lock_);
+  return entries_.size();
+}
+
+
+// static
+string VerifiedSCTCache::Key(const string& leaf_hash, const string& sct) {
+  return leaf_hash + Sha256Hasher::Sha256Digest(sct);
+}
+
+
+}  // namespace cert_trans
@@ -0,0 +1,60 @@
+#ifndef CERT_TRANS_CLIENT_VERIFIED_SCT_CACHE_H_
+#define CERT_TRANS_CLIENT_VERIFIED_SCT_CACHE_H_
+
+#include <stddef.h>
+#include <list>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <utility>
+
+namespace cert_trans {
+
+
+// Remembers which SCTs have already been verified for which
+// certificates, so that a client seeing the same certificate again
+// (as it does for every host behind the same CDN) does not need to
+// check the signature of the log again.
+//
+// An SCT is known by its leaf hash (the SHA-256 hash of the leaf data
+// of the entry it was issued for, as in SSLClientCTData) and the hash
+// of its serialization, which covers everything the signature covers.
+// A cache must only be used for SCTs of a single log, since the
+// signatures are only checked against one key.
+//
+// This class is thread-safe. The least recently used SCTs are evicted
+// first.
+class VerifiedSCTCache {
+ public:
+  explicit VerifiedSCTCache(size_t max_entries);
+  VerifiedSCTCache(const VerifiedSCTCache&) = delete;
+  VerifiedSCTCache& operator=(const VerifiedSCTCache&) = delete;
+
+  // Returns true, with the Merkle leaf hash that was recorded for it in
+  // |*merkle_leaf_hash|, if |sct| was verified for |leaf_hash| before.
+  bool Find(const std::string& leaf_hash, const std::string& sct,
+            std::string* merkle_leaf_hash);
+
+  // Records that |sct| was verified for |leaf_hash|.
+  void Insert(const std::string& leaf_hash, const std::string& sct,
+              const std::string& merkle_leaf_hash);
+
+  size_t size() const;
+
+ private:
+  // Most recently used first.
+  typedef std::list<std::pair<std::string, std::string>> EntryList;
+
+  static std::string Key(const std::string& leaf_hash,
+                         const std::string& sct);
+
+  const size_t max_entries_;
+  mutable std::mutex lock_;
+  EntryList entries_;
+  std::unordered_map<std::string, EntryList::iterator> index_;
+};
+
+
+}  // namespace cert_trans
+
+#endif  // CERT_TRANS_CLIENT_VERIFIED_SCT_CACHE_H_
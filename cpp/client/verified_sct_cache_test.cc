@@ -0,0 +1,54 @@
+#include "client/verified_sct_cache.h"
+
+#include <gtest/gtest.h>
+#include <string>
+
+#include "util/testing.h"
+
+namespace cert_trans {
+namespace {
+
+using std::string;
+
+
+TEST(VerifiedSCTCacheTest, FindsWhatWasInserted) {
+  VerifiedSCTCache cache(10);
+  string merkle_leaf_hash;
+  EXPECT_FALSE(cache.Find("leaf", "sct", &merkle_leaf_hash));
+
+  cache.Insert("leaf", "sct", "merkle");
+  EXPECT_EQ(1U, cache.size());
+  EXPECT_TRUE(cache.Find("leaf", "sct", &merkle_leaf_hash));
+  EXPECT_EQ("merkle", merkle_leaf_hash);
+
+  // Both have to match.
+  EXPECT_FALSE(cache.Find("leaf", "other sct", &merkle_leaf_hash));
+  EXPECT_FALSE(cache.Find("other leaf", "sct", &merkle_leaf_hash));
+}
+
+
+TEST(VerifiedSCTCacheTest, EvictsLeastRecentlyUsed) {
+  VerifiedSCTCache cache(2);
+  cache.Insert("leaf", "sct1", "merkle1");
+  cache.Insert("leaf", "sct2", "merkle2");
+  string merkle_leaf_hash;
+  EXPECT_TRUE(cache.Find("leaf", "sct1", &merkle_leaf_hash));
+
+  cache.Insert("leaf", "sct3", "merkle3");
+  EXPECT_EQ(2U, cache.size());
+  EXPECT_TRUE(cache.Find("leaf", "sct1", &merkle_leaf_hash));
+  EXPECT_EQ("merkle1", merkle_leaf_hash);
+  EXPECT_FALSE(cache.Find("leaf", "sct2", &merkle_leaf_hash));
+  EXPECT_TRUE(cache.Find("leaf", "sct3", &merkle_leaf_hash));
+  EXPECT_EQ("merkle3", merkle_leaf_hash);
+}
+
+
+}  // namespace
+}  // namespace cert_trans
+
+
+int main(int argc, char** argv) {
+  cert_trans::test::InitTesting(argv[0], &argc, &argv, true);
+  return RUN_ALL_TESTS();
+}
@@ -6,12 +6,14 @@
 #include "fetcher/fetcher.h"
 #include "fetcher/peer_group.h"
 #include "log/log_verifier.h"
+#include "util/thread_pool.h"
 
+using std::atomic;
 using std::bind;
 using std::chrono::seconds;
 using std::lock_guard;
+using std::make_shared;
 using std::map;
-using std::move;
 using std::mutex;
 using std::placeholders::_1;
 using std::shared_ptr;
@@ -21,24 +23,40 @@ using std::unique_ptr;
 using util::Executor;
 using util::Task;
 
-DEFINE_int32(delay_between_fetches_seconds, 30, "delay between fetches");
+DEFINE_int32(delay_between_fetches_seconds, 30,
+             "delay between fetches, for peers which do not signal when "
+             "they have new entries");
+DEFINE_int32(fetcher_verify_threads, 0,
+             "number of threads verifying the SCTs of fetched entries (0 "
+             "for one per core)");
 
 namespace cert_trans {
 
 namespace {
 
 
+// A single PeerGroup lives as long as the fetcher, so that what it
+// learns about the peers is kept, and peers come and go without
+// disturbing the requests in flight. Each fetch runs until it has
+// caught up with the peers (following them as they grow), and the
+// next one starts as soon as there is something new to fetch.
 class ContinuousFetcherImpl : public ContinuousFetcher {
  public:
   ContinuousFetcherImpl(libevent::Base* base, Executor* executor, Database* db,
-                        const LogVerifier* log_verifier, bool fetch_scts);
+                        const LogVerifier* log_verifier, bool fetch_scts,
+                        const string& local_region,
+                        const string& checkpoint_file);
   ContinuousFetcherImpl(const ContinuousFetcherImpl&) = delete;
   ContinuousFetcherImpl& operator=(const ContinuousFetcherImpl&) = delete;
 
   void AddPeer(const string& node_id, const shared_ptr<Peer>& peer) override;
   void RemovePeer(const string& node_id) override;
+  void NewEntriesAvailable() override;
+  void SetPriorityTreeSize(int64_t tree_size) override;
 
  private:
+  // Starts a fetch, or if there is one already, another one after it.
+  void WantFetch(const unique_lock<mutex>& lock);
   void StartFetch(const unique_lock<mutex>& lock);
   void FetchDone(Task* task);
   void FetchDelayDone(Task* task);
@@ -47,25 +65,40 @@ class ContinuousFetcherImpl : public ContinuousFetcher {
   Executor* const executor_;
   Database* const db_;
   const LogVerifier* const log_verifier_;
-  const bool fetch_scts_;
+  const string checkpoint_file_;
+  const unique_ptr<ThreadPool> verify_pool_;
+  const shared_ptr<PeerGroup> peer_group_;
+  atomic<int64_t> priority_tree_size_;
 
   mutex lock_;
   map<string, shared_ptr<Peer>> peers_;
 
-  bool restart_fetch_;
+  // Whether to start another fetch as soon as the current one is
+  // done, as there might be new entries it didn't see.
+  bool fetch_again_;
+  // Whether FetchDelayDone is already scheduled, as fetches can also
+  // be started early.
+  bool fetch_delayed_;
   unique_ptr<Task> fetch_task_;
 };
 
 
 ContinuousFetcherImpl::ContinuousFetcherImpl(
     libevent::Base* base, Executor* executor, Database* db,
-    const LogVerifier* const log_verifier, bool fetch_scts)
+    const LogVerifier* const log_verifier, bool fetch_scts,
+    const string& local_region, const string& checkpoint_file)
     : base_(CHECK_NOTNULL(base)),
       executor_(CHECK_NOTNULL(executor)),
       db_(CHECK_NOTNULL(db)),
       log_verifier_(CHECK_NOTNULL(log_verifier)),
-      fetch_scts_(fetch_scts),
-      restart_fetch_(false) {
+      checkpoint_file_(checkpoint_file),
+      verify_pool_(FLAGS_fetcher_verify_threads > 0
+                       ? new ThreadPool(FLAGS_fetcher_verify_threads)
+                       : new ThreadPool),
+      peer_group_(make_shared<PeerGroup>(fetch_scts, local_region)),
+      priority_tree_size_(0),
+      fetch_again_(false),
+      fetch_delayed_(false) {
 }
 
 
@@ -73,34 +106,66 @@ void ContinuousFetcherImpl::AddPeer(const string& node_id,
                                     const shared_ptr<Peer>& peer) {
   unique_lock<mutex> lock(lock_);
 
-  // TODO(pphaneuf): Allow updating the peer, as this is currently
-  // simplest, for the case where a peer might change host:port.
+  // A peer might be replaced, for example when it changes host:port.
+  // TODO(pphaneuf): In tests, we rig more than cluster state
+  // controllers to the same continuous fetcher instance, so additions
+  // can be duplicated. Tolerate this for now.
   const auto it(peers_.find(node_id));
   if (it != peers_.end()) {
+    if (it->second == peer) {
+      return;
+    }
+    peer_group_->Remove(it->second);
     it->second = peer;
   } else {
     CHECK(peers_.emplace(node_id, peer).second);
   }
+  peer_group_->Add(peer);
 
-  if (fetch_task_) {
-    restart_fetch_ = true;
-    fetch_task_->Cancel();
-  } else {
-    StartFetch(lock);
-  }
+  WantFetch(lock);
 }
 
 
 void ContinuousFetcherImpl::RemovePeer(const string& node_id) {
   lock_guard<mutex> lock(lock_);
 
-  // TODO(pphaneuf): In tests, we rig more than cluster state
-  // controllers to the same continuous fetcher instance, so additions
-  // and removals can be duplicated. Tolerate this for now, but only
-  // restart the fetching process if there was an actual removal.
-  if (peers_.erase(node_id) > 0 && fetch_task_) {
-    restart_fetch_ = true;
-    fetch_task_->Cancel();
+  // Removals can be duplicated too (see AddPeer). The ranges in flight
+  // to the peer are fetched from others if it doesn't answer anymore.
+  const auto it(peers_.find(node_id));
+  if (it != peers_.end()) {
+    peer_group_->Remove(it->second);
+    peers_.erase(it);
+  }
+}
+
+
+void ContinuousFetcherImpl::NewEntriesAvailable() {
+  unique_lock<mutex> lock(lock_);
+  WantFetch(lock);
+}
+
+
+void ContinuousFetcherImpl::SetPriorityTreeSize(int64_t tree_size) {
+  // A fetch in progress picks up the new value as it goes.
+  if (priority_tree_size_.exchange(tree_size) >= tree_size) {
+    return;
+  }
+
+  unique_lock<mutex> lock(lock_);
+  if (!fetch_task_ && tree_size > db_->TreeSize()) {
+    VLOG(1) << "fetching urgently up to tree size " << tree_size;
+    StartFetch(lock);
+  }
+}
+
+
+void ContinuousFetcherImpl::WantFetch(const unique_lock<mutex>& lock) {
+  CHECK(lock.owns_lock());
+
+  if (fetch_task_) {
+    fetch_again_ = true;
+  } else {
+    StartFetch(lock);
   }
 }
 
@@ -109,18 +174,14 @@ void ContinuousFetcherImpl::StartFetch(const unique_lock<mutex>& lock) {
   CHECK(lock.owns_lock());
   CHECK(!fetch_task_);
 
-  restart_fetch_ = false;
-
-  unique_ptr<PeerGroup> peer_group(new PeerGroup(fetch_scts_));
-  for (const auto& peer : peers_) {
-    peer_group->Add(peer.second);
-  }
+  fetch_again_ = false;
 
   fetch_task_.reset(
       new Task(bind(&ContinuousFetcherImpl::FetchDone, this, _1), executor_));
 
-  VLOG(1) << "starting fetch with tree size: " << peer_group->TreeSize();
-  FetchLogEntries(db_, move(peer_group), log_verifier_, fetch_task_.get());
+  VLOG(1) << "starting fetch with tree size: " << peer_group_->TreeSize();
+  FetchLogEntries(db_, peer_group_, log_verifier_, verify_pool_.get(),
+                  fetch_task_.get(), &priority_tree_size_, checkpoint_file_);
 }
 
 
@@ -132,10 +193,13 @@ void ContinuousFetcherImpl::FetchDone(Task* task) {
   lock_guard<mutex> lock(lock_);
   fetch_task_.reset();
 
-  if (restart_fetch_) {
+  if (fetch_again_) {
     executor_->Add(
         bind(&ContinuousFetcherImpl::FetchDelayDone, this, nullptr));
-  } else {
+  } else if (!fetch_delayed_) {
+    // Peers which don't tell us about their new entries are still
+    // polled from time to time.
+    fetch_delayed_ = true;
     base_->Delay(seconds(FLAGS_delay_between_fetches_seconds),
                  new Task(bind(&ContinuousFetcherImpl::FetchDelayDone, this,
                                _1),
@@ -152,6 +216,9 @@ void ContinuousFetcherImpl::FetchDelayDone(Task* task) {
   }
 
   unique_lock<mutex> lock(lock_);
+  if (task) {
+    fetch_delayed_ = false;
+  }
   if (!fetch_task_) {
     StartFetch(lock);
   }
@@ -164,9 +231,11 @@ void ContinuousFetcherImpl::FetchDelayDone(Task* task) {
 // static
 unique_ptr<ContinuousFetcher> ContinuousFetcher::New(
     libevent::Base* base, Executor* executor, Database* db,
-    const LogVerifier* log_verifier, bool fetch_scts) {
+    const LogVerifier* log_verifier, bool fetch_scts,
+    const string& local_region, const string& checkpoint_file) {
   return unique_ptr<ContinuousFetcher>(
-      new ContinuousFetcherImpl(base, executor, db, log_verifier, fetch_scts));
+      new ContinuousFetcherImpl(base, executor, db, log_verifier, fetch_scts,
+                                local_region, checkpoint_file));
 }
 
 
@@ -1,6 +1,7 @@
 #ifndef CERT_TRANS_FETCHER_CONTINUOUS_FETCHER_H_
 #define CERT_TRANS_FETCHER_CONTINUOUS_FETCHER_H_
 
+#include <stdint.h>
 #include <map>
 #include <memory>
 #include <mutex>
@@ -21,9 +22,14 @@ namespace cert_trans {
 
 class ContinuousFetcher {
  public:
+  // Peers in the same region as |local_region| are preferred, if it
+  // is not empty. The progress of the fetches is kept in
+  // |checkpoint_file|, if it is not empty (see FetchLogEntries()).
   static std::unique_ptr<ContinuousFetcher> New(
       libevent::Base* base, util::Executor* executor, Database* db,
-      const LogVerifier* log_verifier, bool fetch_scts);
+      const LogVerifier* log_verifier, bool fetch_scts,
+      const std::string& local_region,
+      const std::string& checkpoint_file = std::string());
 
   virtual ~ContinuousFetcher() = default;
   ContinuousFetcher(const ContinuousFetcher&) = delete;
@@ -34,6 +40,16 @@ class ContinuousFetcher {
 
   virtual void RemovePeer(const std::string& node_id) = 0;
 
+  // Tells the fetcher that a peer has new entries, so that it fetches
+  // them right away, rather than at its next periodic fetch.
+  virtual void NewEntriesAvailable() = 0;
+
+  // Asks for the entries below |tree_size| to be fetched ahead of any
+  // others, as quickly as the peers allow, typically because the
+  // cluster needs this node to have them before it can serve a newer
+  // STH. Starts fetching right away if it wasn't already.
+  virtual void SetPriorityTreeSize(int64_t tree_size) = 0;
+
  protected:
   ContinuousFetcher() = default;
 };
@@ -2,8 +2,14 @@
 
 #include <gflags/gflags.h>
 #include <glog/logging.h>
+#include <stdio.h>
+#include <chrono>
+#include <fstream>
+#include <iterator>
+#include <map>
 #include <memory>
 #include <mutex>
+#include <set>
 
 #include "log/log_verifier.h"
 #include "monitoring/monitoring.h"
@@ -11,24 +17,49 @@
 using cert_trans::AsyncLogClient;
 using cert_trans::LoggedEntry;
 using cert_trans::PeerGroup;
+using ct::FetchCheckpoint;
+using ct::LogEntry;
+using ct::SignedCertificateTimestamp;
 using std::bind;
+using std::atomic;
+using std::chrono::duration;
+using std::chrono::seconds;
+using std::chrono::steady_clock;
 using std::lock_guard;
+using std::map;
+using std::max;
+using std::min;
 using std::move;
 using std::mutex;
+using std::pair;
 using std::placeholders::_1;
+using std::set;
+using std::shared_ptr;
 using std::string;
 using std::to_string;
 using std::unique_lock;
 using std::unique_ptr;
 using std::vector;
+using util::Executor;
 using util::Status;
 using util::Task;
 using util::TaskHold;
 
 DEFINE_int32(fetcher_concurrent_fetches, 2,
-             "number of concurrent fetch requests");
+             "minimum number of concurrent fetch requests, more are made "
+             "if the peers are answering quickly");
 DEFINE_int32(fetcher_batch_size, 1000,
              "maximum number of entries to fetch per request");
+DEFINE_int32(fetcher_bulk_load_threshold, 1000000,
+             "put the database in bulk loading mode while fetching, when "
+             "at least this many entries are missing (0 to never do so)");
+DEFINE_int32(fetcher_checkpoint_interval_seconds, 10,
+             "minimum interval between two writes of the fetch checkpoint, "
+             "when there is one");
+DEFINE_int32(fetcher_reorder_buffer_size, 50000,
+             "maximum number of entries fetched ahead of the first ones "
+             "missing to hold in memory, so that they are written along "
+             "with them (0 to write all entries as soon as fetched)");
 
 namespace cert_trans {
 
@@ -36,61 +67,169 @@ Counter<string>* num_invalid_entries_fetched =
     Counter<string>::New("num_invalid_entries_fetched", "reason",
                          "Number of invalid entries fetched from remote peers "
                          "broken down by reason.");
+MetricCell* const num_invalid_entries_format =
+    num_invalid_entries_fetched->WithLabels("format");
+MetricCell* const num_invalid_entries_sct_verify_failed =
+    num_invalid_entries_fetched->WithLabels("sct_verify_failed");
 
 
 namespace {
 
 
+// Number of entries of a batch verified together on the verification
+// executor.
+const size_t kVerifyChunkSize = 64;
+
+// Smallest batch the urgent entries are split into, so that spreading
+// them over the peers doesn't turn into a flood of tiny requests.
+const int64_t kMinUrgentBatchSize = 50;
+
+
 struct Range {
   enum State {
     HAVE,
+    // Fetched and verified, waiting in |FetchState::buffered_| for the
+    // entries before it to be written.
+    BUFFERED,
     FETCHING,
     WANT,
   };
 
-  Range(State state, int64_t size, unique_ptr<Range> next = nullptr)
-      : state_(state), size_(size), next_(move(next)) {
-    CHECK(state_ == HAVE || state_ == FETCHING || state_ == WANT);
+  Range(State state, int64_t size) : state_(state), size_(size) {
+    CHECK(state_ == HAVE || state_ == BUFFERED || state_ == FETCHING ||
+          state_ == WANT);
     CHECK_GT(size_, 0);
   };
 
   State state_;
   int64_t size_;
-  unique_ptr<Range> next_;
+};
+
+
+// The entries of a fetched batch, converted and verified, along with
+// the outcome for each of them.
+struct VerifiedEntries {
+  explicit VerifiedEntries(size_t size) : entries(size), results(size) {
+  }
+
+  vector<LoggedEntry> entries;
+  vector<Status> results;
 };
 
 
 struct FetchState {
-  FetchState(Database* db, unique_ptr<PeerGroup> peer_group,
-             const LogVerifier* log_verifier, Task* task);
+  FetchState(Database* db, const shared_ptr<PeerGroup>& peer_group,
+             const LogVerifier* log_verifier, Executor* verify_executor,
+             Task* task, const atomic<int64_t>* priority_tree_size,
+             const string& checkpoint_file);
+  ~FetchState();
   FetchState(const FetchState&) = delete;
   FetchState& operator=(const FetchState&) = delete;
 
   void WalkEntries();
-  void FetchRange(const unique_lock<mutex>& lock, Range* current,
-                  int64_t index, Task* range_task);
-  void WriteToDatabase(int64_t index, Range* range,
-                       const vector<AsyncLogClient::Entry>* retval,
-                       Task* range_task, Task* fetch_task);
+  void FetchRange(const unique_lock<mutex>& lock, int64_t index, bool urgent,
+                  Task* range_task);
+  void FetchDone(int64_t index, const vector<AsyncLogClient::Entry>* retval,
+                 Task* range_task, Task* fetch_task);
+  void VerifyEntries(int64_t index,
+                     const vector<AsyncLogClient::Entry>* retval,
+                     Task* range_task);
+  void VerifyChunk(int64_t index, const vector<AsyncLogClient::Entry>* retval,
+                   size_t begin, size_t end, VerifiedEntries* verified,
+                   Task* verify_task);
+  void WriteToDatabase(int64_t index, VerifiedEntries* verified,
+                       Task* range_task, Task* verify_task);
+  // Writes |entries|, returning how many of them were written.
+  int64_t WriteEntries(const vector<LoggedEntry>& entries);
+
+  // These must be called with |lock_| held.
+  //
+  // Adds the range of |size| entries at |index|, merging it with its
+  // neighbours.
+  void AddRange(int64_t index, Range::State state, int64_t size);
+  // Sets the state of the range at |index|, merging it with its
+  // neighbours unless it is FETCHING.
+  void SetState(int64_t index, Range::State state);
+  // Cuts the range at |index| down to |size| entries, the rest of it
+  // becoming a range of its own, in |rest_state|.
+  void Split(int64_t index, int64_t size, Range::State rest_state);
+  // Merges the range |it| with its neighbours in the same state,
+  // unless they are BUFFERED or FETCHING.
+  void Merge(map<int64_t, Range>::iterator it);
+  // Whether all the entries before the range at |index| are written.
+  bool AtHead(int64_t index) const;
+  // Moves the entries of the BUFFERED ranges from |index| onward to
+  // the end of |entries|, adding their offsets to |ranges|. They are
+  // marked as FETCHING until they are written.
+  void TakeBuffered(int64_t index, vector<LoggedEntry>* entries,
+                    vector<int64_t>* ranges);
+
+  // Adds the ranges from |checkpoint_file_| that the database has, as
+  // HAVE, up to |end|, and what is between them as WANT.
+  void LoadCheckpoint(int64_t end);
+  // Writes the HAVE ranges to |checkpoint_file_|, if there is one, and
+  // if it was not written too recently, unless |force| is true.
+  void SaveCheckpoint(bool force);
 
   Database* const db_;
-  const unique_ptr<PeerGroup> peer_group_;
+  const shared_ptr<PeerGroup> peer_group_;
   const LogVerifier* const log_verifier_;
+  Executor* const verify_executor_;
   Task* const task_;
+  const atomic<int64_t>* const priority_tree_size_;
+  const string checkpoint_file_;
+  bool bulk_loading_;
+  // Whether there is anything to checkpoint, that is, whether the
+  // ranges were set up.
+  bool started_;
 
   mutex lock_;
   int64_t start_;
-  unique_ptr<Range> entries_;
+  // The entries from |start_| onward, as contiguous ranges keyed by
+  // their offset. The ranges being fetched keep their offset until
+  // they are done, so that they can be found again. Neighbouring
+  // ranges in the same state are merged, unless they are BUFFERED or
+  // FETCHING.
+  map<int64_t, Range> entries_;
+  // The offsets of the WANT ranges, so that finding the next ranges to
+  // fetch does not go over all the others.
+  set<int64_t> wanted_;
+  // Number of requests to the peer group currently outstanding. Ranges
+  // which have been received but are still being verified and written
+  // to the database are not counted, so that the next fetches can
+  // proceed meanwhile.
+  int num_fetching_;
+  // The entries of the BUFFERED ranges, keyed by their offset, and
+  // how many there are in all.
+  map<int64_t, vector<LoggedEntry>> buffered_;
+  int64_t num_buffered_;
+  steady_clock::time_point last_checkpoint_;
+
+  // Held while writing the checkpoint.
+  mutex checkpoint_lock_;
 };
 
 
-FetchState::FetchState(Database* db, unique_ptr<PeerGroup> peer_group,
-                       const LogVerifier* log_verifier, Task* task)
+FetchState::FetchState(Database* db,
+                       const shared_ptr<PeerGroup>& peer_group,
+                       const LogVerifier* log_verifier,
+                       Executor* verify_executor, Task* task,
+                       const atomic<int64_t>* priority_tree_size,
+                       const string& checkpoint_file)
     : db_(CHECK_NOTNULL(db)),
-      peer_group_(move(peer_group)),
+      peer_group_(peer_group),
       log_verifier_(CHECK_NOTNULL(log_verifier)),
+      verify_executor_(CHECK_NOTNULL(verify_executor)),
       task_(CHECK_NOTNULL(task)),
-      start_(db_->TreeSize()) {
+      priority_tree_size_(priority_tree_size),
+      checkpoint_file_(checkpoint_file),
+      bulk_loading_(false),
+      started_(false),
+      start_(db_->TreeSize()),
+      num_fetching_(0),
+      num_buffered_(0),
+      last_checkpoint_(steady_clock::now()) {
+  CHECK(peer_group_);
   // TODO(pphaneuf): Might be better to get that as a parameter?
   const int64_t remote_tree_size(peer_group_->TreeSize());
   CHECK_GE(start_, 0);
@@ -103,12 +242,34 @@ FetchState::FetchState(Database* db, unique_ptr<PeerGroup> peer_group,
     return;
   }
 
-  entries_.reset(new Range(Range::WANT, remote_tree_size - start_));
+  if (FLAGS_fetcher_bulk_load_threshold > 0 &&
+      remote_tree_size - start_ >= FLAGS_fetcher_bulk_load_threshold) {
+    LOG(INFO) << "bulk loading " << remote_tree_size - start_ << " entries";
+    db_->BeginBulkLoad();
+    bulk_loading_ = true;
+  }
+
+  {
+    lock_guard<mutex> lock(lock_);
+    LoadCheckpoint(remote_tree_size);
+    started_ = true;
+  }
 
   WalkEntries();
 }
 
 
+FetchState::~FetchState() {
+  // All the writes are done by the time the task deletes us.
+  if (bulk_loading_) {
+    db_->EndBulkLoad();
+  }
+  if (started_) {
+    SaveCheckpoint(true /* force */);
+  }
+}
+
+
 // This is called either when starting the fetching, or when fetching
 // a range completed. In that both cases, there's a hold on our task,
 // so it shouldn't go away from under us.
@@ -128,169 +289,300 @@ void FetchState::WalkEntries() {
 
   // Prune fetched and unavailable sequences at the beginning.
   const int64_t remote_tree_size(peer_group_->TreeSize());
-  while (entries_ &&
-         (entries_->state_ == Range::HAVE ||
-          (entries_->state_ == Range::WANT && remote_tree_size < start_))) {
-    VLOG(1) << "pruning " << entries_->size_ << " at offset " << start_;
-    start_ += entries_->size_;
-    entries_ = move(entries_->next_);
+  while (!entries_.empty()) {
+    const auto first(entries_.begin());
+    const Range& range(first->second);
+    if (range.state_ != Range::HAVE &&
+        (range.state_ != Range::WANT || remote_tree_size >= start_)) {
+      break;
+    }
+    VLOG(1) << "pruning " << range.size_ << " at offset " << start_;
+    start_ += range.size_;
+    wanted_.erase(first->first);
+    entries_.erase(first);
+  }
+
+  // Follow the peers as they get new entries.
+  const int64_t end_index(
+      entries_.empty()
+          ? start_
+          : entries_.rbegin()->first + entries_.rbegin()->second.size_);
+  if (remote_tree_size > end_index) {
+    VLOG(1) << "remote tree size grew to " << remote_tree_size;
+    AddRange(end_index, Range::WANT, remote_tree_size - end_index);
   }
 
   // Are we done?
-  if (!entries_) {
+  if (entries_.empty()) {
     task_->Return();
     return;
   }
 
-  int64_t index(start_);
-  int num_fetch(0);
-  for (Range *current = entries_.get(); current;
-       index += current->size_, current = current->next_.get()) {
-    // Coalesce with the next Range, if possible.
-    if (current->state_ != Range::FETCHING) {
-      while (current->next_ && current->next_->state_ == current->state_) {
-        current->size_ += current->next_->size_;
-        current->next_ = move(current->next_->next_);
-      }
+  const int max_fetches(
+      max(FLAGS_fetcher_concurrent_fetches, peer_group_->FetchCapacity()));
+  // Split the urgent entries so that every fetch slot can work on them.
+  const int64_t priority_tree_size(
+      priority_tree_size_ ? priority_tree_size_->load() : 0);
+  const int64_t urgent_batch_size(
+      min<int64_t>(FLAGS_fetcher_batch_size,
+                   max<int64_t>(kMinUrgentBatchSize,
+                                (priority_tree_size - start_ + max_fetches -
+                                 1) / max_fetches)));
+  // Only the WANT ranges are gone through, the others have nothing to
+  // start.
+  auto want(wanted_.begin());
+  while (want != wanted_.end() && num_fetching_ < max_fetches) {
+    const int64_t index(*want);
+    // Do not start a fetch if we think our peer group does not have
+    // it.
+    if (index >= remote_tree_size) {
+      break;
     }
-
-    switch (current->state_) {
-      case Range::HAVE:
-        VLOG(2) << "at offset " << index << ", we have " << current->size_
-                << " entries";
-        break;
-
-      case Range::FETCHING:
-        VLOG(2) << "at offset " << index << ", fetching " << current->size_
-                << " entries";
-        ++num_fetch;
-        break;
-
-      case Range::WANT:
-        VLOG(2) << "at offset " << index << ", we want " << current->size_
-                << " entries";
-
-        // Do not start a fetch if we think our peer group does not
-        // have it.
-        if (index >= remote_tree_size) {
-          break;
-        }
-
-        // If the range is bigger than the maximum batch size, split it.
-        if (current->size_ > FLAGS_fetcher_batch_size) {
-          current->next_.reset(
-              new Range(Range::WANT, current->size_ - FLAGS_fetcher_batch_size,
-                        move(current->next_)));
-          current->size_ = FLAGS_fetcher_batch_size;
-        }
-
-        FetchRange(lock, current, index,
-                   task_->AddChild(bind(&FetchState::WalkEntries, this)));
-        ++num_fetch;
-
-        break;
+    const Range& range(entries_.at(index));
+    VLOG(2) << "at offset " << index << ", we want " << range.size_
+            << " entries";
+
+    // If the range is bigger than the maximum batch size, split it.
+    // Urgent ranges are also split where the urgent entries end.
+    const bool priority(index < priority_tree_size);
+    const int64_t batch_size(
+        priority ? min(urgent_batch_size, priority_tree_size - index)
+                 : FLAGS_fetcher_batch_size);
+    if (range.size_ > batch_size) {
+      Split(index, batch_size, Range::WANT);
     }
 
-    if (num_fetch >= FLAGS_fetcher_concurrent_fetches ||
-        index >= remote_tree_size) {
-      break;
-    }
+    // The first entries missing hold up writing those fetched after
+    // them, so they go to the quickest peers as well.
+    const bool urgent(priority || index == start_);
+    FetchRange(lock, index, urgent,
+               task_->AddChild(bind(&FetchState::WalkEntries, this)));
+    want = wanted_.upper_bound(index);
   }
 }
 
 
-void FetchState::FetchRange(const unique_lock<mutex>& lock, Range* current,
-                            int64_t index, Task* range_task) {
+void FetchState::FetchRange(const unique_lock<mutex>& lock, int64_t index,
+                            bool urgent, Task* range_task) {
   CHECK(lock.owns_lock());
-  const int64_t end_index(index + current->size_ - 1);
-  VLOG(1) << "fetching from offset " << index << " to " << end_index;
+  const int64_t end_index(index + entries_.at(index).size_ - 1);
+  VLOG(1) << "fetching from offset " << index << " to " << end_index
+          << (urgent ? " (urgent)" : "");
 
   vector<AsyncLogClient::Entry>* const retval(
       new vector<AsyncLogClient::Entry>);
   range_task->DeleteWhenDone(retval);
 
-  current->state_ = Range::FETCHING;
+  SetState(index, Range::FETCHING);
+  ++num_fetching_;
 
   peer_group_->FetchEntries(index, end_index, retval,
                             range_task->AddChild(
-                                bind(&FetchState::WriteToDatabase, this, index,
-                                     current, retval, range_task, _1)));
+                                bind(&FetchState::FetchDone, this, index,
+                                     retval, range_task, _1)),
+                            urgent);
 }
 
 
-void FetchState::WriteToDatabase(int64_t index, Range* range,
-                                 const vector<AsyncLogClient::Entry>* retval,
-                                 Task* range_task, Task* fetch_task) {
-  if (!fetch_task->status().ok()) {
-    LOG(INFO) << "error fetching entries at index " << index << ": "
-              << fetch_task->status();
+void FetchState::FetchDone(int64_t index,
+                           const vector<AsyncLogClient::Entry>* retval,
+                           Task* range_task, Task* fetch_task) {
+  {
     lock_guard<mutex> lock(lock_);
-    range->state_ = Range::WANT;
-    range_task->Return(fetch_task->status());
-    return;
+    CHECK_GT(num_fetching_, 0);
+    --num_fetching_;
+
+    if (!fetch_task->status().ok()) {
+      LOG(INFO) << "error fetching entries at index " << index << ": "
+                << fetch_task->status();
+      SetState(index, Range::WANT);
+      range_task->Return(fetch_task->status());
+      return;
+    }
+
+    CHECK_GT(retval->size(), static_cast<size_t>(0));
+
+    // If we didn't receive everything, give back the rest right away,
+    // so that it can be fetched while we write these.
+    const int64_t received(retval->size());
+    if (entries_.at(index).size_ > received) {
+      Split(index, received, Range::WANT);
+    }
   }
 
-  CHECK_GT(retval->size(), static_cast<size_t>(0));
+  // The range is still marked as FETCHING, so won't be fetched again,
+  // but it no longer counts against the concurrent fetches.
+  WalkEntries();
 
+  VerifyEntries(index, retval, range_task);
+}
+
+
+void FetchState::VerifyEntries(int64_t index,
+                               const vector<AsyncLogClient::Entry>* retval,
+                               Task* range_task) {
   VLOG(1) << "received " << retval->size() << " entries at offset " << index;
-  int64_t processed(0);
-  for (const auto& entry : *retval) {
-    LoggedEntry cert;
-    if (!cert.CopyFromClientLogEntry(entry)) {
+  VerifiedEntries* const verified(new VerifiedEntries(retval->size()));
+  range_task->DeleteWhenDone(verified);
+
+  // The verification of the chunks can complete in any order, the
+  // entries are only written once all of them are done.
+  Task* const verify_task(range_task->AddChild(
+      bind(&FetchState::WriteToDatabase, this, index, verified, range_task,
+           _1)));
+  for (size_t begin = 0; begin < retval->size();
+       begin += kVerifyChunkSize) {
+    const size_t end(std::min(retval->size(), begin + kVerifyChunkSize));
+    verify_task->AddHold();
+    verify_executor_->Add(bind(&FetchState::VerifyChunk, this, index, retval,
+                               begin, end, verified, verify_task));
+  }
+  verify_task->Return();
+}
+
+
+void FetchState::VerifyChunk(int64_t index,
+                             const vector<AsyncLogClient::Entry>* retval,
+                             size_t begin, size_t end,
+                             VerifiedEntries* verified, Task* verify_task) {
+  // The SCTs to verify, and the offsets of their entries.
+  vector<pair<const LogEntry*, const SignedCertificateTimestamp*>> scts;
+  vector<size_t> sct_offsets;
+  for (size_t i = begin; i < end; ++i) {
+    const AsyncLogClient::Entry& entry((*retval)[i]);
+    LoggedEntry* const cert(&verified->entries[i]);
+    if (!cert->CopyFromClientLogEntry(entry)) {
       LOG(WARNING) << "could not convert entry to a LoggedEntry";
-      num_invalid_entries_fetched->Increment("format");
-      break;
+      num_invalid_entries_format->Increment();
+      verified->results[i] =
+          Status(util::error::INVALID_ARGUMENT, "invalid entry format");
+      continue;
     }
     if (entry.sct) {
-      *cert.mutable_sct() = *entry.sct;
       // If we have the full SCT (because this LogEntry came from another
       // internal node which supports our private "give me the SCT too"
       // option), then verify that the signature is good.
-      const LogVerifier::LogVerifyResult verify_result(
-          log_verifier_->VerifySignedCertificateTimestamp(
-              cert.contents().entry(), cert.sct()));
-      VLOG(1) << "SCT verify entry #" << index << ": "
-              << LogVerifier::VerifyResultString(verify_result);
-      if (verify_result != LogVerifier::VERIFY_OK) {
-        num_invalid_entries_fetched->Increment("sct_verify_failed");
-        const string msg("Failed to verify SCT signature for entry# " +
-                         to_string(index) + " : " +
-                         LogVerifier::VerifyResultString(verify_result));
-        LOG(WARNING) << msg;
-        task_->Return(Status(util::error::FAILED_PRECONDITION, msg));
-        return;
-      }
+      *cert->mutable_sct() = *entry.sct;
+      scts.emplace_back(&cert->contents().entry(), &cert->sct());
+      sct_offsets.push_back(i);
     }
-    cert.set_sequence_number(index++);
-    if (db_->CreateSequencedEntry(cert) == Database::OK) {
-      ++processed;
-    } else {
-      LOG(WARNING) << "could not insert entry into the database:\n"
-                   << cert.DebugString();
-      break;
+  }
+
+  vector<LogVerifier::LogVerifyResult> verify_results;
+  log_verifier_->VerifyBatch(scts, &verify_results);
+  for (size_t j = 0; j < verify_results.size(); ++j) {
+    const size_t i(sct_offsets[j]);
+    VLOG(1) << "SCT verify entry #" << index + i << ": "
+            << LogVerifier::VerifyResultString(verify_results[j]);
+    if (verify_results[j] != LogVerifier::VERIFY_OK) {
+      num_invalid_entries_sct_verify_failed->Increment();
+      const string msg("Failed to verify SCT signature for entry# " +
+                       to_string(index + i) + " : " +
+                       LogVerifier::VerifyResultString(verify_results[j]));
+      LOG(WARNING) << msg;
+      verified->results[i] = Status(util::error::FAILED_PRECONDITION, msg);
+    }
+  }
+
+  for (size_t i = begin; i < end; ++i) {
+    if (!verified->results[i].ok()) {
+      continue;
+    }
+    LoggedEntry* const cert(&verified->entries[i]);
+    cert->set_sequence_number(index + i);
+    if (!cert->StoreServingData()) {
+      LOG(WARNING) << "could not serialize entry #" << index + i;
+      num_invalid_entries_format->Increment();
+      verified->results[i] =
+          Status(util::error::INVALID_ARGUMENT, "invalid entry format");
     }
   }
 
+  verify_task->RemoveHold();
+}
+
+
+void FetchState::WriteToDatabase(int64_t index, VerifiedEntries* verified,
+                                 Task* range_task, Task* verify_task) {
+  // Entries are written in order, stopping at the first one which
+  // could not be verified.
+  const size_t num_fetched(verified->entries.size());
+  size_t num_verified(0);
+  while (num_verified < num_fetched && verified->results[num_verified].ok()) {
+    ++num_verified;
+  }
+  Status verify_status;
+  if (num_verified < num_fetched) {
+    verify_status = verified->results[num_verified];
+  }
+  vector<LoggedEntry>* const entries(&verified->entries);
+  entries->resize(num_verified);
+
+  // Ranges fetched ahead of the first entries missing are held back,
+  // if there is room, to be written along with them once they arrive,
+  // so that the database grows in order, and in larger batches.
+  bool held_back(false);
   {
+    lock_guard<mutex> lock(lock_);
+    if (num_verified == num_fetched && !AtHead(index) &&
+        num_buffered_ + static_cast<int64_t>(num_fetched) <=
+            FLAGS_fetcher_reorder_buffer_size) {
+      VLOG(1) << "holding back " << num_fetched << " entries at offset "
+              << index;
+      SetState(index, Range::BUFFERED);
+      buffered_[index].swap(*entries);
+      num_buffered_ += num_fetched;
+      held_back = true;
+    }
+  }
+  if (held_back) {
+    range_task->Return();
+    return;
+  }
+
+  // The offsets of the ranges being written.
+  vector<int64_t> ranges{index};
+  while (!ranges.empty()) {
+    const int64_t processed(WriteEntries(*entries));
+
     lock_guard<mutex> lock(lock_);
     // TODO(pphaneuf): If we have problems fetching entries, to what
     // point should we retry? Or should we just return on the task
     // with an error?
-    if (processed > 0) {
-      // If we don't receive everything, split up the range.
-      if (range->size_ > processed) {
-        range->next_.reset(new Range(Range::WANT, range->size_ - processed,
-                                     move(range->next_)));
-        range->size_ = processed;
+    int64_t remaining(processed);
+    for (const int64_t offset : ranges) {
+      // If we don't write everything, split up the range.
+      const int64_t size(entries_.at(offset).size_);
+      const int64_t done(min(remaining, size));
+      remaining -= done;
+      if (done > 0 && done < size) {
+        Split(offset, done, Range::WANT);
       }
+      SetState(offset, done > 0 ? Range::HAVE : Range::WANT);
+    }
+    if (entries->empty() ||
+        processed < static_cast<int64_t>(entries->size())) {
+      break;
+    }
 
-      range->state_ = Range::HAVE;
-    } else {
-      range->state_ = Range::WANT;
+    // Carry on with the ranges held back that are now at the head,
+    // which may have arrived while these were being written.
+    entries->clear();
+    ranges.clear();
+    auto head(entries_.begin());
+    if (head != entries_.end() && head->second.state_ == Range::HAVE) {
+      ++head;
+    }
+    if (head != entries_.end() && head->second.state_ == Range::BUFFERED) {
+      TakeBuffered(head->first, entries, &ranges);
     }
   }
+  SaveCheckpoint(false /* force */);
 
-  if (static_cast<uint64_t>(processed) < retval->size()) {
+  if (verify_status.CanonicalCode() == util::error::FAILED_PRECONDITION) {
+    // A peer handed us an entry with a bad signature, stop here.
+    task_->Return(verify_status);
+  } else if (!ranges.empty() || num_verified < num_fetched) {
     // We couldn't insert everything that we received into the
     // database, this is fairly serious, return an error for the
     // overall operation and let the higher level deal with it.
@@ -302,14 +594,207 @@ void FetchState::WriteToDatabase(int64_t index, Range* range,
 }
 
 
+int64_t FetchState::WriteEntries(const vector<LoggedEntry>& entries) {
+  // Writing the batch at once is much cheaper for most databases, but
+  // if that fails, find out how far we can get one entry at a time.
+  if (!entries.empty() &&
+      db_->CreateSequencedEntries(entries) == Database::OK) {
+    return entries.size();
+  }
+  int64_t processed(0);
+  for (const auto& cert : entries) {
+    if (db_->CreateSequencedEntry(cert) != Database::OK) {
+      LOG(WARNING) << "could not insert entry into the database:\n"
+                   << cert.DebugString();
+      break;
+    }
+    ++processed;
+  }
+  return processed;
+}
+
+
+void FetchState::AddRange(int64_t index, Range::State state, int64_t size) {
+  const auto it(entries_.emplace(index, Range(state, size)));
+  CHECK(it.second) << "range at offset " << index << " already exists";
+  if (state == Range::WANT) {
+    wanted_.insert(index);
+  }
+  Merge(it.first);
+}
+
+
+void FetchState::SetState(int64_t index, Range::State state) {
+  const auto it(entries_.find(index));
+  CHECK(it != entries_.end()) << "no range at offset " << index;
+  if (it->second.state_ == Range::WANT) {
+    wanted_.erase(index);
+  }
+  it->second.state_ = state;
+  if (state == Range::WANT) {
+    wanted_.insert(index);
+  }
+  Merge(it);
+}
+
+
+void FetchState::Split(int64_t index, int64_t size, Range::State rest_state) {
+  Range* const range(&entries_.at(index));
+  CHECK_GT(range->size_, size);
+  const int64_t rest(range->size_ - size);
+  range->size_ = size;
+  CHECK(entries_.emplace(index + size, Range(rest_state, rest)).second);
+  if (rest_state == Range::WANT) {
+    wanted_.insert(index + size);
+  }
+}
+
+
+void FetchState::Merge(map<int64_t, Range>::iterator it) {
+  const Range::State state(it->second.state_);
+  if (state == Range::BUFFERED || state == Range::FETCHING) {
+    return;
+  }
+
+  const auto next(std::next(it));
+  if (next != entries_.end() && next->second.state_ == state) {
+    CHECK_EQ(it->first + it->second.size_, next->first);
+    it->second.size_ += next->second.size_;
+    wanted_.erase(next->first);
+    entries_.erase(next);
+  }
+
+  if (it != entries_.begin()) {
+    const auto prev(std::prev(it));
+    if (prev->second.state_ == state) {
+      CHECK_EQ(prev->first + prev->second.size_, it->first);
+      prev->second.size_ += it->second.size_;
+      wanted_.erase(it->first);
+      entries_.erase(it);
+    }
+  }
+}
+
+
+bool FetchState::AtHead(int64_t index) const {
+  const auto it(entries_.find(index));
+  CHECK(it != entries_.end()) << "no range at offset " << index;
+  if (it == entries_.begin()) {
+    return true;
+  }
+  // The HAVE ranges are merged, so there can only be one before.
+  const auto prev(std::prev(it));
+  return prev == entries_.begin() && prev->second.state_ == Range::HAVE;
+}
+
+
+void FetchState::TakeBuffered(int64_t index, vector<LoggedEntry>* entries,
+                              vector<int64_t>* ranges) {
+  for (auto it = entries_.find(index);
+       it != entries_.end() && it->second.state_ == Range::BUFFERED; ++it) {
+    const auto buffered(buffered_.find(it->first));
+    CHECK(buffered != buffered_.end());
+    CHECK_EQ(it->second.size_,
+             static_cast<int64_t>(buffered->second.size()));
+    std::move(buffered->second.begin(), buffered->second.end(),
+              std::back_inserter(*entries));
+    ranges->push_back(it->first);
+    num_buffered_ -= it->second.size_;
+    buffered_.erase(buffered);
+    it->second.state_ = Range::FETCHING;
+  }
+}
+
+
+void FetchState::LoadCheckpoint(int64_t end) {
+  int64_t index(start_);
+  if (!checkpoint_file_.empty()) {
+    FetchCheckpoint checkpoint;
+    std::ifstream in(checkpoint_file_.c_str(),
+                     std::ios::in | std::ios::binary);
+    if (in.good() && !checkpoint.ParseFromIstream(&in)) {
+      LOG(WARNING) << "Ignoring fetch checkpoint " << checkpoint_file_
+                   << ": corrupt";
+      checkpoint.Clear();
+    }
+
+    for (const auto& have : checkpoint.have()) {
+      // Only the ranges the database still has are trusted, as it may
+      // not have made it to disk before the checkpoint did.
+      LoggedEntry entry;
+      if (have.start() < index || have.size() <= 0 ||
+          have.start() + have.size() > end ||
+          db_->LookupByIndex(have.start(), &entry) != Database::LOOKUP_OK ||
+          db_->LookupByIndex(have.start() + have.size() - 1, &entry) !=
+              Database::LOOKUP_OK) {
+        continue;
+      }
+      if (have.start() > index) {
+        AddRange(index, Range::WANT, have.start() - index);
+      }
+      AddRange(have.start(), Range::HAVE, have.size());
+      index = have.start() + have.size();
+      VLOG(1) << "resuming with " << have.size() << " entries at offset "
+              << have.start();
+    }
+  }
+
+  if (end > index) {
+    AddRange(index, Range::WANT, end - index);
+  }
+}
+
+
+void FetchState::SaveCheckpoint(bool force) {
+  if (checkpoint_file_.empty()) {
+    return;
+  }
+
+  FetchCheckpoint checkpoint;
+  {
+    lock_guard<mutex> lock(lock_);
+    const steady_clock::time_point now(steady_clock::now());
+    if (!force &&
+        now - last_checkpoint_ <
+            seconds(FLAGS_fetcher_checkpoint_interval_seconds)) {
+      return;
+    }
+    last_checkpoint_ = now;
+    for (const auto& range : entries_) {
+      if (range.second.state_ == Range::HAVE) {
+        FetchCheckpoint::Range* const have(checkpoint.add_have());
+        have->set_start(range.first);
+        have->set_size(range.second.size_);
+      }
+    }
+  }
+
+  lock_guard<mutex> lock(checkpoint_lock_);
+  const string tmp_file(checkpoint_file_ + ".tmp");
+  std::ofstream out(tmp_file.c_str(),
+                    std::ios::out | std::ios::binary | std::ios::trunc);
+  const bool written(checkpoint.SerializeToOstream(&out));
+  out.close();
+  if (!written || !out.good() ||
+      rename(tmp_file.c_str(), checkpoint_file_.c_str()) != 0) {
+    LOG(WARNING) << "Failed to write fetch checkpoint " << checkpoint_file_;
+    remove(tmp_file.c_str());
+  }
+}
+
+
 }  // namespace
 
 
-void FetchLogEntries(Database* db, unique_ptr<PeerGroup> peer_group,
-                     const LogVerifier* log_verifier, Task* task) {
+void FetchLogEntries(Database* db, const shared_ptr<PeerGroup>& peer_group,
+                     const LogVerifier* log_verifier,
+                     Executor* verify_executor, Task* task,
+                     const atomic<int64_t>* priority_tree_size,
+                     const string& checkpoint_file) {
   TaskHold hold(task);
-  task->DeleteWhenDone(
-      new FetchState(db, move(peer_group), log_verifier, task));
+  task->DeleteWhenDone(new FetchState(db, peer_group, log_verifier,
+                                      verify_executor, task,
+                                      priority_tree_size, checkpoint_file));
 }
 
 
@@ -1,10 +1,14 @@
 #ifndef CERT_TRANS_FETCHER_FETCHER_H_
 #define CERT_TRANS_FETCHER_FETCHER_H_
 
+#include <stdint.h>
+#include <atomic>
 #include <memory>
+#include <string>
 
 #include "fetcher/peer_group.h"
 #include "log/database.h"
+#include "util/executor.h"
 #include "util/task.h"
 
 class LogVerifier;
@@ -12,8 +16,26 @@ class LogVerifier;
 namespace cert_trans {
 
 
-void FetchLogEntries(Database* db, std::unique_ptr<PeerGroup> peer_group,
-                     const LogVerifier* log_verifier, util::Task* task);
+// The SCTs of the fetched entries, if any, are verified on
+// |verify_executor|, which should be able to run several of these
+// verifications in parallel.
+//
+// Entries the peers gain while fetching are fetched as well. If
+// |priority_tree_size| is not null, the entries below the tree size it
+// holds (which may change while fetching) are urgent: they are fetched
+// in smaller batches, spread over the quickest peers.
+//
+// If |checkpoint_file| is not empty, the ranges of entries written past
+// the contiguous ones in the database are kept in it (see
+// --fetcher_checkpoint_interval_seconds), so that the next fetch, even
+// after a restart, carries on from there rather than fetching them
+// again.
+void FetchLogEntries(
+    Database* db, const std::shared_ptr<PeerGroup>& peer_group,
+    const LogVerifier* log_verifier, util::Executor* verify_executor,
+    util::Task* task,
+    const std::atomic<int64_t>* priority_tree_size = nullptr,
+    const std::string& checkpoint_file = std::string());
 
 
 }  // namespace cert_trans
@@ -0,0 +1,284 @@
+#include <gflags/gflags.h>
+#include <glog/logging.h>
+#include <gmock/gmock.h>
+#include <gtest/gtest.h>
+#include <chrono>
+#include <cinttypes>
+#include <condition_variable>
+#include <fstream>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "client/async_log_client.h"
+#include "fetcher/fetcher.h"
+#include "fetcher/peer_group.h"
+#include "log/file_db.h"
+#include "log/log_verifier.h"
+#include "log/logged_entry.h"
+#include "log/test_db.h"
+#include "log/test_signer.h"
+#include "merkletree/merkle_verifier.h"
+#include "merkletree/serial_hasher.h"
+#include "net/mock_url_fetcher.h"
+#include "proto/binary_entries.h"
+#include "proto/cert_serializer.h"
+#include "util/json_wrapper.h"
+#include "util/status_test_util.h"
+#include "util/sync_task.h"
+#include "util/test_db.h"
+#include "util/testing.h"
+#include "util/thread_pool.h"
+#include "util/util.h"
+
+DECLARE_int32(fetcher_batch_size);
+
+namespace cert_trans {
+
+using std::bind;
+using std::condition_variable;
+using std::function;
+using std::lock_guard;
+using std::make_shared;
+using std::move;
+using std::mutex;
+using std::placeholders::_1;
+using std::placeholders::_2;
+using std::placeholders::_3;
+using std::string;
+using std::thread;
+using std::unique_lock;
+using std::unique_ptr;
+using std::vector;
+using testing::_;
+using testing::Invoke;
+using util::SyncTask;
+using util::Task;
+
+const char kLogUrl[] = "https://example.com";
+const int64_t kTreeSize = 250;
+
+
+class FakePeer : public Peer {
+ public:
+  FakePeer(util::Executor* executor, UrlFetcher* fetcher, int64_t tree_size)
+      : Peer(unique_ptr<AsyncLogClient>(
+            new AsyncLogClient(executor, fetcher, kLogUrl))),
+        tree_size_(tree_size) {
+  }
+
+  int64_t TreeSize() const override {
+    return tree_size_;
+  }
+
+ private:
+  const int64_t tree_size_;
+};
+
+
+class FetcherTest : public ::testing::Test {
+ public:
+  FetcherTest()
+      : verify_pool_(4),
+        log_verifier_(TestSigner::DefaultLogSigVerifier(),
+                      new MerkleVerifier(
+                          unique_ptr<Sha256Hasher>(new Sha256Hasher))) {
+    FLAGS_fetcher_batch_size = 100;
+  }
+
+  // Holds back the answer to the request for the entries from
+  // |start|, until HeldRequest() is called.
+  void HoldRequest(int64_t start) {
+    lock_guard<mutex> lock(lock_);
+    held_start_ = start;
+  }
+
+  // Waits for |count| requests to have been made, and returns the
+  // answer held back.
+  function<void()> HeldRequest(size_t count) {
+    unique_lock<mutex> lock(lock_);
+    requested_.wait(lock, [this, count]() {
+      return held_ && requested_starts_.size() >= count;
+    });
+    return held_;
+  }
+
+  // Answers get-entries requests, with a corrupted SCT for the
+  // entries from |first_bad_sct| onward.
+  void ServeEntries(int64_t first_bad_sct, const UrlFetcher::Request& req,
+                    UrlFetcher::Response* resp, Task* task) {
+    int64_t start, end;
+    CHECK_EQ(2, sscanf(req.url.Query().c_str(),
+                       "start=%" SCNd64 "&end=%" SCNd64, &start, &end));
+    {
+      lock_guard<mutex> lock(lock_);
+      requested_starts_.push_back(start);
+      if (start == held_start_ && !held_) {
+        held_ = bind(&FetcherTest::ServeEntries, this, first_bad_sct, req,
+                     resp, task);
+        requested_.notify_all();
+        return;
+      }
+      requested_.notify_all();
+    }
+
+    LoggedEntry entry;
+    TestSigner::SetDefaults(&entry);
+    string leaf_input;
+    string extra_data;
+    string sct;
+    CHECK(entry.SerializeForLeaf(&leaf_input));
+    CHECK(entry.SerializeExtraData(&extra_data));
+    CHECK_EQ(serialization::SerializeResult::OK,
+             Serializer::SerializeSCT(entry.sct(), &sct));
+    entry.mutable_sct()->mutable_signature()->mutable_signature()->at(10) ^=
+        1;
+    string bad_sct;
+    CHECK_EQ(serialization::SerializeResult::OK,
+             Serializer::SerializeSCT(entry.sct(), &bad_sct));
+
+    // AsyncLogClient asks for the binary get-entries first.
+    const bool binary(req.url.Path().find("get-entries-binary") !=
+                      string::npos);
+    string body;
+    JsonArray entries;
+    for (int64_t i = start; i <= end; ++i) {
+      const string& entry_sct(i < first_bad_sct ? sct : bad_sct);
+      if (binary) {
+        CHECK_EQ(serialization::SerializeResult::OK,
+                 WriteBinaryEntry(leaf_input, extra_data, entry_sct, &body));
+        continue;
+      }
+      JsonObject json_entry;
+      json_entry.AddBase64("leaf_input", leaf_input);
+      json_entry.AddBase64("extra_data", extra_data);
+      json_entry.AddBase64("sct", entry_sct);
+      entries.Add(&json_entry);
+    }
+    if (!binary) {
+      JsonObject json_reply;
+      json_reply.Add("entries", entries);
+      body = json_reply.ToString();
+    }
+
+    resp->status_code = 200;
+    resp->body = body;
+    task->Return();
+  }
+
+  util::Status Fetch(int64_t first_bad_sct,
+                     const string& checkpoint_file = string()) {
+    EXPECT_CALL(fetcher_, Fetch(_, _, _))
+        .WillRepeatedly(Invoke(bind(&FetcherTest::ServeEntries, this,
+                                    first_bad_sct, _1, _2, _3)));
+
+    unique_ptr<PeerGroup> peer_group(new PeerGroup(true /* fetch_scts */));
+    peer_group->Add(make_shared<FakePeer>(&pool_, &fetcher_, kTreeSize));
+
+    SyncTask task(&pool_);
+    FetchLogEntries(test_db_.db(), move(peer_group), &log_verifier_,
+                    &verify_pool_, task.task(), nullptr /* priority */,
+                    checkpoint_file);
+    task.Wait();
+    return task.status();
+  }
+
+  ThreadPool pool_;
+  ThreadPool verify_pool_;
+  MockUrlFetcher fetcher_;
+  TestDB<FileDB> test_db_;
+  TmpStorage tmp_;
+  LogVerifier log_verifier_;
+
+  mutex lock_;
+  condition_variable requested_;
+  vector<int64_t> requested_starts_;
+  int64_t held_start_ = -1;
+  function<void()> held_;
+};
+
+
+TEST_F(FetcherTest, FetchesAllEntries) {
+  EXPECT_OK(Fetch(kTreeSize));
+  EXPECT_EQ(kTreeSize, test_db_.db()->TreeSize());
+
+  LoggedEntry entry;
+  EXPECT_EQ(Database::LOOKUP_OK, test_db_.db()->LookupByIndex(137, &entry));
+  EXPECT_EQ(137U, entry.sequence_number());
+}
+
+
+TEST_F(FetcherTest, StopsAtBadSct) {
+  EXPECT_EQ(util::error::FAILED_PRECONDITION, Fetch(50).CanonicalCode());
+  // The entries before the bad one were still written, in order.
+  EXPECT_EQ(50, test_db_.db()->TreeSize());
+}
+
+
+TEST_F(FetcherTest, WritesEntriesInOrder) {
+  // The first entries are the last to arrive.
+  HoldRequest(0);
+  util::Status status;
+  thread fetch([this, &status]() { status = Fetch(kTreeSize); });
+
+  const function<void()> held(HeldRequest(3));
+  std::this_thread::sleep_for(std::chrono::milliseconds(100));
+  // The entries fetched since are held back rather than written...
+  LoggedEntry entry;
+  EXPECT_EQ(Database::NOT_FOUND, test_db_.db()->LookupByIndex(150, &entry));
+  held();
+  fetch.join();
+
+  // ...until they can be written with the first ones.
+  EXPECT_OK(status);
+  EXPECT_EQ(kTreeSize, test_db_.db()->TreeSize());
+  EXPECT_EQ(Database::LOOKUP_OK, test_db_.db()->LookupByIndex(150, &entry));
+}
+
+
+TEST_F(FetcherTest, ResumesFromCheckpoint) {
+  // The entries from 100 onward were fetched before a restart.
+  const int64_t kResumeFrom = 100;
+  for (int64_t i = kResumeFrom; i < kTreeSize; ++i) {
+    LoggedEntry entry;
+    TestSigner::SetDefaults(&entry);
+    entry.set_sequence_number(i);
+    ASSERT_TRUE(entry.StoreServingData());
+    ASSERT_EQ(Database::OK, test_db_.db()->CreateSequencedEntry(entry));
+  }
+  ct::FetchCheckpoint checkpoint;
+  ct::FetchCheckpoint::Range* const have(checkpoint.add_have());
+  have->set_start(kResumeFrom);
+  have->set_size(kTreeSize - kResumeFrom);
+  const string checkpoint_file(tmp_.TmpStorageDir() + "/fetch_checkpoint");
+  {
+    std::ofstream out(checkpoint_file.c_str(), std::ios::binary);
+    ASSERT_TRUE(checkpoint.SerializeToOstream(&out));
+  }
+
+  EXPECT_OK(Fetch(kTreeSize, checkpoint_file));
+  EXPECT_EQ(kTreeSize, test_db_.db()->TreeSize());
+  ASSERT_FALSE(requested_starts_.empty());
+  for (const int64_t start : requested_starts_) {
+    EXPECT_LT(start, kResumeFrom);
+  }
+
+  // Everything is contiguous now, so nothing is left to resume.
+  string contents;
+  ASSERT_TRUE(util::ReadBinaryFile(checkpoint_file, &contents));
+  ASSERT_TRUE(checkpoint.ParseFromString(contents));
+  EXPECT_EQ(0, checkpoint.have_size());
+}
+
+
+}  // namespace cert_trans
+
+
+int main(int argc, char** argv) {
+  cert_trans::test::InitTesting(argv[0], &argc, &argv, true);
+  ConfigureSerializerForV1CT();
+  return RUN_ALL_TESTS();
+}
@@ -2,6 +2,7 @@
 
 #include <glog/logging.h>
 
+using std::string;
 using std::unique_ptr;
 
 namespace cert_trans {
@@ -12,4 +13,9 @@ Peer::Peer(unique_ptr<AsyncLogClient> client) : client_(move(client)) {
 }
 
 
+string Peer::Region() const {
+  return string();
+}
+
+
 }  // namespace cert_trans
@@ -2,6 +2,7 @@
 #define CERT_TRANS_FETCHER_PEER_H_
 
 #include <memory>
+#include <string>
 
 #include "client/async_log_client.h"
 
@@ -22,6 +23,10 @@ class Peer {
   // Returns -1 if we do not know yet.
   virtual int64_t TreeSize() const = 0;
 
+  // Returns the region (or zone) the peer is in, or an empty string if
+  // unknown.
+  virtual std::string Region() const;
+
  protected:
   const std::unique_ptr<AsyncLogClient> client_;
 };
@@ -1,23 +1,74 @@
 #include "fetcher/peer_group.h"
 
+#include <gflags/gflags.h>
 #include <glog/logging.h>
-
+#include <algorithm>
+#include <chrono>
+#include <map>
+#include <mutex>
+
+#include "monitoring/monitoring.h"
+
+using std::bind;
+using std::chrono::duration;
+using std::chrono::milliseconds;
+using std::chrono::steady_clock;
+using std::enable_shared_from_this;
 using std::lock_guard;
+using std::make_shared;
+using std::map;
 using std::max;
+using std::min;
 using std::mutex;
 using std::placeholders::_1;
 using std::shared_ptr;
+using std::string;
+using std::unique_lock;
 using std::vector;
 using util::Status;
 using util::Task;
 
+DEFINE_int32(fetcher_max_concurrent_fetches_per_peer, 16,
+             "maximum number of concurrent fetch requests to a single "
+             "peer, when adapting to its latency");
+DEFINE_int32(fetcher_target_latency_ms, 2000,
+             "fetch requests completing within this many milliseconds "
+             "allow more concurrent requests to that peer, slower ones "
+             "reduce them (0 to always use a single request per peer)");
+DEFINE_bool(fetcher_hedge_requests, true,
+            "send fetch requests which take longer than the 95th "
+            "percentile of recent requests to a second peer as well");
+
 namespace cert_trans {
 
 namespace {
 
 
-void GetEntriesDone(AsyncLogClient::Status client_status,
-                    const vector<AsyncLogClient::Entry>* entries, Task* task) {
+Counter<>* num_hedged_fetches =
+    Counter<>::New("num_hedged_fetches",
+                   "Number of fetch requests also sent to a second peer "
+                   "because the first was slow to answer.");
+
+
+// Weight of the latest request in the moving averages kept for each
+// peer.
+const double kAverageWeight = 0.2;
+
+// The number of recent latencies kept to estimate the 95th
+// percentile, and the number needed before requests are hedged.
+const size_t kNumRecentLatencies = 128;
+const size_t kMinLatenciesToHedge = 20;
+
+// The 95th percentile is only recomputed every so many requests.
+const size_t kHedgeDelayUpdateInterval = 16;
+
+// Don't let a peer's error rate make it look more than this many
+// times slower.
+const double kMaxErrorPenalty = 10;
+
+
+Status GetEntriesStatus(AsyncLogClient::Status client_status,
+                        const vector<AsyncLogClient::Entry>* entries) {
   Status status;
 
   switch (client_status) {
@@ -36,25 +87,149 @@ void GetEntriesDone(AsyncLogClient::Status client_status,
         Status(util::error::INTERNAL, "log server did not return any entries");
   }
 
-  task->Return(status);
+  return status;
+}
+
+
+void UpdateAverage(double sample, double* average) {
+  *average =
+      *average < 0 ? sample : *average + kAverageWeight * (sample - *average);
 }
 
 
 }  // namespace
 
 
-PeerGroup::PeerGroup(bool fetch_scts) : fetch_scts_(fetch_scts) {
+class PeerGroup::Impl : public enable_shared_from_this<PeerGroup::Impl> {
+ public:
+  Impl(bool fetch_scts, const string& local_region);
+
+  void Add(const shared_ptr<Peer>& peer);
+  void Remove(const shared_ptr<Peer>& peer);
+  int64_t TreeSize() const;
+  int FetchCapacity() const;
+  void FetchEntries(int64_t start_index, int64_t end_index,
+                    vector<AsyncLogClient::Entry>* entries, Task* task,
+                    bool urgent);
+
+ private:
+  struct PeerState {
+    PeerState();
+
+    // TODO(pphaneuf): Keep a count of errors here, to prune away
+    // unhealthy peers.
+
+    // Number of requests currently outstanding to this peer.
+    int in_flight;
+    // How many concurrent requests this peer should get (additive
+    // increase, multiplicative decrease, as requests complete).
+    double limit;
+    // Don't halve |limit| again for requests which were already in
+    // flight when it was last decreased.
+    steady_clock::time_point next_decrease;
+    // The largest batch this peer returned when asked for more, or -1
+    // if it has never truncated a request.
+    int64_t max_batch_size;
+    // Moving averages of the latency and throughput of successful
+    // requests, or -1 if there has been none yet.
+    double latency_ms;
+    double ms_per_entry;
+    // Moving average of the fraction of requests failing.
+    double error_rate;
+  };
+
+  // A call to FetchEntries, which can be sent to two peers.
+  struct Request {
+    Request(int64_t start_index, int64_t end_index,
+            vector<AsyncLogClient::Entry>* entries, Task* task)
+        : start_index(start_index),
+          end_index(end_index),
+          entries(entries),
+          task(task),
+          in_flight(0),
+          done(false),
+          hedged(false) {
+    }
+
+    const int64_t start_index;
+    const int64_t end_index;
+    vector<AsyncLogClient::Entry>* const entries;
+    Task* const task;
+
+    mutex lock;
+    shared_ptr<Peer> first_peer;
+    int in_flight;
+    // Whether |task| has been returned.
+    bool done;
+    bool hedged;
+  };
+
+  // If a peer is returned, the request is accounted as in flight to
+  // it, and |max_batch_size| is set to its largest known batch size.
+  shared_ptr<Peer> PickPeer(int64_t needed_size, int64_t requested,
+                            bool urgent, const Peer* exclude,
+                            int64_t* max_batch_size);
+  void Send(const shared_ptr<Request>& request, const shared_ptr<Peer>& peer,
+            int64_t max_batch_size);
+  void SendDone(const shared_ptr<Request>& request,
+                const shared_ptr<Peer>& peer, int64_t requested,
+                const steady_clock::time_point& started,
+                const shared_ptr<vector<AsyncLogClient::Entry>>& entries,
+                AsyncLogClient::Status client_status);
+  void UpdatePeerState(const Status& status, int64_t requested,
+                       int64_t received,
+                       const steady_clock::duration& latency,
+                       PeerState* state);
+  void HedgeDelayDone(const shared_ptr<Request>& request, Task* timer);
+
+  const bool fetch_scts_;
+  const string local_region_;
+
+  mutable mutex lock_;
+  map<shared_ptr<Peer>, PeerState> peers_;
+  // The latencies of the latest successful requests, oldest first
+  // from |next_latency_| once it is full.
+  vector<double> recent_latencies_ms_;
+  size_t next_latency_;
+  // How long to wait before hedging a request, or zero for not yet.
+  duration<double> hedge_delay_;
+};
+
+
+PeerGroup::Impl::PeerState::PeerState()
+    : in_flight(0),
+      limit(1),
+      next_decrease(steady_clock::now()),
+      max_batch_size(-1),
+      latency_ms(-1),
+      ms_per_entry(-1),
+      error_rate(0) {
 }
 
 
-void PeerGroup::Add(const shared_ptr<Peer>& peer) {
+PeerGroup::Impl::Impl(bool fetch_scts, const string& local_region)
+    : fetch_scts_(fetch_scts),
+      local_region_(local_region),
+      next_latency_(0),
+      hedge_delay_(0) {
+}
+
+
+void PeerGroup::Impl::Add(const shared_ptr<Peer>& peer) {
   lock_guard<mutex> lock(lock_);
 
   CHECK(peers_.emplace(peer, PeerState()).second);
 }
 
 
-int64_t PeerGroup::TreeSize() const {
+void PeerGroup::Impl::Remove(const shared_ptr<Peer>& peer) {
+  lock_guard<mutex> lock(lock_);
+
+  peers_.erase(peer);
+}
+
+
+int64_t PeerGroup::Impl::TreeSize() const {
   lock_guard<mutex> lock(lock_);
 
   int64_t tree_size(-1);
@@ -66,55 +241,329 @@ int64_t PeerGroup::TreeSize() const {
 }
 
 
-void PeerGroup::FetchEntries(int64_t start_index, int64_t end_index,
-                             vector<AsyncLogClient::Entry>* entries,
-                             Task* task) {
+int PeerGroup::Impl::FetchCapacity() const {
+  lock_guard<mutex> lock(lock_);
+
+  int capacity(0);
+  for (const auto& peer : peers_) {
+    capacity += static_cast<int>(peer.second.limit);
+  }
+
+  return capacity;
+}
+
+
+void PeerGroup::Impl::FetchEntries(int64_t start_index, int64_t end_index,
+                                   vector<AsyncLogClient::Entry>* entries,
+                                   Task* task, bool urgent) {
   CHECK_GE(start_index, 0);
   CHECK_GE(end_index, start_index);
+  CHECK_NOTNULL(entries);
 
-  const shared_ptr<Peer> peer(PickPeer(end_index + 1));
+  int64_t max_batch_size;
+  const shared_ptr<Peer> peer(PickPeer(end_index + 1,
+                                       end_index - start_index + 1, urgent,
+                                       nullptr, &max_batch_size));
   if (!peer) {
     task->Return(Status(util::error::UNAVAILABLE,
                         "requested entries not available in the peer group"));
     return;
   }
 
-  // TODO(pphaneuf): Handle the case where we have no peer more cleanly.
-  if (fetch_scts_) {
-    peer->client().GetEntriesAndSCTs(start_index, end_index,
-                                     CHECK_NOTNULL(entries),
-                                     bind(GetEntriesDone, _1, entries, task));
-  } else {
-    peer->client().GetEntries(start_index, end_index, CHECK_NOTNULL(entries),
-                              bind(GetEntriesDone, _1, entries, task));
+  const shared_ptr<Request> request(
+      make_shared<Request>(start_index, end_index, entries, task));
+  request->first_peer = peer;
+  request->in_flight = 1;
+
+  duration<double> hedge_delay(0);
+  if (FLAGS_fetcher_hedge_requests) {
+    lock_guard<mutex> lock(lock_);
+    hedge_delay = hedge_delay_;
+  }
+  if (hedge_delay > duration<double>::zero()) {
+    task->executor()->Delay(
+        hedge_delay, new Task(bind(&Impl::HedgeDelayDone, shared_from_this(),
+                                   request, _1),
+                              task->executor()));
   }
+
+  Send(request, peer, max_batch_size);
 }
 
 
-shared_ptr<Peer> PeerGroup::PickPeer(const int64_t needed_size) const {
+shared_ptr<Peer> PeerGroup::Impl::PickPeer(int64_t needed_size,
+                                           int64_t requested, bool urgent,
+                                           const Peer* exclude,
+                                           int64_t* max_batch_size) {
+  CHECK_NOTNULL(max_batch_size);
   lock_guard<mutex> lock(lock_);
 
-  // TODO(pphaneuf): We should pick peers a bit more cleverly, to
-  // spread the load somewhat.
   int64_t group_tree_size(-1);
-  vector<shared_ptr<Peer>> capable_peers;
-  for (const auto& peer : peers_) {
-    const int64_t tree_size(peer.first->TreeSize());
+  vector<map<shared_ptr<Peer>, PeerState>::iterator> capable_peers;
+  vector<map<shared_ptr<Peer>, PeerState>::iterator> local_peers;
+  double total_ms_per_entry(0);
+  int num_known(0);
+  for (auto it = peers_.begin(); it != peers_.end(); ++it) {
+    if (it->second.ms_per_entry >= 0) {
+      total_ms_per_entry += it->second.ms_per_entry;
+      ++num_known;
+    }
+    const int64_t tree_size(it->first->TreeSize());
     group_tree_size = max(group_tree_size, tree_size);
-    if (tree_size >= needed_size) {
-      capable_peers.push_back(peer.first);
+    if (tree_size >= needed_size && it->first.get() != exclude) {
+      capable_peers.push_back(it);
+      // Peers which don't say where they are are taken to be local.
+      const string region(it->first->Region());
+      if (local_region_.empty() || region.empty() ||
+          region == local_region_) {
+        local_peers.push_back(it);
+      }
     }
   }
 
-  if (!capable_peers.empty()) {
-    return capable_peers[std::rand() % capable_peers.size()];
+  if (capable_peers.empty()) {
+    LOG_IF(INFO, !exclude) << "requested a peer with " << needed_size
+                           << " entries but the peer group only has "
+                           << group_tree_size << " entries";
+
+    return nullptr;
+  }
+  if (!local_peers.empty()) {
+    capable_peers.swap(local_peers);
+  }
+
+  // Peers not heard from yet are thought to be quicker than average,
+  // so that they get a chance to show how fast they are.
+  const double unknown_ms_per_entry(
+      num_known > 0 ? total_ms_per_entry / num_known / 2 : 1);
+  // The time until the peer would answer, given the requests it
+  // already has, and how often it fails.
+  const auto cost([requested, unknown_ms_per_entry](const PeerState& state) {
+    const double ms_per_entry(state.ms_per_entry >= 0 ? state.ms_per_entry
+                                                      : unknown_ms_per_entry);
+    return (state.in_flight + 1) / state.limit * ms_per_entry * requested /
+           max(1 / kMaxErrorPenalty, 1 - state.error_rate);
+  });
+  // Ties go to the least loaded peer, relative to what it can handle.
+  const auto better([&cost](const PeerState& a, const PeerState& b) {
+    const double cost_a(cost(a));
+    const double cost_b(cost(b));
+    return cost_a != cost_b ? cost_a < cost_b
+                            : a.in_flight / a.limit < b.in_flight / b.limit;
+  });
+
+  // Start at a random point, to spread the load between peers that
+  // are equally good.
+  const size_t offset(std::rand() % capable_peers.size());
+  auto best(capable_peers[offset]);
+  if (urgent || capable_peers.size() <= 2) {
+    for (size_t i = 1; i < capable_peers.size(); ++i) {
+      const auto it(capable_peers[(offset + i) % capable_peers.size()]);
+      if (better(it->second, best->second)) {
+        best = it;
+      }
+    }
+  } else {
+    const auto other(capable_peers[(offset + 1 + std::rand() %
+                                                     (capable_peers.size() -
+                                                      1)) %
+                                   capable_peers.size()]);
+    if (better(other->second, best->second)) {
+      best = other;
+    }
+  }
+
+  ++best->second.in_flight;
+  *max_batch_size = best->second.max_batch_size;
+
+  return best->first;
+}
+
+
+void PeerGroup::Impl::Send(const shared_ptr<Request>& request,
+                           const shared_ptr<Peer>& peer,
+                           int64_t max_batch_size) {
+  // Don't ask for more than the peer is known to return, so that the
+  // request isn't wasting time on entries we would discard anyway.
+  int64_t end_index(request->end_index);
+  if (max_batch_size > 0) {
+    end_index = min(end_index, request->start_index + max_batch_size - 1);
   }
 
-  LOG(INFO) << "requested a peer with " << needed_size
-            << " entries but the peer group only has " << group_tree_size
-            << " entries";
+  // Each peer gets its own results, only the first answer is handed
+  // over to the caller.
+  const shared_ptr<vector<AsyncLogClient::Entry>> entries(
+      make_shared<vector<AsyncLogClient::Entry>>());
+  const AsyncLogClient::Callback done(
+      bind(&Impl::SendDone, shared_from_this(), request, peer,
+           end_index - request->start_index + 1, steady_clock::now(),
+           entries, _1));
 
-  return nullptr;
+  if (fetch_scts_) {
+    peer->client().GetEntriesAndSCTs(request->start_index, end_index,
+                                     entries.get(), done);
+  } else {
+    peer->client().GetEntries(request->start_index, end_index,
+                              entries.get(), done);
+  }
+}
+
+
+void PeerGroup::Impl::SendDone(
+    const shared_ptr<Request>& request, const shared_ptr<Peer>& peer,
+    int64_t requested, const steady_clock::time_point& started,
+    const shared_ptr<vector<AsyncLogClient::Entry>>& entries,
+    AsyncLogClient::Status client_status) {
+  const steady_clock::duration latency(steady_clock::now() - started);
+  const Status status(GetEntriesStatus(client_status, entries.get()));
+
+  {
+    lock_guard<mutex> lock(lock_);
+    // The peer may have been removed meanwhile.
+    const auto it(peers_.find(peer));
+    if (it != peers_.end()) {
+      UpdatePeerState(status, requested, entries->size(), latency,
+                      &it->second);
+    }
+
+    if (status.ok()) {
+      const double latency_ms(duration<double, std::milli>(latency).count());
+      if (recent_latencies_ms_.size() < kNumRecentLatencies) {
+        recent_latencies_ms_.push_back(latency_ms);
+      } else {
+        recent_latencies_ms_[next_latency_] = latency_ms;
+      }
+      next_latency_ = (next_latency_ + 1) % kNumRecentLatencies;
+      if (recent_latencies_ms_.size() >= kMinLatenciesToHedge &&
+          next_latency_ % kHedgeDelayUpdateInterval == 0) {
+        vector<double> latencies(recent_latencies_ms_);
+        const auto p95(latencies.begin() + latencies.size() * 95 / 100);
+        std::nth_element(latencies.begin(), p95, latencies.end());
+        hedge_delay_ = duration<double, std::milli>(*p95);
+      }
+    }
+  }
+
+  {
+    unique_lock<mutex> lock(request->lock);
+    CHECK_GT(request->in_flight, 0);
+    --request->in_flight;
+    // Wait for the other peer if this one failed, unless it is the
+    // last one.
+    if (request->done || (!status.ok() && request->in_flight > 0)) {
+      return;
+    }
+    request->done = true;
+    if (status.ok()) {
+      request->entries->swap(*entries);
+    }
+  }
+
+  // Do not touch anything after this, as returning the task might
+  // cause our owner to go away.
+  request->task->Return(status);
+}
+
+
+void PeerGroup::Impl::UpdatePeerState(const Status& status,
+                                      int64_t requested, int64_t received,
+                                      const steady_clock::duration& latency,
+                                      PeerState* state) {
+  CHECK_GT(state->in_flight, 0);
+  --state->in_flight;
+
+  // We only ask a peer for entries it has, so getting fewer than
+  // requested means that it caps the size of its responses.
+  if (status.ok() && received < requested &&
+      (state->max_batch_size < 0 || received < state->max_batch_size)) {
+    LOG(INFO) << "peer returned " << received << " entries when asked for "
+              << requested << ", reducing its batch size";
+    state->max_batch_size = received;
+  }
+
+  state->error_rate +=
+      kAverageWeight * ((status.ok() ? 0 : 1) - state->error_rate);
+  if (status.ok()) {
+    const double latency_ms(duration<double, std::milli>(latency).count());
+    UpdateAverage(latency_ms, &state->latency_ms);
+    UpdateAverage(latency_ms / received, &state->ms_per_entry);
+  }
+
+  if (FLAGS_fetcher_target_latency_ms > 0) {
+    const double max_limit(
+        max(1, FLAGS_fetcher_max_concurrent_fetches_per_peer));
+    if (status.ok() &&
+        latency <= milliseconds(FLAGS_fetcher_target_latency_ms)) {
+      // Grows by about one request per round trip.
+      state->limit = min(max_limit, state->limit + 1 / state->limit);
+    } else {
+      const steady_clock::time_point now(steady_clock::now());
+      if (now >= state->next_decrease) {
+        state->limit = max(1.0, state->limit / 2);
+        state->next_decrease = now + latency;
+      }
+    }
+  }
+}
+
+
+void PeerGroup::Impl::HedgeDelayDone(const shared_ptr<Request>& request,
+                                     Task* timer) {
+  const bool cancelled(!timer->status().ok());
+  delete timer;
+  if (cancelled) {
+    return;
+  }
+
+  int64_t max_batch_size;
+  shared_ptr<Peer> peer;
+  {
+    lock_guard<mutex> lock(request->lock);
+    if (request->done || request->hedged) {
+      return;
+    }
+    peer = PickPeer(request->end_index + 1,
+                    request->end_index - request->start_index + 1,
+                    true /* urgent */, request->first_peer.get(),
+                    &max_batch_size);
+    if (!peer) {
+      return;
+    }
+    request->hedged = true;
+    ++request->in_flight;
+  }
+
+  VLOG(1) << "hedging the fetch of entries " << request->start_index
+          << " to " << request->end_index;
+  num_hedged_fetches->Increment();
+  Send(request, peer, max_batch_size);
+}
+
+
+PeerGroup::PeerGroup(bool fetch_scts, const string& local_region)
+    : impl_(make_shared<Impl>(fetch_scts, local_region)) {
+}
+
+
+void PeerGroup::Add(const shared_ptr<Peer>& peer) {
+  impl_->Add(peer);
+}
+
+
+int64_t PeerGroup::TreeSize() const {
+  return impl_->TreeSize();
+}
+
+
+int PeerGroup::FetchCapacity() const {
+  return impl_->FetchCapacity();
+}
+
+
+void PeerGroup::FetchEntries(int64_t start_index, int64_t end_index,
+                             vector<AsyncLogClient::Entry>* entries,
+                             Task* task, bool urgent) {
+  impl_->FetchEntries(start_index, end_index, entries, task, urgent);
 }
 
 
@@ -3,8 +3,7 @@
 
 #include <stdint.h>
 #include <memory>
-#include <mutex>
-#include <set>
+#include <string>
 #include <vector>
 
 #include "client/async_log_client.h"
@@ -19,33 +18,54 @@ namespace cert_trans {
 // errors will be retried, and unhealthy peers will be dropped (so the
 // available tree size can get smaller).
 // TODO(pphaneuf): Make that last sentence true!
+//
+// The group keeps moving averages of the throughput and error rate of
+// each peer, and picks between two random capable peers the one which
+// should answer soonest, given those and its load (power of two
+// choices). Urgent fetches go to the best of all the capable peers.
+// Peers in other regions are only used when no peer in the local
+// region has the entries. The number of concurrent requests a peer
+// gets adapts to how quickly it answers, and requests are capped to
+// the largest batch a peer has been seen to return.
+//
+// A request still not answered after the 95th percentile of the
+// recent latencies is sent to a second peer as well, and the first
+// answer wins.
 class PeerGroup {
  public:
-  explicit PeerGroup(bool fetch_scts_);
+  // Peers reporting a different region than |local_region| (if not
+  // empty) are avoided.
+  explicit PeerGroup(bool fetch_scts,
+                     const std::string& local_region = std::string());
   PeerGroup(const PeerGroup&) = delete;
   PeerGroup& operator=(const PeerGroup&) = delete;
 
   // Adding a peer twice is not allowed.
   void Add(const std::shared_ptr<Peer>& peer);
 
+  // Requests already sent to |peer| are still answered, but it gets no
+  // new ones. Removing a peer not in the group does nothing.
+  void Remove(const std::shared_ptr<Peer>& peer);
+
   // Returns the highest tree size of the peer group.
   int64_t TreeSize() const;
 
+  // Returns the number of concurrent fetches the peers in the group
+  // are currently thought to handle well.
+  int FetchCapacity() const;
+
+  // Fewer entries than requested might be returned, if the peer
+  // picked serves smaller batches.
   void FetchEntries(int64_t start_offset, int64_t end_offset,
                     std::vector<AsyncLogClient::Entry>* entries,
-                    util::Task* task);
+                    util::Task* task, bool urgent = false);
 
  private:
-  struct PeerState {
-    // TODO(pphaneuf): Keep a count of errors here, to prune away
-    // unhealthy peers.
-  };
-
-  std::shared_ptr<Peer> PickPeer(const int64_t needed_size) const;
+  class Impl;
 
-  mutable std::mutex lock_;
-  const bool fetch_scts_;
-  std::map<std::shared_ptr<Peer>, PeerState> peers_;
+  // Requests in flight keep this alive, as a hedged request can still
+  // be waiting for its slower peer after the group is gone.
+  const std::shared_ptr<Impl> impl_;
 };
 
 
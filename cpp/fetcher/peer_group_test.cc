@@ -0,0 +1,366 @@
+#include <gflags/gflags.h>
+#include <glog/logging.h>
+#include <gmock/gmock.h>
+#include <gtest/gtest.h>
+#include <chrono>
+#include <cinttypes>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <utility>
+#include <vector>
+
+#include "client/async_log_client.h"
+#include "fetcher/peer_group.h"
+#include "log/logged_entry.h"
+#include "log/test_signer.h"
+#include "net/mock_url_fetcher.h"
+#include "proto/binary_entries.h"
+#include "proto/cert_serializer.h"
+#include "util/json_wrapper.h"
+#include "util/status_test_util.h"
+#include "util/sync_task.h"
+#include "util/testing.h"
+#include "util/thread_pool.h"
+
+DECLARE_int32(fetcher_max_concurrent_fetches_per_peer);
+DECLARE_int32(fetcher_target_latency_ms);
+DECLARE_bool(fetcher_hedge_requests);
+
+namespace cert_trans {
+
+using std::bind;
+using std::lock_guard;
+using std::make_shared;
+using std::mutex;
+using std::pair;
+using std::placeholders::_1;
+using std::placeholders::_2;
+using std::placeholders::_3;
+using std::shared_ptr;
+using std::string;
+using std::unique_ptr;
+using std::vector;
+using testing::_;
+using testing::Invoke;
+using util::SyncTask;
+using util::Task;
+
+const char kLogUrl[] = "https://example.com";
+
+
+class FakePeer : public Peer {
+ public:
+  FakePeer(util::Executor* executor, UrlFetcher* fetcher, int64_t tree_size,
+           const string& region = "")
+      : Peer(unique_ptr<AsyncLogClient>(
+            new AsyncLogClient(executor, fetcher, kLogUrl))),
+        tree_size_(tree_size),
+        region_(region) {
+  }
+
+  int64_t TreeSize() const override {
+    return tree_size_;
+  }
+
+  string Region() const override {
+    return region_;
+  }
+
+ private:
+  const int64_t tree_size_;
+  const string region_;
+};
+
+
+class PeerGroupTest : public ::testing::Test {
+ public:
+  PeerGroupTest()
+      : group_(false /* fetch_scts */, "here"),
+        hold_(true),
+        held_task_(nullptr),
+        held_peer_(-1) {
+    FLAGS_fetcher_max_concurrent_fetches_per_peer = 4;
+    FLAGS_fetcher_target_latency_ms = 10000;
+    FLAGS_fetcher_hedge_requests = true;
+  }
+
+  // Answers get-entries requests with at most |max_batch| entries.
+  void ServeEntries(int64_t max_batch, const UrlFetcher::Request& req,
+                    UrlFetcher::Response* resp, Task* task) {
+    int64_t start, end;
+    CHECK_EQ(2, sscanf(req.url.Query().c_str(),
+                       "start=%" SCNd64 "&end=%" SCNd64, &start, &end));
+    {
+      lock_guard<mutex> lock(lock_);
+      requests_.emplace_back(start, end);
+    }
+    end = std::min(end, start + max_batch - 1);
+
+    LoggedEntry entry;
+    TestSigner::SetDefaults(&entry);
+    string leaf_input;
+    string extra_data;
+    CHECK(entry.SerializeForLeaf(&leaf_input));
+    CHECK(entry.SerializeExtraData(&extra_data));
+
+    // AsyncLogClient asks for the binary get-entries first.
+    const bool binary(req.url.Path().find("get-entries-binary") !=
+                      string::npos);
+    string body;
+    JsonArray entries;
+    for (int64_t i = start; i <= end; ++i) {
+      if (binary) {
+        CHECK_EQ(serialization::SerializeResult::OK,
+                 WriteBinaryEntry(leaf_input, extra_data, string(), &body));
+        continue;
+      }
+      JsonObject json_entry;
+      json_entry.AddBase64("leaf_input", leaf_input);
+      json_entry.AddBase64("extra_data", extra_data);
+      entries.Add(&json_entry);
+    }
+    if (!binary) {
+      JsonObject json_reply;
+      json_reply.Add("entries", entries);
+      body = json_reply.ToString();
+    }
+
+    resp->status_code = 200;
+    resp->body = body;
+    task->Return();
+  }
+
+  // Holds on to the first get-entries request (once |hold_| is set),
+  // to be answered later, and serves the rest, noting which peer they
+  // went to.
+  void HoldFirstRequest(int peer, const UrlFetcher::Request& req,
+                        UrlFetcher::Response* resp, Task* task) {
+    {
+      lock_guard<mutex> lock(lock_);
+      if (hold_ && !held_task_) {
+        held_task_ = task;
+        held_peer_ = peer;
+        return;
+      }
+      served_peers_.push_back(peer);
+    }
+    ServeEntries(1000, req, resp, task);
+  }
+
+  // Serves get-entries requests after |delay_ms| milliseconds, noting
+  // which peer they went to.
+  void ServeSlowly(int peer, int delay_ms, const UrlFetcher::Request& req,
+                   UrlFetcher::Response* resp, Task* task) {
+    std::this_thread::sleep_for(std::chrono::milliseconds(delay_ms));
+    {
+      lock_guard<mutex> lock(lock_);
+      served_peers_.push_back(peer);
+    }
+    ServeEntries(1000, req, resp, task);
+  }
+
+  util::Status Fetch(int64_t start, int64_t end,
+                     vector<AsyncLogClient::Entry>* entries,
+                     bool urgent = false) {
+    SyncTask task(&pool_);
+    group_.FetchEntries(start, end, entries, task.task(), urgent);
+    task.Wait();
+    return task.status();
+  }
+
+  ThreadPool pool_;
+  MockUrlFetcher fetcher_;
+  MockUrlFetcher other_fetcher_;
+  PeerGroup group_;
+
+  mutex lock_;
+  vector<pair<int64_t, int64_t>> requests_;
+  bool hold_;
+  Task* held_task_;
+  int held_peer_;
+  vector<int> served_peers_;
+};
+
+
+TEST_F(PeerGroupTest, DiscoversMaxBatchSize) {
+  group_.Add(make_shared<FakePeer>(&pool_, &fetcher_, 1000));
+  EXPECT_CALL(fetcher_, Fetch(_, _, _))
+      .WillRepeatedly(Invoke(bind(&PeerGroupTest::ServeEntries, this, 10, _1,
+                                  _2, _3)));
+
+  vector<AsyncLogClient::Entry> entries;
+  EXPECT_OK(Fetch(0, 99, &entries));
+  EXPECT_EQ(10U, entries.size());
+
+  // Once the peer is known to truncate, don't ask for more.
+  entries.clear();
+  EXPECT_OK(Fetch(10, 99, &entries));
+  EXPECT_EQ(10U, entries.size());
+
+  lock_guard<mutex> lock(lock_);
+  ASSERT_EQ(2U, requests_.size());
+  EXPECT_EQ(99, requests_[0].second);
+  EXPECT_EQ(10, requests_[1].first);
+  EXPECT_EQ(19, requests_[1].second);
+}
+
+
+TEST_F(PeerGroupTest, CapacityGrowsWhenFast) {
+  group_.Add(make_shared<FakePeer>(&pool_, &fetcher_, 1000));
+  EXPECT_CALL(fetcher_, Fetch(_, _, _))
+      .WillRepeatedly(Invoke(bind(&PeerGroupTest::ServeEntries, this, 1000,
+                                  _1, _2, _3)));
+
+  EXPECT_EQ(1, group_.FetchCapacity());
+  for (int i = 0; i < 20; ++i) {
+    vector<AsyncLogClient::Entry> entries;
+    EXPECT_OK(Fetch(0, 9, &entries));
+  }
+  EXPECT_EQ(FLAGS_fetcher_max_concurrent_fetches_per_peer,
+            group_.FetchCapacity());
+}
+
+
+TEST_F(PeerGroupTest, CapacityFixedWithoutTargetLatency) {
+  FLAGS_fetcher_target_latency_ms = 0;
+  group_.Add(make_shared<FakePeer>(&pool_, &fetcher_, 1000));
+  EXPECT_CALL(fetcher_, Fetch(_, _, _))
+      .WillRepeatedly(Invoke(bind(&PeerGroupTest::ServeEntries, this, 1000,
+                                  _1, _2, _3)));
+
+  for (int i = 0; i < 20; ++i) {
+    vector<AsyncLogClient::Entry> entries;
+    EXPECT_OK(Fetch(0, 9, &entries));
+  }
+  EXPECT_EQ(1, group_.FetchCapacity());
+}
+
+
+TEST_F(PeerGroupTest, PrefersPeerWithSpareCapacity) {
+  group_.Add(make_shared<FakePeer>(&pool_, &fetcher_, 1000));
+  group_.Add(make_shared<FakePeer>(&pool_, &other_fetcher_, 1000));
+  EXPECT_CALL(fetcher_, Fetch(_, _, _))
+      .WillRepeatedly(Invoke(
+          bind(&PeerGroupTest::HoldFirstRequest, this, 0, _1, _2, _3)));
+  EXPECT_CALL(other_fetcher_, Fetch(_, _, _))
+      .WillRepeatedly(Invoke(
+          bind(&PeerGroupTest::HoldFirstRequest, this, 1, _1, _2, _3)));
+
+  vector<AsyncLogClient::Entry> held_entries;
+  SyncTask held_task(&pool_);
+  group_.FetchEntries(0, 9, &held_entries, held_task.task());
+
+  // The peer still busy with the first request is never picked.
+  for (int i = 0; i < 5; ++i) {
+    vector<AsyncLogClient::Entry> entries;
+    EXPECT_OK(Fetch(0, 9, &entries));
+  }
+
+  {
+    lock_guard<mutex> lock(lock_);
+    ASSERT_NE(nullptr, held_task_);
+    EXPECT_EQ(5U, served_peers_.size());
+    for (const int peer : served_peers_) {
+      EXPECT_NE(held_peer_, peer);
+    }
+    held_task_->Return(util::Status::CANCELLED);
+  }
+  held_task.Wait();
+}
+
+
+TEST_F(PeerGroupTest, UrgentFetchesPreferQuickPeer) {
+  group_.Add(make_shared<FakePeer>(&pool_, &fetcher_, 1000));
+  group_.Add(make_shared<FakePeer>(&pool_, &other_fetcher_, 1000));
+  EXPECT_CALL(fetcher_, Fetch(_, _, _))
+      .WillRepeatedly(Invoke(
+          bind(&PeerGroupTest::ServeSlowly, this, 0, 100, _1, _2, _3)));
+  EXPECT_CALL(other_fetcher_, Fetch(_, _, _))
+      .WillRepeatedly(Invoke(
+          bind(&PeerGroupTest::ServeSlowly, this, 1, 0, _1, _2, _3)));
+
+  // Both peers get tried once, as their latency is not known yet,
+  // after which the quick one gets all the urgent fetches.
+  for (int i = 0; i < 7; ++i) {
+    vector<AsyncLogClient::Entry> entries;
+    EXPECT_OK(Fetch(0, 9, &entries, true /* urgent */));
+  }
+
+  lock_guard<mutex> lock(lock_);
+  ASSERT_EQ(7U, served_peers_.size());
+  EXPECT_NE(served_peers_[0], served_peers_[1]);
+  for (size_t i = 2; i < served_peers_.size(); ++i) {
+    EXPECT_EQ(1, served_peers_[i]);
+  }
+}
+
+
+TEST_F(PeerGroupTest, PrefersLocalPeers) {
+  group_.Add(make_shared<FakePeer>(&pool_, &fetcher_, 1000, "here"));
+  group_.Add(make_shared<FakePeer>(&pool_, &other_fetcher_, 2000, "there"));
+  EXPECT_CALL(fetcher_, Fetch(_, _, _))
+      .WillRepeatedly(Invoke(
+          bind(&PeerGroupTest::ServeSlowly, this, 0, 10, _1, _2, _3)));
+  EXPECT_CALL(other_fetcher_, Fetch(_, _, _))
+      .WillRepeatedly(Invoke(
+          bind(&PeerGroupTest::ServeSlowly, this, 1, 0, _1, _2, _3)));
+
+  // The remote peer is quicker, but only used for the entries the
+  // local one doesn't have.
+  for (int i = 0; i < 5; ++i) {
+    vector<AsyncLogClient::Entry> entries;
+    EXPECT_OK(Fetch(0, 9, &entries, true /* urgent */));
+  }
+  vector<AsyncLogClient::Entry> entries;
+  EXPECT_OK(Fetch(1000, 1009, &entries));
+
+  lock_guard<mutex> lock(lock_);
+  EXPECT_EQ(vector<int>({0, 0, 0, 0, 0, 1}), served_peers_);
+}
+
+
+TEST_F(PeerGroupTest, HedgesSlowRequests) {
+  group_.Add(make_shared<FakePeer>(&pool_, &fetcher_, 1000));
+  group_.Add(make_shared<FakePeer>(&pool_, &other_fetcher_, 1000));
+  EXPECT_CALL(fetcher_, Fetch(_, _, _))
+      .WillRepeatedly(Invoke(
+          bind(&PeerGroupTest::HoldFirstRequest, this, 0, _1, _2, _3)));
+  EXPECT_CALL(other_fetcher_, Fetch(_, _, _))
+      .WillRepeatedly(Invoke(
+          bind(&PeerGroupTest::HoldFirstRequest, this, 1, _1, _2, _3)));
+
+  // Learn how quickly requests are usually answered.
+  hold_ = false;
+  for (int i = 0; i < 32; ++i) {
+    vector<AsyncLogClient::Entry> entries;
+    EXPECT_OK(Fetch(0, 9, &entries));
+  }
+
+  {
+    lock_guard<mutex> lock(lock_);
+    served_peers_.clear();
+    hold_ = true;
+  }
+  // The first peer picked doesn't answer, the other one does.
+  vector<AsyncLogClient::Entry> entries;
+  EXPECT_OK(Fetch(0, 9, &entries));
+  EXPECT_EQ(10U, entries.size());
+
+  lock_guard<mutex> lock(lock_);
+  ASSERT_NE(nullptr, held_task_);
+  ASSERT_EQ(1U, served_peers_.size());
+  EXPECT_NE(held_peer_, served_peers_[0]);
+  held_task_->Return(util::Status::CANCELLED);
+}
+
+
+}  // namespace cert_trans
+
+
+int main(int argc, char** argv) {
+  cert_trans::test::InitTesting(argv[0], &argc, &argv, true);
+  ConfigureSerializerForV1CT();
+  return RUN_ALL_TESTS();
+}
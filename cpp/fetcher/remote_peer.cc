@@ -2,7 +2,9 @@
 
 #include <gflags/gflags.h>
 #include <glog/logging.h>
+#include <algorithm>
 #include <chrono>
+#include <random>
 
 #include "base/time_support.h"
 #include "monitoring/monitoring.h"
@@ -10,7 +12,9 @@
 
 using ct::SignedTreeHead;
 using std::bind;
+using std::chrono::duration;
 using std::chrono::seconds;
+using std::chrono::steady_clock;
 using std::lock_guard;
 using std::make_shared;
 using std::move;
@@ -25,8 +29,16 @@ using util::TaskHold;
 namespace cert_trans {
 
 DEFINE_int32(remote_peer_sth_refresh_interval_seconds, 10,
-             "Number of seconds between checks for updated STHs from the "
-             "remote peer.");
+             "Largest number of seconds between checks for updated STHs "
+             "from the remote peer. Peers whose STH changes more often "
+             "are checked more often.");
+DEFINE_double(remote_peer_sth_min_refresh_interval_seconds, 1,
+              "Smallest number of seconds between checks for updated STHs "
+              "from the remote peer.");
+DEFINE_double(remote_peer_sth_refresh_jitter, 0.1,
+              "Fraction by which the interval between checks for updated "
+              "STHs from the remote peer is randomly made longer or "
+              "shorter, so that nodes do not all poll at once.");
 
 Counter<string>* invalid_sths_received =
     Counter<string>::New("remote_peer_invalid_sths_received", "reason",
@@ -41,7 +53,10 @@ struct RemotePeer::Impl {
       : verifier_(move(verifier)),
         client_(CHECK_NOTNULL(client)),
         on_new_sth_(on_new_sth),
-        task_(CHECK_NOTNULL(task)) {
+        task_(CHECK_NOTNULL(task)),
+        change_period_(0),
+        poll_interval_(FLAGS_remote_peer_sth_refresh_interval_seconds),
+        random_(std::random_device()()) {
     CHECK(verifier_);
   }
 
@@ -53,9 +68,21 @@ struct RemotePeer::Impl {
   mutex lock_;
   shared_ptr<SignedTreeHead> sth_;
 
+  // Only used by DoneGetSTH(), which is never running more than once
+  // at a time.
+  steady_clock::time_point last_change_;
+  // The average time between changes of the STH of the peer, or 0
+  // until it has changed twice.
+  duration<double> change_period_;
+  duration<double> poll_interval_;
+  std::mt19937 random_;
+
   void FetchSTH();
   void DoneGetSTH(const std::shared_ptr<ct::SignedTreeHead>& on_new_sth,
                   AsyncLogClient::Status status);
+  // Returns how long to wait before polling again, after a poll which
+  // |succeeded| (or not), and got a |new_sth| (or not).
+  duration<double> NextPollDelay(bool succeeded, bool new_sth);
 };
 
 
@@ -65,7 +92,23 @@ void RemotePeer::Impl::FetchSTH() {
     return;
   }
   shared_ptr<SignedTreeHead> next_sth(make_shared<SignedTreeHead>());
-  client_->GetSTH(next_sth.get(), bind(&Impl::DoneGetSTH, this, next_sth, _1));
+  const AsyncLogClient::Callback done(
+      bind(&Impl::DoneGetSTH, this, next_sth, _1));
+
+  // Peers which support it hold on to the request until they have a
+  // newer STH than ours, so we hear about it right away.
+  int64_t newer_than(-1);
+  if (client_->LongPollsSTH()) {
+    lock_guard<mutex> lock(lock_);
+    if (sth_) {
+      newer_than = sth_->timestamp();
+    }
+  }
+  if (newer_than >= 0) {
+    client_->GetSTHNewerThan(newer_than, next_sth.get(), done);
+  } else {
+    client_->GetSTH(next_sth.get(), done);
+  }
 }
 
 
@@ -77,6 +120,10 @@ void RemotePeer::Impl::DoneGetSTH(
     return;
   }
 
+  // Whether the peer answered as expected of a long poll, with a newer
+  // STH, or the same one if it had none by the time it gave up waiting.
+  bool poll_again_now(false);
+  bool got_new_sth(false);
   if (status == AsyncLogClient::OK) {
     bool sth_provisionally_valid(false);
 
@@ -121,6 +168,10 @@ void RemotePeer::Impl::DoneGetSTH(
         if (on_new_sth_) {
           on_new_sth_(*sth_);
         }
+        poll_again_now = true;
+        got_new_sth = true;
+      } else if (new_sth->timestamp() == sth_->timestamp()) {
+        poll_again_now = true;
       }
     }
   } else {
@@ -128,13 +179,53 @@ void RemotePeer::Impl::DoneGetSTH(
                  << " from AsyncLogClient";
   }
 
-  // Schedule another STH fetch
+  // Schedule another STH fetch, straight away if the peer waits for a
+  // newer STH before answering.
+  const bool long_poll(poll_again_now && client_->LongPollsSTH());
+  const duration<double> delay(
+      NextPollDelay(status == AsyncLogClient::OK, got_new_sth));
   task_->executor()->Delay(
-      seconds(FLAGS_remote_peer_sth_refresh_interval_seconds),
+      long_poll ? duration<double>(0) : delay,
       task_->AddChild(bind(&RemotePeer::Impl::FetchSTH, this)));
 }
 
 
+duration<double> RemotePeer::Impl::NextPollDelay(bool succeeded,
+                                                 bool new_sth) {
+  const duration<double> max_interval(
+      FLAGS_remote_peer_sth_refresh_interval_seconds);
+  const duration<double> min_interval(std::min(
+      FLAGS_remote_peer_sth_min_refresh_interval_seconds,
+      static_cast<double>(FLAGS_remote_peer_sth_refresh_interval_seconds)));
+
+  if (!succeeded) {
+    poll_interval_ = max_interval;
+  } else if (new_sth) {
+    // Polling at twice the rate the STH changes at catches most
+    // changes soon after they happen.
+    const steady_clock::time_point now(steady_clock::now());
+    if (last_change_ != steady_clock::time_point()) {
+      const duration<double> gap(now - last_change_);
+      change_period_ = change_period_.count() > 0
+                           ? (change_period_ + gap) / 2
+                           : gap;
+      poll_interval_ = change_period_ / 2;
+    }
+    last_change_ = now;
+  } else {
+    // Back off from peers whose STH has stopped changing.
+    poll_interval_ *= 2;
+  }
+  poll_interval_ =
+      std::max(min_interval, std::min(max_interval, poll_interval_));
+
+  std::uniform_real_distribution<double> jitter(
+      1 - FLAGS_remote_peer_sth_refresh_jitter,
+      1 + FLAGS_remote_peer_sth_refresh_jitter);
+  return poll_interval_ * jitter(random_);
+}
+
+
 RemotePeer::RemotePeer(
     unique_ptr<AsyncLogClient> client, unique_ptr<LogVerifier> verifier,
     const std::function<void(const ct::SignedTreeHead&)>& on_new_sth,
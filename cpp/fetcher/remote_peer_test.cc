@@ -282,6 +282,56 @@ TEST_F(RemotePeerTest, RejectsSTHWithInvalidSignature) {
 }
 
 
+TEST_F(RemotePeerTest, LongPollsPeersWhichSupportIt) {
+  // Should it wait for this, the test times out.
+  FLAGS_remote_peer_sth_refresh_interval_seconds = 3600;
+
+  tree_signer_.UpdateTree();
+  const SignedTreeHead sth(tree_signer_.LatestSTH());
+  tree_signer_.UpdateTree();
+  const SignedTreeHead new_sth(tree_signer_.LatestSTH());
+
+  const UrlFetcher::Headers long_poll{{"X-CT-STH-Long-Poll", "30"}};
+  URL newer_than_url(string(kLogUrl) + "/ct/v1/get-sth");
+  newer_than_url.SetQuery("newer_than=" + std::to_string(sth.timestamp()));
+  {
+    InSequence s;
+    EXPECT_CALL(fetcher_, Fetch(IsUrlFetchRequest(UrlFetcher::Verb::GET,
+                                                  URL(string(kLogUrl) +
+                                                      "/ct/v1/get-sth"),
+                                                  _, ""),
+                                _, _))
+        .WillOnce(Invoke(bind(&HandleFetch, ::util::OkStatus(), 200,
+                              long_poll, Jsonify(sth), _1, _2, _3)));
+    EXPECT_CALL(fetcher_, Fetch(IsUrlFetchRequest(UrlFetcher::Verb::GET,
+                                                  newer_than_url, _, ""),
+                                _, _))
+        .WillOnce(Invoke(bind(&HandleFetch, ::util::OkStatus(), 200,
+                              long_poll, Jsonify(new_sth), _1, _2, _3)));
+    // As if it timed out waiting for a newer one.
+    newer_than_url.SetQuery("newer_than=" +
+                            std::to_string(new_sth.timestamp()));
+    EXPECT_CALL(fetcher_, Fetch(IsUrlFetchRequest(UrlFetcher::Verb::GET,
+                                                  newer_than_url, _, ""),
+                                _, _))
+        .WillRepeatedly(Invoke(bind(&HandleFetch, ::util::OkStatus(), 200,
+                                    long_poll, Jsonify(new_sth), _1, _2,
+                                    _3)));
+  }
+
+  Notification notify;
+  {
+    InSequence t;
+    EXPECT_CALL(*this, OnNewSTH(EqualsSTH(sth))).Times(1);
+    EXPECT_CALL(*this, OnNewSTH(EqualsSTH(new_sth)))
+        .WillOnce(Invoke(bind(&Notification::Notify, &notify)));
+  }
+
+  CreatePeer();
+  EXPECT_TRUE(notify.WaitForNotificationWithTimeout(seconds(5)));
+}
+
+
 }  // namespace cert_trans
 
 
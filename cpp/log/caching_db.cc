@@ -0,0 +1,360 @@
+#include "log/caching_db.h"
+
+#include <glog/logging.h>
+#include <functional>
+#include <list>
+#include <mutex>
+#include <unordered_map>
+#include <utility>
+
+#include "monitoring/monitoring.h"
+#include "util/task.h"
+
+using std::bind;
+using std::list;
+using std::lock_guard;
+using std::make_shared;
+using std::move;
+using std::mutex;
+using std::placeholders::_1;
+using std::shared_ptr;
+using std::string;
+using std::unique_ptr;
+using std::unordered_map;
+using std::vector;
+
+namespace cert_trans {
+namespace {
+
+
+static Counter<string, string>* database_entry_cache_lookups(
+    Counter<string, string>::New(
+        "database_entry_cache_lookups", "key", "result",
+        "Number of lookups in the entry cache of the database, broken "
+        "down by what they were by and whether they hit."));
+
+
+// Shards of each cache, each with its own lock.
+const int kNumShards = 16;
+// Rough size of the bookkeeping for each entry cached, on top of the
+// entry itself.
+const size_t kEntryOverheadBytes = 128;
+
+
+size_t EntryBytes(const LoggedEntry& logged) {
+  return sizeof(LoggedEntry) + logged.ByteSize() + kEntryOverheadBytes;
+}
+
+
+}  // namespace
+
+
+// A least recently used cache of entries by |Key|, in shards.
+template <class Key>
+class CachingDatabase::Cache {
+ public:
+  explicit Cache(size_t max_bytes) : shard_max_bytes_(max_bytes / kNumShards) {
+  }
+  Cache(const Cache&) = delete;
+  Cache& operator=(const Cache&) = delete;
+
+  shared_ptr<const LoggedEntry> Find(const Key& key) {
+    Shard* const shard(ShardFor(key));
+    lock_guard<mutex> lock(shard->lock);
+    const auto it(shard->index.find(key));
+    if (it == shard->index.end()) {
+      return nullptr;
+    }
+    shard->entries.splice(shard->entries.begin(), shard->entries, it->second);
+    return it->second->second;
+  }
+
+  // Keeps the entry already cached for |key| instead if it has a lower
+  // sequence number, which is the one the backend looks up.
+  void Insert(const Key& key, const shared_ptr<const LoggedEntry>& logged) {
+    const size_t bytes(EntryBytes(*logged));
+    if (bytes > shard_max_bytes_) {
+      return;
+    }
+
+    Shard* const shard(ShardFor(key));
+    lock_guard<mutex> lock(shard->lock);
+    const auto it(shard->index.find(key));
+    if (it != shard->index.end()) {
+      if (it->second->second->sequence_number() <= logged->sequence_number()) {
+        return;
+      }
+      shard->bytes -= EntryBytes(*it->second->second);
+      shard->entries.erase(it->second);
+      shard->index.erase(it);
+    }
+
+    shard->entries.emplace_front(key, logged);
+    shard->index.emplace(key, shard->entries.begin());
+    shard->bytes += bytes;
+    while (shard->bytes > shard_max_bytes_) {
+      shard->bytes -= EntryBytes(*shard->entries.back().second);
+      shard->index.erase(shard->entries.back().first);
+      shard->entries.pop_back();
+    }
+  }
+
+  size_t size_bytes() const {
+    size_t total(0);
+    for (const Shard& shard : shards_) {
+      lock_guard<mutex> lock(shard.lock);
+      total += shard.bytes;
+    }
+    return total;
+  }
+
+ private:
+  typedef list<std::pair<Key, shared_ptr<const LoggedEntry>>> EntryList;
+
+  struct Shard {
+    Shard() : bytes(0) {
+    }
+
+    mutable mutex lock;
+    // Most recently used first.
+    EntryList entries;
+    unordered_map<Key, typename EntryList::iterator> index;
+    size_t bytes;
+  };
+
+  Shard* ShardFor(const Key& key) {
+    return &shards_[std::hash<Key>()(key) % kNumShards];
+  }
+
+  const size_t shard_max_bytes_;
+  Shard shards_[kNumShards];
+};
+
+
+// Half of the cache goes to each key, although the entries cached by
+// both are only there once.
+CachingDatabase::CachingDatabase(unique_ptr<Database> db, size_t max_bytes)
+    : db_(move(db)),
+      by_index_(new Cache<int64_t>(max_bytes / 2)),
+      by_hash_(new Cache<string>(max_bytes / 2)) {
+  CHECK(db_);
+}
+
+
+CachingDatabase::~CachingDatabase() {
+}
+
+
+Database::WriteResult CachingDatabase::CreateSequencedEntry_(
+    const LoggedEntry& logged) {
+  const WriteResult result(db_->CreateSequencedEntry(logged));
+  if (result == OK) {
+    Insert(logged);
+  }
+  return result;
+}
+
+
+Database::WriteResult CachingDatabase::CreateSequencedEntries_(
+    const vector<LoggedEntry>& logged) {
+  const WriteResult result(db_->CreateSequencedEntries(logged));
+  // Otherwise, only some of them may have been written.
+  if (result == OK) {
+    for (const auto& entry : logged) {
+      Insert(entry);
+    }
+  }
+  return result;
+}
+
+
+Database::LookupResult CachingDatabase::LookupByHash(
+    const string& hash, LoggedEntry* result) const {
+  if (FindByHash(hash, result)) {
+    return LOOKUP_OK;
+  }
+
+  const LookupResult lookup(db_->LookupByHash(hash, result));
+  if (lookup == LOOKUP_OK) {
+    Insert(*result);
+  }
+  return lookup;
+}
+
+
+Database::LookupResult CachingDatabase::LookupByIndex(
+    int64_t sequence_number, LoggedEntry* result) const {
+  if (FindByIndex(sequence_number, result)) {
+    return LOOKUP_OK;
+  }
+
+  const LookupResult lookup(db_->LookupByIndex(sequence_number, result));
+  if (lookup == LOOKUP_OK) {
+    Insert(*result);
+  }
+  return lookup;
+}
+
+
+void CachingDatabase::LookupByHashAsync(const string& hash,
+                                        LoggedEntry* result,
+                                        util::Task* task) const {
+  if (FindByHash(hash, result)) {
+    task->Return();
+    return;
+  }
+
+  db_->LookupByHashAsync(hash, result,
+                         task->AddChild(bind(&CachingDatabase::LookupDone,
+                                             this, result, task, _1)));
+}
+
+
+void CachingDatabase::LookupByIndexAsync(int64_t sequence_number,
+                                         LoggedEntry* result,
+                                         util::Task* task) const {
+  if (FindByIndex(sequence_number, result)) {
+    task->Return();
+    return;
+  }
+
+  db_->LookupByIndexAsync(sequence_number, result,
+                          task->AddChild(bind(&CachingDatabase::LookupDone,
+                                              this, result, task, _1)));
+}
+
+
+bool CachingDatabase::FindByHash(const string& hash,
+                                 LoggedEntry* result) const {
+  const shared_ptr<const LoggedEntry> cached(by_hash_->Find(hash));
+  database_entry_cache_lookups->Increment("hash", cached ? "hit" : "miss");
+  if (cached) {
+    CHECK_NOTNULL(result)->CopyFrom(*cached);
+  }
+  return cached != nullptr;
+}
+
+
+bool CachingDatabase::FindByIndex(int64_t sequence_number,
+                                  LoggedEntry* result) const {
+  const shared_ptr<const LoggedEntry> cached(by_index_->Find(sequence_number));
+  database_entry_cache_lookups->Increment("index", cached ? "hit" : "miss");
+  if (cached) {
+    CHECK_NOTNULL(result)->CopyFrom(*cached);
+  }
+  return cached != nullptr;
+}
+
+
+void CachingDatabase::LookupDone(LoggedEntry* result, util::Task* task,
+                                 util::Task* lookup) const {
+  if (lookup->status().ok()) {
+    Insert(*result);
+  }
+  task->Return(lookup->status());
+}
+
+
+void CachingDatabase::Insert(const LoggedEntry& logged) const {
+  CHECK(logged.has_sequence_number());
+  const shared_ptr<const LoggedEntry> entry(make_shared<LoggedEntry>(logged));
+  by_index_->Insert(logged.sequence_number(), entry);
+  by_hash_->Insert(logged.Hash(), entry);
+}
+
+
+size_t CachingDatabase::size_bytes() const {
+  return by_index_->size_bytes() + by_hash_->size_bytes();
+}
+
+
+Database::WriteResult CachingDatabase::WriteTreeHead_(
+    const ct::SignedTreeHead& sth) {
+  return db_->WriteTreeHead(sth);
+}
+
+
+Database::LookupResult CachingDatabase::LatestTreeHead(
+    ct::SignedTreeHead* result) const {
+  return db_->LatestTreeHead(result);
+}
+
+
+unique_ptr<Database::Iterator> CachingDatabase::ScanEntries(
+    int64_t start_index) const {
+  return db_->ScanEntries(start_index);
+}
+
+
+void CachingDatabase::ScanEntriesAsync(int64_t start_index,
+                                       size_t max_entries,
+                                       vector<LoggedEntry>* entries,
+                                       util::Task* task) const {
+  db_->ScanEntriesAsync(start_index, max_entries, entries, task);
+}
+
+
+size_t CachingDatabase::ReadLeafHashes(int64_t start_index,
+                                       size_t max_entries,
+                                       vector<string>* leaf_hashes) const {
+  return db_->ReadLeafHashes(start_index, max_entries, leaf_hashes);
+}
+
+
+void CachingDatabase::TimestampRange(uint64_t min_timestamp,
+                                     uint64_t max_timestamp, int64_t* begin,
+                                     int64_t* end) const {
+  db_->TimestampRange(min_timestamp, max_timestamp, begin, end);
+}
+
+
+int64_t CachingDatabase::TreeSize() const {
+  return db_->TreeSize();
+}
+
+
+void CachingDatabase::AddNotifySTHCallback(
+    const Database::NotifySTHCallback* callback) {
+  db_->AddNotifySTHCallback(callback);
+}
+
+
+void CachingDatabase::RemoveNotifySTHCallback(
+    const Database::NotifySTHCallback* callback) {
+  db_->RemoveNotifySTHCallback(callback);
+}
+
+
+void CachingDatabase::InitializeNode(const string& node_id) {
+  db_->InitializeNode(node_id);
+}
+
+
+Database::LookupResult CachingDatabase::NodeId(string* node_id) {
+  return db_->NodeId(node_id);
+}
+
+
+Database::LookupResult CachingDatabase::LatestTreeFrontier(
+    ct::CompactTreeFrontier* result) const {
+  return db_->LatestTreeFrontier(result);
+}
+
+
+void CachingDatabase::BeginBulkLoad() {
+  db_->BeginBulkLoad();
+}
+
+
+void CachingDatabase::EndBulkLoad() {
+  db_->EndBulkLoad();
+}
+
+
+void CachingDatabase::WriteTreeFrontier(
+    const ct::CompactTreeFrontier& frontier) {
+  db_->WriteTreeFrontier(frontier);
+}
+
+
+}  // namespace cert_trans
@@ -0,0 +1,123 @@
+#ifndef CERT_TRANS_LOG_CACHING_DB_H_
+#define CERT_TRANS_LOG_CACHING_DB_H_
+
+#include <stddef.h>
+#include <stdint.h>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "log/database.h"
+
+namespace cert_trans {
+
+
+// Wraps any Database with a cache of deserialized entries, so that
+// LookupByIndex() and LookupByHash() of the entries most in demand,
+// mostly the recent ones, do not go to the backend. The entries are
+// cached as they are written, and as they are read, with the least
+// recently used ones evicted once they take up more than the size
+// given. Everything else, including ScanEntries(), goes straight to
+// the backend, so that bulk reads do not push the recent entries out.
+//
+// The cache is split into shards, each with its own lock, so that
+// concurrent lookups rarely wait for one another.
+//
+// This class is thread-safe if the wrapped database is.
+class CachingDatabase : public Database {
+ public:
+  // Caches up to about |max_bytes| of entries of |db|.
+  CachingDatabase(std::unique_ptr<Database> db, size_t max_bytes);
+  ~CachingDatabase();
+  CachingDatabase(const CachingDatabase&) = delete;
+  CachingDatabase& operator=(const CachingDatabase&) = delete;
+
+  Database::LookupResult LookupByHash(const std::string& hash,
+                                      LoggedEntry* result) const override;
+
+  Database::LookupResult LookupByIndex(int64_t sequence_number,
+                                       LoggedEntry* result) const override;
+
+  // Entries that are cached are returned right away, on the calling
+  // thread, and the others looked up asynchronously by the backend.
+  void LookupByHashAsync(const std::string& hash, LoggedEntry* result,
+                         util::Task* task) const override;
+
+  void LookupByIndexAsync(int64_t sequence_number, LoggedEntry* result,
+                          util::Task* task) const override;
+
+  Database::LookupResult LatestTreeHead(
+      ct::SignedTreeHead* result) const override;
+
+  std::unique_ptr<Database::Iterator> ScanEntries(
+      int64_t start_index) const override;
+
+  void ScanEntriesAsync(int64_t start_index, size_t max_entries,
+                        std::vector<LoggedEntry>* entries,
+                        util::Task* task) const override;
+
+  size_t ReadLeafHashes(int64_t start_index, size_t max_entries,
+                        std::vector<std::string>* leaf_hashes) const override;
+
+  void TimestampRange(uint64_t min_timestamp, uint64_t max_timestamp,
+                      int64_t* begin, int64_t* end) const override;
+
+  int64_t TreeSize() const override;
+
+  void AddNotifySTHCallback(
+      const Database::NotifySTHCallback* callback) override;
+
+  void RemoveNotifySTHCallback(
+      const Database::NotifySTHCallback* callback) override;
+
+  void InitializeNode(const std::string& node_id) override;
+
+  Database::LookupResult NodeId(std::string* node_id) override;
+
+  Database::LookupResult LatestTreeFrontier(
+      ct::CompactTreeFrontier* result) const override;
+
+  void BeginBulkLoad() override;
+
+  void EndBulkLoad() override;
+
+  void WriteTreeFrontier(const ct::CompactTreeFrontier& frontier) override;
+
+  // Approximate size of the entries cached, in bytes.
+  size_t size_bytes() const;
+
+ private:
+  template <class Key>
+  class Cache;
+
+  Database::WriteResult CreateSequencedEntry_(
+      const LoggedEntry& logged) override;
+
+  Database::WriteResult CreateSequencedEntries_(
+      const std::vector<LoggedEntry>& logged) override;
+
+  Database::WriteResult WriteTreeHead_(const ct::SignedTreeHead& sth) override;
+
+  // Copy the entry cached for |hash| or |sequence_number| to *result,
+  // and return true, if there is one.
+  bool FindByHash(const std::string& hash, LoggedEntry* result) const;
+  bool FindByIndex(int64_t sequence_number, LoggedEntry* result) const;
+
+  // Adds |logged|, just written or read from the backend.
+  void Insert(const LoggedEntry& logged) const;
+
+  // Completes |task| with the status of |lookup|, a lookup by the
+  // backend into *result, caching the entry if it was found.
+  void LookupDone(LoggedEntry* result, util::Task* task,
+                  util::Task* lookup) const;
+
+  const std::unique_ptr<Database> db_;
+  // By sequence number, and by hash. Both point to the same entries.
+  const std::unique_ptr<Cache<int64_t>> by_index_;
+  const std::unique_ptr<Cache<std::string>> by_hash_;
+};
+
+
+}  // namespace cert_trans
+
+#endif  // CERT_TRANS_LOG_CACHING_DB_H_
@@ -221,14 +221,28 @@ unique_ptr<Cert> Cert::Clone() const {
 
 
 unique_ptr<Cert> Cert::FromDerString(const string& der_string) {
-  const unsigned char* start =
-      reinterpret_cast<const unsigned char*>(der_string.data());
-  ScopedX509 x509(d2i_X509(nullptr, &start, der_string.size()));
+  return FromDer(der_string.data(), der_string.size());
+}
+
+
+unique_ptr<Cert> Cert::FromDer(const char* bytes, size_t size) {
+  const unsigned char* const data =
+      reinterpret_cast<const unsigned char*>(bytes);
+  const unsigned char* start = data;
+  ScopedX509 x509(d2i_X509(nullptr, &start, size));
   if (!x509) {
     LOG(WARNING) << "Input is not a valid DER-encoded certificate";
     LOG_OPENSSL_ERRORS(WARNING);
+    return nullptr;
   }
-  return FromX509(move(x509));
+
+  unique_ptr<Cert> cert(FromX509(move(x509)));
+  // We already have the encoding, no need to regenerate it later.
+  Memo* const der(&cert->der_encoding_);
+  std::call_once(der->once, [der, data, start]() {
+    der->value.assign(reinterpret_cast<const char*>(data), start - data);
+  });
+  return cert;
 }
 
 
@@ -505,7 +519,26 @@ StatusOr<bool> Cert::IsSignedBy(const Cert& issuer) const {
 }
 
 
+util::Status Cert::Memoized(Memo* memo,
+                            util::Status (Cert::*compute)(string*) const,
+                            string* result) const {
+  std::call_once(memo->once,
+                 [this, memo, compute]() {
+                   memo->status = (this->*compute)(&memo->value);
+                 });
+  if (memo->status.ok()) {
+    result->assign(memo->value);
+  }
+  return memo->status;
+}
+
+
 util::Status Cert::DerEncoding(string* result) const {
+  return Memoized(&der_encoding_, &Cert::ComputeDerEncoding, result);
+}
+
+
+util::Status Cert::ComputeDerEncoding(string* result) const {
   unsigned char* der_buf(nullptr);
   CHECK(x509_ != nullptr);
   int der_length = i2d_X509(x509_.get(), &der_buf);
@@ -545,6 +578,11 @@ util::Status Cert::PemEncoding(string* result) const {
 
 
 util::Status Cert::Sha256Digest(string* result) const {
+  return Memoized(&sha256_digest_, &Cert::ComputeSha256Digest, result);
+}
+
+
+util::Status Cert::ComputeSha256Digest(string* result) const {
   unsigned char digest[EVP_MAX_MD_SIZE];
   unsigned int len;
   CHECK(x509_ != nullptr);
@@ -562,6 +600,12 @@ util::Status Cert::Sha256Digest(string* result) const {
 
 
 util::Status Cert::DerEncodedTbsCertificate(string* result) const {
+  return Memoized(&der_tbs_certificate_,
+                  &Cert::ComputeDerEncodedTbsCertificate, result);
+}
+
+
+util::Status Cert::ComputeDerEncodedTbsCertificate(string* result) const {
   unsigned char* der_buf(nullptr);
   CHECK(x509_ != nullptr);
   int der_length = i2d_re_X509_tbs(x509_.get(), &der_buf);
@@ -579,12 +623,24 @@ util::Status Cert::DerEncodedTbsCertificate(string* result) const {
 
 
 util::Status Cert::DerEncodedSubjectName(string* result) const {
+  return Memoized(&der_subject_name_, &Cert::ComputeDerEncodedSubjectName,
+                  result);
+}
+
+
+util::Status Cert::ComputeDerEncodedSubjectName(string* result) const {
   CHECK(x509_ != nullptr);
   return DerEncodedName(X509_get_subject_name(x509_.get()), result);
 }
 
 
 util::Status Cert::DerEncodedIssuerName(string* result) const {
+  return Memoized(&der_issuer_name_, &Cert::ComputeDerEncodedIssuerName,
+                  result);
+}
+
+
+util::Status Cert::ComputeDerEncodedIssuerName(string* result) const {
   CHECK(x509_ != nullptr);
   return DerEncodedName(X509_get_issuer_name(x509_.get()), result);
 }
@@ -646,6 +702,12 @@ StatusOr<string> Cert::SPKI() const {
 
 
 util::Status Cert::SPKISha256Digest(string* result) const {
+  return Memoized(&spki_sha256_digest_, &Cert::ComputeSPKISha256Digest,
+                  result);
+}
+
+
+util::Status Cert::ComputeSPKISha256Digest(string* result) const {
   const util::StatusOr<string> spki(SPKI());
   if (spki.ok()) {
     string sha256_digest = Sha256Hasher::Sha256Digest(spki.ValueOrDie());
@@ -868,6 +930,32 @@ util::Status Cert::SubjectAltNames(vector<string>* dns_alt_names) const {
 }
 
 
+util::Status Cert::SubjectCommonName(string* common_name) const {
+  CHECK(common_name != nullptr);
+  common_name->clear();
+  X509_NAME* const name(X509_get_subject_name(x509_.get()));
+  if (!name) {
+    return util::Status(Code::INVALID_ARGUMENT, "Missing X509 subject name");
+  }
+
+  const int name_pos(X509_NAME_get_index_by_NID(name, NID_commonName, -1));
+  if (name_pos < 0) {
+    return util::Status(Code::NOT_FOUND, "No subject CN");
+  }
+  X509_NAME_ENTRY* const name_entry(X509_NAME_get_entry(name, name_pos));
+  ASN1_STRING* const subject_name_asn1(
+      name_entry ? X509_NAME_ENTRY_get_data(name_entry) : nullptr);
+  if (!subject_name_asn1) {
+    return util::Status(Code::NOT_FOUND, "No subject CN");
+  }
+
+  util::Status status;
+  *common_name =
+      ASN1ToStringAndCheckForNulls(subject_name_asn1, "CN", &status);
+  return status;
+}
+
+
 // Helper method for validating V2 redaction rules. If it returns true
 // then the result in status is final.
 bool Cert::ValidateRedactionSubjectAltNameAndCN(int* dns_alt_name_count,
@@ -5,6 +5,7 @@
 #include <openssl/asn1.h>
 #include <openssl/x509.h>
 #include <memory>
+#include <mutex>
 #include <string>
 #include <vector>
 
@@ -19,11 +20,16 @@ bool IsRedactedHost(const std::string& hostname);
 // Tests if a hostname containing any redactions follows the RFC rules
 bool IsValidRedactedHost(const std::string& hostname);
 
+// The various encodings and digests of a Cert are only computed the
+// first time they are requested, and then remembered: a Cert never
+// changes once created.
 class Cert {
  public:
   // The following factory static methods return null if the input is
   // not valid.
   static std::unique_ptr<Cert> FromDerString(const std::string& der_string);
+  // From the |size| bytes at |bytes|, which need not outlive the Cert.
+  static std::unique_ptr<Cert> FromDer(const char* bytes, size_t size);
   // Caller still owns the BIO afterwards.
   static std::unique_ptr<Cert> FromDerBio(BIO* bio_in);
   static std::unique_ptr<Cert> FromPemString(const std::string& pem_string);
@@ -146,6 +152,12 @@ class Cert {
   // Returns FAILED_PRECONDITION if the cert is not loaded.
   util::Status SubjectAltNames(std::vector<std::string>* dns_alt_names) const;
 
+  // Sets the first CN of the subject name in |common_name|.
+  // Returns ::util::OkStatus() if it was extracted.
+  // Returns NOT_FOUND if the subject name has no CN.
+  // Returns INVALID_ARGUMENT if it could not be extracted.
+  util::Status SubjectCommonName(std::string* common_name) const;
+
   // Sets the SHA256 digest of the cert's subjectPublicKeyInfo in |result|.
   // Returns TRUE if computing the digest succeeded.
   // Returns FALSE if computing the digest failed.
@@ -197,9 +209,28 @@ class Cert {
   FRIEND_TEST(CtExtensionsTest, TestPrecertSigning);
 
  private:
+  // The result of one of the memoized accessors. Thread-safe.
+  struct Memo {
+    std::once_flag once;
+    util::Status status;
+    std::string value;
+  };
+
   // Will CHECK-fail if |x509| is null.
   explicit Cert(ScopedX509 x509);
 
+  // Fills in |memo| using |compute| the first time around, and then
+  // copies its result to |result|.
+  util::Status Memoized(Memo* memo,
+                        util::Status (Cert::*compute)(std::string*) const,
+                        std::string* result) const;
+  util::Status ComputeDerEncoding(std::string* result) const;
+  util::Status ComputeSha256Digest(std::string* result) const;
+  util::Status ComputeDerEncodedTbsCertificate(std::string* result) const;
+  util::Status ComputeDerEncodedSubjectName(std::string* result) const;
+  util::Status ComputeDerEncodedIssuerName(std::string* result) const;
+  util::Status ComputeSPKISha256Digest(std::string* result) const;
+
   util::StatusOr<int> ExtensionIndex(int extension_nid) const;
   util::StatusOr<X509_EXTENSION*> GetExtension(int extension_nid) const;
   util::StatusOr<void*> ExtensionStructure(int extension_nid) const;
@@ -210,6 +241,13 @@ class Cert {
   static std::string PrintTime(ASN1_TIME* when);
   static util::Status DerEncodedName(X509_NAME* name, std::string* result);
   const ScopedX509 x509_;
+
+  mutable Memo der_encoding_;
+  mutable Memo sha256_digest_;
+  mutable Memo der_tbs_certificate_;
+  mutable Memo der_subject_name_;
+  mutable Memo der_issuer_name_;
+  mutable Memo spki_sha256_digest_;
 };
 
 // A wrapper around X509_CINF for chopping at the TBS to CT-sign it or verify
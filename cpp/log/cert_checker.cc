@@ -1,6 +1,7 @@
 /* -*- indent-tabs-mode: nil -*- */
 #include "log/cert_checker.h"
 
+#include <gflags/gflags.h>
 #include <glog/logging.h>
 #include <openssl/asn1.h>
 #include <openssl/bio.h>
@@ -15,13 +16,20 @@
 
 #include "log/cert.h"
 #include "log/ct_extensions.h"
+#include "log/precert_tbs.h"
+#include "monitoring/monitoring.h"
 #include "util/openssl_scoped_types.h"
 #include "util/openssl_util.h"  // for LOG_OPENSSL_ERRORS
 #include "util/util.h"
 
+using std::atomic_load;
+using std::atomic_store;
+using std::lock_guard;
+using std::make_shared;
 using std::move;
-using std::multimap;
+using std::mutex;
 using std::pair;
+using std::shared_ptr;
 using std::string;
 using std::unique_ptr;
 using std::vector;
@@ -30,7 +38,31 @@ using util::Status;
 using util::StatusOr;
 using util::error::Code;
 
+DEFINE_int32(cert_checker_signature_cache_size, 10000,
+             "maximum number of verified issuer signatures remembered by "
+             "the certificate checker, 0 to disable");
+
 namespace cert_trans {
+namespace {
+
+
+static Counter<bool>* signature_cache_lookups(
+    Counter<bool>::New("cert_checker_signature_cache_lookups", "hit",
+                       "Number of issuer signature checks, broken down by "
+                       "whether they were answered from the cache."));
+
+
+}  // namespace
+
+CertChecker::CertChecker()
+    : trusted_(make_shared<TrustedCertificates>()),
+      trusted_memory_("trusted_certificates") {
+}
+
+shared_ptr<const CertChecker::TrustedCertificates>
+CertChecker::GetTrustedCertificates() const {
+  return atomic_load(&trusted_);
+}
 
 bool CertChecker::LoadTrustedCertificates(const string& cert_file) {
   // A read-only BIO.
@@ -70,6 +102,9 @@ bool CertChecker::LoadTrustedCertificates(
 
 bool CertChecker::LoadTrustedCertificatesFromBIO(BIO* bio_in) {
   CHECK(bio_in != nullptr);
+  lock_guard<mutex> lock(load_lock_);
+  const shared_ptr<const TrustedCertificates> trusted(
+      GetTrustedCertificates());
   vector<pair<string, unique_ptr<const Cert>>> certs_to_add;
   bool error = false;
   // certs_to_add may be empty if no new certs were added, so keep track of
@@ -83,7 +118,8 @@ bool CertChecker::LoadTrustedCertificatesFromBIO(BIO* bio_in) {
       // and at least warn if it isn't.
       unique_ptr<Cert> cert(Cert::FromX509(move(x509)));
       string subject_name;
-      const StatusOr<bool> is_trusted(IsTrusted(*cert, &subject_name));
+      const StatusOr<bool> is_trusted(
+          IsTrusted(*trusted, *cert, &subject_name));
       if (!is_trusted.ok()) {
         error = true;
         break;
@@ -115,10 +151,25 @@ bool CertChecker::LoadTrustedCertificatesFromBIO(BIO* bio_in) {
   }
 
   size_t new_certs = certs_to_add.size();
+  const shared_ptr<TrustedCertificates> new_trusted(
+      make_shared<TrustedCertificates>(*trusted));
   while (!certs_to_add.empty()) {
-    trusted_.insert(move(certs_to_add.back()));
+    new_trusted->emplace(move(certs_to_add.back().first),
+                         move(certs_to_add.back().second));
     certs_to_add.pop_back();
   }
+  // The parsed certificates take up a few times their DER encoding,
+  // which is what this counts.
+  int64_t trusted_bytes(UnorderedMapByteSize(*new_trusted, 0));
+  for (const auto& it : *new_trusted) {
+    string der;
+    if (it.second->DerEncoding(&der).ok()) {
+      trusted_bytes += it.first.size() + der.size();
+    }
+  }
+  trusted_memory_.Set(trusted_bytes);
+  atomic_store(&trusted_,
+               shared_ptr<const TrustedCertificates>(move(new_trusted)));
   LOG(INFO) << "Added " << new_certs << " new certificate(s) to trusted store";
 
   return true;
@@ -156,7 +207,7 @@ Status CertChecker::CheckIssuerChain(CertChain* chain) const {
     return Status(status.CanonicalCode(), "invalid certificate chain");
   }
 
-  const Status valid_chain(chain->IsValidSignatureChain());
+  const Status valid_chain(CheckSignatureChain(*chain));
   if (!valid_chain.ok()) {
     return valid_chain;
   }
@@ -217,23 +268,15 @@ Status CertChecker::CheckPreCertChain(PreCertChain* chain,
                  ::util::OkStatus()) {
     return Status(util::error::INTERNAL, "internal error");
   }
-  // A well-formed chain always has a precert.
-  TbsCertificate tbs(*chain->PreCert());
-  if (!tbs.IsLoaded() || !tbs.DeleteExtension(cert_trans::NID_ctPoison).ok()) {
-    return Status(util::error::INTERNAL, "internal error");
-  }
-
-  // If the issuing cert is the special Precert Signing Certificate,
-  // replace the issuer with the one that will sign the final cert.
-  // Should always succeed as we've already verified that the chain
-  // is well-formed.
-  if (uses_pre_issuer.ValueOrDie() &&
-      !tbs.CopyIssuerFrom(*chain->PrecertIssuingCert()).ok()) {
-    return Status(util::error::INTERNAL, "internal error");
-  }
-
+  // A well-formed chain always has a precert. If the issuing cert is
+  // the special Precert Signing Certificate, the issuer is replaced
+  // with the one that will sign the final cert. Should always succeed
+  // as we've already verified that the chain is well-formed.
   string der_tbs;
-  if (!tbs.DerEncoding(&der_tbs).ok()) {
+  if (!PrecertTbs(*chain->PreCert(), cert_trans::NID_ctPoison,
+                  uses_pre_issuer.ValueOrDie() ? chain->PrecertIssuingCert()
+                                               : nullptr,
+                  &der_tbs).ok()) {
     return Status(util::error::INTERNAL,
                   "could not DER-encode tbs certificate");
   }
@@ -250,15 +293,19 @@ Status CertChecker::GetTrustedCa(CertChain* chain) const {
     return Status(util::error::INTERNAL, "chain has no valid certificate");
   }
 
-  // Look up issuer from the trusted store.
-  if (trusted_.empty()) {
+  // Look up issuer from the trusted store. Use the same snapshot of it
+  // throughout, even if more certificates get loaded meanwhile.
+  const shared_ptr<const TrustedCertificates> trusted(
+      GetTrustedCertificates());
+  if (trusted->empty()) {
     LOG(WARNING) << "No trusted certificates loaded";
     return Status(util::error::FAILED_PRECONDITION,
                   "no trusted certificates loaded");
   }
 
   string subject_name;
-  const StatusOr<bool> is_trusted(IsTrusted(*subject, &subject_name));
+  const StatusOr<bool> is_trusted(
+      IsTrusted(*trusted, *subject, &subject_name));
   // Either an error, or true, meaning the last cert is in our trusted
   // store.  Note the trusted cert need not necessarily be
   // self-signed.
@@ -279,14 +326,17 @@ Status CertChecker::GetTrustedCa(CertChain* chain) const {
                   "untrusted self-signed certificate");
   }
 
-  const auto issuer_range(trusted_.equal_range(issuer_name));
+  const auto issuer_range(trusted->equal_range(issuer_name));
   const Cert* issuer(nullptr);
-  for (multimap<string, unique_ptr<const Cert>>::const_iterator it =
-           issuer_range.first;
+  for (TrustedCertificates::const_iterator it = issuer_range.first;
        it != issuer_range.second; ++it) {
-    const unique_ptr<const Cert>& issuer_cand(it->second);
+    const shared_ptr<const Cert>& issuer_cand(it->second);
 
-    StatusOr<bool> signed_by_issuer = subject->IsSignedBy(*issuer_cand);
+    // Only a chain with more than one cert has an intermediate here;
+    // don't fill the cache with leaves.
+    StatusOr<bool> signed_by_issuer =
+        chain->Length() > 1 ? CachedIsSignedBy(*subject, *issuer_cand)
+                            : subject->IsSignedBy(*issuer_cand);
     if (signed_by_issuer.status().CanonicalCode() == Code::UNIMPLEMENTED) {
       // If the cert's algorithm is unsupported, then there's no point
       // continuing: it's unconditionally invalid.
@@ -320,8 +370,80 @@ Status CertChecker::GetTrustedCa(CertChain* chain) const {
   return ::util::OkStatus();
 }
 
-StatusOr<bool> CertChecker::IsTrusted(const Cert& cert,
-                                      string* subject_name) const {
+Status CertChecker::CheckSignatureChain(const CertChain& chain) const {
+  if (!chain.IsLoaded()) {
+    LOG(ERROR) << "Chain is not loaded";
+    return Status(util::error::FAILED_PRECONDITION,
+                  "certificate chain is not loaded");
+  }
+
+  for (size_t i = 0; i + 1 < chain.Length(); ++i) {
+    const Cert* subject(chain.CertAt(i));
+    const Cert* issuer(chain.CertAt(i + 1));
+
+    // Leaves are (nearly) always unique, so there is no point in
+    // caching their signatures.
+    const StatusOr<bool> status(i == 0 ? subject->IsSignedBy(*issuer)
+                                       : CachedIsSignedBy(*subject, *issuer));
+
+    // See CertChain::IsValidSignatureChain() for the handling of
+    // errors.
+    if (!status.ok()) {
+      return status.status();
+    }
+
+    if (!status.ValueOrDie()) {
+      return Status(util::error::INVALID_ARGUMENT,
+                    "invalid certificate chain");
+    }
+  }
+
+  return ::util::OkStatus();
+}
+
+StatusOr<bool> CertChecker::CachedIsSignedBy(const Cert& subject,
+                                             const Cert& issuer) const {
+  if (FLAGS_cert_checker_signature_cache_size <= 0) {
+    return subject.IsSignedBy(issuer);
+  }
+
+  string key;
+  string issuer_key_hash;
+  if (subject.Sha256Digest(&key) != ::util::OkStatus() ||
+      issuer.SPKISha256Digest(&issuer_key_hash) != ::util::OkStatus()) {
+    // Let IsSignedBy() deal with whatever is wrong with these.
+    return subject.IsSignedBy(issuer);
+  }
+  key.append(issuer_key_hash);
+
+  {
+    lock_guard<mutex> lock(verified_signatures_lock_);
+    if (verified_signatures_.count(key) > 0) {
+      signature_cache_lookups->Increment(true);
+      return true;
+    }
+  }
+  signature_cache_lookups->Increment(false);
+
+  const StatusOr<bool> signed_by(subject.IsSignedBy(issuer));
+  if (signed_by.ok() && signed_by.ValueOrDie()) {
+    lock_guard<mutex> lock(verified_signatures_lock_);
+    // The set of intermediates in use is small and changes slowly, so
+    // simply starting over when full is good enough.
+    if (verified_signatures_.size() >=
+        static_cast<size_t>(FLAGS_cert_checker_signature_cache_size)) {
+      verified_signatures_.clear();
+    }
+    verified_signatures_.insert(move(key));
+  }
+
+  return signed_by;
+}
+
+// static
+StatusOr<bool> CertChecker::IsTrusted(const TrustedCertificates& trusted,
+                                      const Cert& cert,
+                                      string* subject_name) {
   string cert_name;
   util::Status status = cert.DerEncodedSubjectName(&cert_name);
   if (status != ::util::OkStatus()) {
@@ -331,9 +453,8 @@ StatusOr<bool> CertChecker::IsTrusted(const Cert& cert,
 
   *subject_name = cert_name;
 
-  const auto cand_range(trusted_.equal_range(cert_name));
-  for (multimap<string, unique_ptr<const Cert>>::const_iterator it(
-           cand_range.first);
+  const auto cand_range(trusted.equal_range(cert_name));
+  for (TrustedCertificates::const_iterator it(cand_range.first);
        it != cand_range.second; ++it) {
     if (cert.IsIdenticalTo(*it->second)) {
       return true;
@@ -5,12 +5,15 @@
 #include <openssl/x509.h>
 #include <openssl/x509v3.h>
 
-#include <map>
 #include <memory>
+#include <mutex>
 #include <string>
+#include <unordered_map>
+#include <unordered_set>
 #include <vector>
 
 #include "log/cert.h"
+#include "monitoring/memory_usage.h"
 #include "util/status.h"
 #include "util/statusor.h"
 
@@ -30,7 +33,13 @@ class PreCertChain;
 // (2) we get some spam protection.
 class CertChecker {
  public:
-  CertChecker() = default;
+  // The trusted certificates, by the DER encoding of their subject
+  // name. Once returned, a set of trusted certificates never changes:
+  // loading more certificates replaces it with a new one.
+  typedef std::unordered_multimap<std::string, std::shared_ptr<const Cert>>
+      TrustedCertificates;
+
+  CertChecker();
   virtual ~CertChecker() = default;
   CertChecker(const CertChecker&) = delete;
   CertChecker& operator=(const CertChecker&) = delete;
@@ -44,16 +53,18 @@ class CertChecker {
   // Load directly from |trusted_certs|, a vector of PEM-certs.
   // Returns true if at least one of the supplied certs was loaded
   // successfully.
+  //
+  // Certificates can be loaded while chains are being checked: checks
+  // already in progress carry on with the previous set of trusted
+  // certificates.
   virtual bool LoadTrustedCertificates(
       const std::vector<std::string>& trusted_certs);
 
-  virtual const std::multimap<std::string, std::unique_ptr<const Cert>>&
-  GetTrustedCertificates() const {
-    return trusted_;
-  }
+  virtual std::shared_ptr<const TrustedCertificates> GetTrustedCertificates()
+      const;
 
   virtual size_t NumTrustedCertificates() const {
-    return trusted_.size();
+    return GetTrustedCertificates()->size();
   }
 
   // Check that:
@@ -84,19 +95,39 @@ class CertChecker {
  private:
   util::Status CheckIssuerChain(CertChain* chain) const;
 
+  // Like CertChain::IsValidSignatureChain(), but every link above the
+  // leaf goes through CachedIsSignedBy().
+  util::Status CheckSignatureChain(const CertChain& chain) const;
+
+  // Same as subject.IsSignedBy(issuer), but remembers successful
+  // verifications so that the intermediates included with nearly
+  // every submission only get their signatures checked once.
+  util::StatusOr<bool> CachedIsSignedBy(const Cert& subject,
+                                        const Cert& issuer) const;
+
   // Look issuer up from the trusted store, and verify signature.
   util::Status GetTrustedCa(CertChain* chain) const;
 
   // Returns true if the cert is trusted, false if it's not,
   // INVALID_ARGUMENT if something is wrong with the cert, and
   // INTERNAL if something terrible happened.
-  util::StatusOr<bool> IsTrusted(const Cert& cert,
-                                 std::string* subject_name) const;
-
-  // A map by the DER encoding of the subject name.
-  // All code manipulating this container must ensure contained elements are
-  // deallocated appropriately.
-  std::multimap<std::string, std::unique_ptr<const Cert>> trusted_;
+  static util::StatusOr<bool> IsTrusted(const TrustedCertificates& trusted,
+                                        const Cert& cert,
+                                        std::string* subject_name);
+
+  // Only ever accessed with std::atomic_load() and std::atomic_store(),
+  // so that readers never wait for a load to complete.
+  std::shared_ptr<const TrustedCertificates> trusted_;
+  // Serializes loads, so that concurrent ones don't lose certificates.
+  std::mutex load_lock_;
+  // Of the DER encodings of |trusted_|.
+  MemoryUsage trusted_memory_;
+
+  // Keys are the SHA-256 digest of the full DER encoding of a subject
+  // (so that the signature itself is covered), followed by the SHA-256
+  // digest of the SPKI of the issuer that validly signed it.
+  mutable std::mutex verified_signatures_lock_;
+  mutable std::unordered_set<std::string> verified_signatures_;
 
   // Helper for LoadTrustedCertificates, whether reading from file or memory.
   // Takes ownership of bio_in and frees it.
@@ -18,6 +18,7 @@ using cert_trans::Cert;
 using cert_trans::CertChain;
 using cert_trans::CertChecker;
 using cert_trans::PreCertChain;
+using std::shared_ptr;
 using std::string;
 using std::unique_ptr;
 using std::vector;
@@ -368,6 +369,19 @@ TEST_F(CertCheckerTest, LoadTrustedCertificatesIgnoresDuplicates) {
   EXPECT_EQ(1U, checker_.NumTrustedCertificates());
 }
 
+TEST_F(CertCheckerTest, LoadTrustedCertificatesKeepsOldSnapshot) {
+  EXPECT_TRUE(checker_.LoadTrustedCertificates(cert_dir_ + "/" + kCaCert));
+  const shared_ptr<const CertChecker::TrustedCertificates> before(
+      checker_.GetTrustedCertificates());
+  EXPECT_EQ(1U, before->size());
+
+  EXPECT_TRUE(
+      checker_.LoadTrustedCertificates(cert_dir_ + "/" + kIntermediateCert));
+  EXPECT_EQ(2U, checker_.NumTrustedCertificates());
+  // Whoever was using the previous set of certificates sees no change.
+  EXPECT_EQ(1U, before->size());
+}
+
 TEST_F(CertCheckerTest, LoadTrustedCertificatesMissingFile) {
   EXPECT_EQ(0U, checker_.NumTrustedCertificates());
 
@@ -446,6 +460,29 @@ TEST_F(CertCheckerTest, Intermediates) {
               StatusIs(util::error::INVALID_ARGUMENT));
 }
 
+TEST_F(CertCheckerTest, IntermediatesCachedSignature) {
+  EXPECT_TRUE(checker_.LoadTrustedCertificates(cert_dir_ + "/" + kCaCert));
+
+  // The second check is answered from the signature cache.
+  for (int i = 0; i < 2; ++i) {
+    CertChain chain(chain_leaf_pem_ + intermediate_pem_);
+    ASSERT_EQ(2U, chain.Length());
+    EXPECT_OK(checker_.CheckCertChain(&chain));
+    EXPECT_EQ(3U, chain.Length());
+  }
+
+  // The cache must not vouch for a different signature over the same
+  // contents.
+  string intermediate_der;
+  ASSERT_OK(
+      Cert::FromPemString(intermediate_pem_)->DerEncoding(&intermediate_der));
+  intermediate_der[intermediate_der.size() - 1] ^= 1;
+  CertChain tampered(chain_leaf_pem_);
+  ASSERT_TRUE(tampered.AddCert(Cert::FromDerString(intermediate_der)));
+  ASSERT_EQ(2U, tampered.Length());
+  EXPECT_FALSE(checker_.CheckCertChain(&tampered).ok());
+}
+
 TEST_F(CertCheckerTest, PreCert) {
   const string chain_pem = precert_pem_ + ca_pem_;
   PreCertChain chain(chain_pem);
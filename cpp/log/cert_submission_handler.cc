@@ -6,14 +6,16 @@
 #include "log/cert.h"
 #include "log/cert_checker.h"
 #include "log/ct_extensions.h"
+#include "log/precert_tbs.h"
 #include "proto/ct.pb.h"
 #include "proto/serializer.h"
+#include "util/tracing.h"
 
 using cert_trans::Cert;
 using cert_trans::CertChain;
 using cert_trans::CertChecker;
 using cert_trans::PreCertChain;
-using cert_trans::TbsCertificate;
+using cert_trans::ScopedSpan;
 using ct::LogEntry;
 using ct::PrecertChainEntry;
 using ct::X509ChainEntry;
@@ -33,25 +35,13 @@ bool SerializedTbs(const Cert& cert, string* result) {
   }
 
   // Delete the embedded proof.
-  TbsCertificate tbs(cert);
-  if (!tbs.IsLoaded()) {
-    return false;
-  }
-
-  if (has_embedded_proof.ValueOrDie() &&
-      !tbs.DeleteExtension(
-              cert_trans::NID_ctEmbeddedSignedCertificateTimestampList)
-           .ok()) {
-    return false;
-  }
-
-  string der_tbs;
-  if (!tbs.DerEncoding(&der_tbs).ok()) {
-    return false;
+  if (has_embedded_proof.ValueOrDie()) {
+    return PrecertTbs(cert,
+                      cert_trans::NID_ctEmbeddedSignedCertificateTimestampList,
+                      nullptr, result)
+        .ok();
   }
-
-  result->assign(der_tbs);
-  return true;
+  return cert.DerEncodedTbsCertificate(result).ok();
 }
 
 
@@ -120,6 +110,7 @@ Status CertSubmissionHandler::ProcessX509Submission(CertChain* chain,
   if (!chain->IsLoaded())
     return Status(util::error::INVALID_ARGUMENT, "empty submission");
 
+  ScopedSpan span("check-chain");
   const Status status(cert_checker_->CheckCertChain(chain));
   if (!status.ok())
     return status;
@@ -147,6 +138,7 @@ Status CertSubmissionHandler::ProcessPreCertSubmission(PreCertChain* chain,
                                                        LogEntry* entry) const {
   entry->set_type(ct::PRECERT_ENTRY);
   PrecertChainEntry* precert_entry = entry->mutable_precert_entry();
+  ScopedSpan span("check-chain");
   const Status status(cert_checker_->CheckPreCertChain(
       chain, precert_entry->mutable_pre_cert()->mutable_issuer_key_hash(),
       precert_entry->mutable_pre_cert()->mutable_tbs_certificate()));
@@ -370,6 +370,31 @@ TEST_F(CertTest, LoadInvalidFromDer) {
   EXPECT_FALSE(second);
 }
 
+TEST_F(CertTest, DerEncodingKeepsParsedBytes) {
+  string der;
+  ASSERT_OK(leaf_cert_->DerEncoding(&der));
+  // Trailing data is not part of the certificate.
+  const unique_ptr<Cert> second(Cert::FromDerString(der + "trailing"));
+  ASSERT_TRUE(second.get());
+
+  // Asking again gives the same answer.
+  for (int i = 0; i < 2; ++i) {
+    string second_der;
+    ASSERT_OK(second->DerEncoding(&second_der));
+    EXPECT_EQ(der, second_der);
+
+    string digest, second_digest;
+    ASSERT_OK(leaf_cert_->Sha256Digest(&digest));
+    ASSERT_OK(second->Sha256Digest(&second_digest));
+    EXPECT_EQ(digest, second_digest);
+
+    string tbs, second_tbs;
+    ASSERT_OK(leaf_cert_->DerEncodedTbsCertificate(&tbs));
+    ASSERT_OK(second->DerEncodedTbsCertificate(&second_tbs));
+    EXPECT_EQ(tbs, second_tbs);
+  }
+}
+
 TEST_F(CertTest, PrintVersion) {
   EXPECT_EQ("3", ca_cert_->PrintVersion());
   EXPECT_EQ("3", leaf_cert_->PrintVersion());
@@ -509,6 +534,14 @@ TEST_F(CertTest, TestSubjectAltNames) {
   EXPECT_EQ("youtubeeducation.com", sans[43]);
 }
 
+TEST_F(CertTest, TestSubjectCommonName) {
+  string common_name;
+  EXPECT_OK(google_cert_->SubjectCommonName(&common_name));
+  EXPECT_EQ("*.google.com", common_name);
+  EXPECT_THAT(leaf_cert_->SubjectCommonName(&common_name),
+              StatusIs(util::error::NOT_FOUND));
+}
+
 TEST_F(CertTest, SPKI) {
   const StatusOr<string> spki(leaf_cert_->SPKI());
   EXPECT_OK(spki.status());
@@ -1,11 +1,14 @@
 #include "log/cluster_state_controller.h"
 
 #include <stdint.h>
+#include <algorithm>
+#include <cmath>
 #include <functional>
 
 #include "fetcher/peer.h"
 #include "log/database.h"
 #include "log/etcd_consistent_store.h"
+#include "monitoring/latency.h"
 #include "monitoring/monitoring.h"
 #include "proto/ct.pb.h"
 
@@ -13,10 +16,12 @@ using ct::ClusterConfig;
 using ct::ClusterNodeState;
 using ct::SignedTreeHead;
 using std::bind;
+using std::chrono::milliseconds;
 using std::lock_guard;
 using std::make_pair;
 using std::make_shared;
 using std::map;
+using std::max;
 using std::mutex;
 using std::pair;
 using std::placeholders::_1;
@@ -41,6 +46,38 @@ Gauge<>* serving_tree_timestamp =
     Gauge<>::New("serving_tree_timestamp",
                  "Timestamp of the current serving STH");
 
+Gauge<string>* node_replication_lag_entries =
+    Gauge<string>::New("node_replication_lag_entries", "node_id",
+                       "Number of entries each node is behind the largest "
+                       "STH in the cluster");
+
+Latency<milliseconds> set_serving_sth_latency_ms(
+    "set_serving_sth_latency_ms",
+    "Time spent setting the cluster serving STH in the consistent store");
+
+
+// Returns the fewest nodes, out of |num_nodes|, which satisfy both the
+// minimum_serving_nodes and minimum_serving_fraction of |config|.
+size_t MinServingNodes(const ClusterConfig& config, size_t num_nodes) {
+  CHECK_LT(0U, num_nodes);
+  const auto satisfies_fraction([&config, num_nodes](size_t n) {
+    return static_cast<double>(n) / num_nodes >=
+           config.minimum_serving_fraction();
+  });
+  // Start from the rounded up product, and adjust for any rounding
+  // error, so as to agree with the fraction check exactly.
+  size_t ret(static_cast<size_t>(max(
+      0.0, std::ceil(config.minimum_serving_fraction() * num_nodes))));
+  while (ret > 0 && satisfies_fraction(ret - 1)) {
+    --ret;
+  }
+  while (ret <= num_nodes && !satisfies_fraction(ret)) {
+    ++ret;
+  }
+  return max<size_t>(
+      {ret, static_cast<size_t>(max(0, config.minimum_serving_nodes())), 1});
+}
+
 
 unique_ptr<AsyncLogClient> BuildAsyncLogClient(
     const shared_ptr<libevent::Base>& base, UrlFetcher* fetcher,
@@ -72,6 +109,12 @@ int64_t ClusterStateController::ClusterPeer::TreeSize() const {
 }
 
 
+string ClusterStateController::ClusterPeer::Region() const {
+  lock_guard<mutex> lock(lock_);
+  return state_.region();
+}
+
+
 void ClusterStateController::ClusterPeer::UpdateClusterNodeState(
     const ClusterNodeState& new_state) {
   lock_guard<mutex> lock(lock_);
@@ -110,11 +153,14 @@ ClusterStateController::ClusterStateController(
       watch_config_task_(CHECK_NOTNULL(executor)),
       watch_node_states_task_(CHECK_NOTNULL(executor)),
       watch_serving_sth_task_(CHECK_NOTNULL(executor)),
+      fetch_priority_tree_size_(0),
       exiting_(false),
       update_required_(false),
       cluster_serving_sth_update_thread_(
-          bind(&ClusterStateController::ClusterServingSTHUpdater, this)) {
+          bind(&ClusterStateController::ClusterServingSTHUpdater, this)),
+      on_new_db_sth_(bind(&ClusterStateController::NotifyStaleness, this)) {
   CHECK_NOTNULL(base_.get());
+  database_->AddNotifySTHCallback(&on_new_db_sth_);
   store_->WatchClusterNodeStates(
       bind(&ClusterStateController::OnClusterStateUpdated, this, _1),
       watch_node_states_task_.task());
@@ -128,6 +174,7 @@ ClusterStateController::ClusterStateController(
 
 
 ClusterStateController::~ClusterStateController() {
+  database_->RemoveNotifySTHCallback(&on_new_db_sth_);
   watch_config_task_.Cancel();
   watch_node_states_task_.Cancel();
   watch_serving_sth_task_.Cancel();
@@ -212,6 +259,13 @@ void ClusterStateController::SetNodeHostPort(const string& host,
 }
 
 
+void ClusterStateController::SetNodeRegion(const string& region) {
+  unique_lock<mutex> lock(mutex_);
+  local_node_state_.set_region(region);
+  PushLocalNodeState(lock);
+}
+
+
 void ClusterStateController::RefreshNodeState() {
   unique_lock<mutex> lock(mutex_);
   PushLocalNodeState(lock);
@@ -227,6 +281,20 @@ bool ClusterStateController::NodeIsStale() const {
 }
 
 
+void ClusterStateController::AddStalenessCallback(
+    const std::function<void()>* callback) const {
+  lock_guard<mutex> lock(staleness_callbacks_lock_);
+  CHECK(staleness_callbacks_.insert(CHECK_NOTNULL(callback)).second);
+}
+
+
+void ClusterStateController::RemoveStalenessCallback(
+    const std::function<void()>* callback) const {
+  lock_guard<mutex> lock(staleness_callbacks_lock_);
+  CHECK_EQ(1U, staleness_callbacks_.erase(callback));
+}
+
+
 vector<ClusterNodeState> ClusterStateController::GetFreshNodes() const {
   lock_guard<mutex> lock(mutex_);
   if (!actual_serving_sth_) {
@@ -250,6 +318,33 @@ vector<ClusterNodeState> ClusterStateController::GetFreshNodes() const {
 }
 
 
+bool ClusterStateController::GetNodeHostPort(const string& node_id,
+                                             string* host, int* port) const {
+  lock_guard<mutex> lock(mutex_);
+  for (const auto& node : all_peers_) {
+    const ClusterNodeState state(node.second->state());
+    if (state.node_id() == node_id) {
+      *CHECK_NOTNULL(host) = state.hostname();
+      *CHECK_NOTNULL(port) = state.log_port();
+      return true;
+    }
+  }
+  return false;
+}
+
+
+map<string, int64_t> ClusterStateController::GetReplicationLag() const {
+  lock_guard<mutex> lock(mutex_);
+  const int64_t max_tree_size(serving_sth_index_.MaxTreeSize());
+  map<string, int64_t> lag;
+  for (const auto& node : serving_sth_index_.sths()) {
+    lag.emplace_hint(lag.end(), node.first,
+                     max_tree_size - node.second.tree_size());
+  }
+  return lag;
+}
+
+
 void ClusterStateController::PushLocalNodeState(
     const unique_lock<mutex>& lock) {
   CHECK(lock.owns_lock());
@@ -265,6 +360,12 @@ void ClusterStateController::OnClusterStateUpdated(
   for (const auto& update : updates) {
     const string& node_id(update.handle_.Key());
     if (update.exists_) {
+      if (update.handle_.Entry().has_newest_sth()) {
+        serving_sth_index_.Set(node_id, update.handle_.Entry().newest_sth());
+      } else {
+        serving_sth_index_.Remove(node_id);
+      }
+
       auto it(all_peers_.find(node_id));
       VLOG_IF(1, it == all_peers_.end()) << "Node joined: " << node_id;
 
@@ -290,15 +391,23 @@ void ClusterStateController::OnClusterStateUpdated(
         // parties.
         all_peers_.emplace(node_id, peer);
         fetcher_->AddPeer(node_id, peer);
+        // We will be fetching from it (and proxying to it) soon.
+        url_fetcher_->WarmUp(
+            URL("http://" + update.handle_.Entry().hostname() + ":" +
+                to_string(update.handle_.Entry().log_port()) + "/"));
       }
     } else {
       VLOG(1) << "Node left: " << node_id;
       CHECK_EQ(static_cast<size_t>(1), all_peers_.erase(node_id));
+      serving_sth_index_.Remove(node_id);
       fetcher_->RemovePeer(node_id);
     }
   }
 
+  // Nodes might have new entries for us.
+  fetcher_->NewEntriesAvailable();
   CalculateServingSTH(lock);
+  UpdateReplicationState(lock);
 }
 
 
@@ -317,6 +426,7 @@ void ClusterStateController::OnClusterConfigUpdated(
   // May need to re-calculate the servingSTH since the ClusterConfig has
   // changed:
   CalculateServingSTH(lock);
+  UpdateReplicationState(lock);
 }
 
 
@@ -394,6 +504,7 @@ void ClusterStateController::OnServingSthUpdated(
     // All good, write this STH to our local DB:
     CHECK_EQ(Database::OK, database_->WriteTreeHead(sth_to_write));
   }
+  NotifyStaleness();
 }
 
 
@@ -402,82 +513,61 @@ void ClusterStateController::CalculateServingSTH(
   VLOG(1) << "Calculating new ServingSTH...";
   CHECK(lock.owns_lock());
 
-  // First, create a mapping of tree size to number of nodes at that size, and
-  // a mapping of the newst STH for any given size:
-  map<int64_t, SignedTreeHead> sth_by_size;
-  map<int64_t, int> num_nodes_by_sth_size;
-  for (const auto& node : all_peers_) {
-    const ClusterNodeState node_state(node.second->state());
-    if (node_state.has_newest_sth()) {
-      const int64_t tree_size(node_state.newest_sth().tree_size());
-      CHECK_LE(0, tree_size);
-      const int64_t timestamp(node_state.newest_sth().timestamp());
-      CHECK_LE(0, timestamp);
-
-      num_nodes_by_sth_size[tree_size]++;
-
-      // Default timestamp (first call in here) will be 0
-      if (node_state.newest_sth().timestamp() >
-          sth_by_size[tree_size].timestamp()) {
-        sth_by_size[tree_size] = node_state.newest_sth();
-      }
-    }
-  }
-
-  // Next calculate the newest STH we've seen which satisfies the following
+  // Calculate the newest STH we've seen which satisfies the following
   // criteria:
   //   - at least minimum_serving_nodes have an STH at least as large
   //   - at least minimum_serving_fraction have an STH at least as large
   //   - not smaller than the current serving STH
   //   - has a timestamp higher than the current serving STH
-  int num_nodes_seen(0);
-  const int current_tree_size(
+  const int64_t current_tree_size(
       calculated_serving_sth_ ? calculated_serving_sth_->tree_size() : 0);
   CHECK_LE(0, current_tree_size);
 
   bool candidates_include_current(false);
-  // Work backwards (from largest STH size) until we see that there's enough
-  // coverage (according to the criteria above) to serve an STH (or determine
-  // that there are insufficient nodes to serve anything.)
-  for (auto it = num_nodes_by_sth_size.rbegin();
-       it != num_nodes_by_sth_size.rend() && it->first >= current_tree_size;
-       ++it) {
-    // num_nodes_seen keeps track of the number of nodes we've seen so far (and
-    // since we're working from larger to smaller size STH, they should all be
-    // able to serve this [and smaller] STHs.)
-    num_nodes_seen += it->second;
-    const double serving_fraction(static_cast<double>(num_nodes_seen) /
-                                  all_peers_.size());
-    if (serving_fraction >= cluster_config_.minimum_serving_fraction() &&
-        num_nodes_seen >= cluster_config_.minimum_serving_nodes()) {
-      const SignedTreeHead& candidate_sth(sth_by_size[it->first]);
-
-      // This STH isn't a viable candidate unless its timestamp is strictly
-      // newer than any current serving STH:
-      if (actual_serving_sth_ &&
-          candidate_sth.timestamp() <= actual_serving_sth_->timestamp()) {
-        VLOG(1) << "Discarding candidate STH:\n" << candidate_sth.DebugString()
-                << "\nbecause its timestamp is <= current serving STH "
-                << "timestamp (" << actual_serving_sth_->timestamp() << ")";
-        candidates_include_current |= candidate_sth.SerializeAsString() ==
-                                      actual_serving_sth_->SerializeAsString();
-        continue;
-      }
+  // The largest tree size enough nodes have is where to start, since
+  // those nodes can also serve any smaller STH. Work backwards from
+  // there until an STH newer than the current serving STH turns up.
+  int64_t max_tree_size(
+      all_peers_.empty()
+          ? -1
+          : serving_sth_index_.CoveredTreeSize(
+                MinServingNodes(cluster_config_, all_peers_.size())));
+  while (max_tree_size >= current_tree_size) {
+    const SignedTreeHead* const candidate_sth(
+        serving_sth_index_.NewestSTHAtMost(max_tree_size));
+    if (!candidate_sth || candidate_sth->tree_size() < current_tree_size) {
+      break;
+    }
+    max_tree_size = candidate_sth->tree_size() - 1;
+
+    // This STH isn't a viable candidate unless its timestamp is strictly
+    // newer than any current serving STH:
+    if (actual_serving_sth_ &&
+        candidate_sth->timestamp() <= actual_serving_sth_->timestamp()) {
+      VLOG(1) << "Discarding candidate STH:\n" << candidate_sth->DebugString()
+              << "\nbecause its timestamp is <= current serving STH "
+              << "timestamp (" << actual_serving_sth_->timestamp() << ")";
+      candidates_include_current |= candidate_sth->SerializeAsString() ==
+                                    actual_serving_sth_->SerializeAsString();
+      continue;
+    }
 
-      LOG(INFO) << "Can serve @" << it->first << " with " << num_nodes_seen
-                << " nodes (" << (serving_fraction * 100) << "% of cluster)";
-      calculated_serving_sth_.reset(
-          new SignedTreeHead(sth_by_size[it->first]));
-      // Push this STH out to the cluster if we're master:
-      if (election_->IsMaster()) {
-        VLOG(1) << "Pushing new STH out to cluster";
-        update_required_ = true;
-        update_required_cv_.notify_all();
-      } else {
-        VLOG(1) << "Not pushing new STH to cluster since we're not the master";
-      }
-      return;
+    const size_t num_nodes(
+        serving_sth_index_.NumNodesAtLeast(candidate_sth->tree_size()));
+    LOG(INFO) << "Can serve @" << candidate_sth->tree_size() << " with "
+              << num_nodes << " nodes ("
+              << (static_cast<double>(num_nodes) / all_peers_.size() * 100)
+              << "% of cluster)";
+    calculated_serving_sth_.reset(new SignedTreeHead(*candidate_sth));
+    // Push this STH out to the cluster if we're master:
+    if (election_->IsMaster()) {
+      VLOG(1) << "Pushing new STH out to cluster";
+      update_required_ = true;
+      update_required_cv_.notify_all();
+    } else {
+      VLOG(1) << "Not pushing new STH to cluster since we're not the master";
     }
+    return;
   }
   // TODO(alcutter): Add a mechanism to take the cluster off-line until we have
   // sufficient nodes able to serve.
@@ -489,6 +579,37 @@ void ClusterStateController::CalculateServingSTH(
 }
 
 
+void ClusterStateController::UpdateReplicationState(
+    const unique_lock<mutex>& lock) {
+  CHECK(lock.owns_lock());
+
+  const int64_t max_tree_size(serving_sth_index_.MaxTreeSize());
+  for (const auto& node : serving_sth_index_.sths()) {
+    node_replication_lag_entries->Set(node.first,
+                                      max_tree_size -
+                                          node.second.tree_size());
+  }
+
+  // One node short of what is needed to serve, the largest tree size
+  // the other nodes have is what the cluster could serve next, were
+  // this node to catch up to it. If this node is already there, the
+  // fetcher will find nothing to hurry for.
+  int64_t priority_tree_size(0);
+  if (!all_peers_.empty()) {
+    const size_t num_nodes(
+        MinServingNodes(cluster_config_, all_peers_.size()));
+    if (num_nodes > 1) {
+      priority_tree_size =
+          max<int64_t>(0, serving_sth_index_.CoveredTreeSize(num_nodes - 1));
+    }
+  }
+  if (priority_tree_size != fetch_priority_tree_size_) {
+    fetch_priority_tree_size_ = priority_tree_size;
+    fetcher_->SetPriorityTreeSize(priority_tree_size);
+  }
+}
+
+
 // Thread entry point for cluster_serving_sth_update_thread_.
 void ClusterStateController::ClusterServingSTHUpdater() {
   while (true) {
@@ -515,6 +636,8 @@ void ClusterStateController::ClusterServingSTHUpdater() {
 
     if (election_->IsMaster()) {
       LOG(INFO) << "Setting cluster serving STH @ " << local_sth.timestamp();
+      const ScopedLatency latency(
+          set_serving_sth_latency_ms.GetScopedLatency());
       Status status(store_->SetServingSTH(local_sth));
       LOG_IF(WARNING, !status.ok()) << "SetServingSTH @ "
                                     << local_sth.timestamp()
@@ -526,4 +649,12 @@ void ClusterStateController::ClusterServingSTHUpdater() {
 }
 
 
+void ClusterStateController::NotifyStaleness() {
+  lock_guard<mutex> lock(staleness_callbacks_lock_);
+  for (const std::function<void()>* callback : staleness_callbacks_) {
+    (*callback)();
+  }
+}
+
+
 }  // namespace cert_trans
@@ -6,11 +6,13 @@
 #include <map>
 #include <memory>
 #include <queue>
+#include <set>
 #include <string>
 
 #include "fetcher/continuous_fetcher.h"
 #include "log/etcd_consistent_store.h"
 #include "log/logged_entry.h"
+#include "log/serving_sth_index.h"
 #include "proto/ct.pb.h"
 #include "util/libevent_wrapper.h"
 #include "util/masterelection.h"
@@ -61,15 +63,38 @@ class ClusterStateController {
   // other nodes can request entries from its database.
   void SetNodeHostPort(const std::string& host, const uint16_t port);
 
+  // Publishes the region this node runs in, so that other nodes can
+  // prefer replicating from nodes in their own region.
+  void SetNodeRegion(const std::string& region);
+
   void RefreshNodeState();
 
   bool NodeIsStale() const;
 
+  // Add/remove a callback to be called whenever NodeIsStale() may have
+  // changed its mind, that is, when the local database has a new tree
+  // head, or the cluster a new serving STH. The pointer is used as a
+  // key, so it should be the same in matching add/remove calls.
+  // Callbacks are called without any lock of this object held, and
+  // once RemoveStalenessCallback() returns, the callback is not being
+  // called anymore.
+  void AddStalenessCallback(const std::function<void()>* callback) const;
+  void RemoveStalenessCallback(const std::function<void()>* callback) const;
+
   // Returns a vector of the other nodes in the cluster which are able to serve
   // the cluster's current ServingSTH. Does not include this node in the
   // returned list regardless of its freshness.
   std::vector<ct::ClusterNodeState> GetFreshNodes() const;
 
+  // Sets |host| and |port| to where the node with ID |node_id| serves
+  // its requests, or returns false if it is not in the cluster.
+  bool GetNodeHostPort(const std::string& node_id, std::string* host,
+                       int* port) const;
+
+  // Returns, for each node which has an STH, how many entries it is
+  // behind the largest STH in the cluster, by node ID.
+  std::map<std::string, int64_t> GetReplicationLag() const;
+
  private:
   class ClusterPeer : public Peer {
    public:
@@ -79,6 +104,7 @@ class ClusterStateController {
     ClusterPeer& operator=(const ClusterPeer&) = delete;
 
     int64_t TreeSize() const override;
+    std::string Region() const override;
     void UpdateClusterNodeState(const ct::ClusterNodeState& new_state);
     ct::ClusterNodeState state() const;
     std::pair<std::string, int> GetHostPort() const;
@@ -110,6 +136,12 @@ class ClusterStateController {
   // pushed out to the consistent store.
   void CalculateServingSTH(const std::unique_lock<std::mutex>& lock);
 
+  // Updates the replication lag of the nodes, and asks the fetcher to
+  // hurry for the entries this node would need for the cluster to
+  // serve a larger STH, if the cluster is waiting on this node (among
+  // others) for them.
+  void UpdateReplicationState(const std::unique_lock<std::mutex>& lock);
+
   // Determines whether this node should be participating in the election based
   // on the current node's state.
   void DetermineElectionParticipation(
@@ -118,6 +150,9 @@ class ClusterStateController {
   // Thread entry point for ServingSTH updater thread.
   void ClusterServingSTHUpdater();
 
+  // Calls the staleness callbacks.
+  void NotifyStaleness();
+
   const std::shared_ptr<libevent::Base> base_;
   UrlFetcher* const url_fetcher_;     // Not owned by us
   Database* const database_;          // Not owned by us
@@ -132,6 +167,10 @@ class ClusterStateController {
   mutable std::mutex mutex_;  // covers the members below:
   ct::ClusterNodeState local_node_state_;
   std::map<std::string, const std::shared_ptr<ClusterPeer>> all_peers_;
+  // The newest STH of each of |all_peers_| which has one.
+  ServingSTHIndex serving_sth_index_;
+  // The last priority tree size given to |fetcher_|.
+  int64_t fetch_priority_tree_size_;
   std::unique_ptr<ct::SignedTreeHead> calculated_serving_sth_;
   std::unique_ptr<ct::SignedTreeHead> actual_serving_sth_;
   bool exiting_;
@@ -139,6 +178,13 @@ class ClusterStateController {
   std::condition_variable update_required_cv_;
   std::thread cluster_serving_sth_update_thread_;
 
+  // Held while calling the staleness callbacks, so that they are not
+  // removed while running. Never held along with |mutex_|.
+  mutable std::mutex staleness_callbacks_lock_;
+  mutable std::set<const std::function<void()>*> staleness_callbacks_;
+  // Registered with |database_|.
+  const Database::NotifySTHCallback on_new_db_sth_;
+
   friend class ClusterStateControllerTest;
 };
 
@@ -1,4 +1,6 @@
 #include <gtest/gtest.h>
+#include <atomic>
+#include <functional>
 #include <map>
 #include <memory>
 #include <string>
@@ -618,6 +620,34 @@ TEST_F(ClusterStateControllerTest, TestNodeIsStale) {
 }
 
 
+TEST_F(ClusterStateControllerTest, TestStalenessCallbacks) {
+  std::atomic<int> calls(0);
+  const std::function<void()> callback([&calls]() { ++calls; });
+  controller_.AddStalenessCallback(&callback);
+
+  // A new serving STH, which is written to the database too.
+  SignedTreeHead sth;
+  sth.set_timestamp(10000);
+  sth.set_tree_size(0);
+  store1_->SetServingSTH(sth);
+  sleep(1);
+  EXPECT_LE(2, calls.load());
+
+  // A new local tree head.
+  const int before(calls.load());
+  SignedTreeHead local_sth;
+  local_sth.set_timestamp(10001);
+  local_sth.set_tree_size(0);
+  EXPECT_EQ(Database::OK, test_db_.db()->WriteTreeHead(local_sth));
+  EXPECT_EQ(before + 1, calls.load());
+
+  controller_.RemoveStalenessCallback(&callback);
+  local_sth.set_timestamp(10002);
+  EXPECT_EQ(Database::OK, test_db_.db()->WriteTreeHead(local_sth));
+  EXPECT_EQ(before + 1, calls.load());
+}
+
+
 TEST_F(ClusterStateControllerTest, TestGetFreshNodes) {
   ClusterStateController c2(&pool_, base_, &url_fetcher_, test_db_.db(),
                             store2_.get(), &election2_, &fetcher_);
@@ -5,6 +5,9 @@
 #include <openssl/bio.h>
 #include <openssl/cms.h>
 #include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_set>
 
 #include "log/cert.h"
 #include "util/openssl_util.h"  // for LOG_OPENSSL_ERRORS
@@ -55,19 +58,12 @@ class CmsVerifier {
       BIO* cms_bio_in, const Cert& verify_cert);
 
  private:
-  // Verifies that data from a DER BIO is signed by a given certificate.
-  // and writes the unwrapped content to another BIO. NULL can be passed for
-  // cms_bio_out if the caller just wishes to verify the signature. Does
-  // not free either BIO. Does not do any checks on the content of the
-  // CMS message or validate that the CMS signature is trusted to root.
-  util::Status UnpackCmsDerBio(BIO* cms_bio_in, const Cert& certChain,
-                               BIO* cms_bio_out);
-  // Writes the unwrapped content from a CMS object to another BIO. Does
-  // not free either BIO. Does not do any checks on the content of the
-  // CMS message or validate that the CMS signature is trusted to root.
-  // The unpacked data may not be a valid X.509 cert. The caller must
-  // apply any additional checks necessary.
-  util::Status UnpackCmsDerBio(BIO* cms_bio_in, BIO* cms_bio_out);
+  // The signer certificates and messages that IsCmsSignedByCert() has
+  // verified, by the SHA256 digest of the certificate followed by that
+  // of the message, so that submitting the same message again does not
+  // verify its signature again. Bounded, and cleared when full.
+  mutable std::mutex lock_;
+  mutable std::unordered_set<std::string> verified_;
 };
 
 }  // namespace cert_trans
@@ -113,6 +113,30 @@ TEST_F(CmsVerifierTest, CmsSignTestCase4) {
 }
 
 
+TEST_F(CmsVerifierTest, CmsSignFromString) {
+  string cms_test3;
+  string cms_test4;
+  ASSERT_TRUE(util::ReadBinaryFile(cert_dir_v2_ + kCmsSignedDataTest3,
+                                   &cms_test3));
+  ASSERT_TRUE(util::ReadBinaryFile(cert_dir_v2_ + kCmsSignedDataTest4,
+                                   &cms_test4));
+
+  // The second time round, the signature of cms_test3 is not verified
+  // again, which must not change the answers.
+  for (int i = 0; i < 2; ++i) {
+    EXPECT_TRUE(
+        verifier_.IsCmsSignedByCert(cms_test3, *ca_cert_).ValueOrDie());
+    EXPECT_FALSE(
+        verifier_.IsCmsSignedByCert(cms_test3, *leaf_cert_).ValueOrDie());
+    EXPECT_FALSE(
+        verifier_.IsCmsSignedByCert(cms_test4, *ca_cert_).ValueOrDie());
+  }
+  EXPECT_THAT(verifier_.IsCmsSignedByCert(string("not CMS"), *ca_cert_)
+                  .status(),
+              StatusIs(util::error::INVALID_ARGUMENT));
+}
+
+
 TEST_F(CmsVerifierTest, CmsVerifyTestCase2) {
   ScopedBIO bio(OpenTestFileBio(cert_dir_v2_ + kCmsSignedDataTest2));
   unique_ptr<Cert> unpacked_cert(
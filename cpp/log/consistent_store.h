@@ -1,8 +1,12 @@
 #ifndef CERT_TRANS_LOG_CONSISTENT_STORE_H_
 #define CERT_TRANS_LOG_CONSISTENT_STORE_H_
 
+#include <glog/logging.h>
 #include <stdint.h>
+#include <algorithm>
+#include <functional>
 #include <mutex>
+#include <string>
 #include <vector>
 
 #include "log/logged_entry.h"
@@ -111,6 +115,42 @@ class EntryHandle : public EntryHandleBase {
 };
 
 
+// Comparator for ordering pending hashes.
+// Order by timestamp then hash.
+struct PendingEntriesOrder
+    : std::binary_function<const EntryHandle<LoggedEntry>&,
+                           const EntryHandle<LoggedEntry>&, bool> {
+  bool operator()(const EntryHandle<LoggedEntry>& x,
+                  const EntryHandle<LoggedEntry>& y) const {
+    CHECK(x.Entry().contents().sct().has_timestamp());
+    CHECK(y.Entry().contents().sct().has_timestamp());
+    const uint64_t x_time(x.Entry().contents().sct().timestamp());
+    const uint64_t y_time(y.Entry().contents().sct().timestamp());
+    if (x_time != y_time) {
+      return x_time < y_time;
+    }
+
+    // Fallback to Hash as a final tie-breaker:
+    return x.Entry().Hash() < y.Entry().Hash();
+  }
+};
+
+
+// What the sequencer needs to know of a pending entry, without the
+// entry itself.
+struct PendingEntryInfo {
+  PendingEntryInfo(const std::string& h, uint64_t t, int64_t s)
+      : hash(h), timestamp(t), size(s) {
+  }
+
+  std::string hash;
+  // The timestamp of its SCT.
+  uint64_t timestamp;
+  // The size of the serialized entry, in bytes.
+  int64_t size;
+};
+
+
 template <class T>
 struct Update {
   Update(const EntryHandle<T>& handle, bool exists)
@@ -132,6 +172,8 @@ class ConsistentStore {
                                  updates)> ClusterNodeStateCallback;
   typedef std::function<void(const Update<ct::ClusterConfig>& update)>
       ClusterConfigCallback;
+  typedef std::function<void(const std::vector<Update<LoggedEntry>>& updates)>
+      PendingEntriesCallback;
 
   ConsistentStore() = default;
   ConsistentStore(const ConsistentStore&) = delete;
@@ -147,18 +189,114 @@ class ConsistentStore {
 
   virtual util::Status AddPendingEntry(LoggedEntry* entry) = 0;
 
+  // Adds several pending entries at once, setting (*statuses)[i] to
+  // what AddPendingEntry(entries[i]) would have returned. The default
+  // implementation simply adds them one after the other.
+  virtual void AddPendingEntries(const std::vector<LoggedEntry*>& entries,
+                                 std::vector<util::Status>* statuses) {
+    statuses->clear();
+    for (LoggedEntry* entry : entries) {
+      statuses->push_back(AddPendingEntry(entry));
+    }
+  }
+
   virtual util::Status GetPendingEntryForHash(
       const std::string& hash, EntryHandle<LoggedEntry>* entry) const = 0;
 
   virtual util::Status GetPendingEntries(
       std::vector<EntryHandle<LoggedEntry>>* entries) const = 0;
 
+  // Like GetPendingEntries(), but only the entries with an SCT timestamp
+  // of at most |max_timestamp|, in PendingEntriesOrder, setting
+  // |*num_later| to the number of the others. The default
+  // implementation gets all the entries and sorts these; implementations
+  // which keep the entries in order can skip that.
+  virtual util::Status GetPendingEntriesUpTo(
+      uint64_t max_timestamp, std::vector<EntryHandle<LoggedEntry>>* entries,
+      int64_t* num_later) const {
+    std::vector<EntryHandle<LoggedEntry>> all_entries;
+    const util::Status status(GetPendingEntries(&all_entries));
+    if (!status.ok()) {
+      return status;
+    }
+    entries->clear();
+    for (auto& entry : all_entries) {
+      if (entry.Entry().timestamp() <= max_timestamp) {
+        entries->emplace_back(std::move(entry));
+      }
+    }
+    *num_later = all_entries.size() - entries->size();
+    std::sort(entries->begin(), entries->end(), PendingEntriesOrder());
+    return ::util::OkStatus();
+  }
+
+  // Like GetPendingEntriesUpTo(), but only lists the hash, timestamp
+  // and size of the entries, which implementations keeping an index of
+  // them can do without getting the entries themselves. The default
+  // implementation gets the entries.
+  virtual util::Status GetPendingEntryInfosUpTo(
+      uint64_t max_timestamp, std::vector<PendingEntryInfo>* infos,
+      int64_t* num_later) const {
+    std::vector<EntryHandle<LoggedEntry>> entries;
+    const util::Status status(
+        GetPendingEntriesUpTo(max_timestamp, &entries, num_later));
+    if (!status.ok()) {
+      return status;
+    }
+    infos->clear();
+    infos->reserve(entries.size());
+    for (const auto& entry : entries) {
+      infos->emplace_back(entry.Entry().Hash(), entry.Entry().timestamp(),
+                          entry.Entry().ByteSize());
+    }
+    return ::util::OkStatus();
+  }
+
+  // Gets the pending entries with the leaf hashes |hashes|, setting
+  // (*entries)[i] to the one for hashes[i], and (*statuses)[i] to
+  // whether it could be got, which it cannot if it is not pending. The
+  // default implementation gets them one after the other.
+  virtual void GetPendingEntriesForHashes(
+      const std::vector<std::string>& hashes,
+      std::vector<EntryHandle<LoggedEntry>>* entries,
+      std::vector<util::Status>* statuses) const {
+    entries->clear();
+    entries->resize(hashes.size());
+    statuses->clear();
+    for (size_t i = 0; i < hashes.size(); ++i) {
+      statuses->push_back(GetPendingEntryForHash(hashes[i], &(*entries)[i]));
+    }
+  }
+
   virtual util::Status GetSequenceMapping(
       EntryHandle<ct::SequenceMapping>* entry) const = 0;
 
   virtual util::Status UpdateSequenceMapping(
       EntryHandle<ct::SequenceMapping>* entry) = 0;
 
+  // Records that the pending entries just added with the leaf hashes
+  // |hashes| are to be sequenced one after the other, in that order,
+  // see ct::SequenceRange. The default implementation does not keep
+  // ranges, leaving the entries to be sequenced once they are out of
+  // the guard window.
+  virtual util::Status AddSequenceRange(
+      const std::vector<std::string>& hashes) {
+    return ::util::OkStatus();
+  }
+
+  // Gets the ranges added by AddSequenceRange() and not deleted yet,
+  // oldest first.
+  virtual util::Status GetSequenceRanges(
+      std::vector<EntryHandle<ct::SequenceRange>>* ranges) const {
+    ranges->clear();
+    return ::util::OkStatus();
+  }
+
+  virtual util::Status DeleteSequenceRange(
+      const EntryHandle<ct::SequenceRange>& range) {
+    return ::util::OkStatus();
+  }
+
   virtual util::StatusOr<ct::ClusterNodeState> GetClusterNodeState() const = 0;
 
   virtual util::Status SetClusterNodeState(
@@ -173,6 +311,9 @@ class ConsistentStore {
   virtual void WatchClusterConfig(const ClusterConfigCallback& cb,
                                   util::Task* task) = 0;
 
+  virtual void WatchPendingEntries(const PendingEntriesCallback& cb,
+                                   util::Task* task) = 0;
+
   virtual util::Status SetClusterConfig(const ct::ClusterConfig& config) = 0;
 
   // Cleans up entries in the store according to the implementation's policy.
@@ -1,31 +1,191 @@
 #include "log/database.h"
 
+#include <gflags/gflags.h>
+#include <vector>
+
+#include "util/status.h"
+#include "util/task.h"
+#include "util/thread_pool.h"
+
+using ct::SignedTreeHead;
+using std::lock_guard;
+using std::move;
+using std::mutex;
+using std::string;
+using std::unique_lock;
+using std::unique_ptr;
+using std::vector;
+
+DEFINE_bool(database_async_sth_notify, false,
+            "Call the callbacks for new STHs, such as the update of the "
+            "in-memory Merkle tree, on a thread of their own rather than "
+            "on the one writing the STH, skipping the STHs superseded "
+            "while they run.");
+
 namespace cert_trans {
+namespace {
+
+
+// Returns false, having completed |task|, if it was cancelled, or is
+// past its deadline, so that the work for it is best not started.
+bool StillWanted(util::Task* task) {
+  if (task->CancelRequested()) {
+    task->Return(util::Status::CANCELLED);
+    return false;
+  }
+  if (task->DeadlineExceeded()) {
+    task->Return(util::Status(util::error::DEADLINE_EXCEEDED,
+                              "Deadline exceeded."));
+    return false;
+  }
+  return true;
+}
+
+
+util::Status LookupStatus(ReadOnlyDatabase::LookupResult result) {
+  return result == ReadOnlyDatabase::LOOKUP_OK
+             ? util::OkStatus()
+             : util::Status(util::error::NOT_FOUND, "Entry not found.");
+}
+
+
+}  // namespace
+
+
+void ReadOnlyDatabase::LookupByHashAsync(const string& hash,
+                                         LoggedEntry* result,
+                                         util::Task* task) const {
+  CHECK_NOTNULL(result);
+  CHECK_NOTNULL(task)->executor()->Add([this, hash, result, task]() {
+    if (StillWanted(task)) {
+      task->Return(LookupStatus(LookupByHash(hash, result)));
+    }
+  });
+}
+
+
+void ReadOnlyDatabase::LookupByIndexAsync(int64_t sequence_number,
+                                          LoggedEntry* result,
+                                          util::Task* task) const {
+  CHECK_NOTNULL(result);
+  CHECK_NOTNULL(task)->executor()->Add(
+      [this, sequence_number, result, task]() {
+        if (StillWanted(task)) {
+          task->Return(LookupStatus(LookupByIndex(sequence_number, result)));
+        }
+      });
+}
+
+
+void ReadOnlyDatabase::ScanEntriesAsync(int64_t start_index,
+                                        size_t max_entries,
+                                        vector<LoggedEntry>* entries,
+                                        util::Task* task) const {
+  CHECK_GE(start_index, 0);
+  CHECK_NOTNULL(entries);
+  CHECK_NOTNULL(task)->executor()->Add(
+      [this, start_index, max_entries, entries, task]() {
+        if (StillWanted(task)) {
+          ScanEntries(start_index)->GetNextEntries(max_entries, entries);
+          task->Return();
+        }
+      });
+}
+
+
+DatabaseNotifierHelper::DatabaseNotifierHelper()
+    : owned_executor_(FLAGS_database_async_sth_notify ? new ThreadPool(1)
+                                                      : nullptr),
+      executor_(owned_executor_.get()),
+      running_(nullptr),
+      dispatching_(false) {
+}
+
+
+DatabaseNotifierHelper::DatabaseNotifierHelper(util::Executor* executor)
+    : executor_(CHECK_NOTNULL(executor)),
+      running_(nullptr),
+      dispatching_(false) {
+}
 
 
 DatabaseNotifierHelper::~DatabaseNotifierHelper() {
+  unique_lock<mutex> lock(lock_);
   CHECK(callbacks_.empty());
+  // Dispatch() may still be on its way out, with no callbacks left.
+  dispatch_done_.wait(lock, [this]() { return !dispatching_; });
 }
 
 
 void DatabaseNotifierHelper::Add(const NotifySTHCallback* callback) {
+  lock_guard<mutex> lock(lock_);
   CHECK(callbacks_.insert(callback).second);
 }
 
 
 void DatabaseNotifierHelper::Remove(const NotifySTHCallback* callback) {
+  unique_lock<mutex> lock(lock_);
   Map::iterator it(callbacks_.find(callback));
   CHECK(it != callbacks_.end());
 
   callbacks_.erase(it);
+  if (dispatch_thread_ != std::this_thread::get_id()) {
+    dispatch_done_.wait(lock,
+                        [this, callback]() { return running_ != callback; });
+  }
+}
+
+
+void DatabaseNotifierHelper::Call(const SignedTreeHead& sth) const {
+  if (!executor_) {
+    unique_lock<mutex> lock(lock_);
+    const vector<const NotifySTHCallback*> callbacks(callbacks_.begin(),
+                                                     callbacks_.end());
+    lock.unlock();
+    for (const NotifySTHCallback* callback : callbacks) {
+      (*callback)(sth);
+    }
+    return;
+  }
+
+  {
+    lock_guard<mutex> lock(lock_);
+    if (pending_ && pending_->timestamp() > sth.timestamp()) {
+      return;
+    }
+    pending_.reset(new SignedTreeHead(sth));
+    if (dispatching_) {
+      return;
+    }
+    dispatching_ = true;
+  }
+  executor_->Add([this]() { Dispatch(); });
 }
 
 
-void DatabaseNotifierHelper::Call(const ct::SignedTreeHead& sth) const {
-  for (Map::const_iterator it = callbacks_.begin(); it != callbacks_.end();
-       ++it) {
-    (**it)(sth);
+void DatabaseNotifierHelper::Dispatch() const {
+  unique_lock<mutex> lock(lock_);
+  dispatch_thread_ = std::this_thread::get_id();
+  while (pending_) {
+    const unique_ptr<SignedTreeHead> sth(move(pending_));
+    const vector<const NotifySTHCallback*> callbacks(callbacks_.begin(),
+                                                     callbacks_.end());
+    for (const NotifySTHCallback* callback : callbacks) {
+      // It may have been removed by one of the others.
+      if (callbacks_.count(callback) == 0) {
+        continue;
+      }
+      running_ = callback;
+      lock.unlock();
+      (*callback)(*sth);
+      lock.lock();
+      running_ = nullptr;
+      dispatch_done_.notify_all();
+    }
   }
+  dispatch_thread_ = std::thread::id();
+  dispatching_ = false;
+  dispatch_done_.notify_all();
 }
 
 
@@ -3,13 +3,23 @@
 
 #include <glog/logging.h>
 #include <stdint.h>
+#include <condition_variable>
 #include <functional>
 #include <memory>
+#include <mutex>
 #include <set>
+#include <string>
+#include <thread>
+#include <vector>
 
 #include "log/logged_entry.h"
 #include "proto/ct.pb.h"
 
+namespace util {
+class Executor;
+class Task;
+}  // namespace util
+
 namespace cert_trans {
 
 // This is a database interface for the log server.
@@ -44,6 +54,29 @@ class ReadOnlyDatabase {
     // If there is an entry available, fill *entry and return true,
     // otherwise return false.
     virtual bool GetNextEntry(LoggedEntry* entry) = 0;
+
+    // Replace the contents of *entries with up to |max_entries| of the
+    // next entries, and return how many there were (0 once the scan is
+    // done). Elements already in *entries are reused, so sequential
+    // readers should pass the same vector on every call.
+    // Implementations can override this to read the entries more
+    // efficiently than one at a time.
+    virtual size_t GetNextEntries(size_t max_entries,
+                                  std::vector<LoggedEntry>* entries) {
+      CHECK_NOTNULL(entries);
+      size_t count(0);
+      while (count < max_entries) {
+        if (entries->size() <= count) {
+          entries->emplace_back();
+        }
+        if (!GetNextEntry(&(*entries)[count])) {
+          break;
+        }
+        ++count;
+      }
+      entries->resize(count);
+      return count;
+    }
   };
 
   virtual ~ReadOnlyDatabase() = default;
@@ -59,12 +92,63 @@ class ReadOnlyDatabase {
   virtual LookupResult LookupByIndex(int64_t sequence_number,
                                      LoggedEntry* result) const = 0;
 
+  // Asynchronous variants of the lookups above, which complete |task|
+  // with a NOT_FOUND status if there is no such entry. *result must
+  // stay valid until |task| is done.
+  //
+  // Implementations that can answer without blocking, or that have
+  // asynchronous I/O of their own, override these. By default, the
+  // blocking lookup is run on the executor of |task|, which must then
+  // be one that can block (a ThreadPool, not a libevent::Base). Tasks
+  // cancelled, or past their deadline, before the lookup starts
+  // return CANCELLED or DEADLINE_EXCEEDED without doing it.
+  virtual void LookupByHashAsync(const std::string& hash, LoggedEntry* result,
+                                 util::Task* task) const;
+  virtual void LookupByIndexAsync(int64_t sequence_number,
+                                  LoggedEntry* result, util::Task* task) const;
+
   // Return the tree head with the freshest timestamp.
   virtual LookupResult LatestTreeHead(ct::SignedTreeHead* result) const = 0;
 
   // Scan the entries, starting with the given index.
   virtual std::unique_ptr<Iterator> ScanEntries(int64_t start_index) const = 0;
 
+  // Asynchronously replaces the contents of *entries with up to
+  // |max_entries| consecutive entries, starting with the given index,
+  // as Iterator::GetNextEntries() would, and completes |task| (with an
+  // OK status even if there are fewer, or none). As for
+  // LookupByIndexAsync(), the scan runs on the executor of |task|
+  // unless the implementation overrides this.
+  virtual void ScanEntriesAsync(int64_t start_index, size_t max_entries,
+                                std::vector<LoggedEntry>* entries,
+                                util::Task* task) const;
+
+  // Replace the contents of *leaf_hashes with the Merkle tree leaf
+  // hashes of up to |max_entries| consecutive entries, starting with
+  // the given index, and return how many there were. Implementations
+  // that store the leaf hashes alongside the entries return them
+  // without reading the entries, a small fraction of the I/O. Others,
+  // and entries stored before their leaf hash was, give fewer (down to
+  // none), and callers have to hash the rest of the entries themselves.
+  virtual size_t ReadLeafHashes(int64_t start_index, size_t max_entries,
+                                std::vector<std::string>* leaf_hashes) const {
+    CHECK_NOTNULL(leaf_hashes)->clear();
+    return 0;
+  }
+
+  // Set [*begin, *end) to a range of sequence numbers below TreeSize()
+  // holding all the entries with an SCT timestamp from |min_timestamp|
+  // to |max_timestamp| inclusive, and maybe others. Implementations that
+  // keep an index of the timestamps give a narrow range, others give
+  // all of [0, TreeSize()). Entries are sequenced roughly in timestamp
+  // order, so a window of recent timestamps gives a range near the end
+  // of the tree.
+  virtual void TimestampRange(uint64_t min_timestamp, uint64_t max_timestamp,
+                              int64_t* begin, int64_t* end) const {
+    *CHECK_NOTNULL(begin) = 0;
+    *CHECK_NOTNULL(end) = TreeSize();
+  }
+
   // Return the number of entries of contiguous entries (what could be
   // put in a signed tree head). This can be greater than the tree
   // size returned by LatestTreeHead.
@@ -85,6 +169,11 @@ class ReadOnlyDatabase {
   virtual void InitializeNode(const std::string& node_id) = 0;
   virtual LookupResult NodeId(std::string* node_id) = 0;
 
+  // Return the compact tree frontier most recently written with
+  // WriteTreeFrontier().
+  virtual LookupResult LatestTreeFrontier(
+      ct::CompactTreeFrontier* result) const = 0;
+
  protected:
   ReadOnlyDatabase() = default;
 };
@@ -119,6 +208,35 @@ class Database : public ReadOnlyDatabase {
     return CreateSequencedEntry_(logged);
   }
 
+  // Like CreateSequencedEntry(), but for a whole batch of entries at
+  // once, which implementations write with a single storage operation
+  // where they can. |logged| must be sorted by strictly increasing
+  // sequence number. Entries are processed in order, stopping at the
+  // first one that cannot be created, whose result is returned; the
+  // entries before it may or may not have been written.
+  WriteResult CreateSequencedEntries(const std::vector<LoggedEntry>& logged) {
+    for (std::vector<LoggedEntry>::const_iterator it(logged.begin());
+         it != logged.end(); ++it) {
+      CHECK(it->has_sequence_number());
+      CHECK_GE(it->sequence_number(), 0);
+      if (it != logged.begin()) {
+        CHECK_LT((it - 1)->sequence_number(), it->sequence_number());
+      }
+    }
+    return CreateSequencedEntries_(logged);
+  }
+
+  // Hints that a large number of entries, mostly in increasing
+  // sequence number order, is about to be created, as when a mirror
+  // catches up with its target log. Implementations can defer work
+  // they would otherwise do for every entry until EndBulkLoad() is
+  // called, so LookupByHash() might not find the entries created in
+  // the meantime. Calls must not be nested.
+  virtual void BeginBulkLoad() {
+  }
+  virtual void EndBulkLoad() {
+  }
+
   // Attempt to write a tree head. Fails only if a tree head with this
   // timestamp already exists (i.e., |timestamp| is primary key). Does
   // not check that the timestamp is newer than previous entries.
@@ -128,33 +246,74 @@ class Database : public ReadOnlyDatabase {
     return WriteTreeHead_(sth);
   }
 
+  // Store the frontier of the tree signer's compact tree, replacing
+  // any previous one, so that a restarted signer can resume from it
+  // instead of rebuilding its tree from every entry.
+  virtual void WriteTreeFrontier(const ct::CompactTreeFrontier& frontier) = 0;
+
  protected:
   Database() = default;
 
   // See the inline methods with similar names defined above for more
   // documentation.
   virtual WriteResult CreateSequencedEntry_(const LoggedEntry& logged) = 0;
+  virtual WriteResult CreateSequencedEntries_(
+      const std::vector<LoggedEntry>& logged) = 0;
   virtual WriteResult WriteTreeHead_(const ct::SignedTreeHead& sth) = 0;
 };
 
 
+// Keeps the callbacks registered for new STHs, and calls them.
+//
+// By default, Call() runs the callbacks right away, on the thread
+// writing the STH. With an executor (or --database_async_sth_notify),
+// it only hands the STH over and returns, and the callbacks run on the
+// executor, one STH at a time. STHs that arrive while the callbacks
+// are busy are coalesced: only the newest one is passed on next, as
+// each STH supersedes the previous ones. This way, writing an STH
+// never waits for readers such as LogLookup to catch up with it.
 class DatabaseNotifierHelper {
  public:
   typedef std::function<void(const ct::SignedTreeHead&)> NotifySTHCallback;
 
-  DatabaseNotifierHelper() = default;
+  DatabaseNotifierHelper();
+  // Calls the callbacks on |executor|, which must outlive this object.
+  explicit DatabaseNotifierHelper(util::Executor* executor);
+  // Waits for the callbacks that are running, if any.
   ~DatabaseNotifierHelper();
   DatabaseNotifierHelper(const DatabaseNotifierHelper&) = delete;
   DatabaseNotifierHelper& operator=(const DatabaseNotifierHelper&) = delete;
 
   void Add(const NotifySTHCallback* callback);
+  // Also waits for |callback| to return if it is running on the
+  // executor (unless this is called from a callback), so that it can be
+  // destroyed once this returns.
   void Remove(const NotifySTHCallback* callback);
   void Call(const ct::SignedTreeHead& sth) const;
 
  private:
   typedef std::set<const NotifySTHCallback*> Map;
 
+  // Passes on the pending STHs, until there are none left.
+  void Dispatch() const;
+
+  // Set if this object has its own thread for the callbacks.
+  const std::unique_ptr<util::Executor> owned_executor_;
+  // Null if the callbacks are called synchronously.
+  util::Executor* const executor_;
+
+  // Not held while calling the callbacks.
+  mutable std::mutex lock_;
   Map callbacks_;
+  // The callback that Dispatch() is running, if any.
+  mutable const NotifySTHCallback* running_;
+  // The newest STH given to Call() that is not passed on yet.
+  mutable std::unique_ptr<ct::SignedTreeHead> pending_;
+  // Set while Dispatch() is scheduled or running.
+  mutable bool dispatching_;
+  mutable std::thread::id dispatch_thread_;
+  // Signalled whenever |running_| or |dispatching_| is reset.
+  mutable std::condition_variable dispatch_done_;
 };
 
 
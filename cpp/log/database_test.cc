@@ -1,32 +1,70 @@
 /* -*- indent-tabs-mode: nil -*- */
+#include <gflags/gflags.h>
 #include <gtest/gtest.h>
+#include <leveldb/db.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <atomic>
+#include <memory>
+#include <mutex>
 #include <set>
 #include <string>
+#include <thread>
+#include <vector>
 
+#include "base/notification.h"
+#include "log/caching_db.h"
 #include "log/database.h"
 #include "log/file_db.h"
 #include "log/file_storage.h"
 #include "log/leveldb_db.h"
 #include "log/logged_entry.h"
+#ifdef HAVE_ROCKSDB
+#include "log/rocksdb_db.h"
+#endif
+#include "log/segmented_db.h"
 #include "log/sqlite_db.h"
 #include "log/test_db.h"
 #include "log/test_signer.h"
+#include "merkletree/serial_hasher.h"
+#include "merkletree/tree_hasher.h"
 #include "proto/cert_serializer.h"
+#include "util/status_test_util.h"
+#include "util/sync_task.h"
 #include "util/testing.h"
+#include "util/thread_pool.h"
 #include "util/util.h"
 
+DECLARE_bool(leveldb_deduplicate_chains);
+DECLARE_int64(leveldb_hash_filter_interval);
+DECLARE_int32(leveldb_schema_version);
+DECLARE_int32(segmented_db_cold_cache_segments);
+DECLARE_string(segmented_db_cold_dir);
+DECLARE_int32(segmented_db_entries_per_segment);
+DECLARE_int32(segmented_db_hot_segments);
+
 // TODO(benl): Introduce a test |Logged| type.
 
 namespace {
 
+using cert_trans::CachingDatabase;
 using cert_trans::Database;
+using cert_trans::DatabaseNotifierHelper;
 using cert_trans::FileDB;
 using cert_trans::LevelDB;
 using cert_trans::LoggedEntry;
+using cert_trans::Notification;
+#ifdef HAVE_ROCKSDB
+using cert_trans::RocksDB;
+#endif
+using cert_trans::SegmentedDB;
 using cert_trans::SQLiteDB;
+using cert_trans::ThreadPool;
 using ct::SignedTreeHead;
 using std::string;
 using std::unique_ptr;
+using std::vector;
 
 
 template <class T>
@@ -46,7 +84,13 @@ class DBTest : public ::testing::Test {
   TestSigner test_signer_;
 };
 
-typedef testing::Types<FileDB, SQLiteDB, LevelDB> Databases;
+#ifdef HAVE_ROCKSDB
+typedef testing::Types<FileDB, SQLiteDB, LevelDB, SegmentedDB,
+                       CachingDatabase, RocksDB> Databases;
+#else
+typedef testing::Types<FileDB, SQLiteDB, LevelDB, SegmentedDB,
+                       CachingDatabase> Databases;
+#endif
 
 
 template <class T>
@@ -172,6 +216,134 @@ TYPED_TEST(DBTest, CreateSequencedDuplicateSequenceNumber) {
 }
 
 
+TYPED_TEST(DBTest, CreateSequencedBatch) {
+  vector<LoggedEntry> batch(5);
+  for (size_t i = 0; i < batch.size(); ++i) {
+    this->test_signer_.CreateUnique(&batch[i]);
+    batch[i].set_sequence_number(i);
+  }
+
+  // Entries already present with identical contents are fine.
+  EXPECT_EQ(Database::OK, this->db()->CreateSequencedEntry(batch[1]));
+
+  EXPECT_EQ(Database::OK, this->db()->CreateSequencedEntries(batch));
+  EXPECT_EQ(5, this->db()->TreeSize());
+
+  for (const auto& logged_cert : batch) {
+    LoggedEntry lookup_cert;
+    EXPECT_EQ(Database::LOOKUP_OK,
+              this->db()->LookupByIndex(logged_cert.sequence_number(),
+                                        &lookup_cert));
+    TestSigner::TestEqualLoggedCerts(logged_cert, lookup_cert);
+
+    lookup_cert.Clear();
+    EXPECT_EQ(Database::LOOKUP_OK,
+              this->db()->LookupByHash(logged_cert.Hash(), &lookup_cert));
+    TestSigner::TestEqualLoggedCerts(logged_cert, lookup_cert);
+  }
+
+  // An empty batch is a no-op.
+  EXPECT_EQ(Database::OK,
+            this->db()->CreateSequencedEntries(vector<LoggedEntry>()));
+  EXPECT_EQ(5, this->db()->TreeSize());
+}
+
+
+TYPED_TEST(DBTest, BulkLoad) {
+  LoggedEntry existing;
+  this->test_signer_.CreateUnique(&existing);
+  existing.set_sequence_number(0);
+  EXPECT_EQ(Database::OK, this->db()->CreateSequencedEntry(existing));
+
+  this->db()->BeginBulkLoad();
+  vector<LoggedEntry> batch(5);
+  for (size_t i = 0; i < batch.size(); ++i) {
+    this->test_signer_.CreateUnique(&batch[i]);
+    batch[i].set_sequence_number(i + 1);
+  }
+  EXPECT_EQ(Database::OK, this->db()->CreateSequencedEntries(batch));
+  // Entries are still checked against existing ones.
+  LoggedEntry conflicting;
+  this->test_signer_.CreateUnique(&conflicting);
+  conflicting.set_sequence_number(1);
+  EXPECT_EQ(Database::SEQUENCE_NUMBER_ALREADY_IN_USE,
+            this->db()->CreateSequencedEntry(conflicting));
+  EXPECT_EQ(6, this->db()->TreeSize());
+  this->db()->EndBulkLoad();
+
+  // Everything can be found by hash once the bulk load is over.
+  LoggedEntry lookup_cert;
+  EXPECT_EQ(Database::LOOKUP_OK,
+            this->db()->LookupByHash(existing.Hash(), &lookup_cert));
+  TestSigner::TestEqualLoggedCerts(existing, lookup_cert);
+  for (const auto& logged_cert : batch) {
+    lookup_cert.Clear();
+    EXPECT_EQ(Database::LOOKUP_OK,
+              this->db()->LookupByHash(logged_cert.Hash(), &lookup_cert));
+    TestSigner::TestEqualLoggedCerts(logged_cert, lookup_cert);
+  }
+}
+
+
+TYPED_TEST(DBTest, CreateSequencedBatchDuplicateSequenceNumber) {
+  vector<LoggedEntry> batch(3);
+  for (size_t i = 0; i < batch.size(); ++i) {
+    this->test_signer_.CreateUnique(&batch[i]);
+    batch[i].set_sequence_number(i);
+  }
+
+  LoggedEntry existing;
+  this->test_signer_.CreateUnique(&existing);
+  existing.set_sequence_number(1);
+  EXPECT_EQ(Database::OK, this->db()->CreateSequencedEntry(existing));
+
+  EXPECT_EQ(Database::SEQUENCE_NUMBER_ALREADY_IN_USE,
+            this->db()->CreateSequencedEntries(batch));
+
+  // The entry before the conflict was written, the original entry at
+  // the conflicting sequence number is untouched, and nothing after
+  // the conflict was.
+  LoggedEntry lookup_cert;
+  EXPECT_EQ(Database::LOOKUP_OK,
+            this->db()->LookupByIndex(0, &lookup_cert));
+  TestSigner::TestEqualLoggedCerts(batch[0], lookup_cert);
+  lookup_cert.Clear();
+  EXPECT_EQ(Database::LOOKUP_OK,
+            this->db()->LookupByIndex(1, &lookup_cert));
+  TestSigner::TestEqualLoggedCerts(existing, lookup_cert);
+  EXPECT_EQ(Database::NOT_FOUND, this->db()->LookupByIndex(2, &lookup_cert));
+  EXPECT_EQ(2, this->db()->TreeSize());
+}
+
+
+TYPED_TEST(DBTest, CreateSequencedBatchRepeatedSequenceNumber) {
+  vector<LoggedEntry> batch(3);
+  for (size_t i = 0; i < batch.size(); ++i) {
+    this->test_signer_.CreateUnique(&batch[i]);
+    batch[i].set_sequence_number(i);
+  }
+  // The same entry twice is fine.
+  batch.push_back(batch[1]);
+  EXPECT_EQ(Database::OK, this->db()->CreateSequencedEntries(batch));
+  EXPECT_EQ(3, this->db()->TreeSize());
+
+  // Another entry under a sequence number already in the batch is not.
+  vector<LoggedEntry> conflicting(2);
+  this->test_signer_.CreateUnique(&conflicting[0]);
+  conflicting[0].set_sequence_number(3);
+  this->test_signer_.CreateUnique(&conflicting[1]);
+  conflicting[1].set_sequence_number(3);
+  EXPECT_EQ(Database::SEQUENCE_NUMBER_ALREADY_IN_USE,
+            this->db()->CreateSequencedEntries(conflicting));
+
+  LoggedEntry lookup_cert;
+  EXPECT_EQ(Database::LOOKUP_OK,
+            this->db()->LookupByIndex(3, &lookup_cert));
+  TestSigner::TestEqualLoggedCerts(conflicting[0], lookup_cert);
+  EXPECT_EQ(4, this->db()->TreeSize());
+}
+
+
 TYPED_TEST(DBTest, TreeSize) {
   LoggedEntry logged_cert;
 
@@ -218,6 +390,24 @@ TYPED_TEST(DBTest, TreeSize) {
 }
 
 
+TYPED_TEST(DBTest, TimestampRange) {
+  LoggedEntry logged_cert;
+  for (int i = 0; i < 10; ++i) {
+    this->test_signer_.CreateUnique(&logged_cert);
+    logged_cert.set_sequence_number(i);
+    logged_cert.mutable_sct()->set_timestamp(1000 + i);
+    ASSERT_EQ(Database::OK, this->db()->CreateSequencedEntry(logged_cert));
+  }
+
+  int64_t begin;
+  int64_t end;
+  this->db()->TimestampRange(1004, 1006, &begin, &end);
+  EXPECT_LE(begin, 4);
+  EXPECT_GE(end, 7);
+  EXPECT_LE(end, 10);
+}
+
+
 TYPED_TEST(DBTest, LookupBySequenceNumber) {
   LoggedEntry logged_cert, logged_cert2, lookup_cert, lookup_cert2;
   this->test_signer_.CreateUnique(&logged_cert);
@@ -242,6 +432,106 @@ TYPED_TEST(DBTest, LookupBySequenceNumber) {
 }
 
 
+TYPED_TEST(DBTest, AsyncLookups) {
+  vector<LoggedEntry> logged(3);
+  for (int i = 0; i < 3; ++i) {
+    this->test_signer_.CreateUnique(&logged[i]);
+    logged[i].set_sequence_number(i);
+  }
+  EXPECT_EQ(Database::OK, this->db()->CreateSequencedEntries(logged));
+
+  ThreadPool pool(2);
+  LoggedEntry lookup_cert;
+  {
+    util::SyncTask task(&pool);
+    this->db()->LookupByIndexAsync(1, &lookup_cert, task.task());
+    task.Wait();
+    ASSERT_OK(task.status());
+    TestSigner::TestEqualLoggedCerts(logged[1], lookup_cert);
+  }
+  {
+    util::SyncTask task(&pool);
+    this->db()->LookupByHashAsync(logged[2].Hash(), &lookup_cert,
+                                  task.task());
+    task.Wait();
+    ASSERT_OK(task.status());
+    TestSigner::TestEqualLoggedCerts(logged[2], lookup_cert);
+  }
+  {
+    util::SyncTask task(&pool);
+    this->db()->LookupByIndexAsync(3, &lookup_cert, task.task());
+    task.Wait();
+    EXPECT_EQ(util::error::NOT_FOUND, task.status().CanonicalCode());
+  }
+
+  vector<LoggedEntry> entries;
+  {
+    util::SyncTask task(&pool);
+    this->db()->ScanEntriesAsync(1, 5, &entries, task.task());
+    task.Wait();
+    ASSERT_OK(task.status());
+    ASSERT_EQ(2U, entries.size());
+    TestSigner::TestEqualLoggedCerts(logged[1], entries[0]);
+    TestSigner::TestEqualLoggedCerts(logged[2], entries[1]);
+  }
+}
+
+
+// Entries are found as soon as they are written, by lookups running
+// alongside the writes.
+TYPED_TEST(DBTest, LookupsWhileWriting) {
+  const int kNumEntries(500);
+  vector<LoggedEntry> entries(kNumEntries);
+  for (int i = 0; i < kNumEntries; ++i) {
+    this->test_signer_.CreateUnique(&entries[i]);
+    entries[i].set_sequence_number(i);
+  }
+
+  std::atomic<int> num_written(0);
+  std::atomic<int> num_failures(0);
+  vector<std::thread> readers;
+  for (int i = 0; i < 4; ++i) {
+    readers.emplace_back([this, &entries, &num_written, &num_failures]() {
+      int written;
+      while ((written = num_written.load()) < kNumEntries) {
+        if (written == 0) {
+          continue;
+        }
+        // The latest entry, and one that is likely to be committed.
+        for (const int index : {written - 1, written / 2}) {
+          LoggedEntry by_index, by_hash;
+          if (this->db()->LookupByIndex(index, &by_index) !=
+                  Database::LOOKUP_OK ||
+              by_index.Hash() != entries[index].Hash() ||
+              this->db()->LookupByHash(entries[index].Hash(), &by_hash) !=
+                  Database::LOOKUP_OK ||
+              by_hash.sequence_number() != index) {
+            ++num_failures;
+          }
+        }
+      }
+    });
+  }
+
+  for (int i = 0; i < kNumEntries; ++i) {
+    ASSERT_EQ(Database::OK, this->db()->CreateSequencedEntry(entries[i]));
+    if (i % 100 == 99) {
+      SignedTreeHead sth;
+      sth.set_timestamp(i);
+      sth.set_tree_size(i + 1);
+      EXPECT_EQ(Database::OK, this->db()->WriteTreeHead(sth));
+    }
+    num_written.store(i + 1);
+  }
+  for (auto& reader : readers) {
+    reader.join();
+  }
+
+  EXPECT_EQ(0, num_failures.load());
+  EXPECT_EQ(kNumEntries, this->db()->TreeSize());
+}
+
+
 TYPED_TEST(DBTest, WriteTreeHead) {
   SignedTreeHead sth, lookup_sth;
   this->test_signer_.CreateUnique(&sth);
@@ -353,6 +643,37 @@ TYPED_TEST(DBTest, ResumeEmpty) {
 }
 
 
+TYPED_TEST(DBTest, TreeFrontier) {
+  ct::CompactTreeFrontier lookup_frontier;
+  EXPECT_EQ(Database::NOT_FOUND,
+            this->db()->LatestTreeFrontier(&lookup_frontier));
+
+  ct::CompactTreeFrontier frontier;
+  frontier.set_tree_size(5);
+  frontier.add_node("leaf");
+  frontier.add_node("");
+  frontier.add_node("node");
+  frontier.set_sha256_root_hash("root");
+  this->db()->WriteTreeFrontier(frontier);
+
+  // A newer frontier replaces the previous one.
+  frontier.set_tree_size(6);
+  frontier.set_node(0, "");
+  frontier.set_node(1, "other");
+  frontier.set_sha256_root_hash("root2");
+  this->db()->WriteTreeFrontier(frontier);
+
+  EXPECT_EQ(Database::LOOKUP_OK,
+            this->db()->LatestTreeFrontier(&lookup_frontier));
+  EXPECT_EQ(frontier.SerializeAsString(), lookup_frontier.SerializeAsString());
+
+  std::unique_ptr<Database> db2(this->test_db_.SecondDB());
+  lookup_frontier.Clear();
+  EXPECT_EQ(Database::LOOKUP_OK, db2->LatestTreeFrontier(&lookup_frontier));
+  EXPECT_EQ(frontier.SerializeAsString(), lookup_frontier.SerializeAsString());
+}
+
+
 TYPED_TEST(DBTest, NodeId) {
   const string kNodeId("node_id");
   this->db()->InitializeNode(kNodeId);
@@ -428,6 +749,521 @@ TYPED_TEST(DBTest, Iterator) {
 }
 
 
+TYPED_TEST(DBTest, IteratorBatches) {
+  vector<LoggedEntry> logged_certs(5);
+  for (size_t i = 0; i < logged_certs.size(); ++i) {
+    this->test_signer_.CreateUnique(&logged_certs[i]);
+    logged_certs[i].set_sequence_number(i * 2);
+    ASSERT_EQ(Database::OK,
+              this->db()->CreateSequencedEntry(logged_certs[i]));
+  }
+
+  unique_ptr<Database::Iterator> it(this->db()->ScanEntries(1));
+  vector<LoggedEntry> batch(10);
+  ASSERT_EQ(3U, it->GetNextEntries(3, &batch));
+  ASSERT_EQ(3U, batch.size());
+  for (size_t i = 0; i < batch.size(); ++i) {
+    TestSigner::TestEqualLoggedCerts(logged_certs[i + 1], batch[i]);
+  }
+
+  ASSERT_EQ(1U, it->GetNextEntries(3, &batch));
+  ASSERT_EQ(1U, batch.size());
+  TestSigner::TestEqualLoggedCerts(logged_certs[4], batch[0]);
+
+  EXPECT_EQ(0U, it->GetNextEntries(3, &batch));
+  EXPECT_TRUE(batch.empty());
+}
+
+
+// Databases written before the hash index existed only have the
+// entries themselves; opening them builds the index.
+TEST(LevelDBTest, IndexesOldDatabase) {
+  FLAGS_leveldb_schema_version = 1;
+  TmpStorage tmp;
+  const string path(tmp.TmpStorageDir() + "/leveldb");
+  TestSigner test_signer;
+  vector<LoggedEntry> logged_certs(3);
+  {
+    LevelDB db(path);
+    for (size_t i = 0; i < logged_certs.size(); ++i) {
+      test_signer.CreateUnique(&logged_certs[i]);
+      // Leave a gap after the first entry.
+      logged_certs[i].set_sequence_number(i == 0 ? 0 : i + 1);
+      ASSERT_EQ(Database::OK, db.CreateSequencedEntry(logged_certs[i]));
+    }
+  }
+
+  {
+    leveldb::DB* raw_db;
+    ASSERT_TRUE(leveldb::DB::Open(leveldb::Options(), path, &raw_db).ok());
+    const unique_ptr<leveldb::DB> db(raw_db);
+    const unique_ptr<leveldb::Iterator> it(
+        db->NewIterator(leveldb::ReadOptions()));
+    for (it->SeekToFirst(); it->Valid(); it->Next()) {
+      if (!it->key().starts_with("entry-")) {
+        ASSERT_TRUE(db->Delete(leveldb::WriteOptions(), it->key()).ok());
+      }
+    }
+  }
+
+  for (int reopen = 0; reopen < 2; ++reopen) {
+    LevelDB db(path);
+    EXPECT_EQ(1, db.TreeSize());
+    for (const auto& logged : logged_certs) {
+      LoggedEntry lookup_cert;
+      ASSERT_EQ(Database::LOOKUP_OK,
+                db.LookupByHash(logged.Hash(), &lookup_cert));
+      TestSigner::TestEqualLoggedCerts(logged, lookup_cert);
+    }
+  }
+  FLAGS_leveldb_schema_version = 2;
+}
+
+
+TEST(LevelDBTest, UpgradesSchema) {
+  FLAGS_leveldb_schema_version = 1;
+  TmpStorage tmp;
+  const string path(tmp.TmpStorageDir() + "/leveldb");
+  TestSigner test_signer;
+  vector<LoggedEntry> logged_certs(3);
+  {
+    LevelDB db(path);
+    for (size_t i = 0; i < logged_certs.size(); ++i) {
+      test_signer.CreateUnique(&logged_certs[i]);
+      // Leave a gap after the first entry.
+      logged_certs[i].set_sequence_number(i == 0 ? 0 : i + 1);
+      ASSERT_EQ(Database::OK, db.CreateSequencedEntry(logged_certs[i]));
+    }
+  }
+  FLAGS_leveldb_schema_version = 2;
+
+  // Doing it again does no harm.
+  LevelDB::UpgradeSchema(path);
+  LevelDB::UpgradeSchema(path);
+
+  {
+    leveldb::DB* raw_db;
+    ASSERT_TRUE(leveldb::DB::Open(leveldb::Options(), path, &raw_db).ok());
+    const unique_ptr<leveldb::DB> db(raw_db);
+    const unique_ptr<leveldb::Iterator> it(
+        db->NewIterator(leveldb::ReadOptions()));
+    int num_entries(0);
+    for (it->Seek("entry-"); it->Valid() && it->key().starts_with("entry-");
+         it->Next()) {
+      EXPECT_EQ(strlen("entry-") + sizeof(int64_t), it->key().size());
+      ++num_entries;
+    }
+    EXPECT_EQ(static_cast<int>(logged_certs.size()), num_entries);
+  }
+
+  LevelDB db(path);
+  EXPECT_EQ(1, db.TreeSize());
+  for (const auto& logged : logged_certs) {
+    LoggedEntry lookup_cert;
+    ASSERT_EQ(Database::LOOKUP_OK,
+              db.LookupByHash(logged.Hash(), &lookup_cert));
+    TestSigner::TestEqualLoggedCerts(logged, lookup_cert);
+    ASSERT_EQ(Database::LOOKUP_OK,
+              db.LookupByIndex(logged.sequence_number(), &lookup_cert));
+    TestSigner::TestEqualLoggedCerts(logged, lookup_cert);
+  }
+  vector<string> leaf_hashes;
+  EXPECT_EQ(1U, db.ReadLeafHashes(0, 10, &leaf_hashes));
+  EXPECT_EQ(2U, db.ReadLeafHashes(2, 10, &leaf_hashes));
+}
+
+
+TEST(LevelDBTest, DeduplicatesChains) {
+  TmpStorage tmp;
+  const string path(tmp.TmpStorageDir() + "/leveldb");
+  TestSigner test_signer;
+  vector<LoggedEntry> logged_certs(4);
+  for (size_t i = 0; i < logged_certs.size(); ++i) {
+    test_signer.CreateUnique(&logged_certs[i]);
+    logged_certs[i].set_sequence_number(i);
+    // All of them share the same chain.
+    ct::LogEntry* const entry(logged_certs[i].mutable_entry());
+    google::protobuf::RepeatedPtrField<string>* const chain(
+        entry->type() == ct::X509_ENTRY
+            ? entry->mutable_x509_entry()->mutable_certificate_chain()
+            : entry->mutable_precert_entry()
+                  ->mutable_precertificate_chain());
+    chain->Clear();
+    *chain->Add() = "intermediate";
+    *chain->Add() = "root";
+    ASSERT_TRUE(logged_certs[i].StoreServingData());
+  }
+
+  {
+    LevelDB db(path);
+    // Entries stored before deduplication was turned on stay readable.
+    ASSERT_EQ(Database::OK, db.CreateSequencedEntry(logged_certs[0]));
+    FLAGS_leveldb_deduplicate_chains = true;
+    ASSERT_EQ(Database::OK, db.CreateSequencedEntry(logged_certs[0]));
+    ASSERT_EQ(Database::OK, db.CreateSequencedEntries(vector<LoggedEntry>(
+                                logged_certs.begin() + 1, logged_certs.end())));
+  }
+
+  for (int reopen = 0; reopen < 2; ++reopen) {
+    LevelDB db(path);
+    EXPECT_EQ(static_cast<int64_t>(logged_certs.size()), db.TreeSize());
+    const unique_ptr<Database::Iterator> it(db.ScanEntries(0));
+    for (const auto& logged : logged_certs) {
+      LoggedEntry lookup_cert;
+      ASSERT_EQ(Database::LOOKUP_OK,
+                db.LookupByHash(logged.Hash(), &lookup_cert));
+      TestSigner::TestEqualLoggedCerts(logged, lookup_cert);
+      string extra_data, buffer;
+      ASSERT_TRUE(logged.SerializeExtraData(&extra_data));
+      EXPECT_EQ(extra_data, *CHECK_NOTNULL(lookup_cert.ExtraData(&buffer)));
+
+      ASSERT_TRUE(it->GetNextEntry(&lookup_cert));
+      TestSigner::TestEqualLoggedCerts(logged, lookup_cert);
+    }
+  }
+  FLAGS_leveldb_deduplicate_chains = false;
+
+  leveldb::DB* raw_db;
+  ASSERT_TRUE(leveldb::DB::Open(leveldb::Options(), path, &raw_db).ok());
+  const unique_ptr<leveldb::DB> db(raw_db);
+  const unique_ptr<leveldb::Iterator> it(
+      db->NewIterator(leveldb::ReadOptions()));
+  int num_chain_certs(0);
+  for (it->Seek("chain-"); it->Valid() && it->key().starts_with("chain-");
+       it->Next()) {
+    ++num_chain_certs;
+  }
+  EXPECT_EQ(2, num_chain_certs);
+}
+
+
+TEST(LevelDBTest, StoresLeafHashes) {
+  TmpStorage tmp;
+  LevelDB db(tmp.TmpStorageDir() + "/leveldb");
+  TestSigner test_signer;
+  const TreeHasher hasher(unique_ptr<SerialHasher>(new Sha256Hasher));
+  vector<LoggedEntry> logged_certs(3);
+  vector<string> expected;
+  for (size_t i = 0; i < logged_certs.size(); ++i) {
+    test_signer.CreateUnique(&logged_certs[i]);
+    // Leave a gap before the last entry.
+    logged_certs[i].set_sequence_number(i < 2 ? i : i + 1);
+    ASSERT_EQ(Database::OK, db.CreateSequencedEntry(logged_certs[i]));
+    string serialized_leaf;
+    ASSERT_TRUE(logged_certs[i].SerializeForLeaf(&serialized_leaf));
+    expected.push_back(hasher.HashLeaf(serialized_leaf));
+  }
+
+  vector<string> leaf_hashes;
+  EXPECT_EQ(2U, db.ReadLeafHashes(0, 10, &leaf_hashes));
+  EXPECT_EQ(vector<string>(expected.begin(), expected.begin() + 2),
+            leaf_hashes);
+  EXPECT_EQ(1U, db.ReadLeafHashes(1, 1, &leaf_hashes));
+  EXPECT_EQ(vector<string>(1, expected[1]), leaf_hashes);
+  EXPECT_EQ(0U, db.ReadLeafHashes(2, 10, &leaf_hashes));
+  EXPECT_TRUE(leaf_hashes.empty());
+  EXPECT_EQ(1U, db.ReadLeafHashes(3, 10, &leaf_hashes));
+  EXPECT_EQ(vector<string>(1, expected[2]), leaf_hashes);
+}
+
+
+// More entries than the smallest hash filter is sized for, so that it
+// gets rebuilt bigger, and written out along the way.
+TEST(LevelDBTest, KeepsHashFilter) {
+  FLAGS_leveldb_hash_filter_interval = 100;
+  TmpStorage tmp;
+  const string path(tmp.TmpStorageDir() + "/leveldb");
+  TestSigner test_signer;
+  vector<LoggedEntry> logged_certs(1500);
+  for (size_t i = 0; i < logged_certs.size(); ++i) {
+    test_signer.CreateUnique(&logged_certs[i]);
+    logged_certs[i].set_sequence_number(i);
+  }
+
+  {
+    LevelDB db(path);
+    for (size_t i = 0; i < logged_certs.size(); i += 50) {
+      ASSERT_EQ(Database::OK,
+                db.CreateSequencedEntries(vector<LoggedEntry>(
+                    logged_certs.begin() + i, logged_certs.begin() + i + 50)));
+    }
+    for (const auto& logged : logged_certs) {
+      EXPECT_EQ(Database::LOOKUP_OK, db.LookupByHash(logged.Hash(), nullptr));
+    }
+  }
+
+  for (int reopen = 0; reopen < 2; ++reopen) {
+    LevelDB db(path);
+    for (const auto& logged : logged_certs) {
+      EXPECT_EQ(Database::LOOKUP_OK, db.LookupByHash(logged.Hash(), nullptr));
+    }
+    LoggedEntry unknown;
+    test_signer.CreateUnique(&unknown);
+    EXPECT_EQ(Database::NOT_FOUND, db.LookupByHash(unknown.Hash(), nullptr));
+    // Adding after reopening goes in the filter too.
+    unknown.set_sequence_number(logged_certs.size() + reopen);
+    ASSERT_EQ(Database::OK, db.CreateSequencedEntry(unknown));
+    EXPECT_EQ(Database::LOOKUP_OK, db.LookupByHash(unknown.Hash(), nullptr));
+  }
+  FLAGS_leveldb_hash_filter_interval = 1000000;
+}
+
+
+TEST(SegmentedDBTest, SpansSegments) {
+  FLAGS_segmented_db_entries_per_segment = 4;
+  TmpStorage tmp;
+  const string path(tmp.TmpStorageDir() + "/segmented");
+  TestSigner test_signer;
+  vector<LoggedEntry> logged_certs(10);
+  {
+    SegmentedDB db(path);
+    // Write them backwards, so that the segments fill out of order.
+    for (int i = logged_certs.size() - 1; i >= 0; --i) {
+      test_signer.CreateUnique(&logged_certs[i]);
+      logged_certs[i].set_sequence_number(i);
+      ASSERT_EQ(Database::OK, db.CreateSequencedEntry(logged_certs[i]));
+    }
+  }
+
+  // The segment size is that of the database, not of the flag.
+  FLAGS_segmented_db_entries_per_segment = 3;
+  SegmentedDB db(path);
+  EXPECT_EQ(10, db.TreeSize());
+  for (const auto& logged : logged_certs) {
+    LoggedEntry lookup_cert;
+    ASSERT_EQ(Database::LOOKUP_OK,
+              db.LookupByHash(logged.Hash(), &lookup_cert));
+    TestSigner::TestEqualLoggedCerts(logged, lookup_cert);
+  }
+
+  unique_ptr<Database::Iterator> it(db.ScanEntries(3));
+  LoggedEntry entry;
+  for (size_t i = 3; i < logged_certs.size(); ++i) {
+    ASSERT_TRUE(it->GetNextEntry(&entry));
+    TestSigner::TestEqualLoggedCerts(logged_certs[i], entry);
+  }
+  EXPECT_FALSE(it->GetNextEntry(&entry));
+}
+
+
+TEST(SegmentedDBTest, FindsEntriesByTimestamp) {
+  FLAGS_segmented_db_entries_per_segment = 4;
+  TmpStorage tmp;
+  const string path(tmp.TmpStorageDir() + "/segmented");
+  TestSigner test_signer;
+  {
+    SegmentedDB db(path);
+    for (int i = 0; i < 12; ++i) {
+      LoggedEntry logged_cert;
+      test_signer.CreateUnique(&logged_cert);
+      logged_cert.set_sequence_number(i);
+      logged_cert.mutable_sct()->set_timestamp(1000 + i);
+      ASSERT_EQ(Database::OK, db.CreateSequencedEntry(logged_cert));
+    }
+  }
+
+  // The second time around, the timestamps are indexed again from the
+  // entries, as for a database written before there was an index.
+  for (int reopen = 0; reopen < 2; ++reopen) {
+    SegmentedDB db(path);
+    int64_t begin;
+    int64_t end;
+    db.TimestampRange(1005, 1006, &begin, &end);
+    EXPECT_EQ(4, begin);
+    EXPECT_EQ(8, end);
+    db.TimestampRange(1003, 1008, &begin, &end);
+    EXPECT_EQ(0, begin);
+    EXPECT_EQ(12, end);
+    db.TimestampRange(2000, 3000, &begin, &end);
+    EXPECT_EQ(begin, end);
+
+    for (int number = 0; number < 3; ++number) {
+      ASSERT_EQ(0, unlink((path + "/segments/000000000" +
+                           std::to_string(number) + ".ts").c_str()));
+    }
+  }
+}
+
+
+TEST(CachingDatabaseTest, StaysWithinItsSize) {
+  TmpStorage tmp;
+  TestSigner test_signer;
+  CachingDatabase db(unique_ptr<Database>(
+                         new SegmentedDB(tmp.TmpStorageDir() + "/segmented")),
+                     1 << 15);
+
+  vector<LoggedEntry> logged(100);
+  for (size_t i = 0; i < logged.size(); ++i) {
+    test_signer.CreateUnique(&logged[i]);
+    logged[i].set_sequence_number(i);
+    ASSERT_EQ(Database::OK, db.CreateSequencedEntry(logged[i]));
+  }
+  EXPECT_GT(db.size_bytes(), 0U);
+  EXPECT_LE(db.size_bytes(), 1U << 15);
+
+  // Whether they are still cached or not.
+  for (const auto& logged_cert : logged) {
+    LoggedEntry lookup_cert;
+    EXPECT_EQ(Database::LOOKUP_OK,
+              db.LookupByIndex(logged_cert.sequence_number(), &lookup_cert));
+    TestSigner::TestEqualLoggedCerts(logged_cert, lookup_cert);
+    lookup_cert.Clear();
+    EXPECT_EQ(Database::LOOKUP_OK,
+              db.LookupByHash(logged_cert.Hash(), &lookup_cert));
+    TestSigner::TestEqualLoggedCerts(logged_cert, lookup_cert);
+  }
+  EXPECT_LE(db.size_bytes(), 1U << 15);
+}
+
+
+TEST(SegmentedDBTest, MovesOldSegmentsToColdStorage) {
+  FLAGS_segmented_db_entries_per_segment = 4;
+  FLAGS_segmented_db_hot_segments = 1;
+  FLAGS_segmented_db_cold_cache_segments = 1;
+  TmpStorage tmp;
+  const string path(tmp.TmpStorageDir() + "/segmented");
+  FLAGS_segmented_db_cold_dir = tmp.TmpStorageDir() + "/cold";
+  TestSigner test_signer;
+  vector<LoggedEntry> logged_certs(10);
+  for (size_t i = 0; i < logged_certs.size(); ++i) {
+    test_signer.CreateUnique(&logged_certs[i]);
+    logged_certs[i].set_sequence_number(i);
+  }
+
+  for (int reopen = 0; reopen < 2; ++reopen) {
+    SegmentedDB db(path);
+    if (reopen == 0) {
+      for (const auto& logged : logged_certs) {
+        ASSERT_EQ(Database::OK, db.CreateSequencedEntry(logged));
+      }
+    }
+
+    // The two complete segments before the last one are cold, the
+    // last one is not.
+    struct stat st;
+    EXPECT_NE(0, stat((path + "/segments/0000000000.log").c_str(), &st));
+    EXPECT_NE(0, stat((path + "/segments/0000000001.log").c_str(), &st));
+    EXPECT_EQ(0, stat((path + "/segments/0000000002.log").c_str(), &st));
+
+    EXPECT_EQ(10, db.TreeSize());
+    // Going back and forth between cold segments, with room for only
+    // one of them in the cache.
+    for (size_t i : {0, 5, 1, 9, 6}) {
+      LoggedEntry lookup_cert;
+      ASSERT_EQ(Database::LOOKUP_OK,
+                db.LookupByHash(logged_certs[i].Hash(), &lookup_cert));
+      TestSigner::TestEqualLoggedCerts(logged_certs[i], lookup_cert);
+    }
+    // Writing an entry again compares it with the one in cold storage.
+    EXPECT_EQ(Database::OK, db.CreateSequencedEntry(logged_certs[2]));
+    LoggedEntry conflicting_cert(logged_certs[4]);
+    conflicting_cert.set_sequence_number(3);
+    EXPECT_EQ(Database::SEQUENCE_NUMBER_ALREADY_IN_USE,
+              db.CreateSequencedEntry(conflicting_cert));
+
+    unique_ptr<Database::Iterator> it(db.ScanEntries(1));
+    LoggedEntry entry;
+    for (size_t i = 1; i < logged_certs.size(); ++i) {
+      ASSERT_TRUE(it->GetNextEntry(&entry));
+      TestSigner::TestEqualLoggedCerts(logged_certs[i], entry);
+    }
+    EXPECT_FALSE(it->GetNextEntry(&entry));
+  }
+
+  FLAGS_segmented_db_cold_dir = "";
+}
+
+
+TEST(FileDBTest, ResumesFromIndexSnapshot) {
+  TestDB<FileDB> test_db;
+  TestSigner test_signer;
+  LoggedEntry logged_cert, duplicate_cert, sparse_cert, later_cert, lookup;
+  test_signer.CreateUnique(&logged_cert);
+  logged_cert.set_sequence_number(0);
+  duplicate_cert.CopyFrom(logged_cert);
+  duplicate_cert.set_sequence_number(1);
+  test_signer.CreateUnique(&sparse_cert);
+  sparse_cert.set_sequence_number(5);
+  test_signer.CreateUnique(&later_cert);
+  later_cert.set_sequence_number(2);
+  SignedTreeHead sth, lookup_sth;
+  test_signer.CreateUnique(&sth);
+
+  {
+    // Closing it leaves the snapshot behind.
+    unique_ptr<FileDB> db(test_db.SecondDB());
+    EXPECT_EQ(Database::OK, db->CreateSequencedEntry(logged_cert));
+    EXPECT_EQ(Database::OK, db->CreateSequencedEntry(duplicate_cert));
+    EXPECT_EQ(Database::OK, db->CreateSequencedEntry(sparse_cert));
+    EXPECT_EQ(Database::OK, db->WriteTreeHead(sth));
+  }
+
+  unique_ptr<FileDB> db(test_db.SecondDB());
+  EXPECT_EQ(2, db->TreeSize());
+  EXPECT_EQ(Database::LOOKUP_OK,
+            db->LookupByHash(logged_cert.Hash(), &lookup));
+  EXPECT_EQ(0, lookup.sequence_number());
+  EXPECT_EQ(Database::LOOKUP_OK,
+            db->LookupByHash(sparse_cert.Hash(), &lookup));
+  EXPECT_EQ(5, lookup.sequence_number());
+  EXPECT_EQ(Database::LOOKUP_OK, db->LatestTreeHead(&lookup_sth));
+  TestSigner::TestEqualTreeHeads(sth, lookup_sth);
+  EXPECT_EQ(Database::OK, db->CreateSequencedEntry(later_cert));
+
+  // Opening it again while the other one is still open, as if it had
+  // crashed, does not use the now stale snapshot.
+  unique_ptr<FileDB> crashed_db(test_db.SecondDB());
+  EXPECT_EQ(3, crashed_db->TreeSize());
+  EXPECT_EQ(Database::LOOKUP_OK,
+            crashed_db->LookupByHash(later_cert.Hash(), &lookup));
+  EXPECT_EQ(2, lookup.sequence_number());
+  EXPECT_EQ(Database::LOOKUP_OK, crashed_db->LatestTreeHead(&lookup_sth));
+  TestSigner::TestEqualTreeHeads(sth, lookup_sth);
+}
+
+
+TEST(DatabaseNotifierHelperTest, CoalescesSTHs) {
+  ThreadPool pool(1);
+  DatabaseNotifierHelper helper(&pool);
+  Notification first_started;
+  Notification release;
+  Notification last_done;
+  std::mutex lock;
+  vector<uint64_t> timestamps;
+  const DatabaseNotifierHelper::NotifySTHCallback callback(
+      [&](const SignedTreeHead& sth) {
+        {
+          std::lock_guard<std::mutex> guard(lock);
+          timestamps.push_back(sth.timestamp());
+        }
+        if (sth.timestamp() == 1) {
+          first_started.Notify();
+          release.WaitForNotification();
+        }
+        if (sth.timestamp() == 4) {
+          last_done.Notify();
+        }
+      });
+  helper.Add(&callback);
+
+  SignedTreeHead sth;
+  sth.set_timestamp(1);
+  helper.Call(sth);
+  first_started.WaitForNotification();
+  // These do not wait for the callback, which is still busy with the
+  // first one, and only the newest is passed on.
+  for (uint64_t timestamp : {3, 2, 4}) {
+    sth.set_timestamp(timestamp);
+    helper.Call(sth);
+  }
+  release.Notify();
+  last_done.WaitForNotification();
+
+  helper.Remove(&callback);
+  EXPECT_EQ(vector<uint64_t>({1, 4}), timestamps);
+}
+
+
 }  // namespace
 
 
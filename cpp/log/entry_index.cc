@@ -0,0 +1,254 @@
+#include "log/entry_index.h"
+
+#include <glog/logging.h>
+#include <leveldb/write_batch.h>
+#include <algorithm>
+#include <cctype>
+#include <chrono>
+
+#include "log/cert.h"
+#include "monitoring/latency.h"
+#include "monitoring/monitoring.h"
+
+using std::chrono::milliseconds;
+using std::min;
+using std::pair;
+using std::string;
+using std::stoll;
+using std::to_string;
+using std::unique_ptr;
+using std::vector;
+
+namespace cert_trans {
+namespace {
+
+
+static Latency<milliseconds, string> latency_by_op_ms(
+    "entry_index_latency_by_operation_ms", "operation",
+    "Entry index latency in ms broken out by operation.");
+
+static Counter<>* entries_indexed(
+    Counter<>::New("entries_indexed",
+                   "Number of entries added to the entry index."));
+
+static Counter<>* entries_not_indexed(
+    Counter<>::New("entries_not_indexed",
+                   "Number of entries whose certificate could not be "
+                   "parsed, so that only what is known without it was "
+                   "indexed."));
+
+
+const char kIndexedSizeKey[] = "meta-indexed_size";
+
+// Number of entries indexed per write.
+const size_t kUpdateBatchSize = 1000;
+
+
+char KeyPrefix(EntryIndex::Key key) {
+  switch (key) {
+    case EntryIndex::Key::DNS_NAME:
+      return 'd';
+    case EntryIndex::Key::ISSUER_SPKI_SHA256:
+      return 'i';
+    case EntryIndex::Key::SERIAL_NUMBER:
+      return 's';
+  }
+  LOG(FATAL) << "unknown key " << static_cast<int>(key);
+}
+
+
+// The digests are of a fixed size, so do not need a separator.
+string ValuePrefix(EntryIndex::Key key, const string& value) {
+  string prefix(1, KeyPrefix(key));
+  prefix.append(value);
+  if (key != EntryIndex::Key::ISSUER_SPKI_SHA256) {
+    prefix.push_back('\0');
+  }
+  return prefix;
+}
+
+
+// Big-endian, so that keys sort in numerical order.
+string IndexToBinary(int64_t index) {
+  string index_str(sizeof(index), '\0');
+  for (int i = sizeof(index); i > 0; --i) {
+    index_str[i - 1] = static_cast<char>(index & 0xff);
+    index = index >> 8;
+  }
+
+  return index_str;
+}
+
+
+int64_t BinaryToIndex(const leveldb::Slice& binary) {
+  int64_t index(0);
+  CHECK_EQ(binary.size(), sizeof(index));
+  for (size_t i = 0; i < sizeof(index); ++i) {
+    index = (index << 8) | static_cast<unsigned char>(binary[i]);
+  }
+
+  return index;
+}
+
+
+string Normalize(EntryIndex::Key key, string value) {
+  switch (key) {
+    case EntryIndex::Key::DNS_NAME:
+      std::transform(value.begin(), value.end(), value.begin(), ::tolower);
+      break;
+    case EntryIndex::Key::SERIAL_NUMBER:
+      std::transform(value.begin(), value.end(), value.begin(), ::toupper);
+      break;
+    case EntryIndex::Key::ISSUER_SPKI_SHA256:
+      break;
+  }
+  return value;
+}
+
+
+}  // namespace
+
+
+EntryIndex::EntryIndex(const string& dir) {
+  LOG(INFO) << "Opening entry index " << dir;
+  leveldb::Options options;
+  options.create_if_missing = true;
+  leveldb::DB* db;
+  const leveldb::Status status(leveldb::DB::Open(options, dir, &db));
+  CHECK(status.ok()) << status.ToString();
+  db_.reset(db);
+}
+
+
+EntryIndex::~EntryIndex() {
+}
+
+
+int64_t EntryIndex::IndexedSize() const {
+  string value;
+  const leveldb::Status status(
+      db_->Get(leveldb::ReadOptions(), kIndexedSizeKey, &value));
+  if (status.IsNotFound()) {
+    return 0;
+  }
+  CHECK(status.ok()) << status.ToString();
+  return stoll(value);
+}
+
+
+int64_t EntryIndex::Update(const ReadOnlyDatabase& db, int64_t max_entries) {
+  ScopedLatency latency(latency_by_op_ms.GetScopedLatency("update"));
+  const int64_t start(IndexedSize());
+  const int64_t end(min(db.TreeSize(), start + max_entries));
+  if (end <= start) {
+    return 0;
+  }
+
+  const unique_ptr<Database::Iterator> it(db.ScanEntries(start));
+  vector<LoggedEntry> entries;
+  vector<pair<Key, string>> keys;
+  int64_t index(start);
+  while (index < end) {
+    const size_t count(it->GetNextEntries(
+        min<int64_t>(kUpdateBatchSize, end - index), &entries));
+    CHECK_GT(count, 0U) << "Missing entry " << index;
+
+    // The size indexed is written with the keys of the entries, so
+    // that they are not indexed twice, or left out, after a crash.
+    leveldb::WriteBatch batch;
+    for (size_t i = 0; i < count; ++i, ++index) {
+      CHECK_EQ(entries[i].sequence_number(), index);
+      EntryKeys(entries[i], &keys);
+      const string index_key(IndexToBinary(index));
+      for (const auto& key : keys) {
+        batch.Put(ValuePrefix(key.first, key.second) + index_key, "");
+      }
+    }
+    batch.Put(kIndexedSizeKey, to_string(index));
+    const leveldb::Status status(db_->Write(leveldb::WriteOptions(), &batch));
+    CHECK(status.ok()) << status.ToString();
+    entries_indexed->IncrementBy(count);
+  }
+
+  return end - start;
+}
+
+
+void EntryIndex::Find(Key key, const string& value, int64_t start,
+                      int64_t max_results, vector<int64_t>* indices) const {
+  CHECK_GE(start, 0);
+  CHECK_NOTNULL(indices)->clear();
+  ScopedLatency latency(latency_by_op_ms.GetScopedLatency("find"));
+
+  const string prefix(ValuePrefix(key, Normalize(key, value)));
+  const unique_ptr<leveldb::Iterator> it(
+      db_->NewIterator(leveldb::ReadOptions()));
+  for (it->Seek(prefix + IndexToBinary(start));
+       static_cast<int64_t>(indices->size()) < max_results && it->Valid() &&
+       it->key().starts_with(prefix) &&
+       it->key().size() == prefix.size() + sizeof(int64_t);
+       it->Next()) {
+    leveldb::Slice index(it->key());
+    index.remove_prefix(prefix.size());
+    indices->push_back(BinaryToIndex(index));
+  }
+  CHECK(it->status().ok()) << it->status().ToString();
+}
+
+
+// static
+void EntryIndex::EntryKeys(const LoggedEntry& entry,
+                           vector<pair<Key, string>>* keys) {
+  CHECK_NOTNULL(keys)->clear();
+
+  const string* leaf(nullptr);
+  if (entry.entry().type() == ct::X509_ENTRY) {
+    const ct::X509ChainEntry& x509_entry(entry.entry().x509_entry());
+    leaf = &x509_entry.leaf_certificate();
+    if (x509_entry.certificate_chain_size() > 0) {
+      const unique_ptr<Cert> issuer(
+          Cert::FromDerString(x509_entry.certificate_chain(0)));
+      string digest;
+      if (issuer && issuer->SPKISha256Digest(&digest).ok()) {
+        keys->emplace_back(Key::ISSUER_SPKI_SHA256, digest);
+      }
+    }
+  } else if (entry.entry().type() == ct::PRECERT_ENTRY) {
+    const ct::PrecertChainEntry& precert_entry(entry.entry().precert_entry());
+    leaf = &precert_entry.pre_certificate();
+    if (precert_entry.pre_cert().has_issuer_key_hash()) {
+      keys->emplace_back(Key::ISSUER_SPKI_SHA256,
+                         precert_entry.pre_cert().issuer_key_hash());
+    }
+  }
+
+  const unique_ptr<Cert> cert(leaf ? Cert::FromDerString(*leaf) : nullptr);
+  if (!cert) {
+    entries_not_indexed->Increment();
+    return;
+  }
+
+  keys->emplace_back(Key::SERIAL_NUMBER,
+                     Normalize(Key::SERIAL_NUMBER, cert->PrintSerialNumber()));
+
+  vector<string> names;
+  // Any names extracted before an error are still worth indexing.
+  cert->SubjectAltNames(&names).IgnoreError();
+  string common_name;
+  if (cert->SubjectCommonName(&common_name).ok()) {
+    names.push_back(common_name);
+  }
+  for (auto& name : names) {
+    name = Normalize(Key::DNS_NAME, name);
+  }
+  std::sort(names.begin(), names.end());
+  names.erase(std::unique(names.begin(), names.end()), names.end());
+  for (const auto& name : names) {
+    if (!name.empty()) {
+      keys->emplace_back(Key::DNS_NAME, name);
+    }
+  }
+}
+
+
+}  // namespace cert_trans
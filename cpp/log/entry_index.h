@@ -0,0 +1,79 @@
+#ifndef CERT_TRANS_LOG_ENTRY_INDEX_H_
+#define CERT_TRANS_LOG_ENTRY_INDEX_H_
+
+#include <leveldb/db.h>
+#include <stdint.h>
+#include <memory>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "log/database.h"
+#include "log/logged_entry.h"
+
+namespace cert_trans {
+
+
+// An inverted index of the entries of a log by the names, issuer and
+// serial number of their certificates, so that a mirror can be
+// searched without scanning all of it. The index follows the database
+// of the log, indexing the entries as they are added, and is kept in a
+// LevelDB database of its own, with a key for each name, issuer and
+// serial number of each entry:
+//
+// d<name>\0<index>   - For each DNS name in the subjectAltName and the
+//                      subject CN, lower-cased.
+// i<digest><index>   - For the SHA-256 digest of the subjectPublicKeyInfo
+//                      of the issuer, from the issuer_key_hash of
+//                      precertificates, or else the first certificate
+//                      of the chain.
+// s<serial>\0<index> - For the serial number, in upper-case hex.
+//
+// where <index> is the sequence number of the entry in 8 bytes,
+// big-endian, so that the entries for each name, issuer or serial
+// number are in order. The keys of new entries are spread all over the
+// key space, which LevelDB copes well with, but never change once
+// written.
+//
+// Update() must only be called by one thread at a time, but Find() can
+// be called from any thread at any time.
+class EntryIndex {
+ public:
+  enum class Key {
+    DNS_NAME,
+    ISSUER_SPKI_SHA256,
+    SERIAL_NUMBER,
+  };
+
+  // Opens the index in |dir|, creating it if necessary.
+  explicit EntryIndex(const std::string& dir);
+  ~EntryIndex();
+  EntryIndex(const EntryIndex&) = delete;
+  EntryIndex& operator=(const EntryIndex&) = delete;
+
+  // The number of entries indexed: all those below it are.
+  int64_t IndexedSize() const;
+
+  // Indexes the entries of |db| from IndexedSize() on, up to its tree
+  // size or |max_entries| of them, whichever comes first, and returns
+  // the number indexed. |db| must be the same database every time.
+  int64_t Update(const ReadOnlyDatabase& db, int64_t max_entries);
+
+  // Sets |indices| to the sequence numbers of the entries with |value|
+  // for |key|, in order, from |start| on, up to |max_results| of them.
+  void Find(Key key, const std::string& value, int64_t start,
+            int64_t max_results, std::vector<int64_t>* indices) const;
+
+  // Sets |keys| to what |entry| is indexed by, with the values
+  // normalized as they are looked up in Find().
+  static void EntryKeys(const LoggedEntry& entry,
+                        std::vector<std::pair<Key, std::string>>* keys);
+
+ private:
+  std::unique_ptr<leveldb::DB> db_;
+};
+
+
+}  // namespace cert_trans
+
+#endif  // CERT_TRANS_LOG_ENTRY_INDEX_H_
@@ -0,0 +1,172 @@
+#include "log/entry_index.h"
+
+#include <gtest/gtest.h>
+#include <memory>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "log/cert.h"
+#include "log/test_db.h"
+#include "log/test_signer.h"
+#include "proto/cert_serializer.h"
+#include "util/testing.h"
+#include "util/util.h"
+
+namespace cert_trans {
+namespace {
+
+using std::make_pair;
+using std::pair;
+using std::string;
+using std::unique_ptr;
+using std::vector;
+
+// Issued by ca-cert.pem.
+const char kLeafCert[] = "test-cert.pem";
+const char kCaCert[] = "ca-cert.pem";
+// Has a CN and 44 subjectAltName DNS names, the first the same as it.
+const char kGoogleCert[] = "google-cert.pem";
+
+
+string ReadDer(const string& name) {
+  string pem;
+  const string path(FLAGS_test_srcdir + "/test/testdata/" + name);
+  CHECK(util::ReadTextFile(path, &pem)) << "Could not read " << path
+                                        << ". Wrong --test_srcdir?";
+  const unique_ptr<Cert> cert(Cert::FromPemString(pem));
+  CHECK(cert);
+  string der;
+  CHECK(cert->DerEncoding(&der).ok());
+  return der;
+}
+
+
+string SPKISha256Digest(const string& der) {
+  const unique_ptr<Cert> cert(Cert::FromDerString(der));
+  CHECK(cert);
+  string digest;
+  CHECK(cert->SPKISha256Digest(&digest).ok());
+  return digest;
+}
+
+
+class EntryIndexTest : public ::testing::Test {
+ protected:
+  EntryIndexTest()
+      : leaf_(ReadDer(kLeafCert)),
+        ca_(ReadDer(kCaCert)),
+        google_(ReadDer(kGoogleCert)) {
+  }
+
+  // Adds an X.509 entry for |leaf|, issued by |issuer|.
+  void AddEntry(const string& leaf, const string& issuer) {
+    LoggedEntry logged;
+    test_signer_.CreateUnique(&logged);
+    logged.mutable_entry()->set_type(ct::X509_ENTRY);
+    logged.mutable_entry()->clear_precert_entry();
+    ct::X509ChainEntry* const x509_entry(
+        logged.mutable_entry()->mutable_x509_entry());
+    x509_entry->set_leaf_certificate(leaf);
+    x509_entry->clear_certificate_chain();
+    x509_entry->add_certificate_chain(issuer);
+    logged.set_sequence_number(test_db_.db()->TreeSize());
+    ASSERT_EQ(Database::OK, test_db_.db()->CreateSequencedEntry(logged));
+  }
+
+  const string leaf_;
+  const string ca_;
+  const string google_;
+  TestSigner test_signer_;
+  TestDB<LevelDB> test_db_;
+  TmpStorage tmp_;
+};
+
+
+TEST_F(EntryIndexTest, EntryKeys) {
+  LoggedEntry logged;
+  logged.mutable_entry()->set_type(ct::X509_ENTRY);
+  logged.mutable_entry()->mutable_x509_entry()->set_leaf_certificate(google_);
+  logged.mutable_entry()->mutable_x509_entry()->add_certificate_chain(ca_);
+
+  vector<pair<EntryIndex::Key, string>> keys;
+  EntryIndex::EntryKeys(logged, &keys);
+  // The issuer, the serial number, and the names, with the CN only
+  // once.
+  ASSERT_EQ(46U, keys.size());
+  EXPECT_EQ(make_pair(EntryIndex::Key::ISSUER_SPKI_SHA256,
+                      SPKISha256Digest(ca_)),
+            keys[0]);
+  EXPECT_EQ(make_pair(EntryIndex::Key::SERIAL_NUMBER,
+                      string("605381F50001000088BD")),
+            keys[1]);
+  EXPECT_EQ(make_pair(EntryIndex::Key::DNS_NAME, string("*.android.com")),
+            keys[2]);
+
+  // Precertificates say who their issuer is.
+  logged.mutable_entry()->set_type(ct::PRECERT_ENTRY);
+  logged.mutable_entry()->mutable_precert_entry()->set_pre_certificate(leaf_);
+  logged.mutable_entry()
+      ->mutable_precert_entry()
+      ->mutable_pre_cert()
+      ->set_issuer_key_hash(string(32, 'i'));
+  EntryIndex::EntryKeys(logged, &keys);
+  ASSERT_EQ(2U, keys.size());
+  EXPECT_EQ(make_pair(EntryIndex::Key::ISSUER_SPKI_SHA256, string(32, 'i')),
+            keys[0]);
+  EXPECT_EQ(EntryIndex::Key::SERIAL_NUMBER, keys[1].first);
+
+  // Entries that cannot be parsed are indexed by what is known anyway.
+  logged.mutable_entry()->mutable_precert_entry()->set_pre_certificate(
+      "not a certificate");
+  EntryIndex::EntryKeys(logged, &keys);
+  EXPECT_EQ(1U, keys.size());
+}
+
+
+TEST_F(EntryIndexTest, FindsEntries) {
+  AddEntry(leaf_, ca_);
+  AddEntry(google_, ca_);
+  AddEntry(leaf_, google_);
+  AddEntry(google_, leaf_);
+
+  {
+    EntryIndex index(tmp_.TmpStorageDir() + "/index");
+    EXPECT_EQ(0, index.IndexedSize());
+    EXPECT_EQ(3, index.Update(*test_db_.db(), 3));
+    EXPECT_EQ(3, index.IndexedSize());
+  }
+
+  // It carries on where it left off.
+  EntryIndex index(tmp_.TmpStorageDir() + "/index");
+  EXPECT_EQ(3, index.IndexedSize());
+  EXPECT_EQ(1, index.Update(*test_db_.db(), 100));
+  EXPECT_EQ(0, index.Update(*test_db_.db(), 100));
+
+  vector<int64_t> indices;
+  index.Find(EntryIndex::Key::DNS_NAME, "YouTube.com", 0, 10, &indices);
+  EXPECT_EQ((vector<int64_t>{1, 3}), indices);
+  index.Find(EntryIndex::Key::DNS_NAME, "YouTube.com", 2, 10, &indices);
+  EXPECT_EQ((vector<int64_t>{3}), indices);
+  index.Find(EntryIndex::Key::DNS_NAME, "youtube", 0, 10, &indices);
+  EXPECT_TRUE(indices.empty());
+
+  index.Find(EntryIndex::Key::ISSUER_SPKI_SHA256, SPKISha256Digest(ca_), 0,
+             1, &indices);
+  EXPECT_EQ((vector<int64_t>{0}), indices);
+
+  index.Find(EntryIndex::Key::SERIAL_NUMBER, "605381f50001000088bd", 0, 10,
+             &indices);
+  EXPECT_EQ((vector<int64_t>{1, 3}), indices);
+}
+
+
+}  // namespace
+}  // namespace cert_trans
+
+
+int main(int argc, char** argv) {
+  cert_trans::test::InitTesting(argv[0], &argc, &argv, true);
+  ConfigureSerializerForV1CT();
+  return RUN_ALL_TESTS();
+}
@@ -2,11 +2,19 @@
 
 #include <gflags/gflags.h>
 #include <glog/logging.h>
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <algorithm>
 #include <chrono>
+#include <condition_variable>
+#include <map>
+#include <set>
 #include <unordered_map>
 #include <vector>
 
 #include "base/notification.h"
+#include "log/pending_entry_bodies.h"
 #include "monitoring/event_metric.h"
 #include "monitoring/latency.h"
 #include "monitoring/monitoring.h"
@@ -18,14 +26,22 @@
 using ct::ClusterConfig;
 using ct::ClusterNodeState;
 using ct::SequenceMapping;
+using ct::SequenceRange;
 using ct::SignedTreeHead;
 using std::bind;
+using std::lower_bound;
 using std::chrono::seconds;
+using std::chrono::steady_clock;
 using std::lock_guard;
+using std::make_pair;
 using std::map;
+using std::max;
+using std::min;
 using std::move;
 using std::mutex;
+using std::pair;
 using std::placeholders::_1;
+using std::sort;
 using std::string;
 using std::unique_lock;
 using std::unique_ptr;
@@ -37,12 +53,30 @@ using util::SyncTask;
 using util::Task;
 using util::ToBase64;
 
-// This needs to be quite frequent since the number of entries which can be
-// added every second can be pretty high.
-DEFINE_int32(etcd_stats_collection_interval_seconds, 2,
-             "Number of seconds between fetches of etcd stats.");
+// The store keeps count of its own writes in between, so this only
+// has to catch up with those of the other nodes.
+DEFINE_int32(etcd_stats_collection_interval_seconds, 30,
+             "Number of seconds between fetches of etcd stats, which the "
+             "count of entries in etcd used to reject adds is brought back "
+             "in line with.");
 DEFINE_int32(node_state_ttl_seconds, 60,
              "TTL in seconds on the node state files.");
+DEFINE_bool(etcd_mirror_pending_entries, false,
+            "keep a local copy of the pending entries, kept up to date "
+            "by a watch, rather than listing them all from etcd on every "
+            "GetPendingEntries call");
+DEFINE_int32(etcd_pending_entries_resync_seconds, 300,
+             "how often the local copy of the pending entries is dropped "
+             "and fetched again from etcd");
+DEFINE_int32(etcd_pending_entry_ttl_seconds, 0,
+             "if positive, the cleanup gives pending entries in the "
+             "serving STH this TTL in etcd, rather than deleting them; "
+             "needs etcd 2.3 or later");
+DEFINE_int32(etcd_sequence_mapping_shard_size, 0,
+             "if positive, store the sequence mapping in etcd as several "
+             "keys of this many sequence numbers each (10000 is a good "
+             "value), moving an existing unsharded mapping over on the "
+             "next update; must not change once shards exist");
 
 namespace cert_trans {
 namespace {
@@ -51,6 +85,8 @@ namespace {
 const char kClusterConfigFile[] = "/cluster_config";
 const char kEntriesDir[] = "/entries/";
 const char kSequenceFile[] = "/sequence_mapping";
+const char kSequenceRangesDir[] = "/sequence_ranges/";
+const char kSequenceShardsDir[] = "/sequence_mapping_shards/";
 const char kServingSthFile[] = "/serving_sth";
 const char kNodesDir[] = "/nodes/";
 
@@ -63,6 +99,11 @@ static Gauge<string>* etcd_store_stats =
     Gauge<string>::New("etcd_store_stats", "name",
                        "Re-export of etcd's store stats.");
 
+static Counter<>* etcd_pending_entries_resyncs =
+    Counter<>::New("etcd_pending_entries_resyncs",
+                   "Number of times the local copy of the pending entries "
+                   "was fetched from etcd.");
+
 static EventMetric<string> etcd_throttle_delay_ms("etcd_throttle_delay_ms",
                                                   "type",
                                                   "Count and total thottle "
@@ -82,11 +123,12 @@ static Latency<std::chrono::milliseconds, string> etcd_latency_by_op_ms(
 
 // TODO(pphaneuf): Hmm, I think this should check that it's not just
 // ordered, but contiguous?
-void CheckMappingIsOrdered(const SequenceMapping& mapping) {
+// Only the entries from the |begin|th one on are checked.
+void CheckMappingIsOrdered(const SequenceMapping& mapping, int begin) {
   if (mapping.mapping_size() < 2) {
     return;
   }
-  for (int64_t i = 0; i < mapping.mapping_size() - 1; ++i) {
+  for (int64_t i = begin; i < mapping.mapping_size() - 1; ++i) {
     CHECK_LT(mapping.mapping(i).sequence_number(),
              mapping.mapping(i + 1).sequence_number());
   }
@@ -129,24 +171,61 @@ StatusOr<int64_t> CalculateNumEtcdEntries(const map<string, int64_t>& stats) {
   return created.ValueOrDie() - num_removed;
 }
 
+// How long GetPendingEntries waits for the initial state of the pending
+// entries watch.
+const seconds kPendingEntriesMirrorTimeout(30);
+
+// Number of gets of pending entries sent to etcd at once.
+const size_t kMaxConcurrentEntryGets = 256;
+
 }  // namespace
 
 
+struct EtcdConsistentStore::PendingEntriesMirror {
+  PendingEntriesMirror() : initialised(false) {
+  }
+
+  // Held while (re)starting the watch, so that only one caller does it.
+  std::mutex watch_lock;
+  std::unique_ptr<SyncTask> watch_task;
+  steady_clock::time_point watch_started;
+
+  // Protects the rest, which the watch callback updates.
+  std::mutex lock;
+  std::condition_variable initialised_cv;
+  bool initialised;
+  // Keyed by etcd path. Only what the sequencer needs to know of the
+  // entries is kept, as the entries themselves can add up to a lot.
+  map<string, PendingEntryInfo> entries;
+  // The same entries, in PendingEntriesOrder: keyed by timestamp and
+  // hash.
+  map<pair<uint64_t, string>, const map<string, PendingEntryInfo>::value_type*>
+      ordered;
+};
+
+
 EtcdConsistentStore::EtcdConsistentStore(
     libevent::Base* base, util::Executor* executor, EtcdClient* client,
-    const MasterElection* election, const string& root, const string& node_id)
+    const MasterElection* election, const string& root, const string& node_id,
+    PendingEntryBodies* bodies)
     : client_(CHECK_NOTNULL(client)),
       base_(CHECK_NOTNULL(base)),
       executor_(CHECK_NOTNULL(executor)),
       election_(CHECK_NOTNULL(election)),
       root_(root),
       node_id_(node_id),
+      bodies_(bodies),
       serving_sth_watch_task_(CHECK_NOTNULL(executor)),
       cluster_config_watch_task_(CHECK_NOTNULL(executor)),
       etcd_stats_task_(executor_),
       received_initial_sth_(false),
       exiting_(false),
-      num_etcd_entries_(0) {
+      num_etcd_entries_(0),
+      num_admitted_writes_(0),
+      next_sequence_range_id_(util::TimeInMilliseconds() * 1000),
+      expired_up_to_(-1),
+      pending_mirror_(new PendingEntriesMirror),
+      checked_sequence_number_(-1) {
   // Set up watches on things we're interested in...
   WatchServingSTH(bind(&EtcdConsistentStore::OnEtcdServingSTHUpdated, this,
                        _1),
@@ -173,6 +252,13 @@ EtcdConsistentStore::~EtcdConsistentStore() {
   VLOG(1) << "Waiting for watch tasks to return.";
   serving_sth_watch_task_.Wait();
   cluster_config_watch_task_.Wait();
+  {
+    lock_guard<mutex> lock(pending_mirror_->watch_lock);
+    if (pending_mirror_->watch_task) {
+      pending_mirror_->watch_task->Cancel();
+      pending_mirror_->watch_task->Wait();
+    }
+  }
   VLOG(1) << "Cancelling stats task.";
   etcd_stats_task_.Cancel();
   etcd_stats_task_.Wait();
@@ -309,35 +395,110 @@ Status EtcdConsistentStore::AddPendingEntry(LoggedEntry* entry) {
   CHECK_NOTNULL(entry);
   CHECK(!entry->has_sequence_number());
 
-  Status status(MaybeReject("add_pending_entry"));
+  Status status(MaybeReject("add_pending_entry", 1));
   if (!status.ok()) {
     return status;
   }
 
   const string full_path(GetEntryPath(*entry));
-  EntryHandle<LoggedEntry> handle(full_path, *entry);
-  status = CreateEntry(&handle);
-  if (status.CanonicalCode() == util::error::FAILED_PRECONDITION) {
-    // Entry with that hash already exists.
-    EntryHandle<LoggedEntry> preexisting_entry;
-    status = GetEntry(full_path, &preexisting_entry);
-    if (!status.ok()) {
-      LOG(ERROR) << "Couldn't create or fetch " << full_path << " : "
-                 << status;
-      return status;
+  if (bodies_ && bodies_->KeepsBodies()) {
+    vector<LoggedEntry> stubs;
+    status = bodies_->Keep({entry}, &stubs);
+    if (status.ok()) {
+      EntryHandle<LoggedEntry> handle(full_path, stubs[0]);
+      status = FinishAddPendingEntry(full_path, CreateEntry(&handle), entry);
     }
-
-    // Check the leaf certs are the same (we might be seeing the same cert
-    // submitted with a different chain.)
-    CHECK(LeafEntriesMatch(preexisting_entry.Entry(), *entry));
-    *entry->mutable_sct() = preexisting_entry.Entry().sct();
-    return Status(util::error::ALREADY_EXISTS,
-                  "Pending entry already exists.");
+  } else {
+    EntryHandle<LoggedEntry> handle(full_path, *entry);
+    status = FinishAddPendingEntry(full_path, CreateEntry(&handle), entry);
   }
+  FinishWrites(1, status.ok() ? 1 : 0);
   return status;
 }
 
 
+void EtcdConsistentStore::AddPendingEntries(
+    const vector<LoggedEntry*>& entries, vector<Status>* statuses) {
+  ScopedLatency scoped_latency(
+      etcd_latency_by_op_ms.GetScopedLatency("add_pending_entries"));
+
+  CHECK_NOTNULL(statuses);
+  const int64_t num_entries(entries.size());
+  const Status status(MaybeReject("add_pending_entry", num_entries));
+  if (!status.ok()) {
+    statuses->assign(entries.size(), status);
+    return;
+  }
+
+  // Only stubs go to etcd if the bodies are kept on this node, which
+  // are all written, and synced, together.
+  vector<LoggedEntry> stubs;
+  if (bodies_ && bodies_->KeepsBodies()) {
+    const Status keep_status(bodies_->Keep(
+        vector<const LoggedEntry*>(entries.begin(), entries.end()), &stubs));
+    if (!keep_status.ok()) {
+      FinishWrites(num_entries, 0);
+      statuses->assign(entries.size(), keep_status);
+      return;
+    }
+  }
+
+  vector<string> paths;
+  vector<EtcdClient::Response> responses(entries.size());
+  vector<unique_ptr<SyncTask>> tasks;
+  paths.reserve(entries.size());
+  tasks.reserve(entries.size());
+  for (size_t i = 0; i < entries.size(); ++i) {
+    CHECK_NOTNULL(entries[i]);
+    CHECK(!entries[i]->has_sequence_number());
+    paths.emplace_back(GetEntryPath(*entries[i]));
+    string flat_entry;
+    CHECK((stubs.empty() ? *entries[i] : stubs[i])
+              .SerializeToString(&flat_entry));
+    tasks.emplace_back(new SyncTask(executor_));
+    client_->Create(paths[i], ToBase64(flat_entry), &responses[i],
+                    tasks[i]->task());
+  }
+
+  statuses->clear();
+  int64_t num_created(0);
+  for (size_t i = 0; i < entries.size(); ++i) {
+    tasks[i]->Wait();
+    statuses->push_back(
+        FinishAddPendingEntry(paths[i], tasks[i]->status(), entries[i]));
+    if (statuses->back().ok()) {
+      ++num_created;
+    }
+  }
+  FinishWrites(num_entries, num_created);
+}
+
+
+Status EtcdConsistentStore::FinishAddPendingEntry(const string& full_path,
+                                                  const Status& create_status,
+                                                  LoggedEntry* entry) {
+  if (create_status.CanonicalCode() != util::error::FAILED_PRECONDITION) {
+    return create_status;
+  }
+
+  // Entry with that hash already exists.
+  EntryHandle<LoggedEntry> preexisting_entry;
+  const Status status(GetEntry(full_path, &preexisting_entry));
+  if (!status.ok()) {
+    LOG(ERROR) << "Couldn't create or fetch " << full_path << " : " << status;
+    return status;
+  }
+
+  // Check the leaf certs are the same (we might be seeing the same cert
+  // submitted with a different chain.) Only the hash is left to check
+  // of a stub, which the path already matches.
+  CHECK(preexisting_entry.Entry().has_body_node_id() ||
+        LeafEntriesMatch(preexisting_entry.Entry(), *entry));
+  *entry->mutable_sct() = preexisting_entry.Entry().sct();
+  return Status(util::error::ALREADY_EXISTS, "Pending entry already exists.");
+}
+
+
 Status EtcdConsistentStore::GetPendingEntryForHash(
     const string& hash, EntryHandle<LoggedEntry>* entry) const {
   ScopedLatency scoped_latency(
@@ -357,7 +518,9 @@ Status EtcdConsistentStore::GetPendingEntries(
   ScopedLatency scoped_latency(
       etcd_latency_by_op_ms.GetScopedLatency("get_pending_entries"));
 
-  Status status(GetAllEntriesInDir(GetFullPath(kEntriesDir), entries));
+  Status status(FLAGS_etcd_mirror_pending_entries
+                    ? GetMirroredPendingEntries(entries)
+                    : GetAllEntriesInDir(GetFullPath(kEntriesDir), entries));
   if (status.ok()) {
     for (const auto& entry : *entries) {
       CHECK(!entry.Entry().has_sequence_number());
@@ -368,17 +531,264 @@ Status EtcdConsistentStore::GetPendingEntries(
 }
 
 
+Status EtcdConsistentStore::GetPendingEntriesUpTo(
+    uint64_t max_timestamp, vector<EntryHandle<LoggedEntry>>* entries,
+    int64_t* num_later) const {
+  if (!FLAGS_etcd_mirror_pending_entries) {
+    return ConsistentStore::GetPendingEntriesUpTo(max_timestamp, entries,
+                                                  num_later);
+  }
+  ScopedLatency scoped_latency(
+      etcd_latency_by_op_ms.GetScopedLatency("get_pending_entries_up_to"));
+
+  vector<string> paths;
+  {
+    unique_lock<mutex> lock;
+    const Status status(LockPendingEntriesMirror(&lock));
+    if (!status.ok()) {
+      return status;
+    }
+    const auto& ordered(pending_mirror_->ordered);
+    for (auto it(ordered.begin());
+         it != ordered.end() && it->first.first <= max_timestamp; ++it) {
+      paths.emplace_back(it->second->first);
+    }
+    *num_later = ordered.size() - paths.size();
+    etcd_total_entries->Set("entries", ordered.size());
+  }
+  // Entries removed since they were listed are no longer pending.
+  return GetPendingEntriesAt(paths, true /* skip_missing */, entries);
+}
+
+
+Status EtcdConsistentStore::GetPendingEntryInfosUpTo(
+    uint64_t max_timestamp, vector<PendingEntryInfo>* infos,
+    int64_t* num_later) const {
+  if (!FLAGS_etcd_mirror_pending_entries) {
+    return ConsistentStore::GetPendingEntryInfosUpTo(max_timestamp, infos,
+                                                     num_later);
+  }
+  ScopedLatency scoped_latency(etcd_latency_by_op_ms.GetScopedLatency(
+      "get_pending_entry_infos_up_to"));
+  CHECK_NOTNULL(infos)->clear();
+
+  unique_lock<mutex> lock;
+  const Status status(LockPendingEntriesMirror(&lock));
+  if (!status.ok()) {
+    return status;
+  }
+  const auto& ordered(pending_mirror_->ordered);
+  for (auto it(ordered.begin());
+       it != ordered.end() && it->first.first <= max_timestamp; ++it) {
+    infos->emplace_back(it->second->second);
+  }
+  *num_later = ordered.size() - infos->size();
+  etcd_total_entries->Set("entries", ordered.size());
+  return ::util::OkStatus();
+}
+
+
+void EtcdConsistentStore::GetPendingEntriesForHashes(
+    const vector<string>& hashes, vector<EntryHandle<LoggedEntry>>* entries,
+    vector<Status>* statuses) const {
+  CHECK_NOTNULL(entries)->clear();
+  entries->resize(hashes.size());
+  vector<string> paths;
+  paths.reserve(hashes.size());
+  for (const auto& hash : hashes) {
+    paths.emplace_back(GetEntryPath(hash));
+  }
+  vector<EntryHandle<LoggedEntry>> found;
+  const Status status(
+      GetPendingEntriesAt(paths, true /* skip_missing */, &found));
+  if (!status.ok()) {
+    CHECK_NOTNULL(statuses)->assign(hashes.size(), status);
+    return;
+  }
+
+  // Those found are in the order of |paths|.
+  CHECK_NOTNULL(statuses)->assign(
+      hashes.size(), Status(util::error::NOT_FOUND, "not pending"));
+  for (size_t i = 0, j = 0; i < paths.size() && j < found.size(); ++i) {
+    if (found[j].Key() == paths[i]) {
+      (*entries)[i] = move(found[j++]);
+      (*statuses)[i] = ::util::OkStatus();
+    }
+  }
+  if (!bodies_) {
+    for (size_t i = 0; i < entries->size(); ++i) {
+      if ((*entries)[i].Entry().has_body_node_id()) {
+        (*statuses)[i] = Status(util::error::UNAVAILABLE,
+                                "pending entry kept by node " +
+                                    (*entries)[i].Entry().body_node_id());
+      }
+    }
+    return;
+  }
+
+  vector<Status> expand_statuses;
+  bodies_->Expand(entries, &expand_statuses);
+  for (size_t i = 0; i < statuses->size(); ++i) {
+    if ((*statuses)[i].ok()) {
+      (*statuses)[i] = expand_statuses[i];
+    }
+  }
+}
+
+
+Status EtcdConsistentStore::LockPendingEntriesMirror(
+    unique_lock<mutex>* lock) const {
+  PendingEntriesMirror* const mirror(pending_mirror_.get());
+
+  {
+    lock_guard<mutex> watch_lock(mirror->watch_lock);
+    // Now and then, start over from a fresh listing, in case the watch
+    // has drifted from what is actually in etcd.
+    if (mirror->watch_task &&
+        steady_clock::now() - mirror->watch_started >=
+            seconds(FLAGS_etcd_pending_entries_resync_seconds)) {
+      mirror->watch_task->Cancel();
+      mirror->watch_task->Wait();
+      mirror->watch_task.reset();
+      lock_guard<mutex> lock(mirror->lock);
+      mirror->initialised = false;
+      mirror->entries.clear();
+      mirror->ordered.clear();
+    }
+
+    if (!mirror->watch_task) {
+      etcd_pending_entries_resyncs->Increment();
+      mirror->watch_task.reset(new SyncTask(executor_));
+      mirror->watch_started = steady_clock::now();
+      client_->Watch(
+          GetFullPath(kEntriesDir),
+          bind(&ConvertMultipleUpdate<LoggedEntry,
+                                      ConsistentStore::PendingEntriesCallback>,
+               ConsistentStore::PendingEntriesCallback(bind(
+                   &EtcdConsistentStore::OnPendingEntriesMirrorUpdated, this,
+                   _1)),
+               _1),
+          mirror->watch_task->task());
+    }
+  }
+
+  *lock = unique_lock<mutex>(mirror->lock);
+  if (!mirror->initialised_cv.wait_for(*lock, kPendingEntriesMirrorTimeout,
+                                       [mirror]() {
+                                         return mirror->initialised;
+                                       })) {
+    return Status(util::error::UNAVAILABLE,
+                  "pending entries not received from etcd yet");
+  }
+  return ::util::OkStatus();
+}
+
+
+Status EtcdConsistentStore::GetMirroredPendingEntries(
+    vector<EntryHandle<LoggedEntry>>* entries) const {
+  CHECK_NOTNULL(entries);
+  CHECK_EQ(static_cast<size_t>(0), entries->size());
+  vector<string> paths;
+  {
+    unique_lock<mutex> lock;
+    const Status status(LockPendingEntriesMirror(&lock));
+    if (!status.ok()) {
+      return status;
+    }
+    paths.reserve(pending_mirror_->entries.size());
+    for (const auto& entry : pending_mirror_->entries) {
+      paths.emplace_back(entry.first);
+    }
+  }
+  // Entries removed since they were listed are no longer pending.
+  return GetPendingEntriesAt(paths, true /* skip_missing */, entries);
+}
+
+
+Status EtcdConsistentStore::GetPendingEntriesAt(
+    const vector<string>& paths, bool skip_missing,
+    vector<EntryHandle<LoggedEntry>>* entries) const {
+  ScopedLatency scoped_latency(
+      etcd_latency_by_op_ms.GetScopedLatency("get_pending_entries_at"));
+
+  CHECK_NOTNULL(entries)->clear();
+  entries->reserve(paths.size());
+  for (size_t begin = 0; begin < paths.size();
+       begin += kMaxConcurrentEntryGets) {
+    const size_t end(min(paths.size(), begin + kMaxConcurrentEntryGets));
+    vector<EtcdClient::GetResponse> responses(end - begin);
+    vector<unique_ptr<SyncTask>> tasks;
+    tasks.reserve(end - begin);
+    for (size_t i = begin; i < end; ++i) {
+      tasks.emplace_back(new SyncTask(executor_));
+      client_->Get(paths[i], &responses[i - begin], tasks.back()->task());
+    }
+
+    // All the gets are waited for, even once one of them failed.
+    Status status;
+    for (size_t i = 0; i < tasks.size(); ++i) {
+      tasks[i]->Wait();
+      if (!tasks[i]->status().ok()) {
+        if (status.ok() &&
+            (!skip_missing ||
+             tasks[i]->status().CanonicalCode() != util::error::NOT_FOUND)) {
+          status = tasks[i]->status();
+        }
+        continue;
+      }
+      LoggedEntry entry;
+      CHECK(entry.ParseFromString(FromBase64(responses[i].node.value_)));
+      CHECK(!entry.has_sequence_number());
+      entries->emplace_back(EntryHandle<LoggedEntry>(
+          paths[begin + i], entry, responses[i].node.modified_index_));
+    }
+    if (!status.ok()) {
+      return status;
+    }
+  }
+  return ::util::OkStatus();
+}
+
+
+void EtcdConsistentStore::OnPendingEntriesMirrorUpdated(
+    const vector<Update<LoggedEntry>>& updates) const {
+  lock_guard<mutex> lock(pending_mirror_->lock);
+  auto& entries(pending_mirror_->entries);
+  auto& ordered(pending_mirror_->ordered);
+  for (const auto& update : updates) {
+    const auto it(entries.find(update.handle_.Key()));
+    if (it != entries.end()) {
+      ordered.erase(make_pair(it->second.timestamp, it->second.hash));
+      entries.erase(it);
+    }
+    if (update.exists_) {
+      const LoggedEntry& entry(update.handle_.Entry());
+      const auto& inserted(
+          *entries.emplace(update.handle_.Key(),
+                           PendingEntryInfo(entry.Hash(), entry.timestamp(),
+                                            entry.ByteSize()))
+               .first);
+      ordered[make_pair(entry.timestamp(), entry.Hash())] = &inserted;
+    }
+  }
+  // The first callback carries the whole directory.
+  pending_mirror_->initialised = true;
+  pending_mirror_->initialised_cv.notify_all();
+}
+
+
 Status EtcdConsistentStore::GetSequenceMapping(
     EntryHandle<SequenceMapping>* sequence_mapping) const {
   ScopedLatency scoped_latency(
       etcd_latency_by_op_ms.GetScopedLatency("get_sequence_mapping"));
 
-  Status status(GetEntry(GetFullPath(kSequenceFile), sequence_mapping));
+  Status status(FLAGS_etcd_sequence_mapping_shard_size > 0
+                    ? GetShardedSequenceMapping(sequence_mapping)
+                    : GetEntry(GetFullPath(kSequenceFile), sequence_mapping));
   if (!status.ok()) {
     return status;
   }
-  CheckMappingIsOrdered(sequence_mapping->Entry());
-  CheckMappingIsContiguousWithServingTree(sequence_mapping->Entry());
+  CheckSequenceMapping(sequence_mapping->Entry());
   etcd_total_entries->Set("sequenced",
                           sequence_mapping->Entry().mapping_size());
   return ::util::OkStatus();
@@ -391,12 +801,241 @@ Status EtcdConsistentStore::UpdateSequenceMapping(
       etcd_latency_by_op_ms.GetScopedLatency("update_sequence_mapping"));
 
   CHECK(entry->HasHandle());
-  CheckMappingIsOrdered(entry->Entry());
-  CheckMappingIsContiguousWithServingTree(entry->Entry());
+  CheckSequenceMapping(entry->Entry());
+  if (FLAGS_etcd_sequence_mapping_shard_size > 0) {
+    return UpdateShardedSequenceMapping(entry);
+  }
   return UpdateEntry(entry);
 }
 
 
+Status EtcdConsistentStore::AddSequenceRange(const vector<string>& hashes) {
+  ScopedLatency scoped_latency(
+      etcd_latency_by_op_ms.GetScopedLatency("add_sequence_range"));
+
+  if (hashes.empty()) {
+    return ::util::OkStatus();
+  }
+  Status status(MaybeReject("add_sequence_range", 1));
+  if (!status.ok()) {
+    return status;
+  }
+
+  SequenceRange range;
+  range.set_node_id(node_id_);
+  range.set_timestamp(util::TimeInMilliseconds());
+  for (const auto& hash : hashes) {
+    range.add_entry_hash(hash);
+  }
+  int64_t id;
+  {
+    lock_guard<mutex> lock(mutex_);
+    id = next_sequence_range_id_++;
+  }
+  // Zero-padded, so that the keys sort by number.
+  char id_str[21];
+  CHECK_EQ(20, snprintf(id_str, sizeof(id_str), "%020" PRId64, id));
+  EntryHandle<SequenceRange> handle(
+      GetFullPath(string(kSequenceRangesDir) + id_str + "-" + node_id_),
+      range);
+  status = CreateEntry(&handle);
+  FinishWrites(1, status.ok() ? 1 : 0);
+  return status;
+}
+
+
+Status EtcdConsistentStore::GetSequenceRanges(
+    vector<EntryHandle<SequenceRange>>* ranges) const {
+  CHECK_NOTNULL(ranges)->clear();
+  const Status status(
+      GetAllEntriesInDir(GetFullPath(kSequenceRangesDir), ranges));
+  if (status.CanonicalCode() == util::error::NOT_FOUND) {
+    // No range was ever added.
+    return ::util::OkStatus();
+  }
+  if (!status.ok()) {
+    return status;
+  }
+  sort(ranges->begin(), ranges->end(),
+       [](const EntryHandle<SequenceRange>& a,
+          const EntryHandle<SequenceRange>& b) { return a.Key() < b.Key(); });
+  return ::util::OkStatus();
+}
+
+
+Status EtcdConsistentStore::DeleteSequenceRange(
+    const EntryHandle<SequenceRange>& range) {
+  const Status status(DeleteEntry(range));
+  if (status.ok()) {
+    lock_guard<mutex> lock(mutex_);
+    --num_etcd_entries_;
+  }
+  return status;
+}
+
+
+bool EtcdConsistentStore::SequenceMappingShards::SameKeysAs(
+    const SequenceMappingShards& other) const {
+  if (legacy_index != other.legacy_index ||
+      shards.size() != other.shards.size()) {
+    return false;
+  }
+  for (auto it(shards.begin()), other_it(other.shards.begin());
+       it != shards.end(); ++it, ++other_it) {
+    if (it->first != other_it->first ||
+        it->second.Handle() != other_it->second.Handle()) {
+      return false;
+    }
+  }
+  return true;
+}
+
+
+Status EtcdConsistentStore::GetShardedSequenceMapping(
+    EntryHandle<SequenceMapping>* sequence_mapping) const {
+  SequenceMappingShards fresh;
+
+  EntryHandle<SequenceMapping> legacy;
+  Status status(GetEntry(GetFullPath(kSequenceFile), &legacy));
+  if (status.ok()) {
+    fresh.legacy_index = legacy.Handle();
+  } else if (status.CanonicalCode() != util::error::NOT_FOUND) {
+    return status;
+  }
+
+  SyncTask task(executor_);
+  EtcdClient::GetResponse resp;
+  client_->Get(GetFullPath(kSequenceShardsDir), &resp, task.task());
+  task.Wait();
+  if (task.status().ok()) {
+    if (!resp.node.is_dir_) {
+      return Status(util::error::FAILED_PRECONDITION,
+                    "node is not a directory: " +
+                        GetFullPath(kSequenceShardsDir));
+    }
+    for (const auto& node : resp.node.nodes_) {
+      const int64_t shard(
+          strtoll(node.key_.substr(node.key_.rfind('/') + 1).c_str(),
+                  nullptr, 10));
+      SequenceMapping mapping;
+      CHECK(mapping.ParseFromString(FromBase64(node.value_)));
+      CHECK(fresh.shards
+                .emplace(shard, EntryHandle<SequenceMapping>(
+                                    node.key_, mapping, node.modified_index_))
+                .second);
+    }
+  } else if (task.status().CanonicalCode() != util::error::NOT_FOUND) {
+    return task.status();
+  } else if (!fresh.legacy_index) {
+    return task.status();
+  }
+
+  // Until the unsharded mapping is gone, it is the authoritative one.
+  SequenceMapping mapping;
+  if (fresh.legacy_index) {
+    mapping = legacy.Entry();
+  } else {
+    for (const auto& shard : fresh.shards) {
+      mapping.mutable_mapping()->MergeFrom(shard.second.Entry().mapping());
+    }
+  }
+
+  // Only give out a new version if something changed in etcd, so that
+  // concurrent readers do not invalidate each other.
+  lock_guard<mutex> lock(sequence_shards_lock_);
+  fresh.version = sequence_shards_.version;
+  if (!fresh.SameKeysAs(sequence_shards_)) {
+    ++fresh.version;
+  }
+  sequence_shards_ = fresh;
+  sequence_mapping->Set(GetFullPath(kSequenceShardsDir), mapping,
+                        fresh.version);
+  return ::util::OkStatus();
+}
+
+
+Status EtcdConsistentStore::UpdateShardedSequenceMapping(
+    EntryHandle<SequenceMapping>* entry) {
+  SequenceMappingShards state;
+  {
+    lock_guard<mutex> lock(sequence_shards_lock_);
+    if (entry->Handle() != sequence_shards_.version) {
+      return Status(util::error::FAILED_PRECONDITION,
+                    "sequence mapping changed since it was read");
+    }
+    state = sequence_shards_;
+  }
+
+  map<int64_t, SequenceMapping> new_shards;
+  for (const auto& m : entry->Entry().mapping()) {
+    *new_shards[m.sequence_number() / FLAGS_etcd_sequence_mapping_shard_size]
+         .add_mapping() = m;
+  }
+  std::set<int64_t> shard_numbers;
+  for (const auto& shard : state.shards) {
+    shard_numbers.insert(shard.first);
+  }
+  for (const auto& shard : new_shards) {
+    shard_numbers.insert(shard.first);
+  }
+
+  // Going in ascending order means that, should one of the writes fail,
+  // etcd is left with older entries removed and newer ones added up to
+  // some point, which is still a contiguous mapping.
+  Status status;
+  for (const int64_t shard : shard_numbers) {
+    const auto old_it(state.shards.find(shard));
+    const auto new_it(new_shards.find(shard));
+    if (new_it == new_shards.end()) {
+      // Keep the last shard, even if empty, so that the mapping exists.
+      if (shard == *shard_numbers.rbegin()) {
+        EntryHandle<SequenceMapping> handle(old_it->second.Key(),
+                                            SequenceMapping(),
+                                            old_it->second.Handle());
+        status = UpdateEntry(&handle);
+        old_it->second = handle;
+      } else {
+        status = DeleteEntry(old_it->second);
+        state.shards.erase(old_it);
+      }
+    } else if (old_it == state.shards.end()) {
+      EntryHandle<SequenceMapping> handle(GetSequenceShardPath(shard),
+                                          new_it->second);
+      status = CreateEntry(&handle);
+      state.shards.emplace(shard, handle);
+    } else if (old_it->second.Entry().SerializeAsString() !=
+               new_it->second.SerializeAsString()) {
+      EntryHandle<SequenceMapping> handle(old_it->second.Key(),
+                                          new_it->second,
+                                          old_it->second.Handle());
+      status = UpdateEntry(&handle);
+      old_it->second = handle;
+    }
+    if (!status.ok()) {
+      break;
+    }
+  }
+
+  if (status.ok() && state.legacy_index && !state.shards.empty()) {
+    EntryHandle<SequenceMapping> legacy(GetFullPath(kSequenceFile),
+                                        SequenceMapping(), state.legacy_index);
+    status = DeleteEntry(legacy);
+    state.legacy_index = 0;
+  }
+
+  lock_guard<mutex> lock(sequence_shards_lock_);
+  if (!status.ok()) {
+    // Whatever we did write has to be read back before trying again.
+    ++sequence_shards_.version;
+    return status;
+  }
+  state.version = sequence_shards_.version + 1;
+  sequence_shards_ = state;
+  entry->SetHandle(state.version);
+  return ::util::OkStatus();
+}
+
+
 StatusOr<ClusterNodeState> EtcdConsistentStore::GetClusterNodeState() const {
   ScopedLatency scoped_latency(
       etcd_latency_by_op_ms.GetScopedLatency("get_cluster_node_state"));
@@ -406,7 +1045,7 @@ StatusOr<ClusterNodeState> EtcdConsistentStore::GetClusterNodeState() const {
   if (!status.ok()) {
     return status;
   }
-  return handle.Entry();
+  return move(*handle.MutableEntry());
 }
 
 
@@ -487,6 +1126,17 @@ void EtcdConsistentStore::WatchClusterConfig(
 }
 
 
+void EtcdConsistentStore::WatchPendingEntries(
+    const ConsistentStore::PendingEntriesCallback& cb, Task* task) {
+  client_->Watch(
+      GetFullPath(kEntriesDir),
+      bind(&ConvertMultipleUpdate<LoggedEntry,
+                                  ConsistentStore::PendingEntriesCallback>,
+           cb, _1),
+      task);
+}
+
+
 Status EtcdConsistentStore::SetClusterConfig(const ClusterConfig& config) {
   ScopedLatency scoped_latency(
       etcd_latency_by_op_ms.GetScopedLatency("set_cluster_config"));
@@ -511,14 +1161,15 @@ Status EtcdConsistentStore::GetEntry(const string& path,
     return task.status();
   }
   T t;
-  CHECK(t.ParseFromString(FromBase64(resp.node.value_.c_str())));
+  CHECK(t.ParseFromString(FromBase64(resp.node.value_)));
   entry->Set(path, t, resp.node.modified_index_);
   return ::util::OkStatus();
 }
 
 
+template <class T>
 Status EtcdConsistentStore::GetAllEntriesInDir(
-    const string& dir, vector<EntryHandle<LoggedEntry>>* entries) const {
+    const string& dir, vector<EntryHandle<T>>* entries) const {
   ScopedLatency scoped_latency(
       etcd_latency_by_op_ms.GetScopedLatency("get_all_entries_in_dir"));
 
@@ -536,10 +1187,10 @@ Status EtcdConsistentStore::GetAllEntriesInDir(
                   "node is not a directory: " + dir);
   }
   for (const auto& node : resp.node.nodes_) {
-    LoggedEntry entry;
-    CHECK(entry.ParseFromString(FromBase64(node.value_.c_str())));
+    T entry;
+    CHECK(entry.ParseFromString(FromBase64(node.value_)));
     entries->emplace_back(
-        EntryHandle<LoggedEntry>(node.key_, entry, node.modified_index_));
+        EntryHandle<T>(node.key_, entry, node.modified_index_));
   }
   return ::util::OkStatus();
 }
@@ -660,6 +1311,11 @@ string EtcdConsistentStore::GetEntryPath(const string& hash) const {
 }
 
 
+string EtcdConsistentStore::GetSequenceShardPath(int64_t shard) const {
+  return GetFullPath(string(kSequenceShardsDir) + std::to_string(shard));
+}
+
+
 string EtcdConsistentStore::GetNodePath(const string& id) const {
   return GetFullPath(string(kNodesDir) + id);
 }
@@ -672,8 +1328,39 @@ string EtcdConsistentStore::GetFullPath(const string& key) const {
 }
 
 
-void EtcdConsistentStore::CheckMappingIsContiguousWithServingTree(
+void EtcdConsistentStore::CheckSequenceMapping(
     const SequenceMapping& mapping) const {
+  if (mapping.mapping_size() == 0) {
+    return;
+  }
+
+  lock_guard<mutex> lock(checked_mapping_lock_);
+  // Where the entry last checked is, if still there, going by the part
+  // of the mapping up to it having been found in order then.
+  int begin(0);
+  const auto it(lower_bound(
+      mapping.mapping().begin(), mapping.mapping().end(),
+      checked_sequence_number_,
+      [](const SequenceMapping::Mapping& m, int64_t sequence_number) {
+        return m.sequence_number() < sequence_number;
+      }));
+  if (it != mapping.mapping().end() &&
+      it->sequence_number() == checked_sequence_number_ &&
+      it->entry_hash() == checked_entry_hash_) {
+    begin = it - mapping.mapping().begin();
+  }
+
+  CheckMappingIsOrdered(mapping, begin);
+  CheckMappingIsContiguousWithServingTree(mapping, begin);
+  const SequenceMapping::Mapping& last(
+      mapping.mapping(mapping.mapping_size() - 1));
+  checked_sequence_number_ = last.sequence_number();
+  checked_entry_hash_ = last.entry_hash();
+}
+
+
+void EtcdConsistentStore::CheckMappingIsContiguousWithServingTree(
+    const SequenceMapping& mapping, int begin) const {
   lock_guard<mutex> lock(mutex_);
   if (serving_sth_ && mapping.mapping_size() > 0) {
     // The sequence numbers are signed. However the tree size must fit in
@@ -689,7 +1376,7 @@ void EtcdConsistentStore::CheckMappingIsContiguousWithServingTree(
     // serving tree. (Note that entries below that may not be contiguous
     // because the clean-up operation may not remove them in order.)
     bool above_sth(false);
-    for (int i(0); i < mapping.mapping_size() - 1; ++i) {
+    for (int i(begin); i < mapping.mapping_size() - 1; ++i) {
       const int64_t mapped_seq(mapping.mapping(i).sequence_number());
       if (mapped_seq >= tree_size) {
         CHECK_EQ(mapped_seq + 1, mapping.mapping(i + 1).sequence_number());
@@ -706,9 +1393,10 @@ void EtcdConsistentStore::CheckMappingIsContiguousWithServingTree(
 template <class T>
 Update<T> EtcdConsistentStore::TypedUpdateFromNode(
     const EtcdClient::Node& node) {
-  const string raw_value(FromBase64(node.value_.c_str()));
+  const string raw_value(FromBase64(node.value_));
   T thing;
-  CHECK(thing.ParseFromString(raw_value)) << raw_value;
+  // Deleted nodes have no value, which may not parse.
+  CHECK(node.deleted_ || thing.ParseFromString(raw_value)) << raw_value;
   EntryHandle<T> handle(node.key_, thing);
   if (!node.deleted_) {
     handle.SetHandle(node.modified_index_);
@@ -791,6 +1479,11 @@ StatusOr<int64_t> EtcdConsistentStore::CleanupOldEntries() {
     return status;
   }
 
+  if (FLAGS_etcd_pending_entry_ttl_seconds > 0) {
+    return ExpireServedEntries(clean_up_to_sequence_number,
+                               sequence_mapping.Entry());
+  }
+
   vector<string> keys_to_delete;
   for (int mapping_index = 0;
        mapping_index < sequence_mapping.Entry().mapping_size() &&
@@ -810,11 +1503,67 @@ StatusOr<int64_t> EtcdConsistentStore::CleanupOldEntries() {
   status = task.status();
   if (!status.ok()) {
     LOG(WARNING) << "EtcdDeleteKeys failed: " << task.status();
+  } else {
+    lock_guard<mutex> lock(mutex_);
+    num_etcd_entries_ -= num_entries_cleaned;
   }
   return num_entries_cleaned;
 }
 
 
+StatusOr<int64_t> EtcdConsistentStore::ExpireServedEntries(
+    int64_t clean_up_to_sequence_number, const SequenceMapping& mapping) {
+  unique_lock<mutex> lock(mutex_);
+  const int64_t expired_up_to(expired_up_to_);
+  lock.unlock();
+
+  // Unsequenced entries, and those the serving STH does not cover
+  // yet, keep no TTL, so that they cannot expire before they are
+  // served, however far behind the serving STH falls.
+  vector<string> keys_to_expire;
+  for (const auto& m : mapping.mapping()) {
+    if (m.sequence_number() > expired_up_to &&
+        m.sequence_number() <= clean_up_to_sequence_number) {
+      keys_to_expire.emplace_back(GetEntryPath(m.entry_hash()));
+    }
+  }
+
+  Status status;
+  for (size_t begin = 0; begin < keys_to_expire.size();
+       begin += kMaxConcurrentEntryGets) {
+    const size_t end(
+        min(keys_to_expire.size(), begin + kMaxConcurrentEntryGets));
+    vector<EtcdClient::Response> responses(end - begin);
+    vector<unique_ptr<SyncTask>> tasks;
+    tasks.reserve(end - begin);
+    for (size_t i = begin; i < end; ++i) {
+      tasks.emplace_back(new SyncTask(executor_));
+      client_->RefreshTTL(keys_to_expire[i],
+                          seconds(FLAGS_etcd_pending_entry_ttl_seconds),
+                          &responses[i - begin], tasks.back()->task());
+    }
+    for (const auto& task : tasks) {
+      task->Wait();
+      // Those gone already were cleaned up some other way.
+      if (status.ok() && !task->status().ok() &&
+          task->status().CanonicalCode() != util::error::NOT_FOUND) {
+        status = task->status();
+      }
+    }
+  }
+  if (!status.ok()) {
+    // The next cleanup tries them all again.
+    LOG(WARNING) << "Failed to give served entries their TTL: " << status;
+    return status;
+  }
+
+  lock.lock();
+  expired_up_to_ = max(expired_up_to_, clean_up_to_sequence_number);
+  // They leave num_etcd_entries_ as they expire, through the stats.
+  return keys_to_expire.size();
+}
+
+
 void EtcdConsistentStore::StartEtcdStatsFetch() {
   if (etcd_stats_task_.task()->CancelRequested()) {
     etcd_stats_task_.task()->Return(Status::CANCELLED);
@@ -862,27 +1611,34 @@ void EtcdConsistentStore::EtcdStatsFetchDone(
 //
 // Once the number of entries is above reject_threshold, we will start
 // returning a RESOURCE_EXHAUSTED status, which should result in a 503 being
-// sent to the client.
-Status EtcdConsistentStore::MaybeReject(const string& type) const {
-  unique_lock<mutex> lock(mutex_);
-
-  if (!cluster_config_) {
-    // No config, whatever.
-    return ::util::OkStatus();
-  }
-
-  const int64_t etcd_size(num_etcd_entries_);
-  const int64_t reject_threshold(
-      cluster_config_->etcd_reject_add_pending_threshold());
-  lock.unlock();
-
-  if (etcd_size >= reject_threshold) {
+// sent to the client. The number of entries is kept up to date with the
+// writes of this store as they happen, and the etcd stats only bring it
+// back in line with those of the other nodes now and then, so that this
+// does not let through more than fits, or turn away what would fit,
+// between fetches of the stats.
+Status EtcdConsistentStore::MaybeReject(const string& type,
+                                        int64_t num_entries) {
+  lock_guard<mutex> lock(mutex_);
+  if (cluster_config_ &&
+      num_etcd_entries_ + num_admitted_writes_ + num_entries >
+          cluster_config_->etcd_reject_add_pending_threshold()) {
     etcd_rejected_requests->Increment(type);
     return Status(util::error::RESOURCE_EXHAUSTED,
                   "Rejected due to high number of pending entries.");
   }
+  num_admitted_writes_ += num_entries;
   return ::util::OkStatus();
 }
 
 
+void EtcdConsistentStore::FinishWrites(int64_t num_admitted,
+                                       int64_t num_created) {
+  lock_guard<mutex> lock(mutex_);
+  CHECK_GE(num_admitted_writes_, num_admitted);
+  CHECK_LE(num_created, num_admitted);
+  num_admitted_writes_ -= num_admitted;
+  num_etcd_entries_ += num_created;
+}
+
+
 }  // namespace cert_trans
@@ -2,6 +2,7 @@
 #define CERT_TRANS_LOG_ETCD_CONSISTENT_STORE_H_
 
 #include <stdint.h>
+#include <map>
 #include <memory>
 #include <mutex>
 #include <vector>
@@ -17,16 +18,21 @@
 namespace cert_trans {
 
 class MasterElection;
+class PendingEntryBodies;
 
 
 class EtcdConsistentStore : public ConsistentStore {
  public:
   // No change of ownership for |client|, |executor| must continue to be valid
   // at least as long as this object is, and should not be the libevent::Base
-  // used by |client|.
+  // used by |client|. If |bodies| is set, and keeps the bodies of the
+  // entries of this node, only a stub of the pending entries added is
+  // put in etcd, see PendingEntryBodies. Ownership of |bodies| is not
+  // taken either.
   EtcdConsistentStore(libevent::Base* base, util::Executor* executor,
                       EtcdClient* client, const MasterElection* election,
-                      const std::string& root, const std::string& node_id);
+                      const std::string& root, const std::string& node_id,
+                      PendingEntryBodies* bodies = nullptr);
 
   virtual ~EtcdConsistentStore();
   EtcdConsistentStore(const EtcdConsistentStore&) = delete;
@@ -40,18 +46,68 @@ class EtcdConsistentStore : public ConsistentStore {
 
   util::Status AddPendingEntry(LoggedEntry* entry) override;
 
+  // Sends all the creates to etcd at once, rather than waiting for
+  // each one in turn.
+  void AddPendingEntries(const std::vector<LoggedEntry*>& entries,
+                         std::vector<util::Status>* statuses) override;
+
+  // The entries added by a node keeping their bodies come back as a
+  // stub from this and the other listings of pending entries, except
+  // for GetPendingEntriesForHashes().
   util::Status GetPendingEntryForHash(
       const std::string& hash, EntryHandle<LoggedEntry>* entry) const override;
 
+  // With --etcd_mirror_pending_entries, a local index of the entries
+  // directory is kept up to date by a watch, which is started on the
+  // first call, and the entries it lists are then got all at once,
+  // rather than listing the directory.
   util::Status GetPendingEntries(
       std::vector<EntryHandle<LoggedEntry>>* entries) const override;
 
+  // With --etcd_mirror_pending_entries, the index is also kept in
+  // order, so that only the entries asked for are got.
+  util::Status GetPendingEntriesUpTo(
+      uint64_t max_timestamp, std::vector<EntryHandle<LoggedEntry>>* entries,
+      int64_t* num_later) const override;
+
+  // With --etcd_mirror_pending_entries, this is answered from the
+  // index, without getting any entry from etcd.
+  util::Status GetPendingEntryInfosUpTo(
+      uint64_t max_timestamp, std::vector<PendingEntryInfo>* infos,
+      int64_t* num_later) const override;
+
+  // Sends the gets to etcd together, rather than waiting for each one
+  // in turn. Stubs are replaced by the whole entries, from the nodes
+  // that keep them, which requires the |bodies| given to the
+  // constructor; those which cannot be are not got.
+  void GetPendingEntriesForHashes(
+      const std::vector<std::string>& hashes,
+      std::vector<EntryHandle<LoggedEntry>>* entries,
+      std::vector<util::Status>* statuses) const override;
+
+  // With --etcd_sequence_mapping_shard_size, the mapping is kept in
+  // several keys, each covering a fixed range of sequence numbers, and
+  // updates only rewrite the keys whose range changed. The handle of
+  // |entry| is then a version number local to this store, rather than
+  // an etcd index.
   util::Status GetSequenceMapping(
       EntryHandle<ct::SequenceMapping>* entry) const override;
 
   util::Status UpdateSequenceMapping(
       EntryHandle<ct::SequenceMapping>* entry) override;
 
+  // The ranges are kept as one key each, named after the time they
+  // were added and the node which added them, so that they list
+  // roughly in the order they were added.
+  util::Status AddSequenceRange(
+      const std::vector<std::string>& hashes) override;
+
+  util::Status GetSequenceRanges(
+      std::vector<EntryHandle<ct::SequenceRange>>* ranges) const override;
+
+  util::Status DeleteSequenceRange(
+      const EntryHandle<ct::SequenceRange>& range) override;
+
   util::StatusOr<ct::ClusterNodeState> GetClusterNodeState() const override;
 
   util::Status SetClusterNodeState(const ct::ClusterNodeState& state) override;
@@ -66,23 +122,71 @@ class EtcdConsistentStore : public ConsistentStore {
   void WatchClusterConfig(const ConsistentStore::ClusterConfigCallback& cb,
                           util::Task* task) override;
 
+  void WatchPendingEntries(const ConsistentStore::PendingEntriesCallback& cb,
+                           util::Task* task) override;
+
   util::Status SetClusterConfig(const ct::ClusterConfig& config) override;
 
   // Removes sequenced entries with sequence numbers covered by the current
-  // serving STH.
+  // serving STH. With --etcd_pending_entry_ttl_seconds, see
+  // ExpireServedEntries() instead.
   util::StatusOr<int64_t> CleanupOldEntries() override;
 
  private:
+  struct PendingEntriesMirror;
+
+  // The etcd keys backing a sharded sequence mapping, as last seen.
+  struct SequenceMappingShards {
+    SequenceMappingShards() : version(0), legacy_index(0) {
+    }
+
+    bool SameKeysAs(const SequenceMappingShards& other) const;
+
+    int version;
+    // Index of the unsharded mapping, or 0 if there is none. It is only
+    // removed once all of its contents made it to the shards.
+    int legacy_index;
+    // By shard number.
+    std::map<int64_t, EntryHandle<ct::SequenceMapping>> shards;
+  };
+
   void WaitForServingSTHVersion(std::unique_lock<std::mutex>* lock,
                                 const int version);
 
   template <class T>
   util::Status GetEntry(const std::string& path, EntryHandle<T>* entry) const;
 
-  util::Status GetAllEntriesInDir(
-      const std::string& dir,
+  template <class T>
+  util::Status GetAllEntriesInDir(const std::string& dir,
+                                  std::vector<EntryHandle<T>>* entries) const;
+
+  // Sets |*lock| to hold the lock of |pending_mirror_| once it has the
+  // pending entries, (re)starting its watch as needed.
+  util::Status LockPendingEntriesMirror(
+      std::unique_lock<std::mutex>* lock) const;
+
+  // Fills |entries| with those listed in |pending_mirror_|.
+  util::Status GetMirroredPendingEntries(
+      std::vector<EntryHandle<LoggedEntry>>* entries) const;
+
+  // Gets the pending entries at |paths|, in order, with a few gets in
+  // flight at a time. Those no longer there are left out if
+  // |skip_missing| is true, or fail the call otherwise.
+  util::Status GetPendingEntriesAt(
+      const std::vector<std::string>& paths, bool skip_missing,
       std::vector<EntryHandle<LoggedEntry>>* entries) const;
 
+  void OnPendingEntriesMirrorUpdated(
+      const std::vector<Update<LoggedEntry>>& updates) const;
+
+  util::Status GetShardedSequenceMapping(
+      EntryHandle<ct::SequenceMapping>* entry) const;
+
+  util::Status UpdateShardedSequenceMapping(
+      EntryHandle<ct::SequenceMapping>* entry);
+
+  std::string GetSequenceShardPath(int64_t shard) const;
+
   util::Status UpdateEntry(EntryHandleBase* entry);
 
   util::Status CreateEntry(EntryHandleBase* entry);
@@ -102,8 +206,15 @@ class EtcdConsistentStore : public ConsistentStore {
 
   std::string GetFullPath(const std::string& key) const;
 
+  // Checks that |mapping| is in order, and contiguous above the serving
+  // tree. Only the part of it after the last entry checked by a
+  // previous call is checked, if that entry is still there, as the
+  // mapping only grows at the end.
+  void CheckSequenceMapping(const ct::SequenceMapping& mapping) const;
+
+  // Checks the entries of |mapping| from the |begin|th one on.
   void CheckMappingIsContiguousWithServingTree(
-      const ct::SequenceMapping& mapping) const;
+      const ct::SequenceMapping& mapping, int begin) const;
 
   // The following 3 methods are static just so that they have friend access to
   // the private c'tor/setters of Update<>
@@ -133,11 +244,33 @@ class EtcdConsistentStore : public ConsistentStore {
 
   void OnClusterConfigUpdated(const Update<ct::ClusterConfig>& update);
 
+  // Gives the entries covered by the serving STH, with sequence
+  // numbers up to |clean_up_to_sequence_number| in |mapping|, the TTL,
+  // leaving etcd to drop them. Those given it by an earlier call are
+  // left alone, so that their TTL is not pushed back.
+  util::StatusOr<int64_t> ExpireServedEntries(
+      int64_t clean_up_to_sequence_number, const ct::SequenceMapping& mapping);
+
   void StartEtcdStatsFetch();
   void EtcdStatsFetchDone(EtcdClient::StatsResponse* response,
                           util::Task* task);
 
-  util::Status MaybeReject(const std::string& type) const;
+  // Admits the creation of |num_entries| keys for a request of type
+  // |type|, unless etcd could then hold more entries than the cluster
+  // config allows, counting those admitted but not created yet, in
+  // which case RESOURCE_EXHAUSTED is returned. Must be followed by a
+  // call to FinishWrites() once admitted.
+  util::Status MaybeReject(const std::string& type, int64_t num_entries);
+
+  // Accounts for |num_created| of the |num_admitted| keys admitted by
+  // MaybeReject() having been created.
+  void FinishWrites(int64_t num_admitted, int64_t num_created);
+
+  // Deals with the outcome of creating the pending entry |entry| at
+  // |full_path|, picking up the existing SCT if it was already there.
+  util::Status FinishAddPendingEntry(const std::string& full_path,
+                                     const util::Status& create_status,
+                                     LoggedEntry* entry);
 
   EtcdClient* const client_;              // We don't own this.
   libevent::Base* base_;                  // We don't own this.
@@ -145,6 +278,7 @@ class EtcdConsistentStore : public ConsistentStore {
   const MasterElection* const election_;  // We don't own this.
   const std::string root_;
   const std::string node_id_;
+  PendingEntryBodies* const bodies_;  // We don't own this.
   std::condition_variable serving_sth_cv_;
   util::SyncTask serving_sth_watch_task_;
   util::SyncTask cluster_config_watch_task_;
@@ -155,7 +289,28 @@ class EtcdConsistentStore : public ConsistentStore {
   std::unique_ptr<EntryHandle<ct::SignedTreeHead>> serving_sth_;
   std::unique_ptr<ct::ClusterConfig> cluster_config_;
   bool exiting_;
+  // Number of entries in etcd, as last reported by its stats, plus
+  // those created and less those deleted through this store since.
   int64_t num_etcd_entries_;
+  // Number of keys admitted by MaybeReject() and not created yet.
+  int64_t num_admitted_writes_;
+  // Number of the next range added by AddSequenceRange(), in
+  // microseconds since the epoch, or later.
+  int64_t next_sequence_range_id_;
+  // Sequence number up to which ExpireServedEntries() gave the entries
+  // their TTL, or -1.
+  int64_t expired_up_to_;
+
+  const std::unique_ptr<PendingEntriesMirror> pending_mirror_;
+
+  // The last entry of the mapping checked by CheckSequenceMapping(),
+  // or a sequence number of -1.
+  mutable std::mutex checked_mapping_lock_;
+  mutable int64_t checked_sequence_number_;
+  mutable std::string checked_entry_hash_;
+
+  mutable std::mutex sequence_shards_lock_;
+  mutable SequenceMappingShards sequence_shards_;
 
   friend class EtcdConsistentStoreTest;
   template <class T>
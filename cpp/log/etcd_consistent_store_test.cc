@@ -3,6 +3,7 @@
 #include <gflags/gflags.h>
 #include <gmock/gmock.h>
 #include <gtest/gtest.h>
+#include <algorithm>
 #include <atomic>
 #include <functional>
 #include <map>
@@ -26,6 +27,10 @@
 
 DECLARE_int32(node_state_ttl_seconds);
 DECLARE_int32(etcd_stats_collection_interval_seconds);
+DECLARE_bool(etcd_mirror_pending_entries);
+DECLARE_int32(etcd_pending_entries_resync_seconds);
+DECLARE_int32(etcd_sequence_mapping_shard_size);
+DECLARE_int32(etcd_pending_entry_ttl_seconds);
 
 namespace cert_trans {
 
@@ -56,6 +61,7 @@ using testing::Contains;
 using testing::Pair;
 using testing::Return;
 using testing::SetArgumentPointee;
+using testing::UnorderedElementsAre;
 using util::Status;
 using util::StatusOr;
 using util::SyncTask;
@@ -338,6 +344,26 @@ TEST_F(EtcdConsistentStoreTest,
 }
 
 
+TEST_F(EtcdConsistentStoreTest,
+       TestAddPendingEntryForExistingStubReturnsSct) {
+  LoggedEntry cert(DefaultCert());
+  // Only its hash is left to match, the node keeping it has the rest.
+  LoggedEntry stub(DefaultCert());
+  stub.mutable_sct()->set_timestamp(55555);
+  stub.DropBody("other_node");
+
+  const string kKey(util::HexString(cert.Hash()));
+  const string kPath(string(kRoot) + "/entries/" + kKey);
+  // Set up scenario:
+  InsertEntry(kPath, stub);
+
+  EXPECT_THAT(store_->AddPendingEntry(&cert),
+              StatusIs(util::error::ALREADY_EXISTS));
+  EXPECT_EQ(55555U, cert.timestamp());
+  EXPECT_FALSE(cert.has_body_node_id());
+}
+
+
 TEST_F(EtcdConsistentStoreDeathTest,
        TestAddPendingEntryForExistingNonIdenticalEntry) {
   LoggedEntry cert(DefaultCert());
@@ -349,7 +375,11 @@ TEST_F(EtcdConsistentStoreDeathTest,
   InsertEntry(kPath, other_cert);
 
   EXPECT_DEATH(store_->AddPendingEntry(&cert),
-               "Check failed: LeafEntriesMatch");
+               "Check failed: "
+               "preexisting_entry\\.Entry\\(\\)\\.has_body_node_id\\(\\) "
+               "\\|\\| "
+               "LeafEntriesMatch\\(preexisting_entry\\.Entry\\(\\), "
+               "\\*entry\\)");
 }
 
 
@@ -402,6 +432,121 @@ TEST_F(EtcdConsistentStoreTest, TestGetPendingEntries) {
 }
 
 
+TEST_F(EtcdConsistentStoreTest, TestGetPendingEntriesMirrored) {
+  FLAGS_etcd_mirror_pending_entries = true;
+  const string kPath(string(kRoot) + "/entries/");
+  const LoggedEntry one(MakeCert(123, "one"));
+  const LoggedEntry two(MakeCert(456, "two"));
+  const LoggedEntry three(MakeCert(789, "three"));
+  InsertEntry(kPath + "one", one);
+  InsertEntry(kPath + "two", two);
+
+  vector<EntryHandle<LoggedEntry>> entries;
+  EXPECT_OK(store_->GetPendingEntries(&entries));
+  vector<LoggedEntry> certs;
+  for (const auto& e : entries) {
+    certs.push_back(e.Entry());
+  }
+  EXPECT_THAT(certs, UnorderedElementsAre(one, two));
+
+  // Later changes come in through the watch.
+  SyncTask task(base_.get());
+  client_.ForceDelete(kPath + "one", task.task());
+  task.Wait();
+  ASSERT_OK(task.status());
+  InsertEntry(kPath + "three", three);
+  for (int i = 0; i < 100; ++i) {
+    entries.clear();
+    certs.clear();
+    EXPECT_OK(store_->GetPendingEntries(&entries));
+    for (const auto& e : entries) {
+      certs.push_back(e.Entry());
+    }
+    if (certs.size() == 2 && std::count(certs.begin(), certs.end(), three)) {
+      break;
+    }
+    usleep(10000);
+  }
+  EXPECT_THAT(certs, UnorderedElementsAre(two, three));
+
+  // A resync fetches everything again.
+  FLAGS_etcd_pending_entries_resync_seconds = 0;
+  entries.clear();
+  EXPECT_OK(store_->GetPendingEntries(&entries));
+  EXPECT_EQ(static_cast<size_t>(2), entries.size());
+
+  FLAGS_etcd_pending_entries_resync_seconds = 300;
+  FLAGS_etcd_mirror_pending_entries = false;
+}
+
+
+TEST_F(EtcdConsistentStoreTest, TestGetPendingEntriesUpTo) {
+  const string kPath(string(kRoot) + "/entries/");
+  const LoggedEntry one(MakeCert(456, "one"));
+  const LoggedEntry two(MakeCert(123, "two"));
+  const LoggedEntry three(MakeCert(789, "three"));
+  InsertEntry(kPath + "one", one);
+  InsertEntry(kPath + "two", two);
+  InsertEntry(kPath + "three", three);
+
+  for (const bool mirror : {false, true}) {
+    FLAGS_etcd_mirror_pending_entries = mirror;
+    vector<EntryHandle<LoggedEntry>> entries;
+    int64_t num_later(-1);
+    EXPECT_OK(store_->GetPendingEntriesUpTo(456, &entries, &num_later));
+    ASSERT_EQ(static_cast<size_t>(2), entries.size()) << mirror;
+    EXPECT_EQ(two, entries[0].Entry());
+    EXPECT_EQ(one, entries[1].Entry());
+    EXPECT_EQ(1, num_later);
+  }
+  FLAGS_etcd_mirror_pending_entries = false;
+}
+
+
+TEST_F(EtcdConsistentStoreTest, TestGetPendingEntryInfos) {
+  const LoggedEntry one(MakeCert(456, "one"));
+  const LoggedEntry two(MakeCert(123, "two"));
+  const LoggedEntry three(MakeCert(789, "three"));
+  for (const auto* entry : {&one, &two, &three}) {
+    InsertEntry(string(kRoot) + "/entries/" + util::HexString(entry->Hash()),
+                *entry);
+  }
+
+  for (const bool mirror : {false, true}) {
+    FLAGS_etcd_mirror_pending_entries = mirror;
+    vector<PendingEntryInfo> infos;
+    int64_t num_later(-1);
+    EXPECT_OK(store_->GetPendingEntryInfosUpTo(456, &infos, &num_later));
+    ASSERT_EQ(static_cast<size_t>(2), infos.size()) << mirror;
+    EXPECT_EQ(two.Hash(), infos[0].hash);
+    EXPECT_EQ(123U, infos[0].timestamp);
+    EXPECT_EQ(two.ByteSize(), infos[0].size);
+    EXPECT_EQ(one.Hash(), infos[1].hash);
+    EXPECT_EQ(1, num_later);
+  }
+  FLAGS_etcd_mirror_pending_entries = false;
+
+  vector<EntryHandle<LoggedEntry>> entries;
+  vector<Status> statuses;
+  store_->GetPendingEntriesForHashes({three.Hash(), one.Hash()}, &entries,
+                                     &statuses);
+  ASSERT_EQ(static_cast<size_t>(2), entries.size());
+  ASSERT_EQ(static_cast<size_t>(2), statuses.size());
+  EXPECT_OK(statuses[0]);
+  EXPECT_EQ(three, entries[0].Entry());
+  EXPECT_OK(statuses[1]);
+  EXPECT_EQ(one, entries[1].Entry());
+
+  // The others are still got.
+  store_->GetPendingEntriesForHashes({"Nah", one.Hash()}, &entries,
+                                     &statuses);
+  ASSERT_EQ(static_cast<size_t>(2), statuses.size());
+  EXPECT_THAT(statuses[0], StatusIs(util::error::NOT_FOUND));
+  EXPECT_OK(statuses[1]);
+  EXPECT_EQ(one, entries[1].Entry());
+}
+
+
 TEST_F(EtcdConsistentStoreDeathTest,
        TestGetPendingEntriesBarfsWithSequencedEntry) {
   const string kPath(string(kRoot) + "/entries/");
@@ -482,6 +627,76 @@ TEST_F(EtcdConsistentStoreTest, TestUpdateSequenceMapping) {
 }
 
 
+TEST_F(EtcdConsistentStoreTest, TestShardedSequenceMapping) {
+  FLAGS_etcd_sequence_mapping_shard_size = 2;
+  const string kShards(string(kRoot) + "/sequence_mapping_shards/");
+
+  // The first update moves the unsharded mapping over.
+  AddSequenceMapping(0, "zero");
+  EtcdClient::GetResponse resp;
+  {
+    SyncTask task(base_.get());
+    client_.Get(string(kRoot) + "/sequence_mapping", &resp, task.task());
+    task.Wait();
+    EXPECT_THAT(task.status(), StatusIs(util::error::NOT_FOUND));
+  }
+
+  AddSequenceMapping(1, "one");
+  AddSequenceMapping(2, "two");
+  AddSequenceMapping(3, "three");
+  AddSequenceMapping(4, "four");
+  SequenceMapping shard;
+  PeekEntry(kShards + "1", &shard);
+  EXPECT_EQ(2, shard.mapping_size());
+  {
+    SyncTask task(base_.get());
+    client_.Get(kShards + "1", &resp, task.task());
+    task.Wait();
+    ASSERT_OK(task.status());
+  }
+  const int64_t shard_one_index(resp.node.modified_index_);
+
+  // Only the tail shard gets rewritten.
+  AddSequenceMapping(5, "five");
+  {
+    SyncTask task(base_.get());
+    client_.Get(kShards + "1", &resp, task.task());
+    task.Wait();
+    ASSERT_OK(task.status());
+  }
+  EXPECT_EQ(shard_one_index, resp.node.modified_index_);
+  PeekEntry(kShards + "2", &shard);
+  EXPECT_EQ(2, shard.mapping_size());
+
+  EntryHandle<SequenceMapping> stale;
+  ASSERT_OK(store_->GetSequenceMapping(&stale));
+  ASSERT_EQ(6, stale.Entry().mapping_size());
+  for (int i = 0; i < stale.Entry().mapping_size(); ++i) {
+    EXPECT_EQ(i, stale.Entry().mapping(i).sequence_number());
+  }
+
+  // Emptied shards go away.
+  EntryHandle<SequenceMapping> mapping;
+  ASSERT_OK(store_->GetSequenceMapping(&mapping));
+  mapping.MutableEntry()->mutable_mapping()->DeleteSubrange(0, 2);
+  EXPECT_OK(store_->UpdateSequenceMapping(&mapping));
+  {
+    SyncTask task(base_.get());
+    client_.Get(kShards + "0", &resp, task.task());
+    task.Wait();
+    EXPECT_THAT(task.status(), StatusIs(util::error::NOT_FOUND));
+  }
+  ASSERT_OK(store_->GetSequenceMapping(&mapping));
+  EXPECT_EQ(4, mapping.Entry().mapping_size());
+
+  // Updates made from an out of date mapping are refused.
+  EXPECT_THAT(store_->UpdateSequenceMapping(&stale),
+              StatusIs(util::error::FAILED_PRECONDITION));
+
+  FLAGS_etcd_sequence_mapping_shard_size = 0;
+}
+
+
 TEST_F(EtcdConsistentStoreDeathTest,
        TestUpdateSequenceMappingBarfsWithOutOfOrderSequenceNumber) {
   EntryHandle<SequenceMapping> mapping;
@@ -517,6 +732,32 @@ TEST_F(EtcdConsistentStoreDeathTest,
 }
 
 
+TEST_F(EtcdConsistentStoreDeathTest,
+       TestUpdateSequenceMappingBarfsOnGapAfterCheckedEntries) {
+  // Contiguity is only checked against a serving STH.
+  SignedTreeHead sth;
+  sth.set_timestamp(123);
+  sth.set_tree_size(0);
+  CHECK_EQ(::util::OkStatus(), store_->SetServingSTH(sth));
+
+  EntryHandle<SequenceMapping> mapping;
+  EXPECT_OK(store_->GetSequenceMapping(&mapping));
+  for (int64_t seq : {0, 1}) {
+    SequenceMapping::Mapping* const m(mapping.MutableEntry()->add_mapping());
+    m->set_sequence_number(seq);
+    m->set_entry_hash("hash" + std::to_string(seq));
+  }
+  EXPECT_OK(store_->UpdateSequenceMapping(&mapping));
+
+  // Only what comes after the entries checked already is checked
+  // again, which still has to follow on from them.
+  SequenceMapping::Mapping* const m(mapping.MutableEntry()->add_mapping());
+  m->set_sequence_number(3);
+  m->set_entry_hash("hash3");
+  EXPECT_DEATH(store_->UpdateSequenceMapping(&mapping), "mapped_seq \\+ 1");
+}
+
+
 TEST_F(EtcdConsistentStoreTest, TestSetClusterNodeState) {
   const string kPath(string(kRoot) + "/nodes/" + kNodeId);
 
@@ -764,6 +1005,90 @@ TEST_F(EtcdConsistentStoreTest, TestCleansUpToNewSTH) {
 }
 
 
+TEST_F(EtcdConsistentStoreTest, TestCleanupWithPendingEntryTTL) {
+  FLAGS_etcd_pending_entry_ttl_seconds = 1;
+  PopulateForCleanupTests(3, 2, 0);
+  EntryHandle<SequenceMapping> mapping;
+  ASSERT_OK(store_->GetSequenceMapping(&mapping));
+  ASSERT_EQ(3, mapping.Entry().mapping_size());
+
+  const auto has_expiry([this](const string& hash) {
+    EtcdClient::GetResponse resp;
+    SyncTask task(base_.get());
+    client_.Get(string(kRoot) + "/entries/" + util::HexString(hash), &resp,
+                task.task());
+    task.Wait();
+    CHECK_EQ(::util::OkStatus(), task.status());
+    return resp.node.HasExpiry();
+  });
+  vector<EntryHandle<LoggedEntry>> pending;
+  ASSERT_OK(store_->GetPendingEntries(&pending));
+  ASSERT_EQ(5U, pending.size());
+  for (const auto& entry : pending) {
+    EXPECT_FALSE(has_expiry(entry.Entry().Hash()));
+  }
+
+  EXPECT_CALL(election_, IsMaster()).WillRepeatedly(Return(true));
+  SignedTreeHead sth;
+  sth.set_timestamp(345345);
+  sth.set_tree_size(1);
+  CHECK(store_->SetServingSTH(sth).ok());
+  {
+    const StatusOr<int64_t> num_cleaned(CleanupOldEntries());
+    ASSERT_OK(num_cleaned.status());
+    EXPECT_EQ(1, num_cleaned.ValueOrDie());
+  }
+  EXPECT_TRUE(has_expiry(mapping.Entry().mapping(0).entry_hash()));
+  {
+    // It keeps the TTL it was given.
+    const StatusOr<int64_t> num_cleaned(CleanupOldEntries());
+    ASSERT_OK(num_cleaned.status());
+    EXPECT_EQ(0, num_cleaned.ValueOrDie());
+  }
+
+  // The serving STH lags behind for longer than the TTL, which those
+  // it does not cover do not have.
+  sleep(2);
+  EntryHandle<LoggedEntry> unused;
+  EXPECT_THAT(store_->GetPendingEntryForHash(
+                  mapping.Entry().mapping(0).entry_hash(), &unused),
+              StatusIs(util::error::NOT_FOUND));
+  for (int i = 1; i < 3; ++i) {
+    EXPECT_OK(store_->GetPendingEntryForHash(
+        mapping.Entry().mapping(i).entry_hash(), &unused));
+    EXPECT_FALSE(has_expiry(mapping.Entry().mapping(i).entry_hash()));
+  }
+  vector<EntryHandle<LoggedEntry>> left;
+  ASSERT_OK(store_->GetPendingEntries(&left));
+  EXPECT_EQ(4U, left.size());
+
+  sth.set_timestamp(sth.timestamp() + 1);
+  sth.set_tree_size(3);
+  CHECK(store_->SetServingSTH(sth).ok());
+  {
+    const StatusOr<int64_t> num_cleaned(CleanupOldEntries());
+    ASSERT_OK(num_cleaned.status());
+    EXPECT_EQ(2, num_cleaned.ValueOrDie());
+  }
+  for (int i = 1; i < 3; ++i) {
+    EXPECT_TRUE(has_expiry(mapping.Entry().mapping(i).entry_hash()));
+  }
+  // Those not sequenced yet never get one.
+  left.clear();
+  ASSERT_OK(store_->GetPendingEntries(&left));
+  ASSERT_EQ(4U, left.size());
+  int num_without_expiry(0);
+  for (const auto& entry : left) {
+    if (!has_expiry(entry.Entry().Hash())) {
+      ++num_without_expiry;
+    }
+  }
+  EXPECT_EQ(2, num_without_expiry);
+
+  FLAGS_etcd_pending_entry_ttl_seconds = 0;
+}
+
+
 TEST_F(EtcdConsistentStoreTest, TestStoreStatsFetcher) {
   EXPECT_EQ(0, GetNumEtcdEntries());
   PopulateForCleanupTests(100, 100, 100);
@@ -773,14 +1098,16 @@ TEST_F(EtcdConsistentStoreTest, TestStoreStatsFetcher) {
 
 
 TEST_F(EtcdConsistentStoreTest, TestRejectsAddsWhenOverCapacity) {
+  EXPECT_EQ(0, GetNumEtcdEntries());
+
+  // Filled up before the threshold is set, as the adds of this node
+  // are counted against it too.
+  PopulateForCleanupTests(3, 0, 1);
+
   ct::ClusterConfig config;
   config.set_etcd_reject_add_pending_threshold(2);
   util::Status status(store_->SetClusterConfig(config));
   ASSERT_OK(status);
-
-  EXPECT_EQ(0, GetNumEtcdEntries());
-
-  PopulateForCleanupTests(3, 0, 1);
   sleep(2 * FLAGS_etcd_stats_collection_interval_seconds);
 
   EXPECT_LT(2, GetNumEtcdEntries());
@@ -791,6 +1118,43 @@ TEST_F(EtcdConsistentStoreTest, TestRejectsAddsWhenOverCapacity) {
 }
 
 
+TEST_F(EtcdConsistentStoreTest, TestCountsOwnAddsBetweenStatsFetches) {
+  ct::ClusterConfig config;
+  config.set_etcd_reject_add_pending_threshold(5);
+  ASSERT_OK(store_->SetClusterConfig(config));
+
+  // A batch which does not fit goes nowhere.
+  vector<LoggedEntry> certs;
+  for (int i = 0; i < 6; ++i) {
+    certs.emplace_back(MakeCert(1000 + i, "cert" + std::to_string(i)));
+  }
+  vector<LoggedEntry*> batch;
+  for (auto& cert : certs) {
+    batch.push_back(&cert);
+  }
+  vector<util::Status> statuses;
+  store_->AddPendingEntries(batch, &statuses);
+  ASSERT_EQ(certs.size(), statuses.size());
+  for (const auto& status : statuses) {
+    EXPECT_THAT(status, StatusIs(util::error::RESOURCE_EXHAUSTED));
+  }
+
+  // The adds one at a time are turned away as soon as the threshold
+  // is reached, without waiting for etcd stats to show it.
+  int num_added(0);
+  for (auto& cert : certs) {
+    const util::Status status(store_->AddPendingEntry(&cert));
+    if (!status.ok()) {
+      EXPECT_THAT(status, StatusIs(util::error::RESOURCE_EXHAUSTED));
+      break;
+    }
+    ++num_added;
+  }
+  EXPECT_GE(5, num_added);
+  EXPECT_LE(5, GetNumEtcdEntries());
+}
+
+
 }  // namespace cert_trans
 
 int main(int argc, char** argv) {
@@ -1,5 +1,6 @@
 #include "log/file_db.h"
 
+#include <gflags/gflags.h>
 #include <glog/logging.h>
 #include <stdint.h>
 #include <map>
@@ -12,9 +13,18 @@
 #include "monitoring/monitoring.h"
 #include "proto/ct.pb.h"
 #include "proto/serializer.h"
+#include "proto/tls_encoding.h"
 #include "util/util.h"
 
+DEFINE_bool(file_db_index_snapshot, true,
+            "Save the index of the database when closing it, so that the "
+            "next open does not have to read every entry to rebuild it. "
+            "The snapshot is discarded when opening, so that it is only "
+            "used after a clean shutdown.");
+
 using cert_trans::serialization::DeserializeResult;
+using cert_trans::serialization::WriteUint;
+using cert_trans::serialization::WriteVarBytes;
 using std::chrono::milliseconds;
 using std::lock_guard;
 using std::make_pair;
@@ -26,6 +36,7 @@ using std::string;
 using std::to_string;
 using std::unique_lock;
 using std::unique_ptr;
+using std::vector;
 
 namespace cert_trans {
 namespace {
@@ -37,6 +48,11 @@ static Latency<milliseconds, string> latency_by_op_ms(
 
 
 const char kMetaNodeIdKey[] = "node_id";
+const char kMetaTreeFrontierKey[] = "tree_frontier";
+const char kMetaIndexSnapshotKey[] = "index_snapshot";
+
+const uint8_t kIndexSnapshotVersion = 1;
+const size_t kMaxHashLength = 255;
 
 
 string FormatSequenceNumber(const int64_t seq) {
@@ -82,6 +98,48 @@ class FileDB::Iterator : public Database::Iterator {
     return true;
   }
 
+  // Reads the entries of the batch concurrently, rather than waiting
+  // on the disk for each one in turn.
+  size_t GetNextEntries(size_t max_entries,
+                        vector<LoggedEntry>* entries) override {
+    CHECK_NOTNULL(entries);
+    vector<int64_t> sequence_numbers;
+    {
+      lock_guard<mutex> lock(db_->lock_);
+      while (sequence_numbers.size() < max_entries) {
+        if (next_index_ >= db_->contiguous_size_) {
+          set<int64_t>::const_iterator it(
+              db_->sparse_entries_.lower_bound(next_index_));
+          if (it == db_->sparse_entries_.end()) {
+            break;
+          }
+
+          next_index_ = *it;
+        }
+        sequence_numbers.push_back(next_index_++);
+      }
+    }
+
+    vector<string> keys;
+    keys.reserve(sequence_numbers.size());
+    for (const int64_t seq : sequence_numbers) {
+      keys.emplace_back(FormatSequenceNumber(seq));
+    }
+    ScopedLatency latency(
+        latency_by_op_ms.GetScopedLatency("lookup_by_index_batch"));
+    vector<string> data;
+    const vector<util::Status> statuses(
+        db_->cert_storage_->LookupEntries(keys, &data));
+
+    entries->resize(sequence_numbers.size());
+    for (size_t i = 0; i < sequence_numbers.size(); ++i) {
+      CHECK_EQ(statuses[i], ::util::OkStatus());
+      CHECK((*entries)[i].ParseFromString(data[i]));
+      CHECK_EQ((*entries)[i].sequence_number(), sequence_numbers[i]);
+    }
+    return sequence_numbers.size();
+  }
+
  private:
   const FileDB* const db_;
   int64_t next_index_;
@@ -94,13 +152,19 @@ FileDB::FileDB(FileStorage* cert_storage, FileStorage* tree_storage,
       tree_storage_(CHECK_NOTNULL(tree_storage)),
       meta_storage_(CHECK_NOTNULL(meta_storage)),
       contiguous_size_(0),
+      id_by_hash_memory_("id_by_hash"),
       latest_tree_timestamp_(0) {
   ScopedLatency latency(latency_by_op_ms.GetScopedLatency("open"));
-  BuildIndex();
+  if (!FLAGS_file_db_index_snapshot || !LoadIndexSnapshot()) {
+    BuildIndex();
+  }
 }
 
 
 FileDB::~FileDB() {
+  if (FLAGS_file_db_index_snapshot) {
+    WriteIndexSnapshot();
+  }
 }
 
 
@@ -118,6 +182,42 @@ Database::WriteResult FileDB::CreateSequencedEntry_(
 
   unique_lock<mutex> lock(lock_);
 
+  const Database::WriteResult result(
+      CreateSequencedEntryNoLock(logged, seq_str, data));
+  cert_storage_->Sync();
+  return result;
+}
+
+
+Database::WriteResult FileDB::CreateSequencedEntries_(
+    const vector<LoggedEntry>& logged) {
+  ScopedLatency latency(
+      latency_by_op_ms.GetScopedLatency("create_sequenced_entries"));
+
+  // Serialize everything before taking the lock, then write the whole
+  // batch under a single acquisition of it.
+  vector<string> data(logged.size());
+  for (size_t i = 0; i < logged.size(); ++i) {
+    CHECK(logged[i].SerializeToString(&data[i]));
+  }
+
+  unique_lock<mutex> lock(lock_);
+
+  Database::WriteResult result(this->OK);
+  for (size_t i = 0; i < logged.size() && result == this->OK; ++i) {
+    result = CreateSequencedEntryNoLock(
+        logged[i], FormatSequenceNumber(logged[i].sequence_number()),
+        data[i]);
+  }
+  // Directories shared by the batch are only synced once.
+  cert_storage_->Sync();
+
+  return result;
+}
+
+
+Database::WriteResult FileDB::CreateSequencedEntryNoLock(
+    const LoggedEntry& logged, const string& seq_str, const string& data) {
   // Try to create.
   util::Status status(cert_storage_->CreateEntry(seq_str, data));
   if (status.CanonicalCode() == util::error::ALREADY_EXISTS) {
@@ -213,6 +313,7 @@ Database::WriteResult FileDB::WriteTreeHead_(const ct::SignedTreeHead& sth) {
     return this->DUPLICATE_TREE_HEAD_TIMESTAMP;
   }
   CHECK_EQ(status, ::util::OkStatus());
+  tree_storage_->Sync();
 
   if (sth.timestamp() > latest_tree_timestamp_) {
     latest_tree_timestamp_ = sth.timestamp();
@@ -259,8 +360,8 @@ void FileDB::AddNotifySTHCallback(
 
 void FileDB::RemoveNotifySTHCallback(
     const Database::NotifySTHCallback* callback) {
-  lock_guard<mutex> lock(lock_);
-
+  // Not under |lock_|: |callbacks_| has a lock of its own, and may
+  // wait for callbacks that read from the database.
   callbacks_.Remove(callback);
 }
 
@@ -275,6 +376,7 @@ void FileDB::InitializeNode(const string& node_id) {
                << existing_id;
   }
   CHECK(meta_storage_->CreateEntry(kMetaNodeIdKey, node_id).ok());
+  meta_storage_->Sync();
 }
 
 
@@ -287,6 +389,40 @@ Database::LookupResult FileDB::NodeId(string* node_id) {
 }
 
 
+void FileDB::WriteTreeFrontier(const ct::CompactTreeFrontier& frontier) {
+  ScopedLatency latency(
+      latency_by_op_ms.GetScopedLatency("write_tree_frontier"));
+  string data;
+  CHECK(frontier.SerializeToString(&data));
+
+  lock_guard<mutex> lock(lock_);
+  string existing;
+  if (meta_storage_->LookupEntry(kMetaTreeFrontierKey, &existing).ok()) {
+    CHECK(meta_storage_->UpdateEntry(kMetaTreeFrontierKey, data).ok());
+  } else {
+    CHECK(meta_storage_->CreateEntry(kMetaTreeFrontierKey, data).ok());
+  }
+  meta_storage_->Sync();
+}
+
+
+Database::LookupResult FileDB::LatestTreeFrontier(
+    ct::CompactTreeFrontier* result) const {
+  CHECK_NOTNULL(result);
+  ScopedLatency latency(
+      latency_by_op_ms.GetScopedLatency("latest_tree_frontier"));
+  string data;
+  {
+    lock_guard<mutex> lock(lock_);
+    if (!meta_storage_->LookupEntry(kMetaTreeFrontierKey, &data).ok()) {
+      return this->NOT_FOUND;
+    }
+  }
+  CHECK(result->ParseFromString(data));
+  return this->LOOKUP_OK;
+}
+
+
 void FileDB::BuildIndex() {
   ScopedLatency latency(latency_by_op_ms.GetScopedLatency("build_index"));
   // Technically, this should only be called from the constructor, so
@@ -328,6 +464,102 @@ void FileDB::BuildIndex() {
 }
 
 
+// The snapshot is the state of the index, rather than every entry, as
+// only the lowest sequence number of each hash is needed.
+void FileDB::WriteIndexSnapshot() {
+  ScopedLatency latency(
+      latency_by_op_ms.GetScopedLatency("write_index_snapshot"));
+  lock_guard<mutex> lock(lock_);
+
+  string snapshot;
+  WriteUint(kIndexSnapshotVersion, 1, &snapshot);
+  WriteUint(latest_tree_timestamp_, 8, &snapshot);
+  WriteUint(static_cast<uint64_t>(contiguous_size_), 8, &snapshot);
+  WriteUint(sparse_entries_.size(), 8, &snapshot);
+  for (const int64_t seq : sparse_entries_) {
+    WriteUint(static_cast<uint64_t>(seq), 8, &snapshot);
+  }
+  WriteUint(id_by_hash_.size(), 8, &snapshot);
+  for (const auto& it : id_by_hash_) {
+    CHECK_LE(it.first.size(), kMaxHashLength);
+    WriteVarBytes(it.first, kMaxHashLength, &snapshot);
+    WriteUint(static_cast<uint64_t>(it.second), 8, &snapshot);
+  }
+
+  WriteIndexSnapshotEntry(snapshot);
+}
+
+
+bool FileDB::LoadIndexSnapshot() {
+  ScopedLatency latency(
+      latency_by_op_ms.GetScopedLatency("load_index_snapshot"));
+  lock_guard<mutex> lock(lock_);
+
+  string snapshot;
+  if (!meta_storage_->LookupEntry(kMetaIndexSnapshotKey, &snapshot).ok() ||
+      snapshot.empty()) {
+    return false;
+  }
+
+  TLSDeserializer reader(snapshot);
+  uint8_t version;
+  uint64_t contiguous_size, num_sparse;
+  CHECK(reader.ReadUint(1, &version));
+  if (version != kIndexSnapshotVersion) {
+    LOG(WARNING) << "Ignoring index snapshot with unknown version "
+                 << static_cast<int>(version);
+    return false;
+  }
+  CHECK(reader.ReadUint(8, &latest_tree_timestamp_));
+  CHECK(reader.ReadUint(8, &contiguous_size));
+  contiguous_size_ = contiguous_size;
+  CHECK(reader.ReadUint(8, &num_sparse));
+  for (uint64_t i = 0; i < num_sparse; ++i) {
+    uint64_t seq;
+    CHECK(reader.ReadUint(8, &seq));
+    sparse_entries_.insert(sparse_entries_.end(), seq);
+  }
+  uint64_t num_hashes;
+  CHECK(reader.ReadUint(8, &num_hashes));
+  id_by_hash_.reserve(num_hashes);
+  for (uint64_t i = 0; i < num_hashes; ++i) {
+    string hash;
+    uint64_t seq;
+    CHECK(reader.ReadVarBytes(kMaxHashLength, &hash));
+    CHECK(reader.ReadUint(8, &seq));
+    id_by_hash_.emplace(std::move(hash), seq);
+  }
+  CHECK(reader.ReachedEnd());
+  id_by_hash_memory_.Set(UnorderedMapByteSize(
+      id_by_hash_,
+      id_by_hash_.empty() ? 0 : id_by_hash_.begin()->first.size() + 1));
+
+  if (latest_tree_timestamp_ > 0) {
+    latest_timestamp_key_ =
+        Serializer::SerializeUint(latest_tree_timestamp_,
+                                  FileDB::kTimestampBytesIndexed);
+  }
+
+  // Writes made from now on are not in the snapshot, so it must not be
+  // used again if we do not get to write a new one.
+  WriteIndexSnapshotEntry("");
+  LOG(INFO) << "Loaded index snapshot of " << num_hashes << " entries";
+
+  return true;
+}
+
+
+// This must be called with "lock_" held.
+void FileDB::WriteIndexSnapshotEntry(const string& snapshot) {
+  if (meta_storage_->LookupEntry(kMetaIndexSnapshotKey, nullptr).ok()) {
+    CHECK(meta_storage_->UpdateEntry(kMetaIndexSnapshotKey, snapshot).ok());
+  } else {
+    CHECK(meta_storage_->CreateEntry(kMetaIndexSnapshotKey, snapshot).ok());
+  }
+  meta_storage_->Sync();
+}
+
+
 Database::LookupResult FileDB::LatestTreeHeadNoLock(
     ct::SignedTreeHead* result) const {
   if (latest_tree_timestamp_ == 0) {
@@ -352,6 +584,7 @@ void FileDB::InsertEntryMapping(int64_t sequence_number, const string& hash) {
     // Make sure we track the entry with the lowest sequence number:
     id_by_hash_[hash] = min(id_by_hash_[hash], sequence_number);
   }
+  id_by_hash_memory_.Set(UnorderedMapByteSize(id_by_hash_, hash.size() + 1));
 
   if (sequence_number == contiguous_size_) {
     ++contiguous_size_;
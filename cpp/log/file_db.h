@@ -10,6 +10,7 @@
 #include <vector>
 
 #include "log/database.h"
+#include "monitoring/memory_usage.h"
 #include "proto/ct.pb.h"
 #include "util/statusor.h"
 
@@ -23,7 +24,8 @@ class FileStorage;
 class FileDB : public Database {
  public:
   // Reference implementation: reads the entire database on boot
-  // and builds an in-memory index.
+  // and builds an in-memory index, unless it was closed cleanly and
+  // left a snapshot of its index behind (see --file_db_index_snapshot).
   // Writes to the underlying FileStorage are atomic (assuming underlying
   // file system operations such as 'rename' are atomic) which should
   // guarantee full recoverability from crashes/power failures.
@@ -45,6 +47,9 @@ class FileDB : public Database {
   Database::WriteResult CreateSequencedEntry_(
       const LoggedEntry& logged) override;
 
+  Database::WriteResult CreateSequencedEntries_(
+      const std::vector<LoggedEntry>& logged) override;
+
   Database::LookupResult LookupByHash(const std::string& hash,
                                       LoggedEntry* result) const override;
 
@@ -71,10 +76,23 @@ class FileDB : public Database {
 
   Database::LookupResult NodeId(std::string* node_id) override;
 
+  void WriteTreeFrontier(const ct::CompactTreeFrontier& frontier) override;
+
+  Database::LookupResult LatestTreeFrontier(
+      ct::CompactTreeFrontier* result) const override;
+
  private:
   class Iterator;
 
   void BuildIndex();
+  void WriteIndexSnapshot();
+  // Returns false if there is no usable snapshot, in which case the
+  // index is left untouched.
+  bool LoadIndexSnapshot();
+  void WriteIndexSnapshotEntry(const std::string& snapshot);
+  Database::WriteResult CreateSequencedEntryNoLock(const LoggedEntry& logged,
+                                                   const std::string& seq_str,
+                                                   const std::string& data);
   Database::LookupResult LatestTreeHeadNoLock(
       ct::SignedTreeHead* result) const;
   void InsertEntryMapping(int64_t sequence_number, const std::string& hash);
@@ -91,6 +109,7 @@ class FileDB : public Database {
 
   int64_t contiguous_size_;
   std::unordered_map<std::string, int64_t> id_by_hash_;
+  MemoryUsage id_by_hash_memory_;
 
   // This is a mapping of the non-contiguous entries of the log (which
   // can happen while it is being fetched). When entries here become
@@ -3,21 +3,77 @@
 
 #include <dirent.h>
 #include <errno.h>
+#include <fcntl.h>
+#include <gflags/gflags.h>
 #include <glog/logging.h>
 #include <sys/stat.h>
 #include <unistd.h>
+#include <algorithm>
+#include <atomic>
 #include <cstdlib>
 #include <set>
 #include <string>
+#include <thread>
+#include <vector>
 
 #include "log/filesystem_ops.h"
+#include "util/sync_task.h"
+#include "util/task.h"
 #include "util/util.h"
 
+DEFINE_int32(file_storage_scan_threads, 8,
+             "Number of threads scanning the top level directories of a "
+             "file storage in parallel.");
+DEFINE_bool(file_storage_fsync, false,
+            "Sync the data of file storage entries to disk before moving "
+            "them into place, and their directories when the database "
+            "makes a batch of writes durable.");
+
 using cert_trans::BasicFilesystemOps;
 using cert_trans::FilesystemOps;
+using std::atomic;
+using std::lock_guard;
+using std::mutex;
 using std::string;
+using std::thread;
+using std::vector;
 
 namespace cert_trans {
+namespace {
+
+
+// Returns the names in |dir_path|, leaving out the hidden ones.
+vector<string> ListDirectory(const string& dir_path) {
+  // TODO: make opendir part of filesystemop.
+  DIR* dir = CHECK_NOTNULL(opendir(dir_path.c_str()));
+  vector<string> names;
+  struct dirent* entry;
+  while ((entry = readdir(dir)) != NULL) {
+    if (entry->d_name[0] == '.')
+      continue;
+    names.emplace_back(entry->d_name);
+  }
+  closedir(dir);
+  return names;
+}
+
+
+void SyncFile(const string& path) {
+  const int fd(open(path.c_str(), O_RDONLY));
+  PCHECK(fd >= 0) << "open " << path;
+  PCHECK(fsync(fd) == 0) << "fsync " << path;
+  close(fd);
+}
+
+
+string Dirname(const string& path) {
+  const string::size_type slash(path.rfind('/'));
+  CHECK_NE(slash, string::npos) << path;
+  return path.substr(0, slash);
+}
+
+
+}  // namespace
 
 
 FileStorage::FileStorage(const string& file_base, int storage_depth)
@@ -52,11 +108,50 @@ FileStorage::~FileStorage() {
 
 std::set<string> FileStorage::Scan() const {
   std::set<string> storage_keys;
-  ScanDir(storage_dir_, storage_depth_, &storage_keys);
+  if (storage_depth_ == 0 || FLAGS_file_storage_scan_threads <= 1) {
+    ScanDir(storage_dir_, storage_depth_, &storage_keys);
+    return storage_keys;
+  }
+
+  // With many entries, scanning is mostly waiting on the disk, so the
+  // top level directories are spread over threads.
+  const vector<string> subdirs(ListDirectory(storage_dir_));
+  const size_t num_threads(std::min<size_t>(FLAGS_file_storage_scan_threads,
+                                            subdirs.size()));
+  vector<std::set<string>> thread_keys(num_threads);
+  atomic<size_t> next_subdir(0);
+  vector<thread> threads;
+  for (size_t i = 0; i < num_threads; ++i) {
+    threads.emplace_back([this, &subdirs, &next_subdir, &thread_keys, i]() {
+      for (size_t n; (n = next_subdir++) < subdirs.size();) {
+        ScanDir(storage_dir_ + "/" + subdirs[n], storage_depth_ - 1,
+                &thread_keys[i]);
+      }
+    });
+  }
+  for (auto& t : threads) {
+    t.join();
+  }
+
+  for (const auto& keys : thread_keys) {
+    storage_keys.insert(keys.begin(), keys.end());
+  }
   return storage_keys;
 }
 
 
+void FileStorage::Sync() {
+  std::set<string> dirs;
+  {
+    lock_guard<mutex> lock(dirs_lock_);
+    dirs.swap(unsynced_dirs_);
+  }
+  for (const auto& dir : dirs) {
+    SyncFile(dir);
+  }
+}
+
+
 util::Status FileStorage::CreateEntry(const string& key, const string& data) {
   if (LookupEntry(key, NULL).ok()) {
     return util::Status(util::error::ALREADY_EXISTS,
@@ -77,9 +172,26 @@ util::Status FileStorage::UpdateEntry(const string& key, const string& data) {
 }
 
 
+util::Status FileStorage::DeleteEntry(const string& key) {
+  const string data_file(StoragePath(key));
+  if (file_op_->remove(data_file) != 0) {
+    CHECK_EQ(errno, ENOENT);
+    return util::Status(util::error::NOT_FOUND,
+                        "tried to delete non-existent entry: " + key);
+  }
+  AddUnsyncedDirectory(Dirname(data_file));
+  return ::util::OkStatus();
+}
+
+
 util::Status FileStorage::LookupEntry(const string& key,
                                       string* result) const {
   string data_file = StoragePath(key);
+  // Try reading straight away, only checking whether the entry exists
+  // if that fails, which saves a system call on the common path.
+  if (result && util::ReadBinaryFile(data_file, result)) {
+    return ::util::OkStatus();
+  }
   if (!FileExists(data_file)) {
     return util::Status(util::error::NOT_FOUND, "entry not found: " + key);
   }
@@ -90,6 +202,28 @@ util::Status FileStorage::LookupEntry(const string& key,
 }
 
 
+vector<util::Status> FileStorage::LookupEntries(
+    const vector<string>& keys, vector<string>* results) const {
+  CHECK_NOTNULL(results)->resize(keys.size());
+  vector<util::Status> statuses(keys.size());
+
+  util::SyncTask task(FilesystemOps::ReadExecutor());
+  for (size_t i = 0; i < keys.size(); ++i) {
+    file_op_->ReadFile(StoragePath(keys[i]), &(*results)[i],
+                       task.task()->AddChild(
+                           [&statuses, i](util::Task* child) {
+                             statuses[i] = child->status();
+                           }));
+  }
+  // The reads do not support cancellation, which returning the parent
+  // task requests, and it is only done once they all are.
+  task.task()->Return();
+  task.Wait();
+
+  return statuses;
+}
+
+
 string FileStorage::StoragePathBasename(const string& hex) const {
   if (hex.length() <= static_cast<uint>(storage_depth_))
     return "-";
@@ -151,14 +285,9 @@ void FileStorage::WriteStorageEntry(const string& key, const string& data) {
 
 void FileStorage::ScanFiles(const string& dir_path,
                             std::set<string>* keys) const {
-  DIR* dir = CHECK_NOTNULL(opendir(dir_path.c_str()));
-  struct dirent* entry;
-  while ((entry = readdir(dir)) != NULL) {
-    if (entry->d_name[0] == '.')
-      continue;
-    keys->insert(StorageKey(dir_path + "/" + entry->d_name));
+  for (const auto& name : ListDirectory(dir_path)) {
+    keys->insert(StorageKey(dir_path + "/" + name));
   }
-  closedir(dir);
 }
 
 
@@ -166,16 +295,10 @@ void FileStorage::ScanDir(const string& dir_path, int depth,
                           std::set<string>* keys) const {
   CHECK_GE(depth, 0);
   if (depth > 0) {
-    // Parse subdirectories. (TODO: make opendir part of filesystemop).
-    DIR* dir = CHECK_NOTNULL(opendir(dir_path.c_str()));
-    struct dirent* entry;
-    std::set<string> result;
-    while ((entry = readdir(dir)) != NULL) {
-      if (entry->d_name[0] == '.')
-        continue;
-      ScanDir(dir_path + "/" + entry->d_name, depth - 1, keys);
+    // Parse subdirectories.
+    for (const auto& name : ListDirectory(dir_path)) {
+      ScanDir(dir_path + "/" + name, depth - 1, keys);
     }
-    closedir(dir);
   } else {
     // depth == 0; parse files.
     ScanFiles(dir_path, keys);
@@ -199,13 +322,36 @@ void FileStorage::AtomicWriteBinaryFile(const string& file_path,
       util::WriteTemporaryBinaryFile(tmp_file_template_, data));
 
   CHECK(!tmp_file.empty());
+  if (FLAGS_file_storage_fsync) {
+    // Otherwise, the rename could reach the disk before the data.
+    SyncFile(tmp_file);
+  }
   CHECK_EQ(file_op_->rename(tmp_file, file_path), 0);
+  AddUnsyncedDirectory(Dirname(file_path));
 }
 
 
 void FileStorage::CreateMissingDirectory(const string& dir_path) {
+  {
+    lock_guard<mutex> lock(dirs_lock_);
+    if (created_dirs_.count(dir_path) > 0) {
+      return;
+    }
+  }
   if (file_op_->mkdir(dir_path, 0700) != 0) {
     CHECK_EQ(errno, EEXIST);
+  } else {
+    AddUnsyncedDirectory(Dirname(dir_path));
+  }
+  lock_guard<mutex> lock(dirs_lock_);
+  created_dirs_.insert(dir_path);
+}
+
+
+void FileStorage::AddUnsyncedDirectory(const string& dir_path) {
+  if (FLAGS_file_storage_fsync) {
+    lock_guard<mutex> lock(dirs_lock_);
+    unsynced_dirs_.insert(dir_path);
   }
 }
 
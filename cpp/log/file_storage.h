@@ -3,8 +3,11 @@
 
 #include <stdint.h>
 #include <memory>
+#include <mutex>
 #include <set>
 #include <string>
+#include <unordered_set>
+#include <vector>
 
 #include "util/status.h"
 
@@ -39,6 +42,10 @@ class FilesystemOps;
 // <root>/tmp     - Temporary storage for atomicity. Must be on the
 //                  same filesystem as <root>/storage.
 //
+// Entries are not synced to disk unless --file_storage_fsync is set,
+// in which case Sync() must be called to make the entries written
+// since the last call durable.
+//
 // FileStorage aborts upon any FilesystemOps error. This class is
 // threadsafe.
 class FileStorage {
@@ -52,18 +59,34 @@ class FileStorage {
   FileStorage(const FileStorage&) = delete;
   FileStorage& operator=(const FileStorage&) = delete;
 
-  // Scan the entire database and return the list of keys.
+  // Scan the entire database and return the list of keys. The top
+  // level directories are scanned in parallel.
   std::set<std::string> Scan() const;
 
+  // Syncs the directories written to since the last call, once each,
+  // so that a batch of writes only costs one directory sync per
+  // directory. Does nothing unless --file_storage_fsync is set.
+  void Sync();
+
   // Write (key, data) unless an entry matching |key| already exists.
   util::Status CreateEntry(const std::string& key, const std::string& data);
 
   // Update an existing entry; fail if it doesn't already exist.
   util::Status UpdateEntry(const std::string& key, const std::string& data);
 
+  // Delete an existing entry; fail if it doesn't already exist.
+  util::Status DeleteEntry(const std::string& key);
+
   // Lookup entry based on key.
   util::Status LookupEntry(const std::string& key, std::string* result) const;
 
+  // Like LookupEntry(), for each of |keys|, but with all the reads in
+  // flight at once. |results| is resized to match |keys|, and the
+  // status of each lookup is returned in the same order.
+  std::vector<util::Status> LookupEntries(
+      const std::vector<std::string>& keys,
+      std::vector<std::string>* results) const;
+
  private:
   std::string StoragePathBasename(const std::string& hex) const;
   std::string StoragePathComponent(const std::string& hex, int n) const;
@@ -80,14 +103,20 @@ class FileStorage {
   bool FileExists(const std::string& file_path) const;
   void AtomicWriteBinaryFile(const std::string& file_path,
                              const std::string& data);
-  // Create directory, unless it already exists.
+  // Create directory, unless it already exists. Directories are only
+  // created once per instance.
   void CreateMissingDirectory(const std::string& dir_path);
+  void AddUnsyncedDirectory(const std::string& dir_path);
 
   const std::string storage_dir_;
   const std::string tmp_dir_;
   const std::string tmp_file_template_;
   const int storage_depth_;
   const std::unique_ptr<cert_trans::FilesystemOps> file_op_;
+
+  std::mutex dirs_lock_;
+  std::unordered_set<std::string> created_dirs_;
+  std::set<std::string> unsynced_dirs_;
 };
 
 
@@ -6,6 +6,7 @@
 #include <iostream>
 #include <set>
 #include <string>
+#include <vector>
 
 #include "log/file_storage.h"
 #include "log/filesystem_ops.h"
@@ -73,6 +74,30 @@ TEST_F(BasicFileStorageTest, Scan) {
   EXPECT_EQ(keys, scan_keys);
 }
 
+TEST_F(BasicFileStorageTest, LookupEntries) {
+  string key0("1234xyzw", 8);
+  string value0("unicorn", 7);
+
+  string key1("1245abcd", 8);
+  string value1("Alice", 5);
+
+  string missing_key("1245abce", 8);
+
+  EXPECT_OK(fs()->CreateEntry(key0, value0));
+  EXPECT_OK(fs()->CreateEntry(key1, value1));
+
+  std::vector<string> results;
+  const std::vector<util::Status> statuses(
+      fs()->LookupEntries({key1, missing_key, key0}, &results));
+  ASSERT_EQ(3U, statuses.size());
+  ASSERT_EQ(3U, results.size());
+  EXPECT_OK(statuses[0]);
+  EXPECT_EQ(value1, results[0]);
+  EXPECT_THAT(statuses[1], StatusIs(util::error::NOT_FOUND));
+  EXPECT_OK(statuses[2]);
+  EXPECT_EQ(value0, results[2]);
+}
+
 TEST_F(BasicFileStorageTest, CreateDuplicate) {
   string key("1234xyzw", 8);
   string value("unicorn", 7);
@@ -113,6 +138,23 @@ TEST_F(BasicFileStorageTest, Update) {
   EXPECT_EQ(new_value, lookup_result);
 }
 
+TEST_F(BasicFileStorageTest, Delete) {
+  string key("1234xyzw", 8);
+  string value("unicorn", 7);
+
+  EXPECT_THAT(fs()->DeleteEntry(key), StatusIs(util::error::NOT_FOUND));
+  EXPECT_OK(fs()->CreateEntry(key, value));
+  EXPECT_OK(fs()->DeleteEntry(key));
+  EXPECT_THAT(fs()->LookupEntry(key, NULL), StatusIs(util::error::NOT_FOUND));
+  EXPECT_TRUE(fs()->Scan().empty());
+
+  // It can be created again.
+  EXPECT_OK(fs()->CreateEntry(key, value));
+  string lookup_result;
+  EXPECT_OK(fs()->LookupEntry(key, &lookup_result));
+  EXPECT_EQ(value, lookup_result);
+}
+
 // Test for non-existing keys that are similar to  existing ones.
 TEST_F(BasicFileStorageTest, LookupInvalidKey) {
   string key("1234xyzw", 8);
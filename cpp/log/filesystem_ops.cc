@@ -1,11 +1,71 @@
 #include "log/filesystem_ops.h"
 
 #include <errno.h>
+#include <fcntl.h>
+#include <gflags/gflags.h>
 #include <stdio.h>
+#include <string.h>
 #include <sys/stat.h>
 #include <unistd.h>
 
+#include "util/status.h"
+#include "util/task.h"
+#include "util/thread_pool.h"
+
+DEFINE_int32(filesystem_read_threads, 16,
+             "Number of threads reading files for the storage, which "
+             "bounds the number of reads in flight.");
+
 namespace cert_trans {
+namespace {
+
+
+util::Status ReadWholeFile(const std::string& path, std::string* data) {
+  const int fd(open(path.c_str(), O_RDONLY));
+  if (fd < 0) {
+    return util::Status(errno == ENOENT ? util::error::NOT_FOUND
+                                        : util::error::INTERNAL,
+                        "open " + path + ": " + strerror(errno));
+  }
+
+  util::Status status;
+  struct stat st;
+  if (fstat(fd, &st) != 0) {
+    status = util::Status(util::error::INTERNAL,
+                          "fstat " + path + ": " + strerror(errno));
+  } else {
+    data->resize(st.st_size);
+    size_t done(0);
+    while (done < data->size()) {
+      const ssize_t num_read(read(fd, &(*data)[done], data->size() - done));
+      if (num_read < 0 && errno == EINTR) {
+        continue;
+      }
+      if (num_read <= 0) {
+        status = util::Status(util::error::INTERNAL,
+                              "read " + path + ": " +
+                                  (num_read < 0 ? strerror(errno)
+                                                : "unexpected end of file"));
+        break;
+      }
+      done += num_read;
+    }
+  }
+  close(fd);
+
+  return status;
+}
+
+
+}  // namespace
+
+
+// static
+util::Executor* FilesystemOps::ReadExecutor() {
+  // Never deleted, as it can be in use until the very end.
+  static ThreadPool* const pool(new ThreadPool(FLAGS_filesystem_read_threads));
+  return pool;
+}
 
 
 int BasicFilesystemOps::mkdir(const std::string& path, mode_t mode) {
@@ -29,6 +89,13 @@ int BasicFilesystemOps::access(const std::string& path, int amode) {
 }
 
 
+void BasicFilesystemOps::ReadFile(const std::string& path, std::string* data,
+                                  util::Task* task) {
+  ReadExecutor()->Add(
+      [path, data, task]() { task->Return(ReadWholeFile(path, data)); });
+}
+
+
 FailingFilesystemOps::FailingFilesystemOps(int fail_point)
     : op_count_(0), fail_point_(fail_point) {
 }
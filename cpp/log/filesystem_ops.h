@@ -4,6 +4,11 @@
 #include <sys/types.h>
 #include <string>
 
+namespace util {
+class Executor;
+class Task;
+}  // namespace util
+
 namespace cert_trans {
 
 
@@ -21,6 +26,17 @@ class FilesystemOps {
                      const std::string& new_name) = 0;
   virtual int access(const std::string& path, int amode) = 0;
 
+  // Reads the whole of |path| into |*data| without blocking the
+  // caller, and returns through |task|, with NOT_FOUND if there is no
+  // such file. Many reads can be in flight at once, which is what
+  // keeps a fast disk busy.
+  virtual void ReadFile(const std::string& path, std::string* data,
+                        util::Task* task) = 0;
+
+  // The thread pool the reads of BasicFilesystemOps are done on, sized
+  // by --filesystem_read_threads.
+  static util::Executor* ReadExecutor();
+
  protected:
   FilesystemOps() = default;
 };
@@ -35,10 +51,12 @@ class BasicFilesystemOps : public FilesystemOps {
   int rename(const std::string& old_name,
              const std::string& new_name) override;
   int access(const std::string& path, int amode) override;
+  void ReadFile(const std::string& path, std::string* data,
+                util::Task* task) override;
 };
 
 
-// Fail at an operation with a given op count.
+// Fail at an operation with a given op count. Reads are not counted.
 class FailingFilesystemOps : public BasicFilesystemOps {
  public:
   explicit FailingFilesystemOps(int fail_point);
@@ -17,6 +17,7 @@ using ct::SignedCertificateTimestamp;
 using std::string;
 using std::lock_guard;
 using std::mutex;
+using std::vector;
 using util::Status;
 
 namespace {
@@ -55,3 +56,40 @@ Status Frontend::QueueProcessedEntry(Status pre_status, const LogEntry& entry,
   // Step 2. Submit to database.
   return UpdateStats(entry.type(), signer_->QueueEntry(entry, sct));
 }
+
+void Frontend::QueueProcessedEntries(const vector<Status>& pre_statuses,
+                                     const vector<LogEntry>& entries,
+                                     vector<SignedCertificateTimestamp>* scts,
+                                     vector<Status>* statuses) {
+  CHECK_EQ(pre_statuses.size(), entries.size());
+  // Only submit the entries that made it through processing.
+  vector<LogEntry> processed;
+  vector<size_t> processed_index;
+  for (size_t i = 0; i < entries.size(); ++i) {
+    CHECK(entries[i].has_type());
+    if (pre_statuses[i].ok()) {
+      processed.push_back(entries[i]);
+      processed_index.push_back(i);
+    }
+  }
+
+  vector<SignedCertificateTimestamp> processed_scts;
+  vector<Status> processed_statuses;
+  signer_->QueueEntries(processed, &processed_scts, &processed_statuses);
+
+  scts->assign(entries.size(), SignedCertificateTimestamp());
+  *statuses = pre_statuses;
+  for (size_t j = 0; j < processed.size(); ++j) {
+    (*scts)[processed_index[j]] = processed_scts[j];
+    (*statuses)[processed_index[j]] = processed_statuses[j];
+  }
+  for (size_t i = 0; i < entries.size(); ++i) {
+    UpdateStats(entries[i].type(), (*statuses)[i]);
+  }
+}
+
+bool Frontend::LookupSubmittedEntry(const LogEntry& entry, Status* status,
+                                    SignedCertificateTimestamp* sct) {
+  CHECK(entry.has_type());
+  return signer_->LookupEntry(entry, status, sct);
+}
@@ -3,6 +3,7 @@
 
 #include <memory>
 #include <mutex>
+#include <vector>
 
 #include "log/cert.h"
 #include "proto/ct.pb.h"
@@ -26,6 +27,20 @@ class Frontend {
                                    const ct::LogEntry& entry,
                                    ct::SignedCertificateTimestamp* sct);
 
+  // As above for each of |entries|, setting (*scts)[i] and
+  // (*statuses)[i] for |entries[i]|, but submitting them together.
+  void QueueProcessedEntries(
+      const std::vector<util::Status>& pre_statuses,
+      const std::vector<ct::LogEntry>& entries,
+      std::vector<ct::SignedCertificateTimestamp>* scts,
+      std::vector<util::Status>* statuses);
+
+  // Returns true, setting |status| and |sct|, if |entry| was submitted
+  // before, in which case it need not be processed at all. Only the
+  // leaf of |entry| has to be set, see FrontendSigner::LookupEntry().
+  bool LookupSubmittedEntry(const ct::LogEntry& entry, util::Status* status,
+                            ct::SignedCertificateTimestamp* sct);
+
  private:
   const std::unique_ptr<FrontendSigner> signer_;
 };
@@ -1,36 +1,205 @@
 /* -*- indent-tabs-mode: nil -*- */
 #include "log/frontend_signer.h"
 
+#include <gflags/gflags.h>
 #include <glog/logging.h>
+#include <chrono>
+#include <thread>
 
 #include "log/database.h"
 #include "log/log_signer.h"
 #include "merkletree/serial_hasher.h"
+#include "monitoring/monitoring.h"
 #include "proto/ct.pb.h"
 #include "proto/serializer.h"
 #include "util/status.h"
+#include "util/tracing.h"
 #include "util/util.h"
 
 using cert_trans::ConsistentStore;
+using cert_trans::Counter;
 using cert_trans::Database;
 using cert_trans::LoggedEntry;
+using cert_trans::ScopedSpan;
+using cert_trans::Update;
 using ct::LogEntry;
 using ct::SignedCertificateTimestamp;
+using std::bind;
+using std::chrono::milliseconds;
+using std::lock_guard;
+using std::make_pair;
+using std::mutex;
+using std::placeholders::_1;
 using std::string;
+using std::unique_lock;
+using std::unique_ptr;
+using std::vector;
+using util::Executor;
 using util::Status;
+using util::SyncTask;
+
+DEFINE_int32(frontend_signer_group_commit_ms, 0,
+             "if positive, gather the pending entries of concurrent "
+             "submissions for this many milliseconds and add them to the "
+             "consistent store together, rather than one round trip each");
+DEFINE_int32(frontend_signer_dedup_cache_size, 10000,
+             "maximum number of pending entries whose SCT the frontend "
+             "remembers, so that resubmissions need not go to the "
+             "consistent store, 0 to disable");
+DEFINE_bool(frontend_signer_sequence_ranges, false,
+            "have each batch of pending entries added together "
+            "sequenced in the order they were added, as soon as the "
+            "sequencer sees them, rather than once out of its guard "
+            "window; takes one more consistent store write per batch, "
+            "and must be set the same on all the nodes");
+
+namespace {
+
+
+Counter<bool>* dedup_cache_lookups(
+    Counter<bool>::New("frontend_signer_dedup_cache_lookups", "hit",
+                       "Number of submissions not found in the database, "
+                       "broken down by whether they were known to be "
+                       "pending already."));
+
+
+}  // namespace
+
+
+struct FrontendSigner::PendingAdd {
+  explicit PendingAdd(LoggedEntry* e) : entry(e), done(false) {
+  }
+
+  LoggedEntry* const entry;
+  Status status;
+  bool done;
+};
 
 
 FrontendSigner::FrontendSigner(Database* db, ConsistentStore* store,
                                LogSigner* signer)
+    : FrontendSigner(db, store, signer, nullptr) {
+}
+
+
+FrontendSigner::FrontendSigner(Database* db, ConsistentStore* store,
+                               LogSigner* signer, Executor* executor)
     : db_(CHECK_NOTNULL(db)),
       store_(CHECK_NOTNULL(store)),
-      signer_(CHECK_NOTNULL(signer)) {
+      signer_(CHECK_NOTNULL(signer)),
+      leaf_hasher_(unique_ptr<SerialHasher>(new Sha256Hasher)),
+      cache_memory_("frontend_signer_sct_cache"),
+      watch_task_(executor && FLAGS_frontend_signer_dedup_cache_size > 0
+                      ? new SyncTask(executor)
+                      : nullptr) {
+  if (watch_task_) {
+    store_->WatchPendingEntries(
+        bind(&FrontendSigner::OnPendingEntriesUpdated, this, _1),
+        watch_task_->task());
+  }
+}
+
+
+FrontendSigner::~FrontendSigner() {
+  if (watch_task_) {
+    watch_task_->Cancel();
+    watch_task_->Wait();
+  }
 }
 
 Status FrontendSigner::QueueEntry(const LogEntry& entry,
                                   SignedCertificateTimestamp* sct) {
+  ScopedSpan span("queue-entry");
+  cert_trans::LoggedEntry new_logged;
+  util::Status status;
+  if (!PrepareEntry(entry, &new_logged, &status, sct)) {
+    return status;
+  }
+
+  // If this cert has already been added (but not yet integrated into the
+  // tree), then this call will update new_logged.sct with the previously
+  // issued one.
+  {
+    ScopedSpan store_span("add-pending-entry");
+    status = FLAGS_frontend_signer_group_commit_ms > 0
+                 ? GroupAddPendingEntry(&new_logged)
+                 : store_->AddPendingEntry(&new_logged);
+  }
+  FinishEntry(new_logged, status, sct);
+  return status;
+}
+
+
+void FrontendSigner::QueueEntries(const vector<LogEntry>& entries,
+                                  vector<SignedCertificateTimestamp>* scts,
+                                  vector<Status>* statuses) {
+  ScopedSpan span("queue-entries");
+  scts->assign(entries.size(), SignedCertificateTimestamp());
+  statuses->assign(entries.size(), Status());
+  vector<LoggedEntry> new_logged(entries.size());
+  // The entries to add to the store, and their index in |entries|.
+  vector<LoggedEntry*> to_add;
+  vector<size_t> to_add_index;
+  for (size_t i = 0; i < entries.size(); ++i) {
+    if (PrepareEntry(entries[i], &new_logged[i], &(*statuses)[i],
+                     &(*scts)[i])) {
+      to_add.push_back(&new_logged[i]);
+      to_add_index.push_back(i);
+    }
+  }
+  if (to_add.empty()) {
+    return;
+  }
+
+  vector<Status> add_statuses;
+  {
+    ScopedSpan store_span("add-pending-entries");
+    store_->AddPendingEntries(to_add, &add_statuses);
+  }
+  CHECK_EQ(add_statuses.size(), to_add.size());
+  for (size_t j = 0; j < to_add.size(); ++j) {
+    const size_t i(to_add_index[j]);
+    (*statuses)[i] = add_statuses[j];
+    FinishEntry(new_logged[i], (*statuses)[i], &(*scts)[i]);
+  }
+  AddSequenceRange(to_add, add_statuses);
+}
+
+
+bool FrontendSigner::LookupEntry(const LogEntry& entry, Status* status,
+                                 SignedCertificateTimestamp* sct) {
+  return LookupHash(Sha256Hasher::Sha256Digest(Serializer::LeafData(entry)),
+                    status, sct);
+}
+
+
+bool FrontendSigner::PrepareEntry(const LogEntry& entry,
+                                  LoggedEntry* new_logged, Status* status,
+                                  SignedCertificateTimestamp* sct) {
   const string sha256_hash(
       Sha256Hasher::Sha256Digest(Serializer::LeafData(entry)));
+  if (LookupHash(sha256_hash, status, sct)) {
+    return false;
+  }
+
+  // Dont have the cert locally, so create an SCT and store it and the cert.
+  SignedCertificateTimestamp local_sct;
+  {
+    ScopedSpan sign_span("sign-sct");
+    TimestampAndSign(entry, &local_sct);
+  }
+
+  new_logged->mutable_sct()->CopyFrom(local_sct);
+  new_logged->mutable_entry()->CopyFrom(entry);
+  CHECK_EQ(new_logged->Hash(), sha256_hash);
+  // Hashed once here, instead of by every node adding it to its tree.
+  new_logged->StoreMerkleLeafHash(leaf_hasher_);
+  return true;
+}
+
+
+bool FrontendSigner::LookupHash(const string& sha256_hash, Status* status,
+                                SignedCertificateTimestamp* sct) {
   CHECK(!sha256_hash.empty());
 
   // Check if the entry already exists in the local DB (i.e. it's been
@@ -47,31 +216,161 @@ Status FrontendSigner::QueueEntry(const LogEntry& entry,
     if (sct != nullptr) {
       *sct = logged.sct();
     }
-    return Status(util::error::ALREADY_EXISTS,
-                  "entry already exists in Database");
+    *status = Status(util::error::ALREADY_EXISTS,
+                     "entry already exists in Database");
+    return true;
   }
   CHECK_EQ(Database::NOT_FOUND, db_result);
 
-  // Dont have the cert locally, so create an SCT and store it and the cert.
-  SignedCertificateTimestamp local_sct;
-  TimestampAndSign(entry, &local_sct);
+  if (LookupPendingSct(sha256_hash, sct)) {
+    *status = Status(util::error::ALREADY_EXISTS,
+                     "Pending entry already exists.");
+    return true;
+  }
 
-  cert_trans::LoggedEntry new_logged;
-  new_logged.mutable_sct()->CopyFrom(local_sct);
-  new_logged.mutable_entry()->CopyFrom(entry);
-  CHECK_EQ(new_logged.Hash(), sha256_hash);
+  return false;
+}
 
-  // If this cert has already been added (but not yet integrated into the
-  // tree), then this call will update new_logged.sct with the previously
-  // issued one.
-  util::Status status(store_->AddPendingEntry(&new_logged));
-  CHECK_EQ(new_logged.Hash(), sha256_hash);
+
+void FrontendSigner::FinishEntry(const LoggedEntry& logged,
+                                 const Status& status,
+                                 SignedCertificateTimestamp* sct) {
+  if (status.ok() || status.CanonicalCode() == util::error::ALREADY_EXISTS) {
+    CachePendingSct(logged.Hash(), logged.sct());
+  }
 
   if (sct != nullptr) {
-    *sct = new_logged.sct();
+    *sct = logged.sct();
   }
+}
 
-  return status;
+
+Status FrontendSigner::GroupAddPendingEntry(LoggedEntry* entry) {
+  PendingAdd add(entry);
+  unique_lock<mutex> lock(group_lock_);
+  group_.push_back(&add);
+  if (group_.size() > 1) {
+    // Someone else is leading this commit.
+    group_done_.wait(lock, [&add]() { return add.done; });
+    return add.status;
+  }
+
+  // Give concurrent submissions a chance to join in.
+  lock.unlock();
+  std::this_thread::sleep_for(
+      milliseconds(FLAGS_frontend_signer_group_commit_ms));
+  lock.lock();
+  vector<PendingAdd*> group;
+  group.swap(group_);
+  lock.unlock();
+
+  vector<LoggedEntry*> entries;
+  entries.reserve(group.size());
+  for (const auto& pending : group) {
+    entries.push_back(pending->entry);
+  }
+  vector<Status> statuses;
+  store_->AddPendingEntries(entries, &statuses);
+  CHECK_EQ(statuses.size(), group.size());
+
+  lock.lock();
+  for (size_t i = 0; i < group.size(); ++i) {
+    group[i]->status = statuses[i];
+    group[i]->done = true;
+  }
+  group_done_.notify_all();
+  lock.unlock();
+
+  // The others need not wait for this.
+  AddSequenceRange(entries, statuses);
+  return add.status;
+}
+
+
+void FrontendSigner::AddSequenceRange(const vector<LoggedEntry*>& entries,
+                                      const vector<Status>& statuses) {
+  if (!FLAGS_frontend_signer_sequence_ranges) {
+    return;
+  }
+  CHECK_EQ(entries.size(), statuses.size());
+  // Those which were pending already are left to where they were
+  // first added.
+  vector<string> hashes;
+  for (size_t i = 0; i < entries.size(); ++i) {
+    if (statuses[i].ok()) {
+      hashes.emplace_back(entries[i]->Hash());
+    }
+  }
+  ScopedSpan span("add-sequence-range");
+  const Status status(store_->AddSequenceRange(hashes));
+  if (!status.ok()) {
+    // Not a problem for the submissions, only for how soon they get
+    // sequenced.
+    LOG(WARNING) << "Failed to add sequence range of " << hashes.size()
+                 << " entries: " << status;
+  }
+}
+
+
+bool FrontendSigner::LookupPendingSct(const string& hash,
+                                      SignedCertificateTimestamp* sct) {
+  if (FLAGS_frontend_signer_dedup_cache_size <= 0) {
+    return false;
+  }
+
+  lock_guard<mutex> lock(cache_lock_);
+  const auto it(cache_index_.find(hash));
+  dedup_cache_lookups->Increment(it != cache_index_.end());
+  if (it == cache_index_.end()) {
+    return false;
+  }
+  cache_.splice(cache_.begin(), cache_, it->second);
+  if (sct != nullptr) {
+    *sct = it->second->second;
+  }
+  return true;
+}
+
+
+void FrontendSigner::CachePendingSct(const string& hash,
+                                     const SignedCertificateTimestamp& sct) {
+  if (FLAGS_frontend_signer_dedup_cache_size <= 0) {
+    return;
+  }
+
+  lock_guard<mutex> lock(cache_lock_);
+  const auto it(cache_index_.find(hash));
+  if (it != cache_index_.end()) {
+    // An entry's SCT never changes once it is pending.
+    cache_.splice(cache_.begin(), cache_, it->second);
+    return;
+  }
+  cache_.emplace_front(make_pair(hash, sct));
+  cache_index_.emplace(hash, cache_.begin());
+  while (cache_.size() >
+         static_cast<size_t>(FLAGS_frontend_signer_dedup_cache_size)) {
+    cache_index_.erase(cache_.back().first);
+    cache_.pop_back();
+  }
+  // The hashes, and the SCTs, are all about the same size.
+  cache_memory_.Set(
+      cache_.size() * (sizeof(SctList::value_type) + 2 * sizeof(void*) +
+                       hash.size() + 1 + sct.ByteSize()) +
+      cert_trans::UnorderedMapByteSize(cache_index_, hash.size() + 1));
+}
+
+
+void FrontendSigner::OnPendingEntriesUpdated(
+    const vector<Update<LoggedEntry>>& updates) {
+  for (const auto& update : updates) {
+    // Entries are only removed from the store once they have been
+    // integrated into the tree, at which point their SCT is still good,
+    // so there is nothing to forget.
+    if (update.exists_) {
+      const LoggedEntry& entry(update.handle_.Entry());
+      CachePendingSct(entry.Hash(), entry.sct());
+    }
+  }
 }
 
 
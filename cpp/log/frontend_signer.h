@@ -2,10 +2,20 @@
 #define CERT_TRANS_LOG_FRONTEND_SIGNER_H_
 
 #include <stdint.h>
+#include <condition_variable>
+#include <list>
+#include <memory>
+#include <mutex>
 #include <string>
+#include <unordered_map>
+#include <utility>
+#include <vector>
 
 #include "log/consistent_store.h"
 #include "log/logged_entry.h"
+#include "merkletree/tree_hasher.h"
+#include "monitoring/memory_usage.h"
+#include "util/sync_task.h"
 
 class LogSigner;
 
@@ -23,6 +33,12 @@ class FrontendSigner {
   // Does not take ownership of |db|, |store| or |signer|.
   FrontendSigner(cert_trans::Database* db, cert_trans::ConsistentStore* store,
                  LogSigner* signer);
+  // As above, but also watches the pending entries in |store| (using
+  // |executor|, which is not owned either), so that resubmissions of
+  // entries added through other frontends are answered locally too.
+  FrontendSigner(cert_trans::Database* db, cert_trans::ConsistentStore* store,
+                 LogSigner* signer, util::Executor* executor);
+  ~FrontendSigner();
   FrontendSigner(const FrontendSigner&) = delete;
   FrontendSigner& operator=(const FrontendSigner&) = delete;
 
@@ -30,16 +46,93 @@ class FrontendSigner {
   // and return either a new timestamp-signature pair,
   // or a previously existing one. (Currently also copies the
   // entry to the sct but you shouldn't rely on this.)
+  //
+  // With --frontend_signer_group_commit_ms, concurrent calls are
+  // gathered and their pending entries added to the store together.
+  //
+  // The SCTs of recently seen pending entries are remembered (see
+  // --frontend_signer_dedup_cache_size), and resubmissions of those are
+  // answered without going to the store.
   util::Status QueueEntry(const ct::LogEntry& entry,
                           ct::SignedCertificateTimestamp* sct);
 
+  // As QueueEntry() for each of |entries|, setting (*scts)[i] and
+  // (*statuses)[i] for |entries[i]|, but the new ones are added to the
+  // store together, whatever --frontend_signer_group_commit_ms says.
+  void QueueEntries(const std::vector<ct::LogEntry>& entries,
+                    std::vector<ct::SignedCertificateTimestamp>* scts,
+                    std::vector<util::Status>* statuses);
+
+  // Returns true, setting |status| and |sct| (if not NULL) as
+  // QueueEntry() would, if |entry| is already in the database or known
+  // to be pending. Only the leaf of |entry| is looked at, so this can
+  // be called before the rest of a submission is checked.
+  bool LookupEntry(const ct::LogEntry& entry, util::Status* status,
+                   ct::SignedCertificateTimestamp* sct);
+
  private:
+  struct PendingAdd;
+
+  // What QueueEntry() does before adding |entry| to the store. Returns
+  // false, setting |status| and |sct| (if not NULL), if there is no
+  // need to add it, or else sets |new_logged| to the entry to add, with
+  // a new SCT.
+  bool PrepareEntry(const ct::LogEntry& entry,
+                    cert_trans::LoggedEntry* new_logged, util::Status* status,
+                    ct::SignedCertificateTimestamp* sct);
+  // And what it does after, with |status| what the store said.
+  void FinishEntry(const cert_trans::LoggedEntry& logged,
+                   const util::Status& status,
+                   ct::SignedCertificateTimestamp* sct);
+
+  // As LookupEntry(), for the entry with leaf hash |hash|.
+  bool LookupHash(const std::string& hash, util::Status* status,
+                  ct::SignedCertificateTimestamp* sct);
+
   void TimestampAndSign(const ct::LogEntry& entry,
                         ct::SignedCertificateTimestamp* sct) const;
 
+  // Adds |entry| to the store as part of the next group commit.
+  util::Status GroupAddPendingEntry(cert_trans::LoggedEntry* entry);
+
+  // With --frontend_signer_sequence_ranges, tells the store to sequence
+  // those of |entries| which were added, going by |statuses|, in the
+  // order they are in.
+  void AddSequenceRange(const std::vector<cert_trans::LoggedEntry*>& entries,
+                        const std::vector<util::Status>& statuses);
+
+  // Returns true and sets |sct| (if not NULL) if the entry with leaf
+  // hash |hash| is known to be pending.
+  bool LookupPendingSct(const std::string& hash,
+                        ct::SignedCertificateTimestamp* sct);
+  void CachePendingSct(const std::string& hash,
+                       const ct::SignedCertificateTimestamp& sct);
+  void OnPendingEntriesUpdated(
+      const std::vector<cert_trans::Update<cert_trans::LoggedEntry>>&
+          updates);
+
   cert_trans::Database* const db_;
   cert_trans::ConsistentStore* const store_;
   LogSigner* const signer_;
+  // Hashes the new entries for the Merkle tree. A SHA-256 TreeHasher
+  // can be used from several threads at once.
+  const TreeHasher leaf_hasher_;
+
+  std::mutex group_lock_;
+  std::condition_variable group_done_;
+  // The entries waiting for the next group commit. The first caller to
+  // find this empty leads that commit.
+  std::vector<PendingAdd*> group_;
+
+  // Leaf hash to SCT, most recently used first.
+  typedef std::list<std::pair<std::string, ct::SignedCertificateTimestamp>>
+      SctList;
+  std::mutex cache_lock_;
+  SctList cache_;
+  std::unordered_map<std::string, SctList::iterator> cache_index_;
+  cert_trans::MemoryUsage cache_memory_;
+
+  const std::unique_ptr<util::SyncTask> watch_task_;
 };
 
 #endif  // CERT_TRANS_LOG_FRONTEND_SIGNER_H_
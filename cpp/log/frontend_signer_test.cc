@@ -15,6 +15,7 @@
 #include "log/test_signer.h"
 #include "merkletree/merkle_verifier.h"
 #include "merkletree/serial_hasher.h"
+#include "merkletree/tree_hasher.h"
 #include "proto/cert_serializer.h"
 #include "proto/ct.pb.h"
 #include "proto/serializer.h"
@@ -109,6 +110,12 @@ TYPED_TEST(FrontendSignerTest, LogKatTest) {
   const LoggedEntry& logged_cert(entry_handle.Entry());
 
   TestSigner::TestEqualEntries(default_entry, logged_cert.entry());
+
+  // It comes with its Merkle leaf hash.
+  string serialized_leaf;
+  ASSERT_TRUE(logged_cert.SerializeForLeaf(&serialized_leaf));
+  const TreeHasher hasher(unique_ptr<SerialHasher>(new Sha256Hasher));
+  EXPECT_EQ(hasher.HashLeaf(serialized_leaf), logged_cert.merkle_leaf_hash());
 }
 
 TYPED_TEST(FrontendSignerTest, Log) {
@@ -194,6 +201,60 @@ TYPED_TEST(FrontendSignerTest, LogDuplicatesDifferentChain) {
   EXPECT_EQ(sct0.timestamp(), sct1.timestamp());
 }
 
+TYPED_TEST(FrontendSignerTest, LookupEntry) {
+  LogEntry entry;
+  this->test_signer_.CreateUnique(&entry);
+  util::Status status;
+  SignedCertificateTimestamp sct0, sct1;
+  EXPECT_FALSE(this->frontend_.LookupEntry(entry, &status, &sct1));
+
+  EXPECT_OK(this->frontend_.QueueEntry(entry, &sct0));
+  // Only the leaf counts, not the chain.
+  if (entry.type() == ct::X509_ENTRY) {
+    entry.mutable_x509_entry()->clear_certificate_chain();
+  } else {
+    entry.mutable_precert_entry()->clear_precertificate_chain();
+  }
+  EXPECT_TRUE(this->frontend_.LookupEntry(entry, &status, &sct1));
+  EXPECT_THAT(status, StatusIs(util::error::ALREADY_EXISTS, _));
+  EXPECT_EQ(sct0.timestamp(), sct1.timestamp());
+}
+
+TYPED_TEST(FrontendSignerTest, QueueEntries) {
+  LogEntry entry0, entry1, entry2;
+  this->test_signer_.CreateUnique(&entry0);
+  this->test_signer_.CreateUnique(&entry1);
+  this->test_signer_.CreateUnique(&entry2);
+  SignedCertificateTimestamp sct0;
+  EXPECT_OK(this->frontend_.QueueEntry(entry0, &sct0));
+
+  // Already pending, new, and new again within the batch.
+  vector<SignedCertificateTimestamp> scts;
+  vector<util::Status> statuses;
+  this->frontend_.QueueEntries({entry0, entry1, entry2, entry1}, &scts,
+                               &statuses);
+  ASSERT_EQ(4U, statuses.size());
+  ASSERT_EQ(4U, scts.size());
+  EXPECT_THAT(statuses[0], StatusIs(util::error::ALREADY_EXISTS, _));
+  EXPECT_EQ(sct0.timestamp(), scts[0].timestamp());
+  EXPECT_OK(statuses[2]);
+  // Whichever of the two got there first.
+  EXPECT_TRUE(statuses[1].ok() != statuses[3].ok());
+  EXPECT_EQ(scts[1].timestamp(), scts[3].timestamp());
+  EXPECT_EQ(scts[1].signature().signature(),
+            scts[3].signature().signature());
+
+  EXPECT_EQ(LogVerifier::VERIFY_OK,
+            this->verifier_.VerifySignedCertificateTimestamp(entry1, scts[1]));
+  EXPECT_EQ(LogVerifier::VERIFY_OK,
+            this->verifier_.VerifySignedCertificateTimestamp(entry2, scts[2]));
+  EntryHandle<LoggedEntry> entry_handle;
+  EXPECT_OK(this->store_.GetPendingEntryForHash(
+      Sha256Hasher::Sha256Digest(Serializer::LeafData(entry2)),
+      &entry_handle));
+  TestSigner::TestEqualEntries(entry2, entry_handle.Entry().entry());
+}
+
 TYPED_TEST(FrontendSignerTest, Verify) {
   LogEntry entry0, entry1;
   this->test_signer_.CreateUnique(&entry0);
@@ -216,6 +277,30 @@ TYPED_TEST(FrontendSignerTest, Verify) {
             LogVerifier::INVALID_SIGNATURE);
 }
 
+TYPED_TEST(FrontendSignerTest, VerifyBatch) {
+  LogEntry entry0, entry1;
+  this->test_signer_.CreateUnique(&entry0);
+  this->test_signer_.CreateUnique(&entry1);
+
+  SignedCertificateTimestamp sct0, sct1;
+  EXPECT_OK(this->frontend_.QueueEntry(entry0, &sct0));
+  EXPECT_OK(this->frontend_.QueueEntry(entry1, &sct1));
+
+  // The results are in order, the swapped pair failing.
+  vector<LogVerifier::LogVerifyResult> results{LogVerifier::INVALID_FORMAT};
+  this->verifier_.VerifyBatch({{&entry0, &sct0},
+                               {&entry0, &sct1},
+                               {&entry1, &sct1}},
+                              &results);
+  EXPECT_EQ((vector<LogVerifier::LogVerifyResult>{
+                LogVerifier::VERIFY_OK, LogVerifier::INVALID_SIGNATURE,
+                LogVerifier::VERIFY_OK}),
+            results);
+
+  this->verifier_.VerifyBatch({}, &results);
+  EXPECT_TRUE(results.empty());
+}
+
 TYPED_TEST(FrontendSignerTest, TimedVerify) {
   LogEntry entry0, entry1;
   this->test_signer_.CreateUnique(&entry0);
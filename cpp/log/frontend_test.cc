@@ -1,4 +1,5 @@
 /* -*- indent-tabs-mode: nil -*- */
+#include <gflags/gflags.h>
 #include <glog/logging.h>
 #include <gmock/gmock.h>
 #include <gtest/gtest.h>
@@ -6,6 +7,8 @@
 #include <openssl/evp.h>
 #include <memory>
 #include <string>
+#include <thread>
+#include <vector>
 
 #include "log/cert_submission_handler.h"
 #include "log/ct_extensions.h"
@@ -26,6 +29,7 @@
 #include "util/libevent_wrapper.h"
 #include "util/mock_masterelection.h"
 #include "util/status_test_util.h"
+#include "util/sync_task.h"
 #include "util/testing.h"
 #include "util/thread_pool.h"
 #include "util/util.h"
@@ -51,6 +55,8 @@ static const char kIntermediateCert[] = "intermediate-cert.pem";
 // Issued by intermediate-cert.pem
 static const char kChainLeafCert[] = "test-intermediate-cert.pem";
 
+DECLARE_int32(frontend_signer_group_commit_ms);
+
 namespace {
 
 namespace libevent = cert_trans::libevent;
@@ -78,6 +84,7 @@ using std::unique_ptr;
 using std::vector;
 using testing::NiceMock;
 using testing::_;
+using util::SyncTask;
 using util::testing::StatusIs;
 
 typedef Frontend FE;
@@ -279,6 +286,87 @@ TYPED_TEST(FrontendTest, TestSubmitDuplicate) {
                 logged_cert.entry(), sct));
 }
 
+TYPED_TEST(FrontendTest, TestSubmitDuplicateAnsweredLocally) {
+  CertChain chain1(this->leaf_pem_);
+  CertChain chain2(this->leaf_pem_);
+  EXPECT_TRUE(chain1.IsLoaded());
+  EXPECT_TRUE(chain2.IsLoaded());
+
+  SignedCertificateTimestamp sct1, sct2;
+  LogEntry entry1, entry2;
+  EXPECT_OK(this->frontend_.QueueProcessedEntry(
+      this->submission_handler_.ProcessX509Submission(&chain1, &entry1),
+      entry1, &sct1));
+
+  // Take the entry out of the store behind the frontend's back.
+  const unique_ptr<Cert> cert(Cert::FromPemString(this->leaf_pem_));
+  ASSERT_TRUE(cert.get());
+  string sha256_digest;
+  ASSERT_OK(cert->Sha256Digest(&sha256_digest));
+  SyncTask task(this->base_.get());
+  this->etcd_client_.ForceDelete("/root/entries/" + H(sha256_digest),
+                                 task.task());
+  task.Wait();
+  ASSERT_OK(task.status());
+
+  // The resubmission gets the original SCT without going to the store.
+  EXPECT_THAT(this->frontend_.QueueProcessedEntry(
+                  this->submission_handler_.ProcessX509Submission(&chain2,
+                                                                  &entry2),
+                  entry2, &sct2),
+              StatusIs(util::error::ALREADY_EXISTS, _));
+  EXPECT_EQ(sct1.timestamp(), sct2.timestamp());
+  EXPECT_EQ(sct1.signature().signature(), sct2.signature().signature());
+  EntryHandle<LoggedEntry> entry_handle;
+  EXPECT_THAT(this->store_.GetPendingEntryForHash(sha256_digest,
+                                                  &entry_handle),
+              StatusIs(util::error::NOT_FOUND, _));
+}
+
+
+TYPED_TEST(FrontendTest, TestSubmitGroupCommit) {
+  FLAGS_frontend_signer_group_commit_ms = 100;
+  const vector<string> pems{this->leaf_pem_,
+                            this->chain_leaf_pem_ + this->intermediate_pem_,
+                            this->leaf_pem_};
+  vector<util::Status> statuses(pems.size());
+  vector<SignedCertificateTimestamp> scts(pems.size());
+  vector<std::thread> threads;
+  for (size_t i = 0; i < pems.size(); ++i) {
+    threads.emplace_back([this, &pems, &statuses, &scts, i]() {
+      CertChain chain(pems[i]);
+      CHECK(chain.IsLoaded());
+      LogEntry entry;
+      statuses[i] = this->frontend_.QueueProcessedEntry(
+          this->submission_handler_.ProcessX509Submission(&chain, &entry),
+          entry, &scts[i]);
+    });
+  }
+  for (auto& thread : threads) {
+    thread.join();
+  }
+  FLAGS_frontend_signer_group_commit_ms = 0;
+
+  EXPECT_OK(statuses[1]);
+  // The same certificate was submitted twice: one of them got there
+  // first, and both got the same SCT.
+  EXPECT_NE(statuses[0].ok(), statuses[2].ok());
+  EXPECT_THAT(statuses[0].ok() ? statuses[2] : statuses[0],
+              StatusIs(util::error::ALREADY_EXISTS, _));
+  EXPECT_EQ(scts[0].timestamp(), scts[2].timestamp());
+  EXPECT_EQ(scts[0].signature().signature(), scts[2].signature().signature());
+
+  for (const string& pem : {this->leaf_pem_, this->chain_leaf_pem_}) {
+    const unique_ptr<Cert> cert(Cert::FromPemString(pem));
+    ASSERT_TRUE(cert.get());
+    string sha256_digest;
+    ASSERT_OK(cert->Sha256Digest(&sha256_digest));
+    EntryHandle<LoggedEntry> entry_handle;
+    EXPECT_OK(this->store_.GetPendingEntryForHash(sha256_digest,
+                                                  &entry_handle));
+  }
+}
+
 TYPED_TEST(FrontendTest, TestSubmitInvalidChain) {
   CertChain chain(this->chain_leaf_pem_);
   EXPECT_TRUE(chain.IsLoaded());
@@ -0,0 +1,115 @@
+#include "log/hash_filter.h"
+
+#include <glog/logging.h>
+#include <algorithm>
+
+using std::string;
+using std::unique_ptr;
+
+namespace cert_trans {
+
+namespace {
+
+
+const int64_t kMinimumCapacity = 1024;
+// About 1% false positives.
+const int kBitsPerHash = 10;
+const int kNumProbes = 7;
+// Bytes of the hash that the probes come from.
+const size_t kHashBytesUsed = 16;
+
+
+uint64_t ReadUint64(const string& data, size_t offset) {
+  uint64_t value(0);
+  for (size_t i = 0; i < 8; ++i) {
+    value = (value << 8) | static_cast<unsigned char>(data[offset + i]);
+  }
+  return value;
+}
+
+
+void AppendUint64(uint64_t value, string* data) {
+  for (int shift = 56; shift >= 0; shift -= 8) {
+    data->push_back(static_cast<char>((value >> shift) & 0xff));
+  }
+}
+
+
+}  // namespace
+
+
+HashFilter::HashFilter(int64_t capacity)
+    : capacity_(std::max(capacity, kMinimumCapacity)),
+      size_(0),
+      bits_((capacity_ * kBitsPerHash + 63) / 64, 0) {
+}
+
+
+// static
+unique_ptr<HashFilter> HashFilter::Parse(const string& data) {
+  if (data.size() < 16) {
+    return nullptr;
+  }
+  const int64_t capacity(ReadUint64(data, 0));
+  const int64_t size(ReadUint64(data, 8));
+  if (capacity < kMinimumCapacity || size < 0 ||
+      static_cast<int64_t>(data.size()) !=
+          16 + (capacity * kBitsPerHash + 63) / 64 * 8) {
+    return nullptr;
+  }
+
+  unique_ptr<HashFilter> filter(new HashFilter(capacity));
+  filter->size_ = size;
+  for (size_t i = 0; i < filter->bits_.size(); ++i) {
+    filter->bits_[i] = ReadUint64(data, 16 + i * 8);
+  }
+  return filter;
+}
+
+
+size_t HashFilter::Bit(const string& hash, int i) const {
+  // Double hashing, with an odd step so that the probes differ.
+  const uint64_t h1(ReadUint64(hash, 0));
+  const uint64_t h2(ReadUint64(hash, 8) | 1);
+  return (h1 + i * h2) % (bits_.size() * 64);
+}
+
+
+void HashFilter::Add(const string& hash) {
+  if (hash.size() < kHashBytesUsed) {
+    return;
+  }
+  for (int i = 0; i < kNumProbes; ++i) {
+    const size_t bit(Bit(hash, i));
+    bits_[bit / 64] |= uint64_t(1) << (bit % 64);
+  }
+  ++size_;
+}
+
+
+bool HashFilter::MayContain(const string& hash) const {
+  if (hash.size() < kHashBytesUsed) {
+    return true;
+  }
+  for (int i = 0; i < kNumProbes; ++i) {
+    const size_t bit(Bit(hash, i));
+    if (!(bits_[bit / 64] & (uint64_t(1) << (bit % 64)))) {
+      return false;
+    }
+  }
+  return true;
+}
+
+
+void HashFilter::Serialize(string* data) const {
+  data->clear();
+  data->reserve(16 + bits_.size() * 8);
+  AppendUint64(capacity_, data);
+  AppendUint64(size_, data);
+  for (const uint64_t word : bits_) {
+    AppendUint64(word, data);
+  }
+}
+
+
+}  // namespace cert_trans
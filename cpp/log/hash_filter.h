@@ -0,0 +1,72 @@
+#ifndef CERT_TRANS_LOG_HASH_FILTER_H_
+#define CERT_TRANS_LOG_HASH_FILTER_H_
+
+#include <stddef.h>
+#include <stdint.h>
+#include <memory>
+#include <string>
+#include <vector>
+
+namespace cert_trans {
+
+
+// A Bloom filter of entry hashes, for answering "definitely not
+// there" to most lookups of new entries without going to storage.
+//
+// As entry hashes are SHA-256 digests, and so uniformly distributed,
+// the probes are taken from the hash itself rather than hashing it
+// again. Hashes shorter than 16 bytes are not filtered: MayContain()
+// always returns true for them.
+//
+// The filter is sized for a number of hashes, with which about 1% of
+// the hashes not added are reported as maybe there. Adding more than
+// that still works, but with more false positives, so users should
+// build a bigger one once Full() is true.
+//
+// This class is thread-compatible, but not thread-safe.
+class HashFilter {
+ public:
+  explicit HashFilter(int64_t capacity);
+  HashFilter(const HashFilter&) = delete;
+  HashFilter& operator=(const HashFilter&) = delete;
+
+  // Returns nullptr if |data| is not what Serialize() returned.
+  static std::unique_ptr<HashFilter> Parse(const std::string& data);
+
+  void Add(const std::string& hash);
+
+  // Returns false if |hash| was definitely not added.
+  bool MayContain(const std::string& hash) const;
+
+  int64_t size() const {
+    return size_;
+  }
+
+  int64_t capacity() const {
+    return capacity_;
+  }
+
+  bool Full() const {
+    return size_ >= capacity_;
+  }
+
+  // Number of bytes the filter takes up in memory.
+  size_t ByteSize() const {
+    return bits_.size() * sizeof(uint64_t);
+  }
+
+  void Serialize(std::string* data) const;
+
+ private:
+  // The bit of probe |i| for |hash|.
+  size_t Bit(const std::string& hash, int i) const;
+
+  const int64_t capacity_;
+  int64_t size_;
+  std::vector<uint64_t> bits_;
+};
+
+
+}  // namespace cert_trans
+
+#endif  // CERT_TRANS_LOG_HASH_FILTER_H_
@@ -0,0 +1,96 @@
+#include "log/hash_filter.h"
+
+#include <gtest/gtest.h>
+#include <memory>
+#include <string>
+
+#include "merkletree/serial_hasher.h"
+#include "util/testing.h"
+
+namespace cert_trans {
+namespace {
+
+using std::string;
+using std::to_string;
+using std::unique_ptr;
+
+
+string Hash(int i) {
+  return Sha256Hasher::Sha256Digest("entry " + to_string(i));
+}
+
+
+TEST(HashFilterTest, Empty) {
+  const HashFilter filter(100);
+  EXPECT_EQ(0, filter.size());
+  EXPECT_FALSE(filter.Full());
+  EXPECT_FALSE(filter.MayContain(Hash(0)));
+}
+
+
+TEST(HashFilterTest, NoFalseNegatives) {
+  HashFilter filter(10000);
+  for (int i = 0; i < 10000; ++i) {
+    filter.Add(Hash(i));
+  }
+  EXPECT_EQ(10000, filter.size());
+  EXPECT_TRUE(filter.Full());
+  for (int i = 0; i < 10000; ++i) {
+    EXPECT_TRUE(filter.MayContain(Hash(i))) << i;
+  }
+}
+
+
+TEST(HashFilterTest, FewFalsePositives) {
+  HashFilter filter(10000);
+  for (int i = 0; i < 10000; ++i) {
+    filter.Add(Hash(i));
+  }
+  int false_positives(0);
+  for (int i = 10000; i < 20000; ++i) {
+    if (filter.MayContain(Hash(i))) {
+      ++false_positives;
+    }
+  }
+  // About 1% is expected.
+  EXPECT_LT(false_positives, 200);
+}
+
+
+TEST(HashFilterTest, ShortHashesAreNotFiltered) {
+  HashFilter filter(100);
+  filter.Add("short");
+  EXPECT_EQ(0, filter.size());
+  EXPECT_TRUE(filter.MayContain("other"));
+}
+
+
+TEST(HashFilterTest, SerializeAndParse) {
+  HashFilter filter(2000);
+  for (int i = 0; i < 1000; ++i) {
+    filter.Add(Hash(i));
+  }
+  string data;
+  filter.Serialize(&data);
+
+  const unique_ptr<HashFilter> parsed(HashFilter::Parse(data));
+  ASSERT_TRUE(parsed);
+  EXPECT_EQ(filter.capacity(), parsed->capacity());
+  EXPECT_EQ(filter.size(), parsed->size());
+  for (int i = 0; i < 2000; ++i) {
+    EXPECT_EQ(filter.MayContain(Hash(i)), parsed->MayContain(Hash(i))) << i;
+  }
+
+  EXPECT_FALSE(HashFilter::Parse(""));
+  EXPECT_FALSE(HashFilter::Parse(data.substr(0, data.size() - 1)));
+}
+
+
+}  // namespace
+}  // namespace cert_trans
+
+
+int main(int argc, char** argv) {
+  cert_trans::test::InitTesting(argv[0], &argc, &argv, true);
+  return RUN_ALL_TESTS();
+}
@@ -0,0 +1,321 @@
+#include "log/leaf_index.h"
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <glog/logging.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <algorithm>
+#include <utility>
+
+#include "merkletree/merkle_tree.h"
+#include "util/huge_pages.h"
+
+using std::string;
+using std::unique_ptr;
+using std::vector;
+
+namespace cert_trans {
+
+namespace {
+
+
+const size_t kMinimumCapacity = 1024;
+// Prefix of the names of the files of the tables kept in a directory.
+const char kTableFilePrefix[] = "leaf-index-";
+
+
+// Keep the table at most 3/4 full, so that probe sequences stay short.
+bool OverLoaded(size_t size, size_t capacity) {
+  return size * 4 > capacity * 3;
+}
+
+
+// The capacity to hold |count| entries, starting from |capacity|.
+size_t CapacityFor(size_t count, size_t capacity) {
+  capacity = std::max(capacity, kMinimumCapacity);
+  while (OverLoaded(count, capacity))
+    capacity *= 2;
+  return capacity;
+}
+
+
+}  // namespace
+
+
+// The slots of an index, on the heap or in a memory-mapped file.
+class LeafIndex::Table {
+ public:
+  // An empty table of |capacity| slots, in a new file in |dir| if it
+  // is not empty.
+  Table(size_t capacity, const string& dir);
+  ~Table();
+  Table(const Table&) = delete;
+  Table& operator=(const Table&) = delete;
+
+  // Maps the table in |path| read-only, or returns null if it cannot.
+  static unique_ptr<Table> MapFile(const string& path);
+
+  size_t capacity() const {
+    return capacity_;
+  }
+  const string& path() const {
+    return path_;
+  }
+  Slot* slots() const {
+    return slots_;
+  }
+  bool read_only() const {
+    return read_only_;
+  }
+
+ private:
+  Table() = default;
+
+  vector<Slot, util::HugePageAllocator<Slot>> heap_slots_;
+  // Empty for a table on the heap.
+  string path_;
+  bool read_only_ = false;
+  Slot* slots_ = nullptr;
+  size_t capacity_ = 0;
+};
+
+
+LeafIndex::Table::Table(size_t capacity, const string& dir)
+    : capacity_(capacity) {
+  if (dir.empty()) {
+    heap_slots_.assign(capacity_, Slot{0, 0});
+    slots_ = heap_slots_.data();
+    return;
+  }
+
+  string path(dir + "/" + kTableFilePrefix + "XXXXXX");
+  const int fd(mkstemp(&path[0]));
+  PCHECK(fd >= 0) << "Failed to create " << path;
+  // The file is all zeroes, that is, empty slots.
+  PCHECK(ftruncate(fd, capacity_ * sizeof(Slot)) == 0) << "Failed to grow "
+                                                       << path;
+  void* const data(mmap(nullptr, capacity_ * sizeof(Slot),
+                        PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0));
+  PCHECK(data != MAP_FAILED) << "Failed to map " << path;
+  close(fd);
+  util::AdviseHugePages(data, capacity_ * sizeof(Slot));
+  path_ = path;
+  slots_ = static_cast<Slot*>(data);
+}
+
+
+LeafIndex::Table::~Table() {
+  if (!path_.empty() && capacity_ > 0) {
+    PCHECK(munmap(slots_, capacity_ * sizeof(Slot)) == 0);
+  }
+}
+
+
+// static
+unique_ptr<LeafIndex::Table> LeafIndex::Table::MapFile(const string& path) {
+  const int fd(open(path.c_str(), O_RDONLY));
+  if (fd < 0) {
+    PLOG(WARNING) << "Failed to open " << path;
+    return nullptr;
+  }
+  struct stat st;
+  PCHECK(fstat(fd, &st) == 0);
+  const size_t capacity(st.st_size / sizeof(Slot));
+  if (capacity == 0 || (capacity & (capacity - 1)) != 0 ||
+      st.st_size % sizeof(Slot) != 0) {
+    LOG(WARNING) << path << " is not a leaf index";
+    close(fd);
+    return nullptr;
+  }
+  void* const data(mmap(nullptr, st.st_size, PROT_READ, MAP_SHARED, fd, 0));
+  close(fd);
+  if (data == MAP_FAILED) {
+    PLOG(WARNING) << "Failed to map " << path;
+    return nullptr;
+  }
+  util::AdviseHugePages(data, st.st_size);
+
+  unique_ptr<Table> table(new Table);
+  table->path_ = path;
+  table->read_only_ = true;
+  table->slots_ = static_cast<Slot*>(data);
+  table->capacity_ = capacity;
+  return table;
+}
+
+
+LeafIndex::LeafIndex(const MerkleTree* tree)
+    : LeafIndex([tree](int64_t index) { return tree->LeafHash(index + 1); }) {
+  CHECK_NOTNULL(tree);
+}
+
+
+LeafIndex::LeafIndex(std::function<string(int64_t)> leaf_hash)
+    : LeafIndex(std::move(leaf_hash), string()) {
+}
+
+
+LeafIndex::LeafIndex(std::function<string(int64_t)> leaf_hash,
+                     const string& dir)
+    : leaf_hash_(std::move(leaf_hash)),
+      dir_(dir),
+      table_(new Table(dir.empty() ? 0 : kMinimumCapacity, dir)),
+      size_(0) {
+  CHECK(leaf_hash_);
+}
+
+
+LeafIndex::~LeafIndex() {
+}
+
+
+bool LeafIndex::Insert(const string& leaf_hash, int64_t index) {
+  CHECK_GE(index, 0);
+  CHECK(!table_->read_only());
+  if (OverLoaded(size_ + 1, table_->capacity()))
+    Rehash(std::max(2 * table_->capacity(), kMinimumCapacity));
+
+  const uint64_t prefix(Prefix(leaf_hash));
+  Slot* const slot(&table_->slots()[FindSlot(prefix, leaf_hash)]);
+  if (slot->entry != 0)
+    return false;
+
+  // The entry last, as it is what marks the slot as used.
+  slot->prefix = prefix;
+  slot->entry = index + 1;
+  ++size_;
+  return true;
+}
+
+
+int64_t LeafIndex::Find(const string& leaf_hash) const {
+  if (size_ == 0)
+    return -1;
+  return static_cast<int64_t>(
+             table_->slots()[FindSlot(Prefix(leaf_hash), leaf_hash)].entry) -
+         1;
+}
+
+
+void LeafIndex::Reserve(size_t count) {
+  const size_t capacity(CapacityFor(count, table_->capacity()));
+  if (capacity > table_->capacity())
+    Rehash(capacity);
+}
+
+
+bool LeafIndex::HasRoomFor(size_t count) const {
+  return !OverLoaded(count, table_->capacity());
+}
+
+
+void LeafIndex::CopyFrom(const LeafIndex& other, size_t count) {
+  table_.reset(new Table(
+      CapacityFor(std::max(count, other.size_), other.table_->capacity()),
+      dir_));
+  AddSlots(*other.table_);
+  size_ = other.size_;
+}
+
+
+void LeafIndex::Swap(LeafIndex* other) {
+  table_.swap(other->table_);
+  std::swap(size_, other->size_);
+}
+
+
+string LeafIndex::Sync() {
+  CHECK(!dir_.empty());
+  CHECK(!table_->read_only());
+  PCHECK(msync(table_->slots(), table_->capacity() * sizeof(Slot),
+               MS_SYNC) == 0);
+
+  // Readers still using the others keep their mapping.
+  DIR* const dir(opendir(dir_.c_str()));
+  PCHECK(dir) << "Failed to open " << dir_;
+  const string current(table_->path().substr(dir_.size() + 1));
+  while (struct dirent* const entry = readdir(dir)) {
+    const string name(entry->d_name);
+    if (name.compare(0, strlen(kTableFilePrefix), kTableFilePrefix) == 0 &&
+        name != current) {
+      PCHECK(unlink((dir_ + "/" + name).c_str()) == 0 || errno == ENOENT);
+    }
+  }
+  closedir(dir);
+  return table_->path();
+}
+
+
+bool LeafIndex::MapShared(const string& path, size_t size) {
+  if (table_->read_only() && table_->path() == path) {
+    size_ = size;
+    return true;
+  }
+  unique_ptr<Table> table(Table::MapFile(path));
+  if (!table) {
+    return false;
+  }
+  table_ = std::move(table);
+  size_ = size;
+  return true;
+}
+
+
+size_t LeafIndex::ByteSize() const {
+  return table_->capacity() * sizeof(Slot);
+}
+
+
+// static
+uint64_t LeafIndex::Prefix(const string& leaf_hash) {
+  uint64_t prefix(0);
+  memcpy(&prefix, leaf_hash.data(),
+         std::min(sizeof(prefix), leaf_hash.size()));
+  return prefix;
+}
+
+
+size_t LeafIndex::FindSlot(uint64_t prefix, const string& leaf_hash) const {
+  const Slot* const slots(table_->slots());
+  const size_t mask(table_->capacity() - 1);
+  // Linear probing, there is always at least one empty slot.
+  for (size_t i = prefix & mask;; i = (i + 1) & mask) {
+    const Slot& slot(slots[i]);
+    if (slot.entry == 0)
+      return i;
+    if (slot.prefix == prefix && leaf_hash_(slot.entry - 1) == leaf_hash)
+      return i;
+  }
+}
+
+
+void LeafIndex::Rehash(size_t capacity) {
+  CHECK_EQ(0U, capacity & (capacity - 1)) << "Capacity must be a power of 2";
+  unique_ptr<Table> old_table(new Table(capacity, dir_));
+  old_table.swap(table_);
+  AddSlots(*old_table);
+}
+
+
+void LeafIndex::AddSlots(const Table& table) {
+  Slot* const slots(table_->slots());
+  const size_t mask(table_->capacity() - 1);
+  for (size_t j = 0; j < table.capacity(); ++j) {
+    const Slot& slot(table.slots()[j]);
+    if (slot.entry == 0)
+      continue;
+    // Entries are unique, so there is no need to check the leaf hashes
+    // when moving them over.
+    size_t i(slot.prefix & mask);
+    while (slots[i].entry != 0)
+      i = (i + 1) & mask;
+    slots[i] = slot;
+  }
+}
+
+
+}  // namespace cert_trans
@@ -0,0 +1,128 @@
+#ifndef CERT_TRANS_LOG_LEAF_INDEX_H_
+#define CERT_TRANS_LOG_LEAF_INDEX_H_
+
+#include <stddef.h>
+#include <stdint.h>
+#include <functional>
+#include <memory>
+#include <string>
+#include <vector>
+
+class MerkleTree;
+
+namespace cert_trans {
+
+
+// A leaf hash -> leaf index mapping, for the leaves of a Merkle tree.
+//
+// Rather than keeping the full leaf hashes, this is a flat,
+// open-addressing hash table of (hash prefix, index) pairs, relying on
+// the tree itself to hold the full hashes. Since leaf hashes are
+// uniformly distributed, the first 8 bytes of the hash are used directly
+// to pick the slot, so a lookup is usually a single probe, and
+// colliding prefixes are told apart by comparing with the leaf hash in
+// the tree.
+//
+// The table can also be kept in memory-mapped files, for other
+// processes to map read-only with MapShared(). Entries are only ever
+// added to a table (growing it switches to a new file), and an entry
+// is only looked for once its leaf is in the tree of the reader, by
+// which time it was written, so readers need no locking.
+//
+// A table on the heap is kept in huge pages if --huge_pages asks for
+// them (see util/huge_pages.h).
+//
+// This class is thread-compatible, but not thread-safe.
+class LeafIndex {
+ public:
+  // |tree| must outlive this object.
+  explicit LeafIndex(const MerkleTree* tree);
+  // For leaves kept elsewhere, |leaf_hash| returns the hash of the leaf
+  // at the index it is given (starting from 0). It must return an
+  // empty string for leaves that are not in the tree (yet).
+  explicit LeafIndex(std::function<std::string(int64_t)> leaf_hash);
+  // As above, but keeps the table in files in |dir|, which must exist,
+  // so that Sync() can share it with other processes.
+  LeafIndex(std::function<std::string(int64_t)> leaf_hash,
+            const std::string& dir);
+  ~LeafIndex();
+  LeafIndex(const LeafIndex&) = delete;
+  LeafIndex& operator=(const LeafIndex&) = delete;
+
+  // Record that |leaf_hash| is the hash of the leaf at |index|
+  // (starting from 0), which must already be in the tree. If
+  // |leaf_hash| was already indexed, the first index is kept, and false
+  // is returned.
+  bool Insert(const std::string& leaf_hash, int64_t index);
+
+  // Returns the index of the first leaf with hash |leaf_hash|, or -1 if
+  // there is none.
+  int64_t Find(const std::string& leaf_hash) const;
+
+  // Make room for |count| entries without rehashing.
+  void Reserve(size_t count);
+
+  // Whether there is room for |count| entries without rehashing.
+  bool HasRoomFor(size_t count) const;
+
+  // Make this index a copy of |other|, with room for |count| entries
+  // without rehashing. |other| is only read, so that lookups in it can
+  // go on meanwhile. Both must map to the leaves of the same tree.
+  void CopyFrom(const LeafIndex& other, size_t count);
+
+  // Exchange the entries of this index with those of |other|.
+  void Swap(LeafIndex* other);
+
+  // For an index kept in files: flushes the table to disk, removes the
+  // files of the tables it no longer uses, and returns the path of the
+  // file of the table, to hand to MapShared() along with size().
+  std::string Sync();
+
+  // Makes this index a read-only view of the table in |path|, written
+  // by another process, which had |size| entries as far as the reader
+  // is concerned. Returns false, leaving the index as it was, if it
+  // cannot be mapped.
+  bool MapShared(const std::string& path, size_t size);
+
+  size_t size() const {
+    return size_;
+  }
+
+  // Where the table is kept, empty if on the heap.
+  const std::string& dir() const {
+    return dir_;
+  }
+
+  // Number of bytes the table takes up, in memory or mapped.
+  size_t ByteSize() const;
+
+ private:
+  struct Slot {
+    uint64_t prefix;
+    // The index of the leaf plus one, 0 for an empty slot, so that a
+    // new file is an empty table.
+    uint64_t entry;
+  };
+  class Table;
+
+  static uint64_t Prefix(const std::string& leaf_hash);
+  // Returns the slot holding |leaf_hash|, or the empty slot where it
+  // should go.
+  size_t FindSlot(uint64_t prefix, const std::string& leaf_hash) const;
+  void Rehash(size_t capacity);
+  // Adds the entries of |table|, which must not be in this one yet,
+  // without checking their leaf hashes.
+  void AddSlots(const Table& table);
+
+  const std::function<std::string(int64_t)> leaf_hash_;
+  // Empty if the table is kept on the heap.
+  const std::string dir_;
+  // Always a power of two in capacity (or empty).
+  std::unique_ptr<Table> table_;
+  size_t size_;
+};
+
+
+}  // namespace cert_trans
+
+#endif  // CERT_TRANS_LOG_LEAF_INDEX_H_
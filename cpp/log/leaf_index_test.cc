@@ -0,0 +1,150 @@
+#include "log/leaf_index.h"
+
+#include <gtest/gtest.h>
+#include <memory>
+#include <string>
+
+#include "merkletree/merkle_tree.h"
+#include "merkletree/serial_hasher.h"
+#include "util/test_db.h"
+#include "util/testing.h"
+
+namespace cert_trans {
+namespace {
+
+using std::string;
+using std::to_string;
+using std::unique_ptr;
+
+
+class LeafIndexTest : public ::testing::Test {
+ protected:
+  LeafIndexTest()
+      : tree_(unique_ptr<Sha256Hasher>(new Sha256Hasher)), index_(&tree_) {
+  }
+
+  // Add |leaf_hash| to both the tree and the index.
+  bool Add(const string& leaf_hash) {
+    const int64_t index(tree_.AddLeafHash(leaf_hash) - 1);
+    return index_.Insert(leaf_hash, index);
+  }
+
+  MerkleTree tree_;
+  LeafIndex index_;
+};
+
+
+TEST_F(LeafIndexTest, Empty) {
+  EXPECT_EQ(0U, index_.size());
+  EXPECT_EQ(-1, index_.Find(tree_.LeafHash("foo")));
+}
+
+
+TEST_F(LeafIndexTest, FindsEveryLeaf) {
+  // Enough to go through several rehashes.
+  for (int i = 0; i < 10000; ++i)
+    EXPECT_TRUE(Add(tree_.LeafHash("leaf" + to_string(i))));
+  EXPECT_EQ(10000U, index_.size());
+
+  for (int i = 0; i < 10000; ++i)
+    EXPECT_EQ(i, index_.Find(tree_.LeafHash("leaf" + to_string(i))));
+  EXPECT_EQ(-1, index_.Find(tree_.LeafHash("leaf10000")));
+}
+
+
+TEST_F(LeafIndexTest, KeepsFirstDuplicate) {
+  const string leaf_hash(tree_.LeafHash("leaf"));
+  EXPECT_TRUE(Add(tree_.LeafHash("other")));
+  EXPECT_TRUE(Add(leaf_hash));
+  EXPECT_FALSE(Add(leaf_hash));
+  EXPECT_EQ(2U, index_.size());
+  EXPECT_EQ(1, index_.Find(leaf_hash));
+}
+
+
+TEST_F(LeafIndexTest, SharedPrefix) {
+  const string prefix(8, 'p');
+  const string first(prefix + string(24, 'a'));
+  const string second(prefix + string(24, 'b'));
+  EXPECT_TRUE(Add(first));
+  EXPECT_TRUE(Add(second));
+  EXPECT_EQ(0, index_.Find(first));
+  EXPECT_EQ(1, index_.Find(second));
+  EXPECT_EQ(-1, index_.Find(prefix + string(24, 'c')));
+}
+
+
+TEST_F(LeafIndexTest, Reserve) {
+  index_.Reserve(5000);
+  for (int i = 0; i < 5000; ++i)
+    EXPECT_TRUE(Add(tree_.LeafHash(to_string(i))));
+  for (int i = 0; i < 5000; ++i)
+    EXPECT_EQ(i, index_.Find(tree_.LeafHash(to_string(i))));
+}
+
+
+TEST_F(LeafIndexTest, CopyFromAndSwap) {
+  for (int i = 0; i < 1000; ++i)
+    EXPECT_TRUE(Add(tree_.LeafHash(to_string(i))));
+
+  LeafIndex copy(&tree_);
+  copy.CopyFrom(index_, 5000);
+  EXPECT_EQ(1000U, copy.size());
+  EXPECT_TRUE(copy.HasRoomFor(5000));
+  EXPECT_FALSE(index_.HasRoomFor(5000));
+
+  index_.Swap(&copy);
+  EXPECT_EQ(1000U, copy.size());
+  for (int i = 1000; i < 5000; ++i)
+    EXPECT_TRUE(Add(tree_.LeafHash(to_string(i))));
+  EXPECT_TRUE(index_.HasRoomFor(5000));
+  for (int i = 0; i < 5000; ++i)
+    EXPECT_EQ(i, index_.Find(tree_.LeafHash(to_string(i))));
+  EXPECT_EQ(999, copy.Find(tree_.LeafHash(to_string(999))));
+  EXPECT_EQ(-1, copy.Find(tree_.LeafHash(to_string(1000))));
+}
+
+
+TEST_F(LeafIndexTest, SharedWithReaders) {
+  TmpStorage tmp;
+  LeafIndex writer([this](int64_t index) { return tree_.LeafHash(index + 1); },
+                   tmp.TmpStorageDir());
+  const int64_t kPublished(3000);
+  for (int i = 0; i < 5000; ++i) {
+    const string leaf_hash(tree_.LeafHash("leaf" + to_string(i)));
+    EXPECT_TRUE(writer.Insert(leaf_hash, tree_.AddLeafHash(leaf_hash) - 1));
+  }
+  const string path(writer.Sync());
+
+  // A reader that is only up to |kPublished| leaves does not find the
+  // others.
+  LeafIndex reader([this, kPublished](int64_t index) {
+    return index < kPublished ? tree_.LeafHash(index + 1) : string();
+  });
+  EXPECT_FALSE(reader.MapShared(tmp.TmpStorageDir() + "/missing", 1));
+  ASSERT_TRUE(reader.MapShared(path, kPublished));
+  EXPECT_EQ(static_cast<size_t>(kPublished), reader.size());
+  for (int i = 0; i < 5000; ++i) {
+    EXPECT_EQ(i < kPublished ? i : -1,
+              reader.Find(tree_.LeafHash("leaf" + to_string(i))));
+  }
+
+  // Growing the writer moves it to a new file, the reader keeps going
+  // with the old one until it maps the new one.
+  writer.Reserve(100000);
+  const string new_path(writer.Sync());
+  EXPECT_NE(path, new_path);
+  EXPECT_EQ(0, reader.Find(tree_.LeafHash("leaf0")));
+  ASSERT_TRUE(reader.MapShared(new_path, 5000));
+  EXPECT_EQ(2999, reader.Find(tree_.LeafHash("leaf2999")));
+}
+
+
+}  // namespace
+}  // namespace cert_trans
+
+
+int main(int argc, char** argv) {
+  cert_trans::test::InitTesting(argv[0], &argc, &argv, true);
+  return RUN_ALL_TESTS();
+}
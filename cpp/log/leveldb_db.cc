@@ -2,10 +2,18 @@
 
 #include <gflags/gflags.h>
 #include <glog/logging.h>
+#include <leveldb/write_batch.h>
 #include <stdint.h>
+#include <stdio.h>
+#include <functional>
 #include <map>
+#include <set>
+#include <sstream>
 #include <string>
+#include <vector>
 
+#include "merkletree/serial_hasher.h"
+#include "monitoring/gauge.h"
 #include "monitoring/latency.h"
 #include "monitoring/monitoring.h"
 #include "proto/ct.pb.h"
@@ -13,19 +21,66 @@
 #include "util/util.h"
 
 using cert_trans::serialization::DeserializeResult;
+using std::bind;
 using std::chrono::milliseconds;
+using std::chrono::seconds;
+using std::istringstream;
 using std::lock_guard;
-using std::make_pair;
-using std::min;
+using std::map;
+using std::move;
 using std::mutex;
+using std::set;
+using std::stoi;
+using std::stoll;
 using std::string;
+using std::thread;
+using std::to_string;
 using std::unique_lock;
 using std::unique_ptr;
+using std::vector;
 
 DEFINE_int32(leveldb_max_open_files, 0,
              "number of open files that can be used by leveldb");
 DEFINE_int32(leveldb_bloom_filter_bits_per_key, 0,
              "number of open files that can be used by leveldb");
+DEFINE_int32(leveldb_block_cache_size_mb, 0,
+             "size of the block cache shared by all the tables of the "
+             "leveldb database, in megabytes (0 uses the leveldb default, "
+             "of a few megabytes)");
+DEFINE_int32(leveldb_write_buffer_size_mb, 0,
+             "amount of data leveldb buffers in memory before writing it "
+             "out to a table, in megabytes (0 uses the leveldb default); "
+             "larger values help sustained writes, at the cost of memory "
+             "and of a longer recovery when opening the database");
+DEFINE_int32(leveldb_block_size_kb, 0,
+             "approximate size of the blocks leveldb reads and caches, in "
+             "kilobytes (0 uses the leveldb default)");
+DEFINE_bool(leveldb_compression, true,
+            "whether leveldb compresses its tables with snappy");
+DEFINE_bool(leveldb_deduplicate_chains, false,
+            "store each certificate of the submitted chains only once, "
+            "keyed by its SHA-256 digest, rather than with every entry; "
+            "databases written with this cannot be read by older versions");
+DEFINE_int32(leveldb_stats_interval_seconds, 60,
+             "how often to export the internal statistics of leveldb as "
+             "metrics, 0 to disable");
+DEFINE_bool(leveldb_hash_filter, true,
+            "keep a Bloom filter of the entry hashes in memory, of about "
+            "10 bits per entry, so that looking up hashes which are not in "
+            "the database, as with most new submissions, does not read it");
+DEFINE_int32(leveldb_schema_version, 2,
+             "schema of the keys of new databases: 1 has sequence numbers "
+             "in hex, which older versions can read, and 2 in binary; "
+             "existing databases keep theirs until upgraded with "
+             "\"db_tool upgrade_leveldb\"");
+DEFINE_bool(leveldb_store_leaf_hashes, true,
+            "store the Merkle tree leaf hash of each entry alongside it, so "
+            "that rebuilding the tree does not have to read and hash the "
+            "entries themselves");
+DEFINE_int64(leveldb_hash_filter_interval, 1000000,
+             "number of entries to add between writing the hash filter to "
+             "the database, so that opening it only has to read the hashes "
+             "of the entries added since");
 
 namespace cert_trans {
 namespace {
@@ -35,11 +90,59 @@ static Latency<milliseconds, string> latency_by_op_ms(
     "leveldb_latency_by_operation_ms", "operation",
     "Database latency in ms broken out by operation.");
 
+static Gauge<int>* leveldb_files_by_level(
+    Gauge<int>::New("leveldb_files_by_level", "level",
+                    "Number of leveldb table files at each level."));
+
+static Gauge<int>* leveldb_size_mb_by_level(
+    Gauge<int>::New("leveldb_size_mb_by_level", "level",
+                    "Size of the leveldb tables at each level, in MB."));
+
+static Gauge<int, string>* leveldb_compactions_by_level(
+    Gauge<int, string>::New("leveldb_compactions_by_level", "level", "stat",
+                            "Cumulative leveldb compaction statistics at "
+                            "each level: time spent in seconds and MB read "
+                            "and written."));
+
+static Gauge<>* leveldb_approximate_memory_usage_bytes(Gauge<>::New(
+    "leveldb_approximate_memory_usage_bytes",
+    "Approximate memory used by leveldb, including the block cache."));
+
 
 const char kMetaNodeIdKey[] = "metadata";
+const char kMetaTreeFrontierKey[] = "tree_frontier";
+const char kMetaContiguousSizeKey[] = "contiguous_size";
+// Present once every entry has its hash index entry.
+const char kMetaHashIndexKey[] = "hash_index";
+// The schema version, in decimal.
+const char kMetaSchemaVersionKey[] = "schema_version";
+// Present while LevelDB::UpgradeSchema() is rewriting the keys.
+const char kMetaSchemaUpgradeKey[] = "schema_upgrade";
+// The contiguous size it was written at, in hex, then the hash filter.
+const char kMetaHashFilterKey[] = "hash_filter";
 const char kEntryPrefix[] = "entry-";
+// Followed by the entry hash and sequence number, so that the first
+// key for a hash is that of the lowest sequence number it has.
+const char kHashPrefix[] = "hash-";
+// Followed by the sequence number, like the entries.
+const char kLeafHashPrefix[] = "leaf-";
 const char kTreeHeadPrefix[] = "sth-";
 const char kMetaPrefix[] = "meta-";
+// Followed by the SHA-256 digest of a chain certificate.
+const char kChainCertPrefix[] = "chain-";
+
+
+unique_ptr<leveldb::Cache> BuildBlockCache() {
+  unique_ptr<leveldb::Cache> retval;
+
+  CHECK_GE(FLAGS_leveldb_block_cache_size_mb, 0);
+  if (FLAGS_leveldb_block_cache_size_mb > 0) {
+    retval.reset(CHECK_NOTNULL(leveldb::NewLRUCache(
+        static_cast<size_t>(FLAGS_leveldb_block_cache_size_mb) << 20)));
+  }
+
+  return retval;
+}
 
 
 #ifdef HAVE_LEVELDB_FILTER_POLICY_H
@@ -56,9 +159,21 @@ unique_ptr<const leveldb::FilterPolicy> BuildFilterPolicy() {
 #endif
 
 
+// Number of entries indexed per write when building the hash index of
+// an existing database, or keys rewritten when upgrading its schema.
+const int kHashIndexBatchSize = 10000;
+
+// Databases from before the schema version was recorded have keys that
+// end with the sequence number in 16 hex digits.
+const int kHexKeysSchema = 1;
+// Keys end with the sequence number in 8 bytes, which makes them
+// shorter and cheaper to decode.
+const int kBinaryKeysSchema = 2;
+
+
 // WARNING: Do NOT change the type of "index" from int64_t, or you'll
 // break existing databases!
-string IndexToKey(int64_t index) {
+string IndexToHex(int64_t index) {
   const char nibble[] = "0123456789abcdef";
   string index_str(sizeof(index) * 2, nibble[0]);
   for (int i = sizeof(index) * 2; i > 0 && index > 0; --i) {
@@ -66,14 +181,12 @@ string IndexToKey(int64_t index) {
     index = index >> 4;
   }
 
-  return kEntryPrefix + index_str;
+  return index_str;
 }
 
 
-int64_t KeyToIndex(leveldb::Slice key) {
-  CHECK(key.starts_with(kEntryPrefix));
-  key.remove_prefix(strlen(kEntryPrefix));
-  const string index_str(util::BinaryString(key.ToString()));
+int64_t HexToIndex(const leveldb::Slice& hex) {
+  const string index_str(util::BinaryString(hex.ToString()));
 
   int64_t index(0);
   CHECK_EQ(index_str.size(), sizeof(index));
@@ -85,15 +198,162 @@ int64_t KeyToIndex(leveldb::Slice key) {
 }
 
 
+// Big-endian, so that keys sort in numerical order.
+string IndexToBinary(int64_t index) {
+  string index_str(sizeof(index), '\0');
+  for (int i = sizeof(index); i > 0; --i) {
+    index_str[i - 1] = static_cast<char>(index & 0xff);
+    index = index >> 8;
+  }
+
+  return index_str;
+}
+
+
+int64_t BinaryToIndex(const leveldb::Slice& binary) {
+  int64_t index(0);
+  CHECK_EQ(binary.size(), sizeof(index));
+  for (size_t i = 0; i < sizeof(index); ++i) {
+    index = (index << 8) | static_cast<unsigned char>(binary[i]);
+  }
+
+  return index;
+}
+
+
+// How sequence numbers end the keys, with each schema.
+string IndexToSuffix(int schema_version, int64_t index) {
+  return schema_version == kHexKeysSchema ? IndexToHex(index)
+                                          : IndexToBinary(index);
+}
+
+
+int64_t SuffixToIndex(int schema_version, const leveldb::Slice& suffix) {
+  return schema_version == kHexKeysSchema ? HexToIndex(suffix)
+                                          : BinaryToIndex(suffix);
+}
+
+
+size_t SuffixSize(int schema_version) {
+  return schema_version == kHexKeysSchema ? sizeof(int64_t) * 2
+                                          : sizeof(int64_t);
+}
+
+
+string IndexToKey(int schema_version, int64_t index) {
+  return kEntryPrefix + IndexToSuffix(schema_version, index);
+}
+
+
+int64_t KeyToIndex(int schema_version, leveldb::Slice key) {
+  CHECK(key.starts_with(kEntryPrefix));
+  key.remove_prefix(strlen(kEntryPrefix));
+  return SuffixToIndex(schema_version, key);
+}
+
+
+string HashToKey(int schema_version, const string& hash, int64_t index) {
+  return kHashPrefix + hash + IndexToSuffix(schema_version, index);
+}
+
+
+string IndexToLeafHashKey(int schema_version, int64_t index) {
+  return kLeafHashPrefix + IndexToSuffix(schema_version, index);
+}
+
+
+int64_t LeafHashKeyToIndex(int schema_version, leveldb::Slice key) {
+  CHECK(key.starts_with(kLeafHashPrefix));
+  key.remove_prefix(strlen(kLeafHashPrefix));
+  return SuffixToIndex(schema_version, key);
+}
+
+
+// Rewrites the keys of |db| which start with |prefix| and end with a
+// sequence number in hex, after |body_size| more bytes, so that they
+// end with it in binary instead. Keys already rewritten are left
+// alone, so that an interrupted upgrade can be carried on. Returns the
+// number of keys rewritten.
+int64_t UpgradeKeysToBinary(leveldb::DB* db, const char* prefix,
+                            size_t body_size) {
+  const size_t hex_size(strlen(prefix) + body_size +
+                        SuffixSize(kHexKeysSchema));
+  const size_t binary_size(strlen(prefix) + body_size +
+                           SuffixSize(kBinaryKeysSchema));
+  leveldb::ReadOptions options;
+  options.fill_cache = false;
+  // The iterator does not see the keys written while it goes.
+  unique_ptr<leveldb::Iterator> it(db->NewIterator(options));
+  CHECK(it);
+  int64_t num_upgraded(0);
+  leveldb::WriteBatch batch;
+  for (it->Seek(prefix); it->Valid() && it->key().starts_with(prefix);
+       it->Next()) {
+    const leveldb::Slice key(it->key());
+    if (key.size() == binary_size) {
+      continue;
+    }
+    CHECK_EQ(key.size(), hex_size) << "Unexpected key "
+                                   << util::HexString(key.ToString());
+    const string head(key.data(), binary_size - sizeof(int64_t));
+    const leveldb::Slice hex(key.data() + head.size(),
+                             SuffixSize(kHexKeysSchema));
+    batch.Put(head + IndexToBinary(HexToIndex(hex)), it->value());
+    batch.Delete(key);
+    if (++num_upgraded % kHashIndexBatchSize == 0) {
+      const leveldb::Status status(db->Write(leveldb::WriteOptions(), &batch));
+      CHECK(status.ok()) << "Failed to upgrade keys: " << status.ToString();
+      batch.Clear();
+      LOG(INFO) << "Upgraded " << num_upgraded << " " << prefix << " keys";
+    }
+  }
+  const leveldb::Status status(db->Write(leveldb::WriteOptions(), &batch));
+  CHECK(status.ok()) << "Failed to upgrade keys: " << status.ToString();
+
+  return num_upgraded;
+}
+
+
+// Parses the per-level compaction table of the "leveldb.stats"
+// property, which looks like:
+//
+//                                Compactions
+// Level  Files Size(MB) Time(sec) Read(MB) Write(MB)
+// --------------------------------------------------
+//   0        2        0         0        0         0
+//   1        5        9         1       12        10
+void ExportCompactionStats(const string& stats) {
+  istringstream in(stats);
+  string line;
+  bool in_table(false);
+  while (getline(in, line)) {
+    if (!in_table) {
+      in_table = line.compare(0, 5, "-----") == 0;
+      continue;
+    }
+    int level, files;
+    double size_mb, time_sec, read_mb, write_mb;
+    if (sscanf(line.c_str(), "%d %d %lf %lf %lf %lf", &level, &files,
+               &size_mb, &time_sec, &read_mb, &write_mb) != 6) {
+      break;
+    }
+    leveldb_size_mb_by_level->Set(level, size_mb);
+    leveldb_compactions_by_level->Set(level, "time_sec", time_sec);
+    leveldb_compactions_by_level->Set(level, "read_mb", read_mb);
+    leveldb_compactions_by_level->Set(level, "write_mb", write_mb);
+  }
+}
+
+
 }  // namespace
 
 
 class LevelDB::Iterator : public Database::Iterator {
  public:
   Iterator(const LevelDB* db, int64_t start_index)
-      : it_(CHECK_NOTNULL(db)->db_->NewIterator(leveldb::ReadOptions())) {
+      : db_(CHECK_NOTNULL(db)), it_(db_->db_->NewIterator(ScanOptions())) {
     CHECK(it_);
-    it_->Seek(IndexToKey(start_index));
+    it_->Seek(IndexToKey(db_->schema_version_, start_index));
   }
 
   bool GetNextEntry(LoggedEntry* entry) override {
@@ -101,8 +361,8 @@ class LevelDB::Iterator : public Database::Iterator {
       return false;
     }
 
-    const int64_t seq(KeyToIndex(it_->key()));
-    CHECK(entry->ParseFromArray(it_->value().data(), it_->value().size()))
+    const int64_t seq(KeyToIndex(db_->schema_version_, it_->key()));
+    CHECK(db_->ParseEntry(it_->value(), entry))
         << "failed to parse entry for key " << it_->key().ToString();
     CHECK(entry->has_sequence_number())
         << "no sequence number for entry with expected sequence number "
@@ -115,6 +375,16 @@ class LevelDB::Iterator : public Database::Iterator {
   }
 
  private:
+  // Scans mostly read each entry once (rebuilding the tree, serving
+  // get-entries, ...), so they shouldn't evict the blocks that point
+  // lookups keep coming back to from the block cache.
+  static leveldb::ReadOptions ScanOptions() {
+    leveldb::ReadOptions options;
+    options.fill_cache = false;
+    return options;
+  }
+
+  const LevelDB* const db_;
   const unique_ptr<leveldb::Iterator> it_;
 };
 
@@ -127,8 +397,15 @@ LevelDB::LevelDB(const string& dbfile)
 #ifdef HAVE_LEVELDB_FILTER_POLICY_H
       filter_policy_(BuildFilterPolicy()),
 #endif
+      block_cache_(BuildBlockCache()),
+      schema_version_(kHexKeysSchema),
+      leaf_hasher_(unique_ptr<SerialHasher>(new Sha256Hasher)),
       contiguous_size_(0),
-      latest_tree_timestamp_(0) {
+      hash_filter_written_size_(0),
+      hash_filter_memory_("hash_filter"),
+      latest_tree_timestamp_(0),
+      memory_("leveldb"),
+      exiting_(false) {
   LOG(INFO) << "Opening " << dbfile;
   ScopedLatency latency(latency_by_op_ms.GetScopedLatency("open"));
   leveldb::Options options;
@@ -136,6 +413,18 @@ LevelDB::LevelDB(const string& dbfile)
   if (FLAGS_leveldb_max_open_files > 0) {
     options.max_open_files = FLAGS_leveldb_max_open_files;
   }
+  options.block_cache = block_cache_.get();
+  if (FLAGS_leveldb_write_buffer_size_mb > 0) {
+    options.write_buffer_size =
+        static_cast<size_t>(FLAGS_leveldb_write_buffer_size_mb) << 20;
+  }
+  if (FLAGS_leveldb_block_size_kb > 0) {
+    options.block_size = static_cast<size_t>(FLAGS_leveldb_block_size_kb)
+                         << 10;
+  }
+  options.compression = FLAGS_leveldb_compression
+                            ? leveldb::kSnappyCompression
+                            : leveldb::kNoCompression;
 #ifdef HAVE_LEVELDB_FILTER_POLICY_H
   options.filter_policy = filter_policy_.get();
 #else
@@ -147,7 +436,35 @@ LevelDB::LevelDB(const string& dbfile)
   CHECK(status.ok()) << status.ToString();
   db_.reset(db);
 
+  LoadSchemaVersion();
   BuildIndex();
+
+  if (FLAGS_leveldb_stats_interval_seconds > 0) {
+    stats_thread_ = thread(bind(&LevelDB::ExportStats, this));
+  }
+}
+
+
+LevelDB::~LevelDB() {
+  {
+    lock_guard<mutex> lock(stats_lock_);
+    exiting_ = true;
+  }
+  stats_cv_.notify_all();
+  if (stats_thread_.joinable()) {
+    stats_thread_.join();
+  }
+
+  // So that opening the database again does not have to read the
+  // hashes added since it was last written.
+  lock_guard<mutex> lock(lock_);
+  if (hash_filter_ && hash_filter_written_size_ != contiguous_size_) {
+    leveldb::WriteBatch batch;
+    AddHashFilterToBatch(true, &batch);
+    const leveldb::Status status(db_->Write(leveldb::WriteOptions(), &batch));
+    LOG_IF(WARNING, !status.ok()) << "Failed to write hash filter: "
+                                  << status.ToString();
+  }
 }
 
 
@@ -161,28 +478,113 @@ Database::WriteResult LevelDB::CreateSequencedEntry_(
   unique_lock<mutex> lock(lock_);
 
   string data;
-  CHECK(logged.SerializeToString(&data));
+  ChainCertMap new_chain_certs;
+  SerializeEntry(logged, &data, &new_chain_certs);
+
+  const string key(IndexToKey(schema_version_, logged.sequence_number()));
+
+  // The index knows about every entry, so only read existing ones.
+  if (HaveEntry(logged.sequence_number())) {
+    string existing_data;
+    const leveldb::Status status(
+        db_->Get(leveldb::ReadOptions(), key, &existing_data));
+    if (!status.IsNotFound()) {
+      if (SameEntry(existing_data, data, logged)) {
+        return this->OK;
+      }
+      return this->SEQUENCE_NUMBER_ALREADY_IN_USE;
+    }
+  }
+
+  leveldb::WriteBatch batch;
+  AddEntryToBatch(logged, data, &batch);
+  AddContiguousSizeToBatch(contiguous_size_,
+                           ContiguousSizeWith({logged.sequence_number()}),
+                           &batch);
+  AddHashFilterToBatch(false, &batch);
+  AddChainCertsToBatch(new_chain_certs, &batch);
+  const leveldb::Status status(db_->Write(leveldb::WriteOptions(), &batch));
+  CHECK(status.ok()) << "Failed to write sequenced entry (seq: "
+                     << logged.sequence_number()
+                     << "): " << status.ToString();
+  InsertEntryMapping(logged.sequence_number());
+  InsertChainCerts(&new_chain_certs);
+  MaybeGrowHashFilter();
+
+  return this->OK;
+}
+
+
+Database::WriteResult LevelDB::CreateSequencedEntries_(
+    const vector<LoggedEntry>& logged) {
+  ScopedLatency latency(
+      latency_by_op_ms.GetScopedLatency("create_sequenced_entries"));
 
-  const string key(IndexToKey(logged.sequence_number()));
+  unique_lock<mutex> lock(lock_);
 
+  // Collect all the new entries into a single batch, stopping at the
+  // first conflict; whatever came before it still gets written. The
+  // batch is checked against itself as well, as the mapping only
+  // learns about its entries once it is written.
+  leveldb::WriteBatch batch;
+  map<int64_t, const LoggedEntry*> batched;
+  Database::WriteResult result(this->OK);
+  ChainCertMap new_chain_certs;
+  string data;
   string existing_data;
-  leveldb::Status status(
-      db_->Get(leveldb::ReadOptions(), key, &existing_data));
-  if (status.IsNotFound()) {
-    status = db_->Put(leveldb::WriteOptions(), key, data);
-    CHECK(status.ok()) << "Failed to write sequenced entry (seq: "
-                       << logged.sequence_number()
-                       << "): " << status.ToString();
-  } else {
-    if (existing_data == data) {
-      return this->OK;
+  for (const auto& entry : logged) {
+    const auto it(batched.find(entry.sequence_number()));
+    if (it != batched.end()) {
+      if (!(*it->second == entry)) {
+        result = this->SEQUENCE_NUMBER_ALREADY_IN_USE;
+        break;
+      }
+      continue;
+    }
+
+    SerializeEntry(entry, &data, &new_chain_certs);
+    const string key(IndexToKey(schema_version_, entry.sequence_number()));
+
+    // The index knows about every entry, so only read existing ones.
+    if (!HaveEntry(entry.sequence_number())) {
+      AddEntryToBatch(entry, data, &batch);
+      batched.emplace(entry.sequence_number(), &entry);
+      continue;
+    }
+
+    const leveldb::Status status(
+        db_->Get(leveldb::ReadOptions(), key, &existing_data));
+    if (status.IsNotFound()) {
+      AddEntryToBatch(entry, data, &batch);
+      batched.emplace(entry.sequence_number(), &entry);
+    } else if (!SameEntry(existing_data, data, entry)) {
+      result = this->SEQUENCE_NUMBER_ALREADY_IN_USE;
+      break;
     }
-    return this->SEQUENCE_NUMBER_ALREADY_IN_USE;
   }
 
-  InsertEntryMapping(logged.sequence_number(), logged.Hash());
+  if (!batched.empty()) {
+    set<int64_t> sequence_numbers;
+    for (const auto& it : batched) {
+      sequence_numbers.insert(sequence_numbers.end(), it.first);
+    }
+    AddContiguousSizeToBatch(contiguous_size_,
+                             ContiguousSizeWith(sequence_numbers), &batch);
+    AddHashFilterToBatch(false, &batch);
+    // This might include the certificates of the conflicting entry,
+    // which does no harm.
+    AddChainCertsToBatch(new_chain_certs, &batch);
+    const leveldb::Status status(db_->Write(leveldb::WriteOptions(), &batch));
+    CHECK(status.ok()) << "Failed to write " << batched.size()
+                       << " sequenced entries: " << status.ToString();
+    for (const int64_t sequence_number : sequence_numbers) {
+      InsertEntryMapping(sequence_number);
+    }
+    InsertChainCerts(&new_chain_certs);
+    MaybeGrowHashFilter();
+  }
 
-  return this->OK;
+  return result;
 }
 
 
@@ -190,16 +592,33 @@ Database::LookupResult LevelDB::LookupByHash(const string& hash,
                                              LoggedEntry* result) const {
   ScopedLatency latency(latency_by_op_ms.GetScopedLatency("lookup_by_hash"));
 
-  unique_lock<mutex> lock(lock_);
+  {
+    lock_guard<mutex> lock(hash_filter_lock_);
+    if (hash_filter_ && !hash_filter_->MayContain(hash)) {
+      return this->NOT_FOUND;
+    }
+  }
 
-  auto i(id_by_hash_.find(hash));
-  if (i == id_by_hash_.end()) {
+  // The hash index is written together with the entries, so there is
+  // no need to lock.
+  const string prefix(kHashPrefix + hash);
+  const unique_ptr<leveldb::Iterator> it(
+      db_->NewIterator(leveldb::ReadOptions()));
+  CHECK(it);
+  it->Seek(prefix);
+  if (!it->Valid() || !it->key().starts_with(prefix) ||
+      it->key().size() != prefix.size() + SuffixSize(schema_version_)) {
     return this->NOT_FOUND;
   }
+  leveldb::Slice index_suffix(it->key());
+  index_suffix.remove_prefix(prefix.size());
 
   string cert_data;
   const leveldb::Status status(
-      db_->Get(leveldb::ReadOptions(), IndexToKey(i->second), &cert_data));
+      db_->Get(leveldb::ReadOptions(),
+               IndexToKey(schema_version_,
+                          SuffixToIndex(schema_version_, index_suffix)),
+               &cert_data));
   if (status.IsNotFound()) {
     return this->NOT_FOUND;
   }
@@ -207,7 +626,7 @@ Database::LookupResult LevelDB::LookupByHash(const string& hash,
                      << "): " << status.ToString();
 
   if (result) {
-    CHECK(result->ParseFromString(cert_data));
+    CHECK(ParseEntry(cert_data, result));
     CHECK_EQ(result->Hash(), hash);
   }
 
@@ -221,8 +640,9 @@ Database::LookupResult LevelDB::LookupByIndex(int64_t sequence_number,
   ScopedLatency latency(latency_by_op_ms.GetScopedLatency("lookup_by_index"));
 
   string cert_data;
-  leveldb::Status status(db_->Get(leveldb::ReadOptions(),
-                                  IndexToKey(sequence_number), &cert_data));
+  leveldb::Status status(
+      db_->Get(leveldb::ReadOptions(),
+               IndexToKey(schema_version_, sequence_number), &cert_data));
   if (status.IsNotFound()) {
     return this->NOT_FOUND;
   }
@@ -230,7 +650,7 @@ Database::LookupResult LevelDB::LookupByIndex(int64_t sequence_number,
                      << sequence_number;
 
   if (result) {
-    CHECK(result->ParseFromString(cert_data));
+    CHECK(ParseEntry(cert_data, result));
     CHECK_EQ(result->sequence_number(), sequence_number);
   }
 
@@ -244,6 +664,32 @@ unique_ptr<Database::Iterator> LevelDB::ScanEntries(
 }
 
 
+size_t LevelDB::ReadLeafHashes(int64_t start_index, size_t max_entries,
+                               vector<string>* leaf_hashes) const {
+  CHECK_GE(start_index, 0);
+  CHECK_NOTNULL(leaf_hashes)->clear();
+  ScopedLatency latency(
+      latency_by_op_ms.GetScopedLatency("read_leaf_hashes"));
+
+  // Like the entries, the leaf hashes are mostly read once, when
+  // building a tree.
+  leveldb::ReadOptions options;
+  options.fill_cache = false;
+  const unique_ptr<leveldb::Iterator> it(db_->NewIterator(options));
+  CHECK(it);
+  int64_t index(start_index);
+  for (it->Seek(IndexToLeafHashKey(schema_version_, start_index));
+       leaf_hashes->size() < max_entries && it->Valid() &&
+       it->key().starts_with(kLeafHashPrefix) &&
+       LeafHashKeyToIndex(schema_version_, it->key()) == index;
+       it->Next(), ++index) {
+    leaf_hashes->push_back(it->value().ToString());
+  }
+
+  return leaf_hashes->size();
+}
+
+
 Database::WriteResult LevelDB::WriteTreeHead_(const ct::SignedTreeHead& sth) {
   CHECK_GE(sth.tree_size(), 0);
   ScopedLatency latency(latency_by_op_ms.GetScopedLatency("write_tree_head"));
@@ -318,8 +764,8 @@ void LevelDB::AddNotifySTHCallback(
 
 void LevelDB::RemoveNotifySTHCallback(
     const Database::NotifySTHCallback* callback) {
-  lock_guard<mutex> lock(lock_);
-
+  // Not under |lock_|: |callbacks_| has a lock of its own, and may
+  // wait for callbacks that read from the database.
   callbacks_.Remove(callback);
 }
 
@@ -357,30 +803,191 @@ Database::LookupResult LevelDB::NodeId(string* node_id) {
 }
 
 
+void LevelDB::WriteTreeFrontier(const ct::CompactTreeFrontier& frontier) {
+  ScopedLatency latency(
+      latency_by_op_ms.GetScopedLatency("write_tree_frontier"));
+  string data;
+  CHECK(frontier.SerializeToString(&data));
+
+  leveldb::Status status(db_->Put(leveldb::WriteOptions(),
+                                  string(kMetaPrefix) + kMetaTreeFrontierKey,
+                                  data));
+  CHECK(status.ok()) << "Failed to store tree frontier: "
+                     << status.ToString();
+}
+
+
+Database::LookupResult LevelDB::LatestTreeFrontier(
+    ct::CompactTreeFrontier* result) const {
+  CHECK_NOTNULL(result);
+  ScopedLatency latency(
+      latency_by_op_ms.GetScopedLatency("latest_tree_frontier"));
+  string data;
+  leveldb::Status status(db_->Get(leveldb::ReadOptions(),
+                                  string(kMetaPrefix) + kMetaTreeFrontierKey,
+                                  &data));
+  if (status.IsNotFound()) {
+    return this->NOT_FOUND;
+  }
+  CHECK(status.ok()) << "Tree frontier lookup failed: " << status.ToString();
+
+  CHECK(result->ParseFromString(data));
+  return this->LOOKUP_OK;
+}
+
+
+// static
+void LevelDB::UpgradeSchema(const string& dbfile) {
+  LOG(INFO) << "Upgrading the schema of " << dbfile;
+  leveldb::DB* raw_db;
+  leveldb::Status status(leveldb::DB::Open(leveldb::Options(), dbfile,
+                                           &raw_db));
+  CHECK(status.ok()) << status.ToString();
+  const unique_ptr<leveldb::DB> db(raw_db);
+
+  string version;
+  status = db->Get(leveldb::ReadOptions(),
+                   string(kMetaPrefix) + kMetaSchemaVersionKey, &version);
+  if (status.ok() && stoi(version) >= kBinaryKeysSchema) {
+    LOG(INFO) << "Schema version " << version << " is the latest already";
+    return;
+  }
+  CHECK(status.ok() || status.IsNotFound())
+      << "Failed to read schema version: " << status.ToString();
+
+  // Stops the database from being opened half upgraded.
+  status = db->Put(leveldb::WriteOptions(),
+                   string(kMetaPrefix) + kMetaSchemaUpgradeKey,
+                   leveldb::Slice());
+  CHECK(status.ok()) << "Failed to write schema upgrade marker: "
+                     << status.ToString();
+
+  // The hash index keys have the entry hash, a SHA-256 digest, before
+  // the sequence number.
+  const int64_t num_entries(UpgradeKeysToBinary(db.get(), kEntryPrefix, 0));
+  const int64_t num_hashes(UpgradeKeysToBinary(db.get(), kHashPrefix, 32));
+  const int64_t num_leaf_hashes(
+      UpgradeKeysToBinary(db.get(), kLeafHashPrefix, 0));
+
+  leveldb::WriteBatch batch;
+  batch.Put(string(kMetaPrefix) + kMetaSchemaVersionKey,
+            to_string(kBinaryKeysSchema));
+  batch.Delete(string(kMetaPrefix) + kMetaSchemaUpgradeKey);
+  leveldb::WriteOptions options;
+  options.sync = true;
+  status = db->Write(options, &batch);
+  CHECK(status.ok()) << "Failed to write schema version: "
+                     << status.ToString();
+  LOG(INFO) << "Upgraded the keys of " << num_entries << " entries, "
+            << num_hashes << " hash index entries and " << num_leaf_hashes
+            << " leaf hashes";
+
+  // Get rid of the old keys now, rather than as the log grows.
+  db->CompactRange(nullptr, nullptr);
+}
+
+
+// This must be called before BuildIndex(), which needs the schema.
+void LevelDB::LoadSchemaVersion() {
+  string value;
+  leveldb::Status status(db_->Get(leveldb::ReadOptions(),
+                                  string(kMetaPrefix) + kMetaSchemaUpgradeKey,
+                                  &value));
+  CHECK(status.IsNotFound())
+      << "The schema upgrade of this database was interrupted, run "
+      << "\"db_tool upgrade_leveldb\" again to finish it";
+
+  status = db_->Get(leveldb::ReadOptions(),
+                    string(kMetaPrefix) + kMetaSchemaVersionKey, &value);
+  if (status.ok()) {
+    schema_version_ = stoi(value);
+    CHECK(schema_version_ == kHexKeysSchema ||
+          schema_version_ == kBinaryKeysSchema)
+        << "Unknown schema version " << value
+        << ", the database must have been written by a newer version";
+    return;
+  }
+  CHECK(status.IsNotFound()) << "Failed to read schema version: "
+                             << status.ToString();
+
+  // Existing databases without a schema version are from before there
+  // was one.
+  const unique_ptr<leveldb::Iterator> it(
+      db_->NewIterator(leveldb::ReadOptions()));
+  CHECK(it);
+  it->SeekToFirst();
+  if (it->Valid()) {
+    schema_version_ = kHexKeysSchema;
+    LOG(INFO) << "Database has the original schema, \"db_tool "
+              << "upgrade_leveldb\" makes its keys more compact";
+    return;
+  }
+
+  CHECK(FLAGS_leveldb_schema_version == kHexKeysSchema ||
+        FLAGS_leveldb_schema_version == kBinaryKeysSchema)
+      << "Unknown --leveldb_schema_version";
+  schema_version_ = FLAGS_leveldb_schema_version;
+  status = db_->Put(leveldb::WriteOptions(),
+                    string(kMetaPrefix) + kMetaSchemaVersionKey,
+                    to_string(schema_version_));
+  CHECK(status.ok()) << "Failed to write schema version: "
+                     << status.ToString();
+}
+
+
 void LevelDB::BuildIndex() {
   ScopedLatency latency(latency_by_op_ms.GetScopedLatency("build_index"));
   // Technically, this should only be called from the constructor, so
   // this should not be necessarily, but just to be sure...
   lock_guard<mutex> lock(lock_);
 
+  // The entries refer to these, so they are needed before anything
+  // else.
+  LoadChainCerts();
+
+  string index_marker;
+  leveldb::Status status(db_->Get(leveldb::ReadOptions(),
+                                  string(kMetaPrefix) + kMetaHashIndexKey,
+                                  &index_marker));
+  if (status.IsNotFound()) {
+    BuildHashIndex();
+  } else {
+    CHECK(status.ok()) << "Failed to read hash index marker: "
+                       << status.ToString();
+  }
+
+  string size_hex;
+  status = db_->Get(leveldb::ReadOptions(),
+                    string(kMetaPrefix) + kMetaContiguousSizeKey, &size_hex);
+  if (!status.IsNotFound()) {
+    CHECK(status.ok()) << "Failed to read contiguous size: "
+                       << status.ToString();
+    contiguous_size_ = HexToIndex(size_hex);
+  }
+
+  // Only the entries past the stored contiguous size have to be looked
+  // at, and only their keys at that.
   leveldb::ReadOptions options;
   options.fill_cache = false;
   unique_ptr<leveldb::Iterator> it(db_->NewIterator(options));
   CHECK(it);
-  it->Seek(kEntryPrefix);
-
+  const int64_t stored_size(contiguous_size_);
+  it->Seek(IndexToKey(schema_version_, stored_size));
   for (; it->Valid() && it->key().starts_with(kEntryPrefix); it->Next()) {
-    const int64_t seq(KeyToIndex(it->key()));
-    LoggedEntry logged;
-    CHECK(logged.ParseFromString(it->value().ToString()))
-        << "Failed to parse entry with sequence number " << seq;
-    CHECK(logged.has_sequence_number())
-        << "No sequence number for entry with sequence number " << seq;
-    CHECK_EQ(logged.sequence_number(), seq)
-        << "Entry has unexpected sequence_number: " << seq;
-
-    InsertEntryMapping(logged.sequence_number(), logged.Hash());
+    InsertEntryMapping(KeyToIndex(schema_version_, it->key()));
+  }
+  if (contiguous_size_ != stored_size) {
+    leveldb::WriteBatch batch;
+    AddContiguousSizeToBatch(stored_size, contiguous_size_, &batch);
+    status = db_->Write(leveldb::WriteOptions(), &batch);
+    CHECK(status.ok()) << "Failed to write contiguous size: "
+                       << status.ToString();
   }
+  LOG(INFO) << "Opened database with " << contiguous_size_
+            << " contiguous entries and " << sparse_entries_.size()
+            << " more";
+
+  LoadHashFilter();
 
   // Now read the STH entries.
   it->Seek(kTreeHeadPrefix);
@@ -396,6 +1003,34 @@ void LevelDB::BuildIndex() {
 }
 
 
+void LevelDB::ExportStats() {
+  const seconds interval(FLAGS_leveldb_stats_interval_seconds);
+  unique_lock<mutex> lock(stats_lock_);
+  while (!exiting_) {
+    // The properties are read from leveldb itself, which is
+    // thread-safe, so lock_ is not needed.
+    string value;
+    for (int level = 0;; ++level) {
+      if (!db_->GetProperty("leveldb.num-files-at-level" + to_string(level),
+                            &value)) {
+        break;
+      }
+      leveldb_files_by_level->Set(level, stoll(value));
+    }
+    if (db_->GetProperty("leveldb.stats", &value)) {
+      ExportCompactionStats(value);
+    }
+    // Not all versions of leveldb have this one.
+    if (db_->GetProperty("leveldb.approximate-memory-usage", &value)) {
+      leveldb_approximate_memory_usage_bytes->Set(stoll(value));
+      memory_.Set(stoll(value));
+    }
+
+    stats_cv_.wait_for(lock, interval, [this]() { return exiting_; });
+  }
+}
+
+
 Database::LookupResult LevelDB::LatestTreeHeadNoLock(
     ct::SignedTreeHead* result) const {
   if (latest_tree_timestamp_ == 0) {
@@ -417,12 +1052,334 @@ Database::LookupResult LevelDB::LatestTreeHeadNoLock(
 
 
 // This must be called with "lock_" held.
-void LevelDB::InsertEntryMapping(int64_t sequence_number, const string& hash) {
-  if (!id_by_hash_.insert(make_pair(hash, sequence_number)).second) {
-    // This is a duplicate hash under a new sequence number.
-    // Make sure we track the entry with the lowest sequence number:
-    id_by_hash_[hash] = min(id_by_hash_[hash], sequence_number);
+void LevelDB::BuildHashIndex() {
+  ScopedLatency latency(
+      latency_by_op_ms.GetScopedLatency("build_hash_index"));
+  LOG(INFO) << "Building the hash index, this can take a while.";
+
+  leveldb::ReadOptions options;
+  options.fill_cache = false;
+  unique_ptr<leveldb::Iterator> it(db_->NewIterator(options));
+  CHECK(it);
+  it->Seek(kEntryPrefix);
+
+  // Parsing the entries checks them as well, as was always done when
+  // opening a database before it had this index.
+  int64_t num_indexed(0);
+  leveldb::WriteBatch batch;
+  LoggedEntry logged;
+  for (; it->Valid() && it->key().starts_with(kEntryPrefix); it->Next()) {
+    const int64_t seq(KeyToIndex(schema_version_, it->key()));
+    CHECK(ParseEntry(it->value(), &logged))
+        << "Failed to parse entry with sequence number " << seq;
+    CHECK(logged.has_sequence_number())
+        << "No sequence number for entry with sequence number " << seq;
+    CHECK_EQ(logged.sequence_number(), seq)
+        << "Entry has unexpected sequence_number: " << seq;
+
+    batch.Put(HashToKey(schema_version_, logged.Hash(), seq),
+              leveldb::Slice());
+    if (++num_indexed % kHashIndexBatchSize == 0) {
+      const leveldb::Status status(
+          db_->Write(leveldb::WriteOptions(), &batch));
+      CHECK(status.ok()) << "Failed to write hash index: "
+                         << status.ToString();
+      batch.Clear();
+    }
+  }
+
+  // The marker goes in last, so that an interrupted build is redone.
+  batch.Put(string(kMetaPrefix) + kMetaHashIndexKey, leveldb::Slice());
+  const leveldb::Status status(db_->Write(leveldb::WriteOptions(), &batch));
+  CHECK(status.ok()) << "Failed to write hash index: " << status.ToString();
+  LOG(INFO) << "Indexed " << num_indexed << " entries by hash.";
+}
+
+
+// This must be called with "lock_" held.
+bool LevelDB::HaveEntry(int64_t sequence_number) const {
+  return sequence_number < contiguous_size_ ||
+         sparse_entries_.count(sequence_number) > 0;
+}
+
+
+// This must be called with "lock_" held.
+void LevelDB::AddEntryToBatch(const LoggedEntry& logged, const string& data,
+                              leveldb::WriteBatch* batch) {
+  // A duplicate hash under a new sequence number gets its own index
+  // entry, but lookups find the one with the lowest sequence number.
+  const string hash(logged.Hash());
+  batch->Put(IndexToKey(schema_version_, logged.sequence_number()), data);
+  batch->Put(HashToKey(schema_version_, hash, logged.sequence_number()),
+             leveldb::Slice());
+  // Readers fall back to hashing the entry if it is missing, so an
+  // entry that cannot be serialized just goes without. Most entries
+  // come with it anyway.
+  string serialized_leaf;
+  if (FLAGS_leveldb_store_leaf_hashes && logged.has_merkle_leaf_hash()) {
+    batch->Put(IndexToLeafHashKey(schema_version_, logged.sequence_number()),
+               logged.merkle_leaf_hash());
+  } else if (FLAGS_leveldb_store_leaf_hashes &&
+             logged.SerializeForLeaf(&serialized_leaf)) {
+    batch->Put(IndexToLeafHashKey(schema_version_, logged.sequence_number()),
+               leaf_hasher_.HashLeaf(serialized_leaf));
   }
+  // The filter only has to have the hash by the time the entry can be
+  // read, so adding it a little early does no harm.
+  if (hash_filter_) {
+    lock_guard<mutex> lock(hash_filter_lock_);
+    hash_filter_->Add(hash);
+  }
+}
+
+
+// This must be called with "lock_" held.
+void LevelDB::AddContiguousSizeToBatch(int64_t previous, int64_t size,
+                                       leveldb::WriteBatch* batch) {
+  if (size != previous) {
+    batch->Put(string(kMetaPrefix) + kMetaContiguousSizeKey,
+               IndexToHex(size));
+  }
+}
+
+
+// This must be called with "lock_" held.
+int64_t LevelDB::ContiguousSizeWith(
+    const set<int64_t>& sequence_numbers) const {
+  int64_t size(contiguous_size_);
+  auto sparse(sparse_entries_.begin());
+  auto added(sequence_numbers.lower_bound(size));
+  while (true) {
+    if (sparse != sparse_entries_.end() && *sparse == size) {
+      ++sparse;
+    } else if (added != sequence_numbers.end() && *added == size) {
+      ++added;
+    } else {
+      return size;
+    }
+    ++size;
+  }
+}
+
+
+// This must be called with "lock_" held.
+void LevelDB::LoadHashFilter() {
+  if (!FLAGS_leveldb_hash_filter) {
+    return;
+  }
+  ScopedLatency latency(
+      latency_by_op_ms.GetScopedLatency("load_hash_filter"));
+  const int64_t num_entries(contiguous_size_ + sparse_entries_.size());
+
+  string data;
+  const leveldb::Status status(db_->Get(leveldb::ReadOptions(),
+                                        string(kMetaPrefix) +
+                                            kMetaHashFilterKey,
+                                        &data));
+  unique_ptr<HashFilter> filter;
+  int64_t written_size(0);
+  if (status.ok()) {
+    const size_t hex_size(sizeof(int64_t) * 2);
+    if (data.size() > hex_size) {
+      written_size = HexToIndex(leveldb::Slice(data.data(), hex_size));
+      filter = HashFilter::Parse(data.substr(hex_size));
+    }
+    LOG_IF(WARNING, !filter) << "Ignoring invalid hash filter";
+  } else {
+    CHECK(status.IsNotFound()) << "Failed to read hash filter: "
+                               << status.ToString();
+  }
+  // One that is already full is not worth catching up.
+  if (!filter || written_size > contiguous_size_ ||
+      filter->capacity() < num_entries) {
+    BuildHashFilter(2 * num_entries);
+    return;
+  }
+
+  // The entries up to |written_size| were all in the filter already.
+  leveldb::ReadOptions options;
+  options.fill_cache = false;
+  unique_ptr<leveldb::Iterator> it(db_->NewIterator(options));
+  CHECK(it);
+  int64_t num_added(0);
+  LoggedEntry logged;
+  for (it->Seek(IndexToKey(schema_version_, written_size));
+       it->Valid() && it->key().starts_with(kEntryPrefix); it->Next()) {
+    CHECK(ParseEntry(it->value(), &logged))
+        << "Failed to parse entry with sequence number "
+        << KeyToIndex(schema_version_, it->key());
+    filter->Add(logged.Hash());
+    ++num_added;
+  }
+  LOG(INFO) << "Loaded hash filter of " << filter->size() << " hashes, "
+            << num_added << " of them added since it was written";
+
+  hash_filter_memory_.Set(filter->ByteSize());
+  lock_guard<mutex> lock(hash_filter_lock_);
+  hash_filter_ = move(filter);
+  hash_filter_written_size_ = written_size;
+}
+
+
+// This must be called with "lock_" held.
+void LevelDB::BuildHashFilter(int64_t capacity) {
+  ScopedLatency latency(
+      latency_by_op_ms.GetScopedLatency("build_hash_filter"));
+  unique_ptr<HashFilter> filter(new HashFilter(capacity));
+
+  // The hash index has only the keys, which makes this a lot cheaper
+  // than going through the entries.
+  leveldb::ReadOptions options;
+  options.fill_cache = false;
+  unique_ptr<leveldb::Iterator> it(db_->NewIterator(options));
+  CHECK(it);
+  const size_t suffix_size(strlen(kHashPrefix) + SuffixSize(schema_version_));
+  for (it->Seek(kHashPrefix);
+       it->Valid() && it->key().starts_with(kHashPrefix); it->Next()) {
+    const leveldb::Slice key(it->key());
+    CHECK_GT(key.size(), suffix_size);
+    filter->Add(string(key.data() + strlen(kHashPrefix),
+                       key.size() - suffix_size));
+  }
+  LOG(INFO) << "Built hash filter of " << filter->size() << " hashes, for "
+            << filter->capacity();
+
+  hash_filter_memory_.Set(filter->ByteSize());
+  {
+    lock_guard<mutex> lock(hash_filter_lock_);
+    hash_filter_ = move(filter);
+  }
+  leveldb::WriteBatch batch;
+  AddHashFilterToBatch(true, &batch);
+  const leveldb::Status status(db_->Write(leveldb::WriteOptions(), &batch));
+  CHECK(status.ok()) << "Failed to write hash filter: " << status.ToString();
+}
+
+
+// This must be called with "lock_" held.
+void LevelDB::AddHashFilterToBatch(bool force, leveldb::WriteBatch* batch) {
+  if (!hash_filter_ ||
+      (!force && contiguous_size_ - hash_filter_written_size_ <
+                     FLAGS_leveldb_hash_filter_interval)) {
+    return;
+  }
+
+  // Entries past the contiguous size are in the filter as well, and
+  // get added again when it is loaded, which does no harm.
+  string data(IndexToHex(contiguous_size_));
+  {
+    lock_guard<mutex> lock(hash_filter_lock_);
+    string filter_data;
+    hash_filter_->Serialize(&filter_data);
+    data.append(filter_data);
+  }
+  batch->Put(string(kMetaPrefix) + kMetaHashFilterKey, data);
+  hash_filter_written_size_ = contiguous_size_;
+}
+
+
+// This must be called with "lock_" held, once the entries added to the
+// filter are written.
+void LevelDB::MaybeGrowHashFilter() {
+  if (hash_filter_ && hash_filter_->Full()) {
+    BuildHashFilter(2 * hash_filter_->capacity());
+  }
+}
+
+
+// This must be called with "lock_" held.
+void LevelDB::SerializeEntry(const LoggedEntry& logged, string* data,
+                             ChainCertMap* new_chain_certs) const {
+  if (!FLAGS_leveldb_deduplicate_chains) {
+    CHECK(logged.SerializeToString(data));
+    return;
+  }
+
+  LoggedEntry stored;
+  stored.CopyFrom(logged);
+  {
+    lock_guard<mutex> lock(chain_certs_lock_);
+    stored.ReplaceChainByDigests(
+        [this, new_chain_certs](const string& digest, const string& cert) {
+          if (chain_certs_.count(digest) == 0) {
+            new_chain_certs->emplace(digest, cert);
+          }
+        });
+  }
+  CHECK(stored.SerializeToString(data));
+}
+
+
+bool LevelDB::ParseEntry(const leveldb::Slice& data,
+                         LoggedEntry* logged) const {
+  if (!logged->ParseFromArray(data.data(), data.size())) {
+    return false;
+  }
+  lock_guard<mutex> lock(chain_certs_lock_);
+  return logged->ExpandChain([this](const string& digest, string* cert) {
+    const auto it(chain_certs_.find(digest));
+    if (it == chain_certs_.end()) {
+      return false;
+    }
+    *cert = it->second;
+    return true;
+  });
+}
+
+
+// This must be called with "lock_" held.
+bool LevelDB::SameEntry(const string& existing_data, const string& data,
+                        const LoggedEntry& logged) const {
+  if (existing_data == data) {
+    return true;
+  }
+  // It might have been stored with its chain deduplicated or not.
+  LoggedEntry existing;
+  CHECK(ParseEntry(existing_data, &existing));
+  return existing == logged;
+}
+
+
+// This must be called with "lock_" held.
+void LevelDB::AddChainCertsToBatch(const ChainCertMap& chain_certs,
+                                   leveldb::WriteBatch* batch) {
+  for (const auto& cert : chain_certs) {
+    batch->Put(kChainCertPrefix + cert.first, cert.second);
+  }
+}
+
+
+// This must be called with "lock_" held, once the certificates are
+// written.
+void LevelDB::InsertChainCerts(ChainCertMap* chain_certs) {
+  lock_guard<mutex> lock(chain_certs_lock_);
+  for (auto& cert : *chain_certs) {
+    chain_certs_[cert.first].swap(cert.second);
+  }
+}
+
+
+// This must be called with "lock_" held.
+void LevelDB::LoadChainCerts() {
+  leveldb::ReadOptions options;
+  options.fill_cache = false;
+  unique_ptr<leveldb::Iterator> it(db_->NewIterator(options));
+  CHECK(it);
+  lock_guard<mutex> lock(chain_certs_lock_);
+  for (it->Seek(kChainCertPrefix);
+       it->Valid() && it->key().starts_with(kChainCertPrefix); it->Next()) {
+    leveldb::Slice digest(it->key());
+    digest.remove_prefix(strlen(kChainCertPrefix));
+    chain_certs_[digest.ToString()] = it->value().ToString();
+  }
+  if (!chain_certs_.empty()) {
+    LOG(INFO) << "Loaded " << chain_certs_.size() << " chain certificates";
+  }
+}
+
+
+// This must be called with "lock_" held.
+void LevelDB::InsertEntryMapping(int64_t sequence_number) {
   if (sequence_number == contiguous_size_) {
     ++contiguous_size_;
     for (auto i = sparse_entries_.find(contiguous_size_);
@@ -3,21 +3,33 @@
 
 #include "config.h"
 
+#include <leveldb/cache.h>
 #include <leveldb/db.h>
 #ifdef HAVE_LEVELDB_FILTER_POLICY_H
 #include <leveldb/filter_policy.h>
 #endif
 #include <stdint.h>
+#include <condition_variable>
 #include <map>
 #include <memory>
 #include <mutex>
 #include <set>
+#include <string>
+#include <thread>
 #include <unordered_map>
 #include <vector>
 
 #include "log/database.h"
+#include "log/hash_filter.h"
+#include "merkletree/tree_hasher.h"
+#include "monitoring/memory_usage.h"
 #include "proto/ct.pb.h"
 
+namespace leveldb {
+class Slice;
+class WriteBatch;
+}  // namespace leveldb
+
 namespace cert_trans {
 
 
@@ -26,14 +38,23 @@ class LevelDB : public Database {
   static const size_t kTimestampBytesIndexed;
 
   explicit LevelDB(const std::string& dbfile);
-  ~LevelDB() = default;
+  ~LevelDB();
   LevelDB(const LevelDB&) = delete;
   LevelDB& operator=(const LevelDB&) = delete;
 
+  // Rewrites the keys of the database in |dbfile|, which must not be
+  // open, in the latest schema. This can take a while, and can be
+  // started again if interrupted, which the database cannot be opened
+  // until it is.
+  static void UpgradeSchema(const std::string& dbfile);
+
   // Implement abstract functions, see database.h for comments.
   Database::WriteResult CreateSequencedEntry_(
       const LoggedEntry& logged) override;
 
+  Database::WriteResult CreateSequencedEntries_(
+      const std::vector<LoggedEntry>& logged) override;
+
   Database::LookupResult LookupByHash(const std::string& hash,
                                       LoggedEntry* result) const override;
 
@@ -43,6 +64,9 @@ class LevelDB : public Database {
   std::unique_ptr<Database::Iterator> ScanEntries(
       int64_t start_index) const override;
 
+  size_t ReadLeafHashes(int64_t start_index, size_t max_entries,
+                        std::vector<std::string>* leaf_hashes) const override;
+
   Database::WriteResult WriteTreeHead_(const ct::SignedTreeHead& sth) override;
 
   Database::LookupResult LatestTreeHead(
@@ -60,13 +84,72 @@ class LevelDB : public Database {
 
   Database::LookupResult NodeId(std::string* node_id) override;
 
+  void WriteTreeFrontier(const ct::CompactTreeFrontier& frontier) override;
+
+  Database::LookupResult LatestTreeFrontier(
+      ct::CompactTreeFrontier* result) const override;
+
  private:
   class Iterator;
+  // Chain certificates, keyed by their SHA-256 digest.
+  typedef std::unordered_map<std::string, std::string> ChainCertMap;
 
+  // Reads the schema version of the database, or records
+  // --leveldb_schema_version if it is a new one.
+  void LoadSchemaVersion();
   void BuildIndex();
+  // Periodically exports the internal statistics of LevelDB as
+  // metrics, until the database is destroyed.
+  void ExportStats();
+  // Writes the hash index of databases created before it existed.
+  void BuildHashIndex();
   Database::LookupResult LatestTreeHeadNoLock(
       ct::SignedTreeHead* result) const;
-  void InsertEntryMapping(int64_t sequence_number, const std::string& hash);
+  // Adds |logged|, serialized as |data|, to |batch| along with its
+  // hash index entry and leaf hash. Its sequence number is only
+  // recorded as used, by InsertEntryMapping(), once |batch| is written.
+  void AddEntryToBatch(const LoggedEntry& logged, const std::string& data,
+                       leveldb::WriteBatch* batch);
+  // Adds the contiguous |size| to |batch|, if it changed from
+  // |previous|.
+  void AddContiguousSizeToBatch(int64_t previous, int64_t size,
+                                leveldb::WriteBatch* batch);
+  // The contiguous size once the entries |sequence_numbers|, which are
+  // not in the mapping yet, are added to it.
+  int64_t ContiguousSizeWith(const std::set<int64_t>& sequence_numbers) const;
+  // Loads the hash filter written by AddHashFilterToBatch(), adding
+  // the entries written since, or builds it if there is none.
+  void LoadHashFilter();
+  // Builds a hash filter for |capacity| hashes from the hash index, and
+  // writes it.
+  void BuildHashFilter(int64_t capacity);
+  // Adds the hash filter to |batch|, if --leveldb_hash_filter_interval
+  // entries were added since it last was, or if |force|.
+  void AddHashFilterToBatch(bool force, leveldb::WriteBatch* batch);
+  // Builds a bigger hash filter once this one has as many hashes as it
+  // was sized for.
+  void MaybeGrowHashFilter();
+  void InsertEntryMapping(int64_t sequence_number);
+  // Serializes |logged| into |data| the way it is stored. With
+  // --leveldb_deduplicate_chains, the certificates of its chain are
+  // replaced by their digest, and those not stored yet are added to
+  // |new_chain_certs|.
+  void SerializeEntry(const LoggedEntry& logged, std::string* data,
+                      ChainCertMap* new_chain_certs) const;
+  // Parses an entry stored by SerializeEntry(), expanding its chain.
+  bool ParseEntry(const leveldb::Slice& data, LoggedEntry* logged) const;
+  // Whether the stored |existing_data| is the same entry as |logged|,
+  // serialized as |data|, whichever way it was stored.
+  bool SameEntry(const std::string& existing_data, const std::string& data,
+                 const LoggedEntry& logged) const;
+  void AddChainCertsToBatch(const ChainCertMap& chain_certs,
+                            leveldb::WriteBatch* batch);
+  // Makes |chain_certs|, which have been written, available to
+  // ParseEntry(). Their values are taken.
+  void InsertChainCerts(ChainCertMap* chain_certs);
+  void LoadChainCerts();
+  // Whether an entry with this sequence number has been written.
+  bool HaveEntry(int64_t sequence_number) const;
 
   mutable std::mutex lock_;
 #ifdef HAVE_LEVELDB_FILTER_POLICY_H
@@ -74,19 +157,53 @@ class LevelDB : public Database {
   // keep this order.
   const std::unique_ptr<const leveldb::FilterPolicy> filter_policy_;
 #endif
+  // Shared by all the tables, so must also outlive db_.
+  const std::unique_ptr<leveldb::Cache> block_cache_;
   std::unique_ptr<leveldb::DB> db_;
+  // How the keys are laid out, see LoadSchemaVersion().
+  int schema_version_;
 
+  // Hashes the leaves stored with --leveldb_store_leaf_hashes.
+  const TreeHasher leaf_hasher_;
+
+  // Entries are looked up by hash using an index stored alongside
+  // them, so only the shape of the log is kept in memory. The
+  // contiguous size is also stored, so that opening the database only
+  // has to look at the entries beyond it.
   int64_t contiguous_size_;
-  std::unordered_map<std::string, int64_t> id_by_hash_;
+
+  // Answers most lookups of hashes that are not in the database, such
+  // as those of new submissions, without reading it. Only replaced with
+  // lock_ held, and only changed with both locks held, so writers need
+  // only lock_ to read it.
+  mutable std::mutex hash_filter_lock_;
+  std::unique_ptr<HashFilter> hash_filter_;
+  // The contiguous size as of when |hash_filter_| was last written.
+  int64_t hash_filter_written_size_;
+  MemoryUsage hash_filter_memory_;
 
   // This is a mapping of the non-contiguous entries of the log (which
   // can happen while it is being fetched). When entries here become
   // contiguous with the beginning of the tree, they are removed.
   std::set<int64_t> sparse_entries_;
 
+  // The chain certificates are those of the CAs, which are few and
+  // shared by many entries, so they are all kept in memory.
+  mutable std::mutex chain_certs_lock_;
+  ChainCertMap chain_certs_;
+
   uint64_t latest_tree_timestamp_;
   std::string latest_timestamp_key_;
   cert_trans::DatabaseNotifierHelper callbacks_;
+
+  // Of leveldb itself, including the block cache, as of the last time
+  // the stats thread looked.
+  MemoryUsage memory_;
+
+  std::mutex stats_lock_;
+  std::condition_variable stats_cv_;
+  bool exiting_;
+  std::thread stats_thread_;
 };
 
 
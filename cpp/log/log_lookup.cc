@@ -1,122 +1,892 @@
 #include "log/log_lookup.h"
 
+#include <errno.h>
+#include <fcntl.h>
+#include <gflags/gflags.h>
 #include <glog/logging.h>
 #include <stdint.h>
+#include <stdio.h>
 #include <stdlib.h>
+#include <unistd.h>
+#include <algorithm>
+#include <chrono>
+#include <fstream>
 #include <map>
+#include <set>
 #include <string>
 #include <utility>
 #include <vector>
 
 #include "base/time_support.h"
 #include "merkletree/merkle_tree.h"
+#include "merkletree/node_store.h"
 #include "merkletree/serial_hasher.h"
 #include "proto/ct.pb.h"
 #include "proto/serializer.h"
+#include "util/async_log.h"
 #include "util/util.h"
 
 using ct::MerkleAuditProof;
 using ct::ShortMerkleAuditProof;
 using ct::SignedTreeHead;
 using std::bind;
+using std::chrono::milliseconds;
+using std::ifstream;
 using std::lock_guard;
 using std::make_pair;
 using std::map;
+using std::max;
+using std::min;
+using std::move;
 using std::mutex;
+using std::pair;
 using std::placeholders::_1;
+using std::set;
+using std::shared_ptr;
 using std::string;
+using std::thread;
 using std::unique_lock;
 using std::unique_ptr;
 using std::vector;
 using util::HexString;
 
+DEFINE_int64(log_lookup_checkpoint_interval_entries, 1000000,
+             "Minimum number of new entries between two checkpoints of the "
+             "in-memory Merkle tree, when checkpointing is enabled. Each one "
+             "copies the tree, taking as much memory again while it is "
+             "written.");
+DEFINE_string(log_lookup_tree_dir, "",
+              "If set, keep the Merkle tree, and the leaf index, in "
+              "memory-mapped files in this directory instead of on the "
+              "heap. The tree is picked up again from there on restart, "
+              "and other processes can share it with "
+              "--log_lookup_shared_tree_dir.");
+DEFINE_string(log_lookup_shared_tree_dir, "",
+              "If set, do not build the Merkle tree from the database, but "
+              "map read-only the one another process keeps with "
+              "--log_lookup_tree_dir in this directory, and follow the "
+              "STHs it publishes. Cannot be combined with the other ways "
+              "of keeping the tree.");
+DEFINE_int32(log_lookup_shared_refresh_ms, 1000,
+             "How often to check for a new STH in "
+             "--log_lookup_shared_tree_dir, in milliseconds.");
+DEFINE_string(log_lookup_tile_dir, "",
+              "If set, keep the Merkle tree on disk in tiles in this "
+              "directory, for trees that do not fit in memory. Cannot be "
+              "combined with --log_lookup_tree_dir or checkpointing.");
+DEFINE_int32(log_lookup_tile_cache_size, 4096,
+             "Number of Merkle tree tiles read from --log_lookup_tile_dir "
+             "that are kept in memory.");
+DEFINE_int32(log_lookup_proof_cache_size, 100000,
+             "Maximum number of audit paths, and of consistency proofs, "
+             "kept in memory. They are dropped whenever a new STH "
+             "arrives.");
+DEFINE_int32(log_lookup_precomputed_audit_paths, 1000,
+             "Number of entries, counting from the end of the tree, whose "
+             "audit paths are computed as soon as a new STH arrives.");
+DEFINE_int32(log_lookup_cached_snapshots, 10000,
+             "Number of past STHs whose tree size is kept cached in the "
+             "Merkle tree, so that roots and proofs at these sizes need no "
+             "rehashing.");
+DEFINE_int32(log_lookup_precomputed_consistency_proofs, 8,
+             "Number of previous STHs from which a consistency proof to a "
+             "new STH is computed as soon as it arrives.");
+
 namespace cert_trans {
 
 
 static const int kCtimeBufSize = 26;
 
 
-LogLookup::LogLookup(ReadOnlyDatabase* db)
+namespace {
+
+
+// Checkpoint file layout, all integers big-endian:
+//   magic (8 bytes), format version (uint32), node size (uint64),
+//   level count (uint64), then for each level, leaves first:
+//   length in bytes (uint64) followed by the packed node hashes,
+//   and finally the SHA-256 of everything before it.
+const char kCheckpointMagic[] = "CTLOOKUP";
+const size_t kCheckpointMagicSize = 8;
+const uint32_t kCheckpointVersion = 1;
+
+// Number of entries read from the database at a time when updating
+// the tree.
+const int64_t kScanBatchSize = 1000;
+
+
+void AppendUint(uint64_t value, size_t bytes, string* out) {
+  for (size_t i = bytes; i > 0; --i)
+    out->push_back(static_cast<char>((value >> ((i - 1) * 8)) & 0xff));
+}
+
+
+bool WriteFully(int fd, const string& data) {
+  size_t written(0);
+  while (written < data.size()) {
+    const ssize_t num_written(
+        write(fd, data.data() + written, data.size() - written));
+    if (num_written < 0 && errno != EINTR) {
+      return false;
+    }
+    if (num_written > 0) {
+      written += num_written;
+    }
+  }
+  return true;
+}
+
+
+bool SyncDirectoryOf(const string& path) {
+  const string::size_type slash(path.rfind('/'));
+  const string dir(slash == string::npos ? "." : path.substr(0, slash + 1));
+  const int fd(open(dir.c_str(), O_RDONLY | O_DIRECTORY));
+  if (fd < 0) {
+    return false;
+  }
+  const bool synced(fsync(fd) == 0);
+  close(fd);
+  return synced;
+}
+
+
+bool ReadUint(ifstream* in, size_t bytes, uint64_t* value, Sha256Hasher* sha) {
+  string buf(bytes, '\0');
+  if (!in->read(&buf[0], bytes))
+    return false;
+  sha->Update(buf);
+  *value = 0;
+  for (size_t i = 0; i < bytes; ++i)
+    *value = (*value << 8) | static_cast<unsigned char>(buf[i]);
+  return true;
+}
+
+
+// The store for the tree, if it is kept in memory-mapped files.
+MmapNodeStore* NewMmapNodeStore() {
+  const size_t node_size(Sha256Hasher().DigestSize());
+  if (!FLAGS_log_lookup_shared_tree_dir.empty()) {
+    return MmapNodeStore::OpenReadOnly(FLAGS_log_lookup_shared_tree_dir,
+                                       node_size).release();
+  }
+  if (!FLAGS_log_lookup_tree_dir.empty()) {
+    return new MmapNodeStore(FLAGS_log_lookup_tree_dir, node_size);
+  }
+  return nullptr;
+}
+
+
+// Approximate number of bytes taken up by |proofs|, a map to the nodes
+// of each proof.
+template <class ProofMap>
+int64_t ProofsByteSize(const ProofMap& proofs) {
+  int64_t bytes(0);
+  for (const auto& proof : proofs) {
+    bytes += sizeof(proof) + proof.second.capacity() * sizeof(string);
+    for (const string& node : proof.second)
+      bytes += node.capacity();
+  }
+  return bytes;
+}
+
+
+// Returns |mmap_nodes| if it is set, or a new in-memory store otherwise.
+unique_ptr<MerkleTreeNodeStore> NewNodeStore(MmapNodeStore* mmap_nodes) {
+  if (mmap_nodes)
+    return unique_ptr<MerkleTreeNodeStore>(mmap_nodes);
+  return unique_ptr<MerkleTreeNodeStore>(
+      new InMemoryNodeStore(Sha256Hasher().DigestSize()));
+}
+
+
+// What the tree in --log_lookup_tree_dir is published with, for the
+// processes sharing it: the file name of the leaf index and its size,
+// on one line, followed by the serialized STH the tree is at.
+string SharedTreeAnnotation(const SignedTreeHead& sth,
+                            const string& index_path, size_t index_size) {
+  string sth_data;
+  CHECK(sth.SerializeToString(&sth_data));
+  return index_path.substr(index_path.rfind('/') + 1) + " " +
+         std::to_string(index_size) + "\n" + sth_data;
+}
+
+
+bool ParseSharedTreeAnnotation(const string& annotation, SignedTreeHead* sth,
+                               string* index_file, size_t* index_size) {
+  const size_t space(annotation.find(' '));
+  const size_t newline(annotation.find('\n'));
+  if (space == string::npos || newline == string::npos || newline < space)
+    return false;
+  *index_file = annotation.substr(0, space);
+  const string size(annotation.substr(space + 1, newline - space - 1));
+  char* end;
+  *index_size = strtoull(size.c_str(), &end, 10);
+  return !index_file->empty() && index_file->find('/') == string::npos &&
+         !size.empty() && *end == '\0' &&
+         sth->ParseFromString(annotation.substr(newline + 1));
+}
+
+
+}  // namespace
+
+
+LogLookup::LogLookup(ReadOnlyDatabase* db) : LogLookup(db, "") {
+}
+
+
+LogLookup::LogLookup(ReadOnlyDatabase* db, const string& checkpoint_file)
     : db_(CHECK_NOTNULL(db)),
-      cert_tree_(unique_ptr<Sha256Hasher>(new Sha256Hasher)),
-      latest_tree_head_(),
+      shared_tree_dir_(FLAGS_log_lookup_shared_tree_dir),
+      mmap_nodes_(NewMmapNodeStore()),
+      cert_tree_(unique_ptr<Sha256Hasher>(new Sha256Hasher),
+                 NewNodeStore(mmap_nodes_)),
+      tiled_tree_(FLAGS_log_lookup_tile_dir.empty()
+                      ? nullptr
+                      : new TiledMerkleTree(
+                            unique_ptr<Sha256Hasher>(new Sha256Hasher),
+                            FLAGS_log_lookup_tile_dir,
+                            max(0, FLAGS_log_lookup_tile_cache_size))),
+      leaf_index_(bind(&LogLookup::TreeLeafHash, this, _1),
+                  FLAGS_log_lookup_tree_dir),
+      snapshot_(std::make_shared<Snapshot>()),
+      tree_memory_("merkle_tree"),
+      leaf_index_memory_("leaf_index"),
+      proofs_memory_("precomputed_proofs"),
+      checkpoint_file_(checkpoint_file),
+      checkpoint_tree_size_(0),
+      checkpoint_pending_(false),
+      checkpoint_exiting_(false),
+      exiting_(false),
       update_from_sth_cb_(bind(&LogLookup::UpdateFromSTH, this, _1)) {
+  CHECK(!tiled_tree_ || (!mmap_nodes_ && checkpoint_file_.empty()))
+      << "--log_lookup_tile_dir cannot be combined with "
+      << "--log_lookup_tree_dir or a checkpoint file";
+  if (!shared_tree_dir_.empty()) {
+    CHECK(FLAGS_log_lookup_tree_dir.empty() && !tiled_tree_ &&
+          checkpoint_file_.empty())
+        << "--log_lookup_shared_tree_dir cannot be combined with "
+        << "--log_lookup_tree_dir, --log_lookup_tile_dir or a checkpoint "
+        << "file";
+    // The process keeping the tree follows the database instead.
+    RefreshSharedTree();
+    refresh_thread_ = thread(bind(&LogLookup::FollowSharedTree, this));
+    return;
+  }
+  if (TreeSize() > 0) {
+    LoadStoredTree(tiled_tree_ ? FLAGS_log_lookup_tile_dir
+                               : FLAGS_log_lookup_tree_dir);
+  } else if (!checkpoint_file_.empty()) {
+    LoadCheckpoint();
+  }
+  // Lookups count on the tree being fully evaluated, so that they can
+  // run in parallel without modifying it.
+  cert_tree_.CurrentRoot();
+  if (!checkpoint_file_.empty()) {
+    checkpoint_thread_ = thread(bind(&LogLookup::WriteCheckpoints, this));
+  }
   db_->AddNotifySTHCallback(&update_from_sth_cb_);
 }
 
 
 LogLookup::~LogLookup() {
-  db_->RemoveNotifySTHCallback(&update_from_sth_cb_);
+  if (shared_tree_dir_.empty()) {
+    db_->RemoveNotifySTHCallback(&update_from_sth_cb_);
+    if (checkpoint_thread_.joinable()) {
+      // A checkpoint already asked for is written first.
+      {
+        lock_guard<mutex> lock(checkpoint_lock_);
+        checkpoint_exiting_ = true;
+      }
+      checkpoint_cv_.notify_all();
+      checkpoint_thread_.join();
+    }
+    return;
+  }
+  {
+    lock_guard<mutex> lock(refresh_lock_);
+    exiting_ = true;
+  }
+  refresh_cv_.notify_all();
+  refresh_thread_.join();
+}
+
+
+void LogLookup::AddNotifySTHCallback(
+    const Database::NotifySTHCallback* callback) {
+  lock_guard<mutex> lock(notify_lock_);
+  notify_callbacks_.Add(callback);
+}
+
+
+void LogLookup::RemoveNotifySTHCallback(
+    const Database::NotifySTHCallback* callback) {
+  lock_guard<mutex> lock(notify_lock_);
+  notify_callbacks_.Remove(callback);
 }
 
 
 void LogLookup::UpdateFromSTH(const SignedTreeHead& sth) {
-  lock_guard<mutex> lock(lock_);
+  lock_guard<mutex> update_lock(update_lock_);
+  const shared_ptr<const Snapshot> current(CurrentSnapshot());
+  const SignedTreeHead& latest(current->sth);
 
   CHECK_EQ(ct::V1, sth.version())
       << "Tree head signed with an unknown version";
 
-  if (sth.timestamp() == latest_tree_head_.timestamp())
+  if (sth.timestamp() == latest.timestamp())
     return;
 
   CHECK_LE(0, sth.tree_size());
-  if (sth.timestamp() <= latest_tree_head_.timestamp() ||
-      static_cast<uint64_t>(sth.tree_size()) < cert_tree_.LeafCount()) {
-    LOG(WARNING) << "Database replied with an STH that is older than ours: "
-                 << "Our STH:\n" << latest_tree_head_.DebugString()
-                 << "Database STH:\n" << sth.DebugString();
+  if (sth.timestamp() <= latest.timestamp() ||
+      static_cast<uint64_t>(sth.tree_size()) < TreeSize()) {
+    LOG_RATE_LIMITED(WARNING, 1)
+        << "Database replied with an STH that is older than ours: "
+        << "Our STH:\n" << latest.DebugString() << "Database STH:\n"
+        << sth.DebugString();
     return;
   }
 
-  // Record the new hashes: append all of them, die on any error.
-  // TODO(ekasper): make tree signer write leaves out to the database,
-  // so that we don't have to read the entries in.
-  string leaf_hash;
-  auto it(db_->ScanEntries(cert_tree_.LeafCount()));
+  // Read the hashes of the new leaves first. Nothing else modifies
+  // the tree, so this does not need |lock_|, and lookups can go on.
+  const int64_t first_new(TreeSize());
   // LeafCount() is potentially unsigned here but as this is using memory
   // the count can never get close to overflow in 64 bits.
-  CHECK_LE(cert_tree_.LeafCount(), static_cast<uint64_t>(INT64_MAX));
-
-  for (int64_t sequence_number = cert_tree_.LeafCount();
-       sequence_number < sth.tree_size(); ++sequence_number) {
-    LoggedEntry logged;
-    // TODO(ekasper): perhaps some of these errors can/should be
-    // handled more gracefully. E.g. we could retry a failed update
-    // a number of times -- but until we know under which conditions
-    // the database might fail (database busy?), just die.
-    CHECK(it->GetNextEntry(&logged))
-        << "Latest STH has " << sth.tree_size() << "entries but we failed to "
-        << "retrieve entry number " << sequence_number;
-    CHECK(logged.has_sequence_number())
-        << "Logged entry has no sequence number";
-    CHECK_EQ(sequence_number, logged.sequence_number());
-
-    leaf_hash = LeafHash(logged);
-    // TODO(ekasper): plug in the log public key so that we can verify the STH.
-    CHECK_EQ(static_cast<size_t>(sequence_number + 1),
-             cert_tree_.AddLeafHash(leaf_hash));
-    // Duplicate leaves shouldn't really happen but are not a problem either:
-    // we just return the Merkle proof of the first occurrence.
-    leaf_index_.insert(make_pair(leaf_hash, sequence_number));
-  }
-  CHECK_EQ(HexString(cert_tree_.CurrentRoot()),
-           HexString(sth.sha256_root_hash()))
-      << "Computed root hash and stored STH root hash do not match";
-  LOG(INFO) << "Found " << sth.tree_size() - latest_tree_head_.tree_size()
+  CHECK_LE(TreeSize(), static_cast<uint64_t>(INT64_MAX));
+
+  vector<string> leaf_hashes;
+  // TODO(ekasper): perhaps some of these errors can/should be
+  // handled more gracefully. E.g. we could retry a failed update
+  // a number of times -- but until we know under which conditions
+  // the database might fail (database busy?), just die.
+  CHECK(ReadLeafHashes(first_new, sth.tree_size(), &leaf_hashes))
+      << "Latest STH has " << sth.tree_size() << " entries but we failed "
+      << "to retrieve them all";
+
+  // Stage the new nodes of the tree, and a bigger copy of the index if
+  // it has to grow, still without |lock_|: both only read what the
+  // lookups read, so that only copying them in below holds them up.
+  MerkleTree::StagedLeaves staged;
+  if (!tiled_tree_) {
+    staged = cert_tree_.StageLeafHashes(leaf_hashes);
+  }
+  unique_ptr<LeafIndex> grown_index;
+  const size_t index_size(leaf_index_.size() + leaf_hashes.size());
+  if (!leaf_index_.HasRoomFor(index_size)) {
+    grown_index.reset(new LeafIndex(bind(&LogLookup::TreeLeafHash, this, _1),
+                                    leaf_index_.dir()));
+    grown_index->CopyFrom(leaf_index_, index_size);
+  }
+
+  // Record the new hashes: append all of them, die on any error.
+  {
+    lock_guard<ReadWriteLock> lock(lock_);
+    if (grown_index) {
+      // The old one goes away with |grown_index|, once the lock is
+      // released.
+      leaf_index_.Swap(grown_index.get());
+    }
+    if (tiled_tree_) {
+      for (const string& leaf_hash : leaf_hashes) {
+        tiled_tree_->AddLeafHash(leaf_hash);
+      }
+    } else {
+      cert_tree_.AppendStaged(staged);
+    }
+    CHECK_EQ(static_cast<size_t>(sth.tree_size()), TreeSize());
+    for (size_t i = 0; i < leaf_hashes.size(); ++i) {
+      // Duplicate leaves shouldn't really happen but are not a problem
+      // either: we just return the Merkle proof of the first occurrence.
+      leaf_index_.Insert(leaf_hashes[i], first_new + i);
+    }
+    // TODO(ekasper): plug in the log public key so that we can verify
+    // the STH.
+    CHECK_EQ(HexString(TreeRoot(TreeSize())),
+             HexString(sth.sha256_root_hash()))
+        << "Computed root hash and stored STH root hash do not match";
+    CacheSnapshot(sth.tree_size());
+  }
+  LOG(INFO) << "Found " << sth.tree_size() - latest.tree_size()
             << " new log entries";
-  latest_tree_head_.CopyFrom(sth);
 
-  const time_t last_update(static_cast<time_t>(latest_tree_head_.timestamp() /
-                                               kNumMillisPerSecond));
+  if (!checkpoint_file_.empty()) {
+    // Updates that come while one is written do not ask for another.
+    lock_guard<mutex> lock(checkpoint_lock_);
+    if (!checkpoint_pending_ &&
+        sth.tree_size() - checkpoint_tree_size_ >=
+            FLAGS_log_lookup_checkpoint_interval_entries) {
+      checkpoint_pending_ = true;
+      checkpoint_cv_.notify_all();
+    }
+  }
+
+  {
+    ReaderLock lock(&lock_);
+    if (mmap_nodes_) {
+      // The stored levels are up to date, as the tree is fully
+      // evaluated, so that a restart does not have to rehash anything,
+      // and the processes sharing the tree can move on to |sth|.
+      const string index_path(leaf_index_.Sync());
+      mmap_nodes_->Sync(
+          SharedTreeAnnotation(sth, index_path, leaf_index_.size()));
+    }
+    if (tiled_tree_) {
+      tiled_tree_->Sync();
+    }
+  }
+
+  PublishSnapshot(sth, current);
+}
+
+
+void LogLookup::FollowSharedTree() {
+  const milliseconds interval(max(1, FLAGS_log_lookup_shared_refresh_ms));
+  unique_lock<mutex> lock(refresh_lock_);
+  while (!refresh_cv_.wait_for(lock, interval,
+                               [this]() { return exiting_; })) {
+    lock.unlock();
+    RefreshSharedTree();
+    lock.lock();
+  }
+}
+
+
+void LogLookup::RefreshSharedTree() {
+  lock_guard<mutex> update_lock(update_lock_);
+  const shared_ptr<const Snapshot> current(CurrentSnapshot());
+  SignedTreeHead sth;
+  {
+    lock_guard<ReadWriteLock> lock(lock_);
+    // The tree follows the store even if the rest fails below: it only
+    // ever grows, so the current snapshot is still served right.
+    mmap_nodes_->Refresh();
+    CHECK(cert_tree_.ReloadNodes()) << "The tree in " << shared_tree_dir_
+                                    << " is corrupt";
+    if (mmap_nodes_->annotation() == shared_annotation_)
+      return;
+
+    string index_file;
+    size_t index_size;
+    if (!ParseSharedTreeAnnotation(mmap_nodes_->annotation(), &sth,
+                                   &index_file, &index_size) ||
+        index_size > TreeSize()) {
+      LOG(WARNING) << "Cannot make sense of the tree published in "
+                   << shared_tree_dir_;
+      return;
+    }
+    // The index file is replaced when it grows, this one may already
+    // be gone if so: the next version will have the new one.
+    if (!leaf_index_.MapShared(shared_tree_dir_ + "/" + index_file,
+                               index_size)) {
+      return;
+    }
+    shared_annotation_ = mmap_nodes_->annotation();
+
+    CHECK_EQ(static_cast<size_t>(sth.tree_size()), TreeSize());
+    CHECK_EQ(HexString(TreeRoot(TreeSize())),
+             HexString(sth.sha256_root_hash()))
+        << "Computed root hash and shared STH root hash do not match";
+    CacheSnapshot(sth.tree_size());
+  }
+  if (sth.timestamp() <= current->sth.timestamp())
+    return;
+  LOG(INFO) << "Found " << sth.tree_size() - current->sth.tree_size()
+            << " new log entries in " << shared_tree_dir_;
+
+  PublishSnapshot(sth, current);
+}
+
+
+void LogLookup::CacheSnapshot(int64_t tree_size) {
+  if (tiled_tree_ || FLAGS_log_lookup_cached_snapshots <= 0 ||
+      tree_size == 0 ||
+      (!cached_snapshots_.empty() && cached_snapshots_.back() == tree_size))
+    return;
+
+  cert_tree_.CacheSnapshot(tree_size);
+  cached_snapshots_.push_back(tree_size);
+  while (cached_snapshots_.size() >
+         static_cast<size_t>(FLAGS_log_lookup_cached_snapshots)) {
+    cert_tree_.UncacheSnapshot(cached_snapshots_.front());
+    cached_snapshots_.pop_front();
+  }
+}
+
+
+void LogLookup::PublishSnapshot(const SignedTreeHead& sth,
+                                const shared_ptr<const Snapshot>& current) {
+  const SignedTreeHead& latest(current->sth);
+  const bool has_previous(latest.has_timestamp());
+  const bool grew(!has_previous || latest.tree_size() != sth.tree_size());
+  if (grew && has_previous && latest.tree_size() > 0) {
+    previous_tree_sizes_.push_front(latest.tree_size());
+    while (previous_tree_sizes_.size() >
+           static_cast<size_t>(
+               max(0, FLAGS_log_lookup_precomputed_consistency_proofs))) {
+      previous_tree_sizes_.pop_back();
+    }
+  }
+
+  unique_ptr<Snapshot> snapshot(new Snapshot);
+  snapshot->sth.CopyFrom(sth);
+  {
+    ReaderLock lock(&lock_);
+    if (grew) {
+      PrecomputeProofs(snapshot.get());
+    } else {
+      snapshot->audit_paths = current->audit_paths;
+      snapshot->consistency_proofs = current->consistency_proofs;
+    }
+    if (!grew && current->tree) {
+      snapshot->tree = current->tree;
+    } else if (static_cast<int64_t>(TreeSize()) == sth.tree_size()) {
+      snapshot->tree = CompactTreeLocked(
+          unique_ptr<SerialHasher>(new Sha256Hasher))->TakeSnapshot();
+    }
+    tree_memory_.Set(cert_tree_.ByteSize());
+    leaf_index_memory_.Set(leaf_index_.ByteSize());
+  }
+  proofs_memory_.Set(ProofsByteSize(snapshot->audit_paths) +
+                     ProofsByteSize(snapshot->consistency_proofs));
+
+  if (grew) {
+    lock_guard<mutex> cache_lock(cache_lock_);
+    audit_paths_.clear();
+    consistency_proofs_.clear();
+  }
+  std::atomic_store(&snapshot_, shared_ptr<const Snapshot>(move(snapshot)));
+  {
+    lock_guard<mutex> notify_lock(notify_lock_);
+    notify_callbacks_.Call(sth);
+  }
+
+  const time_t last_update(
+      static_cast<time_t>(sth.timestamp() / kNumMillisPerSecond));
   char buf[kCtimeBufSize];
   LOG(INFO) << "Tree successfully updated at " << ctime_r(&last_update, buf);
 }
 
 
+void LogLookup::PrecomputeProofs(Snapshot* snapshot) {
+  const int64_t tree_size(snapshot->sth.tree_size());
+  for (int64_t i = max<int64_t>(
+           0, tree_size - FLAGS_log_lookup_precomputed_audit_paths);
+       i < tree_size; ++i) {
+    snapshot->audit_paths[make_pair(i, tree_size)] =
+        TreePath(i, tree_size);
+  }
+  for (const int64_t first : previous_tree_sizes_) {
+    snapshot->consistency_proofs[make_pair(first, tree_size)] =
+        TreeConsistency(first, tree_size);
+  }
+  VLOG(1) << "Precomputed " << snapshot->audit_paths.size()
+          << " audit paths and " << snapshot->consistency_proofs.size()
+          << " consistency proofs for tree size " << tree_size;
+}
+
+
+bool LogLookup::FindProof(const ProofCache& published,
+                          const ProofCache& cached,
+                          const pair<int64_t, int64_t>& key,
+                          vector<string>* proof) const {
+  auto it(published.find(key));
+  if (it != published.end()) {
+    *proof = it->second;
+    return true;
+  }
+
+  lock_guard<mutex> lock(cache_lock_);
+  it = cached.find(key);
+  if (it == cached.end())
+    return false;
+  *proof = it->second;
+  return true;
+}
+
+
+void LogLookup::CacheProof(ProofCache* cache,
+                           const pair<int64_t, int64_t>& key,
+                           const vector<string>& proof) {
+  lock_guard<mutex> lock(cache_lock_);
+  // Keep it simple: start over when full, the next STH would clear it
+  // anyway.
+  if (cache->size() >=
+      static_cast<size_t>(max(0, FLAGS_log_lookup_proof_cache_size)))
+    cache->clear();
+  if (FLAGS_log_lookup_proof_cache_size > 0)
+    (*cache)[key] = proof;
+}
+
+
+bool LogLookup::ReadLeafHashes(int64_t first, int64_t tree_size,
+                               vector<string>* leaf_hashes) const {
+  // The database might have the leaf hashes of some or all of the
+  // entries, which saves reading and hashing those.
+  leaf_hashes->clear();
+  leaf_hashes->reserve(tree_size - first);
+  vector<string> stored_hashes;
+  int64_t sequence_number(first);
+  while (sequence_number < tree_size) {
+    const int64_t wanted(min(kScanBatchSize, tree_size - sequence_number));
+    db_->ReadLeafHashes(sequence_number, wanted, &stored_hashes);
+    for (string& hash : stored_hashes) {
+      leaf_hashes->emplace_back(move(hash));
+    }
+    sequence_number += stored_hashes.size();
+    if (static_cast<int64_t>(stored_hashes.size()) < wanted) {
+      break;
+    }
+  }
+
+  auto it(db_->ScanEntries(sequence_number));
+  vector<LoggedEntry> batch;
+  while (sequence_number < tree_size) {
+    const int64_t wanted(min(kScanBatchSize, tree_size - sequence_number));
+    if (it->GetNextEntries(wanted, &batch) == 0) {
+      LOG(WARNING) << "Failed to retrieve entry number " << sequence_number;
+      return false;
+    }
+
+    for (const LoggedEntry& logged : batch) {
+      CHECK(logged.has_sequence_number())
+          << "Logged entry has no sequence number";
+      CHECK_EQ(sequence_number, logged.sequence_number());
+      leaf_hashes->push_back(LeafHash(logged));
+      ++sequence_number;
+    }
+  }
+  return true;
+}
+
+
+bool LogLookup::MatchesDatabase(const string& source) {
+  const int64_t tree_size(TreeSize());
+  if (tree_size == 0) {
+    return true;
+  }
+  SignedTreeHead db_sth;
+  if (db_->LatestTreeHead(&db_sth) != ReadOnlyDatabase::LOOKUP_OK) {
+    LOG(WARNING) << "Ignoring the tree in " << source
+                 << ": the database has no tree head";
+    return false;
+  }
+  if (db_sth.tree_size() < tree_size) {
+    LOG(WARNING) << "Ignoring the tree in " << source
+                 << ": it is ahead of the database";
+    return false;
+  }
+
+  // The root at the size of the tree head commits to every leaf, those
+  // of the tree included, so that is all there is to compare. The new
+  // leaves go on a copy, to leave them to UpdateFromSTH().
+  unique_ptr<CompactMerkleTree> tree;
+  {
+    ReaderLock lock(&lock_);
+    tree = CompactTreeLocked(unique_ptr<SerialHasher>(new Sha256Hasher));
+  }
+  vector<string> leaf_hashes;
+  if (!ReadLeafHashes(tree_size, db_sth.tree_size(), &leaf_hashes)) {
+    LOG(WARNING) << "Ignoring the tree in " << source
+                 << ": the database is missing entries";
+    return false;
+  }
+  for (const string& leaf_hash : leaf_hashes) {
+    tree->AddLeafHash(leaf_hash);
+  }
+  if (tree->CurrentRoot() != db_sth.sha256_root_hash()) {
+    LOG(WARNING) << "Ignoring the tree in " << source
+                 << ": it does not match the tree head of the database";
+    return false;
+  }
+  return true;
+}
+
+
+void LogLookup::LoadStoredTree(const string& dir) {
+  if (!MatchesDatabase(dir)) {
+    // Start over from the database instead.
+    if (tiled_tree_) {
+      tiled_tree_->Clear();
+    } else {
+      vector<string> no_levels;
+      CHECK(cert_tree_.RestoreLevels(&no_levels));
+    }
+    return;
+  }
+
+  const int64_t tree_size(TreeSize());
+  leaf_index_.Reserve(tree_size);
+  for (int64_t i = 0; i < tree_size; ++i)
+    leaf_index_.Insert(TreeLeafHash(i), i);
+  checkpoint_tree_size_ = tree_size;
+
+  LOG(INFO) << "Loaded " << tree_size << " entries from " << dir;
+}
+
+
+void LogLookup::LoadCheckpoint() {
+  ifstream in(checkpoint_file_.c_str(), std::ios::in | std::ios::binary);
+  if (!in.good()) {
+    LOG(INFO) << "No checkpoint found at " << checkpoint_file_
+              << ", building tree from the database";
+    return;
+  }
+  in.seekg(0, std::ios::end);
+  const uint64_t file_size(in.tellg());
+  in.seekg(0, std::ios::beg);
+
+  Sha256Hasher sha;
+  sha.Reset();
+  string magic(kCheckpointMagicSize, '\0');
+  uint64_t version, node_size, level_count;
+  if (!in.read(&magic[0], kCheckpointMagicSize) ||
+      magic != string(kCheckpointMagic, kCheckpointMagicSize)) {
+    LOG(WARNING) << "Ignoring checkpoint " << checkpoint_file_
+                 << ": bad header";
+    return;
+  }
+  sha.Update(magic);
+  if (!ReadUint(&in, 4, &version, &sha) || version != kCheckpointVersion ||
+      !ReadUint(&in, 8, &node_size, &sha) ||
+      node_size != cert_tree_.NodeSize() ||
+      !ReadUint(&in, 8, &level_count, &sha) || level_count > 64) {
+    LOG(WARNING) << "Ignoring checkpoint " << checkpoint_file_
+                 << ": unsupported version or tree parameters";
+    return;
+  }
+
+  vector<string> levels(level_count);
+  for (uint64_t level = 0; level < level_count; ++level) {
+    uint64_t level_size;
+    if (!ReadUint(&in, 8, &level_size, &sha) || level_size > file_size) {
+      LOG(WARNING) << "Ignoring checkpoint " << checkpoint_file_
+                   << ": truncated or corrupt";
+      return;
+    }
+    levels[level].resize(level_size);
+    if (level_size > 0 && !in.read(&levels[level][0], level_size)) {
+      LOG(WARNING) << "Ignoring checkpoint " << checkpoint_file_
+                   << ": truncated";
+      return;
+    }
+    sha.Update(levels[level]);
+  }
+
+  string digest(node_size, '\0');
+  if (!in.read(&digest[0], digest.size()) || digest != sha.Final()) {
+    LOG(WARNING) << "Ignoring checkpoint " << checkpoint_file_
+                 << ": checksum mismatch";
+    return;
+  }
+
+  const int64_t tree_size(
+      levels.empty() ? 0 : levels[0].size() / cert_tree_.NodeSize());
+  if (!cert_tree_.RestoreLevels(&levels)) {
+    LOG(WARNING) << "Ignoring checkpoint " << checkpoint_file_
+                 << ": malformed tree";
+    return;
+  }
+  if (!MatchesDatabase(checkpoint_file_)) {
+    // Start over from the database instead.
+    vector<string> no_levels;
+    CHECK(cert_tree_.RestoreLevels(&no_levels));
+    return;
+  }
+
+  const size_t node_bytes(cert_tree_.NodeSize());
+  const char* const leaves(cert_tree_.EvaluatedNodes().LevelData(0));
+  leaf_index_.Reserve(tree_size);
+  for (int64_t i = 0; i < tree_size; ++i)
+    leaf_index_.Insert(string(leaves + i * node_bytes, node_bytes), i);
+  checkpoint_tree_size_ = tree_size;
+
+  LOG(INFO) << "Loaded " << tree_size << " entries from checkpoint "
+            << checkpoint_file_;
+}
+
+
+void LogLookup::WriteCheckpoints() {
+  unique_lock<mutex> lock(checkpoint_lock_);
+  while (true) {
+    checkpoint_cv_.wait(lock, [this]() {
+      return checkpoint_pending_ || checkpoint_exiting_;
+    });
+    if (!checkpoint_pending_) {
+      return;
+    }
+    lock.unlock();
+    const int64_t tree_size(WriteCheckpoint());
+    lock.lock();
+    if (tree_size >= 0) {
+      checkpoint_tree_size_ = tree_size;
+    }
+    checkpoint_pending_ = false;
+  }
+}
+
+
+int64_t LogLookup::WriteCheckpoint() {
+  // Updates only wait for the copy, not for the hashing and the disk.
+  vector<string> levels;
+  size_t node_size;
+  int64_t tree_size;
+  {
+    ReaderLock lock(&lock_);
+    const MerkleTreeNodeStore& nodes(cert_tree_.EvaluatedNodes());
+    node_size = nodes.NodeSize();
+    levels.reserve(nodes.LevelCount());
+    for (size_t level = 0; level < nodes.LevelCount(); ++level) {
+      levels.emplace_back(nodes.LevelData(level),
+                          nodes.NodeCount(level) * node_size);
+    }
+    tree_size = cert_tree_.LeafCount();
+  }
+
+  Sha256Hasher sha;
+  sha.Reset();
+  string header(kCheckpointMagic, kCheckpointMagicSize);
+  AppendUint(kCheckpointVersion, 4, &header);
+  AppendUint(node_size, 8, &header);
+  AppendUint(levels.size(), 8, &header);
+
+  const string tmp_file(checkpoint_file_ + ".tmp");
+  const int fd(open(tmp_file.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644));
+  if (fd < 0) {
+    PLOG(WARNING) << "Failed to create " << tmp_file;
+    return -1;
+  }
+  bool written(WriteFully(fd, header));
+  sha.Update(header);
+  for (const string& level : levels) {
+    string length;
+    AppendUint(level.size(), 8, &length);
+    written = written && WriteFully(fd, length) && WriteFully(fd, level);
+    sha.Update(length);
+    sha.Update(level);
+  }
+  const string digest(sha.Final());
+  // Synced before the rename, so that a crash leaves either the old
+  // checkpoint or the whole new one.
+  written = written && WriteFully(fd, digest) && fsync(fd) == 0;
+  close(fd);
+  if (!written || rename(tmp_file.c_str(), checkpoint_file_.c_str()) != 0) {
+    PLOG(WARNING) << "Failed to write checkpoint " << checkpoint_file_;
+    unlink(tmp_file.c_str());
+    return -1;
+  }
+  // And the rename itself.
+  if (!SyncDirectoryOf(checkpoint_file_)) {
+    PLOG(WARNING) << "Failed to sync the directory of " << checkpoint_file_;
+  }
+  LOG(INFO) << "Checkpointed " << tree_size << " entries to "
+            << checkpoint_file_;
+  return tree_size;
+}
+
+
 LogLookup::LookupResult LogLookup::GetIndex(const string& merkle_leaf_hash,
                                             int64_t* index) {
-  unique_lock<mutex> lock(lock_);
-  const int64_t myindex(GetIndexInternal(lock, merkle_leaf_hash));
+  ReaderLock lock(&lock_);
+  const int64_t myindex(leaf_index_.Find(merkle_leaf_hash));
 
   if (myindex < 0) {
     return NOT_FOUND;
@@ -130,27 +900,30 @@ LogLookup::LookupResult LogLookup::GetIndex(const string& merkle_leaf_hash,
 // Look up by SHA256-hash of the certificate.
 LogLookup::LookupResult LogLookup::AuditProof(const string& merkle_leaf_hash,
                                               MerkleAuditProof* proof) {
-  unique_lock<mutex> lock(lock_);
+  // The tree can be ahead of the latest STH while it is being updated,
+  // the proof is for the latter.
+  const shared_ptr<const Snapshot> snapshot(CurrentSnapshot());
+  const SignedTreeHead& sth(snapshot->sth);
 
-  const int64_t leaf_index(GetIndexInternal(lock, merkle_leaf_hash));
-  if (leaf_index < 0) {
+  int64_t leaf_index;
+  if (GetIndex(merkle_leaf_hash, &leaf_index) != OK ||
+      leaf_index >= sth.tree_size()) {
     return NOT_FOUND;
   }
 
   CHECK_GE(leaf_index, 0);
   proof->set_version(ct::V1);
-  proof->set_tree_size(cert_tree_.LeafCount());
-  proof->set_timestamp(latest_tree_head_.timestamp());
+  proof->set_tree_size(sth.tree_size());
+  proof->set_timestamp(sth.timestamp());
   proof->set_leaf_index(leaf_index);
 
   proof->clear_path_node();
-  vector<string> audit_path = cert_tree_.PathToCurrentRoot(leaf_index + 1);
+  const vector<string> audit_path(AuditPath(leaf_index, sth.tree_size()));
   for (size_t i = 0; i < audit_path.size(); ++i)
     proof->add_path_node(audit_path[i]);
 
-  proof->mutable_id()->CopyFrom(latest_tree_head_.id());
-  proof->mutable_tree_head_signature()->CopyFrom(
-      latest_tree_head_.signature());
+  proof->mutable_id()->CopyFrom(sth.id());
+  proof->mutable_tree_head_signature()->CopyFrom(sth.signature());
   return OK;
 }
 
@@ -158,13 +931,10 @@ LogLookup::LookupResult LogLookup::AuditProof(const string& merkle_leaf_hash,
 LogLookup::LookupResult LogLookup::AuditProof(int64_t leaf_index,
                                               size_t tree_size,
                                               ShortMerkleAuditProof* proof) {
-  lock_guard<mutex> lock(lock_);
-
   proof->set_leaf_index(leaf_index);
 
   proof->clear_path_node();
-  vector<string> audit_path =
-      cert_tree_.PathToRootAtSnapshot(leaf_index + 1, tree_size);
+  const vector<string> audit_path(AuditPath(leaf_index, tree_size));
   for (size_t i = 0; i < audit_path.size(); ++i)
     proof->add_path_node(audit_path[i]);
 
@@ -185,13 +955,103 @@ LogLookup::LookupResult LogLookup::AuditProof(const string& merkle_leaf_hash,
 }
 
 
+LogLookup::LookupResult LogLookup::AuditProofs(
+    const vector<string>& merkle_leaf_hashes, size_t tree_size,
+    vector<int64_t>* leaf_indexes, vector<string>* nodes) {
+  leaf_indexes->clear();
+  nodes->clear();
+  // The nodes of the audit paths, and the nodes on the way from the
+  // leaves to the root, which need not be sent, by (level, index).
+  map<pair<size_t, int64_t>, string> path_nodes;
+  set<pair<size_t, int64_t>> computed;
+
+  ReaderLock lock(&lock_);
+  if (tree_size > TreeSize())
+    return NOT_FOUND;
+  for (const string& merkle_leaf_hash : merkle_leaf_hashes) {
+    const int64_t leaf_index(leaf_index_.Find(merkle_leaf_hash));
+    if (leaf_index < 0 || static_cast<size_t>(leaf_index) >= tree_size)
+      return NOT_FOUND;
+    leaf_indexes->push_back(leaf_index);
+
+    // Same walk as MerkleVerifier::RootFromPath(), to tell where the
+    // nodes of the path are.
+    const vector<string> path(TreePath(leaf_index, tree_size));
+    vector<string>::const_iterator it(path.begin());
+    int64_t node(leaf_index);
+    int64_t last_node(tree_size - 1);
+    for (size_t level = 0; last_node > 0; ++level) {
+      computed.insert(make_pair(level, node));
+      if ((node & 1) || node < last_node) {
+        CHECK(it != path.end());
+        path_nodes[make_pair(level, node ^ 1)] = *it++;
+      }
+      node >>= 1;
+      last_node >>= 1;
+    }
+    CHECK(it == path.end());
+  }
+
+  for (const auto& path_node : path_nodes) {
+    if (computed.count(path_node.first) == 0)
+      nodes->push_back(path_node.second);
+  }
+  return OK;
+}
+
+
+vector<string> LogLookup::AuditPath(int64_t leaf_index, int64_t tree_size) {
+  const pair<int64_t, int64_t> key(leaf_index, tree_size);
+  vector<string> path;
+  if (FindProof(CurrentSnapshot()->audit_paths, audit_paths_, key, &path))
+    return path;
+
+  bool cacheable;
+  {
+    ReaderLock lock(&lock_);
+    path = TreePath(leaf_index, tree_size);
+    // Asking for a tree size we do not have yet gives an empty path,
+    // which would not be right anymore once we do.
+    cacheable = static_cast<uint64_t>(tree_size) <= TreeSize();
+  }
+  if (cacheable)
+    CacheProof(&audit_paths_, key, path);
+  return path;
+}
+
+
+vector<string> LogLookup::ConsistencyProof(size_t first, size_t second) {
+  const pair<int64_t, int64_t> key(first, second);
+  vector<string> proof;
+  if (FindProof(CurrentSnapshot()->consistency_proofs, consistency_proofs_,
+                key, &proof))
+    return proof;
+
+  bool cacheable;
+  {
+    ReaderLock lock(&lock_);
+    proof = TreeConsistency(first, second);
+    cacheable = second <= TreeSize();
+  }
+  if (cacheable)
+    CacheProof(&consistency_proofs_, key, proof);
+  return proof;
+}
+
+
 string LogLookup::RootAtSnapshot(size_t tree_size) {
-  lock_guard<mutex> lock(lock_);
-  return cert_tree_.RootAtSnapshot(tree_size);
+  ReaderLock lock(&lock_);
+  return TreeRoot(tree_size);
 }
 
 
 string LogLookup::LeafHash(const LoggedEntry& logged) const {
+  // Entries normally come with the hash computed when their SCT was
+  // issued, which the tree signer checked, and the root of the tree is
+  // checked against the STH in any case.
+  if (logged.has_merkle_leaf_hash()) {
+    return logged.merkle_leaf_hash();
+  }
   string serialized_leaf;
   CHECK(logged.SerializeForLeaf(&serialized_leaf));
   // We do not need to take the lock for this call into cert_tree_, as
@@ -203,23 +1063,56 @@ string LogLookup::LeafHash(const LoggedEntry& logged) const {
 
 unique_ptr<CompactMerkleTree> LogLookup::GetCompactMerkleTree(
     SerialHasher* hasher) {
-  lock_guard<mutex> lock(lock_);
+  const shared_ptr<const Snapshot> snapshot(CurrentSnapshot());
+  if (snapshot->tree) {
+    return CompactMerkleTree::FromSnapshot(*snapshot->tree,
+                                           unique_ptr<SerialHasher>(hasher));
+  }
+  ReaderLock lock(&lock_);
+  return CompactTreeLocked(unique_ptr<SerialHasher>(hasher));
+}
+
+
+unique_ptr<CompactMerkleTree> LogLookup::CompactTreeLocked(
+    unique_ptr<SerialHasher> hasher) {
+  if (tiled_tree_) {
+    unique_ptr<CompactMerkleTree> tree(CompactMerkleTree::FromFrontier(
+        tiled_tree_->LeafCount(), tiled_tree_->Frontier(), move(hasher)));
+    CHECK(tree) << "Inconsistent frontier in " << FLAGS_log_lookup_tile_dir;
+    return tree;
+  }
   return unique_ptr<CompactMerkleTree>(
-      new CompactMerkleTree(&cert_tree_, unique_ptr<SerialHasher>(hasher)));
+      new CompactMerkleTree(&cert_tree_, move(hasher)));
 }
 
 
-int64_t LogLookup::GetIndexInternal(const unique_lock<mutex>& lock,
-                                    const string& merkle_leaf_hash) const {
-  CHECK(lock.owns_lock());
+size_t LogLookup::TreeSize() const {
+  return tiled_tree_ ? tiled_tree_->LeafCount() : cert_tree_.LeafCount();
+}
+
+
+string LogLookup::TreeLeafHash(int64_t index) const {
+  return tiled_tree_ ? tiled_tree_->LeafHash(index + 1)
+                     : cert_tree_.LeafHash(index + 1);
+}
+
+
+string LogLookup::TreeRoot(size_t tree_size) {
+  return tiled_tree_ ? tiled_tree_->RootAtSnapshot(tree_size)
+                     : cert_tree_.RootAtSnapshot(tree_size);
+}
+
+
+vector<string> LogLookup::TreePath(int64_t leaf_index, size_t tree_size) {
+  return tiled_tree_
+             ? tiled_tree_->PathToRootAtSnapshot(leaf_index + 1, tree_size)
+             : cert_tree_.PathToRootAtSnapshot(leaf_index + 1, tree_size);
+}
 
-  const map<string, int64_t>::const_iterator it(
-      leaf_index_.find(merkle_leaf_hash));
-  if (it == leaf_index_.end())
-    return -1;
 
-  CHECK_GE(it->second, 0);
-  return it->second;
+vector<string> LogLookup::TreeConsistency(size_t first, size_t second) {
+  return tiled_tree_ ? tiled_tree_->SnapshotConsistency(first, second)
+                     : cert_tree_.SnapshotConsistency(first, second);
 }
 
 
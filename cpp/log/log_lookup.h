@@ -2,24 +2,67 @@
 #define CERT_TRANS_LOG_LOG_LOOKUP_H_
 
 #include <stdint.h>
-#include <map>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <memory>
 #include <mutex>
 #include <string>
+#include <thread>
+#include <unordered_map>
+#include <utility>
+#include <vector>
 
 #include "log/database.h"
+#include "log/leaf_index.h"
 #include "merkletree/compact_merkle_tree.h"
 #include "merkletree/merkle_tree.h"
+#include "merkletree/mmap_node_store.h"
+#include "merkletree/tiled_merkle_tree.h"
+#include "monitoring/memory_usage.h"
 #include "proto/ct.pb.h"
+#include "util/read_write_lock.h"
 
 namespace cert_trans {
 
 
 // Lookups into the database. Read-only, so could also be a mirror.
 // Keeps the entire Merkle Tree in memory to serve audit proofs.
+//
+// If a checkpoint file is given, the tree is periodically written out
+// to it, and loaded back on startup so that only the entries added
+// since the last checkpoint have to be read from the database. The
+// checkpoints are written by a thread of their own, from a copy of the
+// tree, so that updates do not wait for them.
+//
+// Alternatively, with --log_lookup_tree_dir, the tree lives in
+// memory-mapped files instead of on the heap, and is reused directly
+// on startup. The leaf index is kept there too, and each STH is
+// published along with them, so that other processes can map both
+// read-only, with --log_lookup_shared_tree_dir, rather than each build
+// its own copy from the database: they only poll for the latest STH.
+//
+// For trees too large for memory, with --log_lookup_tile_dir, the tree
+// is kept on disk as a TiledMerkleTree instead, with only a cache of
+// its tiles in memory.
+//
+// Each new STH is published to the readers as an immutable snapshot,
+// swapped in atomically, along with the proofs for its tree size that
+// most clients ask for: the audit paths of the newest entries, and the
+// consistency proofs from the last few tree sizes. Those, and the STH
+// itself, are served without taking any lock. Other lookups take the
+// lock on the tree shared, so that they run in parallel, and cache
+// their results. Updates read and hash the new entries, and work out
+// the new nodes of the tree (and a bigger leaf index, when it has to
+// grow) before taking that lock, and only hold it exclusively to copy
+// them in.
 class LogLookup {
  public:
   // The constructor loads the content from the database.
   explicit LogLookup(ReadOnlyDatabase* db);
+  // As above, but also maintains a checkpoint of the tree in
+  // |checkpoint_file| (no checkpointing if empty).
+  LogLookup(ReadOnlyDatabase* db, const std::string& checkpoint_file);
   ~LogLookup();
   LogLookup(const LogLookup&) = delete;
   LogLookup& operator=(const LogLookup&) = delete;
@@ -46,41 +89,186 @@ class LogLookup {
   LookupResult AuditProof(const std::string& merkle_leaf_hash,
                           size_t tree_size, ct::ShortMerkleAuditProof* proof);
 
+  // Look up by hash several logged items at once, at |tree_size|, with
+  // one proof for all of them. Sets |leaf_indexes| to their indexes, in
+  // the same order, and |nodes| to those of the nodes of their audit
+  // paths that cannot be computed from the leaves themselves, each one
+  // once, by level from the leaves up, then from left to right (see
+  // MerkleVerifier::RootFromMultiProof()). Returns NOT_FOUND if any of
+  // them is not in the tree at |tree_size|.
+  LookupResult AuditProofs(const std::vector<std::string>& merkle_leaf_hashes,
+                           size_t tree_size,
+                           std::vector<int64_t>* leaf_indexes,
+                           std::vector<std::string>* nodes);
+
   // Get a consitency proof between two tree heads
-  std::vector<std::string> ConsistencyProof(size_t first, size_t second) {
-    std::lock_guard<std::mutex> lock(lock_);
-    return cert_tree_.SnapshotConsistency(first, second);
-  }
+  std::vector<std::string> ConsistencyProof(size_t first, size_t second);
 
-  const ct::SignedTreeHead& GetSTH() const {
-    std::lock_guard<std::mutex> lock(lock_);
-    return latest_tree_head_;
+  ct::SignedTreeHead GetSTH() const {
+    return CurrentSnapshot()->sth;
   }
 
+  // |callback| is called with each new STH once it is served, that is,
+  // once GetSTH() returns it and the lookups are up to date with it. It
+  // is called from the thread updating the tree, so it should be quick.
+  void AddNotifySTHCallback(const Database::NotifySTHCallback* callback);
+  void RemoveNotifySTHCallback(const Database::NotifySTHCallback* callback);
+
   std::string RootAtSnapshot(size_t tree_size);
 
   std::string LeafHash(const LoggedEntry& logged) const;
 
-  // Creates a CompactMerkleTree based on the current state of our MerkleTree.
-  // Takes ownership of |hasher|.
+  // Creates a CompactMerkleTree based on the tree as of GetSTH(), forked
+  // from a snapshot of it taken when that STH was published, so this
+  // does not hold up the lookups. Takes ownership of |hasher|.
   std::unique_ptr<CompactMerkleTree> GetCompactMerkleTree(
       SerialHasher* hasher);
 
  private:
+  struct PairHash {
+    size_t operator()(const std::pair<int64_t, int64_t>& key) const {
+      return std::hash<int64_t>()(key.first) * 31 +
+             std::hash<int64_t>()(key.second);
+    }
+  };
+  // Proofs, keyed by (leaf index, tree size) for audit paths, and by
+  // (first, second) tree size for consistency proofs.
+  typedef std::unordered_map<std::pair<int64_t, int64_t>,
+                             std::vector<std::string>, PairHash> ProofCache;
+
+  // Never modified once published.
+  struct Snapshot {
+    ct::SignedTreeHead sth;
+    // The tree at the size of |sth|, for GetCompactMerkleTree().
+    std::shared_ptr<const CompactMerkleTree::Snapshot> tree;
+    // Computed before publishing, see PrecomputeProofs().
+    ProofCache audit_paths;
+    ProofCache consistency_proofs;
+  };
+
+  std::shared_ptr<const Snapshot> CurrentSnapshot() const {
+    return std::atomic_load(&snapshot_);
+  }
+
   void UpdateFromSTH(const ct::SignedTreeHead& sth);
-  int64_t GetIndexInternal(const std::unique_lock<std::mutex>& lock,
-                           const std::string& merkle_leaf_hash) const;
+  // With --log_lookup_shared_tree_dir, picks up the latest STH
+  // published in there, and the tree and index that go with it.
+  void RefreshSharedTree();
+  // Calls RefreshSharedTree() periodically, until |exiting_| is set.
+  void FollowSharedTree();
+  // Keeps |tree_size| cached in |cert_tree_|, see
+  // --log_lookup_cached_snapshots.
+  // REQUIRES: |lock_| is held exclusively.
+  void CacheSnapshot(int64_t tree_size);
+  // Serves |sth|, the tree being up to date with it, instead of
+  // |current|.
+  void PublishSnapshot(const ct::SignedTreeHead& sth,
+                       const std::shared_ptr<const Snapshot>& current);
+  // Backs GetCompactMerkleTree(), with the tree as it is now.
+  // REQUIRES: |lock_| is held, shared is enough.
+  std::unique_ptr<CompactMerkleTree> CompactTreeLocked(
+      std::unique_ptr<SerialHasher> hasher);
+  // Sets |leaf_hashes| to those of the entries of the database from
+  // |first| up to |tree_size|. Returns false if it does not have them
+  // all.
+  bool ReadLeafHashes(int64_t first, int64_t tree_size,
+                      std::vector<std::string>* leaf_hashes) const;
+  // Whether the tree loaded from |source| on startup is that of the
+  // latest tree head of the database, as of its own size.
+  bool MatchesDatabase(const std::string& source);
+  // Load the tree from |checkpoint_file_|, if there is a usable one.
+  void LoadCheckpoint();
+  // Index the leaves of a tree picked up from --log_lookup_tree_dir or
+  // --log_lookup_tile_dir, or empty it if it does not match the
+  // database.
+  void LoadStoredTree(const std::string& dir);
+  // Writes checkpoints as UpdateFromSTH() asks for them, until
+  // |checkpoint_exiting_| is set.
+  void WriteCheckpoints();
+  // Copies the tree, holding |lock_| shared only for that, and writes
+  // it to |checkpoint_file_|. Returns the tree size written, or -1.
+  int64_t WriteCheckpoint();
+  // Computes the proofs for the tree size of |snapshot| that are likely
+  // to be asked for.
+  // REQUIRES: |lock_| is held, shared is enough.
+  void PrecomputeProofs(Snapshot* snapshot);
+  // Returns the audit path of |leaf_index| at |tree_size|, from the
+  // caches if it is there.
+  std::vector<std::string> AuditPath(int64_t leaf_index, int64_t tree_size);
+  // Returns false if there is no proof for |key| in either |published|,
+  // from the current snapshot, or |cached|.
+  bool FindProof(const ProofCache& published, const ProofCache& cached,
+                 const std::pair<int64_t, int64_t>& key,
+                 std::vector<std::string>* proof) const;
+  void CacheProof(ProofCache* cache, const std::pair<int64_t, int64_t>& key,
+                  const std::vector<std::string>& proof);
 
-  mutable std::mutex lock_;
-  // We keep a hash -> index mapping in memory so that we can quickly serve
-  // Merkle proofs without having to query the database at all.
-  // Note that 32 bytes is an overkill and we can optimize this to use
-  // a shorter prefix (possibly with a multimap).
-  std::map<std::string, int64_t> leaf_index_;
+  // Forward to |tiled_tree_| if set, or to |cert_tree_| otherwise.
+  // REQUIRES: |lock_| is held, shared is enough.
+  size_t TreeSize() const;
+  std::string TreeLeafHash(int64_t index) const;
+  std::string TreeRoot(size_t tree_size);
+  std::vector<std::string> TreePath(int64_t leaf_index, size_t tree_size);
+  std::vector<std::string> TreeConsistency(size_t first, size_t second);
 
+  // Held by UpdateFromSTH(), so that there is only one at a time.
+  std::mutex update_lock_;
+  // Held shared by lookups, which do not modify the tree as long as
+  // it is kept fully evaluated, and exclusively to update it.
+  mutable ReadWriteLock lock_;
   ReadOnlyDatabase* const db_;
+  // The value of --log_lookup_shared_tree_dir when constructed. If it
+  // is set, |mmap_nodes_| is read-only, and the tree is not updated
+  // from |db_|.
+  const std::string shared_tree_dir_;
+  // Set if the tree is kept in memory-mapped files, owned by
+  // |cert_tree_|.
+  MmapNodeStore* const mmap_nodes_;
+  // Empty if |tiled_tree_| is set.
   MerkleTree cert_tree_;
-  ct::SignedTreeHead latest_tree_head_;
+  // Set with --log_lookup_tile_dir.
+  const std::unique_ptr<TiledMerkleTree> tiled_tree_;
+  // We keep a hash -> index mapping in memory so that we can quickly serve
+  // Merkle proofs without having to query the database at all.
+  LeafIndex leaf_index_;
+  // Only ever accessed with std::atomic_load() and std::atomic_store().
+  std::shared_ptr<const Snapshot> snapshot_;
+  // Updated as each snapshot is published.
+  MemoryUsage tree_memory_;
+  MemoryUsage leaf_index_memory_;
+  MemoryUsage proofs_memory_;
+
+  const std::string checkpoint_file_;
+  // For WriteCheckpoints().
+  std::mutex checkpoint_lock_;
+  std::condition_variable checkpoint_cv_;
+  // Tree size of the last checkpoint written or loaded.
+  int64_t checkpoint_tree_size_;
+  // Set while a checkpoint is asked for or being written.
+  bool checkpoint_pending_;
+  bool checkpoint_exiting_;
+  std::thread checkpoint_thread_;
+  // Tree sizes of the STHs before the latest one, most recent first.
+  std::deque<int64_t> previous_tree_sizes_;
+  // Tree sizes kept cached in |cert_tree_|, oldest first.
+  std::deque<int64_t> cached_snapshots_;
+  // The annotation of the version of the shared tree in use, once it
+  // has been picked up.
+  std::string shared_annotation_;
+
+  // For FollowSharedTree().
+  std::mutex refresh_lock_;
+  std::condition_variable refresh_cv_;
+  bool exiting_;
+  std::thread refresh_thread_;
+
+  // Proofs computed by lookups, that were not in the snapshot.
+  mutable std::mutex cache_lock_;
+  ProofCache audit_paths_;
+  ProofCache consistency_proofs_;
+
+  mutable std::mutex notify_lock_;
+  DatabaseNotifierHelper notify_callbacks_;
 
   const Database::NotifySTHCallback update_from_sth_cb_;
 };
@@ -1,7 +1,12 @@
 /* -*- indent-tabs-mode: nil -*- */
 #include <gtest/gtest.h>
+#include <atomic>
+#include <chrono>
+#include <map>
 #include <memory>
 #include <string>
+#include <thread>
+#include <vector>
 
 #include "log/etcd_consistent_store.h"
 #include "log/file_db.h"
@@ -14,6 +19,7 @@
 #include "log/test_db.h"
 #include "log/test_signer.h"
 #include "log/tree_signer.h"
+#include "merkletree/compact_merkle_tree.h"
 #include "merkletree/merkle_verifier.h"
 #include "merkletree/serial_hasher.h"
 #include "proto/cert_serializer.h"
@@ -24,6 +30,13 @@
 #include "util/thread_pool.h"
 #include "util/util.h"
 
+DECLARE_int64(log_lookup_checkpoint_interval_entries);
+DECLARE_string(log_lookup_tree_dir);
+DECLARE_string(log_lookup_shared_tree_dir);
+DECLARE_int32(log_lookup_shared_refresh_ms);
+DECLARE_string(log_lookup_tile_dir);
+DECLARE_int32(log_lookup_precomputed_audit_paths);
+
 namespace {
 
 namespace libevent = cert_trans::libevent;
@@ -41,10 +54,16 @@ using cert_trans::ThreadPool;
 using cert_trans::TreeSigner;
 using ct::MerkleAuditProof;
 using ct::SequenceMapping;
+using ct::ShortMerkleAuditProof;
+using ct::SignedTreeHead;
+using std::atomic;
+using std::chrono::milliseconds;
 using std::make_shared;
 using std::shared_ptr;
 using std::string;
+using std::thread;
 using std::unique_ptr;
+using std::vector;
 using testing::NiceMock;
 
 
@@ -119,6 +138,7 @@ class LogLookupTest : public ::testing::Test {
 
 
   TestDB<T> test_db_;
+  TmpStorage tmp_;
   shared_ptr<libevent::Base> base_;
   libevent::EventPumpThread event_pump_;
   FakeEtcdClient etcd_client_;
@@ -229,6 +249,441 @@ TYPED_TEST(LogLookupTest, VerifyWithPath) {
 }
 
 
+TYPED_TEST(LogLookupTest, AuditProofs) {
+  LoggedEntry logged_certs[13];
+  for (int i = 0; i < 13; ++i) {
+    this->test_signer_.CreateUnique(&logged_certs[i]);
+    this->CreateSequencedEntry(&logged_certs[i], i);
+  }
+  this->UpdateTree();
+
+  LogLookup lookup(this->db());
+  vector<string> hashes;
+  std::map<size_t, string> leaves;
+  for (const int i : {7, 0, 3, 4, 9}) {
+    hashes.push_back(logged_certs[i].merkle_leaf_hash());
+    ASSERT_TRUE(logged_certs[i].SerializeForLeaf(&leaves[i + 1]));
+  }
+
+  vector<int64_t> leaf_indexes;
+  vector<string> nodes;
+  EXPECT_EQ(LogLookup::OK,
+            lookup.AuditProofs(hashes, 10, &leaf_indexes, &nodes));
+  EXPECT_EQ(vector<int64_t>({7, 0, 3, 4, 9}), leaf_indexes);
+  MerkleVerifier verifier(unique_ptr<Sha256Hasher>(new Sha256Hasher));
+  EXPECT_EQ(util::HexString(lookup.RootAtSnapshot(10)),
+            util::HexString(verifier.RootFromMultiProof(10, leaves, nodes)));
+
+  // Not in the tree at that size.
+  hashes.push_back(logged_certs[11].merkle_leaf_hash());
+  EXPECT_EQ(LogLookup::NOT_FOUND,
+            lookup.AuditProofs(hashes, 10, &leaf_indexes, &nodes));
+}
+
+
+vector<string> PathNodes(const ShortMerkleAuditProof& proof) {
+  return vector<string>(proof.path_node().begin(), proof.path_node().end());
+}
+
+
+TYPED_TEST(LogLookupTest, CachedProofs) {
+  // Some of the audit paths get precomputed, the others are computed
+  // (and cached) when asked for.
+  FLAGS_log_lookup_precomputed_audit_paths = 4;
+  LogLookup lookup(this->db());
+  MerkleTree reference(unique_ptr<Sha256Hasher>(new Sha256Hasher));
+  LoggedEntry logged_certs[13];
+
+  ShortMerkleAuditProof proof;
+  // Proofs for a tree we do not have yet are empty, but must not stay
+  // that way once we do.
+  EXPECT_EQ(LogLookup::OK, lookup.AuditProof(0, 7, &proof));
+  EXPECT_EQ(0, proof.path_node_size());
+  EXPECT_TRUE(lookup.ConsistencyProof(3, 7).empty());
+
+  for (int i = 0; i < 7; ++i) {
+    this->test_signer_.CreateUnique(&logged_certs[i]);
+    this->CreateSequencedEntry(&logged_certs[i], i);
+    reference.AddLeafHash(lookup.LeafHash(logged_certs[i]));
+  }
+  this->UpdateTree();
+  EXPECT_EQ(7, lookup.GetSTH().tree_size());
+  EXPECT_EQ(reference.SnapshotConsistency(3, 7),
+            lookup.ConsistencyProof(3, 7));
+
+  for (int i = 7; i < 13; ++i) {
+    this->test_signer_.CreateUnique(&logged_certs[i]);
+    this->CreateSequencedEntry(&logged_certs[i], i);
+    reference.AddLeafHash(lookup.LeafHash(logged_certs[i]));
+  }
+  this->UpdateTree();
+  EXPECT_EQ(13, lookup.GetSTH().tree_size());
+
+  // Twice, so that the second time around comes from the cache.
+  for (int round = 0; round < 2; ++round) {
+    for (size_t tree_size : {7, 13}) {
+      for (size_t i = 0; i < tree_size; ++i) {
+        EXPECT_EQ(LogLookup::OK, lookup.AuditProof(i, tree_size, &proof));
+        EXPECT_EQ(static_cast<int64_t>(i), proof.leaf_index());
+        EXPECT_EQ(reference.PathToRootAtSnapshot(i + 1, tree_size),
+                  PathNodes(proof));
+      }
+    }
+    for (size_t first = 1; first < 13; ++first) {
+      EXPECT_EQ(reference.SnapshotConsistency(first, 13),
+                lookup.ConsistencyProof(first, 13));
+    }
+  }
+}
+
+
+TYPED_TEST(LogLookupTest, ParallelLookups) {
+  LogLookup lookup(this->db());
+  MerkleTree reference(unique_ptr<Sha256Hasher>(new Sha256Hasher));
+  LoggedEntry logged_certs[13];
+
+  for (int i = 0; i < 13; ++i) {
+    this->test_signer_.CreateUnique(&logged_certs[i]);
+    this->CreateSequencedEntry(&logged_certs[i], i);
+    reference.AddLeafHash(lookup.LeafHash(logged_certs[i]));
+    if (i == 6)
+      this->UpdateTree();
+  }
+  const vector<string> consistency(reference.SnapshotConsistency(3, 7));
+  vector<vector<string>> paths;
+  for (int i = 0; i < 7; ++i)
+    paths.emplace_back(reference.PathToRootAtSnapshot(i + 1, 7));
+
+  // Readers keep looking up proofs for the first tree head while the
+  // second one comes in.
+  atomic<bool> done(false);
+  atomic<int> mismatches(0);
+  vector<thread> readers;
+  for (int t = 0; t < 4; ++t) {
+    readers.emplace_back([&lookup, &paths, &consistency, &done,
+                          &mismatches, t]() {
+      ShortMerkleAuditProof proof;
+      for (int i = 0; !done || i < 100; ++i) {
+        const int leaf((i + t) % 7);
+        CHECK_EQ(LogLookup::OK, lookup.AuditProof(leaf, 7, &proof));
+        if (PathNodes(proof) != paths[leaf])
+          ++mismatches;
+        if (lookup.ConsistencyProof(3, 7) != consistency)
+          ++mismatches;
+        const int64_t tree_size(lookup.GetSTH().tree_size());
+        if (tree_size != 7 && tree_size != 13)
+          ++mismatches;
+      }
+    });
+  }
+  this->UpdateTree();
+  done = true;
+  for (auto& reader : readers)
+    reader.join();
+
+  EXPECT_EQ(0, mismatches);
+  EXPECT_EQ(13, lookup.GetSTH().tree_size());
+}
+
+
+TYPED_TEST(LogLookupTest, Checkpoint) {
+  FLAGS_log_lookup_checkpoint_interval_entries = 1;
+  const string checkpoint_file(this->tmp_.TmpStorageDir() + "/checkpoint");
+  LoggedEntry logged_certs[13];
+
+  for (int i = 0; i < 7; ++i) {
+    this->test_signer_.CreateUnique(&logged_certs[i]);
+    this->CreateSequencedEntry(&logged_certs[i], i);
+  }
+  this->UpdateTree();
+
+  {
+    // Writes the first checkpoint.
+    LogLookup lookup(this->db(), checkpoint_file);
+    EXPECT_EQ(7, lookup.GetSTH().tree_size());
+  }
+
+  for (int i = 7; i < 13; ++i) {
+    this->test_signer_.CreateUnique(&logged_certs[i]);
+    this->CreateSequencedEntry(&logged_certs[i], i);
+  }
+  this->UpdateTree();
+
+  // Starts from the checkpoint, and replays the rest from the database.
+  LogLookup lookup(this->db(), checkpoint_file);
+  LogLookup reference(this->db());
+  EXPECT_EQ(13, lookup.GetSTH().tree_size());
+  EXPECT_EQ(reference.RootAtSnapshot(7), lookup.RootAtSnapshot(7));
+  EXPECT_EQ(reference.RootAtSnapshot(13), lookup.RootAtSnapshot(13));
+
+  MerkleAuditProof proof;
+  for (int i = 0; i < 13; ++i) {
+    int64_t index;
+    EXPECT_EQ(LogLookup::OK,
+              lookup.GetIndex(logged_certs[i].merkle_leaf_hash(), &index));
+    EXPECT_EQ(i, index);
+    EXPECT_EQ(LogLookup::OK,
+              lookup.AuditProof(logged_certs[i].merkle_leaf_hash(), &proof));
+    EXPECT_EQ(LogVerifier::VERIFY_OK,
+              this->verifier_.VerifyMerkleAuditProof(logged_certs[i].entry(),
+                                                     logged_certs[i].sct(),
+                                                     proof));
+  }
+}
+
+
+TYPED_TEST(LogLookupTest, CorruptCheckpointIsIgnored) {
+  FLAGS_log_lookup_checkpoint_interval_entries = 1;
+  const string checkpoint_file(this->tmp_.TmpStorageDir() + "/checkpoint");
+  LoggedEntry logged_certs[5];
+
+  for (int i = 0; i < 5; ++i) {
+    this->test_signer_.CreateUnique(&logged_certs[i]);
+    this->CreateSequencedEntry(&logged_certs[i], i);
+  }
+  this->UpdateTree();
+
+  { LogLookup lookup(this->db(), checkpoint_file); }
+
+  string contents;
+  ASSERT_TRUE(util::ReadBinaryFile(checkpoint_file, &contents));
+  contents[contents.size() / 2] ^= 0x01;
+  const string tmp_file(util::WriteTemporaryBinaryFile(
+      this->tmp_.TmpStorageDir() + "/tmpXXXXXX", contents));
+  ASSERT_FALSE(tmp_file.empty());
+  ASSERT_EQ(0, rename(tmp_file.c_str(), checkpoint_file.c_str()));
+
+  LogLookup lookup(this->db(), checkpoint_file);
+  EXPECT_EQ(5, lookup.GetSTH().tree_size());
+  MerkleAuditProof proof;
+  for (int i = 0; i < 5; ++i) {
+    EXPECT_EQ(LogLookup::OK,
+              lookup.AuditProof(logged_certs[i].merkle_leaf_hash(), &proof));
+    EXPECT_EQ(LogVerifier::VERIFY_OK,
+              this->verifier_.VerifyMerkleAuditProof(logged_certs[i].entry(),
+                                                     logged_certs[i].sct(),
+                                                     proof));
+  }
+}
+
+
+TYPED_TEST(LogLookupTest, MismatchedCheckpointIsIgnored) {
+  FLAGS_log_lookup_checkpoint_interval_entries = 1;
+  const string checkpoint_file(this->tmp_.TmpStorageDir() + "/checkpoint");
+  for (int i = 0; i < 5; ++i) {
+    LoggedEntry logged_cert;
+    this->test_signer_.CreateUnique(&logged_cert);
+    this->CreateSequencedEntry(&logged_cert, i);
+  }
+  this->UpdateTree();
+  { LogLookup lookup(this->db(), checkpoint_file); }
+
+  // The checkpoint goes with another log, a little longer.
+  TestDB<TypeParam> other_db;
+  CompactMerkleTree other_tree(unique_ptr<Sha256Hasher>(new Sha256Hasher));
+  LoggedEntry other_certs[6];
+  for (int i = 0; i < 6; ++i) {
+    this->test_signer_.CreateUnique(&other_certs[i]);
+    other_certs[i].set_sequence_number(i);
+    ASSERT_EQ(Database::OK,
+              other_db.db()->CreateSequencedEntry(other_certs[i]));
+    string serialized_leaf;
+    ASSERT_TRUE(other_certs[i].SerializeForLeaf(&serialized_leaf));
+    other_tree.AddLeaf(serialized_leaf);
+  }
+  SignedTreeHead sth(this->tree_signer_.LatestSTH());
+  sth.set_tree_size(6);
+  sth.set_sha256_root_hash(other_tree.CurrentRoot());
+  ASSERT_EQ(Database::OK, other_db.db()->WriteTreeHead(sth));
+
+  LogLookup lookup(other_db.db(), checkpoint_file);
+  EXPECT_EQ(6, lookup.GetSTH().tree_size());
+  EXPECT_EQ(other_tree.CurrentRoot(), lookup.RootAtSnapshot(6));
+  int64_t index;
+  EXPECT_EQ(LogLookup::OK,
+            lookup.GetIndex(other_certs[3].merkle_leaf_hash(), &index));
+  EXPECT_EQ(3, index);
+}
+
+
+TYPED_TEST(LogLookupTest, TreeDir) {
+  FLAGS_log_lookup_tree_dir = this->tmp_.TmpStorageDir();
+  LoggedEntry logged_certs[11];
+
+  for (int i = 0; i < 6; ++i) {
+    this->test_signer_.CreateUnique(&logged_certs[i]);
+    this->CreateSequencedEntry(&logged_certs[i], i);
+  }
+  this->UpdateTree();
+
+  { LogLookup lookup(this->db()); }
+
+  for (int i = 6; i < 11; ++i) {
+    this->test_signer_.CreateUnique(&logged_certs[i]);
+    this->CreateSequencedEntry(&logged_certs[i], i);
+  }
+  this->UpdateTree();
+
+  // Picks up the first six entries from the tree directory, and the
+  // rest from the database.
+  LogLookup lookup(this->db());
+  FLAGS_log_lookup_tree_dir = "";
+  LogLookup reference(this->db());
+  EXPECT_EQ(11, lookup.GetSTH().tree_size());
+  EXPECT_EQ(reference.RootAtSnapshot(6), lookup.RootAtSnapshot(6));
+  EXPECT_EQ(reference.RootAtSnapshot(11), lookup.RootAtSnapshot(11));
+
+  MerkleAuditProof proof;
+  for (int i = 0; i < 11; ++i) {
+    int64_t index;
+    EXPECT_EQ(LogLookup::OK,
+              lookup.GetIndex(logged_certs[i].merkle_leaf_hash(), &index));
+    EXPECT_EQ(i, index);
+    EXPECT_EQ(LogLookup::OK,
+              lookup.AuditProof(logged_certs[i].merkle_leaf_hash(), &proof));
+    EXPECT_EQ(LogVerifier::VERIFY_OK,
+              this->verifier_.VerifyMerkleAuditProof(logged_certs[i].entry(),
+                                                     logged_certs[i].sct(),
+                                                     proof));
+  }
+}
+
+
+TYPED_TEST(LogLookupTest, MismatchedTreeDirIsIgnored) {
+  FLAGS_log_lookup_tree_dir = this->tmp_.TmpStorageDir();
+  for (int i = 0; i < 5; ++i) {
+    LoggedEntry logged_cert;
+    this->test_signer_.CreateUnique(&logged_cert);
+    this->CreateSequencedEntry(&logged_cert, i);
+  }
+  this->UpdateTree();
+  { LogLookup lookup(this->db()); }
+
+  // The tree directory goes with another log, a little longer.
+  TestDB<TypeParam> other_db;
+  CompactMerkleTree other_tree(unique_ptr<Sha256Hasher>(new Sha256Hasher));
+  LoggedEntry other_certs[6];
+  for (int i = 0; i < 6; ++i) {
+    this->test_signer_.CreateUnique(&other_certs[i]);
+    other_certs[i].set_sequence_number(i);
+    ASSERT_EQ(Database::OK,
+              other_db.db()->CreateSequencedEntry(other_certs[i]));
+    string serialized_leaf;
+    ASSERT_TRUE(other_certs[i].SerializeForLeaf(&serialized_leaf));
+    other_tree.AddLeaf(serialized_leaf);
+  }
+  SignedTreeHead sth(this->tree_signer_.LatestSTH());
+  sth.set_tree_size(6);
+  sth.set_sha256_root_hash(other_tree.CurrentRoot());
+  ASSERT_EQ(Database::OK, other_db.db()->WriteTreeHead(sth));
+
+  LogLookup lookup(other_db.db());
+  FLAGS_log_lookup_tree_dir = "";
+  EXPECT_EQ(6, lookup.GetSTH().tree_size());
+  EXPECT_EQ(other_tree.CurrentRoot(), lookup.RootAtSnapshot(6));
+  int64_t index;
+  EXPECT_EQ(LogLookup::OK,
+            lookup.GetIndex(other_certs[3].merkle_leaf_hash(), &index));
+  EXPECT_EQ(3, index);
+}
+
+
+TYPED_TEST(LogLookupTest, SharedTreeDir) {
+  FLAGS_log_lookup_tree_dir = this->tmp_.TmpStorageDir();
+  FLAGS_log_lookup_shared_refresh_ms = 10;
+  LoggedEntry logged_certs[11];
+
+  for (int i = 0; i < 6; ++i) {
+    this->test_signer_.CreateUnique(&logged_certs[i]);
+    this->CreateSequencedEntry(&logged_certs[i], i);
+  }
+  this->UpdateTree();
+
+  LogLookup writer(this->db());
+  FLAGS_log_lookup_shared_tree_dir = FLAGS_log_lookup_tree_dir;
+  FLAGS_log_lookup_tree_dir = "";
+  LogLookup reader(this->db());
+  FLAGS_log_lookup_shared_tree_dir = "";
+  EXPECT_EQ(6, reader.GetSTH().tree_size());
+
+  for (int i = 6; i < 11; ++i) {
+    this->test_signer_.CreateUnique(&logged_certs[i]);
+    this->CreateSequencedEntry(&logged_certs[i], i);
+  }
+  this->UpdateTree();
+  EXPECT_EQ(11, writer.GetSTH().tree_size());
+
+  // The reader only polls for the STHs of the writer.
+  while (reader.GetSTH().tree_size() < 11)
+    std::this_thread::sleep_for(milliseconds(10));
+  EXPECT_EQ(writer.GetSTH().timestamp(), reader.GetSTH().timestamp());
+  EXPECT_EQ(writer.RootAtSnapshot(6), reader.RootAtSnapshot(6));
+  EXPECT_EQ(writer.RootAtSnapshot(11), reader.RootAtSnapshot(11));
+  EXPECT_EQ(writer.ConsistencyProof(6, 11), reader.ConsistencyProof(6, 11));
+
+  MerkleAuditProof proof;
+  for (int i = 0; i < 11; ++i) {
+    int64_t index;
+    EXPECT_EQ(LogLookup::OK,
+              reader.GetIndex(logged_certs[i].merkle_leaf_hash(), &index));
+    EXPECT_EQ(i, index);
+    EXPECT_EQ(LogLookup::OK,
+              reader.AuditProof(logged_certs[i].merkle_leaf_hash(), &proof));
+    EXPECT_EQ(LogVerifier::VERIFY_OK,
+              this->verifier_.VerifyMerkleAuditProof(logged_certs[i].entry(),
+                                                     logged_certs[i].sct(),
+                                                     proof));
+  }
+}
+
+
+TYPED_TEST(LogLookupTest, TileDir) {
+  FLAGS_log_lookup_tile_dir = this->tmp_.TmpStorageDir();
+  LoggedEntry logged_certs[300];
+
+  for (int i = 0; i < 260; ++i) {
+    this->test_signer_.CreateUnique(&logged_certs[i]);
+    this->CreateSequencedEntry(&logged_certs[i], i);
+  }
+  this->UpdateTree();
+
+  { LogLookup lookup(this->db()); }
+
+  for (int i = 260; i < 300; ++i) {
+    this->test_signer_.CreateUnique(&logged_certs[i]);
+    this->CreateSequencedEntry(&logged_certs[i], i);
+  }
+  this->UpdateTree();
+
+  // Picks up the first entries from the tiles, and the rest from the
+  // database.
+  LogLookup lookup(this->db());
+  FLAGS_log_lookup_tile_dir = "";
+  LogLookup reference(this->db());
+  EXPECT_EQ(300, lookup.GetSTH().tree_size());
+  EXPECT_EQ(reference.RootAtSnapshot(260), lookup.RootAtSnapshot(260));
+  EXPECT_EQ(reference.RootAtSnapshot(300), lookup.RootAtSnapshot(300));
+  EXPECT_EQ(reference.ConsistencyProof(17, 300),
+            lookup.ConsistencyProof(17, 300));
+  EXPECT_EQ(reference.GetCompactMerkleTree(new Sha256Hasher)->CurrentRoot(),
+            lookup.GetCompactMerkleTree(new Sha256Hasher)->CurrentRoot());
+
+  MerkleAuditProof proof;
+  for (int i = 0; i < 300; i += 7) {
+    int64_t index;
+    EXPECT_EQ(LogLookup::OK,
+              lookup.GetIndex(logged_certs[i].merkle_leaf_hash(), &index));
+    EXPECT_EQ(i, index);
+    EXPECT_EQ(LogLookup::OK,
+              lookup.AuditProof(logged_certs[i].merkle_leaf_hash(), &proof));
+    EXPECT_EQ(LogVerifier::VERIFY_OK,
+              this->verifier_.VerifyMerkleAuditProof(logged_certs[i].entry(),
+                                                     logged_certs[i].sct(),
+                                                     proof));
+  }
+}
+
+
 }  // namespace
 
 
@@ -1,11 +1,17 @@
 #include "log/log_verifier.h"
 
+#include <gflags/gflags.h>
 #include <glog/logging.h>
 #include <stdint.h>
+#include <algorithm>
+#include <deque>
+#include <mutex>
+#include <unordered_set>
 
 #include "log/cert_submission_handler.h"
 #include "log/log_signer.h"
 #include "merkletree/merkle_verifier.h"
+#include "merkletree/serial_hasher.h"
 #include "proto/ct.pb.h"
 #include "proto/serializer.h"
 #include "util/util.h"
@@ -15,7 +21,59 @@ using ct::LogEntry;
 using ct::MerkleAuditProof;
 using ct::SignedCertificateTimestamp;
 using ct::SignedTreeHead;
+using std::deque;
+using std::lock_guard;
+using std::mutex;
+using std::pair;
 using std::string;
+using std::unordered_set;
+using std::vector;
+
+DEFINE_int32(verified_sth_cache_size, 256,
+             "Number of STHs with a valid signature to remember, so that "
+             "getting the same STH again (such as when polling a peer) does "
+             "not verify its signature again. 0 disables the cache.");
+
+namespace {
+
+
+// The STHs whose signature was found to be valid, shared by all the
+// verifiers. The oldest are forgotten first.
+class VerifiedSTHCache {
+ public:
+  bool Contains(const string& key) {
+    lock_guard<mutex> lock(lock_);
+    return keys_.count(key) > 0;
+  }
+
+  void Add(const string& key) {
+    const size_t max_size(std::max(FLAGS_verified_sth_cache_size, 0));
+    lock_guard<mutex> lock(lock_);
+    if (!keys_.insert(key).second) {
+      return;
+    }
+    order_.push_back(key);
+    while (order_.size() > max_size) {
+      keys_.erase(order_.front());
+      order_.pop_front();
+    }
+  }
+
+ private:
+  mutex lock_;
+  unordered_set<string> keys_;
+  // The keys, oldest first.
+  deque<string> order_;
+};
+
+
+VerifiedSTHCache* GetVerifiedSTHCache() {
+  static VerifiedSTHCache* const cache(new VerifiedSTHCache);
+  return cache;
+}
+
+
+}  // namespace
 
 LogVerifier::LogVerifier(LogSigVerifier* sig_verifier,
                          MerkleVerifier* merkle_verifier)
@@ -56,14 +114,44 @@ LogVerifier::LogVerifyResult LogVerifier::VerifySignedCertificateTimestamp(
                                           merkle_leaf_hash);
 }
 
+void LogVerifier::VerifyBatch(
+    const vector<pair<const LogEntry*, const SignedCertificateTimestamp*>>&
+        scts,
+    vector<LogVerifyResult>* results) const {
+  CHECK_NOTNULL(results)->clear();
+  results->reserve(scts.size());
+  // Allow a bit of slack, say 1 second into the future.
+  const uint64_t end_range(util::TimeInMilliseconds() + 1000);
+  for (const auto& sct : scts) {
+    results->push_back(VerifySignedCertificateTimestamp(
+        *CHECK_NOTNULL(sct.first), *CHECK_NOTNULL(sct.second), 0, end_range,
+        nullptr));
+  }
+}
+
 LogVerifier::LogVerifyResult LogVerifier::VerifySignedTreeHead(
     const SignedTreeHead& sth, uint64_t begin_range,
     uint64_t end_range) const {
   if (!IsBetween(sth.timestamp(), begin_range, end_range))
     return INVALID_TIMESTAMP;
 
+  // The cache key covers all of the STH, including the signature, and
+  // the key it should be signed with.
+  const bool use_cache(FLAGS_verified_sth_cache_size > 0);
+  string cache_key;
+  if (use_cache) {
+    cache_key = Sha256Hasher::Sha256Digest(sig_verifier_->KeyID() +
+                                           sth.SerializeAsString());
+    if (GetVerifiedSTHCache()->Contains(cache_key)) {
+      return VERIFY_OK;
+    }
+  }
+
   if (sig_verifier_->VerifySTHSignature(sth) != LogSigVerifier::OK)
     return INVALID_SIGNATURE;
+  if (use_cache) {
+    GetVerifiedSTHCache()->Add(cache_key);
+  }
   return VERIFY_OK;
 }
 
@@ -3,6 +3,8 @@
 
 #include <glog/logging.h>
 #include <stdint.h>
+#include <utility>
+#include <vector>
 
 #include "log/log_signer.h"
 #include "proto/ct.pb.h"
@@ -88,6 +90,16 @@ class LogVerifier {
     return VerifySignedCertificateTimestamp(entry, sct, NULL);
   }
 
+  // Verify the SCTs of many entries, as the above does for each one
+  // (with the same current time for all), and set |results| to the
+  // result of each, in the same order. This does not use threads of its
+  // own, callers with many SCTs can verify a batch on each of theirs.
+  void VerifyBatch(
+      const std::vector<std::pair<const ct::LogEntry*,
+                                  const ct::SignedCertificateTimestamp*>>&
+          scts,
+      std::vector<LogVerifyResult>* results) const;
+
   // Verify that the timestamp is in the given range,
   // and the signature is valid.
   // Timestamps are given in milliseconds, since January 1, 1970,
@@ -1,31 +1,75 @@
 #include "log/logged_entry.h"
 
+#include "merkletree/tree_hasher.h"
 #include "proto/cert_serializer.h"
 #include "proto/serializer.h"
 #include "util/util.h"
 
 using cert_trans::serialization::SerializeResult;
+using google::protobuf::RepeatedPtrField;
 using ct::LogEntry;
 using ct::PreCert;
 using ct::SignedCertificateTimestamp;
 using std::string;
+using std::vector;
 using util::RandomString;
 
 namespace cert_trans {
+namespace {
+
+
+RepeatedPtrField<string>* MutableChain(LogEntry* entry) {
+  switch (entry->type()) {
+    case ct::X509_ENTRY:
+      return entry->mutable_x509_entry()->mutable_certificate_chain();
+    case ct::PRECERT_ENTRY:
+      return entry->mutable_precert_entry()->mutable_precertificate_chain();
+    default:
+      return nullptr;
+  }
+}
+
+
+}  // namespace
 
 
 string LoggedEntry::Hash() const {
+  if (has_entry_hash()) {
+    return entry_hash();
+  }
   return Sha256Hasher::Sha256Digest(Serializer::LeafData(entry()));
 }
 
 
+void LoggedEntry::DropBody(const string& node_id,
+                           const vector<string>& copy_node_ids) {
+  set_entry_hash(Hash());
+  set_body_node_id(node_id);
+  for (const auto& copy_node_id : copy_node_ids) {
+    add_body_copy_node_id(copy_node_id);
+  }
+  ClearServingData();
+  mutable_contents()->clear_entry();
+  clear_chain_by_digest();
+}
+
+
 bool LoggedEntry::SerializeForLeaf(string* dst) const {
+  if (has_leaf_input()) {
+    *dst = leaf_input();
+    return true;
+  }
   return Serializer::SerializeSCTMerkleTreeLeaf(sct(), entry(), dst) ==
          SerializeResult::OK;
 }
 
 
 bool LoggedEntry::SerializeExtraData(string* dst) const {
+  if (has_extra_data()) {
+    *dst = extra_data();
+    return true;
+  }
+  CHECK(!chain_by_digest()) << "chain not expanded";
   switch (entry().type()) {
     case ct::X509_ENTRY:
       return SerializeX509Chain(entry().x509_entry(), dst) ==
@@ -48,6 +92,87 @@ bool LoggedEntry::SerializeExtraData(string* dst) const {
 }
 
 
+const string* LoggedEntry::LeafInput(string* buffer) const {
+  if (has_leaf_input()) {
+    return &leaf_input();
+  }
+  return SerializeForLeaf(CHECK_NOTNULL(buffer)) ? buffer : nullptr;
+}
+
+
+const string* LoggedEntry::ExtraData(string* buffer) const {
+  if (has_extra_data()) {
+    return &extra_data();
+  }
+  return SerializeExtraData(CHECK_NOTNULL(buffer)) ? buffer : nullptr;
+}
+
+
+bool LoggedEntry::StoreServingData() {
+  ClearServingData();
+  if (entry().type() == ct::PRECERT_ENTRY_V2) {
+    // There is no extra_data for these yet, see SerializeExtraData().
+    return true;
+  }
+  string leaf;
+  string extra;
+  if (!SerializeForLeaf(&leaf) || !SerializeExtraData(&extra)) {
+    return false;
+  }
+  mutable_leaf_input()->swap(leaf);
+  mutable_extra_data()->swap(extra);
+  return true;
+}
+
+
+void LoggedEntry::StoreMerkleLeafHash(const TreeHasher& hasher) {
+  clear_merkle_leaf_hash();
+  string leaf;
+  if (SerializeForLeaf(&leaf)) {
+    set_merkle_leaf_hash(hasher.HashLeaf(leaf));
+  }
+}
+
+
+void LoggedEntry::ReplaceChainByDigests(const StoreChainCertCallback& store) {
+  CHECK(!chain_by_digest());
+  RepeatedPtrField<string>* const chain(
+      MutableChain(mutable_contents()->mutable_entry()));
+  if (!chain) {
+    return;
+  }
+  for (string& cert : *chain) {
+    string digest(Sha256Hasher::Sha256Digest(cert));
+    store(digest, cert);
+    cert.swap(digest);
+  }
+  // The leaf_input does not depend on the chain, so it is kept.
+  clear_extra_data();
+  set_chain_by_digest(true);
+}
+
+
+bool LoggedEntry::ExpandChain(const LookupChainCertCallback& lookup) {
+  if (!chain_by_digest()) {
+    return true;
+  }
+  RepeatedPtrField<string>* const chain(
+      MutableChain(mutable_contents()->mutable_entry()));
+  CHECK_NOTNULL(chain);
+  string cert;
+  for (string& digest : *chain) {
+    if (!lookup(digest, &cert)) {
+      LOG(WARNING) << "Missing chain certificate "
+                   << util::HexString(digest);
+      return false;
+    }
+    digest.swap(cert);
+  }
+  clear_chain_by_digest();
+  return true;
+}
+
+
 bool LoggedEntry::CopyFromClientLogEntry(const AsyncLogClient::Entry& entry) {
   if (entry.leaf.timestamped_entry().entry_type() != ct::X509_ENTRY &&
       entry.leaf.timestamped_entry().entry_type() != ct::PRECERT_ENTRY &&
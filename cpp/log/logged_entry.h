@@ -2,25 +2,39 @@
 #define CERT_TRANS_LOG_LOGGED_ENTRY_H_
 
 #include <glog/logging.h>
+#include <functional>
+#include <string>
+#include <vector>
 
 #include "client/async_log_client.h"
 #include "merkletree/serial_hasher.h"
 #include "proto/ct.pb.h"
 
+class TreeHasher;
+
 namespace cert_trans {
 
 class LoggedEntry : private ct::LoggedEntryPB {
  public:
   // Pull only what is used.
+  using LoggedEntryPB::ByteSize;
   using LoggedEntryPB::Clear;
   using LoggedEntryPB::DebugString;
   using LoggedEntryPB::ParseFromArray;
   using LoggedEntryPB::ParseFromString;
   using LoggedEntryPB::SerializeToString;
   using LoggedEntryPB::Swap;
+  using LoggedEntryPB::body_copy_node_id;
+  using LoggedEntryPB::body_node_id;
   using LoggedEntryPB::clear_sequence_number;
   using LoggedEntryPB::contents;
+  using LoggedEntryPB::extra_data;
+  using LoggedEntryPB::has_body_node_id;
+  using LoggedEntryPB::has_extra_data;
+  using LoggedEntryPB::has_leaf_input;
+  using LoggedEntryPB::has_merkle_leaf_hash;
   using LoggedEntryPB::has_sequence_number;
+  using LoggedEntryPB::leaf_input;
   using LoggedEntryPB::sequence_number;
   using LoggedEntryPB::merkle_leaf_hash;
   using LoggedEntryPB::set_merkle_leaf_hash;
@@ -29,7 +43,13 @@ class LoggedEntry : private ct::LoggedEntryPB {
   void CopyFrom(const LoggedEntry& from) {
     LoggedEntryPB::CopyFrom(from);
   }
+  // Cheaper than copying, as the fields are swapped in place.
+  void Swap(LoggedEntry* other) {
+    LoggedEntryPB::Swap(other);
+  }
 
+  // The hash of the entry, which is kept along with the SCT when the
+  // entry itself is dropped by DropBody().
   std::string Hash() const;
 
   uint64_t timestamp() const {
@@ -41,6 +61,7 @@ class LoggedEntry : private ct::LoggedEntryPB {
   }
 
   ct::SignedCertificateTimestamp* mutable_sct() {
+    ClearDerivedData();
     return mutable_contents()->mutable_sct();
   }
 
@@ -49,6 +70,7 @@ class LoggedEntry : private ct::LoggedEntryPB {
   }
 
   ct::LogEntry* mutable_entry() {
+    ClearDerivedData();
     return mutable_contents()->mutable_entry();
   }
 
@@ -57,25 +79,91 @@ class LoggedEntry : private ct::LoggedEntryPB {
   }
 
   bool ParseFromDatabase(const std::string& src) {
+    ClearDerivedData();
     return mutable_contents()->ParseFromString(src);
   }
 
+  // These use the bytes stored by StoreServingData(), if any.
   bool SerializeForLeaf(std::string* dst) const;
   bool SerializeExtraData(std::string* dst) const;
 
+  // Return the stored bytes if there are any, or else serialize them
+  // into |buffer| and return that. Return nullptr on failure.
+  const std::string* LeafInput(std::string* buffer) const;
+  const std::string* ExtraData(std::string* buffer) const;
+
+  // Stores the leaf_input and extra_data served by get-entries, which
+  // are then kept with the entry in the database. Call this once the
+  // entry is sequenced, as they are dropped if the contents change.
+  bool StoreServingData();
+
+  // Computes the Merkle tree leaf hash of the entry with |hasher|, and
+  // stores it in merkle_leaf_hash, where it stays through the
+  // consistent store and the database, so that the nodes adding the
+  // entry to their tree need not hash it again. Call this once the SCT
+  // is issued, as it is dropped if the contents change. Entries that
+  // cannot be serialized are left without one.
+  void StoreMerkleLeafHash(const TreeHasher& hasher);
+
+  // Replaces each certificate of the chain by its SHA-256 digest,
+  // calling |store| with the digest and the certificate, so that a
+  // database can keep each of them only once. The extra_data, which
+  // repeats the chain, is dropped as well. Hash() is unchanged, but
+  // the entry can only be served once ExpandChain() is called.
+  typedef std::function<void(const std::string& digest,
+                             const std::string& cert)> StoreChainCertCallback;
+  void ReplaceChainByDigests(const StoreChainCertCallback& store);
+
+  // Puts back the certificates replaced by ReplaceChainByDigests(),
+  // getting them from |lookup|. Does nothing for entries that had
+  // their chain left in, and returns false if a certificate could not
+  // be found.
+  typedef std::function<bool(const std::string& digest, std::string* cert)>
+      LookupChainCertCallback;
+  bool ExpandChain(const LookupChainCertCallback& lookup);
+
+  // Drops the entry, keeping only its hash, SCT and Merkle leaf hash,
+  // and records that the node with ID |node_id| keeps the whole entry
+  // instead, with a copy on each of the nodes with IDs
+  // |copy_node_ids|, for pending entries whose body is kept out of the
+  // consistent store.
+  void DropBody(const std::string& node_id,
+                const std::vector<std::string>& copy_node_ids =
+                    std::vector<std::string>());
+
   // Note that this method will not fully populate the SCT.
   bool CopyFromClientLogEntry(const AsyncLogClient::Entry& entry);
 
   // FIXME(benl): unify with TestSigner?
   void RandomForTest();
+
+ private:
+  void ClearServingData() {
+    clear_leaf_input();
+    clear_extra_data();
+  }
+
+  // Drops everything derived from the contents, which are about to
+  // change.
+  void ClearDerivedData() {
+    ClearServingData();
+    clear_merkle_leaf_hash();
+  }
 };
 
 
 inline bool operator==(const LoggedEntry& lhs, const LoggedEntry& rhs) {
   // TODO(alcutter): Do this properly
+  // The stored serving data is derived from the contents, so whether
+  // it has been stored yet does not matter.
+  if (lhs.has_sequence_number() != rhs.has_sequence_number() ||
+      lhs.sequence_number() != rhs.sequence_number() ||
+      lhs.merkle_leaf_hash() != rhs.merkle_leaf_hash()) {
+    return false;
+  }
   std::string l_str, r_str;
-  CHECK(lhs.SerializeToString(&l_str));
-  CHECK(rhs.SerializeToString(&r_str));
+  CHECK(lhs.contents().SerializeToString(&l_str));
+  CHECK(rhs.contents().SerializeToString(&r_str));
   return l_str == r_str;
 }
 
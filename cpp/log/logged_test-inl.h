@@ -2,8 +2,11 @@
 #ifndef CERT_TRANS_LOG_LOGGED_TEST_INL_H_
 #define CERT_TRANS_LOG_LOGGED_TEST_INL_H_
 
+#include <memory>
 #include <string>
 
+#include "merkletree/serial_hasher.h"
+#include "merkletree/tree_hasher.h"
 #include "proto/cert_serializer.h"
 #include "util/testing.h"
 
@@ -97,6 +100,63 @@ TYPED_TEST(LoggedTest, DifferentMerkleSerialization) {
   EXPECT_NE(s1, s2);
 }
 
+TYPED_TEST(LoggedTest, StoredServingDataIsUsed) {
+  TypeParam l1;
+  l1.RandomForTest();
+
+  std::string leaf;
+  std::string extra;
+  EXPECT_TRUE(l1.SerializeForLeaf(&leaf));
+  EXPECT_TRUE(l1.SerializeExtraData(&extra));
+
+  EXPECT_TRUE(l1.StoreServingData());
+  EXPECT_EQ(leaf, l1.leaf_input());
+  EXPECT_EQ(extra, l1.extra_data());
+
+  std::string buffer;
+  EXPECT_EQ(&l1.leaf_input(), l1.LeafInput(&buffer));
+  EXPECT_EQ(&l1.extra_data(), l1.ExtraData(&buffer));
+  EXPECT_TRUE(buffer.empty());
+
+  // It is kept in the database along with the rest.
+  std::string d1;
+  EXPECT_TRUE(l1.SerializeToString(&d1));
+  TypeParam l2;
+  EXPECT_TRUE(l2.ParseFromString(d1));
+  EXPECT_EQ(leaf, l2.leaf_input());
+  EXPECT_EQ(extra, l2.extra_data());
+
+  // But dropped when the contents change.
+  l2.mutable_sct()->set_timestamp(l2.sct().timestamp() + 1);
+  EXPECT_FALSE(l2.has_leaf_input());
+  EXPECT_FALSE(l2.has_extra_data());
+  EXPECT_EQ(&buffer, l2.LeafInput(&buffer));
+  EXPECT_NE(leaf, buffer);
+}
+
+TYPED_TEST(LoggedTest, StoredMerkleLeafHash) {
+  TypeParam l1;
+  l1.RandomForTest();
+
+  std::string leaf;
+  EXPECT_TRUE(l1.SerializeForLeaf(&leaf));
+  const TreeHasher hasher(std::unique_ptr<SerialHasher>(new Sha256Hasher));
+  l1.StoreMerkleLeafHash(hasher);
+  EXPECT_EQ(hasher.HashLeaf(leaf), l1.merkle_leaf_hash());
+
+  // It is kept along with the serving data, and without the body.
+  EXPECT_TRUE(l1.StoreServingData());
+  EXPECT_EQ(hasher.HashLeaf(leaf), l1.merkle_leaf_hash());
+  TypeParam l2;
+  l2.CopyFrom(l1);
+  l2.DropBody("node");
+  EXPECT_EQ(hasher.HashLeaf(leaf), l2.merkle_leaf_hash());
+
+  // But dropped when the contents change.
+  l1.mutable_sct()->set_timestamp(l1.sct().timestamp() + 1);
+  EXPECT_FALSE(l1.has_merkle_leaf_hash());
+}
+
 int main(int argc, char** argv) {
   cert_trans::test::InitTesting(argv[0], &argc, &argv, true);
   ConfigureSerializerForV1CT();
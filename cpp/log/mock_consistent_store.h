@@ -50,6 +50,10 @@ class MockConsistentStore : public ConsistentStore {
                  void(const ConsistentStore::ClusterConfigCallback& cb,
                       util::Task* task));
 
+  MOCK_METHOD2_T(WatchPendingEntries,
+                 void(const ConsistentStore::PendingEntriesCallback& cb,
+                      util::Task* task));
+
   MOCK_METHOD1(SetClusterConfig, util::Status(const ct::ClusterConfig&));
 
   MOCK_METHOD0(CleanupOldEntries, util::StatusOr<int64_t>());
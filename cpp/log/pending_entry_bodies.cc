@@ -0,0 +1,388 @@
+#include "log/pending_entry_bodies.h"
+
+#include <glog/logging.h>
+#include <algorithm>
+#include <set>
+
+#include "log/database.h"
+#include "log/file_storage.h"
+#include "monitoring/monitoring.h"
+#include "net/url.h"
+#include "net/url_fetcher.h"
+#include "util/sync_task.h"
+#include "util/util.h"
+
+using std::find;
+using std::lock_guard;
+using std::min;
+using std::mutex;
+using std::remove;
+using std::set;
+using std::string;
+using std::to_string;
+using std::unique_ptr;
+using std::vector;
+using util::Status;
+using util::SyncTask;
+
+namespace cert_trans {
+namespace {
+
+
+// Number of fetches of entries from other nodes in flight at once.
+const size_t kMaxConcurrentFetches = 256;
+
+
+Counter<string>* pending_entry_bodies_fetched = Counter<string>::New(
+    "pending_entry_bodies_fetched", "source",
+    "Number of pending entries got back from where their body was kept, "
+    "broken down by whether that was this node or another.");
+
+Counter<bool>* pending_entry_bodies_copies = Counter<bool>::New(
+    "pending_entry_bodies_copies", "successful",
+    "Number of copies of batches of pending entries made to other nodes, "
+    "broken down by success.");
+
+Counter<>* pending_entry_bodies_removed = Counter<>::New(
+    "pending_entry_bodies_removed",
+    "Number of pending entries kept here removed once in the serving STH.");
+
+
+}  // namespace
+
+
+PendingEntryBodies::PendingEntryBodies(const string& node_id,
+                                       FileStorage* storage,
+                                       UrlFetcher* fetcher,
+                                       util::Executor* executor,
+                                       const string& path_prefix)
+    : node_id_(node_id),
+      storage_(storage),
+      fetcher_(CHECK_NOTNULL(fetcher)),
+      executor_(CHECK_NOTNULL(executor)),
+      path_prefix_(path_prefix),
+      next_copy_node_(0) {
+  CHECK(!node_id_.empty());
+}
+
+
+PendingEntryBodies::~PendingEntryBodies() {
+}
+
+
+void PendingEntryBodies::SetNodes(const NodeLookup& lookup,
+                                  const NodeList& list) {
+  lock_guard<mutex> lock(lock_);
+  lookup_ = lookup;
+  list_ = list;
+}
+
+
+Status PendingEntryBodies::Keep(const vector<const LoggedEntry*>& entries,
+                                vector<LoggedEntry>* stubs) {
+  CHECK(KeepsBodies());
+  CHECK_NOTNULL(stubs)->clear();
+  vector<string> flat_entries(entries.size());
+  for (size_t i = 0; i < entries.size(); ++i) {
+    CHECK(entries[i]->SerializeToString(&flat_entries[i]));
+    const Status status(Store(entries[i]->Hash(), flat_entries[i]));
+    if (!status.ok()) {
+      return status;
+    }
+  }
+  storage_->Sync();
+
+  vector<string> copy_node_ids;
+  const Status status(CopyToOtherNodes(flat_entries, &copy_node_ids));
+  if (!status.ok()) {
+    return status;
+  }
+
+  stubs->resize(entries.size());
+  for (size_t i = 0; i < entries.size(); ++i) {
+    (*stubs)[i].CopyFrom(*entries[i]);
+    (*stubs)[i].DropBody(node_id_, copy_node_ids);
+  }
+  return ::util::OkStatus();
+}
+
+
+Status PendingEntryBodies::KeepCopy(const string& flat_entry) {
+  CHECK(KeepsBodies());
+  LoggedEntry entry;
+  if (!entry.ParseFromString(flat_entry) || entry.has_body_node_id()) {
+    return Status(util::error::INVALID_ARGUMENT, "bad pending entry");
+  }
+  const Status status(Store(entry.Hash(), flat_entry));
+  if (status.ok()) {
+    storage_->Sync();
+  }
+  return status;
+}
+
+
+Status PendingEntryBodies::Store(const string& hash,
+                                 const string& flat_entry) {
+  const Status status(storage_->CreateEntry(hash, flat_entry));
+  // The same entry may be submitted again before it is sequenced.
+  if (!status.ok() && status.CanonicalCode() != util::error::ALREADY_EXISTS) {
+    return status;
+  }
+  return ::util::OkStatus();
+}
+
+
+Status PendingEntryBodies::CopyToOtherNodes(const vector<string>& flat_entries,
+                                            vector<string>* node_ids) {
+  CHECK_NOTNULL(node_ids)->clear();
+  NodeLookup lookup;
+  NodeList list;
+  {
+    lock_guard<mutex> lock(lock_);
+    lookup = lookup_;
+    list = list_;
+  }
+  if (!list) {
+    return Status(util::error::UNAVAILABLE, "cluster nodes not known yet");
+  }
+
+  vector<string> others(list());
+  others.erase(remove(others.begin(), others.end(), node_id_), others.end());
+  // Along with this node, a majority of the nodes up.
+  const size_t wanted((others.size() + 1) / 2);
+  if (wanted == 0) {
+    return ::util::OkStatus();
+  }
+
+  const size_t first(next_copy_node_++);
+  for (size_t i = 0; i < others.size() && node_ids->size() < wanted; ++i) {
+    const string& node_id(others[(first + i) % others.size()]);
+    const Status status(CopyToNode(lookup, node_id, flat_entries));
+    pending_entry_bodies_copies->Increment(status.ok());
+    if (!status.ok()) {
+      LOG(WARNING) << "Couldn't copy pending entries to node " << node_id
+                   << ": " << status;
+      continue;
+    }
+    node_ids->push_back(node_id);
+  }
+  if (node_ids->size() < wanted) {
+    return Status(util::error::UNAVAILABLE,
+                  "pending entries copied to " +
+                      to_string(node_ids->size()) + " other nodes, of " +
+                      to_string(wanted) + " needed");
+  }
+  return ::util::OkStatus();
+}
+
+
+Status PendingEntryBodies::CopyToNode(const NodeLookup& lookup,
+                                      const string& node_id,
+                                      const vector<string>& flat_entries) {
+  UrlFetcher::Request request;
+  if (!NodeUrl(lookup, node_id, "/ct/v1/internal/add-pending-entry",
+               &request.url)) {
+    return Status(util::error::UNAVAILABLE, "unknown node " + node_id);
+  }
+  request.verb = UrlFetcher::Verb::POST;
+
+  for (size_t begin = 0; begin < flat_entries.size();
+       begin += kMaxConcurrentFetches) {
+    const size_t end(min(flat_entries.size(), begin + kMaxConcurrentFetches));
+    vector<UrlFetcher::Response> responses(end - begin);
+    vector<unique_ptr<SyncTask>> tasks;
+    tasks.reserve(end - begin);
+    for (size_t i = begin; i < end; ++i) {
+      request.body = flat_entries[i];
+      tasks.emplace_back(new SyncTask(executor_));
+      fetcher_->Fetch(request, &responses[i - begin], tasks.back()->task());
+    }
+
+    // All the copies are waited for, even once one of them failed.
+    Status status;
+    for (size_t i = 0; i < tasks.size(); ++i) {
+      tasks[i]->Wait();
+      if (!status.ok()) {
+        continue;
+      }
+      if (!tasks[i]->status().ok()) {
+        status = tasks[i]->status();
+      } else if (responses[i].status_code != 200) {
+        status = Status(util::error::UNAVAILABLE,
+                        "copying pending entry returned " +
+                            to_string(responses[i].status_code));
+      }
+    }
+    if (!status.ok()) {
+      return status;
+    }
+  }
+  return ::util::OkStatus();
+}
+
+
+bool PendingEntryBodies::NodeUrl(const NodeLookup& lookup,
+                                 const string& node_id, const string& path,
+                                 URL* url) const {
+  string host;
+  int port;
+  if (!lookup || !lookup(node_id, &host, &port)) {
+    return false;
+  }
+  *url = URL("http://" + host + ":" + to_string(port) + path_prefix_ + path);
+  return true;
+}
+
+
+Status PendingEntryBodies::Lookup(const string& hash, string* entry) const {
+  if (!KeepsBodies()) {
+    return Status(util::error::NOT_FOUND, "pending entries not kept here");
+  }
+  return storage_->LookupEntry(hash, entry);
+}
+
+
+void PendingEntryBodies::Expand(vector<EntryHandle<LoggedEntry>>* entries,
+                                vector<Status>* statuses) const {
+  CHECK_NOTNULL(entries);
+  CHECK_NOTNULL(statuses)->assign(entries->size(), ::util::OkStatus());
+
+  NodeLookup lookup;
+  {
+    lock_guard<mutex> lock(lock_);
+    lookup = lookup_;
+  }
+
+  // Replaces the stub |i| by the serialized entry |body|.
+  const auto expand([entries](size_t i, const string& body) {
+    LoggedEntry* const stub((*entries)[i].MutableEntry());
+    LoggedEntry entry;
+    if (!entry.ParseFromString(body) || entry.Hash() != stub->Hash()) {
+      return Status(util::error::DATA_LOSS, "bad pending entry");
+    }
+    stub->Swap(&entry);
+    return ::util::OkStatus();
+  });
+
+  // The stubs to fetch, with the other nodes that have them, in the
+  // order to try them in, and the next one to try.
+  vector<size_t> to_fetch;
+  vector<vector<string>> sources(entries->size());
+  vector<size_t> next_source(entries->size(), 0);
+  for (size_t i = 0; i < entries->size(); ++i) {
+    const LoggedEntry& stub((*entries)[i].Entry());
+    if (!stub.has_body_node_id()) {
+      continue;
+    }
+    vector<string> node_ids{stub.body_node_id()};
+    node_ids.insert(node_ids.end(), stub.body_copy_node_id().begin(),
+                    stub.body_copy_node_id().end());
+    if (find(node_ids.begin(), node_ids.end(), node_id_) != node_ids.end()) {
+      string body;
+      Status status(Lookup(stub.Hash(), &body));
+      if (status.ok()) {
+        status = expand(i, body);
+      }
+      if (status.ok()) {
+        pending_entry_bodies_fetched->Increment("local");
+        continue;
+      }
+      LOG(WARNING) << "Pending entry " << util::ToBase64(stub.Hash())
+                   << " not kept here: " << status;
+      (*statuses)[i] = status;
+    }
+    for (const auto& node_id : node_ids) {
+      if (node_id != node_id_) {
+        sources[i].push_back(node_id);
+      }
+    }
+    if (sources[i].empty()) {
+      continue;
+    }
+    to_fetch.push_back(i);
+  }
+
+  while (!to_fetch.empty()) {
+    // Those to try the next node for.
+    vector<size_t> failed;
+    for (size_t begin = 0; begin < to_fetch.size();
+         begin += kMaxConcurrentFetches) {
+      const size_t end(min(to_fetch.size(), begin + kMaxConcurrentFetches));
+      vector<UrlFetcher::Response> responses(end - begin);
+      vector<unique_ptr<SyncTask>> tasks(end - begin);
+      for (size_t j = begin; j < end; ++j) {
+        const size_t i(to_fetch[j]);
+        const string& node_id(sources[i][next_source[i]]);
+        URL url;
+        if (!NodeUrl(lookup, node_id,
+                     "/ct/v1/internal/get-pending-entry?hash=" +
+                         util::HexString((*entries)[i].Entry().Hash()),
+                     &url)) {
+          (*statuses)[i] =
+              Status(util::error::UNAVAILABLE, "unknown node " + node_id);
+          continue;
+        }
+        tasks[j - begin].reset(new SyncTask(executor_));
+        fetcher_->Fetch(UrlFetcher::Request(url), &responses[j - begin],
+                        tasks[j - begin]->task());
+      }
+
+      for (size_t j = begin; j < end; ++j) {
+        const size_t i(to_fetch[j]);
+        SyncTask* const task(tasks[j - begin].get());
+        if (task) {
+          task->Wait();
+          if (!task->status().ok()) {
+            (*statuses)[i] = task->status();
+          } else if (responses[j - begin].status_code != 200) {
+            (*statuses)[i] = Status(
+                util::error::UNAVAILABLE,
+                "fetching pending entry from node " +
+                    sources[i][next_source[i]] + " returned " +
+                    to_string(responses[j - begin].status_code));
+          } else {
+            (*statuses)[i] = expand(i, responses[j - begin].body);
+          }
+          if ((*statuses)[i].ok()) {
+            pending_entry_bodies_fetched->Increment("remote");
+            continue;
+          }
+        }
+        LOG(WARNING) << "Couldn't get pending entry "
+                     << util::ToBase64((*entries)[i].Entry().Hash())
+                     << " from node " << sources[i][next_source[i]] << ": "
+                     << (*statuses)[i];
+        if (++next_source[i] < sources[i].size()) {
+          failed.push_back(i);
+        }
+      }
+    }
+    to_fetch.swap(failed);
+  }
+}
+
+
+int64_t PendingEntryBodies::RemoveSequenced(const ReadOnlyDatabase& db,
+                                            int64_t tree_size) {
+  if (!KeepsBodies()) {
+    return 0;
+  }
+  int64_t num_removed(0);
+  const set<string> hashes(storage_->Scan());
+  for (const auto& hash : hashes) {
+    LoggedEntry entry;
+    if (db.LookupByHash(hash, &entry) != ReadOnlyDatabase::LOOKUP_OK ||
+        entry.sequence_number() >= tree_size) {
+      continue;
+    }
+    // It may have been removed by a concurrent call.
+    if (storage_->DeleteEntry(hash).ok()) {
+      ++num_removed;
+    }
+  }
+  pending_entry_bodies_removed->IncrementBy(num_removed);
+  return num_removed;
+}
+
+
+}  // namespace cert_trans
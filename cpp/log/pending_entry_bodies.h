@@ -0,0 +1,133 @@
+#ifndef CERT_TRANS_LOG_PENDING_ENTRY_BODIES_H_
+#define CERT_TRANS_LOG_PENDING_ENTRY_BODIES_H_
+
+#include <stdint.h>
+#include <atomic>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include "log/consistent_store.h"
+#include "log/logged_entry.h"
+#include "util/executor.h"
+#include "util/status.h"
+
+namespace cert_trans {
+
+class FileStorage;
+class ReadOnlyDatabase;
+class URL;
+class UrlFetcher;
+
+
+// Keeps the pending entries added by this node on local disk, so that
+// only their hash and SCT, with the ID of this node, have to go in the
+// consistent store (see LoggedEntry::DropBody()), and gets the entries
+// back for those, from the local disk or from the node that kept them,
+// which serves them at "/ct/v1/internal/get-pending-entry".
+//
+// So that losing a node loses none of them, the entries are copied to
+// other nodes, which take them at "/ct/v1/internal/add-pending-entry",
+// before they go in the consistent store, and are got from those if
+// need be. They are removed by RemoveSequenced() once in the serving
+// STH.
+//
+// This class is thread-safe.
+class PendingEntryBodies {
+ public:
+  // Sets |host| and |port| to where the node with ID |node_id| serves
+  // its requests, or returns false if it is not known.
+  typedef std::function<bool(const std::string& node_id, std::string* host,
+                             int* port)> NodeLookup;
+  // Returns the IDs of the nodes of the cluster which are up.
+  typedef std::function<std::vector<std::string>()> NodeList;
+
+  // The entries of this node, with ID |node_id|, are kept in
+  // |storage|, of which ownership is taken, unless it is null, in
+  // which case they are left whole. Those of other nodes are fetched
+  // through |fetcher|, from the log at |path_prefix| on the node, with
+  // their callbacks run on |executor|. Ownership of |fetcher| and
+  // |executor| is not taken.
+  PendingEntryBodies(const std::string& node_id, FileStorage* storage,
+                     UrlFetcher* fetcher, util::Executor* executor,
+                     const std::string& path_prefix);
+  ~PendingEntryBodies();
+  PendingEntryBodies(const PendingEntryBodies&) = delete;
+  PendingEntryBodies& operator=(const PendingEntryBodies&) = delete;
+
+  // Must be called before entries can be kept, or those of other
+  // nodes fetched, which fails until then.
+  void SetNodes(const NodeLookup& lookup, const NodeList& list);
+
+  // Whether the entries of this node are kept here, rather than going
+  // whole to the consistent store.
+  bool KeepsBodies() const {
+    return storage_ != nullptr;
+  }
+
+  const std::string& node_id() const {
+    return node_id_;
+  }
+
+  // Keeps |entries|, durably once this returns, here and on enough of
+  // the other nodes up for a majority of them all to have them, and
+  // sets |stubs| to what to put in the consistent store in their
+  // place. Must only be called if KeepsBodies().
+  util::Status Keep(const std::vector<const LoggedEntry*>& entries,
+                    std::vector<LoggedEntry>* stubs);
+
+  // Keeps the serialized entry |flat_entry|, copied here by the node
+  // which added it. Must only be called if KeepsBodies().
+  util::Status KeepCopy(const std::string& flat_entry);
+
+  // Sets |entry| to the serialized entry with hash |hash| kept here.
+  util::Status Lookup(const std::string& hash, std::string* entry) const;
+
+  // Replaces the entries of |entries| which were put in the consistent
+  // store without their body by the whole entry, setting
+  // (*statuses)[i] to whether entries[i] could be: those which cannot
+  // are left as they are. The fetches from other nodes are all in
+  // flight at once, going to the nodes with a copy in turn for those
+  // which fail.
+  void Expand(std::vector<EntryHandle<LoggedEntry>>* entries,
+              std::vector<util::Status>* statuses) const;
+
+  // Removes the entries kept here which are in |db| with a sequence
+  // number below |tree_size|, that of the serving STH, as no node
+  // needs them anymore. Returns how many there were.
+  int64_t RemoveSequenced(const ReadOnlyDatabase& db, int64_t tree_size);
+
+ private:
+  util::Status Store(const std::string& hash, const std::string& flat_entry);
+  // Copies |flat_entries| to enough other nodes for Keep(), setting
+  // |node_ids| to those.
+  util::Status CopyToOtherNodes(const std::vector<std::string>& flat_entries,
+                                std::vector<std::string>* node_ids);
+  util::Status CopyToNode(const NodeLookup& lookup, const std::string& node_id,
+                          const std::vector<std::string>& flat_entries);
+  // Sets |url| to that of |path| on the node with ID |node_id|, or
+  // returns false if it is not known.
+  bool NodeUrl(const NodeLookup& lookup, const std::string& node_id,
+               const std::string& path, URL* url) const;
+
+  const std::string node_id_;
+  const std::unique_ptr<FileStorage> storage_;
+  UrlFetcher* const fetcher_;
+  util::Executor* const executor_;
+  const std::string path_prefix_;
+
+  // Where to start in the list of the other nodes for the next copy,
+  // so that the copies are spread over them.
+  std::atomic<size_t> next_copy_node_;
+
+  mutable std::mutex lock_;
+  NodeLookup lookup_;
+  NodeList list_;
+};
+
+
+}  // namespace cert_trans
+
+#endif  // CERT_TRANS_LOG_PENDING_ENTRY_BODIES_H_
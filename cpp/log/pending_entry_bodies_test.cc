@@ -0,0 +1,290 @@
+#include "log/pending_entry_bodies.h"
+
+#include <gmock/gmock.h>
+#include <gtest/gtest.h>
+#include <sys/stat.h>
+#include <string>
+#include <vector>
+
+#include "log/file_db.h"
+#include "log/file_storage.h"
+#include "net/mock_url_fetcher.h"
+#include "proto/cert_serializer.h"
+#include "util/status_test_util.h"
+#include "util/test_db.h"
+#include "util/testing.h"
+#include "util/thread_pool.h"
+#include "util/util.h"
+
+namespace cert_trans {
+namespace {
+
+using std::string;
+using std::vector;
+using testing::_;
+using testing::ElementsAre;
+using testing::Invoke;
+using util::Task;
+using util::testing::StatusIs;
+
+const char kNodeId[] = "node-a";
+const char kOtherNodeId[] = "node-b";
+const char kThirdNodeId[] = "node-c";
+
+
+class PendingEntryBodiesTest : public ::testing::Test {
+ protected:
+  PendingEntryBodiesTest()
+      : bodies_(kNodeId, new FileStorage(tmp_.TmpStorageDir(), 3),
+                &fetcher_, &pool_, "/2019"),
+        nodes_{kNodeId} {
+    bodies_.SetNodes(
+        [](const string& node_id, string* host, int* port) {
+          if (node_id != kOtherNodeId) {
+            return false;
+          }
+          *host = "other";
+          *port = 8080;
+          return true;
+        },
+        [this]() { return nodes_; });
+  }
+
+  static LoggedEntry RandomEntry() {
+    LoggedEntry entry;
+    entry.RandomForTest();
+    entry.clear_sequence_number();
+    return entry;
+  }
+
+  static EntryHandle<LoggedEntry> Handle(const LoggedEntry& entry) {
+    EntryHandle<LoggedEntry> handle;
+    handle.MutableEntry()->CopyFrom(entry);
+    return handle;
+  }
+
+  TmpStorage tmp_;
+  ThreadPool pool_;
+  MockUrlFetcher fetcher_;
+  PendingEntryBodies bodies_;
+  // The nodes up, as returned to |bodies_|.
+  vector<string> nodes_;
+};
+
+
+TEST_F(PendingEntryBodiesTest, KeepsEntriesAndMakesStubs) {
+  const LoggedEntry entry(RandomEntry());
+  vector<LoggedEntry> stubs;
+  ASSERT_OK(bodies_.Keep({&entry}, &stubs));
+  ASSERT_EQ(1U, stubs.size());
+  EXPECT_EQ(kNodeId, stubs[0].body_node_id());
+  EXPECT_EQ(entry.Hash(), stubs[0].Hash());
+  EXPECT_EQ(entry.sct().SerializeAsString(),
+            stubs[0].sct().SerializeAsString());
+  EXPECT_TRUE(stubs[0].body_copy_node_id().empty());
+  EXPECT_FALSE(stubs[0].contents().has_entry());
+  EXPECT_LT(stubs[0].ByteSize(), entry.ByteSize());
+
+  string flat_entry;
+  ASSERT_OK(bodies_.Lookup(entry.Hash(), &flat_entry));
+  LoggedEntry kept;
+  ASSERT_TRUE(kept.ParseFromString(flat_entry));
+  EXPECT_EQ(entry, kept);
+
+  // Keeping it again, for a resubmission, is fine.
+  EXPECT_OK(bodies_.Keep({&entry}, &stubs));
+  EXPECT_THAT(bodies_.Lookup("nope", &flat_entry),
+              StatusIs(util::error::NOT_FOUND));
+}
+
+
+TEST_F(PendingEntryBodiesTest, ExpandsStubs) {
+  const LoggedEntry local(RandomEntry());
+  const LoggedEntry remote(RandomEntry());
+  const LoggedEntry whole(RandomEntry());
+  vector<LoggedEntry> stubs;
+  ASSERT_OK(bodies_.Keep({&local}, &stubs));
+  LoggedEntry remote_stub;
+  remote_stub.CopyFrom(remote);
+  remote_stub.DropBody(kOtherNodeId);
+
+  EXPECT_CALL(fetcher_, Fetch(_, _, _))
+      .WillOnce(Invoke([&remote](const UrlFetcher::Request& req,
+                                 UrlFetcher::Response* resp, Task* task) {
+        EXPECT_EQ("other", req.url.Host());
+        EXPECT_EQ(8080, req.url.Port());
+        EXPECT_EQ("/2019/ct/v1/internal/get-pending-entry", req.url.Path());
+        EXPECT_EQ("hash=" + util::HexString(remote.Hash()), req.url.Query());
+        resp->status_code = 200;
+        CHECK(remote.SerializeToString(&resp->body));
+        task->Return();
+      }));
+
+  vector<EntryHandle<LoggedEntry>> entries{Handle(stubs[0]),
+                                           Handle(remote_stub),
+                                           Handle(whole)};
+  vector<util::Status> statuses;
+  bodies_.Expand(&entries, &statuses);
+  ASSERT_EQ(3U, statuses.size());
+  EXPECT_OK(statuses[0]);
+  EXPECT_OK(statuses[1]);
+  EXPECT_OK(statuses[2]);
+  EXPECT_EQ(local, entries[0].Entry());
+  EXPECT_EQ(remote, entries[1].Entry());
+  EXPECT_EQ(whole, entries[2].Entry());
+}
+
+
+TEST_F(PendingEntryBodiesTest, FailsForUnknownNode) {
+  LoggedEntry stub(RandomEntry());
+  stub.DropBody(kThirdNodeId);
+  vector<EntryHandle<LoggedEntry>> entries{Handle(stub)};
+  vector<util::Status> statuses;
+  bodies_.Expand(&entries, &statuses);
+  ASSERT_EQ(1U, statuses.size());
+  EXPECT_THAT(statuses[0], StatusIs(util::error::UNAVAILABLE));
+  EXPECT_EQ(stub, entries[0].Entry());
+}
+
+
+TEST_F(PendingEntryBodiesTest, CopiesEntriesToAnotherNode) {
+  nodes_ = {kNodeId, kOtherNodeId, kThirdNodeId};
+  const LoggedEntry entry(RandomEntry());
+
+  EXPECT_CALL(fetcher_, Fetch(_, _, _))
+      .WillOnce(Invoke([&entry](const UrlFetcher::Request& req,
+                                UrlFetcher::Response* resp, Task* task) {
+        EXPECT_EQ(UrlFetcher::Verb::POST, req.verb);
+        EXPECT_EQ("other", req.url.Host());
+        EXPECT_EQ("/2019/ct/v1/internal/add-pending-entry", req.url.Path());
+        LoggedEntry copy;
+        EXPECT_TRUE(copy.ParseFromString(req.body));
+        EXPECT_EQ(entry, copy);
+        resp->status_code = 200;
+        task->Return();
+      }));
+
+  // Along with this one, two of the three nodes have it: node-c is
+  // not known, so node-b has to be copied to.
+  vector<LoggedEntry> stubs;
+  ASSERT_OK(bodies_.Keep({&entry}, &stubs));
+  ASSERT_EQ(1U, stubs.size());
+  EXPECT_EQ(kNodeId, stubs[0].body_node_id());
+  EXPECT_THAT(stubs[0].body_copy_node_id(), ElementsAre(kOtherNodeId));
+}
+
+
+TEST_F(PendingEntryBodiesTest, FailsToKeepWithoutEnoughCopies) {
+  nodes_ = {kNodeId, kOtherNodeId};
+  const LoggedEntry entry(RandomEntry());
+
+  EXPECT_CALL(fetcher_, Fetch(_, _, _))
+      .WillOnce(Invoke([](const UrlFetcher::Request&,
+                          UrlFetcher::Response* resp, Task* task) {
+        resp->status_code = 500;
+        task->Return();
+      }));
+
+  vector<LoggedEntry> stubs;
+  EXPECT_THAT(bodies_.Keep({&entry}, &stubs),
+              StatusIs(util::error::UNAVAILABLE));
+  EXPECT_TRUE(stubs.empty());
+}
+
+
+TEST_F(PendingEntryBodiesTest, KeepsCopies) {
+  const LoggedEntry entry(RandomEntry());
+  string flat_entry;
+  ASSERT_TRUE(entry.SerializeToString(&flat_entry));
+  ASSERT_OK(bodies_.KeepCopy(flat_entry));
+
+  string kept;
+  ASSERT_OK(bodies_.Lookup(entry.Hash(), &kept));
+  EXPECT_EQ(flat_entry, kept);
+
+  LoggedEntry stub;
+  stub.CopyFrom(entry);
+  stub.DropBody(kOtherNodeId);
+  ASSERT_TRUE(stub.SerializeToString(&flat_entry));
+  EXPECT_THAT(bodies_.KeepCopy(flat_entry),
+              StatusIs(util::error::INVALID_ARGUMENT));
+  EXPECT_THAT(bodies_.KeepCopy("garbage"),
+              StatusIs(util::error::INVALID_ARGUMENT));
+}
+
+
+TEST_F(PendingEntryBodiesTest, ExpandsFromCopies) {
+  const LoggedEntry entry(RandomEntry());
+  LoggedEntry stub;
+  stub.CopyFrom(entry);
+  // The node which kept it is gone, but node-b has a copy.
+  stub.DropBody(kThirdNodeId, {kOtherNodeId});
+
+  EXPECT_CALL(fetcher_, Fetch(_, _, _))
+      .WillOnce(Invoke([&entry](const UrlFetcher::Request& req,
+                                UrlFetcher::Response* resp, Task* task) {
+        EXPECT_EQ("other", req.url.Host());
+        EXPECT_EQ("/2019/ct/v1/internal/get-pending-entry", req.url.Path());
+        resp->status_code = 200;
+        CHECK(entry.SerializeToString(&resp->body));
+        task->Return();
+      }));
+
+  vector<EntryHandle<LoggedEntry>> entries{Handle(stub)};
+  vector<util::Status> statuses;
+  bodies_.Expand(&entries, &statuses);
+  ASSERT_EQ(1U, statuses.size());
+  EXPECT_OK(statuses[0]);
+  EXPECT_EQ(entry, entries[0].Entry());
+}
+
+
+TEST_F(PendingEntryBodiesTest, RemovesSequencedEntries) {
+  TmpStorage db_tmp;
+  const string certs_dir(db_tmp.TmpStorageDir() + "/certs");
+  const string tree_dir(db_tmp.TmpStorageDir() + "/tree");
+  const string meta_dir(db_tmp.TmpStorageDir() + "/meta");
+  CHECK_ERR(mkdir(certs_dir.c_str(), 0700));
+  CHECK_ERR(mkdir(tree_dir.c_str(), 0700));
+  CHECK_ERR(mkdir(meta_dir.c_str(), 0700));
+  FileDB db(new FileStorage(certs_dir, 3), new FileStorage(tree_dir, 8),
+            new FileStorage(meta_dir, 0));
+
+  const LoggedEntry served(RandomEntry());
+  const LoggedEntry unserved(RandomEntry());
+  const LoggedEntry pending(RandomEntry());
+  vector<LoggedEntry> stubs;
+  ASSERT_OK(bodies_.Keep({&served, &unserved, &pending}, &stubs));
+
+  LoggedEntry sequenced;
+  sequenced.CopyFrom(served);
+  sequenced.set_sequence_number(0);
+  ASSERT_EQ(Database::OK, db.CreateSequencedEntry(sequenced));
+  sequenced.CopyFrom(unserved);
+  sequenced.set_sequence_number(1);
+  ASSERT_EQ(Database::OK, db.CreateSequencedEntry(sequenced));
+
+  // Only the first entry is in the serving STH.
+  EXPECT_EQ(1, bodies_.RemoveSequenced(db, 1));
+  string flat_entry;
+  EXPECT_THAT(bodies_.Lookup(served.Hash(), &flat_entry),
+              StatusIs(util::error::NOT_FOUND));
+  EXPECT_OK(bodies_.Lookup(unserved.Hash(), &flat_entry));
+  EXPECT_OK(bodies_.Lookup(pending.Hash(), &flat_entry));
+
+  EXPECT_EQ(1, bodies_.RemoveSequenced(db, 2));
+  EXPECT_THAT(bodies_.Lookup(unserved.Hash(), &flat_entry),
+              StatusIs(util::error::NOT_FOUND));
+  EXPECT_OK(bodies_.Lookup(pending.Hash(), &flat_entry));
+}
+
+
+}  // namespace
+}  // namespace cert_trans
+
+
+int main(int argc, char** argv) {
+  cert_trans::test::InitTesting(argv[0], &argc, &argv, true);
+  ConfigureSerializerForV1CT();
+  return RUN_ALL_TESTS();
+}
@@ -0,0 +1,390 @@
+#include "log/precert_tbs.h"
+
+#include <glog/logging.h>
+#include <openssl/asn1.h>
+#include <openssl/objects.h>
+#include <vector>
+
+#include "log/cert.h"
+
+using std::string;
+using std::vector;
+using util::Status;
+
+namespace cert_trans {
+namespace {
+
+
+const unsigned char kSequenceTag = 0x30;
+const unsigned char kIntegerTag = 0x02;
+const unsigned char kBooleanTag = 0x01;
+const unsigned char kOctetStringTag = 0x04;
+const unsigned char kObjectTag = 0x06;
+const unsigned char kVersionTag = 0xa0;
+const unsigned char kExtensionsTag = 0xa3;
+
+
+// A DER element of a buffer, with its contents from |content| to
+// |end|.
+struct Element {
+  unsigned char tag;
+  size_t start;
+  size_t content;
+  size_t end;
+};
+
+
+struct Extension {
+  Element element;
+  Element object;
+  // Set if the extension is marked critical.
+  bool critical;
+  Element critical_element;
+  Element value;
+};
+
+
+// The parts of a TBSCertificate that get spliced.
+struct TbsParts {
+  Element tbs;
+  Element issuer;
+  Element extensions;
+  vector<Extension> extension_list;
+};
+
+
+// Reads the element of |der| at |pos|, which must end by |limit|. As
+// the result has to be what encoding the certificate again would
+// give, only DER is accepted: low tag numbers, and lengths in as few
+// bytes as possible.
+bool ReadElement(const string& der, size_t pos, size_t limit,
+                 Element* element) {
+  if (pos >= limit || limit - pos < 2) {
+    return false;
+  }
+  const unsigned char tag(der[pos]);
+  if ((tag & 0x1f) == 0x1f) {
+    return false;
+  }
+
+  size_t length(static_cast<unsigned char>(der[pos + 1]));
+  size_t content(pos + 2);
+  if (length & 0x80) {
+    const size_t num_bytes(length & 0x7f);
+    if (num_bytes == 0 || num_bytes > 4 || limit - content < num_bytes ||
+        der[content] == 0) {
+      return false;
+    }
+    length = 0;
+    for (size_t i = 0; i < num_bytes; ++i) {
+      length = (length << 8) | static_cast<unsigned char>(der[content + i]);
+    }
+    content += num_bytes;
+    if (length < 0x80) {
+      return false;
+    }
+  }
+  if (length > limit - content) {
+    return false;
+  }
+
+  element->tag = tag;
+  element->start = pos;
+  element->content = content;
+  element->end = content + length;
+  return true;
+}
+
+
+// Reads the element of |der| at |*pos|, which must have tag |tag|,
+// and moves |*pos| past it.
+bool ReadTagged(const string& der, unsigned char tag, size_t* pos,
+                size_t limit, Element* element) {
+  if (!ReadElement(der, *pos, limit, element) || element->tag != tag) {
+    return false;
+  }
+  *pos = element->end;
+  return true;
+}
+
+
+bool ParseExtension(const string& der, const Element& element,
+                    Extension* extension) {
+  extension->element = element;
+  size_t pos(element.content);
+  if (!ReadTagged(der, kObjectTag, &pos, element.end, &extension->object)) {
+    return false;
+  }
+
+  extension->critical = false;
+  Element next;
+  if (!ReadElement(der, pos, element.end, &next)) {
+    return false;
+  }
+  if (next.tag == kBooleanTag) {
+    // The default (false) is not encoded in DER.
+    if (next.end - next.content != 1 ||
+        static_cast<unsigned char>(der[next.content]) != 0xff) {
+      return false;
+    }
+    extension->critical = true;
+    extension->critical_element = next;
+    pos = next.end;
+  }
+
+  return ReadTagged(der, kOctetStringTag, &pos, element.end,
+                    &extension->value) &&
+         pos == element.end;
+}
+
+
+bool ParseTbs(const string& der, TbsParts* parts) {
+  if (!ReadElement(der, 0, der.size(), &parts->tbs) ||
+      parts->tbs.tag != kSequenceTag || parts->tbs.end != der.size()) {
+    return false;
+  }
+  const size_t end(parts->tbs.end);
+  size_t pos(parts->tbs.content);
+
+  Element element;
+  if (!ReadElement(der, pos, end, &element)) {
+    return false;
+  }
+  if (element.tag == kVersionTag) {
+    pos = element.end;
+  }
+  // The serial number, signature algorithm, issuer, validity, subject
+  // and public key.
+  if (!ReadTagged(der, kIntegerTag, &pos, end, &element) ||
+      !ReadTagged(der, kSequenceTag, &pos, end, &element) ||
+      !ReadTagged(der, kSequenceTag, &pos, end, &parts->issuer) ||
+      !ReadTagged(der, kSequenceTag, &pos, end, &element) ||
+      !ReadTagged(der, kSequenceTag, &pos, end, &element) ||
+      !ReadTagged(der, kSequenceTag, &pos, end, &element)) {
+    return false;
+  }
+
+  // Skip the unique identifiers, if any.
+  while (true) {
+    if (!ReadElement(der, pos, end, &element)) {
+      return false;
+    }
+    if (element.tag == kExtensionsTag) {
+      break;
+    }
+    if (element.tag != 0x81 && element.tag != 0x82) {
+      return false;
+    }
+    pos = element.end;
+  }
+  parts->extensions = element;
+  if (parts->extensions.end != end) {
+    return false;
+  }
+
+  Element list;
+  pos = parts->extensions.content;
+  if (!ReadTagged(der, kSequenceTag, &pos, end, &list) || pos != end) {
+    return false;
+  }
+  pos = list.content;
+  while (pos < list.end) {
+    parts->extension_list.emplace_back();
+    if (!ReadTagged(der, kSequenceTag, &pos, list.end, &element) ||
+        !ParseExtension(der, element, &parts->extension_list.back())) {
+      return false;
+    }
+  }
+  return true;
+}
+
+
+void AppendElement(unsigned char tag, const string& content, string* out) {
+  out->push_back(tag);
+  const size_t length(content.size());
+  if (length < 0x80) {
+    out->push_back(static_cast<char>(length));
+  } else {
+    string length_bytes;
+    for (size_t l = length; l > 0; l >>= 8) {
+      length_bytes.insert(length_bytes.begin(), static_cast<char>(l & 0xff));
+    }
+    out->push_back(static_cast<char>(0x80 | length_bytes.size()));
+    out->append(length_bytes);
+  }
+  out->append(content);
+}
+
+
+string Bytes(const string& der, const Element& element) {
+  return der.substr(element.start, element.end - element.start);
+}
+
+
+// Returns the DER encoding of the object identifier of |nid|, or an
+// empty string if it is not known.
+string ObjectEncoding(int nid) {
+  ASN1_OBJECT* const object(OBJ_nid2obj(nid));
+  if (!object) {
+    return string();
+  }
+  const int length(i2d_ASN1_OBJECT(object, nullptr));
+  if (length <= 0) {
+    return string();
+  }
+  string result(length, '\0');
+  unsigned char* out(reinterpret_cast<unsigned char*>(&result[0]));
+  CHECK_EQ(length, i2d_ASN1_OBJECT(object, &out));
+  return result;
+}
+
+
+// Returns the index in |parts| of the only extension with the object
+// identifier |object|, or -1 if there is none. Returns -2 if there is
+// more than one.
+int FindExtension(const string& der, const TbsParts& parts,
+                  const string& object) {
+  int index(-1);
+  for (size_t i = 0; i < parts.extension_list.size(); ++i) {
+    if (Bytes(der, parts.extension_list[i].object) == object) {
+      if (index >= 0) {
+        return -2;
+      }
+      index = i;
+    }
+  }
+  return index;
+}
+
+
+// Splices |der_tbs| as described for PrecertTbs(), returning false for
+// anything that is left to TbsCertificate.
+bool SpliceTbs(const string& der_tbs, int extension_nid,
+               const string* issuer_der_tbs, string* result) {
+  TbsParts parts;
+  if (!ParseTbs(der_tbs, &parts)) {
+    return false;
+  }
+
+  const int removed(
+      FindExtension(der_tbs, parts, ObjectEncoding(extension_nid)));
+  // Having no other extensions would leave an empty list, which
+  // OpenSSL encodes its own way.
+  if (removed < 0 || parts.extension_list.size() < 2) {
+    return false;
+  }
+
+  string issuer(Bytes(der_tbs, parts.issuer));
+  int key_id(-1);
+  string key_id_value;
+  if (issuer_der_tbs) {
+    TbsParts issuer_parts;
+    if (!ParseTbs(*issuer_der_tbs, &issuer_parts)) {
+      return false;
+    }
+    issuer = Bytes(*issuer_der_tbs, issuer_parts.issuer);
+
+    // The authority key identifier, if there is one, is that of the
+    // issuer, keeping the critical bit.
+    const string key_id_object(ObjectEncoding(NID_authority_key_identifier));
+    key_id = FindExtension(der_tbs, parts, key_id_object);
+    if (key_id == -2) {
+      return false;
+    }
+    if (key_id >= 0) {
+      const int issuer_key_id(
+          FindExtension(*issuer_der_tbs, issuer_parts, key_id_object));
+      if (issuer_key_id < 0) {
+        return false;
+      }
+      key_id_value = Bytes(*issuer_der_tbs,
+                           issuer_parts.extension_list[issuer_key_id].value);
+    }
+  }
+
+  string extensions;
+  for (int i = 0; i < static_cast<int>(parts.extension_list.size()); ++i) {
+    const Extension& extension(parts.extension_list[i]);
+    if (i == removed) {
+      continue;
+    }
+    if (i == key_id) {
+      string content(Bytes(der_tbs, extension.object));
+      if (extension.critical) {
+        content.append(Bytes(der_tbs, extension.critical_element));
+      }
+      content.append(key_id_value);
+      AppendElement(kSequenceTag, content, &extensions);
+    } else {
+      extensions.append(Bytes(der_tbs, extension.element));
+    }
+  }
+  string extensions_list;
+  AppendElement(kSequenceTag, extensions, &extensions_list);
+
+  string content(der_tbs, parts.tbs.content,
+                 parts.issuer.start - parts.tbs.content);
+  content.append(issuer);
+  content.append(der_tbs, parts.issuer.end,
+                 parts.extensions.start - parts.issuer.end);
+  AppendElement(kExtensionsTag, extensions_list, &content);
+
+  result->clear();
+  AppendElement(kSequenceTag, content, result);
+  return true;
+}
+
+
+// Sets |der_tbs| to the TBSCertificate of |cert|, as it was received.
+// The encoding of the whole certificate is kept by OpenSSL, and
+// memoized by |cert|, unlike that of the TBSCertificate, which is
+// encoded again.
+bool ReceivedTbs(const Cert& cert, string* der_tbs) {
+  string der_cert;
+  if (!cert.DerEncoding(&der_cert).ok()) {
+    return false;
+  }
+  Element certificate;
+  Element tbs;
+  if (!ReadElement(der_cert, 0, der_cert.size(), &certificate) ||
+      certificate.tag != kSequenceTag ||
+      !ReadElement(der_cert, certificate.content, certificate.end, &tbs) ||
+      tbs.tag != kSequenceTag) {
+    return false;
+  }
+  *der_tbs = Bytes(der_cert, tbs);
+  return true;
+}
+
+
+}  // namespace
+
+
+Status PrecertTbs(const Cert& cert, int extension_nid, const Cert* issuer,
+                  string* result) {
+  string der_tbs;
+  string issuer_der_tbs;
+  if (ReceivedTbs(cert, &der_tbs) &&
+      (!issuer || ReceivedTbs(*issuer, &issuer_der_tbs)) &&
+      SpliceTbs(der_tbs, extension_nid, issuer ? &issuer_der_tbs : nullptr,
+                result)) {
+    return ::util::OkStatus();
+  }
+
+  VLOG(1) << "could not splice the TBSCertificate, encoding it again";
+  TbsCertificate tbs(cert);
+  if (!tbs.IsLoaded()) {
+    return Status(util::error::FAILED_PRECONDITION, "Cert not loaded (TBS)");
+  }
+  Status status(tbs.DeleteExtension(extension_nid));
+  if (status.ok() && issuer) {
+    status = tbs.CopyIssuerFrom(*issuer);
+  }
+  if (!status.ok()) {
+    return status;
+  }
+  return tbs.DerEncoding(result);
+}
+
+
+}  // namespace cert_trans
@@ -0,0 +1,31 @@
+#ifndef CERT_TRANS_LOG_PRECERT_TBS_H_
+#define CERT_TRANS_LOG_PRECERT_TBS_H_
+
+#include <string>
+
+#include "util/status.h"
+
+namespace cert_trans {
+
+class Cert;
+
+
+// Sets |result| to the DER encoding of the TBSCertificate of |cert|
+// without its |extension_nid| extension (the poison, or the embedded
+// SCTs) and, if |issuer| is set, with the issuer name and authority
+// key identifier of |issuer| (the Precertificate Signing Certificate),
+// as it goes in the log entry for a precertificate.
+//
+// This splices the DER encoding of |cert| as it was received, rather
+// than changing the OpenSSL structures and encoding them all over
+// again, which used to be most of the cost of a pre-chain. The few
+// certificates that splicing does not handle, such as those where the
+// extension is the only one, go through TbsCertificate instead, and
+// its errors are returned.
+util::Status PrecertTbs(const Cert& cert, int extension_nid,
+                        const Cert* issuer, std::string* result);
+
+
+}  // namespace cert_trans
+
+#endif  // CERT_TRANS_LOG_PRECERT_TBS_H_
@@ -0,0 +1,118 @@
+#include "log/precert_tbs.h"
+
+#include <gflags/gflags.h>
+#include <gtest/gtest.h>
+#include <openssl/err.h>
+#include <openssl/evp.h>
+#include <openssl/x509v3.h>
+#include <memory>
+#include <string>
+
+#include "log/cert.h"
+#include "log/ct_extensions.h"
+#include "util/status_test_util.h"
+#include "util/testing.h"
+#include "util/util.h"
+
+namespace cert_trans {
+namespace {
+
+using std::string;
+using std::unique_ptr;
+using util::Status;
+using util::testing::StatusIs;
+
+
+// Issued by ca-cert.pem
+const char kPreCert[] = "test-embedded-pre-cert.pem";
+// Issued by ca-pre-cert.pem
+const char kPreWithPreCaCert[] = "test-embedded-with-preca-pre-cert.pem";
+// Issued by ca-cert.pem
+const char kCaPreCert[] = "ca-pre-cert.pem";
+// Issued by intermediate-pre-cert.pem
+const char kPreWithIntermediatePreCaCert[] =
+    "test-embedded-with-intermediate-preca-pre-cert.pem";
+// Issued by intermediate-cert.pem
+const char kIntermediatePreCaCert[] = "intermediate-pre-cert.pem";
+// With embedded SCTs, issued by ca-cert.pem
+const char kEmbeddedCert[] = "test-embedded-cert.pem";
+// Issued by ca-cert.pem
+const char kLeafCert[] = "test-cert.pem";
+
+
+class PrecertTbsTest : public ::testing::Test {
+ protected:
+  unique_ptr<Cert> ReadCert(const string& name) {
+    string pem;
+    CHECK(util::ReadTextFile(FLAGS_test_srcdir + "/test/testdata/" + name,
+                             &pem))
+        << "Could not read test data " << name;
+    unique_ptr<Cert> cert(Cert::FromPemString(pem));
+    CHECK(cert);
+    return cert;
+  }
+
+  // The TBSCertificate as TbsCertificate makes it.
+  string ExpectedTbs(const Cert& cert, int extension_nid,
+                     const Cert* issuer) {
+    TbsCertificate tbs(cert);
+    CHECK(tbs.IsLoaded());
+    CHECK_EQ(::util::OkStatus(), tbs.DeleteExtension(extension_nid));
+    if (issuer) {
+      CHECK_EQ(::util::OkStatus(), tbs.CopyIssuerFrom(*issuer));
+    }
+    string result;
+    CHECK_EQ(::util::OkStatus(), tbs.DerEncoding(&result));
+    return result;
+  }
+
+  void ExpectSameTbs(const string& cert_name, int extension_nid,
+                     const string& issuer_name) {
+    const unique_ptr<Cert> cert(ReadCert(cert_name));
+    const unique_ptr<Cert> issuer(issuer_name.empty() ? nullptr
+                                                      : ReadCert(issuer_name));
+    string tbs;
+    EXPECT_OK(PrecertTbs(*cert, extension_nid, issuer.get(), &tbs));
+    EXPECT_EQ(ExpectedTbs(*cert, extension_nid, issuer.get()), tbs)
+        << cert_name;
+  }
+};
+
+
+TEST_F(PrecertTbsTest, RemovesPoison) {
+  ExpectSameTbs(kPreCert, NID_ctPoison, "");
+}
+
+
+TEST_F(PrecertTbsTest, CopiesIssuer) {
+  ExpectSameTbs(kPreWithPreCaCert, NID_ctPoison, kCaPreCert);
+  ExpectSameTbs(kPreWithIntermediatePreCaCert, NID_ctPoison,
+                kIntermediatePreCaCert);
+}
+
+
+TEST_F(PrecertTbsTest, RemovesEmbeddedSCTs) {
+  ExpectSameTbs(kEmbeddedCert, NID_ctEmbeddedSignedCertificateTimestampList,
+                "");
+}
+
+
+TEST_F(PrecertTbsTest, NoExtension) {
+  const unique_ptr<Cert> cert(ReadCert(kLeafCert));
+  string tbs;
+  EXPECT_THAT(PrecertTbs(*cert, NID_ctPoison, nullptr, &tbs),
+              StatusIs(util::error::NOT_FOUND));
+}
+
+
+}  // namespace
+}  // namespace cert_trans
+
+
+int main(int argc, char** argv) {
+  cert_trans::test::InitTesting(argv[0], &argc, &argv, true);
+  OpenSSL_add_all_algorithms();
+  ERR_load_crypto_strings();
+  cert_trans::LoadCtExtensions();
+  return RUN_ALL_TESTS();
+}
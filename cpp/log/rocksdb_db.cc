@@ -0,0 +1,655 @@
+#include "log/rocksdb_db.h"
+
+#include <gflags/gflags.h>
+#include <glog/logging.h>
+#include <rocksdb/cache.h>
+#include <rocksdb/filter_policy.h>
+#include <rocksdb/options.h>
+#include <rocksdb/rate_limiter.h>
+#include <rocksdb/slice_transform.h>
+#include <rocksdb/table.h>
+#include <rocksdb/write_batch.h>
+#include <stdint.h>
+#include <string>
+#include <vector>
+
+#include "monitoring/latency.h"
+#include "monitoring/monitoring.h"
+#include "proto/ct.pb.h"
+#include "proto/serializer.h"
+#include "util/util.h"
+
+using cert_trans::serialization::DeserializeResult;
+using std::chrono::milliseconds;
+using std::lock_guard;
+using std::mutex;
+using std::shared_ptr;
+using std::string;
+using std::unique_lock;
+using std::unique_ptr;
+using std::vector;
+
+DEFINE_int32(rocksdb_block_cache_size_mb, 0,
+             "size of the block cache shared by all the column families of "
+             "the rocksdb database, in megabytes (0 uses the rocksdb "
+             "default)");
+DEFINE_int32(rocksdb_bloom_filter_bits_per_key, 10,
+             "bits per key of the prefix bloom filter on the hash index of "
+             "the rocksdb database, 0 to disable it");
+DEFINE_int32(rocksdb_compaction_rate_limit_mb_per_sec, 0,
+             "limit on how fast rocksdb flushes and compacts, in megabytes "
+             "per second, so that compactions leave enough I/O for serving "
+             "(0 for no limit)");
+DEFINE_bool(rocksdb_use_direct_reads, false,
+            "whether rocksdb reads its tables with direct I/O, bypassing "
+            "the page cache, so that scans don't push out the rest of its "
+            "contents; the block cache should be sized to match");
+DEFINE_int32(rocksdb_scan_readahead_kb, 2048,
+             "how far ahead scans of the entries of the rocksdb database "
+             "read, in kilobytes (0 uses the rocksdb default)");
+
+namespace cert_trans {
+namespace {
+
+
+static Latency<milliseconds, string> latency_by_op_ms(
+    "rocksdb_latency_by_operation_ms", "operation",
+    "Database latency in ms broken out by operation.");
+
+
+// The meta data lives in the default column family.
+const char kEntriesColumnFamily[] = "entries";
+const char kHashesColumnFamily[] = "hashes";
+const char kTreeHeadsColumnFamily[] = "tree_heads";
+
+const char kMetaNodeIdKey[] = "metadata";
+const char kMetaTreeFrontierKey[] = "tree_frontier";
+const char kMetaContiguousSizeKey[] = "contiguous_size";
+
+// Entry hashes are SHA-256 digests, and the keys of the hash index
+// start with them, which makes them the prefix to filter on.
+const size_t kHashBytes = 32;
+
+
+// Sequence numbers and timestamps are stored big-endian, so that keys
+// sort in numerical order.
+// WARNING: Do NOT change the type of "index" from int64_t, or you'll
+// break existing databases!
+string IndexToKey(int64_t index) {
+  return Serializer::SerializeUint(static_cast<uint64_t>(index));
+}
+
+
+int64_t KeyToIndex(const rocksdb::Slice& key) {
+  uint64_t index;
+  CHECK_EQ(DeserializeResult::OK,
+           Deserializer::DeserializeUint<uint64_t>(key.ToString(),
+                                                   sizeof(index), &index));
+  return index;
+}
+
+
+// Followed by the sequence number, so that the first key for a hash is
+// that of the lowest sequence number it has.
+string HashToKey(const string& hash, int64_t index) {
+  return hash + IndexToKey(index);
+}
+
+
+string TimestampToKey(uint64_t timestamp) {
+  return Serializer::SerializeUint(timestamp);
+}
+
+
+rocksdb::BlockBasedTableOptions TableOptions(
+    const shared_ptr<rocksdb::Cache>& block_cache) {
+  rocksdb::BlockBasedTableOptions retval;
+  if (block_cache) {
+    retval.block_cache = block_cache;
+  }
+  return retval;
+}
+
+
+rocksdb::ColumnFamilyOptions HashesOptions(
+    const shared_ptr<rocksdb::Cache>& block_cache) {
+  rocksdb::ColumnFamilyOptions retval;
+  retval.prefix_extractor.reset(rocksdb::NewFixedPrefixTransform(kHashBytes));
+
+  // Lookups are always by prefix, the whole keys are never asked for.
+  rocksdb::BlockBasedTableOptions table(TableOptions(block_cache));
+  CHECK_GE(FLAGS_rocksdb_bloom_filter_bits_per_key, 0);
+  if (FLAGS_rocksdb_bloom_filter_bits_per_key > 0) {
+    table.filter_policy.reset(rocksdb::NewBloomFilterPolicy(
+        FLAGS_rocksdb_bloom_filter_bits_per_key, false));
+    table.whole_key_filtering = false;
+    retval.memtable_prefix_bloom_size_ratio = 0.1;
+  }
+  retval.table_factory.reset(rocksdb::NewBlockBasedTableFactory(table));
+
+  return retval;
+}
+
+
+}  // namespace
+
+
+class RocksDB::Iterator : public Database::Iterator {
+ public:
+  Iterator(const RocksDB* db, int64_t start_index)
+      : it_(CHECK_NOTNULL(db)->db_->NewIterator(ScanOptions(),
+                                                db->entries_)) {
+    CHECK(it_);
+    it_->Seek(IndexToKey(start_index));
+  }
+
+  bool GetNextEntry(LoggedEntry* entry) override {
+    if (!it_->Valid()) {
+      CHECK(it_->status().ok()) << "Failed to scan entries: "
+                                << it_->status().ToString();
+      return false;
+    }
+
+    const int64_t seq(KeyToIndex(it_->key()));
+    CHECK(entry->ParseFromArray(it_->value().data(), it_->value().size()))
+        << "failed to parse entry for sequence number " << seq;
+    CHECK(entry->has_sequence_number())
+        << "no sequence number for entry with expected sequence number "
+        << seq;
+    CHECK_EQ(entry->sequence_number(), seq) << "unexpected sequence_number";
+
+    it_->Next();
+
+    return true;
+  }
+
+ private:
+  // Scans mostly read each entry once (rebuilding the tree, serving
+  // get-entries, ...), so they shouldn't evict the blocks that point
+  // lookups keep coming back to from the block cache, and they can read
+  // well ahead.
+  static rocksdb::ReadOptions ScanOptions() {
+    rocksdb::ReadOptions options;
+    options.fill_cache = false;
+    CHECK_GE(FLAGS_rocksdb_scan_readahead_kb, 0);
+    if (FLAGS_rocksdb_scan_readahead_kb > 0) {
+      options.readahead_size =
+          static_cast<size_t>(FLAGS_rocksdb_scan_readahead_kb) << 10;
+    }
+    return options;
+  }
+
+  const unique_ptr<rocksdb::Iterator> it_;
+};
+
+
+RocksDB::RocksDB(const string& dbfile)
+    : meta_(nullptr),
+      entries_(nullptr),
+      hashes_(nullptr),
+      tree_heads_(nullptr),
+      contiguous_size_(0),
+      latest_tree_timestamp_(0) {
+  LOG(INFO) << "Opening " << dbfile;
+  ScopedLatency latency(latency_by_op_ms.GetScopedLatency("open"));
+  rocksdb::DBOptions options;
+  options.create_if_missing = true;
+  options.create_missing_column_families = true;
+  CHECK_GE(FLAGS_rocksdb_compaction_rate_limit_mb_per_sec, 0);
+  if (FLAGS_rocksdb_compaction_rate_limit_mb_per_sec > 0) {
+    options.rate_limiter.reset(rocksdb::NewGenericRateLimiter(
+        static_cast<int64_t>(FLAGS_rocksdb_compaction_rate_limit_mb_per_sec)
+        << 20));
+  }
+  options.use_direct_reads = FLAGS_rocksdb_use_direct_reads;
+
+  shared_ptr<rocksdb::Cache> block_cache;
+  CHECK_GE(FLAGS_rocksdb_block_cache_size_mb, 0);
+  if (FLAGS_rocksdb_block_cache_size_mb > 0) {
+    block_cache = rocksdb::NewLRUCache(
+        static_cast<size_t>(FLAGS_rocksdb_block_cache_size_mb) << 20);
+  }
+  rocksdb::ColumnFamilyOptions family_options;
+  family_options.table_factory.reset(
+      rocksdb::NewBlockBasedTableFactory(TableOptions(block_cache)));
+
+  // The order of the handles follows this one.
+  const vector<rocksdb::ColumnFamilyDescriptor> families{
+      {rocksdb::kDefaultColumnFamilyName, family_options},
+      {kEntriesColumnFamily, family_options},
+      {kHashesColumnFamily, HashesOptions(block_cache)},
+      {kTreeHeadsColumnFamily, family_options}};
+  vector<rocksdb::ColumnFamilyHandle*> handles;
+  rocksdb::DB* db;
+  const rocksdb::Status status(
+      rocksdb::DB::Open(options, dbfile, families, &handles, &db));
+  CHECK(status.ok()) << status.ToString();
+  db_.reset(db);
+  CHECK_EQ(handles.size(), families.size());
+  for (rocksdb::ColumnFamilyHandle* handle : handles) {
+    handles_.emplace_back(handle);
+  }
+  meta_ = handles[0];
+  entries_ = handles[1];
+  hashes_ = handles[2];
+  tree_heads_ = handles[3];
+
+  BuildIndex();
+}
+
+
+RocksDB::~RocksDB() {
+  // The column family handles have to go before the database itself.
+  handles_.clear();
+}
+
+
+Database::WriteResult RocksDB::CreateSequencedEntry_(
+    const LoggedEntry& logged) {
+  CHECK(logged.has_sequence_number());
+  CHECK_GE(logged.sequence_number(), 0);
+  ScopedLatency latency(
+      latency_by_op_ms.GetScopedLatency("create_sequenced_entry"));
+
+  unique_lock<mutex> lock(lock_);
+
+  string data;
+  CHECK(logged.SerializeToString(&data));
+
+  // The index knows about every entry, so only read existing ones.
+  if (HaveEntry(logged.sequence_number())) {
+    string existing_data;
+    const rocksdb::Status status(
+        db_->Get(rocksdb::ReadOptions(), entries_,
+                 IndexToKey(logged.sequence_number()), &existing_data));
+    if (!status.IsNotFound()) {
+      if (existing_data == data) {
+        return this->OK;
+      }
+      return this->SEQUENCE_NUMBER_ALREADY_IN_USE;
+    }
+  }
+
+  const int64_t previous_size(contiguous_size_);
+  rocksdb::WriteBatch batch;
+  AddEntryToBatch(logged, data, &batch);
+  AddContiguousSizeToBatch(previous_size, &batch);
+  const rocksdb::Status status(db_->Write(rocksdb::WriteOptions(), &batch));
+  CHECK(status.ok()) << "Failed to write sequenced entry (seq: "
+                     << logged.sequence_number()
+                     << "): " << status.ToString();
+
+  return this->OK;
+}
+
+
+Database::WriteResult RocksDB::CreateSequencedEntries_(
+    const vector<LoggedEntry>& logged) {
+  ScopedLatency latency(
+      latency_by_op_ms.GetScopedLatency("create_sequenced_entries"));
+
+  unique_lock<mutex> lock(lock_);
+
+  // Collect all the new entries into a single batch, stopping at the
+  // first conflict; whatever came before it still gets written.
+  const int64_t previous_size(contiguous_size_);
+  rocksdb::WriteBatch batch;
+  int64_t num_written(0);
+  Database::WriteResult result(this->OK);
+  string data;
+  string existing_data;
+  for (const auto& entry : logged) {
+    CHECK(entry.SerializeToString(&data));
+
+    // The index knows about every entry, so only read existing ones.
+    if (!HaveEntry(entry.sequence_number())) {
+      AddEntryToBatch(entry, data, &batch);
+      ++num_written;
+      continue;
+    }
+
+    const rocksdb::Status status(
+        db_->Get(rocksdb::ReadOptions(), entries_,
+                 IndexToKey(entry.sequence_number()), &existing_data));
+    if (status.IsNotFound()) {
+      AddEntryToBatch(entry, data, &batch);
+      ++num_written;
+    } else if (existing_data != data) {
+      result = this->SEQUENCE_NUMBER_ALREADY_IN_USE;
+      break;
+    }
+  }
+
+  if (num_written > 0) {
+    AddContiguousSizeToBatch(previous_size, &batch);
+    const rocksdb::Status status(db_->Write(rocksdb::WriteOptions(), &batch));
+    CHECK(status.ok()) << "Failed to write " << num_written
+                       << " sequenced entries: " << status.ToString();
+  }
+
+  return result;
+}
+
+
+Database::LookupResult RocksDB::LookupByHash(const string& hash,
+                                             LoggedEntry* result) const {
+  ScopedLatency latency(latency_by_op_ms.GetScopedLatency("lookup_by_hash"));
+
+  // The hash index is written together with the entries, so there is
+  // no need to lock. Hashes that were never logged are mostly turned
+  // away by the prefix bloom filter, without reading any table.
+  rocksdb::ReadOptions options;
+  options.prefix_same_as_start = true;
+  const unique_ptr<rocksdb::Iterator> it(db_->NewIterator(options, hashes_));
+  CHECK(it);
+  it->Seek(hash);
+  if (!it->Valid() || !it->key().starts_with(hash) ||
+      it->key().size() != hash.size() + sizeof(int64_t)) {
+    CHECK(it->status().ok()) << "Failed to look up hash("
+                             << util::HexString(hash)
+                             << "): " << it->status().ToString();
+    return this->NOT_FOUND;
+  }
+  rocksdb::Slice index_key(it->key());
+  index_key.remove_prefix(hash.size());
+
+  string cert_data;
+  const rocksdb::Status status(db_->Get(rocksdb::ReadOptions(), entries_,
+                                        index_key, &cert_data));
+  if (status.IsNotFound()) {
+    return this->NOT_FOUND;
+  }
+  CHECK(status.ok()) << "Failed to get entry by hash(" << util::HexString(hash)
+                     << "): " << status.ToString();
+
+  if (result) {
+    CHECK(result->ParseFromString(cert_data));
+    CHECK_EQ(result->Hash(), hash);
+  }
+
+  return this->LOOKUP_OK;
+}
+
+
+Database::LookupResult RocksDB::LookupByIndex(int64_t sequence_number,
+                                              LoggedEntry* result) const {
+  CHECK_GE(sequence_number, 0);
+  ScopedLatency latency(latency_by_op_ms.GetScopedLatency("lookup_by_index"));
+
+  string cert_data;
+  const rocksdb::Status status(db_->Get(rocksdb::ReadOptions(), entries_,
+                                        IndexToKey(sequence_number),
+                                        &cert_data));
+  if (status.IsNotFound()) {
+    return this->NOT_FOUND;
+  }
+  CHECK(status.ok()) << "Failed to get entry for sequence number "
+                     << sequence_number;
+
+  if (result) {
+    CHECK(result->ParseFromString(cert_data));
+    CHECK_EQ(result->sequence_number(), sequence_number);
+  }
+
+  return this->LOOKUP_OK;
+}
+
+
+unique_ptr<Database::Iterator> RocksDB::ScanEntries(
+    int64_t start_index) const {
+  return unique_ptr<Iterator>(new Iterator(this, start_index));
+}
+
+
+Database::WriteResult RocksDB::WriteTreeHead_(const ct::SignedTreeHead& sth) {
+  CHECK_GE(sth.tree_size(), 0);
+  ScopedLatency latency(latency_by_op_ms.GetScopedLatency("write_tree_head"));
+
+  const string timestamp_key(TimestampToKey(sth.timestamp()));
+  string data;
+  CHECK(sth.SerializeToString(&data));
+
+  unique_lock<mutex> lock(lock_);
+  string existing_data;
+  rocksdb::Status status(db_->Get(rocksdb::ReadOptions(), tree_heads_,
+                                  timestamp_key, &existing_data));
+  if (status.ok()) {
+    if (existing_data == data) {
+      return this->OK;
+    }
+    return this->DUPLICATE_TREE_HEAD_TIMESTAMP;
+  }
+
+  rocksdb::WriteOptions opts;
+  opts.sync = true;
+  status = db_->Put(opts, tree_heads_, timestamp_key, data);
+  CHECK(status.ok()) << "Failed to write tree head (" << sth.timestamp()
+                     << "): " << status.ToString();
+
+  if (sth.timestamp() > latest_tree_timestamp_) {
+    latest_tree_timestamp_ = sth.timestamp();
+  }
+
+  lock.unlock();
+  callbacks_.Call(sth);
+
+  return this->OK;
+}
+
+
+Database::LookupResult RocksDB::LatestTreeHead(
+    ct::SignedTreeHead* result) const {
+  ScopedLatency latency(latency_by_op_ms.GetScopedLatency("latest_tree_head"));
+  lock_guard<mutex> lock(lock_);
+
+  return LatestTreeHeadNoLock(result);
+}
+
+
+int64_t RocksDB::TreeSize() const {
+  ScopedLatency latency(latency_by_op_ms.GetScopedLatency("tree_size"));
+  lock_guard<mutex> lock(lock_);
+
+  return contiguous_size_;
+}
+
+
+void RocksDB::AddNotifySTHCallback(
+    const Database::NotifySTHCallback* callback) {
+  unique_lock<mutex> lock(lock_);
+
+  callbacks_.Add(callback);
+
+  ct::SignedTreeHead sth;
+  if (LatestTreeHeadNoLock(&sth) == this->LOOKUP_OK) {
+    lock.unlock();
+    (*callback)(sth);
+  }
+}
+
+
+void RocksDB::RemoveNotifySTHCallback(
+    const Database::NotifySTHCallback* callback) {
+  // Not under |lock_|: |callbacks_| has a lock of its own, and may
+  // wait for callbacks that read from the database.
+  callbacks_.Remove(callback);
+}
+
+
+void RocksDB::InitializeNode(const string& node_id) {
+  CHECK(!node_id.empty());
+  ScopedLatency latency(latency_by_op_ms.GetScopedLatency("initialize_node"));
+  unique_lock<mutex> lock(lock_);
+  string existing_id;
+  if (NodeId(&existing_id) != this->NOT_FOUND) {
+    LOG(FATAL)
+        << "Attempting to initialize DB belonging to node with node_id: "
+        << existing_id;
+  }
+  const rocksdb::Status status(
+      db_->Put(rocksdb::WriteOptions(), meta_, kMetaNodeIdKey, node_id));
+  CHECK(status.ok()) << "Failed to store NodeId: " << status.ToString();
+}
+
+
+Database::LookupResult RocksDB::NodeId(string* node_id) {
+  return GetMeta(kMetaNodeIdKey, CHECK_NOTNULL(node_id));
+}
+
+
+void RocksDB::WriteTreeFrontier(const ct::CompactTreeFrontier& frontier) {
+  ScopedLatency latency(
+      latency_by_op_ms.GetScopedLatency("write_tree_frontier"));
+  string data;
+  CHECK(frontier.SerializeToString(&data));
+
+  const rocksdb::Status status(
+      db_->Put(rocksdb::WriteOptions(), meta_, kMetaTreeFrontierKey, data));
+  CHECK(status.ok()) << "Failed to store tree frontier: "
+                     << status.ToString();
+}
+
+
+Database::LookupResult RocksDB::LatestTreeFrontier(
+    ct::CompactTreeFrontier* result) const {
+  CHECK_NOTNULL(result);
+  ScopedLatency latency(
+      latency_by_op_ms.GetScopedLatency("latest_tree_frontier"));
+  string data;
+  if (GetMeta(kMetaTreeFrontierKey, &data) == this->NOT_FOUND) {
+    return this->NOT_FOUND;
+  }
+
+  CHECK(result->ParseFromString(data));
+  return this->LOOKUP_OK;
+}
+
+
+void RocksDB::BuildIndex() {
+  ScopedLatency latency(latency_by_op_ms.GetScopedLatency("build_index"));
+  // Technically, this should only be called from the constructor, so
+  // this should not be necessarily, but just to be sure...
+  lock_guard<mutex> lock(lock_);
+
+  string size_key;
+  if (GetMeta(kMetaContiguousSizeKey, &size_key) == this->LOOKUP_OK) {
+    contiguous_size_ = KeyToIndex(size_key);
+  }
+
+  // The hash index is kept on disk, so only the keys of the entries
+  // past the stored contiguous size have to be looked at.
+  rocksdb::ReadOptions options;
+  options.fill_cache = false;
+  unique_ptr<rocksdb::Iterator> it(db_->NewIterator(options, entries_));
+  CHECK(it);
+  const int64_t stored_size(contiguous_size_);
+  for (it->Seek(IndexToKey(stored_size)); it->Valid(); it->Next()) {
+    InsertEntryMapping(KeyToIndex(it->key()));
+  }
+  CHECK(it->status().ok()) << "Failed to scan entries: "
+                           << it->status().ToString();
+  if (contiguous_size_ != stored_size) {
+    rocksdb::WriteBatch batch;
+    AddContiguousSizeToBatch(stored_size, &batch);
+    const rocksdb::Status status(db_->Write(rocksdb::WriteOptions(), &batch));
+    CHECK(status.ok()) << "Failed to write contiguous size: "
+                       << status.ToString();
+  }
+  LOG(INFO) << "Opened database with " << contiguous_size_
+            << " contiguous entries and " << sparse_entries_.size()
+            << " more";
+
+  // Tree heads are keyed by timestamp, so the latest one is the last.
+  it.reset(db_->NewIterator(rocksdb::ReadOptions(), tree_heads_));
+  CHECK(it);
+  it->SeekToLast();
+  if (it->Valid()) {
+    CHECK_EQ(DeserializeResult::OK,
+             Deserializer::DeserializeUint<uint64_t>(
+                 it->key().ToString(), sizeof(latest_tree_timestamp_),
+                 &latest_tree_timestamp_));
+  }
+  CHECK(it->status().ok()) << "Failed to read tree heads: "
+                           << it->status().ToString();
+}
+
+
+Database::LookupResult RocksDB::LatestTreeHeadNoLock(
+    ct::SignedTreeHead* result) const {
+  if (latest_tree_timestamp_ == 0) {
+    return this->NOT_FOUND;
+  }
+
+  string tree_data;
+  const rocksdb::Status status(
+      db_->Get(rocksdb::ReadOptions(), tree_heads_,
+               TimestampToKey(latest_tree_timestamp_), &tree_data));
+  CHECK(status.ok()) << "Failed to read latest tree head: "
+                     << status.ToString();
+
+  CHECK(result->ParseFromString(tree_data));
+  CHECK_EQ(result->timestamp(), latest_tree_timestamp_);
+
+  return this->LOOKUP_OK;
+}
+
+
+Database::LookupResult RocksDB::GetMeta(const string& key,
+                                        string* value) const {
+  const rocksdb::Status status(
+      db_->Get(rocksdb::ReadOptions(), meta_, key, value));
+  if (status.IsNotFound()) {
+    return this->NOT_FOUND;
+  }
+  CHECK(status.ok()) << "Failed to read " << key << ": " << status.ToString();
+
+  return this->LOOKUP_OK;
+}
+
+
+// This must be called with "lock_" held.
+bool RocksDB::HaveEntry(int64_t sequence_number) const {
+  return sequence_number < contiguous_size_ ||
+         sparse_entries_.count(sequence_number) > 0;
+}
+
+
+// This must be called with "lock_" held.
+void RocksDB::AddEntryToBatch(const LoggedEntry& logged, const string& data,
+                              rocksdb::WriteBatch* batch) {
+  // A duplicate hash under a new sequence number gets its own index
+  // entry, but lookups find the one with the lowest sequence number.
+  batch->Put(entries_, IndexToKey(logged.sequence_number()), data);
+  batch->Put(hashes_, HashToKey(logged.Hash(), logged.sequence_number()),
+             rocksdb::Slice());
+  InsertEntryMapping(logged.sequence_number());
+}
+
+
+// This must be called with "lock_" held.
+void RocksDB::AddContiguousSizeToBatch(int64_t previous,
+                                       rocksdb::WriteBatch* batch) {
+  if (contiguous_size_ != previous) {
+    batch->Put(meta_, kMetaContiguousSizeKey, IndexToKey(contiguous_size_));
+  }
+}
+
+
+// This must be called with "lock_" held.
+void RocksDB::InsertEntryMapping(int64_t sequence_number) {
+  if (sequence_number == contiguous_size_) {
+    ++contiguous_size_;
+    for (auto i = sparse_entries_.find(contiguous_size_);
+         i != sparse_entries_.end() && *i == contiguous_size_;) {
+      ++contiguous_size_;
+      i = sparse_entries_.erase(i);
+    }
+  } else {
+    // It's not contiguous, put it with the other sparse entries.
+    CHECK(sparse_entries_.insert(sequence_number).second)
+        << "sequence number " << sequence_number << " already assigned.";
+  }
+}
+
+
+}  // namespace cert_trans
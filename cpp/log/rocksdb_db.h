@@ -0,0 +1,117 @@
+#ifndef CERT_TRANS_LOG_ROCKSDB_DB_H_
+#define CERT_TRANS_LOG_ROCKSDB_DB_H_
+
+#include <rocksdb/db.h>
+#include <stdint.h>
+#include <memory>
+#include <mutex>
+#include <set>
+#include <string>
+#include <vector>
+
+#include "log/database.h"
+#include "proto/ct.pb.h"
+
+namespace rocksdb {
+class WriteBatch;
+}  // namespace rocksdb
+
+namespace cert_trans {
+
+
+// Database backed by RocksDB, for logs that have outgrown LevelDB and
+// SQLite. Entries, the index of their hashes and the tree heads each
+// have their own column family, so that they can be tuned separately:
+// the hash index is only ever read by prefix, which a bloom filter can
+// answer, while entries are mostly scanned in order.
+//
+// Like LevelDB, only the shape of the log is kept in memory, and it is
+// stored as well, so opening the database does not have to read every
+// entry.
+class RocksDB : public Database {
+ public:
+  explicit RocksDB(const std::string& dbfile);
+  ~RocksDB();
+  RocksDB(const RocksDB&) = delete;
+  RocksDB& operator=(const RocksDB&) = delete;
+
+  // Implement abstract functions, see database.h for comments.
+  Database::WriteResult CreateSequencedEntry_(
+      const LoggedEntry& logged) override;
+
+  Database::WriteResult CreateSequencedEntries_(
+      const std::vector<LoggedEntry>& logged) override;
+
+  Database::LookupResult LookupByHash(const std::string& hash,
+                                      LoggedEntry* result) const override;
+
+  Database::LookupResult LookupByIndex(int64_t sequence_number,
+                                       LoggedEntry* result) const override;
+
+  std::unique_ptr<Database::Iterator> ScanEntries(
+      int64_t start_index) const override;
+
+  Database::WriteResult WriteTreeHead_(const ct::SignedTreeHead& sth) override;
+
+  Database::LookupResult LatestTreeHead(
+      ct::SignedTreeHead* result) const override;
+
+  int64_t TreeSize() const override;
+
+  void AddNotifySTHCallback(
+      const Database::NotifySTHCallback* callback) override;
+
+  void RemoveNotifySTHCallback(
+      const Database::NotifySTHCallback* callback) override;
+
+  void InitializeNode(const std::string& node_id) override;
+
+  Database::LookupResult NodeId(std::string* node_id) override;
+
+  void WriteTreeFrontier(const ct::CompactTreeFrontier& frontier) override;
+
+  Database::LookupResult LatestTreeFrontier(
+      ct::CompactTreeFrontier* result) const override;
+
+ private:
+  class Iterator;
+
+  void BuildIndex();
+  Database::LookupResult LatestTreeHeadNoLock(
+      ct::SignedTreeHead* result) const;
+  Database::LookupResult GetMeta(const std::string& key,
+                                 std::string* value) const;
+  // Adds |logged|, serialized as |data|, to |batch| along with its
+  // hash index entry, and records its sequence number as used.
+  void AddEntryToBatch(const LoggedEntry& logged, const std::string& data,
+                       rocksdb::WriteBatch* batch);
+  // Adds the contiguous size to |batch|, if it changed from |previous|.
+  void AddContiguousSizeToBatch(int64_t previous, rocksdb::WriteBatch* batch);
+  void InsertEntryMapping(int64_t sequence_number);
+  // Whether an entry with this sequence number has been written.
+  bool HaveEntry(int64_t sequence_number) const;
+
+  mutable std::mutex lock_;
+  std::unique_ptr<rocksdb::DB> db_;
+  // The handles must be released before db_ is, so keep this order.
+  std::vector<std::unique_ptr<rocksdb::ColumnFamilyHandle>> handles_;
+  rocksdb::ColumnFamilyHandle* meta_;
+  rocksdb::ColumnFamilyHandle* entries_;
+  rocksdb::ColumnFamilyHandle* hashes_;
+  rocksdb::ColumnFamilyHandle* tree_heads_;
+
+  int64_t contiguous_size_;
+
+  // This is a mapping of the non-contiguous entries of the log (which
+  // can happen while it is being fetched). When entries here become
+  // contiguous with the beginning of the tree, they are removed.
+  std::set<int64_t> sparse_entries_;
+
+  uint64_t latest_tree_timestamp_;
+  cert_trans::DatabaseNotifierHelper callbacks_;
+};
+
+
+}  // namespace cert_trans
+
+#endif  // CERT_TRANS_LOG_ROCKSDB_DB_H_
@@ -0,0 +1,1323 @@
+#include "log/segmented_db.h"
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <gflags/gflags.h>
+#include <glog/logging.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <algorithm>
+#include <list>
+#include <set>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "log/file_storage.h"
+#include "monitoring/latency.h"
+#include "monitoring/monitoring.h"
+#include "proto/ct.pb.h"
+#include "proto/serializer.h"
+#include "util/compression.h"
+#include "util/util.h"
+
+using cert_trans::serialization::DeserializeResult;
+using std::chrono::milliseconds;
+using std::lock_guard;
+using std::make_pair;
+using std::min;
+using std::move;
+using std::mutex;
+using std::pair;
+using std::set;
+using std::shared_ptr;
+using std::stoll;
+using std::string;
+using std::to_string;
+using std::unique_lock;
+using std::unique_ptr;
+using std::vector;
+
+DEFINE_int32(segmented_db_entries_per_segment, 1 << 16,
+             "number of sequence numbers each segment of a new segmented "
+             "database covers; existing databases keep the number they "
+             "were created with");
+DEFINE_string(segmented_db_cold_dir, "",
+              "if set, complete segments other than the most recent ones "
+              "have their entries moved to this directory, compressed, "
+              "which can be a mounted object store; their index stays "
+              "local");
+DEFINE_int32(segmented_db_hot_segments, 2,
+             "number of the most recent segments that are never moved to "
+             "--segmented_db_cold_dir");
+DEFINE_int32(segmented_db_cold_cache_segments, 4,
+             "number of segments from --segmented_db_cold_dir kept on "
+             "local disk for reading");
+
+namespace cert_trans {
+namespace {
+
+
+static Latency<milliseconds, string> latency_by_op_ms(
+    "segmenteddb_latency_by_operation_ms", "operation",
+    "Database latency in ms broken out by operation.");
+
+
+const char kMetaNodeIdKey[] = "node_id";
+const char kMetaTreeFrontierKey[] = "tree_frontier";
+const char kMetaEntriesPerSegmentKey[] = "entries_per_segment";
+const char kLogSuffix[] = ".log";
+const char kIndexSuffix[] = ".idx";
+// Marks a segment whose log is in cold storage, and holds its size.
+const char kColdSuffix[] = ".cold";
+const char kTimestampsSuffix[] = ".ts";
+const char kCompressedSuffix[] = ".log.zst";
+const char kTmpSuffix[] = ".tmp";
+const int kColdCompressionLevel = 3;
+
+// Tree heads are keyed by the 6 lower bytes of their timestamp, this
+// buckets about a minute of them in each directory.
+const int kTreeStorageDepth = 8;
+
+// Each record of a log file starts with the length of the entry.
+const size_t kLengthBytes = 4;
+
+// Each slot of an index file is the location of the entry, as its
+// offset in the log file and its length packed together (big-endian),
+// followed by its hash. A location of zero is an empty slot, which is
+// never a valid one, since records start with their length.
+const size_t kLocationBytes = 8;
+const size_t kHashBytes = 32;
+const size_t kSlotBytes = kLocationBytes + kHashBytes;
+const int kLengthBits = 24;
+const uint64_t kMaxLogSize = 1ULL << (kLocationBytes * 8 - kLengthBits);
+
+// The timestamps file of a segment has one record per block of this
+// many slots, with the lowest and the highest SCT timestamp of the
+// entries in it (8 bytes each, big-endian). A block with no entries
+// is all zeroes.
+const int64_t kTimestampBlockSlots = 256;
+const size_t kTimestampRecordBytes = 16;
+
+
+uint64_t ReadUint64(const char* data) {
+  uint64_t value(0);
+  for (size_t i = 0; i < 8; ++i) {
+    value = (value << 8) | static_cast<unsigned char>(data[i]);
+  }
+  return value;
+}
+
+
+void WriteUint64(uint64_t value, char* data) {
+  for (size_t i = 8; i > 0; --i) {
+    data[i - 1] = value & 0xff;
+    value >>= 8;
+  }
+}
+
+
+// Creates |dir| if it doesn't exist yet, and returns it.
+string MakeDir(const string& dir) {
+  PCHECK(mkdir(dir.c_str(), 0700) == 0 || errno == EEXIST)
+      << "Failed to create " << dir;
+  return dir;
+}
+
+
+string SegmentPath(const string& dir, int64_t number, const char* suffix) {
+  char name[32];
+  CHECK_LT(snprintf(name, sizeof(name), "%010lld%s",
+                    static_cast<long long>(number), suffix),
+           static_cast<int>(sizeof(name)));
+  return dir + "/" + name;
+}
+
+
+void ReadFully(int fd, off_t offset, size_t size, char* data) {
+  while (size > 0) {
+    const ssize_t num_read(pread(fd, data, size, offset));
+    PCHECK(num_read >= 0 || errno == EINTR) << "Failed to read a segment";
+    CHECK_NE(num_read, 0) << "Unexpected end of a segment";
+    if (num_read > 0) {
+      data += num_read;
+      size -= num_read;
+      offset += num_read;
+    }
+  }
+}
+
+
+void WriteFully(int fd, off_t offset, const string& data) {
+  size_t written(0);
+  while (written < data.size()) {
+    const ssize_t num_written(pwrite(fd, data.data() + written,
+                                     data.size() - written, offset + written));
+    PCHECK(num_written >= 0 || errno == EINTR) << "Failed to write a segment";
+    if (num_written > 0) {
+      written += num_written;
+    }
+  }
+}
+
+
+// Writes |data| to |path|, replacing it atomically, and syncs it.
+void WriteFileAtomically(const string& path, const string& data) {
+  const string tmp_path(path + kTmpSuffix);
+  const int fd(open(tmp_path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644));
+  PCHECK(fd >= 0) << "Failed to create " << tmp_path;
+  WriteFully(fd, 0, data);
+  PCHECK(fsync(fd) == 0) << "Failed to sync " << tmp_path;
+  close(fd);
+  PCHECK(rename(tmp_path.c_str(), path.c_str()) == 0) << "Failed to rename "
+                                                     << tmp_path;
+}
+
+
+// The log file of a segment. It stays open for as long as someone reads
+// from it, so that a segment can move to cold storage under them.
+class SegmentLog {
+ public:
+  explicit SegmentLog(int fd) : fd_(fd) {
+    CHECK_GE(fd_, 0);
+  }
+  ~SegmentLog() {
+    close(fd_);
+  }
+  SegmentLog(const SegmentLog&) = delete;
+  SegmentLog& operator=(const SegmentLog&) = delete;
+
+  int fd() const {
+    return fd_;
+  }
+
+  void Read(uint64_t offset, size_t length, string* data) const {
+    data->resize(length);
+    if (length > 0) {
+      ReadFully(fd_, offset, length, &(*data)[0]);
+    }
+  }
+
+ private:
+  const int fd_;
+};
+
+
+}  // namespace
+
+
+// One segment of the log, with its log and index files. The index file
+// is mapped in memory, the log file is only ever appended to and read
+// with pread(). Once the segment is complete, its log can be moved to
+// cold storage, after which it is no longer local. Access to the
+// segment must be serialized by the caller.
+class SegmentedDB::Segment {
+ public:
+  // Opens segment |number| in |dir|, creating it if |create| is true.
+  // Returns nullptr if it doesn't exist and |create| is false.
+  static unique_ptr<Segment> Open(const string& dir, int64_t number,
+                                  int64_t num_slots, bool create);
+  ~Segment();
+
+  // Returns false if there is no entry in slot |index|.
+  bool GetSlot(int64_t index, uint64_t* offset, size_t* length,
+               string* hash) const;
+
+  // Appends |data| to the log, then fills slot |index|, which must be
+  // empty, with where it is and with |hash|.
+  void Append(int64_t index, const string& hash, const string& data);
+
+  // Marks the log as moved to cold storage, and removes the local copy.
+  // Readers that already have it can keep reading from it.
+  void MakeCold();
+
+  // Returns nullptr if the log is in cold storage.
+  shared_ptr<const SegmentLog> log() const {
+    return log_;
+  }
+
+  uint64_t log_size() const {
+    return log_size_;
+  }
+
+  // Whether every slot is filled, after which it never changes again.
+  bool complete() const {
+    return num_filled_ == num_slots_;
+  }
+
+  // Notes that the entry going in slot |index| has the SCT timestamp
+  // |timestamp|. This must be done before Append(), so that the
+  // timestamps never leave out an entry that is there.
+  void NoteTimestamp(int64_t index, uint64_t timestamp);
+
+  // Returns false if no entry of the segment can have an SCT timestamp
+  // from |min_timestamp| to |max_timestamp| inclusive, or else sets
+  // [|begin|, |end|) to the slots of those that can.
+  bool FindTimestamps(uint64_t min_timestamp, uint64_t max_timestamp,
+                      int64_t* begin, int64_t* end) const;
+
+  // Whether the timestamps file did not exist when the segment was
+  // opened, in which case those of the entries already there must be
+  // noted before CommitTimestamps() makes the file permanent.
+  bool timestamps_missing() const {
+    return !timestamps_tmp_path_.empty();
+  }
+
+  void CommitTimestamps();
+
+ private:
+  Segment(const string& log_path, const string& cold_path,
+          shared_ptr<const SegmentLog> log, int index_fd, char* slots,
+          int64_t num_slots, uint64_t log_size,
+          const string& timestamps_path, const string& timestamps_tmp_path,
+          int timestamps_fd, char* timestamps);
+
+  int64_t num_blocks() const {
+    return (num_slots_ + kTimestampBlockSlots - 1) / kTimestampBlockSlots;
+  }
+
+  const string log_path_;
+  const string cold_path_;
+  shared_ptr<const SegmentLog> log_;
+  const int index_fd_;
+  char* const slots_;
+  const int64_t num_slots_;
+  int64_t num_filled_;
+  uint64_t log_size_;
+  const string timestamps_path_;
+  // Where the timestamps file is until it is committed, or empty.
+  string timestamps_tmp_path_;
+  const int timestamps_fd_;
+  char* const timestamps_;
+  // Over all the blocks, with |max_timestamp_| zero while there are
+  // no entries.
+  uint64_t min_timestamp_;
+  uint64_t max_timestamp_;
+};
+
+
+// Where the logs of cold segments go, along with a cache of the ones
+// read recently on local disk. This class is thread-safe.
+class SegmentedDB::ColdStore {
+ public:
+  ColdStore(const string& cold_dir, const string& cache_dir,
+            size_t cache_segments)
+      : cold_dir_(MakeDir(cold_dir)),
+        cache_dir_(MakeDir(cache_dir)),
+        cache_segments_(cache_segments) {
+  }
+  ColdStore(const ColdStore&) = delete;
+  ColdStore& operator=(const ColdStore&) = delete;
+
+  // Copies the log file at |log_path| to cold storage, as that of
+  // segment |number|.
+  void Put(int64_t number, const string& log_path);
+
+  // Returns the log of segment |number|, fetching it from cold storage
+  // if it is not in the cache.
+  shared_ptr<const SegmentLog> Get(int64_t number);
+
+ private:
+  shared_ptr<const SegmentLog> Fetch(int64_t number);
+
+  const string cold_dir_;
+  const string cache_dir_;
+  const size_t cache_segments_;
+
+  // Held while fetching, so that a segment is only fetched once.
+  mutex lock_;
+  // The most recently used first.
+  std::list<pair<int64_t, shared_ptr<const SegmentLog>>> cache_;
+};
+
+
+SegmentedDB::Segment::Segment(const string& log_path,
+                              const string& cold_path,
+                              shared_ptr<const SegmentLog> log, int index_fd,
+                              char* slots, int64_t num_slots,
+                              uint64_t log_size,
+                              const string& timestamps_path,
+                              const string& timestamps_tmp_path,
+                              int timestamps_fd, char* timestamps)
+    : log_path_(log_path),
+      cold_path_(cold_path),
+      log_(move(log)),
+      index_fd_(index_fd),
+      slots_(slots),
+      num_slots_(num_slots),
+      num_filled_(0),
+      log_size_(log_size),
+      timestamps_path_(timestamps_path),
+      timestamps_tmp_path_(timestamps_tmp_path),
+      timestamps_fd_(timestamps_fd),
+      timestamps_(timestamps),
+      min_timestamp_(0),
+      max_timestamp_(0) {
+  uint64_t offset;
+  size_t length;
+  for (int64_t index = 0; index < num_slots_; ++index) {
+    if (GetSlot(index, &offset, &length, nullptr)) {
+      ++num_filled_;
+    }
+  }
+  for (int64_t block = 0; block < num_blocks(); ++block) {
+    const char* const record(timestamps_ + block * kTimestampRecordBytes);
+    const uint64_t block_max(ReadUint64(record + 8));
+    if (block_max != 0) {
+      const uint64_t block_min(ReadUint64(record));
+      min_timestamp_ = max_timestamp_ == 0
+                           ? block_min
+                           : std::min(min_timestamp_, block_min);
+      max_timestamp_ = std::max(max_timestamp_, block_max);
+    }
+  }
+}
+
+
+unique_ptr<SegmentedDB::Segment> SegmentedDB::Segment::Open(
+    const string& dir, int64_t number, int64_t num_slots, bool create) {
+  const string log_path(SegmentPath(dir, number, kLogSuffix));
+  const string index_path(SegmentPath(dir, number, kIndexSuffix));
+  const string cold_path(SegmentPath(dir, number, kColdSuffix));
+
+  // The index file is only created once the log file exists.
+  int index_fd(open(index_path.c_str(), O_RDWR));
+  PCHECK(index_fd >= 0 || errno == ENOENT) << "Failed to open "
+                                           << index_path;
+  if (index_fd < 0 && !create) {
+    return nullptr;
+  }
+
+  string cold_size;
+  shared_ptr<const SegmentLog> log;
+  uint64_t log_size;
+  if (index_fd >= 0 && util::ReadBinaryFile(cold_path, &cold_size)) {
+    // We might have stopped before removing the local copy.
+    PCHECK(unlink(log_path.c_str()) == 0 || errno == ENOENT)
+        << "Failed to remove " << log_path;
+    log_size = std::stoull(cold_size);
+  } else {
+    const int log_fd(
+        open(log_path.c_str(), O_RDWR | (create ? O_CREAT : 0), 0644));
+    PCHECK(log_fd >= 0) << "Failed to open " << log_path;
+    log.reset(new SegmentLog(log_fd));
+    struct stat st;
+    PCHECK(fstat(log_fd, &st) == 0);
+    log_size = st.st_size;
+  }
+
+  if (index_fd < 0) {
+    index_fd = open(index_path.c_str(), O_RDWR | O_CREAT, 0644);
+    PCHECK(index_fd >= 0) << "Failed to create " << index_path;
+  }
+
+  // The index file is created at its full size, which costs nothing
+  // until its slots are written.
+  const size_t index_size(num_slots * kSlotBytes);
+  struct stat st;
+  PCHECK(fstat(index_fd, &st) == 0);
+  if (static_cast<size_t>(st.st_size) != index_size) {
+    CHECK_EQ(st.st_size, 0) << index_path << " has the wrong size";
+    PCHECK(ftruncate(index_fd, index_size) == 0) << "Failed to size "
+                                                 << index_path;
+  }
+  void* const slots(mmap(nullptr, index_size, PROT_READ | PROT_WRITE,
+                         MAP_SHARED, index_fd, 0));
+  PCHECK(slots != MAP_FAILED) << "Failed to map " << index_path;
+
+  // Segments written before there were timestamps files get one under
+  // a temporary name, only renamed once it covers all their entries.
+  const string timestamps_path(
+      SegmentPath(dir, number, kTimestampsSuffix));
+  string timestamps_tmp_path;
+  int timestamps_fd(open(timestamps_path.c_str(), O_RDWR));
+  PCHECK(timestamps_fd >= 0 || errno == ENOENT) << "Failed to open "
+                                                << timestamps_path;
+  if (timestamps_fd < 0) {
+    timestamps_tmp_path = timestamps_path + kTmpSuffix;
+    timestamps_fd =
+        open(timestamps_tmp_path.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0644);
+    PCHECK(timestamps_fd >= 0) << "Failed to create " << timestamps_tmp_path;
+  }
+  const size_t timestamps_size(
+      (num_slots + kTimestampBlockSlots - 1) / kTimestampBlockSlots *
+      kTimestampRecordBytes);
+  PCHECK(fstat(timestamps_fd, &st) == 0);
+  if (static_cast<size_t>(st.st_size) != timestamps_size) {
+    CHECK_EQ(st.st_size, 0) << timestamps_path << " has the wrong size";
+    PCHECK(ftruncate(timestamps_fd, timestamps_size) == 0)
+        << "Failed to size " << timestamps_path;
+  }
+  void* const timestamps(mmap(nullptr, timestamps_size,
+                              PROT_READ | PROT_WRITE, MAP_SHARED,
+                              timestamps_fd, 0));
+  PCHECK(timestamps != MAP_FAILED) << "Failed to map " << timestamps_path;
+
+  return unique_ptr<Segment>(new Segment(
+      log_path, cold_path, move(log), index_fd, static_cast<char*>(slots),
+      num_slots, log_size, timestamps_path, timestamps_tmp_path,
+      timestamps_fd, static_cast<char*>(timestamps)));
+}
+
+
+SegmentedDB::Segment::~Segment() {
+  PCHECK(munmap(slots_, num_slots_ * kSlotBytes) == 0);
+  close(index_fd_);
+  PCHECK(munmap(timestamps_, num_blocks() * kTimestampRecordBytes) == 0);
+  close(timestamps_fd_);
+}
+
+
+bool SegmentedDB::Segment::GetSlot(int64_t index, uint64_t* offset,
+                                   size_t* length, string* hash) const {
+  CHECK_GE(index, 0);
+  CHECK_LT(index, num_slots_);
+  const char* const slot(slots_ + index * kSlotBytes);
+
+  uint64_t location(0);
+  for (size_t i = 0; i < kLocationBytes; ++i) {
+    location = (location << 8) | static_cast<unsigned char>(slot[i]);
+  }
+  if (location == 0) {
+    return false;
+  }
+
+  *offset = location >> kLengthBits;
+  *length = location & ((1 << kLengthBits) - 1);
+  if (hash) {
+    hash->assign(slot + kLocationBytes, kHashBytes);
+  }
+  return true;
+}
+
+
+void SegmentedDB::Segment::Append(int64_t index, const string& hash,
+                                  const string& data) {
+  CHECK_GE(index, 0);
+  CHECK_LT(index, num_slots_);
+  CHECK_EQ(hash.size(), kHashBytes);
+  CHECK_LT(data.size(), 1U << kLengthBits) << "entry too large";
+  // Only complete segments go to cold storage.
+  CHECK(log_);
+  const uint64_t offset(log_size_ + kLengthBytes);
+  CHECK_LT(offset, kMaxLogSize) << "segment too large";
+
+  WriteFully(log_->fd(), log_size_,
+             Serializer::SerializeUint<uint32_t>(data.size(), kLengthBytes) +
+                 data);
+  log_size_ = offset + data.size();
+
+  char* const slot(slots_ + index * kSlotBytes);
+  memcpy(slot + kLocationBytes, hash.data(), kHashBytes);
+  uint64_t location((offset << kLengthBits) | data.size());
+  for (size_t i = kLocationBytes; i > 0; --i) {
+    slot[i - 1] = location & 0xff;
+    location >>= 8;
+  }
+  ++num_filled_;
+}
+
+
+void SegmentedDB::Segment::NoteTimestamp(int64_t index, uint64_t timestamp) {
+  CHECK_GE(index, 0);
+  CHECK_LT(index, num_slots_);
+  char* const record(timestamps_ +
+                     index / kTimestampBlockSlots * kTimestampRecordBytes);
+  const uint64_t block_max(ReadUint64(record + 8));
+  if (block_max == 0 || timestamp < ReadUint64(record)) {
+    WriteUint64(timestamp, record);
+  }
+  if (timestamp > block_max) {
+    WriteUint64(timestamp, record + 8);
+  }
+  min_timestamp_ = max_timestamp_ == 0 ? timestamp
+                                       : std::min(min_timestamp_, timestamp);
+  max_timestamp_ = std::max(max_timestamp_, timestamp);
+}
+
+
+bool SegmentedDB::Segment::FindTimestamps(uint64_t min_timestamp,
+                                          uint64_t max_timestamp,
+                                          int64_t* begin,
+                                          int64_t* end) const {
+  if (max_timestamp_ == 0 || max_timestamp_ < min_timestamp ||
+      min_timestamp_ > max_timestamp) {
+    return false;
+  }
+
+  int64_t first_block(-1);
+  int64_t last_block(-1);
+  for (int64_t block = 0; block < num_blocks(); ++block) {
+    const char* const record(timestamps_ + block * kTimestampRecordBytes);
+    const uint64_t block_max(ReadUint64(record + 8));
+    if (block_max != 0 && block_max >= min_timestamp &&
+        ReadUint64(record) <= max_timestamp) {
+      if (first_block < 0) {
+        first_block = block;
+      }
+      last_block = block;
+    }
+  }
+  if (first_block < 0) {
+    return false;
+  }
+  *begin = first_block * kTimestampBlockSlots;
+  *end = std::min(num_slots_, (last_block + 1) * kTimestampBlockSlots);
+  return true;
+}
+
+
+void SegmentedDB::Segment::CommitTimestamps() {
+  CHECK(timestamps_missing());
+  PCHECK(fsync(timestamps_fd_) == 0) << "Failed to sync "
+                                     << timestamps_tmp_path_;
+  PCHECK(rename(timestamps_tmp_path_.c_str(), timestamps_path_.c_str()) == 0)
+      << "Failed to rename " << timestamps_tmp_path_;
+  timestamps_tmp_path_.clear();
+}
+
+
+void SegmentedDB::Segment::MakeCold() {
+  CHECK(complete());
+  CHECK(log_);
+  // The marker goes first, so that the log is never missing from both
+  // places.
+  WriteFileAtomically(cold_path_, to_string(log_size_));
+  PCHECK(unlink(log_path_.c_str()) == 0) << "Failed to remove " << log_path_;
+  log_.reset();
+}
+
+
+void SegmentedDB::ColdStore::Put(int64_t number, const string& log_path) {
+  string data;
+  CHECK(util::ReadBinaryFile(log_path, &data)) << "Failed to read "
+                                               << log_path;
+  if (ZstdSupported()) {
+    string compressed;
+    CHECK(ZstdCompress(data, kColdCompressionLevel, &compressed));
+    WriteFileAtomically(SegmentPath(cold_dir_, number, kCompressedSuffix),
+                        compressed);
+  } else {
+    WriteFileAtomically(SegmentPath(cold_dir_, number, kLogSuffix), data);
+  }
+}
+
+
+shared_ptr<const SegmentLog> SegmentedDB::ColdStore::Get(int64_t number) {
+  lock_guard<mutex> lock(lock_);
+  for (auto it = cache_.begin(); it != cache_.end(); ++it) {
+    if (it->first == number) {
+      cache_.splice(cache_.begin(), cache_, it);
+      return it->second;
+    }
+  }
+
+  shared_ptr<const SegmentLog> log(Fetch(number));
+  cache_.emplace_front(number, log);
+  if (cache_.size() > cache_segments_) {
+    // Readers still using it keep it open.
+    cache_.pop_back();
+  }
+  return log;
+}
+
+
+// This must be called with "lock_" held.
+shared_ptr<const SegmentLog> SegmentedDB::ColdStore::Fetch(int64_t number) {
+  ScopedLatency latency(latency_by_op_ms.GetScopedLatency("fetch_cold"));
+  const string compressed_path(
+      SegmentPath(cold_dir_, number, kCompressedSuffix));
+  const int in_fd(open(compressed_path.c_str(), O_RDONLY));
+  if (in_fd < 0) {
+    // It was stored uncompressed, and can be read where it is.
+    PCHECK(errno == ENOENT) << "Failed to open " << compressed_path;
+    const string log_path(SegmentPath(cold_dir_, number, kLogSuffix));
+    const int log_fd(open(log_path.c_str(), O_RDONLY));
+    PCHECK(log_fd >= 0) << "Failed to open " << log_path;
+    return std::make_shared<SegmentLog>(log_fd);
+  }
+
+  // The cached copy is removed right away, so that it goes away with
+  // the last reader, even if we crash.
+  string tmp_path(cache_dir_ + "/segmentXXXXXX");
+  const int out_fd(mkstemp(&tmp_path[0]));
+  PCHECK(out_fd >= 0) << "Failed to create a file in " << cache_dir_;
+  PCHECK(unlink(tmp_path.c_str()) == 0) << "Failed to remove " << tmp_path;
+  shared_ptr<const SegmentLog> log(std::make_shared<SegmentLog>(out_fd));
+
+  ZstdDecompressor decompressor(kMaxLogSize);
+  char buffer[1 << 16];
+  string decompressed;
+  uint64_t size(0);
+  for (;;) {
+    const ssize_t num_read(read(in_fd, buffer, sizeof(buffer)));
+    PCHECK(num_read >= 0 || errno == EINTR) << "Failed to read "
+                                            << compressed_path;
+    if (num_read == 0) {
+      break;
+    }
+    if (num_read > 0) {
+      decompressed.clear();
+      CHECK(decompressor.Decompress(buffer, num_read, &decompressed))
+          << "Failed to decompress " << compressed_path;
+      WriteFully(out_fd, size, decompressed);
+      size += decompressed.size();
+    }
+  }
+  close(in_fd);
+  CHECK(decompressor.AtFrameEnd()) << compressed_path << " is truncated";
+
+  return log;
+}
+
+
+class SegmentedDB::Iterator : public Database::Iterator {
+ public:
+  Iterator(const SegmentedDB* db, int64_t start_index)
+      : db_(CHECK_NOTNULL(db)),
+        next_index_(start_index),
+        mapped_number_(-1),
+        data_(nullptr),
+        size_(0) {
+    CHECK_GE(next_index_, 0);
+  }
+
+  ~Iterator() {
+    Unmap();
+  }
+
+  bool GetNextEntry(LoggedEntry* entry) override {
+    CHECK_NOTNULL(entry);
+    shared_ptr<const SegmentLog> log;
+    uint64_t offset;
+    size_t length;
+    {
+      lock_guard<mutex> lock(db_->lock_);
+      if (next_index_ >= db_->contiguous_size_) {
+        set<int64_t>::const_iterator it(
+            db_->sparse_entries_.lower_bound(next_index_));
+        if (it == db_->sparse_entries_.end()) {
+          return false;
+        }
+
+        next_index_ = *it;
+      }
+      const Segment* segment;
+      CHECK(db_->FindEntry(next_index_, &segment, &offset, &length));
+      log = segment->log();
+    }
+    const int64_t number(next_index_ / db_->entries_per_segment_);
+    if (!log) {
+      // The log already mapped stays usable, even if it moved to cold
+      // storage meanwhile.
+      log = number == mapped_number_ ? log_
+                                     : db_->cold_store_->Get(number);
+    }
+
+    // Scanning a segment reads through its log file mostly in order,
+    // so map all of it, and only map it again if it has since grown
+    // past the entries read so far.
+    if (log != log_ || offset + length > size_) {
+      Map(number, log);
+    }
+    CHECK(entry->ParseFromArray(data_ + offset, length))
+        << "failed to parse entry with sequence number " << next_index_;
+    CHECK_EQ(entry->sequence_number(), next_index_)
+        << "unexpected sequence_number";
+
+    ++next_index_;
+    return true;
+  }
+
+ private:
+  void Map(int64_t number, const shared_ptr<const SegmentLog>& log) {
+    Unmap();
+    mapped_number_ = number;
+    log_ = log;
+    struct stat st;
+    PCHECK(fstat(log_->fd(), &st) == 0);
+    size_ = st.st_size;
+    CHECK_GT(size_, 0U);
+    void* const data(
+        mmap(nullptr, size_, PROT_READ, MAP_SHARED, log_->fd(), 0));
+    PCHECK(data != MAP_FAILED) << "Failed to map a segment";
+    PCHECK(madvise(data, size_, MADV_SEQUENTIAL) == 0);
+    data_ = static_cast<const char*>(data);
+  }
+
+  void Unmap() {
+    if (data_) {
+      PCHECK(munmap(const_cast<char*>(data_), size_) == 0);
+      data_ = nullptr;
+    }
+  }
+
+  const SegmentedDB* const db_;
+  int64_t next_index_;
+  // The log mapped, and the number of its segment.
+  int64_t mapped_number_;
+  shared_ptr<const SegmentLog> log_;
+  const char* data_;
+  size_t size_;
+};
+
+
+const size_t SegmentedDB::kTimestampBytesIndexed = 6;
+
+
+SegmentedDB::SegmentedDB(const string& dir)
+    : segment_dir_(MakeDir(MakeDir(dir) + "/segments")),
+      tree_storage_(
+          new FileStorage(MakeDir(dir + "/tree"), kTreeStorageDepth)),
+      meta_storage_(new FileStorage(MakeDir(dir + "/meta"), 0)),
+      cold_store_(FLAGS_segmented_db_cold_dir.empty()
+                      ? nullptr
+                      : new ColdStore(
+                            FLAGS_segmented_db_cold_dir, dir + "/cache",
+                            FLAGS_segmented_db_cold_cache_segments)),
+      entries_per_segment_(0),
+      offload_pending_(true),
+      contiguous_size_(0),
+      id_by_hash_memory_("id_by_hash"),
+      latest_tree_timestamp_(0) {
+  ScopedLatency latency(latency_by_op_ms.GetScopedLatency("open"));
+  CHECK_GE(FLAGS_segmented_db_hot_segments, 1);
+  BuildIndex();
+  OffloadColdSegments();
+}
+
+
+SegmentedDB::~SegmentedDB() {
+}
+
+
+Database::WriteResult SegmentedDB::CreateSequencedEntry_(
+    const LoggedEntry& logged) {
+  CHECK(logged.has_sequence_number());
+  CHECK_GE(logged.sequence_number(), 0);
+  ScopedLatency latency(
+      latency_by_op_ms.GetScopedLatency("create_sequenced_entry"));
+
+  string data;
+  CHECK(logged.SerializeToString(&data));
+
+  unique_lock<mutex> lock(lock_);
+
+  const Database::WriteResult result(CreateSequencedEntryNoLock(logged, data));
+  lock.unlock();
+  OffloadColdSegments();
+  return result;
+}
+
+
+Database::WriteResult SegmentedDB::CreateSequencedEntries_(
+    const vector<LoggedEntry>& logged) {
+  ScopedLatency latency(
+      latency_by_op_ms.GetScopedLatency("create_sequenced_entries"));
+
+  // Serialize everything before taking the lock, then write the whole
+  // batch under a single acquisition of it.
+  vector<string> data(logged.size());
+  for (size_t i = 0; i < logged.size(); ++i) {
+    CHECK(logged[i].SerializeToString(&data[i]));
+  }
+
+  unique_lock<mutex> lock(lock_);
+
+  Database::WriteResult result(this->OK);
+  for (size_t i = 0; i < logged.size() && result == this->OK; ++i) {
+    result = CreateSequencedEntryNoLock(logged[i], data[i]);
+  }
+  lock.unlock();
+  OffloadColdSegments();
+
+  return result;
+}
+
+
+// This must be called with "lock_" held.
+Database::WriteResult SegmentedDB::CreateSequencedEntryNoLock(
+    const LoggedEntry& logged, const string& data) {
+  CHECK_GE(logged.sequence_number(), 0);
+  Segment* const segment(GetSegment(logged.sequence_number(), true));
+  const int64_t index(logged.sequence_number() % entries_per_segment_);
+
+  uint64_t offset;
+  size_t length;
+  if (segment->GetSlot(index, &offset, &length, nullptr)) {
+    string existing_data;
+    shared_ptr<const SegmentLog> log(segment->log());
+    if (!log) {
+      log = cold_store_->Get(logged.sequence_number() / entries_per_segment_);
+    }
+    log->Read(offset, length, &existing_data);
+    if (existing_data == data) {
+      return this->OK;
+    }
+    return this->SEQUENCE_NUMBER_ALREADY_IN_USE;
+  }
+
+  const string hash(logged.Hash());
+  segment->NoteTimestamp(index, logged.timestamp());
+  segment->Append(index, hash, data);
+  InsertEntryMapping(logged.sequence_number(), hash);
+  if (segment->complete()) {
+    offload_pending_ = true;
+  }
+
+  return this->OK;
+}
+
+
+Database::LookupResult SegmentedDB::LookupByHash(const string& hash,
+                                                 LoggedEntry* result) const {
+  ScopedLatency latency(latency_by_op_ms.GetScopedLatency("lookup_by_hash"));
+
+  unique_lock<mutex> lock(lock_);
+
+  auto i(id_by_hash_.find(hash));
+  if (i == id_by_hash_.end()) {
+    return this->NOT_FOUND;
+  }
+  const int64_t sequence_number(i->second);
+
+  lock.unlock();
+
+  // Gotta be there, or we're in trouble...
+  CHECK_EQ(ReadEntry(sequence_number, result), this->LOOKUP_OK);
+  if (result) {
+    CHECK_EQ(result->Hash(), hash);
+  }
+
+  return this->LOOKUP_OK;
+}
+
+
+Database::LookupResult SegmentedDB::LookupByIndex(int64_t sequence_number,
+                                                  LoggedEntry* result) const {
+  CHECK_GE(sequence_number, 0);
+  ScopedLatency latency(latency_by_op_ms.GetScopedLatency("lookup_by_index"));
+
+  return ReadEntry(sequence_number, result);
+}
+
+
+unique_ptr<Database::Iterator> SegmentedDB::ScanEntries(
+    int64_t start_index) const {
+  return unique_ptr<Iterator>(new Iterator(this, start_index));
+}
+
+
+Database::WriteResult SegmentedDB::WriteTreeHead_(
+    const ct::SignedTreeHead& sth) {
+  CHECK_GE(sth.tree_size(), 0);
+  ScopedLatency latency(latency_by_op_ms.GetScopedLatency("write_tree_head"));
+
+  // 6 bytes are good enough for some 9000 years.
+  string timestamp_key =
+      Serializer::SerializeUint(sth.timestamp(),
+                                SegmentedDB::kTimestampBytesIndexed);
+  string data;
+  CHECK(sth.SerializeToString(&data));
+
+  unique_lock<mutex> lock(lock_);
+  util::Status status(tree_storage_->CreateEntry(timestamp_key, data));
+  if (status.CanonicalCode() == util::error::ALREADY_EXISTS) {
+    string existing_sth_data;
+    status = tree_storage_->LookupEntry(timestamp_key, &existing_sth_data);
+    CHECK_EQ(status, ::util::OkStatus());
+    if (existing_sth_data == data) {
+      LOG(WARNING) << "Attempted to store identical STH in DB.";
+      return this->OK;
+    }
+    return this->DUPLICATE_TREE_HEAD_TIMESTAMP;
+  }
+  CHECK_EQ(status, ::util::OkStatus());
+
+  if (sth.timestamp() > latest_tree_timestamp_) {
+    latest_tree_timestamp_ = sth.timestamp();
+    latest_timestamp_key_ = timestamp_key;
+  }
+
+  lock.unlock();
+  callbacks_.Call(sth);
+
+  return this->OK;
+}
+
+
+Database::LookupResult SegmentedDB::LatestTreeHead(
+    ct::SignedTreeHead* result) const {
+  ScopedLatency latency(latency_by_op_ms.GetScopedLatency("latest_tree_head"));
+  lock_guard<mutex> lock(lock_);
+
+  return LatestTreeHeadNoLock(result);
+}
+
+
+void SegmentedDB::TimestampRange(uint64_t min_timestamp,
+                                 uint64_t max_timestamp, int64_t* begin,
+                                 int64_t* end) const {
+  ScopedLatency latency(latency_by_op_ms.GetScopedLatency("timestamp_range"));
+  CHECK_NOTNULL(begin);
+  CHECK_NOTNULL(end);
+  *begin = 0;
+  *end = 0;
+
+  lock_guard<mutex> lock(lock_);
+  bool found(false);
+  for (const auto& it : segments_) {
+    const int64_t first_index(it.first * entries_per_segment_);
+    if (first_index >= contiguous_size_) {
+      break;
+    }
+    int64_t segment_begin;
+    int64_t segment_end;
+    if (!it.second->FindTimestamps(min_timestamp, max_timestamp,
+                                   &segment_begin, &segment_end)) {
+      continue;
+    }
+    if (!found) {
+      *begin = first_index + segment_begin;
+      found = true;
+    }
+    *end = min(first_index + segment_end, contiguous_size_);
+  }
+}
+
+
+int64_t SegmentedDB::TreeSize() const {
+  ScopedLatency latency(latency_by_op_ms.GetScopedLatency("tree_size"));
+  lock_guard<mutex> lock(lock_);
+
+  return contiguous_size_;
+}
+
+
+void SegmentedDB::AddNotifySTHCallback(
+    const Database::NotifySTHCallback* callback) {
+  unique_lock<mutex> lock(lock_);
+
+  callbacks_.Add(callback);
+
+  ct::SignedTreeHead sth;
+  if (LatestTreeHeadNoLock(&sth) == this->LOOKUP_OK) {
+    lock.unlock();
+    (*callback)(sth);
+  }
+}
+
+
+void SegmentedDB::RemoveNotifySTHCallback(
+    const Database::NotifySTHCallback* callback) {
+  // Not under |lock_|: |callbacks_| has a lock of its own, and may
+  // wait for callbacks that read from the database.
+  callbacks_.Remove(callback);
+}
+
+
+void SegmentedDB::InitializeNode(const string& node_id) {
+  CHECK(!node_id.empty());
+  ScopedLatency latency(latency_by_op_ms.GetScopedLatency("initialize_node"));
+  unique_lock<mutex> lock(lock_);
+  string existing_id;
+  if (NodeId(&existing_id) != this->NOT_FOUND) {
+    LOG(FATAL)
+        << "Attempting to initialize DB belonging to node with node_id: "
+        << existing_id;
+  }
+  CHECK(meta_storage_->CreateEntry(kMetaNodeIdKey, node_id).ok());
+}
+
+
+Database::LookupResult SegmentedDB::NodeId(string* node_id) {
+  CHECK_NOTNULL(node_id);
+  if (!meta_storage_->LookupEntry(kMetaNodeIdKey, node_id).ok()) {
+    return this->NOT_FOUND;
+  }
+  return this->LOOKUP_OK;
+}
+
+
+void SegmentedDB::WriteTreeFrontier(const ct::CompactTreeFrontier& frontier) {
+  ScopedLatency latency(
+      latency_by_op_ms.GetScopedLatency("write_tree_frontier"));
+  string data;
+  CHECK(frontier.SerializeToString(&data));
+
+  lock_guard<mutex> lock(lock_);
+  string existing;
+  if (meta_storage_->LookupEntry(kMetaTreeFrontierKey, &existing).ok()) {
+    CHECK(meta_storage_->UpdateEntry(kMetaTreeFrontierKey, data).ok());
+  } else {
+    CHECK(meta_storage_->CreateEntry(kMetaTreeFrontierKey, data).ok());
+  }
+}
+
+
+Database::LookupResult SegmentedDB::LatestTreeFrontier(
+    ct::CompactTreeFrontier* result) const {
+  CHECK_NOTNULL(result);
+  ScopedLatency latency(
+      latency_by_op_ms.GetScopedLatency("latest_tree_frontier"));
+  string data;
+  {
+    lock_guard<mutex> lock(lock_);
+    if (!meta_storage_->LookupEntry(kMetaTreeFrontierKey, &data).ok()) {
+      return this->NOT_FOUND;
+    }
+  }
+  CHECK(result->ParseFromString(data));
+  return this->LOOKUP_OK;
+}
+
+
+void SegmentedDB::BuildIndex() {
+  ScopedLatency latency(latency_by_op_ms.GetScopedLatency("build_index"));
+  // Technically, this should only be called from the constructor, so
+  // this should not be necessarily, but just to be sure...
+  lock_guard<mutex> lock(lock_);
+
+  string entries_per_segment;
+  if (meta_storage_->LookupEntry(kMetaEntriesPerSegmentKey,
+                                 &entries_per_segment)
+          .ok()) {
+    entries_per_segment_ = stoll(entries_per_segment);
+  } else {
+    entries_per_segment_ = FLAGS_segmented_db_entries_per_segment;
+    CHECK(meta_storage_->CreateEntry(kMetaEntriesPerSegmentKey,
+                                     to_string(entries_per_segment_))
+              .ok());
+  }
+  CHECK_GT(entries_per_segment_, 0);
+
+  // Only the index files are read, not the entries themselves.
+  set<int64_t> numbers;
+  DIR* const dir(CHECK_NOTNULL(opendir(segment_dir_.c_str())));
+  struct dirent* entry;
+  while ((entry = readdir(dir)) != NULL) {
+    const size_t name_length(strlen(entry->d_name));
+    const size_t suffix_length(strlen(kIndexSuffix));
+    if (entry->d_name[0] == '.' || name_length <= suffix_length ||
+        strcmp(entry->d_name + name_length - suffix_length, kIndexSuffix)) {
+      continue;
+    }
+    char* end;
+    const int64_t number(strtoll(entry->d_name, &end, 10));
+    CHECK_EQ(end, entry->d_name + name_length - suffix_length)
+        << "Unexpected file in " << segment_dir_ << ": " << entry->d_name;
+    numbers.insert(number);
+  }
+  closedir(dir);
+
+  string hash;
+  for (const int64_t number : numbers) {
+    unique_ptr<Segment> segment(
+        Segment::Open(segment_dir_, number, entries_per_segment_, false));
+    CHECK(segment) << "Failed to open segment " << number;
+    CHECK(segment->log() || cold_store_)
+        << "Segment " << number << " is in cold storage, but "
+        << "--segmented_db_cold_dir is not set";
+    for (int64_t index = 0; index < entries_per_segment_; ++index) {
+      uint64_t offset;
+      size_t length;
+      if (segment->GetSlot(index, &offset, &length, &hash)) {
+        CHECK_LE(offset + length, segment->log_size())
+            << "Entry " << number * entries_per_segment_ + index
+            << " is past the end of its segment";
+        InsertEntryMapping(number * entries_per_segment_ + index, hash);
+        if (segment->timestamps_missing()) {
+          shared_ptr<const SegmentLog> log(segment->log());
+          if (!log) {
+            log = cold_store_->Get(number);
+          }
+          string data;
+          log->Read(offset, length, &data);
+          LoggedEntry logged;
+          CHECK(logged.ParseFromString(data));
+          segment->NoteTimestamp(index, logged.timestamp());
+        }
+      }
+    }
+    if (segment->timestamps_missing()) {
+      LOG(INFO) << "Indexed the timestamps of segment " << number;
+      segment->CommitTimestamps();
+    }
+    segments_[number] = move(segment);
+  }
+
+  // Now read the STH entries.
+  set<string> sth_timestamps = tree_storage_->Scan();
+  if (!sth_timestamps.empty()) {
+    latest_timestamp_key_ = *sth_timestamps.rbegin();
+    CHECK_EQ(DeserializeResult::OK,
+             Deserializer::DeserializeUint<uint64_t>(
+                 latest_timestamp_key_, SegmentedDB::kTimestampBytesIndexed,
+                 &latest_tree_timestamp_));
+  }
+}
+
+
+// This must be called with "lock_" held.
+SegmentedDB::Segment* SegmentedDB::GetSegment(int64_t sequence_number,
+                                              bool create) {
+  const int64_t number(sequence_number / entries_per_segment_);
+  auto it(segments_.find(number));
+  if (it != segments_.end()) {
+    return it->second.get();
+  }
+
+  unique_ptr<Segment> segment(
+      Segment::Open(segment_dir_, number, entries_per_segment_, create));
+  if (!segment) {
+    return nullptr;
+  }
+  if (segment->timestamps_missing()) {
+    // All the existing segments are opened along with the database,
+    // so this one is new and empty.
+    segment->CommitTimestamps();
+  }
+  Segment* const retval(segment.get());
+  segments_[number] = move(segment);
+  // Older segments might now be old enough to move to cold storage.
+  offload_pending_ = true;
+  return retval;
+}
+
+
+void SegmentedDB::OffloadColdSegments() {
+  if (!cold_store_) {
+    return;
+  }
+  // Writers do not wait for another one to be done with this.
+  unique_lock<mutex> offload_lock(offload_lock_, std::try_to_lock);
+  if (!offload_lock.owns_lock()) {
+    return;
+  }
+
+  for (;;) {
+    int64_t number(-1);
+    {
+      lock_guard<mutex> lock(lock_);
+      if (!offload_pending_ || segments_.empty()) {
+        return;
+      }
+      const int64_t last_cold(segments_.rbegin()->first -
+                              FLAGS_segmented_db_hot_segments);
+      for (const auto& it : segments_) {
+        if (it.first > last_cold) {
+          break;
+        }
+        if (it.second->log() && it.second->complete()) {
+          number = it.first;
+          break;
+        }
+      }
+      if (number < 0) {
+        offload_pending_ = false;
+        return;
+      }
+    }
+
+    // The segment is complete, so its log no longer changes, and can be
+    // copied without holding the lock.
+    ScopedLatency latency(latency_by_op_ms.GetScopedLatency("offload"));
+    cold_store_->Put(number, SegmentPath(segment_dir_, number, kLogSuffix));
+    LOG(INFO) << "Moved segment " << number << " to cold storage";
+
+    lock_guard<mutex> lock(lock_);
+    segments_[number]->MakeCold();
+  }
+}
+
+
+// This must be called with "lock_" held.
+bool SegmentedDB::FindEntry(int64_t sequence_number, const Segment** segment,
+                            uint64_t* offset, size_t* length) const {
+  // All the existing segments are opened along with the database.
+  auto it(segments_.find(sequence_number / entries_per_segment_));
+  if (it == segments_.end()) {
+    return false;
+  }
+  *segment = it->second.get();
+  return (*segment)->GetSlot(sequence_number % entries_per_segment_, offset,
+                             length, nullptr);
+}
+
+
+Database::LookupResult SegmentedDB::ReadEntry(int64_t sequence_number,
+                                              LoggedEntry* result) const {
+  shared_ptr<const SegmentLog> log;
+  uint64_t offset;
+  size_t length;
+  {
+    lock_guard<mutex> lock(lock_);
+    const Segment* segment;
+    if (!FindEntry(sequence_number, &segment, &offset, &length)) {
+      return this->NOT_FOUND;
+    }
+    log = segment->log();
+  }
+
+  if (result) {
+    if (!log) {
+      log = cold_store_->Get(sequence_number / entries_per_segment_);
+    }
+    string data;
+    log->Read(offset, length, &data);
+    CHECK(result->ParseFromString(data));
+    CHECK_EQ(result->sequence_number(), sequence_number);
+  }
+  return this->LOOKUP_OK;
+}
+
+
+Database::LookupResult SegmentedDB::LatestTreeHeadNoLock(
+    ct::SignedTreeHead* result) const {
+  if (latest_tree_timestamp_ == 0) {
+    return this->NOT_FOUND;
+  }
+
+  string tree_data;
+  CHECK_EQ(tree_storage_->LookupEntry(latest_timestamp_key_, &tree_data),
+           ::util::OkStatus());
+
+  CHECK(result->ParseFromString(tree_data));
+  CHECK_EQ(result->timestamp(), latest_tree_timestamp_);
+
+  return this->LOOKUP_OK;
+}
+
+
+// This must be called with "lock_" held.
+void SegmentedDB::InsertEntryMapping(int64_t sequence_number,
+                                     const string& hash) {
+  if (!id_by_hash_.insert(make_pair(hash, sequence_number)).second) {
+    // This is a duplicate hash under a new sequence number.
+    // Make sure we track the entry with the lowest sequence number:
+    id_by_hash_[hash] = min(id_by_hash_[hash], sequence_number);
+  }
+  id_by_hash_memory_.Set(UnorderedMapByteSize(id_by_hash_, hash.size() + 1));
+
+  if (sequence_number == contiguous_size_) {
+    ++contiguous_size_;
+    for (auto i = sparse_entries_.find(contiguous_size_);
+         i != sparse_entries_.end() && *i == contiguous_size_;) {
+      ++contiguous_size_;
+      i = sparse_entries_.erase(i);
+    }
+  } else {
+    // It's not contiguous, put it with the other sparse entries.
+    CHECK(sparse_entries_.insert(sequence_number).second)
+        << "sequence number " << sequence_number << " already assigned.";
+  }
+}
+
+
+}  // namespace cert_trans
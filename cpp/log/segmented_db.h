@@ -0,0 +1,165 @@
+#ifndef CERT_TRANS_LOG_SEGMENTED_DB_H_
+#define CERT_TRANS_LOG_SEGMENTED_DB_H_
+
+#include <stdint.h>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <set>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "log/database.h"
+#include "monitoring/memory_usage.h"
+#include "proto/ct.pb.h"
+
+namespace cert_trans {
+
+class FileStorage;
+
+
+// Database that appends the sequenced entries to segment files, each
+// covering a fixed range of sequence numbers, instead of keeping one
+// file per entry like FileDB does:
+//
+// <dir>/segments/<n>.log - The entries of segment <n>, in the order
+//                          they were written, each one preceded by
+//                          its length (4 bytes, big-endian). Only
+//                          ever appended to.
+// <dir>/segments/<n>.idx - One fixed-width slot per sequence number of
+//                          the segment, with the location of the entry
+//                          in the log file and its hash; the slot is
+//                          written last, which is what commits the
+//                          entry.
+// <dir>/segments/<n>.cold - Present once the log of segment <n> has
+//                          moved to cold storage, with its size.
+// <dir>/segments/<n>.ts  - The lowest and highest SCT timestamps of
+//                          each block of 256 slots of the segment, to
+//                          find entries by time with TimestampRange().
+// <dir>/tree, <dir>/meta - Tree heads and meta data, in FileStorage.
+//
+// Looking up an entry by index is a read of its slot and a single
+// pread() of the log, and scans map the log files and read them in
+// order. Opening the database reads the index files, not the entries,
+// and a complete segment is never written again, so it can be copied
+// as it is.
+//
+// The number of entries per segment is chosen when the database is
+// created, from --segmented_db_entries_per_segment.
+//
+// With --segmented_db_cold_dir, the logs of complete segments, other
+// than the most recent ones, are compressed into that directory, which
+// can be a mounted object store, and removed locally. The index files
+// stay local, so lookups by hash and opening the database do not touch
+// cold storage, and reads of cold entries go through a small cache of
+// segments on local disk (<dir>/cache).
+class SegmentedDB : public Database {
+ public:
+  // Opens, or creates, the database in |dir|, which must exist.
+  explicit SegmentedDB(const std::string& dir);
+  ~SegmentedDB();
+  SegmentedDB(const SegmentedDB&) = delete;
+  SegmentedDB& operator=(const SegmentedDB&) = delete;
+
+  static const size_t kTimestampBytesIndexed;
+
+  // Implement abstract functions, see database.h for comments.
+  Database::WriteResult CreateSequencedEntry_(
+      const LoggedEntry& logged) override;
+
+  Database::WriteResult CreateSequencedEntries_(
+      const std::vector<LoggedEntry>& logged) override;
+
+  Database::LookupResult LookupByHash(const std::string& hash,
+                                      LoggedEntry* result) const override;
+
+  Database::LookupResult LookupByIndex(int64_t sequence_number,
+                                       LoggedEntry* result) const override;
+
+  std::unique_ptr<Database::Iterator> ScanEntries(
+      int64_t start_index) const override;
+
+  Database::WriteResult WriteTreeHead_(const ct::SignedTreeHead& sth) override;
+
+  Database::LookupResult LatestTreeHead(
+      ct::SignedTreeHead* result) const override;
+
+  void TimestampRange(uint64_t min_timestamp, uint64_t max_timestamp,
+                      int64_t* begin, int64_t* end) const override;
+
+  int64_t TreeSize() const override;
+
+  void AddNotifySTHCallback(
+      const Database::NotifySTHCallback* callback) override;
+
+  void RemoveNotifySTHCallback(
+      const Database::NotifySTHCallback* callback) override;
+
+  void InitializeNode(const std::string& node_id) override;
+
+  Database::LookupResult NodeId(std::string* node_id) override;
+
+  void WriteTreeFrontier(const ct::CompactTreeFrontier& frontier) override;
+
+  Database::LookupResult LatestTreeFrontier(
+      ct::CompactTreeFrontier* result) const override;
+
+ private:
+  class ColdStore;
+  class Iterator;
+  class Segment;
+
+  void BuildIndex();
+  // Returns the segment holding |sequence_number|, opening it first if
+  // needed. Returns nullptr if it does not exist and |create| is false.
+  Segment* GetSegment(int64_t sequence_number, bool create);
+  Database::WriteResult CreateSequencedEntryNoLock(const LoggedEntry& logged,
+                                                   const std::string& data);
+  // Finds where the entry with |sequence_number| is stored, returning
+  // false if there is no such entry.
+  bool FindEntry(int64_t sequence_number, const Segment** segment,
+                 uint64_t* offset, size_t* length) const;
+  Database::LookupResult ReadEntry(int64_t sequence_number,
+                                   LoggedEntry* result) const;
+  Database::LookupResult LatestTreeHeadNoLock(
+      ct::SignedTreeHead* result) const;
+  void InsertEntryMapping(int64_t sequence_number, const std::string& hash);
+  // Moves the segments old enough for it to cold storage, if a write
+  // might have made some so.
+  void OffloadColdSegments();
+
+  const std::string segment_dir_;
+  const std::unique_ptr<FileStorage> tree_storage_;
+  const std::unique_ptr<FileStorage> meta_storage_;
+  // nullptr if there is no cold storage.
+  const std::unique_ptr<ColdStore> cold_store_;
+
+  mutable std::mutex lock_;
+  std::mutex offload_lock_;
+
+  int64_t entries_per_segment_;
+  bool offload_pending_;
+  // Segments are never closed until the database is, so pointers to
+  // them stay valid.
+  std::map<int64_t, std::unique_ptr<Segment>> segments_;
+
+  int64_t contiguous_size_;
+  std::unordered_map<std::string, int64_t> id_by_hash_;
+  MemoryUsage id_by_hash_memory_;
+
+  // This is a mapping of the non-contiguous entries of the log (which
+  // can happen while it is being fetched). When entries here become
+  // contiguous with the head of the tree they'll be removed.
+  std::set<int64_t> sparse_entries_;
+
+  uint64_t latest_tree_timestamp_;
+  // The same as a string;
+  std::string latest_timestamp_key_;
+  DatabaseNotifierHelper callbacks_;
+};
+
+
+}  // namespace cert_trans
+
+#endif  // CERT_TRANS_LOG_SEGMENTED_DB_H_
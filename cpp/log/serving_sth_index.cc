@@ -0,0 +1,78 @@
+#include "log/serving_sth_index.h"
+
+#include <glog/logging.h>
+#include <algorithm>
+
+using ct::SignedTreeHead;
+using std::lower_bound;
+using std::make_pair;
+using std::string;
+using std::upper_bound;
+
+namespace cert_trans {
+
+
+void ServingSTHIndex::Set(const string& node_id, const SignedTreeHead& sth) {
+  CHECK_LE(0, sth.tree_size());
+  Remove(node_id);
+
+  sths_.emplace(node_id, sth);
+  CHECK(nodes_by_size_[sth.tree_size()]
+            .emplace(sth.timestamp(), node_id)
+            .second);
+  sizes_.insert(upper_bound(sizes_.begin(), sizes_.end(), sth.tree_size()),
+                sth.tree_size());
+}
+
+
+void ServingSTHIndex::Remove(const string& node_id) {
+  const auto it(sths_.find(node_id));
+  if (it == sths_.end()) {
+    return;
+  }
+  const int64_t tree_size(it->second.tree_size());
+
+  const auto nodes(nodes_by_size_.find(tree_size));
+  CHECK(nodes != nodes_by_size_.end());
+  CHECK_EQ(1U, nodes->second.erase(make_pair(it->second.timestamp(),
+                                             node_id)));
+  if (nodes->second.empty()) {
+    nodes_by_size_.erase(nodes);
+  }
+
+  const auto size(lower_bound(sizes_.begin(), sizes_.end(), tree_size));
+  CHECK(size != sizes_.end() && *size == tree_size);
+  sizes_.erase(size);
+
+  sths_.erase(it);
+}
+
+
+int64_t ServingSTHIndex::CoveredTreeSize(size_t num_nodes) const {
+  CHECK_LT(0U, num_nodes);
+  if (num_nodes > sizes_.size()) {
+    return -1;
+  }
+  return sizes_[sizes_.size() - num_nodes];
+}
+
+
+size_t ServingSTHIndex::NumNodesAtLeast(int64_t tree_size) const {
+  return sizes_.end() - lower_bound(sizes_.begin(), sizes_.end(), tree_size);
+}
+
+
+const SignedTreeHead* ServingSTHIndex::NewestSTHAtMost(
+    int64_t tree_size) const {
+  auto it(nodes_by_size_.upper_bound(tree_size));
+  if (it == nodes_by_size_.begin()) {
+    return nullptr;
+  }
+  --it;
+  const auto sth(sths_.find(it->second.begin()->second));
+  CHECK(sth != sths_.end());
+  return &sth->second;
+}
+
+
+}  // namespace cert_trans
@@ -0,0 +1,91 @@
+#ifndef CERT_TRANS_LOG_SERVING_STH_INDEX_H_
+#define CERT_TRANS_LOG_SERVING_STH_INDEX_H_
+
+#include <stddef.h>
+#include <stdint.h>
+#include <map>
+#include <set>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "proto/ct.pb.h"
+
+namespace cert_trans {
+
+
+// The newest STH of each node of a cluster, indexed for picking the
+// STH the cluster should serve.
+//
+// Nodes are added, changed and removed one at a time, so that the
+// index follows the cluster state without going over all the nodes
+// each time one of them reports a new STH. The tree sizes are kept
+// sorted, which makes finding the largest tree size that some number
+// of nodes can serve a constant time lookup, and the STHs are grouped
+// by tree size, newest first.
+//
+// This class is thread-compatible, but not thread-safe.
+class ServingSTHIndex {
+ public:
+  ServingSTHIndex() = default;
+  ServingSTHIndex(const ServingSTHIndex&) = delete;
+  ServingSTHIndex& operator=(const ServingSTHIndex&) = delete;
+
+  // Sets the newest STH of |node_id|, replacing the previous one, if
+  // any.
+  void Set(const std::string& node_id, const ct::SignedTreeHead& sth);
+
+  // Forgets the STH of |node_id|, if there is one.
+  void Remove(const std::string& node_id);
+
+  // Returns the |num_nodes|th largest tree size, which at least
+  // |num_nodes| nodes have an STH for, or -1 if fewer nodes have an
+  // STH.
+  int64_t CoveredTreeSize(size_t num_nodes) const;
+
+  // Returns the number of nodes with an STH at least |tree_size| in
+  // size.
+  size_t NumNodesAtLeast(int64_t tree_size) const;
+
+  // Returns the newest STH of the largest tree size no larger than
+  // |tree_size|, or nullptr if there is none. Between STHs with the
+  // same timestamp, that of the first node (by node ID) is returned.
+  const ct::SignedTreeHead* NewestSTHAtMost(int64_t tree_size) const;
+
+  // Returns the largest tree size of any node, or -1 if there is no
+  // node.
+  int64_t MaxTreeSize() const {
+    return sizes_.empty() ? -1 : sizes_.back();
+  }
+
+  // The newest STH of each node, by node ID.
+  const std::map<std::string, ct::SignedTreeHead>& sths() const {
+    return sths_;
+  }
+
+  // The number of nodes with an STH.
+  size_t size() const {
+    return sths_.size();
+  }
+
+ private:
+  // Orders by timestamp, newest first, then node ID.
+  struct NewestFirst {
+    bool operator()(const std::pair<uint64_t, std::string>& a,
+                    const std::pair<uint64_t, std::string>& b) const {
+      return a.first != b.first ? a.first > b.first : a.second < b.second;
+    }
+  };
+
+  std::map<std::string, ct::SignedTreeHead> sths_;
+  // The (timestamp, node ID) of each node, by tree size.
+  std::map<int64_t, std::set<std::pair<uint64_t, std::string>, NewestFirst>>
+      nodes_by_size_;
+  // The tree size of each node, in ascending order.
+  std::vector<int64_t> sizes_;
+};
+
+
+}  // namespace cert_trans
+
+#endif  // CERT_TRANS_LOG_SERVING_STH_INDEX_H_
@@ -0,0 +1,119 @@
+#include "log/serving_sth_index.h"
+
+#include <gtest/gtest.h>
+#include <string>
+
+#include "util/testing.h"
+
+namespace cert_trans {
+namespace {
+
+using ct::SignedTreeHead;
+using std::string;
+
+
+SignedTreeHead MakeSTH(int64_t tree_size, uint64_t timestamp) {
+  SignedTreeHead ret;
+  ret.set_tree_size(tree_size);
+  ret.set_timestamp(timestamp);
+  return ret;
+}
+
+
+class ServingSTHIndexTest : public ::testing::Test {
+ protected:
+  ServingSTHIndex index_;
+};
+
+
+TEST_F(ServingSTHIndexTest, Empty) {
+  EXPECT_EQ(0U, index_.size());
+  EXPECT_EQ(-1, index_.MaxTreeSize());
+  EXPECT_EQ(-1, index_.CoveredTreeSize(1));
+  EXPECT_EQ(0U, index_.NumNodesAtLeast(0));
+  EXPECT_EQ(nullptr, index_.NewestSTHAtMost(100));
+}
+
+
+TEST_F(ServingSTHIndexTest, CoveredTreeSize) {
+  index_.Set("a", MakeSTH(100, 1));
+  index_.Set("b", MakeSTH(300, 2));
+  index_.Set("c", MakeSTH(200, 3));
+  index_.Set("d", MakeSTH(200, 4));
+
+  EXPECT_EQ(4U, index_.size());
+  EXPECT_EQ(300, index_.MaxTreeSize());
+  EXPECT_EQ(300, index_.CoveredTreeSize(1));
+  EXPECT_EQ(200, index_.CoveredTreeSize(2));
+  EXPECT_EQ(200, index_.CoveredTreeSize(3));
+  EXPECT_EQ(100, index_.CoveredTreeSize(4));
+  EXPECT_EQ(-1, index_.CoveredTreeSize(5));
+
+  EXPECT_EQ(4U, index_.NumNodesAtLeast(100));
+  EXPECT_EQ(3U, index_.NumNodesAtLeast(101));
+  EXPECT_EQ(3U, index_.NumNodesAtLeast(200));
+  EXPECT_EQ(1U, index_.NumNodesAtLeast(300));
+  EXPECT_EQ(0U, index_.NumNodesAtLeast(301));
+}
+
+
+TEST_F(ServingSTHIndexTest, NewestSTHAtMost) {
+  index_.Set("a", MakeSTH(100, 1));
+  index_.Set("b", MakeSTH(200, 5));
+  index_.Set("c", MakeSTH(200, 3));
+  index_.Set("d", MakeSTH(200, 5));
+
+  EXPECT_EQ(nullptr, index_.NewestSTHAtMost(99));
+  ASSERT_NE(nullptr, index_.NewestSTHAtMost(199));
+  EXPECT_EQ(100, index_.NewestSTHAtMost(199)->tree_size());
+  // The newest, and the first node between those with the same
+  // timestamp.
+  EXPECT_EQ(index_.NewestSTHAtMost(200), index_.NewestSTHAtMost(1000));
+  ASSERT_NE(nullptr, index_.NewestSTHAtMost(200));
+  EXPECT_EQ(200, index_.NewestSTHAtMost(200)->tree_size());
+  EXPECT_EQ(5U, index_.NewestSTHAtMost(200)->timestamp());
+
+  index_.Remove("b");
+  EXPECT_EQ(5U, index_.NewestSTHAtMost(200)->timestamp());
+  index_.Remove("d");
+  EXPECT_EQ(3U, index_.NewestSTHAtMost(200)->timestamp());
+}
+
+
+TEST_F(ServingSTHIndexTest, FollowsNodes) {
+  index_.Set("a", MakeSTH(100, 1));
+  index_.Set("b", MakeSTH(100, 2));
+  EXPECT_EQ(100, index_.CoveredTreeSize(2));
+
+  // Nodes move on to larger trees.
+  index_.Set("a", MakeSTH(200, 3));
+  EXPECT_EQ(2U, index_.size());
+  EXPECT_EQ(200, index_.CoveredTreeSize(1));
+  EXPECT_EQ(100, index_.CoveredTreeSize(2));
+  EXPECT_EQ(2U, index_.NewestSTHAtMost(100)->timestamp());
+
+  index_.Set("b", MakeSTH(200, 4));
+  EXPECT_EQ(200, index_.CoveredTreeSize(2));
+  EXPECT_EQ(nullptr, index_.NewestSTHAtMost(199));
+  EXPECT_EQ(4U, index_.NewestSTHAtMost(200)->timestamp());
+
+  // And leave.
+  index_.Remove("b");
+  index_.Remove("unknown");
+  EXPECT_EQ(1U, index_.size());
+  EXPECT_EQ(-1, index_.CoveredTreeSize(2));
+  EXPECT_EQ(3U, index_.NewestSTHAtMost(200)->timestamp());
+  index_.Remove("a");
+  EXPECT_EQ(0U, index_.size());
+  EXPECT_EQ(nullptr, index_.NewestSTHAtMost(200));
+}
+
+
+}  // namespace
+}  // namespace cert_trans
+
+
+int main(int argc, char** argv) {
+  cert_trans::test::InitTesting(argv[0], &argc, &argv, true);
+  return RUN_ALL_TESTS();
+}
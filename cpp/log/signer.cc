@@ -5,6 +5,7 @@
 #include <openssl/evp.h>
 #include <openssl/opensslv.h>
 #include <stdint.h>
+#include <utility>
 
 #include "log/verifier.h"
 #include "proto/ct.pb.h"
@@ -15,6 +16,10 @@
 #endif
 
 using cert_trans::Verifier;
+using std::lock_guard;
+using std::move;
+using std::mutex;
+using std::unique_ptr;
 
 namespace cert_trans {
 
@@ -43,7 +48,7 @@ void Signer::Sign(const std::string& data,
                   ct::DigitallySigned* signature) const {
   signature->set_hash_algorithm(hash_algo_);
   signature->set_sig_algorithm(sig_algo_);
-  signature->set_signature(RawSign(data));
+  RawSign(data, signature->mutable_signature());
 }
 
 Signer::Signer()
@@ -51,22 +56,40 @@ Signer::Signer()
       sig_algo_(ct::DigitallySigned::ANONYMOUS) {
 }
 
-std::string Signer::RawSign(const std::string& data) const {
-  EVP_MD_CTX ctx;
-  EVP_MD_CTX_init(&ctx);
+void Signer::RawSign(const std::string& data,
+                     std::string* signature) const {
+  unique_ptr<ScopedEVP_MD_CTX> ctx(TakeContext());
   // NOTE: this syntax for setting the hash function requires OpenSSL >= 1.0.0.
-  CHECK_EQ(1, EVP_SignInit(&ctx, EVP_sha256()));
-  CHECK_EQ(1, EVP_SignUpdate(&ctx, data.data(), data.size()));
+  // Unlike EVP_SignInit, this keeps the digest state of a reused context.
+  CHECK_EQ(1, EVP_SignInit_ex(ctx->get(), EVP_sha256(), nullptr));
+  CHECK_EQ(1, EVP_SignUpdate(ctx->get(), data.data(), data.size()));
+
+  // Sign straight into the result, which is at most this large.
   unsigned int sig_size = EVP_PKEY_size(pkey_.get());
-  unsigned char* sig = new unsigned char[sig_size];
+  signature->resize(sig_size);
+  CHECK_EQ(1, EVP_SignFinal(ctx->get(),
+                            reinterpret_cast<unsigned char*>(&(*signature)[0]),
+                            &sig_size, pkey_.get()));
+  signature->resize(sig_size);
 
-  CHECK_EQ(1, EVP_SignFinal(&ctx, sig, &sig_size, pkey_.get()));
+  ReturnContext(move(ctx));
+}
 
-  EVP_MD_CTX_cleanup(&ctx);
-  std::string ret(reinterpret_cast<char*>(sig), sig_size);
+unique_ptr<ScopedEVP_MD_CTX> Signer::TakeContext() const {
+  {
+    lock_guard<mutex> lock(contexts_lock_);
+    if (!contexts_.empty()) {
+      unique_ptr<ScopedEVP_MD_CTX> ctx(move(contexts_.back()));
+      contexts_.pop_back();
+      return ctx;
+    }
+  }
+  return unique_ptr<ScopedEVP_MD_CTX>(new ScopedEVP_MD_CTX);
+}
 
-  delete[] sig;
-  return ret;
+void Signer::ReturnContext(unique_ptr<ScopedEVP_MD_CTX> ctx) const {
+  lock_guard<mutex> lock(contexts_lock_);
+  contexts_.emplace_back(move(ctx));
 }
 
 }  // namespace cert_trans
@@ -1,4 +1,9 @@
-// A base class for signing unstructured data.  This class is mockable.
+// A base class for signing unstructured data.  This class is mockable,
+// and signing elsewhere than in-process (such as with an HSM) is done by
+// overriding Sign().
+//
+// Signing is thread-safe, the digest contexts being kept in a pool for
+// reuse by the next signature, rather than set up for each one.
 
 #ifndef CERT_TRANS_LOG_SIGNER_H_
 #define CERT_TRANS_LOG_SIGNER_H_
@@ -6,6 +11,10 @@
 #include <openssl/evp.h>
 #include <openssl/x509.h>  // for i2d_PUBKEY
 #include <stdint.h>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
 
 #include "proto/ct.pb.h"
 #include "util/openssl_scoped_types.h"
@@ -29,12 +38,20 @@ class Signer {
   Signer();
 
  private:
-  std::string RawSign(const std::string& data) const;
+  // Signs |data| straight into |signature|.
+  void RawSign(const std::string& data, std::string* signature) const;
+
+  std::unique_ptr<ScopedEVP_MD_CTX> TakeContext() const;
+  void ReturnContext(std::unique_ptr<ScopedEVP_MD_CTX> ctx) const;
 
   ScopedEVP_PKEY pkey_;
   ct::DigitallySigned::HashAlgorithm hash_algo_;
   ct::DigitallySigned::SignatureAlgorithm sig_algo_;
   std::string key_id_;
+
+  mutable std::mutex contexts_lock_;
+  // The contexts not currently in use.
+  mutable std::vector<std::unique_ptr<ScopedEVP_MD_CTX>> contexts_;
 };
 
 }  // namespace cert_trans
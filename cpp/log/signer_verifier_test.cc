@@ -3,6 +3,8 @@
 #include <gtest/gtest.h>
 #include <stdint.h>
 #include <string>
+#include <thread>
+#include <vector>
 
 #include "log/signer.h"
 #include "log/test_signer.h"
@@ -16,6 +18,8 @@
 using cert_trans::Verifier;
 using ct::DigitallySigned;
 using std::string;
+using std::thread;
+using std::vector;
 
 namespace cert_trans {
 namespace {
@@ -91,6 +95,37 @@ TEST_F(SignerVerifierTest, SignAndVerify) {
   EXPECT_EQ(Verifier::OK, verifier_->Verify(kTestString, signature2));
 }
 
+// Check that signing from several threads at once, which shares the
+// signing contexts, gives valid signatures.
+TEST_F(SignerVerifierTest, SignConcurrently) {
+  const int kNumThreads(4);
+  const int kNumSignatures(20);
+  vector<vector<DigitallySigned>> signatures(kNumThreads);
+  vector<thread> threads;
+  for (int i = 0; i < kNumThreads; ++i) {
+    threads.emplace_back([this, i, &signatures]() {
+      for (int j = 0; j < kNumSignatures; ++j) {
+        signatures[i].emplace_back();
+        signer_->Sign(kTestString + std::to_string(i * kNumSignatures + j),
+                      &signatures[i].back());
+      }
+    });
+  }
+  for (auto& t : threads) {
+    t.join();
+  }
+
+  for (int i = 0; i < kNumThreads; ++i) {
+    ASSERT_EQ(static_cast<size_t>(kNumSignatures), signatures[i].size());
+    for (int j = 0; j < kNumSignatures; ++j) {
+      EXPECT_EQ(Verifier::OK,
+                verifier_->Verify(
+                    kTestString + std::to_string(i * kNumSignatures + j),
+                    signatures[i][j]));
+    }
+  }
+}
+
 // Check various error cases.
 TEST_F(SignerVerifierTest, Errors) {
   DigitallySigned signature;
@@ -0,0 +1,232 @@
+#include "log/snapshot.h"
+
+#include <gflags/gflags.h>
+#include <glog/logging.h>
+#include <inttypes.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <fstream>
+#include <functional>
+#include <memory>
+#include <vector>
+
+#include "log/database.h"
+#include "log/logged_entry.h"
+#include "merkletree/compact_merkle_tree.h"
+#include "merkletree/serial_hasher.h"
+#include "proto/ct.pb.h"
+#include "proto/tls_encoding.h"
+#include "util/util.h"
+
+DEFINE_int32(snapshot_entries_per_file, 10000,
+             "Number of entries in each file of a snapshot. Each file is "
+             "read whole when importing.");
+
+using cert_trans::serialization::WriteVarBytes;
+using ct::CompactTreeFrontier;
+using ct::SignedTreeHead;
+using std::function;
+using std::ofstream;
+using std::string;
+using std::unique_ptr;
+using std::vector;
+using util::Status;
+
+namespace cert_trans {
+namespace {
+
+
+const char kTreeHeadFile[] = "sth";
+const char kEntriesFilePrefix[] = "entries-";
+// The entries are stored with a 4-byte length prefix.
+const size_t kMaxEntryLength = 0xffffffff;
+
+
+string EntriesFilePath(const string& dir, int64_t first) {
+  char name[64];
+  snprintf(name, sizeof(name), "%s%020" PRId64, kEntriesFilePrefix, first);
+  return dir + "/" + name;
+}
+
+
+// Writes through a temporary file, so that a snapshot being copied
+// never has partially written files.
+Status WriteFile(const string& path, const string& data) {
+  const string tmp_path(path + ".tmp");
+  ofstream out(tmp_path.c_str(), std::ios::binary | std::ios::trunc);
+  out.write(data.data(), data.size());
+  out.close();
+  if (!out.good() || rename(tmp_path.c_str(), path.c_str()) != 0) {
+    remove(tmp_path.c_str());
+    return Status(util::error::INTERNAL, "failed to write " + path);
+  }
+  return ::util::OkStatus();
+}
+
+
+// Calls |f| with the entries of each file of the snapshot in |dir|,
+// up to |tree_size|, stopping at the first error.
+Status ForEachSnapshotFile(
+    const string& dir, int64_t tree_size,
+    const function<Status(const vector<LoggedEntry>&)>& f) {
+  string contents;
+  string data;
+  vector<LoggedEntry> entries;
+  int64_t seq(0);
+  while (seq < tree_size) {
+    const string path(EntriesFilePath(dir, seq));
+    if (!util::ReadBinaryFile(path, &contents)) {
+      return Status(util::error::NOT_FOUND, "failed to read " + path);
+    }
+
+    TLSDeserializer reader(contents);
+    entries.clear();
+    while (!reader.ReachedEnd() && seq < tree_size) {
+      entries.emplace_back();
+      if (!reader.ReadVarBytes(kMaxEntryLength, &data) ||
+          !entries.back().ParseFromString(data) ||
+          entries.back().sequence_number() != seq) {
+        return Status(util::error::INVALID_ARGUMENT,
+                      "bad entry " + std::to_string(seq) + " in " + path);
+      }
+      ++seq;
+    }
+    if (entries.empty()) {
+      return Status(util::error::INVALID_ARGUMENT, "no entries in " + path);
+    }
+
+    const Status status(f(entries));
+    if (!status.ok()) {
+      return status;
+    }
+  }
+
+  return ::util::OkStatus();
+}
+
+
+}  // namespace
+
+
+Status ExportSnapshot(const ReadOnlyDatabase* db, const string& dir) {
+  CHECK_NOTNULL(db);
+  CHECK_GT(FLAGS_snapshot_entries_per_file, 0);
+  SignedTreeHead sth;
+  if (db->LatestTreeHead(&sth) != Database::LOOKUP_OK) {
+    return Status(util::error::FAILED_PRECONDITION, "no tree head");
+  }
+  if (sth.tree_size() > db->TreeSize()) {
+    return Status(util::error::FAILED_PRECONDITION,
+                  "missing entries for the tree head");
+  }
+
+  const unique_ptr<ReadOnlyDatabase::Iterator> it(db->ScanEntries(0));
+  LoggedEntry entry;
+  string data;
+  string contents;
+  int64_t seq(0);
+  while (seq < sth.tree_size()) {
+    const int64_t first(seq);
+    contents.clear();
+    for (; seq < sth.tree_size() &&
+           seq < first + FLAGS_snapshot_entries_per_file;
+         ++seq) {
+      if (!it->GetNextEntry(&entry) || entry.sequence_number() != seq) {
+        return Status(util::error::FAILED_PRECONDITION,
+                      "missing entry " + std::to_string(seq));
+      }
+      CHECK(entry.SerializeToString(&data));
+      WriteVarBytes(data, kMaxEntryLength, &contents);
+    }
+
+    const Status status(WriteFile(EntriesFilePath(dir, first), contents));
+    if (!status.ok()) {
+      return status;
+    }
+  }
+
+  // The tree head goes in last, so that a snapshot that has one is
+  // complete.
+  CHECK(sth.SerializeToString(&data));
+  const Status status(WriteFile(dir + "/" + kTreeHeadFile, data));
+  if (status.ok()) {
+    LOG(INFO) << "Exported a snapshot of " << sth.tree_size()
+              << " entries to " << dir;
+  }
+  return status;
+}
+
+
+Status ImportSnapshot(const string& dir, Database* db) {
+  CHECK_NOTNULL(db);
+  string data;
+  SignedTreeHead sth;
+  if (!util::ReadBinaryFile(dir + "/" + kTreeHeadFile, &data)) {
+    return Status(util::error::NOT_FOUND, "no tree head in " + dir);
+  }
+  if (!sth.ParseFromString(data) || sth.tree_size() < 0) {
+    return Status(util::error::INVALID_ARGUMENT, "bad tree head in " + dir);
+  }
+
+  // Check the whole snapshot before writing anything, so that a bad
+  // one does not leave entries behind that would then conflict with
+  // those of the log.
+  CompactMerkleTree tree(unique_ptr<SerialHasher>(new Sha256Hasher));
+  Status status(ForEachSnapshotFile(
+      dir, sth.tree_size(),
+      [&tree](const vector<LoggedEntry>& entries) -> Status {
+        string leaf;
+        for (const auto& entry : entries) {
+          if (!entry.SerializeForLeaf(&leaf)) {
+            return Status(util::error::INVALID_ARGUMENT,
+                          "failed to serialize the leaf of entry " +
+                              std::to_string(entry.sequence_number()));
+          }
+          tree.AddLeaf(leaf);
+        }
+        return ::util::OkStatus();
+      }));
+  if (!status.ok()) {
+    return status;
+  }
+  if (tree.CurrentRoot() != sth.sha256_root_hash()) {
+    return Status(util::error::INVALID_ARGUMENT,
+                  "entries do not match the tree head in " + dir);
+  }
+
+  db->BeginBulkLoad();
+  status = ForEachSnapshotFile(
+      dir, sth.tree_size(),
+      [db](const vector<LoggedEntry>& entries) -> Status {
+        if (db->CreateSequencedEntries(entries) != Database::OK) {
+          return Status(util::error::FAILED_PRECONDITION,
+                        "snapshot conflicts with the entries of the "
+                        "database");
+        }
+        return ::util::OkStatus();
+      });
+  db->EndBulkLoad();
+  if (!status.ok()) {
+    return status;
+  }
+
+  CompactTreeFrontier frontier;
+  frontier.set_tree_size(sth.tree_size());
+  for (const auto& node : tree.Frontier()) {
+    frontier.add_node(node);
+  }
+  frontier.set_sha256_root_hash(sth.sha256_root_hash());
+  db->WriteTreeFrontier(frontier);
+
+  if (db->WriteTreeHead(sth) != Database::OK) {
+    return Status(util::error::FAILED_PRECONDITION,
+                  "another tree head has the timestamp of the snapshot");
+  }
+
+  LOG(INFO) << "Imported a snapshot of " << sth.tree_size()
+            << " entries from " << dir;
+  return ::util::OkStatus();
+}
+
+
+}  // namespace cert_trans
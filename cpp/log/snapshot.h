@@ -0,0 +1,40 @@
+#ifndef CERT_TRANS_LOG_SNAPSHOT_H_
+#define CERT_TRANS_LOG_SNAPSHOT_H_
+
+#include <string>
+
+#include "util/status.h"
+
+namespace cert_trans {
+
+class Database;
+class ReadOnlyDatabase;
+
+
+// A snapshot is a directory holding a tree head and the entries it
+// covers, which a new node can import rather than fetch every entry
+// from its peers. The entries are split into files of a fixed number
+// of entries, named after the sequence number of their first entry,
+// that do not change once full, so that a snapshot can be refreshed
+// with rsync and the like by only copying the newest files.
+
+// Writes the latest tree head of |db| and the entries it covers to
+// |dir|, which must exist. As sequenced entries do not change, this
+// can be done while the database is being written to, by a process
+// that has it open.
+util::Status ExportSnapshot(const ReadOnlyDatabase* db,
+                            const std::string& dir);
+
+// Writes the entries of the snapshot in |dir| to |db|, along with its
+// tree head and the matching tree frontier, so that the node only
+// has to fetch the entries that came after it. The frontier is
+// rebuilt from the entries and checked against the tree head, so
+// that a snapshot that is incomplete or corrupted is rejected, but
+// the tree head signature is not verified. Entries that |db| already
+// has must match those of the snapshot.
+util::Status ImportSnapshot(const std::string& dir, Database* db);
+
+
+}  // namespace cert_trans
+
+#endif  // CERT_TRANS_LOG_SNAPSHOT_H_
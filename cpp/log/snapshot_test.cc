@@ -0,0 +1,139 @@
+#include "log/snapshot.h"
+
+#include <gflags/gflags.h>
+#include <gtest/gtest.h>
+#include <sys/stat.h>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "log/logged_entry.h"
+#include "log/sqlite_db.h"
+#include "log/test_signer.h"
+#include "merkletree/compact_merkle_tree.h"
+#include "merkletree/serial_hasher.h"
+#include "proto/cert_serializer.h"
+#include "proto/ct.pb.h"
+#include "util/status_test_util.h"
+#include "util/test_db.h"
+#include "util/testing.h"
+#include "util/util.h"
+
+DECLARE_int32(snapshot_entries_per_file);
+
+namespace cert_trans {
+namespace {
+
+using ct::CompactTreeFrontier;
+using ct::SignedTreeHead;
+using std::string;
+using std::unique_ptr;
+using std::vector;
+using util::testing::StatusIs;
+
+
+class SnapshotTest : public ::testing::Test {
+ protected:
+  void SetUp() override {
+    FLAGS_snapshot_entries_per_file = 3;
+    snapshot_dir_ = tmp_.TmpStorageDir() + "/snapshot";
+    ASSERT_EQ(0, mkdir(snapshot_dir_.c_str(), 0700));
+    source_.reset(new SQLiteDB(tmp_.TmpStorageDir() + "/source"));
+  }
+
+  // Writes |num_entries| entries to the source database, and a tree
+  // head for the first |tree_size| of them.
+  void FillSource(int num_entries, int tree_size) {
+    CompactMerkleTree tree(unique_ptr<SerialHasher>(new Sha256Hasher));
+    string leaf;
+    entries_.resize(num_entries);
+    for (int i = 0; i < num_entries; ++i) {
+      test_signer_.CreateUnique(&entries_[i]);
+      entries_[i].set_sequence_number(i);
+      ASSERT_EQ(Database::OK, source_->CreateSequencedEntry(entries_[i]));
+      if (i < tree_size) {
+        ASSERT_TRUE(entries_[i].SerializeForLeaf(&leaf));
+        tree.AddLeaf(leaf);
+      }
+    }
+
+    sth_.set_timestamp(util::TimeInMilliseconds());
+    sth_.set_tree_size(tree_size);
+    sth_.set_sha256_root_hash(tree.CurrentRoot());
+    ASSERT_EQ(Database::OK, source_->WriteTreeHead(sth_));
+  }
+
+  TmpStorage tmp_;
+  TestSigner test_signer_;
+  string snapshot_dir_;
+  unique_ptr<SQLiteDB> source_;
+  vector<LoggedEntry> entries_;
+  SignedTreeHead sth_;
+};
+
+
+TEST_F(SnapshotTest, ExportAndImport) {
+  FillSource(6, 5);
+  EXPECT_OK(ExportSnapshot(source_.get(), snapshot_dir_));
+
+  SQLiteDB dest(tmp_.TmpStorageDir() + "/dest");
+  EXPECT_OK(ImportSnapshot(snapshot_dir_, &dest));
+  EXPECT_EQ(5, dest.TreeSize());
+  for (int i = 0; i < 5; ++i) {
+    LoggedEntry entry;
+    ASSERT_EQ(Database::LOOKUP_OK, dest.LookupByIndex(i, &entry));
+    TestSigner::TestEqualLoggedCerts(entries_[i], entry);
+  }
+  EXPECT_EQ(Database::NOT_FOUND, dest.LookupByIndex(5, nullptr));
+
+  SignedTreeHead sth;
+  ASSERT_EQ(Database::LOOKUP_OK, dest.LatestTreeHead(&sth));
+  TestSigner::TestEqualTreeHeads(sth_, sth);
+
+  CompactTreeFrontier frontier;
+  ASSERT_EQ(Database::LOOKUP_OK, dest.LatestTreeFrontier(&frontier));
+  EXPECT_EQ(5, frontier.tree_size());
+  EXPECT_EQ(sth_.sha256_root_hash(), frontier.sha256_root_hash());
+
+  // Importing again, over the same entries, is fine.
+  EXPECT_OK(ImportSnapshot(snapshot_dir_, &dest));
+}
+
+
+TEST_F(SnapshotTest, NoTreeHead) {
+  EXPECT_THAT(ExportSnapshot(source_.get(), snapshot_dir_),
+              StatusIs(util::error::FAILED_PRECONDITION));
+
+  SQLiteDB dest(tmp_.TmpStorageDir() + "/dest");
+  EXPECT_THAT(ImportSnapshot(snapshot_dir_, &dest),
+              StatusIs(util::error::NOT_FOUND));
+}
+
+
+TEST_F(SnapshotTest, RejectsMismatchedTreeHead) {
+  FillSource(4, 4);
+  // A newer tree head, that is not for these entries.
+  SignedTreeHead sth(sth_);
+  sth.set_timestamp(sth_.timestamp() + 1);
+  sth.set_sha256_root_hash(string(32, 'x'));
+  ASSERT_EQ(Database::OK, source_->WriteTreeHead(sth));
+  EXPECT_OK(ExportSnapshot(source_.get(), snapshot_dir_));
+
+  SQLiteDB dest(tmp_.TmpStorageDir() + "/dest");
+  EXPECT_THAT(ImportSnapshot(snapshot_dir_, &dest),
+              StatusIs(util::error::INVALID_ARGUMENT));
+  // Nothing was written.
+  EXPECT_EQ(0, dest.TreeSize());
+  EXPECT_EQ(Database::NOT_FOUND, dest.LatestTreeHead(&sth));
+}
+
+
+}  // namespace
+}  // namespace cert_trans
+
+
+int main(int argc, char** argv) {
+  cert_trans::test::InitTesting(argv[0], &argc, &argv, true);
+  ConfigureSerializerForV1CT();
+  return RUN_ALL_TESTS();
+}
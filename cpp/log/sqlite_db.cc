@@ -3,19 +3,23 @@
 #include <gflags/gflags.h>
 #include <glog/logging.h>
 #include <sqlite3.h>
+#include <strings.h>
 
 #include "log/sqlite_statement.h"
 #include "monitoring/latency.h"
 #include "monitoring/monitoring.h"
 #include "util/util.h"
 
+using std::function;
 using std::unique_ptr;
 using std::chrono::milliseconds;
 using std::lock_guard;
+using std::move;
 using std::mutex;
 using std::ostringstream;
 using std::string;
 using std::unique_lock;
+using std::vector;
 
 // Several of these flags pass their value directly through to SQLite PRAGMA
 // statements, see the SQLite documentation
@@ -42,6 +46,11 @@ DEFINE_bool(sqlite_batch_into_transactions, true,
             "scenes.");
 DEFINE_int32(sqlite_transaction_batch_size, 400,
              "Max number of operations to batch into one transaction.");
+DEFINE_int32(sqlite_read_connections, 4,
+             "Number of read-only connections for lookups and scans to run "
+             "on, in parallel with each other and with the writes. Each has "
+             "its own cache of sqlite_cache_size pages. Only used with the "
+             "WAL journal mode, 0 to do everything on the one connection.");
 
 namespace cert_trans {
 namespace {
@@ -51,6 +60,19 @@ static Latency<milliseconds, string> latency_by_op_ms(
     "sqlitedb_latency_by_operation_ms", "operation",
     "Database latency in ms broken out by operation");
 
+// How long a reader waits for the database to be available, for the
+// rare cases where WAL mode does not let it go ahead regardless (such
+// as while the writer recovers the WAL).
+const int kReaderBusyTimeoutMs = 10000;
+
+
+void SetCacheSize(sqlite3* db) {
+  ostringstream oss;
+  oss << "PRAGMA cache_size = " << FLAGS_sqlite_cache_size;
+  sqlite::Statement statement(db, oss.str().c_str());
+  CHECK_EQ(SQLITE_DONE, statement.Step()) << sqlite3_errmsg(db);
+}
+
 
 sqlite3* SQLiteOpen(const string& dbfile) {
   ScopedLatency scoped_latency(latency_by_op_ms.GetScopedLatency("open"));
@@ -97,9 +119,42 @@ sqlite3* SQLiteOpen(const string& dbfile) {
 }
 
 
+sqlite3* SQLiteOpenReader(const string& dbfile) {
+  ScopedLatency scoped_latency(
+      latency_by_op_ms.GetScopedLatency("open_reader"));
+  sqlite3* retval;
+
+  CHECK_EQ(SQLITE_OK, sqlite3_open_v2(dbfile.c_str(), &retval,
+                                      SQLITE_OPEN_READONLY, nullptr))
+      << sqlite3_errmsg(retval);
+  CHECK_EQ(SQLITE_OK, sqlite3_busy_timeout(retval, kReaderBusyTimeoutMs))
+      << sqlite3_errmsg(retval);
+  SetCacheSize(retval);
+
+  return retval;
+}
+
+
 }  // namespace
 
 
+struct SQLiteDB::Connection {
+  explicit Connection(sqlite3* db)
+      : db(CHECK_NOTNULL(db)), statements(new sqlite::StatementCache(db)) {
+  }
+
+  ~Connection() {
+    // The statements have to be finalized before the connection can be
+    // closed.
+    statements.reset();
+    CHECK_EQ(SQLITE_OK, sqlite3_close(db)) << sqlite3_errmsg(db);
+  }
+
+  sqlite3* const db;
+  unique_ptr<sqlite::StatementCache> statements;
+};
+
+
 class SQLiteDB::Iterator : public Database::Iterator {
  public:
   Iterator(const SQLiteDB* db, int64_t start_index)
@@ -109,15 +164,23 @@ class SQLiteDB::Iterator : public Database::Iterator {
 
   bool GetNextEntry(LoggedEntry* entry) override {
     CHECK_NOTNULL(entry);
-    unique_lock<mutex> lock(db_->lock_);
-    if (next_index_ < db_->tree_size_) {
-      CHECK_EQ(db_->LookupByIndex(lock, next_index_, entry), db_->LOOKUP_OK);
+    const int64_t index(next_index_);
+    if (index < db_->tree_size_.load()) {
+      CHECK_EQ(db_->LookupByIndex(index, entry), db_->LOOKUP_OK);
       ++next_index_;
       return true;
     }
 
-    const bool retval(db_->LookupNextIndex(lock, next_index_, entry) ==
-                      db_->LOOKUP_OK);
+    // A later entry found by a reader is only the next one if there is
+    // none before it still to be committed.
+    const bool retval(
+        db_->Read([this, index, entry](Connection* conn) {
+                    return db_->LookupNextIndex(conn, index, entry);
+                  },
+                  [index, entry](LookupResult result) {
+                    return result == LOOKUP_OK &&
+                           entry->sequence_number() == index;
+                  }) == db_->LOOKUP_OK);
     if (retval) {
       next_index_ = entry->sequence_number() + 1;
     }
@@ -132,16 +195,18 @@ class SQLiteDB::Iterator : public Database::Iterator {
 
 
 SQLiteDB::SQLiteDB(const string& dbfile)
-    : db_(SQLiteOpen(dbfile)),
+    : writer_(new Connection(SQLiteOpen(dbfile))),
       tree_size_(0),
+      uncommitted_entries_(false),
       transaction_size_(0),
       in_transaction_(false) {
+  sqlite3* const db(writer_->db);
   unique_lock<mutex> lock(lock_);
   {
     ostringstream oss;
     oss << "PRAGMA synchronous = " << FLAGS_sqlite_synchronous_mode;
-    sqlite::Statement statement(db_, oss.str().c_str());
-    CHECK_EQ(SQLITE_DONE, statement.Step()) << sqlite3_errmsg(db_);
+    sqlite::Statement statement(db, oss.str().c_str());
+    CHECK_EQ(SQLITE_DONE, statement.Step()) << sqlite3_errmsg(db);
     LOG(WARNING) << "SQLite \"synchronous\" pragma set to "
                  << FLAGS_sqlite_synchronous_mode;
     if (FLAGS_sqlite_batch_into_transactions) {
@@ -153,27 +218,40 @@ SQLiteDB::SQLiteDB(const string& dbfile)
   {
     ostringstream oss;
     oss << "PRAGMA journal_mode = " << FLAGS_sqlite_journal_mode;
-    sqlite::Statement statement(db_, oss.str().c_str());
-    CHECK_EQ(SQLITE_ROW, statement.Step()) << sqlite3_errmsg(db_);
+    sqlite::Statement statement(db, oss.str().c_str());
+    CHECK_EQ(SQLITE_ROW, statement.Step()) << sqlite3_errmsg(db);
     string mode;
     statement.GetBlob(0, &mode);
     CHECK_STRCASEEQ(mode.c_str(), FLAGS_sqlite_journal_mode.c_str());
-    CHECK_EQ(SQLITE_DONE, statement.Step()) << sqlite3_errmsg(db_);
+    CHECK_EQ(SQLITE_DONE, statement.Step()) << sqlite3_errmsg(db);
   }
 
+  SetCacheSize(db);
+
   {
-    ostringstream oss;
-    oss << "PRAGMA cache_size = " << FLAGS_sqlite_cache_size;
-    sqlite::Statement statement(db_, oss.str().c_str());
-    CHECK_EQ(SQLITE_DONE, statement.Step()) << sqlite3_errmsg(db_);
+    // Databases created before tree frontiers were stored do not have
+    // this table yet.
+    sqlite::Statement statement(db,
+                                "CREATE TABLE IF NOT EXISTS "
+                                "frontier(id INTEGER PRIMARY KEY, "
+                                "frontier BLOB)");
+    CHECK_EQ(SQLITE_DONE, statement.Step()) << sqlite3_errmsg(db);
+  }
+
+  // Only in WAL mode can readers go ahead while there is a write
+  // transaction open, as there nearly always is.
+  if (strcasecmp(FLAGS_sqlite_journal_mode.c_str(), "WAL") == 0) {
+    for (int i = 0; i < FLAGS_sqlite_read_connections; ++i) {
+      idle_readers_.emplace_back(new Connection(SQLiteOpenReader(dbfile)));
+    }
   }
+  num_readers_ = idle_readers_.size();
 
   BeginTransaction(lock);
 }
 
 
 SQLiteDB::~SQLiteDB() {
-  CHECK_EQ(SQLITE_OK, sqlite3_close(db_)) << sqlite3_errmsg(db_);
 }
 
 
@@ -185,7 +263,47 @@ Database::WriteResult SQLiteDB::CreateSequencedEntry_(
 
   MaybeStartNewTransaction(lock);
 
-  sqlite::Statement statement(db_,
+  return InsertSequencedEntry(lock, logged);
+}
+
+
+Database::WriteResult SQLiteDB::CreateSequencedEntries_(
+    const vector<LoggedEntry>& logged) {
+  ScopedLatency latency(
+      latency_by_op_ms.GetScopedLatency("create_sequenced_entries"));
+  unique_lock<mutex> lock(lock_);
+
+  // The whole batch goes into one transaction, committed at the end
+  // (along with any operations already batched into it).
+  if (!FLAGS_sqlite_batch_into_transactions) {
+    sqlite::Statement s(writer_->statements.get(), "BEGIN TRANSACTION");
+    CHECK_EQ(SQLITE_DONE, s.Step()) << sqlite3_errmsg(writer_->db);
+  }
+
+  WriteResult result(this->OK);
+  for (const auto& entry : logged) {
+    result = InsertSequencedEntry(lock, entry);
+    if (result != this->OK) {
+      break;
+    }
+  }
+
+  if (FLAGS_sqlite_batch_into_transactions) {
+    EndTransaction(lock);
+    BeginTransaction(lock);
+  } else {
+    sqlite::Statement s(writer_->statements.get(), "END TRANSACTION");
+    CHECK_EQ(SQLITE_DONE, s.Step()) << sqlite3_errmsg(writer_->db);
+  }
+
+  return result;
+}
+
+
+Database::WriteResult SQLiteDB::InsertSequencedEntry(
+    const unique_lock<mutex>& lock, const LoggedEntry& logged) {
+  CHECK(lock.owns_lock());
+  sqlite::Statement statement(writer_->statements.get(),
                               "INSERT INTO leaves(hash, entry, sequence) "
                               "VALUES(?, ?, ?)");
   const string hash(logged.Hash());
@@ -203,15 +321,14 @@ Database::WriteResult SQLiteDB::CreateSequencedEntry_(
     // Check whether we're trying to store a hash/sequence pair which already
     // exists - if it's identical we'll return OK as it could be the fetcher.
     sqlite::Statement s2(
-        db_, "SELECT sequence, hash FROM leaves WHERE sequence = ?");
+        writer_->statements.get(),
+        "SELECT sequence, hash FROM leaves WHERE sequence = ?");
     s2.BindUInt64(0, logged.sequence_number());
     if (s2.Step() == SQLITE_ROW) {
       string existing_hash;
       s2.GetBlob(1, &existing_hash);
 
-      if (logged.sequence_number() == tree_size_) {
-        ++tree_size_;
-      }
+      SawSequenceNumber(logged.sequence_number());
 
       if (hash == existing_hash) {
         return this->OK;
@@ -219,11 +336,12 @@ Database::WriteResult SQLiteDB::CreateSequencedEntry_(
     }
     return this->SEQUENCE_NUMBER_ALREADY_IN_USE;
   }
-  CHECK_EQ(SQLITE_DONE, ret) << sqlite3_errmsg(db_);
+  CHECK_EQ(SQLITE_DONE, ret) << sqlite3_errmsg(writer_->db);
 
-  if (logged.sequence_number() == tree_size_) {
-    ++tree_size_;
+  if (in_transaction_) {
+    uncommitted_entries_.store(true);
   }
+  SawSequenceNumber(logged.sequence_number());
 
   return this->OK;
 }
@@ -234,9 +352,19 @@ Database::LookupResult SQLiteDB::LookupByHash(const string& hash,
   CHECK_NOTNULL(result);
   ScopedLatency latency(latency_by_op_ms.GetScopedLatency("lookup_by_hash"));
 
-  lock_guard<mutex> lock(lock_);
+  return Read([this, &hash, result](Connection* conn) {
+                return LookupByHash(conn, hash, result);
+              },
+              [](LookupResult lookup_result) {
+                return lookup_result == LOOKUP_OK;
+              });
+}
+
 
-  sqlite::Statement statement(db_,
+Database::LookupResult SQLiteDB::LookupByHash(Connection* conn,
+                                              const string& hash,
+                                              LoggedEntry* result) const {
+  sqlite::Statement statement(conn->statements.get(),
                               "SELECT entry, sequence FROM leaves "
                               "WHERE hash = ? ORDER BY sequence LIMIT 1");
 
@@ -246,7 +374,7 @@ Database::LookupResult SQLiteDB::LookupByHash(const string& hash,
   if (ret == SQLITE_DONE) {
     return this->NOT_FOUND;
   }
-  CHECK_EQ(SQLITE_ROW, ret) << sqlite3_errmsg(db_);
+  CHECK_EQ(SQLITE_ROW, ret) << sqlite3_errmsg(conn->db);
 
   string data;
   statement.GetBlob(0, &data);
@@ -256,9 +384,7 @@ Database::LookupResult SQLiteDB::LookupByHash(const string& hash,
     result->clear_sequence_number();
   } else {
     result->set_sequence_number(statement.GetUInt64(1));
-    if (result->sequence_number() == tree_size_) {
-      ++tree_size_;
-    }
+    SawSequenceNumber(result->sequence_number());
   }
 
   return this->LOOKUP_OK;
@@ -268,19 +394,22 @@ Database::LookupResult SQLiteDB::LookupByHash(const string& hash,
 Database::LookupResult SQLiteDB::LookupByIndex(int64_t sequence_number,
                                                LoggedEntry* result) const {
   ScopedLatency latency(latency_by_op_ms.GetScopedLatency("lookup_by_index"));
-  unique_lock<mutex> lock(lock_);
 
-  return LookupByIndex(lock, sequence_number, result);
+  return Read([this, sequence_number, result](Connection* conn) {
+                return LookupByIndex(conn, sequence_number, result);
+              },
+              [](LookupResult lookup_result) {
+                return lookup_result == LOOKUP_OK;
+              });
 }
 
 
-Database::LookupResult SQLiteDB::LookupByIndex(const unique_lock<mutex>& lock,
+Database::LookupResult SQLiteDB::LookupByIndex(Connection* conn,
                                                int64_t sequence_number,
                                                LoggedEntry* result) const {
-  CHECK(lock.owns_lock());
   CHECK_GE(sequence_number, 0);
   CHECK_NOTNULL(result);
-  sqlite::Statement statement(db_,
+  sqlite::Statement statement(conn->statements.get(),
                               "SELECT entry, hash FROM leaves "
                               "WHERE sequence = ?");
   statement.BindUInt64(0, sequence_number);
@@ -299,21 +428,18 @@ Database::LookupResult SQLiteDB::LookupByIndex(const unique_lock<mutex>& lock,
   CHECK_EQ(result->Hash(), hash);
 
   result->set_sequence_number(sequence_number);
-  if (result->sequence_number() == tree_size_) {
-    ++tree_size_;
-  }
+  SawSequenceNumber(sequence_number);
 
   return this->LOOKUP_OK;
 }
 
 
-Database::LookupResult SQLiteDB::LookupNextIndex(
-    const unique_lock<mutex>& lock, int64_t sequence_number,
-    LoggedEntry* result) const {
-  CHECK(lock.owns_lock());
+Database::LookupResult SQLiteDB::LookupNextIndex(Connection* conn,
+                                                 int64_t sequence_number,
+                                                 LoggedEntry* result) const {
   CHECK_GE(sequence_number, 0);
   CHECK_NOTNULL(result);
-  sqlite::Statement statement(db_,
+  sqlite::Statement statement(conn->statements.get(),
                               "SELECT entry, hash, sequence FROM leaves "
                               "WHERE sequence >= ? ORDER BY sequence");
   statement.BindUInt64(0, sequence_number);
@@ -331,9 +457,7 @@ Database::LookupResult SQLiteDB::LookupNextIndex(
   CHECK_EQ(result->Hash(), hash);
 
   result->set_sequence_number(statement.GetUInt64(2));
-  if (result->sequence_number() == tree_size_) {
-    ++tree_size_;
-  }
+  SawSequenceNumber(result->sequence_number());
 
   return this->LOOKUP_OK;
 }
@@ -349,7 +473,7 @@ Database::WriteResult SQLiteDB::WriteTreeHead_(const ct::SignedTreeHead& sth) {
   ScopedLatency latency(latency_by_op_ms.GetScopedLatency("write_tree_head"));
   unique_lock<mutex> lock(lock_);
 
-  sqlite::Statement statement(db_,
+  sqlite::Statement statement(writer_->statements.get(),
                               "INSERT INTO trees(timestamp, sth) "
                               "VALUES(?, ?)");
   statement.BindUInt64(0, sth.timestamp());
@@ -360,11 +484,11 @@ Database::WriteResult SQLiteDB::WriteTreeHead_(const ct::SignedTreeHead& sth) {
 
   int r2 = statement.Step();
   if (r2 == SQLITE_CONSTRAINT) {
-    sqlite::Statement s2(db_,
+    sqlite::Statement s2(writer_->statements.get(),
                          "SELECT timestamp,sth FROM trees "
                          "WHERE timestamp = ?");
     s2.BindUInt64(0, sth.timestamp());
-    CHECK_EQ(SQLITE_ROW, s2.Step()) << sqlite3_errmsg(db_);
+    CHECK_EQ(SQLITE_ROW, s2.Step()) << sqlite3_errmsg(writer_->db);
     string existing_sth_data;
     s2.GetBlob(1, &existing_sth_data);
     if (existing_sth_data == sth_data) {
@@ -373,7 +497,7 @@ Database::WriteResult SQLiteDB::WriteTreeHead_(const ct::SignedTreeHead& sth) {
     }
     return this->DUPLICATE_TREE_HEAD_TIMESTAMP;
   }
-  CHECK_EQ(SQLITE_DONE, r2) << sqlite3_errmsg(db_);
+  CHECK_EQ(SQLITE_DONE, r2) << sqlite3_errmsg(writer_->db);
 
   EndTransaction(lock);
   BeginTransaction(lock);
@@ -390,9 +514,12 @@ Database::WriteResult SQLiteDB::WriteTreeHead_(const ct::SignedTreeHead& sth) {
 Database::LookupResult SQLiteDB::LatestTreeHead(
     ct::SignedTreeHead* result) const {
   ScopedLatency latency(latency_by_op_ms.GetScopedLatency("latest_tree_head"));
-  unique_lock<mutex> lock(lock_);
 
-  return LatestTreeHeadNoLock(lock, result);
+  // Tree heads are committed as soon as they are written.
+  return Read([this, result](Connection* conn) {
+                return LatestTreeHead(conn, result);
+              },
+              [](LookupResult) { return true; });
 }
 
 
@@ -400,26 +527,28 @@ int64_t SQLiteDB::TreeSize() const {
   ScopedLatency latency(latency_by_op_ms.GetScopedLatency("tree_size"));
   unique_lock<mutex> lock(lock_);
 
-  CHECK_GE(tree_size_, 0);
+  int64_t tree_size(tree_size_.load());
+  CHECK_GE(tree_size, 0);
   sqlite::Statement statement(
-      db_,
+      writer_->statements.get(),
       "SELECT sequence FROM leaves WHERE sequence >= ? ORDER BY sequence");
-  statement.BindUInt64(0, tree_size_);
+  statement.BindUInt64(0, tree_size);
 
   int ret(statement.Step());
   while (ret == SQLITE_ROW) {
     const sqlite3_uint64 sequence(statement.GetUInt64(0));
 
-    if (sequence != static_cast<uint64_t>(tree_size_)) {
-      return tree_size_;
+    if (sequence != static_cast<uint64_t>(tree_size)) {
+      return tree_size_.load();
     }
 
-    ++tree_size_;
+    SawSequenceNumber(tree_size);
+    ++tree_size;
     ret = statement.Step();
   }
-  CHECK_EQ(SQLITE_DONE, ret) << sqlite3_errmsg(db_);
+  CHECK_EQ(SQLITE_DONE, ret) << sqlite3_errmsg(writer_->db);
 
-  return tree_size_;
+  return tree_size_.load();
 }
 
 
@@ -430,7 +559,7 @@ void SQLiteDB::AddNotifySTHCallback(
   callbacks_.Add(callback);
 
   ct::SignedTreeHead sth;
-  if (LatestTreeHeadNoLock(lock, &sth) == this->LOOKUP_OK) {
+  if (LatestTreeHead(writer_.get(), &sth) == this->LOOKUP_OK) {
     // Do not call the callback while holding the lock, as they might
     // want to perform some lookups.
     lock.unlock();
@@ -441,8 +570,8 @@ void SQLiteDB::AddNotifySTHCallback(
 
 void SQLiteDB::RemoveNotifySTHCallback(
     const Database::NotifySTHCallback* callback) {
-  lock_guard<mutex> lock(lock_);
-
+  // Not under |lock_|: |callbacks_| has a lock of its own, and may
+  // wait for callbacks that read from the database.
   callbacks_.Remove(callback);
 }
 
@@ -456,11 +585,12 @@ void SQLiteDB::InitializeNode(const string& node_id) {
     LOG(FATAL) << "Attempting to initialize DB beloging to node with node_id: "
                << existing_id;
   }
-  sqlite::Statement statement(db_, "INSERT INTO node(node_id) VALUES(?)");
+  sqlite::Statement statement(writer_->statements.get(),
+                              "INSERT INTO node(node_id) VALUES(?)");
   statement.BindBlob(0, node_id);
 
   const int result(statement.Step());
-  CHECK_EQ(SQLITE_DONE, result) << sqlite3_errmsg(db_);
+  CHECK_EQ(SQLITE_DONE, result) << sqlite3_errmsg(writer_->db);
 }
 
 
@@ -475,30 +605,77 @@ Database::LookupResult SQLiteDB::NodeId(const unique_lock<mutex>& lock,
   ScopedLatency latency(latency_by_op_ms.GetScopedLatency("set_node_id"));
   CHECK(lock.owns_lock());
   CHECK_NOTNULL(node_id);
-  sqlite::Statement statement(db_, "SELECT node_id FROM node");
+  sqlite::Statement statement(writer_->statements.get(),
+                              "SELECT node_id FROM node");
 
   int result(statement.Step());
   if (result == SQLITE_DONE) {
     return this->NOT_FOUND;
   }
-  CHECK_EQ(SQLITE_ROW, result) << sqlite3_errmsg(db_);
+  CHECK_EQ(SQLITE_ROW, result) << sqlite3_errmsg(writer_->db);
 
   statement.GetBlob(0, node_id);
   result = statement.Step();
   // There can only be one!
-  CHECK_EQ(SQLITE_DONE, result) << sqlite3_errmsg(db_);
+  CHECK_EQ(SQLITE_DONE, result) << sqlite3_errmsg(writer_->db);
   return this->LOOKUP_OK;
 }
 
 
+void SQLiteDB::WriteTreeFrontier(const ct::CompactTreeFrontier& frontier) {
+  ScopedLatency latency(
+      latency_by_op_ms.GetScopedLatency("write_tree_frontier"));
+  unique_lock<mutex> lock(lock_);
+
+  // There is only ever one row, which gets replaced.
+  sqlite::Statement statement(writer_->statements.get(),
+                              "INSERT OR REPLACE INTO frontier(id, frontier) "
+                              "VALUES(0, ?)");
+  string data;
+  CHECK(frontier.SerializeToString(&data));
+  statement.BindBlob(0, data);
+
+  CHECK_EQ(SQLITE_DONE, statement.Step()) << sqlite3_errmsg(writer_->db);
+
+  EndTransaction(lock);
+  BeginTransaction(lock);
+}
+
+
+Database::LookupResult SQLiteDB::LatestTreeFrontier(
+    ct::CompactTreeFrontier* result) const {
+  ScopedLatency latency(
+      latency_by_op_ms.GetScopedLatency("latest_tree_frontier"));
+  CHECK_NOTNULL(result);
+
+  // Like tree heads, the frontier is committed as soon as it is written.
+  return Read([this, result](Connection* conn) -> LookupResult {
+                sqlite::Statement statement(conn->statements.get(),
+                                            "SELECT frontier FROM frontier");
+
+                const int ret(statement.Step());
+                if (ret == SQLITE_DONE) {
+                  return this->NOT_FOUND;
+                }
+                CHECK_EQ(SQLITE_ROW, ret) << sqlite3_errmsg(conn->db);
+
+                string data;
+                statement.GetBlob(0, &data);
+                CHECK(result->ParseFromString(data));
+                return this->LOOKUP_OK;
+              },
+              [](LookupResult) { return true; });
+}
+
+
 void SQLiteDB::BeginTransaction(const unique_lock<mutex>& lock) {
   CHECK(lock.owns_lock());
   if (FLAGS_sqlite_batch_into_transactions) {
     CHECK_EQ(0, transaction_size_);
     CHECK(!in_transaction_);
     VLOG(1) << "Beginning new transaction.";
-    sqlite::Statement s(db_, "BEGIN TRANSACTION");
-    CHECK_EQ(SQLITE_DONE, s.Step()) << sqlite3_errmsg(db_);
+    sqlite::Statement s(writer_->statements.get(), "BEGIN TRANSACTION");
+    CHECK_EQ(SQLITE_DONE, s.Step()) << sqlite3_errmsg(writer_->db);
     in_transaction_ = true;
   }
 }
@@ -510,13 +687,17 @@ void SQLiteDB::EndTransaction(const unique_lock<mutex>& lock) {
     CHECK(in_transaction_);
     VLOG(1) << "Committing transaction.";
     {
-      sqlite::Statement s(db_, "END TRANSACTION");
-      CHECK_EQ(SQLITE_DONE, s.Step()) << sqlite3_errmsg(db_);
+      sqlite::Statement s(writer_->statements.get(), "END TRANSACTION");
+      CHECK_EQ(SQLITE_DONE, s.Step()) << sqlite3_errmsg(writer_->db);
     }
+    uncommitted_entries_.store(false);
     {
-      sqlite::Statement s(db_, "PRAGMA wal_checkpoint(TRUNCATE)");
-      CHECK_EQ(SQLITE_ROW, s.Step()) << sqlite3_errmsg(db_);
-      CHECK_EQ(SQLITE_DONE, s.Step()) << sqlite3_errmsg(db_);
+      // With readers about, this may not manage to truncate the WAL,
+      // which it will then do another time.
+      sqlite::Statement s(writer_->statements.get(),
+                          "PRAGMA wal_checkpoint(TRUNCATE)");
+      CHECK_EQ(SQLITE_ROW, s.Step()) << sqlite3_errmsg(writer_->db);
+      CHECK_EQ(SQLITE_DONE, s.Step()) << sqlite3_errmsg(writer_->db);
     }
 
     transaction_size_ = 0;
@@ -542,7 +723,7 @@ void SQLiteDB::ForceNotifySTH() {
 
   ct::SignedTreeHead sth;
   const Database::LookupResult db_result =
-      this->LatestTreeHeadNoLock(lock, &sth);
+      this->LatestTreeHead(writer_.get(), &sth);
   if (db_result == Database::NOT_FOUND) {
     return;
   }
@@ -556,10 +737,9 @@ void SQLiteDB::ForceNotifySTH() {
 }
 
 
-Database::LookupResult SQLiteDB::LatestTreeHeadNoLock(
-    const unique_lock<mutex>& lock, ct::SignedTreeHead* result) const {
-  CHECK(lock.owns_lock());
-  sqlite::Statement statement(db_,
+Database::LookupResult SQLiteDB::LatestTreeHead(
+    Connection* conn, ct::SignedTreeHead* result) const {
+  sqlite::Statement statement(conn->statements.get(),
                               "SELECT sth FROM trees WHERE timestamp IN "
                               "(SELECT MAX(timestamp) FROM trees)");
 
@@ -567,7 +747,7 @@ Database::LookupResult SQLiteDB::LatestTreeHeadNoLock(
   if (ret == SQLITE_DONE) {
     return this->NOT_FOUND;
   }
-  CHECK_EQ(SQLITE_ROW, ret) << sqlite3_errmsg(db_);
+  CHECK_EQ(SQLITE_ROW, ret) << sqlite3_errmsg(conn->db);
 
   string sth;
   statement.GetBlob(0, &sth);
@@ -577,4 +757,45 @@ Database::LookupResult SQLiteDB::LatestTreeHeadNoLock(
 }
 
 
+Database::LookupResult SQLiteDB::Read(
+    const function<LookupResult(Connection*)>& lookup,
+    const function<bool(LookupResult)>& final) const {
+  if (num_readers_ > 0) {
+    // This is checked before the reader starts its read transaction,
+    // so that if there are no uncommitted entries now, the reader sees
+    // all the entries written so far.
+    const bool uncommitted(uncommitted_entries_.load());
+
+    unique_ptr<Connection> reader;
+    {
+      unique_lock<mutex> lock(readers_lock_);
+      reader_returned_.wait(lock, [this]() { return !idle_readers_.empty(); });
+      reader = move(idle_readers_.back());
+      idle_readers_.pop_back();
+    }
+
+    const LookupResult result(lookup(reader.get()));
+
+    {
+      lock_guard<mutex> lock(readers_lock_);
+      idle_readers_.emplace_back(move(reader));
+    }
+    reader_returned_.notify_one();
+
+    if (!uncommitted || final(result)) {
+      return result;
+    }
+  }
+
+  lock_guard<mutex> lock(lock_);
+  return lookup(writer_.get());
+}
+
+
+void SQLiteDB::SawSequenceNumber(int64_t sequence_number) const {
+  int64_t expected(sequence_number);
+  tree_size_.compare_exchange_strong(expected, sequence_number + 1);
+}
+
+
 }  // namespace cert_trans
@@ -1,8 +1,13 @@
 #ifndef CERT_TRANS_LOG_SQLITE_DB_H_
 #define CERT_TRANS_LOG_SQLITE_DB_H_
 
+#include <atomic>
+#include <condition_variable>
+#include <functional>
+#include <memory>
 #include <mutex>
 #include <string>
+#include <vector>
 
 #include "log/database.h"
 #include "log/logged_entry.h"
@@ -25,6 +30,9 @@ class SQLiteDB : public Database {
 
   WriteResult CreateSequencedEntry_(const LoggedEntry& logged) override;
 
+  WriteResult CreateSequencedEntries_(
+      const std::vector<LoggedEntry>& logged) override;
+
   LookupResult LookupByHash(const std::string& hash,
                             LoggedEntry* result) const override;
 
@@ -49,6 +57,10 @@ class SQLiteDB : public Database {
   void InitializeNode(const std::string& node_id) override;
   LookupResult NodeId(std::string* node_id) override;
 
+  void WriteTreeFrontier(const ct::CompactTreeFrontier& frontier) override;
+  LookupResult LatestTreeFrontier(
+      ct::CompactTreeFrontier* result) const override;
+
   // Force an STH notification. This is needed only for ct-dns-server,
   // which shares a SQLite database with ct-server, but needs to
   // refresh itself occasionally.
@@ -56,20 +68,38 @@ class SQLiteDB : public Database {
 
  private:
   class Iterator;
-
-  LookupResult LookupByIndex(const std::unique_lock<std::mutex>& lock,
-                             int64_t sequence_number,
+  // A connection to the database, with its prepared statements.
+  struct Connection;
+
+  // The lookups below run on |conn|, which is either the writer, with
+  // |lock_| held, or a reader.
+  LookupResult LookupByHash(Connection* conn, const std::string& hash,
+                            LoggedEntry* result) const;
+  LookupResult LookupByIndex(Connection* conn, int64_t sequence_number,
                              LoggedEntry* result) const;
   // This finds the next entry with a sequence number equal or greater
   // to the one specified.
-  LookupResult LookupNextIndex(const std::unique_lock<std::mutex>& lock,
-                               int64_t sequence_number,
+  LookupResult LookupNextIndex(Connection* conn, int64_t sequence_number,
                                LoggedEntry* result) const;
-  LookupResult LatestTreeHeadNoLock(const std::unique_lock<std::mutex>& lock,
-                                    ct::SignedTreeHead* result) const;
+  LookupResult LatestTreeHead(Connection* conn,
+                              ct::SignedTreeHead* result) const;
   LookupResult NodeId(const std::unique_lock<std::mutex>& lock,
                       std::string* node_id);
 
+  // Runs |lookup| on a reader, if there are any. Readers only see
+  // committed data, so unless |final| says that the result is good
+  // enough regardless, it is run again on the writer if there were
+  // entries yet to be committed.
+  LookupResult Read(const std::function<LookupResult(Connection*)>& lookup,
+                    const std::function<bool(LookupResult)>& final) const;
+
+  // Moves |tree_size_| past |sequence_number| if that is the entry
+  // right after the end of the tree.
+  void SawSequenceNumber(int64_t sequence_number) const;
+
+  WriteResult InsertSequencedEntry(const std::unique_lock<std::mutex>& lock,
+                                   const LoggedEntry& logged);
+
   void BeginTransaction(const std::unique_lock<std::mutex>& lock);
 
   void EndTransaction(const std::unique_lock<std::mutex>& lock);
@@ -77,13 +107,23 @@ class SQLiteDB : public Database {
   void MaybeStartNewTransaction(const std::unique_lock<std::mutex>& lock);
 
   mutable std::mutex lock_;
-  sqlite3* const db_;
+  // All the writes go through this connection, guarded by |lock_|.
+  const std::unique_ptr<Connection> writer_;
   // This is marked mutable, as it is a lazily updated cache updated
   // from some of the getters.
-  mutable int64_t tree_size_;
+  mutable std::atomic<int64_t> tree_size_;
+  // Whether the writer has written entries in the transaction it has
+  // open, which the readers cannot see yet.
+  std::atomic<bool> uncommitted_entries_;
   DatabaseNotifierHelper callbacks_;
   int64_t transaction_size_;
   bool in_transaction_;
+
+  // Read-only connections, for the lookups to run in parallel.
+  size_t num_readers_;
+  mutable std::mutex readers_lock_;
+  mutable std::condition_variable reader_returned_;
+  mutable std::vector<std::unique_ptr<Connection>> idle_readers_;
 };
 
 
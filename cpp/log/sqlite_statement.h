@@ -4,22 +4,92 @@
 #include <glog/logging.h>
 #include <sqlite3.h>
 #include <string>
+#include <unordered_map>
 
 namespace sqlite {
 
+
+inline sqlite3_stmt* Prepare(sqlite3* db, const char* sql) {
+  sqlite3_stmt* stmt(NULL);
+  int ret = sqlite3_prepare_v2(db, sql, -1, &stmt, NULL);
+  if (ret != SQLITE_OK)
+    LOG(ERROR) << "ret = " << ret << ", err = " << sqlite3_errmsg(db)
+               << ", sql = " << sql << std::endl;
+
+  CHECK_EQ(SQLITE_OK, ret);
+  return stmt;
+}
+
+
+// Keeps the statements prepared on a connection, so that each SQL
+// statement is only compiled once. Like the connection, it must only be
+// used by one thread at a time, and it must be destroyed before the
+// connection is closed.
+class StatementCache {
+ public:
+  explicit StatementCache(sqlite3* db) : db_(CHECK_NOTNULL(db)) {
+  }
+
+  ~StatementCache() {
+    for (const auto& it : statements_) {
+      sqlite3_finalize(it.second);
+    }
+  }
+
+  StatementCache(const StatementCache&) = delete;
+  StatementCache& operator=(const StatementCache&) = delete;
+
+  sqlite3* db() const {
+    return db_;
+  }
+
+  // Returns the statement for |sql|, preparing it if it is not in the
+  // cache. It is out of the cache until it is given back to Return(),
+  // so the same SQL can be used by nested statements.
+  sqlite3_stmt* Take(const char* sql) {
+    const auto it(statements_.find(sql));
+    if (it == statements_.end()) {
+      return Prepare(db_, sql);
+    }
+    sqlite3_stmt* const stmt(it->second);
+    statements_.erase(it);
+    return stmt;
+  }
+
+  void Return(const char* sql, sqlite3_stmt* stmt) {
+    // This returns the error of the last step, if there was one, which
+    // has been dealt with already.
+    sqlite3_reset(stmt);
+    CHECK_EQ(SQLITE_OK, sqlite3_clear_bindings(stmt));
+    if (!statements_.emplace(sql, stmt).second) {
+      sqlite3_finalize(stmt);
+    }
+  }
+
+ private:
+  sqlite3* const db_;
+  std::unordered_map<std::string, sqlite3_stmt*> statements_;
+};
+
+
 // Reduce the ugliness of the sqlite3 API.
 class Statement {
  public:
-  Statement(sqlite3* db, const char* sql) : stmt_(NULL) {
-    int ret = sqlite3_prepare_v2(db, sql, -1, &stmt_, NULL);
-    if (ret != SQLITE_OK)
-      LOG(ERROR) << "ret = " << ret << ", err = " << sqlite3_errmsg(db)
-                 << ", sql = " << sql << std::endl;
+  Statement(sqlite3* db, const char* sql)
+      : cache_(NULL), sql_(sql), stmt_(Prepare(db, sql)) {
+  }
 
-    CHECK_EQ(SQLITE_OK, ret);
+  // Uses the prepared statement for |sql| in |cache|, and gives it back
+  // once done. |sql| must outlive this statement.
+  Statement(StatementCache* cache, const char* sql)
+      : cache_(CHECK_NOTNULL(cache)), sql_(sql), stmt_(cache->Take(sql)) {
   }
 
   ~Statement() {
+    if (cache_) {
+      cache_->Return(sql_, stmt_);
+      return;
+    }
     int ret = sqlite3_finalize(stmt_);
     // can get SQLITE_CONSTRAINT if an insert failed due to a duplicate key.
     CHECK(ret == SQLITE_OK || ret == SQLITE_CONSTRAINT);
@@ -60,6 +130,8 @@ class Statement {
   }
 
  private:
+  StatementCache* const cache_;
+  const char* const sql_;
   sqlite3_stmt* stmt_;
 };
 
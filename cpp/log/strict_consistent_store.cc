@@ -1,6 +1,8 @@
 #include "log/strict_consistent_store.h"
 
 using ct::SignedTreeHead;
+using std::string;
+using std::vector;
 using util::Status;
 using util::StatusOr;
 
@@ -38,6 +40,15 @@ Status StrictConsistentStore::UpdateSequenceMapping(
 }
 
 
+Status StrictConsistentStore::DeleteSequenceRange(
+    const EntryHandle<ct::SequenceRange>& range) {
+  if (!election_->IsMaster()) {
+    return Status(util::error::PERMISSION_DENIED, "Not currently master.");
+  }
+  return peer_->DeleteSequenceRange(range);
+}
+
+
 Status StrictConsistentStore::SetClusterConfig(
     const ct::ClusterConfig& config) {
   if (!election_->IsMaster()) {
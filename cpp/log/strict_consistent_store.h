@@ -31,6 +31,9 @@ class StrictConsistentStore : public ConsistentStore {
   util::Status UpdateSequenceMapping(
       EntryHandle<ct::SequenceMapping>* entry) override;
 
+  util::Status DeleteSequenceRange(
+      const EntryHandle<ct::SequenceRange>& range) override;
+
   util::Status SetClusterConfig(const ct::ClusterConfig& config) override;
 
   util::StatusOr<int64_t> CleanupOldEntries() override;
@@ -45,6 +48,11 @@ class StrictConsistentStore : public ConsistentStore {
     return peer_->AddPendingEntry(entry);
   }
 
+  void AddPendingEntries(const std::vector<LoggedEntry*>& entries,
+                         std::vector<util::Status>* statuses) override {
+    return peer_->AddPendingEntries(entries, statuses);
+  }
+
   util::Status GetPendingEntryForHash(
       const std::string& hash,
       EntryHandle<LoggedEntry>* entry) const override {
@@ -56,11 +64,40 @@ class StrictConsistentStore : public ConsistentStore {
     return peer_->GetPendingEntries(entries);
   }
 
+  util::Status GetPendingEntriesUpTo(
+      uint64_t max_timestamp, std::vector<EntryHandle<LoggedEntry>>* entries,
+      int64_t* num_later) const override {
+    return peer_->GetPendingEntriesUpTo(max_timestamp, entries, num_later);
+  }
+
+  util::Status GetPendingEntryInfosUpTo(
+      uint64_t max_timestamp, std::vector<PendingEntryInfo>* infos,
+      int64_t* num_later) const override {
+    return peer_->GetPendingEntryInfosUpTo(max_timestamp, infos, num_later);
+  }
+
+  void GetPendingEntriesForHashes(
+      const std::vector<std::string>& hashes,
+      std::vector<EntryHandle<LoggedEntry>>* entries,
+      std::vector<util::Status>* statuses) const override {
+    return peer_->GetPendingEntriesForHashes(hashes, entries, statuses);
+  }
+
   util::Status GetSequenceMapping(
       EntryHandle<ct::SequenceMapping>* entry) const override {
     return peer_->GetSequenceMapping(entry);
   }
 
+  util::Status AddSequenceRange(
+      const std::vector<std::string>& hashes) override {
+    return peer_->AddSequenceRange(hashes);
+  }
+
+  util::Status GetSequenceRanges(
+      std::vector<EntryHandle<ct::SequenceRange>>* ranges) const override {
+    return peer_->GetSequenceRanges(ranges);
+  }
+
   util::StatusOr<ct::ClusterNodeState> GetClusterNodeState() const override {
     return peer_->GetClusterNodeState();
   }
@@ -86,6 +123,11 @@ class StrictConsistentStore : public ConsistentStore {
     return peer_->WatchClusterConfig(cb, task);
   }
 
+  void WatchPendingEntries(const ConsistentStore::PendingEntriesCallback& cb,
+                           util::Task* task) override {
+    return peer_->WatchPendingEntries(cb, task);
+  }
+
  private:
   const MasterElection* const election_;  // Not owned by us
   const std::unique_ptr<ConsistentStore> peer_;
@@ -3,11 +3,17 @@
 
 #include <sys/stat.h>
 
+#include "config.h"
+#include "log/caching_db.h"
 #include "log/database.h"
 #include "log/file_db.h"
 #include "log/file_storage.h"
 #include "log/leveldb_db.h"
 #include "log/logged_entry.h"
+#ifdef HAVE_ROCKSDB
+#include "log/rocksdb_db.h"
+#endif
+#include "log/segmented_db.h"
 #include "log/sqlite_db.h"
 #include "util/test_db.h"
 
@@ -63,6 +69,51 @@ cert_trans::LevelDB* TestDB<cert_trans::LevelDB>::SecondDB() {
   return new cert_trans::LevelDB(tmp_.TmpStorageDir() + "/leveldb");
 }
 
+#ifdef HAVE_ROCKSDB
+template <>
+void TestDB<cert_trans::RocksDB>::Setup() {
+  db_.reset(new cert_trans::RocksDB(tmp_.TmpStorageDir() + "/rocksdb"));
+}
+
+template <>
+cert_trans::RocksDB* TestDB<cert_trans::RocksDB>::SecondDB() {
+  // Like LevelDB, RocksDB locks the database against other openers.
+  db_.reset();
+  return new cert_trans::RocksDB(tmp_.TmpStorageDir() + "/rocksdb");
+}
+#endif
+
+template <>
+void TestDB<cert_trans::SegmentedDB>::Setup() {
+  db_.reset(new cert_trans::SegmentedDB(tmp_.TmpStorageDir() + "/segmented"));
+}
+
+template <>
+cert_trans::SegmentedDB* TestDB<cert_trans::SegmentedDB>::SecondDB() {
+  // Both would append to the same segments, so close the original.
+  db_.reset();
+  return new cert_trans::SegmentedDB(tmp_.TmpStorageDir() + "/segmented");
+}
+
+// Over a SegmentedDB, with a cache small enough for some entries to
+// be evicted.
+template <>
+void TestDB<cert_trans::CachingDatabase>::Setup() {
+  db_.reset(new cert_trans::CachingDatabase(
+      std::unique_ptr<cert_trans::Database>(new cert_trans::SegmentedDB(
+          tmp_.TmpStorageDir() + "/segmented")),
+      1 << 16));
+}
+
+template <>
+cert_trans::CachingDatabase* TestDB<cert_trans::CachingDatabase>::SecondDB() {
+  db_.reset();
+  return new cert_trans::CachingDatabase(
+      std::unique_ptr<cert_trans::Database>(new cert_trans::SegmentedDB(
+          tmp_.TmpStorageDir() + "/segmented")),
+      1 << 16);
+}
+
 // Not a Database; we just use the same template for setup.
 template <>
 void TestDB<cert_trans::FileStorage>::Setup() {
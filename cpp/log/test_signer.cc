@@ -362,6 +362,9 @@ void TestSigner::CreateUnique(LoggedEntry* logged_cert) {
   CHECK_EQ(LogSigner::OK,
            default_signer_->SignCertificateTimestamp(
                logged_cert->entry(), logged_cert->mutable_sct()));
+  // Changing the SCT drops the leaf hash.
+  logged_cert->StoreMerkleLeafHash(tree_hasher_);
+  CHECK(logged_cert->has_merkle_leaf_hash());
 }
 
 void TestSigner::CreateUniqueFakeSignature(LoggedEntry* logged_cert) {
@@ -373,6 +376,8 @@ void TestSigner::CreateUniqueFakeSignature(LoggedEntry* logged_cert) {
       DigitallySigned::ECDSA);
   logged_cert->mutable_sct()->mutable_signature()->set_signature(
       B(kDefaultCertSCTSignature));
+  logged_cert->StoreMerkleLeafHash(tree_hasher_);
+  CHECK(logged_cert->has_merkle_leaf_hash());
 }
 
 void TestSigner::CreateUnique(SignedTreeHead* sth) {
@@ -469,12 +474,6 @@ void TestSigner::FillData(LoggedEntry* logged_cert) {
   CHECK_EQ(logged_cert->Hash(),
            Sha256Hasher::Sha256Digest(
                Serializer::LeafData(logged_cert->entry())));
-  string serialized_leaf;
-  CHECK_EQ(cert_trans::serialization::SerializeResult::OK,
-           Serializer::SerializeSCTMerkleTreeLeaf(logged_cert->sct(),
-                                                  logged_cert->entry(),
-                                                  &serialized_leaf));
-  logged_cert->set_merkle_leaf_hash(tree_hasher_.HashLeaf(serialized_leaf));
 
   logged_cert->clear_sequence_number();
 }
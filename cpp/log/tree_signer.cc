@@ -1,44 +1,223 @@
 #include "log/tree_signer.h"
 
+#include <gflags/gflags.h>
 #include <glog/logging.h>
 #include <stdint.h>
 #include <algorithm>
 #include <chrono>
+#include <condition_variable>
+#include <limits>
+#include <mutex>
 #include <set>
 #include <unordered_map>
+#include <unordered_set>
 
 #include "log/database.h"
 #include "log/log_signer.h"
+#include "merkletree/serial_hasher.h"
+#include "monitoring/latency.h"
+#include "monitoring/monitoring.h"
 #include "proto/serializer.h"
 #include "util/status.h"
+#include "util/thread_pool.h"
 #include "util/util.h"
 
 using ct::ClusterNodeState;
+using ct::CompactTreeFrontier;
 using ct::SequenceMapping;
 using ct::SequenceMapping_Mapping;
+using ct::SequenceRange;
 using ct::SignedTreeHead;
 using std::chrono::duration;
+using std::chrono::duration_cast;
+using std::chrono::microseconds;
 using std::chrono::milliseconds;
+using std::chrono::steady_clock;
 using std::chrono::system_clock;
+using std::condition_variable;
+using std::lock_guard;
 using std::make_pair;
 using std::map;
 using std::max;
+using std::min;
 using std::move;
+using std::mutex;
+using std::numeric_limits;
 using std::pair;
 using std::sort;
 using std::string;
 using std::unique_ptr;
 using std::unordered_map;
+using std::unordered_set;
 using std::vector;
 using util::Status;
 using util::StatusOr;
 using util::TimeInMilliseconds;
 using util::ToBase64;
 
+DECLARE_bool(frontend_signer_sequence_ranges);
+
+DEFINE_int32(tree_signer_hash_batch_size, 10000,
+             "Number of newly sequenced entries read from the database and "
+             "hashed together when updating the tree, if the tree signer "
+             "has a thread pool to hash on.");
+DEFINE_int32(tree_signer_fetch_batch_bytes, 16 << 20,
+             "Approximate number of bytes of newly sequenced entries got "
+             "from the consistent store, or written to the database, at "
+             "once.");
+DEFINE_int32(tree_signer_leaf_hash_check_interval, 1,
+             "Of the newly sequenced entries that come with their Merkle "
+             "leaf hash, computed when their SCT was issued, hash one in "
+             "this many again to check it before adding it to the tree, "
+             "dying on a mismatch. The others are added by the hash they "
+             "come with, which saves hashing them.");
+
 namespace cert_trans {
 namespace {
 
 
+// Number of entries hashed by each task of a batch.
+const size_t kHashChunkSize = 256;
+
+
+Latency<microseconds, string> sequencer_stage_latency_us(
+    "sequencer_stage_latency_us", "stage",
+    "Time spent by the sequencer in each stage of a run");
+
+Gauge<>* sequencer_pending_entries =
+    Gauge<>::New("sequencer_pending_entries",
+                 "Number of pending entries seen by the last sequencer run");
+
+Gauge<>* sequencer_too_recent_entries = Gauge<>::New(
+    "sequencer_too_recent_entries",
+    "Number of pending entries left unsequenced by the last sequencer run, "
+    "for being within the guard window");
+
+Counter<string>* sequencer_sequence_ranges = Counter<string>::New(
+    "sequencer_sequence_ranges", "outcome",
+    "Number of sequence ranges done with by the sequencer, broken down by "
+    "whether their entries were sequenced together (merged), or the "
+    "usual way, for some of them being missing (expired)");
+
+Counter<>* sequencer_unavailable_entries = Counter<>::New(
+    "sequencer_unavailable_entries",
+    "Number of times a pending entry was left for a later sequencer run, "
+    "for its body not being available");
+
+Histogram<>* sequencer_entries_per_run =
+    Histogram<>::New("sequencer_entries_per_run",
+                     "Number of entries newly sequenced by each sequencer run");
+
+Latency<microseconds, string> signer_stage_latency_us(
+    "signer_stage_latency_us", "stage",
+    "Time spent by the signer in each stage of a run");
+
+Histogram<>* signer_entries_per_run =
+    Histogram<>::New("signer_entries_per_run",
+                     "Number of entries added to the tree by each signer run");
+
+Histogram<>* signer_merge_delay_ms = Histogram<>::New(
+    "signer_merge_delay_ms",
+    "Time from the SCT of entries to the first local STH including them");
+
+Counter<string>* signer_leaf_hashes = Counter<string>::New(
+    "signer_leaf_hashes", "source",
+    "Number of leaf hashes added to the tree by the signer, broken down "
+    "by whether they were computed by the signer, or came with the "
+    "entry and were not checked");
+
+Gauge<>* signer_max_merge_delay_ms =
+    Gauge<>::New("signer_max_merge_delay_ms",
+                 "Largest merge delay of the entries added by the last "
+                 "signer run");
+
+
+// Records the time each stage of a run took, each starting where the
+// previous one ended.
+class StageTimer {
+ public:
+  explicit StageTimer(Latency<microseconds, string>* latency)
+      : latency_(latency), start_(steady_clock::now()) {
+  }
+
+  void EndStage(const string& stage) {
+    const steady_clock::time_point now(steady_clock::now());
+    latency_->RecordLatency(stage, now - start_);
+    start_ = now;
+  }
+
+ private:
+  Latency<microseconds, string>* const latency_;
+  steady_clock::time_point start_;
+};
+
+
+// Returns true if the Merkle leaf hash that |logged| comes with can
+// be added to the tree without checking it, see
+// --tree_signer_leaf_hash_check_interval.
+bool TrustLeafHash(const LoggedEntry& logged) {
+  CHECK_GT(FLAGS_tree_signer_leaf_hash_check_interval, 0);
+  return logged.has_merkle_leaf_hash() &&
+         logged.sequence_number() %
+                 FLAGS_tree_signer_leaf_hash_check_interval !=
+             0;
+}
+
+
+// Dies if |logged| comes with a Merkle leaf hash other than
+// |leaf_hash|, which is what the signer computed for it.
+void CheckLeafHash(const LoggedEntry& logged, const string& leaf_hash) {
+  CHECK(!logged.has_merkle_leaf_hash() ||
+        logged.merkle_leaf_hash() == leaf_hash)
+      << "Entry " << logged.sequence_number()
+      << " comes with the wrong Merkle leaf hash "
+      << util::HexString(logged.merkle_leaf_hash()) << ", expected "
+      << util::HexString(leaf_hash);
+}
+
+
+// Adds the leaves of the entries of |db| to |tree|, up to |tree_size|.
+// Returns false if |db| does not have them all.
+bool ExtendTree(const ReadOnlyDatabase* db, int64_t tree_size,
+                CompactMerkleTree* tree) {
+  int64_t sequence_number(tree->LeafCount());
+  vector<string> leaf_hashes;
+  while (sequence_number < tree_size) {
+    const int64_t wanted(min<int64_t>(FLAGS_tree_signer_hash_batch_size,
+                                      tree_size - sequence_number));
+    db->ReadLeafHashes(sequence_number, wanted, &leaf_hashes);
+    for (const auto& leaf_hash : leaf_hashes) {
+      tree->AddLeafHash(leaf_hash);
+    }
+    sequence_number += leaf_hashes.size();
+    if (static_cast<int64_t>(leaf_hashes.size()) < wanted) {
+      break;
+    }
+  }
+
+  // Those stored without their leaf hash are hashed here.
+  auto it(db->ScanEntries(sequence_number));
+  vector<LoggedEntry> batch;
+  string serialized_leaf;
+  while (sequence_number < tree_size) {
+    const int64_t wanted(min<int64_t>(FLAGS_tree_signer_hash_batch_size,
+                                      tree_size - sequence_number));
+    if (it->GetNextEntries(wanted, &batch) == 0) {
+      return false;
+    }
+    for (const auto& logged : batch) {
+      if (logged.sequence_number() != sequence_number) {
+        return false;
+      }
+      CHECK(logged.SerializeForLeaf(&serialized_leaf));
+      tree->AddLeaf(serialized_leaf);
+      ++sequence_number;
+    }
+  }
+  return true;
+}
+
+
 bool LessThanBySequence(const SequenceMapping::Mapping& lhs,
                         const SequenceMapping::Mapping& rhs) {
   CHECK(lhs.has_sequence_number());
@@ -50,45 +229,111 @@ bool LessThanBySequence(const SequenceMapping::Mapping& lhs,
 }  // namespace
 
 
-// Comparator for ordering pending hashes.
-// Order by timestamp then hash.
-bool PendingEntriesOrder::operator()(const EntryHandle<LoggedEntry>& x,
-                                     const EntryHandle<LoggedEntry>& y) const {
-  CHECK(x.Entry().contents().sct().has_timestamp());
-  CHECK(y.Entry().contents().sct().has_timestamp());
-  const uint64_t x_time(x.Entry().contents().sct().timestamp());
-  const uint64_t y_time(y.Entry().contents().sct().timestamp());
-  if (x_time < y_time) {
-    return true;
-  } else if (x_time > y_time) {
-    return false;
-  }
-
-  // Fallback to Hash as a final tie-breaker:
-  return x.Entry().Hash() < y.Entry().Hash();
+TreeSigner::TreeSigner(const duration<double>& guard_window, Database* db,
+                       unique_ptr<CompactMerkleTree> merkle_tree,
+                       ConsistentStore* consistent_store, LogSigner* signer)
+    : TreeSigner(guard_window, db, move(merkle_tree), consistent_store,
+                 signer, nullptr) {
 }
 
 
 TreeSigner::TreeSigner(const duration<double>& guard_window, Database* db,
                        unique_ptr<CompactMerkleTree> merkle_tree,
-                       ConsistentStore* consistent_store, LogSigner* signer)
+                       ConsistentStore* consistent_store, LogSigner* signer,
+                       ThreadPool* hash_pool)
     : guard_window_(guard_window),
       db_(db),
       consistent_store_(consistent_store),
       signer_(signer),
+      hash_pool_(hash_pool),
       cert_tree_(move(merkle_tree)),
-      latest_tree_head_() {
+      latest_tree_head_(),
+      frontier_tree_size_(-1) {
   CHECK(cert_tree_);
   // Try to get any STH previously published by this node.
-  const StatusOr<ClusterNodeState> node_state(
+  StatusOr<ClusterNodeState> node_state(
       consistent_store_->GetClusterNodeState());
   CHECK(node_state.ok() ||
         node_state.status().CanonicalCode() == util::error::NOT_FOUND)
       << "Problem fetching this node's previous state: "
       << node_state.status();
   if (node_state.ok()) {
-    latest_tree_head_ = node_state.ValueOrDie().newest_sth();
+    latest_tree_head_ = move(*node_state.ValueOrDie().mutable_newest_sth());
+  }
+}
+
+
+// static
+unique_ptr<CompactMerkleTree> TreeSigner::ResumeTree(
+    const ReadOnlyDatabase* db, unique_ptr<SerialHasher> hasher) {
+  CompactTreeFrontier frontier;
+  if (db->LatestTreeFrontier(&frontier) != Database::LOOKUP_OK) {
+    return nullptr;
+  }
+
+  // The signer only ever signs entries it found in the database, so
+  // a frontier beyond the end of the database is from another log.
+  if (frontier.tree_size() < 0 || frontier.tree_size() > db->TreeSize()) {
+    LOG(WARNING) << "Ignoring tree frontier of size " << frontier.tree_size()
+                 << " for a database of size " << db->TreeSize();
+    return nullptr;
+  }
+
+  unique_ptr<SerialHasher> common_hasher(hasher->Create());
+  unique_ptr<CompactMerkleTree> tree(CompactMerkleTree::FromFrontier(
+      frontier.tree_size(),
+      vector<string>(frontier.node().begin(), frontier.node().end()),
+      move(hasher)));
+  if (!tree || tree->CurrentRoot() != frontier.sha256_root_hash()) {
+    LOG(WARNING) << "Ignoring inconsistent tree frontier of size "
+                 << frontier.tree_size();
+    return nullptr;
+  }
+
+  // The frontier only vouches for itself, so it has to agree with the
+  // latest tree head of the database. That is checked against the
+  // root at its size, got by adding the entries since the frontier to
+  // it or, for a tree head behind it, by adding those since the
+  // largest subtrees both have in common to those.
+  SignedTreeHead sth;
+  if (db->LatestTreeHead(&sth) != Database::LOOKUP_OK) {
+    LOG(WARNING) << "Ignoring tree frontier of size " << frontier.tree_size()
+                 << " for a database without a tree head to check it";
+    return nullptr;
+  }
+  const int64_t sth_size(sth.tree_size());
+  unique_ptr<CompactMerkleTree> common_tree;
+  CompactMerkleTree* sth_tree(tree.get());
+  if (sth_size < frontier.tree_size()) {
+    int highest_bit(0);
+    for (int64_t diff(frontier.tree_size() ^ sth_size); diff > 1; diff >>= 1) {
+      ++highest_bit;
+    }
+    const int64_t common_size(frontier.tree_size() &
+                              ~((static_cast<int64_t>(2) << highest_bit) - 1));
+    vector<string> common_nodes;
+    if (common_size > 0) {
+      common_nodes = tree->Frontier();
+      for (int level = 0; level <= highest_bit; ++level) {
+        common_nodes[level].clear();
+      }
+    }
+    common_tree = CompactMerkleTree::FromFrontier(common_size, common_nodes,
+                                                  move(common_hasher));
+    CHECK(common_tree);
+    sth_tree = common_tree.get();
+  }
+  if (sth_size > db->TreeSize() || !ExtendTree(db, sth_size, sth_tree) ||
+      sth_tree->CurrentRoot() != sth.sha256_root_hash()) {
+    LOG(WARNING) << "Ignoring tree frontier of size " << frontier.tree_size()
+                 << ", which does not match the tree head of size "
+                 << sth_size;
+    return nullptr;
   }
+
+  LOG(INFO) << "Resuming tree from frontier of size " << frontier.tree_size()
+            << ", at size " << tree->LeafCount();
+  return tree;
 }
 
 
@@ -97,8 +342,14 @@ uint64_t TreeSigner::LastUpdateTime() const {
 }
 
 
+int64_t TreeSigner::NumUnsignedEntries() const {
+  return max<int64_t>(db_->TreeSize() - cert_tree_->LeafCount(), 0);
+}
+
+
 Status TreeSigner::SequenceNewEntries() {
   const system_clock::time_point now(system_clock::now());
+  StageTimer timer(&sequencer_stage_latency_us);
   StatusOr<int64_t> status_or_sequence_number(
       consistent_store_->NextAvailableSequenceNumber());
   if (!status_or_sequence_number.ok()) {
@@ -106,6 +357,7 @@ Status TreeSigner::SequenceNewEntries() {
   }
   int64_t next_sequence_number(status_or_sequence_number.ValueOrDie());
   CHECK_GE(next_sequence_number, 0);
+  const int64_t first_new_sequence_number(next_sequence_number);
   VLOG(1) << "Next available sequence number: " << next_sequence_number;
 
   EntryHandle<SequenceMapping> mapping;
@@ -124,46 +376,112 @@ Status TreeSigner::SequenceNewEntries() {
               .second);
   }
 
-  vector<EntryHandle<LoggedEntry>> pending_entries;
-  status = consistent_store_->GetPendingEntries(&pending_entries);
+  timer.EndStage("get_sequence_mapping");
+
+  // Ranges are only written with --frontend_signer_sequence_ranges,
+  // so without it there is no need to look for them.
+  vector<EntryHandle<SequenceRange>> ranges;
+  if (FLAGS_frontend_signer_sequence_ranges) {
+    status = consistent_store_->GetSequenceRanges(&ranges);
+    if (!status.ok()) {
+      return status;
+    }
+    timer.EndStage("get_sequence_ranges");
+  }
+
+  // Only what it takes to sequence the entries is listed here, the
+  // entries themselves are got later, for those the local DB does not
+  // have. With ranges, those within the guard window are listed too,
+  // as they may be in one, or sequenced already for having been in
+  // one. Otherwise, they are left for a later run, and the store only
+  // has to sort the others, if it does not keep them in order already.
+  const uint64_t max_timestamp(
+      duration_cast<milliseconds>((now - guard_window_).time_since_epoch())
+          .count());
+  vector<PendingEntryInfo> pending_entries;
+  int64_t num_too_recent(0);
+  status = consistent_store_->GetPendingEntryInfosUpTo(
+      FLAGS_frontend_signer_sequence_ranges ? numeric_limits<uint64_t>::max()
+                                            : max_timestamp,
+      &pending_entries, &num_too_recent);
   if (!status.ok()) {
     return status;
   }
-  sort(pending_entries.begin(), pending_entries.end(), PendingEntriesOrder());
+  timer.EndStage("get_pending_entries");
 
-  VLOG(1) << "Sequencing " << pending_entries.size() << " entr"
-          << (pending_entries.size() == 1 ? "y" : "ies");
+  // The entries of the ranges which have all of theirs pending (or
+  // sequenced already) go first, one range after the other, in the
+  // order their nodes put them in. They are marked as sequenced, so
+  // that they keep their place below.
+  int num_sequenced(0);
+  // With what became of them, to delete once the new mapping is in.
+  vector<pair<const EntryHandle<SequenceRange>*, string>> ranges_done;
+  {
+    unordered_set<string> pending_hashes;
+    for (const auto& pending_entry : pending_entries) {
+      pending_hashes.insert(pending_entry.hash);
+    }
+    for (const auto& range : ranges) {
+      bool complete(true);
+      for (const auto& hash : range.Entry().entry_hash()) {
+        if (pending_hashes.count(hash) == 0 &&
+            sequenced_hashes.count(hash) == 0) {
+          complete = false;
+          break;
+        }
+      }
+      if (!complete) {
+        // The store may not show all of its entries yet. Once out of
+        // the guard window, there is no point waiting for them, as the
+        // rest are sequenced the usual way by then.
+        if (range.Entry().timestamp() <= max_timestamp) {
+          ranges_done.emplace_back(&range, "expired");
+        }
+        continue;
+      }
+      for (const auto& hash : range.Entry().entry_hash()) {
+        if (sequenced_hashes
+                .insert(make_pair(hash, make_pair(next_sequence_number,
+                                                  false /*present*/)))
+                .second) {
+          VLOG(1) << ToBase64(hash) << " = " << next_sequence_number
+                  << " (from " << range.Key() << ")";
+          ++num_sequenced;
+          ++next_sequence_number;
+        }
+      }
+      ranges_done.emplace_back(&range, "merged");
+    }
+  }
+  timer.EndStage("merge_sequence_ranges");
 
   // We're going to update the sequence mapping based on the following rules:
   // 1) existing sequence mappings whose corresponding PendingEntry still
   //    exists will remain in the mappings file.
   // 2) PendingEntries which do not have a corresponding sequence mapping will
-  //    gain one.
+  //    gain one, unless they are within the guard window.
   // 3) mappings whose corresponding PendingEntry no longer exists will be
   //    removed from the sequence mapping file.
   google::protobuf::RepeatedPtrField<SequenceMapping_Mapping> new_mapping;
-  map<int64_t, const LoggedEntry*> seq_to_entry;
-  int num_sequenced(0);
-  for (auto& pending_entry : pending_entries) {
-    const string& pending_hash(pending_entry.Entry().Hash());
-    const system_clock::time_point cert_time(
-        milliseconds(pending_entry.Entry().timestamp()));
-    if (now - cert_time < guard_window_) {
-      VLOG(1) << "Entry too recent: "
-              << ToBase64(pending_entry.Entry().Hash());
-      continue;
-    }
+  map<int64_t, const PendingEntryInfo*> seq_to_entry;
+  for (const auto& pending_entry : pending_entries) {
+    const string& pending_hash(pending_entry.hash);
     const auto seq_it(sequenced_hashes.find(pending_hash));
-    SequenceMapping::Mapping* const seq_mapping(new_mapping.Add());
 
     if (seq_it == sequenced_hashes.end()) {
+      if (pending_entry.timestamp > max_timestamp) {
+        // Left for a later run.
+        ++num_too_recent;
+        continue;
+      }
+
       // Need to sequence this one.
       VLOG(1) << ToBase64(pending_hash) << " = " << next_sequence_number;
 
       // Record the sequence -> hash mapping
+      SequenceMapping::Mapping* const seq_mapping(new_mapping.Add());
       seq_mapping->set_sequence_number(next_sequence_number);
-      seq_mapping->set_entry_hash(pending_entry.Entry().Hash());
-      pending_entry.MutableEntry()->set_sequence_number(next_sequence_number);
+      seq_mapping->set_entry_hash(pending_hash);
       ++num_sequenced;
       ++next_sequence_number;
     } else {
@@ -171,18 +489,63 @@ Status TreeSigner::SequenceNewEntries() {
               << seq_it->second.first;
       CHECK(!seq_it->second.second /*present*/)
           << "Saw same sequenced cert twice.";
-      CHECK(!pending_entry.Entry().has_sequence_number());
       seq_it->second.second = true;  // present
 
+      SequenceMapping::Mapping* const seq_mapping(new_mapping.Add());
       seq_mapping->set_entry_hash(seq_it->first);
       seq_mapping->set_sequence_number(seq_it->second.first);
-      pending_entry.MutableEntry()->set_sequence_number(seq_it->second.first);
     }
     CHECK(seq_to_entry
-              .insert(make_pair(pending_entry.Entry().sequence_number(),
-                                pending_entry.MutableEntry()))
+              .insert(make_pair(new_mapping.rbegin()->sequence_number(),
+                                &pending_entry))
               .second);
   }
+  sequencer_pending_entries->Set(
+      FLAGS_frontend_signer_sequence_ranges
+          ? pending_entries.size()
+          : pending_entries.size() + num_too_recent);
+  sequencer_too_recent_entries->Set(num_too_recent);
+
+  timer.EndStage("assign");
+
+  // The entries given a number by this run are got before the new
+  // mapping is written, so that those which cannot be, for their body
+  // being unavailable, are left for a later run rather than holding up
+  // the others, which move down to fill the gaps.
+  unordered_map<string, LoggedEntry> new_entries;
+  {
+    vector<const PendingEntryInfo*> infos;
+    for (auto it(seq_to_entry.lower_bound(first_new_sequence_number));
+         it != seq_to_entry.end(); ++it) {
+      infos.push_back(it->second);
+    }
+    status = GetPendingEntries(infos, &new_entries);
+    if (!status.ok()) {
+      LOG(WARNING) << "Leaving " << infos.size() - new_entries.size()
+                   << " entries for a later run: " << status;
+      sequencer_unavailable_entries->IncrementBy(infos.size() -
+                                                 new_entries.size());
+      num_sequenced -= infos.size() - new_entries.size();
+
+      map<int64_t, const PendingEntryInfo*> available;
+      int64_t sequence_number(first_new_sequence_number);
+      for (const PendingEntryInfo* info : infos) {
+        if (new_entries.count(info->hash) > 0) {
+          available.emplace(sequence_number++, info);
+        }
+      }
+      seq_to_entry.erase(seq_to_entry.lower_bound(first_new_sequence_number),
+                         seq_to_entry.end());
+      seq_to_entry.insert(available.begin(), available.end());
+      new_mapping.Clear();
+      for (const auto& entry : seq_to_entry) {
+        SequenceMapping::Mapping* const seq_mapping(new_mapping.Add());
+        seq_mapping->set_sequence_number(entry.first);
+        seq_mapping->set_entry_hash(entry.second->hash);
+      }
+    }
+  }
+  timer.EndStage("get_new_pending_entries");
 
   const StatusOr<SignedTreeHead> serving_sth(
       consistent_store_->GetServingSTH());
@@ -190,14 +553,22 @@ Status TreeSigner::SequenceNewEntries() {
     LOG(WARNING) << "Failed to get ServingSTH: " << serving_sth.status();
     return serving_sth.status();
   }
+  timer.EndStage("get_serving_sth");
 
   // Sanity check: make sure no hashes above the serving_sth level vanished:
   CHECK_LE(serving_sth.ValueOrDie().tree_size(), INT64_MAX);
   const int64_t serving_tree_size(serving_sth.ValueOrDie().tree_size());
   for (const auto& s : sequenced_hashes) {
-    if (!s.second.second /*present*/) {
-      // if it disappeared, check it's underwater:
-      CHECK_LT(s.second.first, serving_tree_size);
+    if (!s.second.second /*present*/ &&
+        s.second.first >= serving_tree_size) {
+      // It keeps its place, for the local DB may have it, until the
+      // serving STH covers it.
+      LOG(WARNING) << "Sequenced entry " << ToBase64(s.first) << " = "
+                   << s.second.first << " vanished above the serving STH "
+                   << "(tree size " << serving_tree_size << ")";
+      SequenceMapping::Mapping* const seq_mapping(new_mapping.Add());
+      seq_mapping->set_sequence_number(s.second.first);
+      seq_mapping->set_entry_hash(s.first);
     }
   }
 
@@ -214,16 +585,75 @@ Status TreeSigner::SequenceNewEntries() {
   if (!status.ok()) {
     return status;
   }
+  timer.EndStage("update_sequence_mapping");
+
+  for (const auto& range : ranges_done) {
+    status = consistent_store_->DeleteSequenceRange(*range.first);
+    if (!status.ok()) {
+      // Its entries all have their place now, so a later run just
+      // deletes it again.
+      LOG(WARNING) << "Failed to delete sequence range " << range.first->Key()
+                   << ": " << status;
+      continue;
+    }
+    sequencer_sequence_ranges->Increment(range.second);
+  }
+  timer.EndStage("delete_sequence_ranges");
 
   // Now add the sequenced entries to our local DB so that the local signer can
-  // incorporate them.
-  for (auto it(seq_to_entry.find(db_->TreeSize())); it != seq_to_entry.end();
-       ++it) {
-    VLOG(1) << "Adding to local DB: " << it->first;
-    CHECK_EQ(it->first, it->second->sequence_number());
-    CHECK_EQ(Database::OK, db_->CreateSequencedEntry(*(it->second)));
+  // incorporate them. They go in in batches, rather than one write per
+  // entry, along with the encoding get-entries serves for them, which
+  // cannot change from now on. Those given a number by an earlier run
+  // are got from the consistent store here.
+  auto it(seq_to_entry.find(db_->TreeSize()));
+  while (it != seq_to_entry.end()) {
+    vector<pair<int64_t, const PendingEntryInfo*>> batch;
+    vector<const PendingEntryInfo*> to_get;
+    int64_t batch_bytes(0);
+    for (; it != seq_to_entry.end() &&
+           (batch.empty() ||
+            batch_bytes + it->second->size <=
+                FLAGS_tree_signer_fetch_batch_bytes);
+         ++it) {
+      batch.emplace_back(*it);
+      if (new_entries.count(it->second->hash) == 0) {
+        to_get.push_back(it->second);
+      }
+      batch_bytes += it->second->size;
+    }
+    if (!to_get.empty()) {
+      status = GetPendingEntries(to_get, &new_entries);
+      timer.EndStage("get_pending_entries_for_hashes");
+    }
+
+    // The database only takes them in order, so this stops at the
+    // first one missing.
+    vector<LoggedEntry> to_add;
+    to_add.reserve(batch.size());
+    for (const auto& entry : batch) {
+      const auto new_entry(new_entries.find(entry.second->hash));
+      if (new_entry == new_entries.end()) {
+        break;
+      }
+      VLOG(1) << "Adding to local DB: " << entry.first;
+      to_add.emplace_back();
+      to_add.back().Swap(&new_entry->second);
+      new_entries.erase(new_entry);
+      to_add.back().set_sequence_number(entry.first);
+      CHECK(to_add.back().StoreServingData());
+    }
+    if (!to_add.empty()) {
+      CHECK_EQ(Database::OK, db_->CreateSequencedEntries(to_add));
+      timer.EndStage("db_write");
+    }
+    if (to_add.size() < batch.size()) {
+      // The new mapping is in place, so a later run picks up from
+      // here.
+      return status;
+    }
   }
 
+  sequencer_entries_per_run->Record(num_sequenced);
   VLOG(1) << "Sequenced " << num_sequenced << " entries.";
 
   return ::util::OkStatus();
@@ -238,18 +668,45 @@ typename TreeSigner::UpdateResult TreeSigner::UpdateTree() {
   // multiple nodes in the cluster may make STHs with the same timestamp.
   // That'll get handled by the Serving STH selection code.
   uint64_t min_timestamp = LastUpdateTime() + 1;
+  StageTimer timer(&signer_stage_latency_us);
+  // Of the entries added to the tree, to work out their merge delay.
+  vector<uint64_t> sct_timestamps;
 
   // Add any newly sequenced entries from our local DB.
   auto it(db_->ScanEntries(cert_tree_->LeafCount()));
-  for (int64_t i(cert_tree_->LeafCount());; ++i) {
-    LoggedEntry logged;
-    if (!it->GetNextEntry(&logged) || logged.sequence_number() != i) {
-      break;
+  if (hash_pool_) {
+    CHECK_GT(FLAGS_tree_signer_hash_batch_size, 0);
+    const size_t batch_size(FLAGS_tree_signer_hash_batch_size);
+    vector<LoggedEntry> batch;
+    bool done(false);
+    while (!done) {
+      done = it->GetNextEntries(batch_size, &batch) < batch_size;
+      // Stop at the first gap in the sequence numbers.
+      const int64_t first(cert_tree_->LeafCount());
+      for (size_t i = 0; i < batch.size(); ++i) {
+        if (batch[i].sequence_number() != first + static_cast<int64_t>(i)) {
+          batch.resize(i);
+          done = true;
+          break;
+        }
+        min_timestamp = max(min_timestamp, batch[i].sct().timestamp());
+        sct_timestamps.push_back(batch[i].sct().timestamp());
+      }
+      AppendBatchToTree(batch);
+    }
+  } else {
+    for (int64_t i(cert_tree_->LeafCount());; ++i) {
+      LoggedEntry logged;
+      if (!it->GetNextEntry(&logged) || logged.sequence_number() != i) {
+        break;
+      }
+      CHECK_EQ(logged.sequence_number(), i);
+      AppendToTree(logged);
+      min_timestamp = max(min_timestamp, logged.sct().timestamp());
+      sct_timestamps.push_back(logged.sct().timestamp());
     }
-    CHECK_EQ(logged.sequence_number(), i);
-    AppendToTree(logged);
-    min_timestamp = max(min_timestamp, logged.sct().timestamp());
   }
+  timer.EndStage("read_and_hash");
   int64_t next_seq(cert_tree_->LeafCount());
   CHECK_GE(next_seq, 0);
 
@@ -258,16 +715,68 @@ typename TreeSigner::UpdateResult TreeSigner::UpdateTree() {
   // the sequence number is not allowed).
   SignedTreeHead new_sth;
   TimestampAndSign(min_timestamp, &new_sth);
+  timer.EndStage("sign");
+  WriteFrontier(new_sth);
+  timer.EndStage("write_frontier");
+
+  signer_entries_per_run->Record(sct_timestamps.size());
+  uint64_t max_merge_delay_ms(0);
+  for (const uint64_t sct_timestamp : sct_timestamps) {
+    // The STH timestamp is never before that of its entries.
+    const uint64_t merge_delay_ms(new_sth.timestamp() - sct_timestamp);
+    signer_merge_delay_ms->Record(merge_delay_ms);
+    max_merge_delay_ms = max(max_merge_delay_ms, merge_delay_ms);
+  }
+  signer_max_merge_delay_ms->Set(max_merge_delay_ms);
 
   // We don't actually store this STH anywhere durable yet, but rather let the
   // caller decide what to do with it.  (In practice, this will mean that it's
   // pushed out to this node's ClusterNodeState so that it becomes a candidate
   // for the cluster-wide Serving STH.)
   latest_tree_head_.CopyFrom(new_sth);
+  std::atomic_store(&latest_tree_snapshot_, cert_tree_->TakeSnapshot());
   return OK;
 }
 
 
+Status TreeSigner::GetPendingEntries(
+    const vector<const PendingEntryInfo*>& infos,
+    unordered_map<string, LoggedEntry>* entries) {
+  Status status;
+  for (size_t begin = 0; begin < infos.size();) {
+    vector<string> hashes;
+    int64_t batch_bytes(0);
+    for (; begin < infos.size() &&
+           (hashes.empty() ||
+            batch_bytes + infos[begin]->size <=
+                FLAGS_tree_signer_fetch_batch_bytes);
+         ++begin) {
+      hashes.emplace_back(infos[begin]->hash);
+      batch_bytes += infos[begin]->size;
+    }
+
+    vector<EntryHandle<LoggedEntry>> got;
+    vector<Status> statuses;
+    consistent_store_->GetPendingEntriesForHashes(hashes, &got, &statuses);
+    CHECK_EQ(hashes.size(), got.size());
+    CHECK_EQ(hashes.size(), statuses.size());
+    for (size_t i = 0; i < hashes.size(); ++i) {
+      if (!statuses[i].ok()) {
+        LOG(WARNING) << "Couldn't get pending entry " << ToBase64(hashes[i])
+                     << ": " << statuses[i];
+        if (status.ok()) {
+          status = statuses[i];
+        }
+        continue;
+      }
+      CHECK_EQ(hashes[i], got[i].Entry().Hash());
+      (*entries)[hashes[i]].Swap(got[i].MutableEntry());
+    }
+  }
+  return status;
+}
+
+
 bool TreeSigner::Append(const LoggedEntry& logged) {
   // Serialize for inclusion in the tree.
   string serialized_leaf;
@@ -293,12 +802,69 @@ bool TreeSigner::Append(const LoggedEntry& logged) {
 
 
 void TreeSigner::AppendToTree(const LoggedEntry& logged) {
+  const bool trusted(TrustLeafHash(logged));
+  signer_leaf_hashes->Increment(trusted ? "entry" : "signer");
+  if (trusted) {
+    cert_tree_->AddLeafHash(logged.merkle_leaf_hash());
+    return;
+  }
+
   // Serialize for inclusion in the tree.
   string serialized_leaf;
   CHECK(logged.SerializeForLeaf(&serialized_leaf));
+  const string leaf_hash(cert_tree_->LeafHash(serialized_leaf));
+  CheckLeafHash(logged, leaf_hash);
 
   // Update in-memory tree.
-  cert_tree_->AddLeaf(serialized_leaf);
+  cert_tree_->AddLeafHash(leaf_hash);
+}
+
+
+void TreeSigner::AppendBatchToTree(const vector<LoggedEntry>& batch) {
+  CHECK_NOTNULL(hash_pool_);
+  vector<string> leaf_hashes(batch.size());
+
+  mutex lock;
+  condition_variable done;
+  size_t remaining((batch.size() + kHashChunkSize - 1) / kHashChunkSize);
+  for (size_t begin = 0; begin < batch.size(); begin += kHashChunkSize) {
+    const size_t end(min(begin + kHashChunkSize, batch.size()));
+    hash_pool_->Add([this, &batch, &leaf_hashes, &lock, &done, &remaining,
+                     begin, end]() {
+      // The tree's own hasher is locked on every call, so each task gets
+      // its own.
+      const unique_ptr<TreeHasher> hasher(cert_tree_->NewTreeHasher());
+      string serialized_leaf;
+      size_t trusted(0);
+      for (size_t i = begin; i < end; ++i) {
+        if (TrustLeafHash(batch[i])) {
+          leaf_hashes[i] = batch[i].merkle_leaf_hash();
+          ++trusted;
+          continue;
+        }
+        CHECK(batch[i].SerializeForLeaf(&serialized_leaf));
+        leaf_hashes[i] = hasher->HashLeaf(serialized_leaf);
+        CheckLeafHash(batch[i], leaf_hashes[i]);
+      }
+      signer_leaf_hashes->IncrementBy("entry", trusted);
+      signer_leaf_hashes->IncrementBy("signer", end - begin - trusted);
+
+      lock_guard<mutex> guard(lock);
+      if (--remaining == 0)
+        done.notify_one();
+    });
+  }
+
+  {
+    std::unique_lock<mutex> guard(lock);
+    done.wait(guard, [&remaining]() { return remaining == 0; });
+  }
+
+  for (size_t i = 0; i < batch.size(); ++i) {
+    CHECK_EQ(batch[i].sequence_number(),
+             static_cast<int64_t>(cert_tree_->LeafCount()));
+    cert_tree_->AddLeafHash(leaf_hashes[i]);
+  }
 }
 
 
@@ -320,4 +886,20 @@ void TreeSigner::TimestampAndSign(uint64_t min_timestamp,
 }
 
 
+void TreeSigner::WriteFrontier(const SignedTreeHead& sth) {
+  if (sth.tree_size() == frontier_tree_size_) {
+    return;
+  }
+
+  CompactTreeFrontier frontier;
+  frontier.set_tree_size(sth.tree_size());
+  for (const auto& node : cert_tree_->Frontier()) {
+    frontier.add_node(node);
+  }
+  frontier.set_sha256_root_hash(sth.sha256_root_hash());
+  db_->WriteTreeFrontier(frontier);
+  frontier_tree_size_ = sth.tree_size();
+}
+
+
 }  // namespace cert_trans
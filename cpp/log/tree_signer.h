@@ -4,6 +4,10 @@
 #include <stdint.h>
 #include <algorithm>
 #include <chrono>
+#include <memory>
+#include <string>
+#include <unordered_map>
+#include <vector>
 
 #include "log/cluster_state_controller.h"
 #include "log/consistent_store.h"
@@ -17,11 +21,14 @@ class Status;
 }  // namespace util
 
 class LogSigner;
+class SerialHasher;
 
 
 namespace cert_trans {
 
 class Database;
+class ReadOnlyDatabase;
+class ThreadPool;
 
 
 // Signer for appending new entries to the log.
@@ -37,6 +44,22 @@ class TreeSigner {
   TreeSigner(const std::chrono::duration<double>& guard_window, Database* db,
              std::unique_ptr<CompactMerkleTree> merkle_tree,
              cert_trans::ConsistentStore* consistent_store, LogSigner* signer);
+  // As above, but the leaf hashes of newly sequenced entries are
+  // computed on |hash_pool|, in batches, rather than one at a time on
+  // the calling thread.
+  TreeSigner(const std::chrono::duration<double>& guard_window, Database* db,
+             std::unique_ptr<CompactMerkleTree> merkle_tree,
+             cert_trans::ConsistentStore* consistent_store, LogSigner* signer,
+             ThreadPool* hash_pool);
+
+  // Recreates the tree from the frontier last written to |db| by
+  // UpdateTree(), so that a restarted signer does not have to rebuild
+  // it from every entry. The frontier is checked against the latest
+  // tree head of |db| first, and the tree returned is brought up to
+  // it, if it is the larger. Returns nullptr if there is no usable
+  // frontier, in which case the tree has to be built some other way.
+  static std::unique_ptr<CompactMerkleTree> ResumeTree(
+      const ReadOnlyDatabase* db, std::unique_ptr<SerialHasher> hasher);
 
   enum UpdateResult {
     OK,
@@ -49,6 +72,21 @@ class TreeSigner {
   // Latest Tree Head timestamp;
   uint64_t LastUpdateTime() const;
 
+  // How old pending entries must be for SequenceNewEntries() to
+  // sequence them, unless they are in a sequence range (see
+  // ConsistentStore::AddSequenceRange()).
+  const std::chrono::duration<double>& GuardWindow() const {
+    return guard_window_;
+  }
+
+  // The number of entries in the database which UpdateTree() would add
+  // to the tree. Only to be called by the thread calling UpdateTree().
+  int64_t NumUnsignedEntries() const;
+
+  // Gives sequence numbers to the entries of the sequence ranges in the
+  // store, one range after the other, then to the pending entries out
+  // of the guard window, in PendingEntriesOrder, and adds them to the
+  // database.
   util::Status SequenceNewEntries();
 
   // Simplest update mechanism: take all pending entries and append
@@ -62,33 +100,46 @@ class TreeSigner {
     return latest_tree_head_;
   }
 
+  // The tree as of LatestSTH(), or null if it was not signed by this
+  // signer. Unlike the rest of this class, this can be called from
+  // any thread, to fork a tree from without copying it under a lock.
+  std::shared_ptr<const CompactMerkleTree::Snapshot> LatestTreeSnapshot()
+      const {
+    return std::atomic_load(&latest_tree_snapshot_);
+  }
+
  private:
+  // Gets the pending entries of |infos| from the consistent store, in
+  // batches of about --tree_signer_fetch_batch_bytes, adding those it
+  // can to |entries|, by hash. Returns the first failure to get one.
+  util::Status GetPendingEntries(
+      const std::vector<const PendingEntryInfo*>& infos,
+      std::unordered_map<std::string, LoggedEntry>* entries);
   bool Append(const LoggedEntry& logged);
   void AppendToTree(const LoggedEntry& logged_cert);
+  // Appends all of |batch| to the tree, in order, hashing the leaves
+  // in parallel on |hash_pool_|.
+  void AppendBatchToTree(const std::vector<LoggedEntry>& batch);
   void TimestampAndSign(uint64_t min_timestamp, ct::SignedTreeHead* sth);
+  void WriteFrontier(const ct::SignedTreeHead& sth);
 
   const std::chrono::duration<double> guard_window_;
   Database* const db_;
   cert_trans::ConsistentStore* const consistent_store_;
   LogSigner* const signer_;
+  ThreadPool* const hash_pool_;
   const std::unique_ptr<CompactMerkleTree> cert_tree_;
   ct::SignedTreeHead latest_tree_head_;
+  // Only ever accessed with std::atomic_load() and std::atomic_store().
+  std::shared_ptr<const CompactMerkleTree::Snapshot> latest_tree_snapshot_;
+  // Tree size of the frontier last written to the database, or -1.
+  int64_t frontier_tree_size_;
 
   template <class T>
   friend class TreeSignerTest;
 };
 
 
-// Comparator for ordering pending hashes.
-// Order by timestamp then hash.
-struct PendingEntriesOrder
-    : std::binary_function<const cert_trans::EntryHandle<LoggedEntry>&,
-                           const cert_trans::EntryHandle<LoggedEntry>&, bool> {
-  bool operator()(const cert_trans::EntryHandle<LoggedEntry>& x,
-                  const cert_trans::EntryHandle<LoggedEntry>& y) const;
-};
-
-
 }  // namespace cert_trans
 
 #endif  // CERT_TRANS_LOG_TREE_SIGNER_H_
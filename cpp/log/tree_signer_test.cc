@@ -1,4 +1,5 @@
 /* -*- indent-tabs-mode: nil -*- */
+#include <gflags/gflags.h>
 #include <gtest/gtest.h>
 #include <stdint.h>
 #include <memory>
@@ -23,6 +24,10 @@
 #include "util/thread_pool.h"
 #include "util/util.h"
 
+DECLARE_bool(frontend_signer_sequence_ranges);
+DECLARE_int32(tree_signer_hash_batch_size);
+DECLARE_int32(tree_signer_leaf_hash_check_interval);
+
 namespace cert_trans {
 
 using cert_trans::EntryHandle;
@@ -222,6 +227,38 @@ TYPED_TEST(TreeSignerTest, Verify) {
 }
 
 
+TYPED_TEST(TreeSignerTest, VerifyCached) {
+  LoggedEntry logged_cert;
+  this->test_signer_.CreateUnique(&logged_cert);
+  this->AddSequencedEntry(&logged_cert, 0);
+
+  EXPECT_EQ(TreeSigner::OK, this->tree_signer_->UpdateTree());
+
+  // The second time comes from the cache of verified STHs.
+  const SignedTreeHead sth(this->tree_signer_->LatestSTH());
+  EXPECT_EQ(LogVerifier::VERIFY_OK,
+            this->verifier_->VerifySignedTreeHead(sth));
+  EXPECT_EQ(LogVerifier::VERIFY_OK,
+            this->verifier_->VerifySignedTreeHead(sth));
+
+  // But an STH differing in any way is still checked.
+  SignedTreeHead wrong_sth(sth);
+  wrong_sth.set_tree_size(sth.tree_size() + 1);
+  EXPECT_EQ(LogVerifier::INVALID_SIGNATURE,
+            this->verifier_->VerifySignedTreeHead(wrong_sth));
+  wrong_sth = sth;
+  wrong_sth.mutable_signature()->set_signature(
+      sth.signature().signature() + "x");
+  EXPECT_EQ(LogVerifier::INVALID_SIGNATURE,
+            this->verifier_->VerifySignedTreeHead(wrong_sth));
+
+  // The timestamp range is checked before the cache.
+  EXPECT_EQ(LogVerifier::INVALID_TIMESTAMP,
+            this->verifier_->VerifySignedTreeHead(sth, 0,
+                                                  sth.timestamp() - 1));
+}
+
+
 TYPED_TEST(TreeSignerTest, ResumeClean) {
   LoggedEntry logged_cert;
   this->test_signer_.CreateUnique(&logged_cert);
@@ -276,6 +313,149 @@ TYPED_TEST(TreeSignerTest, ResumePartialSign) {
 }
 
 
+TYPED_TEST(TreeSignerTest, ResumeFromFrontier) {
+  EXPECT_FALSE(TreeSigner::ResumeTree(
+      this->db(), unique_ptr<Sha256Hasher>(new Sha256Hasher)));
+
+  for (int i = 0; i < 11; ++i) {
+    LoggedEntry logged_cert;
+    this->test_signer_.CreateUnique(&logged_cert);
+    this->AddSequencedEntry(&logged_cert, i);
+  }
+  EXPECT_EQ(TreeSigner::OK, this->tree_signer_->UpdateTree());
+  const SignedTreeHead sth(this->tree_signer_->LatestSTH());
+  // Without a tree head in the database, the frontier cannot be checked.
+  EXPECT_FALSE(TreeSigner::ResumeTree(
+      this->db(), unique_ptr<Sha256Hasher>(new Sha256Hasher)));
+  EXPECT_EQ(Database::OK, this->db()->WriteTreeHead(sth));
+
+  // More entries get sequenced after the last signed tree head.
+  for (int i = 11; i < 14; ++i) {
+    LoggedEntry logged_cert;
+    this->test_signer_.CreateUnique(&logged_cert);
+    this->AddSequencedEntry(&logged_cert, i);
+  }
+
+  unique_ptr<CompactMerkleTree> tree(TreeSigner::ResumeTree(
+      this->db(), unique_ptr<Sha256Hasher>(new Sha256Hasher)));
+  ASSERT_TRUE(tree);
+  EXPECT_EQ(11U, tree->LeafCount());
+  EXPECT_EQ(sth.sha256_root_hash(), tree->CurrentRoot());
+
+  TreeSigner signer2(std::chrono::duration<double>(0), this->db(),
+                     move(tree), this->store_.get(), this->log_signer_.get());
+  EXPECT_EQ(TreeSigner::OK, signer2.UpdateTree());
+  EXPECT_EQ(TreeSigner::OK, this->tree_signer_->UpdateTree());
+  EXPECT_EQ(14U, signer2.LatestSTH().tree_size());
+  EXPECT_EQ(this->tree_signer_->LatestSTH().sha256_root_hash(),
+            signer2.LatestSTH().sha256_root_hash());
+}
+
+
+TYPED_TEST(TreeSignerTest, ResumeChecksFrontierAgainstTreeHead) {
+  for (int i = 0; i < 5; ++i) {
+    LoggedEntry logged_cert;
+    this->test_signer_.CreateUnique(&logged_cert);
+    this->AddSequencedEntry(&logged_cert, i);
+  }
+  EXPECT_EQ(TreeSigner::OK, this->tree_signer_->UpdateTree());
+  SignedTreeHead sth(this->tree_signer_->LatestSTH());
+  for (int i = 5; i < 8; ++i) {
+    LoggedEntry logged_cert;
+    this->test_signer_.CreateUnique(&logged_cert);
+    this->AddSequencedEntry(&logged_cert, i);
+  }
+  EXPECT_EQ(TreeSigner::OK, this->tree_signer_->UpdateTree());
+  const SignedTreeHead newer_sth(this->tree_signer_->LatestSTH());
+
+  // The database only has the older tree head, behind the frontier.
+  EXPECT_EQ(Database::OK, this->db()->WriteTreeHead(sth));
+  unique_ptr<CompactMerkleTree> tree(TreeSigner::ResumeTree(
+      this->db(), unique_ptr<Sha256Hasher>(new Sha256Hasher)));
+  ASSERT_TRUE(tree);
+  EXPECT_EQ(8U, tree->LeafCount());
+  EXPECT_EQ(newer_sth.sha256_root_hash(), tree->CurrentRoot());
+
+  // One that does not match it.
+  sth.set_timestamp(newer_sth.timestamp() + 1);
+  sth.set_sha256_root_hash(string(32, 'x'));
+  EXPECT_EQ(Database::OK, this->db()->WriteTreeHead(sth));
+  EXPECT_FALSE(TreeSigner::ResumeTree(
+      this->db(), unique_ptr<Sha256Hasher>(new Sha256Hasher)));
+}
+
+
+TYPED_TEST(TreeSignerTest, ResumeIgnoresFrontierBeyondDatabase) {
+  ct::CompactTreeFrontier frontier;
+  frontier.set_tree_size(1);
+  frontier.add_node(string(32, 'x'));
+  frontier.set_sha256_root_hash(string(32, 'x'));
+  this->db()->WriteTreeFrontier(frontier);
+
+  EXPECT_FALSE(TreeSigner::ResumeTree(
+      this->db(), unique_ptr<Sha256Hasher>(new Sha256Hasher)));
+}
+
+
+TYPED_TEST(TreeSignerTest, HashInBatches) {
+  // More than a batch, with batches spanning several hashing tasks.
+  FLAGS_tree_signer_hash_batch_size = 500;
+  for (int i = 0; i < 600; ++i) {
+    LoggedEntry logged_cert;
+    this->test_signer_.CreateUnique(&logged_cert);
+    logged_cert.set_sequence_number(i);
+    CHECK_EQ(Database::OK, this->db()->CreateSequencedEntry(logged_cert));
+  }
+
+  TreeSigner batch_signer(std::chrono::duration<double>(0), this->db(),
+                          unique_ptr<CompactMerkleTree>(new CompactMerkleTree(
+                              unique_ptr<Sha256Hasher>(new Sha256Hasher))),
+                          this->store_.get(), this->log_signer_.get(),
+                          &this->pool_);
+  EXPECT_EQ(TreeSigner::OK, batch_signer.UpdateTree());
+  EXPECT_EQ(TreeSigner::OK, this->tree_signer_->UpdateTree());
+
+  const SignedTreeHead sth(batch_signer.LatestSTH());
+  EXPECT_EQ(600U, sth.tree_size());
+  EXPECT_EQ(this->tree_signer_->LatestSTH().sha256_root_hash(),
+            sth.sha256_root_hash());
+  EXPECT_EQ(LogVerifier::VERIFY_OK,
+            this->verifier_->VerifySignedTreeHead(sth));
+}
+
+
+TYPED_TEST(TreeSignerTest, TrustsLeafHashesOfEntries) {
+  // Every other entry is added by the hash it comes with, which is made
+  // up here so that it shows in the root, if the database keeps it.
+  FLAGS_tree_signer_leaf_hash_check_interval = 2;
+  CompactMerkleTree expected_tree(unique_ptr<Sha256Hasher>(new Sha256Hasher));
+  for (int i = 0; i < 4; ++i) {
+    LoggedEntry logged_cert;
+    this->test_signer_.CreateUnique(&logged_cert);
+    if (i % 2 == 1) {
+      logged_cert.set_merkle_leaf_hash(string(32, 'a' + i));
+    }
+    this->AddSequencedEntry(&logged_cert, i);
+
+    LoggedEntry stored;
+    ASSERT_EQ(Database::LOOKUP_OK, this->db()->LookupByIndex(i, &stored));
+    if (i % 2 == 1 && stored.has_merkle_leaf_hash()) {
+      expected_tree.AddLeafHash(stored.merkle_leaf_hash());
+    } else {
+      string serialized_leaf;
+      CHECK(logged_cert.SerializeForLeaf(&serialized_leaf));
+      expected_tree.AddLeaf(serialized_leaf);
+    }
+  }
+
+  EXPECT_EQ(TreeSigner::OK, this->tree_signer_->UpdateTree());
+  EXPECT_EQ(4U, this->tree_signer_->LatestSTH().tree_size());
+  EXPECT_EQ(expected_tree.CurrentRoot(),
+            this->tree_signer_->LatestSTH().sha256_root_hash());
+  FLAGS_tree_signer_leaf_hash_check_interval = 1;
+}
+
+
 TYPED_TEST(TreeSignerTest, SignEmpty) {
   EXPECT_EQ(TreeSigner::OK, this->tree_signer_->UpdateTree());
 
@@ -327,6 +507,105 @@ TYPED_TEST(TreeSignerTest, SequenceNewEntriesCleansUpOldSequenceMappings) {
 }
 
 
+TYPED_TEST(TreeSignerTest, KeepsMappingOfEntryGoneAboveServingSTH) {
+  LoggedEntry logged_cert;
+  this->test_signer_.CreateUnique(&logged_cert);
+  this->AddSequencedEntry(&logged_cert, 0);
+  // The serving STH is still empty, so nothing should have removed it.
+  this->DeletePendingEntry(logged_cert);
+  LoggedEntry other_cert;
+  this->test_signer_.CreateUnique(&other_cert);
+  this->AddPendingEntry(&other_cert);
+
+  EXPECT_OK(this->tree_signer_->SequenceNewEntries());
+  EntryHandle<SequenceMapping> mapping;
+  CHECK_EQ(::util::OkStatus(), this->store_->GetSequenceMapping(&mapping));
+  ASSERT_EQ(2, mapping.Entry().mapping_size());
+  EXPECT_EQ(0, mapping.Entry().mapping(0).sequence_number());
+  EXPECT_EQ(logged_cert.Hash(), mapping.Entry().mapping(0).entry_hash());
+  EXPECT_EQ(1, mapping.Entry().mapping(1).sequence_number());
+  EXPECT_EQ(other_cert.Hash(), mapping.Entry().mapping(1).entry_hash());
+  EXPECT_EQ(2, this->db()->TreeSize());
+}
+
+
+TYPED_TEST(TreeSignerTest, LeavesEntriesWithUnavailableBodyPending) {
+  vector<LoggedEntry> certs(3);
+  for (auto& cert : certs) {
+    this->test_signer_.CreateUnique(&cert);
+  }
+  this->AddPendingEntry(&certs[0]);
+  // Its body is on a node this store cannot get it from.
+  {
+    LoggedEntry stub;
+    stub.CopyFrom(certs[1]);
+    stub.clear_sequence_number();
+    stub.DropBody("gone");
+    string flat_stub;
+    CHECK(stub.SerializeToString(&flat_stub));
+    util::SyncTask task(&this->pool_);
+    EtcdClient::Response r;
+    this->etcd_client_.Create("/root/entries/" +
+                                  util::HexString(certs[1].Hash()),
+                              util::ToBase64(flat_stub), &r, task.task());
+    task.Wait();
+    ASSERT_OK(task.status());
+  }
+  this->AddPendingEntry(&certs[2]);
+
+  EXPECT_OK(this->tree_signer_->SequenceNewEntries());
+  EntryHandle<SequenceMapping> mapping;
+  CHECK_EQ(::util::OkStatus(), this->store_->GetSequenceMapping(&mapping));
+  // The others are sequenced without a gap.
+  ASSERT_EQ(2, mapping.Entry().mapping_size());
+  EXPECT_EQ(0, mapping.Entry().mapping(0).sequence_number());
+  EXPECT_EQ(1, mapping.Entry().mapping(1).sequence_number());
+  for (const auto& m : mapping.Entry().mapping()) {
+    EXPECT_NE(certs[1].Hash(), m.entry_hash());
+  }
+  EXPECT_EQ(2, this->db()->TreeSize());
+
+  EntryHandle<LoggedEntry> stub;
+  EXPECT_OK(this->store_->GetPendingEntryForHash(certs[1].Hash(), &stub));
+}
+
+
+TYPED_TEST(TreeSignerTest, SequencesRangesWithinGuardWindow) {
+  unique_ptr<TreeSigner> signer(
+      new TreeSigner(std::chrono::hours(1), this->db(),
+                     unique_ptr<CompactMerkleTree>(new CompactMerkleTree(
+                         unique_ptr<Sha256Hasher>(new Sha256Hasher))),
+                     this->store_.get(), this->log_signer_.get()));
+  vector<LoggedEntry> certs(3);
+  for (auto& cert : certs) {
+    this->test_signer_.CreateUnique(&cert);
+    this->AddPendingEntry(&cert);
+  }
+  FLAGS_frontend_signer_sequence_ranges = true;
+  EXPECT_OK(
+      this->store_->AddSequenceRange({certs[2].Hash(), certs[0].Hash()}));
+
+  // Twice, so that the second run has to keep what the first one
+  // sequenced, even though it is still within the guard window.
+  for (int run = 0; run < 2; ++run) {
+    EXPECT_OK(signer->SequenceNewEntries());
+    EntryHandle<SequenceMapping> mapping;
+    CHECK_EQ(::util::OkStatus(), this->store_->GetSequenceMapping(&mapping));
+    ASSERT_EQ(2, mapping.Entry().mapping_size());
+    EXPECT_EQ(0, mapping.Entry().mapping(0).sequence_number());
+    EXPECT_EQ(certs[2].Hash(), mapping.Entry().mapping(0).entry_hash());
+    EXPECT_EQ(1, mapping.Entry().mapping(1).sequence_number());
+    EXPECT_EQ(certs[0].Hash(), mapping.Entry().mapping(1).entry_hash());
+
+    vector<EntryHandle<ct::SequenceRange>> ranges;
+    EXPECT_OK(this->store_->GetSequenceRanges(&ranges));
+    EXPECT_TRUE(ranges.empty());
+  }
+  EXPECT_EQ(2, this->db()->TreeSize());
+  FLAGS_frontend_signer_sequence_ranges = false;
+}
+
+
 }  // namespace cert_trans
 
 
@@ -4,7 +4,9 @@
 #include <glog/logging.h>
 #include <openssl/evp.h>
 #include <openssl/opensslv.h>
+#include <openssl/sha.h>
 #include <stdint.h>
+#include <utility>
 
 #include "merkletree/serial_hasher.h"
 #include "proto/ct.pb.h"
@@ -15,6 +17,9 @@
 #endif
 
 using ct::DigitallySigned;
+using std::lock_guard;
+using std::move;
+using std::mutex;
 
 namespace cert_trans {
 
@@ -72,16 +77,40 @@ Verifier::Verifier()
 
 bool Verifier::RawVerify(const std::string& data,
                          const std::string& sig_string) const {
-  EVP_MD_CTX ctx;
-  EVP_MD_CTX_init(&ctx);
-  // NOTE: this syntax for setting the hash function requires OpenSSL >= 1.0.0.
-  CHECK_EQ(1, EVP_VerifyInit(&ctx, EVP_sha256()));
-  CHECK_EQ(1, EVP_VerifyUpdate(&ctx, data.data(), data.size()));
-  bool ret = (EVP_VerifyFinal(&ctx, reinterpret_cast<const unsigned char*>(
-                                        sig_string.data()),
-                              sig_string.size(), pkey_.get()) == 1);
-  EVP_MD_CTX_cleanup(&ctx);
+  // This is what EVP_VerifyFinal does, but without setting up a new
+  // public key context every time.
+  unsigned char digest[SHA256_DIGEST_LENGTH];
+  SHA256(reinterpret_cast<const unsigned char*>(data.data()), data.size(),
+         digest);
+
+  const unsigned char* const sig(
+      reinterpret_cast<const unsigned char*>(sig_string.data()));
+  ScopedEVP_PKEY_CTX ctx(TakeContext());
+  const bool ret(EVP_PKEY_verify(ctx.get(), sig, sig_string.size(), digest,
+                                 sizeof(digest)) == 1);
+  ReturnContext(move(ctx));
   return ret;
 }
 
+ScopedEVP_PKEY_CTX Verifier::TakeContext() const {
+  {
+    lock_guard<mutex> lock(contexts_lock_);
+    if (!contexts_.empty()) {
+      ScopedEVP_PKEY_CTX ctx(move(contexts_.back()));
+      contexts_.pop_back();
+      return ctx;
+    }
+  }
+  ScopedEVP_PKEY_CTX ctx(
+      CHECK_NOTNULL(EVP_PKEY_CTX_new(pkey_.get(), nullptr)));
+  CHECK_EQ(1, EVP_PKEY_verify_init(ctx.get()));
+  CHECK_GT(EVP_PKEY_CTX_set_signature_md(ctx.get(), EVP_sha256()), 0);
+  return ctx;
+}
+
+void Verifier::ReturnContext(ScopedEVP_PKEY_CTX ctx) const {
+  lock_guard<mutex> lock(contexts_lock_);
+  contexts_.emplace_back(move(ctx));
+}
+
 }  // namespace cert_trans
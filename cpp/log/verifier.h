@@ -1,5 +1,8 @@
 // A base class for verifying signatures of unstructured data.  This class is
 // mockable.
+//
+// Verifying is thread-safe. The public key contexts are set up once and
+// kept in a pool for reuse, rather than set up for each signature.
 
 #ifndef CERT_TRANS_LOG_VERIFIER_H_
 #define CERT_TRANS_LOG_VERIFIER_H_
@@ -7,6 +10,9 @@
 #include <openssl/evp.h>
 #include <openssl/x509.h>  // for i2d_PUBKEY
 #include <stdint.h>
+#include <mutex>
+#include <string>
+#include <vector>
 
 #include "proto/ct.pb.h"
 #include "util/openssl_scoped_types.h"
@@ -41,10 +47,17 @@ class Verifier {
  private:
   bool RawVerify(const std::string& data, const std::string& sig_string) const;
 
+  ScopedEVP_PKEY_CTX TakeContext() const;
+  void ReturnContext(ScopedEVP_PKEY_CTX ctx) const;
+
   ScopedEVP_PKEY pkey_;
   ct::DigitallySigned::HashAlgorithm hash_algo_;
   ct::DigitallySigned::SignatureAlgorithm sig_algo_;
   std::string key_id_;
+
+  mutable std::mutex contexts_lock_;
+  // The contexts not currently in use, ready to verify SHA-256 digests.
+  mutable std::vector<ScopedEVP_PKEY_CTX> contexts_;
 };
 
 }  // namespace cert_trans
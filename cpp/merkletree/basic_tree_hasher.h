@@ -0,0 +1,81 @@
+#ifndef CERT_TRANS_MERKLETREE_BASIC_TREE_HASHER_H_
+#define CERT_TRANS_MERKLETREE_BASIC_TREE_HASHER_H_
+
+#include <openssl/sha.h>
+#include <stddef.h>
+#include <string.h>
+
+// SHA-256, for BasicTreeHasher.
+struct Sha256Policy {
+  typedef SHA256_CTX Context;
+  static constexpr size_t kDigestSize = SHA256_DIGEST_LENGTH;
+
+  static void Init(Context* ctx) {
+    SHA256_Init(ctx);
+  }
+
+  static void Update(Context* ctx, const char* data, size_t size) {
+    SHA256_Update(ctx, data, size);
+  }
+
+  static void Final(Context* ctx, char* digest) {
+    SHA256_Final(reinterpret_cast<unsigned char*>(digest), ctx);
+  }
+
+  // Init(), Update() and Final() in one go.
+  static void Digest(const char* data, size_t size, char* digest) {
+    SHA256(reinterpret_cast<const unsigned char*>(data), size,
+           reinterpret_cast<unsigned char*>(digest));
+  }
+};
+
+
+// The tree hashing of TreeHasher, with the hash function given at
+// compile time by |Policy|, so that the calls to it are not virtual
+// and the node hashes, being of fixed size, are hashed in one go. It
+// keeps no state, so it is safe to use from several threads at once.
+template <class Policy>
+class BasicTreeHasher {
+ public:
+  static constexpr size_t kDigestSize = Policy::kDigestSize;
+  static constexpr char kLeafPrefix = '\x00';
+  static constexpr char kNodePrefix = '\x01';
+
+  BasicTreeHasher() = delete;
+
+  static void HashEmpty(char* digest) {
+    Policy::Digest("", 0, digest);
+  }
+
+  static void HashLeaf(const char* data, size_t size, char* digest) {
+    const char prefix(kLeafPrefix);
+    typename Policy::Context ctx;
+    Policy::Init(&ctx);
+    Policy::Update(&ctx, &prefix, 1);
+    Policy::Update(&ctx, data, size);
+    Policy::Final(&ctx, digest);
+  }
+
+  // Both children are kDigestSize bytes long, and |digest| may point
+  // to either of them.
+  static void HashChildren(const char* left_child, const char* right_child,
+                           char* digest) {
+    char message[1 + 2 * kDigestSize];
+    message[0] = kNodePrefix;
+    memcpy(message + 1, left_child, kDigestSize);
+    memcpy(message + 1 + kDigestSize, right_child, kDigestSize);
+    Policy::Digest(message, sizeof(message), digest);
+  }
+
+  // See TreeHasher::HashChildrenBatch().
+  static void HashChildrenBatch(const char* children, size_t count,
+                                char* parents) {
+    for (size_t i = 0; i < count; ++i) {
+      HashChildren(children + 2 * i * kDigestSize,
+                   children + (2 * i + 1) * kDigestSize,
+                   parents + i * kDigestSize);
+    }
+  }
+};
+
+#endif  // CERT_TRANS_MERKLETREE_BASIC_TREE_HASHER_H_
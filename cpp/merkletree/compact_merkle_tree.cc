@@ -10,6 +10,7 @@
 
 using cert_trans::MerkleTreeInterface;
 using std::move;
+using std::shared_ptr;
 using std::string;
 using std::unique_ptr;
 
@@ -107,19 +108,84 @@ CompactMerkleTree::CompactMerkleTree(const CompactMerkleTree& other,
       leaf_count_(other.leaf_count_),
       leaves_processed_(other.leaves_processed_),
       level_count_(other.level_count_),
-      root_(other.root_) {
+      root_(other.root_),
+      snapshot_(other.snapshot_) {
 }
 
 CompactMerkleTree::~CompactMerkleTree() {
 }
 
 
+// static
+unique_ptr<CompactMerkleTree> CompactMerkleTree::FromFrontier(
+    size_t leaf_count, const std::vector<string>& frontier,
+    unique_ptr<SerialHasher> hasher) {
+  unique_ptr<CompactMerkleTree> tree(new CompactMerkleTree(move(hasher)));
+
+  // There is one node per bit of |leaf_count|, the top one always being
+  // present.
+  size_t level(0);
+  for (size_t remaining(leaf_count); remaining != 0; remaining >>= 1) {
+    if (level >= frontier.size()) {
+      return nullptr;
+    }
+    const size_t expected_size((remaining & 1) != 0 ? tree->NodeSize() : 0);
+    if (frontier[level].size() != expected_size) {
+      return nullptr;
+    }
+    ++level;
+  }
+  if (level != frontier.size()) {
+    return nullptr;
+  }
+
+  tree->tree_ = frontier;
+  tree->leaf_count_ = leaf_count;
+  // A k-level tree can hold 2^{k-1} leaves.
+  size_t level_count(leaf_count == 0 ? 0 : 1);
+  while (leaf_count > (static_cast<size_t>(1) << (level_count - 1))) {
+    ++level_count;
+  }
+  tree->level_count_ = level_count;
+  return tree;
+}
+
+
+// static
+unique_ptr<CompactMerkleTree> CompactMerkleTree::FromSnapshot(
+    const Snapshot& snapshot, unique_ptr<SerialHasher> hasher) {
+  unique_ptr<CompactMerkleTree> tree(new CompactMerkleTree(move(hasher)));
+  CHECK_EQ(tree->NodeSize(), snapshot.root.size());
+  tree->tree_ = snapshot.frontier;
+  tree->leaf_count_ = snapshot.leaf_count;
+  tree->leaves_processed_ = snapshot.leaf_count;
+  tree->level_count_ = snapshot.level_count;
+  tree->root_ = snapshot.root;
+  return tree;
+}
+
+
+shared_ptr<const CompactMerkleTree::Snapshot>
+CompactMerkleTree::TakeSnapshot() {
+  if (!snapshot_) {
+    unique_ptr<Snapshot> snapshot(new Snapshot);
+    snapshot->leaf_count = leaf_count_;
+    snapshot->level_count = level_count_;
+    snapshot->frontier = tree_;
+    snapshot->root = CurrentRoot();
+    snapshot_.reset(snapshot.release());
+  }
+  return snapshot_;
+}
+
+
 size_t CompactMerkleTree::AddLeaf(const string& data) {
   return AddLeafHash(treehasher_.HashLeaf(data));
 }
 
 size_t CompactMerkleTree::AddLeafHash(const string& hash) {
   PushBack(0, hash);
+  snapshot_.reset();
   // Update level count: a k-level tree can hold 2^{k-1} leaves,
   // so increment level count every time we overflow a power of two.
   // Do not update the root; we evaluate the tree lazily.
@@ -134,7 +200,7 @@ string CompactMerkleTree::CurrentRoot() {
 }
 
 void CompactMerkleTree::PushBack(size_t level, string node) {
-  assert(node.size() == treehasher_.DigestSize());
+  CHECK_EQ(node.size(), treehasher_.DigestSize());
   if (tree_.size() <= level) {
     // First node at a new level.
     tree_.push_back(node);
@@ -142,9 +208,11 @@ void CompactMerkleTree::PushBack(size_t level, string node) {
     // Lone left sibling.
     tree_[level] = node;
   } else {
-    // Left sibling waiting: hash together and propagate up.
-    PushBack(level + 1, treehasher_.HashChildren(tree_[level], node));
+    // Left sibling waiting: hash together (reusing the buffer of
+    // |node|) and propagate up.
+    treehasher_.HashChildren(tree_[level].data(), node.data(), &node[0]);
     tree_[level].clear();
+    PushBack(level + 1, move(node));
   }
 }
 
@@ -160,7 +228,8 @@ void CompactMerkleTree::UpdateRoot() {
       if (right_sibling.empty())
         right_sibling = tree_[level];
       else
-        right_sibling = treehasher_.HashChildren(tree_[level], right_sibling);
+        treehasher_.HashChildren(tree_[level].data(), right_sibling.data(),
+                                 &right_sibling[0]);
     }
   }
 
@@ -19,6 +19,17 @@ class SerialHasher;
 // This class is thread-compatible, but not thread-safe.
 class CompactMerkleTree : public cert_trans::MerkleTreeInterface {
  public:
+  // The state of a tree at some size. Snapshots are never modified, so
+  // they can be shared between threads without locking, and any number
+  // of trees can be forked from one with FromSnapshot().
+  struct Snapshot {
+    size_t leaf_count;
+    size_t level_count;
+    // See Frontier().
+    std::vector<std::string> frontier;
+    std::string root;
+  };
+
   // The constructor takes a pointer to some concrete hash function
   // instantiation of the SerialHasher abstract class.
   explicit CompactMerkleTree(std::unique_ptr<SerialHasher> hasher);
@@ -39,6 +50,30 @@ class CompactMerkleTree : public cert_trans::MerkleTreeInterface {
 
   virtual ~CompactMerkleTree();
 
+  // Recreates a tree with |leaf_count| leaves from its |frontier|, as
+  // previously returned by Frontier(). Returns nullptr if |frontier|
+  // is not consistent with |leaf_count| or the hasher.
+  static std::unique_ptr<CompactMerkleTree> FromFrontier(
+      size_t leaf_count, const std::vector<std::string>& frontier,
+      std::unique_ptr<SerialHasher> hasher);
+
+  // Recreates a tree from |snapshot|, to append to independently of
+  // the tree it was taken from.
+  static std::unique_ptr<CompactMerkleTree> FromSnapshot(
+      const Snapshot& snapshot, std::unique_ptr<SerialHasher> hasher);
+
+  // Returns the current state of the tree. The same snapshot is
+  // returned until leaves are added, so taking one after each update
+  // for readers to pick up is cheap.
+  std::shared_ptr<const Snapshot> TakeSnapshot();
+
+  // The nodes the tree keeps, one per level starting with the leaves
+  // (see |tree_| below). Together with LeafCount(), this is enough to
+  // recreate the tree using FromFrontier().
+  const std::vector<std::string>& Frontier() const {
+    return tree_;
+  }
+
   // Length of a node (i.e., a hash), in bytes.
   virtual size_t NodeSize() const {
     return treehasher_.DigestSize();
@@ -54,6 +89,12 @@ class CompactMerkleTree : public cert_trans::MerkleTreeInterface {
     return treehasher_.HashLeaf(data);
   }
 
+  // A TreeHasher computing the same leaf hashes as LeafHash(), but which
+  // can be used concurrently with this tree.
+  std::unique_ptr<TreeHasher> NewTreeHasher() const {
+    return treehasher_.Clone();
+  }
+
   // Number of levels. An empty tree has 0 levels, a tree with 1 leaf has
   // 1 level, a tree with 2 leaves has 2 levels, and a tree with n leaves has
   // ceil(log2(n)) + 1 levels.
@@ -153,6 +194,8 @@ class CompactMerkleTree : public cert_trans::MerkleTreeInterface {
   size_t level_count_;
   // The root for |leaves_processed_| leaves.
   std::string root_;
+  // The last snapshot taken, if no leaves were added since.
+  std::shared_ptr<const Snapshot> snapshot_;
 };
 
 #endif  // CERT_TRANS_MERKLETREE_COMPACT_MERKLE_TREE_H_
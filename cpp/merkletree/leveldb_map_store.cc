@@ -0,0 +1,48 @@
+#include "merkletree/leveldb_map_store.h"
+
+#include <glog/logging.h>
+#include <leveldb/write_batch.h>
+
+using std::pair;
+using std::string;
+using std::vector;
+
+namespace cert_trans {
+
+
+LevelDBMapStore::LevelDBMapStore(const string& dbfile) {
+  LOG(INFO) << "Opening " << dbfile;
+  leveldb::Options options;
+  options.create_if_missing = true;
+  leveldb::DB* db;
+  const leveldb::Status status(leveldb::DB::Open(options, dbfile, &db));
+  CHECK(status.ok()) << status.ToString();
+  db_.reset(db);
+}
+
+
+bool LevelDBMapStore::Get(const string& key, string* value) const {
+  const leveldb::Status status(
+      db_->Get(leveldb::ReadOptions(), key, value));
+  if (status.IsNotFound())
+    return false;
+  CHECK(status.ok()) << "Failed to read from the map store: "
+                     << status.ToString();
+  return true;
+}
+
+
+void LevelDBMapStore::Write(const vector<pair<string, string>>& entries) {
+  leveldb::WriteBatch batch;
+  for (const auto& entry : entries)
+    batch.Put(entry.first, entry.second);
+
+  leveldb::WriteOptions options;
+  options.sync = true;
+  const leveldb::Status status(db_->Write(options, &batch));
+  CHECK(status.ok()) << "Failed to write to the map store: "
+                     << status.ToString();
+}
+
+
+}  // namespace cert_trans
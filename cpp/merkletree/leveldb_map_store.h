@@ -0,0 +1,32 @@
+#ifndef CERT_TRANS_MERKLETREE_LEVELDB_MAP_STORE_H_
+#define CERT_TRANS_MERKLETREE_LEVELDB_MAP_STORE_H_
+
+#include <leveldb/db.h>
+#include <memory>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "merkletree/map_store.h"
+
+namespace cert_trans {
+
+
+// A MapStore in a LevelDB database, created in |dbfile| if needed.
+// Aborts on any LevelDB error.
+class LevelDBMapStore : public MapStore {
+ public:
+  explicit LevelDBMapStore(const std::string& dbfile);
+
+  bool Get(const std::string& key, std::string* value) const override;
+  void Write(const std::vector<std::pair<std::string, std::string>>& entries)
+      override;
+
+ private:
+  std::unique_ptr<leveldb::DB> db_;
+};
+
+
+}  // namespace cert_trans
+
+#endif  // CERT_TRANS_MERKLETREE_LEVELDB_MAP_STORE_H_
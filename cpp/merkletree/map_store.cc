@@ -0,0 +1,29 @@
+#include "merkletree/map_store.h"
+
+using std::lock_guard;
+using std::mutex;
+using std::pair;
+using std::string;
+using std::vector;
+
+namespace cert_trans {
+
+
+bool InMemoryMapStore::Get(const string& key, string* value) const {
+  lock_guard<mutex> lock(lock_);
+  const auto it(entries_.find(key));
+  if (it == entries_.end())
+    return false;
+  *value = it->second;
+  return true;
+}
+
+
+void InMemoryMapStore::Write(const vector<pair<string, string>>& entries) {
+  lock_guard<mutex> lock(lock_);
+  for (const auto& entry : entries)
+    entries_[entry.first] = entry.second;
+}
+
+
+}  // namespace cert_trans
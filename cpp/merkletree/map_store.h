@@ -0,0 +1,50 @@
+#ifndef CERT_TRANS_MERKLETREE_MAP_STORE_H_
+#define CERT_TRANS_MERKLETREE_MAP_STORE_H_
+
+#include <map>
+#include <mutex>
+#include <string>
+#include <utility>
+#include <vector>
+
+namespace cert_trans {
+
+// Key-value storage for a PersistentVerifiableMap (see
+// merkletree/persistent_verifiable_map.h). Implementations must be
+// thread-safe.
+class MapStore {
+ public:
+  MapStore() = default;
+  virtual ~MapStore() = default;
+  MapStore(const MapStore&) = delete;
+  MapStore& operator=(const MapStore&) = delete;
+
+  // Returns false if there is no entry for |key|.
+  virtual bool Get(const std::string& key, std::string* value) const = 0;
+
+  // Writes all of |entries| (key first), replacing existing ones. This
+  // must be durable once it returns, and atomic: a reader sees either
+  // none or all of them.
+  virtual void Write(
+      const std::vector<std::pair<std::string, std::string>>& entries) = 0;
+};
+
+
+// Keeps everything on the heap, mostly for testing.
+class InMemoryMapStore : public MapStore {
+ public:
+  InMemoryMapStore() = default;
+
+  bool Get(const std::string& key, std::string* value) const override;
+  void Write(const std::vector<std::pair<std::string, std::string>>& entries)
+      override;
+
+ private:
+  mutable std::mutex lock_;
+  std::map<std::string, std::string> entries_;
+};
+
+
+}  // namespace cert_trans
+
+#endif  // CERT_TRANS_MERKLETREE_MAP_STORE_H_
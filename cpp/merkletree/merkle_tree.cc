@@ -2,23 +2,75 @@
 
 #include <assert.h>
 #include <stddef.h>
+#include <string.h>
+#include <algorithm>
 #include <string>
 #include <vector>
 
 #include "merkletree/merkle_tree_math.h"
+#include "util/thread_pool.h"
 
+using cert_trans::InMemoryNodeStore;
 using cert_trans::MerkleTreeInterface;
+using cert_trans::MerkleTreeNodeStore;
+using cert_trans::RunAll;
+using cert_trans::ThreadPool;
+using std::min;
 using std::move;
 using std::string;
 using std::unique_ptr;
 
+namespace {
+
+// Maximum number of parents computed by a single HashChildrenBatch()
+// call, to bound the size of the temporary buffers.
+const size_t kMaxHashBatchSize = 4096;
+
+// BuildFromLeafHashes() hashes subtrees of 2^kBuildSubtreeLevels
+// leaves in one go each.
+const size_t kBuildSubtreeLevels = 16;
+
+// Hashes the |count| nodes from the |first|th one (which is even) of
+// |nodes|, writing their parents to |parents|, where the last node is
+// copied up as is if it has no sibling.
+void HashLevel(const TreeHasher& hasher, const char* nodes, size_t first,
+               size_t count, char* parents) {
+  const size_t node_size(hasher.DigestSize());
+  assert(first % 2 == 0);
+  for (size_t i = 0; i + 1 < count; i += 2 * kMaxHashBatchSize) {
+    const size_t batch(min((count - i) / 2, kMaxHashBatchSize));
+    hasher.HashChildrenBatch(nodes + (first + i) * node_size, batch,
+                             parents + (first + i) / 2 * node_size);
+  }
+  if (count % 2 == 1) {
+    memcpy(parents + (first + count - 1) / 2 * node_size,
+           nodes + (first + count - 1) * node_size, node_size);
+  }
+}
+
+}  // namespace
+
 MerkleTree::MerkleTree(unique_ptr<SerialHasher> hasher)
     : MerkleTreeInterface(),
       treehasher_(move(hasher)),
+      tree_(new InMemoryNodeStore(treehasher_.DigestSize())),
       leaves_processed_(0),
       level_count_(0) {
 }
 
+MerkleTree::MerkleTree(unique_ptr<SerialHasher> hasher,
+                       unique_ptr<MerkleTreeNodeStore> nodes)
+    : MerkleTreeInterface(),
+      treehasher_(move(hasher)),
+      tree_(move(nodes)),
+      leaves_processed_(0),
+      level_count_(0) {
+  assert(tree_);
+  assert(tree_->NodeSize() == treehasher_.DigestSize());
+  if (!ReloadNodes())
+    tree_->RemoveLevels(0);
+}
+
 MerkleTree::~MerkleTree() {
 }
 
@@ -43,6 +95,91 @@ size_t MerkleTree::AddLeafHash(const string& hash) {
   return leaf_count;
 }
 
+MerkleTree::StagedLeaves MerkleTree::StageLeafHashes(
+    const std::vector<string>& hashes) const {
+  assert(leaves_processed_ == LeafCount());
+  StagedLeaves staged;
+  if (hashes.empty())
+    return staged;
+
+  const size_t node_size(treehasher_.DigestSize());
+  const unique_ptr<TreeHasher> hasher(treehasher_.Clone());
+  string leaves;
+  leaves.reserve(hashes.size() * node_size);
+  for (const string& hash : hashes) {
+    assert(hash.size() == node_size);
+    leaves.append(hash);
+  }
+
+  // As UpdateToSnapshot(), except that the new nodes of each level
+  // come from |staged| rather than from the tree.
+  size_t first_node = LeafCount();
+  size_t last_node = first_node + hashes.size() - 1;
+  staged.first_nodes.push_back(first_node);
+  staged.levels.push_back(move(leaves));
+  for (size_t level = 0; last_node; ++level) {
+    const string& nodes(staged.levels[level]);
+    string parents;
+    parents.reserve((last_node / 2 - first_node / 2 + 1) * node_size);
+    size_t j = first_node;
+    // The left sibling of the first new node is already in the tree.
+    if (MerkleTreeMath::IsRightChild(j)) {
+      parents.append(hasher->HashChildren(Node(level, j - 1),
+                                          nodes.substr(0, node_size)));
+      ++j;
+    }
+    while (j < last_node) {
+      const size_t count(
+          std::min((last_node - j + 1) / 2, kMaxHashBatchSize));
+      const size_t offset(parents.size());
+      parents.resize(offset + count * node_size);
+      hasher->HashChildrenBatch(nodes.data() + (j - first_node) * node_size,
+                                count, &parents[offset]);
+      j += 2 * count;
+    }
+    if (!MerkleTreeMath::IsRightChild(last_node))
+      parents.append(nodes, (last_node - first_node) * node_size, node_size);
+
+    first_node = MerkleTreeMath::Parent(first_node);
+    last_node = MerkleTreeMath::Parent(last_node);
+    staged.first_nodes.push_back(first_node);
+    staged.levels.push_back(move(parents));
+  }
+  return staged;
+}
+
+void MerkleTree::AppendStaged(const StagedLeaves& staged) {
+  assert(leaves_processed_ == LeafCount());
+  const size_t node_size(treehasher_.DigestSize());
+  for (size_t level = 0; level < staged.levels.size(); ++level) {
+    if (LazyLevelCount() <= level) {
+      AddLevel();
+    } else if (NodeCount(level) > staged.first_nodes[level]) {
+      // The last node of the level was incomplete.
+      assert(NodeCount(level) == staged.first_nodes[level] + 1);
+      PopBack(level);
+    }
+    assert(NodeCount(level) == staged.first_nodes[level]);
+    tree_->Append(level, staged.levels[level].data(),
+                  staged.levels[level].size() / node_size);
+  }
+  if (!staged.levels.empty()) {
+    leaves_processed_ = LeafCount();
+    level_count_ = staged.levels.size();
+  }
+}
+
+bool MerkleTree::ReloadNodes() {
+  std::vector<size_t> level_sizes;
+  for (size_t level = 0; level < tree_->LevelCount(); ++level)
+    level_sizes.push_back(tree_->NodeCount(level));
+  if (!level_sizes.empty() && !IsFullyEvaluatedShape(level_sizes))
+    return false;
+  leaves_processed_ = level_sizes.empty() ? 0 : level_sizes[0];
+  level_count_ = level_sizes.size();
+  return true;
+}
+
 string MerkleTree::CurrentRoot() {
   return RootAtSnapshot(LeafCount());
 }
@@ -105,6 +242,131 @@ std::vector<string> MerkleTree::SnapshotConsistency(size_t snapshot1,
   return proof;
 }
 
+const MerkleTreeNodeStore& MerkleTree::EvaluatedNodes() {
+  UpdateToSnapshot(LeafCount());
+  return *tree_;
+}
+
+bool MerkleTree::RestoreLevels(std::vector<string>* levels) {
+  const size_t digest_size(treehasher_.DigestSize());
+  std::vector<size_t> level_sizes;
+  for (const auto& level : *levels) {
+    if (level.size() % digest_size != 0)
+      return false;
+    level_sizes.push_back(level.size() / digest_size);
+  }
+  if (!levels->empty() && !IsFullyEvaluatedShape(level_sizes))
+    return false;
+
+  tree_->RemoveLevels(0);
+  for (size_t level = 0; level < levels->size(); ++level) {
+    tree_->AddLevel();
+    tree_->Append(level, (*levels)[level].data(), level_sizes[level]);
+  }
+  levels->clear();
+  snapshot_edges_.clear();
+  leaves_processed_ = level_sizes.empty() ? 0 : level_sizes[0];
+  level_count_ = level_sizes.size();
+  return true;
+}
+
+bool MerkleTree::BuildFromLeafHashes(string* leaves, ThreadPool* pool) {
+  const size_t node_size(treehasher_.DigestSize());
+  if (leaves->empty() || leaves->size() % node_size != 0)
+    return false;
+
+  // All the levels are sized up front, so that the subtrees can be
+  // hashed straight into them.
+  std::vector<string> levels;
+  levels.emplace_back(move(*leaves));
+  leaves->clear();
+  const size_t leaf_count(levels[0].size() / node_size);
+  for (size_t count = leaf_count; count > 1;) {
+    count = (count + 1) / 2;
+    levels.emplace_back(count * node_size, '\0');
+  }
+  std::vector<char*> level_data;
+  for (string& level : levels)
+    level_data.push_back(&level[0]);
+
+  // The subtrees are aligned, so none of them needs a node of another,
+  // and only the last one can have a node without a sibling.
+  const size_t subtree_levels(min(kBuildSubtreeLevels, levels.size() - 1));
+  const size_t subtree_leaves(static_cast<size_t>(1) << kBuildSubtreeLevels);
+  const size_t subtree_count((leaf_count + subtree_leaves - 1) /
+                             subtree_leaves);
+  const auto hash_subtree([this, &level_data, leaf_count, subtree_levels,
+                           subtree_leaves](size_t subtree) {
+    const unique_ptr<TreeHasher> hasher(treehasher_.Clone());
+    size_t first(subtree * subtree_leaves);
+    size_t count(min(leaf_count - first, subtree_leaves));
+    for (size_t level = 0; level < subtree_levels; ++level) {
+      HashLevel(*hasher, level_data[level], first, count,
+                level_data[level + 1]);
+      first /= 2;
+      count = (count + 1) / 2;
+    }
+  });
+  if (pool && subtree_count > 1) {
+    RunAll(pool, subtree_count, hash_subtree);
+  } else {
+    for (size_t subtree = 0; subtree < subtree_count; ++subtree)
+      hash_subtree(subtree);
+  }
+
+  // What is left above the subtrees is small.
+  for (size_t level = subtree_levels; level + 1 < levels.size(); ++level) {
+    HashLevel(treehasher_, level_data[level], 0,
+              levels[level].size() / node_size, level_data[level + 1]);
+  }
+
+  return RestoreLevels(&levels);
+}
+
+void MerkleTree::CacheSnapshot(size_t snapshot) {
+  if (snapshot == 0 || snapshot > LeafCount() ||
+      snapshot_edges_.count(snapshot) > 0)
+    return;
+  std::vector<string> edge;
+  if (snapshot == 1) {
+    // The leaf is the root, RecomputePastSnapshot() would want the tree
+    // to be evaluated past it.
+    edge.push_back(Node(0, 0));
+    snapshot_edges_[snapshot].swap(edge);
+    return;
+  }
+  if (snapshot > leaves_processed_)
+    UpdateToSnapshot(snapshot);
+
+  for (size_t level = 0;; ++level) {
+    string node;
+    RecomputePastSnapshot(snapshot, level, &node);
+    edge.push_back(node);
+    // Stop at the level of the root.
+    if (((snapshot - 1) >> level) == 0)
+      break;
+  }
+  snapshot_edges_[snapshot].swap(edge);
+}
+
+// static
+bool MerkleTree::IsFullyEvaluatedShape(
+    const std::vector<size_t>& level_sizes) {
+  // Each level must hold half as many nodes as the one below it
+  // (rounded up), all the way up to a single root.
+  if (level_sizes.empty() || level_sizes[0] == 0)
+    return false;
+  size_t expected_nodes = level_sizes[0];
+  for (size_t level = 0; level < level_sizes.size(); ++level) {
+    if (level_sizes[level] != expected_nodes)
+      return false;
+    if ((expected_nodes == 1) != (level + 1 == level_sizes.size()))
+      return false;
+    expected_nodes = (expected_nodes + 1) / 2;
+  }
+  return true;
+}
+
 string MerkleTree::UpdateToSnapshot(size_t snapshot) {
   if (snapshot == 0)
     return treehasher_.HashEmpty();
@@ -135,10 +397,19 @@ string MerkleTree::UpdateToSnapshot(size_t snapshot) {
     }
 
     // Compute the parents of new nodes at the current level.
-    // Start with a left sibling and parse an even number of nodes.
-    for (size_t j = first_node & ~1; j < last_node; j += 2) {
-      PushBack(level + 1,
-               treehasher_.HashChildren(Node(level, j), Node(level, j + 1)));
+    // Start with a left sibling and parse an even number of nodes,
+    // which are contiguous in the level, so they can be hashed in
+    // batches.
+    const size_t node_size(treehasher_.DigestSize());
+    std::vector<char> parents;
+    for (size_t j = first_node & ~1; j < last_node;) {
+      const size_t count(
+          std::min((last_node - j + 1) / 2, kMaxHashBatchSize));
+      parents.resize(count * node_size);
+      treehasher_.HashChildrenBatch(tree_->LevelData(level) + j * node_size,
+                                    count, parents.data());
+      tree_->Append(level + 1, parents.data(), count);
+      j += 2 * count;
     }
     // If the last node at the current level is a left sibling,
     // dummy-propagate it one level up.
@@ -160,6 +431,14 @@ string MerkleTree::RecomputePastSnapshot(size_t snapshot, size_t node_level,
   // Index of the rightmost node at the current level for this snapshot.
   size_t last_node = snapshot - 1;
 
+  const auto cached(snapshot_edges_.find(snapshot));
+  if (cached != snapshot_edges_.end()) {
+    const std::vector<string>& edge(cached->second);
+    if (node && node_level < edge.size())
+      node->assign(edge[node_level]);
+    return edge.back();
+  }
+
   if (snapshot == leaves_processed_) {
     // Nothing to recompute.
     if (node && LazyLevelCount() > node_level) {
@@ -194,9 +473,9 @@ string MerkleTree::RecomputePastSnapshot(size_t snapshot, size_t node_level,
 
   while (last_node) {
     if (MerkleTreeMath::IsRightChild(last_node)) {
-      // Recompute the parent of tree_[level][last_node].
-      subtree_root =
-          treehasher_.HashChildren(Node(level, last_node - 1), subtree_root);
+      // Recompute the parent of tree_[level][last_node], in place.
+      treehasher_.HashChildren(NodeData(level, last_node - 1),
+                               subtree_root.data(), &subtree_root[0]);
     }
     // Else the parent is a dummy copy of the current node; do nothing.
 
@@ -251,43 +530,46 @@ std::vector<string> MerkleTree::PathFromNodeToRootAtSnapshot(size_t node,
 }
 
 string MerkleTree::Node(size_t level, size_t index) const {
+  return string(NodeData(level, index), treehasher_.DigestSize());
+}
+
+const char* MerkleTree::NodeData(size_t level, size_t index) const {
   assert(NodeCount(level) > index);
-  return tree_[level].substr(index * treehasher_.DigestSize(),
-                             treehasher_.DigestSize());
+  return tree_->NodeData(level, index);
 }
 
 string MerkleTree::Root() const {
-  assert(tree_.back().size() == treehasher_.DigestSize());
-  return tree_.back();
+  assert(NodeCount(LazyLevelCount() - 1) == 1U);
+  return Node(LazyLevelCount() - 1, 0);
 }
 
 size_t MerkleTree::NodeCount(size_t level) const {
   assert(LazyLevelCount() > level);
-  return tree_[level].size() / treehasher_.DigestSize();
+  return tree_->NodeCount(level);
 }
 
 string MerkleTree::LastNode(size_t level) const {
   assert(NodeCount(level) >= 1U);
-  return tree_[level].substr(tree_[level].size() - treehasher_.DigestSize());
+  return Node(level, NodeCount(level) - 1);
 }
 
 void MerkleTree::PopBack(size_t level) {
   assert(NodeCount(level) >= 1U);
-  tree_[level].erase(tree_[level].size() - treehasher_.DigestSize());
+  tree_->Truncate(level, NodeCount(level) - 1);
 }
 
 void MerkleTree::PushBack(size_t level, string node) {
   assert(node.size() == treehasher_.DigestSize());
   assert(LazyLevelCount() > level);
-  tree_[level].append(node);
+  tree_->Append(level, node.data(), 1);
 }
 
 void MerkleTree::AddLevel() {
-  tree_.push_back(string());
+  tree_->AddLevel();
 }
 
 size_t MerkleTree::LazyLevelCount() const {
-  return tree_.size();
+  return tree_->LevelCount();
 }
 
 MutableMerkleTree::MutableMerkleTree(unique_ptr<SerialHasher> hasher)
@@ -301,10 +583,14 @@ bool MutableMerkleTree::UpdateLeafHash(size_t leaf, const string& hash) {
   if (leaf == 0 || leaf > LeafCount())
     return false;
 
+  // The snapshots that include the leaf are not what they were anymore.
+  snapshot_edges_.erase(snapshot_edges_.lower_bound(leaf),
+                        snapshot_edges_.end());
+
   // Update the leaf node.
   size_t child = leaf - 1;
-  tree_[0].replace(treehasher_.DigestSize() * child, treehasher_.DigestSize(),
-                   hash);
+  assert(hash.size() == treehasher_.DigestSize());
+  tree_->SetNode(0, child, hash.data());
 
   if (leaf > leaves_processed_)
     return true;
@@ -312,21 +598,22 @@ bool MutableMerkleTree::UpdateLeafHash(size_t leaf, const string& hash) {
   // Update the parents chain, level by level.
   size_t child_level = 0;
   size_t parent = MerkleTreeMath::Parent(child);
-  string parent_hash;
+  string parent_hash(treehasher_.DigestSize(), '\0');
   while (child) {
     if (MerkleTreeMath::IsRightChild(child)) {
-      parent_hash = treehasher_.HashChildren(Node(child_level, child - 1),
-                                             Node(child_level, child));
+      treehasher_.HashChildren(NodeData(child_level, child - 1),
+                               NodeData(child_level, child), &parent_hash[0]);
     } else if (child < NodeCount(child_level) - 1) {
-      parent_hash = treehasher_.HashChildren(Node(child_level, child),
-                                             Node(child_level, child + 1));
+      treehasher_.HashChildren(NodeData(child_level, child),
+                               NodeData(child_level, child + 1),
+                               &parent_hash[0]);
     } else {
       // Propagate the "dummy" node.
-      parent_hash = Node(child_level, child);
+      parent_hash.assign(NodeData(child_level, child),
+                         treehasher_.DigestSize());
     }
 
-    tree_[child_level + 1].replace(treehasher_.DigestSize() * parent,
-                                   treehasher_.DigestSize(), parent_hash);
+    tree_->SetNode(child_level + 1, parent, parent_hash.data());
 
     child = parent;
     parent = MerkleTreeMath::Parent(parent);
@@ -340,8 +627,11 @@ bool MutableMerkleTree::Truncate(size_t leaf) {
   if (leaf > LeafCount())
     return false;
 
+  snapshot_edges_.erase(snapshot_edges_.upper_bound(leaf),
+                        snapshot_edges_.end());
+
   if (leaf == 0) {
-    tree_.clear();
+    tree_->RemoveLevels(0);
     leaves_processed_ = 0;
     level_count_ = 0;
 
@@ -350,7 +640,7 @@ bool MutableMerkleTree::Truncate(size_t leaf) {
 
   // Truncate leaves level.
   size_t child = leaf - 1;
-  tree_[0].erase(treehasher_.DigestSize() * (child + 1));
+  tree_->Truncate(0, child + 1);
 
   // Update levels count.
   level_count_ = 1;
@@ -367,7 +657,7 @@ bool MutableMerkleTree::Truncate(size_t leaf) {
   size_t child_level = 0;
   size_t parent = MerkleTreeMath::Parent(child);
   while (child) {
-    tree_[child_level + 1].erase(treehasher_.DigestSize() * (parent + 1));
+    tree_->Truncate(child_level + 1, parent + 1);
 
     child = parent;
     parent = MerkleTreeMath::Parent(parent);
@@ -376,8 +666,9 @@ bool MutableMerkleTree::Truncate(size_t leaf) {
 
   // The current child_level value corresponds to the root level - remove empty
   // levels.
-  if (child_level + 1 < tree_.size())
-    tree_.erase(tree_.begin() + child_level + 1, tree_.end());
+  tree_->RemoveLevels(child_level + 1);
+  // Leaves appended from now on still have to be processed.
+  leaves_processed_ = leaf;
 
   // Update rightmost chain of nodes.
   assert(UpdateLeafHash(leaf, LeafHash(leaf)));
@@ -2,15 +2,21 @@
 #define CERT_TRANS_MERKLETREE_MERKLE_TREE_H_
 
 #include <stddef.h>
+#include <map>
 #include <memory>
 #include <string>
 #include <vector>
 
 #include "merkletree/merkle_tree_interface.h"
+#include "merkletree/node_store.h"
 #include "merkletree/tree_hasher.h"
 
 class SerialHasher;
 
+namespace cert_trans {
+class ThreadPool;
+}  // namespace cert_trans
+
 // Class for manipulating Merkle Hash Trees, as specified in the
 // Certificate Transparency specificationdoc/sunlight.xml
 // Implement binary Merkle Hash Trees, using an arbitrary hash function
@@ -25,6 +31,12 @@ class MerkleTree : public cert_trans::MerkleTreeInterface {
   // The constructor takes a pointer to some concrete hash function
   // instantiation of the SerialHasher abstract class.
   explicit MerkleTree(std::unique_ptr<SerialHasher> hasher);
+  // As above, but keeps the nodes in |nodes| rather than on the heap.
+  // If |nodes| already holds a fully evaluated tree (e.g. one persisted
+  // by a previous process), the tree starts from there, otherwise
+  // |nodes| is cleared.
+  MerkleTree(std::unique_ptr<SerialHasher> hasher,
+             std::unique_ptr<cert_trans::MerkleTreeNodeStore> nodes);
   virtual ~MerkleTree();
 
   // Length of a node (i.e., a hash), in bytes.
@@ -34,7 +46,7 @@ class MerkleTree : public cert_trans::MerkleTreeInterface {
 
   // Number of leaves in the tree.
   virtual size_t LeafCount() const {
-    return tree_.empty() ? 0 : NodeCount(0);
+    return LazyLevelCount() == 0 ? 0 : NodeCount(0);
   }
 
   // The |leaf|th leaf hash in the tree. Indexing starts from 1.
@@ -56,6 +68,11 @@ class MerkleTree : public cert_trans::MerkleTreeInterface {
     return level_count_;
   }
 
+  // Approximate number of bytes the nodes of the tree take up.
+  size_t ByteSize() const {
+    return tree_->ByteSize();
+  }
+
   // Add a new leaf to the hash tree. Stores the hash of the leaf data in the
   // tree structure, does not store the data itself.
   //
@@ -79,6 +96,27 @@ class MerkleTree : public cert_trans::MerkleTreeInterface {
   // @param hash leaf hash
   virtual size_t AddLeafHash(const std::string& hash);
 
+  // The nodes that appending leaf hashes adds to a fully evaluated
+  // tree, leaves first, as worked out by StageLeafHashes().
+  struct StagedLeaves {
+    // For each level, the index of the first node that changes, and
+    // the packed nodes from there on.
+    std::vector<size_t> first_nodes;
+    std::vector<std::string> levels;
+  };
+
+  // Works out the nodes that appending |hashes| to the tree adds,
+  // without changing it, so that AppendStaged() only has to copy them
+  // in. This only reads the tree, and hashes with a hasher of its own,
+  // so it can run alongside anything else that only reads the tree.
+  // The tree must be fully evaluated (see CurrentRoot()).
+  StagedLeaves StageLeafHashes(const std::vector<std::string>& hashes) const;
+
+  // Appends the leaves staged by StageLeafHashes(), with no hashing.
+  // The tree must not have changed since, and is fully evaluated
+  // afterwards.
+  void AppendStaged(const StagedLeaves& staged);
+
   // Get the current root of the tree.
   // Update the root to reflect the current shape of the tree,
   // and return the tree digest.
@@ -130,6 +168,48 @@ class MerkleTree : public cert_trans::MerkleTreeInterface {
   std::vector<std::string> SnapshotConsistency(size_t snapshot1,
                                                size_t snapshot2);
 
+  // Bring the tree fully up to date and return its node storage, so
+  // that the levels can be handed back to RestoreLevels() later, e.g.
+  // to checkpoint the tree to disk.
+  const cert_trans::MerkleTreeNodeStore& EvaluatedNodes();
+
+  // Replace the contents of the tree with |levels|, the packed node
+  // hashes of every level of a fully evaluated tree, leaves first. No
+  // hashing is done, so it is the caller's responsibility to ensure
+  // the node hashes are correct.
+  //
+  // Returns false, leaving the tree unchanged, if |levels| is not
+  // shaped like a fully evaluated tree.
+  bool RestoreLevels(std::vector<std::string>* levels);
+
+  // Replace the contents of the tree with the fully evaluated tree
+  // with the leaf hashes |leaves|, packed back to back, which are
+  // taken (leaving |leaves| empty). The nodes are hashed an aligned
+  // subtree at a time, in parallel on |pool| if it is not null, which
+  // is much quicker than adding the leaves one by one.
+  //
+  // Returns false, leaving the tree unchanged, if |leaves| is empty or
+  // not made of whole leaf hashes.
+  bool BuildFromLeafHashes(std::string* leaves, cert_trans::ThreadPool* pool);
+
+  // Pick up the nodes that the node store holds now, for a store
+  // changed behind the back of the tree (see MmapNodeStore::Refresh()).
+  // Returns false, leaving the tree as it was, if they are not shaped
+  // like a fully evaluated tree. The tree must not shrink.
+  bool ReloadNodes();
+
+  // Keep the right edge of the tree at |snapshot|, that is, the last
+  // node of each level as it was at that point, so that
+  // RootAtSnapshot() and PathToRootAtSnapshot() for it do not have to
+  // rehash anything once the tree has grown past it. Meant for the
+  // tree sizes of published tree heads, the cost is one node per level.
+  // Does nothing if |snapshot| is 0 or in the future.
+  void CacheSnapshot(size_t snapshot);
+
+  void UncacheSnapshot(size_t snapshot) {
+    snapshot_edges_.erase(snapshot);
+  }
+
  protected:
   // Update to a given snapshot, return the root.
   std::string UpdateToSnapshot(size_t snapshot);
@@ -146,6 +226,10 @@ class MerkleTree : public cert_trans::MerkleTreeInterface {
   // Get the |index|-th node at level |level|. Indexing starts at 0;
   // caller is responsible for ensuring tree is sufficiently up to date.
   std::string Node(size_t level, size_t index) const;
+  // As above, but points into the node storage rather than copying the
+  // NodeSize() bytes of the node. Only valid until the next change to
+  // the tree.
+  const char* NodeData(size_t level, size_t index) const;
 
   // Get the current root (of the lazily evaluated tree).
   // Caller is responsible for keeping track of the lazy evaluation status.
@@ -169,6 +253,12 @@ class MerkleTree : public cert_trans::MerkleTreeInterface {
 
   // Current level count of the lazily evaluated tree.
   size_t LazyLevelCount() const;
+
+  // Whether |level_sizes| (node counts, leaves first) is the shape of a
+  // fully evaluated tree.
+  static bool IsFullyEvaluatedShape(const std::vector<size_t>& level_sizes);
+
+  TreeHasher treehasher_;
   // A container for nodes, organized according to levels and sorted
   // left-to-right in each level. tree_[0] is the leaf level, etc.
   // The hash of nodes tree_[i][j] and tree_[i][j+1] (j even) is stored
@@ -200,13 +290,15 @@ class MerkleTree : public cert_trans::MerkleTreeInterface {
   // Since the tree is append-only from the right, at any given point in time,
   // at each level, all nodes computed so far, except possibly the last node,
   // are fixed and will no longer change.
-  std::vector<std::string> tree_;
-  TreeHasher treehasher_;
+  const std::unique_ptr<cert_trans::MerkleTreeNodeStore> tree_;
   // Number of leaves propagated up to the root,
   // to keep track of lazy evaluation.
   size_t leaves_processed_;
   // The "true" level count for a fully evaluated tree.
   size_t level_count_;
+  // The right edges kept by CacheSnapshot(), leaves first, so that the
+  // last one is the root.
+  std::map<size_t, std::vector<std::string>> snapshot_edges_;
 };
 
 // Mutable Merkle Tree, supports updating nodes and truncating the tree.
@@ -4,15 +4,19 @@
 #include <stdint.h>
 #include <stdlib.h>
 #include <time.h>
+#include <map>
+#include <set>
 #include <string>
 #include <vector>
 
 #include "merkletree/compact_merkle_tree.h"
 #include "merkletree/merkle_tree.h"
 #include "merkletree/merkle_verifier.h"
+#include "merkletree/node_store.h"
 #include "merkletree/serial_hasher.h"
 #include "merkletree/tree_hasher.h"
 #include "util/testing.h"
+#include "util/thread_pool.h"
 #include "util/util.h"
 
 namespace {
@@ -643,12 +647,262 @@ TEST_F(MerkleTreeTest, AddLeafHash) {
   EXPECT_EQ(kHashValue, tree.LeafHash(index));
 }
 
+// Copy out the packed node hashes of every level of |tree|.
+std::vector<string> EvaluatedLevels(MerkleTree* tree) {
+  const cert_trans::MerkleTreeNodeStore& nodes(tree->EvaluatedNodes());
+  std::vector<string> levels;
+  for (size_t level = 0; level < nodes.LevelCount(); ++level)
+    levels.emplace_back(nodes.LevelData(level),
+                        nodes.NodeCount(level) * nodes.NodeSize());
+  return levels;
+}
+
+TEST_F(MerkleTreeTest, RestoreLevels) {
+  for (size_t tree_size = 0; tree_size <= 70; ++tree_size) {
+    MerkleTree tree(NewSha256Hasher());
+    for (size_t j = 0; j < tree_size; ++j)
+      tree.AddLeaf(data_[j]);
+    std::vector<string> levels(EvaluatedLevels(&tree));
+
+    MerkleTree restored(NewSha256Hasher());
+    ASSERT_TRUE(restored.RestoreLevels(&levels));
+    EXPECT_EQ(tree_size, restored.LeafCount());
+    EXPECT_EQ(tree.LevelCount(), restored.LevelCount());
+    EXPECT_EQ(tree.CurrentRoot(), restored.CurrentRoot());
+    for (size_t snapshot = 1; snapshot <= tree_size; ++snapshot) {
+      EXPECT_EQ(tree.RootAtSnapshot(snapshot),
+                restored.RootAtSnapshot(snapshot));
+      EXPECT_EQ(tree.PathToRootAtSnapshot(1, snapshot),
+                restored.PathToRootAtSnapshot(1, snapshot));
+    }
+
+    // The restored tree can keep growing.
+    tree.AddLeaf(data_[tree_size]);
+    restored.AddLeaf(data_[tree_size]);
+    EXPECT_EQ(tree.CurrentRoot(), restored.CurrentRoot());
+  }
+}
+
+TEST_F(MerkleTreeTest, RestoreLevelsRejectsMalformedInput) {
+  MerkleTree tree(NewSha256Hasher());
+  for (size_t j = 0; j < 5; ++j)
+    tree.AddLeaf(data_[j]);
+  const std::vector<string> good(EvaluatedLevels(&tree));
+
+  MerkleTree restored(NewSha256Hasher());
+  std::vector<string> bad(good);
+  bad.pop_back();
+  EXPECT_FALSE(restored.RestoreLevels(&bad));
+
+  bad = good;
+  bad[1].erase(0, 1);
+  EXPECT_FALSE(restored.RestoreLevels(&bad));
+
+  bad = good;
+  bad.push_back(good.back());
+  EXPECT_FALSE(restored.RestoreLevels(&bad));
+
+  EXPECT_EQ(0U, restored.LeafCount());
+}
+
+TEST_F(MerkleTreeTest, AppendStaged) {
+  for (size_t tree_size = 0; tree_size <= 40; ++tree_size) {
+    for (size_t added = 0; added <= 40; ++added) {
+      MerkleTree tree(NewSha256Hasher());
+      MerkleTree staged_tree(NewSha256Hasher());
+      for (size_t j = 0; j < tree_size; ++j) {
+        tree.AddLeaf(data_[j]);
+        staged_tree.AddLeaf(data_[j]);
+      }
+      staged_tree.CurrentRoot();
+
+      std::vector<string> hashes;
+      for (size_t j = tree_size; j < tree_size + added; ++j) {
+        tree.AddLeaf(data_[j]);
+        hashes.push_back(tree_hasher_.HashLeaf(data_[j]));
+      }
+      const MerkleTree::StagedLeaves staged(
+          staged_tree.StageLeafHashes(hashes));
+      // Staging leaves the tree alone.
+      EXPECT_EQ(tree_size, staged_tree.LeafCount());
+      staged_tree.AppendStaged(staged);
+
+      EXPECT_EQ(tree.LeafCount(), staged_tree.LeafCount());
+      EXPECT_EQ(tree.LevelCount(), staged_tree.LevelCount());
+      EXPECT_EQ(EvaluatedLevels(&tree), EvaluatedLevels(&staged_tree));
+      EXPECT_EQ(tree.CurrentRoot(), staged_tree.CurrentRoot());
+    }
+  }
+}
+
+TEST_F(MerkleTreeTest, BuildFromLeafHashes) {
+  cert_trans::ThreadPool pool(4);
+  // Past 2^16 leaves, the subtrees are hashed on the pool.
+  const size_t kTreeSizes[] = {1, 2, 3, 5, 8, 70, 65536, 65537, 196613};
+  for (size_t tree_size : kTreeSizes) {
+    MerkleTree tree(NewSha256Hasher());
+    string leaves;
+    for (size_t j = 0; j < tree_size; ++j) {
+      const string hash(tree_hasher_.HashLeaf(std::to_string(j)));
+      tree.AddLeafHash(hash);
+      leaves.append(hash);
+    }
+
+    const std::vector<cert_trans::ThreadPool*> pools{&pool, nullptr};
+    for (cert_trans::ThreadPool* build_pool : pools) {
+      string to_build(leaves);
+      MerkleTree built(NewSha256Hasher());
+      ASSERT_TRUE(built.BuildFromLeafHashes(&to_build, build_pool));
+      EXPECT_TRUE(to_build.empty());
+      EXPECT_EQ(tree_size, built.LeafCount());
+      EXPECT_EQ(tree.LevelCount(), built.LevelCount());
+      EXPECT_EQ(EvaluatedLevels(&tree), EvaluatedLevels(&built));
+    }
+  }
+
+  MerkleTree built(NewSha256Hasher());
+  string bad("not a whole hash");
+  EXPECT_FALSE(built.BuildFromLeafHashes(&bad, &pool));
+  bad.clear();
+  EXPECT_FALSE(built.BuildFromLeafHashes(&bad, &pool));
+  EXPECT_EQ(0U, built.LeafCount());
+}
+
+TEST_F(MerkleTreeTest, CachedSnapshots) {
+  const size_t kTreeSize = 70;
+  MerkleTree tree(NewSha256Hasher());
+  for (size_t j = 0; j < kTreeSize; ++j) {
+    tree.AddLeaf(data_[j]);
+    // Cache some of the snapshots while they are current, others after
+    // the tree has moved on.
+    if (j % 3 == 0)
+      tree.CacheSnapshot(j + 1);
+    if (j % 5 == 0 && j > 10)
+      tree.CacheSnapshot(j - 10);
+  }
+  // Out of range, these do nothing.
+  tree.CacheSnapshot(0);
+  tree.CacheSnapshot(kTreeSize + 1);
+  tree.UncacheSnapshot(4);
+
+  for (size_t snapshot = 0; snapshot <= kTreeSize; ++snapshot) {
+    EXPECT_EQ(ReferenceMerkleTreeHash(data_.data(), snapshot, &tree_hasher_),
+              tree.RootAtSnapshot(snapshot));
+    for (size_t leaf = 0; leaf <= snapshot; ++leaf) {
+      EXPECT_EQ(ReferenceMerklePath(data_.data(), snapshot, leaf,
+                                    &tree_hasher_),
+                tree.PathToRootAtSnapshot(leaf, snapshot));
+    }
+    for (size_t snapshot1 = 0; snapshot1 <= snapshot; ++snapshot1) {
+      EXPECT_EQ(ReferenceSnapshotConsistency(data_.data(), snapshot,
+                                             snapshot1, &tree_hasher_, true),
+                tree.SnapshotConsistency(snapshot1, snapshot));
+    }
+  }
+}
+
+TEST_F(MutableMerkleTreeTest, CachedSnapshotsFollowChanges) {
+  MutableMerkleTree tree(NewSha256Hasher());
+  for (size_t j = 0; j < 10; ++j)
+    tree.AddLeaf(data_[j]);
+  for (size_t snapshot = 1; snapshot <= 10; ++snapshot)
+    tree.CacheSnapshot(snapshot);
+
+  std::vector<string> inputs(data_.begin(), data_.begin() + 10);
+  inputs[9] = data_[100];
+  EXPECT_TRUE(tree.UpdateLeafHash(10, tree_hasher_.HashLeaf(inputs[9])));
+  for (size_t snapshot = 1; snapshot <= 10; ++snapshot) {
+    EXPECT_EQ(ReferenceMerkleTreeHash(inputs.data(), snapshot, &tree_hasher_),
+              tree.RootAtSnapshot(snapshot));
+  }
+
+  for (size_t snapshot = 1; snapshot <= 10; ++snapshot)
+    tree.CacheSnapshot(snapshot);
+  EXPECT_TRUE(tree.Truncate(7));
+  for (size_t j = 7; j < 10; ++j) {
+    inputs[j] = data_[200 + j];
+    tree.AddLeaf(inputs[j]);
+  }
+  for (size_t snapshot = 1; snapshot <= 10; ++snapshot) {
+    EXPECT_EQ(ReferenceMerkleTreeHash(inputs.data(), snapshot, &tree_hasher_),
+              tree.RootAtSnapshot(snapshot));
+  }
+}
+
 TEST_F(CompactMerkleTreeTest, TestCloneEmptyTreeProducesWorkingTree) {
   MerkleTree tree(NewSha256Hasher());
   CompactMerkleTree compact(&tree, NewSha256Hasher());
   EXPECT_STREQ(H(compact.CurrentRoot()).c_str(), kSHA256EmptyTreeHash.str);
 }
 
+TEST_F(CompactMerkleTreeFuzzTest, FromFrontierThenAppend) {
+  CompactMerkleTree tree(NewSha256Hasher());
+  for (size_t tree_size = 0; tree_size <= 130; ++tree_size) {
+    unique_ptr<CompactMerkleTree> restored(CompactMerkleTree::FromFrontier(
+        tree.LeafCount(), tree.Frontier(), NewSha256Hasher()));
+    ASSERT_TRUE(restored);
+    EXPECT_EQ(tree.LeafCount(), restored->LeafCount());
+    EXPECT_EQ(tree.LevelCount(), restored->LevelCount());
+    EXPECT_EQ(tree.CurrentRoot(), restored->CurrentRoot());
+
+    const string l(RandomLeaf(64));
+    tree.AddLeaf(l);
+    restored->AddLeaf(l);
+    EXPECT_EQ(tree.LevelCount(), restored->LevelCount());
+    EXPECT_EQ(tree.CurrentRoot(), restored->CurrentRoot());
+  }
+}
+
+TEST_F(CompactMerkleTreeFuzzTest, SnapshotsAreForkedIndependently) {
+  CompactMerkleTree tree(NewSha256Hasher());
+  for (size_t tree_size = 0; tree_size <= 70; ++tree_size) {
+    const std::shared_ptr<const CompactMerkleTree::Snapshot> snapshot(
+        tree.TakeSnapshot());
+    // Nothing changed, so the same snapshot is shared.
+    EXPECT_EQ(snapshot, tree.TakeSnapshot());
+    EXPECT_EQ(tree.LeafCount(), snapshot->leaf_count);
+    EXPECT_EQ(tree.CurrentRoot(), snapshot->root);
+
+    unique_ptr<CompactMerkleTree> fork(
+        CompactMerkleTree::FromSnapshot(*snapshot, NewSha256Hasher()));
+    EXPECT_EQ(tree.LevelCount(), fork->LevelCount());
+    EXPECT_EQ(tree.CurrentRoot(), fork->CurrentRoot());
+
+    const string l(RandomLeaf(64));
+    tree.AddLeaf(l);
+    // Neither the snapshot nor the fork follow the original tree...
+    EXPECT_NE(snapshot, tree.TakeSnapshot());
+    EXPECT_EQ(tree_size, snapshot->leaf_count);
+    EXPECT_EQ(tree_size, fork->LeafCount());
+    // ...but they agree once the fork catches up.
+    fork->AddLeaf(l);
+    EXPECT_EQ(tree.LevelCount(), fork->LevelCount());
+    EXPECT_EQ(tree.CurrentRoot(), fork->CurrentRoot());
+  }
+}
+
+TEST_F(CompactMerkleTreeTest, FromFrontierRejectsInconsistentFrontier) {
+  CompactMerkleTree tree(NewSha256Hasher());
+  for (size_t i = 0; i < 5; ++i) {
+    tree.AddLeaf(data_[i]);
+  }
+  const std::vector<string> frontier(tree.Frontier());
+
+  EXPECT_TRUE(
+      CompactMerkleTree::FromFrontier(5, frontier, NewSha256Hasher()));
+  EXPECT_FALSE(
+      CompactMerkleTree::FromFrontier(4, frontier, NewSha256Hasher()));
+  EXPECT_FALSE(
+      CompactMerkleTree::FromFrontier(6, frontier, NewSha256Hasher()));
+  EXPECT_FALSE(
+      CompactMerkleTree::FromFrontier(13, frontier, NewSha256Hasher()));
+
+  std::vector<string> truncated(frontier);
+  truncated[0].resize(3);
+  EXPECT_FALSE(
+      CompactMerkleTree::FromFrontier(5, truncated, NewSha256Hasher()));
+}
+
 // VERIFICATION TESTS
 
 class MerkleVerifierTest : public MerkleTreeTest {
@@ -847,6 +1101,117 @@ TEST_F(MerkleVerifierTest, VerifyPath) {
   }
 }
 
+TEST_F(MerkleVerifierTest, VerifyPaths) {
+  for (size_t tree_size = 1; tree_size <= data_.size() / 2; ++tree_size) {
+    const string root(
+        ReferenceMerkleTreeHash(data_.data(), tree_size, &tree_hasher_));
+    std::vector<MerkleVerifier::LeafPath> paths;
+    for (size_t leaf = 1; leaf <= tree_size; ++leaf) {
+      paths.push_back(MerkleVerifier::LeafPath{
+          leaf,
+          ReferenceMerklePath(data_.data(), tree_size, leaf, &tree_hasher_),
+          data_[leaf - 1]});
+    }
+    std::vector<bool> valid;
+    EXPECT_TRUE(verifier_.VerifyPaths(tree_size, paths, root, &valid));
+    EXPECT_EQ(std::vector<bool>(tree_size, true), valid);
+
+    // Mix in broken copies of the paths, after the valid ones, so that
+    // they meet nodes that are already known.
+    const size_t count(paths.size());
+    for (size_t i = 0; i < count; ++i) {
+      MerkleVerifier::LeafPath wrong(paths[i]);
+      if (!wrong.path.empty()) {
+        wrong.path.back() = S(kSHA256EmptyTreeHash);
+        paths.push_back(wrong);
+        wrong.path.pop_back();
+        paths.push_back(wrong);
+      }
+      wrong = paths[i];
+      wrong.path.push_back(root);
+      paths.push_back(wrong);
+      wrong = paths[i];
+      wrong.data = "WrongLeaf";
+      paths.push_back(wrong);
+      wrong = paths[i];
+      wrong.leaf = wrong.leaf % tree_size + 1;
+      paths.push_back(wrong);
+    }
+    EXPECT_FALSE(verifier_.VerifyPaths(tree_size, paths, root, &valid));
+    ASSERT_EQ(paths.size(), valid.size());
+    for (size_t i = 0; i < paths.size(); ++i) {
+      EXPECT_EQ(verifier_.VerifyPath(paths[i].leaf, tree_size, paths[i].path,
+                                     root, paths[i].data),
+                valid[i])
+          << "tree size " << tree_size << ", path " << i;
+    }
+  }
+}
+
+TEST_F(MerkleVerifierTest, RootFromMultiProof) {
+  for (size_t tree_size = 1; tree_size <= 40; ++tree_size) {
+    const string root(
+        ReferenceMerkleTreeHash(data_.data(), tree_size, &tree_hasher_));
+    // Every other leaf, from the first, then from the second.
+    for (size_t first = 1; first <= 2 && first <= tree_size; ++first) {
+      std::map<size_t, string> leaves;
+      // The nodes of the audit paths, and those that can be computed
+      // from the leaves, by (level, index).
+      std::map<std::pair<size_t, size_t>, string> path_nodes;
+      std::set<std::pair<size_t, size_t>> computed;
+      for (size_t leaf = first; leaf <= tree_size; leaf += 2) {
+        leaves[leaf] = data_[leaf - 1];
+        const std::vector<string> path(ReferenceMerklePath(
+            data_.data(), tree_size, leaf, &tree_hasher_));
+        size_t node = leaf - 1, last_node = tree_size - 1, i = 0;
+        for (size_t level = 0; last_node > 0; ++level) {
+          computed.insert(std::make_pair(level, node));
+          if ((node & 1) || node < last_node)
+            path_nodes[std::make_pair(level, node ^ 1)] = path[i++];
+          node >>= 1;
+          last_node >>= 1;
+        }
+      }
+      std::vector<string> proof;
+      for (const auto& path_node : path_nodes)
+        if (computed.count(path_node.first) == 0)
+          proof.push_back(path_node.second);
+
+      EXPECT_EQ(H(root), H(verifier_.RootFromMultiProof(tree_size, leaves,
+                                                         proof)))
+          << "tree size " << tree_size << ", first leaf " << first;
+
+      // Missing, extra or wrong nodes.
+      std::vector<string> wrong_proof(proof);
+      wrong_proof.push_back(root);
+      EXPECT_EQ("", verifier_.RootFromMultiProof(tree_size, leaves,
+                                                 wrong_proof));
+      if (!proof.empty()) {
+        wrong_proof = proof;
+        wrong_proof.pop_back();
+        EXPECT_EQ("", verifier_.RootFromMultiProof(tree_size, leaves,
+                                                   wrong_proof));
+        wrong_proof = proof;
+        wrong_proof.front() = S(kSHA256EmptyTreeHash);
+        EXPECT_NE(H(root), H(verifier_.RootFromMultiProof(tree_size, leaves,
+                                                           wrong_proof)));
+      }
+
+      // Wrong leaves.
+      std::map<size_t, string> wrong_leaves(leaves);
+      wrong_leaves.begin()->second = "WrongLeaf";
+      EXPECT_NE(H(root), H(verifier_.RootFromMultiProof(
+                             tree_size, wrong_leaves, proof)));
+      wrong_leaves = leaves;
+      wrong_leaves[tree_size + 1] = data_[0];
+      EXPECT_EQ("", verifier_.RootFromMultiProof(tree_size, wrong_leaves,
+                                                 proof));
+    }
+  }
+  EXPECT_EQ("", verifier_.RootFromMultiProof(1, std::map<size_t, string>(),
+                                             std::vector<string>()));
+}
+
 TEST_F(MerkleVerifierTest, VerifyConsistencyProof) {
   std::vector<string> proof;
   string root1, root2;
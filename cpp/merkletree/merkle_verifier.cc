@@ -1,10 +1,14 @@
 #include "merkletree/merkle_verifier.h"
 
 #include <stddef.h>
+#include <iterator>
+#include <tuple>
 #include <vector>
 
+using std::make_tuple;
 using std::move;
 using std::string;
+using std::tuple;
 using std::unique_ptr;
 
 MerkleVerifier::MerkleVerifier(unique_ptr<SerialHasher> hasher)
@@ -22,6 +26,20 @@ static inline bool IsRightChild(size_t leaf) {
   return leaf & 1;
 }
 
+// Replaces |node| with the hash of |left| and |right|, one of which
+// is |node| itself. Hashes in place when both children are well-formed
+// digests; proof nodes are untrusted, so other lengths fall back to
+// the (allocating) string version.
+static inline void HashChildrenInPlace(const TreeHasher& hasher,
+                                       const string& left,
+                                       const string& right, string* node) {
+  if (left.size() == hasher.DigestSize() &&
+      right.size() == hasher.DigestSize())
+    hasher.HashChildren(left.data(), right.data(), &(*node)[0]);
+  else
+    *node = hasher.HashChildren(left, right);
+}
+
 bool MerkleVerifier::VerifyPath(size_t leaf, size_t tree_size,
                                 const std::vector<string>& path,
                                 const string& root, const string& data) {
@@ -31,6 +49,96 @@ bool MerkleVerifier::VerifyPath(size_t leaf, size_t tree_size,
   return path_root == root;
 }
 
+bool MerkleVerifier::VerifyPaths(size_t tree_size,
+                                 const std::vector<LeafPath>& paths,
+                                 const string& root,
+                                 std::vector<bool>* valid) {
+  valid->assign(paths.size(), false);
+  KnownNodes known;
+  bool all_valid = true;
+  for (size_t i = 0; i < paths.size(); ++i) {
+    (*valid)[i] = VerifyPathWithKnownNodes(tree_size, paths[i], root, &known);
+    all_valid = all_valid && (*valid)[i];
+  }
+  return all_valid;
+}
+
+bool MerkleVerifier::VerifyPathWithKnownNodes(size_t tree_size,
+                                              const LeafPath& path,
+                                              const string& root,
+                                              KnownNodes* known) {
+  if (path.leaf > tree_size || path.leaf == 0)
+    // No valid path exists.
+    return false;
+
+  size_t node = path.leaf - 1;
+  size_t last_node = tree_size - 1;
+  size_t level = 0;
+
+  string node_hash = LeafHash(path.data);
+  std::vector<string>::const_iterator it = path.path.begin();
+  // The (level, index, hash) of the nodes hashed, and of their
+  // siblings, to add to |known| if the path turns out valid.
+  std::vector<tuple<size_t, size_t, string>> hashed;
+
+  while (last_node) {
+    if (level < known->size()) {
+      const auto found((*known)[level].find(node));
+      if (found != (*known)[level].end()) {
+        if (found->second != node_hash)
+          return false;
+        // All the nodes above it are known too, and their siblings,
+        // which is what the rest of the path should be.
+        while (last_node) {
+          if (IsRightChild(node) || node < last_node) {
+            if (it == path.path.end())
+              return false;
+            const auto sibling((*known)[level].find(
+                IsRightChild(node) ? node - 1 : node + 1));
+            if (sibling == (*known)[level].end() || sibling->second != *it++)
+              return false;
+          }
+          node = Parent(node);
+          last_node = Parent(last_node);
+          ++level;
+        }
+        return it == path.path.end();
+      }
+    }
+
+    if (it == path.path.end())
+      // We've reached the end but we're not done yet.
+      return false;
+    if (IsRightChild(node)) {
+      hashed.emplace_back(make_tuple(level, node, node_hash));
+      hashed.emplace_back(make_tuple(level, node - 1, *it));
+      HashChildrenInPlace(treehasher_, *it++, node_hash, &node_hash);
+    } else if (node < last_node) {
+      hashed.emplace_back(make_tuple(level, node, node_hash));
+      hashed.emplace_back(make_tuple(level, node + 1, *it));
+      HashChildrenInPlace(treehasher_, node_hash, *it++, &node_hash);
+    }
+    // Else the sibling does not exist and the parent is a dummy copy,
+    // which is what gets looked up at the next level.
+
+    node = Parent(node);
+    last_node = Parent(last_node);
+    ++level;
+  }
+
+  // Check that we've reached the end, and the root.
+  if (it != path.path.end() || node_hash != root)
+    return false;
+
+  for (auto& entry : hashed) {
+    if (known->size() <= std::get<0>(entry))
+      known->resize(std::get<0>(entry) + 1);
+    (*known)[std::get<0>(entry)].emplace(std::get<1>(entry),
+                                         move(std::get<2>(entry)));
+  }
+  return true;
+}
+
 string MerkleVerifier::RootFromPath(size_t leaf, size_t tree_size,
                                     const std::vector<string>& path,
                                     const string& data) {
@@ -49,9 +157,9 @@ string MerkleVerifier::RootFromPath(size_t leaf, size_t tree_size,
       // We've reached the end but we're not done yet.
       return string();
     if (IsRightChild(node))
-      node_hash = treehasher_.HashChildren(*it++, node_hash);
+      HashChildrenInPlace(treehasher_, *it++, node_hash, &node_hash);
     else if (node < last_node)
-      node_hash = treehasher_.HashChildren(node_hash, *it++);
+      HashChildrenInPlace(treehasher_, node_hash, *it++, &node_hash);
     // Else the sibling does not exist and the parent is a dummy copy.
     // Do nothing.
 
@@ -65,6 +173,58 @@ string MerkleVerifier::RootFromPath(size_t leaf, size_t tree_size,
   return node_hash;
 }
 
+string MerkleVerifier::RootFromMultiProof(
+    size_t tree_size, const std::map<size_t, string>& leaves,
+    const std::vector<string>& proof) {
+  if (leaves.empty() || leaves.begin()->first == 0 ||
+      leaves.rbegin()->first > tree_size)
+    // No valid proof exists.
+    return string();
+
+  // The nodes of the current level that can be computed, by index.
+  std::map<size_t, string> nodes;
+  for (const auto& leaf : leaves)
+    nodes.emplace_hint(nodes.end(), leaf.first - 1, LeafHash(leaf.second));
+  size_t last_node = tree_size - 1;
+  std::vector<string>::const_iterator it = proof.begin();
+
+  while (last_node) {
+    std::map<size_t, string> parents;
+    for (auto node = nodes.begin(); node != nodes.end(); ++node) {
+      const size_t index = node->first;
+      const auto next = std::next(node);
+      string node_hash = move(node->second);
+      if (IsRightChild(index)) {
+        // The left sibling would have been handled already if it could
+        // be computed.
+        if (it == proof.end())
+          return string();
+        HashChildrenInPlace(treehasher_, *it++, node_hash, &node_hash);
+      } else if (index < last_node) {
+        if (next != nodes.end() && next->first == index + 1) {
+          HashChildrenInPlace(treehasher_, node_hash, next->second,
+                              &node_hash);
+          // Done with the sibling too.
+          node = next;
+        } else {
+          if (it == proof.end())
+            return string();
+          HashChildrenInPlace(treehasher_, node_hash, *it++, &node_hash);
+        }
+      }
+      // Else the sibling does not exist and the parent is a dummy copy.
+      parents.emplace_hint(parents.end(), Parent(index), move(node_hash));
+    }
+    nodes.swap(parents);
+    last_node = Parent(last_node);
+  }
+
+  // Check that we've reached the end.
+  if (it != proof.end())
+    return string();
+  return nodes.begin()->second;
+}
+
 bool MerkleVerifier::VerifyConsistency(size_t snapshot1, size_t snapshot2,
                                        const string& root1,
                                        const string& root2,
@@ -102,13 +262,13 @@ bool MerkleVerifier::VerifyConsistency(size_t snapshot1, size_t snapshot2,
       return false;
 
     if (IsRightChild(node)) {
-      node1_hash = treehasher_.HashChildren(*it, node1_hash);
-      node2_hash = treehasher_.HashChildren(*it, node2_hash);
+      HashChildrenInPlace(treehasher_, *it, node1_hash, &node1_hash);
+      HashChildrenInPlace(treehasher_, *it, node2_hash, &node2_hash);
       ++it;
     } else if (node < last_node)
       // The sibling only exists in the later tree. The parent in the
       // snapshot1 tree is a dummy copy.
-      node2_hash = treehasher_.HashChildren(node2_hash, *it++);
+      HashChildrenInPlace(treehasher_, node2_hash, *it++, &node2_hash);
     // Else the sibling does not exist in either tree. Do nothing.
 
     node = Parent(node);
@@ -125,7 +285,7 @@ bool MerkleVerifier::VerifyConsistency(size_t snapshot1, size_t snapshot2,
       // We've reached the end but we're not done yet.
       return false;
 
-    node2_hash = treehasher_.HashChildren(node2_hash, *it++);
+    HashChildrenInPlace(treehasher_, node2_hash, *it++, &node2_hash);
     last_node = Parent(last_node);
   }
 
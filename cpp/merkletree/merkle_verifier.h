@@ -2,7 +2,10 @@
 #define CERT_TRANS_MERKLETREE_MERKLE_VERIFIER_H_
 
 #include <stddef.h>
+#include <map>
 #include <memory>
+#include <string>
+#include <unordered_map>
 #include <vector>
 
 #include "merkletree/tree_hasher.h"
@@ -31,6 +34,22 @@ class MerkleVerifier {
                   const std::vector<std::string>& path,
                   const std::string& root, const std::string& data);
 
+  // A Merkle path to verify with VerifyPaths(), see VerifyPath() for
+  // the fields.
+  struct LeafPath {
+    size_t leaf;
+    std::vector<std::string> path;
+    std::string data;
+  };
+
+  // Verify many Merkle paths in the same tree. Sets (*valid)[i] to what
+  // VerifyPath() would return for |paths[i]|, and returns true iff they
+  // are all valid. Nodes that paths have in common (the upper levels,
+  // mostly) are only hashed once: past the first node already known
+  // to be in the tree, a path is just compared with what is known.
+  bool VerifyPaths(size_t tree_size, const std::vector<LeafPath>& paths,
+                   const std::string& root, std::vector<bool>* valid);
+
   // Compute the root corresponding to a Merkle audit path.
   // Returns an empty string if the path is not valid.
   //
@@ -43,6 +62,21 @@ class MerkleVerifier {
                            const std::vector<std::string>& path,
                            const std::string& data);
 
+  // Compute the root corresponding to a multi-proof, that is, the
+  // Merkle audit paths of several leaves at once, with the nodes they
+  // share, and those that can be computed from the leaves, left out.
+  // Returns an empty string if the proof is not valid.
+  //
+  // @param tree_size number of leaves in the tree.
+  // @param leaves the leaf data, by index of the leaf (as above,
+  // starting from 1). Must not be empty.
+  // @param proof the nodes of the audit paths of the leaves that cannot
+  // be computed from them, each once, ordered by level from the leaves
+  // to the root, then from left to right.
+  std::string RootFromMultiProof(size_t tree_size,
+                                 const std::map<size_t, std::string>& leaves,
+                                 const std::vector<std::string>& proof);
+
   bool VerifyConsistency(size_t snapshot1, size_t snapshot2,
                          const std::string& root1, const std::string& root2,
                          const std::vector<std::string>& proof);
@@ -51,6 +85,14 @@ class MerkleVerifier {
   std::string LeafHash(const std::string& data);
 
  private:
+  // Nodes known to be in a tree, by level (leaves first), then index.
+  typedef std::vector<std::unordered_map<size_t, std::string>> KnownNodes;
+
+  // VerifyPaths() for one path, adding the nodes of |path| and their
+  // siblings to |known| if it is valid.
+  bool VerifyPathWithKnownNodes(size_t tree_size, const LeafPath& path,
+                                const std::string& root, KnownNodes* known);
+
   TreeHasher treehasher_;
 };
 
@@ -0,0 +1,416 @@
+#include "merkletree/mmap_node_store.h"
+
+#include <fcntl.h>
+#include <glog/logging.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <algorithm>
+#include <sstream>
+
+#include "util/huge_pages.h"
+#include "util/util.h"
+
+using std::string;
+using std::unique_ptr;
+using std::vector;
+
+namespace cert_trans {
+
+namespace {
+
+
+const char kMetadataMagic[] = "ct-mmap-node-store";
+// Version 2 added the generation, the edges and the annotation.
+const int kMetadataVersion = 2;
+// Smallest mapping we create for a level, to avoid remapping over and
+// over as a new tree starts growing.
+const size_t kMinimumCapacity = 1 << 16;
+
+
+}  // namespace
+
+
+MmapNodeStore::MmapNodeStore(const string& dir, size_t node_size)
+    : MmapNodeStore(dir, node_size, false) {
+}
+
+
+MmapNodeStore::MmapNodeStore(const string& dir, size_t node_size,
+                             bool read_only)
+    : dir_(dir),
+      node_size_(node_size),
+      page_size_(sysconf(_SC_PAGESIZE)),
+      read_only_(read_only),
+      generation_(0) {
+  CHECK_GT(node_size_, 0U);
+  if (read_only_) {
+    if (!Refresh()) {
+      LOG(INFO) << "Nothing published in " << dir_ << " yet";
+    }
+    return;
+  }
+
+  Metadata metadata;
+  if (!ReadMetadata(&metadata)) {
+    LOG(INFO) << "Starting an empty node store in " << dir_;
+    return;
+  }
+  // Keep counting from there, so that readers see a new version.
+  generation_ = metadata.generation;
+  for (size_t level = 0; level < metadata.node_counts.size(); ++level) {
+    Level new_level;
+    if (!OpenLevel(level, metadata.node_counts[level], &new_level)) {
+      LOG(WARNING) << "Node store in " << dir_ << " is inconsistent, "
+                   << "starting from an empty one";
+      RemoveLevels(0);
+      return;
+    }
+    levels_.push_back(new_level);
+  }
+}
+
+
+// static
+unique_ptr<MmapNodeStore> MmapNodeStore::OpenReadOnly(const string& dir,
+                                                      size_t node_size) {
+  return unique_ptr<MmapNodeStore>(new MmapNodeStore(dir, node_size, true));
+}
+
+
+MmapNodeStore::~MmapNodeStore() {
+  for (auto& level : levels_)
+    CloseLevel(&level);
+}
+
+
+size_t MmapNodeStore::NodeCount(size_t level) const {
+  CHECK_LT(level, levels_.size());
+  return levels_[level].node_count;
+}
+
+
+const char* MmapNodeStore::LevelData(size_t level) const {
+  CHECK_LT(level, levels_.size());
+  return levels_[level].data;
+}
+
+
+const char* MmapNodeStore::NodeData(size_t level, size_t index) const {
+  CHECK_LT(level, levels_.size());
+  if (level < edges_.size() && index + 1 == levels_[level].node_count) {
+    return edges_[level].data();
+  }
+  return levels_[level].data + index * node_size_;
+}
+
+
+void MmapNodeStore::Append(size_t level, const char* nodes, size_t count) {
+  CHECK(!read_only_);
+  CHECK_LT(level, levels_.size());
+  Reserve(level, levels_[level].node_count + count);
+  levels_[level].dirty_from =
+      std::min(levels_[level].dirty_from, levels_[level].node_count);
+  memcpy(levels_[level].data + levels_[level].node_count * node_size_, nodes,
+         count * node_size_);
+  levels_[level].node_count += count;
+}
+
+
+void MmapNodeStore::SetNode(size_t level, size_t index, const char* node) {
+  CHECK(!read_only_);
+  CHECK_LT(index, NodeCount(level));
+  levels_[level].dirty_from = std::min(levels_[level].dirty_from, index);
+  memcpy(levels_[level].data + index * node_size_, node, node_size_);
+}
+
+
+void MmapNodeStore::Truncate(size_t level, size_t count) {
+  CHECK(!read_only_);
+  CHECK_LE(count, NodeCount(level));
+  // We keep the file (and mapping) size, the space will most likely be
+  // reused soon.
+  levels_[level].node_count = count;
+  levels_[level].dirty_from = std::min(levels_[level].dirty_from, count);
+}
+
+
+void MmapNodeStore::AddLevel() {
+  CHECK(!read_only_);
+  Level new_level;
+  CHECK(OpenLevel(levels_.size(), 0, &new_level));
+  levels_.push_back(new_level);
+}
+
+
+void MmapNodeStore::RemoveLevels(size_t level) {
+  while (levels_.size() > level) {
+    CloseLevel(&levels_.back());
+    levels_.pop_back();
+    // Readers only let go of their view, the files are the writer's.
+    if (read_only_) {
+      edges_.resize(std::min(edges_.size(), levels_.size()));
+      continue;
+    }
+    PCHECK(unlink(LevelPath(levels_.size()).c_str()) == 0 ||
+           errno == ENOENT);
+  }
+}
+
+
+size_t MmapNodeStore::ByteSize() const {
+  size_t bytes(0);
+  for (const Level& level : levels_)
+    bytes += level.capacity;
+  return bytes;
+}
+
+
+void MmapNodeStore::Sync() {
+  Sync(string());
+}
+
+
+void MmapNodeStore::Sync(const string& annotation) {
+  CHECK(!read_only_);
+  // Only the nodes written since the last time can be dirty, from the
+  // start of the page holding the first of them.
+  for (auto& level : levels_) {
+    if (level.dirty_from < level.node_count) {
+      const size_t begin(level.dirty_from * node_size_ / page_size_ *
+                         page_size_);
+      const size_t end(level.node_count * node_size_);
+      PCHECK(msync(level.data + begin, end - begin, MS_SYNC) == 0);
+    }
+    level.dirty_from = level.node_count;
+  }
+  annotation_ = annotation;
+  WriteMetadata();
+}
+
+
+bool MmapNodeStore::Refresh() {
+  CHECK(read_only_);
+  Metadata metadata;
+  if (!ReadMetadata(&metadata) || metadata.generation == generation_) {
+    return false;
+  }
+
+  // Keep the mappings that still cover the level, the nodes in them
+  // do not change (except the last one, which comes from the edges).
+  vector<Level> levels;
+  vector<bool> reused(levels_.size(), false);
+  for (size_t level = 0; level < metadata.node_counts.size(); ++level) {
+    const size_t node_count(metadata.node_counts[level]);
+    Level new_level;
+    if (!OpenLevel(level, node_count, &new_level)) {
+      LOG(WARNING) << "Node store in " << dir_ << " is inconsistent";
+      for (size_t i = 0; i < levels.size(); ++i) {
+        if (i >= reused.size() || !reused[i])
+          CloseLevel(&levels[i]);
+      }
+      return false;
+    }
+    if (level < levels_.size() && levels_[level].inode == new_level.inode &&
+        levels_[level].capacity >= node_count * node_size_) {
+      CloseLevel(&new_level);
+      new_level = levels_[level];
+      new_level.node_count = node_count;
+      reused[level] = true;
+    }
+    levels.push_back(new_level);
+  }
+
+  for (size_t i = 0; i < levels_.size(); ++i) {
+    if (!reused[i])
+      CloseLevel(&levels_[i]);
+  }
+  levels_.swap(levels);
+  edges_.swap(metadata.edges);
+  generation_ = metadata.generation;
+  annotation_.swap(metadata.annotation);
+  return true;
+}
+
+
+string MmapNodeStore::LevelPath(size_t level) const {
+  std::ostringstream path;
+  path << dir_ << "/level-" << level;
+  return path.str();
+}
+
+
+string MmapNodeStore::MetadataPath() const {
+  return dir_ + "/nodes";
+}
+
+
+bool MmapNodeStore::OpenLevel(size_t level, size_t node_count,
+                              Level* result) const {
+  const string path(LevelPath(level));
+  Level new_level;
+  if (read_only_) {
+    new_level.fd = open(path.c_str(), O_RDONLY);
+    if (new_level.fd < 0) {
+      PLOG(WARNING) << "Failed to open " << path;
+      return false;
+    }
+  } else {
+    new_level.fd = open(path.c_str(), O_RDWR | O_CREAT, 0644);
+    PCHECK(new_level.fd >= 0) << "Failed to open " << path;
+  }
+
+  struct stat st;
+  PCHECK(fstat(new_level.fd, &st) == 0);
+  new_level.capacity = st.st_size;
+  new_level.node_count = node_count;
+  new_level.dirty_from = node_count;
+  new_level.inode = st.st_ino;
+  new_level.data = nullptr;
+  if (new_level.capacity < node_count * node_size_) {
+    close(new_level.fd);
+    return false;
+  }
+  if (new_level.capacity > 0) {
+    void* const data(mmap(nullptr, new_level.capacity,
+                          read_only_ ? PROT_READ : PROT_READ | PROT_WRITE,
+                          MAP_SHARED, new_level.fd, 0));
+    PCHECK(data != MAP_FAILED) << "Failed to map " << path;
+    util::AdviseHugePages(data, new_level.capacity);
+    new_level.data = static_cast<char*>(data);
+  }
+  *result = new_level;
+  return true;
+}
+
+
+void MmapNodeStore::CloseLevel(Level* level) const {
+  if (level->capacity > 0) {
+    PCHECK(munmap(level->data, level->capacity) == 0);
+  }
+  if (level->fd >= 0)
+    close(level->fd);
+}
+
+
+void MmapNodeStore::Reserve(size_t level, size_t node_count) {
+  Level* const l(&levels_[level]);
+  const size_t needed(node_count * node_size_);
+  if (needed <= l->capacity)
+    return;
+
+  size_t capacity(std::max(std::max(needed, 2 * l->capacity),
+                           kMinimumCapacity));
+  capacity = (capacity + page_size_ - 1) / page_size_ * page_size_;
+
+  if (l->capacity > 0) {
+    PCHECK(munmap(l->data, l->capacity) == 0);
+  }
+  PCHECK(ftruncate(l->fd, capacity) == 0) << "Failed to grow "
+                                          << LevelPath(level);
+  void* const data(
+      mmap(nullptr, capacity, PROT_READ | PROT_WRITE, MAP_SHARED, l->fd, 0));
+  PCHECK(data != MAP_FAILED) << "Failed to map " << LevelPath(level);
+  util::AdviseHugePages(data, capacity);
+  l->data = static_cast<char*>(data);
+  l->capacity = capacity;
+}
+
+
+bool MmapNodeStore::ReadMetadata(Metadata* metadata) const {
+  string contents;
+  if (!util::ReadBinaryFile(MetadataPath(), &contents))
+    return false;
+
+  std::istringstream in(contents);
+  string magic;
+  int version;
+  size_t node_size, level_count;
+  if (!(in >> magic >> version >> node_size >> level_count) ||
+      magic != kMetadataMagic || version < 1 || version > kMetadataVersion) {
+    LOG(WARNING) << "Unrecognized node store metadata in " << MetadataPath();
+    return false;
+  }
+  if (node_size != node_size_) {
+    LOG(WARNING) << "Node store in " << dir_ << " has nodes of " << node_size
+                 << " bytes, expected " << node_size_;
+    return false;
+  }
+  metadata->generation = 0;
+  if (version >= 2 && !(in >> metadata->generation)) {
+    LOG(WARNING) << "Truncated node store metadata in " << MetadataPath();
+    return false;
+  }
+
+  metadata->node_counts.resize(level_count);
+  for (size_t level = 0; level < level_count; ++level) {
+    if (!(in >> metadata->node_counts[level])) {
+      LOG(WARNING) << "Truncated node store metadata in " << MetadataPath();
+      return false;
+    }
+  }
+
+  metadata->edges.clear();
+  metadata->annotation.clear();
+  if (version < 2) {
+    return true;
+  }
+  for (size_t level = 0; level < level_count; ++level) {
+    string edge;
+    if (!(in >> edge)) {
+      LOG(WARNING) << "Truncated node store metadata in " << MetadataPath();
+      return false;
+    }
+    metadata->edges.push_back(edge == "-" ? string()
+                                          : util::BinaryString(edge));
+    if (metadata->edges.back().size() !=
+        (metadata->node_counts[level] > 0 ? node_size_ : 0)) {
+      LOG(WARNING) << "Bad edge in node store metadata " << MetadataPath();
+      return false;
+    }
+  }
+  size_t annotation_size;
+  if (!(in >> annotation_size) || in.get() != '\n') {
+    LOG(WARNING) << "Truncated node store metadata in " << MetadataPath();
+    return false;
+  }
+  metadata->annotation.resize(annotation_size);
+  if (annotation_size > 0 &&
+      !in.read(&metadata->annotation[0], annotation_size)) {
+    LOG(WARNING) << "Truncated node store metadata in " << MetadataPath();
+    return false;
+  }
+  return true;
+}
+
+
+void MmapNodeStore::WriteMetadata() {
+  ++generation_;
+  std::ostringstream out;
+  out << kMetadataMagic << " " << kMetadataVersion << "\n"
+      << node_size_ << " " << levels_.size() << " " << generation_ << "\n";
+  for (const auto& level : levels_)
+    out << level.node_count << "\n";
+  for (const auto& level : levels_) {
+    if (level.node_count == 0) {
+      out << "-\n";
+    } else {
+      out << util::HexString(string(
+                 level.data + (level.node_count - 1) * node_size_,
+                 node_size_))
+          << "\n";
+    }
+  }
+  out << annotation_.size() << "\n" << annotation_;
+
+  const string tmp_file(
+      util::WriteTemporaryBinaryFile(dir_ + "/nodes.tmpXXXXXX", out.str()));
+  CHECK(!tmp_file.empty()) << "Failed to write node store metadata in "
+                           << dir_;
+  PCHECK(rename(tmp_file.c_str(), MetadataPath().c_str()) == 0);
+}
+
+
+}  // namespace cert_trans
@@ -0,0 +1,132 @@
+#ifndef CERT_TRANS_MERKLETREE_MMAP_NODE_STORE_H_
+#define CERT_TRANS_MERKLETREE_MMAP_NODE_STORE_H_
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "merkletree/node_store.h"
+
+namespace cert_trans {
+
+
+// A MerkleTreeNodeStore keeping each level in its own memory-mapped
+// file, so that very large trees are paged in and out by the kernel
+// instead of living on the heap. Files are grown by doubling (in
+// multiples of the page size), which keeps the cost of growth
+// amortized without ever copying the nodes around.
+//
+// The node counts are recorded in a small metadata file by Sync(), so
+// a store opened again on the same directory picks up the state as of
+// the last Sync() (nodes written afterwards are ignored).
+//
+// Other processes can map the same directory with OpenReadOnly(), to
+// share the nodes rather than keep a copy each. Each Sync() publishes a
+// new version of the store, which they pick up with Refresh(). Nodes
+// only ever change at the end of a level, so the metadata also holds
+// the last node of each level, as it was when published, and that is
+// what readers get for it: the writer may well be rewriting it.
+//
+// This class is thread-compatible, but not thread-safe.
+class MmapNodeStore : public MerkleTreeNodeStore {
+ public:
+  // Opens the store in |dir|, which must exist. If it holds a store
+  // with a different node size, or one that cannot be read back, it is
+  // replaced by an empty one.
+  MmapNodeStore(const std::string& dir, size_t node_size);
+  ~MmapNodeStore() override;
+
+  // Maps the store that another process keeps in |dir|, as of its
+  // last Sync(), or an empty one if there is none yet. The store
+  // cannot be changed, except by Refresh().
+  static std::unique_ptr<MmapNodeStore> OpenReadOnly(const std::string& dir,
+                                                     size_t node_size);
+
+  size_t NodeSize() const override {
+    return node_size_;
+  }
+  size_t LevelCount() const override {
+    return levels_.size();
+  }
+  size_t NodeCount(size_t level) const override;
+  const char* LevelData(size_t level) const override;
+  const char* NodeData(size_t level, size_t index) const override;
+  void Append(size_t level, const char* nodes, size_t count) override;
+  void SetNode(size_t level, size_t index, const char* node) override;
+  void Truncate(size_t level, size_t count) override;
+  void AddLevel() override;
+  void RemoveLevels(size_t level) override;
+  // The size of the mappings, which only take up memory as far as
+  // they are paged in.
+  size_t ByteSize() const override;
+
+  // Flush all the nodes to disk, then record the node counts, which
+  // publishes a new version of the store. |annotation| is published
+  // along with it, for the readers.
+  void Sync();
+  void Sync(const std::string& annotation);
+
+  // For a store opened with OpenReadOnly(): switches to the version
+  // last published, if it is newer than the one in use. Returns false
+  // if there is none, or if it cannot be read, in which case the store
+  // is left as it was.
+  bool Refresh();
+
+  // The annotation of the version in use.
+  const std::string& annotation() const {
+    return annotation_;
+  }
+
+ private:
+  struct Level {
+    int fd;
+    char* data;
+    // Size of the mapping, in bytes.
+    size_t capacity;
+    size_t node_count;
+    // First node written since the last Sync(), |node_count| if none:
+    // only the nodes from there on need to be flushed.
+    size_t dirty_from;
+    ino_t inode;
+  };
+
+  struct Metadata {
+    std::vector<size_t> node_counts;
+    // The last node of each level, empty for empty levels.
+    std::vector<std::string> edges;
+    uint64_t generation;
+    std::string annotation;
+  };
+
+  MmapNodeStore(const std::string& dir, size_t node_size, bool read_only);
+
+  std::string LevelPath(size_t level) const;
+  std::string MetadataPath() const;
+  // Opens, and maps, the file for |level|. Returns false if it is
+  // smaller than |node_count| nodes (or, read-only, if it is missing).
+  bool OpenLevel(size_t level, size_t node_count, Level* result) const;
+  void CloseLevel(Level* level) const;
+  // Make room for at least |node_count| nodes in |level|.
+  void Reserve(size_t level, size_t node_count);
+  bool ReadMetadata(Metadata* metadata) const;
+  void WriteMetadata();
+
+  const std::string dir_;
+  const size_t node_size_;
+  const size_t page_size_;
+  const bool read_only_;
+  std::vector<Level> levels_;
+  // Only used read-only, see Metadata.
+  std::vector<std::string> edges_;
+  // Of the version in use.
+  uint64_t generation_;
+  std::string annotation_;
+};
+
+
+}  // namespace cert_trans
+
+#endif  // CERT_TRANS_MERKLETREE_MMAP_NODE_STORE_H_
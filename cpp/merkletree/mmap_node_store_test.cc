@@ -0,0 +1,199 @@
+#include "merkletree/mmap_node_store.h"
+
+#include <gtest/gtest.h>
+#include <memory>
+#include <string>
+
+#include "merkletree/merkle_tree.h"
+#include "merkletree/node_store.h"
+#include "merkletree/serial_hasher.h"
+#include "util/test_db.h"
+#include "util/testing.h"
+#include "util/util.h"
+
+namespace cert_trans {
+namespace {
+
+using std::string;
+using std::to_string;
+using std::unique_ptr;
+
+const size_t kNodeSize = 32;
+
+
+class MmapNodeStoreTest : public ::testing::Test {
+ protected:
+  unique_ptr<MmapNodeStore> OpenStore() {
+    return unique_ptr<MmapNodeStore>(
+        new MmapNodeStore(tmp_.TmpStorageDir(), kNodeSize));
+  }
+
+  TmpStorage tmp_;
+};
+
+
+TEST_F(MmapNodeStoreTest, MatchesInMemoryTree) {
+  MerkleTree reference(unique_ptr<Sha256Hasher>(new Sha256Hasher));
+  MerkleTree tree(unique_ptr<Sha256Hasher>(new Sha256Hasher),
+                  unique_ptr<MerkleTreeNodeStore>(OpenStore().release()));
+
+  // Enough leaves to grow level 0 past its initial mapping.
+  for (int i = 0; i < 5000; ++i) {
+    const string leaf("leaf" + to_string(i));
+    EXPECT_EQ(reference.AddLeaf(leaf), tree.AddLeaf(leaf));
+    if (i % 97 == 0) {
+      EXPECT_EQ(reference.CurrentRoot(), tree.CurrentRoot());
+    }
+  }
+  EXPECT_EQ(reference.CurrentRoot(), tree.CurrentRoot());
+  EXPECT_EQ(reference.RootAtSnapshot(1234), tree.RootAtSnapshot(1234));
+  EXPECT_EQ(reference.PathToCurrentRoot(4321),
+            tree.PathToCurrentRoot(4321));
+  EXPECT_EQ(reference.SnapshotConsistency(17, 4999),
+            tree.SnapshotConsistency(17, 4999));
+}
+
+
+TEST_F(MmapNodeStoreTest, ReopenAfterSync) {
+  string root;
+  {
+    unique_ptr<MmapNodeStore> store(OpenStore());
+    MmapNodeStore* const raw_store(store.get());
+    MerkleTree tree(unique_ptr<Sha256Hasher>(new Sha256Hasher),
+                    unique_ptr<MerkleTreeNodeStore>(store.release()));
+    for (int i = 0; i < 1000; ++i)
+      tree.AddLeaf("leaf" + to_string(i));
+    root = tree.CurrentRoot();
+    raw_store->Sync();
+
+    // Not synced, so this leaf should not be there next time.
+    tree.AddLeaf("unsynced");
+  }
+
+  MerkleTree tree(unique_ptr<Sha256Hasher>(new Sha256Hasher),
+                  unique_ptr<MerkleTreeNodeStore>(OpenStore().release()));
+  EXPECT_EQ(1000U, tree.LeafCount());
+  EXPECT_EQ(root, tree.CurrentRoot());
+  EXPECT_EQ(1001U, tree.AddLeaf("leaf1000"));
+}
+
+
+TEST_F(MmapNodeStoreTest, MismatchedNodeSizeStartsEmpty) {
+  {
+    unique_ptr<MmapNodeStore> store(OpenStore());
+    store->AddLevel();
+    store->Append(0, string(kNodeSize, 'x').data(), 1);
+    store->Sync();
+  }
+
+  MmapNodeStore store(tmp_.TmpStorageDir(), kNodeSize + 1);
+  EXPECT_EQ(0U, store.LevelCount());
+}
+
+
+TEST_F(MmapNodeStoreTest, TruncateAndRemoveLevels) {
+  unique_ptr<MmapNodeStore> store(OpenStore());
+  store->AddLevel();
+  store->AddLevel();
+  const string node(kNodeSize, 'a');
+  for (int i = 0; i < 10; ++i)
+    store->Append(0, node.data(), 1);
+  store->Truncate(0, 4);
+  EXPECT_EQ(4U, store->NodeCount(0));
+  store->RemoveLevels(1);
+  EXPECT_EQ(1U, store->LevelCount());
+  store->Sync();
+
+  store = OpenStore();
+  ASSERT_EQ(1U, store->LevelCount());
+  EXPECT_EQ(4U, store->NodeCount(0));
+  EXPECT_EQ(node, string(store->LevelData(0), node.size()));
+}
+
+
+TEST_F(MmapNodeStoreTest, SyncKeepsChangesSinceLastSync) {
+  unique_ptr<MmapNodeStore> store(OpenStore());
+  store->AddLevel();
+  const string a(kNodeSize, 'a'), b(kNodeSize, 'b'), c(kNodeSize, 'c');
+  for (int i = 0; i < 300; ++i)
+    store->Append(0, a.data(), 1);
+  store->Sync();
+
+  // An older node, on an earlier page than the end of the level.
+  store->SetNode(0, 3, b.data());
+  store->Append(0, c.data(), 1);
+  store->Sync();
+  store->Sync();
+
+  store = OpenStore();
+  ASSERT_EQ(1U, store->LevelCount());
+  EXPECT_EQ(301U, store->NodeCount(0));
+  EXPECT_EQ(a, string(store->NodeData(0, 2), kNodeSize));
+  EXPECT_EQ(b, string(store->NodeData(0, 3), kNodeSize));
+  EXPECT_EQ(c, string(store->NodeData(0, 300), kNodeSize));
+}
+
+
+TEST_F(MmapNodeStoreTest, ReadOnlyFollowsPublishedVersions) {
+  unique_ptr<MmapNodeStore> writer_store(OpenStore());
+  MmapNodeStore* const raw_writer_store(writer_store.get());
+  MerkleTree writer(unique_ptr<Sha256Hasher>(new Sha256Hasher),
+                    unique_ptr<MerkleTreeNodeStore>(writer_store.release()));
+  MerkleTree reference(unique_ptr<Sha256Hasher>(new Sha256Hasher));
+
+  // Nothing published yet.
+  unique_ptr<MmapNodeStore> reader_store(
+      MmapNodeStore::OpenReadOnly(tmp_.TmpStorageDir(), kNodeSize));
+  MmapNodeStore* const raw_reader_store(reader_store.get());
+  MerkleTree reader(unique_ptr<Sha256Hasher>(new Sha256Hasher),
+                    unique_ptr<MerkleTreeNodeStore>(reader_store.release()));
+  EXPECT_EQ(0U, reader.LeafCount());
+  EXPECT_FALSE(raw_reader_store->Refresh());
+
+  for (int i = 0; i < 1000; ++i) {
+    writer.AddLeaf("leaf" + to_string(i));
+    reference.AddLeaf("leaf" + to_string(i));
+  }
+  writer.CurrentRoot();
+  raw_writer_store->Sync("first");
+
+  ASSERT_TRUE(raw_reader_store->Refresh());
+  EXPECT_FALSE(raw_reader_store->Refresh());
+  EXPECT_EQ("first", raw_reader_store->annotation());
+  ASSERT_TRUE(reader.ReloadNodes());
+  EXPECT_EQ(1000U, reader.LeafCount());
+  const string root(reference.CurrentRoot());
+  EXPECT_EQ(root, reader.CurrentRoot());
+
+  // The writer rewrites the last nodes of the levels as it goes on,
+  // which the reader does not see until they are published.
+  for (int i = 1000; i < 5000; ++i) {
+    writer.AddLeaf("leaf" + to_string(i));
+    reference.AddLeaf("leaf" + to_string(i));
+  }
+  writer.CurrentRoot();
+  EXPECT_EQ(root, reader.CurrentRoot());
+  EXPECT_EQ(reference.PathToRootAtSnapshot(999, 1000),
+            reader.PathToCurrentRoot(999));
+  EXPECT_EQ(reference.SnapshotConsistency(17, 1000),
+            reader.SnapshotConsistency(17, 1000));
+
+  raw_writer_store->Sync("second");
+  ASSERT_TRUE(raw_reader_store->Refresh());
+  EXPECT_EQ("second", raw_reader_store->annotation());
+  ASSERT_TRUE(reader.ReloadNodes());
+  EXPECT_EQ(5000U, reader.LeafCount());
+  EXPECT_EQ(reference.CurrentRoot(), reader.CurrentRoot());
+  EXPECT_EQ(reference.PathToCurrentRoot(4321),
+            reader.PathToCurrentRoot(4321));
+}
+
+
+}  // namespace
+}  // namespace cert_trans
+
+
+int main(int argc, char** argv) {
+  cert_trans::test::InitTesting(argv[0], &argc, &argv, true);
+  return RUN_ALL_TESTS();
+}
@@ -0,0 +1,73 @@
+#include "merkletree/node_store.h"
+
+#include <assert.h>
+
+namespace cert_trans {
+
+
+size_t MerkleTreeNodeStore::ByteSize() const {
+  size_t bytes(0);
+  for (size_t level = 0; level < LevelCount(); ++level)
+    bytes += NodeCount(level) * NodeSize();
+  return bytes;
+}
+
+
+InMemoryNodeStore::InMemoryNodeStore(size_t node_size)
+    : node_size_(node_size) {
+  assert(node_size_ > 0);
+}
+
+
+size_t InMemoryNodeStore::NodeCount(size_t level) const {
+  assert(level < levels_.size());
+  return levels_[level].size() / node_size_;
+}
+
+
+const char* InMemoryNodeStore::LevelData(size_t level) const {
+  assert(level < levels_.size());
+  return levels_[level].data();
+}
+
+
+void InMemoryNodeStore::Append(size_t level, const char* nodes,
+                               size_t count) {
+  assert(level < levels_.size());
+  levels_[level].append(nodes, count * node_size_);
+}
+
+
+void InMemoryNodeStore::SetNode(size_t level, size_t index,
+                                const char* node) {
+  assert(index < NodeCount(level));
+  levels_[level].replace(index * node_size_, node_size_, node, node_size_);
+}
+
+
+void InMemoryNodeStore::Truncate(size_t level, size_t count) {
+  assert(count <= NodeCount(level));
+  levels_[level].resize(count * node_size_);
+}
+
+
+void InMemoryNodeStore::AddLevel() {
+  levels_.push_back(Level());
+}
+
+
+void InMemoryNodeStore::RemoveLevels(size_t level) {
+  if (level < levels_.size())
+    levels_.resize(level);
+}
+
+
+size_t InMemoryNodeStore::ByteSize() const {
+  size_t bytes(levels_.capacity() * sizeof(Level));
+  for (const Level& level : levels_)
+    bytes += level.capacity();
+  return bytes;
+}
+
+
+}  // namespace cert_trans
@@ -0,0 +1,98 @@
+#ifndef CERT_TRANS_MERKLETREE_NODE_STORE_H_
+#define CERT_TRANS_MERKLETREE_NODE_STORE_H_
+
+#include <stddef.h>
+#include <string>
+#include <vector>
+
+#include "util/huge_pages.h"
+
+namespace cert_trans {
+
+// Storage for the nodes of a MerkleTree (see merkletree/merkle_tree.h),
+// organized in levels, leaves first. Each level is a contiguous array
+// of fixed-size nodes, so that implementations are free to keep it
+// anywhere addressable (the heap, a memory-mapped file...).
+class MerkleTreeNodeStore {
+ public:
+  MerkleTreeNodeStore() = default;
+  virtual ~MerkleTreeNodeStore() = default;
+  MerkleTreeNodeStore(const MerkleTreeNodeStore&) = delete;
+  MerkleTreeNodeStore& operator=(const MerkleTreeNodeStore&) = delete;
+
+  // Length of a node, in bytes.
+  virtual size_t NodeSize() const = 0;
+
+  // Number of levels currently allocated.
+  virtual size_t LevelCount() const = 0;
+
+  // Number of nodes in |level|, which must exist.
+  virtual size_t NodeCount(size_t level) const = 0;
+
+  // The packed nodes of |level|. The pointer is only valid until the
+  // next call to a non-const method.
+  virtual const char* LevelData(size_t level) const = 0;
+
+  // Node |index| of |level|, which must exist. The pointer is only
+  // valid until the next call to a non-const method. Stores that can
+  // serve some nodes from elsewhere than the level (see
+  // MmapNodeStore's read-only mode) override this.
+  virtual const char* NodeData(size_t level, size_t index) const {
+    return LevelData(level) + index * NodeSize();
+  }
+
+  // Append |count| packed nodes to |level|.
+  virtual void Append(size_t level, const char* nodes, size_t count) = 0;
+
+  // Overwrite node |index| of |level|, which must exist.
+  virtual void SetNode(size_t level, size_t index, const char* node) = 0;
+
+  // Shrink |level| to its first |count| nodes.
+  virtual void Truncate(size_t level, size_t count) = 0;
+
+  // Add an empty level on top of the existing ones.
+  virtual void AddLevel() = 0;
+
+  // Remove |level| and all the levels above it.
+  virtual void RemoveLevels(size_t level) = 0;
+
+  // Approximate number of bytes the levels take up in memory,
+  // including the room kept for growth.
+  virtual size_t ByteSize() const;
+};
+
+
+// The default node store, keeps everything on the heap, in huge pages
+// if --huge_pages asks for them (see util/huge_pages.h).
+class InMemoryNodeStore : public MerkleTreeNodeStore {
+ public:
+  explicit InMemoryNodeStore(size_t node_size);
+
+  size_t NodeSize() const override {
+    return node_size_;
+  }
+  size_t LevelCount() const override {
+    return levels_.size();
+  }
+  size_t NodeCount(size_t level) const override;
+  const char* LevelData(size_t level) const override;
+  void Append(size_t level, const char* nodes, size_t count) override;
+  void SetNode(size_t level, size_t index, const char* node) override;
+  void Truncate(size_t level, size_t count) override;
+  void AddLevel() override;
+  void RemoveLevels(size_t level) override;
+  size_t ByteSize() const override;
+
+ private:
+  typedef std::basic_string<char, std::char_traits<char>,
+                            util::HugePageAllocator<char>>
+      Level;
+
+  const size_t node_size_;
+  std::vector<Level> levels_;
+};
+
+
+}  // namespace cert_trans
+
+#endif  // CERT_TRANS_MERKLETREE_NODE_STORE_H_
@@ -0,0 +1,436 @@
+#include "merkletree/persistent_verifiable_map.h"
+
+#include <glog/logging.h>
+#include <algorithm>
+#include <iterator>
+
+#include "merkletree/serial_hasher.h"
+#include "util/util.h"
+
+using std::lock_guard;
+using std::min;
+using std::mutex;
+using std::next;
+using std::pair;
+using std::partition_point;
+using std::prev;
+using std::reverse;
+using std::string;
+using std::to_string;
+using std::unique_ptr;
+using std::vector;
+using util::Status;
+using util::StatusOr;
+
+namespace cert_trans {
+
+namespace {
+
+
+const char kNodePrefix[] = "node-";
+const char kRevisionPrefix[] = "revision-";
+const char kLatestRevisionKey[] = "latest-revision";
+const char kLeafNode = 'L';
+const char kInternalNode = 'I';
+
+
+void AppendUint64(uint64_t value, string* out) {
+  for (int i = 7; i >= 0; --i)
+    out->push_back(static_cast<char>((value >> (i * 8)) & 0xff));
+}
+
+
+// Reads a uint64_t at |*offset| in |in|, and moves past it.
+uint64_t ReadUint64(const string& in, size_t* offset) {
+  CHECK_LE(*offset + 8, in.size()) << "Truncated map store entry";
+  uint64_t value(0);
+  for (size_t i = 0; i < 8; ++i)
+    value = (value << 8) | static_cast<unsigned char>(in[(*offset)++]);
+  return value;
+}
+
+
+string ReadBytes(const string& in, size_t size, size_t* offset) {
+  CHECK_LE(*offset + size, in.size()) << "Truncated map store entry";
+  const string bytes(in, *offset, size);
+  *offset += size;
+  return bytes;
+}
+
+
+string IdKey(const char* prefix, uint64_t id) {
+  string bytes;
+  AppendUint64(id, &bytes);
+  return prefix + util::HexString(bytes);
+}
+
+
+}  // namespace
+
+
+const PersistentVerifiableMap::NodeId PersistentVerifiableMap::kNoNode;
+
+
+PersistentVerifiableMap::PersistentVerifiableMap(SerialHasher* hasher,
+                                                 MapStore* store,
+                                                 size_t cache_nodes)
+    : hasher_model_(CHECK_NOTNULL(hasher)),
+      treehasher_(unique_ptr<SerialHasher>(hasher->Create())),
+      null_hashes_(GetNullHashes(treehasher_)),
+      store_(CHECK_NOTNULL(store)),
+      cache_nodes_(cache_nodes),
+      latest_revision_(0),
+      node_reads_(0) {
+  CHECK_EQ(SparseMerkleTree::kDigestSizeBits / 8, treehasher_.DigestSize());
+  CHECK(ReadRevision(0, &latest_));
+
+  string latest;
+  if (store_->Get(kLatestRevisionKey, &latest)) {
+    const int64_t revision(std::stoll(latest));
+    CHECK_GT(revision, 0);
+    latest_revision_ = revision;
+    CHECK(ReadRevision(revision, &latest_))
+        << "Missing latest revision " << revision << " from the map store";
+  }
+  next_node_ = latest_.next_node;
+  LOG(INFO) << "Opened map at revision " << latest_revision_;
+}
+
+
+void PersistentVerifiableMap::Set(const string& key, const string& value) {
+  changes_[PathFromKey(key)] = value;
+}
+
+
+int64_t PersistentVerifiableMap::Commit() {
+  Revision revision(latest_);
+  if (!changes_.empty()) {
+    const Ref root(Apply(Ref{latest_.root, latest_.root_hash}, 0,
+                         changes_.begin(), changes_.end()));
+    revision.root = root.id;
+    revision.root_hash = root.hash;
+  }
+  revision.next_node = next_node_;
+
+  string record;
+  AppendUint64(revision.root, &record);
+  AppendUint64(revision.next_node, &record);
+  record.append(revision.root_hash);
+  // The revision goes last, once everything it refers to is there.
+  writes_.emplace_back(IdKey(kRevisionPrefix, latest_revision_ + 1), record);
+  writes_.emplace_back(kLatestRevisionKey, to_string(latest_revision_ + 1));
+  store_->Write(writes_);
+
+  writes_.clear();
+  changes_.clear();
+  latest_ = revision;
+  return ++latest_revision_;
+}
+
+
+StatusOr<string> PersistentVerifiableMap::RootAtRevision(
+    int64_t revision) const {
+  Revision result;
+  if (!ReadRevision(revision, &result))
+    return Status(util::error::NOT_FOUND, "No such revision.");
+  return result.root_hash;
+}
+
+
+StatusOr<string> PersistentVerifiableMap::Get(const string& key,
+                                              int64_t revision) const {
+  Revision result;
+  if (!ReadRevision(revision, &result))
+    return Status(util::error::NOT_FOUND, "No such revision.");
+
+  const Path path(PathFromKey(key));
+  NodeId id(result.root);
+  size_t level(0);
+  while (id != kNoNode) {
+    const NodePtr node(ReadNode(id));
+    if (FirstPathDifference(path, node->path, level, node->prefix_bits) <
+        node->prefix_bits)
+      break;
+    if (node->IsLeaf())
+      return node->value;
+    level = node->prefix_bits + 1;
+    id = node->children[PathBit(path, node->prefix_bits)];
+  }
+  return Status(util::error::NOT_FOUND, "No such entry.");
+}
+
+
+StatusOr<vector<string>> PersistentVerifiableMap::InclusionProof(
+    const string& key, int64_t revision) const {
+  Revision result;
+  if (!ReadRevision(revision, &result))
+    return Status(util::error::NOT_FOUND, "No such revision.");
+
+  const Path path(PathFromKey(key));
+  vector<string> proof;
+  proof.reserve(SparseMerkleTree::kDigestSizeBits);
+  // The stored node on |path| at or below the one fixing |bit| bits.
+  NodePtr node(result.root == kNoNode ? nullptr : ReadNode(result.root));
+  for (size_t bit = 0; bit < SparseMerkleTree::kDigestSizeBits; ++bit) {
+    // Record the sibling of the node fixing |bit| + 1 bits of |path|.
+    if (!node) {
+      proof.push_back(null_hashes_->at(bit));
+    } else if (bit == node->prefix_bits) {
+      const int side(PathBit(path, bit));
+      proof.push_back(node->child_hashes[1 - side]);
+      node = ReadNode(node->children[side]);
+    } else if (PathBit(node->path, bit) == PathBit(path, bit)) {
+      proof.push_back(null_hashes_->at(bit));
+    } else {
+      // |path| leaves the stored nodes here, for an empty subtree.
+      proof.push_back(HashAt(*node, bit + 1));
+      node.reset();
+    }
+  }
+  reverse(proof.begin(), proof.end());
+  return proof;
+}
+
+
+PersistentVerifiableMap::Path PersistentVerifiableMap::PathFromKey(
+    const string& key) const {
+  unique_ptr<SerialHasher> h(hasher_model_->Create());
+  h->Update(key);
+  return PathFromBytes(h->Final());
+}
+
+
+bool PersistentVerifiableMap::ReadRevision(int64_t revision,
+                                           Revision* result) const {
+  if (revision == 0) {
+    result->root = kNoNode;
+    result->root_hash =
+        treehasher_.HashChildren(null_hashes_->at(0), null_hashes_->at(0));
+    result->next_node = kNoNode + 1;
+    return true;
+  }
+  if (revision < 0 || revision > latest_revision_)
+    return false;
+
+  string record;
+  CHECK(store_->Get(IdKey(kRevisionPrefix, revision), &record))
+      << "Missing revision " << revision << " from the map store";
+  size_t offset(0);
+  result->root = ReadUint64(record, &offset);
+  result->next_node = ReadUint64(record, &offset);
+  result->root_hash = ReadBytes(record, treehasher_.DigestSize(), &offset);
+  return true;
+}
+
+
+PersistentVerifiableMap::NodePtr PersistentVerifiableMap::ReadNode(
+    NodeId id) const {
+  CHECK_NE(kNoNode, id);
+  {
+    lock_guard<mutex> lock(cache_lock_);
+    const auto it(cached_.find(id));
+    if (it != cached_.end()) {
+      lru_.splice(lru_.begin(), lru_, it->second);
+      return it->second->second;
+    }
+  }
+
+  string record;
+  CHECK(store_->Get(IdKey(kNodePrefix, id), &record))
+      << "Missing node " << id << " from the map store";
+  ++node_reads_;
+
+  const size_t node_size(treehasher_.DigestSize());
+  Node* const node(new Node);
+  const NodePtr result(node);
+  size_t offset(0);
+  const string type(ReadBytes(record, 1, &offset));
+  const string path(ReadBytes(record, node->path.size(), &offset));
+  std::copy(path.begin(), path.end(), node->path.begin());
+  if (type[0] == kLeafNode) {
+    node->prefix_bits = SparseMerkleTree::kDigestSizeBits;
+    node->leaf_hash = ReadBytes(record, node_size, &offset);
+    node->value = record.substr(offset);
+  } else {
+    CHECK_EQ(kInternalNode, type[0]) << "Corrupt node " << id;
+    node->prefix_bits = ReadUint64(record, &offset);
+    CHECK_LT(node->prefix_bits,
+             static_cast<size_t>(SparseMerkleTree::kDigestSizeBits));
+    for (int side = 0; side < 2; ++side) {
+      node->children[side] = ReadUint64(record, &offset);
+      node->child_hashes[side] = ReadBytes(record, node_size, &offset);
+    }
+  }
+  CacheNode(id, result);
+
+  return result;
+}
+
+
+void PersistentVerifiableMap::CacheNode(NodeId id,
+                                        const NodePtr& node) const {
+  lock_guard<mutex> lock(cache_lock_);
+  if (cache_nodes_ == 0)
+    return;
+
+  const auto it(cached_.find(id));
+  if (it != cached_.end()) {
+    // Someone else read it in the meantime.
+    lru_.splice(lru_.begin(), lru_, it->second);
+    return;
+  }
+  lru_.emplace_front(id, node);
+  cached_[id] = lru_.begin();
+  while (lru_.size() > cache_nodes_) {
+    cached_.erase(lru_.back().first);
+    lru_.pop_back();
+  }
+}
+
+
+PersistentVerifiableMap::Ref PersistentVerifiableMap::Apply(
+    const Ref& ref, size_t level, ChangeIterator begin, ChangeIterator end) {
+  CHECK(begin != end);
+  if (ref.id == kNoNode)
+    return Build(level, begin, end);
+
+  const NodePtr node(ReadNode(ref.id));
+  // The changes are sorted, so the first and the last are the ones
+  // that leave the path of |node| first.
+  size_t split(
+      min(FirstPathDifference(node->path, begin->first, level,
+                              node->prefix_bits),
+          FirstPathDifference(node->path, prev(end)->first, level,
+                              node->prefix_bits)));
+  // Must be called with |split| set to the bit the changes are split on.
+  const auto on_left([&split](const pair<const Path, string>& change) {
+    return PathBit(change.first, split) == 0;
+  });
+
+  if (split < node->prefix_bits) {
+    // Some of the changes branch off above |node|, which goes one level
+    // down, below a new internal node.
+    Node internal;
+    internal.path = node->path;
+    internal.prefix_bits = split;
+    const ChangeIterator middle(partition_point(begin, end, on_left));
+    const int node_side(PathBit(node->path, split));
+    for (int side = 0; side < 2; ++side) {
+      const ChangeIterator first(side == 0 ? begin : middle);
+      const ChangeIterator last(side == 0 ? middle : end);
+      Ref child;
+      if (side != node_side) {
+        child = Build(split + 1, first, last);
+      } else if (first == last) {
+        child = Ref{ref.id, HashAt(*node, split + 1)};
+      } else {
+        child = Apply(ref, split + 1, first, last);
+      }
+      internal.children[side] = child.id;
+      internal.child_hashes[side] = child.hash;
+    }
+    return WriteNode(&internal, level);
+  }
+
+  if (node->IsLeaf()) {
+    // Only one change can have the same path.
+    CHECK(next(begin) == end);
+    Node leaf(*node);
+    leaf.leaf_hash = treehasher_.HashLeaf(begin->second);
+    leaf.value = begin->second;
+    return WriteNode(&leaf, level);
+  }
+
+  Node internal(*node);
+  split = node->prefix_bits;
+  const ChangeIterator middle(partition_point(begin, end, on_left));
+  for (int side = 0; side < 2; ++side) {
+    const ChangeIterator first(side == 0 ? begin : middle);
+    const ChangeIterator last(side == 0 ? middle : end);
+    if (first == last)
+      continue;
+    const Ref child(Apply(Ref{node->children[side], node->child_hashes[side]},
+                          split + 1, first, last));
+    internal.children[side] = child.id;
+    internal.child_hashes[side] = child.hash;
+  }
+  return WriteNode(&internal, level);
+}
+
+
+PersistentVerifiableMap::Ref PersistentVerifiableMap::Build(
+    size_t level, ChangeIterator begin, ChangeIterator end) {
+  CHECK(begin != end);
+  Node node;
+  node.path = begin->first;
+  if (next(begin) == end) {
+    node.prefix_bits = SparseMerkleTree::kDigestSizeBits;
+    node.leaf_hash = treehasher_.HashLeaf(begin->second);
+    node.value = begin->second;
+    return WriteNode(&node, level);
+  }
+
+  // The changes are sorted and distinct, so this is where they first
+  // split in two.
+  node.prefix_bits =
+      FirstPathDifference(begin->first, prev(end)->first, level,
+                          SparseMerkleTree::kDigestSizeBits);
+  CHECK_LT(node.prefix_bits,
+           static_cast<size_t>(SparseMerkleTree::kDigestSizeBits));
+  const size_t split(node.prefix_bits);
+  const ChangeIterator middle(partition_point(
+      begin, end, [split](const pair<const Path, string>& change) {
+        return PathBit(change.first, split) == 0;
+      }));
+  const Ref left(Build(split + 1, begin, middle));
+  const Ref right(Build(split + 1, middle, end));
+  node.children[0] = left.id;
+  node.child_hashes[0] = left.hash;
+  node.children[1] = right.id;
+  node.child_hashes[1] = right.hash;
+  return WriteNode(&node, level);
+}
+
+
+PersistentVerifiableMap::Ref PersistentVerifiableMap::WriteNode(
+    Node* node, size_t level) {
+  string record(1, node->IsLeaf() ? kLeafNode : kInternalNode);
+  record.append(reinterpret_cast<const char*>(node->path.data()),
+                node->path.size());
+  if (node->IsLeaf()) {
+    record.append(node->leaf_hash);
+    record.append(node->value);
+  } else {
+    AppendUint64(node->prefix_bits, &record);
+    for (int side = 0; side < 2; ++side) {
+      AppendUint64(node->children[side], &record);
+      record.append(node->child_hashes[side]);
+    }
+  }
+
+  const NodeId id(next_node_++);
+  writes_.emplace_back(IdKey(kNodePrefix, id), record);
+  const NodePtr written(new Node(*node));
+  CacheNode(id, written);
+  return Ref{id, HashAt(*written, level)};
+}
+
+
+string PersistentVerifiableMap::HashAt(const Node& node, size_t bits) const {
+  CHECK_LE(bits, node.prefix_bits);
+  string hash(node.IsLeaf() ? node.leaf_hash
+                            : treehasher_.HashChildren(node.child_hashes[0],
+                                                       node.child_hashes[1]));
+  for (size_t b = node.prefix_bits; b > bits; --b) {
+    // The sibling is empty, and fixes |b| bits.
+    if (PathBit(node.path, b - 1) == 0) {
+      hash = treehasher_.HashChildren(hash, null_hashes_->at(b - 1));
+    } else {
+      hash = treehasher_.HashChildren(null_hashes_->at(b - 1), hash);
+    }
+  }
+  return hash;
+}
+
+
+}  // namespace cert_trans
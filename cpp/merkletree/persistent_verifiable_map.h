@@ -0,0 +1,154 @@
+#ifndef CERT_TRANS_MERKLETREE_PERSISTENT_VERIFIABLE_MAP_H_
+#define CERT_TRANS_MERKLETREE_PERSISTENT_VERIFIABLE_MAP_H_
+
+#include <stddef.h>
+#include <stdint.h>
+#include <atomic>
+#include <list>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+#include "merkletree/map_store.h"
+#include "merkletree/sparse_merkle_tree.h"
+#include "merkletree/tree_hasher.h"
+#include "util/statusor.h"
+
+namespace cert_trans {
+
+
+// A VerifiableMap (with the same roots and inclusion proofs) kept in a
+// MapStore rather than in memory, and versioned: changes are made with
+// Set(), then become a new revision with Commit(), and every revision
+// committed so far can be read from.
+//
+// The tree has the same shape as a SparseMerkleTree, but nodes are
+// never modified once written: a revision writes new copies of the
+// nodes on the paths to the keys it changes, which refer to the nodes
+// of earlier revisions for everything else. Each node records the
+// hashes of its children, so that a lookup or an inclusion proof reads
+// one node per stored level of the tree, and the nodes read are kept in
+// an LRU cache. Opening the map only reads the latest revision.
+//
+// The const methods can be called concurrently with each other, but
+// not with the others.
+class PersistentVerifiableMap {
+ public:
+  // Takes ownership of |hasher|, but not of |store|. Keeps up to
+  // |cache_nodes| nodes in memory.
+  PersistentVerifiableMap(SerialHasher* hasher, MapStore* store,
+                          size_t cache_nodes);
+  PersistentVerifiableMap(const PersistentVerifiableMap&) = delete;
+  PersistentVerifiableMap& operator=(const PersistentVerifiableMap&) = delete;
+
+  // The latest revision committed, 0 being the empty map.
+  int64_t LatestRevision() const {
+    return latest_revision_;
+  }
+
+  // Changes |key| in the next revision.
+  void Set(const std::string& key, const std::string& value);
+
+  // Writes out the changes made since the last call as a new revision,
+  // and returns it.
+  int64_t Commit();
+
+  // These return NOT_FOUND for a revision that is not committed yet.
+  util::StatusOr<std::string> RootAtRevision(int64_t revision) const;
+  util::StatusOr<std::string> Get(const std::string& key,
+                                  int64_t revision) const;
+  // As SparseMerkleTree::InclusionProof().
+  util::StatusOr<std::vector<std::string>> InclusionProof(
+      const std::string& key, int64_t revision) const;
+
+  // Number of nodes read from the store so far.
+  uint64_t NodeReads() const {
+    return node_reads_;
+  }
+
+ private:
+  typedef SparseMerkleTree::Path Path;
+  typedef uint64_t NodeId;
+  static const NodeId kNoNode = 0;
+
+  // As in SparseMerkleTree, but each internal node also has the hashes
+  // of its children, as they hang from it.
+  struct Node {
+    Path path;
+    size_t prefix_bits;
+    // For a leaf only.
+    std::string leaf_hash;
+    std::string value;
+    // For an internal node only.
+    NodeId children[2];
+    std::string child_hashes[2];
+
+    bool IsLeaf() const {
+      return prefix_bits == SparseMerkleTree::kDigestSizeBits;
+    }
+  };
+  typedef std::shared_ptr<const Node> NodePtr;
+  typedef std::list<std::pair<NodeId, NodePtr>> NodeList;
+
+  // A node as its parent sees it.
+  struct Ref {
+    NodeId id;
+    // The hash of the subtree, at the level the node hangs from.
+    std::string hash;
+  };
+
+  struct Revision {
+    NodeId root;
+    // The hash of the whole tree.
+    std::string root_hash;
+    // The first node id free after this revision.
+    NodeId next_node;
+  };
+
+  typedef std::map<Path, std::string>::const_iterator ChangeIterator;
+
+  Path PathFromKey(const std::string& key) const;
+  bool ReadRevision(int64_t revision, Revision* result) const;
+  NodePtr ReadNode(NodeId id) const;
+  // Returns the new version of |ref|, a subtree fixing |level| bits,
+  // with the changes in [begin, end) applied.
+  Ref Apply(const Ref& ref, size_t level, ChangeIterator begin,
+            ChangeIterator end);
+  // As above, for a subtree that was empty.
+  Ref Build(size_t level, ChangeIterator begin, ChangeIterator end);
+  // Queues |node| for writing with the next revision, hanging at
+  // |level|.
+  Ref WriteNode(Node* node, size_t level);
+  void CacheNode(NodeId id, const NodePtr& node) const;
+  // The hash of the subtree with |node| at the bottom, fixing |bits|
+  // bits.
+  std::string HashAt(const Node& node, size_t bits) const;
+
+  const std::unique_ptr<SerialHasher> hasher_model_;
+  const TreeHasher treehasher_;
+  const std::vector<std::string>* const null_hashes_;
+  MapStore* const store_;
+  const size_t cache_nodes_;
+
+  int64_t latest_revision_;
+  Revision latest_;
+  std::map<Path, std::string> changes_;
+  // The nodes and revision of the next Commit().
+  std::vector<std::pair<std::string, std::string>> writes_;
+  NodeId next_node_;
+
+  mutable std::mutex cache_lock_;
+  // Most recently used first.
+  mutable NodeList lru_;
+  mutable std::unordered_map<NodeId, NodeList::iterator> cached_;
+  mutable std::atomic<uint64_t> node_reads_;
+};
+
+
+}  // namespace cert_trans
+
+#endif  // CERT_TRANS_MERKLETREE_PERSISTENT_VERIFIABLE_MAP_H_
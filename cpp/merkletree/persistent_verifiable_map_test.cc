@@ -0,0 +1,160 @@
+#include "merkletree/persistent_verifiable_map.h"
+
+#include <glog/logging.h>
+#include <gtest/gtest.h>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "merkletree/map_store.h"
+#include "merkletree/serial_hasher.h"
+#include "merkletree/verifiable_map.h"
+#include "util/status_test_util.h"
+#include "util/testing.h"
+#include "util/util.h"
+
+namespace cert_trans {
+namespace {
+
+using std::string;
+using std::to_string;
+using std::unique_ptr;
+using util::StatusOr;
+using util::testing::StatusIs;
+using util::ToBase64;
+
+
+class PersistentVerifiableMapTest : public testing::Test {
+ protected:
+  unique_ptr<PersistentVerifiableMap> OpenMap(size_t cache_nodes) {
+    return unique_ptr<PersistentVerifiableMap>(
+        new PersistentVerifiableMap(new Sha256Hasher, &store_, cache_nodes));
+  }
+
+  InMemoryMapStore store_;
+};
+
+
+TEST_F(PersistentVerifiableMapTest, EmptyMap) {
+  const unique_ptr<PersistentVerifiableMap> map(OpenMap(100));
+  VerifiableMap reference(new Sha256Hasher);
+  EXPECT_EQ(0, map->LatestRevision());
+  EXPECT_EQ(ToBase64(reference.CurrentRoot()),
+            ToBase64(map->RootAtRevision(0).ValueOrDie()));
+  EXPECT_THAT(map->Get("key", 0).status(),
+              StatusIs(util::error::NOT_FOUND));
+  EXPECT_THAT(map->RootAtRevision(1).status(),
+              StatusIs(util::error::NOT_FOUND));
+}
+
+
+TEST_F(PersistentVerifiableMapTest, MatchesVerifiableMap) {
+  const unique_ptr<PersistentVerifiableMap> map(OpenMap(100));
+  VerifiableMap reference(new Sha256Hasher);
+
+  for (int revision = 1; revision <= 5; ++revision) {
+    // Overwrite some of the keys of the previous revisions too.
+    for (int i = 0; i < 200; ++i) {
+      const string key(to_string(i * revision % 500));
+      const string value(to_string(revision) + "/" + to_string(i));
+      map->Set(key, value);
+      reference.Set(key, value);
+    }
+    EXPECT_EQ(revision, map->Commit());
+
+    EXPECT_EQ(ToBase64(reference.CurrentRoot()),
+              ToBase64(map->RootAtRevision(revision).ValueOrDie()));
+    for (int i = 0; i < 500; i += 7) {
+      const string key(to_string(i));
+      const StatusOr<string> expected(reference.Get(key));
+      const StatusOr<string> value(map->Get(key, revision));
+      ASSERT_EQ(expected.ok(), value.ok()) << key;
+      if (expected.ok()) {
+        EXPECT_EQ(expected.ValueOrDie(), value.ValueOrDie());
+      }
+      EXPECT_EQ(reference.InclusionProof(key),
+                map->InclusionProof(key, revision).ValueOrDie());
+    }
+  }
+}
+
+
+TEST_F(PersistentVerifiableMapTest, KeepsPastRevisions) {
+  const unique_ptr<PersistentVerifiableMap> map(OpenMap(100));
+  map->Set("a", "1");
+  map->Set("b", "1");
+  EXPECT_EQ(1, map->Commit());
+  const string root1(map->RootAtRevision(1).ValueOrDie());
+  map->Set("a", "2");
+  EXPECT_EQ(2, map->Commit());
+
+  EXPECT_EQ(root1, map->RootAtRevision(1).ValueOrDie());
+  EXPECT_NE(root1, map->RootAtRevision(2).ValueOrDie());
+  EXPECT_EQ("1", map->Get("a", 1).ValueOrDie());
+  EXPECT_EQ("2", map->Get("a", 2).ValueOrDie());
+  EXPECT_EQ("1", map->Get("b", 2).ValueOrDie());
+  EXPECT_THAT(map->Get("a", 3).status(), StatusIs(util::error::NOT_FOUND));
+
+  // Nothing changed, but that is still a new revision.
+  EXPECT_EQ(3, map->Commit());
+  EXPECT_EQ(map->RootAtRevision(2).ValueOrDie(),
+            map->RootAtRevision(3).ValueOrDie());
+}
+
+
+TEST_F(PersistentVerifiableMapTest, Reopen) {
+  VerifiableMap reference(new Sha256Hasher);
+  {
+    const unique_ptr<PersistentVerifiableMap> map(OpenMap(100));
+    for (int i = 0; i < 100; ++i) {
+      map->Set(to_string(i), "value");
+      reference.Set(to_string(i), "value");
+    }
+    map->Commit();
+    // Never committed.
+    map->Set("lost", "value");
+  }
+
+  const unique_ptr<PersistentVerifiableMap> map(OpenMap(100));
+  EXPECT_EQ(1, map->LatestRevision());
+  EXPECT_EQ(ToBase64(reference.CurrentRoot()),
+            ToBase64(map->RootAtRevision(1).ValueOrDie()));
+  EXPECT_THAT(map->Get("lost", 1).status(),
+              StatusIs(util::error::NOT_FOUND));
+
+  map->Set("new", "value");
+  reference.Set("new", "value");
+  EXPECT_EQ(2, map->Commit());
+  EXPECT_EQ(ToBase64(reference.CurrentRoot()),
+            ToBase64(map->RootAtRevision(2).ValueOrDie()));
+  EXPECT_EQ("value", map->Get("17", 2).ValueOrDie());
+}
+
+
+TEST_F(PersistentVerifiableMapTest, ProofsReadOneNodePerLevel) {
+  {
+    const unique_ptr<PersistentVerifiableMap> map(OpenMap(0));
+    for (int i = 0; i < 4096; ++i)
+      map->Set(to_string(i), "value");
+    map->Commit();
+  }
+
+  const unique_ptr<PersistentVerifiableMap> map(OpenMap(0));
+  for (int i = 0; i < 100; ++i) {
+    const uint64_t reads(map->NodeReads());
+    EXPECT_TRUE(map->InclusionProof(to_string(i), 1).ok());
+    // The keys are random, so with 4096 of them a path has about 12
+    // stored nodes.
+    EXPECT_LT(map->NodeReads() - reads, 30U);
+  }
+}
+
+
+}  // namespace
+}  // namespace cert_trans
+
+
+int main(int argc, char** argv) {
+  cert_trans::test::InitTesting(argv[0], &argc, &argv, true);
+  return RUN_ALL_TESTS();
+}
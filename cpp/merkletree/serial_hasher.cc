@@ -2,12 +2,32 @@
 
 #include <openssl/sha.h>
 #include <stddef.h>
+#include <string.h>
 
 using std::string;
 using std::unique_ptr;
 
 const size_t Sha256Hasher::kDigestSize = SHA256_DIGEST_LENGTH;
 
+void SerialHasher::Update(const char* data, size_t size) {
+  Update(string(data, size));
+}
+
+void SerialHasher::Final(char* digest) {
+  const string result(Final());
+  memcpy(digest, result.data(), result.size());
+}
+
+void SerialHasher::HashBatch(const char* messages, size_t message_size,
+                             size_t count, char* digests) {
+  const size_t digest_size(DigestSize());
+  for (size_t i = 0; i < count; ++i) {
+    Reset();
+    Update(string(messages + i * message_size, message_size));
+    memcpy(digests + i * digest_size, Final().data(), digest_size);
+  }
+}
+
 Sha256Hasher::Sha256Hasher() : initialized_(false) {
 }
 
@@ -17,26 +37,46 @@ void Sha256Hasher::Reset() {
 }
 
 void Sha256Hasher::Update(const std::string& data) {
+  Update(data.data(), data.size());
+}
+
+void Sha256Hasher::Update(const char* data, size_t size) {
   if (!initialized_)
     Reset();
 
-  SHA256_Update(&ctx_, data.data(), data.size());
+  SHA256_Update(&ctx_, data, size);
 }
 
 string Sha256Hasher::Final() {
+  string hash(SHA256_DIGEST_LENGTH, '\0');
+  Final(&hash[0]);
+  return hash;
+}
+
+void Sha256Hasher::Final(char* digest) {
   if (!initialized_)
     Reset();
 
-  unsigned char hash[SHA256_DIGEST_LENGTH];
-  SHA256_Final(hash, &ctx_);
+  SHA256_Final(reinterpret_cast<unsigned char*>(digest), &ctx_);
   initialized_ = false;
-  return string(reinterpret_cast<char*>(hash), SHA256_DIGEST_LENGTH);
 }
 
 unique_ptr<SerialHasher> Sha256Hasher::Create() const {
   return unique_ptr<SerialHasher>(new Sha256Hasher);
 }
 
+void Sha256Hasher::HashBatch(const char* messages, size_t message_size,
+                             size_t count, char* digests) {
+  // The one-shot interface avoids all the copies and allocations of
+  // going through Update() and Final(). OpenSSL picks the fastest
+  // implementation for the CPU (SHA extensions, AVX2...) by itself.
+  for (size_t i = 0; i < count; ++i) {
+    SHA256(reinterpret_cast<const unsigned char*>(messages) + i * message_size,
+           message_size,
+           reinterpret_cast<unsigned char*>(digests) + i * kDigestSize);
+  }
+}
+
 // static
 string Sha256Hasher::Sha256Digest(const string& data) {
   Sha256Hasher hasher;
@@ -24,11 +24,28 @@ class SerialHasher {
   // Update the hash context with (binary) data.
   virtual void Update(const std::string& data) = 0;
 
+  // As above, without requiring a std::string. The default
+  // implementation copies the data into one; subclasses can do better.
+  virtual void Update(const char* data, size_t size);
+
   // Finalize the hash context and return the binary digest blob.
   virtual std::string Final() = 0;
 
+  // As above, but writes the DigestSize() bytes of the digest to
+  // |digest| instead of allocating a string.
+  virtual void Final(char* digest);
+
   // A virtual constructor, creates a new instance of the same type.
   virtual std::unique_ptr<SerialHasher> Create() const = 0;
+
+  // Hash |count| messages of |message_size| bytes each, laid out back
+  // to back in |messages|, writing their digests back to back to
+  // |digests| (which must have room for |count| * DigestSize() bytes).
+  // The context does not need to be reset before or after. The default
+  // implementation goes through Update() and Final() for each message;
+  // subclasses can do better.
+  virtual void HashBatch(const char* messages, size_t message_size,
+                         size_t count, char* digests);
 };
 
 class Sha256Hasher : public SerialHasher {
@@ -43,8 +60,12 @@ class Sha256Hasher : public SerialHasher {
 
   void Reset();
   void Update(const std::string& data);
+  void Update(const char* data, size_t size);
   std::string Final();
+  void Final(char* digest);
   std::unique_ptr<SerialHasher> Create() const;
+  void HashBatch(const char* messages, size_t message_size, size_t count,
+                 char* digests);
 
   // Create a new hasher and call Reset(), Update(), and Final().
   static std::string Sha256Digest(const std::string& data);
@@ -107,6 +107,47 @@ TYPED_TEST(SerialHasherTest, Create) {
   }
 }
 
+TYPED_TEST(SerialHasherTest, HashBatch) {
+  // Messages of the same size, back to back.
+  const size_t kMessageSize = 65;
+  const size_t kMessageCount = 10;
+  string messages;
+  for (size_t i = 0; i < kMessageCount; ++i)
+    messages.append(kMessageSize, static_cast<char>(i));
+
+  const size_t digest_size(this->hasher_->DigestSize());
+  string digests(kMessageCount * digest_size, '\0');
+  this->hasher_->HashBatch(messages.data(), kMessageSize, kMessageCount,
+                           &digests[0]);
+  for (size_t i = 0; i < kMessageCount; ++i) {
+    this->hasher_->Reset();
+    this->hasher_->Update(messages.substr(i * kMessageSize, kMessageSize));
+    EXPECT_EQ(H(this->hasher_->Final()),
+              H(digests.substr(i * digest_size, digest_size)));
+  }
+
+  // This must also work at the base class level.
+  string base_digests(kMessageCount * digest_size, '\0');
+  this->hasher_->SerialHasher::HashBatch(messages.data(), kMessageSize,
+                                         kMessageCount, &base_digests[0]);
+  EXPECT_EQ(H(digests), H(base_digests));
+}
+
+TYPED_TEST(SerialHasherTest, BufferUpdateAndFinal) {
+  for (size_t i = 0; this->test_vectors_[i].input != NULL; ++i) {
+    const string input(S(this->test_vectors_[i].input,
+                         this->test_vectors_[i].input_length));
+    this->hasher_->Reset();
+    // Split the input to exercise repeated updates.
+    const size_t half = input.size() / 2;
+    this->hasher_->Update(input.data(), half);
+    this->hasher_->Update(input.data() + half, input.size() - half);
+    string digest(this->hasher_->DigestSize(), '\0');
+    this->hasher_->Final(&digest[0]);
+    EXPECT_STREQ(this->test_vectors_[i].output, H(digest).c_str());
+  }
+}
+
 TEST(Sha256Test, StaticDigest) {
   string input, output, digest;
 
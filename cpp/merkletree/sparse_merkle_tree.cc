@@ -2,18 +2,23 @@
 
 #include <stddef.h>
 #include <algorithm>
+#include <memory>
+#include <sstream>
 #include <vector>
 
 #include "merkletree/merkle_tree_math.h"
+#include "util/thread_pool.h"
 #include "util/util.h"
 
-using std::make_pair;
+using cert_trans::RunAll;
+using std::copy;
+using std::min;
 using std::ostream;
 using std::ostringstream;
+using std::pair;
 using std::reverse;
 using std::string;
 using std::unique_ptr;
-using std::unordered_map;
 using std::vector;
 
 
@@ -33,74 +38,164 @@ const vector<string>* GetNullHashes(const TreeHasher& hasher) {
 }
 
 
+namespace {
+
+
+// Number of leaves hashed by each task in SetLeaves().
+const size_t kHashChunkSize = 1024;
+// How many stored nodes down from the root CurrentRoot() goes to find
+// the subtrees to recalculate in parallel, giving up to 2^6 tasks.
+const size_t kParallelDepth = 6;
+
+
+}  // namespace
+
+
+const SparseMerkleTree::NodeIndex SparseMerkleTree::kNoNode;
+
+
 SparseMerkleTree::SparseMerkleTree(SerialHasher* hasher)
+    : SparseMerkleTree(hasher, nullptr) {
+}
+
+
+SparseMerkleTree::SparseMerkleTree(SerialHasher* hasher,
+                                   cert_trans::ThreadPool* pool)
     : treehasher_(unique_ptr<SerialHasher>(hasher)),
-      null_hashes_(GetNullHashes(treehasher_)) {
+      null_hashes_(GetNullHashes(treehasher_)),
+      pool_(pool),
+      root_(kNoNode) {
+  CHECK_EQ(sizeof(Hash), treehasher_.DigestSize());
 }
 
 
-void SparseMerkleTree::EnsureHaveLevel(size_t level) {
-  if (tree_.size() < (level + 1)) {
-    tree_.resize(level + 1);
-  }
+SparseMerkleTree::NodeIndex SparseMerkleTree::NewNode(const Path& path,
+                                                      size_t level,
+                                                      size_t prefix_bits) {
+  CHECK_LT(nodes_.size(), static_cast<size_t>(kNoNode));
+  nodes_.emplace_back();
+  Node* const node(&nodes_.back());
+  node->path = path;
+  node->children[0] = node->children[1] = kNoNode;
+  node->level = level;
+  node->prefix_bits = prefix_bits;
+  node->dirty = true;
+  return nodes_.size() - 1;
+}
+
+
+SparseMerkleTree::NodeIndex SparseMerkleTree::NewLeaf(
+    const Path& path, size_t level, const string& leaf_hash) {
+  const NodeIndex index(NewNode(path, level, kDigestSizeBits));
+  copy(leaf_hash.begin(), leaf_hash.end(), nodes_[index].leaf_hash.begin());
+  return index;
 }
 
 
 void SparseMerkleTree::SetLeaf(const Path& path, const string& data) {
   CHECK_EQ(treehasher_.DigestSize(), path.size());
+  SetLeafHash(path, treehasher_.HashLeaf(data));
+}
+
+
+void SparseMerkleTree::SetLeaves(const vector<pair<Path, string>>& leaves) {
+  vector<string> leaf_hashes(leaves.size());
+  const auto hash_chunk([this, &leaves, &leaf_hashes](size_t chunk) {
+    // The tree's own hasher is locked on every call, so each task gets
+    // its own.
+    const unique_ptr<TreeHasher> hasher(treehasher_.Clone());
+    const size_t begin(chunk * kHashChunkSize);
+    const size_t end(min(begin + kHashChunkSize, leaves.size()));
+    for (size_t i(begin); i < end; ++i) {
+      leaf_hashes[i] = hasher->HashLeaf(leaves[i].second);
+    }
+  });
+  const size_t chunks((leaves.size() + kHashChunkSize - 1) / kHashChunkSize);
+  if (pool_ && chunks > 1) {
+    RunAll(pool_, chunks, hash_chunk);
+  } else {
+    for (size_t chunk(0); chunk < chunks; ++chunk) {
+      hash_chunk(chunk);
+    }
+  }
+
+  // A stable sort keeps the later of two leaves with the same path last,
+  // so that it wins.
+  vector<size_t> order(leaves.size());
+  for (size_t i(0); i < order.size(); ++i) {
+    order[i] = i;
+  }
+  std::stable_sort(order.begin(), order.end(),
+                   [&leaves](size_t a, size_t b) {
+                     return leaves[a].first < leaves[b].first;
+                   });
+  for (const size_t i : order) {
+    SetLeafHash(leaves[i].first, leaf_hashes[i]);
+  }
+}
+
+
+void SparseMerkleTree::SetLeafHash(const Path& path,
+                                   const string& leaf_hash) {
   // Mark the tree dirty:
   root_hash_.clear();
-  string leaf_hash(treehasher_.HashLeaf(data));
-
-  IndexType node_index(0);
-  for (int depth(0); depth <= kDigestSizeBits; ++depth) {
-    node_index += PathBit(path, depth);
-    EnsureHaveLevel(depth);
-    auto it(tree_[depth].find(node_index));
-    if (it == tree_[depth].end()) {
-      CHECK(tree_[depth]
-                .emplace(make_pair(node_index, TreeNode(path, leaf_hash)))
-                .second);
-      return;
-    } else if (it->second.type_ == TreeNode::INTERNAL) {
-      // Mark the internal node hash dirty
-      it->second.hash_.clear();
-    } else if (*it->second.path_ == path) {
+
+  // Going down from the root, the node at |index| hangs from side |side|
+  // of |parent|, fixing |level| bits of |path|.
+  NodeIndex parent(kNoNode);
+  int side(0);
+  size_t level(0);
+  NodeIndex index(root_);
+  while (index != kNoNode) {
+    Node& node(nodes_[index]);
+    // Mark the node hash dirty
+    node.dirty = true;
+    const size_t split(
+        FirstPathDifference(path, node.path, level, node.prefix_bits));
+    if (split < node.prefix_bits) {
+      // restructure: the new leaf and the existing node go one level below
+      // a new INTERNAL node, which takes the place of the latter.
+      const int node_side(PathBit(node.path, split));
+      node.level = split + 1;
+      const NodeIndex leaf(NewLeaf(path, split + 1, leaf_hash));
+      const NodeIndex internal(NewNode(path, level, split));
+      nodes_[internal].children[node_side] = index;
+      nodes_[internal].children[1 - node_side] = leaf;
+      index = internal;
+      break;
+    }
+    if (node.IsLeaf()) {
       // replacement
-      CHECK_EQ(TreeNode::LEAF, it->second.type_);
-      it->second.hash_ = std::move(leaf_hash);
+      copy(leaf_hash.begin(), leaf_hash.end(), node.leaf_hash.begin());
       return;
-    } else {
-      // restructure: push the existing node down a level and replace this one
-      // with an INTERNAL node
-      CHECK_LT(depth, kDigestSizeBits);
-      EnsureHaveLevel(depth + 1);
-      IndexType child_index((node_index << 1) +
-                            PathBit(*it->second.path_, depth + 1));
-      CHECK(tree_[depth + 1]
-                .emplace(make_pair(child_index, std::move(it->second)))
-                .second);
-      it->second.type_ = TreeNode::INTERNAL;
-      it->second.hash_.clear();
     }
-    node_index <<= 1;
+    parent = index;
+    side = PathBit(path, node.prefix_bits);
+    level = node.prefix_bits + 1;
+    index = node.children[side];
+    // INTERNAL nodes always have both children.
+    CHECK_NE(kNoNode, index);
+  }
+
+  if (index == kNoNode) {
+    // Empty tree.
+    index = NewLeaf(path, 0, leaf_hash);
+  }
+  if (parent == kNoNode) {
+    root_ = index;
+  } else {
+    nodes_[parent].children[side] = index;
   }
-  LOG(FATAL) << "Failed to set " << path << " to " << data;
 }
 
 
-void SparseMerkleTree::DumpTree(ostream* os, size_t depth,
-                                IndexType index) const {
-  if (tree_.size() <= depth) {
-    return;
-  }
-  const string indent((depth + 1) * 2, '-');
-  for (int side(0); side < 2; ++side) {
-    auto child(tree_[depth].find(index + side));
-    if (child != tree_[depth].end()) {
-      *os << indent << side << ": " << child->second.DebugString() << "\n";
-      DumpTree(os, depth + 1, (index + side) << 1);
-    }
+void SparseMerkleTree::DumpTree(ostream* os, NodeIndex index) const {
+  const Node& node(nodes_[index]);
+  *os << string((node.level + 1) * 2, '-') << " " << NodeDebugString(node)
+      << "\n";
+  if (!node.IsLeaf()) {
+    DumpTree(os, node.children[0]);
+    DumpTree(os, node.children[1]);
   }
 }
 
@@ -108,92 +203,229 @@ void SparseMerkleTree::DumpTree(ostream* os, size_t depth,
 string SparseMerkleTree::Dump() const {
   ostringstream ret;
   ret << "\nTree [Root: " << util::ToBase64(root_hash_) << "]:\n";
-  if (!tree_.empty()) {
-    DumpTree(&ret, 0, 0);
+  if (root_ != kNoNode) {
+    DumpTree(&ret, root_);
   }
   return ret.str();
 }
 
 
-string SparseMerkleTree::CalculateSubtreeHash(size_t depth, IndexType index) {
-  if (tree_.size() <= depth) {
-    return null_hashes_->at(depth);
-  }
-
-  auto it(tree_[depth].find(index));
-  if (it != tree_[depth].end()) {
-    switch (it->second.type_) {
-      case TreeNode::INTERNAL: {
-        if (!it->second.hash_.empty()) {
-          return it->second.hash_;
-        }
-        IndexType left_child_index(index << 1);
-        const string left(CalculateSubtreeHash(depth + 1, left_child_index));
-        const string right(
-            CalculateSubtreeHash(depth + 1, left_child_index + 1));
-        it->second.hash_.assign(treehasher_.HashChildren(left, right));
-        return it->second.hash_;
-      }
-
-      case TreeNode::LEAF: {
-        string ret(it->second.hash_);
-        const int64_t signed_depth(depth);
-        CHECK_LE(0, signed_depth);
-        for (int i(kDigestSizeBits - 1); i > signed_depth; --i) {
-          if (PathBit(*(it->second.path_), i) == 0) {
-            ret = treehasher_.HashChildren(ret, null_hashes_->at(i));
-          } else {
-            ret = treehasher_.HashChildren(null_hashes_->at(i), ret);
-          }
-        }
-        // TODO(alcutter): maybe cache this?
-        return ret;
-      }
+void SparseMerkleTree::HashUp(const Path& path, size_t from, size_t to,
+                              const TreeHasher& hasher, Hash* hash) const {
+  for (size_t bits(from); bits > to; --bits) {
+    if (PathBit(path, bits - 1) == 0) {
+      hasher.HashChildren(hash->data(), NullHash(bits), hash->data());
+    } else {
+      hasher.HashChildren(NullHash(bits), hash->data(), hash->data());
+    }
+  }
+}
+
+
+SparseMerkleTree::Hash SparseMerkleTree::HashAt(
+    NodeIndex index, size_t bits, const TreeHasher& hasher) const {
+  const Node& node(nodes_[index]);
+  CHECK_LE(bits, node.prefix_bits);
+  Hash hash;
+  if (node.IsLeaf()) {
+    hash = node.leaf_hash;
+  } else {
+    const Node& left(nodes_[node.children[0]]);
+    const Node& right(nodes_[node.children[1]]);
+    CHECK(!left.dirty && !right.dirty);
+    hasher.HashChildren(left.hash.data(), right.hash.data(), hash.data());
+  }
+  HashUp(node.path, node.prefix_bits, bits, hasher, &hash);
+  return hash;
+}
+
+
+const SparseMerkleTree::Hash& SparseMerkleTree::UpdateHash(
+    NodeIndex index, const TreeHasher& hasher) {
+  Node& node(nodes_[index]);
+  if (node.dirty) {
+    if (!node.IsLeaf()) {
+      UpdateHash(node.children[0], hasher);
+      UpdateHash(node.children[1], hasher);
     }
-    LOG(FATAL) << "Unknown node type " << it->second.type_ << " !";
+    node.hash = HashAt(index, node.level, hasher);
+    node.dirty = false;
   }
+  return node.hash;
+}
 
-  return null_hashes_->at(depth);
+
+void SparseMerkleTree::DirtySubtrees(NodeIndex index, size_t depth,
+                                     vector<NodeIndex>* subtrees) const {
+  const Node& node(nodes_[index]);
+  if (!node.dirty) {
+    return;
+  }
+  if (depth == 0 || node.IsLeaf()) {
+    subtrees->push_back(index);
+    return;
+  }
+  DirtySubtrees(node.children[0], depth - 1, subtrees);
+  DirtySubtrees(node.children[1], depth - 1, subtrees);
+}
+
+
+void SparseMerkleTree::UpdateHashes() {
+  if (root_ == kNoNode) {
+    return;
+  }
+  if (pool_) {
+    // The subtrees do not share any node, so they can be done at the
+    // same time, leaving only the few nodes above them.
+    vector<NodeIndex> subtrees;
+    DirtySubtrees(root_, kParallelDepth, &subtrees);
+    if (subtrees.size() > 1) {
+      RunAll(pool_, subtrees.size(), [this, &subtrees](size_t i) {
+        const unique_ptr<TreeHasher> hasher(treehasher_.Clone());
+        UpdateHash(subtrees[i], *hasher);
+      });
+    }
+  }
+  UpdateHash(root_, treehasher_);
 }
 
 
 string SparseMerkleTree::CurrentRoot() {
   if (root_hash_.empty()) {
-    root_hash_ = treehasher_.HashChildren(CalculateSubtreeHash(0, 0),
-                                          CalculateSubtreeHash(0, 1));
+    if (root_ == kNoNode) {
+      root_hash_ = treehasher_.HashChildren(null_hashes_->at(0),
+                                            null_hashes_->at(0));
+    } else {
+      UpdateHashes();
+      const Hash& hash(nodes_[root_].hash);
+      root_hash_.assign(hash.data(), hash.size());
+    }
   }
   return root_hash_;
 }
 
 
-std::vector<string> SparseMerkleTree::InclusionProof(const Path& path) {
-  // TODO(alcutter): implement
-  LOG(FATAL) << "Not implemented.";
+vector<string> SparseMerkleTree::InclusionProof(const Path& path) {
+  // Bring the hashes of all the stored nodes up to date.
+  CurrentRoot();
+
+  vector<string> proof;
+  proof.reserve(kDigestSizeBits);
+  // The stored node on |path| at or below the one fixing |bit| bits.
+  NodeIndex index(root_);
+  for (size_t bit(0); bit < kDigestSizeBits; ++bit) {
+    // Record the sibling of the node fixing |bit| + 1 bits of |path|.
+    if (index == kNoNode) {
+      proof.emplace_back(NullHash(bit + 1), NodeSize());
+      continue;
+    }
+    const Node& node(nodes_[index]);
+    if (bit == node.prefix_bits) {
+      const int side(PathBit(path, bit));
+      const Hash& sibling(nodes_[node.children[1 - side]].hash);
+      proof.emplace_back(sibling.data(), sibling.size());
+      index = node.children[side];
+    } else if (PathBit(node.path, bit) == PathBit(path, bit)) {
+      // One of the levels skipped over by |node|.
+      proof.emplace_back(NullHash(bit + 1), NodeSize());
+    } else {
+      // |path| leaves the stored nodes here, for an empty subtree.
+      const Hash sibling(HashAt(index, bit + 1, treehasher_));
+      proof.emplace_back(sibling.data(), sibling.size());
+      index = kNoNode;
+    }
+  }
+  reverse(proof.begin(), proof.end());
+  return proof;
 }
 
 
-string SparseMerkleTree::TreeNode::DebugString() const {
-  ostringstream os;
-  os << "[TreeNode type: ";
-  switch (type_) {
-    case INTERNAL:
-      os << "I";
-      break;
-    case LEAF:
-      os << "L";
-      break;
+SparseMerkleTree::BatchProof SparseMerkleTree::BatchInclusionProof(
+    vector<Path> paths) {
+  // Bring the hashes of all the stored nodes up to date.
+  CurrentRoot();
+
+  std::sort(paths.begin(), paths.end());
+  paths.erase(std::unique(paths.begin(), paths.end()), paths.end());
+  BatchProof proof;
+  if (!paths.empty()) {
+    ProveBatch(root_, 0, paths.begin(), paths.end(), &proof);
+  }
+  return proof;
+}
+
+
+void SparseMerkleTree::ProveBatch(NodeIndex index, size_t bits,
+                                  vector<Path>::const_iterator begin,
+                                  vector<Path>::const_iterator end,
+                                  BatchProof* proof) const {
+  if (bits == kDigestSizeBits) {
+    // The leaf itself, which the verifier has.
+    return;
+  }
+
+  // The stored nodes at or below either child of this subtree.
+  NodeIndex children[2] = {kNoNode, kNoNode};
+  if (index != kNoNode) {
+    const Node& node(nodes_[index]);
+    if (bits == node.prefix_bits) {
+      children[0] = node.children[0];
+      children[1] = node.children[1];
+    } else {
+      // One of the levels skipped over by |node|.
+      children[PathBit(node.path, bits)] = index;
+    }
+  }
+
+  const vector<Path>::const_iterator sides[3] = {
+      begin,
+      std::partition_point(begin, end,
+                           [bits](const Path& path) {
+                             return PathBit(path, bits) == 0;
+                           }),
+      end};
+  // The sibling comes before the subtrees below, so that the proof for
+  // a single path goes from the root down.
+  for (int side(0); side < 2; ++side) {
+    if (sides[side] != sides[side + 1]) {
+      continue;
+    } else if (children[side] == kNoNode) {
+      proof->non_null.push_back(false);
+    } else {
+      const Node& child(nodes_[children[side]]);
+      const Hash hash(child.level == bits + 1
+                          ? child.hash
+                          : HashAt(children[side], bits + 1, treehasher_));
+      proof->non_null.push_back(true);
+      proof->hashes.emplace_back(hash.data(), hash.size());
+    }
+  }
+  for (int side(0); side < 2; ++side) {
+    if (sides[side] != sides[side + 1]) {
+      ProveBatch(children[side], bits + 1, sides[side], sides[side + 1],
+                 proof);
+    }
   }
+}
+
+
+string SparseMerkleTree::NodeDebugString(const Node& node) const {
+  ostringstream os;
+  os << "[TreeNode type: " << (node.IsLeaf() ? "L" : "I")
+     << " level: " << node.level;
 
   os << " hash: ";
-  if (!hash_.empty()) {
-    os << util::ToBase64(hash_);
+  if (!node.dirty) {
+    os << util::ToBase64(string(node.hash.data(), node.hash.size()));
   } else {
     os << "(unset)";
   }
 
-  if (path_) {
+  if (node.IsLeaf()) {
     os << " path: ";
-    os << *path_;
+    os << node.path;
+  } else {
+    os << " prefix bits: " << node.prefix_bits;
   }
   os << "]";
   return os.str();
@@ -3,9 +3,11 @@
 
 #include <glog/logging.h>
 #include <stddef.h>
+#include <stdint.h>
 #include <array>
+#include <ostream>
 #include <string>
-#include <unordered_map>
+#include <utility>
 #include <vector>
 
 #include "merkletree/merkle_tree_interface.h"
@@ -13,6 +15,10 @@
 
 class SerialHasher;
 
+namespace cert_trans {
+class ThreadPool;
+}  // namespace cert_trans
+
 
 // Calculates the set of "null" hashes:
 // ...H(H(H("")||H(""))||H("")||(H(""))||...)...
@@ -100,10 +106,23 @@ const std::vector<std::string>* GetNullHashes(const TreeHasher& hasher);
  *                p:"10"      p:"11"
  *                v:"hi"      v:"to"
  *
+ * * Storage
+ * Internal nodes with a single non-empty child, such as the "1" node
+ * above, are not actually stored: as in a radix tree, the stored parent of
+ * the node is linked directly to its first descendant with two children (or
+ * to the leaf), skipping over the levels in between. The stored nodes are
+ * kept in a single array, referring to each other by index, with the hashes
+ * inline.
+ *
  * * Calculating the root hash
  * Calculating the root of the tree is similar to a regular MerkleTree, but is
  * optimised by cribbing the value of "missing" nodes from a simple cache. This
- * removes the need to calculate the vast majority of nodes from scratch.
+ * removes the need to calculate the vast majority of nodes from scratch. The
+ * hash of each stored node, taking in the levels skipped above it, is kept
+ * until a leaf below it changes.
+ *
+ * Given a ThreadPool, the dirty subtrees near the top of the tree, which are
+ * independent of each other, are recalculated in parallel.
  *
  * TODO(alcutter): LOTS!
  *
@@ -136,6 +155,9 @@ class SparseMerkleTree {
   // instantiation of the SerialHasher abstract class.
   // Takes ownership of the hasher.
   explicit SparseMerkleTree(SerialHasher* hasher);
+  // As above, but also hashes on |pool|, which must outlive this object,
+  // when calculating the root and setting leaves in batches.
+  SparseMerkleTree(SerialHasher* hasher, cert_trans::ThreadPool* pool);
 
   // Length of a node (i.e., a hash), in bytes.
   virtual size_t NodeSize() const {
@@ -154,6 +176,12 @@ class SparseMerkleTree {
   // @param path Binary path of node to set.
   virtual void SetLeaf(const Path& path, const std::string& data);
 
+  // Same as calling SetLeaf() on each of |leaves| in turn, but cheaper
+  // for large batches: the leaves are hashed in parallel, and added in
+  // path order, so that the nodes they have in common are visited
+  // together.
+  void SetLeaves(const std::vector<std::pair<Path, std::string>>& leaves);
+
   // Get the current root of the tree.
   // Update the root to reflect the current shape of the tree,
   // and return the tree digest.
@@ -164,54 +192,118 @@ class SparseMerkleTree {
 
   // Get the Merkle path from the leaf at |path| to the current root.
   //
-  // Returns a vector of node hashes, ordered by levels from leaf to root.
-  // The first element is the sibling of the leaf hash, and the last element
-  // is one below the root.
-  // Returns an empty vector if the tree is not large enough
-  // or the leaf index is 0.
+  // Returns a vector of kDigestSizeBits node hashes, ordered by levels from
+  // leaf to root. The first element is the sibling of the leaf hash, and the
+  // last element is one below the root. If there is no leaf at |path|, this
+  // proves that it is empty instead, starting from the sibling of the null
+  // leaf hash.
   //
   // @param path the path of the leaf whose inclusion proof to return.
   std::vector<std::string> InclusionProof(const Path& path);
 
+  // A proof for the leaves at several paths at once, verified with
+  // SparseMerkleVerifier::VerifyBatchProof().
+  //
+  // Going down from the root towards all of the paths in order, the
+  // proof has an entry for each sibling of the nodes on the way that is
+  // not itself on the way to one of the paths, before those below it. Empty
+  // siblings, whose hashes are known to both sides, are only marked as
+  // such in |non_null|, and the hashes of the others are in |hashes|.
+  // Compared with a separate InclusionProof() for each path, this
+  // leaves out both the null hashes and the upper levels the paths
+  // share.
+  struct BatchProof {
+    // One entry per sibling, false for an empty one.
+    std::vector<bool> non_null;
+    // The hashes of the siblings that are not empty, in the same
+    // order.
+    std::vector<std::string> hashes;
+  };
+
+  // Returns a proof for the leaves at all of |paths| at once, which may
+  // be in any order and have duplicates. As with InclusionProof(), the
+  // paths with no leaf are proven to be empty.
+  BatchProof BatchInclusionProof(std::vector<Path> paths);
+
   std::string Dump() const;
 
  private:
-  // WARNING WARNING WARNING
-  // 64 < 256 !
-  // WARNING WARNING WARNING
-  // TODO(alcutter): BIGNUM probably.
-  typedef uint64_t IndexType;
-
-  struct TreeNode {
-    TreeNode(const std::string& hash) : type_(INTERNAL), hash_(hash) {
-    }
-
-    TreeNode(const Path& path, const std::string& leaf_hash)
-        : type_(LEAF), path_(new Path(path)), hash_(leaf_hash) {
+  typedef std::array<char, kDigestSizeBits / 8> Hash;
+  // Index of a node in |nodes_|.
+  typedef uint32_t NodeIndex;
+
+  static const NodeIndex kNoNode = UINT32_MAX;
+
+  // A stored node, either a leaf or an internal node with two children.
+  // Nodes are placed in the tree by the number of leading bits of the
+  // paths below them they fix, from 0 for the root to kDigestSizeBits for
+  // a leaf at the very bottom of the tree.
+  struct Node {
+    // For a leaf, its path. For an internal node, the path of one of the
+    // leaves below it, of which only the first |prefix_bits| matter.
+    Path path;
+    // The hash of the subtree at |level|, unless |dirty|.
+    Hash hash;
+    // For a leaf, the hash of its value.
+    Hash leaf_hash;
+    // For an internal node, the next stored node down each side.
+    NodeIndex children[2];
+    // Where the node hangs from its stored parent: one more than the
+    // |prefix_bits| of the parent, or 0 for the root.
+    uint16_t level;
+    // The number of leading bits that the paths of all the leaves below
+    // have in common, kDigestSizeBits for a leaf.
+    uint16_t prefix_bits;
+    bool dirty;
+
+    bool IsLeaf() const {
+      return prefix_bits == kDigestSizeBits;
     }
-
-    std::string DebugString() const;
-
-    enum { INTERNAL, LEAF } type_;
-    std::unique_ptr<Path> path_;
-    std::string hash_;
   };
 
-  std::string CalculateSubtreeHash(size_t depth, IndexType index);
-
-  void DumpTree(std::ostream* os, size_t depth, IndexType index) const;
-
-  // Get the |index|-th node at level |level|. Indexing starts at 0;
-  // caller is responsible for ensuring tree is sufficiently up to date.
-  std::string Node(size_t level, size_t index) const;
+  void SetLeafHash(const Path& path, const std::string& leaf_hash);
+  NodeIndex NewNode(const Path& path, size_t level, size_t prefix_bits);
+  NodeIndex NewLeaf(const Path& path, size_t level,
+                    const std::string& leaf_hash);
+  // Recomputes the hashes of all the dirty nodes.
+  void UpdateHashes();
+  // Appends the dirty nodes at most |depth| stored nodes below |index|
+  // that have no dirty node above them at that depth, to |subtrees|.
+  void DirtySubtrees(NodeIndex index, size_t depth,
+                     std::vector<NodeIndex>* subtrees) const;
+  // Recomputes the hash of |index| and those below it, if needed, with
+  // |hasher|.
+  const Hash& UpdateHash(NodeIndex index, const TreeHasher& hasher);
+  // The hash of the subtree with |index| at the bottom, fixing |bits| bits,
+  // which must be at most its |prefix_bits|. The nodes below it must be up
+  // to date.
+  Hash HashAt(NodeIndex index, size_t bits, const TreeHasher& hasher) const;
+  // Hashes |hash|, of a subtree fixing |from| bits of |path|, up with
+  // the null hashes until it is the hash of the subtree fixing |to|
+  // bits.
+  void HashUp(const Path& path, size_t from, size_t to,
+              const TreeHasher& hasher, Hash* hash) const;
+  // Adds to |proof| the siblings needed for the sorted paths in [begin,
+  // end), below the subtree fixing |bits| bits of them with |index| at
+  // or below its top.
+  void ProveBatch(NodeIndex index, size_t bits,
+                  std::vector<Path>::const_iterator begin,
+                  std::vector<Path>::const_iterator end,
+                  BatchProof* proof) const;
+  // The hash of an empty subtree fixing |bits| bits, which must be at
+  // least 1.
+  const char* NullHash(size_t bits) const {
+    return null_hashes_->at(bits - 1).data();
+  }
 
-  // Maybe add a new tree level.
-  void EnsureHaveLevel(size_t n);
+  void DumpTree(std::ostream* os, NodeIndex index) const;
+  std::string NodeDebugString(const Node& node) const;
 
   TreeHasher treehasher_;
   const std::vector<std::string>* const null_hashes_;
-  // TODO(alcutter): investigate other structures
-  std::vector<std::unordered_map<IndexType, TreeNode>> tree_;
+  cert_trans::ThreadPool* const pool_;
+  std::vector<Node> nodes_;
+  NodeIndex root_;
   std::string root_hash_;
 };
 
@@ -239,6 +331,25 @@ inline int PathBit(const SparseMerkleTree::Path& path, size_t bit) {
 }
 
 
+// Returns the first bit in [begin, end) where |a| and |b| differ, or
+// |end| if there is none.
+inline size_t FirstPathDifference(const SparseMerkleTree::Path& a,
+                                  const SparseMerkleTree::Path& b,
+                                  size_t begin, size_t end) {
+  size_t bit(begin);
+  while (bit < end) {
+    if (bit % 8 == 0 && bit + 8 <= end && a[bit / 8] == b[bit / 8]) {
+      bit += 8;
+    } else if (PathBit(a, bit) != PathBit(b, bit)) {
+      return bit;
+    } else {
+      ++bit;
+    }
+  }
+  return end;
+}
+
+
 struct PathHasher {
   size_t operator()(const SparseMerkleTree::Path& p) const {
     return std::hash<std::string>()(
@@ -8,8 +8,10 @@
 #include <string>
 
 #include "merkletree/sparse_merkle_tree.h"
+#include "merkletree/sparse_merkle_verifier.h"
 #include "util/openssl_scoped_types.h"
 #include "util/testing.h"
+#include "util/thread_pool.h"
 #include "util/util.h"
 
 namespace {
@@ -341,6 +343,182 @@ TEST_F(SparseMerkleTreeTest, TestSetLeaf) {
 }
 
 
+TEST_F(SparseMerkleTreeTest, RandomPathsReferenceTest) {
+  Reference ref(new Sha256Hasher);
+  ValueList values;
+  for (int i(0); i < 1000; ++i) {
+    const SparseMerkleTree::Path p(RandomPath());
+    const string value(to_string(i));
+    values.emplace_back();
+    values.back().first.reset(BN_bin2bn(p.data(), p.size(), nullptr));
+    values.back().second = value;
+    tree_.SetLeaf(p, value);
+  }
+  EXPECT_EQ(ToBase64(ref.HStar2(256, &values)), ToBase64(tree_.CurrentRoot()));
+}
+
+
+TEST_F(SparseMerkleTreeTest, ReplaceLeaf) {
+  Reference ref(new Sha256Hasher);
+  ValueList values;
+  for (auto r : vector<uint64_t>{1, 5, 10}) {
+    values.emplace_back(Value(r, "new" + to_string(r)));
+    tree_.SetLeaf(PathLow(r), "old" + to_string(r));
+  }
+  tree_.CurrentRoot();
+  for (auto r : vector<uint64_t>{1, 5, 10}) {
+    tree_.SetLeaf(PathLow(r), "new" + to_string(r));
+  }
+  EXPECT_EQ(ToBase64(ref.HStar2(256, &values)), ToBase64(tree_.CurrentRoot()));
+}
+
+
+TEST_F(SparseMerkleTreeTest, InclusionProof) {
+  vector<SparseMerkleTree::Path> paths;
+  for (int i(0); i < 300; ++i) {
+    paths.emplace_back(i % 2 == 0 ? RandomPath() : PathLow(rand_()));
+    tree_.SetLeaf(paths.back(), to_string(i));
+  }
+  // Some paths that are not in the tree.
+  paths.emplace_back(PathLow(rand_()));
+  paths.emplace_back(RandomPath());
+
+  const string root(tree_.CurrentRoot());
+  for (size_t i(0); i < paths.size(); ++i) {
+    const vector<string> proof(tree_.InclusionProof(paths[i]));
+    ASSERT_EQ(static_cast<size_t>(SparseMerkleTree::kDigestSizeBits),
+              proof.size());
+
+    // The paths that are not there prove the null leaf.
+    string hash(tree_hasher_.HashLeaf(i < 300 ? to_string(i) : string()));
+    for (size_t j(0); j < proof.size(); ++j) {
+      const size_t bit(proof.size() - 1 - j);
+      const string& sibling(proof[j]);
+      hash = PathBit(paths[i], bit) == 0
+                 ? tree_hasher_.HashChildren(hash, sibling)
+                 : tree_hasher_.HashChildren(sibling, hash);
+    }
+    EXPECT_EQ(ToBase64(root), ToBase64(hash)) << "path " << i;
+  }
+}
+
+
+TEST_F(SparseMerkleTreeTest, SetLeavesMatchesSetLeaf) {
+  cert_trans::ThreadPool pool(4);
+  SparseMerkleTree batched(new Sha256Hasher, &pool);
+  SparseMerkleTree unthreaded(new Sha256Hasher);
+
+  for (int round(0); round < 3; ++round) {
+    vector<pair<SparseMerkleTree::Path, string>> leaves;
+    for (int i(0); i < 5000; ++i) {
+      const string value(to_string(round) + "/" + to_string(i));
+      leaves.emplace_back(i % 3 == 0 ? PathLow(rand_()) : RandomPath(),
+                          value);
+    }
+    // Set some twice in the same batch, the last one wins.
+    leaves.emplace_back(leaves[10].first, "again");
+    leaves.emplace_back(leaves[20].first, "again");
+
+    for (const auto& leaf : leaves) {
+      tree_.SetLeaf(leaf.first, leaf.second);
+    }
+    batched.SetLeaves(leaves);
+    unthreaded.SetLeaves(leaves);
+
+    EXPECT_EQ(ToBase64(tree_.CurrentRoot()), ToBase64(batched.CurrentRoot()));
+    EXPECT_EQ(ToBase64(tree_.CurrentRoot()),
+              ToBase64(unthreaded.CurrentRoot()));
+  }
+
+  // A small update after a large one only recalculates a few nodes.
+  tree_.SetLeaf(PathLow(42), "small");
+  batched.SetLeaves({{PathLow(42), "small"}});
+  EXPECT_EQ(ToBase64(tree_.CurrentRoot()), ToBase64(batched.CurrentRoot()));
+  EXPECT_EQ(tree_.InclusionProof(PathLow(42)),
+            batched.InclusionProof(PathLow(42)));
+}
+
+
+TEST_F(SparseMerkleTreeTest, BatchInclusionProof) {
+  SparseMerkleVerifier verifier(unique_ptr<Sha256Hasher>(new Sha256Hasher));
+  SparseMerkleVerifier::LeafList leaves;
+  for (int i(0); i < 1000; ++i) {
+    const SparseMerkleTree::Path path(i % 2 == 0 ? RandomPath()
+                                                 : PathLow(rand_()));
+    tree_.SetLeaf(path, to_string(i));
+    if (i % 10 == 0) {
+      leaves.emplace_back(path, to_string(i));
+    }
+  }
+  // Some paths that are not in the tree, and one asked for twice.
+  leaves.emplace_back(RandomPath(), "");
+  leaves.emplace_back(PathLow(rand_()), "");
+  leaves.emplace_back(leaves[0]);
+  reverse(leaves.begin(), leaves.end());
+
+  vector<SparseMerkleTree::Path> paths;
+  for (const auto& leaf : leaves) {
+    paths.push_back(leaf.first);
+  }
+  const string root(tree_.CurrentRoot());
+  const SparseMerkleTree::BatchProof proof(tree_.BatchInclusionProof(paths));
+  EXPECT_TRUE(verifier.VerifyBatchProof(leaves, proof, root));
+  // Far fewer hashes than the 256 a path of separate proofs would have.
+  EXPECT_LT(proof.hashes.size(), leaves.size() * 10);
+
+  // Wrong data, or a proof for other paths.
+  SparseMerkleVerifier::LeafList wrong(leaves);
+  wrong[3].second = "wrong";
+  EXPECT_FALSE(verifier.VerifyBatchProof(wrong, proof, root));
+  wrong = leaves;
+  wrong.erase(wrong.begin() + 1);
+  EXPECT_FALSE(verifier.VerifyBatchProof(wrong, proof, root));
+  wrong = leaves;
+  wrong.emplace_back(RandomPath(), "");
+  EXPECT_FALSE(verifier.VerifyBatchProof(wrong, proof, root));
+  wrong = leaves;
+  wrong.emplace_back(leaves[0].first, "other");
+  EXPECT_FALSE(verifier.VerifyBatchProof(wrong, proof, root));
+
+  // A tampered proof.
+  SparseMerkleTree::BatchProof bad(proof);
+  bad.hashes[bad.hashes.size() / 2][0] ^= 1;
+  EXPECT_FALSE(verifier.VerifyBatchProof(leaves, bad, root));
+  bad = proof;
+  bad.non_null.push_back(false);
+  EXPECT_FALSE(verifier.VerifyBatchProof(leaves, bad, root));
+  bad = proof;
+  bad.hashes.pop_back();
+  EXPECT_FALSE(verifier.VerifyBatchProof(leaves, bad, root));
+
+  // A proof for a single path is the same as InclusionProof(), without
+  // the null hashes.
+  const SparseMerkleTree::BatchProof single(
+      tree_.BatchInclusionProof({leaves[5].first}));
+  const vector<string> full(tree_.InclusionProof(leaves[5].first));
+  vector<string> non_null;
+  for (size_t i(0); i < full.size(); ++i) {
+    if (single.non_null[i]) {
+      non_null.push_back(full[full.size() - 1 - i]);
+    }
+  }
+  EXPECT_EQ(non_null, single.hashes);
+  EXPECT_TRUE(verifier.VerifyBatchProof({leaves[5]}, single, root));
+}
+
+
+TEST_F(SparseMerkleTreeTest, BatchInclusionProofEmptyTree) {
+  SparseMerkleVerifier verifier(unique_ptr<Sha256Hasher>(new Sha256Hasher));
+  const SparseMerkleVerifier::LeafList leaves{{RandomPath(), ""},
+                                              {RandomPath(), ""}};
+  const SparseMerkleTree::BatchProof proof(
+      tree_.BatchInclusionProof({leaves[0].first, leaves[1].first}));
+  EXPECT_TRUE(proof.hashes.empty());
+  EXPECT_TRUE(verifier.VerifyBatchProof(leaves, proof, tree_.CurrentRoot()));
+  EXPECT_TRUE(tree_.BatchInclusionProof({}).non_null.empty());
+}
+
+
 // TODO(alcutter): Lots and lots more tests.
 
 
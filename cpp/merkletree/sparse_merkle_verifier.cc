@@ -0,0 +1,93 @@
+#include "merkletree/sparse_merkle_verifier.h"
+
+#include <algorithm>
+
+using std::move;
+using std::string;
+using std::unique_ptr;
+
+SparseMerkleVerifier::SparseMerkleVerifier(unique_ptr<SerialHasher> hasher)
+    : treehasher_(move(hasher)), null_hashes_(GetNullHashes(treehasher_)) {
+}
+
+bool SparseMerkleVerifier::VerifyBatchProof(
+    const LeafList& leaves, const SparseMerkleTree::BatchProof& proof,
+    const string& root) {
+  const string proof_root(RootFromBatchProof(leaves, proof));
+  if (proof_root.empty())
+    return false;
+  return proof_root == root;
+}
+
+string SparseMerkleVerifier::RootFromBatchProof(
+    const LeafList& leaves, const SparseMerkleTree::BatchProof& proof) {
+  if (leaves.empty())
+    // Nothing to prove.
+    return string();
+
+  // Go through the paths in the order the tree did.
+  LeafList sorted(leaves);
+  std::stable_sort(sorted.begin(), sorted.end(),
+                   [](const LeafList::value_type& a,
+                      const LeafList::value_type& b) {
+                     return a.first < b.first;
+                   });
+  for (size_t i = 1; i < sorted.size(); ++i) {
+    if (sorted[i - 1].first == sorted[i].first &&
+        sorted[i - 1].second != sorted[i].second)
+      // Two different leaves at the same path cannot both be there.
+      return string();
+  }
+  sorted.erase(std::unique(sorted.begin(), sorted.end()), sorted.end());
+
+  ProofPosition position = {0, 0};
+  string root;
+  if (!SubtreeHash(0, sorted.begin(), sorted.end(), proof, &position, &root))
+    return string();
+  if (position.sibling != proof.non_null.size() ||
+      position.hash != proof.hashes.size())
+    // The proof is for more paths than |leaves|.
+    return string();
+  return root;
+}
+
+bool SparseMerkleVerifier::SubtreeHash(
+    size_t bits, LeafList::const_iterator begin, LeafList::const_iterator end,
+    const SparseMerkleTree::BatchProof& proof, ProofPosition* position,
+    string* hash) {
+  if (bits == SparseMerkleTree::kDigestSizeBits) {
+    *hash = treehasher_.HashLeaf(begin->second);
+    return true;
+  }
+
+  const LeafList::const_iterator sides[3] = {
+      begin, std::partition_point(begin, end,
+                                  [bits](const LeafList::value_type& leaf) {
+                                    return PathBit(leaf.first, bits) == 0;
+                                  }),
+      end};
+  string children[2];
+  // As in the tree, the sibling first.
+  for (int side = 0; side < 2; ++side) {
+    if (sides[side] != sides[side + 1]) {
+      continue;
+    } else if (position->sibling >= proof.non_null.size()) {
+      return false;
+    } else if (!proof.non_null[position->sibling++]) {
+      // The empty subtree fixing |bits| + 1 bits.
+      children[side] = null_hashes_->at(bits);
+    } else if (position->hash >= proof.hashes.size()) {
+      return false;
+    } else {
+      children[side] = proof.hashes[position->hash++];
+    }
+  }
+  for (int side = 0; side < 2; ++side) {
+    if (sides[side] != sides[side + 1] &&
+        !SubtreeHash(bits + 1, sides[side], sides[side + 1], proof, position,
+                     &children[side]))
+      return false;
+  }
+  *hash = treehasher_.HashChildren(children[0], children[1]);
+  return true;
+}
@@ -0,0 +1,60 @@
+#ifndef CERT_TRANS_MERKLETREE_SPARSE_MERKLE_VERIFIER_H_
+#define CERT_TRANS_MERKLETREE_SPARSE_MERKLE_VERIFIER_H_
+
+#include <stddef.h>
+#include <memory>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "merkletree/sparse_merkle_tree.h"
+#include "merkletree/tree_hasher.h"
+
+class SerialHasher;
+
+// Class for verifying proofs emitted by SparseMerkleTrees.
+class SparseMerkleVerifier {
+ public:
+  typedef std::vector<std::pair<SparseMerkleTree::Path, std::string>>
+      LeafList;
+
+  SparseMerkleVerifier(std::unique_ptr<SerialHasher> hasher);
+
+  // Verify a batch proof. Return true iff |proof| is a valid proof that
+  // each of the paths in |leaves| has the leaf data given with it in
+  // the tree with root |root|, the empty string standing for a path
+  // with no leaf (the null leaf is the leaf hash of empty data).
+  //
+  // @param leaves the paths that the proof was made for, with their
+  // data, in any order.
+  // @param proof a proof from SparseMerkleTree::BatchInclusionProof().
+  // @param root The root hash
+  bool VerifyBatchProof(const LeafList& leaves,
+                        const SparseMerkleTree::BatchProof& proof,
+                        const std::string& root);
+
+  // Compute the root corresponding to a batch proof.
+  // Returns an empty string if the proof is not valid for |leaves|.
+  std::string RootFromBatchProof(const LeafList& leaves,
+                                 const SparseMerkleTree::BatchProof& proof);
+
+ private:
+  // Where RootFromBatchProof() is in |proof|.
+  struct ProofPosition {
+    size_t sibling;
+    size_t hash;
+  };
+
+  // Sets |hash| to the hash of the subtree fixing |bits| bits of the
+  // sorted leaves in [begin, end), taking its missing siblings from
+  // |proof|. Returns false if |proof| is too short.
+  bool SubtreeHash(size_t bits, LeafList::const_iterator begin,
+                   LeafList::const_iterator end,
+                   const SparseMerkleTree::BatchProof& proof,
+                   ProofPosition* position, std::string* hash);
+
+  TreeHasher treehasher_;
+  const std::vector<std::string>* const null_hashes_;
+};
+
+#endif  // CERT_TRANS_MERKLETREE_SPARSE_MERKLE_VERIFIER_H_
@@ -0,0 +1,422 @@
+#include "merkletree/tiled_merkle_tree.h"
+
+#include <fcntl.h>
+#include <glog/logging.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <sstream>
+
+#include "merkletree/serial_hasher.h"
+#include "util/util.h"
+
+using std::lock_guard;
+using std::move;
+using std::mutex;
+using std::string;
+using std::unique_ptr;
+using std::vector;
+
+namespace cert_trans {
+
+namespace {
+
+
+const char kMetadataMagic[] = "ct-tiled-merkle-tree";
+const int kMetadataVersion = 1;
+const size_t kTileWidth = static_cast<size_t>(1)
+                          << TiledMerkleTree::kTileHeight;
+
+
+// Offset, in nodes, of |row| (0 being the bottom one) in a tile. Each
+// row is half as wide as the one below it.
+size_t RowOffset(size_t row) {
+  return 2 * kTileWidth - ((2 * kTileWidth) >> row);
+}
+
+
+// The largest power of two smaller than |n|, which must be at least 2.
+size_t SplitPoint(size_t n) {
+  CHECK_GE(n, 2U);
+  size_t split(1);
+  while ((split << 1) < n)
+    split <<= 1;
+  return split;
+}
+
+
+}  // namespace
+
+
+const size_t TiledMerkleTree::kTileHeight;
+
+
+TiledMerkleTree::TiledMerkleTree(unique_ptr<SerialHasher> hasher,
+                                 const string& dir, size_t cache_tiles)
+    : treehasher_(move(hasher)),
+      dir_(dir),
+      tile_bytes_(RowOffset(kTileHeight) * treehasher_.DigestSize()),
+      cache_tiles_(cache_tiles),
+      leaf_count_(0),
+      tile_reads_(0) {
+  size_t leaf_count;
+  if (!ReadMetadata(&leaf_count)) {
+    LOG(INFO) << "Starting an empty tiled tree in " << dir_;
+    return;
+  }
+
+  for (size_t tile_level = 0;
+       tile_level * kTileHeight < 64 &&
+       (leaf_count >> (tile_level * kTileHeight)) > 0;
+       ++tile_level) {
+    OpenTiles(tile_level);
+    const size_t complete(
+        (leaf_count >> (tile_level * kTileHeight)) >> kTileHeight);
+    struct stat st;
+    PCHECK(fstat(fds_[tile_level], &st) == 0);
+    if (static_cast<size_t>(st.st_size) < complete * tile_bytes_) {
+      LOG(WARNING) << "Tiled tree in " << dir_ << " is inconsistent, "
+                   << "starting from an empty one";
+      edge_.clear();
+      return;
+    }
+
+    // The tile on the edge is only there if Sync() wrote it out.
+    string edge(tile_bytes_, '\0');
+    const ssize_t got(pread(fds_[tile_level], &edge[0], tile_bytes_,
+                            complete * tile_bytes_));
+    PCHECK(got >= 0) << "Failed to read " << TilesPath(tile_level);
+    edge_.push_back(edge);
+  }
+  leaf_count_ = leaf_count;
+  LOG(INFO) << "Opened a tiled tree of " << leaf_count_ << " leaves in "
+            << dir_;
+}
+
+
+TiledMerkleTree::~TiledMerkleTree() {
+  for (const int fd : fds_)
+    close(fd);
+}
+
+
+size_t TiledMerkleTree::AddLeafHash(const string& hash) {
+  CHECK_EQ(NodeSize(), hash.size());
+  size_t index(leaf_count_);
+  SetEdgeNode(0, index, hash.data());
+  ++leaf_count_;
+
+  // Every right child completes its parent.
+  string parent(NodeSize(), '\0');
+  for (size_t level = 0; (index & 1) != 0; ++level, index >>= 1) {
+    // Siblings are always in the same tile.
+    const size_t tile_level(level / kTileHeight);
+    const char* const right(edge_[tile_level].data() +
+                            NodeOffset(level, index));
+    treehasher_.HashChildren(right - NodeSize(), right, &parent[0]);
+
+    if (level % kTileHeight == kTileHeight - 1) {
+      // That was the last node of the tile, and its parent goes at the
+      // bottom of the next tile level.
+      const size_t tile_index(index >> 1);
+      WriteTile(tile_level, tile_index, edge_[tile_level]);
+      CacheTile((static_cast<uint64_t>(tile_level) << 56) | tile_index,
+                Tile(new string(edge_[tile_level])));
+      edge_[tile_level].assign(tile_bytes_, '\0');
+    }
+    SetEdgeNode(level + 1, index >> 1, parent.data());
+  }
+
+  return leaf_count_;
+}
+
+
+string TiledMerkleTree::LeafHash(size_t leaf) const {
+  if (leaf == 0 || leaf > leaf_count_)
+    return string();
+  return Node(0, leaf - 1);
+}
+
+
+string TiledMerkleTree::RootAtSnapshot(size_t snapshot) const {
+  if (snapshot == 0)
+    return treehasher_.HashEmpty();
+  if (snapshot > leaf_count_)
+    return string();
+  return SubtreeHash(0, snapshot);
+}
+
+
+vector<string> TiledMerkleTree::PathToRootAtSnapshot(size_t leaf,
+                                                     size_t snapshot) const {
+  vector<string> path;
+  if (leaf > snapshot || snapshot > leaf_count_ || leaf == 0)
+    return path;
+  SubtreePath(leaf - 1, 0, snapshot, &path);
+  return path;
+}
+
+
+vector<string> TiledMerkleTree::SnapshotConsistency(size_t snapshot1,
+                                                    size_t snapshot2) const {
+  vector<string> proof;
+  if (snapshot1 == 0 || snapshot1 >= snapshot2 || snapshot2 > leaf_count_)
+    return proof;
+  SubtreeConsistency(snapshot1, 0, snapshot2, true, &proof);
+  return proof;
+}
+
+
+vector<string> TiledMerkleTree::Frontier() const {
+  vector<string> frontier;
+  for (size_t level = 0; (leaf_count_ >> level) != 0; ++level) {
+    const size_t count(leaf_count_ >> level);
+    frontier.push_back((count & 1) != 0 ? Node(level, count - 1) : string());
+  }
+  return frontier;
+}
+
+
+void TiledMerkleTree::Sync() {
+  for (size_t tile_level = 0; tile_level < edge_.size(); ++tile_level)
+    WriteTile(tile_level, CompleteTiles(tile_level), edge_[tile_level]);
+  for (const int fd : fds_)
+    PCHECK(fdatasync(fd) == 0);
+  WriteMetadata();
+}
+
+
+void TiledMerkleTree::Clear() {
+  leaf_count_ = 0;
+  edge_.clear();
+  {
+    lock_guard<mutex> lock(cache_lock_);
+    lru_.clear();
+    cached_.clear();
+  }
+  WriteMetadata();
+}
+
+
+size_t TiledMerkleTree::CompleteTiles(size_t tile_level) const {
+  const size_t shift(tile_level * kTileHeight);
+  if (shift >= 64)
+    return 0;
+  return (leaf_count_ >> shift) >> kTileHeight;
+}
+
+
+size_t TiledMerkleTree::NodeOffset(size_t level, size_t index) const {
+  const size_t row(level % kTileHeight);
+  return (RowOffset(row) + (index & ((kTileWidth >> row) - 1))) * NodeSize();
+}
+
+
+string TiledMerkleTree::Node(size_t level, size_t index) const {
+  const size_t tile_level(level / kTileHeight);
+  const size_t tile_index(index >> (kTileHeight - level % kTileHeight));
+  const size_t offset(NodeOffset(level, index));
+  if (tile_index < CompleteTiles(tile_level))
+    return GetTile(tile_level, tile_index)->substr(offset, NodeSize());
+
+  CHECK_LT(tile_level, edge_.size());
+  return edge_[tile_level].substr(offset, NodeSize());
+}
+
+
+void TiledMerkleTree::SetEdgeNode(size_t level, size_t index,
+                                  const char* node) {
+  const size_t tile_level(level / kTileHeight);
+  while (edge_.size() <= tile_level) {
+    // Open the file here rather than in WriteTile(), so that Sync() does
+    // not modify |fds_| while lookups use it.
+    if (fds_.size() <= edge_.size())
+      OpenTiles(fds_.size());
+    edge_.emplace_back(tile_bytes_, '\0');
+  }
+  memcpy(&edge_[tile_level][NodeOffset(level, index)], node, NodeSize());
+}
+
+
+string TiledMerkleTree::SubtreeHash(size_t begin, size_t end) const {
+  const size_t size(end - begin);
+  CHECK_GT(size, 0U);
+  if ((size & (size - 1)) == 0 && begin % size == 0) {
+    // A complete subtree, which is a node of the tree.
+    size_t level(0);
+    while ((static_cast<size_t>(1) << level) < size)
+      ++level;
+    return Node(level, begin >> level);
+  }
+
+  const size_t split(SplitPoint(size));
+  return treehasher_.HashChildren(SubtreeHash(begin, begin + split),
+                                  SubtreeHash(begin + split, end));
+}
+
+
+void TiledMerkleTree::SubtreePath(size_t leaf, size_t begin, size_t end,
+                                  vector<string>* path) const {
+  if (end - begin <= 1)
+    return;
+
+  const size_t split(SplitPoint(end - begin));
+  if (leaf < begin + split) {
+    SubtreePath(leaf, begin, begin + split, path);
+    path->push_back(SubtreeHash(begin + split, end));
+  } else {
+    SubtreePath(leaf, begin + split, end, path);
+    path->push_back(SubtreeHash(begin, begin + split));
+  }
+}
+
+
+void TiledMerkleTree::SubtreeConsistency(size_t snapshot1, size_t begin,
+                                         size_t end, bool complete_subtree,
+                                         vector<string>* proof) const {
+  if (snapshot1 == end) {
+    // Unless this is the whole of the first tree, which the verifier
+    // has, record the root of this subtree.
+    if (!complete_subtree)
+      proof->push_back(SubtreeHash(begin, end));
+    return;
+  }
+
+  const size_t split(SplitPoint(end - begin));
+  if (snapshot1 <= begin + split) {
+    SubtreeConsistency(snapshot1, begin, begin + split, complete_subtree,
+                       proof);
+    proof->push_back(SubtreeHash(begin + split, end));
+  } else {
+    SubtreeConsistency(snapshot1, begin + split, end, false, proof);
+    proof->push_back(SubtreeHash(begin, begin + split));
+  }
+}
+
+
+TiledMerkleTree::Tile TiledMerkleTree::GetTile(size_t tile_level,
+                                               size_t tile_index) const {
+  const uint64_t key((static_cast<uint64_t>(tile_level) << 56) | tile_index);
+  {
+    lock_guard<mutex> lock(cache_lock_);
+    const auto it(cached_.find(key));
+    if (it != cached_.end()) {
+      lru_.splice(lru_.begin(), lru_, it->second);
+      return it->second->second;
+    }
+  }
+
+  CHECK_LT(tile_level, fds_.size());
+  string* const tile(new string(tile_bytes_, '\0'));
+  const Tile result(tile);
+  size_t done(0);
+  while (done < tile_bytes_) {
+    const ssize_t got(pread(fds_[tile_level], &(*tile)[done],
+                            tile_bytes_ - done,
+                            tile_index * tile_bytes_ + done));
+    PCHECK(got >= 0) << "Failed to read " << TilesPath(tile_level);
+    CHECK_GT(got, 0) << "Tile " << tile_index << " missing from "
+                     << TilesPath(tile_level);
+    done += got;
+  }
+  ++tile_reads_;
+  CacheTile(key, result);
+
+  return result;
+}
+
+
+void TiledMerkleTree::CacheTile(uint64_t key, const Tile& tile) const {
+  lock_guard<mutex> lock(cache_lock_);
+  if (cache_tiles_ == 0)
+    return;
+
+  const auto it(cached_.find(key));
+  if (it != cached_.end()) {
+    // Someone else read it in the meantime.
+    lru_.splice(lru_.begin(), lru_, it->second);
+    return;
+  }
+  lru_.emplace_front(key, tile);
+  cached_[key] = lru_.begin();
+  while (lru_.size() > cache_tiles_) {
+    cached_.erase(lru_.back().first);
+    lru_.pop_back();
+  }
+}
+
+
+string TiledMerkleTree::TilesPath(size_t tile_level) const {
+  std::ostringstream path;
+  path << dir_ << "/tiles-" << tile_level;
+  return path.str();
+}
+
+
+string TiledMerkleTree::MetadataPath() const {
+  return dir_ + "/tiles";
+}
+
+
+void TiledMerkleTree::OpenTiles(size_t tile_level) {
+  CHECK_EQ(tile_level, fds_.size());
+  const string path(TilesPath(tile_level));
+  const int fd(open(path.c_str(), O_RDWR | O_CREAT, 0644));
+  PCHECK(fd >= 0) << "Failed to open " << path;
+  fds_.push_back(fd);
+}
+
+
+void TiledMerkleTree::WriteTile(size_t tile_level, size_t tile_index,
+                                const string& tile) {
+  CHECK_LT(tile_level, fds_.size());
+  size_t done(0);
+  while (done < tile.size()) {
+    const ssize_t wrote(pwrite(fds_[tile_level], tile.data() + done,
+                               tile.size() - done,
+                               tile_index * tile_bytes_ + done));
+    PCHECK(wrote > 0) << "Failed to write " << TilesPath(tile_level);
+    done += wrote;
+  }
+}
+
+
+bool TiledMerkleTree::ReadMetadata(size_t* leaf_count) const {
+  string contents;
+  if (!util::ReadTextFile(MetadataPath(), &contents))
+    return false;
+
+  std::istringstream in(contents);
+  string magic;
+  int version;
+  size_t node_size, tile_height;
+  if (!(in >> magic >> version >> node_size >> tile_height >> *leaf_count) ||
+      magic != kMetadataMagic || version != kMetadataVersion) {
+    LOG(WARNING) << "Unrecognized tiled tree metadata in " << MetadataPath();
+    return false;
+  }
+  if (node_size != NodeSize() || tile_height != kTileHeight) {
+    LOG(WARNING) << "Tiled tree in " << dir_ << " has nodes of " << node_size
+                 << " bytes in tiles " << tile_height << " high, expected "
+                 << NodeSize() << " and " << kTileHeight;
+    return false;
+  }
+  return true;
+}
+
+
+void TiledMerkleTree::WriteMetadata() const {
+  std::ostringstream out;
+  out << kMetadataMagic << " " << kMetadataVersion << "\n"
+      << NodeSize() << " " << kTileHeight << " " << leaf_count_ << "\n";
+
+  const string tmp_file(
+      util::WriteTemporaryBinaryFile(dir_ + "/tiles.tmpXXXXXX", out.str()));
+  CHECK(!tmp_file.empty()) << "Failed to write tiled tree metadata in "
+                           << dir_;
+  PCHECK(rename(tmp_file.c_str(), MetadataPath().c_str()) == 0);
+}
+
+
+}  // namespace cert_trans
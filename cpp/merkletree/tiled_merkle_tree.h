@@ -0,0 +1,151 @@
+#ifndef CERT_TRANS_MERKLETREE_TILED_MERKLE_TREE_H_
+#define CERT_TRANS_MERKLETREE_TILED_MERKLE_TREE_H_
+
+#include <stddef.h>
+#include <stdint.h>
+#include <atomic>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+#include "merkletree/tree_hasher.h"
+
+class SerialHasher;
+
+namespace cert_trans {
+
+
+// A Merkle tree (with the same semantics as MerkleTree) kept on disk,
+// for trees that do not fit in memory.
+//
+// The tree is cut into tiles kTileHeight levels high: a tile holds the
+// nodes of a subtree that is 2^kTileHeight nodes wide at the bottom,
+// except for its root, which is at the bottom of a tile of the next
+// tile level up. An audit or consistency proof then needs about
+// log2(n) / kTileHeight tiles, rather than one read for each of the
+// log2(n) levels.
+//
+// Complete tiles never change, and are written out as soon as they
+// are, while those on the right edge of the tree stay in memory. The
+// tiles read back are kept in an LRU cache. On disk, in |dir|:
+//
+// <dir>/tiles-<t> - The tiles of tile level <t>, each at a fixed
+//                   offset given by its index. The tiles of tile level
+//                   0 hold the leaves.
+// <dir>/tiles     - The node size and the leaf count, as of the last
+//                   Sync(). The tiles on the right edge are written out
+//                   too by Sync(), so that a tree opened again on the
+//                   same directory picks up from there.
+//
+// The const methods, and Sync(), can be called concurrently with each
+// other, but not with AddLeafHash().
+class TiledMerkleTree {
+ public:
+  static const size_t kTileHeight = 8;
+
+  // Opens the tree in |dir|, which must exist, keeping up to
+  // |cache_tiles| tiles read from disk in memory. If it holds a tree
+  // with a different node size, or one that cannot be read back, it is
+  // replaced by an empty one.
+  TiledMerkleTree(std::unique_ptr<SerialHasher> hasher,
+                  const std::string& dir, size_t cache_tiles);
+  ~TiledMerkleTree();
+  TiledMerkleTree(const TiledMerkleTree&) = delete;
+  TiledMerkleTree& operator=(const TiledMerkleTree&) = delete;
+
+  size_t NodeSize() const {
+    return treehasher_.DigestSize();
+  }
+
+  size_t LeafCount() const {
+    return leaf_count_;
+  }
+
+  // Returns the leaf hash, but does not append the data to the tree.
+  std::string LeafHash(const std::string& data) const {
+    return treehasher_.HashLeaf(data);
+  }
+
+  // The rest is as in MerkleTree, the tree is always fully evaluated.
+  size_t AddLeafHash(const std::string& hash);
+  std::string LeafHash(size_t leaf) const;
+  std::string CurrentRoot() const {
+    return RootAtSnapshot(leaf_count_);
+  }
+  std::string RootAtSnapshot(size_t snapshot) const;
+  std::vector<std::string> PathToRootAtSnapshot(size_t leaf,
+                                                size_t snapshot) const;
+  std::vector<std::string> SnapshotConsistency(size_t snapshot1,
+                                               size_t snapshot2) const;
+
+  // The nodes a CompactMerkleTree with the same leaves keeps, see
+  // CompactMerkleTree::FromFrontier().
+  std::vector<std::string> Frontier() const;
+
+  // Write out the tiles on the right edge, flush everything to disk,
+  // then record the leaf count.
+  void Sync();
+
+  // Empties the tree, recording it as such. The tiles on disk are
+  // overwritten as leaves are added again.
+  void Clear();
+
+  // Number of tiles read from disk so far.
+  uint64_t TileReads() const {
+    return tile_reads_;
+  }
+
+ private:
+  typedef std::shared_ptr<const std::string> Tile;
+  typedef std::list<std::pair<uint64_t, Tile>> TileList;
+
+  // Number of complete tiles in |tile_level|.
+  size_t CompleteTiles(size_t tile_level) const;
+  // Offset, in bytes, of node |index| of |level| in its tile.
+  size_t NodeOffset(size_t level, size_t index) const;
+  std::string Node(size_t level, size_t index) const;
+  void SetEdgeNode(size_t level, size_t index, const char* node);
+  // The root of the leaves in [begin, end), where |begin| is a multiple
+  // of the largest power of two smaller than |end| - |begin|, as for
+  // all the subtrees of the RFC 6962 definitions.
+  std::string SubtreeHash(size_t begin, size_t end) const;
+  void SubtreePath(size_t leaf, size_t begin, size_t end,
+                   std::vector<std::string>* path) const;
+  void SubtreeConsistency(size_t snapshot1, size_t begin, size_t end,
+                          bool complete_subtree,
+                          std::vector<std::string>* proof) const;
+  Tile GetTile(size_t tile_level, size_t tile_index) const;
+  void CacheTile(uint64_t key, const Tile& tile) const;
+  std::string TilesPath(size_t tile_level) const;
+  std::string MetadataPath() const;
+  void OpenTiles(size_t tile_level);
+  void WriteTile(size_t tile_level, size_t tile_index,
+                 const std::string& tile);
+  bool ReadMetadata(size_t* leaf_count) const;
+  void WriteMetadata() const;
+
+  const TreeHasher treehasher_;
+  const std::string dir_;
+  const size_t tile_bytes_;
+  const size_t cache_tiles_;
+  size_t leaf_count_;
+  // One per tile level.
+  std::vector<int> fds_;
+  // The tile on the right edge of each tile level, not complete yet.
+  std::vector<std::string> edge_;
+
+  mutable std::mutex cache_lock_;
+  // Most recently used first.
+  mutable TileList lru_;
+  mutable std::unordered_map<uint64_t, TileList::iterator> cached_;
+  mutable std::atomic<uint64_t> tile_reads_;
+};
+
+
+}  // namespace cert_trans
+
+#endif  // CERT_TRANS_MERKLETREE_TILED_MERKLE_TREE_H_
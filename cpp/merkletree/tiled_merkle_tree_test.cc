@@ -0,0 +1,199 @@
+#include "merkletree/tiled_merkle_tree.h"
+
+#include <gtest/gtest.h>
+#include <stdio.h>
+#include <memory>
+#include <string>
+
+#include "merkletree/compact_merkle_tree.h"
+#include "merkletree/merkle_tree.h"
+#include "merkletree/serial_hasher.h"
+#include "util/test_db.h"
+#include "util/testing.h"
+#include "util/util.h"
+
+namespace cert_trans {
+namespace {
+
+using std::string;
+using std::to_string;
+using std::unique_ptr;
+
+// Enough leaves for three tile levels.
+const size_t kLeafCount = 70000;
+
+
+class TiledMerkleTreeTest : public ::testing::Test {
+ protected:
+  unique_ptr<TiledMerkleTree> OpenTree(size_t cache_tiles) {
+    return unique_ptr<TiledMerkleTree>(
+        new TiledMerkleTree(unique_ptr<Sha256Hasher>(new Sha256Hasher),
+                            tmp_.TmpStorageDir(), cache_tiles));
+  }
+
+  // Adds leaves to both |tree| and |reference| up to |count|.
+  void Grow(TiledMerkleTree* tree, MerkleTree* reference, size_t count) {
+    while (reference->LeafCount() < count) {
+      const string hash(
+          reference->LeafHash("leaf" + to_string(reference->LeafCount())));
+      EXPECT_EQ(reference->AddLeafHash(hash), tree->AddLeafHash(hash));
+    }
+  }
+
+  TmpStorage tmp_;
+};
+
+
+TEST_F(TiledMerkleTreeTest, MatchesMerkleTree) {
+  unique_ptr<TiledMerkleTree> tree(OpenTree(16));
+  MerkleTree reference(unique_ptr<Sha256Hasher>(new Sha256Hasher));
+  EXPECT_EQ(reference.CurrentRoot(), tree->CurrentRoot());
+
+  for (size_t size = 1; size <= 600; ++size) {
+    Grow(tree.get(), &reference, size);
+    ASSERT_EQ(reference.CurrentRoot(), tree->CurrentRoot());
+    EXPECT_EQ(reference.PathToCurrentRoot(size / 3 + 1),
+              tree->PathToRootAtSnapshot(size / 3 + 1, size));
+    EXPECT_EQ(reference.SnapshotConsistency(size / 2, size),
+              tree->SnapshotConsistency(size / 2, size));
+  }
+  Grow(tree.get(), &reference, kLeafCount);
+  EXPECT_EQ(reference.CurrentRoot(), tree->CurrentRoot());
+  EXPECT_EQ(kLeafCount, tree->LeafCount());
+
+  for (size_t snapshot = 1; snapshot <= kLeafCount; snapshot += 997) {
+    EXPECT_EQ(reference.RootAtSnapshot(snapshot),
+              tree->RootAtSnapshot(snapshot));
+    for (size_t leaf = 1; leaf <= snapshot; leaf += snapshot / 5 + 1) {
+      EXPECT_EQ(reference.LeafHash(leaf), tree->LeafHash(leaf));
+      EXPECT_EQ(reference.PathToRootAtSnapshot(leaf, snapshot),
+                tree->PathToRootAtSnapshot(leaf, snapshot));
+    }
+    EXPECT_EQ(reference.SnapshotConsistency(snapshot, kLeafCount),
+              tree->SnapshotConsistency(snapshot, kLeafCount));
+  }
+
+  // Out of range.
+  EXPECT_EQ("", tree->RootAtSnapshot(kLeafCount + 1));
+  EXPECT_TRUE(tree->PathToRootAtSnapshot(0, kLeafCount).empty());
+  EXPECT_TRUE(tree->PathToRootAtSnapshot(2, 1).empty());
+  EXPECT_TRUE(tree->SnapshotConsistency(5, 5).empty());
+  EXPECT_TRUE(tree->SnapshotConsistency(5, kLeafCount + 1).empty());
+}
+
+
+TEST_F(TiledMerkleTreeTest, Frontier) {
+  unique_ptr<TiledMerkleTree> tree(OpenTree(16));
+  MerkleTree reference(unique_ptr<Sha256Hasher>(new Sha256Hasher));
+  for (size_t size : {0, 1, 255, 256, 257, 65535, 65536, 65537}) {
+    Grow(tree.get(), &reference, size);
+    const unique_ptr<CompactMerkleTree> compact(
+        CompactMerkleTree::FromFrontier(
+            size, tree->Frontier(),
+            unique_ptr<Sha256Hasher>(new Sha256Hasher)));
+    ASSERT_TRUE(compact != nullptr);
+    EXPECT_EQ(reference.CurrentRoot(), compact->CurrentRoot());
+  }
+}
+
+
+TEST_F(TiledMerkleTreeTest, ReopenAfterSync) {
+  MerkleTree reference(unique_ptr<Sha256Hasher>(new Sha256Hasher));
+  {
+    unique_ptr<TiledMerkleTree> tree(OpenTree(16));
+    Grow(tree.get(), &reference, 3000);
+    tree->Sync();
+
+    // Not synced, so this leaf should not be there next time.
+    tree->AddLeafHash(reference.LeafHash("unsynced"));
+  }
+
+  unique_ptr<TiledMerkleTree> tree(OpenTree(16));
+  EXPECT_EQ(3000U, tree->LeafCount());
+  EXPECT_EQ(reference.CurrentRoot(), tree->CurrentRoot());
+  Grow(tree.get(), &reference, 5000);
+  EXPECT_EQ(reference.CurrentRoot(), tree->CurrentRoot());
+  EXPECT_EQ(reference.PathToRootAtSnapshot(17, 4000),
+            tree->PathToRootAtSnapshot(17, 4000));
+}
+
+
+TEST_F(TiledMerkleTreeTest, ProofsReadFewTiles) {
+  MerkleTree reference(unique_ptr<Sha256Hasher>(new Sha256Hasher));
+  {
+    unique_ptr<TiledMerkleTree> tree(OpenTree(0));
+    Grow(tree.get(), &reference, kLeafCount);
+    tree->Sync();
+  }
+
+  // Start with an empty cache.
+  unique_ptr<TiledMerkleTree> tree(OpenTree(64));
+  EXPECT_EQ(reference.PathToRootAtSnapshot(12345, kLeafCount - 1),
+            tree->PathToRootAtSnapshot(12345, kLeafCount - 1));
+  // The tile of the leaf, the one above it, and the few covering the
+  // right edge of the tree.
+  EXPECT_LE(tree->TileReads(), 6U);
+
+  const uint64_t reads(tree->TileReads());
+  EXPECT_EQ(reference.PathToRootAtSnapshot(12346, kLeafCount - 1),
+            tree->PathToRootAtSnapshot(12346, kLeafCount - 1));
+  EXPECT_EQ(reads, tree->TileReads());
+}
+
+
+TEST_F(TiledMerkleTreeTest, Clear) {
+  {
+    MerkleTree reference(unique_ptr<Sha256Hasher>(new Sha256Hasher));
+    unique_ptr<TiledMerkleTree> tree(OpenTree(16));
+    Grow(tree.get(), &reference, 3000);
+    tree->Sync();
+    tree->Clear();
+    EXPECT_EQ(0U, tree->LeafCount());
+  }
+
+  // Cleared for good, and grown again with other leaves.
+  unique_ptr<TiledMerkleTree> tree(OpenTree(16));
+  EXPECT_EQ(0U, tree->LeafCount());
+  MerkleTree reference(unique_ptr<Sha256Hasher>(new Sha256Hasher));
+  while (reference.LeafCount() < 2000) {
+    const string hash(
+        reference.LeafHash("other" + to_string(reference.LeafCount())));
+    EXPECT_EQ(reference.AddLeafHash(hash), tree->AddLeafHash(hash));
+  }
+  EXPECT_EQ(reference.CurrentRoot(), tree->CurrentRoot());
+  EXPECT_EQ(reference.PathToRootAtSnapshot(17, 1500),
+            tree->PathToRootAtSnapshot(17, 1500));
+}
+
+
+TEST_F(TiledMerkleTreeTest, MismatchedTileHeightStartsEmpty) {
+  {
+    unique_ptr<TiledMerkleTree> tree(OpenTree(16));
+    tree->AddLeafHash(string(32, 'x'));
+    tree->Sync();
+  }
+
+  // Pretend the tree was written with another tile height.
+  const string metadata_file(tmp_.TmpStorageDir() + "/tiles");
+  string metadata;
+  ASSERT_TRUE(util::ReadTextFile(metadata_file, &metadata));
+  ASSERT_NE(string::npos, metadata.find(" 8 "));
+  metadata.replace(metadata.find(" 8 "), 3, " 4 ");
+  const string tmp_file(util::WriteTemporaryBinaryFile(
+      tmp_.TmpStorageDir() + "/tilesXXXXXX", metadata));
+  ASSERT_FALSE(tmp_file.empty());
+  ASSERT_EQ(0, rename(tmp_file.c_str(), metadata_file.c_str()));
+
+  unique_ptr<TiledMerkleTree> tree(OpenTree(16));
+  EXPECT_EQ(0U, tree->LeafCount());
+}
+
+
+}  // namespace
+}  // namespace cert_trans
+
+
+int main(int argc, char** argv) {
+  cert_trans::test::InitTesting(argv[0], &argc, &argv, true);
+  return RUN_ALL_TESTS();
+}
@@ -1,7 +1,11 @@
 #include "merkletree/tree_hasher.h"
 
 #include <assert.h>
+#include <string.h>
+#include <typeinfo>
+#include <vector>
 
+#include "merkletree/basic_tree_hasher.h"
 #include "merkletree/serial_hasher.h"
 
 using std::lock_guard;
@@ -9,9 +13,12 @@ using std::move;
 using std::mutex;
 using std::string;
 using std::unique_ptr;
+using std::vector;
 
 namespace {
 
+typedef BasicTreeHasher<Sha256Policy> Sha256TreeHasher;
+
 const char kLeafPrefix('\x00');
 const char kNodePrefix('\x01');
 
@@ -23,24 +30,88 @@ std::string EmptyHash(SerialHasher* hasher) {
 }  // namespace
 
 TreeHasher::TreeHasher(unique_ptr<SerialHasher> hasher)
-    : hasher_(move(hasher)), empty_hash_(EmptyHash(hasher_.get())) {
+    : hasher_(move(hasher)),
+      // Not a subclass, which could hash differently.
+      sha256_(hasher_ && typeid(*hasher_) == typeid(Sha256Hasher)),
+      empty_hash_(EmptyHash(hasher_.get())) {
   assert(hasher_);
 }
 
 string TreeHasher::HashLeaf(const string& data) const {
-  lock_guard<mutex> lock(lock_);
-  hasher_->Reset();
-  hasher_->Update(string(1, kLeafPrefix));
-  hasher_->Update(data);
-  return hasher_->Final();
+  string digest(DigestSize(), '\0');
+  HashLeaf(data.data(), data.size(), &digest[0]);
+  return digest;
 }
 
 string TreeHasher::HashChildren(const string& left_child,
                                 const string& right_child) const {
+  if (sha256_ && left_child.size() == Sha256TreeHasher::kDigestSize &&
+      right_child.size() == Sha256TreeHasher::kDigestSize) {
+    string digest(Sha256TreeHasher::kDigestSize, '\0');
+    Sha256TreeHasher::HashChildren(left_child.data(), right_child.data(),
+                                   &digest[0]);
+    return digest;
+  }
+
   lock_guard<mutex> lock(lock_);
   hasher_->Reset();
-  hasher_->Update(string(1, kNodePrefix));
-  hasher_->Update(left_child);
-  hasher_->Update(right_child);
+  hasher_->Update(&kNodePrefix, 1);
+  hasher_->Update(left_child.data(), left_child.size());
+  hasher_->Update(right_child.data(), right_child.size());
   return hasher_->Final();
 }
+
+void TreeHasher::HashLeaf(const char* data, size_t size, char* digest) const {
+  if (sha256_) {
+    Sha256TreeHasher::HashLeaf(data, size, digest);
+    return;
+  }
+
+  lock_guard<mutex> lock(lock_);
+  hasher_->Reset();
+  hasher_->Update(&kLeafPrefix, 1);
+  hasher_->Update(data, size);
+  hasher_->Final(digest);
+}
+
+void TreeHasher::HashChildren(const char* left_child, const char* right_child,
+                              char* digest) const {
+  if (sha256_) {
+    Sha256TreeHasher::HashChildren(left_child, right_child, digest);
+    return;
+  }
+
+  const size_t digest_size(DigestSize());
+  lock_guard<mutex> lock(lock_);
+  hasher_->Reset();
+  hasher_->Update(&kNodePrefix, 1);
+  hasher_->Update(left_child, digest_size);
+  hasher_->Update(right_child, digest_size);
+  // The inputs have all been consumed, so it is fine for |digest| to
+  // overlap with them.
+  hasher_->Final(digest);
+}
+
+void TreeHasher::HashChildrenBatch(const char* children, size_t count,
+                                   char* parents) const {
+  if (sha256_) {
+    Sha256TreeHasher::HashChildrenBatch(children, count, parents);
+    return;
+  }
+
+  const size_t digest_size(DigestSize());
+  const size_t message_size(1 + 2 * digest_size);
+  vector<char> messages(count * message_size);
+  for (size_t i = 0; i < count; ++i) {
+    messages[i * message_size] = kNodePrefix;
+    memcpy(&messages[i * message_size + 1], children + i * 2 * digest_size,
+           2 * digest_size);
+  }
+
+  lock_guard<mutex> lock(lock_);
+  hasher_->HashBatch(messages.data(), message_size, count, parents);
+}
+
+unique_ptr<TreeHasher> TreeHasher::Clone() const {
+  return unique_ptr<TreeHasher>(new TreeHasher(hasher_->Create()));
+}
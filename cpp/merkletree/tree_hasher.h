@@ -8,6 +8,9 @@
 
 #include "merkletree/serial_hasher.h"
 
+// Hashes the leaves and nodes of a Merkle tree with |hasher|. A
+// Sha256Hasher is not called at all, BasicTreeHasher<Sha256Policy>
+// being used in its place, without locking.
 class TreeHasher {
  public:
   TreeHasher(std::unique_ptr<SerialHasher> hasher);
@@ -30,9 +33,30 @@ class TreeHasher {
   std::string HashChildren(const std::string& left_child,
                            const std::string& right_child) const;
 
+  // Allocation-free versions of the above, writing the DigestSize()
+  // bytes of the result to |digest|. For HashChildren(), both children
+  // must be DigestSize() bytes long, and |digest| may point to either
+  // of them.
+  void HashLeaf(const char* data, size_t size, char* digest) const;
+  void HashChildren(const char* left_child, const char* right_child,
+                    char* digest) const;
+
+  // Compute the parents of |count| pairs of digests, laid out back to
+  // back in |children| (left child first), writing the |count| parent
+  // digests back to back to |parents|. This is equivalent to calling
+  // HashChildren() on every pair, but much cheaper.
+  void HashChildrenBatch(const char* children, size_t count,
+                         char* parents) const;
+
+  // A new TreeHasher using the same hash function, e.g. to hash on
+  // several threads at once without contending on this one.
+  std::unique_ptr<TreeHasher> Clone() const;
+
  private:
   mutable std::mutex lock_;
   const std::unique_ptr<SerialHasher> hasher_;
+  // Whether |hasher_| is a plain Sha256Hasher.
+  const bool sha256_;
   // The pre-computed hash of an empty tree.
   const std::string empty_hash_;
 };
@@ -65,6 +65,15 @@ TestVector* TestVectors<Sha256Hasher>() {
   return &test_sha256;
 }
 
+// Hashes the same as Sha256Hasher, but goes through the SerialHasher
+// interface rather than BasicTreeHasher<Sha256Policy>.
+class SerialSha256Hasher : public Sha256Hasher {};
+
+template <>
+TestVector* TestVectors<SerialSha256Hasher>() {
+  return &test_sha256;
+}
+
 template <class T>
 class TreeHasherTest : public ::testing::Test {
  protected:
@@ -75,7 +84,7 @@ class TreeHasherTest : public ::testing::Test {
   }
 };
 
-typedef ::testing::Types<Sha256Hasher> Hashers;
+typedef ::testing::Types<Sha256Hasher, SerialSha256Hasher> Hashers;
 
 TYPED_TEST_CASE(TreeHasherTest, Hashers);
 
@@ -149,6 +158,50 @@ TYPED_TEST(TreeHasherTest, TestVectors) {
   }
 }
 
+TYPED_TEST(TreeHasherTest, HashChildrenBatch) {
+  const size_t digest_size(this->tree_hasher_.DigestSize());
+  const size_t kCount = 7;
+  string children;
+  for (size_t i = 0; i < 2 * kCount; ++i)
+    children.append(this->tree_hasher_.HashLeaf(std::to_string(i)));
+
+  string parents(kCount * digest_size, '\0');
+  this->tree_hasher_.HashChildrenBatch(children.data(), kCount, &parents[0]);
+  for (size_t i = 0; i < kCount; ++i) {
+    EXPECT_EQ(H(this->tree_hasher_.HashChildren(
+                  children.substr(2 * i * digest_size, digest_size),
+                  children.substr((2 * i + 1) * digest_size, digest_size))),
+              H(parents.substr(i * digest_size, digest_size)));
+  }
+
+  // An empty batch is fine too.
+  this->tree_hasher_.HashChildrenBatch(children.data(), 0, &parents[0]);
+}
+
+TYPED_TEST(TreeHasherTest, BufferOverloads) {
+  const size_t digest_size(this->tree_hasher_.DigestSize());
+  const string data("some leaf data");
+  string digest(digest_size, '\0');
+  this->tree_hasher_.HashLeaf(data.data(), data.size(), &digest[0]);
+  EXPECT_EQ(H(this->tree_hasher_.HashLeaf(data)), H(digest));
+
+  const string left(this->tree_hasher_.HashLeaf("left"));
+  const string right(this->tree_hasher_.HashLeaf("right"));
+  const string expected(this->tree_hasher_.HashChildren(left, right));
+  this->tree_hasher_.HashChildren(left.data(), right.data(), &digest[0]);
+  EXPECT_EQ(H(expected), H(digest));
+
+  // The output may alias either input.
+  string in_place(left);
+  this->tree_hasher_.HashChildren(in_place.data(), right.data(),
+                                  &in_place[0]);
+  EXPECT_EQ(H(expected), H(in_place));
+  in_place = right;
+  this->tree_hasher_.HashChildren(left.data(), in_place.data(),
+                                  &in_place[0]);
+  EXPECT_EQ(H(expected), H(in_place));
+}
+
 #undef S
 #undef H
 
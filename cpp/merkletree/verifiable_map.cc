@@ -1,9 +1,11 @@
 #include <array>
 #include <string>
+#include <utility>
 
 #include "merkletree/verifiable_map.h"
 
 
+using std::move;
 using std::string;
 using std::unique_ptr;
 using std::vector;
@@ -41,6 +43,17 @@ vector<string> VerifiableMap::InclusionProof(const string& key) {
 }
 
 
+SparseMerkleTree::BatchProof VerifiableMap::BatchInclusionProof(
+    const vector<string>& keys) {
+  vector<SparseMerkleTree::Path> paths;
+  paths.reserve(keys.size());
+  for (const auto& key : keys) {
+    paths.emplace_back(PathFromKey(key));
+  }
+  return merkle_tree_.BatchInclusionProof(move(paths));
+}
+
+
 SparseMerkleTree::Path VerifiableMap::PathFromKey(const string& key) const {
   unique_ptr<SerialHasher> h(hasher_model_->Create());
   h->Update(key);
@@ -28,6 +28,10 @@ class VerifiableMap {
 
   std::vector<std::string> InclusionProof(const std::string& key);
 
+  // As SparseMerkleTree::BatchInclusionProof(), for the paths of |keys|.
+  SparseMerkleTree::BatchProof BatchInclusionProof(
+      const std::vector<std::string>& keys);
+
  private:
   SparseMerkleTree::Path PathFromKey(const std::string& key) const;
 
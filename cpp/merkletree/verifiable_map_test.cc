@@ -2,6 +2,7 @@
 #include <gtest/gtest.h>
 #include <string>
 
+#include "merkletree/sparse_merkle_verifier.h"
 #include "merkletree/verifiable_map.h"
 #include "util/status_test_util.h"
 #include "util/testing.h"
@@ -14,6 +15,7 @@ namespace {
 using std::array;
 using std::string;
 using std::unique_ptr;
+using std::vector;
 using util::StatusOr;
 using util::testing::StatusIs;
 using util::ToBase64;
@@ -47,6 +49,29 @@ TEST_F(VerifiableMapTest, TestSetGet) {
 }
 
 
+TEST_F(VerifiableMapTest, TestBatchInclusionProof) {
+  vector<string> keys;
+  for (int i = 0; i < 50; ++i) {
+    keys.emplace_back("key" + std::to_string(i));
+    map_.Set(keys.back(), "value" + std::to_string(i));
+  }
+  keys.emplace_back("unknown_key");
+
+  SparseMerkleVerifier::LeafList leaves;
+  for (const string& key : keys) {
+    Sha256Hasher hasher;
+    hasher.Update(key);
+    const StatusOr<string> value(map_.Get(key));
+    leaves.emplace_back(PathFromBytes(hasher.Final()),
+                        value.ok() ? value.ValueOrDie() : "");
+  }
+
+  SparseMerkleVerifier verifier(unique_ptr<Sha256Hasher>(new Sha256Hasher));
+  EXPECT_TRUE(verifier.VerifyBatchProof(leaves, map_.BatchInclusionProof(keys),
+                                        map_.CurrentRoot()));
+}
+
+
 // TODO(alcutter): Lots and lots more tests.
 
 
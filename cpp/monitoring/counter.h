@@ -30,15 +30,22 @@ class Counter : public Metric {
 
   double Get(const LabelTypes&... labels) const;
 
+  // Returns the cell holding the count for |labels|, which hot paths
+  // can keep and Increment() directly, without looking it up (or
+  // taking any lock) each time. It lives as long as the counter.
+  MetricCell* WithLabels(const LabelTypes&... labels);
+
   std::map<std::vector<std::string>, Metric::TimestampedValue> CurrentValues()
       const override;
 
+  void SnapshotValues(std::vector<Metric::Sample>* samples) const override;
+
  private:
   Counter(const std::string& name,
           const typename NameType<LabelTypes>::name&... label_names,
           const std::string& help);
 
-  LabelledValues<LabelTypes...> values_;
+  LabelledValues<MetricCell, LabelTypes...> values_;
 };
 
 
@@ -81,6 +88,12 @@ double Counter<LabelTypes...>::Get(const LabelTypes&... labels) const {
 }
 
 
+template <class... LabelTypes>
+MetricCell* Counter<LabelTypes...>::WithLabels(const LabelTypes&... labels) {
+  return values_.Cell(labels...);
+}
+
+
 template <class... LabelTypes>
 std::map<std::vector<std::string>, Metric::TimestampedValue>
 Counter<LabelTypes...>::CurrentValues() const {
@@ -88,6 +101,13 @@ Counter<LabelTypes...>::CurrentValues() const {
 }
 
 
+template <class... LabelTypes>
+void Counter<LabelTypes...>::SnapshotValues(
+    std::vector<Metric::Sample>* samples) const {
+  values_.SnapshotValues(samples);
+}
+
+
 }  // namespace cert_trans
 
 #endif  // CERT_TRANS_MONITORING_COUNTER_H_
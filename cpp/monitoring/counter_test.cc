@@ -4,6 +4,7 @@
 #include <gmock/gmock.h>
 #include <gtest/gtest.h>
 #include <memory>
+#include <thread>
 
 #include "util/testing.h"
 
@@ -91,6 +92,40 @@ TEST_F(CounterTest, TestCounterWithLabelsMultiValues) {
 }
 
 
+TEST_F(CounterTest, TestCounterCell) {
+  std::unique_ptr<Counter<std::string>> counter(
+      Counter<std::string>::New("name", "a string", "help"));
+  MetricCell* const cell(counter->WithLabels("alpha"));
+  EXPECT_EQ(cell, counter->WithLabels("alpha"));
+  EXPECT_TRUE(counter->CurrentValues().empty());
+  cell->Increment();
+  counter->IncrementBy("alpha", 2);
+  EXPECT_EQ(3, cell->Get());
+  EXPECT_EQ(3, counter->Get("alpha"));
+  EXPECT_EQ(0, counter->Get("beta"));
+  EXPECT_EQ(1, counter->CurrentValues().size());
+}
+
+
+TEST_F(CounterTest, TestCounterConcurrentIncrements) {
+  std::unique_ptr<Counter<>> counter(Counter<>::New("name", "help"));
+  const int kNumThreads(8);
+  const int kNumIncrements(10000);
+  vector<std::thread> threads;
+  for (int i = 0; i < kNumThreads; ++i) {
+    threads.emplace_back([&counter]() {
+      for (int j = 0; j < kNumIncrements; ++j) {
+        counter->Increment();
+      }
+    });
+  }
+  for (auto& thread : threads) {
+    thread.join();
+  }
+  EXPECT_EQ(kNumThreads * kNumIncrements, counter->Get());
+}
+
+
 }  // namespace cert_trans
 
 
@@ -2,11 +2,11 @@
 #define CERT_TRANS_MONITORING_EVENT_METRIC_H_
 
 #include <memory>
-#include <mutex>
 #include <string>
 
 #include "monitoring/counter.h"
 #include "monitoring/monitoring.h"
+#include "monitoring/windowed_histogram.h"
 
 namespace cert_trans {
 
@@ -18,6 +18,12 @@ namespace cert_trans {
 // which contains the sum of all events broken down by labels, and another
 // called "|base_name|_count" which contains the number of measurements taken,
 // also broken down by labels.
+//
+// The amounts recorded over the last 1, 5 and 15 minutes are also kept
+// in-process, so that the rate of events and quantiles of the amounts
+// over those windows can be read without an external metrics system,
+// and the rates are exported as a gauge called "|base_name|_rate",
+// with a "window" label ("1m", "5m" or "15m") after the others.
 template <class... LabelTypes>
 class EventMetric {
  public:
@@ -32,10 +38,15 @@ class EventMetric {
   // increments the "|base_name|_count" metric by 1.
   void RecordEvent(const LabelTypes&... labels, double amount);
 
+  // Returns the amounts recorded for |labels| over the last few
+  // minutes. It lives as long as this object.
+  const WindowedHistogramCell* Windows(const LabelTypes&... labels);
+
  private:
-  std::mutex mutex_;
   std::unique_ptr<Counter<LabelTypes...>> totals_;
   std::unique_ptr<Counter<LabelTypes...>> counts_;
+  LabelledValues<WindowedHistogramCell, LabelTypes...> windows_;
+  const std::unique_ptr<WindowedRates<LabelTypes...>> rates_;
 };
 
 
@@ -47,16 +58,26 @@ EventMetric<LabelTypes...>::EventMetric(
     : totals_(Counter<LabelTypes...>::New(base_name + "_overall_sum",
                                           label_names..., help)),
       counts_(Counter<LabelTypes...>::New(base_name + "_count", label_names...,
-                                          help + " (count)")) {
+                                          help + " (count)")),
+      windows_(base_name + "_rate", label_names...),
+      rates_(new WindowedRates<LabelTypes...>(base_name, label_names..., help,
+                                              &windows_)) {
 }
 
 
 template <class... LabelTypes>
 void EventMetric<LabelTypes...>::RecordEvent(const LabelTypes&... labels,
                                              double amount) {
-  std::lock_guard<std::mutex> lock(mutex_);
   totals_->IncrementBy(labels..., amount);
   counts_->Increment(labels...);
+  windows_.Cell(labels...)->Record(amount);
+}
+
+
+template <class... LabelTypes>
+const WindowedHistogramCell* EventMetric<LabelTypes...>::Windows(
+    const LabelTypes&... labels) {
+  return windows_.Cell(labels...);
 }
 
 
@@ -27,16 +27,23 @@ class Gauge : public Metric {
 
   void Set(const LabelTypes&... labels, double value);
 
+  // Returns the cell holding the value for |labels|, which hot paths
+  // can keep and Set() directly, without looking it up each time. It
+  // lives as long as the gauge.
+  MetricCell* WithLabels(const LabelTypes&... labels);
+
   // TODO(alcutter): Not over the moon about having this here.
   std::map<std::vector<std::string>, Metric::TimestampedValue> CurrentValues()
       const override;
 
+  void SnapshotValues(std::vector<Metric::Sample>* samples) const override;
+
  private:
   Gauge(const std::string& name,
         const typename NameType<LabelTypes>::name&... label_names,
         const std::string& help);
 
-  LabelledValues<LabelTypes...> values_;
+  LabelledValues<MetricCell, LabelTypes...> values_;
 };
 
 
@@ -72,6 +79,12 @@ void Gauge<LabelTypes...>::Set(const LabelTypes&... labels, double value) {
 }
 
 
+template <class... LabelTypes>
+MetricCell* Gauge<LabelTypes...>::WithLabels(const LabelTypes&... labels) {
+  return values_.Cell(labels...);
+}
+
+
 template <class... LabelTypes>
 std::map<std::vector<std::string>, Metric::TimestampedValue>
 Gauge<LabelTypes...>::CurrentValues() const {
@@ -79,6 +92,13 @@ Gauge<LabelTypes...>::CurrentValues() const {
 }
 
 
+template <class... LabelTypes>
+void Gauge<LabelTypes...>::SnapshotValues(
+    std::vector<Metric::Sample>* samples) const {
+  values_.SnapshotValues(samples);
+}
+
+
 }  // namespace cert_trans
 
 
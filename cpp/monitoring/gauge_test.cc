@@ -96,6 +96,17 @@ TEST_F(GaugeTest, TestGaugeWithLabelsMultiValues) {
 }
 
 
+TEST_F(GaugeTest, TestGaugeCell) {
+  std::unique_ptr<Gauge<std::string>> gauge(
+      Gauge<std::string>::New("name", "a string", "help"));
+  MetricCell* const cell(gauge->WithLabels("alpha"));
+  cell->Set(100);
+  EXPECT_EQ(100, gauge->Get("alpha"));
+  gauge->Set("alpha", 50);
+  EXPECT_EQ(50, cell->Get());
+}
+
+
 }  // namespace cert_trans
 
 
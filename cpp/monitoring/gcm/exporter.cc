@@ -2,8 +2,13 @@
 
 #include <gflags/gflags.h>
 #include <glog/logging.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <algorithm>
+#include <cmath>
 #include <sstream>
 
+#include "monitoring/histogram.h"
 #include "monitoring/monitoring.h"
 #include "monitoring/registry.h"
 #include "net/url.h"
@@ -24,6 +29,14 @@ DEFINE_int32(google_compute_monitoring_credentials_refresh_interval_minutes,
              "GCM.");
 DEFINE_int32(google_compute_monitoring_retry_delay_seconds, 5,
              "Seconds between retrying failed GCM requests.");
+DEFINE_int32(google_compute_monitoring_max_timeseries_per_request, 200,
+             "Maximum number of timeseries to push to GCM in one request.");
+DEFINE_int32(google_compute_monitoring_max_concurrent_requests, 4,
+             "Maximum number of requests pushing metric values to GCM at "
+             "once.");
+DEFINE_int32(google_compute_monitoring_resend_interval_seconds, 300,
+             "Seconds after which the values which have not changed are "
+             "pushed to GCM again (0 to push every value every time).");
 
 
 namespace cert_trans {
@@ -32,14 +45,17 @@ using std::bind;
 using std::chrono::minutes;
 using std::chrono::seconds;
 using std::chrono::system_clock;
+using std::lock_guard;
 using std::make_pair;
 using std::mutex;
+using std::pair;
 using std::ostringstream;
 using std::placeholders::_1;
 using std::string;
 using std::thread;
 using std::unique_lock;
 using std::unique_ptr;
+using std::vector;
 using util::Executor;
 using util::SyncTask;
 using util::Task;
@@ -62,6 +78,11 @@ namespace {
 // Label and Metric -name prefix.
 const char kCloudPrefix[] = "custom.cloudmonitoring.googleapis.com/ct/";
 
+// Custom metrics can only be doubles, so histograms are pushed as
+// these quantiles, told apart by this extra label.
+const char kQuantileLabel[] = "quantile";
+const double kQuantiles[] = {0.5, 0.9, 0.99};
+
 
 inline std::string RFC3339Time(const system_clock::time_point& when) {
   const std::time_t now_c(system_clock::to_time_t(when));
@@ -80,7 +101,13 @@ GCMExporter::GCMExporter(const string& instance_name, UrlFetcher* fetcher,
       fetcher_(CHECK_NOTNULL(fetcher)),
       executor_(CHECK_NOTNULL(executor)),
       task_(executor_),
-      metrics_created_(false) {
+      metrics_created_(false),
+      batches_in_flight_(0),
+      last_body_size_(0) {
+  JsonObject common_labels;
+  common_labels.Add((kCloudPrefix + string("instance")).c_str(),
+                    instance_name_);
+  common_labels_ = common_labels.ToString();
   executor_->Add(bind(&GCMExporter::PushMetrics, this));
 }
 
@@ -161,6 +188,10 @@ void GCMExporter::CreateMetrics() {
     for (const auto& label : m->LabelNames()) {
       AddLabelDescription(label, label, &labels);
     }
+    if (m->Type() == Metric::HISTOGRAM) {
+      AddLabelDescription(kQuantileLabel, "Quantile of the distribution.",
+                          &labels);
+    }
 
     JsonObject desc;
     switch (m->Type()) {
@@ -170,6 +201,7 @@ void GCMExporter::CreateMetrics() {
         desc.Add("metricType", "gauge");
         break;
       case Metric::GAUGE:
+      case Metric::HISTOGRAM:
         desc.Add("metricType", "gauge");
         break;
       default:
@@ -224,6 +256,13 @@ void AddLabel(const string& key, const string& value, JsonObject* labels) {
 }
 
 
+void AppendDouble(double value, string* out) {
+  char buf[32];
+  snprintf(buf, sizeof(buf), "%.17g", value);
+  out->append(buf);
+}
+
+
 }  // namespace
 
 
@@ -246,76 +285,205 @@ void GCMExporter::PushMetrics() {
     CreateMetrics();
   }
 
-  // Build up the JSON write request into this object:
-  JsonObject metric_write;
-  metric_write.Add("kind", "cloudmonitoring#writeTimeseriesRequest");
+  // According to
+  // https://cloud.google.com/monitoring/v2beta2/timeseries/write
+  // GAUGE types should have a zero size timerange here
+  // Which implies we need to use the current time rather than the time the
+  // value was set because there's a [short ~5m] horizon over which GCM
+  // won't accept samples.
+  const system_clock::time_point now(system_clock::now());
+  vector<pair<Series*, double>> pending;
+  CollectChangedSeries(now, &pending);
+
+  const size_t batch_size(static_cast<size_t>(
+      std::max(FLAGS_google_compute_monitoring_max_timeseries_per_request,
+               1)));
+  const string time(RFC3339Time(now));
+  {
+    lock_guard<mutex> lock(mutex_);
+    CHECK(queued_batches_.empty());
+    CHECK_EQ(0, batches_in_flight_);
+    for (size_t i = 0; i < pending.size(); i += batch_size) {
+      unique_ptr<Batch> batch(new Batch);
+      EncodeBatch(time, pending.begin() + i,
+                  pending.begin() + std::min(i + batch_size, pending.size()),
+                  batch.get());
+      queued_batches_.emplace_back(std::move(batch));
+    }
+  }
 
-  JsonObject common_labels;
-  AddLabel("instance", instance_name_, &common_labels);
-  metric_write.Add("commonLabels", common_labels);
+  if (pending.empty()) {
+    VLOG(1) << "No metrics changed.";
+    executor_->Delay(
+        seconds(FLAGS_google_compute_monitoring_push_interval_seconds),
+        task_.task()->AddChild(bind(&GCMExporter::PushMetrics, this)));
+    return;
+  }
+  VLOG(1) << "Pushing " << pending.size() << " metric values...";
+  SendBatches();
+}
+
+
+void GCMExporter::CollectChangedSeries(
+    system_clock::time_point now, vector<pair<Series*, double>>* pending) {
+  const seconds resend_interval(
+      FLAGS_google_compute_monitoring_resend_interval_seconds);
+  const auto add([now, resend_interval, pending](Series* series,
+                                                 double value) {
+    // Those values cannot be encoded in JSON.
+    if (!std::isfinite(value)) {
+      return;
+    }
+    if (!series->pushed || series->pushed_value != value ||
+        now - series->pushed_at >= resend_interval) {
+      pending->emplace_back(series, value);
+    }
+  });
 
   const std::set<const Metric*> metrics(Registry::Instance()->GetMetrics());
-  JsonArray timeseries;
+  lock_guard<mutex> lock(mutex_);
   for (auto& m : metrics) {
     CHECK_NOTNULL(m);
-    for (auto& p : m->CurrentValues()) {
-      JsonObject labels;
-      for (size_t i(0); i < p.first.size(); ++i) {
-        AddLabel(m->LabelName(i), p.first[i], &labels);
+    if (m->Type() == Metric::HISTOGRAM) {
+      m->SnapshotDistributions(&distributions_);
+      for (const auto& d : distributions_) {
+        for (size_t i = 0; i < sizeof(kQuantiles) / sizeof(kQuantiles[0]);
+             ++i) {
+          add(GetSeries(*m, *d.labels, i),
+              Quantile(d.distribution, kQuantiles[i]));
+        }
       }
+      continue;
+    }
+    m->SnapshotValues(&samples_);
+    for (const auto& sample : samples_) {
+      add(GetSeries(*m, *sample.labels, -1), sample.value.second);
+    }
+  }
+}
 
-      JsonObject desc;
-      desc.Add("labels", labels);
-      desc.Add("metric", kCloudPrefix + m->Name());
-
-      JsonObject ts;
-      ts.Add("timeseriesDesc", desc);
-
-      JsonObject point;
-      // According to
-      // https://cloud.google.com/monitoring/v2beta2/timeseries/write
-      // GAUGE types should have a zero size timerange here
-      // Which implies we need to use the current time rather than the time the
-      // value was set because there's a [short ~5m] horizon over which GCM
-      // won't accept samples.
-      const auto now(system_clock::now());
-      point.Add("start", RFC3339Time(now));
-      point.Add("end", RFC3339Time(now));
-      point.Add("doubleValue", p.second.second);
-      ts.Add("point", point);
-
-      timeseries.Add(&ts);
+
+GCMExporter::Series* GCMExporter::GetSeries(const Metric& metric,
+                                            const vector<string>& labels,
+                                            int quantile) {
+  Series* const series(&series_[SeriesKey(&metric, &labels, quantile)]);
+  if (series->desc.empty()) {
+    JsonObject label_values;
+    for (size_t i(0); i < labels.size(); ++i) {
+      AddLabel(metric.LabelName(i), labels[i], &label_values);
+    }
+    if (quantile >= 0) {
+      ostringstream value;
+      value << kQuantiles[quantile];
+      AddLabel(kQuantileLabel, value.str(), &label_values);
     }
+    JsonObject desc;
+    desc.Add("labels", label_values);
+    desc.Add("metric", kCloudPrefix + metric.Name());
+    series->desc = desc.ToString();
   }
-  metric_write.Add("timeseries", timeseries);
+  return series;
+}
 
-  UrlFetcher::Request req(
-      (URL(FLAGS_google_compute_monitoring_base_url + "/timeseries:write")));
-  req.verb = UrlFetcher::Verb::POST;
-  req.headers.insert(make_pair("Content-Type", "application/json"));
-  req.headers.insert(make_pair("Authorization", "Bearer " + bearer_token_));
-  req.body = metric_write.ToString();
-
-  UrlFetcher::Response* resp(new UrlFetcher::Response);
-  VLOG(1) << "Pushing metrics...";
-  VLOG(2) << req.body;
-  fetcher_->Fetch(req, resp,
-                  task_.task()->AddChild(
-                      bind(&GCMExporter::PushMetricsDone, this, resp, _1)));
+
+// Rather than building the request as JSON objects, only to encode
+// them, the parts of it which vary are written out directly, and the
+// rest was encoded once.
+void GCMExporter::EncodeBatch(
+    const string& time, vector<pair<Series*, double>>::const_iterator begin,
+    vector<pair<Series*, double>>::const_iterator end, Batch* batch) {
+  string* const body(&batch->body);
+  body->reserve(last_body_size_);
+  body->append(
+      "{\"kind\":\"cloudmonitoring#writeTimeseriesRequest\","
+      "\"commonLabels\":");
+  body->append(common_labels_);
+  body->append(",\"timeseries\":[");
+  for (auto it(begin); it != end; ++it) {
+    if (it != begin) {
+      body->push_back(',');
+    }
+    body->append("{\"timeseriesDesc\":");
+    body->append(it->first->desc);
+    body->append(",\"point\":{\"start\":\"");
+    body->append(time);
+    body->append("\",\"end\":\"");
+    body->append(time);
+    body->append("\",\"doubleValue\":");
+    AppendDouble(it->second, body);
+    body->append("}}");
+  }
+  body->append("]}");
+  last_body_size_ = body->size();
+  batch->values.assign(begin, end);
+}
+
+
+void GCMExporter::SendBatches() {
+  while (true) {
+    unique_ptr<Batch> batch;
+    {
+      lock_guard<mutex> lock(mutex_);
+      if (queued_batches_.empty() ||
+          batches_in_flight_ >=
+              std::max(FLAGS_google_compute_monitoring_max_concurrent_requests,
+                       1)) {
+        return;
+      }
+      batch = std::move(queued_batches_.front());
+      queued_batches_.pop_front();
+      ++batches_in_flight_;
+    }
+
+    UrlFetcher::Request req(
+        (URL(FLAGS_google_compute_monitoring_base_url + "/timeseries:write")));
+    req.verb = UrlFetcher::Verb::POST;
+    req.headers.insert(make_pair("Content-Type", "application/json"));
+    req.headers.insert(make_pair("Authorization", "Bearer " + bearer_token_));
+    req.body.swap(batch->body);
+
+    UrlFetcher::Response* const resp(new UrlFetcher::Response);
+    VLOG(2) << req.body;
+    Batch* const batch_ptr(batch.release());
+    fetcher_->Fetch(req, resp,
+                    task_.task()->AddChild(bind(&GCMExporter::PushBatchDone,
+                                                this, batch_ptr, resp, _1)));
+  }
 }
 
 
-void GCMExporter::PushMetricsDone(UrlFetcher::Response* resp, Task* task) {
+void GCMExporter::PushBatchDone(Batch* batch, UrlFetcher::Response* resp,
+                                Task* task) {
+  unique_ptr<Batch> batch_deleter(batch);
   unique_ptr<UrlFetcher::Response> resp_deleter(resp);
-  if (!task->status().ok() || resp->status_code != 200) {
-    num_gcm_push_failures->Increment();
-    LOG(WARNING) << "Failed to push metrics to GCM, status: " << task->status()
-                 << ", reponse code: " << resp->status_code;
-  } else {
-    VLOG(1) << "Metrics pushed.";
-    VLOG(2) << resp->body;
+  bool round_done;
+  {
+    lock_guard<mutex> lock(mutex_);
+    if (!task->status().ok() || resp->status_code != 200) {
+      num_gcm_push_failures->Increment();
+      LOG(WARNING) << "Failed to push metrics to GCM, status: "
+                   << task->status()
+                   << ", reponse code: " << resp->status_code;
+      // The values will be pushed again with the next round, being
+      // still unpushed.
+    } else {
+      VLOG(2) << resp->body;
+      const system_clock::time_point now(system_clock::now());
+      for (const auto& value : batch->values) {
+        value.first->pushed = true;
+        value.first->pushed_value = value.second;
+        value.first->pushed_at = now;
+      }
+    }
+    --batches_in_flight_;
+    round_done = batches_in_flight_ == 0 && queued_batches_.empty();
   }
 
+  if (!round_done) {
+    SendBatches();
+    return;
+  }
+  VLOG(1) << "Metrics pushed.";
   executor_->Delay(
       seconds(FLAGS_google_compute_monitoring_push_interval_seconds),
       task_.task()->AddChild(bind(&GCMExporter::PushMetrics, this)));
@@ -3,9 +3,17 @@
 
 #include <chrono>
 #include <condition_variable>
+#include <deque>
+#include <map>
 #include <memory>
+#include <mutex>
+#include <string>
 #include <thread>
+#include <tuple>
+#include <utility>
+#include <vector>
 
+#include "monitoring/metric.h"
 #include "net/url_fetcher.h"
 #include "util/executor.h"
 #include "util/sync_task.h"
@@ -13,6 +21,10 @@
 namespace cert_trans {
 
 
+// Pushes the registered metrics to GCM periodically. Only the series
+// whose value changed since they were last pushed are sent (and those
+// not sent for a while, so that GCM keeps showing them), split into
+// requests of a bounded size, several of which are in flight at once.
 class GCMExporter {
  public:
   GCMExporter(const std::string& instance_name, UrlFetcher* fetcher,
@@ -25,8 +37,40 @@ class GCMExporter {
 
   void CreateMetrics();
 
+  // A value pushed to GCM: that of a metric for one set of labels, and
+  // for histograms, one of the quantiles (or -1 for other metrics).
+  typedef std::tuple<const Metric*, const std::vector<std::string>*, int>
+      SeriesKey;
+
+  struct Series {
+    // The timeseriesDesc JSON of the series, encoded once.
+    std::string desc;
+    bool pushed = false;
+    double pushed_value = 0;
+    std::chrono::system_clock::time_point pushed_at;
+  };
+
+  // The series pushed by one request, with their values.
+  struct Batch {
+    std::vector<std::pair<Series*, double>> values;
+    std::string body;
+  };
+
   void PushMetrics();
-  void PushMetricsDone(UrlFetcher::Response* resp, util::Task* task);
+  // Adds the series which need pushing to |pending|.
+  void CollectChangedSeries(
+      std::chrono::system_clock::time_point now,
+      std::vector<std::pair<Series*, double>>* pending);
+  Series* GetSeries(const Metric& metric,
+                    const std::vector<std::string>& labels, int quantile);
+  void EncodeBatch(const std::string& time,
+                   std::vector<std::pair<Series*, double>>::const_iterator begin,
+                   std::vector<std::pair<Series*, double>>::const_iterator end,
+                   Batch* batch);
+  // Sends as many of the queued batches as allowed.
+  void SendBatches();
+  void PushBatchDone(Batch* batch, UrlFetcher::Response* resp,
+                     util::Task* task);
 
   const std::string instance_name_;
   UrlFetcher* const fetcher_;
@@ -35,6 +79,17 @@ class GCMExporter {
   bool metrics_created_;
   std::chrono::system_clock::time_point token_refreshed_at_;
   std::string bearer_token_;
+  // The commonLabels JSON of every request.
+  std::string common_labels_;
+
+  std::mutex mutex_;
+  std::map<SeriesKey, Series> series_;
+  std::deque<std::unique_ptr<Batch>> queued_batches_;
+  int batches_in_flight_;
+  // The size of the last request, to size the next one.
+  size_t last_body_size_;
+  std::vector<Metric::Sample> samples_;
+  std::vector<Metric::DistributionSample> distributions_;
 
   friend class GCMExporterTest;
 };
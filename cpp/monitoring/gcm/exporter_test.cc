@@ -16,6 +16,8 @@ DECLARE_string(google_compute_monitoring_base_url);
 DECLARE_int32(google_compute_monitoring_push_interval_seconds);
 DECLARE_string(google_compute_monitoring_service_account);
 DECLARE_int32(google_compute_monitoring_retry_delay_seconds);
+DECLARE_int32(google_compute_monitoring_max_timeseries_per_request);
+DECLARE_int32(google_compute_monitoring_resend_interval_seconds);
 
 namespace cert_trans {
 
@@ -49,6 +51,7 @@ using testing::InSequence;
 using testing::Invoke;
 using testing::InvokeWithoutArgs;
 using testing::IsEmpty;
+using testing::Not;
 using util::Status;
 using util::SyncTask;
 using util::Task;
@@ -85,12 +88,20 @@ class GCMExporterTest : public ::testing::Test {
     FLAGS_google_compute_monitoring_push_interval_seconds = kPushInterval;
     FLAGS_google_compute_metadata_url = kMetadataUrl;
     FLAGS_google_compute_monitoring_service_account = kServiceAccount;
+    // Push every value every time, unless a test says otherwise.
+    FLAGS_google_compute_monitoring_resend_interval_seconds = 0;
+    FLAGS_google_compute_monitoring_max_timeseries_per_request = 200;
 
     ON_CALL(fetcher_, Fetch(_, _, _))
         .WillByDefault(Invoke(bind(&HandleFetch, ::util::OkStatus(), 200,
                                    UrlFetcher::Headers{}, "", _1, _2, _3)));
   }
 
+  void TearDown() override {
+    // The metrics of each test go away with it.
+    Registry::Instance()->ResetForTestingOnly();
+  }
+
  protected:
   string GetBearerToken(const GCMExporter& e) {
     return e.bearer_token_;
@@ -378,6 +389,130 @@ TEST_F(GCMExporterTest, TestRetriesWhenPushingMetricsFails) {
 }
 
 
+TEST_F(GCMExporterTest, TestPushesOnlyChangedValues) {
+  FLAGS_google_compute_monitoring_resend_interval_seconds = 3600;
+  std::unique_ptr<Counter<>> one(Counter<>::New("one", "help1"));
+  one->Increment();
+  std::unique_ptr<Gauge<>> two(Gauge<>::New("two", "help2"));
+  two->Set(2);
+
+  SyncTask sync(&pool_);
+
+  EXPECT_CALL(
+      fetcher_,
+      Fetch(IsUrlFetchRequest(
+                UrlFetcher::Verb::GET,
+                URL(string(kMetadataUrl) + "/" + kServiceAccount + "/token"),
+                UrlFetcher::Headers{make_pair("Metadata-Flavor", "Google")},
+                ""),
+            _, _))
+      .WillRepeatedly(
+          Invoke(bind(&HandleFetch, ::util::OkStatus(), 200,
+                      UrlFetcher::Headers{}, kCredentialsJson, _1, _2, _3)));
+  EXPECT_CALL(fetcher_,
+              Fetch(IsUrlFetchRequest(
+                        UrlFetcher::Verb::POST, URL(string(metrics_url_)),
+                        UrlFetcher::Headers{
+                            make_pair("Content-Type", "application/json"),
+                            make_pair("Authorization", "Bearer token")},
+                        _),
+                    _, _))
+      .WillRepeatedly(Invoke(bind(&HandleFetch, ::util::OkStatus(), 200,
+                                  UrlFetcher::Headers{}, "", _1, _2, _3)));
+  {
+    InSequence s;
+    // Everything the first time, and then change one of them.
+    EXPECT_CALL(fetcher_,
+                Fetch(IsUrlFetchRequest(
+                          UrlFetcher::Verb::POST, URL(push_url_),
+                          UrlFetcher::Headers{
+                              make_pair("Content-Type", "application/json"),
+                              make_pair("Authorization", "Bearer token")},
+                          AllOf(HasSubstr("one"), HasSubstr("two"))),
+                      _, _))
+        .WillOnce(DoAll(InvokeWithoutArgs([&one] { one->Increment(); }),
+                        Invoke(bind(&HandleFetch, ::util::OkStatus(), 200,
+                                    UrlFetcher::Headers{}, "", _1, _2, _3))));
+    // Only what changed after that.
+    EXPECT_CALL(fetcher_,
+                Fetch(IsUrlFetchRequest(
+                          UrlFetcher::Verb::POST, URL(push_url_),
+                          UrlFetcher::Headers{
+                              make_pair("Content-Type", "application/json"),
+                              make_pair("Authorization", "Bearer token")},
+                          AllOf(HasSubstr("one"), Not(HasSubstr("two")))),
+                      _, _))
+        .WillOnce(DoAll(InvokeWithoutArgs([&sync] { sync.task()->Return(); }),
+                        Invoke(bind(&HandleFetch, ::util::OkStatus(), 200,
+                                    UrlFetcher::Headers{}, "", _1, _2, _3))));
+  }
+  GCMExporter exporter("instance", &fetcher_, &pool_);
+  sync.Wait();
+}
+
+
+TEST_F(GCMExporterTest, TestSplitsPushesIntoBatches) {
+  FLAGS_google_compute_monitoring_resend_interval_seconds = 3600;
+  FLAGS_google_compute_monitoring_max_timeseries_per_request = 1;
+  std::unique_ptr<Counter<>> one(Counter<>::New("one", "help1"));
+  one->Increment();
+  std::unique_ptr<Gauge<>> two(Gauge<>::New("two", "help2"));
+  two->Set(2);
+
+  SyncTask sync_one(&pool_);
+  SyncTask sync_two(&pool_);
+
+  EXPECT_CALL(
+      fetcher_,
+      Fetch(IsUrlFetchRequest(
+                UrlFetcher::Verb::GET,
+                URL(string(kMetadataUrl) + "/" + kServiceAccount + "/token"),
+                UrlFetcher::Headers{make_pair("Metadata-Flavor", "Google")},
+                ""),
+            _, _))
+      .WillRepeatedly(
+          Invoke(bind(&HandleFetch, ::util::OkStatus(), 200,
+                      UrlFetcher::Headers{}, kCredentialsJson, _1, _2, _3)));
+  EXPECT_CALL(fetcher_,
+              Fetch(IsUrlFetchRequest(
+                        UrlFetcher::Verb::POST, URL(string(metrics_url_)),
+                        UrlFetcher::Headers{
+                            make_pair("Content-Type", "application/json"),
+                            make_pair("Authorization", "Bearer token")},
+                        _),
+                    _, _))
+      .WillRepeatedly(Invoke(bind(&HandleFetch, ::util::OkStatus(), 200,
+                                  UrlFetcher::Headers{}, "", _1, _2, _3)));
+  EXPECT_CALL(fetcher_,
+              Fetch(IsUrlFetchRequest(
+                        UrlFetcher::Verb::POST, URL(push_url_),
+                        UrlFetcher::Headers{
+                            make_pair("Content-Type", "application/json"),
+                            make_pair("Authorization", "Bearer token")},
+                        AllOf(HasSubstr("one"), Not(HasSubstr("two")))),
+                    _, _))
+      .WillOnce(
+          DoAll(InvokeWithoutArgs([&sync_one] { sync_one.task()->Return(); }),
+                Invoke(bind(&HandleFetch, ::util::OkStatus(), 200,
+                            UrlFetcher::Headers{}, "", _1, _2, _3))));
+  EXPECT_CALL(fetcher_,
+              Fetch(IsUrlFetchRequest(
+                        UrlFetcher::Verb::POST, URL(push_url_),
+                        UrlFetcher::Headers{
+                            make_pair("Content-Type", "application/json"),
+                            make_pair("Authorization", "Bearer token")},
+                        AllOf(Not(HasSubstr("one")), HasSubstr("two"))),
+                    _, _))
+      .WillOnce(
+          DoAll(InvokeWithoutArgs([&sync_two] { sync_two.task()->Return(); }),
+                Invoke(bind(&HandleFetch, ::util::OkStatus(), 200,
+                            UrlFetcher::Headers{}, "", _1, _2, _3))));
+  GCMExporter exporter("instance", &fetcher_, &pool_);
+  sync_one.Wait();
+  sync_two.Wait();
+}
+
+
 }  // namespace cert_trans
 
 
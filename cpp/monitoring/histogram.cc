@@ -0,0 +1,142 @@
+#include "monitoring/histogram.h"
+
+#include <glog/logging.h>
+#include <algorithm>
+#include <cmath>
+
+using std::chrono::system_clock;
+using std::vector;
+
+namespace cert_trans {
+namespace {
+
+
+const int kMinExponent = -2;
+const int kMaxExponent = 24;
+const int kSubBuckets = 4;
+
+
+vector<double> MakeUpperBounds() {
+  vector<double> ret{std::ldexp(1.0, kMinExponent)};
+  for (int e = kMinExponent; e < kMaxExponent; ++e) {
+    const double base(std::ldexp(1.0, e));
+    for (int i = 1; i <= kSubBuckets; ++i) {
+      ret.push_back(base + base * i / kSubBuckets);
+    }
+  }
+  return ret;
+}
+
+
+}  // namespace
+
+
+const vector<double>& HistogramUpperBounds() {
+  static const vector<double>* const bounds(
+      new vector<double>(MakeUpperBounds()));
+  return *bounds;
+}
+
+
+double Quantile(const Metric::Distribution& distribution, double q) {
+  CHECK_GE(q, 0);
+  CHECK_LE(q, 1);
+  if (distribution.count == 0) {
+    return 0;
+  }
+  const vector<double>& bounds(HistogramUpperBounds());
+  CHECK_EQ(distribution.bucket_counts.size(), bounds.size() + 1);
+
+  // The rank of the value we are after, counting from 1.
+  const double rank(std::max(1.0, q * distribution.count));
+  uint64_t below(0);
+  for (size_t i = 0; i < distribution.bucket_counts.size(); ++i) {
+    const uint64_t in_bucket(distribution.bucket_counts[i]);
+    if (below + in_bucket < rank) {
+      below += in_bucket;
+      continue;
+    }
+    // The overflow bucket has no upper bound to interpolate towards.
+    if (i == bounds.size()) {
+      return bounds.back();
+    }
+    const double lower(i == 0 ? 0 : bounds[i - 1]);
+    return lower + (bounds[i] - lower) * (rank - below) / in_bucket;
+  }
+  return bounds.back();
+}
+
+
+HistogramCell::HistogramCell() {
+  CHECK_EQ(static_cast<size_t>(kNumBuckets),
+           HistogramUpperBounds().size() + 1);
+  for (Shard& shard : shards_) {
+    for (auto& count : shard.counts) {
+      count.store(0, std::memory_order_relaxed);
+    }
+    shard.sum.store(0, std::memory_order_relaxed);
+    shard.updated.store(0, std::memory_order_relaxed);
+  }
+}
+
+
+void HistogramCell::Record(double value) {
+  const vector<double>& bounds(HistogramUpperBounds());
+  const size_t bucket(std::lower_bound(bounds.begin(), bounds.end(), value) -
+                      bounds.begin());
+
+  Shard* const shard(&shards_[MetricShardIndex()]);
+  shard->counts[bucket].fetch_add(1, std::memory_order_relaxed);
+  double sum(shard->sum.load(std::memory_order_relaxed));
+  while (!shard->sum.compare_exchange_weak(sum, sum + value,
+                                           std::memory_order_relaxed)) {
+  }
+  shard->updated.store(system_clock::now().time_since_epoch().count(),
+                       std::memory_order_relaxed);
+}
+
+
+Metric::Distribution HistogramCell::GetDistribution() const {
+  Metric::Distribution ret;
+  GetDistribution(&ret);
+  return ret;
+}
+
+
+void HistogramCell::GetDistribution(Metric::Distribution* distribution) const {
+  distribution->bucket_counts.assign(kNumBuckets, 0);
+  distribution->count = 0;
+  distribution->sum = 0;
+  int64_t updated(0);
+  for (const Shard& shard : shards_) {
+    for (int i = 0; i < kNumBuckets; ++i) {
+      const uint64_t count(shard.counts[i].load(std::memory_order_relaxed));
+      distribution->bucket_counts[i] += count;
+      distribution->count += count;
+    }
+    distribution->sum += shard.sum.load(std::memory_order_relaxed);
+    updated = std::max(updated, shard.updated.load(std::memory_order_relaxed));
+  }
+  distribution->updated =
+      system_clock::time_point(system_clock::duration(updated));
+}
+
+
+Metric::TimestampedValue HistogramCell::GetTimestamped() const {
+  const Metric::Distribution distribution(GetDistribution());
+  return make_pair(distribution.updated,
+                   static_cast<double>(distribution.count));
+}
+
+
+bool HistogramCell::Updated() const {
+  for (const Shard& shard : shards_) {
+    if (shard.updated.load(std::memory_order_relaxed) != 0) {
+      return true;
+    }
+  }
+  return false;
+}
+
+
+}  // namespace cert_trans
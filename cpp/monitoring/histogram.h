@@ -0,0 +1,189 @@
+#ifndef CERT_TRANS_MONITORING_HISTOGRAM_H_
+#define CERT_TRANS_MONITORING_HISTOGRAM_H_
+
+#include <atomic>
+#include <stdint.h>
+#include <string>
+#include <vector>
+
+#include "monitoring/labelled_values.h"
+#include "monitoring/metric.h"
+
+namespace cert_trans {
+
+
+// The inclusive upper bounds of the buckets of every histogram, in
+// increasing order, followed by an implicit overflow bucket. They are
+// log-linear: each power of two from 1/4 to 2^24 is split into four
+// equal parts, so that any value in range lands in a bucket no more
+// than 25% wider than it. Being the same for all histograms, their
+// distributions can be merged by adding up bucket counts.
+const std::vector<double>& HistogramUpperBounds();
+
+// Estimates the |q| quantile (0 <= |q| <= 1) of |distribution|, by
+// interpolating within the bucket it falls in. Returns 0 for an empty
+// distribution.
+double Quantile(const Metric::Distribution& distribution, double q);
+
+
+// The values recorded by a histogram for one set of labels, sharded
+// like MetricCell, so that recording takes no lock, and uses a fixed
+// amount of memory however many values are recorded.
+class HistogramCell {
+ public:
+  HistogramCell();
+  HistogramCell(const HistogramCell&) = delete;
+  HistogramCell& operator=(const HistogramCell&) = delete;
+
+  void Record(double value);
+
+  Metric::Distribution GetDistribution() const;
+
+  // As above, reusing the memory |distribution| already has.
+  void GetDistribution(Metric::Distribution* distribution) const;
+
+  // The number of values recorded, and when the last one was.
+  Metric::TimestampedValue GetTimestamped() const;
+
+  // Whether any value was ever recorded.
+  bool Updated() const;
+
+ private:
+  // 1 + 26 * 4 bounds, plus the overflow bucket.
+  static const int kNumBuckets = 106;
+
+  struct Shard {
+    std::atomic<uint64_t> counts[kNumBuckets];
+    std::atomic<double> sum;
+    // In system_clock ticks since the epoch, or 0 if never.
+    std::atomic<int64_t> updated;
+    // Keeps the end of one shard and the start of the next apart.
+    char padding[64];
+  };
+
+  Shard shards_[kNumMetricShards];
+};
+
+
+// A metric recording the distribution of values (e.g. request
+// latencies), from which quantiles can be estimated, rather than just
+// their total.
+template <class... LabelTypes>
+class Histogram : public Metric {
+ public:
+  static Histogram<LabelTypes...>* New(
+      const std::string& name,
+      const typename NameType<LabelTypes>::name&... label_names,
+      const std::string& help);
+
+  Histogram(const Histogram&) = delete;
+  Histogram& operator=(const Histogram&) = delete;
+
+  void Record(const LabelTypes&... labels, double value);
+
+  // Returns the cell recording values for |labels|, which hot paths
+  // can keep and Record() to directly, without looking it up each
+  // time. It lives as long as the histogram.
+  HistogramCell* WithLabels(const LabelTypes&... labels);
+
+  std::map<std::vector<std::string>, Metric::TimestampedValue> CurrentValues()
+      const override;
+
+  void SnapshotValues(std::vector<Metric::Sample>* samples) const override;
+
+  std::map<std::vector<std::string>, Metric::Distribution>
+  CurrentDistributions() const override;
+
+  void SnapshotDistributions(
+      std::vector<Metric::DistributionSample>* samples) const override;
+
+ private:
+  Histogram(const std::string& name,
+            const typename NameType<LabelTypes>::name&... label_names,
+            const std::string& help);
+
+  LabelledValues<HistogramCell, LabelTypes...> values_;
+};
+
+
+// static
+template <class... LabelTypes>
+Histogram<LabelTypes...>* Histogram<LabelTypes...>::New(
+    const std::string& name,
+    const typename NameType<LabelTypes>::name&... label_names,
+    const std::string& help) {
+  return new Histogram(name, label_names..., help);
+}
+
+
+template <class... LabelTypes>
+Histogram<LabelTypes...>::Histogram(
+    const std::string& name,
+    const typename NameType<LabelTypes>::name&... label_names,
+    const std::string& help)
+    : Metric(HISTOGRAM, name, {label_names...}, help),
+      values_(name, label_names...) {
+}
+
+
+template <class... LabelTypes>
+void Histogram<LabelTypes...>::Record(const LabelTypes&... labels,
+                                      double value) {
+  values_.Cell(labels...)->Record(value);
+}
+
+
+template <class... LabelTypes>
+HistogramCell* Histogram<LabelTypes...>::WithLabels(
+    const LabelTypes&... labels) {
+  return values_.Cell(labels...);
+}
+
+
+template <class... LabelTypes>
+std::map<std::vector<std::string>, Metric::TimestampedValue>
+Histogram<LabelTypes...>::CurrentValues() const {
+  return values_.CurrentValues();
+}
+
+
+template <class... LabelTypes>
+void Histogram<LabelTypes...>::SnapshotValues(
+    std::vector<Metric::Sample>* samples) const {
+  values_.SnapshotValues(samples);
+}
+
+
+template <class... LabelTypes>
+std::map<std::vector<std::string>, Metric::Distribution>
+Histogram<LabelTypes...>::CurrentDistributions() const {
+  std::map<std::vector<std::string>, Metric::Distribution> ret;
+  for (const auto& cell : values_.UpdatedCells()) {
+    ret[cell.first] = cell.second->GetDistribution();
+  }
+  return ret;
+}
+
+
+template <class... LabelTypes>
+void Histogram<LabelTypes...>::SnapshotDistributions(
+    std::vector<Metric::DistributionSample>* samples) const {
+  // Samples are overwritten in place, rather than cleared, so that
+  // their bucket counts keep their memory.
+  size_t size(0);
+  values_.ForEachUpdatedCell([samples, &size](
+      const std::vector<std::string>& labels, const HistogramCell& cell) {
+    if (size == samples->size()) {
+      samples->emplace_back();
+    }
+    Metric::DistributionSample* const sample(&(*samples)[size++]);
+    sample->labels = &labels;
+    cell.GetDistribution(&sample->distribution);
+  });
+  samples->resize(size);
+}
+
+
+}  // namespace cert_trans
+
+#endif  // CERT_TRANS_MONITORING_HISTOGRAM_H_
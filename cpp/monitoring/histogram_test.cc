@@ -0,0 +1,106 @@
+#include "monitoring/histogram.h"
+
+#include <glog/logging.h>
+#include <gtest/gtest.h>
+#include <algorithm>
+#include <memory>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "util/testing.h"
+
+namespace cert_trans {
+
+using std::string;
+using std::unique_ptr;
+using std::vector;
+
+
+TEST(HistogramTest, UpperBoundsIncrease) {
+  const vector<double>& bounds(HistogramUpperBounds());
+  ASSERT_FALSE(bounds.empty());
+  EXPECT_EQ(0.25, bounds.front());
+  for (size_t i = 1; i < bounds.size(); ++i) {
+    EXPECT_LT(bounds[i - 1], bounds[i]);
+    // No bucket is more than 25% wider than the values in it.
+    EXPECT_LE(bounds[i], bounds[i - 1] * 1.25);
+  }
+}
+
+
+TEST(HistogramTest, RecordsIntoBuckets) {
+  unique_ptr<Histogram<>> histogram(Histogram<>::New("name", "help"));
+  EXPECT_TRUE(histogram->CurrentDistributions().empty());
+
+  histogram->Record(0);
+  histogram->Record(1);
+  histogram->Record(1e12);
+
+  const auto distributions(histogram->CurrentDistributions());
+  ASSERT_EQ(1, distributions.size());
+  const Metric::Distribution& d(distributions.begin()->second);
+  EXPECT_EQ(3, d.count);
+  EXPECT_EQ(1e12 + 1, d.sum);
+  ASSERT_EQ(HistogramUpperBounds().size() + 1, d.bucket_counts.size());
+  EXPECT_EQ(1, d.bucket_counts.front());
+  EXPECT_EQ(1, d.bucket_counts.back());
+  // Bounds are inclusive, so 1 goes in the bucket ending at 1.
+  const vector<double>& bounds(HistogramUpperBounds());
+  const size_t one(std::find(bounds.begin(), bounds.end(), 1.0) -
+                   bounds.begin());
+  EXPECT_EQ(1, d.bucket_counts[one]);
+
+  EXPECT_EQ(3, histogram->CurrentValues().begin()->second.second);
+}
+
+
+TEST(HistogramTest, Quantiles) {
+  unique_ptr<Histogram<string>> histogram(
+      Histogram<string>::New("name", "a string", "help"));
+  HistogramCell* const cell(histogram->WithLabels("alpha"));
+  for (int i = 1; i <= 1000; ++i) {
+    cell->Record(i);
+  }
+
+  const auto distributions(histogram->CurrentDistributions());
+  ASSERT_EQ(1, distributions.size());
+  EXPECT_EQ(vector<string>{"alpha"}, distributions.begin()->first);
+  const Metric::Distribution& d(distributions.begin()->second);
+  EXPECT_NEAR(500, Quantile(d, 0.5), 500 * 0.25);
+  EXPECT_NEAR(990, Quantile(d, 0.99), 990 * 0.25);
+  EXPECT_LE(Quantile(d, 0), 1);
+  EXPECT_EQ(0, Quantile(Metric::Distribution(), 0.5));
+}
+
+
+TEST(HistogramTest, ConcurrentRecords) {
+  unique_ptr<Histogram<>> histogram(Histogram<>::New("name", "help"));
+  const int kNumThreads(8);
+  const int kNumRecords(10000);
+  vector<std::thread> threads;
+  for (int i = 0; i < kNumThreads; ++i) {
+    threads.emplace_back([&histogram]() {
+      for (int j = 0; j < kNumRecords; ++j) {
+        histogram->Record(2);
+      }
+    });
+  }
+  for (auto& thread : threads) {
+    thread.join();
+  }
+
+  const Metric::Distribution d(
+      histogram->CurrentDistributions().begin()->second);
+  EXPECT_EQ(kNumThreads * kNumRecords, d.count);
+  EXPECT_EQ(2 * kNumThreads * kNumRecords, d.sum);
+}
+
+
+}  // namespace cert_trans
+
+
+int main(int argc, char** argv) {
+  cert_trans::test::InitTesting(argv[0], &argc, &argv, true);
+  return RUN_ALL_TESTS();
+}
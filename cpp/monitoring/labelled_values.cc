@@ -0,0 +1,99 @@
+#include "config.h"
+#include "monitoring/labelled_values.h"
+
+#include <algorithm>
+
+using std::atomic;
+using std::chrono::system_clock;
+
+namespace cert_trans {
+namespace {
+
+
+atomic<int> next_shard(0);
+
+#ifdef HAVE_THREAD_LOCAL
+thread_local int current_shard = -1;
+#elif HAVE___THREAD
+__thread int current_shard = -1;
+#else
+#error No suitable thread local storage available
+#endif
+
+
+int64_t Now() {
+  return system_clock::now().time_since_epoch().count();
+}
+
+
+}  // namespace
+
+
+int MetricShardIndex() {
+  if (current_shard < 0) {
+    current_shard = next_shard.fetch_add(1, std::memory_order_relaxed) %
+                    kNumMetricShards;
+  }
+  return current_shard;
+}
+
+
+MetricCell::MetricCell() {
+  for (Shard& shard : shards_) {
+    shard.value.store(0, std::memory_order_relaxed);
+    shard.updated.store(0, std::memory_order_relaxed);
+  }
+}
+
+
+double MetricCell::Get() const {
+  double ret(0);
+  for (const Shard& shard : shards_) {
+    ret += shard.value.load(std::memory_order_relaxed);
+  }
+  return ret;
+}
+
+
+Metric::TimestampedValue MetricCell::GetTimestamped() const {
+  int64_t updated(0);
+  for (const Shard& shard : shards_) {
+    updated = std::max(updated, shard.updated.load(std::memory_order_relaxed));
+  }
+  return make_pair(system_clock::time_point(system_clock::duration(updated)),
+                   Get());
+}
+
+
+bool MetricCell::Updated() const {
+  for (const Shard& shard : shards_) {
+    if (shard.updated.load(std::memory_order_relaxed) != 0) {
+      return true;
+    }
+  }
+  return false;
+}
+
+
+void MetricCell::Set(double value) {
+  for (int i = 1; i < kNumMetricShards; ++i) {
+    shards_[i].value.store(0, std::memory_order_relaxed);
+  }
+  shards_[0].value.store(value, std::memory_order_relaxed);
+  shards_[0].updated.store(Now(), std::memory_order_relaxed);
+}
+
+
+void MetricCell::IncrementBy(double amount) {
+  Shard* const shard(&shards_[MetricShardIndex()]);
+  // There is no fetch_add() for doubles, but with each thread mostly
+  // having its shard to itself, this rarely goes round more than once.
+  double current(shard->value.load(std::memory_order_relaxed));
+  while (!shard->value.compare_exchange_weak(current, current + amount,
+                                             std::memory_order_relaxed)) {
+  }
+  shard->updated.store(Now(), std::memory_order_relaxed);
+}
+
+
+}  // namespace cert_trans
@@ -2,16 +2,73 @@
 #define CERT_TRANS_MONITORING_LABELLED_VALUES_H_
 
 #include <glog/logging.h>
+#include <atomic>
 #include <chrono>
 #include <map>
+#include <memory>
 #include <mutex>
+#include <sstream>
+#include <stdint.h>
 
 #include "monitoring/metric.h"
 
 namespace cert_trans {
 
 
-template <class... LabelTypes>
+// Metric values are split into this many shards, each updated by
+// some of the threads, so that threads rarely contend on them.
+const int kNumMetricShards = 16;
+
+// The shard the current thread updates. Threads are given shards in
+// turn, the first time they update any metric.
+int MetricShardIndex();
+
+
+// The value of a metric for one set of labels. Updates go to one of
+// several shards, each on its own cache line, picked by the updating
+// thread, so that they take no lock and threads updating the same
+// value rarely touch the same cache line. Reading sums the shards.
+class MetricCell {
+ public:
+  MetricCell();
+  MetricCell(const MetricCell&) = delete;
+  MetricCell& operator=(const MetricCell&) = delete;
+
+  double Get() const;
+
+  // Along with the time of the last update.
+  Metric::TimestampedValue GetTimestamped() const;
+
+  // Whether it was ever updated.
+  bool Updated() const;
+
+  // Not atomic with respect to concurrent calls to IncrementBy(), but
+  // gauges are only ever set, and counters only ever incremented.
+  void Set(double value);
+
+  void Increment() {
+    IncrementBy(1);
+  }
+
+  void IncrementBy(double amount);
+
+ private:
+  struct Shard {
+    std::atomic<double> value;
+    // When |value| was last updated, in system_clock ticks since the
+    // epoch, or 0 if never.
+    std::atomic<int64_t> updated;
+    char padding[64 - sizeof(std::atomic<double>) -
+                 sizeof(std::atomic<int64_t>)];
+  };
+
+  Shard shards_[kNumMetricShards];
+};
+
+
+// The cells holding the values of a metric, by labels. |CellType| is
+// MetricCell for counters and gauges.
+template <class CellType, class... LabelTypes>
 class LabelledValues {
  public:
   LabelledValues(const std::string& name,
@@ -19,6 +76,11 @@ class LabelledValues {
   LabelledValues(const LabelledValues&) = delete;
   LabelledValues& operator=(const LabelledValues&) = delete;
 
+  // Returns the cell for |labels|, creating it if need be. It lives as
+  // long as this object, so that callers on hot paths can look it up
+  // once and then update it without any lookup or lock.
+  CellType* Cell(const LabelTypes&... labels);
+
   double Get(const LabelTypes&...) const;
 
   void Set(const LabelTypes&... labels, double value);
@@ -30,12 +92,37 @@ class LabelledValues {
   std::map<std::vector<std::string>, Metric::TimestampedValue> CurrentValues()
       const;
 
+  // As CurrentValues(), but replacing the contents of |samples|, whose
+  // labels point into this object, so that nothing but the values is
+  // copied.
+  void SnapshotValues(std::vector<Metric::Sample>* samples) const;
+
+  // The cells which were ever updated, by their stringified labels.
+  std::map<std::vector<std::string>, const CellType*> UpdatedCells() const;
+
+  // Calls |f| with the stringified labels and the cell of each cell
+  // which was ever updated, in label order. The labels live as long as
+  // this object. No cell can be added meanwhile, but they can all be
+  // updated, so |f| should be quick.
+  template <class F>
+  void ForEachUpdatedCell(const F& f) const;
+
  private:
+  struct Entry {
+    std::unique_ptr<CellType> cell;
+    // The key of the entry, stringified once and for all.
+    std::vector<std::string> labels;
+  };
+
+  CellType* LookupCell(const std::tuple<LabelTypes...>& key);
+
   const std::string name_;
   const std::vector<std::string> label_names_;
+  // Guards |values_|, but not the cells in it.
   mutable std::mutex mutex_;
-  std::map<std::tuple<LabelTypes...>,
-           std::pair<std::chrono::system_clock::time_point, double>> values_;
+  std::map<std::tuple<LabelTypes...>, Entry> values_;
+  // The one cell of metrics without labels, which need no lookup.
+  CellType* const unlabelled_;
 };
 
 
@@ -71,66 +158,123 @@ std::vector<std::string> label_values(const std::tuple<Types...>& t) {
 }  // namespace
 
 
-template <class... LabelTypes>
-LabelledValues<LabelTypes...>::LabelledValues(
+template <class CellType, class... LabelTypes>
+LabelledValues<CellType, LabelTypes...>::LabelledValues(
     const std::string& name,
     const typename NameType<LabelTypes>::name&... label_names)
-    : name_(name), label_names_{label_names...} {
+    : name_(name),
+      label_names_{label_names...},
+      unlabelled_(sizeof...(LabelTypes) == 0
+                      ? LookupCell(std::tuple<LabelTypes...>())
+                      : nullptr) {
+}
+
+
+template <class CellType, class... LabelTypes>
+CellType* LabelledValues<CellType, LabelTypes...>::Cell(
+    const LabelTypes&... labels) {
+  if (unlabelled_) {
+    return unlabelled_;
+  }
+  return LookupCell(std::tuple<LabelTypes...>(labels...));
 }
 
 
-template <class... LabelTypes>
-double LabelledValues<LabelTypes...>::Get(const LabelTypes&... labels) const {
+template <class CellType, class... LabelTypes>
+CellType* LabelledValues<CellType, LabelTypes...>::LookupCell(
+    const std::tuple<LabelTypes...>& key) {
+  std::lock_guard<std::mutex> lock(mutex_);
+  Entry& entry(values_[key]);
+  if (!entry.cell) {
+    entry.cell.reset(new CellType);
+    entry.labels = label_values(key);
+  }
+  return entry.cell.get();
+}
+
+
+template <class CellType, class... LabelTypes>
+double LabelledValues<CellType, LabelTypes...>::Get(
+    const LabelTypes&... labels) const {
+  if (unlabelled_) {
+    return unlabelled_->Get();
+  }
   std::lock_guard<std::mutex> lock(mutex_);
   const std::tuple<LabelTypes...> key(labels...);
   const auto it(values_.find(key));
   if (it == values_.end()) {
     return 0;
   }
-  return it->second.second;
+  return it->second.cell->Get();
 }
 
 
-template <class... LabelTypes>
-void LabelledValues<LabelTypes...>::Set(const LabelTypes&... labels,
-                                        double value) {
-  std::lock_guard<std::mutex> lock(mutex_);
-  values_[std::tuple<LabelTypes...>(labels...)] =
-      make_pair(std::chrono::system_clock::now(), value);
+template <class CellType, class... LabelTypes>
+void LabelledValues<CellType, LabelTypes...>::Set(
+    const LabelTypes&... labels, double value) {
+  Cell(labels...)->Set(value);
 }
 
 
-template <class... LabelTypes>
-void LabelledValues<LabelTypes...>::Increment(const LabelTypes&... labels) {
+template <class CellType, class... LabelTypes>
+void LabelledValues<CellType, LabelTypes...>::Increment(
+    const LabelTypes&... labels) {
   IncrementBy(labels..., 1);
 }
 
 
-template <class... LabelTypes>
-void LabelledValues<LabelTypes...>::IncrementBy(const LabelTypes&... labels,
-                                                double amount) {
-  std::lock_guard<std::mutex> lock(mutex_);
-  const std::tuple<LabelTypes...> key(labels...);
-  const auto it(values_.find(key));
-  if (it == values_.end()) {
-    values_[key] = make_pair(std::chrono::system_clock::now(), amount);
-    return;
-  }
-  values_[key] = make_pair(std::chrono::system_clock::now(),
-                           values_[key].second + amount);
+template <class CellType, class... LabelTypes>
+void LabelledValues<CellType, LabelTypes...>::IncrementBy(
+    const LabelTypes&... labels, double amount) {
+  Cell(labels...)->IncrementBy(amount);
 }
 
 
-template <class... LabelTypes>
+template <class CellType, class... LabelTypes>
 std::map<std::vector<std::string>, Metric::TimestampedValue>
-LabelledValues<LabelTypes...>::CurrentValues() const {
-  std::lock_guard<std::mutex> lock(mutex_);
+LabelledValues<CellType, LabelTypes...>::CurrentValues() const {
   std::map<std::vector<std::string>, Metric::TimestampedValue> ret;
+  for (const auto& cell : UpdatedCells()) {
+    ret[cell.first] = cell.second->GetTimestamped();
+  }
+  return ret;
+}
+
+
+template <class CellType, class... LabelTypes>
+void LabelledValues<CellType, LabelTypes...>::SnapshotValues(
+    std::vector<Metric::Sample>* samples) const {
+  samples->clear();
+  ForEachUpdatedCell([samples](const std::vector<std::string>& labels,
+                               const CellType& cell) {
+    samples->push_back(Metric::Sample{&labels, cell.GetTimestamped()});
+  });
+}
+
 
+template <class CellType, class... LabelTypes>
+std::map<std::vector<std::string>, const CellType*>
+LabelledValues<CellType, LabelTypes...>::UpdatedCells() const {
+  std::map<std::vector<std::string>, const CellType*> ret;
+  ForEachUpdatedCell(
+      [&ret](const std::vector<std::string>& labels, const CellType& cell) {
+        ret[labels] = &cell;
+      });
+  return ret;
+}
+
+
+template <class CellType, class... LabelTypes>
+template <class F>
+void LabelledValues<CellType, LabelTypes...>::ForEachUpdatedCell(
+    const F& f) const {
+  std::lock_guard<std::mutex> lock(mutex_);
   for (const auto& v : values_) {
-    ret[label_values(v.first)] = v.second;
+    // Leave out values never updated, such as those only ever read.
+    if (v.second.cell->Updated()) {
+      f(v.second.labels, *v.second.cell);
+    }
   }
-  return ret;
 }
 
 
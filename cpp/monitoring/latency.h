@@ -2,10 +2,12 @@
 #define CERT_TRANS_MONITORING_LATENCY_H_
 
 #include <functional>
+#include <memory>
 #include <string>
 
 #include "monitoring/counter.h"
 #include "monitoring/event_metric.h"
+#include "monitoring/histogram.h"
 #include "monitoring/monitoring.h"
 
 namespace cert_trans {
@@ -17,7 +19,9 @@ class ScopedLatency;
 // This class creates two Counter metrics, one called "|base_name|_overall_sum"
 // which contains the sum of all latencies broken down by labels, and another
 // called "|base_name|_count" which contains the number of latency measurements
-// taken, also broken down by labels.
+// taken, also broken down by labels. It also creates a Histogram called
+// "|base_name|_distribution" of the latencies, from which percentiles can be
+// estimated.
 //
 // To actually measure latency, you can either call RecordLatency() directly
 // with a latency sample, or use the ScopedLatency() method to return an object
@@ -67,8 +71,14 @@ class Latency {
 
   ScopedLatency GetScopedLatency(const LabelTypes&... labels);
 
+  // Returns the latencies recorded for |labels| over the last few
+  // minutes, in |TimeUnit|, from which their recent quantiles can be
+  // read in-process.
+  const WindowedHistogramCell* Windows(const LabelTypes&... labels);
+
  private:
   EventMetric<LabelTypes...> metric_;
+  const std::unique_ptr<Histogram<LabelTypes...>> histogram_;
 };
 
 
@@ -105,15 +115,19 @@ Latency<TimeUnit, LabelTypes...>::Latency(
     const std::string& base_name,
     const typename NameType<LabelTypes>::name&... label_names,
     const std::string& help)
-    : metric_(base_name, label_names..., help) {
+    : metric_(base_name, label_names..., help),
+      histogram_(Histogram<LabelTypes...>::New(base_name + "_distribution",
+                                               label_names...,
+                                               help + " (distribution)")) {
 }
 
 
 template <class TimeUnit, class... LabelTypes>
 void Latency<TimeUnit, LabelTypes...>::RecordLatency(
     const LabelTypes&... labels, std::chrono::duration<double> latency) {
-  metric_.RecordEvent(labels...,
-                      std::chrono::duration_cast<TimeUnit>(latency).count());
+  const double value(std::chrono::duration_cast<TimeUnit>(latency).count());
+  metric_.RecordEvent(labels..., value);
+  histogram_->Record(labels..., value);
 }
 
 
@@ -126,6 +140,13 @@ ScopedLatency Latency<TimeUnit, LabelTypes...>::GetScopedLatency(
 }
 
 
+template <class TimeUnit, class... LabelTypes>
+const WindowedHistogramCell* Latency<TimeUnit, LabelTypes...>::Windows(
+    const LabelTypes&... labels) {
+  return metric_.Windows(labels...);
+}
+
+
 }  // namespace cert_trans
 
 
@@ -0,0 +1,79 @@
+#include "monitoring/memory_usage.h"
+
+#include <map>
+#include <mutex>
+
+#include "monitoring/monitoring.h"
+
+using std::lock_guard;
+using std::map;
+using std::mutex;
+using std::string;
+
+namespace cert_trans {
+
+namespace {
+
+
+Gauge<string>* MemoryUsageBytes() {
+  static Gauge<string>* const memory_usage_bytes(Gauge<string>::New(
+      "memory_usage_bytes", "structure",
+      "Approximate number of bytes used by the large structures of the "
+      "node, broken down by kind of structure."));
+  return memory_usage_bytes;
+}
+
+
+mutex* TotalsLock() {
+  static mutex* const totals_lock(new mutex);
+  return totals_lock;
+}
+
+
+// The sum of the usage of all the instances of each kind of structure.
+// Guarded by TotalsLock().
+map<string, int64_t>* Totals() {
+  static map<string, int64_t>* const totals(new map<string, int64_t>);
+  return totals;
+}
+
+
+}  // namespace
+
+
+MemoryUsage::MemoryUsage(const string& structure)
+    : structure_(structure), bytes_(0) {
+  lock_guard<mutex> lock(*TotalsLock());
+  MemoryUsageBytes()->Set(structure_, (*Totals())[structure_]);
+}
+
+
+MemoryUsage::~MemoryUsage() {
+  Set(0);
+}
+
+
+void MemoryUsage::Set(int64_t bytes) {
+  lock_guard<mutex> lock(*TotalsLock());
+  int64_t* const total(&(*Totals())[structure_]);
+  *total += bytes - bytes_;
+  bytes_ = bytes;
+  MemoryUsageBytes()->Set(structure_, *total);
+}
+
+
+int64_t MemoryUsage::bytes() const {
+  lock_guard<mutex> lock(*TotalsLock());
+  return bytes_;
+}
+
+
+// static
+int64_t MemoryUsage::Total(const string& structure) {
+  lock_guard<mutex> lock(*TotalsLock());
+  const auto it(Totals()->find(structure));
+  return it == Totals()->end() ? 0 : it->second;
+}
+
+
+}  // namespace cert_trans
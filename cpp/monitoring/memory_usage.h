@@ -0,0 +1,55 @@
+#ifndef CERT_TRANS_MONITORING_MEMORY_USAGE_H_
+#define CERT_TRANS_MONITORING_MEMORY_USAGE_H_
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string>
+
+namespace cert_trans {
+
+
+// Reports the approximate number of bytes used by one instance of a
+// large structure (a Merkle tree, an index, a cache...) in the
+// "memory_usage_bytes" gauge, labelled by the kind of structure. The
+// gauge holds the sum over all the instances of that kind, such as the
+// trees of all the logs served by a process.
+//
+// This class is thread-safe.
+class MemoryUsage {
+ public:
+  explicit MemoryUsage(const std::string& structure);
+  // Takes the usage of this instance out of the gauge.
+  ~MemoryUsage();
+  MemoryUsage(const MemoryUsage&) = delete;
+  MemoryUsage& operator=(const MemoryUsage&) = delete;
+
+  // Records that this instance now uses |bytes| bytes.
+  void Set(int64_t bytes);
+
+  int64_t bytes() const;
+
+  // The sum over all the instances of |structure|.
+  static int64_t Total(const std::string& structure);
+
+ private:
+  const std::string structure_;
+  // Guarded by the lock of the totals, in the .cc file.
+  int64_t bytes_;
+};
+
+
+// Approximate number of bytes taken up by |map|, a std::unordered_map
+// (or set) each element of which allocates |element_bytes| more bytes
+// of its own, such as those of a string key.
+template <class Map>
+int64_t UnorderedMapByteSize(const Map& map, size_t element_bytes) {
+  // Each node holds the element, the next pointer and the cached hash.
+  return map.bucket_count() * sizeof(void*) +
+         map.size() * (sizeof(typename Map::value_type) + sizeof(void*) +
+                       sizeof(size_t) + element_bytes);
+}
+
+
+}  // namespace cert_trans
+
+#endif  // CERT_TRANS_MONITORING_MEMORY_USAGE_H_
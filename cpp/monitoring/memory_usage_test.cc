@@ -0,0 +1,42 @@
+#include "monitoring/memory_usage.h"
+
+#include <gtest/gtest.h>
+#include <memory>
+
+#include "util/testing.h"
+
+namespace cert_trans {
+namespace {
+
+using std::unique_ptr;
+
+
+TEST(MemoryUsageTest, SumsInstances) {
+  MemoryUsage first("tree");
+  unique_ptr<MemoryUsage> second(new MemoryUsage("tree"));
+  MemoryUsage other("index");
+  EXPECT_EQ(0, MemoryUsage::Total("tree"));
+
+  first.Set(100);
+  second->Set(50);
+  other.Set(7);
+  EXPECT_EQ(150, MemoryUsage::Total("tree"));
+  EXPECT_EQ(7, MemoryUsage::Total("index"));
+
+  first.Set(80);
+  EXPECT_EQ(80, first.bytes());
+  EXPECT_EQ(130, MemoryUsage::Total("tree"));
+
+  second.reset();
+  EXPECT_EQ(80, MemoryUsage::Total("tree"));
+}
+
+
+}  // namespace
+}  // namespace cert_trans
+
+
+int main(int argc, char** argv) {
+  cert_trans::test::InitTesting(argv[0], &argc, &argv, true);
+  return RUN_ALL_TESTS();
+}
@@ -1,6 +1,8 @@
 #ifndef CERT_TRANS_MONITORING_METRIC_H_
 #define CERT_TRANS_MONITORING_METRIC_H_
 
+#include <stdint.h>
+#include <chrono>
 #include <map>
 #include <ostream>
 #include <set>
@@ -26,9 +28,35 @@ class Metric {
   typedef std::pair<std::chrono::system_clock::time_point, double>
       TimestampedValue;
 
+  // The values recorded by a histogram, in the buckets given by
+  // HistogramUpperBounds().
+  struct Distribution {
+    std::chrono::system_clock::time_point updated;
+    // The number of values in each bucket, each one counting those
+    // above the previous bucket's upper bound. The last one counts
+    // those above all of the bounds.
+    std::vector<uint64_t> bucket_counts;
+    uint64_t count = 0;
+    double sum = 0;
+  };
+
+  // The value for one set of labels, as of a snapshot. |labels|
+  // belongs to the metric, and lives as long as it does.
+  struct Sample {
+    const std::vector<std::string>* labels;
+    TimestampedValue value;
+  };
+
+  // As above, for the distribution of a histogram.
+  struct DistributionSample {
+    const std::vector<std::string>* labels;
+    Distribution distribution;
+  };
+
   enum Type {
     COUNTER,
     GAUGE,
+    HISTOGRAM,
   };
 
   Type Type() const {
@@ -65,6 +93,25 @@ class Metric {
   virtual std::map<std::vector<std::string>, TimestampedValue> CurrentValues()
       const = 0;
 
+  // Replaces the contents of |samples| with the current values, in the
+  // same order as CurrentValues(). Nothing is copied but the values,
+  // and |samples| can be kept from one call to the next, so that
+  // exporters taking a snapshot every scrape need not allocate.
+  virtual void SnapshotValues(std::vector<Sample>* samples) const = 0;
+
+  // Only histograms have distributions, their CurrentValues() are the
+  // number of values recorded.
+  virtual std::map<std::vector<std::string>, Distribution>
+  CurrentDistributions() const {
+    return {};
+  }
+
+  // As SnapshotValues(), for CurrentDistributions().
+  virtual void SnapshotDistributions(
+      std::vector<DistributionSample>* samples) const {
+    samples->clear();
+  }
+
  protected:
   Metric(enum Type type, const std::string& name,
          const std::vector<std::string>& label_names, const std::string& help)
@@ -1,11 +1,24 @@
 #include "monitoring/prometheus/exporter.h"
+
+#include <ctype.h>
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <cmath>
+#include <limits>
+#include <mutex>
+
+#include "monitoring/histogram.h"
 #include "monitoring/metric.h"
 #include "monitoring/prometheus/metrics.pb.h"
 #include "monitoring/registry.h"
 
 using std::chrono::duration_cast;
 using std::chrono::milliseconds;
+using std::chrono::system_clock;
+using std::lock_guard;
 using std::map;
+using std::mutex;
 using std::set;
 using std::string;
 using std::vector;
@@ -26,43 +39,202 @@ void AddLabelTypes(::io::prometheus::client::Metric* metric,
 }
 
 
-::io::prometheus::client::MetricFamily PopulateMetricFamily(
-    const Metric& metric) {
-  ::io::prometheus::client::MetricFamily family;
-  family.set_name(metric.Name());
-  family.set_help(metric.Help());
+// The buffers metric values are read into, kept from one metric to
+// the next.
+struct Snapshot {
+  vector<Metric::Sample> samples;
+  vector<Metric::DistributionSample> distributions;
+};
+
+
+int64_t TimestampMs(const system_clock::time_point& time) {
+  return duration_cast<milliseconds>(time.time_since_epoch()).count();
+}
+
+
+void PopulateHistograms(const Metric& metric, Snapshot* snapshot,
+                        ::io::prometheus::client::MetricFamily* family) {
+  const vector<double>& bounds(HistogramUpperBounds());
+  metric.SnapshotDistributions(&snapshot->distributions);
+  for (const auto& d : snapshot->distributions) {
+    io::prometheus::client::Metric* m(family->add_metric());
+    AddLabelTypes(m, metric.LabelNames(), *d.labels);
+    m->set_timestamp_ms(TimestampMs(d.distribution.updated));
+    io::prometheus::client::Histogram* const histogram(m->mutable_histogram());
+    histogram->set_sample_count(d.distribution.count);
+    histogram->set_sample_sum(d.distribution.sum);
+    // The +Inf bucket is left implicit, it always holds sample_count.
+    uint64_t cumulative_count(0);
+    for (size_t i(0); i < bounds.size(); ++i) {
+      cumulative_count += d.distribution.bucket_counts[i];
+      io::prometheus::client::Bucket* const bucket(histogram->add_bucket());
+      bucket->set_cumulative_count(cumulative_count);
+      bucket->set_upper_bound(bounds[i]);
+    }
+  }
+}
+
+
+// Replaces the contents of |family|, which can be reused for each
+// metric so that its memory is too.
+void PopulateMetricFamily(const Metric& metric, Snapshot* snapshot,
+                          ::io::prometheus::client::MetricFamily* family) {
+  family->Clear();
+  family->set_name(metric.Name());
+  family->set_help(metric.Help());
   switch (metric.Type()) {
     case Metric::COUNTER:
-      family.set_type(io::prometheus::client::MetricType::COUNTER);
+      family->set_type(io::prometheus::client::MetricType::COUNTER);
       break;
     case Metric::GAUGE:
-      family.set_type(io::prometheus::client::MetricType::GAUGE);
+      family->set_type(io::prometheus::client::MetricType::GAUGE);
       break;
+    case Metric::HISTOGRAM:
+      family->set_type(io::prometheus::client::MetricType::HISTOGRAM);
+      PopulateHistograms(metric, snapshot, family);
+      return;
     default:
       LOG(FATAL) << "Unknown metric type: " << metric.Type();
   }
-  const map<vector<string>, Metric::TimestampedValue> values(
-      metric.CurrentValues());
-  const vector<string> label_names(metric.LabelNames());
-  for (auto it(values.begin()); it != values.end(); ++it) {
-    io::prometheus::client::Metric* m(family.add_metric());
-    AddLabelTypes(m, label_names, it->first);
-    m->set_timestamp_ms(
-        duration_cast<milliseconds>(it->second.first.time_since_epoch())
-            .count());
+  metric.SnapshotValues(&snapshot->samples);
+  for (const Metric::Sample& sample : snapshot->samples) {
+    io::prometheus::client::Metric* m(family->add_metric());
+    AddLabelTypes(m, metric.LabelNames(), *sample.labels);
+    m->set_timestamp_ms(TimestampMs(sample.value.first));
     switch (metric.Type()) {
       case Metric::COUNTER:
-        m->mutable_counter()->set_value(it->second.second);
+        m->mutable_counter()->set_value(sample.value.second);
         break;
       case Metric::GAUGE:
-        m->mutable_gauge()->set_value(it->second.second);
+        m->mutable_gauge()->set_value(sample.value.second);
         break;
       default:
         LOG(FATAL) << "Unknown metric type: " << metric.Type();
     }
   }
+}
+
+
+// Metric and label names may only have letters, digits, underscores
+// and colons, and may not start with a digit.
+void AppendName(const string& name, string* out) {
+  if (name.empty() || isdigit(static_cast<unsigned char>(name[0]))) {
+    out->push_back('_');
+  }
+  for (const char c : name) {
+    out->push_back(isalnum(static_cast<unsigned char>(c)) || c == ':'
+                       ? c
+                       : '_');
+  }
+}
+
+
+void AppendEscaped(const string& value, bool escape_quotes, string* out) {
+  for (const char c : value) {
+    if (c == '\\') {
+      out->append("\\\\");
+    } else if (c == '\n') {
+      out->append("\\n");
+    } else if (c == '"' && escape_quotes) {
+      out->append("\\\"");
+    } else {
+      out->push_back(c);
+    }
+  }
+}
 
-  return family;
+
+// The shortest of the usual representations which reads back as
+// |value|.
+void AppendDouble(double value, string* out) {
+  if (std::isnan(value)) {
+    out->append("NaN");
+    return;
+  }
+  if (std::isinf(value)) {
+    out->append(value > 0 ? "+Inf" : "-Inf");
+    return;
+  }
+  char buf[32];
+  snprintf(buf, sizeof(buf), "%.15g", value);
+  if (strtod(buf, nullptr) != value) {
+    snprintf(buf, sizeof(buf), "%.17g", value);
+  }
+  out->append(buf);
+}
+
+
+void AppendInt(int64_t value, string* out) {
+  char buf[24];
+  snprintf(buf, sizeof(buf), "%" PRId64, value);
+  out->append(buf);
+}
+
+
+// Appends |metric|'s name, with |suffix|, followed by its labels with
+// |values|, and then the label "le" if |le| is not null.
+void AppendSeriesName(const Metric& metric, const char* suffix,
+                      const vector<string>& values, const double* le,
+                      string* out) {
+  AppendName(metric.Name(), out);
+  out->append(suffix);
+  const vector<string>& names(metric.LabelNames());
+  CHECK_EQ(names.size(), values.size());
+  if (names.empty() && !le) {
+    return;
+  }
+  out->push_back('{');
+  for (size_t i(0); i < names.size(); ++i) {
+    if (i > 0) {
+      out->push_back(',');
+    }
+    AppendName(names[i], out);
+    out->append("=\"");
+    AppendEscaped(values[i], true, out);
+    out->push_back('"');
+  }
+  if (le) {
+    if (!names.empty()) {
+      out->push_back(',');
+    }
+    out->append("le=\"");
+    AppendDouble(*le, out);
+    out->push_back('"');
+  }
+  out->push_back('}');
+}
+
+
+void AppendSample(double value, int64_t timestamp_ms, string* out) {
+  out->push_back(' ');
+  AppendDouble(value, out);
+  out->push_back(' ');
+  AppendInt(timestamp_ms, out);
+  out->push_back('\n');
+}
+
+
+string FamilyHeader(const Metric& metric) {
+  string ret("# HELP ");
+  AppendName(metric.Name(), &ret);
+  ret.push_back(' ');
+  AppendEscaped(metric.Help(), false, &ret);
+  ret.append("\n# TYPE ");
+  AppendName(metric.Name(), &ret);
+  switch (metric.Type()) {
+    case Metric::COUNTER:
+      ret.append(" counter\n");
+      break;
+    case Metric::GAUGE:
+      ret.append(" gauge\n");
+      break;
+    case Metric::HISTOGRAM:
+      ret.append(" histogram\n");
+      break;
+    default:
+      LOG(FATAL) << "Unknown metric type: " << metric.Type();
+  }
+  return ret;
 }
 
 
@@ -71,14 +243,25 @@ void AddLabelTypes(::io::prometheus::client::Metric* metric,
 void ExportMetricsToPrometheus(std::ostream* os) {
   const set<const Metric*> metrics(Registry::Instance()->GetMetrics());
 
+  Snapshot snapshot;
+  ::io::prometheus::client::MetricFamily family;
   for (auto it(metrics.begin()); it != metrics.end(); ++it) {
-    const ::io::prometheus::client::MetricFamily family(
-        PopulateMetricFamily(**it));
+    PopulateMetricFamily(**it, &snapshot, &family);
     CHECK(WriteDelimitedToOstream(family, os));
   }
 }
 
 
+void ExportMetricsToPrometheusText(string* out) {
+  static mutex* const exporter_mutex(new mutex);
+  static PrometheusTextExporter* const exporter(new PrometheusTextExporter);
+
+  const set<const Metric*> metrics(Registry::Instance()->GetMetrics());
+  lock_guard<mutex> lock(*exporter_mutex);
+  exporter->Export(metrics, out);
+}
+
+
 void ExportMetricsToHtml(std::ostream* os) {
   const set<const Metric*> metrics(Registry::Instance()->GetMetrics());
   *os << "<html>\n"
@@ -87,13 +270,14 @@ void ExportMetricsToHtml(std::ostream* os) {
 
   *os << "<table>\n";
   bool bg_flip(false);
+  Snapshot snapshot;
+  ::io::prometheus::client::MetricFamily family;
   for (const auto* m : metrics) {
     *os << "<tr><td style='background-color:#"
         << (bg_flip ? "bbffbb" : "eeffee") << "'><code>\n";
     bg_flip = !bg_flip;
 
-    const ::io::prometheus::client::MetricFamily family(
-        PopulateMetricFamily(*m));
+    PopulateMetricFamily(*m, &snapshot, &family);
     *os << family.DebugString();
 
     *os << "\n</code></td></tr>\n";
@@ -104,4 +288,93 @@ void ExportMetricsToHtml(std::ostream* os) {
 }
 
 
+void PrometheusTextExporter::Export(const set<const Metric*>& metrics,
+                                    string* out) {
+  out->clear();
+  out->reserve(last_size_);
+
+  // Forget the metrics which went away.
+  for (auto it(families_.begin()); it != families_.end();) {
+    if (metrics.count(it->first) == 0) {
+      it = families_.erase(it);
+    } else {
+      ++it;
+    }
+  }
+
+  for (const Metric* metric : metrics) {
+    Family* const family(&families_[metric]);
+    if (family->header.empty()) {
+      family->header = FamilyHeader(*metric);
+    }
+    out->append(family->header);
+    if (metric->Type() == Metric::HISTOGRAM) {
+      ExportDistributions(*metric, family, out);
+    } else {
+      ExportValues(*metric, family, out);
+    }
+  }
+  last_size_ = out->size();
+}
+
+
+void PrometheusTextExporter::ExportValues(const Metric& metric,
+                                          Family* family, string* out) {
+  metric.SnapshotValues(&samples_);
+  for (const Metric::Sample& sample : samples_) {
+    auto inserted(family->series.emplace(sample.labels, Series()));
+    Series* const series(&inserted.first->second);
+    if (inserted.second || series->updated != sample.value.first ||
+        series->value != sample.value.second) {
+      series->updated = sample.value.first;
+      series->value = sample.value.second;
+      series->text.clear();
+      AppendSeriesName(metric, "", *sample.labels, nullptr, &series->text);
+      AppendSample(sample.value.second, TimestampMs(sample.value.first),
+                   &series->text);
+    }
+    out->append(series->text);
+  }
+}
+
+
+void PrometheusTextExporter::ExportDistributions(const Metric& metric,
+                                                 Family* family,
+                                                 string* out) {
+  const vector<double>& bounds(HistogramUpperBounds());
+  metric.SnapshotDistributions(&distributions_);
+  for (const Metric::DistributionSample& sample : distributions_) {
+    const Metric::Distribution& d(sample.distribution);
+    auto inserted(family->series.emplace(sample.labels, Series()));
+    Series* const series(&inserted.first->second);
+    if (inserted.second || series->updated != d.updated ||
+        series->value != d.count || series->sum != d.sum) {
+      series->updated = d.updated;
+      series->value = d.count;
+      series->sum = d.sum;
+      series->text.clear();
+      const int64_t timestamp_ms(TimestampMs(d.updated));
+      uint64_t cumulative_count(0);
+      for (size_t i(0); i < bounds.size(); ++i) {
+        cumulative_count += d.bucket_counts[i];
+        AppendSeriesName(metric, "_bucket", *sample.labels, &bounds[i],
+                         &series->text);
+        AppendSample(cumulative_count, timestamp_ms, &series->text);
+      }
+      const double inf(std::numeric_limits<double>::infinity());
+      AppendSeriesName(metric, "_bucket", *sample.labels, &inf,
+                       &series->text);
+      AppendSample(d.count, timestamp_ms, &series->text);
+      AppendSeriesName(metric, "_sum", *sample.labels, nullptr,
+                       &series->text);
+      AppendSample(d.sum, timestamp_ms, &series->text);
+      AppendSeriesName(metric, "_count", *sample.labels, nullptr,
+                       &series->text);
+      AppendSample(d.count, timestamp_ms, &series->text);
+    }
+    out->append(series->text);
+  }
+}
+
+
 }  // namespace cert_trans
@@ -2,17 +2,75 @@
 #define CERT_TRANS_MONITORING_PROMETHEUS_H_
 
 #include <glog/logging.h>
+#include <chrono>
+#include <map>
+#include <set>
+#include <string>
+#include <unordered_map>
+#include <vector>
 
+#include "monitoring/metric.h"
 #include "util/protobuf_util.h"
 
 namespace cert_trans {
 
+// Writes the registered metrics in the Prometheus protobuf exposition
+// format, as delimited MetricFamily messages.
 void ExportMetricsToPrometheus(std::ostream* os);
 
 
+// Replaces the contents of |out| with the registered metrics in the
+// Prometheus text exposition format (version 0.0.4).
+void ExportMetricsToPrometheusText(std::string* out);
+
+
 void ExportMetricsToHtml(std::ostream* os);
 
 
+// Formats metrics in the Prometheus text exposition format, keeping
+// the text of each series from one export to the next, so that only
+// those whose value changed are formatted again. Metric values are
+// read into snapshots whose memory is reused, so that an export holds
+// the lock of a metric no longer than it takes to copy its values.
+//
+// Not thread-safe.
+class PrometheusTextExporter {
+ public:
+  PrometheusTextExporter() = default;
+  PrometheusTextExporter(const PrometheusTextExporter&) = delete;
+  PrometheusTextExporter& operator=(const PrometheusTextExporter&) = delete;
+
+  // Replaces the contents of |out| with |metrics|. Metrics exported
+  // previously but not in |metrics| are forgotten.
+  void Export(const std::set<const Metric*>& metrics, std::string* out);
+
+ private:
+  struct Series {
+    std::chrono::system_clock::time_point updated;
+    double value;
+    // Only for histograms.
+    double sum;
+    std::string text;
+  };
+
+  struct Family {
+    // The HELP and TYPE lines.
+    std::string header;
+    std::unordered_map<const std::vector<std::string>*, Series> series;
+  };
+
+  void ExportValues(const Metric& metric, Family* family, std::string* out);
+  void ExportDistributions(const Metric& metric, Family* family,
+                           std::string* out);
+
+  std::map<const Metric*, Family> families_;
+  std::vector<Metric::Sample> samples_;
+  std::vector<Metric::DistributionSample> distributions_;
+  // The size of the last export, to size the next one.
+  size_t last_size_ = 0;
+};
+
+
 }  // namespace cert_trans
 
 #endif  // CERT_TRANS_MONITORING_PROMETHEUS_H_
@@ -0,0 +1,121 @@
+#include "monitoring/prometheus/exporter.h"
+
+#include <glog/logging.h>
+#include <gtest/gtest.h>
+#include <memory>
+#include <set>
+#include <string>
+
+#include "monitoring/histogram.h"
+#include "monitoring/monitoring.h"
+#include "util/testing.h"
+
+namespace cert_trans {
+namespace {
+
+using std::set;
+using std::string;
+using std::unique_ptr;
+
+
+class PrometheusTextExporterTest : public ::testing::Test {
+ protected:
+  void TearDown() override {
+    Registry::Instance()->ResetForTestingOnly();
+  }
+
+  string Export(const set<const Metric*>& metrics) {
+    string ret;
+    exporter_.Export(metrics, &ret);
+    return ret;
+  }
+
+  static bool Contains(const string& haystack, const string& needle) {
+    return haystack.find(needle) != string::npos;
+  }
+
+  PrometheusTextExporter exporter_;
+};
+
+
+TEST_F(PrometheusTextExporterTest, ExportsCountersAndGauges) {
+  unique_ptr<Counter<string>> counter(
+      Counter<string>::New("requests", "path", "Requests\nserved"));
+  unique_ptr<Gauge<>> gauge(Gauge<>::New("tree-size", "Size of the tree"));
+  counter->IncrementBy("/a\"b", 3);
+  gauge->Set(0.5);
+
+  const string text(Export({counter.get(), gauge.get()}));
+  EXPECT_TRUE(Contains(text, "# HELP requests Requests\\nserved\n")) << text;
+  EXPECT_TRUE(Contains(text, "# TYPE requests counter\n")) << text;
+  EXPECT_TRUE(Contains(text, "requests{path=\"/a\\\"b\"} 3 ")) << text;
+  // Names are made valid.
+  EXPECT_TRUE(Contains(text, "# TYPE tree_size gauge\n")) << text;
+  EXPECT_TRUE(Contains(text, "\ntree_size 0.5 ")) << text;
+}
+
+
+TEST_F(PrometheusTextExporterTest, LeavesOutValuesNeverSet) {
+  unique_ptr<Counter<string>> counter(
+      Counter<string>::New("requests", "path", "help"));
+  counter->Get("/a");
+
+  EXPECT_FALSE(Contains(Export({counter.get()}), "/a"));
+}
+
+
+TEST_F(PrometheusTextExporterTest, ExportsHistograms) {
+  unique_ptr<Histogram<string>> histogram(
+      Histogram<string>::New("latency", "path", "help"));
+  histogram->Record("/a", 1);
+  histogram->Record("/a", 1e12);
+
+  const string text(Export({histogram.get()}));
+  EXPECT_TRUE(Contains(text, "# TYPE latency histogram\n")) << text;
+  EXPECT_TRUE(Contains(text, "latency_bucket{path=\"/a\",le=\"0.25\"} 0 "))
+      << text;
+  EXPECT_TRUE(Contains(text, "latency_bucket{path=\"/a\",le=\"1\"} 1 "))
+      << text;
+  EXPECT_TRUE(Contains(text, "latency_bucket{path=\"/a\",le=\"+Inf\"} 2 "))
+      << text;
+  EXPECT_TRUE(Contains(text, "latency_sum{path=\"/a\"} 1000000000001 "))
+      << text;
+  EXPECT_TRUE(Contains(text, "latency_count{path=\"/a\"} 2 ")) << text;
+}
+
+
+TEST_F(PrometheusTextExporterTest, FollowsChanges) {
+  unique_ptr<Counter<string>> counter(
+      Counter<string>::New("requests", "path", "help"));
+  unique_ptr<Histogram<>> histogram(Histogram<>::New("latency", "help"));
+  counter->Increment("/a");
+  histogram->Record(1);
+  const set<const Metric*> metrics{counter.get(), histogram.get()};
+
+  string text(Export(metrics));
+  EXPECT_TRUE(Contains(text, "requests{path=\"/a\"} 1 ")) << text;
+  EXPECT_EQ(text, Export(metrics));
+
+  counter->Increment("/a");
+  counter->Increment("/b");
+  histogram->Record(3);
+  text = Export(metrics);
+  EXPECT_TRUE(Contains(text, "requests{path=\"/a\"} 2 ")) << text;
+  EXPECT_TRUE(Contains(text, "requests{path=\"/b\"} 1 ")) << text;
+  EXPECT_TRUE(Contains(text, "latency_sum 4 ")) << text;
+  EXPECT_TRUE(Contains(text, "latency_count 2 ")) << text;
+
+  // Metrics which are gone are no longer exported.
+  text = Export({counter.get()});
+  EXPECT_FALSE(Contains(text, "latency")) << text;
+}
+
+
+}  // namespace
+}  // namespace cert_trans
+
+
+int main(int argc, char** argv) {
+  cert_trans::test::InitTesting(argv[0], &argc, &argv, true);
+  return RUN_ALL_TESTS();
+}
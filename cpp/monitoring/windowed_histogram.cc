@@ -0,0 +1,149 @@
+#include "monitoring/windowed_histogram.h"
+
+#include <glog/logging.h>
+#include <algorithm>
+
+#include "monitoring/histogram.h"
+
+using std::chrono::duration;
+using std::chrono::duration_cast;
+using std::chrono::minutes;
+using std::chrono::seconds;
+using std::chrono::steady_clock;
+using std::pair;
+using std::string;
+using std::vector;
+
+namespace cert_trans {
+namespace {
+
+
+// The number of the kSlotSeconds interval |now| is in.
+int64_t SlotNumber(steady_clock::time_point now) {
+  return duration_cast<seconds>(now.time_since_epoch()).count() /
+         WindowedHistogramCell::kSlotSeconds;
+}
+
+
+}  // namespace
+
+
+const vector<pair<seconds, string>>& MetricWindows() {
+  static const vector<pair<seconds, string>>* const windows(
+      new vector<pair<seconds, string>>{{minutes(1), "1m"},
+                                        {minutes(5), "5m"},
+                                        {minutes(15), "15m"}});
+  return *windows;
+}
+
+
+WindowedHistogramCell::WindowedHistogramCell()
+    : created_(steady_clock::now()) {
+  CHECK_EQ(static_cast<size_t>(kNumBuckets),
+           HistogramUpperBounds().size() + 1);
+  for (Slot& slot : slots_) {
+    slot.number.store(-1, std::memory_order_relaxed);
+    for (auto& count : slot.counts) {
+      count.store(0, std::memory_order_relaxed);
+    }
+    slot.sum.store(0, std::memory_order_relaxed);
+  }
+}
+
+
+void WindowedHistogramCell::Record(double value,
+                                   steady_clock::time_point now) {
+  const vector<double>& bounds(HistogramUpperBounds());
+  const size_t bucket(std::lower_bound(bounds.begin(), bounds.end(), value) -
+                      bounds.begin());
+
+  const int64_t number(SlotNumber(now));
+  Slot* const slot(&slots_[number % kNumSlots]);
+  int64_t slot_number(slot->number.load(std::memory_order_acquire));
+  while (slot_number < number) {
+    // The slot holds values older than any window, whoever moves it on
+    // clears them.
+    if (slot->number.compare_exchange_weak(slot_number, number,
+                                           std::memory_order_acq_rel)) {
+      for (auto& count : slot->counts) {
+        count.store(0, std::memory_order_relaxed);
+      }
+      slot->sum.store(0, std::memory_order_relaxed);
+      slot_number = number;
+    }
+  }
+  // |now| was taken long enough ago for the slot to have moved on.
+  if (slot_number > number) {
+    return;
+  }
+
+  slot->counts[bucket].fetch_add(1, std::memory_order_relaxed);
+  double sum(slot->sum.load(std::memory_order_relaxed));
+  while (!slot->sum.compare_exchange_weak(sum, sum + value,
+                                          std::memory_order_relaxed)) {
+  }
+}
+
+
+Metric::Distribution WindowedHistogramCell::GetDistribution(
+    seconds window, double* covered, steady_clock::time_point now) const {
+  CHECK_GT(window.count(), 0);
+  CHECK_LE(window, MetricWindows().back().first);
+  CHECK_NOTNULL(covered);
+
+  Metric::Distribution ret;
+  ret.bucket_counts.assign(kNumBuckets, 0);
+  const int64_t number(SlotNumber(now));
+  const int64_t full_slots(window.count() / kSlotSeconds);
+  for (int64_t n = number - full_slots; n <= number; ++n) {
+    const Slot& slot(slots_[n % kNumSlots]);
+    if (slot.number.load(std::memory_order_acquire) != n) {
+      continue;
+    }
+    for (int i = 0; i < kNumBuckets; ++i) {
+      const uint64_t count(slot.counts[i].load(std::memory_order_relaxed));
+      ret.bucket_counts[i] += count;
+      ret.count += count;
+    }
+    ret.sum += slot.sum.load(std::memory_order_relaxed);
+  }
+
+  const double into_slot(
+      duration<double>(now.time_since_epoch()).count() -
+      static_cast<double>(number * kSlotSeconds));
+  *covered = std::min(full_slots * kSlotSeconds + into_slot,
+                      duration<double>(now - created_).count());
+  return ret;
+}
+
+
+double WindowedHistogramCell::Rate(seconds window,
+                                   steady_clock::time_point now) const {
+  double covered;
+  const Metric::Distribution distribution(
+      GetDistribution(window, &covered, now));
+  if (covered <= 0) {
+    return 0;
+  }
+  return distribution.count / covered;
+}
+
+
+double WindowedHistogramCell::Quantile(double q, seconds window,
+                                       steady_clock::time_point now) const {
+  double covered;
+  return cert_trans::Quantile(GetDistribution(window, &covered, now), q);
+}
+
+
+bool WindowedHistogramCell::Updated() const {
+  for (const Slot& slot : slots_) {
+    if (slot.number.load(std::memory_order_relaxed) >= 0) {
+      return true;
+    }
+  }
+  return false;
+}
+
+
+}  // namespace cert_trans
@@ -0,0 +1,163 @@
+#ifndef CERT_TRANS_MONITORING_WINDOWED_HISTOGRAM_H_
+#define CERT_TRANS_MONITORING_WINDOWED_HISTOGRAM_H_
+
+#include <stdint.h>
+#include <atomic>
+#include <chrono>
+#include <map>
+#include <mutex>
+#include <set>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "monitoring/labelled_values.h"
+#include "monitoring/metric.h"
+
+namespace cert_trans {
+
+
+// The windows over which WindowedHistogramCell works out rates and
+// quantiles, and their names, as in the "window" label of the
+// "|base_name|_rate" metric of an EventMetric.
+const std::vector<std::pair<std::chrono::seconds, std::string>>&
+MetricWindows();
+
+
+// The values recorded for one set of labels over the last few minutes,
+// in the buckets of HistogramUpperBounds(), so that their rate and
+// quantiles can be worked out over any of MetricWindows() in-process,
+// without waiting for an external metrics system to derive them from
+// the totals.
+//
+// The values are kept in a ring of slots kSlotSeconds long, each
+// reused once it is older than the longest window. A window is made of
+// the slot being filled and the complete ones before it, so it spans
+// up to kSlotSeconds more than asked for, and the rates are over the
+// time actually spanned. Recording and reading take no lock. The one
+// value recorded as a slot is being reused can be lost, which is of
+// no consequence for the estimates these are.
+class WindowedHistogramCell {
+ public:
+  static const int kSlotSeconds = 15;
+
+  WindowedHistogramCell();
+  WindowedHistogramCell(const WindowedHistogramCell&) = delete;
+  WindowedHistogramCell& operator=(const WindowedHistogramCell&) = delete;
+
+  void Record(double value) {
+    Record(value, std::chrono::steady_clock::now());
+  }
+
+  void Record(double value, std::chrono::steady_clock::time_point now);
+
+  // The values recorded over the last |window|, which is at most the
+  // longest of MetricWindows(). Sets |covered| to the number of seconds
+  // they were recorded over, less than |window| while the cell is
+  // younger than that.
+  Metric::Distribution GetDistribution(
+      std::chrono::seconds window, double* covered,
+      std::chrono::steady_clock::time_point now =
+          std::chrono::steady_clock::now()) const;
+
+  // The number of values recorded per second over the last |window|.
+  double Rate(std::chrono::seconds window,
+              std::chrono::steady_clock::time_point now =
+                  std::chrono::steady_clock::now()) const;
+
+  // Estimates the |q| quantile of the values recorded over the last
+  // |window|, or returns 0 if there are none.
+  double Quantile(double q, std::chrono::seconds window,
+                  std::chrono::steady_clock::time_point now =
+                      std::chrono::steady_clock::now()) const;
+
+  // Whether any value was ever recorded.
+  bool Updated() const;
+
+ private:
+  // 1 + 26 * 4 bounds, plus the overflow bucket, as in HistogramCell.
+  static const int kNumBuckets = 106;
+  // Enough for the longest window, plus the slot being filled.
+  static const int kNumSlots = 15 * 60 / kSlotSeconds + 1;
+
+  struct Slot {
+    // Which kSlotSeconds interval since the epoch of steady_clock the
+    // slot holds the values of, or -1 if none yet.
+    std::atomic<int64_t> number;
+    std::atomic<uint64_t> counts[kNumBuckets];
+    std::atomic<double> sum;
+  };
+
+  const std::chrono::steady_clock::time_point created_;
+  Slot slots_[kNumSlots];
+};
+
+
+// A gauge named "|name|_rate", with a "window" label after those of
+// |values|, holding the number of values per second recorded in each
+// of its cells over each of MetricWindows(), so that exporters which
+// only have totals to go on (such as GCM) get a rate too.
+template <class... LabelTypes>
+class WindowedRates : public Metric {
+ public:
+  WindowedRates(const std::string& name,
+                const typename NameType<LabelTypes>::name&... label_names,
+                const std::string& help,
+                const LabelledValues<WindowedHistogramCell, LabelTypes...>*
+                    values)
+      : Metric(GAUGE, name + "_rate", {label_names..., "window"},
+               help + " (per second)"),
+        values_(values) {
+  }
+
+  std::map<std::vector<std::string>, Metric::TimestampedValue> CurrentValues()
+      const override;
+
+  void SnapshotValues(std::vector<Metric::Sample>* samples) const override;
+
+ private:
+  const LabelledValues<WindowedHistogramCell, LabelTypes...>* const values_;
+  // The labels of the samples, which have to live as long as this
+  // object does.
+  mutable std::mutex labels_lock_;
+  mutable std::set<std::vector<std::string>> labels_;
+};
+
+
+template <class... LabelTypes>
+std::map<std::vector<std::string>, Metric::TimestampedValue>
+WindowedRates<LabelTypes...>::CurrentValues() const {
+  std::vector<Metric::Sample> samples;
+  SnapshotValues(&samples);
+  std::map<std::vector<std::string>, Metric::TimestampedValue> ret;
+  for (const Metric::Sample& sample : samples) {
+    ret[*sample.labels] = sample.value;
+  }
+  return ret;
+}
+
+
+template <class... LabelTypes>
+void WindowedRates<LabelTypes...>::SnapshotValues(
+    std::vector<Metric::Sample>* samples) const {
+  samples->clear();
+  const std::chrono::system_clock::time_point now(
+      std::chrono::system_clock::now());
+  std::lock_guard<std::mutex> lock(labels_lock_);
+  values_->ForEachUpdatedCell([this, samples, now](
+      const std::vector<std::string>& labels,
+      const WindowedHistogramCell& cell) {
+    for (const auto& window : MetricWindows()) {
+      std::vector<std::string> window_labels(labels);
+      window_labels.push_back(window.second);
+      samples->push_back(
+          Metric::Sample{&*labels_.insert(window_labels).first,
+                         make_pair(now, cell.Rate(window.first))});
+    }
+  });
+}
+
+
+}  // namespace cert_trans
+
+#endif  // CERT_TRANS_MONITORING_WINDOWED_HISTOGRAM_H_
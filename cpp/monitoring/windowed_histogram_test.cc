@@ -0,0 +1,156 @@
+#include "monitoring/windowed_histogram.h"
+
+#include <glog/logging.h>
+#include <gtest/gtest.h>
+#include <chrono>
+#include <string>
+#include <vector>
+
+#include "monitoring/event_metric.h"
+#include "util/testing.h"
+
+namespace cert_trans {
+
+using std::chrono::minutes;
+using std::chrono::seconds;
+using std::chrono::steady_clock;
+using std::string;
+using std::vector;
+
+
+// The start of a slot at least one slot after now.
+steady_clock::time_point NextSlotStart() {
+  const int64_t slot_number(std::chrono::duration_cast<seconds>(
+                                steady_clock::now().time_since_epoch())
+                                .count() /
+                            WindowedHistogramCell::kSlotSeconds);
+  return steady_clock::time_point(
+      seconds((slot_number + 2) * WindowedHistogramCell::kSlotSeconds));
+}
+
+
+class WindowedHistogramTest : public ::testing::Test {
+ protected:
+  WindowedHistogramTest() : start_(NextSlotStart()) {
+  }
+
+  WindowedHistogramCell cell_;
+  const steady_clock::time_point start_;
+};
+
+
+TEST_F(WindowedHistogramTest, Empty) {
+  EXPECT_FALSE(cell_.Updated());
+  EXPECT_EQ(0, cell_.Rate(minutes(1), start_));
+  EXPECT_EQ(0, cell_.Quantile(0.5, minutes(1), start_));
+}
+
+
+TEST_F(WindowedHistogramTest, RateOverWindows) {
+  // One value a second for two minutes.
+  for (int i = 0; i < 120; ++i) {
+    cell_.Record(1, start_ + seconds(i));
+  }
+  EXPECT_TRUE(cell_.Updated());
+
+  const steady_clock::time_point now(start_ + seconds(120));
+  double covered;
+  const Metric::Distribution last_minute(
+      cell_.GetDistribution(minutes(1), &covered, now));
+  EXPECT_EQ(60U, last_minute.count);
+  EXPECT_EQ(60, last_minute.sum);
+  EXPECT_EQ(60, covered);
+  EXPECT_DOUBLE_EQ(1, cell_.Rate(minutes(1), now));
+
+  // The cell is younger than five minutes, so the rate is over the
+  // time it has existed, but the values all fall in the window.
+  EXPECT_EQ(120U, cell_.GetDistribution(minutes(5), &covered, now).count);
+  EXPECT_LT(120, covered);
+  EXPECT_LT(0, cell_.Rate(minutes(5), now));
+  EXPECT_GT(1, cell_.Rate(minutes(5), now));
+}
+
+
+TEST_F(WindowedHistogramTest, OldValuesExpire) {
+  cell_.Record(1, start_);
+  cell_.Record(1, start_ + minutes(14));
+  double covered;
+  EXPECT_EQ(2U, cell_.GetDistribution(minutes(15), &covered,
+                                      start_ + minutes(14)).count);
+  EXPECT_EQ(1U, cell_.GetDistribution(minutes(15), &covered,
+                                      start_ + minutes(16)).count);
+  EXPECT_EQ(0U, cell_.GetDistribution(minutes(1), &covered,
+                                      start_ + minutes(16)).count);
+
+  // Reusing the slot of the first value clears it.
+  cell_.Record(5, start_ + minutes(15) + seconds(15));
+  const Metric::Distribution d(cell_.GetDistribution(
+      minutes(15), &covered, start_ + minutes(15) + seconds(15)));
+  EXPECT_EQ(2U, d.count);
+  EXPECT_EQ(6, d.sum);
+}
+
+
+TEST_F(WindowedHistogramTest, DropsValuesOlderThanTheirSlot) {
+  cell_.Record(1, start_ + minutes(16));
+  // Same slot in the ring, a full turn earlier.
+  cell_.Record(1, start_ + minutes(16) -
+                      seconds(WindowedHistogramCell::kSlotSeconds * 61));
+  double covered;
+  EXPECT_EQ(1U, cell_.GetDistribution(minutes(1), &covered,
+                                      start_ + minutes(16)).count);
+}
+
+
+TEST_F(WindowedHistogramTest, Quantiles) {
+  for (int i = 1; i <= 100; ++i) {
+    cell_.Record(i, start_ + seconds(30));
+  }
+  const steady_clock::time_point now(start_ + seconds(40));
+  EXPECT_NEAR(50, cell_.Quantile(0.5, minutes(1), now), 50 * 0.25);
+  EXPECT_NEAR(99, cell_.Quantile(0.99, minutes(1), now), 99 * 0.25);
+  // Too long ago for the last minute.
+  EXPECT_EQ(0, cell_.Quantile(0.5, minutes(1), now + minutes(2)));
+  EXPECT_NEAR(50, cell_.Quantile(0.5, minutes(5), now + minutes(2)),
+              50 * 0.25);
+}
+
+
+TEST(EventMetricTest, ExportsRates) {
+  EventMetric<string> metric("events", "label", "help");
+  metric.RecordEvent("a", 2);
+  metric.RecordEvent("a", 3);
+  metric.RecordEvent("b", 1);
+
+  double covered;
+  EXPECT_EQ(2U, metric.Windows("a")
+                    ->GetDistribution(minutes(1), &covered,
+                                      steady_clock::now())
+                    .count);
+
+  const Metric* rates(nullptr);
+  for (const Metric* m : Registry::Instance()->GetMetrics()) {
+    if (m->Name() == "events_rate") {
+      rates = m;
+    }
+  }
+  ASSERT_NE(nullptr, rates);
+  EXPECT_EQ(Metric::GAUGE, rates->Type());
+  EXPECT_EQ(vector<string>({"label", "window"}), rates->LabelNames());
+
+  const auto values(rates->CurrentValues());
+  EXPECT_EQ(6U, values.size());
+  for (const string window : {"1m", "5m", "15m"}) {
+    EXPECT_LT(0, values.at({"a", window}).second);
+    EXPECT_LT(0, values.at({"b", window}).second);
+  }
+}
+
+
+}  // namespace cert_trans
+
+
+int main(int argc, char** argv) {
+  cert_trans::test::InitTesting(argv[0], &argc, &argv, true);
+  return RUN_ALL_TESTS();
+}
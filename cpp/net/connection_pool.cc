@@ -3,7 +3,9 @@
 #include <event2/event.h>
 #include <gflags/gflags.h>
 #include <glog/logging.h>
+#include <time.h>
 #include <chrono>
+#include <vector>
 
 #include "monitoring/monitoring.h"
 #include "util/openssl_util.h"
@@ -31,6 +33,7 @@ using std::to_string;
 using std::unique_lock;
 using std::unique_ptr;
 using std::shared_ptr;
+using std::vector;
 using util::ClearOpenSSLErrors;
 using util::DumpOpenSSLErrorStack;
 
@@ -40,16 +43,20 @@ DEFINE_int32(
 DEFINE_int32(connection_write_timeout_seconds, 60,
              "Connection write timeout in seconds, only applies while willing "
              "to write.");
-DEFINE_int32(
-    connection_pool_max_unused_age_seconds, 60 * 5,
-    "When there are more than --url_fetcher_max_conn_per_host_port "
-    "connections per host:port pair, any unused for at least this long will "
-    "be removed.");
+DEFINE_int32(connection_pool_max_unused_age_seconds, 60 * 5,
+             "Idle connections unused for at least this long are closed, "
+             "unless that leaves fewer than "
+             "--connection_pool_warm_conns_per_host_port of them.");
+DEFINE_int32(connection_pool_warm_conns_per_host_port, 0,
+             "Number of connections to keep open ahead of requests to the "
+             "hosts connections are warmed up for (such as the other nodes of "
+             "a cluster).");
 DEFINE_string(trusted_root_certs, "",
               "Location of trusted CA root certs for outgoing SSL "
               "connections.");
 DEFINE_int32(url_fetcher_max_conn_per_host_port, 4,
-             "maximum number of URL fetcher connections per host:port");
+             "maximum number of idle URL fetcher connections kept per "
+             "host:port");
 
 DEFINE_string(tls_client_minimum_protocol, "tlsv12",
               "Minimum acceptable TLS "
@@ -69,6 +76,11 @@ DEFINE_string(
     "List of ciphers the client will accept, default is the Mozilla 'Modern "
     "compatibility' recommended list.");
 
+DEFINE_int32(tls_client_session_timeout_seconds, 60 * 60,
+             "How long the TLS session (or session ticket) last negotiated "
+             "with a host:port is offered for resumption on new connections "
+             "to it. 0 disables session resumption.");
+
 
 namespace cert_trans {
 namespace internal {
@@ -81,6 +93,12 @@ static Gauge<string>* connections_per_host_port(
     Gauge<string>::New("connections_per_host_port", "host_port",
                        "Number of cached connections port host:port"));
 
+static Counter<bool>* tls_client_handshakes(
+    Counter<bool>::New("tls_client_handshakes", "resumed",
+                       "Number of TLS handshakes completed by outgoing "
+                       "connections, broken down by whether they resumed a "
+                       "previous session."));
+
 
 namespace {
 
@@ -97,6 +115,13 @@ string HostPortString(const HostPortPair& pair) {
 }
 
 
+HostPortPair HostPortForURL(const URL& url) {
+  CHECK(url.Protocol() == "http" || url.Protocol() == "https");
+  const uint16_t default_port(url.Protocol() == "https" ? 443 : 80);
+  return HostPortPair(url.Host(), url.Port() != 0 ? url.Port() : default_port);
+}
+
+
 }  // namespace
 
 
@@ -115,7 +140,10 @@ class EvConnection {
   // delete it.
   static evhtp_res ConnectionFinishedHook(evhtp_connection_t* conn, void* arg);
 
-  EvConnection(evhtp_connection_t* conn, HostPortPair&& other_end)
+  // If not null, |session| is offered to the server for resumption,
+  // sparing a full handshake.
+  EvConnection(evhtp_connection_t* conn, HostPortPair&& other_end,
+               SSL_SESSION* session)
       : ev_conn_(CHECK_NOTNULL(conn)),
         other_end_(move(other_end)),
         errored_(false) {
@@ -123,6 +151,9 @@ class EvConnection {
       SSL_set_ex_data(ev_conn_->ssl, GetSSLConnectionIndex(),
                       static_cast<void*>(this));
       SSL_set_tlsext_host_name(ev_conn_->ssl, other_end_.first.c_str());
+      if (session) {
+        SSL_set_session(ev_conn_->ssl, session);
+      }
     }
   }
 
@@ -252,6 +283,14 @@ const int kSslOpMinVersionTls11 = kSslOpMinVersionTls1 | SSL_OP_NO_TLSv1;
 const int kSslOpMinVersionTls12 = kSslOpMinVersionTls11 | SSL_OP_NO_TLSv1_1;
 
 
+void SSLInfoCallback(const SSL* ssl, int where, int ret) {
+  if (where & SSL_CB_HANDSHAKE_DONE) {
+    tls_client_handshakes->Increment(
+        SSL_session_reused(const_cast<SSL*>(ssl)) == 1);
+  }
+}
+
+
 // Create an SSL_CTX which permits the TLS versions specified by flags.
 // SSLv2 and SSLv3 are never supported.
 SSL_CTX* CreateSSLCTXFromFlags() {
@@ -274,6 +313,19 @@ SSL_CTX* CreateSSLCTXFromFlags() {
 
   CHECK_EQ(1, SSL_CTX_set_cipher_list(ctx, FLAGS_tls_client_ciphers.c_str()));
 
+  // The ConnectionPool keeps the sessions to resume itself, by
+  // host:port, and sessions from session tickets are kept for as
+  // long as those negotiated with a session ID.
+  CHECK_LE(0, FLAGS_tls_client_session_timeout_seconds);
+  SSL_CTX_set_session_cache_mode(ctx, SSL_SESS_CACHE_CLIENT |
+                                          SSL_SESS_CACHE_NO_INTERNAL_STORE);
+  if (FLAGS_tls_client_session_timeout_seconds > 0) {
+    SSL_CTX_set_timeout(ctx, FLAGS_tls_client_session_timeout_seconds);
+  } else {
+    SSL_CTX_set_options(ctx, SSL_OP_NO_TICKET);
+  }
+  SSL_CTX_set_info_callback(ctx, SSLInfoCallback);
+
   return ctx;
 }
 
@@ -282,9 +334,21 @@ SSL_CTX* CreateSSLCTXFromFlags() {
 
 
 ConnectionPool::ConnectionPool(libevent::Base* base)
+    : ConnectionPool(base, UrlFetcher::Options()) {
+}
+
+
+ConnectionPool::ConnectionPool(libevent::Base* base,
+                               const UrlFetcher::Options& options)
     : base_(CHECK_NOTNULL(base)),
+      options_(options),
       cleanup_scheduled_(false),
-      ssl_ctx_(CreateSSLCTXFromFlags(), SSL_CTX_free) {
+      ssl_ctx_(CreateSSLCTXFromFlags(), SSL_CTX_free),
+      reap_event_(*base_, -1, 0, bind(&ConnectionPool::Reap, this)),
+      reap_scheduled_(false) {
+  CHECK_LE(0, options_.max_idle_conns_per_host_port);
+  CHECK_LE(0, options_.warm_conns_per_host_port);
+  CHECK_LT(0, options_.idle_timeout.count());
   CHECK(ssl_ctx_) << "could not build SSL context: "
                   << DumpOpenSSLErrorStack();
 
@@ -419,10 +483,62 @@ void ConnectionPool::RemoveDeadConnectionsFromDeque(
 }
 
 
+unique_ptr<ConnectionPool::Connection> ConnectionPool::NewConnection(
+    const unique_lock<mutex>& lock, const string& protocol, HostPortPair key) {
+  CHECK(lock.owns_lock());
+  VLOG(1) << "new evhtp_connection for " << key.first << ":" << key.second;
+  const bool https(protocol == "https");
+  SSL_SESSION* session(nullptr);
+  if (https) {
+    const auto it(ssl_sessions_.find(key));
+    if (it != ssl_sessions_.end()) {
+      // Expired sessions would be refused by the server anyway.
+      if (SSL_SESSION_get_time(it->second.get()) +
+              SSL_SESSION_get_timeout(it->second.get()) >
+          time(nullptr)) {
+        session = it->second.get();
+      } else {
+        ssl_sessions_.erase(it);
+      }
+    }
+  }
+
+  // This EvConnection has a slightly complicated lifetime; it needs to hang
+  // around until libevhtp/libevent have entirely finished with the
+  // evhtp_connection_t it references, and for at least as long as the life
+  // of the Connection we return from this method.
+  //
+  // This is accomplished through the use of a couple of shared_ptrs;
+  // this one, which goes inside the returned Connection object, and another
+  // created further below which gets passed in to the
+  // ConnectionFinishedHook.
+  auto conn(std::make_shared<EvConnection>(
+      https ? base_->HttpsConnectionNew(key.first, key.second, ssl_ctx_.get())
+            : base_->HttpConnectionNew(key.first, key.second),
+      move(key), session));
+  unique_ptr<ConnectionPool::Connection> handle(new Connection(conn));
+  struct timeval read_timeout = {FLAGS_connection_read_timeout_seconds,
+                                 kZeroMillis};
+  struct timeval write_timeout = {FLAGS_connection_write_timeout_seconds,
+                                  kZeroMillis};
+  evhtp_connection_set_timeouts(handle->connection(), &read_timeout,
+                                &write_timeout);
+  evhtp_set_hook(&handle->connection()->hooks, evhtp_hook_on_conn_error,
+                 reinterpret_cast<evhtp_hook>(
+                     EvConnection::ConnectionErrorHook),
+                 reinterpret_cast<void*>(conn.get()));
+  evhtp_set_hook(
+      &handle->connection()->hooks, evhtp_hook_on_connection_fini,
+      reinterpret_cast<evhtp_hook>(EvConnection::ConnectionFinishedHook),
+      // We'll hold on to another shared_ptr to the Connection
+      // until evhtp tells us that it's finished with the cnxn.
+      reinterpret_cast<void*>(new shared_ptr<EvConnection>(conn)));
+  return handle;
+}
+
+
 unique_ptr<ConnectionPool::Connection> ConnectionPool::Get(const URL& url) {
-  CHECK(url.Protocol() == "http" || url.Protocol() == "https");
-  const uint16_t default_port(url.Protocol() == "https" ? 443 : 80);
-  HostPortPair key(url.Host(), url.Port() != 0 ? url.Port() : default_port);
+  HostPortPair key(HostPortForURL(url));
   unique_lock<mutex> lock(lock_);
 
   auto it(conns_.find(key));
@@ -432,39 +548,7 @@ unique_ptr<ConnectionPool::Connection> ConnectionPool::Get(const URL& url) {
   }
 
   if (it == conns_.end() || it->second.empty()) {
-    VLOG(1) << "new evhtp_connection for " << key.first << ":" << key.second;
-    // This EvConnection has a slightly complicated lifetime; it needs to hang
-    // around until libevhtp/libevent have entirely finished with the
-    // evhtp_connection_t it references, and for at least as long as the life
-    // of the Connection we return from this method.
-    //
-    // This is accomplished through the use of a couple of shared_ptrs;
-    // this one, which goes inside the returned Connection object, and another
-    // created further below which gets passed in to the
-    // ConnectionFinishedHook.
-    auto conn(std::make_shared<EvConnection>(
-        url.Protocol() == "https"
-            ? base_->HttpsConnectionNew(key.first, key.second, ssl_ctx_.get())
-            : base_->HttpConnectionNew(key.first, key.second),
-        move(key)));
-    unique_ptr<ConnectionPool::Connection> handle(new Connection(conn));
-    struct timeval read_timeout = {FLAGS_connection_read_timeout_seconds,
-                                   kZeroMillis};
-    struct timeval write_timeout = {FLAGS_connection_write_timeout_seconds,
-                                    kZeroMillis};
-    evhtp_connection_set_timeouts(handle->connection(), &read_timeout,
-                                  &write_timeout);
-    evhtp_set_hook(&handle->connection()->hooks, evhtp_hook_on_conn_error,
-                   reinterpret_cast<evhtp_hook>(
-                       EvConnection::ConnectionErrorHook),
-                   reinterpret_cast<void*>(conn.get()));
-    evhtp_set_hook(
-        &handle->connection()->hooks, evhtp_hook_on_connection_fini,
-        reinterpret_cast<evhtp_hook>(EvConnection::ConnectionFinishedHook),
-        // We'll hold on to another shared_ptr to the Connection
-        // until evhtp tells us that it's finished with the cnxn.
-        reinterpret_cast<void*>(new shared_ptr<EvConnection>(conn)));
-    return handle;
+    return NewConnection(lock, url.Protocol(), move(key));
   }
 
   VLOG(1) << "cached evhtp_connection for " << key.first << ":" << key.second;
@@ -497,42 +581,111 @@ void ConnectionPool::Put(unique_ptr<ConnectionPool::Connection> handle) {
 
   const HostPortPair& key(handle->other_end());
   VLOG(1) << "returned Connection for " << key.first << ":" << key.second;
-  lock_guard<mutex> lock(lock_);
+  unique_lock<mutex> lock(lock_);
+
+  // Remember the session of a healthy connection, so that the next
+  // new connection to that host:port can resume it.
+  if (handle->connection()->ssl &&
+      FLAGS_tls_client_session_timeout_seconds > 0) {
+    SSL_SESSION* const session(SSL_get1_session(handle->connection()->ssl));
+    if (session) {
+      ssl_sessions_[key].reset(session);
+    }
+  }
+
+  AddIdle(lock, move(handle));
+}
+
+
+void ConnectionPool::WarmUp(const URL& url) {
+  const HostPortPair key(HostPortForURL(url));
+  unique_lock<mutex> lock(lock_);
+
+  auto& entry(conns_[key]);
+  RemoveDeadConnectionsFromDeque(lock, &entry);
+  int num_new(options_.warm_conns_per_host_port -
+              static_cast<int>(entry.size()));
+  if (num_new > 0) {
+    VLOG(1) << "warming up " << num_new << " connections to "
+            << HostPortString(key);
+  }
+  for (; num_new > 0; --num_new) {
+    AddIdle(lock, NewConnection(lock, url.Protocol(), key));
+  }
+}
+
+
+void ConnectionPool::AddIdle(const unique_lock<mutex>& lock,
+                             unique_ptr<Connection> handle) {
+  CHECK(lock.owns_lock());
+  const HostPortPair key(handle->other_end());
   auto& entry(conns_[key]);
 
-  CHECK_GE(FLAGS_url_fetcher_max_conn_per_host_port, 0);
   entry.emplace_back(make_pair(system_clock::now(), move(handle)));
   const string hostport(HostPortString(key));
   VLOG(1) << "ConnectionPool for " << hostport << " size : " << entry.size();
   connections_per_host_port->Set(hostport, entry.size());
   if (!cleanup_scheduled_ &&
       entry.size() >
-          static_cast<uint>(FLAGS_url_fetcher_max_conn_per_host_port)) {
+          static_cast<uint>(options_.max_idle_conns_per_host_port)) {
     cleanup_scheduled_ = true;
     base_->Add(bind(&ConnectionPool::Cleanup, this));
   }
+  if (!reap_scheduled_) {
+    reap_scheduled_ = true;
+    reap_event_.Add(options_.idle_timeout);
+  }
+}
+
+
+void ConnectionPool::Reap() {
+  {
+    lock_guard<mutex> lock(lock_);
+    reap_scheduled_ = false;
+  }
+  Cleanup();
 }
 
 
 void ConnectionPool::Cleanup() {
+  CHECK(libevent::Base::OnEventThread());
   unique_lock<mutex> lock(lock_);
   cleanup_scheduled_ = false;
-  const system_clock::time_point cutoff(
-      system_clock::now() -
-      seconds(FLAGS_connection_pool_max_unused_age_seconds));
-
+  const system_clock::time_point cutoff(system_clock::now() -
+                                        options_.idle_timeout);
+  const size_t max_idle(options_.max_idle_conns_per_host_port);
+  const size_t warm(options_.warm_conns_per_host_port);
+
+  // Dropping a Connection does not close it, so the pruned ones are
+  // freed once we are done with the lock.
+  vector<unique_ptr<Connection>> closing;
+  bool have_idle(false);
   // conns_ is a std::map<HostPortPair, std::deque<TimestampedConnection>>
   for (auto& entry : conns_) {
-    RemoveDeadConnectionsFromDeque(lock, &entry.second);
-    while (entry.second.front().first < cutoff &&
-           entry.second.size() >
-               static_cast<uint>(FLAGS_url_fetcher_max_conn_per_host_port)) {
-      entry.second.pop_front();
+    auto& conns(entry.second);
+    RemoveDeadConnectionsFromDeque(lock, &conns);
+    while (conns.size() > max_idle ||
+           (conns.size() > warm && conns.front().first < cutoff)) {
+      closing.emplace_back(move(conns.front().second));
+      conns.pop_front();
     }
     const string hostport(HostPortString(entry.first));
-    VLOG(1) << "ConnectionPool for " << hostport
-            << " size : " << entry.second.size();
-    connections_per_host_port->Set(hostport, entry.second.size());
+    VLOG(1) << "ConnectionPool for " << hostport << " size : " << conns.size();
+    connections_per_host_port->Set(hostport, conns.size());
+    have_idle |= !conns.empty();
+  }
+
+  if (have_idle && !reap_scheduled_) {
+    reap_scheduled_ = true;
+    reap_event_.Add(options_.idle_timeout);
+  }
+  lock.unlock();
+
+  for (const auto& conn : closing) {
+    VLOG(1) << "closing idle connection to "
+            << HostPortString(conn->other_end());
+    // This calls ConnectionFinishedHook.
+    evhtp_connection_free(conn->connection());
   }
 }
 
@@ -10,6 +10,7 @@
 #include <string>
 
 #include "net/url.h"
+#include "net/url_fetcher.h"
 #include "util/libevent_wrapper.h"
 
 namespace cert_trans {
@@ -35,6 +36,13 @@ struct evhtp_connection_deleter {
 };
 
 
+struct ssl_session_deleter {
+  void operator()(SSL_SESSION* session) const {
+    SSL_SESSION_free(session);
+  }
+};
+
+
 typedef std::pair<std::string, uint16_t> HostPortPair;
 class EvConnection;
 
@@ -59,12 +67,17 @@ class ConnectionPool {
   };
 
   ConnectionPool(libevent::Base* base);
+  ConnectionPool(libevent::Base* base, const UrlFetcher::Options& options);
   ConnectionPool(const ConnectionPool&) = delete;
   ConnectionPool& operator=(const ConnectionPool&) = delete;
 
   std::unique_ptr<Connection> Get(const URL& url);
   void Put(std::unique_ptr<Connection> conn);
 
+  // Opens new connections to the host:port of |url| until there are
+  // |warm_conns_per_host_port| idle ones.
+  void WarmUp(const URL& url);
+
  private:
   typedef std::pair<std::chrono::system_clock::time_point,
                     std::unique_ptr<Connection>> TimestampedConnection;
@@ -73,17 +86,34 @@ class ConnectionPool {
       const std::unique_lock<std::mutex>& lock,
       std::deque<TimestampedConnection>* deque);
 
+  std::unique_ptr<Connection> NewConnection(
+      const std::unique_lock<std::mutex>& lock, const std::string& protocol,
+      HostPortPair key);
+  // Adds |handle| to the idle connections, and makes sure they will
+  // be cleaned up.
+  void AddIdle(const std::unique_lock<std::mutex>& lock,
+               std::unique_ptr<Connection> handle);
+  void Reap();
   void Cleanup();
 
   libevent::Base* const base_;
+  const UrlFetcher::Options options_;
 
   std::mutex lock_;
   // We get and put connections from the back of the deque, and when
   // there are too many, we prune them from the front (LIFO).
   std::map<HostPortPair, std::deque<TimestampedConnection>> conns_;
   bool cleanup_scheduled_;
+  // The TLS session last negotiated with each host:port, to resume on
+  // new connections to it.
+  std::map<HostPortPair, std::unique_ptr<SSL_SESSION, ssl_session_deleter>>
+      ssl_sessions_;
 
   std::unique_ptr<evhtp_ssl_ctx_t, void (*)(evhtp_ssl_ctx_t*)> ssl_ctx_;
+  // Checks on the idle connections every |idle_timeout|, while there
+  // are some.
+  const libevent::Event reap_event_;
+  bool reap_scheduled_;
 };
 
 
@@ -0,0 +1,240 @@
+#include "net/fetch_budget.h"
+
+#include <glog/logging.h>
+#include <algorithm>
+#include <deque>
+#include <utility>
+#include <vector>
+
+using std::chrono::duration;
+using std::chrono::steady_clock;
+using std::deque;
+using std::function;
+using std::lock_guard;
+using std::max;
+using std::min;
+using std::move;
+using std::mutex;
+using std::pair;
+using std::unique_ptr;
+using std::vector;
+using util::Status;
+using util::Task;
+
+namespace cert_trans {
+
+namespace {
+
+
+// Shortest wait for the bandwidth to come back, so that running out
+// does not turn into a busy loop.
+const double kMinRefillWaitSeconds = 0.001;
+
+
+}  // namespace
+
+
+class FetchBudget::Fetcher : public UrlFetcher {
+ public:
+  Fetcher(FetchBudget* budget, UrlFetcher* fetcher)
+      : budget_(CHECK_NOTNULL(budget)), fetcher_(CHECK_NOTNULL(fetcher)) {
+  }
+
+  ~Fetcher() override {
+    budget_->Forget(this);
+  }
+
+  void Fetch(const Request& req, Response* resp, Task* task) override;
+  void FetchStreaming(const Request& req, Response* resp,
+                      const BodyCallback& body_cb, Task* task) override;
+
+  void WarmUp(const URL& url) override {
+    fetcher_->WarmUp(url);
+  }
+
+ private:
+  friend class FetchBudget;
+
+  FetchBudget* const budget_;
+  UrlFetcher* const fetcher_;
+  // The requests waiting for their turn, with their tasks. Guarded by
+  // the |lock_| of |budget_|.
+  deque<pair<Task*, function<void()>>> pending_;
+};
+
+
+void FetchBudget::Fetcher::Fetch(const Request& req, Response* resp,
+                                 Task* task) {
+  FetchBudget* const budget(budget_);
+  UrlFetcher* const fetcher(fetcher_);
+  budget_->Enqueue(this, task, [budget, fetcher, req, resp, task]() {
+    fetcher->Fetch(req, resp, task->AddChild([budget, resp,
+                                              task](Task* child) {
+      budget->Charge(resp->body.size());
+      budget->Done();
+      task->Return(child->status());
+    }));
+  });
+}
+
+
+void FetchBudget::Fetcher::FetchStreaming(const Request& req, Response* resp,
+                                          const BodyCallback& body_cb,
+                                          Task* task) {
+  FetchBudget* const budget(budget_);
+  UrlFetcher* const fetcher(fetcher_);
+  // The body is charged as it arrives, so that a long response slows
+  // down the requests that follow it while it is still coming in.
+  const BodyCallback charging_body_cb(
+      [budget, body_cb](const char* data, size_t size) {
+        budget->Charge(size);
+        return body_cb(data, size);
+      });
+  budget_->Enqueue(this, task,
+                   [budget, fetcher, req, resp, charging_body_cb, task]() {
+                     fetcher->FetchStreaming(
+                         req, resp, charging_body_cb,
+                         task->AddChild([budget, task](Task* child) {
+                           budget->Done();
+                           task->Return(child->status());
+                         }));
+                   });
+}
+
+
+FetchBudget::FetchBudget(libevent::Base* base, int max_concurrent_fetches,
+                         int64_t max_bytes_per_second)
+    : base_(CHECK_NOTNULL(base)),
+      max_concurrent_fetches_(max_concurrent_fetches),
+      max_bytes_per_second_(max_bytes_per_second),
+      task_(base_),
+      num_fetching_(0),
+      bytes_available_(max_bytes_per_second_),
+      last_refill_(steady_clock::now()),
+      refill_pending_(false) {
+  CHECK_GT(max_concurrent_fetches_, 0);
+  CHECK_GE(max_bytes_per_second_, 0);
+}
+
+
+FetchBudget::~FetchBudget() {
+  task_.task()->Return();
+  task_.Wait();
+  CHECK(waiting_.empty());
+  CHECK_EQ(num_fetching_, 0);
+}
+
+
+unique_ptr<UrlFetcher> FetchBudget::NewFetcher(UrlFetcher* fetcher) {
+  return unique_ptr<UrlFetcher>(new Fetcher(this, fetcher));
+}
+
+
+void FetchBudget::Enqueue(Fetcher* fetcher, Task* task,
+                          const function<void()>& start) {
+  {
+    lock_guard<mutex> lock(lock_);
+    if (fetcher->pending_.empty()) {
+      waiting_.push_back(fetcher);
+    }
+    fetcher->pending_.emplace_back(CHECK_NOTNULL(task), start);
+  }
+  StartFetches();
+}
+
+
+void FetchBudget::Charge(int64_t bytes) {
+  if (max_bytes_per_second_ > 0) {
+    lock_guard<mutex> lock(lock_);
+    bytes_available_ -= bytes;
+  }
+}
+
+
+void FetchBudget::Done() {
+  {
+    lock_guard<mutex> lock(lock_);
+    CHECK_GT(num_fetching_, 0);
+    --num_fetching_;
+  }
+  StartFetches();
+}
+
+
+void FetchBudget::StartFetches() {
+  // The requests are started without holding the lock, as they may
+  // complete (and so come back here) right away.
+  vector<function<void()>> starts;
+  {
+    lock_guard<mutex> lock(lock_);
+    while (!waiting_.empty() && CanStartLocked()) {
+      Fetcher* const fetcher(waiting_.front());
+      waiting_.pop_front();
+      starts.emplace_back(move(fetcher->pending_.front().second));
+      fetcher->pending_.pop_front();
+      if (!fetcher->pending_.empty()) {
+        waiting_.push_back(fetcher);
+      }
+      ++num_fetching_;
+    }
+
+    // If it is the bandwidth that ran out, come back when there is
+    // some again.
+    if (!waiting_.empty() && num_fetching_ < max_concurrent_fetches_ &&
+        !refill_pending_) {
+      refill_pending_ = true;
+      base_->Delay(
+          duration<double>(max(kMinRefillWaitSeconds,
+                               -bytes_available_ / max_bytes_per_second_)),
+          task_.task()->AddChild([this](Task* child) {
+            if (!child->status().ok()) {
+              return;
+            }
+            {
+              lock_guard<mutex> lock(lock_);
+              refill_pending_ = false;
+            }
+            StartFetches();
+          }));
+    }
+  }
+
+  for (const auto& start : starts) {
+    start();
+  }
+}
+
+
+void FetchBudget::Forget(Fetcher* fetcher) {
+  deque<pair<Task*, function<void()>>> pending;
+  {
+    lock_guard<mutex> lock(lock_);
+    waiting_.remove(fetcher);
+    pending.swap(fetcher->pending_);
+  }
+  for (const auto& request : pending) {
+    request.first->Return(Status::CANCELLED);
+  }
+}
+
+
+bool FetchBudget::CanStartLocked() {
+  if (num_fetching_ >= max_concurrent_fetches_) {
+    return false;
+  }
+  if (max_bytes_per_second_ == 0) {
+    return true;
+  }
+
+  const steady_clock::time_point now(steady_clock::now());
+  bytes_available_ = min<double>(
+      max_bytes_per_second_,
+      bytes_available_ +
+          duration<double>(now - last_refill_).count() *
+              max_bytes_per_second_);
+  last_refill_ = now;
+  return bytes_available_ > 0;
+}
+
+
+}  // namespace cert_trans
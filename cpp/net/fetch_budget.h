@@ -0,0 +1,87 @@
+#ifndef CERT_TRANS_NET_FETCH_BUDGET_H_
+#define CERT_TRANS_NET_FETCH_BUDGET_H_
+
+#include <stdint.h>
+#include <chrono>
+#include <functional>
+#include <list>
+#include <memory>
+#include <mutex>
+
+#include "net/url_fetcher.h"
+#include "util/libevent_wrapper.h"
+#include "util/sync_task.h"
+
+namespace cert_trans {
+
+
+// A budget of concurrent requests and of bandwidth, shared by the
+// fetchers it hands out (one per mirrored log, for instance), which
+// send their requests through a common UrlFetcher.
+//
+// Requests wait for their turn once the budget is used up, and the
+// fetchers with requests waiting then take turns, one request at a
+// time, so that a log with a large backlog does not hold up the
+// others. The bandwidth is counted in bytes of response bodies, once
+// they are received, and may be exceeded by a burst of up to a
+// second's worth.
+//
+// This class is thread-safe.
+class FetchBudget {
+ public:
+  // Allows up to |max_concurrent_fetches| requests at once, and
+  // |max_bytes_per_second| bytes a second on average, or as many as
+  // asked for if 0. Does not take ownership of |base|.
+  FetchBudget(libevent::Base* base, int max_concurrent_fetches,
+              int64_t max_bytes_per_second);
+  // All the fetchers handed out must have been deleted by then.
+  ~FetchBudget();
+  FetchBudget(const FetchBudget&) = delete;
+  FetchBudget& operator=(const FetchBudget&) = delete;
+
+  // Returns a fetcher sending its requests through |fetcher| within
+  // this budget. Does not take ownership of |fetcher|, which must
+  // outlive the returned fetcher.
+  std::unique_ptr<UrlFetcher> NewFetcher(UrlFetcher* fetcher);
+
+ private:
+  class Fetcher;
+
+  // Queues |start| for when the budget allows a request from
+  // |fetcher|. |task| is the task of the request, which is cancelled
+  // if |fetcher| is deleted before then.
+  void Enqueue(Fetcher* fetcher, util::Task* task,
+               const std::function<void()>& start);
+  // Charges |bytes| received for a request, which may still be in
+  // progress.
+  void Charge(int64_t bytes);
+  // Releases the slot of a request that finished.
+  void Done();
+  // Starts the requests the budget allows, from the fetchers in turn.
+  void StartFetches();
+  // Cancels the requests of |fetcher| still waiting.
+  void Forget(Fetcher* fetcher);
+  // Whether the budget allows another request. Must be called with
+  // |lock_| held.
+  bool CanStartLocked();
+
+  libevent::Base* const base_;
+  const int max_concurrent_fetches_;
+  const int64_t max_bytes_per_second_;
+  util::SyncTask task_;
+
+  std::mutex lock_;
+  int num_fetching_;
+  // Bytes that may still be received without waiting, which goes
+  // negative as requests go over, and back up with time.
+  double bytes_available_;
+  std::chrono::steady_clock::time_point last_refill_;
+  bool refill_pending_;
+  // The fetchers with requests waiting, in the order of their turns.
+  std::list<Fetcher*> waiting_;
+};
+
+
+}  // namespace cert_trans
+
+#endif  // CERT_TRANS_NET_FETCH_BUDGET_H_
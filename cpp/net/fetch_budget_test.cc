@@ -0,0 +1,181 @@
+#include "net/fetch_budget.h"
+
+#include <gmock/gmock.h>
+#include <gtest/gtest.h>
+#include <chrono>
+#include <condition_variable>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include "net/mock_url_fetcher.h"
+#include "util/libevent_wrapper.h"
+#include "util/sync_task.h"
+#include "util/testing.h"
+#include "util/thread_pool.h"
+
+namespace cert_trans {
+namespace {
+
+using std::chrono::duration;
+using std::chrono::steady_clock;
+using std::condition_variable;
+using std::lock_guard;
+using std::make_shared;
+using std::mutex;
+using std::shared_ptr;
+using std::string;
+using std::unique_lock;
+using std::unique_ptr;
+using std::vector;
+using testing::_;
+using testing::Invoke;
+using util::SyncTask;
+using util::Task;
+
+
+class FetchBudgetTest : public ::testing::Test {
+ protected:
+  FetchBudgetTest() : base_(make_shared<libevent::Base>()), pump_(base_) {
+    EXPECT_CALL(fetcher_, Fetch(_, _, _))
+        .WillRepeatedly(Invoke(this, &FetchBudgetTest::Started));
+  }
+
+  void Started(const UrlFetcher::Request& req, UrlFetcher::Response* resp,
+               Task* task) {
+    lock_guard<mutex> lock(lock_);
+    paths_.push_back(req.url.Path());
+    responses_.push_back(resp);
+    tasks_.push_back(task);
+    started_.notify_all();
+  }
+
+  // Waits for |count| requests to have been started in all.
+  void WaitForStarted(size_t count) {
+    unique_lock<mutex> lock(lock_);
+    started_.wait(lock, [this, count]() { return tasks_.size() >= count; });
+  }
+
+  // Completes the |index|th request started, with a body of |size|
+  // bytes.
+  void Complete(size_t index, size_t size = 0) {
+    Task* task;
+    {
+      lock_guard<mutex> lock(lock_);
+      responses_[index]->status_code = 200;
+      responses_[index]->body.assign(size, 'x');
+      task = tasks_[index];
+    }
+    task->Return();
+  }
+
+  vector<string> Paths() {
+    lock_guard<mutex> lock(lock_);
+    return paths_;
+  }
+
+  const shared_ptr<libevent::Base> base_;
+  libevent::EventPumpThread pump_;
+  ThreadPool pool_;
+  MockUrlFetcher fetcher_;
+
+  mutex lock_;
+  condition_variable started_;
+  vector<string> paths_;
+  vector<UrlFetcher::Response*> responses_;
+  vector<Task*> tasks_;
+};
+
+
+TEST_F(FetchBudgetTest, TakesTurns) {
+  FetchBudget budget(base_.get(), 1, 0);
+  const unique_ptr<UrlFetcher> a(budget.NewFetcher(&fetcher_));
+  const unique_ptr<UrlFetcher> b(budget.NewFetcher(&fetcher_));
+
+  vector<unique_ptr<SyncTask>> tasks;
+  vector<unique_ptr<UrlFetcher::Response>> responses;
+  for (const auto& fetch : vector<std::pair<UrlFetcher*, string>>{
+           {a.get(), "/a1"}, {a.get(), "/a2"}, {a.get(), "/a3"},
+           {b.get(), "/b1"}}) {
+    tasks.emplace_back(new SyncTask(&pool_));
+    responses.emplace_back(new UrlFetcher::Response);
+    fetch.first->Fetch(UrlFetcher::Request(
+                           URL("http://example.com" + fetch.second)),
+                       responses.back().get(), tasks.back()->task());
+  }
+
+  // Only one request at a time, and the log with a backlog does not
+  // hold up the other for more than one of its requests.
+  WaitForStarted(1);
+  EXPECT_EQ(vector<string>({"/a1"}), Paths());
+  for (size_t i = 0; i < 4; ++i) {
+    WaitForStarted(i + 1);
+    EXPECT_EQ(i + 1, Paths().size());
+    Complete(i);
+  }
+  for (const auto& task : tasks) {
+    task->Wait();
+    EXPECT_TRUE(task->status().ok());
+  }
+  EXPECT_EQ(vector<string>({"/a1", "/a2", "/b1", "/a3"}), Paths());
+}
+
+
+TEST_F(FetchBudgetTest, LimitsBandwidth) {
+  FetchBudget budget(base_.get(), 2, 10000);
+  const unique_ptr<UrlFetcher> a(budget.NewFetcher(&fetcher_));
+
+  SyncTask task1(&pool_);
+  SyncTask task2(&pool_);
+  UrlFetcher::Response resp1;
+  UrlFetcher::Response resp2;
+  a->Fetch(UrlFetcher::Request(URL("http://example.com/1")), &resp1,
+           task1.task());
+  WaitForStarted(1);
+
+  // Going 5000 bytes over holds up the next request for half a second.
+  Complete(0, 15000);
+  task1.Wait();
+  const steady_clock::time_point start(steady_clock::now());
+  a->Fetch(UrlFetcher::Request(URL("http://example.com/2")), &resp2,
+           task2.task());
+  WaitForStarted(2);
+  EXPECT_LE(0.4, duration<double>(steady_clock::now() - start).count());
+  Complete(1);
+  task2.Wait();
+}
+
+
+TEST_F(FetchBudgetTest, CancelsWaitingRequestsOfDeletedFetcher) {
+  FetchBudget budget(base_.get(), 1, 0);
+  unique_ptr<UrlFetcher> a(budget.NewFetcher(&fetcher_));
+
+  SyncTask task1(&pool_);
+  SyncTask task2(&pool_);
+  UrlFetcher::Response resp1;
+  UrlFetcher::Response resp2;
+  a->Fetch(UrlFetcher::Request(URL("http://example.com/1")), &resp1,
+           task1.task());
+  a->Fetch(UrlFetcher::Request(URL("http://example.com/2")), &resp2,
+           task2.task());
+  WaitForStarted(1);
+
+  a.reset();
+  task2.Wait();
+  EXPECT_EQ(util::Status::CANCELLED, task2.status());
+
+  Complete(0);
+  task1.Wait();
+  EXPECT_TRUE(task1.status().ok());
+}
+
+
+}  // namespace
+}  // namespace cert_trans
+
+
+int main(int argc, char** argv) {
+  cert_trans::test::InitTesting(argv[0], &argc, &argv, true);
+  return RUN_ALL_TESTS();
+}
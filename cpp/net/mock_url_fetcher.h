@@ -2,8 +2,11 @@
 #define CERT_TRANS_NET_MOCK_URL_FETCHER_H_
 
 #include <gmock/gmock.h>
+#include <string>
 
 #include "net/url_fetcher.h"
+#include "util/status.h"
+#include "util/task.h"
 
 namespace cert_trans {
 
@@ -12,6 +15,28 @@ class MockUrlFetcher : public UrlFetcher {
  public:
   MOCK_METHOD3(Fetch,
                void(const Request& req, Response* resp, util::Task* task));
+  MOCK_METHOD1(WarmUp, void(const URL& url));
+
+  // Streaming fetches go through Fetch(), with the whole body handed
+  // to |body_cb| at once, so that tests only have to mock the one.
+  void FetchStreaming(const Request& req, Response* resp,
+                      const BodyCallback& body_cb,
+                      util::Task* task) override {
+    Fetch(req, resp, task->AddChild([resp, body_cb, task](util::Task* child) {
+      if (!child->status().ok()) {
+        task->Return(child->status());
+        return;
+      }
+      std::string body;
+      body.swap(resp->body);
+      if (!body.empty() && !body_cb(body.data(), body.size())) {
+        task->Return(util::Status(util::error::ABORTED,
+                                  "body callback aborted the fetch"));
+        return;
+      }
+      task->Return();
+    }));
+  }
 };
 
 
@@ -3,6 +3,7 @@
 #include <event2/buffer.h>
 #include <event2/keyvalq_struct.h>
 #include <evhtp.h>
+#include <gflags/gflags.h>
 #include <glog/logging.h>
 #include <htparse.h>
 
@@ -22,16 +23,32 @@ using util::Status;
 using util::Task;
 using util::TaskHold;
 
+DECLARE_int32(connection_pool_max_unused_age_seconds);
+DECLARE_int32(connection_pool_warm_conns_per_host_port);
+DECLARE_int32(url_fetcher_max_conn_per_host_port);
+
 namespace cert_trans {
 
 
+UrlFetcher::Options::Options()
+    : max_idle_conns_per_host_port(FLAGS_url_fetcher_max_conn_per_host_port),
+      idle_timeout(FLAGS_connection_pool_max_unused_age_seconds),
+      warm_conns_per_host_port(
+          FLAGS_connection_pool_warm_conns_per_host_port) {
+}
+
+
 struct UrlFetcher::Impl {
-  Impl(libevent::Base* base, ThreadPool* thread_pool)
+  Impl(libevent::Base* base, ThreadPool* thread_pool,
+       const UrlFetcher::Options& options)
       : base_(CHECK_NOTNULL(base)),
         thread_pool_(CHECK_NOTNULL(thread_pool)),
-        pool_(base_) {
+        pool_(base_, options) {
   }
 
+  void Start(const UrlFetcher::Request& req, UrlFetcher::Response* resp,
+             const UrlFetcher::BodyCallback& body_cb, util::Task* task);
+
   libevent::Base* const base_;
   ThreadPool* const thread_pool_;
   internal::ConnectionPool pool_;
@@ -60,10 +77,12 @@ htp_method VerbToCmdType(UrlFetcher::Verb verb) {
 }
 
 
-struct State {
+struct State : public util::Pooled {
+  // If |body_cb| is set, the response body is handed to it as it
+  // arrives.
   State(libevent::Base* base, ConnectionPool* pool,
         const UrlFetcher::Request& request, UrlFetcher::Response* response,
-        Task* task);
+        const UrlFetcher::BodyCallback& body_cb, Task* task);
 
   ~State() {
     CHECK(!conn_) << "request state object still had a connection at cleanup?";
@@ -74,15 +93,21 @@ struct State {
   // The following methods must only be called on the libevent
   // dispatch thread.
   void RunRequest();
+  void ReadHeaders(evhtp_request_t* req);
+  void ReadBody(evbuffer* buf);
   void RequestDone(evhtp_request_t* req);
 
   libevent::Base* const base_;
   ConnectionPool* const pool_;
   const UrlFetcher::Request request_;
   UrlFetcher::Response* const response_;
+  const UrlFetcher::BodyCallback body_cb_;
   Task* const task_;
 
   unique_ptr<ConnectionPool::Connection> conn_;
+  // Set once |body_cb_| returned false, the rest of the body is then
+  // discarded.
+  bool aborted_;
 };
 
 
@@ -91,6 +116,19 @@ void RequestCallback(evhtp_request_t* req, void* userdata) {
 }
 
 
+evhtp_res ResponseHeadersHook(evhtp_request_t* req, evhtp_headers_t*,
+                              void* userdata) {
+  static_cast<State*>(CHECK_NOTNULL(userdata))->ReadHeaders(req);
+  return EVHTP_RES_OK;
+}
+
+
+evhtp_res ResponseBodyHook(evhtp_request_t*, evbuffer* buf, void* userdata) {
+  static_cast<State*>(CHECK_NOTNULL(userdata))->ReadBody(buf);
+  return EVHTP_RES_OK;
+}
+
+
 UrlFetcher::Request NormaliseRequest(UrlFetcher::Request req) {
   if (req.url.Path().empty()) {
     req.url.SetPath("/");
@@ -106,12 +144,15 @@ UrlFetcher::Request NormaliseRequest(UrlFetcher::Request req) {
 
 State::State(libevent::Base* base, ConnectionPool* pool,
              const UrlFetcher::Request& request,
-             UrlFetcher::Response* response, Task* task)
+             UrlFetcher::Response* response,
+             const UrlFetcher::BodyCallback& body_cb, Task* task)
     : base_(CHECK_NOTNULL(base)),
       pool_(CHECK_NOTNULL(pool)),
       request_(NormaliseRequest(request)),
       response_(CHECK_NOTNULL(response)),
-      task_(CHECK_NOTNULL(task)) {
+      body_cb_(body_cb),
+      task_(CHECK_NOTNULL(task)),
+      aborted_(false) {
   if (request_.url.Protocol() != "http" &&
       request_.url.Protocol() != "https") {
     VLOG(1) << "unsupported protocol: " << request_.url.Protocol();
@@ -125,6 +166,12 @@ State::State(libevent::Base* base, ConnectionPool* pool,
 
 void State::MakeRequest() {
   CHECK(!libevent::Base::OnEventThread());
+  // The thread pool might have been busy for a while.
+  if (task_->DeadlineExceeded()) {
+    task_->Return(Status(util::error::DEADLINE_EXCEEDED,
+                         "UrlFetcher: deadline exceeded"));
+    return;
+  }
   conn_ = pool_->Get(request_.url);
   base_->Add(bind(&State::RunRequest, this));
 }
@@ -147,6 +194,15 @@ void State::RunRequest() {
                                               header.second.c_str(), 1, 1));
   }
 
+  if (body_cb_) {
+    // Take the body as it is read, instead of letting evhtp buffer all
+    // of it.
+    evhtp_set_hook(&http_req->hooks, evhtp_hook_on_headers,
+                   reinterpret_cast<evhtp_hook>(ResponseHeadersHook), this);
+    evhtp_set_hook(&http_req->hooks, evhtp_hook_on_read,
+                   reinterpret_cast<evhtp_hook>(ResponseBodyHook), this);
+  }
+
   if (!conn_->connection() || conn_->GetErrored()) {
     conn_.reset();
     task_->Return(Status(util::error::UNAVAILABLE, "connection failed."));
@@ -191,6 +247,33 @@ struct evhtp_request_deleter {
 };
 
 
+void State::ReadHeaders(evhtp_request_t* req) {
+  CHECK(libevent::Base::OnEventThread());
+  // Use evhtp_request_status, see RequestDone().
+  response_->status_code = evhtp_request_status(req);
+  response_->headers.clear();
+  for (evhtp_kv_s* ptr = req->headers_in->tqh_first; ptr;
+       ptr = ptr->next.tqe_next) {
+    response_->headers.insert(make_pair(ptr->key, ptr->val));
+  }
+}
+
+
+void State::ReadBody(evbuffer* buf) {
+  CHECK(libevent::Base::OnEventThread());
+  const size_t length(evbuffer_get_length(buf));
+  if (!aborted_ && length > 0) {
+    aborted_ = !body_cb_(
+        reinterpret_cast<const char*>(evbuffer_pullup(buf, length)), length);
+    VLOG_IF(1, aborted_) << "body callback aborted fetch of "
+                         << request_.url.PathQuery();
+  }
+  // Whatever is left in |buf| would end up in the request's
+  // buffer_in.
+  evbuffer_drain(buf, length);
+}
+
+
 void State::RequestDone(evhtp_request_t* req) {
   CHECK(libevent::Base::OnEventThread());
   CHECK(conn_);
@@ -235,12 +318,16 @@ void State::RequestDone(evhtp_request_t* req) {
     return;
   }
 
-  response_->headers.clear();
-  for (evhtp_kv_s* ptr = req->headers_in->tqh_first; ptr;
-       ptr = ptr->next.tqe_next) {
-    response_->headers.insert(make_pair(ptr->key, ptr->val));
+  if (body_cb_) {
+    // The status and headers were set by ReadHeaders() already.
+    VLOG(2) << *response_;
+    task_->Return(aborted_ ? Status(util::error::ABORTED,
+                                    "body callback aborted the fetch")
+                           : Status::OK);
+    return;
   }
 
+  ReadHeaders(req);
   const size_t body_length(evbuffer_get_length(req->buffer_in));
   string body(reinterpret_cast<const char*>(
                   evbuffer_pullup(req->buffer_in, body_length)),
@@ -262,7 +349,14 @@ UrlFetcher::UrlFetcher() {
 
 
 UrlFetcher::UrlFetcher(libevent::Base* base, ThreadPool* thread_pool)
-    : impl_(new Impl(CHECK_NOTNULL(base), CHECK_NOTNULL(thread_pool))) {
+    : UrlFetcher(base, thread_pool, Options()) {
+}
+
+
+UrlFetcher::UrlFetcher(libevent::Base* base, ThreadPool* thread_pool,
+                       const Options& options)
+    : impl_(new Impl(CHECK_NOTNULL(base), CHECK_NOTNULL(thread_pool),
+                     options)) {
 }
 
 
@@ -272,16 +366,47 @@ UrlFetcher::~UrlFetcher() {
 
 
 void UrlFetcher::Fetch(const Request& req, Response* resp, Task* task) {
+  impl_->Start(req, resp, BodyCallback(), task);
+}
+
+
+void UrlFetcher::FetchStreaming(const Request& req, Response* resp,
+                                const BodyCallback& body_cb, Task* task) {
+  CHECK(body_cb);
+  impl_->Start(req, resp, body_cb, task);
+}
+
+
+void UrlFetcher::Impl::Start(const Request& req, Response* resp,
+                             const BodyCallback& body_cb, Task* task) {
+  if (task->DeadlineExceeded()) {
+    task->Return(Status(util::error::DEADLINE_EXCEEDED,
+                        "UrlFetcher: deadline exceeded"));
+    return;
+  }
+
   TaskHold hold(task);
 
-  State* const state(new State(impl_->base_, &impl_->pool_, req, resp, task));
+  State* const state(new State(base_, &pool_, req, resp, body_cb, task));
   task->DeleteWhenDone(state);
 
   // Run State::MakeRequest() on the task's executor because it may
   // block doing DNS resolution etc.
   // TODO(alcutter): this can go back to being put straight on the event Base
   // once evhtp supports creating SSL connections to a DNS name.
-  impl_->thread_pool_->Add(bind(&State::MakeRequest, state));
+  thread_pool_->Add(bind(&State::MakeRequest, state));
+}
+
+
+void UrlFetcher::WarmUp(const URL& url) {
+  if (url.Protocol() != "http" && url.Protocol() != "https") {
+    VLOG(1) << "not warming up unsupported protocol: " << url.Protocol();
+    return;
+  }
+
+  // Like State::MakeRequest(), this may block doing DNS resolution.
+  impl_->thread_pool_->Add(
+      bind(&internal::ConnectionPool::WarmUp, &impl_->pool_, url));
 }
 
 
@@ -1,7 +1,9 @@
 #ifndef CERT_TRANS_NET_URL_FETCHER_H_
 #define CERT_TRANS_NET_URL_FETCHER_H_
 
+#include <stddef.h>
 #include <chrono>
+#include <functional>
 #include <map>
 #include <memory>
 #include <ostream>
@@ -9,6 +11,7 @@
 
 #include "net/url.h"
 #include "util/compare.h"
+#include "util/pool_allocator.h"
 #include "util/task.h"
 
 namespace cert_trans {
@@ -44,7 +47,9 @@ class UrlFetcher {
     std::string body;
   };
 
-  struct Response {
+  // Allocated from the per-thread pools (see util/pool_allocator.h),
+  // as there is one per request.
+  struct Response : public util::Pooled {
     Response() : status_code(0) {
     }
 
@@ -53,7 +58,32 @@ class UrlFetcher {
     std::string body;
   };
 
+  // Receives the body of a response a piece at a time, as it arrives.
+  // Returning false aborts the fetch. It is called on the libevent
+  // dispatch thread, and so must not block.
+  typedef std::function<bool(const char* data, size_t size)> BodyCallback;
+
+  // How connections are kept around for reuse, for each host:port
+  // the fetcher talks to. Fetchers for different kinds of traffic
+  // (peers in the cluster, etcd, ...) can be given different options.
+  struct Options {
+    // Uses --url_fetcher_max_conn_per_host_port,
+    // --connection_pool_max_unused_age_seconds and
+    // --connection_pool_warm_conns_per_host_port.
+    Options();
+
+    // Idle connections above this number are closed, oldest first.
+    int max_idle_conns_per_host_port;
+    // Idle connections unused for this long are closed, unless that
+    // would leave fewer than |warm_conns_per_host_port| of them.
+    std::chrono::seconds idle_timeout;
+    // The number of connections WarmUp() opens ahead of requests.
+    int warm_conns_per_host_port;
+  };
+
   UrlFetcher(libevent::Base* base, ThreadPool* thread_pool);
+  UrlFetcher(libevent::Base* base, ThreadPool* thread_pool,
+             const Options& options);
   virtual ~UrlFetcher();
   UrlFetcher(const UrlFetcher&) = delete;
   UrlFetcher& operator=(const UrlFetcher&) = delete;
@@ -61,9 +91,24 @@ class UrlFetcher {
   // If the status on the task is not OK, the response will be in an
   // undefined state. If it is OK, it only means that the transaction
   // with the remote server went correctly, you should still check
-  // Response::status_code.
+  // Response::status_code. If the deadline of the task (see
+  // util/task.h) passes before the request is sent, it is not sent,
+  // and the task returns DEADLINE_EXCEEDED.
   virtual void Fetch(const Request& req, Response* resp, util::Task* task);
 
+  // As Fetch(), but the body is handed to |body_cb| as it arrives,
+  // rather than held in |resp->body|, which is left empty. The status
+  // code and headers of |resp| are set before the first call to
+  // |body_cb|. If it aborts the fetch, the task returns ABORTED.
+  virtual void FetchStreaming(const Request& req, Response* resp,
+                              const BodyCallback& body_cb, util::Task* task);
+
+  // Opens connections to the host:port of |url|, so that the first
+  // requests to it do not have to wait for the connection (and TLS
+  // handshake) to be established. Does nothing if there already are
+  // enough idle connections to it.
+  virtual void WarmUp(const URL& url);
+
  protected:
   UrlFetcher();
 
@@ -134,6 +134,36 @@ TEST_F(UrlFetcherTest, TestCertMatchesHost) {
 }
 
 
+TEST_F(UrlFetcherTest, TestStreamsBody) {
+  UrlFetcher::Request req(
+      URL("https://localhost:" + to_string(kLocalHostPort)));
+  UrlFetcher::Response streamed_resp;
+  string streamed_body;
+  {
+    SyncTask task(&pool_);
+    fetcher_->FetchStreaming(req, &streamed_resp,
+                             [&streamed_body](const char* data, size_t size) {
+                               streamed_body.append(data, size);
+                               return true;
+                             },
+                             task.task());
+    task.Wait();
+    EXPECT_OK(task.status());
+  }
+  EXPECT_EQ(200, streamed_resp.status_code);
+  EXPECT_TRUE(streamed_resp.body.empty());
+  // The status page of "openssl s_server -www".
+  EXPECT_NE(string::npos, streamed_body.find("<HTML>"));
+
+  SyncTask task(&pool_);
+  fetcher_->FetchStreaming(req, &streamed_resp,
+                           [](const char*, size_t) { return false; },
+                           task.task());
+  task.Wait();
+  EXPECT_THAT(task.status(), StatusIs(util::error::ABORTED));
+}
+
+
 TEST_F(UrlFetcherTest, TestCertDoesNotMatchHost) {
   UrlFetcher::Request req(
       URL("https://localhost:" + to_string(kNonLocalHostPort)));
@@ -0,0 +1,103 @@
+/* -*- indent-tabs-mode: nil -*- */
+#include "proto/binary_entries.h"
+
+#include <glog/logging.h>
+#include <utility>
+
+#include "proto/serializer.h"
+
+using cert_trans::serialization::DeserializeResult;
+using cert_trans::serialization::SerializeResult;
+using cert_trans::serialization::WriteVarBytes;
+using std::move;
+using std::string;
+using std::vector;
+
+namespace cert_trans {
+namespace {
+
+
+const size_t kMaxLeafInputLength = 0xffffffff;
+const size_t kMaxExtraDataLength = 0xffffffff;
+
+
+// Reads one record from |deserializer|, which fails if there are not
+// enough bytes for the whole of it.
+bool ReadBinaryEntry(TLSDeserializer* deserializer, BinaryEntry* entry) {
+  return deserializer->ReadVarBytes(kMaxLeafInputLength,
+                                    &entry->leaf_input) &&
+         deserializer->ReadVarBytes(kMaxExtraDataLength,
+                                    &entry->extra_data) &&
+         deserializer->ReadVarBytes(Serializer::kMaxSerializedSCTLength,
+                                    &entry->sct);
+}
+
+
+}  // namespace
+
+
+SerializeResult WriteBinaryEntry(const string& leaf_input,
+                                 const string& extra_data, const string& sct,
+                                 string* output) {
+  CHECK_NOTNULL(output);
+  if (leaf_input.empty()) {
+    return SerializeResult::EMPTY_ELEM_IN_LIST;
+  }
+  if (leaf_input.size() > kMaxLeafInputLength ||
+      extra_data.size() > kMaxExtraDataLength ||
+      sct.size() > Serializer::kMaxSerializedSCTLength) {
+    return SerializeResult::LIST_ELEM_TOO_LONG;
+  }
+
+  WriteVarBytes(leaf_input, kMaxLeafInputLength, output);
+  WriteVarBytes(extra_data, kMaxExtraDataLength, output);
+  WriteVarBytes(sct, Serializer::kMaxSerializedSCTLength, output);
+  return SerializeResult::OK;
+}
+
+
+DeserializeResult ReadBinaryEntries(const string& input,
+                                    vector<BinaryEntry>* entries) {
+  CHECK_NOTNULL(entries);
+  TLSDeserializer deserializer(input);
+  while (!deserializer.ReachedEnd()) {
+    BinaryEntry entry;
+    if (!ReadBinaryEntry(&deserializer, &entry)) {
+      return DeserializeResult::INPUT_TOO_SHORT;
+    }
+    if (entry.leaf_input.empty()) {
+      return DeserializeResult::EMPTY_ELEM_IN_LIST;
+    }
+    entries->emplace_back(move(entry));
+  }
+
+  return DeserializeResult::OK;
+}
+
+
+DeserializeResult BinaryEntryReader::Read(const char* data, size_t size,
+                                          vector<BinaryEntry>* entries) {
+  CHECK_NOTNULL(entries);
+  partial_.append(data, size);
+
+  TLSDeserializer deserializer(partial_);
+  size_t remaining(deserializer.BytesRemaining());
+  while (!deserializer.ReachedEnd()) {
+    BinaryEntry entry;
+    if (!ReadBinaryEntry(&deserializer, &entry)) {
+      // The rest of this record is still to come.
+      break;
+    }
+    if (entry.leaf_input.empty()) {
+      return DeserializeResult::EMPTY_ELEM_IN_LIST;
+    }
+    entries->emplace_back(move(entry));
+    remaining = deserializer.BytesRemaining();
+  }
+  partial_.erase(0, partial_.size() - remaining);
+
+  return DeserializeResult::OK;
+}
+
+
+}  // namespace cert_trans
@@ -0,0 +1,71 @@
+/* -*- mode: c++; indent-tabs-mode: nil -*- */
+#ifndef CERT_TRANS_PROTO_BINARY_ENTRIES_H_
+#define CERT_TRANS_PROTO_BINARY_ENTRIES_H_
+
+#include <string>
+#include <vector>
+
+#include "proto/tls_encoding.h"
+
+namespace cert_trans {
+
+
+// The body of a binary get-entries response, which this log
+// implementation serves to its peers and mirrors as a more compact
+// alternative to the base64 in JSON of the standard get-entries.
+// It is a sequence of records, one per entry, of the form:
+//
+//   struct {
+//     opaque leaf_input<1..2^32-1>;
+//     opaque extra_data<0..2^32-1>;
+//     opaque sct<0..2^16-1>;
+//   } BinaryEntry;
+//
+// where |leaf_input| and |extra_data| are as in get-entries, and |sct|
+// is the serialized SCT, or empty if it was not requested.
+struct BinaryEntry {
+  std::string leaf_input;
+  std::string extra_data;
+  std::string sct;
+};
+
+
+// Appends a record to |output|.
+serialization::SerializeResult WriteBinaryEntry(const std::string& leaf_input,
+                                                const std::string& extra_data,
+                                                const std::string& sct,
+                                                std::string* output);
+
+// Reads all the records in |input|, appending them to |entries|. On
+// error, some of them may have been appended already.
+serialization::DeserializeResult ReadBinaryEntries(
+    const std::string& input, std::vector<BinaryEntry>* entries);
+
+
+// Reads records as the bytes of a response arrive, holding on only to
+// those of the record not received in full yet.
+class BinaryEntryReader {
+ public:
+  BinaryEntryReader() = default;
+  BinaryEntryReader(const BinaryEntryReader&) = delete;
+  BinaryEntryReader& operator=(const BinaryEntryReader&) = delete;
+
+  // Appends the records completed by the next |size| bytes at |data|
+  // to |entries|.
+  serialization::DeserializeResult Read(const char* data, size_t size,
+                                        std::vector<BinaryEntry>* entries);
+
+  // Whether the input so far ends with a complete record (otherwise,
+  // it was truncated).
+  bool AtRecordEnd() const {
+    return partial_.empty();
+  }
+
+ private:
+  std::string partial_;
+};
+
+
+}  // namespace cert_trans
+
+#endif  // CERT_TRANS_PROTO_BINARY_ENTRIES_H_
@@ -3,13 +3,19 @@
 
 #include <glog/logging.h>
 #include <math.h>
+#include <functional>
 #include <string>
 
 #include "proto/ct.pb.h"
 #include "proto/serializer.h"
 
+using cert_trans::serialization::BufferWriter;
+using cert_trans::serialization::FixedBytesField;
+using cert_trans::serialization::SerializeExactly;
 using cert_trans::serialization::SerializeResult;
 using cert_trans::serialization::DeserializeResult;
+using cert_trans::serialization::UintField;
+using cert_trans::serialization::VarBytesField;
 using cert_trans::serialization::WriteFixedBytes;
 using cert_trans::serialization::WriteList;
 using cert_trans::serialization::WriteUint;
@@ -25,12 +31,25 @@ using ct::SthExtension;
 using ct::SctExtension;
 using ct::X509ChainEntry;
 using google::protobuf::RepeatedPtrField;
+using std::bind;
+using std::cref;
+using std::placeholders::_1;
 using std::string;
 
 
 const size_t kMaxCertificateLength = (1 << 24) - 1;
 const size_t kMaxCertificateChainLength = (1 << 24) - 1;
 
+// The fields of a V1 MerkleTreeLeaf, which are written and read the
+// most.
+typedef UintField<Serializer::kVersionLengthInBytes> VersionField;
+typedef UintField<Serializer::kMerkleLeafTypeLengthInBytes> LeafTypeField;
+typedef UintField<Serializer::kTimestampLengthInBytes> TimestampField;
+typedef UintField<Serializer::kLogEntryTypeLengthInBytes> EntryTypeField;
+typedef FixedBytesField<Serializer::kKeyHashLengthInBytes> KeyHashField;
+typedef VarBytesField<kMaxCertificateLength> CertificateField;
+typedef VarBytesField<Serializer::kMaxExtensionsLength> ExtensionsField;
+
 
 SerializeResult CheckCertificateFormat(const string& cert) {
   if (cert.empty()) {
@@ -68,10 +87,10 @@ string CertV1LeafData(const LogEntry& entry) {
 }
 
 
-SerializeResult SerializeV1CertSCTSignatureInput(uint64_t timestamp,
-                                                 const string& certificate,
-                                                 const string& extensions,
-                                                 string* result) {
+SerializeResult WriteV1CertSCTSignatureInput(uint64_t timestamp,
+                                             const string& certificate,
+                                             const string& extensions,
+                                             BufferWriter* result) {
   SerializeResult res = CheckCertificateFormat(certificate);
   if (res != SerializeResult::OK) {
     return res;
@@ -91,9 +110,21 @@ SerializeResult SerializeV1CertSCTSignatureInput(uint64_t timestamp,
 }
 
 
-SerializeResult SerializeV1PrecertSCTSignatureInput(
+SerializeResult SerializeV1CertSCTSignatureInput(uint64_t timestamp,
+                                                 const string& certificate,
+                                                 const string& extensions,
+                                                 string* result) {
+  return SerializeExactly(
+      bind(WriteV1CertSCTSignatureInput,
+           timestamp, cref(certificate), cref(extensions), _1),
+      result);
+}
+
+
+SerializeResult WriteV1PrecertSCTSignatureInput(
     uint64_t timestamp, const string& issuer_key_hash,
-    const string& tbs_certificate, const string& extensions, string* result) {
+    const string& tbs_certificate, const string& extensions,
+    BufferWriter* result) {
   SerializeResult res = CheckCertificateFormat(tbs_certificate);
   if (res != SerializeResult::OK) {
     return res;
@@ -106,7 +137,6 @@ SerializeResult SerializeV1PrecertSCTSignatureInput(
   if (res != SerializeResult::OK) {
     return res;
   }
-  result->clear();
   WriteUint(ct::V1, Serializer::kVersionLengthInBytes, result);
   WriteUint(ct::CERTIFICATE_TIMESTAMP, Serializer::kSignatureTypeLengthInBytes,
             result);
@@ -119,20 +149,30 @@ SerializeResult SerializeV1PrecertSCTSignatureInput(
 }
 
 
-SerializeResult SerializeV1SCTSignatureInput(
+SerializeResult SerializeV1PrecertSCTSignatureInput(
+    uint64_t timestamp, const string& issuer_key_hash,
+    const string& tbs_certificate, const string& extensions, string* result) {
+  return SerializeExactly(
+      bind(WriteV1PrecertSCTSignatureInput,
+           timestamp, cref(issuer_key_hash), cref(tbs_certificate),
+           cref(extensions), _1),
+      result);
+}
+
+
+SerializeResult WriteV1SCTSignatureInput(
     const SignedCertificateTimestamp& sct, const LogEntry& entry,
-    string* result) {
+    BufferWriter* result) {
   if (sct.version() != ct::V1) {
     return SerializeResult::UNSUPPORTED_VERSION;
   }
-  result->clear();
   switch (entry.type()) {
     case ct::X509_ENTRY:
-      return SerializeV1CertSCTSignatureInput(
+      return WriteV1CertSCTSignatureInput(
           sct.timestamp(), entry.x509_entry().leaf_certificate(),
           sct.extensions(), result);
     case ct::PRECERT_ENTRY:
-      return SerializeV1PrecertSCTSignatureInput(
+      return WriteV1PrecertSCTSignatureInput(
           sct.timestamp(), entry.precert_entry().pre_cert().issuer_key_hash(),
           entry.precert_entry().pre_cert().tbs_certificate(), sct.extensions(),
           result);
@@ -142,10 +182,10 @@ SerializeResult SerializeV1SCTSignatureInput(
 }
 
 
-SerializeResult SerializeV1CertSCTMerkleTreeLeaf(uint64_t timestamp,
-                                                 const string& certificate,
-                                                 const string& extensions,
-                                                 string* result) {
+SerializeResult WriteV1CertSCTMerkleTreeLeaf(uint64_t timestamp,
+                                             const string& certificate,
+                                             const string& extensions,
+                                             BufferWriter* result) {
   SerializeResult res = CheckCertificateFormat(certificate);
   if (res != SerializeResult::OK) {
     return res;
@@ -154,21 +194,31 @@ SerializeResult SerializeV1CertSCTMerkleTreeLeaf(uint64_t timestamp,
   if (res != SerializeResult::OK) {
     return res;
   }
-  result->clear();
-  WriteUint(ct::V1, Serializer::kVersionLengthInBytes, result);
-  WriteUint(ct::TIMESTAMPED_ENTRY, Serializer::kMerkleLeafTypeLengthInBytes,
-            result);
-  WriteUint(timestamp, Serializer::kTimestampLengthInBytes, result);
-  WriteUint(ct::X509_ENTRY, Serializer::kLogEntryTypeLengthInBytes, result);
-  WriteVarBytes(certificate, kMaxCertificateLength, result);
-  WriteVarBytes(extensions, Serializer::kMaxExtensionsLength, result);
+  VersionField::Write(ct::V1, result);
+  LeafTypeField::Write(ct::TIMESTAMPED_ENTRY, result);
+  TimestampField::Write(timestamp, result);
+  EntryTypeField::Write(ct::X509_ENTRY, result);
+  CertificateField::Write(certificate, result);
+  ExtensionsField::Write(extensions, result);
   return SerializeResult::OK;
 }
 
 
-SerializeResult SerializeV1PrecertSCTMerkleTreeLeaf(
+SerializeResult SerializeV1CertSCTMerkleTreeLeaf(uint64_t timestamp,
+                                                 const string& certificate,
+                                                 const string& extensions,
+                                                 string* result) {
+  return SerializeExactly(
+      bind(WriteV1CertSCTMerkleTreeLeaf,
+           timestamp, cref(certificate), cref(extensions), _1),
+      result);
+}
+
+
+SerializeResult WriteV1PrecertSCTMerkleTreeLeaf(
     uint64_t timestamp, const string& issuer_key_hash,
-    const string& tbs_certificate, const string& extensions, string* result) {
+    const string& tbs_certificate, const string& extensions,
+    BufferWriter* result) {
   SerializeResult res = CheckCertificateFormat(tbs_certificate);
   if (res != SerializeResult::OK) {
     return res;
@@ -181,33 +231,41 @@ SerializeResult SerializeV1PrecertSCTMerkleTreeLeaf(
   if (res != SerializeResult::OK) {
     return res;
   }
-  result->clear();
-  WriteUint(ct::V1, Serializer::kVersionLengthInBytes, result);
-  WriteUint(ct::TIMESTAMPED_ENTRY, Serializer::kMerkleLeafTypeLengthInBytes,
-            result);
-  WriteUint(timestamp, Serializer::kTimestampLengthInBytes, result);
-  WriteUint(ct::PRECERT_ENTRY, Serializer::kLogEntryTypeLengthInBytes, result);
-  WriteFixedBytes(issuer_key_hash, result);
-  WriteVarBytes(tbs_certificate, kMaxCertificateLength, result);
-  WriteVarBytes(extensions, Serializer::kMaxExtensionsLength, result);
+  VersionField::Write(ct::V1, result);
+  LeafTypeField::Write(ct::TIMESTAMPED_ENTRY, result);
+  TimestampField::Write(timestamp, result);
+  EntryTypeField::Write(ct::PRECERT_ENTRY, result);
+  KeyHashField::Write(issuer_key_hash, result);
+  CertificateField::Write(tbs_certificate, result);
+  ExtensionsField::Write(extensions, result);
   return SerializeResult::OK;
 }
 
 
-SerializeResult SerializeV1SCTMerkleTreeLeaf(
+SerializeResult SerializeV1PrecertSCTMerkleTreeLeaf(
+    uint64_t timestamp, const string& issuer_key_hash,
+    const string& tbs_certificate, const string& extensions, string* result) {
+  return SerializeExactly(
+      bind(WriteV1PrecertSCTMerkleTreeLeaf,
+           timestamp, cref(issuer_key_hash), cref(tbs_certificate),
+           cref(extensions), _1),
+      result);
+}
+
+
+SerializeResult WriteV1SCTMerkleTreeLeaf(
     const ct::SignedCertificateTimestamp& sct, const ct::LogEntry& entry,
-    string* result) {
+    BufferWriter* result) {
   if (sct.version() != ct::V1) {
     return SerializeResult::UNSUPPORTED_VERSION;
   }
-  result->clear();
   switch (entry.type()) {
     case ct::X509_ENTRY:
-      return SerializeV1CertSCTMerkleTreeLeaf(
+      return WriteV1CertSCTMerkleTreeLeaf(
           sct.timestamp(), entry.x509_entry().leaf_certificate(),
           sct.extensions(), result);
     case ct::PRECERT_ENTRY:
-      return SerializeV1PrecertSCTMerkleTreeLeaf(
+      return WriteV1PrecertSCTMerkleTreeLeaf(
           sct.timestamp(), entry.precert_entry().pre_cert().issuer_key_hash(),
           entry.precert_entry().pre_cert().tbs_certificate(), sct.extensions(),
           result);
@@ -224,7 +282,7 @@ DeserializeResult DeserializeV1SCTMerkleTreeLeaf(TLSDeserializer* des,
   CHECK(leaf != nullptr);
 
   unsigned int version;
-  if (!des->ReadUint(Serializer::kVersionLengthInBytes, &version)) {
+  if (!VersionField::Read(des, &version)) {
     return DeserializeResult::INPUT_TOO_SHORT;
   }
 
@@ -234,7 +292,7 @@ DeserializeResult DeserializeV1SCTMerkleTreeLeaf(TLSDeserializer* des,
   leaf->set_version(ct::V1);
 
   unsigned int type;
-  if (!des->ReadUint(Serializer::kMerkleLeafTypeLengthInBytes, &type)) {
+  if (!LeafTypeField::Read(des, &type)) {
     return DeserializeResult::INPUT_TOO_SHORT;
   }
   if (type != ct::TIMESTAMPED_ENTRY) {
@@ -245,13 +303,13 @@ DeserializeResult DeserializeV1SCTMerkleTreeLeaf(TLSDeserializer* des,
   ct::TimestampedEntry* const entry = leaf->mutable_timestamped_entry();
 
   uint64_t timestamp;
-  if (!des->ReadUint(Serializer::kTimestampLengthInBytes, &timestamp)) {
+  if (!TimestampField::Read(des, &timestamp)) {
     return DeserializeResult::INPUT_TOO_SHORT;
   }
   entry->set_timestamp(timestamp);
 
   unsigned int entry_type;
-  if (!des->ReadUint(Serializer::kLogEntryTypeLengthInBytes, &entry_type)) {
+  if (!EntryTypeField::Read(des, &entry_type)) {
     return DeserializeResult::INPUT_TOO_SHORT;
   }
 
@@ -260,27 +318,22 @@ DeserializeResult DeserializeV1SCTMerkleTreeLeaf(TLSDeserializer* des,
 
   switch (entry_type) {
     case ct::X509_ENTRY: {
-      string x509;
-      if (!des->ReadVarBytes(kMaxCertificateLength, &x509)) {
+      if (!CertificateField::Read(
+              des, entry->mutable_signed_entry()->mutable_x509())) {
         return DeserializeResult::INPUT_TOO_SHORT;
       }
-      entry->mutable_signed_entry()->set_x509(x509);
       return ReadExtensionsV1(des, entry);
     }
 
     case ct::PRECERT_ENTRY: {
-      string issuer_key_hash;
-      if (!des->ReadFixedBytes(32, &issuer_key_hash)) {
+      ct::PreCert* const precert(
+          entry->mutable_signed_entry()->mutable_precert());
+      if (!KeyHashField::Read(des, precert->mutable_issuer_key_hash())) {
         return DeserializeResult::INPUT_TOO_SHORT;
       }
-      entry->mutable_signed_entry()->mutable_precert()->set_issuer_key_hash(
-          issuer_key_hash);
-      string tbs_certificate;
-      if (!des->ReadVarBytes(kMaxCertificateLength, &tbs_certificate)) {
+      if (!CertificateField::Read(des, precert->mutable_tbs_certificate())) {
         return DeserializeResult::INPUT_TOO_SHORT;
       }
-      entry->mutable_signed_entry()->mutable_precert()->set_tbs_certificate(
-          tbs_certificate);
       return ReadExtensionsV1(des, entry);
     }
   }
@@ -318,10 +371,11 @@ string CertV2LeafData(const LogEntry& entry) {
 
 
 // static
-SerializeResult SerializeV2CertSCTSignatureInput(
+SerializeResult WriteV2CertSCTSignatureInput(
     uint64_t timestamp, const string& issuer_key_hash,
     const string& tbs_certificate,
-    const RepeatedPtrField<ct::SctExtension>& sct_extension, string* result) {
+    const RepeatedPtrField<ct::SctExtension>& sct_extension,
+    BufferWriter* result) {
   SerializeResult res = CheckCertificateFormat(tbs_certificate);
   if (res != SerializeResult::OK) {
     return res;
@@ -330,7 +384,6 @@ SerializeResult SerializeV2CertSCTSignatureInput(
   if (res != SerializeResult::OK) {
     return res;
   }
-  result->clear();
   WriteUint(ct::V2, Serializer::kVersionLengthInBytes, result);
   WriteUint(ct::CERTIFICATE_TIMESTAMP, Serializer::kSignatureTypeLengthInBytes,
             result);
@@ -343,11 +396,24 @@ SerializeResult SerializeV2CertSCTSignatureInput(
 }
 
 
-// static
-SerializeResult SerializeV2PrecertSCTSignatureInput(
+SerializeResult SerializeV2CertSCTSignatureInput(
     uint64_t timestamp, const string& issuer_key_hash,
     const string& tbs_certificate,
     const RepeatedPtrField<ct::SctExtension>& sct_extension, string* result) {
+  return SerializeExactly(
+      bind(WriteV2CertSCTSignatureInput,
+           timestamp, cref(issuer_key_hash), cref(tbs_certificate),
+           cref(sct_extension), _1),
+      result);
+}
+
+
+// static
+SerializeResult WriteV2PrecertSCTSignatureInput(
+    uint64_t timestamp, const string& issuer_key_hash,
+    const string& tbs_certificate,
+    const RepeatedPtrField<ct::SctExtension>& sct_extension,
+    BufferWriter* result) {
   SerializeResult res = CheckCertificateFormat(tbs_certificate);
   if (res != SerializeResult::OK) {
     return res;
@@ -356,7 +422,6 @@ SerializeResult SerializeV2PrecertSCTSignatureInput(
   if (res != SerializeResult::OK) {
     return res;
   }
-  result->clear();
   WriteUint(ct::V2, Serializer::kVersionLengthInBytes, result);
   WriteUint(ct::CERTIFICATE_TIMESTAMP, Serializer::kSignatureTypeLengthInBytes,
             result);
@@ -369,22 +434,33 @@ SerializeResult SerializeV2PrecertSCTSignatureInput(
   return SerializeResult::OK;
 }
 
+
+SerializeResult SerializeV2PrecertSCTSignatureInput(
+    uint64_t timestamp, const string& issuer_key_hash,
+    const string& tbs_certificate,
+    const RepeatedPtrField<ct::SctExtension>& sct_extension, string* result) {
+  return SerializeExactly(
+      bind(WriteV2PrecertSCTSignatureInput,
+           timestamp, cref(issuer_key_hash), cref(tbs_certificate),
+           cref(sct_extension), _1),
+      result);
+}
+
 // static
-SerializeResult SerializeV2SCTSignatureInput(
+SerializeResult WriteV2SCTSignatureInput(
     const SignedCertificateTimestamp& sct, const LogEntry& entry,
-    string* result) {
+    BufferWriter* result) {
   if (sct.version() != ct::V2) {
     return SerializeResult::UNSUPPORTED_VERSION;
   }
-  result->clear();
   switch (entry.type()) {
     case ct::X509_ENTRY:
-      return SerializeV2CertSCTSignatureInput(
+      return WriteV2CertSCTSignatureInput(
           sct.timestamp(), entry.x509_entry().cert_info().issuer_key_hash(),
           entry.x509_entry().cert_info().tbs_certificate(),
           sct.sct_extension(), result);
     case ct::PRECERT_ENTRY_V2:
-      return SerializeV2PrecertSCTSignatureInput(
+      return WriteV2PrecertSCTSignatureInput(
           sct.timestamp(), entry.precert_entry().cert_info().issuer_key_hash(),
           entry.precert_entry().cert_info().tbs_certificate(),
           sct.sct_extension(), result);
@@ -395,10 +471,11 @@ SerializeResult SerializeV2SCTSignatureInput(
 }
 
 
-SerializeResult SerializeV2CertSCTMerkleTreeLeaf(
+SerializeResult WriteV2CertSCTMerkleTreeLeaf(
     uint64_t timestamp, const string& issuer_key_hash,
     const string& tbs_certificate,
-    const RepeatedPtrField<SctExtension>& sct_extension, string* result) {
+    const RepeatedPtrField<SctExtension>& sct_extension,
+    BufferWriter* result) {
   SerializeResult res = CheckCertificateFormat(tbs_certificate);
   if (res != SerializeResult::OK) {
     return res;
@@ -407,7 +484,6 @@ SerializeResult SerializeV2CertSCTMerkleTreeLeaf(
   if (res != SerializeResult::OK) {
     return res;
   }
-  result->clear();
   WriteUint(ct::V2, Serializer::kVersionLengthInBytes, result);
   WriteUint(ct::TIMESTAMPED_ENTRY, Serializer::kMerkleLeafTypeLengthInBytes,
             result);
@@ -420,11 +496,23 @@ SerializeResult SerializeV2CertSCTMerkleTreeLeaf(
 }
 
 
-SerializeResult SerializeV2PrecertSCTMerkleTreeLeaf(
+SerializeResult SerializeV2CertSCTMerkleTreeLeaf(
+    uint64_t timestamp, const string& issuer_key_hash,
+    const string& tbs_certificate,
+    const RepeatedPtrField<SctExtension>& sct_extension, string* result) {
+  return SerializeExactly(
+      bind(WriteV2CertSCTMerkleTreeLeaf,
+           timestamp, cref(issuer_key_hash), cref(tbs_certificate),
+           cref(sct_extension), _1),
+      result);
+}
+
+
+SerializeResult WriteV2PrecertSCTMerkleTreeLeaf(
     uint64_t timestamp, const string& issuer_key_hash,
     const string& tbs_certificate,
     const google::protobuf::RepeatedPtrField<ct::SctExtension>& sct_extension,
-    string* result) {
+    BufferWriter* result) {
   SerializeResult res = CheckCertificateFormat(tbs_certificate);
   if (res != SerializeResult::OK) {
     return res;
@@ -437,7 +525,6 @@ SerializeResult SerializeV2PrecertSCTMerkleTreeLeaf(
   if (res != SerializeResult::OK) {
     return res;
   }
-  result->clear();
   WriteUint(ct::V2, Serializer::kVersionLengthInBytes, result);
   WriteUint(ct::TIMESTAMPED_ENTRY, Serializer::kMerkleLeafTypeLengthInBytes,
             result);
@@ -451,19 +538,31 @@ SerializeResult SerializeV2PrecertSCTMerkleTreeLeaf(
 }
 
 
-SerializeResult SerializeV2SCTMerkleTreeLeaf(
-    const ct::SignedCertificateTimestamp& sct, const ct::LogEntry& entry,
+SerializeResult SerializeV2PrecertSCTMerkleTreeLeaf(
+    uint64_t timestamp, const string& issuer_key_hash,
+    const string& tbs_certificate,
+    const google::protobuf::RepeatedPtrField<ct::SctExtension>& sct_extension,
     string* result) {
+  return SerializeExactly(
+      bind(WriteV2PrecertSCTMerkleTreeLeaf,
+           timestamp, cref(issuer_key_hash), cref(tbs_certificate),
+           cref(sct_extension), _1),
+      result);
+}
+
+
+SerializeResult WriteV2SCTMerkleTreeLeaf(
+    const ct::SignedCertificateTimestamp& sct, const ct::LogEntry& entry,
+    BufferWriter* result) {
   CHECK_EQ(ct::V2, sct.version());
-  result->clear();
   switch (entry.type()) {
     case ct::X509_ENTRY:
-      return SerializeV2CertSCTMerkleTreeLeaf(
+      return WriteV2CertSCTMerkleTreeLeaf(
           sct.timestamp(), entry.x509_entry().cert_info().issuer_key_hash(),
           entry.x509_entry().cert_info().tbs_certificate(),
           sct.sct_extension(), result);
     case ct::PRECERT_ENTRY_V2:
-      return SerializeV2PrecertSCTMerkleTreeLeaf(
+      return WriteV2PrecertSCTMerkleTreeLeaf(
           sct.timestamp(), entry.precert_entry().cert_info().issuer_key_hash(),
           entry.precert_entry().cert_info().tbs_certificate(),
           sct.sct_extension(), result);
@@ -546,15 +645,15 @@ DeserializeResult DeserializeV2SCTMerkleTreeLeaf(TLSDeserializer* des,
 
 
 void ConfigureSerializerForV1CT() {
-  Serializer::ConfigureV1(CertV1LeafData, SerializeV1SCTSignatureInput,
-                          SerializeV1SCTMerkleTreeLeaf);
+  Serializer::ConfigureV1(CertV1LeafData, WriteV1SCTSignatureInput,
+                          WriteV1SCTMerkleTreeLeaf);
   Deserializer::Configure(DeserializeV1SCTMerkleTreeLeaf);
 }
 
 
 void ConfigureSerializerForV2CT() {
-  Serializer::ConfigureV2(CertV2LeafData, SerializeV2SCTSignatureInput,
-                          SerializeV2SCTMerkleTreeLeaf);
+  Serializer::ConfigureV2(CertV2LeafData, WriteV2SCTSignatureInput,
+                          WriteV2SCTMerkleTreeLeaf);
   Deserializer::Configure(DeserializeV2SCTMerkleTreeLeaf);
 }
 
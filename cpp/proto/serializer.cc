@@ -4,13 +4,20 @@
 #include <gflags/gflags.h>
 #include <glog/logging.h>
 #include <math.h>
+#include <functional>
 #include <string>
 
 #include "proto/ct.pb.h"
 
+using cert_trans::serialization::BufferWriter;
+using cert_trans::serialization::DigitallySignedEncodedSize;
+using cert_trans::serialization::FixedBytesField;
 using cert_trans::serialization::internal::PrefixLength;
+using cert_trans::serialization::SerializeExactly;
 using cert_trans::serialization::SerializeResult;
 using cert_trans::serialization::DeserializeResult;
+using cert_trans::serialization::UintField;
+using cert_trans::serialization::VarBytesField;
 using cert_trans::serialization::WriteDigitallySigned;
 using cert_trans::serialization::WriteFixedBytes;
 using cert_trans::serialization::WriteUint;
@@ -31,22 +38,25 @@ using ct::SctExtension;
 using ct::Version_IsValid;
 using ct::X509ChainEntry;
 using google::protobuf::RepeatedPtrField;
+using std::bind;
+using std::cref;
 using std::function;
+using std::placeholders::_1;
 using std::string;
 
-const size_t Serializer::kMaxV2ExtensionType = (1 << 16) - 1;
-const size_t Serializer::kMaxV2ExtensionsCount = (1 << 16) - 2;
-const size_t Serializer::kMaxExtensionsLength = (1 << 16) - 1;
-const size_t Serializer::kMaxSerializedSCTLength = (1 << 16) - 1;
-const size_t Serializer::kMaxSCTListLength = (1 << 16) - 1;
+const size_t Serializer::kMaxV2ExtensionType;
+const size_t Serializer::kMaxV2ExtensionsCount;
+const size_t Serializer::kMaxExtensionsLength;
+const size_t Serializer::kMaxSerializedSCTLength;
+const size_t Serializer::kMaxSCTListLength;
 
-const size_t Serializer::kLogEntryTypeLengthInBytes = 2;
-const size_t Serializer::kSignatureTypeLengthInBytes = 1;
-const size_t Serializer::kVersionLengthInBytes = 1;
-const size_t Serializer::kKeyIDLengthInBytes = 32;
-const size_t Serializer::kMerkleLeafTypeLengthInBytes = 1;
-const size_t Serializer::kKeyHashLengthInBytes = 32;
-const size_t Serializer::kTimestampLengthInBytes = 8;
+const size_t Serializer::kLogEntryTypeLengthInBytes;
+const size_t Serializer::kSignatureTypeLengthInBytes;
+const size_t Serializer::kVersionLengthInBytes;
+const size_t Serializer::kKeyIDLengthInBytes;
+const size_t Serializer::kMerkleLeafTypeLengthInBytes;
+const size_t Serializer::kKeyHashLengthInBytes;
+const size_t Serializer::kTimestampLengthInBytes;
 
 DEFINE_bool(allow_reconfigure_serializer_test_only, false,
             "Allow tests to reconfigure the serializer multiple times.");
@@ -61,15 +71,20 @@ SerializeResult CheckSthExtensionsFormat(
 namespace {
 
 
+typedef UintField<Serializer::kVersionLengthInBytes> VersionField;
+typedef UintField<Serializer::kSignatureTypeLengthInBytes> SignatureTypeField;
+typedef FixedBytesField<Serializer::kKeyIDLengthInBytes> KeyIDField;
+typedef UintField<Serializer::kTimestampLengthInBytes> TimestampField;
+typedef UintField<8> TreeSizeField;
+typedef FixedBytesField<32> RootHashField;
+typedef VarBytesField<Serializer::kMaxExtensionsLength> ExtensionsField;
+
+
 function<string(const ct::LogEntry&)> leaf_data;
 
-function<SerializeResult(const ct::SignedCertificateTimestamp& sct,
-                         const ct::LogEntry& entry, std::string* result)>
-    serialize_sct_sig_input;
+Serializer::SCTWriter serialize_sct_sig_input;
 
-function<SerializeResult(const ct::SignedCertificateTimestamp& sct,
-                         const ct::LogEntry& entry, std::string* result)>
-    serialize_sct_merkle_leaf;
+Serializer::SCTWriter serialize_sct_merkle_leaf;
 
 function<SerializeResult(uint64_t timestamp, int64_t tree_size,
                          const std::string& root_hash, std::string* result)>
@@ -112,13 +127,17 @@ static SerializeResult SerializeV1STHSignatureInput(uint64_t timestamp,
                                                     string* result) {
   CHECK_GE(tree_size, 0);
   result->clear();
-  if (root_hash.size() != 32)
+  if (root_hash.size() != RootHashField::EncodedSize())
     return SerializeResult::INVALID_HASH_LENGTH;
-  WriteUint(ct::V1, Serializer::kVersionLengthInBytes, result);
-  WriteUint(ct::TREE_HEAD, Serializer::kSignatureTypeLengthInBytes, result);
-  WriteUint(timestamp, Serializer::kTimestampLengthInBytes, result);
-  WriteUint(tree_size, 8, result);
-  WriteFixedBytes(root_hash, result);
+  result->reserve(VersionField::EncodedSize() +
+                  SignatureTypeField::EncodedSize() +
+                  TimestampField::EncodedSize() +
+                  TreeSizeField::EncodedSize() + RootHashField::EncodedSize());
+  VersionField::Write(ct::V1, result);
+  SignatureTypeField::Write(ct::TREE_HEAD, result);
+  TimestampField::Write(timestamp, result);
+  TreeSizeField::Write(tree_size, result);
+  RootHashField::Write(root_hash, result);
   return SerializeResult::OK;
 }
 
@@ -201,7 +220,31 @@ SerializeResult Serializer::SerializeSCTMerkleTreeLeaf(
     std::string* result) {
   CHECK(result);
   CHECK(serialize_sct_merkle_leaf);
-  return serialize_sct_merkle_leaf(sct, entry, result);
+  return SerializeExactly(bind(serialize_sct_merkle_leaf, cref(sct),
+                               cref(entry), _1),
+                          result);
+}
+
+
+// static
+SerializeResult Serializer::SerializeSCTMerkleTreeLeaf(
+    const ct::SignedCertificateTimestamp& sct, const ct::LogEntry& entry,
+    evbuffer* output) {
+  CHECK(output);
+  CHECK(serialize_sct_merkle_leaf);
+  return SerializeExactly(bind(serialize_sct_merkle_leaf, cref(sct),
+                               cref(entry), _1),
+                          output);
+}
+
+
+// static
+SerializeResult Serializer::SerializeSCTMerkleTreeLeaf(
+    const ct::SignedCertificateTimestamp& sct, const ct::LogEntry& entry,
+    BufferWriter* output) {
+  CHECK(output);
+  CHECK(serialize_sct_merkle_leaf);
+  return serialize_sct_merkle_leaf(sct, entry, output);
 }
 
 
@@ -211,7 +254,31 @@ SerializeResult Serializer::SerializeSCTSignatureInput(
     string* result) {
   CHECK(result);
   CHECK(serialize_sct_sig_input);
-  return serialize_sct_sig_input(sct, entry, result);
+  return SerializeExactly(bind(serialize_sct_sig_input, cref(sct),
+                               cref(entry), _1),
+                          result);
+}
+
+
+// static
+SerializeResult Serializer::SerializeSCTSignatureInput(
+    const SignedCertificateTimestamp& sct, const LogEntry& entry,
+    evbuffer* output) {
+  CHECK(output);
+  CHECK(serialize_sct_sig_input);
+  return SerializeExactly(bind(serialize_sct_sig_input, cref(sct),
+                               cref(entry), _1),
+                          output);
+}
+
+
+// static
+SerializeResult Serializer::SerializeSCTSignatureInput(
+    const SignedCertificateTimestamp& sct, const LogEntry& entry,
+    BufferWriter* output) {
+  CHECK(output);
+  CHECK(serialize_sct_sig_input);
+  return serialize_sct_sig_input(sct, entry, output);
 }
 
 SerializeResult WriteSCTV1(const SignedCertificateTimestamp& sct,
@@ -222,18 +289,24 @@ SerializeResult WriteSCTV1(const SignedCertificateTimestamp& sct,
   if (res != SerializeResult::OK) {
     return res;
   }
-  if (sct.id().key_id().size() != Serializer::kKeyIDLengthInBytes) {
+  if (sct.id().key_id().size() != KeyIDField::EncodedSize()) {
     return SerializeResult::INVALID_KEYID_LENGTH;
   }
-  WriteUint(sct.version(), Serializer::kVersionLengthInBytes, output);
-  WriteFixedBytes(sct.id().key_id(), output);
-  WriteUint(sct.timestamp(), Serializer::kTimestampLengthInBytes, output);
-  WriteVarBytes(sct.extensions(), Serializer::kMaxExtensionsLength, output);
+  output->reserve(VersionField::EncodedSize() + KeyIDField::EncodedSize() +
+                  TimestampField::EncodedSize() +
+                  ExtensionsField::EncodedSize(sct.extensions()) +
+                  DigitallySignedEncodedSize(sct.signature()));
+  VersionField::Write(sct.version(), output);
+  KeyIDField::Write(sct.id().key_id(), output);
+  TimestampField::Write(sct.timestamp(), output);
+  ExtensionsField::Write(sct.extensions(), output);
   return WriteDigitallySigned(sct.signature(), output);
+
 }
 
+template <class Output>
 void WriteSctExtension(const RepeatedPtrField<SctExtension>& extension,
-                       std::string* output) {
+                       Output* output) {
   WriteUint(extension.size(), 2, output);
   for (auto it = extension.begin(); it != extension.end(); ++it) {
     WriteUint(it->sct_extension_type(), 2, output);
@@ -242,6 +315,11 @@ void WriteSctExtension(const RepeatedPtrField<SctExtension>& extension,
   }
 }
 
+template void WriteSctExtension(
+    const RepeatedPtrField<SctExtension>& extension, string* output);
+template void WriteSctExtension(
+    const RepeatedPtrField<SctExtension>& extension, BufferWriter* output);
+
 SerializeResult WriteSCTV2(const SignedCertificateTimestamp& sct,
                            std::string* output) {
   CHECK(sct.version() == ct::V2);
@@ -401,20 +479,17 @@ namespace {
 DeserializeResult ReadSCTV1(TLSDeserializer* deserializer,
                             SignedCertificateTimestamp* sct) {
   sct->set_version(ct::V1);
-  if (!deserializer->ReadFixedBytes(Serializer::kKeyIDLengthInBytes,
-                                    sct->mutable_id()->mutable_key_id())) {
+  if (!KeyIDField::Read(deserializer, sct->mutable_id()->mutable_key_id())) {
     return DeserializeResult::INPUT_TOO_SHORT;
   }
   // V1 encoding.
   uint64_t timestamp = 0;
-  if (!deserializer->ReadUint(Serializer::kTimestampLengthInBytes,
-                              &timestamp)) {
+  if (!TimestampField::Read(deserializer, &timestamp)) {
     return DeserializeResult::INPUT_TOO_SHORT;
   }
   sct->set_timestamp(timestamp);
   string extensions;
-  if (!deserializer->ReadVarBytes(Serializer::kMaxExtensionsLength,
-                                  &extensions)) {
+  if (!ExtensionsField::Read(deserializer, &extensions)) {
     // In theory, could also be an invalid length prefix, but not if
     // length limits follow byte boundaries.
     return DeserializeResult::INPUT_TOO_SHORT;
@@ -606,12 +681,8 @@ DeserializeResult Deserializer::DeserializeMerkleTreeLeaf(
 // static
 void Serializer::ConfigureV1(
     const function<string(const ct::LogEntry&)>& leaf_data_func,
-    const function<SerializeResult(
-        const ct::SignedCertificateTimestamp& sct, const ct::LogEntry& entry,
-        std::string* result)>& serialize_sct_sig_input_func,
-    const function<SerializeResult(
-        const ct::SignedCertificateTimestamp& sct, const ct::LogEntry& entry,
-        std::string* result)>& serialize_sct_merkle_leaf_func) {
+    const SCTWriter& serialize_sct_sig_input_func,
+    const SCTWriter& serialize_sct_merkle_leaf_func) {
   CHECK(FLAGS_allow_reconfigure_serializer_test_only ||
         (!leaf_data&& !serialize_sct_sig_input &&
          !serialize_sct_merkle_leaf))
@@ -626,12 +697,8 @@ void Serializer::ConfigureV1(
 // static
 void Serializer::ConfigureV2(
     const function<string(const ct::LogEntry&)>& leaf_data_func,
-    const function<SerializeResult(
-        const ct::SignedCertificateTimestamp& sct, const ct::LogEntry& entry,
-        std::string* result)>& serialize_sct_sig_input_func,
-    const function<SerializeResult(
-        const ct::SignedCertificateTimestamp& sct, const ct::LogEntry& entry,
-        std::string* result)>& serialize_sct_merkle_leaf_func) {
+    const SCTWriter& serialize_sct_sig_input_func,
+    const SCTWriter& serialize_sct_merkle_leaf_func) {
   CHECK(FLAGS_allow_reconfigure_serializer_test_only ||
         (!leaf_data && !serialize_sct_sig_input &&
          !serialize_sct_merkle_leaf))
@@ -22,8 +22,10 @@ cert_trans::serialization::SerializeResult CheckKeyHashFormat(
 cert_trans::serialization::SerializeResult CheckSctExtensionsFormat(
     const repeated_sct_extension& extension);
 
+// Writes to either a std::string or a BufferWriter.
+template <class Output>
 void WriteSctExtension(const repeated_sct_extension& extension,
-                       std::string* output);
+                       Output* output);
 
 cert_trans::serialization::DeserializeResult ReadExtensionsV1(
     TLSDeserializer* deserializer, ct::TimestampedEntry* entry);
@@ -37,41 +39,41 @@ cert_trans::serialization::DeserializeResult ReadMerkleTreeLeaf(
 // A utility class for writing protocol buffer fields in canonical TLS style.
 class Serializer {
  public:
-  static const size_t kMaxV2ExtensionType;
-  static const size_t kMaxV2ExtensionsCount;
-  static const size_t kMaxExtensionsLength;
-  static const size_t kMaxSerializedSCTLength;
-  static const size_t kMaxSCTListLength;
-
-  static const size_t kLogEntryTypeLengthInBytes;
-  static const size_t kSignatureTypeLengthInBytes;
-  static const size_t kVersionLengthInBytes;
+  static const size_t kMaxV2ExtensionType = (1 << 16) - 1;
+  static const size_t kMaxV2ExtensionsCount = (1 << 16) - 2;
+  static const size_t kMaxExtensionsLength = (1 << 16) - 1;
+  static const size_t kMaxSerializedSCTLength = (1 << 16) - 1;
+  static const size_t kMaxSCTListLength = (1 << 16) - 1;
+
+  static const size_t kLogEntryTypeLengthInBytes = 2;
+  static const size_t kSignatureTypeLengthInBytes = 1;
+  static const size_t kVersionLengthInBytes = 1;
   // Log Key ID
-  static const size_t kKeyIDLengthInBytes;
-  static const size_t kMerkleLeafTypeLengthInBytes;
+  static const size_t kKeyIDLengthInBytes = 32;
+  static const size_t kMerkleLeafTypeLengthInBytes = 1;
   // Public key hash from cert
-  static const size_t kKeyHashLengthInBytes;
-  static const size_t kTimestampLengthInBytes;
+  static const size_t kKeyHashLengthInBytes = 32;
+  static const size_t kTimestampLengthInBytes = 8;
+
+  // Writes the serialization of |sct| with |entry| to |output|, which
+  // may only be counting the bytes; see
+  // cert_trans::serialization::BufferWriter.
+  typedef std::function<cert_trans::serialization::SerializeResult(
+      const ct::SignedCertificateTimestamp& sct, const ct::LogEntry& entry,
+      cert_trans::serialization::BufferWriter* output)>
+      SCTWriter;
 
   // API
   // TODO(alcutter): typedef these function<> bits
   static void ConfigureV1(
       const std::function<std::string(const ct::LogEntry&)>& leaf_data,
-      const std::function<cert_trans::serialization::SerializeResult(
-          const ct::SignedCertificateTimestamp& sct, const ct::LogEntry& entry,
-          std::string* result)>& serialize_sct_sig_input,
-      const std::function<cert_trans::serialization::SerializeResult(
-          const ct::SignedCertificateTimestamp& sct, const ct::LogEntry& entry,
-          std::string* result)>& serialize_sct_merkle_leaf);
+      const SCTWriter& serialize_sct_sig_input,
+      const SCTWriter& serialize_sct_merkle_leaf);
 
   static void ConfigureV2(
       const std::function<std::string(const ct::LogEntry&)>& leaf_data,
-      const std::function<cert_trans::serialization::SerializeResult(
-          const ct::SignedCertificateTimestamp& sct, const ct::LogEntry& entry,
-          std::string* result)>& serialize_sct_sig_input,
-      const std::function<cert_trans::serialization::SerializeResult(
-          const ct::SignedCertificateTimestamp& sct, const ct::LogEntry& entry,
-          std::string* result)>& serialize_sct_merkle_leaf);
+      const SCTWriter& serialize_sct_sig_input,
+      const SCTWriter& serialize_sct_merkle_leaf);
 
   static std::string LeafData(const ct::LogEntry& entry);
 
@@ -86,6 +88,25 @@ class Serializer {
       const ct::SignedCertificateTimestamp& sct, const ct::LogEntry& entry,
       std::string* result);
 
+  // The two above produce their result in a single allocation of the
+  // right size. These variants write it straight to where it is needed
+  // instead: appended to an evbuffer, or to the memory given to a
+  // BufferWriter, which must be large enough. Calling them with a
+  // BufferWriter that only counts gives the size needed.
+  static cert_trans::serialization::SerializeResult SerializeSCTMerkleTreeLeaf(
+      const ct::SignedCertificateTimestamp& sct, const ct::LogEntry& entry,
+      evbuffer* output);
+  static cert_trans::serialization::SerializeResult SerializeSCTMerkleTreeLeaf(
+      const ct::SignedCertificateTimestamp& sct, const ct::LogEntry& entry,
+      cert_trans::serialization::BufferWriter* output);
+
+  static cert_trans::serialization::SerializeResult SerializeSCTSignatureInput(
+      const ct::SignedCertificateTimestamp& sct, const ct::LogEntry& entry,
+      evbuffer* output);
+  static cert_trans::serialization::SerializeResult SerializeSCTSignatureInput(
+      const ct::SignedCertificateTimestamp& sct, const ct::LogEntry& entry,
+      cert_trans::serialization::BufferWriter* output);
+
   static cert_trans::serialization::SerializeResult
   SerializeV1STHSignatureInput(uint64_t timestamp, int64_t tree_size,
                                const std::string& root_hash,
@@ -1,10 +1,16 @@
 /* -*- indent-tabs-mode: nil -*- */
+#include <event2/buffer.h>
 #include <gflags/gflags.h>
 #include <glog/logging.h>
 #include <google/protobuf/repeated_field.h>
 #include <gtest/gtest.h>
+#include <string.h>
+#include <algorithm>
+#include <memory>
 #include <string>
+#include <vector>
 
+#include "proto/binary_entries.h"
 #include "proto/cert_serializer.h"
 #include "proto/ct.pb.h"
 #include "proto/serializer.h"
@@ -15,6 +21,11 @@ DECLARE_bool(allow_reconfigure_serializer_test_only);
 
 namespace {
 
+using cert_trans::BinaryEntry;
+using cert_trans::BinaryEntryReader;
+using cert_trans::ReadBinaryEntries;
+using cert_trans::WriteBinaryEntry;
+using cert_trans::serialization::BufferWriter;
 using cert_trans::serialization::SerializeResult;
 using cert_trans::serialization::DeserializeResult;
 using ct::DigitallySigned;
@@ -31,6 +42,8 @@ using ct::Version;
 using ct::X509ChainEntry;
 using google::protobuf::RepeatedPtrField;
 using std::string;
+using std::unique_ptr;
+using std::vector;
 
 // A slightly shorter notation for constructing binary blobs from test vectors.
 string B(const string& hexstring) {
@@ -721,6 +734,73 @@ TEST_F(SerializerTestV1, SerializeDigitallySignedKatTest) {
   EXPECT_EQ(string(kDefaultSCTSignatureHexString), H(result));
 }
 
+TEST_F(SerializerTestV1, DigitallySignedEncodedSize) {
+  string result;
+  EXPECT_EQ(SerializeResult::OK,
+            Serializer::SerializeDigitallySigned(DefaultSCTSignature(),
+                                                 &result));
+  EXPECT_EQ(result.size(),
+            cert_trans::serialization::DigitallySignedEncodedSize(
+                DefaultSCTSignature()));
+}
+
+TEST(TLSEncodingTest, PrefixLength) {
+  using cert_trans::serialization::internal::PrefixLength;
+  static_assert(
+      cert_trans::serialization::internal::PrefixLengthFor(65535) == 2,
+      "not a constant expression");
+  EXPECT_EQ(0U, PrefixLength(1));
+  EXPECT_EQ(1U, PrefixLength(2));
+  EXPECT_EQ(1U, PrefixLength(255));
+  EXPECT_EQ(1U, PrefixLength(256));
+  EXPECT_EQ(2U, PrefixLength(257));
+  EXPECT_EQ(2U, PrefixLength((1 << 16) - 1));
+  EXPECT_EQ(3U, PrefixLength((1 << 24) - 1));
+  EXPECT_EQ(8U, PrefixLength(~static_cast<size_t>(0)));
+}
+
+TEST(TLSEncodingTest, Fields) {
+  using cert_trans::serialization::FixedBytesField;
+  using cert_trans::serialization::UintField;
+  using cert_trans::serialization::VarBytesField;
+  typedef VarBytesField<(1 << 16) - 1> Field;
+  static_assert(Field::kPrefixLength == 2, "wrong prefix length");
+
+  string written;
+  UintField<3>::Write(0x010203, &written);
+  FixedBytesField<2>::Write("ab", &written);
+  Field::Write("hello", &written);
+  EXPECT_EQ("010203" "6162" "0005" "68656c6c6f", H(written));
+  EXPECT_EQ(written.size(), UintField<3>::EncodedSize() +
+                                FixedBytesField<2>::EncodedSize() +
+                                Field::EncodedSize("hello"));
+
+  // A BufferWriter gets the same bytes as a string.
+  string buffer(written.size(), '\0');
+  BufferWriter writer(&buffer[0], buffer.size());
+  UintField<3>::Write(0x010203, &writer);
+  FixedBytesField<2>::Write("ab", &writer);
+  Field::Write("hello", &writer);
+  EXPECT_EQ(written, buffer);
+
+  TLSDeserializer deserializer(written);
+  int number;
+  string fixed, var;
+  EXPECT_TRUE(UintField<3>::Read(&deserializer, &number));
+  EXPECT_EQ(0x010203, number);
+  EXPECT_TRUE(FixedBytesField<2>::Read(&deserializer, &fixed));
+  EXPECT_EQ("ab", fixed);
+  EXPECT_TRUE(Field::Read(&deserializer, &var));
+  EXPECT_EQ("hello", var);
+  EXPECT_TRUE(deserializer.ReachedEnd());
+  EXPECT_FALSE(Field::Read(&deserializer, &var));
+
+  // Lengths over the maximum are rejected.
+  const string too_long(B("03616263"));
+  TLSDeserializer too_long_deserializer(too_long);
+  EXPECT_FALSE(VarBytesField<2>::Read(&too_long_deserializer, &var));
+}
+
 TEST_F(SerializerTestV1, SerializeSCTKatTest) {
   string result;
   EXPECT_EQ(SerializeResult::OK,
@@ -848,6 +928,51 @@ TEST_F(SerializerTestV1, SerializeSCTMerkleTreeLeafKatTestV1) {
   EXPECT_EQ(string(kDefaultPrecertSCTLeafHexString), H(precert_result));
 }
 
+TEST_F(SerializerTestV1, SerializeSCTMerkleTreeLeafToBufferV1) {
+  BufferWriter counter;
+  EXPECT_EQ(SerializeResult::OK,
+            Serializer::SerializeSCTMerkleTreeLeaf(DefaultSCT(),
+                                                   DefaultCertEntry(),
+                                                   &counter));
+  EXPECT_EQ(strlen(kDefaultCertSCTLeafHexString) / 2, counter.size());
+
+  string result(counter.size(), '\0');
+  BufferWriter writer(&result[0], result.size());
+  EXPECT_EQ(SerializeResult::OK,
+            Serializer::SerializeSCTMerkleTreeLeaf(DefaultSCT(),
+                                                   DefaultCertEntry(),
+                                                   &writer));
+  EXPECT_EQ(result.size(), writer.size());
+  EXPECT_EQ(string(kDefaultCertSCTLeafHexString), H(result));
+
+  unique_ptr<evbuffer, void (*)(evbuffer*)> buffer(evbuffer_new(),
+                                                   evbuffer_free);
+  evbuffer_add(buffer.get(), "x", 1);
+  EXPECT_EQ(SerializeResult::OK,
+            Serializer::SerializeSCTSignatureInput(DefaultSCT(),
+                                                   DefaultPrecertEntry(),
+                                                   buffer.get()));
+  string expected("x");
+  ASSERT_EQ(SerializeResult::OK,
+            Serializer::SerializeSCTSignatureInput(DefaultSCT(),
+                                                   DefaultPrecertEntry(),
+                                                   &result));
+  expected.append(result);
+  const size_t length(evbuffer_get_length(buffer.get()));
+  EXPECT_EQ(expected,
+            string(reinterpret_cast<const char*>(
+                       evbuffer_pullup(buffer.get(), length)),
+                   length));
+
+  // Errors leave the buffer untouched.
+  LogEntry entry(DefaultCertEntry());
+  entry.mutable_x509_entry()->clear_leaf_certificate();
+  EXPECT_EQ(SerializeResult::EMPTY_CERTIFICATE,
+            Serializer::SerializeSCTSignatureInput(DefaultSCT(), entry,
+                                                   buffer.get()));
+  EXPECT_EQ(length, evbuffer_get_length(buffer.get()));
+}
+
 TEST_F(SerializerTestV2, SerializeSCTMerkleTreeLeafKatTestV2) {
   string cert_result, precert_result;
   EXPECT_EQ(SerializeResult::OK,
@@ -1564,6 +1689,78 @@ TEST_F(SerializerTest, SerializeSCTSignedEntryWithType_BadIssuerKeyHash) {
                                                   &result));
 }
 
+TEST_F(SerializerTestV1, BinaryEntriesRoundTrip) {
+  string leaf;
+  ASSERT_EQ(SerializeResult::OK,
+            Serializer::SerializeSCTMerkleTreeLeaf(DefaultSCT(),
+                                                   DefaultCertEntry(), &leaf));
+  string sct;
+  ASSERT_EQ(SerializeResult::OK, Serializer::SerializeSCT(DefaultSCT(), &sct));
+
+  string body;
+  EXPECT_EQ(SerializeResult::OK,
+            WriteBinaryEntry(leaf, "extra", string(), &body));
+  EXPECT_EQ(SerializeResult::OK, WriteBinaryEntry(leaf, string(), sct, &body));
+  EXPECT_EQ(SerializeResult::EMPTY_ELEM_IN_LIST,
+            WriteBinaryEntry(string(), "extra", sct, &body));
+  EXPECT_EQ(2 * (4 + leaf.size() + 4 + 2) + 5 + sct.size(), body.size());
+
+  vector<BinaryEntry> entries;
+  ASSERT_EQ(DeserializeResult::OK, ReadBinaryEntries(body, &entries));
+  ASSERT_EQ(2U, entries.size());
+  EXPECT_EQ(leaf, entries[0].leaf_input);
+  EXPECT_EQ("extra", entries[0].extra_data);
+  EXPECT_EQ("", entries[0].sct);
+  EXPECT_EQ(leaf, entries[1].leaf_input);
+  EXPECT_EQ("", entries[1].extra_data);
+  EXPECT_EQ(sct, entries[1].sct);
+
+  entries.clear();
+  EXPECT_EQ(DeserializeResult::OK, ReadBinaryEntries(string(), &entries));
+  EXPECT_TRUE(entries.empty());
+  EXPECT_EQ(DeserializeResult::INPUT_TOO_SHORT,
+            ReadBinaryEntries(body.substr(0, body.size() - 1), &entries));
+  EXPECT_EQ(DeserializeResult::EMPTY_ELEM_IN_LIST,
+            ReadBinaryEntries(string(10, '\0'), &entries));
+}
+
+TEST_F(SerializerTestV1, BinaryEntryReaderReadsPieces) {
+  string leaf;
+  ASSERT_EQ(SerializeResult::OK,
+            Serializer::SerializeSCTMerkleTreeLeaf(DefaultSCT(),
+                                                   DefaultCertEntry(), &leaf));
+  string body;
+  for (int i = 0; i < 3; ++i) {
+    ASSERT_EQ(SerializeResult::OK,
+              WriteBinaryEntry(leaf, string(i, 'x'), string(), &body));
+  }
+
+  BinaryEntryReader reader;
+  vector<BinaryEntry> entries;
+  for (size_t i = 0; i < body.size(); i += 5) {
+    ASSERT_EQ(DeserializeResult::OK,
+              reader.Read(body.data() + i, std::min<size_t>(5, body.size() - i),
+                          &entries));
+  }
+  EXPECT_TRUE(reader.AtRecordEnd());
+  ASSERT_EQ(3U, entries.size());
+  for (int i = 0; i < 3; ++i) {
+    EXPECT_EQ(leaf, entries[i].leaf_input);
+    EXPECT_EQ(string(i, 'x'), entries[i].extra_data);
+  }
+
+  BinaryEntryReader truncated;
+  entries.clear();
+  ASSERT_EQ(DeserializeResult::OK,
+            truncated.Read(body.data(), body.size() - 1, &entries));
+  EXPECT_EQ(2U, entries.size());
+  EXPECT_FALSE(truncated.AtRecordEnd());
+
+  BinaryEntryReader empty_leaf;
+  EXPECT_EQ(DeserializeResult::EMPTY_ELEM_IN_LIST,
+            empty_leaf.Read(string(10, '\0').data(), 10, &entries));
+}
+
 }  // namespace
 
 int main(int argc, char** argv) {
@@ -2,6 +2,8 @@
 #include "proto/serializer_v2.h"
 
 #include <glog/logging.h>
+#include <mutex>
+#include <unordered_map>
 
 #include "util/status.h"
 #include "util/openssl_util.h"
@@ -21,34 +23,12 @@ const char kDerOIDTag = 0x06;
 // OpenSSL documentation recommends 80, see the BUGS section in:
 // https://www.openssl.org/docs/manmaster/crypto/OBJ_obj2txt.html
 const size_t kTextOIDMaxSize = 80;
-}
-
-OID::OID() : oid_(nullptr) {
-}
-
-OID::OID(ASN1_OBJECT* oid) : oid_(oid) {
-  CHECK_NOTNULL(oid_);
-}
-
-OID::OID(const OID& other) : oid_(nullptr) {
-  if (other.oid_ != nullptr) {
-    oid_ = OBJ_dup(other.oid_);
-  }
-}
-
-OID::~OID() {
-  if (oid_ != nullptr) {
-    ASN1_OBJECT_free(oid_);
-  }
-}
+// How many OIDs FromString() keeps, which bounds what it costs when
+// given many different ones.
+const size_t kMaxInternedOIDs = 1024;
 
-util::StatusOr<std::string> OID::ToTagMissingDER() const {
-  if(oid_ == nullptr) {
-    // Uninitialized.
-    return Status(util::error::INVALID_ARGUMENT,
-                  std::string("OID not initialized."));
-  }
-  int encoded_length = i2d_ASN1_OBJECT(oid_, NULL);
+StatusOr<std::string> EncodeTagMissingDER(ASN1_OBJECT* oid) {
+  int encoded_length = i2d_ASN1_OBJECT(oid, NULL);
   if (encoded_length <= 0) {
     return Status(util::error::INVALID_ARGUMENT,
                   std::string("Failed to encode OID: ") +
@@ -59,7 +39,7 @@ util::StatusOr<std::string> OID::ToTagMissingDER() const {
       reinterpret_cast<uint8_t*>(OPENSSL_malloc(encoded_length)));
   // i2d_ASN1_OBJECT will change the pointer, so have to use a temporary.
   unsigned char* tmp_ptr = encoded_oid.get();
-  encoded_length = i2d_ASN1_OBJECT(oid_, &tmp_ptr);
+  encoded_length = i2d_ASN1_OBJECT(oid, &tmp_ptr);
   if (encoded_length <= 0) {
     return Status(util::error::INVALID_ARGUMENT,
                   std::string("Failed to encode OID: ") +
@@ -71,7 +51,27 @@ util::StatusOr<std::string> OID::ToTagMissingDER() const {
   CHECK_EQ(encoded_oid.get()[0], kDerOIDTag);
   // Skip the tag byte.
   std::string out(reinterpret_cast<char*>(encoded_oid.get() + 1), encoded_length - 1);
-  return std::move(out);
+  return out;
+}
+
+std::mutex interned_oids_lock;
+std::unordered_map<std::string, OID>* interned_oids = nullptr;
+}
+
+OID::OID() {
+}
+
+OID::OID(ASN1_OBJECT* oid, const std::string& der)
+    : oid_(CHECK_NOTNULL(oid), ASN1_OBJECT_free), der_(der) {
+}
+
+util::StatusOr<std::string> OID::ToTagMissingDER() const {
+  if(oid_ == nullptr) {
+    // Uninitialized.
+    return Status(util::error::INVALID_ARGUMENT,
+                  std::string("OID not initialized."));
+  }
+  return der_;
 }
 
 std::string OID::ToString() const {
@@ -80,21 +80,40 @@ std::string OID::ToString() const {
   }
 
   char output_buffer[kTextOIDMaxSize];
-  int encoded_length = i2t_ASN1_OBJECT(output_buffer, kTextOIDMaxSize, oid_);
+  int encoded_length =
+      i2t_ASN1_OBJECT(output_buffer, kTextOIDMaxSize, oid_.get());
 
   return std::string(output_buffer, encoded_length);
 }
 
 // static
 util::StatusOr<OID> OID::FromString(const std::string& oid_string) {
+  std::lock_guard<std::mutex> lock(interned_oids_lock);
+  if (!interned_oids) {
+    interned_oids = new std::unordered_map<std::string, OID>;
+  }
+  const auto it(interned_oids->find(oid_string));
+  if (it != interned_oids->end()) {
+    return it->second;
+  }
+
   ASN1_OBJECT *oid = OBJ_txt2obj(oid_string.c_str(), 0);
   if (oid == nullptr) {
     return Status(util::error::INVALID_ARGUMENT,
                   std::string("Bad OID: ") + oid_string + " "
                   + util::DumpOpenSSLErrorStack());
   }
+  const StatusOr<std::string> der(EncodeTagMissingDER(oid));
+  if (!der.ok()) {
+    ASN1_OBJECT_free(oid);
+    return der.status();
+  }
 
-  return OID(oid);
+  const OID result(oid, der.ValueOrDie());
+  if (interned_oids->size() < kMaxInternedOIDs) {
+    interned_oids->emplace(oid_string, result);
+  }
+  return result;
 }
 
 // static
@@ -111,7 +130,10 @@ util::StatusOr<OID> OID::FromTagMissingDER(
                   std::string("Bad DER in OID: ") +
                   util::DumpOpenSSLErrorStack());
   }
-  return OID(oid);
+  // Anything after the OID is ignored, and not part of its encoding.
+  const size_t consumed =
+      data_ptr - reinterpret_cast<const unsigned char*>(oid_der.data());
+  return OID(oid, oid_der.substr(1, consumed - 1));
 }
 
 }  // namespace rfc6962_bis
@@ -2,6 +2,7 @@
 #ifndef SERIALIZER_V2_H
 #define SERIALIZER_V2_H
 
+#include <memory>
 #include <string>
 
 #include <openssl/objects.h>
@@ -10,23 +11,27 @@
 
 // RFC6962-bis (V2) stuff.
 namespace rfc6962_bis {
+// The DER encoding is computed once, when the OID is made, and shared
+// by its copies, as are the OpenSSL structures.
 class OID {
  public:
+  // OIDs made from a string are interned, so that making the same few
+  // log OIDs again does not go through OpenSSL.
   static util::StatusOr<OID> FromString(const std::string& oid_string);
   static util::StatusOr<OID> FromTagMissingDER(const std::string& der_oid);
 
   OID();
-  OID(const OID& other);
-  ~OID();
 
   util::StatusOr<std::string> ToTagMissingDER() const;
   std::string ToString() const;
 
  private:
-  // Takes ownership
-  OID(ASN1_OBJECT* oid);
+  // Takes ownership of |oid|, which |der| is the encoding of, with
+  // the tag missing.
+  OID(ASN1_OBJECT* oid, const std::string& der);
 
-  ASN1_OBJECT *oid_;
+  std::shared_ptr<ASN1_OBJECT> oid_;
+  std::string der_;
 };
 
 }  // namespace rfc6962_bis
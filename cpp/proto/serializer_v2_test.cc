@@ -52,6 +52,30 @@ TEST_F(SerializerV2Test, CreatesFromTagMissingDER) {
   EXPECT_EQ(oid_text_, res.ValueOrDie().ToString());
 }
 
+TEST_F(SerializerV2Test, InternsOIDsFromStrings) {
+  util::StatusOr<OID> first = OID::FromString(oid_text_);
+  util::StatusOr<OID> second = OID::FromString(oid_text_);
+  ASSERT_TRUE(first.ok());
+  ASSERT_TRUE(second.ok());
+
+  EXPECT_EQ(oid_der_missing_tag_,
+            second.ValueOrDie().ToTagMissingDER().ValueOrDie());
+  EXPECT_EQ(oid_text_, second.ValueOrDie().ToString());
+  // Bad OIDs are not cached as good ones.
+  EXPECT_FALSE(OID::FromString("3.7.-12.b").ok());
+  EXPECT_FALSE(OID::FromString("3.7.-12.b").ok());
+}
+
+TEST_F(SerializerV2Test, CopiesShareEncoding) {
+  util::StatusOr<OID> res = OID::FromTagMissingDER(oid_der_missing_tag_);
+  ASSERT_TRUE(res.ok());
+  const OID copy(res.ValueOrDie());
+
+  EXPECT_EQ(oid_der_missing_tag_, copy.ToTagMissingDER().ValueOrDie());
+  EXPECT_EQ(oid_text_, copy.ToString());
+  EXPECT_FALSE(OID().ToTagMissingDER().ok());
+}
+
 }  // namespace
 
 int main(int argc, char** argv) {
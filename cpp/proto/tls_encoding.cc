@@ -1,7 +1,7 @@
 /* -*- indent-tabs-mode: nil -*- */
 #include "proto/tls_encoding.h"
 
-#include <math.h>
+#include <event2/buffer.h>
 #include <ostream>
 #include <string>
 
@@ -13,6 +13,10 @@ namespace serialization {
 
 namespace {
 
+typedef UintField<constants::kHashAlgorithmLengthInBytes> HashAlgorithmField;
+typedef UintField<constants::kSigAlgorithmLengthInBytes> SigAlgorithmField;
+typedef VarBytesField<constants::kMaxSignatureLength> SignatureField;
+
 SerializeResult CheckSignatureFormat(const DigitallySigned& sig) {
   // This is just DCHECKED upon setting, so check again.
   if (!DigitallySigned_HashAlgorithm_IsValid(sig.hash_algorithm()))
@@ -118,12 +122,47 @@ std::ostream& operator<<(std::ostream& stream, const DeserializeResult& r) {
   return stream << "<unknown>";
 }
 
-void WriteFixedBytes(const std::string& in, std::string* output) {
+SerializeResult SerializeExactly(const WriteFunction& write,
+                                 std::string* result) {
+  BufferWriter counter;
+  const SerializeResult res(write(&counter));
+  if (res != SerializeResult::OK) {
+    result->clear();
+    return res;
+  }
+
+  result->resize(counter.size());
+  BufferWriter writer(&(*result)[0], result->size());
+  CHECK_EQ(SerializeResult::OK, write(&writer));
+  CHECK_EQ(result->size(), writer.size());
+  return SerializeResult::OK;
+}
+
+SerializeResult SerializeExactly(const WriteFunction& write,
+                                 evbuffer* output) {
+  BufferWriter counter;
+  const SerializeResult res(write(&counter));
+  if (res != SerializeResult::OK || counter.size() == 0)
+    return res;
+
+  evbuffer_iovec vec;
+  CHECK_EQ(1, evbuffer_reserve_space(output, counter.size(), &vec, 1));
+  BufferWriter writer(static_cast<char*>(vec.iov_base), counter.size());
+  CHECK_EQ(SerializeResult::OK, write(&writer));
+  CHECK_EQ(counter.size(), writer.size());
+  vec.iov_len = writer.size();
+  CHECK_EQ(0, evbuffer_commit_space(output, &vec, 1));
+  return SerializeResult::OK;
+}
+
+template <class Output>
+void WriteFixedBytes(const std::string& in, Output* output) {
   output->append(in);
 }
 
+template <class Output>
 void WriteVarBytes(const std::string& in, size_t max_length,
-                   std::string* output) {
+                   Output* output) {
   CHECK_LE(in.size(), max_length);
 
   size_t prefix_length = internal::PrefixLength(max_length);
@@ -131,8 +170,9 @@ void WriteVarBytes(const std::string& in, size_t max_length,
   WriteFixedBytes(in, output);
 }
 
+template <class Output>
 SerializeResult WriteList(const repeated_string& in, size_t max_elem_length,
-                          size_t max_total_length, std::string* output) {
+                          size_t max_total_length, Output* output) {
   for (int i = 0; i < in.size(); ++i) {
     if (in.Get(i).empty())
       return SerializeResult::EMPTY_ELEM_IN_LIST;
@@ -152,24 +192,50 @@ SerializeResult WriteList(const repeated_string& in, size_t max_elem_length,
   return SerializeResult::OK;
 }
 
+template <class Output>
 SerializeResult WriteDigitallySigned(const DigitallySigned& sig,
-                                     std::string* output) {
+                                     Output* output) {
   SerializeResult res = CheckSignatureFormat(sig);
   if (res != SerializeResult::OK)
     return res;
-  WriteUint(sig.hash_algorithm(), constants::kHashAlgorithmLengthInBytes,
-            output);
-  WriteUint(sig.sig_algorithm(), constants::kSigAlgorithmLengthInBytes,
-            output);
-  WriteVarBytes(sig.signature(), constants::kMaxSignatureLength, output);
+  HashAlgorithmField::Write(sig.hash_algorithm(), output);
+  SigAlgorithmField::Write(sig.sig_algorithm(), output);
+  SignatureField::Write(sig.signature(), output);
   return SerializeResult::OK;
 }
 
+
+size_t DigitallySignedEncodedSize(const DigitallySigned& sig) {
+  return HashAlgorithmField::EncodedSize() + SigAlgorithmField::EncodedSize() +
+         SignatureField::EncodedSize(sig.signature());
+}
+
+// The Write*() functions for each output.
+template void WriteFixedBytes(const std::string& in, std::string* output);
+template void WriteVarBytes(const std::string& in, size_t max_length,
+                            std::string* output);
+template SerializeResult WriteList(const repeated_string& in,
+                                   size_t max_elem_length,
+                                   size_t max_total_length,
+                                   std::string* output);
+template SerializeResult WriteDigitallySigned(const DigitallySigned& sig,
+                                              std::string* output);
+
+template void WriteFixedBytes(const std::string& in, BufferWriter* output);
+template void WriteVarBytes(const std::string& in, size_t max_length,
+                            BufferWriter* output);
+template SerializeResult WriteList(const repeated_string& in,
+                                   size_t max_elem_length,
+                                   size_t max_total_length,
+                                   BufferWriter* output);
+template SerializeResult WriteDigitallySigned(const DigitallySigned& sig,
+                                              BufferWriter* output);
+
 namespace internal {
 
 size_t PrefixLength(size_t max_length) {
   CHECK_GT(max_length, 0U);
-  return ceil(log2(max_length) / float(8));
+  return PrefixLengthFor(max_length);
 }
 
 }  // namespace internal
@@ -184,7 +250,9 @@ size_t PrefixLength(size_t max_length) {
 
 
 using cert_trans::serialization::DeserializeResult;
-namespace constants = cert_trans::serialization::constants;
+using cert_trans::serialization::HashAlgorithmField;
+using cert_trans::serialization::SigAlgorithmField;
+using cert_trans::serialization::SignatureField;
 
 
 TLSDeserializer::TLSDeserializer(const std::string& input)
@@ -245,22 +313,22 @@ DeserializeResult TLSDeserializer::ReadList(size_t max_total_length,
 
 DeserializeResult TLSDeserializer::ReadDigitallySigned(DigitallySigned* sig) {
   int hash_algo = -1, sig_algo = -1;
-  if (!ReadUint(constants::kHashAlgorithmLengthInBytes, &hash_algo))
+  if (!HashAlgorithmField::Read(this, &hash_algo))
     return DeserializeResult::INPUT_TOO_SHORT;
   if (!ct::DigitallySigned_HashAlgorithm_IsValid(hash_algo))
     return DeserializeResult::INVALID_HASH_ALGORITHM;
-  if (!ReadUint(constants::kSigAlgorithmLengthInBytes, &sig_algo))
+  if (!SigAlgorithmField::Read(this, &sig_algo))
     return DeserializeResult::INPUT_TOO_SHORT;
   if (!ct::DigitallySigned_SignatureAlgorithm_IsValid(sig_algo))
     return DeserializeResult::INVALID_SIGNATURE_ALGORITHM;
 
   std::string sig_string;
-  if (!ReadVarBytes(constants::kMaxSignatureLength, &sig_string))
+  if (!SignatureField::Read(this, &sig_string))
     return DeserializeResult::INPUT_TOO_SHORT;
   sig->set_hash_algorithm(
       static_cast<DigitallySigned::HashAlgorithm>(hash_algo));
   sig->set_sig_algorithm(
       static_cast<DigitallySigned::SignatureAlgorithm>(sig_algo));
-  sig->set_signature(sig_string);
+  sig->mutable_signature()->swap(sig_string);
   return DeserializeResult::OK;
 }
@@ -2,12 +2,17 @@
 #define CERT_TRANS_PROTO_TLS_ENCODING_H_
 
 #include <glog/logging.h>
+#include <stdint.h>
+#include <string.h>
+#include <functional>
 #include <string>
 
 #include "proto/ct.pb.h"
 
 typedef google::protobuf::RepeatedPtrField<std::string> repeated_string;
 
+struct evbuffer;
+
 namespace cert_trans {
 
 namespace serialization {
@@ -56,11 +61,71 @@ enum class DeserializeResult {
 
 std::ostream& operator<<(std::ostream& stream, const DeserializeResult& r);
 
+// An output for the Write*() functions below, other than a string, that
+// writes into memory of a known size, or only counts the bytes when it
+// has none. Running the same serialization code once to count and then
+// again to write produces the result in a single pass over memory of
+// exactly the right size; see SerializeExactly().
+class BufferWriter {
+ public:
+  // Only counts the bytes written.
+  BufferWriter() : buffer_(nullptr), capacity_(0), size_(0) {
+  }
+
+  // Writes up to |capacity| bytes to |buffer|, which must remain valid.
+  BufferWriter(char* buffer, size_t capacity)
+      : buffer_(CHECK_NOTNULL(buffer)), capacity_(capacity), size_(0) {
+  }
+
+  BufferWriter(const BufferWriter&) = delete;
+  BufferWriter& operator=(const BufferWriter&) = delete;
+
+  // Number of bytes written (or counted) so far.
+  size_t size() const {
+    return size_;
+  }
+
+  void push_back(char c) {
+    append(&c, 1);
+  }
+
+  void append(const char* data, size_t length) {
+    if (buffer_) {
+      CHECK_LE(length, capacity_ - size_) << "BufferWriter overflow";
+      memcpy(buffer_ + size_, data, length);
+    }
+    size_ += length;
+  }
+
+  void append(const std::string& data) {
+    append(data.data(), data.size());
+  }
+
+ private:
+  char* const buffer_;
+  const size_t capacity_;
+  size_t size_;
+};
+
+typedef std::function<SerializeResult(BufferWriter* output)> WriteFunction;
+
+// Calls |write| once to count the bytes, then again to write them into
+// |result|, which is resized to exactly fit them. |write| must write
+// the same bytes both times. Clears |result| on error.
+SerializeResult SerializeExactly(const WriteFunction& write,
+                                 std::string* result);
+
+// As above, but appends to |output|, writing straight into space
+// reserved in it. Leaves |output| untouched on error.
+SerializeResult SerializeExactly(const WriteFunction& write,
+                                 evbuffer* output);
+
 ///////////////////////////////////////////////////////////////////////////////
 // Basic serialization functions.                                            //
 ///////////////////////////////////////////////////////////////////////////////
-template <class T>
-void WriteUint(T in, size_t bytes, std::string* output) {
+// These all write to either a std::string or a BufferWriter.
+template <class T, class Output>
+void WriteUint(T in, size_t bytes, Output* output) {
   CHECK_LE(bytes, sizeof(in));
   CHECK(bytes == sizeof(in) || in >> (bytes * 8) == 0);
   for (; bytes > 0; --bytes)
@@ -69,19 +134,22 @@ void WriteUint(T in, size_t bytes, std::string* output) {
 }
 
 // Fixed-length byte array.
-void WriteFixedBytes(const std::string& in, std::string* output);
+template <class Output>
+void WriteFixedBytes(const std::string& in, Output* output);
 
 // Variable-length byte array.
 // Caller is responsible for checking |in| <= max_length
 // TODO(ekasper): could return a bool instead.
-void WriteVarBytes(const std::string& in, size_t max_length,
-                   std::string* output);
+template <class Output>
+void WriteVarBytes(const std::string& in, size_t max_length, Output* output);
 
+template <class Output>
 SerializeResult WriteList(const repeated_string& in, size_t max_elem_length,
-                          size_t max_total_length, std::string* output);
+                          size_t max_total_length, Output* output);
 
+template <class Output>
 SerializeResult WriteDigitallySigned(const ct::DigitallySigned& sig,
-                                     std::string* output);
+                                     Output* output);
 
 namespace constants {
 static const size_t kMaxSignatureLength = (1 << 16) - 1;
@@ -94,6 +162,14 @@ namespace internal {
 // Returns the number of bytes needed to store a value up to max_length.
 size_t PrefixLength(size_t max_length);
 
+// As above, but usable at compile time, and also with integer
+// arithmetic only.
+constexpr size_t PrefixLengthFor(size_t max_length) {
+  return max_length <= 1 ? 0
+                         : 1 + PrefixLengthFor(max_length / 256 +
+                                               (max_length % 256 != 0));
+}
+
 }  // namespace internal
 
 }  // namespace serializer
@@ -124,6 +200,11 @@ class TLSDeserializer {
     return bytes_remaining_ == 0;
   }
 
+  // The number of bytes of input not read yet.
+  size_t BytesRemaining() const {
+    return bytes_remaining_;
+  }
+
   template <class T>
   bool ReadUint(size_t bytes, T* result) {
     if (bytes_remaining_ < bytes)
@@ -146,4 +227,106 @@ class TLSDeserializer {
 };
 
 
+namespace cert_trans {
+namespace serialization {
+
+
+// Codecs for the fields of TLS structures whose widths and limits are
+// known at compile time, so that their encoded sizes are constants or
+// simple sums, and writing or reading them needs no loops over a
+// width only known at run time. Computing the size of a structure
+// from those of its fields lets its serialization be written into
+// memory allocated once, up front.
+//
+// Like the Write*() functions above, Write() works with either a
+// std::string or a BufferWriter.
+
+// An unsigned integer of |kBytes| bytes.
+template <size_t kBytes>
+struct UintField {
+  static_assert(kBytes > 0 && kBytes <= 8, "invalid integer width");
+
+  static constexpr size_t EncodedSize() {
+    return kBytes;
+  }
+
+  template <class T, class Output>
+  static void Write(T in, Output* output) {
+    static_assert(kBytes <= sizeof(T), "integer too narrow");
+    uint64_t value(static_cast<uint64_t>(in));
+    char bytes[kBytes];
+    for (size_t i = kBytes; i > 0; --i) {
+      bytes[i - 1] = static_cast<char>(value & 0xff);
+      value >>= 8;
+    }
+    CHECK(kBytes == sizeof(T) || value == 0) << "integer too large";
+    output->append(bytes, kBytes);
+  }
+
+  template <class T>
+  static bool Read(TLSDeserializer* input, T* result) {
+    return input->ReadUint(kBytes, result);
+  }
+};
+
+
+// Opaque data of exactly |kLength| bytes. The caller is responsible
+// for checking the length of what it writes.
+template <size_t kLength>
+struct FixedBytesField {
+  static constexpr size_t EncodedSize() {
+    return kLength;
+  }
+
+  template <class Output>
+  static void Write(const std::string& in, Output* output) {
+    DCHECK_EQ(kLength, in.size());
+    output->append(in);
+  }
+
+  static bool Read(TLSDeserializer* input, std::string* result) {
+    return input->ReadFixedBytes(kLength, result);
+  }
+};
+
+
+// Opaque data of up to |kMaxLength| bytes, with a length prefix as
+// wide as that needs. The caller is responsible for checking the
+// length of what it writes.
+template <size_t kMaxLength>
+struct VarBytesField {
+  static constexpr size_t kPrefixLength =
+      internal::PrefixLengthFor(kMaxLength);
+  static_assert(kPrefixLength > 0, "invalid maximum length");
+
+  static size_t EncodedSize(const std::string& in) {
+    return kPrefixLength + in.size();
+  }
+
+  template <class Output>
+  static void Write(const std::string& in, Output* output) {
+    CHECK_LE(in.size(), kMaxLength);
+    UintField<kPrefixLength>::Write(in.size(), output);
+    output->append(in);
+  }
+
+  static bool Read(TLSDeserializer* input, std::string* result) {
+    size_t length;
+    if (!UintField<kPrefixLength>::Read(input, &length) ||
+        length > kMaxLength) {
+      return false;
+    }
+    return input->ReadFixedBytes(length, result);
+  }
+};
+
+
+// Returns the size of the serialization of |sig|, if it is valid.
+size_t DigitallySignedEncodedSize(const ct::DigitallySigned& sig);
+
+
+}  // namespace serialization
+}  // namespace cert_trans
+
+
 #endif
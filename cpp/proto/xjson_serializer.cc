@@ -8,6 +8,7 @@
 #include "proto/ct.pb.h"
 #include "proto/serializer.h"
 
+using cert_trans::serialization::BufferWriter;
 using cert_trans::serialization::SerializeResult;
 using cert_trans::serialization::DeserializeResult;
 using cert_trans::serialization::WriteDigitallySigned;
@@ -50,24 +51,23 @@ string V1LeafData(const LogEntry& entry) {
 }
 
 
-SerializeResult SerializeV1SCTSignatureInput(
+SerializeResult WriteV1SCTSignatureInput(
     const SignedCertificateTimestamp& sct, const LogEntry& entry,
-    string* result) {
+    BufferWriter* result) {
   CHECK_NOTNULL(result);
   if (sct.version() != ct::V1) {
     return SerializeResult::UNSUPPORTED_VERSION;
   }
-  const string json(entry.x_json_entry().json());
+  const string& json(entry.x_json_entry().json());
   SerializeResult res = CheckJsonFormat(json);
   if (res != SerializeResult::OK) {
     return res;
   }
-  const string extensions(sct.extensions());
+  const string& extensions(sct.extensions());
   res = CheckExtensionsFormat(extensions);
   if (res != SerializeResult::OK) {
     return res;
   }
-  result->clear();
   WriteUint(ct::V1, Serializer::kVersionLengthInBytes, result);
   WriteUint(ct::CERTIFICATE_TIMESTAMP, Serializer::kSignatureTypeLengthInBytes,
             result);
@@ -79,24 +79,23 @@ SerializeResult SerializeV1SCTSignatureInput(
 }
 
 
-SerializeResult SerializeV1SCTMerkleTreeLeaf(
+SerializeResult WriteV1SCTMerkleTreeLeaf(
     const ct::SignedCertificateTimestamp& sct, const ct::LogEntry& entry,
-    string* result) {
+    BufferWriter* result) {
   CHECK_NOTNULL(result);
   if (sct.version() != ct::V1) {
     return SerializeResult::UNSUPPORTED_VERSION;
   }
-  const string json(entry.x_json_entry().json());
+  const string& json(entry.x_json_entry().json());
   SerializeResult res = CheckJsonFormat(json);
   if (res != SerializeResult::OK) {
     return res;
   }
-  const string extensions(sct.extensions());
+  const string& extensions(sct.extensions());
   res = CheckExtensionsFormat(extensions);
   if (res != SerializeResult::OK) {
     return res;
   }
-  result->clear();
   WriteUint(ct::V1, Serializer::kVersionLengthInBytes, result);
   WriteUint(ct::TIMESTAMPED_ENTRY, Serializer::kMerkleLeafTypeLengthInBytes,
             result);
@@ -171,7 +170,7 @@ DeserializeResult DeserializeV1SCTMerkleTreeLeaf(TLSDeserializer* des,
 
 
 void ConfigureSerializerForV1XJSON() {
-  Serializer::ConfigureV1(V1LeafData, SerializeV1SCTSignatureInput,
-                          SerializeV1SCTMerkleTreeLeaf);
+  Serializer::ConfigureV1(V1LeafData, WriteV1SCTSignatureInput,
+                          WriteV1SCTMerkleTreeLeaf);
   Deserializer::Configure(DeserializeV1SCTMerkleTreeLeaf);
 }
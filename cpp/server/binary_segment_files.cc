@@ -0,0 +1,125 @@
+#include "server/binary_segment_files.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <glog/logging.h>
+#include <stdio.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "monitoring/monitoring.h"
+
+using std::string;
+using std::to_string;
+
+namespace cert_trans {
+namespace {
+
+
+Counter<string>* binary_segment_files_opened = Counter<string>::New(
+    "binary_segment_files_opened", "source",
+    "Number of binary get-entries segment files opened to be sent, "
+    "broken down by whether they had to be rendered first.");
+
+
+// Writes all of |data| to |fd|, returning false on error.
+bool WriteFully(int fd, const string& data) {
+  size_t written(0);
+  while (written < data.size()) {
+    const ssize_t num_written(
+        write(fd, data.data() + written, data.size() - written));
+    if (num_written < 0 && errno != EINTR) {
+      return false;
+    }
+    if (num_written > 0) {
+      written += num_written;
+    }
+  }
+  return true;
+}
+
+
+// Opens the file at |path| for reading, setting |size| to its size, or
+// returns -1 if there is no such file.
+int OpenFile(const string& path, uint64_t* size) {
+  const int fd(open(path.c_str(), O_RDONLY | O_CLOEXEC));
+  if (fd < 0) {
+    if (errno != ENOENT) {
+      PLOG(WARNING) << "Failed to open " << path;
+    }
+    return -1;
+  }
+  struct stat st;
+  PCHECK(fstat(fd, &st) == 0);
+  *size = st.st_size;
+  return fd;
+}
+
+
+}  // namespace
+
+
+BinarySegmentFiles::BinarySegmentFiles(const string& dir,
+                                       int64_t entries_per_segment)
+    : dir_(dir), entries_per_segment_(entries_per_segment) {
+  CHECK(!dir_.empty());
+  CHECK_GT(entries_per_segment_, 0);
+}
+
+
+bool BinarySegmentFiles::IsSegment(int64_t start, int64_t end) const {
+  return start >= 0 && start % entries_per_segment_ == 0 &&
+         end == start + entries_per_segment_ - 1;
+}
+
+
+int BinarySegmentFiles::Open(int64_t start, bool include_scts,
+                             const Renderer& render, uint64_t* size) {
+  CHECK_EQ(start % entries_per_segment_, 0);
+  CHECK_NOTNULL(size);
+  const string path(Path(start, include_scts));
+  int fd(OpenFile(path, size));
+  if (fd >= 0) {
+    binary_segment_files_opened->Increment("file");
+    return fd;
+  }
+
+  string body;
+  if (!render(&body)) {
+    return -1;
+  }
+
+  // Written under another name and renamed once complete, so that
+  // readers never see a partial file. Two requests rendering the same
+  // segment at once write the same thing, so either can win.
+  string tmp_path(dir_ + "/segmentXXXXXX");
+  const int tmp_fd(mkstemp(&tmp_path[0]));
+  if (tmp_fd < 0) {
+    PLOG(WARNING) << "Failed to create a file in " << dir_;
+    return -1;
+  }
+  const bool written(WriteFully(tmp_fd, body) && fchmod(tmp_fd, 0644) == 0 &&
+                     fdatasync(tmp_fd) == 0);
+  close(tmp_fd);
+  if (!written || rename(tmp_path.c_str(), path.c_str()) != 0) {
+    PLOG(WARNING) << "Failed to write " << path;
+    unlink(tmp_path.c_str());
+    return -1;
+  }
+
+  fd = OpenFile(path, size);
+  if (fd >= 0) {
+    binary_segment_files_opened->Increment("rendered");
+  }
+  return fd;
+}
+
+
+string BinarySegmentFiles::Path(int64_t start, bool include_scts) const {
+  return dir_ + "/" + to_string(start) + "-" +
+         to_string(start + entries_per_segment_ - 1) +
+         (include_scts ? "-scts" : "") + ".bin";
+}
+
+
+}  // namespace cert_trans
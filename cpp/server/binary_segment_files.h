@@ -0,0 +1,59 @@
+#ifndef CERT_TRANS_SERVER_BINARY_SEGMENT_FILES_H_
+#define CERT_TRANS_SERVER_BINARY_SEGMENT_FILES_H_
+
+#include <stdint.h>
+#include <functional>
+#include <string>
+
+namespace cert_trans {
+
+
+// Keeps the binary get-entries response bodies (see
+// proto/binary_entries.h) for aligned ranges of entries, or segments,
+// in files, so that they can be sent from the page cache with
+// sendfile(), rather than being encoded and copied through user space
+// for each request. The files are written the first time a segment is
+// asked for, and never changed afterwards, so only segments of entries
+// that cannot change anymore must be asked for.
+//
+// This class is thread-safe.
+class BinarySegmentFiles {
+ public:
+  // Sets |body| to the response body for the segment, returning false
+  // if it cannot be rendered (e.g. because some of its entries are
+  // missing).
+  typedef std::function<bool(std::string* body)> Renderer;
+
+  // The files are kept in |dir|, which must exist, with
+  // |entries_per_segment| entries in each.
+  BinarySegmentFiles(const std::string& dir, int64_t entries_per_segment);
+  BinarySegmentFiles(const BinarySegmentFiles&) = delete;
+  BinarySegmentFiles& operator=(const BinarySegmentFiles&) = delete;
+
+  int64_t entries_per_segment() const {
+    return entries_per_segment_;
+  }
+
+  // Whether the entries from |start| to |end| inclusive are exactly
+  // one segment.
+  bool IsSegment(int64_t start, int64_t end) const;
+
+  // Returns a file descriptor, which the caller must close, for the
+  // file of the segment starting at |start|, with or without the SCTs
+  // of its entries, setting |size| to its size. If there is no such
+  // file yet, it is written with the body from |render| first. Returns
+  // -1 if that fails.
+  int Open(int64_t start, bool include_scts, const Renderer& render,
+           uint64_t* size);
+
+ private:
+  std::string Path(int64_t start, bool include_scts) const;
+
+  const std::string dir_;
+  const int64_t entries_per_segment_;
+};
+
+
+}  // namespace cert_trans
+
+#endif  // CERT_TRANS_SERVER_BINARY_SEGMENT_FILES_H_
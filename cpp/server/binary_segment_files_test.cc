@@ -0,0 +1,99 @@
+#include "server/binary_segment_files.h"
+
+#include <gtest/gtest.h>
+#include <unistd.h>
+#include <string>
+
+#include "util/test_db.h"
+#include "util/testing.h"
+
+namespace cert_trans {
+namespace {
+
+using std::string;
+
+
+// Reads the whole of |fd|, and closes it.
+string ReadAndClose(int fd) {
+  string data;
+  char buffer[256];
+  ssize_t num_read;
+  while ((num_read = read(fd, buffer, sizeof(buffer))) > 0) {
+    data.append(buffer, num_read);
+  }
+  close(fd);
+  return data;
+}
+
+
+class BinarySegmentFilesTest : public ::testing::Test {
+ protected:
+  BinarySegmentFilesTest() : files_(tmp_.TmpStorageDir(), 10) {
+  }
+
+  TmpStorage tmp_;
+  BinarySegmentFiles files_;
+};
+
+
+TEST_F(BinarySegmentFilesTest, IsSegment) {
+  EXPECT_TRUE(files_.IsSegment(0, 9));
+  EXPECT_TRUE(files_.IsSegment(20, 29));
+  EXPECT_FALSE(files_.IsSegment(0, 8));
+  EXPECT_FALSE(files_.IsSegment(0, 10));
+  EXPECT_FALSE(files_.IsSegment(5, 14));
+  EXPECT_FALSE(files_.IsSegment(-10, -1));
+}
+
+
+TEST_F(BinarySegmentFilesTest, RendersOnce) {
+  int renders(0);
+  const auto render([&renders](string* body) {
+    ++renders;
+    *body = "segment body";
+    return true;
+  });
+
+  uint64_t size;
+  int fd(files_.Open(10, false, render, &size));
+  ASSERT_GE(fd, 0);
+  EXPECT_EQ(12U, size);
+  EXPECT_EQ("segment body", ReadAndClose(fd));
+  EXPECT_EQ(1, renders);
+
+  fd = files_.Open(10, false, render, &size);
+  ASSERT_GE(fd, 0);
+  EXPECT_EQ("segment body", ReadAndClose(fd));
+  EXPECT_EQ(1, renders);
+
+  // With SCTs is a different file.
+  fd = files_.Open(10, true, render, &size);
+  ASSERT_GE(fd, 0);
+  close(fd);
+  EXPECT_EQ(2, renders);
+}
+
+
+TEST_F(BinarySegmentFilesTest, FailedRenderLeavesNoFile) {
+  uint64_t size;
+  EXPECT_EQ(-1, files_.Open(0, false, [](string*) { return false; }, &size));
+
+  const int fd(files_.Open(0, false,
+                           [](string* body) {
+                             *body = "later";
+                             return true;
+                           },
+                           &size));
+  ASSERT_GE(fd, 0);
+  EXPECT_EQ("later", ReadAndClose(fd));
+}
+
+
+}  // namespace
+}  // namespace cert_trans
+
+
+int main(int argc, char** argv) {
+  cert_trans::test::InitTesting(argv[0], &argc, &argv, true);
+  return RUN_ALL_TESTS();
+}
@@ -1,55 +1,95 @@
+#include <event2/buffer.h>
+#include <gflags/gflags.h>
+#include <glog/logging.h>
+#include <string.h>
 #include <functional>
+#include <map>
+#include <mutex>
+#include <utility>
+#include <vector>
 
 #include "log/frontend.h"
 #include "server/certificate_handler.h"
 #include "server/json_output.h"
+#include "util/compression.h"
 #include "util/json_wrapper.h"
 #include "util/status.h"
+#include "monitoring/monitoring.h"
+#include "util/task.h"
 #include "util/thread_pool.h"
+#include "util/tracing.h"
+
+DEFINE_int32(max_pending_submissions, 1000,
+             "maximum number of add-chain and add-pre-chain requests "
+             "waiting to be verified; further requests are rejected "
+             "with a 503 until the backlog drains, 0 for no limit");
+DEFINE_int32(max_chains_per_batch_submission, 0,
+             "if positive, also accept add-chains and add-pre-chains "
+             "requests, which submit up to this many chains at once and "
+             "get an SCT for each; each chain counts against "
+             "--max_pending_submissions");
 
 namespace cert_trans {
 
 using ct::LogEntry;
 using ct::SignedCertificateTimestamp;
 using std::bind;
+using std::lock_guard;
 using std::make_shared;
 using std::move;
 using std::multimap;
+using std::mutex;
+using std::pair;
 using std::placeholders::_1;
 using std::shared_ptr;
 using std::string;
 using std::unique_ptr;
+using std::vector;
 using util::Status;
 
 
 namespace {
 
 
-bool ExtractChain(libevent::Base* base, evhttp_request* req,
-                  CertChain* chain) {
+static Counter<>* rejected_submissions(
+    Counter<>::New("rejected_submissions",
+                   "Number of add-chain and add-pre-chain requests "
+                   "rejected because too many were already pending."));
+
+
+// Replies with an error and returns false if |req| is not a POST.
+bool CheckPost(libevent::Base* base, evhttp_request* req) {
   if (evhttp_request_get_command(req) != EVHTTP_REQ_POST) {
     SendJsonError(base, req, HTTP_BADMETHOD, "Method not allowed.");
     return false;
   }
+  return true;
+}
 
-  // TODO(pphaneuf): Should we check that Content-Type says
-  // "application/json", as recommended by RFC4627?
-  JsonObject json_body(evhttp_request_get_input_buffer(req));
-  if (!json_body.Ok() || !json_body.IsType(json_type_object)) {
-    SendJsonError(base, req, HTTP_BADREQUEST,
-                  "Unable to parse provided JSON.");
-    return false;
+
+// Parses the body of |req|, which must be a POST with a JSON object.
+unique_ptr<JsonObject> ExtractBody(libevent::Base* base,
+                                   evhttp_request* req) {
+  if (!CheckPost(base, req)) {
+    return nullptr;
   }
 
-  JsonArray json_chain(json_body, "chain");
-  if (!json_chain.Ok()) {
+  // TODO(pphaneuf): Should we check that Content-Type says
+  // "application/json", as recommended by RFC4627?
+  unique_ptr<JsonObject> json_body(
+      new JsonObject(evhttp_request_get_input_buffer(req)));
+  if (!json_body->Ok() || !json_body->IsType(json_type_object)) {
     SendJsonError(base, req, HTTP_BADREQUEST,
                   "Unable to parse provided JSON.");
-    return false;
+    return nullptr;
   }
+  return json_body;
+}
 
-  VLOG(2) << "ExtractChain chain:\n" << json_chain.DebugString();
 
+// Adds the certificates of |json_chain| to |chain|.
+bool AddCerts(libevent::Base* base, evhttp_request* req,
+              const JsonArray& json_chain, CertChain* chain) {
   for (int i = 0; i < json_chain.Length(); ++i) {
     JsonString json_cert(json_chain, i);
     if (!json_cert.Ok()) {
@@ -72,6 +112,252 @@ bool ExtractChain(libevent::Base* base, evhttp_request* req,
 }
 
 
+const char* SkipWhitespace(const char* p, const char* end) {
+  while (p < end && (*p == ' ' || *p == '\t' || *p == '\n' || *p == '\r')) {
+    ++p;
+  }
+  return p;
+}
+
+
+// Decodes the certificates of an add-chain or add-pre-chain body in
+// |buffer| straight to the end of |der|, adding the offset and size of
+// each to |certs|, without building a JSON tree or a string for each
+// of them. Only the form clients send in practice is understood, that
+// is, {"chain": ["<base 64>", ...]}, without escapes, and false is
+// returned for anything else, to be left to the JSON parser.
+bool DecodeChain(evbuffer* buffer, string* der,
+                 vector<pair<size_t, size_t>>* certs) {
+  const size_t length(evbuffer_get_length(buffer));
+  // This only copies if the body came in several chunks.
+  const char* p(
+      reinterpret_cast<const char*>(evbuffer_pullup(buffer, length)));
+  if (!p) {
+    return false;
+  }
+  const char* const end(p + length);
+  // The certificates are smaller than their base 64, and so than the
+  // body.
+  der->reserve(length / 4 * 3);
+
+  static const char kPrefix[] = "\"chain\"";
+  p = SkipWhitespace(p, end);
+  if (p == end || *p++ != '{') {
+    return false;
+  }
+  p = SkipWhitespace(p, end);
+  if (end - p < static_cast<ptrdiff_t>(sizeof(kPrefix) - 1) ||
+      memcmp(p, kPrefix, sizeof(kPrefix) - 1) != 0) {
+    return false;
+  }
+  p = SkipWhitespace(p + sizeof(kPrefix) - 1, end);
+  if (p == end || *p++ != ':') {
+    return false;
+  }
+  p = SkipWhitespace(p, end);
+  if (p == end || *p++ != '[') {
+    return false;
+  }
+  p = SkipWhitespace(p, end);
+  if (p != end && *p == ']') {
+    ++p;
+  } else {
+    while (true) {
+      if (p == end || *p++ != '"') {
+        return false;
+      }
+      const char* const quote(
+          static_cast<const char*>(memchr(p, '"', end - p)));
+      if (!quote || memchr(p, '\\', quote - p)) {
+        return false;
+      }
+      const size_t offset(der->size());
+      if (!util::AppendFromBase64(p, quote - p, der)) {
+        return false;
+      }
+      certs->emplace_back(offset, der->size() - offset);
+      p = SkipWhitespace(quote + 1, end);
+      if (p == end) {
+        return false;
+      }
+      if (*p == ']') {
+        ++p;
+        break;
+      }
+      if (*p++ != ',') {
+        return false;
+      }
+      p = SkipWhitespace(p, end);
+    }
+  }
+  p = SkipWhitespace(p, end);
+  if (p == end || *p++ != '}') {
+    return false;
+  }
+  return SkipWhitespace(p, end) == end;
+}
+
+
+bool ExtractChain(libevent::Base* base, evhttp_request* req,
+                  CertChain* chain) {
+  ScopedSpan span("parse-chain");
+  if (!CheckPost(base, req)) {
+    return false;
+  }
+
+  // The certificates are parsed from one buffer holding all of them.
+  string der;
+  vector<pair<size_t, size_t>> certs;
+  if (DecodeChain(evhttp_request_get_input_buffer(req), &der, &certs)) {
+    for (const auto& cert_span : certs) {
+      unique_ptr<Cert> cert(
+          Cert::FromDer(der.data() + cert_span.first, cert_span.second));
+      if (!cert) {
+        SendJsonError(base, req, HTTP_BADREQUEST,
+                      "Unable to parse provided chain.");
+        return false;
+      }
+      chain->AddCert(move(cert));
+    }
+    return true;
+  }
+
+  const unique_ptr<JsonObject> json_body(ExtractBody(base, req));
+  if (!json_body) {
+    return false;
+  }
+
+  JsonArray json_chain(*json_body, "chain");
+  if (!json_chain.Ok()) {
+    SendJsonError(base, req, HTTP_BADREQUEST,
+                  "Unable to parse provided JSON.");
+    return false;
+  }
+
+  VLOG(2) << "ExtractChain chain:\n" << json_chain.DebugString();
+
+  return AddCerts(base, req, json_chain, chain);
+}
+
+
+// Fills |chains| with the chains of an add-chains or add-pre-chains
+// request, which has a "chains" array of arrays of certificates.
+bool ExtractChains(libevent::Base* base, evhttp_request* req, bool precert,
+                   vector<unique_ptr<CertChain>>* chains) {
+  ScopedSpan span("parse-chains");
+  const unique_ptr<JsonObject> json_body(ExtractBody(base, req));
+  if (!json_body) {
+    return false;
+  }
+
+  JsonArray json_chains(*json_body, "chains");
+  if (!json_chains.Ok()) {
+    SendJsonError(base, req, HTTP_BADREQUEST,
+                  "Unable to parse provided JSON.");
+    return false;
+  }
+  if (json_chains.Length() == 0 ||
+      json_chains.Length() > FLAGS_max_chains_per_batch_submission) {
+    SendJsonError(base, req, HTTP_BADREQUEST, "Missing or too many chains.");
+    return false;
+  }
+
+  for (int i = 0; i < json_chains.Length(); ++i) {
+    JsonArray json_chain(json_chains, i);
+    if (!json_chain.Ok()) {
+      SendJsonError(base, req, HTTP_BADREQUEST,
+                    "Unable to parse provided JSON.");
+      return false;
+    }
+    chains->emplace_back(precert ? new PreCertChain : new CertChain);
+    if (!AddCerts(base, req, json_chain, chains->back().get())) {
+      return false;
+    }
+  }
+
+  return true;
+}
+
+
+// The get-roots responses for a set of trusted certificates, rendered
+// once and then shared by every handler of the process (e.g. those of
+// the several logs it serves), so that clients polling get-roots cost
+// next to nothing.
+class RootsResponses {
+ public:
+  // Returns the body of a get-roots response listing |trusted|,
+  // encoded with |encoding|, or nullptr if it could not be made.
+  shared_ptr<const string> Get(
+      const shared_ptr<const CertChecker::TrustedCertificates>& trusted,
+      ContentEncoding encoding);
+
+ private:
+  shared_ptr<const string> GetLocked(ContentEncoding encoding);
+
+  mutex lock_;
+  // What |bodies_| are for. Since a set of trusted certificates never
+  // changes, it is enough to compare the pointers.
+  shared_ptr<const CertChecker::TrustedCertificates> trusted_;
+  std::map<ContentEncoding, shared_ptr<const string>> bodies_;
+};
+
+
+shared_ptr<const string> RootsResponses::Get(
+    const shared_ptr<const CertChecker::TrustedCertificates>& trusted,
+    ContentEncoding encoding) {
+  lock_guard<mutex> lock(lock_);
+  if (trusted != trusted_) {
+    trusted_ = trusted;
+    bodies_.clear();
+  }
+  return GetLocked(encoding);
+}
+
+
+shared_ptr<const string> RootsResponses::GetLocked(ContentEncoding encoding) {
+  const auto it(bodies_.find(encoding));
+  if (it != bodies_.end()) {
+    return it->second;
+  }
+
+  shared_ptr<const string> body;
+  if (encoding == ContentEncoding::IDENTITY) {
+    JsonArray roots;
+    for (const auto& trusted_cert : *trusted_) {
+      string cert;
+      if (trusted_cert.second->DerEncoding(&cert) != ::util::OkStatus()) {
+        LOG(ERROR) << "Cert encoding failed";
+        return nullptr;
+      }
+      roots.AddBase64(cert);
+    }
+
+    JsonObject json_reply;
+    json_reply.Add("certificates", roots);
+    body = make_shared<const string>(json_reply.ToJson());
+  } else {
+    const shared_ptr<const string> identity(
+        GetLocked(ContentEncoding::IDENTITY));
+    string compressed;
+    if (!identity || !Compress(encoding, *identity, &compressed)) {
+      return nullptr;
+    }
+    body = make_shared<const string>(move(compressed));
+  }
+  bodies_[encoding] = body;
+  return body;
+}
+
+
+RootsResponses* roots_responses(new RootsResponses);
+
+
+// Frees the reference to a shared response body held by an evbuffer.
+void ReleaseSharedBody(const void* /*data*/, size_t /*len*/, void* body) {
+  delete static_cast<shared_ptr<const string>*>(body);
+}
+
+
 CertSubmissionHandler* MaybeCreateSubmissionHandler(
     const CertChecker* checker) {
   if (checker != nullptr) {
@@ -84,16 +370,48 @@ CertSubmissionHandler* MaybeCreateSubmissionHandler(
 }  // namespace
 
 
+struct CertificateHttpHandler::BatchSubmission {
+  BatchSubmission(evhttp_request* r, bool p)
+      : req(r), precert(p), remaining(0) {
+  }
+
+  evhttp_request* const req;
+  const bool precert;
+  // PreCertChain if |precert| is set.
+  vector<unique_ptr<CertChain>> chains;
+  // Set by BlockingVerifyBatchedChain(), each to its own index.
+  vector<Status> pre_statuses;
+  vector<LogEntry> entries;
+  // The SCTs of the chains found to be logged before verifying them.
+  vector<SignedCertificateTimestamp> known_scts;
+  // Number of chains still to verify.
+  std::atomic<size_t> remaining;
+};
+
+
 CertificateHttpHandler::CertificateHttpHandler(
     LogLookup* log_lookup, const ReadOnlyDatabase* db,
     const ClusterStateController* controller, const CertChecker* cert_checker,
     Frontend* frontend, ThreadPool* pool, libevent::Base* event_base,
     StalenessTracker* staleness_tracker)
+    : CertificateHttpHandler(log_lookup, db, controller, cert_checker,
+                             frontend, pool, nullptr, event_base,
+                             staleness_tracker) {
+}
+
+
+CertificateHttpHandler::CertificateHttpHandler(
+    LogLookup* log_lookup, const ReadOnlyDatabase* db,
+    const ClusterStateController* controller, const CertChecker* cert_checker,
+    Frontend* frontend, ThreadPool* pool, ThreadPool* submission_pool,
+    libevent::Base* event_base, StalenessTracker* staleness_tracker)
     : HttpHandler(log_lookup, db, controller, pool, event_base,
                   staleness_tracker),
       cert_checker_(cert_checker),
       submission_handler_(MaybeCreateSubmissionHandler(cert_checker_)),
-      frontend_(frontend) {
+      frontend_(frontend),
+      submission_pool_(submission_pool ? submission_pool : pool),
+      pending_submissions_(0) {
 }
 
 
@@ -110,10 +428,21 @@ void CertificateHttpHandler::AddHandlers(libevent::HttpServer* server) {
     // more up-to-date node will have a better chance of handling dupes
     // correctly, rather than bloating the tree.
     AddProxyWrappedHandler(server, "/ct/v1/add-chain",
-                           bind(&CertificateHttpHandler::AddChain, this, _1));
+                           bind(&CertificateHttpHandler::AddChain, this, _1),
+                           LocalDataCheck(), RequestClass::WRITE);
     AddProxyWrappedHandler(server, "/ct/v1/add-pre-chain",
                            bind(&CertificateHttpHandler::AddPreChain, this,
-                                _1));
+                                _1),
+                           LocalDataCheck(), RequestClass::WRITE);
+  }
+  if (frontend_ && FLAGS_max_chains_per_batch_submission > 0) {
+    AddProxyWrappedHandler(server, "/ct/v1/add-chains",
+                           bind(&CertificateHttpHandler::AddChains, this, _1),
+                           LocalDataCheck(), RequestClass::WRITE);
+    AddProxyWrappedHandler(server, "/ct/v1/add-pre-chains",
+                           bind(&CertificateHttpHandler::AddPreChains, this,
+                                _1),
+                           LocalDataCheck(), RequestClass::WRITE);
   }
 }
 
@@ -124,21 +453,34 @@ void CertificateHttpHandler::GetRoots(evhttp_request* req) const {
                          "Method not allowed.");
   }
 
-  JsonArray roots;
-  for (const auto& trusted_cert : cert_checker_->GetTrustedCertificates()) {
-    string cert;
-    if (trusted_cert.second->DerEncoding(&cert) != ::util::OkStatus()) {
-      LOG(ERROR) << "Cert encoding failed";
-      return SendJsonError(event_base_, req, HTTP_INTERNAL,
-                           "Serialisation failed.");
+  const shared_ptr<const CertChecker::TrustedCertificates> trusted(
+      cert_checker_->GetTrustedCertificates());
+  const shared_ptr<const string> body(
+      roots_responses->Get(trusted, ContentEncoding::IDENTITY));
+  if (!body) {
+    return SendJsonError(event_base_, req, HTTP_INTERNAL,
+                         "Serialisation failed.");
+  }
+  ContentEncoding encoding(ResponseEncoding(req, body->size()));
+  shared_ptr<const string> encoded_body(body);
+  if (encoding != ContentEncoding::IDENTITY) {
+    encoded_body = roots_responses->Get(trusted, encoding);
+    if (!encoded_body) {
+      // Send it uncompressed, then.
+      encoding = ContentEncoding::IDENTITY;
+      encoded_body = body;
     }
-    roots.AddBase64(cert);
   }
 
-  JsonObject json_reply;
-  json_reply.Add("certificates", roots);
-
-  SendJsonReply(event_base_, req, HTTP_OK, json_reply);
+  // Hand the shared body over to libevent without copying it, keeping
+  // a reference until it is done with it.
+  evbuffer* const buffer(CHECK_NOTNULL(evbuffer_new()));
+  CHECK_EQ(0, evbuffer_add_reference(
+                  buffer, encoded_body->data(), encoded_body->size(),
+                  &ReleaseSharedBody,
+                  new shared_ptr<const string>(encoded_body)));
+  SendJsonReply(event_base_, req, HTTP_OK, encoding, buffer);
+  evbuffer_free(buffer);
 }
 
 
@@ -148,7 +490,11 @@ void CertificateHttpHandler::AddChain(evhttp_request* req) {
     return;
   }
 
-  pool_->Add(
+  if (!StartSubmission(req, 1)) {
+    return;
+  }
+
+  submission_pool_->Add(
       bind(&CertificateHttpHandler::BlockingAddChain, this, req, chain));
 }
 
@@ -159,19 +505,113 @@ void CertificateHttpHandler::AddPreChain(evhttp_request* req) {
     return;
   }
 
-  pool_->Add(
+  if (!StartSubmission(req, 1)) {
+    return;
+  }
+
+  submission_pool_->Add(
       bind(&CertificateHttpHandler::BlockingAddPreChain, this, req, chain));
 }
 
 
+void CertificateHttpHandler::AddChains(evhttp_request* req) {
+  AddChainBatch(req, false);
+}
+
+
+void CertificateHttpHandler::AddPreChains(evhttp_request* req) {
+  AddChainBatch(req, true);
+}
+
+
+void CertificateHttpHandler::AddChainBatch(evhttp_request* req,
+                                           bool precert) {
+  const shared_ptr<BatchSubmission> batch(
+      make_shared<BatchSubmission>(req, precert));
+  if (!ExtractChains(event_base_, req, precert, &batch->chains)) {
+    return;
+  }
+
+  const size_t count(batch->chains.size());
+  if (!StartSubmission(req, count)) {
+    return;
+  }
+
+  batch->pre_statuses.resize(count);
+  batch->entries.resize(count);
+  batch->known_scts.resize(count);
+  batch->remaining = count;
+  // The chains are verified separately, so that a batch is spread
+  // over the pool, and the last one submits them all together.
+  for (size_t i = 0; i < count; ++i) {
+    submission_pool_->Add(
+        bind(&CertificateHttpHandler::BlockingVerifyBatchedChain, this,
+             batch, i));
+  }
+}
+
+
+bool CertificateHttpHandler::StartSubmission(evhttp_request* req,
+                                             int count) {
+  const int pending(pending_submissions_.fetch_add(count));
+  if (FLAGS_max_pending_submissions > 0 &&
+      pending + count > FLAGS_max_pending_submissions) {
+    FinishSubmission(count);
+    rejected_submissions->Increment();
+    // This sets a Retry-After header.
+    SendJsonError(event_base_, req, HTTP_SERVUNAVAIL,
+                  "Too many pending submissions.");
+    return false;
+  }
+  return true;
+}
+
+
+void CertificateHttpHandler::FinishSubmission(int count) const {
+  CHECK_GE(pending_submissions_.fetch_sub(count), count);
+}
+
+
+bool CertificateHttpHandler::LookupResubmission(
+    const CertChain& chain, LogEntry* entry, Status* status,
+    SignedCertificateTimestamp* sct) const {
+  // The leaf hash of an X509_ENTRY only depends on the leaf, so that
+  // resubmissions can be answered before building and verifying the
+  // chain, which is most of the cost of a submission. The leaf was
+  // checked when it was first logged.
+  ScopedSpan span("lookup-resubmission");
+  entry->set_type(ct::X509_ENTRY);
+  return chain.IsLoaded() &&
+         chain.LeafCert()->DerEncoding(
+             entry->mutable_x509_entry()->mutable_leaf_certificate()) ==
+             ::util::OkStatus() &&
+         frontend_->LookupSubmittedEntry(*entry, status, sct);
+}
+
+
 void CertificateHttpHandler::BlockingAddChain(
     evhttp_request* req, const shared_ptr<CertChain>& chain) const {
   SignedCertificateTimestamp sct;
+  if (util::DeadlineExceeded()) {
+    FinishSubmission(1);
+    return AddEntryReply(req,
+                         Status(util::error::DEADLINE_EXCEEDED,
+                                "Request deadline exceeded."),
+                         sct);
+  }
 
   LogEntry entry;
-  const Status status(frontend_->QueueProcessedEntry(
-      submission_handler_->ProcessX509Submission(chain.get(), &entry), entry,
-      &sct));
+  Status status;
+  if (LookupResubmission(*chain, &entry, &status, &sct)) {
+    // This only updates the stats.
+    frontend_->QueueProcessedEntry(status, entry, &sct);
+  } else {
+    entry.Clear();
+    status = frontend_->QueueProcessedEntry(
+        submission_handler_->ProcessX509Submission(chain.get(), &entry),
+        entry, &sct);
+  }
+  FinishSubmission(1);
 
   AddEntryReply(req, status, sct);
 }
@@ -180,14 +620,60 @@ void CertificateHttpHandler::BlockingAddChain(
 void CertificateHttpHandler::BlockingAddPreChain(
     evhttp_request* req, const shared_ptr<PreCertChain>& chain) const {
   SignedCertificateTimestamp sct;
+  if (util::DeadlineExceeded()) {
+    FinishSubmission(1);
+    return AddEntryReply(req,
+                         Status(util::error::DEADLINE_EXCEEDED,
+                                "Request deadline exceeded."),
+                         sct);
+  }
 
   LogEntry entry;
   const Status status(frontend_->QueueProcessedEntry(
       submission_handler_->ProcessPreCertSubmission(chain.get(), &entry),
       entry, &sct));
+  FinishSubmission(1);
 
   AddEntryReply(req, status, sct);
 }
 
 
+void CertificateHttpHandler::BlockingVerifyBatchedChain(
+    const shared_ptr<BatchSubmission>& batch, size_t index) const {
+  LogEntry* const entry(&batch->entries[index]);
+  if (util::DeadlineExceeded()) {
+    entry->set_type(batch->precert ? ct::PRECERT_ENTRY : ct::X509_ENTRY);
+    batch->pre_statuses[index] = Status(util::error::DEADLINE_EXCEEDED,
+                                        "Request deadline exceeded.");
+  } else if (batch->precert) {
+    batch->pre_statuses[index] = submission_handler_->ProcessPreCertSubmission(
+        static_cast<PreCertChain*>(batch->chains[index].get()), entry);
+  } else if (!LookupResubmission(*batch->chains[index], entry,
+                                  &batch->pre_statuses[index],
+                                  &batch->known_scts[index])) {
+    entry->Clear();
+    batch->pre_statuses[index] = submission_handler_->ProcessX509Submission(
+        batch->chains[index].get(), entry);
+  }
+  if (batch->remaining.fetch_sub(1) > 1) {
+    return;
+  }
+
+  vector<SignedCertificateTimestamp> scts;
+  vector<Status> statuses;
+  frontend_->QueueProcessedEntries(batch->pre_statuses, batch->entries, &scts,
+                                   &statuses);
+  // The entries not submitted have no SCT, but those found to be
+  // logged already.
+  for (size_t i = 0; i < scts.size(); ++i) {
+    if (!batch->pre_statuses[i].ok()) {
+      scts[i] = batch->known_scts[i];
+    }
+  }
+  FinishSubmission(batch->chains.size());
+
+  AddEntriesReply(batch->req, statuses, scts);
+}
+
+
 }  // namespace cert_trans
@@ -1,6 +1,9 @@
 #ifndef CERT_TRANS_SERVER_CERTIFICATE_HANDLER_H_
 #define CERT_TRANS_SERVER_CERTIFICATE_HANDLER_H_
 
+#include <atomic>
+#include <memory>
+
 #include "log/cert_submission_handler.h"
 #include "log/database.h"
 #include "log/logged_entry.h"
@@ -22,6 +25,17 @@ class CertificateHttpHandler : public HttpHandler {
                          ThreadPool* pool, libevent::Base* event_base,
                          StalenessTracker* staleness_tracker);
 
+  // As above, but "add-chain" and "add-pre-chain" requests are
+  // verified on |submission_pool| rather than |pool|, so that a burst
+  // of submissions does not hold up read requests. If NULL, |pool| is
+  // used for those too.
+  CertificateHttpHandler(LogLookup* log_lookup, const ReadOnlyDatabase* db,
+                         const ClusterStateController* controller,
+                         const CertChecker* cert_checker, Frontend* frontend,
+                         ThreadPool* pool, ThreadPool* submission_pool,
+                         libevent::Base* event_base,
+                         StalenessTracker* staleness_tracker);
+
   ~CertificateHttpHandler() = default;
   CertificateHttpHandler(const CertificateHttpHandler&) = delete;
   CertificateHttpHandler& operator=(const CertificateHttpHandler&) = delete;
@@ -30,18 +44,47 @@ class CertificateHttpHandler : public HttpHandler {
   void AddHandlers(libevent::HttpServer* server) override;
 
  private:
+  struct BatchSubmission;
+
   const CertChecker* const cert_checker_;
   const std::unique_ptr<CertSubmissionHandler> submission_handler_;
   Frontend* const frontend_;
+  ThreadPool* const submission_pool_;
+  // Number of submissions queued or being processed on
+  // |submission_pool_|.
+  mutable std::atomic<int> pending_submissions_;
 
   void GetRoots(evhttp_request* req) const;
   void AddChain(evhttp_request* req);
   void AddPreChain(evhttp_request* req);
+  // Non-standard: several chains at once, see
+  // --max_chains_per_batch_submission.
+  void AddChains(evhttp_request* req);
+  void AddPreChains(evhttp_request* req);
+  void AddChainBatch(evhttp_request* req, bool precert);
+
+  // Reserves slots for |count| new submissions, or replies with a 503
+  // and returns false if there are too many pending already. Every
+  // successful call must be matched by a call to FinishSubmission()
+  // with the same |count|.
+  bool StartSubmission(evhttp_request* req, int count);
+  void FinishSubmission(int count) const;
+
+  // Returns true, setting |status| and |sct|, if the leaf of |chain|
+  // was logged before, in which case there is no need to check the
+  // chain. |entry| is set to an X509_ENTRY for the leaf.
+  bool LookupResubmission(const CertChain& chain, ct::LogEntry* entry,
+                          util::Status* status,
+                          ct::SignedCertificateTimestamp* sct) const;
 
   void BlockingAddChain(evhttp_request* req,
                         const std::shared_ptr<CertChain>& chain) const;
   void BlockingAddPreChain(evhttp_request* req,
                            const std::shared_ptr<PreCertChain>& chain) const;
+  // Verifies the chain at |index| in |batch|, and if it is the last of
+  // the batch to be verified, submits them all and replies.
+  void BlockingVerifyBatchedChain(
+      const std::shared_ptr<BatchSubmission>& batch, size_t index) const;
 };
 
 
@@ -1,11 +1,21 @@
 #include <gflags/gflags.h>
 #include <ldns/ldns.h>
 #include <iostream>
+#include <memory>
 #include <sstream>
 #include <string>
+#include <thread>
+#include <unordered_map>
+#include <vector>
 
+#include "log/database.h"
+#include "log/leveldb_db.h"
 #include "log/log_lookup.h"
 #include "log/logged_entry.h"
+#ifdef HAVE_ROCKSDB
+#include "log/rocksdb_db.h"
+#endif
+#include "log/segmented_db.h"
 #include "log/sqlite_db.h"
 #include "proto/cert_serializer.h"
 #include "proto/ct.pb.h"
@@ -13,17 +23,49 @@
 #include "util/init.h"
 #include "util/util.h"
 
+using cert_trans::LevelDB;
 using cert_trans::LogLookup;
 using cert_trans::LoggedEntry;
+using cert_trans::ReadOnlyDatabase;
+#ifdef HAVE_ROCKSDB
+using cert_trans::RocksDB;
+#endif
 using cert_trans::SQLiteDB;
+using cert_trans::SegmentedDB;
 using ct::SignedTreeHead;
 using google::RegisterFlagValidator;
 using std::string;
 using std::stringstream;
+using std::thread;
+using std::unique_ptr;
+using std::unordered_map;
+using std::vector;
 
 DEFINE_int32(port, 0, "Server port");
 DEFINE_string(domain, "", "Domain");
-DEFINE_string(db, "", "Database for certificate and tree storage");
+DEFINE_string(db, "",
+              "SQLite database for certificate and tree storage, which can "
+              "be shared with the ct-server that writes to it");
+DEFINE_string(leveldb_db, "",
+              "LevelDB database for certificate and tree storage. These "
+              "cannot be shared with a running ct-server, so this serves a "
+              "copy of one (an imported snapshot, say) as of when the server "
+              "started.");
+DEFINE_string(rocksdb_db, "",
+              "RocksDB database for certificate and tree storage, see "
+              "--leveldb_db");
+DEFINE_string(segmented_db, "",
+              "Directory of a segmented database for certificate and tree "
+              "storage, see --leveldb_db");
+DEFINE_int32(dns_threads, 4,
+             "Number of threads answering queries, each with its own "
+             "socket bound to the port with SO_REUSEPORT");
+DEFINE_int32(sth_refresh_interval_seconds, 1,
+             "How often to check the database for a new STH. Queries are "
+             "answered from the latest one seen.");
+DEFINE_int32(dns_answer_cache_size, 10000,
+             "Number of answers each thread keeps for repeated questions, "
+             "until there is a new STH");
 
 // Basic sanity checks on flag values.
 static bool ValidatePort(const char*, int32_t port) {
@@ -40,10 +82,28 @@ static bool NonEmptyString(const char*, const string& str) {
 static const bool domain_dummy =
     RegisterFlagValidator(&FLAGS_domain, &NonEmptyString);
 
+static bool ValidateIsPositive(const char*, int value) {
+  return value > 0;
+}
+
+static const bool threads_dummy =
+    RegisterFlagValidator(&FLAGS_dns_threads, &ValidateIsPositive);
+
+static const bool refresh_dummy = RegisterFlagValidator(
+    &FLAGS_sth_refresh_interval_seconds, &ValidateIsPositive);
+
+// Answers the queries from the STH last seen by |lookup|, which is
+// shared by all the threads and kept up to date by STHRefresher.
 class CTUDPDNSServer : public UDPServer {
  public:
-  CTUDPDNSServer(const string& domain, SQLiteDB* db, EventLoop* loop, int fd)
-      : UDPServer(loop, fd), domain_(domain), lookup_(db), db_(db) {
+  CTUDPDNSServer(const string& domain, ReadOnlyDatabase* db,
+                 LogLookup* lookup,
+                 EventLoop* loop, int fd)
+      : UDPServer(loop, fd),
+        domain_(domain),
+        lookup_(*CHECK_NOTNULL(lookup)),
+        db_(db),
+        cached_sth_timestamp_(0) {
   }
 
   virtual void PacketRead(const sockaddr_in& from, const char* buf,
@@ -56,8 +116,6 @@ class CTUDPDNSServer : public UDPServer {
       return;
     }
 
-    // ldns_pkt_print(stdout, packet);
-
     if (ldns_pkt_qr(packet) != 0) {
       LOG(INFO) << "Packet is not a query";
       return;
@@ -105,7 +163,7 @@ class CTUDPDNSServer : public UDPServer {
       ldns_buffer_free(dname);
       dname = NULL;
 
-      LOG(INFO) << "Question is TXT of " << owner_name;
+      VLOG(1) << "Question is TXT of " << owner_name;
 
       if (owner_name.length() <= domain_.length() ||
           owner_name.compare(owner_name.length() - domain_.length(),
@@ -114,23 +172,27 @@ class CTUDPDNSServer : public UDPServer {
         continue;
       }
 
-      std::string response = Response(
-          owner_name.substr(0, owner_name.length() - domain_.length() - 1));
-
-      ldns_rr* answer = ldns_rr_new();
-      ldns_rr_set_owner(answer, ldns_rdf_new_frm_str(LDNS_RDF_TYPE_DNAME,
-                                                     owner_name.c_str()));
-      ldns_rr_set_type(answer, LDNS_RR_TYPE_TXT);
-      ldns_rr_set_ttl(answer, 123);
-      ldns_rr_push_rdf(answer, ldns_rdf_new_frm_str(LDNS_RDF_TYPE_STR,
-                                                    response.c_str()));
-      ldns_pkt_safe_push_rr(answers, LDNS_SECTION_ANSWER, answer);
+      const vector<string>& response(CachedResponse(
+          owner_name.substr(0, owner_name.length() - domain_.length() - 1)));
+
+      for (const auto& record : response) {
+        ldns_rr* answer = ldns_rr_new();
+        ldns_rr_set_owner(answer, ldns_rdf_new_frm_str(LDNS_RDF_TYPE_DNAME,
+                                                       owner_name.c_str()));
+        ldns_rr_set_type(answer, LDNS_RR_TYPE_TXT);
+        ldns_rr_set_ttl(answer, 123);
+        ldns_rr_push_rdf(answer, ldns_rdf_new_frm_str(LDNS_RDF_TYPE_STR,
+                                                      record.c_str()));
+        ldns_pkt_safe_push_rr(answers, LDNS_SECTION_ANSWER, answer);
+      }
     }
     ldns_pkt_free(packet);
 
-    char* answer_str = ldns_pkt2str(answers);
-    LOG(INFO) << "Answer is " << answer_str;
-    free(answer_str);
+    if (VLOG_IS_ON(1)) {
+      char* answer_str = ldns_pkt2str(answers);
+      VLOG(1) << "Answer is " << answer_str;
+      free(answer_str);
+    }
 
     uint8_t* wire_answer;
     size_t answer_size;
@@ -144,29 +206,108 @@ class CTUDPDNSServer : public UDPServer {
   }
 
  private:
-  string Response(string question) {
+  // Base64 path nodes are 44 characters, so this many fit in a TXT
+  // string (of at most 255 characters) with the separating dots.
+  static const int kProofNodesPerRecord = 5;
+
+  // The answers only change with the STH, so they are kept until there
+  // is a new one.
+  const vector<string>& CachedResponse(const string& question) {
+    const uint64_t timestamp(lookup_.GetSTH().timestamp());
+    if (timestamp != cached_sth_timestamp_ ||
+        cached_responses_.size() >=
+            static_cast<size_t>(FLAGS_dns_answer_cache_size)) {
+      cached_responses_.clear();
+      cached_proofs_.clear();
+      cached_sth_timestamp_ = timestamp;
+    }
+
+    const auto it(cached_responses_.find(question));
+    if (it != cached_responses_.end()) {
+      return it->second;
+    }
+    return cached_responses_[question] = Response(question);
+  }
+
+  // Returns the TXT records answering |question|, usually just one.
+  vector<string> Response(string question) {
     if (question == "sth")
-      return STH();
+      return {STH()};
 
     size_t dot = question.find_last_of('.');
     if (dot == string::npos)
-      return question + " not understood";
+      return {question + " not understood"};
 
     string head = question.substr(0, dot);
     string tail = question.substr(dot + 1);
-    LOG(INFO) << "head = " << head << ", tail = " << tail;
+    VLOG(1) << "head = " << head << ", tail = " << tail;
     if (tail == "tree")
-      return Tree(head);
+      return {Tree(head)};
+    else if (tail == "proof")
+      return Proof(head);
     else if (tail == "hash")
-      return Hash(head);
+      return {Hash(head)};
     else if (tail == "leafhash")
-      return LeafHash(head);
+      return {LeafHash(head)};
+
+    return {question + " is the question."};
+  }
 
-    return question + " is the question.";
+  // Returns the base64 nodes of the audit path for |index| in the tree
+  // of |size|, or nullptr if there is none. Every level of a path is
+  // asked for separately with the "tree" questions, so the whole path
+  // is kept rather than looked up again for each of them.
+  const vector<string>* ProofNodes(const string& index, const string& size) {
+    const string key(index + "." + size);
+    const auto it(cached_proofs_.find(key));
+    if (it != cached_proofs_.end()) {
+      return &it->second;
+    }
+
+    ct::ShortMerkleAuditProof proof;
+    if (lookup_.AuditProof(atoi(index.c_str()), atoi(size.c_str()), &proof) !=
+        lookup_.OK)
+      return nullptr;
+
+    vector<string>* const nodes(&cached_proofs_[key]);
+    for (const auto& node : proof.path_node()) {
+      nodes->push_back(util::ToBase64(node));
+    }
+    return nodes;
+  }
+
+  // Answers "<index>.<size>.proof" with the whole audit path, in
+  // records of up to kProofNodesPerRecord dot-separated base64 nodes,
+  // leaf level first.
+  vector<string> Proof(const string& question) {
+    const size_t dot = question.find_first_of('.');
+    if (dot == string::npos)
+      return {question + " not understood"};
+
+    const string index(question.substr(0, dot));
+    const string size(question.substr(dot + 1));
+    const vector<string>* const nodes(ProofNodes(index, size));
+    if (!nodes)
+      return {"Lookup of node " + index + "." + size + " failed"};
+
+    vector<string> records(1);
+    for (size_t i = 0; i < nodes->size(); ++i) {
+      if (i > 0 && i % kProofNodesPerRecord == 0) {
+        records.emplace_back();
+      }
+      if (!records.back().empty()) {
+        records.back() += '.';
+      }
+      records.back() += (*nodes)[i];
+    }
+    return records;
   }
 
   string LeafHash(const string& index_str) const {
     int index = atoi(index_str.c_str());
+    vector<string> leaf_hashes;
+    if (index >= 0 && db_->ReadLeafHashes(index, 1, &leaf_hashes) == 1)
+      return util::ToBase64(leaf_hashes[0]);
     LoggedEntry cert;
     if (db_->LookupByIndex(index, &cert) != db_->LOOKUP_OK)
       return "No such index";
@@ -174,8 +315,6 @@ class CTUDPDNSServer : public UDPServer {
   }
 
   string Hash(const string& hash) {
-    db_->ForceNotifySTH();
-
     // FIXME: decode hash!
     int64_t index;
     if (lookup_.GetIndex(hash, &index) != lookup_.OK)
@@ -199,26 +338,22 @@ class CTUDPDNSServer : public UDPServer {
     string index = question.substr(dot + 1, dot2 - dot - 1);
     string size = question.substr(dot2 + 1);
 
-    LOG(INFO) << "level = " << level << ", index = " << index
-              << ", size = " << size;
+    VLOG(1) << "level = " << level << ", index = " << index
+            << ", size = " << size;
 
-    ct::ShortMerkleAuditProof proof;
-    if (lookup_.AuditProof(atoi(index.c_str()), atoi(size.c_str()), &proof) !=
-        lookup_.OK)
+    const vector<string>* const nodes(ProofNodes(index, size));
+    if (!nodes)
       return "Lookup of node " + index + "." + size + " failed";
 
     int l = atoi(level.c_str());
-    if (l < 0 || l >= proof.path_node_size())
+    if (l < 0 || l >= static_cast<int>(nodes->size()))
       return "Level " + level + " is out of range";
 
-    string b64 = util::ToBase64(proof.path_node(l));
-    return b64;
+    return (*nodes)[l];
   }
 
   string STH() {
-    db_->ForceNotifySTH();
-
-    const SignedTreeHead& sth = lookup_.GetSTH();
+    const SignedTreeHead sth(lookup_.GetSTH());
 
     std::string signature;
     CHECK_EQ(Serializer::SerializeDigitallySigned(sth.signature(), &signature),
@@ -232,11 +367,48 @@ class CTUDPDNSServer : public UDPServer {
     return ss.str();
   }
 
-  string domain_;
-  LogLookup lookup_;
+  const string domain_;
+  LogLookup& lookup_;
+  ReadOnlyDatabase* const db_;
+  uint64_t cached_sth_timestamp_;
+  unordered_map<string, vector<string>> cached_responses_;
+  // Audit paths, keyed by "<index>.<size>".
+  unordered_map<string, vector<string>> cached_proofs_;
+};
+
+
+// Checks the database for a new STH, which it then passes on to the
+// LogLookup, rather than doing so for every query.
+class STHRefresher : public RepeatedEvent {
+ public:
+  explicit STHRefresher(SQLiteDB* db)
+      : RepeatedEvent(FLAGS_sth_refresh_interval_seconds),
+        db_(CHECK_NOTNULL(db)) {
+  }
+
+  string Description() override {
+    return "STH refresh";
+  }
+
+  void Execute() override {
+    db_->ForceNotifySTH();
+  }
+
+ private:
   SQLiteDB* const db_;
 };
 
+
+// Answers queries on its own socket and event loop.
+void AnswerQueries(const string& domain, ReadOnlyDatabase* db,
+                   LogLookup* lookup) {
+  EventLoop loop;
+  int dns_fd;
+  CHECK(Services::InitServer(&dns_fd, FLAGS_port, NULL, SOCK_DGRAM, true));
+  CTUDPDNSServer dns(domain, db, lookup, &loop, dns_fd);
+  loop.Forever();
+}
+
 class Keyboard : public Server {
  public:
   Keyboard(EventLoop* loop) : Server(loop, 0) {
@@ -270,20 +442,58 @@ int main(int argc, char* argv[]) {
   util::InitCT(&argc, &argv);
   ConfigureSerializerForV1CT();
 
-  // TODO(pphaneuf): This current *has* to be SQLite, because it
-  // depends on sharing the database with a ct-server that will
-  // populate it (which FileDB does not support).
-  SQLiteDB db(FLAGS_db);
+  if (!FLAGS_db.empty() + !FLAGS_leveldb_db.empty() +
+          !FLAGS_rocksdb_db.empty() + !FLAGS_segmented_db.empty() !=
+      1) {
+    LOG(FATAL) << "Must specify exactly one database.";
+  }
+
+  // Only SQLite can be shared with a ct-server that populates it, and
+  // so have new STHs to pick up.
+  SQLiteDB* sqlite_db(nullptr);
+  unique_ptr<ReadOnlyDatabase> db;
+  if (!FLAGS_db.empty()) {
+    sqlite_db = new SQLiteDB(FLAGS_db);
+    db.reset(sqlite_db);
+  } else if (!FLAGS_leveldb_db.empty()) {
+    db.reset(new LevelDB(FLAGS_leveldb_db));
+  } else if (!FLAGS_segmented_db.empty()) {
+    db.reset(new SegmentedDB(FLAGS_segmented_db));
+  } else {
+#ifdef HAVE_ROCKSDB
+    db.reset(new RocksDB(FLAGS_rocksdb_db));
+#else
+    LOG(FATAL) << "--rocksdb_db given, but built without RocksDB support.";
+#endif
+  }
+
+  // The LogLookup picks up the STH of the other databases when it
+  // registers for it.
+  LogLookup lookup(db.get());
 
   EventLoop loop;
 
   // Mostly so we can have a clean exit for valgrind etc.
   Keyboard keyboard(&loop);
 
+  unique_ptr<STHRefresher> refresher;
+  if (sqlite_db) {
+    sqlite_db->ForceNotifySTH();
+    refresher.reset(new STHRefresher(sqlite_db));
+    loop.Add(refresher.get());
+  }
+
+  // The main thread answers queries as well.
   int dns_fd;
-  CHECK(Services::InitServer(&dns_fd, FLAGS_port, NULL, SOCK_DGRAM));
-  CTUDPDNSServer dns(FLAGS_domain, &db, &loop, dns_fd);
+  CHECK(Services::InitServer(&dns_fd, FLAGS_port, NULL, SOCK_DGRAM,
+                             FLAGS_dns_threads > 1));
+  CTUDPDNSServer dns(FLAGS_domain, db.get(), &lookup, &loop, dns_fd);
+  for (int i = 1; i < FLAGS_dns_threads; ++i) {
+    // These never stop, the process exits from under them.
+    thread(&AnswerQueries, FLAGS_domain, db.get(), &lookup).detach();
+  }
 
-  LOG(INFO) << "Server listening on port " << FLAGS_port;
+  LOG(INFO) << "Server listening on port " << FLAGS_port << " with "
+            << FLAGS_dns_threads << " threads";
   loop.Forever();
 }
@@ -3,6 +3,7 @@
 #include <event2/buffer.h>
 #include <event2/thread.h>
 #include <gflags/gflags.h>
+#include <google/protobuf/text_format.h>
 #include <openssl/crypto.h>
 #include <openssl/err.h>
 #include <signal.h>
@@ -14,8 +15,11 @@
 #include <iostream>
 #include <memory>
 #include <mutex>
+#include <set>
 #include <string>
+#include <thread>
 #include <utility>
+#include <vector>
 
 #include "client/async_log_client.h"
 #include "config.h"
@@ -25,6 +29,7 @@
 #include "log/cluster_state_controller.h"
 #include "log/ct_extensions.h"
 #include "log/database.h"
+#include "log/entry_index.h"
 #include "log/etcd_consistent_store.h"
 #include "log/log_lookup.h"
 #include "log/strict_consistent_store.h"
@@ -33,6 +38,7 @@
 #include "monitoring/latency.h"
 #include "monitoring/monitoring.h"
 #include "monitoring/registry.h"
+#include "net/fetch_budget.h"
 #include "proto/cert_serializer.h"
 #include "server/certificate_handler.h"
 #include "server/json_output.h"
@@ -41,12 +47,14 @@
 #include "server/server.h"
 #include "server/server_helper.h"
 #include "util/etcd.h"
+#include "util/json_wrapper.h"
 #include "util/init.h"
 #include "util/libevent_wrapper.h"
 #include "util/masterelection.h"
 #include "util/periodic_closure.h"
 #include "util/read_key.h"
 #include "util/status.h"
+#include "util/sync_task.h"
 #include "util/thread_pool.h"
 #include "util/util.h"
 #include "util/uuid.h"
@@ -67,6 +75,27 @@ DEFINE_string(
     "PEM-encoded server public key file of the log we're mirroring.");
 DEFINE_int32(local_sth_update_frequency_seconds, 30,
              "Number of seconds between local checks for updated tree data.");
+DEFINE_string(targets_config, "",
+              "File holding a ct.MirrorTargetsConfig in text format, to "
+              "mirror several logs from this process, each served under "
+              "its own path prefix. They share the HTTP server, thread "
+              "pools, connections and fetch budget. --target_log_uri, "
+              "--target_public_key and the database flags are then not "
+              "used.");
+DEFINE_int32(mirror_max_concurrent_fetches, 64,
+             "Maximum number of requests to the mirrored logs at once, "
+             "shared fairly between them.");
+DEFINE_int64(mirror_max_fetch_bytes_per_second, 0,
+             "Maximum bandwidth of the responses from the mirrored logs, "
+             "shared fairly between them, or 0 for no limit.");
+DEFINE_string(entry_index_dir, "",
+              "Directory of an index of the mirrored entries by DNS name, "
+              "issuer and serial number, kept up to date as they are "
+              "fetched and searched with /ct/v1/search-entries, or empty "
+              "for none. With --targets_config, each target has its own "
+              "entry_index_dir instead.");
+DEFINE_int32(search_entries_max_results, 1000,
+             "Maximum number of entries in a /ct/v1/search-entries reply.");
 
 namespace libevent = cert_trans::libevent;
 
@@ -77,8 +106,10 @@ using cert_trans::ConsistentStore;
 using cert_trans::ContinuousFetcher;
 using cert_trans::Counter;
 using cert_trans::Database;
+using cert_trans::EntryIndex;
 using cert_trans::EtcdClient;
 using cert_trans::EtcdConsistentStore;
+using cert_trans::FetchBudget;
 using cert_trans::Gauge;
 using cert_trans::HttpHandler;
 using cert_trans::Latency;
@@ -90,6 +121,8 @@ using cert_trans::Proxy;
 using cert_trans::ReadPublicKey;
 using cert_trans::RemotePeer;
 using cert_trans::ScopedLatency;
+using cert_trans::SendJsonError;
+using cert_trans::SendJsonReply;
 using cert_trans::Server;
 using cert_trans::StalenessTracker;
 using cert_trans::StrictConsistentStore;
@@ -97,8 +130,12 @@ using cert_trans::ThreadPool;
 using cert_trans::Update;
 using cert_trans::UrlFetcher;
 using ct::ClusterNodeState;
+using ct::LogShardConfig;
+using ct::MirrorTargetConfig;
+using ct::MirrorTargetsConfig;
 using ct::SignedTreeHead;
 using google::RegisterFlagValidator;
+using google::protobuf::TextFormat;
 using std::bind;
 using std::chrono::duration;
 using std::chrono::duration_cast;
@@ -110,12 +147,14 @@ using std::lock_guard;
 using std::make_pair;
 using std::make_shared;
 using std::map;
+using std::move;
 using std::mutex;
 using std::placeholders::_1;
 using std::shared_ptr;
 using std::string;
 using std::thread;
 using std::unique_ptr;
+using std::vector;
 using util::HexString;
 using util::StatusOr;
 using util::SyncTask;
@@ -125,14 +164,17 @@ using util::Task;
 namespace {
 
 
-Gauge<>* latest_local_tree_size_gauge =
-    Gauge<>::New("latest_local_tree_size",
-                 "Size of latest locally available STH.");
+Gauge<string>* latest_local_tree_size_gauge =
+    Gauge<string>::New("latest_local_tree_size", "target",
+                       "Size of latest locally available STH, broken down "
+                       "by the path prefix of the mirrored log.");
 
-Counter<>* inconsistent_sths_received =
-    Counter<>::New("inconsistent_sths_received",
-                   "Number of STHs received from the mirror target whose root "
-                   "hash does not match the locally built tree.");
+Counter<string>* inconsistent_sths_received =
+    Counter<string>::New("inconsistent_sths_received", "target",
+                         "Number of STHs received from the mirror target "
+                         "whose root hash does not match the locally built "
+                         "tree, broken down by the path prefix of the "
+                         "mirrored log.");
 
 
 // Basic sanity checks on flag values.
@@ -144,8 +186,14 @@ static bool ValidateRead(const char* flagname, const string& path) {
   return true;
 }
 
+static bool ValidatePublicKey(const char* flagname, const string& path) {
+  // Each mirrored log has its own key when mirroring several.
+  return (path.empty() && !FLAGS_targets_config.empty()) ||
+         ValidateRead(flagname, path);
+}
+
 static const bool pubkey_dummy =
-    RegisterFlagValidator(&FLAGS_target_public_key, &ValidateRead);
+    RegisterFlagValidator(&FLAGS_target_public_key, &ValidatePublicKey);
 
 static bool ValidateIsPositive(const char* flagname, int value) {
   if (value <= 0) {
@@ -158,53 +206,321 @@ static bool ValidateIsPositive(const char* flagname, int value) {
 static const bool follow_dummy =
     RegisterFlagValidator(&FLAGS_target_poll_frequency_seconds,
                           &ValidateIsPositive);
-}  // namespace
+
+static const bool max_concurrent_fetches_dummy =
+    RegisterFlagValidator(&FLAGS_mirror_max_concurrent_fetches,
+                          &ValidateIsPositive);
+
+static bool ValidateIsNonNegative(const char* flagname, int64_t value) {
+  if (value < 0) {
+    std::cout << flagname << " must not be negative" << std::endl;
+    return false;
+  }
+  return true;
+}
+
+static const bool max_fetch_bytes_dummy =
+    RegisterFlagValidator(&FLAGS_mirror_max_fetch_bytes_per_second,
+                          &ValidateIsNonNegative);
+
+static const bool search_entries_max_results_dummy =
+    RegisterFlagValidator(&FLAGS_search_entries_max_results,
+                          &ValidateIsPositive);
+
+// Number of entries indexed at a time, between checks for cancellation.
+const int64_t kEntryIndexBatchSize = 10000;
+
+
+// A log mirrored by this process, with its own database, state in
+// etcd and URL path prefix. The mirrors of a process share its HTTP
+// server, thread pools, URL fetcher, etcd client and fetch budget.
+class Mirror {
+ public:
+  // Does not take ownership of anything. The first mirror must be
+  // given a null |http_server|, so that its Server creates the HTTP
+  // server that the other mirrors are then given. The requests to the
+  // target log go through |url_fetcher|, within |budget|.
+  Mirror(const MirrorTargetConfig& config, unique_ptr<Database> db,
+         const shared_ptr<libevent::Base>& event_base,
+         ThreadPool* internal_pool, ThreadPool* http_pool,
+         ThreadPool* fetch_pool, UrlFetcher* url_fetcher,
+         EtcdClient* etcd_client, FetchBudget* budget,
+         libevent::HttpServer* http_server);
+  // Stops following the target log.
+  ~Mirror();
+  Mirror(const Mirror&) = delete;
+  Mirror& operator=(const Mirror&) = delete;
+
+  Server* server() {
+    return &server_;
+  }
+
+  // Loads the Merkle tree, and starts serving the copy of the log.
+  // Several mirrors can be loaded at once.
+  void Load();
+
+  // Sets up a simple single-node environment, see main().
+  void InitStandalone();
+
+  // Starts following the target log, once the database has caught up
+  // with the serving STH.
+  void Start();
+
+ private:
+  static Server::Options ServerOptions(const MirrorTargetConfig& config,
+                                       libevent::HttpServer* http_server);
+
+  // Queues |sth|, received from the target log, for UpdateServingSTH().
+  void NewSTH(const SignedTreeHead& sth);
+  // Has the cluster serve the STHs queued, as the entries they cover
+  // are fetched, once their roots are checked against the local tree.
+  void UpdateServingSTH(Task* task);
+  // Adds the entries to |entry_index_| as they are fetched.
+  void UpdateEntryIndex(Task* task);
+  // Non-standard: the sequence numbers of the entries with a given DNS
+  // name, issuer or serial number, see EntryIndex.
+  void SearchEntries(evhttp_request* req) const;
+
+  const MirrorTargetConfig config_;
+  const shared_ptr<libevent::Base> event_base_;
+  ThreadPool* const internal_pool_;
+  ThreadPool* const fetch_pool_;
+  EtcdClient* const etcd_client_;
+  const unique_ptr<Database> db_;
+  EVP_PKEY* const pubkey_;
+  const LogVerifier log_verifier_;
+  // The target log is fetched from through this, which must outlive
+  // the peer that |server_| fetches from.
+  const unique_ptr<UrlFetcher> url_fetcher_;
+  Server server_;
+  unique_ptr<StalenessTracker> staleness_tracker_;
+  unique_ptr<CertificateHttpHandler> handler_;
+  unique_ptr<EntryIndex> entry_index_;
+  SyncTask fetcher_task_;
+
+  mutex queue_mutex_;
+  map<int64_t, SignedTreeHead> queue_;
+
+  unique_ptr<thread> sth_updater_;
+  unique_ptr<thread> entry_indexer_;
+};
+
+
+EVP_PKEY* ReadKey(const string& file) {
+  const StatusOr<EVP_PKEY*> pubkey(ReadPublicKey(file));
+  CHECK(pubkey.ok()) << "Failed to read target log's public key file "
+                     << file << ": " << pubkey.status();
+  return pubkey.ValueOrDie();
+}
+
+
+// static
+Server::Options Mirror::ServerOptions(const MirrorTargetConfig& config,
+                                      libevent::HttpServer* http_server) {
+  Server::Options options;
+  options.http_server = http_server;
+  options.etcd_root = config.log().etcd_root();
+  options.log_lookup_checkpoint_file =
+      config.log().log_lookup_checkpoint_file();
+  options.fetch_checkpoint_file = config.log().fetch_checkpoint_file();
+  return options;
+}
+
+
+Mirror::Mirror(const MirrorTargetConfig& config, unique_ptr<Database> db,
+               const shared_ptr<libevent::Base>& event_base,
+               ThreadPool* internal_pool, ThreadPool* http_pool,
+               ThreadPool* fetch_pool, UrlFetcher* url_fetcher,
+               EtcdClient* etcd_client, FetchBudget* budget,
+               libevent::HttpServer* http_server)
+    : config_(config),
+      event_base_(event_base),
+      internal_pool_(CHECK_NOTNULL(internal_pool)),
+      fetch_pool_(CHECK_NOTNULL(fetch_pool)),
+      etcd_client_(CHECK_NOTNULL(etcd_client)),
+      db_(move(db)),
+      pubkey_(ReadKey(config.target_public_key())),
+      log_verifier_(new LogSigVerifier(pubkey_),
+                    new MerkleVerifier(
+                        unique_ptr<Sha256Hasher>(new Sha256Hasher))),
+      url_fetcher_(CHECK_NOTNULL(budget)->NewFetcher(url_fetcher)),
+      server_(event_base, internal_pool, http_pool, CHECK_NOTNULL(db_.get()),
+              etcd_client, url_fetcher, &log_verifier_,
+              ServerOptions(config, http_server)),
+      fetcher_task_(fetch_pool_) {
+}
+
+
+Mirror::~Mirror() {
+  fetcher_task_.task()->Return();
+  fetcher_task_.Wait();
+  if (sth_updater_) {
+    sth_updater_->join();
+  }
+  if (entry_indexer_) {
+    entry_indexer_->join();
+  }
+}
+
+
+void Mirror::Load() {
+  server_.Initialise(true /* is_mirror */);
+
+  staleness_tracker_.reset(
+      new StalenessTracker(server_.cluster_state_controller(), internal_pool_,
+                           event_base_.get()));
+
+  handler_.reset(new CertificateHttpHandler(
+      server_.log_lookup(), db_.get(), server_.cluster_state_controller(),
+      nullptr /* checker */, nullptr /* Frontend */, internal_pool_,
+      event_base_.get(), staleness_tracker_.get()));
+
+  // Connect the handler, proxy and server together
+  handler_->SetProxy(server_.proxy());
+  handler_->Add(server_.http_server(), config_.log().path_prefix());
+
+  if (!config_.entry_index_dir().empty()) {
+    entry_index_.reset(new EntryIndex(config_.entry_index_dir()));
+    CHECK(server_.http_server()->AddHandler(
+        config_.log().path_prefix() + "/ct/v1/search-entries",
+        bind(&Mirror::SearchEntries, this, _1)));
+  }
+}
+
+
+void Mirror::InitStandalone() {
+  // Put a sensible single-node config into FakeEtcd. For a real clustered
+  // log
+  // we'd expect a ClusterConfig already to be present within etcd as part of
+  // the provisioning of the log.
+  //
+  // TODO(alcutter): Note that we're currently broken wrt to restarting the
+  // log server when there's data in the log.  It's a temporary thing though,
+  // so fear ye not.
+  ct::ClusterConfig config;
+  config.set_minimum_serving_nodes(1);
+  config.set_minimum_serving_fraction(1);
+  LOG(INFO) << "Setting default single-node ClusterConfig:\n"
+            << config.DebugString();
+  server_.consistent_store()->SetClusterConfig(config);
+
+  // Since we're a single node cluster, we'll settle that we're the
+  // master here, so that we can populate the initial STH
+  // (StrictConsistentStore won't allow us to do so unless we're master.)
+  server_.election()->StartElection();
+  server_.election()->WaitToBecomeMaster();
+}
+
+
+void Mirror::Start() {
+  if (config_.target_log_uri().empty()) {
+    LOG(WARNING) << "Empty target_log_uri flag; mirroring DISABLED";
+  } else {
+    LOG(INFO) << "Adding remote peer for target log "
+              << config_.target_log_uri();
+    server_.continuous_fetcher()->AddPeer(
+        "target",
+        make_shared<RemotePeer>(
+            unique_ptr<AsyncLogClient>(
+                new AsyncLogClient(fetch_pool_, url_fetcher_.get(),
+                                   config_.target_log_uri())),
+            unique_ptr<LogVerifier>(new LogVerifier(
+                new LogSigVerifier(pubkey_),
+                new MerkleVerifier(
+                    unique_ptr<Sha256Hasher>(new Sha256Hasher)))),
+            bind(&Mirror::NewSTH, this, _1),
+            fetcher_task_.task()->AddChild(
+                [](Task*) { LOG(INFO) << "RemotePeer exited."; })));
+  }
+
+  server_.WaitForReplication();
+
+  sth_updater_.reset(
+      new thread(&Mirror::UpdateServingSTH, this,
+                 fetcher_task_.task()->AddChild(
+                     [](Task*) { LOG(INFO) << "STHUpdater exited."; })));
+
+  if (entry_index_) {
+    entry_indexer_.reset(
+        new thread(&Mirror::UpdateEntryIndex, this,
+                   fetcher_task_.task()->AddChild([](Task*) {
+                     LOG(INFO) << "EntryIndexer exited.";
+                   })));
+  }
+}
+
+
+void Mirror::NewSTH(const SignedTreeHead& sth) {
+  {
+    lock_guard<mutex> lock(queue_mutex_);
+    const auto it(queue_.find(sth.tree_size()));
+    if (it != queue_.end() && sth.timestamp() < it->second.timestamp()) {
+      LOG(WARNING) << "Received older STH:\nHad:\n"
+                   << it->second.DebugString() << "\nGot:\n"
+                   << sth.DebugString();
+      return;
+    }
+    queue_.insert(make_pair(sth.tree_size(), sth));
+  }
+  // Start fetching the new entries right away.
+  server_.continuous_fetcher()->NewEntriesAvailable();
+}
 
 
-void STHUpdater(Database* db, ClusterStateController* cluster_state_controller,
-                mutex* queue_mutex, map<int64_t, ct::SignedTreeHead>* queue,
-                LogLookup* log_lookup, Task* task) {
-  CHECK_NOTNULL(db);
-  CHECK_NOTNULL(cluster_state_controller);
-  CHECK_NOTNULL(queue_mutex);
-  CHECK_NOTNULL(queue);
+void Mirror::UpdateServingSTH(Task* task) {
   CHECK_NOTNULL(task);
-  CHECK_NOTNULL(log_lookup);
+  const string& target(config_.log().path_prefix());
+  LogLookup* const log_lookup(server_.log_lookup());
+
+  // The compact tree is kept from one round to the next, so that
+  // entries are only read and hashed once, however many STHs are
+  // checked along the way.
+  unique_ptr<CompactMerkleTree> new_tree;
 
   while (true) {
     if (task->CancelRequested()) {
       task->Return(util::Status::CANCELLED);
+      return;
     }
 
-    const int64_t local_size(db->TreeSize());
-    latest_local_tree_size_gauge->Set(local_size);
-
-    // log_lookup doesn't yet have the data for the new STHs integrated (that
-    // happens via a callback when the WriteTreeHead() method is called on the
-    // DB), so we'll used a compact tree to pre-validate the STH roots.
-    //
-    // We'll start with one based on the current state of our serving tree and
-    // update it to the STH sizes we're checking.
-    unique_ptr<CompactMerkleTree> new_tree(
-        log_lookup->GetCompactMerkleTree(new Sha256Hasher));
+    const int64_t local_size(db_->TreeSize());
+    latest_local_tree_size_gauge->Set(target, local_size);
 
     {
-      lock_guard<mutex> lock(*queue_mutex);
-      unique_ptr<Database::Iterator> entries(
-          db->ScanEntries(new_tree->LeafCount()));
-      while (!queue->empty() &&
-             queue->begin()->second.tree_size() <= local_size) {
-        const SignedTreeHead next_sth(queue->begin()->second);
-        queue->erase(queue->begin());
+      lock_guard<mutex> lock(queue_mutex_);
+      unique_ptr<Database::Iterator> entries;
+      while (!queue_.empty() &&
+             queue_.begin()->second.tree_size() <= local_size) {
+        const SignedTreeHead next_sth(queue_.begin()->second);
+        queue_.erase(queue_.begin());
+        CHECK_LE(next_sth.tree_size(), local_size);
+        CHECK_GE(next_sth.tree_size(), 0);
+        const uint64_t next_sth_tree_size(
+            static_cast<uint64_t>(next_sth.tree_size()));
+
+        // log_lookup doesn't yet have the data for the new STHs
+        // integrated (that happens via a callback when the
+        // WriteTreeHead() method is called on the DB), so we'll use a
+        // compact tree to pre-validate the STH roots.
+        //
+        // It starts from the current state of our serving tree, and
+        // only needs to start over if it is behind that, or if an
+        // STH for a size it went past shows up late.
+        const uint64_t serving_tree_size(log_lookup->GetSTH().tree_size());
+        if (!new_tree || new_tree->LeafCount() < serving_tree_size ||
+            (new_tree->LeafCount() > next_sth_tree_size &&
+             next_sth_tree_size > serving_tree_size)) {
+          new_tree = log_lookup->GetCompactMerkleTree(new Sha256Hasher);
+          entries.reset();
+        }
 
         // First, if necessary, catch our local compact tree up to the
         // candidate STH size:
-        {
+        if (new_tree->LeafCount() < next_sth_tree_size) {
+          if (!entries) {
+            entries = db_->ScanEntries(new_tree->LeafCount());
+          }
           LoggedEntry entry;
-          CHECK_LE(next_sth.tree_size(), local_size);
-          CHECK_GE(next_sth.tree_size(), 0);
-          const uint64_t next_sth_tree_size(
-              static_cast<uint64_t>(next_sth.tree_size()));
           while (new_tree->LeafCount() < next_sth_tree_size) {
             CHECK(entries->GetNextEntry(&entry));
             CHECK(entry.has_sequence_number());
@@ -223,7 +539,7 @@ void STHUpdater(Database* db, ClusterStateController* cluster_state_controller,
         // our serving tree, otherwise use the root we just calculated with our
         // compact tree.
         const string local_root_at_snapshot(
-            next_sth.tree_size() > log_lookup->GetSTH().tree_size()
+            next_sth_tree_size > serving_tree_size
                 ? new_tree->CurrentRoot()
                 : log_lookup->RootAtSnapshot(next_sth.tree_size()));
 
@@ -234,14 +550,14 @@ void STHUpdater(Database* db, ClusterStateController* cluster_state_controller,
                        << "\ndoes not match that of local tree at "
                        << "corresponding snapshot:\n"
                        << HexString(local_root_at_snapshot);
-          inconsistent_sths_received->Increment();
+          inconsistent_sths_received->Increment(target);
           // TODO(alcutter): We should probably write these bad STHs out to a
           // separate DB table for later analysis.
           continue;
         }
         LOG(INFO) << "Can serve new STH of size " << next_sth.tree_size()
                   << " locally";
-        cluster_state_controller->NewTreeHead(next_sth);
+        server_.cluster_state_controller()->NewTreeHead(next_sth);
       }
     }
 
@@ -251,25 +567,113 @@ void STHUpdater(Database* db, ClusterStateController* cluster_state_controller,
 }
 
 
-shared_ptr<RemotePeer> createTargetPeerFromFlags(
-    ThreadPool* pool, UrlFetcher* url_fetcher, EVP_PKEY* pubkey, Task* task,
-    function<void(const ct::SignedTreeHead&)> new_sth) {
-  if (FLAGS_target_log_uri.empty()) {
-    LOG(WARNING) << "Empty target_log_uri flag; mirroring DISABLED";
-    return shared_ptr<RemotePeer>();
+void Mirror::UpdateEntryIndex(Task* task) {
+  CHECK_NOTNULL(task);
+  while (true) {
+    if (task->CancelRequested()) {
+      task->Return(util::Status::CANCELLED);
+      return;
+    }
+
+    // Only waits once it has caught up with the database.
+    if (entry_index_->Update(*db_, kEntryIndexBatchSize) <
+        kEntryIndexBatchSize) {
+      std::this_thread::sleep_for(
+          seconds(FLAGS_local_sth_update_frequency_seconds));
+    }
   }
+}
 
-  return make_shared<RemotePeer>(
-      unique_ptr<AsyncLogClient>(new AsyncLogClient(CHECK_NOTNULL(pool),
-                                                    CHECK_NOTNULL(url_fetcher),
-                                                    FLAGS_target_log_uri)),
-      unique_ptr<LogVerifier>(new LogVerifier(
-          new LogSigVerifier(CHECK_NOTNULL(pubkey)),
-          new MerkleVerifier(unique_ptr<Sha256Hasher>(new Sha256Hasher)))),
-      new_sth, CHECK_NOTNULL(task)->AddChild(
-                   [](Task*) { LOG(INFO) << "RemotePeer exited."; }));
+
+void Mirror::SearchEntries(evhttp_request* req) const {
+  if (evhttp_request_get_command(req) != EVHTTP_REQ_GET) {
+    return SendJsonError(event_base_.get(), req, HTTP_BADMETHOD,
+                         "Method not allowed.");
+  }
+
+  const libevent::QueryParams query(libevent::ParseQuery(req));
+  EntryIndex::Key key;
+  string value;
+  if (libevent::GetParam(query, "dns_name", &value)) {
+    key = EntryIndex::Key::DNS_NAME;
+  } else if (libevent::GetParam(query, "serial_number", &value)) {
+    key = EntryIndex::Key::SERIAL_NUMBER;
+  } else if (libevent::GetParam(query, "issuer_spki_sha256", &value)) {
+    key = EntryIndex::Key::ISSUER_SPKI_SHA256;
+    value = util::FromBase64(value);
+  }
+  if (value.empty() || query.size() > 1 + query.count("start")) {
+    return SendJsonError(event_base_.get(), req, HTTP_BADREQUEST,
+                         "Need exactly one of the \"dns_name\", "
+                         "\"serial_number\" or \"issuer_spki_sha256\" "
+                         "parameters.");
+  }
+
+  const int64_t start(query.count("start") > 0
+                          ? libevent::GetIntParam(query, "start")
+                          : 0);
+  if (start < 0) {
+    return SendJsonError(event_base_.get(), req, HTTP_BADREQUEST,
+                         "Invalid \"start\" parameter.");
+  }
+
+  vector<int64_t> indices;
+  entry_index_->Find(key, value, start, FLAGS_search_entries_max_results,
+                     &indices);
+
+  JsonArray json_entries;
+  for (const int64_t index : indices) {
+    json_entries.Add(json_object_new_int64(index));
+  }
+  JsonObject json_reply;
+  json_reply.Add("entries", json_entries);
+  // Where to start from for the next page, if there might be one.
+  if (static_cast<int64_t>(indices.size()) ==
+      FLAGS_search_entries_max_results) {
+    json_reply.Add("next_start", indices.back() + 1);
+  }
+  json_reply.Add("indexed_size", entry_index_->IndexedSize());
+  SendJsonReply(event_base_.get(), req, HTTP_OK, json_reply);
 }
 
+
+// The logs to mirror, from --targets_config if set, or else the single
+// one given by the other flags.
+MirrorTargetsConfig ReadTargetsConfig() {
+  MirrorTargetsConfig config;
+  if (FLAGS_targets_config.empty()) {
+    MirrorTargetConfig* const target(config.add_target());
+    target->set_target_log_uri(FLAGS_target_log_uri);
+    target->set_target_public_key(FLAGS_target_public_key);
+    target->set_entry_index_dir(FLAGS_entry_index_dir);
+    return config;
+  }
+
+  string text;
+  CHECK(util::ReadTextFile(FLAGS_targets_config, &text))
+      << "Could not read " << FLAGS_targets_config;
+  CHECK(TextFormat::ParseFromString(text, &config))
+      << "Could not parse " << FLAGS_targets_config;
+  CHECK_GT(config.target_size(), 0) << "No targets in "
+                                    << FLAGS_targets_config;
+  std::set<string> prefixes;
+  std::set<string> etcd_roots;
+  for (const auto& target : config.target()) {
+    CHECK(!target.target_log_uri().empty())
+        << "No target_log_uri for path prefix: "
+        << target.log().path_prefix();
+    CHECK(prefixes.insert(target.log().path_prefix()).second)
+        << "Duplicate path prefix: " << target.log().path_prefix();
+    CHECK(etcd_roots.insert(target.log().etcd_root()).second)
+        << "Duplicate etcd root: " << target.log().etcd_root();
+  }
+  return config;
+}
+
+
+}  // namespace
+
+
 int main(int argc, char* argv[]) {
   // Ignore various signals whilst we start up.
   signal(SIGHUP, SIG_IGN);
@@ -282,8 +686,7 @@ int main(int argc, char* argv[]) {
   Server::StaticInit();
 
   cert_trans::EnsureValidatorsRegistered();
-  const unique_ptr<Database> db(cert_trans::ProvideDatabase());
-  CHECK(db) << "No database instance created, check flag settings";
+  const MirrorTargetsConfig targets(ReadTargetsConfig());
 
   const bool stand_alone_mode(cert_trans::IsStandalone(false));
   const shared_ptr<libevent::Base> event_base(make_shared<libevent::Base>());
@@ -294,100 +697,44 @@ int main(int argc, char* argv[]) {
       cert_trans::ProvideEtcdClient(event_base.get(), &internal_pool,
                                     &url_fetcher));
 
-  CHECK(!FLAGS_target_public_key.empty());
-  const StatusOr<EVP_PKEY*> pubkey(ReadPublicKey(FLAGS_target_public_key));
-  CHECK(pubkey.ok()) << "Failed to read target log's public key file: "
-                     << pubkey.status();
-
-  const LogVerifier log_verifier(new LogSigVerifier(pubkey.ValueOrDie()),
-                                 new MerkleVerifier(unique_ptr<Sha256Hasher>(
-                                     new Sha256Hasher)));
-
   ThreadPool http_pool(FLAGS_num_http_server_threads);
-
-  Server server(event_base, &internal_pool, &http_pool, db.get(),
-                etcd_client.get(), &url_fetcher, &log_verifier);
-  server.Initialise(true /* is_mirror */);
-
-  unique_ptr<StalenessTracker> staleness_tracker(
-      new StalenessTracker(server.cluster_state_controller(), &internal_pool,
-                           event_base.get()));
-
-  CertificateHttpHandler handler(server.log_lookup(), db.get(),
-                                 server.cluster_state_controller(),
-                                 nullptr /* checker */, nullptr /* Frontend */,
-                                 &internal_pool, event_base.get(),
-                                 staleness_tracker.get());
-
-  // Connect the handler, proxy and server together
-  handler.SetProxy(server.proxy());
-  handler.Add(server.http_server());
-
-  if (stand_alone_mode) {
-    // Set up a simple single-node mirror environment for testing.
-    //
-    // Put a sensible single-node config into FakeEtcd. For a real clustered
-    // log
-    // we'd expect a ClusterConfig already to be present within etcd as part of
-    // the provisioning of the log.
-    //
-    // TODO(alcutter): Note that we're currently broken wrt to restarting the
-    // log server when there's data in the log.  It's a temporary thing though,
-    // so fear ye not.
-    ct::ClusterConfig config;
-    config.set_minimum_serving_nodes(1);
-    config.set_minimum_serving_fraction(1);
-    LOG(INFO) << "Setting default single-node ClusterConfig:\n"
-              << config.DebugString();
-    server.consistent_store()->SetClusterConfig(config);
-
-    // Since we're a single node cluster, we'll settle that we're the
-    // master here, so that we can populate the initial STH
-    // (StrictConsistentStore won't allow us to do so unless we're master.)
-    server.election()->StartElection();
-    server.election()->WaitToBecomeMaster();
+  ThreadPool fetch_pool(16);
+  // All the mirrored logs are fetched within the one budget, which
+  // they take turns at once it runs out.
+  FetchBudget budget(event_base.get(), FLAGS_mirror_max_concurrent_fetches,
+                     FLAGS_mirror_max_fetch_bytes_per_second);
+
+  // Each mirror is loaded and started on a thread of its own, and
+  // serves what it can as soon as it is loaded, without waiting for
+  // the others.
+  vector<unique_ptr<Mirror>> mirrors;
+  vector<thread> mirror_loaders;
+  for (const auto& target : targets.target()) {
+    unique_ptr<Database> db(FLAGS_targets_config.empty()
+                                ? cert_trans::ProvideDatabase()
+                                : cert_trans::ProvideShardDatabase(
+                                      target.log()));
+    CHECK(db) << "No database instance created, check flag settings";
+    mirrors.emplace_back(new Mirror(
+        target, move(db), event_base, &internal_pool, &http_pool,
+        &fetch_pool, &url_fetcher, etcd_client.get(), &budget,
+        mirrors.empty() ? nullptr : mirrors[0]->server()->http_server()));
+    Mirror* const mirror(mirrors.back().get());
+    mirror_loaders.emplace_back([mirror, stand_alone_mode]() {
+      mirror->Load();
+      if (stand_alone_mode) {
+        // Set up a simple single-node mirror environment for testing.
+        mirror->InitStandalone();
+      }
+      mirror->Start();
+    });
   }
 
-
-  ThreadPool pool(16);
-  SyncTask fetcher_task(&pool);
-
-  mutex queue_mutex;
-  map<int64_t, ct::SignedTreeHead> queue;
-
-  const function<void(const ct::SignedTreeHead&)> new_sth(
-      [&queue_mutex, &queue](const ct::SignedTreeHead& sth) {
-        lock_guard<mutex> lock(queue_mutex);
-        const auto it(queue.find(sth.tree_size()));
-        if (it != queue.end() && sth.timestamp() < it->second.timestamp()) {
-          LOG(WARNING) << "Received older STH:\nHad:\n"
-                       << it->second.DebugString() << "\nGot:\n"
-                       << sth.DebugString();
-          return;
-        }
-        queue.insert(make_pair(sth.tree_size(), sth));
-      });
-
-  const shared_ptr<RemotePeer> peer(
-      createTargetPeerFromFlags(&pool, &url_fetcher, pubkey.ValueOrDie(),
-                                fetcher_task.task(), new_sth));
-  if (peer) {
-    LOG(INFO) << "Adding remote peer for target log.";
-    server.continuous_fetcher()->AddPeer("target", peer);
+  for (auto& loader : mirror_loaders) {
+    loader.join();
   }
 
-  server.WaitForReplication();
-
-  thread sth_updater(&STHUpdater, db.get(), server.cluster_state_controller(),
-                     &queue_mutex, &queue, server.log_lookup(),
-                     fetcher_task.task()->AddChild(
-                         [](Task*) { LOG(INFO) << "STHUpdater exited."; }));
-
-  server.Run();
-
-  fetcher_task.task()->Return();
-  fetcher_task.Wait();
-  sth_updater.join();
+  mirrors[0]->server()->Run();
 
   return 0;
 }
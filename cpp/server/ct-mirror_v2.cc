@@ -164,6 +164,11 @@ void STHUpdater(Database* db, ClusterStateController* cluster_state_controller,
   CHECK_NOTNULL(task);
   CHECK_NOTNULL(log_lookup);
 
+  // The compact tree is kept from one round to the next, so that
+  // entries are only read and hashed once, however many STHs are
+  // checked along the way.
+  unique_ptr<CompactMerkleTree> new_tree;
+
   while (true) {
     if (task->CancelRequested()) {
       task->Return(util::Status::CANCELLED);
@@ -172,32 +177,42 @@ void STHUpdater(Database* db, ClusterStateController* cluster_state_controller,
     const int64_t local_size(db->TreeSize());
     latest_local_tree_size_gauge->Set(local_size);
 
-    // log_lookup doesn't yet have the data for the new STHs integrated (that
-    // happens via a callback when the WriteTreeHead() method is called on the
-    // DB), so we'll used a compact tree to pre-validate the STH roots.
-    //
-    // We'll start with one based on the current state of our serving tree and
-    // update it to the STH sizes we're checking.
-    unique_ptr<CompactMerkleTree> new_tree(
-        log_lookup->GetCompactMerkleTree(new Sha256Hasher));
-
     {
       lock_guard<mutex> lock(*queue_mutex);
-      unique_ptr<Database::Iterator> entries(
-          db->ScanEntries(new_tree->LeafCount()));
+      unique_ptr<Database::Iterator> entries;
       while (!queue->empty() &&
              queue->begin()->second.tree_size() <= local_size) {
         const SignedTreeHead next_sth(queue->begin()->second);
         queue->erase(queue->begin());
 
+        CHECK_LE(next_sth.tree_size(), local_size);
+        CHECK_GE(next_sth.tree_size(), 0);
+        const uint64_t next_sth_tree_size(
+            static_cast<uint64_t>(next_sth.tree_size()));
+
+        // log_lookup doesn't yet have the data for the new STHs
+        // integrated (that happens via a callback when the
+        // WriteTreeHead() method is called on the DB), so we'll use a
+        // compact tree to pre-validate the STH roots.
+        //
+        // It starts from the current state of our serving tree, and
+        // only needs to start over if it is behind that, or if an
+        // STH for a size it went past shows up late.
+        const uint64_t serving_tree_size(log_lookup->GetSTH().tree_size());
+        if (!new_tree || new_tree->LeafCount() < serving_tree_size ||
+            (new_tree->LeafCount() > next_sth_tree_size &&
+             next_sth_tree_size > serving_tree_size)) {
+          new_tree = log_lookup->GetCompactMerkleTree(new Sha256Hasher);
+          entries.reset();
+        }
+
         // First, if necessary, catch our local compact tree up to the
         // candidate STH size:
-        {
+        if (new_tree->LeafCount() < next_sth_tree_size) {
+          if (!entries) {
+            entries = db->ScanEntries(new_tree->LeafCount());
+          }
           LoggedEntry entry;
-          CHECK_LE(next_sth.tree_size(), local_size);
-          CHECK_GE(next_sth.tree_size(), 0);
-          const uint64_t next_sth_tree_size(
-              static_cast<uint64_t>(next_sth.tree_size()));
           while (new_tree->LeafCount() < next_sth_tree_size) {
             CHECK(entries->GetNextEntry(&entry));
             CHECK(entry.has_sequence_number());
@@ -216,7 +231,7 @@ void STHUpdater(Database* db, ClusterStateController* cluster_state_controller,
         // our serving tree, otherwise use the root we just calculated with our
         // compact tree.
         const string local_root_at_snapshot(
-            next_sth.tree_size() > log_lookup->GetSTH().tree_size()
+            next_sth_tree_size > serving_tree_size
                 ? new_tree->CurrentRoot()
                 : log_lookup->RootAtSnapshot(next_sth.tree_size()));
 
@@ -336,16 +351,21 @@ int main(int argc, char* argv[]) {
   map<int64_t, ct::SignedTreeHead> queue;
 
   const function<void(const ct::SignedTreeHead&)> new_sth(
-      [&queue_mutex, &queue](const ct::SignedTreeHead& sth) {
-        lock_guard<mutex> lock(queue_mutex);
-        const auto it(queue.find(sth.tree_size()));
-        if (it != queue.end() && sth.timestamp() < it->second.timestamp()) {
-          LOG(WARNING) << "Received older STH:\nHad:\n"
-                       << it->second.DebugString() << "\nGot:\n"
-                       << sth.DebugString();
-          return;
+      [&queue_mutex, &queue, &server](const ct::SignedTreeHead& sth) {
+        {
+          lock_guard<mutex> lock(queue_mutex);
+          const auto it(queue.find(sth.tree_size()));
+          if (it != queue.end() &&
+              sth.timestamp() < it->second.timestamp()) {
+            LOG(WARNING) << "Received older STH:\nHad:\n"
+                         << it->second.DebugString() << "\nGot:\n"
+                         << sth.DebugString();
+            return;
+          }
+          queue.insert(make_pair(sth.tree_size(), sth));
         }
-        queue.insert(make_pair(sth.tree_size(), sth));
+        // Start fetching the new entries right away.
+        server.continuous_fetcher()->NewEntriesAvailable();
       });
 
   const shared_ptr<RemotePeer> peer(make_shared<RemotePeer>(
@@ -1,12 +1,16 @@
 /* -*- indent-tabs-mode: nil -*- */
 
 #include <gflags/gflags.h>
+#include <google/protobuf/text_format.h>
 #include <openssl/err.h>
 #include <signal.h>
 #include <stdlib.h>
 #include <unistd.h>
+#include <chrono>
 #include <iostream>
+#include <set>
 #include <string>
+#include <vector>
 
 #include "config.h"
 #include "log/cert_checker.h"
@@ -25,15 +29,23 @@
 #include "server/certificate_handler.h"
 #include "server/log_processes.h"
 #include "server/server.h"
+#include "server/json_output.h"
 #include "server/server_helper.h"
 #include "server/staleness_tracker.h"
+#include "server/startup_status.h"
 #include "util/etcd.h"
 #include "util/init.h"
+#include "util/json_wrapper.h"
 #include "util/libevent_wrapper.h"
 #include "util/read_key.h"
 #include "util/status.h"
+#include "util/thread_placement.h"
+#include "util/util.h"
 #include "util/uuid.h"
 
+// Defined in server_helper.
+DECLARE_string(etcd_root);
+
 DEFINE_string(key, "", "PEM-encoded server private key file");
 DEFINE_string(trusted_cert_file, "",
               "File for trusted CA certificates, in concatenated PEM format");
@@ -42,6 +54,33 @@ DEFINE_double(guard_window_seconds, 60,
               "number of seconds will not be sequenced.");
 DEFINE_int32(num_http_server_threads, 16,
              "Number of threads for servicing the incoming HTTP requests.");
+DEFINE_string(shards_config, "",
+              "File holding a ct.LogShardsConfig in text format, to serve "
+              "several logs (e.g. temporal shards) from this process, each "
+              "under its own path prefix. They share the HTTP server, "
+              "thread pools and trusted certificates. --key and the "
+              "database flags are then not used.");
+// See util/thread_placement.h for the syntax of these.
+DEFINE_string(http_pool_placement, "",
+              "Where the threads servicing HTTP requests run.");
+DEFINE_string(internal_pool_placement, "",
+              "Where the threads of the internal pool run.");
+DEFINE_string(submission_pool_placement, "",
+              "Where the threads verifying submissions run.");
+DEFINE_string(hash_pool_placement, "",
+              "Where the threads hashing for the tree signer run.");
+DEFINE_string(event_pump_placement, "",
+              "Where the thread running the event loop runs.");
+DEFINE_string(log_memory_placement, "",
+              "Where the threads opening the database and loading the "
+              "Merkle tree of each log run, one log per CPU with "
+              "\"spread\". On Linux, this also puts the tree and leaf "
+              "index on the NUMA node of those CPUs, which should then "
+              "be the one the HTTP threads run on.");
+DEFINE_int32(warmup_timeout_seconds, 60,
+             "Longest the warm-up of the caches of each log may keep the "
+             "node from reporting itself ready; what is left of it is "
+             "then skipped. 0 to skip it altogether.");
 
 namespace libevent = cert_trans::libevent;
 
@@ -59,19 +98,29 @@ using cert_trans::SequenceEntries;
 using cert_trans::Server;
 using cert_trans::SignMerkleTree;
 using cert_trans::StalenessTracker;
+using cert_trans::StartupStatus;
+using cert_trans::ThreadPlacement;
 using cert_trans::ThreadPool;
 using cert_trans::TreeSigner;
 using cert_trans::UrlFetcher;
 using ct::ClusterNodeState;
+using ct::LogShardConfig;
+using ct::LogShardsConfig;
 using ct::SignedTreeHead;
 using google::RegisterFlagValidator;
+using google::protobuf::TextFormat;
 using std::bind;
+using std::chrono::seconds;
+using std::chrono::steady_clock;
 using std::function;
 using std::make_shared;
+using std::move;
+using std::placeholders::_1;
 using std::shared_ptr;
 using std::string;
 using std::thread;
 using std::unique_ptr;
+using std::vector;
 
 
 namespace {
@@ -85,11 +134,341 @@ static bool ValidateRead(const char* flagname, const string& path) {
   return true;
 }
 
-static const bool key_dummy = RegisterFlagValidator(&FLAGS_key, &ValidateRead);
+static bool ValidateKey(const char* flagname, const string& path) {
+  // Each log has its own key when serving several.
+  return (path.empty() && !FLAGS_shards_config.empty()) ||
+         ValidateRead(flagname, path);
+}
+
+static const bool key_dummy = RegisterFlagValidator(&FLAGS_key, &ValidateKey);
 
 static const bool cert_dummy =
     RegisterFlagValidator(&FLAGS_trusted_cert_file, &ValidateRead);
 
+static bool ValidatePlacement(const char* flagname, const string& spec) {
+  const util::StatusOr<ThreadPlacement> placement(
+      ThreadPlacement::Parse(spec));
+  if (!placement.ok()) {
+    std::cout << "Invalid " << flagname << ": " << placement.status()
+              << std::endl;
+    return false;
+  }
+  return true;
+}
+
+static const bool http_pool_placement_dummy =
+    RegisterFlagValidator(&FLAGS_http_pool_placement, &ValidatePlacement);
+static const bool internal_pool_placement_dummy =
+    RegisterFlagValidator(&FLAGS_internal_pool_placement, &ValidatePlacement);
+static const bool submission_pool_placement_dummy = RegisterFlagValidator(
+    &FLAGS_submission_pool_placement, &ValidatePlacement);
+static const bool hash_pool_placement_dummy =
+    RegisterFlagValidator(&FLAGS_hash_pool_placement, &ValidatePlacement);
+static const bool event_pump_placement_dummy =
+    RegisterFlagValidator(&FLAGS_event_pump_placement, &ValidatePlacement);
+static const bool log_memory_placement_dummy =
+    RegisterFlagValidator(&FLAGS_log_memory_placement, &ValidatePlacement);
+
+
+// The placement in |spec|, which was validated along with the flags.
+ThreadPlacement Placement(const string& spec) {
+  return ThreadPlacement::Parse(spec).ValueOrDie();
+}
+
+
+
+// The name of startup stage |stage| of the log of |config|, which has
+// the path prefix of the log appended when serving several.
+string StageName(const string& stage, const LogShardConfig& config) {
+  return FLAGS_shards_config.empty() ? stage
+                                     : stage + ":" + config.path_prefix();
+}
+
+
+// Adds the startup stages of the log of |config| to |startup|.
+void AddLogStages(const LogShardConfig& config, StartupStatus* startup) {
+  startup->AddStage(StageName("index", config));
+  startup->AddStage(StageName("tree", config));
+  startup->AddStage(StageName("replication", config));
+  startup->AddStage(StageName("warmup", config));
+}
+
+
+// Replies with the state of the startup stages, with a 503 until they
+// are all done.
+void SendStartupStatus(const StartupStatus* startup, libevent::Base* base,
+                       evhttp_request* req) {
+  JsonObject json;
+  const bool ready(startup->ToJson(&json));
+  cert_trans::SendJsonReply(base, req, ready ? HTTP_OK : HTTP_SERVUNAVAIL,
+                            json);
+}
+
+
+// A log served by this process, with its own key, database, state in
+// etcd and URL path prefix. The logs of a process share its HTTP
+// server, thread pools, URL fetcher, etcd client and trusted
+// certificates.
+class Log {
+ public:
+  // Does not take ownership of anything. The first log must be given a
+  // null |http_server|, so that its Server creates the HTTP server
+  // that the other logs are then given. The stages added by
+  // AddLogStages() are reported to |startup|, and the "roots" stage
+  // must be the loading of |checker|.
+  Log(const LogShardConfig& config, unique_ptr<Database> db,
+      const shared_ptr<libevent::Base>& event_base,
+      ThreadPool* internal_pool, ThreadPool* http_pool,
+      ThreadPool* submission_pool, ThreadPool* hash_pool,
+      UrlFetcher* url_fetcher, EtcdClient* etcd_client,
+      CertChecker* checker, libevent::HttpServer* http_server,
+      StartupStatus* startup);
+  Log(const Log&) = delete;
+  Log& operator=(const Log&) = delete;
+
+  Server* server() {
+    return &server_;
+  }
+
+  // Loads the Merkle tree, and starts serving the log once the trusted
+  // certificates are loaded too. Several logs can be loaded at once.
+  void Load();
+
+  // Sets up a simple single-node environment, see main().
+  void InitStandalone(libevent::Base* event_base, EtcdClient* etcd_client);
+
+  // Starts sequencing and signing, once the database has caught up
+  // with the serving STH.
+  void Start();
+
+ private:
+  static Server::Options ServerOptions(const LogShardConfig& config,
+                                       libevent::HttpServer* http_server);
+
+  const LogShardConfig config_;
+  const shared_ptr<libevent::Base> event_base_;
+  ThreadPool* const internal_pool_;
+  ThreadPool* const submission_pool_;
+  ThreadPool* const hash_pool_;
+  CertChecker* const checker_;
+  StartupStatus* const startup_;
+  EVP_PKEY* const pkey_;
+  LogSigner log_signer_;
+  const unique_ptr<Database> db_;
+  const string etcd_root_;
+  const LogVerifier log_verifier_;
+  Server server_;
+  unique_ptr<Frontend> frontend_;
+  unique_ptr<StalenessTracker> staleness_tracker_;
+  unique_ptr<CertificateHttpHandler> handler_;
+  unique_ptr<TreeSigner> tree_signer_;
+  unique_ptr<thread> sequencer_;
+  unique_ptr<thread> cleanup_;
+  unique_ptr<thread> signer_;
+};
+
+
+EVP_PKEY* ReadKey(const string& file) {
+  util::StatusOr<EVP_PKEY*> pkey(ReadPrivateKey(file));
+  CHECK_EQ(pkey.status(), ::util::OkStatus()) << "Could not read " << file;
+  return pkey.ValueOrDie();
+}
+
+
+// static
+Server::Options Log::ServerOptions(const LogShardConfig& config,
+                                   libevent::HttpServer* http_server) {
+  Server::Options options;
+  options.http_server = http_server;
+  options.etcd_root = config.etcd_root();
+  options.log_lookup_checkpoint_file = config.log_lookup_checkpoint_file();
+  options.fetch_checkpoint_file = config.fetch_checkpoint_file();
+  options.pending_bodies_dir = config.pending_bodies_dir();
+  options.path_prefix = config.path_prefix();
+  options.event_pump_placement = Placement(FLAGS_event_pump_placement);
+  return options;
+}
+
+
+Log::Log(const LogShardConfig& config, unique_ptr<Database> db,
+         const shared_ptr<libevent::Base>& event_base,
+         ThreadPool* internal_pool, ThreadPool* http_pool,
+         ThreadPool* submission_pool, ThreadPool* hash_pool,
+         UrlFetcher* url_fetcher, EtcdClient* etcd_client,
+         CertChecker* checker, libevent::HttpServer* http_server,
+         StartupStatus* startup)
+    : config_(config),
+      event_base_(event_base),
+      internal_pool_(CHECK_NOTNULL(internal_pool)),
+      submission_pool_(CHECK_NOTNULL(submission_pool)),
+      hash_pool_(CHECK_NOTNULL(hash_pool)),
+      checker_(CHECK_NOTNULL(checker)),
+      startup_(CHECK_NOTNULL(startup)),
+      pkey_(ReadKey(config.key())),
+      log_signer_(pkey_),
+      db_(move(db)),
+      etcd_root_(config.etcd_root().empty() ? FLAGS_etcd_root
+                                            : config.etcd_root()),
+      log_verifier_(new LogSigVerifier(pkey_),
+                    new MerkleVerifier(
+                        unique_ptr<Sha256Hasher>(new Sha256Hasher))),
+      server_(event_base, internal_pool, http_pool, CHECK_NOTNULL(db_.get()),
+              etcd_client, url_fetcher, &log_verifier_,
+              ServerOptions(config, http_server)) {
+}
+
+
+void Log::Load() {
+  startup_->Start(StageName("tree", config_));
+  server_.Initialise(false /* is_mirror */);
+  startup_->Finish(StageName("tree", config_));
+
+  frontend_.reset(
+      new Frontend(new FrontendSigner(db_.get(), server_.consistent_store(),
+                                      &log_signer_, internal_pool_)));
+  staleness_tracker_.reset(
+      new StalenessTracker(server_.cluster_state_controller(), internal_pool_,
+                           event_base_.get()));
+  handler_.reset(new CertificateHttpHandler(
+      server_.log_lookup(), db_.get(), server_.cluster_state_controller(),
+      checker_, frontend_.get(), internal_pool_, submission_pool_,
+      event_base_.get(), staleness_tracker_.get()));
+
+  // Connect the handler, proxy and server together, once the handler
+  // can tell which roots are trusted. From then on, the reads that
+  // this node cannot answer yet are proxied to the others.
+  handler_->SetProxy(server_.proxy());
+  handler_->SetPendingEntryBodies(server_.pending_entry_bodies());
+  startup_->WaitFor("roots");
+  handler_->Add(server_.http_server(), config_.path_prefix());
+
+  // Resume the signer's tree from the frontier it last stored, if
+  // any, rather than building it from every entry in the log.
+  unique_ptr<CompactMerkleTree> signer_tree(TreeSigner::ResumeTree(
+      db_.get(), unique_ptr<SerialHasher>(new Sha256Hasher)));
+  if (!signer_tree) {
+    signer_tree = server_.log_lookup()->GetCompactMerkleTree(new Sha256Hasher);
+  }
+  tree_signer_.reset(new TreeSigner(
+      std::chrono::duration<double>(FLAGS_guard_window_seconds), db_.get(),
+      move(signer_tree), server_.consistent_store(), &log_signer_,
+      hash_pool_));
+}
+
+
+void Log::InitStandalone(libevent::Base* event_base,
+                         EtcdClient* etcd_client) {
+  // Put a sensible single-node config into FakeEtcd. For a real clustered
+  // log
+  // we'd expect a ClusterConfig already to be present within etcd as part of
+  // the provisioning of the log.
+  //
+  // TODO(alcutter): Note that we're currently broken wrt to restarting the
+  // log server when there's data in the log.  It's a temporary thing though,
+  // so fear ye not.
+  ct::ClusterConfig config;
+  config.set_minimum_serving_nodes(1);
+  config.set_minimum_serving_fraction(1);
+  LOG(INFO) << "Setting default single-node ClusterConfig:\n"
+            << config.DebugString();
+  server_.consistent_store()->SetClusterConfig(config);
+
+  // Since we're a single node cluster, we'll settle that we're the
+  // master here, so that we can populate the initial STH
+  // (StrictConsistentStore won't allow us to do so unless we're master.)
+  server_.election()->StartElection();
+  server_.election()->WaitToBecomeMaster();
+
+  {
+    EtcdClient::Response resp;
+    util::SyncTask task(event_base);
+    etcd_client->Create(etcd_root_ + "/sequence_mapping", "", &resp,
+                        task.task());
+    task.Wait();
+    CHECK_EQ(::util::OkStatus(), task.status());
+  }
+
+  // Do an initial signing run to get the initial STH, again this is
+  // temporary until we re-populate FakeEtcd from the DB.
+  CHECK_EQ(tree_signer_->UpdateTree(), TreeSigner::OK);
+
+  // Need to boot-strap the Serving STH too because we consider it an error
+  // if it's not set, which in turn causes us to not attempt to become
+  // master:
+  server_.consistent_store()->SetServingSTH(tree_signer_->LatestSTH());
+}
+
+
+void Log::Start() {
+  const string replication_stage(StageName("replication", config_));
+  startup_->Start(replication_stage);
+  server_.WaitForReplication(
+      [this, &replication_stage](int64_t local_size, int64_t serving_size) {
+        startup_->SetProgress(replication_stage, local_size, serving_size);
+      });
+  startup_->Finish(replication_stage);
+
+  // Only once the database has caught up, so that what gets warmed up
+  // is what the first requests will be for.
+  const string warmup_stage(StageName("warmup", config_));
+  startup_->Start(warmup_stage);
+  if (FLAGS_warmup_timeout_seconds > 0) {
+    const steady_clock::time_point deadline(
+        steady_clock::now() + seconds(FLAGS_warmup_timeout_seconds));
+    if (!server_.WarmUp(deadline,
+                        [this, &warmup_stage](int64_t done, int64_t total) {
+                          startup_->SetProgress(warmup_stage, done, total);
+                        }) ||
+        !handler_->WarmUp(deadline)) {
+      LOG(WARNING) << "Cache warm-up timed out, serving anyway";
+    }
+  }
+  startup_->Finish(warmup_stage);
+
+  // TODO(pphaneuf): We should be remaining in an "unhealthy state"
+  // (either not accepting any requests, or returning some internal
+  // server error) until we have an STH to serve.
+  const function<bool()> is_master(bind(&Server::IsMaster, &server_));
+  sequencer_.reset(new thread(&SequenceEntries, tree_signer_.get(),
+                              server_.consistent_store(), internal_pool_,
+                              is_master));
+  cleanup_.reset(
+      new thread(&CleanUpEntries, server_.consistent_store(),
+                 server_.pending_entry_bodies(), db_.get(), is_master));
+  signer_.reset(new thread(&SignMerkleTree, tree_signer_.get(),
+                           server_.consistent_store(),
+                           server_.cluster_state_controller()));
+}
+
+
+// The logs to serve, from --shards_config if set, or else the single
+// one given by the other flags.
+LogShardsConfig ReadShardsConfig() {
+  LogShardsConfig config;
+  if (FLAGS_shards_config.empty()) {
+    LogShardConfig* const shard(config.add_shard());
+    shard->set_key(FLAGS_key);
+    return config;
+  }
+
+  string text;
+  CHECK(util::ReadTextFile(FLAGS_shards_config, &text))
+      << "Could not read " << FLAGS_shards_config;
+  CHECK(TextFormat::ParseFromString(text, &config))
+      << "Could not parse " << FLAGS_shards_config;
+  CHECK_GT(config.shard_size(), 0) << "No shards in " << FLAGS_shards_config;
+  std::set<string> prefixes;
+  std::set<string> etcd_roots;
+  for (const auto& shard : config.shard()) {
+    CHECK(prefixes.insert(shard.path_prefix()).second)
+        << "Duplicate path prefix: " << shard.path_prefix();
+    CHECK(etcd_roots.insert(shard.etcd_root()).second)
+        << "Duplicate etcd root: " << shard.etcd_root();
+  }
+  return config;
+}
+
+
 }  // namespace
 
 
@@ -104,17 +483,39 @@ int main(int argc, char* argv[]) {
 
   Server::StaticInit();
 
-  util::StatusOr<EVP_PKEY*> pkey(ReadPrivateKey(FLAGS_key));
-  CHECK_EQ(pkey.status(), ::util::OkStatus());
-  LogSigner log_signer(pkey.ValueOrDie());
+  cert_trans::EnsureValidatorsRegistered();
+  const LogShardsConfig shards(ReadShardsConfig());
+
+  // The stages of the startup that do not depend on each other run in
+  // parallel, and how far along they are is served at /ready. All the
+  // stages are added first, so that the node does not look ready while
+  // some of them have yet to be.
+  StartupStatus startup;
+  startup.AddStage("roots");
+  for (const auto& shard : shards.shard()) {
+    AddLogStages(shard, &startup);
+  }
 
   CertChecker checker;
-  CHECK(checker.LoadTrustedCertificates(FLAGS_trusted_cert_file))
-      << "Could not load CA certs from " << FLAGS_trusted_cert_file;
-
-  cert_trans::EnsureValidatorsRegistered();
-  const unique_ptr<Database> db(cert_trans::ProvideDatabase());
-  CHECK(db) << "No database instance created, check flag settings";
+  thread roots_loader(startup.Run("roots", [&checker]() {
+    CHECK(checker.LoadTrustedCertificates(FLAGS_trusted_cert_file))
+        << "Could not load CA certs from " << FLAGS_trusted_cert_file;
+  }));
+
+  vector<unique_ptr<Database>> dbs(shards.shard_size());
+  vector<thread> db_openers;
+  for (int i = 0; i < shards.shard_size(); ++i) {
+    const LogShardConfig& shard(shards.shard(i));
+    db_openers.emplace_back(
+        startup.Run(StageName("index", shard), [&dbs, i, &shard]() {
+          Placement(FLAGS_log_memory_placement).Apply(i);
+          dbs[i] = FLAGS_shards_config.empty()
+                       ? cert_trans::ProvideDatabase()
+                       : cert_trans::ProvideShardDatabase(shard);
+          CHECK(dbs[i])
+              << "No database instance created, check flag settings";
+        }));
+  }
 
   shared_ptr<libevent::Base> event_base(make_shared<libevent::Base>());
 
@@ -123,7 +524,8 @@ int main(int argc, char* argv[]) {
    // internal pool are processing add-chain request, as during processing
    // additional thread from internal pool is needed for each request for adding
    // pending entry to etcd server.
-  ThreadPool internal_pool(FLAGS_num_http_server_threads * 2);
+  ThreadPool internal_pool(FLAGS_num_http_server_threads * 2,
+                          Placement(FLAGS_internal_pool_placement));
   UrlFetcher url_fetcher(event_base.get(), &internal_pool);
 
   const bool stand_alone_mode(cert_trans::IsStandalone(true));
@@ -134,89 +536,52 @@ int main(int argc, char* argv[]) {
       cert_trans::ProvideEtcdClient(event_base.get(), &internal_pool,
                                     &url_fetcher));
 
-  const LogVerifier log_verifier(new LogSigVerifier(pkey.ValueOrDie()),
-                                 new MerkleVerifier(unique_ptr<Sha256Hasher>(
-                                     new Sha256Hasher)));
-
-  ThreadPool http_pool(FLAGS_num_http_server_threads);
-
-  Server server(event_base, &internal_pool, &http_pool, db.get(),
-                etcd_client.get(), &url_fetcher, &log_verifier);
-  server.Initialise(false /* is_mirror */);
-
-  Frontend frontend(
-      new FrontendSigner(db.get(), server.consistent_store(), &log_signer));
-  unique_ptr<StalenessTracker> staleness_tracker(
-      new StalenessTracker(server.cluster_state_controller(), &internal_pool,
-                           event_base.get()));
-  CertificateHttpHandler handler(server.log_lookup(), db.get(),
-                                 server.cluster_state_controller(), &checker,
-                                 &frontend, &internal_pool, event_base.get(),
-                                 staleness_tracker.get());
-
-  // Connect the handler, proxy and server together
-  handler.SetProxy(server.proxy());
-  handler.Add(server.http_server());
-
-  TreeSigner tree_signer(
-      std::chrono::duration<double>(FLAGS_guard_window_seconds), db.get(),
-      server.log_lookup()->GetCompactMerkleTree(new Sha256Hasher),
-      server.consistent_store(), &log_signer);
-
-  if (stand_alone_mode) {
-    // Set up a simple single-node environment.
-    //
-    // Put a sensible single-node config into FakeEtcd. For a real clustered
-    // log
-    // we'd expect a ClusterConfig already to be present within etcd as part of
-    // the provisioning of the log.
-    //
-    // TODO(alcutter): Note that we're currently broken wrt to restarting the
-    // log server when there's data in the log.  It's a temporary thing though,
-    // so fear ye not.
-    ct::ClusterConfig config;
-    config.set_minimum_serving_nodes(1);
-    config.set_minimum_serving_fraction(1);
-    LOG(INFO) << "Setting default single-node ClusterConfig:\n"
-              << config.DebugString();
-    server.consistent_store()->SetClusterConfig(config);
-
-    // Since we're a single node cluster, we'll settle that we're the
-    // master here, so that we can populate the initial STH
-    // (StrictConsistentStore won't allow us to do so unless we're master.)
-    server.election()->StartElection();
-    server.election()->WaitToBecomeMaster();
-
-    {
-      EtcdClient::Response resp;
-      util::SyncTask task(event_base.get());
-      etcd_client->Create("/root/sequence_mapping", "", &resp, task.task());
-      task.Wait();
-      CHECK_EQ(::util::OkStatus(), task.status());
+  ThreadPool http_pool(FLAGS_num_http_server_threads,
+                      Placement(FLAGS_http_pool_placement));
+  // Submissions are verified on their own pool, sized to the number
+  // of cores, so that signature checking does not compete with read
+  // requests for the internal pool.
+  ThreadPool submission_pool(Placement(FLAGS_submission_pool_placement));
+  // Separate from the internal pool, whose threads may all be blocked on
+  // add-chain requests.
+  ThreadPool hash_pool(Placement(FLAGS_hash_pool_placement));
+
+  // Each log is loaded and started on a thread of its own as soon as
+  // its database is open, and serves what it can as soon as it is
+  // loaded, without waiting for the others.
+  vector<unique_ptr<Log>> logs;
+  vector<thread> log_loaders;
+  for (int i = 0; i < shards.shard_size(); ++i) {
+    db_openers[i].join();
+    logs.emplace_back(new Log(
+        shards.shard(i), move(dbs[i]), event_base, &internal_pool,
+        &http_pool, &submission_pool, &hash_pool, &url_fetcher,
+        etcd_client.get(), &checker,
+        logs.empty() ? nullptr : logs[0]->server()->http_server(),
+        &startup));
+    if (i == 0) {
+      CHECK(logs[0]->server()->http_server()->AddHandler(
+          "/ready", bind(&SendStartupStatus, &startup, event_base.get(), _1)));
     }
-
-    // Do an initial signing run to get the initial STH, again this is
-    // temporary until we re-populate FakeEtcd from the DB.
-    CHECK_EQ(tree_signer.UpdateTree(), TreeSigner::OK);
-
-    // Need to boot-strap the Serving STH too because we consider it an error
-    // if it's not set, which in turn causes us to not attempt to become
-    // master:
-    server.consistent_store()->SetServingSTH(tree_signer.LatestSTH());
+    Log* const log(logs.back().get());
+    log_loaders.emplace_back(
+        [log, i, stand_alone_mode, &event_base, &etcd_client]() {
+          Placement(FLAGS_log_memory_placement).Apply(i);
+          log->Load();
+          if (stand_alone_mode) {
+            log->InitStandalone(event_base.get(), etcd_client.get());
+          }
+          log->Start();
+        });
   }
 
-  server.WaitForReplication();
-
-  // TODO(pphaneuf): We should be remaining in an "unhealthy state"
-  // (either not accepting any requests, or returning some internal
-  // server error) until we have an STH to serve.
-  const function<bool()> is_master(bind(&Server::IsMaster, &server));
-  thread sequencer(&SequenceEntries, &tree_signer, is_master);
-  thread cleanup(&CleanUpEntries, server.consistent_store(), is_master);
-  thread signer(&SignMerkleTree, &tree_signer, server.consistent_store(),
-                server.cluster_state_controller());
+  roots_loader.join();
+  for (auto& loader : log_loaders) {
+    loader.join();
+  }
+  LOG(INFO) << "Startup done";
 
-  server.Run();
+  logs[0]->server()->Run();
 
   return 0;
 }
@@ -70,6 +70,7 @@ using google::RegisterFlagValidator;
 using std::bind;
 using std::function;
 using std::make_shared;
+using std::move;
 using std::shared_ptr;
 using std::string;
 using std::thread;
@@ -146,7 +147,8 @@ int main(int argc, char* argv[]) {
   server.Initialise(false /* is_mirror */);
 
   Frontend frontend(
-      new FrontendSigner(db.get(), server.consistent_store(), &log_signer));
+      new FrontendSigner(db.get(), server.consistent_store(), &log_signer,
+                         &internal_pool));
   unique_ptr<StalenessTracker> staleness_tracker(
       new StalenessTracker(server.cluster_state_controller(), &internal_pool,
                            event_base.get()));
@@ -157,12 +159,22 @@ int main(int argc, char* argv[]) {
 
   // Connect the handler, proxy and server together
   handler.SetProxy(server.proxy());
+  handler.SetPendingEntryBodies(server.pending_entry_bodies());
   handler.Add(server.http_server());
 
+  // Separate from the internal pool, whose threads may all be blocked on
+  // add-chain requests.
+  ThreadPool hash_pool;
+  // Resume the signer's tree from the frontier it last stored, if
+  // any, rather than building it from every entry in the log.
+  unique_ptr<CompactMerkleTree> signer_tree(TreeSigner::ResumeTree(
+      db.get(), unique_ptr<SerialHasher>(new Sha256Hasher)));
+  if (!signer_tree) {
+    signer_tree = server.log_lookup()->GetCompactMerkleTree(new Sha256Hasher);
+  }
   TreeSigner tree_signer(
       std::chrono::duration<double>(FLAGS_guard_window_seconds), db.get(),
-      server.log_lookup()->GetCompactMerkleTree(new Sha256Hasher),
-      server.consistent_store(), &log_signer);
+      move(signer_tree), server.consistent_store(), &log_signer, &hash_pool);
 
   if (stand_alone_mode) {
     // Set up a simple single-node environment.
@@ -212,8 +224,10 @@ int main(int argc, char* argv[]) {
   // (either not accepting any requests, or returning some internal
   // server error) until we have an STH to serve.
   const function<bool()> is_master(bind(&Server::IsMaster, &server));
-  thread sequencer(&SequenceEntries, &tree_signer, is_master);
-  thread cleanup(&CleanUpEntries, server.consistent_store(), is_master);
+  thread sequencer(&SequenceEntries, &tree_signer, server.consistent_store(),
+                   &internal_pool, is_master);
+  thread cleanup(&CleanUpEntries, server.consistent_store(),
+                 server.pending_entry_bodies(), db.get(), is_master);
   thread signer(&SignMerkleTree, &tree_signer, server.consistent_store(),
                 server.cluster_state_controller());
 
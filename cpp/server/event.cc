@@ -242,7 +242,8 @@ void UDPServer::QueuePacket(const sockaddr_in& to, const char* buf,
   write_queue_.push_back(wbuf);
 }
 
-bool Services::InitServer(int* sock, int port, const char* ip, int type) {
+bool Services::InitServer(int* sock, int port, const char* ip, int type,
+                          bool reuse_port) {
   bool ret = false;
   struct sockaddr_in server;
   int s = -1;
@@ -267,6 +268,19 @@ bool Services::InitServer(int* sock, int port, const char* ip, int type) {
     setsockopt(s, SOL_SOCKET, SO_REUSEADDR, &j, sizeof j);
   }
 
+  if (reuse_port) {
+#ifdef SO_REUSEPORT
+    int j = 1;
+    if (setsockopt(s, SOL_SOCKET, SO_REUSEPORT, &j, sizeof j) == -1) {
+      perror("setsockopt(SO_REUSEPORT)");
+      goto err;
+    }
+#else
+    LOG(ERROR) << "SO_REUSEPORT is not supported";
+    goto err;
+#endif
+  }
+
   if (bind(s, (struct sockaddr*)&server, sizeof(server)) == -1) {
     perror("bind");
     goto err;
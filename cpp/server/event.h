@@ -25,7 +25,11 @@ class Services {
     rough_time_ = 0;
   }
 
-  static bool InitServer(int* sock, int port, const char* ip, int type);
+  // With |reuse_port|, several sockets can be bound to the same port
+  // (where SO_REUSEPORT is supported), and the kernel spreads the
+  // incoming connections or packets between them.
+  static bool InitServer(int* sock, int port, const char* ip, int type,
+                         bool reuse_port = false);
 
  private:
   // This class is only used as a namespace, it should never be
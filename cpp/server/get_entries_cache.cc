@@ -0,0 +1,73 @@
+#include "server/get_entries_cache.h"
+
+#include <glog/logging.h>
+#include <functional>
+
+using std::hash;
+using std::lock_guard;
+using std::mutex;
+using std::shared_ptr;
+using std::string;
+
+namespace cert_trans {
+
+
+size_t GetEntriesCache::KeyHash::operator()(const Key& key) const {
+  // Windows are usually aligned and of a fixed size, so mix both ends.
+  return (hash<int64_t>()(key.start) * 31 + hash<int64_t>()(key.end)) * 8 +
+         (key.include_scts ? 4 : 0) + static_cast<size_t>(key.encoding);
+}
+
+
+GetEntriesCache::GetEntriesCache(size_t max_bytes)
+    : max_bytes_(max_bytes), size_bytes_(0) {
+}
+
+
+shared_ptr<const string> GetEntriesCache::Find(int64_t start, int64_t end,
+                                               bool include_scts,
+                                               ContentEncoding encoding) {
+  lock_guard<mutex> lock(lock_);
+  const auto it(index_.find(Key{start, end, include_scts, encoding}));
+  if (it == index_.end())
+    return nullptr;
+
+  // Move it to the front.
+  entries_.splice(entries_.begin(), entries_, it->second);
+  return it->second->body;
+}
+
+
+void GetEntriesCache::Insert(int64_t start, int64_t end, bool include_scts,
+                             ContentEncoding encoding,
+                             const shared_ptr<const string>& body) {
+  CHECK(body);
+  if (body->size() > max_bytes_)
+    return;
+
+  const Key key{start, end, include_scts, encoding};
+  lock_guard<mutex> lock(lock_);
+  if (index_.find(key) != index_.end())
+    // Another request got there first, and the contents are the same.
+    return;
+
+  while (size_bytes_ + body->size() > max_bytes_) {
+    CHECK(!entries_.empty());
+    size_bytes_ -= entries_.back().body->size();
+    index_.erase(entries_.back().key);
+    entries_.pop_back();
+  }
+
+  entries_.push_front(Entry{key, body});
+  index_.emplace(key, entries_.begin());
+  size_bytes_ += body->size();
+}
+
+
+size_t GetEntriesCache::size_bytes() const {
+  lock_guard<mutex> lock(lock_);
+  return size_bytes_;
+}
+
+
+}  // namespace cert_trans
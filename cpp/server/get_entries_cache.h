@@ -0,0 +1,82 @@
+#ifndef CERT_TRANS_SERVER_GET_ENTRIES_CACHE_H_
+#define CERT_TRANS_SERVER_GET_ENTRIES_CACHE_H_
+
+#include <stddef.h>
+#include <stdint.h>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+
+#include "util/compression.h"
+
+namespace cert_trans {
+
+
+// A bounded, least recently used cache of serialized get-entries
+// response bodies, keyed by the requested range and the content coding
+// of the body, so that hot responses only get compressed once.
+//
+// Entries are never invalidated, so callers must only insert responses
+// for ranges that cannot change anymore, i.e. that are entirely covered
+// by the tree head being served.
+//
+// This class is thread-safe.
+class GetEntriesCache {
+ public:
+  // The cache holds at most |max_bytes| of response bodies.
+  explicit GetEntriesCache(size_t max_bytes);
+  GetEntriesCache(const GetEntriesCache&) = delete;
+  GetEntriesCache& operator=(const GetEntriesCache&) = delete;
+
+  // Returns the cached body for this range, or nullptr if there is none.
+  std::shared_ptr<const std::string> Find(int64_t start, int64_t end,
+                                          bool include_scts,
+                                          ContentEncoding encoding);
+
+  // Adds |body| as the response for this range, evicting the least
+  // recently used entries as needed. Bodies that are larger than the
+  // whole cache are not kept.
+  void Insert(int64_t start, int64_t end, bool include_scts,
+              ContentEncoding encoding,
+              const std::shared_ptr<const std::string>& body);
+
+  // Total size of the cached bodies, in bytes.
+  size_t size_bytes() const;
+
+ private:
+  struct Key {
+    bool operator==(const Key& other) const {
+      return start == other.start && end == other.end &&
+             include_scts == other.include_scts && encoding == other.encoding;
+    }
+
+    int64_t start;
+    int64_t end;
+    bool include_scts;
+    ContentEncoding encoding;
+  };
+
+  struct KeyHash {
+    size_t operator()(const Key& key) const;
+  };
+
+  struct Entry {
+    Key key;
+    std::shared_ptr<const std::string> body;
+  };
+
+  const size_t max_bytes_;
+
+  mutable std::mutex lock_;
+  // Most recently used first.
+  std::list<Entry> entries_;
+  std::unordered_map<Key, std::list<Entry>::iterator, KeyHash> index_;
+  size_t size_bytes_;
+};
+
+
+}  // namespace cert_trans
+
+#endif  // CERT_TRANS_SERVER_GET_ENTRIES_CACHE_H_
@@ -0,0 +1,95 @@
+#include "server/get_entries_cache.h"
+
+#include <gtest/gtest.h>
+#include <memory>
+#include <string>
+
+#include "util/testing.h"
+
+namespace cert_trans {
+namespace {
+
+using std::make_shared;
+using std::shared_ptr;
+using std::string;
+
+
+const ContentEncoding kPlain(ContentEncoding::IDENTITY);
+
+
+shared_ptr<const string> Body(size_t size, char c) {
+  return make_shared<const string>(size, c);
+}
+
+
+TEST(GetEntriesCacheTest, FindsWhatWasInserted) {
+  GetEntriesCache cache(1000);
+  EXPECT_EQ(nullptr, cache.Find(0, 9, false, kPlain));
+
+  const shared_ptr<const string> body(Body(100, 'a'));
+  cache.Insert(0, 9, false, kPlain, body);
+  EXPECT_EQ(body, cache.Find(0, 9, false, kPlain));
+  EXPECT_EQ(100U, cache.size_bytes());
+
+  // Every part of the key matters.
+  EXPECT_EQ(nullptr, cache.Find(0, 9, true, kPlain));
+  EXPECT_EQ(nullptr, cache.Find(0, 10, false, kPlain));
+  EXPECT_EQ(nullptr, cache.Find(1, 9, false, kPlain));
+  EXPECT_EQ(nullptr, cache.Find(0, 9, false, ContentEncoding::GZIP));
+
+  // Each encoding of a response is kept separately.
+  const shared_ptr<const string> gzipped(Body(20, 'z'));
+  cache.Insert(0, 9, false, ContentEncoding::GZIP, gzipped);
+  EXPECT_EQ(gzipped, cache.Find(0, 9, false, ContentEncoding::GZIP));
+  EXPECT_EQ(body, cache.Find(0, 9, false, kPlain));
+  EXPECT_EQ(120U, cache.size_bytes());
+}
+
+
+TEST(GetEntriesCacheTest, EvictsLeastRecentlyUsed) {
+  GetEntriesCache cache(300);
+  cache.Insert(0, 9, false, kPlain, Body(100, 'a'));
+  cache.Insert(10, 19, false, kPlain, Body(100, 'b'));
+  cache.Insert(20, 29, false, kPlain, Body(100, 'c'));
+  EXPECT_EQ(300U, cache.size_bytes());
+
+  // Make the first one the most recently used, so that the second one
+  // goes first.
+  EXPECT_NE(nullptr, cache.Find(0, 9, false, kPlain));
+  cache.Insert(30, 39, false, kPlain, Body(100, 'd'));
+  EXPECT_EQ(300U, cache.size_bytes());
+  EXPECT_NE(nullptr, cache.Find(0, 9, false, kPlain));
+  EXPECT_EQ(nullptr, cache.Find(10, 19, false, kPlain));
+  EXPECT_NE(nullptr, cache.Find(20, 29, false, kPlain));
+  EXPECT_NE(nullptr, cache.Find(30, 39, false, kPlain));
+
+  // A larger entry can push out several.
+  cache.Insert(40, 49, false, kPlain, Body(250, 'e'));
+  EXPECT_EQ(250U, cache.size_bytes());
+  EXPECT_NE(nullptr, cache.Find(40, 49, false, kPlain));
+  EXPECT_EQ(nullptr, cache.Find(0, 9, false, kPlain));
+}
+
+
+TEST(GetEntriesCacheTest, IgnoresOversizedAndDuplicateEntries) {
+  GetEntriesCache cache(100);
+  cache.Insert(0, 9, false, kPlain, Body(101, 'a'));
+  EXPECT_EQ(nullptr, cache.Find(0, 9, false, kPlain));
+  EXPECT_EQ(0U, cache.size_bytes());
+
+  const shared_ptr<const string> body(Body(50, 'b'));
+  cache.Insert(0, 9, false, kPlain, body);
+  cache.Insert(0, 9, false, kPlain, Body(50, 'c'));
+  EXPECT_EQ(body, cache.Find(0, 9, false, kPlain));
+  EXPECT_EQ(50U, cache.size_bytes());
+}
+
+
+}  // namespace
+}  // namespace cert_trans
+
+
+int main(int argc, char** argv) {
+  cert_trans::test::InitTesting(argv[0], &argc, &argv, true);
+  return RUN_ALL_TESTS();
+}
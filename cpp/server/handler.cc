@@ -1,5 +1,6 @@
 #include "server/handler.h"
 
+#include <errno.h>
 #include <gflags/gflags.h>
 #include <glog/logging.h>
 #include <stdint.h>
@@ -7,9 +8,11 @@
 #include <algorithm>
 #include <algorithm>
 #include <functional>
+#include <limits>
 #include <memory>
 #include <mutex>
 #include <string>
+#include <unordered_set>
 #include <vector>
 
 #include "log/cert.h"
@@ -17,48 +20,294 @@
 #include "log/cluster_state_controller.h"
 #include "log/log_lookup.h"
 #include "log/logged_entry.h"
+#include "log/pending_entry_bodies.h"
 #include "monitoring/latency.h"
 #include "monitoring/monitoring.h"
+#include "proto/binary_entries.h"
+#include "server/binary_segment_files.h"
+#include "server/get_entries_cache.h"
 #include "server/json_output.h"
 #include "server/proxy.h"
+#include "server/rate_limiter.h"
+#include "server/sth_long_poll.h"
+#include "util/async_log.h"
+#include "util/compression.h"
+#include "util/json_stream_writer.h"
 #include "util/json_wrapper.h"
+#include "util/task.h"
 #include "util/thread_pool.h"
+#include "util/tracing.h"
+#include "util/util.h"
 
 namespace libevent = cert_trans::libevent;
 
+using cert_trans::BinarySegmentFiles;
+using cert_trans::ChunkedJsonReply;
+using cert_trans::ContentEncoding;
 using cert_trans::Counter;
+using cert_trans::Database;
+using cert_trans::GetEntriesCache;
 using cert_trans::HttpHandler;
+using cert_trans::JsonStreamWriter;
 using cert_trans::Latency;
 using cert_trans::LoggedEntry;
 using cert_trans::Proxy;
+using cert_trans::RateLimiter;
+using cert_trans::ResponseEncoding;
+using cert_trans::STHLongPoll;
 using cert_trans::ScopedLatency;
+using cert_trans::ScopedSpan;
+using cert_trans::ScopedTrace;
 using ct::ShortMerkleAuditProof;
 using ct::SignedCertificateTimestamp;
 using ct::SignedTreeHead;
 using std::bind;
+using std::chrono::duration;
+using std::chrono::duration_cast;
 using std::chrono::milliseconds;
 using std::chrono::seconds;
+using std::chrono::steady_clock;
 using std::lock_guard;
 using std::make_shared;
+using std::max;
 using std::multimap;
+using std::numeric_limits;
 using std::min;
+using std::move;
 using std::mutex;
 using std::placeholders::_1;
+using std::shared_ptr;
 using std::string;
 using std::unique_ptr;
+using std::unordered_set;
 using std::vector;
 
+DECLARE_int32(log_lookup_precomputed_consistency_proofs);
+
 DEFINE_int32(max_leaf_entries_per_response, 1000,
              "maximum number of entries to put in the response of a "
              "get-entries request");
+DEFINE_int64(get_entries_cache_size_bytes, 64 << 20,
+             "maximum total size of the get-entries responses kept in "
+             "memory to serve repeated requests, 0 to disable");
+DEFINE_int32(get_entries_chunk_entries, 100,
+             "number of entries written out at a time for get-entries "
+             "responses; larger ones are sent in chunks as they are written");
+DEFINE_int32(warmup_get_entries_pages, 20,
+             "number of the newest complete pages of "
+             "--max_leaf_entries_per_response entries put in the "
+             "get-entries cache on startup, as far as it has room for "
+             "them");
+DEFINE_int64(get_entries_max_bytes_in_flight, 1 << 20,
+             "maximum number of bytes of a chunked get-entries response "
+             "waiting to be written to the client");
+DEFINE_int64(get_entries_max_cached_response_bytes, 16 << 20,
+             "get-entries responses larger than this are not cached, so "
+             "that they can be streamed without being held whole");
+DEFINE_string(trusted_mirrors, "",
+              "comma-separated IP addresses of the clients allowed "
+              "--max_leaf_entries_per_trusted_response entries per "
+              "get-entries response, such as our own mirrors");
+DEFINE_int32(max_leaf_entries_per_trusted_response, 100000,
+             "maximum number of entries to put in the response of a "
+             "get-entries request from one of the --trusted_mirrors");
+DEFINE_int32(get_entries_binary_zstd_level, 3,
+             "zstd compression level of binary get-entries responses, for "
+             "the clients which accept it");
+DEFINE_string(get_entries_binary_segment_dir, "",
+              "directory in which to keep the binary get-entries responses "
+              "for aligned ranges of --get_entries_binary_segment_entries "
+              "entries, which are then sent with sendfile() and without "
+              "compression; empty to disable");
+DEFINE_int32(get_entries_binary_segment_entries, 1000,
+             "number of entries in the ranges kept in "
+             "--get_entries_binary_segment_dir");
+DEFINE_int32(get_sth_long_poll_timeout_seconds, 30,
+             "How long a get-sth request with a \"newer_than\" parameter "
+             "may be held until there is a newer STH, 0 to always answer "
+             "right away. This should stay below the read timeout of the "
+             "clients.");
+DEFINE_int32(get_sth_max_age_seconds, 0,
+             "how long caches may serve a get-sth response without "
+             "checking for a newer one; 0 has them check every time, "
+             "which the ETag of the response makes cheap");
+DEFINE_int32(max_hashes_per_proofs_request, 100,
+             "maximum number of leaf hashes a get-proofs-by-hash request "
+             "may ask a proof for");
+DEFINE_double(rate_limit_writes_per_second, 0,
+              "add-chain and add-pre-chain requests allowed per second "
+              "from each client, 0 for no limit");
+DEFINE_double(rate_limit_proofs_per_second, 0,
+              "get-proof-by-hash, get-proofs-by-hash and "
+              "get-sth-consistency requests allowed per second from each "
+              "client, 0 for no limit");
+DEFINE_double(rate_limit_bulk_reads_per_second, 0,
+              "get-entries requests allowed per second from each client, "
+              "0 for no limit");
+DEFINE_double(rate_limit_burst_seconds, 10,
+              "how many seconds worth of requests a client that was idle "
+              "can send at once");
+DEFINE_int32(rate_limit_max_clients, 100000,
+             "maximum number of clients tracked for rate limiting");
+DEFINE_string(rate_limit_client_header, "",
+              "header identifying the client for rate limiting, such as "
+              "X-Forwarded-For or an API key header set by a trusted "
+              "front end; the peer address is used if empty or missing");
+DEFINE_int32(max_queued_reads, 0,
+             "proof and get-entries requests are rejected with a 503 "
+             "while more than this many closures wait on the thread pool, "
+             "so that submissions keep going; 0 for no limit");
+DEFINE_double(request_deadline_seconds, 0,
+              "work for a request that has not started this many seconds "
+              "after it was received, such as a submission waiting for "
+              "the thread pool or a request to etcd, is dropped and the "
+              "request answered with a 503, as the client has likely "
+              "given up on it; 0 for no deadline");
 
 namespace {
 
 
+// Sent with get-sth replies when "newer_than" is supported, giving the
+// longest the reply may be held, in seconds.
+const char kSTHLongPollHeader[] = "X-CT-STH-Long-Poll";
+
+
 static Latency<milliseconds, string> http_server_request_latency_ms(
     "total_http_server_request_latency_ms", "path",
     "Total request latency in ms broken down by path");
 
+static Counter<string, string>* rejected_requests(
+    Counter<string, string>::New("rejected_requests", "class", "reason",
+                                 "Number of requests rejected by admission "
+                                 "control, broken down by class and by "
+                                 "reason (rate_limit or overload)."));
+
+static Counter<bool>* get_entries_cache_lookups(
+    Counter<bool>::New("get_entries_cache_lookups", "hit",
+                       "Number of cacheable get-entries requests, broken "
+                       "down by whether they were served from the cache."));
+
+
+GetEntriesCache* NewGetEntriesCache() {
+  if (FLAGS_get_entries_cache_size_bytes <= 0)
+    return nullptr;
+  return new GetEntriesCache(FLAGS_get_entries_cache_size_bytes);
+}
+
+
+vector<unique_ptr<RateLimiter>> NewRateLimiters() {
+  vector<unique_ptr<RateLimiter>> retval;
+  for (const double rate :
+       {0.0, FLAGS_rate_limit_writes_per_second,
+        FLAGS_rate_limit_proofs_per_second,
+        FLAGS_rate_limit_bulk_reads_per_second}) {
+    retval.emplace_back(
+        rate > 0 ? new RateLimiter(rate, rate * FLAGS_rate_limit_burst_seconds,
+                                   FLAGS_rate_limit_max_clients)
+                 : nullptr);
+  }
+  return retval;
+}
+
+
+// Fills |json| with the add-chain reply for an entry added with
+// |add_status| and |sct|, and returns the HTTP status to send it with.
+int AddEntryJson(const util::Status& add_status,
+                 const SignedCertificateTimestamp& sct, JsonObject* json) {
+  if (!add_status.ok() &&
+      add_status.CanonicalCode() != util::error::ALREADY_EXISTS) {
+    VLOG(1) << "error adding chain: " << add_status;
+    if (add_status.CanonicalCode() == util::error::DEADLINE_EXCEEDED) {
+      rejected_requests->Increment("write", "deadline");
+    }
+    json->Add("error_message", add_status.error_message());
+    json->AddBoolean("success", false);
+    return add_status.CanonicalCode() == util::error::RESOURCE_EXHAUSTED ||
+                   add_status.CanonicalCode() ==
+                       util::error::DEADLINE_EXCEEDED
+               ? HTTP_SERVUNAVAIL
+               : HTTP_BADREQUEST;
+  }
+
+  json->Add("sct_version", static_cast<int64_t>(0));
+  json->AddBase64("id", sct.id().key_id());
+  json->Add("timestamp", sct.timestamp());
+  json->Add("extensions", "");
+  json->Add("signature", sct.signature());
+  return HTTP_OK;
+}
+
+
+unordered_set<string> NewTrustedMirrors() {
+  unordered_set<string> retval;
+  for (const string& address : util::split(FLAGS_trusted_mirrors)) {
+    if (!address.empty()) {
+      retval.insert(address);
+    }
+  }
+  return retval;
+}
+
+
+// Frees the reference to a cached response body held by an evbuffer.
+void ReleaseCachedBody(const void* /*data*/, size_t /*len*/, void* body) {
+  delete static_cast<shared_ptr<const string>*>(body);
+}
+
+
+// Writes the object for |entry| in a get-entries response to |json|,
+// reusing the buffers given from one entry to the next. Writes nothing
+// and returns false if |entry| could not be serialized.
+bool WriteEntryJson(const LoggedEntry& entry, bool include_scts,
+                    JsonStreamWriter* json, string* leaf_buffer,
+                    string* extra_buffer, string* sct_data) {
+  // Entries normally have their encoding stored with them, so only
+  // those stored without it get encoded here.
+  const string* const leaf_input(entry.LeafInput(leaf_buffer));
+  const string* const extra_data(entry.ExtraData(extra_buffer));
+  if (!leaf_input || !extra_data ||
+      (include_scts &&
+       Serializer::SerializeSCT(entry.sct(), sct_data) !=
+           cert_trans::serialization::SerializeResult::OK)) {
+    return false;
+  }
+
+  json->BeginObject();
+  json->Key("leaf_input");
+  json->AddBase64(*leaf_input);
+  json->Key("extra_data");
+  json->AddBase64(*extra_data);
+
+  if (include_scts) {
+    // This is non-standard for this implementation, and is currently
+    // only used by other nodes when "following" to fetch data from each
+    // other:
+    json->Key("sct");
+    json->AddBase64(*sct_data);
+  }
+  json->EndObject();
+  return true;
+}
+
+
+string ConsistencyJson(const vector<string>& consistency) {
+  JsonArray json_cons;
+  for (const auto& node : consistency) {
+    json_cons.AddBase64(node);
+  }
+
+  JsonObject json_reply;
+  json_reply.Add("consistency", json_cons);
+  return json_reply.ToString();
+}
+
+
+// A proof between two tree sizes never changes, so they are all it
+// depends on.
+string ConsistencyETag(int64_t first, int64_t second) {
+  return "\"" + std::to_string(first) + "-" + std::to_string(second) + "\"";
+}
+
 
 }  // namespace
 
@@ -71,13 +320,34 @@ HttpHandler::HttpHandler(LogLookup* log_lookup, const ReadOnlyDatabase* db,
       db_(CHECK_NOTNULL(db)),
       controller_(CHECK_NOTNULL(controller)),
       proxy_(nullptr),
+      pending_bodies_(nullptr),
       pool_(CHECK_NOTNULL(pool)),
       event_base_(CHECK_NOTNULL(event_base)),
-      staleness_tracker_(CHECK_NOTNULL(staleness_tracker)) {
+      staleness_tracker_(CHECK_NOTNULL(staleness_tracker)),
+      get_entries_cache_(NewGetEntriesCache()),
+      segment_files_(FLAGS_get_entries_binary_segment_dir.empty()
+                         ? nullptr
+                         : new BinarySegmentFiles(
+                               FLAGS_get_entries_binary_segment_dir,
+                               FLAGS_get_entries_binary_segment_entries)),
+      trusted_mirrors_(NewTrustedMirrors()),
+      sth_long_poll_(FLAGS_get_sth_long_poll_timeout_seconds > 0
+                         ? new STHLongPoll(
+                               log_lookup_, event_base_,
+                               seconds(
+                                   FLAGS_get_sth_long_poll_timeout_seconds),
+                               bind(&HttpHandler::SendSTH, this, _1))
+                         : nullptr),
+      rate_limiters_(NewRateLimiters()),
+      on_new_sth_(bind(&HttpHandler::RenderSTH, this, _1)) {
+  log_lookup_->AddNotifySTHCallback(&on_new_sth_);
+  // Any STH served before the callback was added.
+  RenderSTH(log_lookup_->GetSTH());
 }
 
 
 HttpHandler::~HttpHandler() {
+  log_lookup_->RemoveNotifySTHCallback(&on_new_sth_);
 }
 
 
@@ -86,6 +356,7 @@ void StatsHandlerInterceptor(const string& path,
                              evhttp_request* req) {
   ScopedLatency total_http_server_request_latency(
       http_server_request_latency_ms.GetScopedLatency(path));
+  ScopedTrace trace(path.c_str());
 
   cb(req);
 }
@@ -94,35 +365,47 @@ void StatsHandlerInterceptor(const string& path,
 void HttpHandler::AddEntryReply(evhttp_request* req,
                                 const util::Status& add_status,
                                 const SignedCertificateTimestamp& sct) const {
-  if (!add_status.ok() &&
-      add_status.CanonicalCode() != util::error::ALREADY_EXISTS) {
-    VLOG(1) << "error adding chain: " << add_status;
-    const int response_code(add_status.CanonicalCode() ==
-                                    util::error::RESOURCE_EXHAUSTED
-                                ? HTTP_SERVUNAVAIL
-                                : HTTP_BADREQUEST);
-    return SendJsonError(event_base_, req, response_code,
-                         add_status.error_message());
+  JsonObject json_reply;
+  const int response_code(AddEntryJson(add_status, sct, &json_reply));
+  SendJsonReply(event_base_, req, response_code, json_reply);
+}
+
+
+void HttpHandler::AddEntriesReply(
+    evhttp_request* req, const vector<util::Status>& add_statuses,
+    const vector<SignedCertificateTimestamp>& scts) const {
+  CHECK_EQ(add_statuses.size(), scts.size());
+  JsonArray json_scts;
+  for (size_t i = 0; i < scts.size(); ++i) {
+    JsonObject json_sct;
+    AddEntryJson(add_statuses[i], scts[i], &json_sct);
+    json_scts.Add(&json_sct);
   }
 
   JsonObject json_reply;
-  json_reply.Add("sct_version", static_cast<int64_t>(0));
-  json_reply.AddBase64("id", sct.id().key_id());
-  json_reply.Add("timestamp", sct.timestamp());
-  json_reply.Add("extensions", "");
-  json_reply.Add("signature", sct.signature());
-
+  json_reply.Add("scts", json_scts);
   SendJsonReply(event_base_, req, HTTP_OK, json_reply);
 }
 
 void HttpHandler::ProxyInterceptor(
+    RequestClass request_class, const LocalDataCheck& have_local_data,
     const libevent::HttpServer::HandlerCallback& local_handler,
     evhttp_request* request) {
+  if (!Admit(request_class, request)) {
+    return;
+  }
+  // The deadline follows the work for the request to other threads.
+  util::ScopedDeadline deadline(
+      FLAGS_request_deadline_seconds > 0
+          ? steady_clock::now() +
+                duration_cast<steady_clock::duration>(
+                    duration<double>(FLAGS_request_deadline_seconds))
+          : steady_clock::time_point::max());
   VLOG(2) << "Running proxy interceptor...";
-  // TODO(alcutter): We can be a bit smarter about when to proxy off
-  // the request - being stale wrt to the current serving STH doesn't
-  // automatically mean we're unable to answer this request.
-  if (staleness_tracker_->IsNodeStale()) {
+  // Being stale wrt to the current serving STH doesn't mean we're unable
+  // to answer requests about the part of the tree we do have.
+  if (staleness_tracker_->IsNodeStale() &&
+      !(have_local_data && have_local_data(request))) {
     // Can't do this on the libevent thread since it can block on the lock in
     // ClusterStatusController::GetFreshNodes().
     pool_->Add(bind(&Proxy::ProxyRequest, proxy_, request));
@@ -134,30 +417,143 @@ void HttpHandler::ProxyInterceptor(
 
 void HttpHandler::AddProxyWrappedHandler(
     libevent::HttpServer* server, const string& path,
-    const libevent::HttpServer::HandlerCallback& local_handler) {
+    const libevent::HttpServer::HandlerCallback& local_handler,
+    const LocalDataCheck& have_local_data, RequestClass request_class) {
+  const string full_path(path_prefix_ + path);
   const libevent::HttpServer::HandlerCallback stats_handler(
-      bind(&StatsHandlerInterceptor, path, local_handler, _1));
-  CHECK(server->AddHandler(path, bind(&HttpHandler::ProxyInterceptor, this,
-                                      stats_handler, _1)));
+      bind(&StatsHandlerInterceptor, full_path, local_handler, _1));
+  CHECK(server->AddHandler(full_path,
+                           bind(&HttpHandler::ProxyInterceptor, this,
+                                request_class, have_local_data,
+                                stats_handler, _1)));
+}
+
+
+// The checks below also answer true for requests that are invalid, as
+// the local handlers can reject those just as well.
+
+bool HttpHandler::HaveLocalEntries(evhttp_request* req) const {
+  const libevent::QueryParams query(libevent::ParseQuery(req));
+  const int64_t start(libevent::GetIntParam(query, "start"));
+  const int64_t end(libevent::GetIntParam(query, "end"));
+  if (start < 0 || end < start) {
+    return true;
+  }
+
+  // The entries below the tree size are all in the database.
+  return std::min(end, start + MaxEntriesPerResponse(req)) <
+         log_lookup_->GetSTH().tree_size();
+}
+
+
+bool HttpHandler::HaveLocalProof(evhttp_request* req) const {
+  const libevent::QueryParams query(libevent::ParseQuery(req));
+  string b64_hash;
+  const int64_t tree_size(libevent::GetIntParam(query, "tree_size"));
+  if (!libevent::GetParam(query, "hash", &b64_hash) || tree_size < 0) {
+    return true;
+  }
+  if (tree_size > log_lookup_->GetSTH().tree_size()) {
+    return false;
+  }
+
+  // Even within the tree size, an entry we do not know about could be
+  // one we have yet to get.
+  const string hash(util::FromBase64(b64_hash));
+  int64_t index;
+  return hash.empty() ||
+         (log_lookup_->GetIndex(hash, &index) == LogLookup::OK &&
+          index < tree_size);
+}
+
+
+bool HttpHandler::HaveLocalProofs(evhttp_request* req) const {
+  const libevent::QueryParams query(libevent::ParseQuery(req));
+  const int64_t tree_size(libevent::GetIntParam(query, "tree_size"));
+  if (tree_size < 0) {
+    return true;
+  }
+  if (tree_size > log_lookup_->GetSTH().tree_size()) {
+    return false;
+  }
+
+  const auto b64_hashes(query.equal_range("hash"));
+  for (auto it = b64_hashes.first; it != b64_hashes.second; ++it) {
+    const string hash(util::FromBase64(it->second));
+    int64_t index;
+    if (!hash.empty() &&
+        (log_lookup_->GetIndex(hash, &index) != LogLookup::OK ||
+         index >= tree_size)) {
+      return false;
+    }
+  }
+  return true;
 }
 
 
-void HttpHandler::Add(libevent::HttpServer* server) {
+bool HttpHandler::HaveLocalConsistency(evhttp_request* req) const {
+  const libevent::QueryParams query(libevent::ParseQuery(req));
+  const int64_t first(libevent::GetIntParam(query, "first"));
+  const int64_t second(libevent::GetIntParam(query, "second"));
+  if (first < 0 || second < first) {
+    return true;
+  }
+
+  return second <= log_lookup_->GetSTH().tree_size();
+}
+
+
+void HttpHandler::Add(libevent::HttpServer* server,
+                      const string& path_prefix) {
   CHECK_NOTNULL(server);
-  // TODO(pphaneuf): An optional prefix might be nice?
+  path_prefix_ = path_prefix;
+  AddLogHandlers(server);
+
+  // Only ever asked of this node in particular, so never proxied.
+  if (pending_bodies_ && pending_bodies_->KeepsBodies()) {
+    CHECK(server->AddHandler(path_prefix_ +
+                                 "/ct/v1/internal/get-pending-entry",
+                             bind(&HttpHandler::GetPendingEntry, this, _1)));
+    CHECK(server->AddHandler(path_prefix_ +
+                                 "/ct/v1/internal/add-pending-entry",
+                             bind(&HttpHandler::AddPendingEntry, this, _1)));
+  }
+
+  // Now add any sub-class handlers.
+  AddHandlers(server);
+}
+
+
+void HttpHandler::AddLogHandlers(libevent::HttpServer* server) {
   // TODO(pphaneuf): Find out which methods are CPU intensive enough
   // that they should be spun off to the thread pool.
   AddProxyWrappedHandler(server, "/ct/v1/get-entries",
-                         bind(&HttpHandler::GetEntries, this, _1));
+                         bind(&HttpHandler::GetEntries, this, _1),
+                         bind(&HttpHandler::HaveLocalEntries, this, _1),
+                         RequestClass::BULK_READ);
+  AddProxyWrappedHandler(server, "/ct/v1/get-entries-binary",
+                         bind(&HttpHandler::GetEntriesBinary, this, _1),
+                         bind(&HttpHandler::HaveLocalEntries, this, _1),
+                         RequestClass::BULK_READ);
   AddProxyWrappedHandler(server, "/ct/v1/get-proof-by-hash",
-                         bind(&HttpHandler::GetProof, this, _1));
+                         bind(&HttpHandler::GetProof, this, _1),
+                         bind(&HttpHandler::HaveLocalProof, this, _1),
+                         RequestClass::PROOF);
+  AddProxyWrappedHandler(server, "/ct/v1/get-proofs-by-hash",
+                         bind(&HttpHandler::GetProofs, this, _1),
+                         bind(&HttpHandler::HaveLocalProofs, this, _1),
+                         RequestClass::PROOF);
   AddProxyWrappedHandler(server, "/ct/v1/get-sth",
                          bind(&HttpHandler::GetSTH, this, _1));
   AddProxyWrappedHandler(server, "/ct/v1/get-sth-consistency",
-                         bind(&HttpHandler::GetConsistency, this, _1));
-
-  // Now add any sub-class handlers.
-  AddHandlers(server);
+                         bind(&HttpHandler::GetConsistency, this, _1),
+                         bind(&HttpHandler::HaveLocalConsistency, this, _1),
+                         RequestClass::PROOF);
+  // Non-standard: the range of entries logged in a window of time.
+  AddProxyWrappedHandler(server, "/ct/v1/get-entry-range-by-time",
+                         bind(&HttpHandler::GetEntryRangeByTime, this, _1),
+                         [](evhttp_request*) { return true; },
+                         RequestClass::PROOF);
 }
 
 
@@ -167,35 +563,137 @@ void HttpHandler::SetProxy(Proxy* proxy) {
 }
 
 
-void HttpHandler::GetEntries(evhttp_request* req) const {
+void HttpHandler::SetPendingEntryBodies(PendingEntryBodies* bodies) {
+  pending_bodies_ = CHECK_NOTNULL(bodies);
+}
+
+
+string HttpHandler::ClientId(evhttp_request* req) const {
+  if (!FLAGS_rate_limit_client_header.empty()) {
+    const char* const value(
+        evhttp_find_header(evhttp_request_get_input_headers(req),
+                           FLAGS_rate_limit_client_header.c_str()));
+    if (value) {
+      return value;
+    }
+  }
+  evhttp_connection* const conn(evhttp_request_get_connection(req));
+  if (!conn) {
+    return "";
+  }
+  char* address;
+  ev_uint16_t port;
+  evhttp_connection_get_peer(conn, &address, &port);
+  return address;
+}
+
+
+bool HttpHandler::FromTrustedMirror(evhttp_request* req) const {
+  evhttp_connection* const conn(evhttp_request_get_connection(req));
+  if (trusted_mirrors_.empty() || !conn) {
+    return false;
+  }
+  char* address;
+  ev_uint16_t port;
+  evhttp_connection_get_peer(conn, &address, &port);
+  return trusted_mirrors_.count(address) > 0;
+}
+
+
+bool HttpHandler::Admit(RequestClass request_class,
+                        evhttp_request* req) const {
+  static const char* const kClassNames[] = {"unlimited", "write", "proof",
+                                            "bulk_read"};
+  if (request_class == RequestClass::UNLIMITED || FromTrustedMirror(req)) {
+    return true;
+  }
+  const string class_name(kClassNames[static_cast<int>(request_class)]);
+
+  // Submissions have their own limit, see --max_pending_submissions,
+  // and also need the thread pool, so reads give way to them.
+  if (request_class != RequestClass::WRITE && FLAGS_max_queued_reads > 0 &&
+      pool_->NumQueued() > FLAGS_max_queued_reads) {
+    rejected_requests->Increment(class_name, "overload");
+    SendJsonError(event_base_, req, HTTP_SERVUNAVAIL, "Server overloaded.");
+    return false;
+  }
+
+  RateLimiter* const limiter(
+      rate_limiters_[static_cast<int>(request_class)].get());
+  if (limiter && !limiter->Admit(ClientId(req))) {
+    rejected_requests->Increment(class_name, "rate_limit");
+    SendJsonError(event_base_, req, kHttpTooManyRequests,
+                  "Rate limit exceeded.");
+    return false;
+  }
+
+  return true;
+}
+
+
+int64_t HttpHandler::MaxEntriesPerResponse(evhttp_request* req) const {
+  return FromTrustedMirror(req) ? FLAGS_max_leaf_entries_per_trusted_response
+                                : FLAGS_max_leaf_entries_per_response;
+}
+
+
+bool HttpHandler::GetEntriesParams(evhttp_request* req, int64_t* start,
+                                   int64_t* end, bool* include_scts) const {
   if (evhttp_request_get_command(req) != EVHTTP_REQ_GET) {
-    return SendJsonError(event_base_, req, HTTP_BADMETHOD,
-                         "Method not allowed.");
+    SendJsonError(event_base_, req, HTTP_BADMETHOD, "Method not allowed.");
+    return false;
   }
 
   const libevent::QueryParams query(libevent::ParseQuery(req));
 
-  const int64_t start(libevent::GetIntParam(query, "start"));
-  if (start < 0) {
-    return SendJsonError(event_base_, req, HTTP_BADREQUEST,
-                         "Missing or invalid \"start\" parameter.");
+  *start = libevent::GetIntParam(query, "start");
+  if (*start < 0) {
+    SendJsonError(event_base_, req, HTTP_BADREQUEST,
+                  "Missing or invalid \"start\" parameter.");
+    return false;
   }
 
-  int64_t end(libevent::GetIntParam(query, "end"));
-  if (end < start) {
-    return SendJsonError(event_base_, req, HTTP_BADREQUEST,
-                         "Missing or invalid \"end\" parameter.");
+  *end = libevent::GetIntParam(query, "end");
+  if (*end < *start) {
+    SendJsonError(event_base_, req, HTTP_BADREQUEST,
+                  "Missing or invalid \"end\" parameter.");
+    return false;
   }
 
   // Limit the number of entries returned in a single request.
-  end = std::min(end, start + FLAGS_max_leaf_entries_per_response);
+  *end = std::min(*end, *start + MaxEntriesPerResponse(req));
 
   // Sekrit parameter to indicate that SCTs should be included too.
   // This is non-standard, and is only used internally by other log nodes when
   // "following" nodes with more data.
-  const bool include_scts(libevent::GetBoolParam(query, "include_scts"));
+  *include_scts = libevent::GetBoolParam(query, "include_scts");
+  return true;
+}
+
+
+void HttpHandler::GetEntries(evhttp_request* req) const {
+  int64_t start;
+  int64_t end;
+  bool include_scts;
+  if (GetEntriesParams(req, &start, &end, &include_scts)) {
+    // Building (and compressing) the response can take a while, so it
+    // is done off the event loop.
+    pool_->Add(bind(&HttpHandler::BlockingGetEntries, this, req, start, end,
+                    include_scts));
+  }
+}
+
 
-  BlockingGetEntries(req, start, end, include_scts);
+void HttpHandler::GetEntriesBinary(evhttp_request* req) const {
+  int64_t start;
+  int64_t end;
+  bool include_scts;
+  if (GetEntriesParams(req, &start, &end, &include_scts)) {
+    pool_->Add(bind(&HttpHandler::BlockingGetEntriesBinary, this, req, start,
+                    end, include_scts,
+                    ZstdSupported() &&
+                        libevent::AcceptsEncoding(req, "zstd")));
+  }
 }
 
 
@@ -213,7 +711,7 @@ void HttpHandler::GetProof(evhttp_request* req) const {
                          "Missing or invalid \"hash\" parameter.");
   }
 
-  const string hash(util::FromBase64(b64_hash.c_str()));
+  const string hash(util::FromBase64(b64_hash));
   if (hash.empty()) {
     return SendJsonError(event_base_, req, HTTP_BADREQUEST,
                          "Invalid \"hash\" parameter.");
@@ -245,28 +743,115 @@ void HttpHandler::GetProof(evhttp_request* req) const {
 }
 
 
-void HttpHandler::GetSTH(evhttp_request* req) const {
+void HttpHandler::GetProofs(evhttp_request* req) const {
   if (evhttp_request_get_command(req) != EVHTTP_REQ_GET) {
     return SendJsonError(event_base_, req, HTTP_BADMETHOD,
                          "Method not allowed.");
   }
 
-  const SignedTreeHead& sth(log_lookup_->GetSTH());
+  const libevent::QueryParams query(libevent::ParseQuery(req));
 
-  VLOG(2) << "SignedTreeHead:\n" << sth.DebugString();
+  vector<string> hashes;
+  const auto b64_hashes(query.equal_range("hash"));
+  for (auto it = b64_hashes.first; it != b64_hashes.second; ++it) {
+    hashes.emplace_back(util::FromBase64(it->second));
+    if (hashes.back().empty()) {
+      return SendJsonError(event_base_, req, HTTP_BADREQUEST,
+                           "Invalid \"hash\" parameter.");
+    }
+  }
+  if (hashes.empty() ||
+      hashes.size() >
+          static_cast<size_t>(max(0, FLAGS_max_hashes_per_proofs_request))) {
+    return SendJsonError(event_base_, req, HTTP_BADREQUEST,
+                         "Missing or too many \"hash\" parameters.");
+  }
 
-  JsonObject json_reply;
-  json_reply.Add("tree_size", sth.tree_size());
-  json_reply.Add("timestamp", sth.timestamp());
-  json_reply.AddBase64("sha256_root_hash", sth.sha256_root_hash());
-  json_reply.Add("tree_head_signature", sth.signature());
+  const int64_t tree_size(libevent::GetIntParam(query, "tree_size"));
+  if (tree_size < 0 || tree_size > log_lookup_->GetSTH().tree_size()) {
+    return SendJsonError(event_base_, req, HTTP_BADREQUEST,
+                         "Missing or invalid \"tree_size\" parameter.");
+  }
 
-  VLOG(2) << "GetSTH:\n" << json_reply.DebugString();
+  vector<int64_t> leaf_indexes;
+  vector<string> nodes;
+  if (log_lookup_->AuditProofs(hashes, tree_size, &leaf_indexes, &nodes) !=
+      LogLookup::OK) {
+    return SendJsonError(event_base_, req, HTTP_BADREQUEST,
+                         "Couldn't find hash.");
+  }
+
+  JsonArray json_indexes;
+  for (const int64_t leaf_index : leaf_indexes) {
+    json_indexes.Add(json_object_new_int64(leaf_index));
+  }
+  JsonArray json_nodes;
+  for (const string& node : nodes) {
+    json_nodes.AddBase64(node);
+  }
+
+  JsonObject json_reply;
+  json_reply.Add("leaf_indexes", json_indexes);
+  json_reply.Add("audit_nodes", json_nodes);
 
   SendJsonReply(event_base_, req, HTTP_OK, json_reply);
 }
 
 
+void HttpHandler::GetSTH(evhttp_request* req) const {
+  if (evhttp_request_get_command(req) != EVHTTP_REQ_GET) {
+    return SendJsonError(event_base_, req, HTTP_BADMETHOD,
+                         "Method not allowed.");
+  }
+
+  // Non-standard: clients which already have an STH can ask for the
+  // reply to wait until there is a newer one.
+  const libevent::QueryParams query(libevent::ParseQuery(req));
+  string newer_than_str;
+  if (sth_long_poll_ &&
+      libevent::GetParam(query, "newer_than", &newer_than_str)) {
+    char* end;
+    errno = 0;
+    const unsigned long long newer_than(
+        strtoull(newer_than_str.c_str(), &end, 10));
+    if (errno || newer_than_str.empty() || *end != '\0') {
+      return SendJsonError(event_base_, req, HTTP_BADREQUEST,
+                           "Invalid \"newer_than\" parameter.");
+    }
+    return sth_long_poll_->Wait(req, newer_than);
+  }
+
+  SendSTH(req);
+}
+
+
+void HttpHandler::SendSTH(evhttp_request* req) const {
+  const shared_ptr<const RenderedSTH> rendered(CurrentRenderedSTH());
+  evkeyvalq* const headers(evhttp_request_get_output_headers(req));
+  if (sth_long_poll_) {
+    // Lets clients know that they can use "newer_than".
+    CHECK_EQ(evhttp_add_header(headers, kSTHLongPollHeader,
+                               std::to_string(
+                                   FLAGS_get_sth_long_poll_timeout_seconds)
+                                   .c_str()),
+             0);
+  }
+  const string cache_control(
+      FLAGS_get_sth_max_age_seconds > 0
+          ? "public, max-age=" +
+                std::to_string(FLAGS_get_sth_max_age_seconds)
+          : "no-cache");
+  CHECK_EQ(evhttp_add_header(headers, "Cache-Control", cache_control.c_str()),
+           0);
+  CHECK_EQ(evhttp_add_header(headers, "ETag", rendered->etag.c_str()), 0);
+  if (SendNotModified(req, rendered->etag)) {
+    return;
+  }
+
+  SendSharedBody(req, ContentEncoding::IDENTITY, rendered->body);
+}
+
+
 void HttpHandler::GetConsistency(evhttp_request* req) const {
   if (evhttp_request_get_command(req) != EVHTTP_REQ_GET) {
     return SendJsonError(event_base_, req, HTTP_BADMETHOD,
@@ -287,66 +872,584 @@ void HttpHandler::GetConsistency(evhttp_request* req) const {
                          "Missing or invalid \"second\" parameter.");
   }
 
-  const vector<string> consistency(
-      log_lookup_->ConsistencyProof(first, second));
-  JsonArray json_cons;
-  for (vector<string>::const_iterator it = consistency.begin();
-       it != consistency.end(); ++it) {
-    json_cons.AddBase64(*it);
+  const shared_ptr<const RenderedSTH> rendered(CurrentRenderedSTH());
+  if (second <= rendered->tree_size) {
+    const string etag(ConsistencyETag(first, second));
+    evkeyvalq* const headers(evhttp_request_get_output_headers(req));
+    // The proof is not going to change, but how long to trust that
+    // is left to the caches.
+    CHECK_EQ(evhttp_add_header(headers, "Cache-Control",
+                               "public, max-age=86400"),
+             0);
+    CHECK_EQ(evhttp_add_header(headers, "ETag", etag.c_str()), 0);
+    if (SendNotModified(req, etag)) {
+      return;
+    }
+    if (second == rendered->tree_size) {
+      const auto it(rendered->consistency.find(first));
+      if (it != rendered->consistency.end()) {
+        return SendSharedBody(req, ContentEncoding::IDENTITY, it->second);
+      }
+    }
   }
 
-  JsonObject json_reply;
-  json_reply.Add("consistency", json_cons);
+  const string body(
+      ConsistencyJson(log_lookup_->ConsistencyProof(first, second)));
+  evbuffer* const buffer(CHECK_NOTNULL(evbuffer_new()));
+  CHECK_EQ(evbuffer_add(buffer, body.data(), body.size()), 0);
+  SendJsonReply(event_base_, req, HTTP_OK, buffer);
+  evbuffer_free(buffer);
+}
+
+
+void HttpHandler::GetEntryRangeByTime(evhttp_request* req) const {
+  if (evhttp_request_get_command(req) != EVHTTP_REQ_GET) {
+    return SendJsonError(event_base_, req, HTTP_BADMETHOD,
+                         "Method not allowed.");
+  }
+
+  const libevent::QueryParams query(libevent::ParseQuery(req));
+
+  const int64_t start(libevent::GetIntParam(query, "start"));
+  if (start < 0) {
+    return SendJsonError(event_base_, req, HTTP_BADREQUEST,
+                         "Missing or invalid \"start\" parameter.");
+  }
 
+  const int64_t end(libevent::GetIntParam(query, "end"));
+  if (end < start) {
+    return SendJsonError(event_base_, req, HTTP_BADREQUEST,
+                         "Missing or invalid \"end\" parameter.");
+  }
+
+  // Only the entries in the STH being served can be asked for with
+  // get-entries.
+  int64_t begin_index;
+  int64_t end_index;
+  db_->TimestampRange(start, end, &begin_index, &end_index);
+  end_index = min(end_index, log_lookup_->GetSTH().tree_size());
+  begin_index = min(begin_index, end_index);
+
+  // Inclusive, as for get-entries, so "end" is "start" - 1 if there
+  // are no such entries.
+  JsonObject json_reply;
+  json_reply.Add("start", begin_index);
+  json_reply.Add("end", end_index - 1);
   SendJsonReply(event_base_, req, HTTP_OK, json_reply);
 }
 
 
+void HttpHandler::RenderSTH(const SignedTreeHead& sth) {
+  lock_guard<mutex> lock(render_lock_);
+  const shared_ptr<const RenderedSTH> current(CurrentRenderedSTH());
+  if (current && current->timestamp > sth.timestamp()) {
+    return;
+  }
+
+  VLOG(2) << "SignedTreeHead:\n" << sth.DebugString();
+
+  JsonObject json_reply;
+  json_reply.Add("tree_size", sth.tree_size());
+  json_reply.Add("timestamp", sth.timestamp());
+  json_reply.AddBase64("sha256_root_hash", sth.sha256_root_hash());
+  json_reply.Add("tree_head_signature", sth.signature());
+
+  VLOG(2) << "GetSTH:\n" << json_reply.DebugString();
+
+  unique_ptr<RenderedSTH> rendered(new RenderedSTH);
+  rendered->tree_size = sth.tree_size();
+  rendered->timestamp = sth.timestamp();
+  rendered->etag = "\"" + std::to_string(sth.tree_size()) + "-" +
+                   std::to_string(sth.timestamp()) + "\"";
+  rendered->body = make_shared<const string>(json_reply.ToString());
+
+  if (current && current->tree_size > 0 &&
+      current->tree_size != sth.tree_size()) {
+    previous_tree_sizes_.push_front(current->tree_size);
+    while (previous_tree_sizes_.size() >
+           static_cast<size_t>(
+               max(0, FLAGS_log_lookup_precomputed_consistency_proofs))) {
+      previous_tree_sizes_.pop_back();
+    }
+  }
+  // The log lookup has these precomputed, as they are the ones clients
+  // ask for once they see the new STH.
+  for (const int64_t first : previous_tree_sizes_) {
+    if (first < sth.tree_size()) {
+      rendered->consistency[first] = make_shared<const string>(
+          ConsistencyJson(log_lookup_->ConsistencyProof(first,
+                                                        sth.tree_size())));
+    }
+  }
+
+  std::atomic_store(&rendered_sth_,
+                    shared_ptr<const RenderedSTH>(move(rendered)));
+}
+
+
+bool HttpHandler::SendNotModified(evhttp_request* req,
+                                  const string& etag) const {
+  const char* const if_none_match(evhttp_find_header(
+      evhttp_request_get_input_headers(req), "If-None-Match"));
+  if (!if_none_match || etag != if_none_match) {
+    return false;
+  }
+
+  evbuffer* const buffer(CHECK_NOTNULL(evbuffer_new()));
+  SendJsonReply(event_base_, req, HTTP_NOTMODIFIED, ContentEncoding::IDENTITY,
+                buffer);
+  evbuffer_free(buffer);
+  return true;
+}
+
+
+void HttpHandler::GetPendingEntry(evhttp_request* req) const {
+  if (evhttp_request_get_command(req) != EVHTTP_REQ_GET) {
+    return SendJsonError(event_base_, req, HTTP_BADMETHOD,
+                         "Method not allowed.");
+  }
+
+  const libevent::QueryParams query(libevent::ParseQuery(req));
+  string hex_hash;
+  // As sent by PendingEntryBodies, which is all BinaryString() takes.
+  if (!libevent::GetParam(query, "hash", &hex_hash) || hex_hash.empty() ||
+      hex_hash.size() % 2 != 0 ||
+      hex_hash.find_first_not_of("0123456789abcdef") != string::npos) {
+    return SendJsonError(event_base_, req, HTTP_BADREQUEST,
+                         "Missing or invalid \"hash\" parameter.");
+  }
+
+  // The entry is read from disk, which is best kept off the event loop.
+  pool_->Add(bind(&HttpHandler::BlockingGetPendingEntry, this, req,
+                  util::BinaryString(hex_hash)));
+}
+
+
+void HttpHandler::BlockingGetPendingEntry(evhttp_request* req,
+                                          const string& hash) const {
+  string entry;
+  const util::Status status(pending_bodies_->Lookup(hash, &entry));
+  if (!status.ok()) {
+    return SendJsonError(event_base_, req,
+                         status.CanonicalCode() == util::error::NOT_FOUND
+                             ? HTTP_NOTFOUND
+                             : HTTP_INTERNAL,
+                         status.error_message());
+  }
+
+  evbuffer* const buffer(CHECK_NOTNULL(evbuffer_new()));
+  CHECK_EQ(0, evbuffer_add(buffer, entry.data(), entry.size()));
+  SendReply(event_base_, req, HTTP_OK, "application/octet-stream", buffer);
+  evbuffer_free(buffer);
+}
+
+
+void HttpHandler::AddPendingEntry(evhttp_request* req) {
+  if (evhttp_request_get_command(req) != EVHTTP_REQ_POST) {
+    return SendJsonError(event_base_, req, HTTP_BADMETHOD,
+                         "Method not allowed.");
+  }
+
+  evbuffer* const input(evhttp_request_get_input_buffer(req));
+  const size_t length(evbuffer_get_length(input));
+  if (length == 0) {
+    return SendJsonError(event_base_, req, HTTP_BADREQUEST,
+                         "Missing pending entry.");
+  }
+  string entry(length, '\0');
+  CHECK_EQ(static_cast<int>(length),
+           evbuffer_remove(input, &entry[0], length));
+
+  // The entry is synced to disk, which is best kept off the event loop.
+  pool_->Add(
+      bind(&HttpHandler::BlockingAddPendingEntry, this, req, move(entry)));
+}
+
+
+void HttpHandler::BlockingAddPendingEntry(evhttp_request* req,
+                                          const string& entry) {
+  const util::Status status(pending_bodies_->KeepCopy(entry));
+  if (!status.ok()) {
+    return SendJsonError(event_base_, req,
+                         status.CanonicalCode() ==
+                                 util::error::INVALID_ARGUMENT
+                             ? HTTP_BADREQUEST
+                             : HTTP_INTERNAL,
+                         status.error_message());
+  }
+
+  evbuffer* const buffer(CHECK_NOTNULL(evbuffer_new()));
+  SendReply(event_base_, req, HTTP_OK, "application/octet-stream", buffer);
+  evbuffer_free(buffer);
+}
+
+
 void HttpHandler::BlockingGetEntries(evhttp_request* req, int64_t start,
                                      int64_t end, bool include_scts) const {
-  JsonArray json_entries;
-  auto it(db_->ScanEntries(start));
-  for (int64_t i = start; i <= end; ++i) {
-    LoggedEntry entry;
+  if (util::DeadlineExceeded()) {
+    rejected_requests->Increment("bulk_read", "deadline");
+    return SendJsonError(event_base_, req, HTTP_SERVUNAVAIL,
+                         "Request deadline exceeded.");
+  }
+
+  // Entries below the tree size never change, so neither do the
+  // responses for them.
+  bool cacheable(get_entries_cache_ &&
+                       end < log_lookup_->GetSTH().tree_size());
+  if (cacheable) {
+    const shared_ptr<const string> body(get_entries_cache_->Find(
+        start, end, include_scts, ContentEncoding::IDENTITY));
+    get_entries_cache_lookups->Increment(body != nullptr);
+    if (body) {
+      return SendCacheableEntries(req, start, end, include_scts, body);
+    }
+  }
+
+  // The response is streamed straight into a buffer, as building it with
+  // JsonObject was dominating the cost of serving large requests. Once
+  // it no longer fits in one chunk of entries, it is also sent as it is
+  // written, so that only the responses being cached are held whole.
+  // Those are not streamed at all if the client takes them compressed,
+  // as they get compressed whole for the cache anyway.
+  // Either way, they are only held whole up to a point, so that memory
+  // use does not depend on how many entries are asked for.
+  bool send_whole(cacheable &&
+                  ResponseEncoding(req, numeric_limits<size_t>::max()) !=
+                      ContentEncoding::IDENTITY);
+  JsonStreamWriter json_reply;
+  json_reply.BeginObject();
+  json_reply.Key("entries");
+  json_reply.BeginArray();
+
+  const unique_ptr<Database::Iterator> it(db_->ScanEntries(start));
+  const int64_t chunk_entries(max(FLAGS_get_entries_chunk_entries, 1));
+  vector<LoggedEntry> entries;
+  // Reused from one entry to the next.
+  string leaf_buffer;
+  string extra_buffer;
+  string sct_data;
+  unique_ptr<ChunkedJsonReply> chunked_reply;
+  string body;
+  int64_t next(start);
+  bool done(false);
+  while (!done) {
+    const size_t wanted(min(end - next + 1, chunk_entries));
+    size_t got;
+    {
+      ScopedSpan span("scan-entries");
+      got = it->GetNextEntries(wanted, &entries);
+    }
+    done = got < wanted || next + static_cast<int64_t>(got) > end;
+    for (size_t i = 0; i < got; ++i, ++next) {
+      const LoggedEntry& entry(entries[i]);
+      if (entry.sequence_number() != next) {
+        done = true;
+        break;
+      }
+
+      if (!WriteEntryJson(entry, include_scts, &json_reply, &leaf_buffer,
+                          &extra_buffer, &sct_data)) {
+        LOG_RATE_LIMITED(WARNING, 10) << "Failed to serialize entry @ "
+                                      << next << ":\n"
+                                      << entry.DebugString();
+        if (!chunked_reply) {
+          return SendJsonError(event_base_, req, HTTP_INTERNAL,
+                               "Serialization failed.");
+        }
+        // Part of the response is out already, so end it here instead:
+        // clients have to cope with getting fewer entries than they
+        // asked for anyway.
+        cacheable = false;
+        done = true;
+        break;
+      }
+    }
+
+    if (json_reply.ElementCount() < 1) {
+      return SendJsonError(event_base_, req, HTTP_BADREQUEST,
+                           "Entry not found.");
+    }
+
+    if (done) {
+      json_reply.EndArray();
+      json_reply.EndObject();
+    }
+    evbuffer* const buffer(json_reply.buffer());
+    if (cacheable &&
+        body.size() + evbuffer_get_length(buffer) >
+            static_cast<size_t>(FLAGS_get_entries_max_cached_response_bytes)) {
+      // Too large to cache, so stream it after all.
+      cacheable = false;
+      send_whole = false;
+      string().swap(body);
+    }
+    if ((done && !chunked_reply) || send_whole) {
+      // It all fitted in one go, or it is to be sent that way.
+      continue;
+    }
+    if (cacheable) {
+      body.append(reinterpret_cast<const char*>(evbuffer_pullup(buffer, -1)),
+                  evbuffer_get_length(buffer));
+    }
+    if (!chunked_reply) {
+      chunked_reply.reset(new ChunkedJsonReply(
+          event_base_, req, FLAGS_get_entries_max_bytes_in_flight));
+    }
+    if (!chunked_reply->Send(buffer)) {
+      // The client has gone away.
+      return;
+    }
+  }
 
-    if (!it->GetNextEntry(&entry) || entry.sequence_number() != i) {
+  if (chunked_reply) {
+    if (cacheable) {
+      get_entries_cache_->Insert(start, end, include_scts,
+                                 ContentEncoding::IDENTITY,
+                                 make_shared<const string>(move(body)));
+    }
+    return chunked_reply->End();
+  }
+
+  evbuffer* const buffer(json_reply.buffer());
+  if (!cacheable) {
+    return SendJsonReply(event_base_, req, HTTP_OK, buffer);
+  }
+  const shared_ptr<const string> whole_body(make_shared<const string>(
+      reinterpret_cast<const char*>(evbuffer_pullup(buffer, -1)),
+      evbuffer_get_length(buffer)));
+  get_entries_cache_->Insert(start, end, include_scts,
+                             ContentEncoding::IDENTITY, whole_body);
+  SendCacheableEntries(req, start, end, include_scts, whole_body);
+}
+
+
+bool HttpHandler::RenderEntries(int64_t start, int64_t end,
+                                bool include_scts, string* body) const {
+  JsonStreamWriter json;
+  json.BeginObject();
+  json.Key("entries");
+  json.BeginArray();
+
+  const unique_ptr<Database::Iterator> it(db_->ScanEntries(start));
+  const int64_t chunk_entries(max(FLAGS_get_entries_chunk_entries, 1));
+  vector<LoggedEntry> entries;
+  string leaf_buffer;
+  string extra_buffer;
+  string sct_data;
+  int64_t next(start);
+  while (next <= end) {
+    const size_t got(
+        it->GetNextEntries(min(end - next + 1, chunk_entries), &entries));
+    if (got == 0) {
+      return false;
+    }
+    for (size_t i = 0; i < got; ++i, ++next) {
+      if (entries[i].sequence_number() != next ||
+          !WriteEntryJson(entries[i], include_scts, &json, &leaf_buffer,
+                          &extra_buffer, &sct_data)) {
+        return false;
+      }
+    }
+  }
+
+  json.EndArray();
+  json.EndObject();
+  evbuffer* const buffer(json.buffer());
+  body->assign(reinterpret_cast<const char*>(evbuffer_pullup(buffer, -1)),
+               evbuffer_get_length(buffer));
+  return true;
+}
+
+
+bool HttpHandler::WarmUp(const steady_clock::time_point& deadline) {
+  const int64_t page_entries(FLAGS_max_leaf_entries_per_response);
+  if (!get_entries_cache_ || FLAGS_warmup_get_entries_pages <= 0 ||
+      page_entries <= 0) {
+    return true;
+  }
+  const int64_t tree_size(log_lookup_->GetSTH().tree_size());
+  int64_t start(tree_size / page_entries * page_entries);
+  for (int i = 0; i < FLAGS_warmup_get_entries_pages && start > 0; ++i) {
+    if (steady_clock::now() >= deadline) {
+      return false;
+    }
+    start -= page_entries;
+    const int64_t end(start + page_entries - 1);
+    string body;
+    if (!RenderEntries(start, end, /*include_scts*/ false, &body)) {
+      LOG(WARNING) << "Could not warm up get-entries " << start << "-"
+                   << end;
       break;
     }
+    // As when serving them, but the oldest pages are not worth
+    // evicting the newest ones for.
+    if (body.size() >
+            static_cast<size_t>(FLAGS_get_entries_max_cached_response_bytes) ||
+        get_entries_cache_->size_bytes() + body.size() >
+            static_cast<size_t>(FLAGS_get_entries_cache_size_bytes)) {
+      break;
+    }
+    get_entries_cache_->Insert(start, end, /*include_scts*/ false,
+                               ContentEncoding::IDENTITY,
+                               make_shared<const string>(move(body)));
+  }
+  return true;
+}
 
-    string leaf_input;
-    string extra_data;
-    string sct_data;
-    if (!entry.SerializeForLeaf(&leaf_input) ||
-        !entry.SerializeExtraData(&extra_data) ||
-        (include_scts &&
-         Serializer::SerializeSCT(entry.sct(), &sct_data) !=
-             cert_trans::serialization::SerializeResult::OK)) {
-      LOG(WARNING) << "Failed to serialize entry @ " << i << ":\n"
-                   << entry.DebugString();
-      return SendJsonError(event_base_, req, HTTP_INTERNAL,
-                           "Serialization failed.");
+
+void HttpHandler::SendCacheableEntries(
+    evhttp_request* req, int64_t start, int64_t end, bool include_scts,
+    const shared_ptr<const string>& body) const {
+  // Compressed responses are cached as well, next to the uncompressed
+  // one they are made from, so that hot pages are only compressed once.
+  ContentEncoding encoding(ResponseEncoding(req, body->size()));
+  shared_ptr<const string> encoded_body(body);
+  if (encoding != ContentEncoding::IDENTITY) {
+    encoded_body =
+        get_entries_cache_->Find(start, end, include_scts, encoding);
+    string compressed;
+    if (!encoded_body && Compress(encoding, *body, &compressed)) {
+      encoded_body = make_shared<const string>(move(compressed));
+      get_entries_cache_->Insert(start, end, include_scts, encoding,
+                                 encoded_body);
+    } else if (!encoded_body) {
+      // Send it uncompressed, then.
+      encoding = ContentEncoding::IDENTITY;
+      encoded_body = body;
     }
+  }
+
+  SendSharedBody(req, encoding, encoded_body);
+}
+
+
+void HttpHandler::SendSharedBody(evhttp_request* req,
+                                 ContentEncoding encoding,
+                                 const shared_ptr<const string>& body) const {
+  // Hand the body over to libevent without copying it, keeping a
+  // reference until it is done with it.
+  evbuffer* const buffer(CHECK_NOTNULL(evbuffer_new()));
+  CHECK_EQ(0, evbuffer_add_reference(buffer, body->data(), body->size(),
+                                     &ReleaseCachedBody,
+                                     new shared_ptr<const string>(body)));
+  SendJsonReply(event_base_, req, HTTP_OK, encoding, buffer);
+  evbuffer_free(buffer);
+}
 
-    JsonObject json_entry;
-    json_entry.AddBase64("leaf_input", leaf_input);
-    json_entry.AddBase64("extra_data", extra_data);
 
-    if (include_scts) {
-      // This is non-standard for this implementation, and is currently only
-      // used by other nodes when "following" to fetch data from each other:
-      json_entry.AddBase64("sct", sct_data);
+void HttpHandler::BlockingGetEntriesBinary(evhttp_request* req, int64_t start,
+                                           int64_t end, bool include_scts,
+                                           bool zstd) const {
+  if (util::DeadlineExceeded()) {
+    rejected_requests->Increment("bulk_read", "deadline");
+    return SendJsonError(event_base_, req, HTTP_SERVUNAVAIL,
+                         "Request deadline exceeded.");
+  }
+
+  if (segment_files_ && segment_files_->IsSegment(start, end)) {
+    uint64_t size;
+    const int fd(segment_files_->Open(
+        start, include_scts,
+        [this, start, end, include_scts](string* body) {
+          int64_t num_entries;
+          return EncodeBinaryEntries(start, end, include_scts, body,
+                                     &num_entries) &&
+                 num_entries == end - start + 1;
+        },
+        &size));
+    if (fd >= 0) {
+      // libevent writes file segments out with sendfile() where it
+      // can, so that the entries do not go through user space at all.
+      // It takes ownership of |fd|.
+      evbuffer* const buffer(CHECK_NOTNULL(evbuffer_new()));
+      CHECK_EQ(0, evbuffer_add_file(buffer, fd, 0, size));
+      SendReply(event_base_, req, HTTP_OK, "application/octet-stream",
+                buffer);
+      evbuffer_free(buffer);
+      return;
     }
+  }
 
-    json_entries.Add(&json_entry);
+  // These responses are only used by our own peers and mirrors, which
+  // fetch each range once, so they are neither cached nor chunked.
+  string body;
+  int64_t num_entries;
+  if (!EncodeBinaryEntries(start, end, include_scts, &body, &num_entries)) {
+    return SendJsonError(event_base_, req, HTTP_INTERNAL,
+                         "Serialization failed.");
   }
 
-  if (json_entries.Length() < 1) {
+  if (num_entries == 0) {
     return SendJsonError(event_base_, req, HTTP_BADREQUEST,
                          "Entry not found.");
   }
 
-  JsonObject json_reply;
-  json_reply.Add("entries", json_entries);
+  if (zstd) {
+    string compressed;
+    if (!cert_trans::ZstdCompress(body, FLAGS_get_entries_binary_zstd_level,
+                                  &compressed)) {
+      return SendJsonError(event_base_, req, HTTP_INTERNAL,
+                           "Compression failed.");
+    }
+    body.swap(compressed);
+    CHECK_EQ(evhttp_add_header(evhttp_request_get_output_headers(req),
+                               "Content-Encoding", "zstd"),
+             0);
+  }
 
-  SendJsonReply(event_base_, req, HTTP_OK, json_reply);
+  // Hand the body over to libevent without copying it.
+  evbuffer* const buffer(CHECK_NOTNULL(evbuffer_new()));
+  const shared_ptr<const string> shared_body(
+      make_shared<const string>(move(body)));
+  CHECK_EQ(0, evbuffer_add_reference(
+                  buffer, shared_body->data(), shared_body->size(),
+                  &ReleaseCachedBody,
+                  new shared_ptr<const string>(shared_body)));
+  SendReply(event_base_, req, HTTP_OK, "application/octet-stream", buffer);
+  evbuffer_free(buffer);
+}
+
+
+bool HttpHandler::EncodeBinaryEntries(int64_t start, int64_t end,
+                                      bool include_scts, string* body,
+                                      int64_t* num_entries) const {
+  const unique_ptr<Database::Iterator> it(db_->ScanEntries(start));
+  const int64_t chunk_entries(max(FLAGS_get_entries_chunk_entries, 1));
+  vector<LoggedEntry> entries;
+  // Reused from one entry to the next.
+  string leaf_buffer;
+  string extra_buffer;
+  string sct_data;
+  body->clear();
+  int64_t next(start);
+  bool done(false);
+  while (!done) {
+    const size_t wanted(min(end - next + 1, chunk_entries));
+    const size_t got(it->GetNextEntries(wanted, &entries));
+    done = got < wanted || next + static_cast<int64_t>(got) > end;
+    for (size_t i = 0; i < got; ++i, ++next) {
+      const LoggedEntry& entry(entries[i]);
+      if (entry.sequence_number() != next) {
+        done = true;
+        break;
+      }
+
+      const string* const leaf_input(entry.LeafInput(&leaf_buffer));
+      const string* const extra_data(entry.ExtraData(&extra_buffer));
+      if (!leaf_input || !extra_data ||
+          (include_scts &&
+           Serializer::SerializeSCT(entry.sct(), &sct_data) !=
+               cert_trans::serialization::SerializeResult::OK) ||
+          cert_trans::WriteBinaryEntry(*leaf_input, *extra_data, sct_data,
+                                       body) !=
+              cert_trans::serialization::SerializeResult::OK) {
+        LOG_RATE_LIMITED(WARNING, 10) << "Failed to serialize entry @ "
+                                      << next << ":\n"
+                                      << entry.DebugString();
+        return false;
+      }
+    }
+  }
+  *num_entries = next - start;
+  return true;
 }
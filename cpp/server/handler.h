@@ -2,12 +2,19 @@
 #define CERT_TRANS_SERVER_HANDLER_H_
 
 #include <stdint.h>
+#include <chrono>
+#include <deque>
+#include <map>
 #include <memory>
 #include <mutex>
 #include <string>
+#include <unordered_set>
+#include <vector>
 
+#include "log/database.h"
 #include "proto/ct.pb.h"
 #include "server/staleness_tracker.h"
+#include "util/compression.h"
 #include "util/libevent_wrapper.h"
 #include "util/sync_task.h"
 #include "util/task.h"
@@ -16,14 +23,19 @@ class Frontend;
 
 namespace cert_trans {
 
+class BinarySegmentFiles;
 class CertChain;
 class CertChecker;
 class ClusterStateController;
+class GetEntriesCache;
 class LogLookup;
 class LoggedEntry;
+class PendingEntryBodies;
 class PreCertChain;
 class Proxy;
+class RateLimiter;
 class ReadOnlyDatabase;
+class STHLongPoll;
 class ThreadPool;
 
 
@@ -38,40 +50,201 @@ class HttpHandler {
   HttpHandler(const HttpHandler&) = delete;
   HttpHandler& operator=(const HttpHandler&) = delete;
 
-  void Add(libevent::HttpServer* server);
+  // Adds the handlers to |server|, with their paths starting with
+  // |path_prefix| (e.g. "/2019"), so that several logs can be served
+  // by one server.
+  void Add(libevent::HttpServer* server,
+           const std::string& path_prefix = "");
 
   void SetProxy(Proxy* proxy);
 
+  // Serves the pending entries kept by |bodies| to the other nodes of
+  // the cluster, if it keeps any. Must be called before Add(), and
+  // does not take ownership of |bodies|.
+  void SetPendingEntryBodies(PendingEntryBodies* bodies);
+
+  // Fills the get-entries cache with the responses for the newest
+  // complete pages of --max_leaf_entries_per_response entries, those
+  // that the monitors following the log ask for, so that they are not
+  // all read from the database at once after a restart. Returns false
+  // if it was cut short by |deadline|.
+  bool WarmUp(const std::chrono::steady_clock::time_point& deadline);
+
  protected:
   // Implemented by subclasses which want to add their own extra http handlers.
   virtual void AddHandlers(libevent::HttpServer* server) = 0;
 
+  // Adds the handlers of the log API itself, those of RFC 6962 unless
+  // overridden, e.g. by HttpHandlerV2. These go through the same
+  // proxying, admission and stats as the v1 ones, by using
+  // AddProxyWrappedHandler().
+  virtual void AddLogHandlers(libevent::HttpServer* server);
+
+  // What requests are admitted by, see Admit().
+  enum class RequestClass {
+    UNLIMITED,
+    WRITE,
+    PROOF,
+    BULK_READ,
+  };
+
   void AddEntryReply(evhttp_request* req, const util::Status& add_status,
                      const ct::SignedCertificateTimestamp& sct) const;
+  // As above, for several entries submitted at once: the reply has an
+  // "scts" array, with what AddEntryReply() would send for each.
+  void AddEntriesReply(
+      evhttp_request* req, const std::vector<util::Status>& add_statuses,
+      const std::vector<ct::SignedCertificateTimestamp>& scts) const;
+
+  // Says whether a request only needs what is already in the local
+  // tree, so that it can be answered locally even while the node is
+  // stale.
+  typedef std::function<bool(evhttp_request*)> LocalDataCheck;
 
   void ProxyInterceptor(
+      RequestClass request_class, const LocalDataCheck& have_local_data,
       const libevent::HttpServer::HandlerCallback& local_handler,
       evhttp_request* request);
 
+  // Requests are proxied while the node is stale, unless
+  // |have_local_data| is set and returns true for them. |path| is
+  // relative to the prefix given to Add(). Either way, they must first
+  // be admitted as |request_class|.
   void AddProxyWrappedHandler(
       libevent::HttpServer* server, const std::string& path,
-      const libevent::HttpServer::HandlerCallback& local_handler);
+      const libevent::HttpServer::HandlerCallback& local_handler,
+      const LocalDataCheck& have_local_data = LocalDataCheck(),
+      RequestClass request_class = RequestClass::UNLIMITED);
+
+  // Who sent |req|, for rate limiting: the --rate_limit_client_header
+  // header if set, or else the peer address.
+  std::string ClientId(evhttp_request* req) const;
+
+  // Whether |req| comes from one of the --trusted_mirrors.
+  bool FromTrustedMirror(evhttp_request* req) const;
+
+  // Says whether |req| can go ahead, or else replies to it with a 429
+  // if its client is over the rate limit of |request_class|, or a 503
+  // if it is a read and the thread pool is too backed up.
+  bool Admit(RequestClass request_class, evhttp_request* req) const;
+
+  bool HaveLocalEntries(evhttp_request* req) const;
+  bool HaveLocalProof(evhttp_request* req) const;
+  bool HaveLocalProofs(evhttp_request* req) const;
+  bool HaveLocalConsistency(evhttp_request* req) const;
+
+  // The most entries a get-entries response to |req| may have, which
+  // depends on whether it comes from one of the trusted mirrors.
+  int64_t MaxEntriesPerResponse(evhttp_request* req) const;
+
+  // Parses and checks the parameters of a get-entries request,
+  // sending an error reply if they are not valid.
+  bool GetEntriesParams(evhttp_request* req, int64_t* start, int64_t* end,
+                        bool* include_scts) const;
 
   void GetEntries(evhttp_request* req) const;
+  // Non-standard, see proto/binary_entries.h.
+  void GetEntriesBinary(evhttp_request* req) const;
   void GetProof(evhttp_request* req) const;
+  // Non-standard: the proofs for several leaves at once, see
+  // LogLookup::AuditProofs().
+  void GetProofs(evhttp_request* req) const;
   void GetSTH(evhttp_request* req) const;
+  // Replies to |req| with the current STH.
+  void SendSTH(evhttp_request* req) const;
   void GetConsistency(evhttp_request* req) const;
+  // Non-standard: the range of sequence numbers, for get-entries,
+  // holding the entries with SCT timestamps from the "start" to the
+  // "end" parameters, in milliseconds, see
+  // ReadOnlyDatabase::TimestampRange().
+  void GetEntryRangeByTime(evhttp_request* req) const;
+  // Renders the replies for |sth| and serves them from then on, unless
+  // a newer STH was rendered already.
+  void RenderSTH(const ct::SignedTreeHead& sth);
+  // Whether |req| says the client already has the reply tagged |etag|,
+  // in which case it is answered with a 304.
+  bool SendNotModified(evhttp_request* req, const std::string& etag) const;
+  // Sends |body|, already encoded with |encoding|, without copying it.
+  void SendSharedBody(evhttp_request* req, ContentEncoding encoding,
+                      const std::shared_ptr<const std::string>& body) const;
+  // Internal: a pending entry kept by this node, for another node of
+  // the cluster, see PendingEntryBodies.
+  void GetPendingEntry(evhttp_request* req) const;
+  void BlockingGetPendingEntry(evhttp_request* req,
+                               const std::string& hash) const;
+  // Internal: a copy of a pending entry added by another node of the
+  // cluster, see PendingEntryBodies.
+  void AddPendingEntry(evhttp_request* req);
+  void BlockingAddPendingEntry(evhttp_request* req, const std::string& entry);
 
   void BlockingGetEntries(evhttp_request* req, int64_t start, int64_t end,
                           bool include_scts) const;
+  // Sends |body|, the uncompressed response for a range that is in
+  // the get-entries cache, compressed if the client allows.
+  void SendCacheableEntries(evhttp_request* req, int64_t start, int64_t end,
+                            bool include_scts,
+                            const std::shared_ptr<const std::string>& body)
+      const;
+  void BlockingGetEntriesBinary(evhttp_request* req, int64_t start,
+                                int64_t end, bool include_scts,
+                                bool zstd) const;
+  // Sets |body| to the whole get-entries response for the entries from
+  // |start| to |end|. Returns false if one of them is missing or could
+  // not be serialized.
+  bool RenderEntries(int64_t start, int64_t end, bool include_scts,
+                     std::string* body) const;
+  // Sets |body| to the binary records of the entries from |start| to
+  // |end|, stopping at the first one missing, and |num_entries| to the
+  // number of them. Returns false if one could not be serialized.
+  bool EncodeBinaryEntries(int64_t start, int64_t end, bool include_scts,
+                           std::string* body, int64_t* num_entries) const;
+
+  // The get-sth reply for an STH, and the get-sth-consistency ones
+  // from the sizes of the STHs served before it, rendered once when it
+  // is served. Never modified once published.
+  struct RenderedSTH {
+    int64_t tree_size;
+    uint64_t timestamp;
+    std::string etag;
+    std::shared_ptr<const std::string> body;
+    // By first tree size, for a second tree size of |tree_size|.
+    std::map<int64_t, std::shared_ptr<const std::string>> consistency;
+  };
+
+  std::shared_ptr<const RenderedSTH> CurrentRenderedSTH() const {
+    return std::atomic_load(&rendered_sth_);
+  }
 
   LogLookup* const log_lookup_;
   const ReadOnlyDatabase* const db_;
   const ClusterStateController* const controller_;
   Proxy* proxy_;
+  PendingEntryBodies* pending_bodies_;
+  std::string path_prefix_;
   ThreadPool* const pool_;
   libevent::Base* const event_base_;
   StalenessTracker* const staleness_tracker_;
+  // Responses for ranges below the current tree size, nullptr if
+  // disabled.
+  const std::unique_ptr<GetEntriesCache> get_entries_cache_;
+  // Binary get-entries responses for aligned ranges, nullptr if
+  // disabled.
+  const std::unique_ptr<BinarySegmentFiles> segment_files_;
+  // Addresses of the clients allowed larger get-entries responses.
+  const std::unordered_set<std::string> trusted_mirrors_;
+  // Holds get-sth requests until there is a newer STH, nullptr if
+  // disabled.
+  const std::unique_ptr<STHLongPoll> sth_long_poll_;
+  // By RequestClass, nullptr for UNLIMITED.
+  std::vector<std::unique_ptr<RateLimiter>> rate_limiters_;
+
+  const Database::NotifySTHCallback on_new_sth_;
+  // Serializes RenderSTH(), and guards |previous_tree_sizes_|.
+  std::mutex render_lock_;
+  // Of the last STHs rendered before the current one, latest first.
+  std::deque<int64_t> previous_tree_sizes_;
+  // Only ever accessed with std::atomic_load() and std::atomic_store().
+  std::shared_ptr<const RenderedSTH> rendered_sth_;
 };
 
 
@@ -2,32 +2,19 @@
 #define CERT_TRANS_SERVER_HANDLER_V2_H_
 
 #include <stdint.h>
-#include <memory>
-#include <mutex>
-#include <string>
 
 #include "proto/ct.pb.h"
+#include "server/handler.h"
 #include "server/staleness_tracker.h"
 #include "util/libevent_wrapper.h"
-#include "util/sync_task.h"
-#include "util/task.h"
-
-class Frontend;
 
 namespace cert_trans {
 
-class CertChain;
-class CertChecker;
-class ClusterStateController;
-class LogLookup;
-class LoggedEntry;
-class PreCertChain;
-class Proxy;
-class ReadOnlyDatabase;
-class ThreadPool;
-
 
-class HttpHandlerV2 {
+// Serves the RFC 6962-bis API. The proxying, admission, rate limiting,
+// request deadlines and stats all come from HttpHandler, as do the
+// flags controlling them; only the v2 endpoints are its own.
+class HttpHandlerV2 : public HttpHandler {
  public:
   // Does not take ownership of its parameters, which must outlive
   // this instance.
@@ -39,25 +26,12 @@ class HttpHandlerV2 {
   HttpHandlerV2(const HttpHandlerV2&) = delete;
   HttpHandlerV2& operator=(const HttpHandlerV2&) = delete;
 
-  void Add(libevent::HttpServer* server);
-
-  void SetProxy(Proxy* proxy);
-
  protected:
-  // Implemented by subclasses which want to add their own extra http handlers.
-  virtual void AddHandlers(libevent::HttpServer* server) = 0;
+  void AddLogHandlers(libevent::HttpServer* server) override;
 
   void AddEntryReply(evhttp_request* req, const util::Status& add_status,
                      const ct::SignedCertificateTimestamp& sct) const;
 
-  void ProxyInterceptor(
-      const libevent::HttpServer::HandlerCallback& local_handler,
-      evhttp_request* request);
-
-  void AddProxyWrappedHandler(
-      libevent::HttpServer* server, const std::string& path,
-      const libevent::HttpServer::HandlerCallback& local_handler);
-
   void GetEntries(evhttp_request* req) const;
   void GetProof(evhttp_request* req) const;
   void GetSTH(evhttp_request* req) const;
@@ -65,14 +39,6 @@ class HttpHandlerV2 {
 
   void BlockingGetEntries(evhttp_request* req, int64_t start, int64_t end,
                           bool include_scts) const;
-
-  LogLookup* const log_lookup_;
-  const ReadOnlyDatabase* const db_;
-  const ClusterStateController* const controller_;
-  Proxy* proxy_;
-  ThreadPool* const pool_;
-  libevent::Base* const event_base_;
-  StalenessTracker* const staleness_tracker_;
 };
 
 
@@ -1,6 +1,10 @@
 #include "server/json_output.h"
 
+#include <event2/buffer.h>
+#include <event2/http.h>
+#include <gflags/gflags.h>
 #include <glog/logging.h>
+#include <future>
 #include <string>
 
 #include "monitoring/latency.h"
@@ -8,7 +12,18 @@
 #include "util/json_wrapper.h"
 #include "util/libevent_wrapper.h"
 
+using std::function;
+using std::lock_guard;
+using std::mutex;
+using std::promise;
 using std::string;
+using std::unique_lock;
+
+DEFINE_bool(compress_responses, true,
+            "compress JSON responses with the best content coding the "
+            "client accepts, among gzip, br and zstd (as built in)");
+DEFINE_int32(compress_responses_min_bytes, 1024,
+             "JSON responses smaller than this are never compressed");
 
 namespace cert_trans {
 namespace {
@@ -26,6 +41,11 @@ static Counter<string, int>* total_http_server_response_codes(
 
 static const char kJsonContentType[] = "application/json; charset=utf-8";
 
+// In order of preference.
+static const ContentEncoding kResponseEncodings[] = {
+    ContentEncoding::ZSTD, ContentEncoding::BROTLI, ContentEncoding::GZIP,
+};
+
 
 string LogRequest(evhttp_request* req, int http_status, int resp_body_length) {
   evhttp_connection* conn = evhttp_request_get_connection(req);
@@ -65,34 +85,43 @@ string LogRequest(evhttp_request* req, int http_status, int resp_body_length) {
 }
 
 
-}  // namespace
+// The reply has to be sent from the event loop the request came in
+// on, which is not that of |base| if the HTTP server has several.
+libevent::Base* ReplyBase(libevent::Base* base, evhttp_request* req) {
+  libevent::Base* const owner(libevent::Base::ForRequest(req));
+  return owner ? owner : CHECK_NOTNULL(base);
+}
 
 
-void SendJsonReply(libevent::Base* base, evhttp_request* req, int http_status,
-                   const JsonObject& json) {
-  CHECK_NOTNULL(base);
+// Sends the reply, with the body already in the output buffer of
+// |req|.
+void SendOutputBuffer(libevent::Base* base, evhttp_request* req,
+                      int http_status, const char* content_type) {
   CHECK_NOTNULL(req);
+  base = ReplyBase(base, req);
   CHECK_EQ(evhttp_add_header(evhttp_request_get_output_headers(req),
-                             "Content-Type", kJsonContentType),
+                             "Content-Type", content_type),
            0);
   if (http_status == HTTP_SERVUNAVAIL) {
     CHECK_EQ(evhttp_add_header(evhttp_request_get_output_headers(req),
                                "Retry-After", "10"),
              0);
+  } else if (http_status == kHttpTooManyRequests) {
+    CHECK_EQ(evhttp_add_header(evhttp_request_get_output_headers(req),
+                               "Retry-After", "1"),
+             0);
   }
-  const string resp_body(json.ToString());
-  CHECK_GT(evbuffer_add_printf(evhttp_request_get_output_buffer(req), "%s",
-                               resp_body.c_str()),
-           0);
 
-  const string logstr(LogRequest(req, http_status, resp_body.size()));
+  const string logstr(LogRequest(
+      req, http_status,
+      evbuffer_get_length(evhttp_request_get_output_buffer(req))));
   const auto send_reply([req, http_status, logstr]() {
     evhttp_send_reply(req, http_status, /*reason*/ NULL, /*databuf*/ NULL);
 
     VLOG(1) << logstr;
   });
 
-  if (!libevent::Base::OnEventThread()) {
+  if (!base->OnThisEventThread()) {
     base->Add(send_reply);
   } else {
     send_reply();
@@ -100,6 +129,97 @@ void SendJsonReply(libevent::Base* base, evhttp_request* req, int http_status,
 }
 
 
+// Sends the JSON in |body|, compressing it if the client allows.
+void SendJsonBody(libevent::Base* base, evhttp_request* req, int http_status,
+                  const string& body) {
+  const ContentEncoding encoding(
+      ResponseEncoding(CHECK_NOTNULL(req), body.size()));
+  string compressed;
+  const bool compress(encoding != ContentEncoding::IDENTITY &&
+                      Compress(encoding, body, &compressed));
+  const string& output(compress ? compressed : body);
+  evbuffer* const buffer(CHECK_NOTNULL(evbuffer_new()));
+  CHECK_EQ(evbuffer_add(buffer, output.data(), output.size()), 0);
+  SendJsonReply(base, req, http_status,
+                compress ? encoding : ContentEncoding::IDENTITY, buffer);
+  evbuffer_free(buffer);
+}
+
+
+}  // namespace
+
+
+ContentEncoding ResponseEncoding(evhttp_request* req, size_t body_size) {
+  if (!FLAGS_compress_responses ||
+      body_size < static_cast<size_t>(FLAGS_compress_responses_min_bytes)) {
+    return ContentEncoding::IDENTITY;
+  }
+
+  for (const ContentEncoding encoding : kResponseEncodings) {
+    if (ContentEncodingSupported(encoding) &&
+        libevent::AcceptsEncoding(req, ContentEncodingName(encoding))) {
+      return encoding;
+    }
+  }
+
+  return ContentEncoding::IDENTITY;
+}
+
+
+void SendJsonReply(libevent::Base* base, evhttp_request* req, int http_status,
+                   const JsonObject& json) {
+  SendJsonBody(base, req, http_status, json.ToString());
+}
+
+
+void SendJsonReply(libevent::Base* base, evhttp_request* req, int http_status,
+                   evbuffer* json) {
+  const size_t length(evbuffer_get_length(CHECK_NOTNULL(json)));
+  if (ResponseEncoding(CHECK_NOTNULL(req), length) ==
+      ContentEncoding::IDENTITY) {
+    // Nothing to do to it.
+    return SendJsonReply(base, req, http_status, ContentEncoding::IDENTITY,
+                         json);
+  }
+
+  const string body(reinterpret_cast<const char*>(evbuffer_pullup(json, -1)),
+                    length);
+  evbuffer_drain(json, length);
+  SendJsonBody(base, req, http_status, body);
+}
+
+
+void SendJsonReply(libevent::Base* base, evhttp_request* req, int http_status,
+                   ContentEncoding encoding, evbuffer* json) {
+  evkeyvalq* const headers(
+      evhttp_request_get_output_headers(CHECK_NOTNULL(req)));
+  if (FLAGS_compress_responses) {
+    // Caches must not serve a compressed response to clients which do
+    // not accept it.
+    CHECK_EQ(evhttp_add_header(headers, "Vary", "Accept-Encoding"), 0);
+  }
+  if (encoding != ContentEncoding::IDENTITY) {
+    CHECK_EQ(evhttp_add_header(headers, "Content-Encoding",
+                               ContentEncodingName(encoding)),
+             0);
+  }
+  // This moves the data over, rather than copying it.
+  CHECK_EQ(evbuffer_add_buffer(evhttp_request_get_output_buffer(req), json),
+           0);
+  SendOutputBuffer(base, req, http_status, kJsonContentType);
+}
+
+
+void SendReply(libevent::Base* base, evhttp_request* req, int http_status,
+               const char* content_type, evbuffer* body) {
+  // This moves the data over, rather than copying it.
+  CHECK_EQ(evbuffer_add_buffer(
+               evhttp_request_get_output_buffer(CHECK_NOTNULL(req)), body),
+           0);
+  SendOutputBuffer(base, req, http_status, content_type);
+}
+
+
 void SendJsonError(libevent::Base* base, evhttp_request* req, int http_status,
                    const string& error_msg) {
   JsonObject json_reply;
@@ -110,4 +230,130 @@ void SendJsonError(libevent::Base* base, evhttp_request* req, int http_status,
 }
 
 
+ChunkedJsonReply::ChunkedJsonReply(libevent::Base* base, evhttp_request* req,
+                                   size_t max_bytes_in_flight)
+    : base_(ReplyBase(base, CHECK_NOTNULL(req))),
+      req_(req),
+      max_bytes_in_flight_(max_bytes_in_flight),
+      conn_(nullptr),
+      bytes_pending_(0),
+      bytes_in_flight_(0),
+      bytes_sent_(0),
+      closed_(false),
+      ended_(false) {
+  CHECK_EQ(evhttp_add_header(evhttp_request_get_output_headers(req_),
+                             "Content-Type", kJsonContentType),
+           0);
+  RunOnEventThread([this]() {
+    lock_guard<mutex> lock(lock_);
+    conn_ = evhttp_request_get_connection(req_);
+    // The client may have gone away already, leaving the request
+    // detached from its connection.
+    if (!conn_) {
+      closed_ = true;
+      return;
+    }
+    evhttp_connection_set_closecb(conn_, &ChunkedJsonReply::Closed, this);
+    evhttp_send_reply_start(req_, HTTP_OK, /*reason*/ NULL);
+  });
+}
+
+
+ChunkedJsonReply::~ChunkedJsonReply() {
+  if (!ended_) {
+    End();
+  }
+}
+
+
+bool ChunkedJsonReply::Send(evbuffer* json) {
+  CHECK(!ended_);
+  const size_t length(evbuffer_get_length(CHECK_NOTNULL(json)));
+  if (length == 0) {
+    return true;
+  }
+
+  unique_lock<mutex> lock(lock_);
+  changed_.wait(lock, [this]() {
+    return closed_ ||
+           bytes_pending_ + bytes_in_flight_ < max_bytes_in_flight_;
+  });
+  if (closed_) {
+    evbuffer_drain(json, length);
+    return false;
+  }
+  bytes_pending_ += length;
+  lock.unlock();
+
+  evbuffer* const chunk(CHECK_NOTNULL(evbuffer_new()));
+  // This moves the data over, rather than copying it.
+  CHECK_EQ(evbuffer_add_buffer(chunk, json), 0);
+  base_->Add([this, chunk, length]() {
+    lock_guard<mutex> lock(lock_);
+    bytes_pending_ -= length;
+    if (!closed_) {
+      bytes_in_flight_ += length;
+      bytes_sent_ += length;
+      evhttp_send_reply_chunk_with_cb(req_, chunk, &ChunkedJsonReply::Flushed,
+                                      this);
+    }
+    evbuffer_free(chunk);
+    changed_.notify_all();
+  });
+
+  return true;
+}
+
+
+void ChunkedJsonReply::End() {
+  CHECK(!ended_);
+  // This runs after the chunks queued by Send(), as closures run in
+  // order. Once it has, libevent no longer has any callback on us.
+  RunOnEventThread([this]() {
+    lock_guard<mutex> lock(lock_);
+    if (!closed_) {
+      evhttp_connection_set_closecb(conn_, nullptr, nullptr);
+      const string logstr(LogRequest(req_, HTTP_OK, bytes_sent_));
+      VLOG(1) << logstr;
+    } else {
+      VLOG(1) << "client went away after " << bytes_sent_ << " bytes of "
+              << evhttp_request_get_uri(req_);
+    }
+    // This also frees the request if it was detached from its connection.
+    evhttp_send_reply_end(req_);
+  });
+  ended_ = true;
+}
+
+
+void ChunkedJsonReply::RunOnEventThread(const function<void()>& cb) {
+  CHECK(!base_->OnThisEventThread());
+  promise<void> done;
+  base_->Add([&cb, &done]() {
+    cb();
+    done.set_value();
+  });
+  done.get_future().wait();
+}
+
+
+// static
+void ChunkedJsonReply::Flushed(evhttp_connection* /*conn*/, void* reply) {
+  ChunkedJsonReply* const self(static_cast<ChunkedJsonReply*>(reply));
+  lock_guard<mutex> lock(self->lock_);
+  // Everything queued on the connection so far has been written.
+  self->bytes_in_flight_ = 0;
+  self->changed_.notify_all();
+}
+
+
+// static
+void ChunkedJsonReply::Closed(evhttp_connection* /*conn*/, void* reply) {
+  ChunkedJsonReply* const self(static_cast<ChunkedJsonReply*>(reply));
+  lock_guard<mutex> lock(self->lock_);
+  self->closed_ = true;
+  self->changed_.notify_all();
+}
+
+
 }  // namespace cert_trans
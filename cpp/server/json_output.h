@@ -1,8 +1,16 @@
 #ifndef CERT_TRANS_SERVER_JSON_OUTPUT_H_
 #define CERT_TRANS_SERVER_JSON_OUTPUT_H_
 
+#include <stddef.h>
+#include <condition_variable>
+#include <functional>
+#include <mutex>
 #include <string>
 
+#include "util/compression.h"
+
+struct evbuffer;
+struct evhttp_connection;
 struct evhttp_request;
 class JsonObject;
 
@@ -12,14 +20,94 @@ class Base;
 }  // namespace libevent
 
 
+// Not defined by libevent. Replies with this status, or with
+// HTTP_SERVUNAVAIL, come with a Retry-After header.
+const int kHttpTooManyRequests = 429;
+
+
+// The content coding to send a response to |req| with, if its body is
+// |body_size| bytes long: the preferred one of those the client
+// accepts and we support, or IDENTITY if there are none, or if the body
+// is too small to be worth compressing.
+ContentEncoding ResponseEncoding(evhttp_request* req, size_t body_size);
+
+
+// Sends |json|, compressed as ResponseEncoding() says. This is done on
+// the calling thread, so large replies should be sent from a worker
+// thread rather than from the event loop.
 void SendJsonReply(libevent::Base* base, evhttp_request* req, int http_status,
                    const JsonObject& json);
 
 
+// As above, but with the JSON already written out in |json| (which is
+// left empty).
+void SendJsonReply(libevent::Base* base, evhttp_request* req, int http_status,
+                   evbuffer* json);
+
+
+// As above, but with |json| already encoded with |encoding|, so that
+// it is sent as is.
+void SendJsonReply(libevent::Base* base, evhttp_request* req, int http_status,
+                   ContentEncoding encoding, evbuffer* json);
+
+
+// Like SendJsonReply(), but for a body that is not JSON.
+void SendReply(libevent::Base* base, evhttp_request* req, int http_status,
+               const char* content_type, evbuffer* body);
+
+
 void SendJsonError(libevent::Base* base, evhttp_request* req, int http_status,
                    const std::string& error_msg);
 
 
+// Sends a successful JSON reply a piece at a time, using chunked
+// transfer encoding, so that the whole body never has to be held in
+// memory. Once more than |max_bytes_in_flight| have been handed over
+// but not written to the client yet, Send() waits for them to be, so
+// memory usage follows what the connection can take.
+//
+// This blocks, so it must not be used from the event loop of the
+// request.
+class ChunkedJsonReply {
+ public:
+  ChunkedJsonReply(libevent::Base* base, evhttp_request* req,
+                   size_t max_bytes_in_flight);
+  // Ends the reply, if End() has not been called.
+  ~ChunkedJsonReply();
+  ChunkedJsonReply(const ChunkedJsonReply&) = delete;
+  ChunkedJsonReply& operator=(const ChunkedJsonReply&) = delete;
+
+  // Sends the JSON in |json| (which is left empty) as the next part of
+  // the body. Returns false if the client has gone away, in which case
+  // there is no point in sending the rest.
+  bool Send(evbuffer* json);
+
+  // Sends the end of the reply. |req| must not be used afterwards.
+  void End();
+
+ private:
+  // Runs |cb| on the event loop of the request, and waits for it.
+  void RunOnEventThread(const std::function<void()>& cb);
+  static void Flushed(evhttp_connection* conn, void* reply);
+  static void Closed(evhttp_connection* conn, void* reply);
+
+  libevent::Base* const base_;
+  evhttp_request* const req_;
+  const size_t max_bytes_in_flight_;
+
+  std::mutex lock_;
+  std::condition_variable changed_;
+  evhttp_connection* conn_;
+  // Handed to Send() but not queued on the connection yet.
+  size_t bytes_pending_;
+  // Queued on the connection, but not written to the client yet.
+  size_t bytes_in_flight_;
+  size_t bytes_sent_;
+  bool closed_;
+  bool ended_;
+};
+
+
 }  // namespace cert_trans
 
 
@@ -0,0 +1,159 @@
+#include "server/json_output.h"
+
+#include <event2/buffer.h>
+#include <event2/http.h>
+#include <glog/logging.h>
+#include <gtest/gtest.h>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "util/compression.h"
+#include "util/libevent_wrapper.h"
+#include "util/testing.h"
+
+using std::lock_guard;
+using std::make_shared;
+using std::mutex;
+using std::shared_ptr;
+using std::string;
+using std::thread;
+using std::to_string;
+using std::vector;
+
+namespace cert_trans {
+namespace {
+
+
+class ChunkedJsonReplyTest : public ::testing::Test {
+ protected:
+  ChunkedJsonReplyTest()
+      : base_(make_shared<libevent::Base>()),
+        pump_(base_),
+        server_(*base_),
+        port_(0) {
+  }
+
+  void SetUp() override {
+    ASSERT_TRUE(server_.AddHandler("/numbers", [this](evhttp_request* req) {
+      // The reply blocks, so it has to be sent from another thread.
+      lock_guard<mutex> lock(lock_);
+      senders_.emplace_back(&ChunkedJsonReplyTest::SendNumbers, this, req);
+    }));
+    port_ = server_.Bind("127.0.0.1", 0);
+  }
+
+  void TearDown() override {
+    lock_guard<mutex> lock(lock_);
+    for (thread& sender : senders_) {
+      sender.join();
+    }
+  }
+
+  // Sends a JSON array of the numbers up to 999, a few at a time, with
+  // little room for them on the connection.
+  void SendNumbers(evhttp_request* req) {
+    ChunkedJsonReply reply(base_.get(), req, 16);
+    evbuffer* const buffer(CHECK_NOTNULL(evbuffer_new()));
+    evbuffer_add_printf(buffer, "[");
+    for (int i = 0; i < 1000; ++i) {
+      evbuffer_add_printf(buffer, i > 0 ? ",%d" : "%d", i);
+      if (i % 7 == 0) {
+        EXPECT_TRUE(reply.Send(buffer));
+        EXPECT_EQ(0U, evbuffer_get_length(buffer));
+      }
+    }
+    evbuffer_add_printf(buffer, "]");
+    EXPECT_TRUE(reply.Send(buffer));
+    evbuffer_free(buffer);
+    reply.End();
+  }
+
+  const shared_ptr<libevent::Base> base_;
+  libevent::EventPumpThread pump_;
+  libevent::HttpServer server_;
+  ev_uint16_t port_;
+  mutex lock_;
+  vector<thread> senders_;
+};
+
+
+TEST_F(ChunkedJsonReplyTest, SendsWholeBody) {
+  string expected("[");
+  for (int i = 0; i < 1000; ++i) {
+    expected += (i > 0 ? "," : "") + to_string(i);
+  }
+  expected += "]";
+
+  for (int i = 0; i < 3; ++i) {
+    const string response(test::HttpGet(port_, "/numbers"));
+    EXPECT_EQ(0U, response.find("HTTP/1.0 200")) << response;
+    EXPECT_NE(string::npos, response.find("application/json")) << response;
+    const size_t body(response.find("\r\n\r\n"));
+    ASSERT_NE(string::npos, body) << response;
+    EXPECT_EQ(expected, response.substr(body + 4));
+  }
+}
+
+
+TEST(SendJsonReplyTest, CompressesWhenAccepted) {
+  if (!ContentEncodingSupported(ContentEncoding::GZIP)) {
+    LOG(WARNING) << "Built without gzip, skipping.";
+    return;
+  }
+
+  const shared_ptr<libevent::Base> base(make_shared<libevent::Base>());
+  libevent::EventPumpThread pump(base);
+  libevent::HttpServer server(*base);
+  string expected("[");
+  for (int i = 0; i < 1000; ++i) {
+    expected += (i > 0 ? "," : "") + to_string(i % 10);
+  }
+  expected += "]";
+  ASSERT_TRUE(server.AddHandler("/big", [&](evhttp_request* req) {
+    evbuffer* const buffer(CHECK_NOTNULL(evbuffer_new()));
+    evbuffer_add(buffer, expected.data(), expected.size());
+    SendJsonReply(base.get(), req, HTTP_OK, buffer);
+    evbuffer_free(buffer);
+  }));
+  ASSERT_TRUE(server.AddHandler("/small", [&](evhttp_request* req) {
+    evbuffer* const buffer(CHECK_NOTNULL(evbuffer_new()));
+    evbuffer_add_printf(buffer, "[%s]", expected.substr(1, 100).c_str());
+    SendJsonReply(base.get(), req, HTTP_OK, buffer);
+    evbuffer_free(buffer);
+  }));
+  const ev_uint16_t port(server.Bind("127.0.0.1", 0));
+
+  string response(test::HttpGet(port, "/big"));
+  size_t body(response.find("\r\n\r\n"));
+  ASSERT_NE(string::npos, body) << response;
+  EXPECT_EQ(string::npos, response.find("Content-Encoding")) << response;
+  EXPECT_NE(string::npos, response.find("Vary: Accept-Encoding")) << response;
+  EXPECT_EQ(expected, response.substr(body + 4));
+
+  response = test::HttpGet(port, "/big",
+                           "Accept-Encoding: gzip, zstd;q=0, br;q=0\r\n");
+  body = response.find("\r\n\r\n");
+  ASSERT_NE(string::npos, body) << response;
+  EXPECT_NE(string::npos, response.find("Content-Encoding: gzip"))
+      << response;
+  string compressed;
+  ASSERT_TRUE(GzipCompress(expected, 6, &compressed));
+  EXPECT_EQ(compressed, response.substr(body + 4));
+
+  // Too small to be worth it.
+  response = test::HttpGet(port, "/small", "Accept-Encoding: gzip\r\n");
+  EXPECT_EQ(string::npos, response.find("Content-Encoding")) << response;
+}
+
+
+}  // namespace
+}  // namespace cert_trans
+
+
+int main(int argc, char** argv) {
+  cert_trans::test::InitTesting(argv[0], &argc, &argv, true);
+  return RUN_ALL_TESTS();
+}
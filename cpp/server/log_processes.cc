@@ -1,21 +1,46 @@
 #include "server/log_processes.h"
 
 #include <gflags/gflags.h>
+#include <algorithm>
+#include <condition_variable>
 #include <iostream>
+#include <mutex>
+#include <set>
 
 #include "monitoring/latency.h"
 #include "monitoring/monitoring.h"
 #include "server/metrics.h"
+#include "util/sync_task.h"
 
 DEFINE_int32(tree_signing_frequency_seconds, 600,
-             "How often should we issue a new signed tree head. Approximate: "
-             "the signer process will kick off if in the beginning of the "
-             "server select loop, at least this period has elapsed since the "
-             "last signing. Set this well below the MMD to ensure we sign in "
-             "a timely manner. Must be greater than 0.");
+             "Longest time between issuing new signed tree heads, even if "
+             "there are no new entries. Set this well below the MMD to ensure "
+             "we sign in a timely manner. Must be greater than 0.");
+DEFINE_int32(tree_signing_min_new_entries, 1000,
+             "Sign a new tree head as soon as this many new entries are in "
+             "the local database.");
+DEFINE_int32(tree_signing_max_delay_seconds, 10,
+             "Longest time new entries in the local database wait for a new "
+             "tree head, when there are fewer than "
+             "--tree_signing_min_new_entries of them.");
+DEFINE_int32(tree_signing_poll_interval_ms, 500,
+             "How often the signer checks the local database for new "
+             "entries. It checks less and less often while there are none, "
+             "down to every --tree_signing_frequency_seconds.");
 DEFINE_int32(sequencing_frequency_seconds, 10,
-             "How often should new entries be sequenced. The sequencing runs "
-             "in parallel with the tree signing and cleanup.");
+             "Longest time between sequencing runs, which otherwise run as "
+             "pending entries come in. The sequencing runs in parallel with "
+             "the tree signing and cleanup.");
+DEFINE_int32(sequencing_batch_size, 1000,
+             "Sequence pending entries as soon as this many of them are past "
+             "the guard window.");
+DEFINE_int32(sequencing_max_delay_ms, 500,
+             "Longest time pending entries past the guard window wait to be "
+             "sequenced, when there are fewer than --sequencing_batch_size "
+             "of them.");
+DEFINE_int32(sequencing_standby_poll_ms, 100,
+             "How often nodes which are not the master check whether they "
+             "became master, upon which they sequence straight away.");
 DEFINE_int32(cleanup_frequency_seconds, 10,
              "How often should new entries be cleanedup. The cleanup runs in "
              "in parallel with the tree signing and sequencing.");
@@ -25,10 +50,18 @@ using cert_trans::Gauge;
 using cert_trans::Latency;
 using google::RegisterFlagValidator;
 using ct::SignedTreeHead;
+using std::condition_variable;
 using std::function;
 using std::chrono::milliseconds;
 using std::chrono::seconds;
 using std::chrono::steady_clock;
+using std::chrono::system_clock;
+using std::lock_guard;
+using std::min;
+using std::multiset;
+using std::mutex;
+using std::unique_lock;
+using std::vector;
 
 namespace {
 
@@ -62,7 +95,124 @@ static bool ValidateIsPositive(const char* flagname, int value) {
 static const bool sign_dummy =
     RegisterFlagValidator(&FLAGS_tree_signing_frequency_seconds,
                           &ValidateIsPositive);
-}
+static const bool sign_min_dummy =
+    RegisterFlagValidator(&FLAGS_tree_signing_min_new_entries,
+                          &ValidateIsPositive);
+static const bool sequencing_batch_dummy =
+    RegisterFlagValidator(&FLAGS_sequencing_batch_size, &ValidateIsPositive);
+
+
+// Wakes up a process loop, either when told there is work for it, or
+// at a deadline.
+class Waker {
+ public:
+  void Notify() {
+    lock_guard<mutex> lock(mutex_);
+    notified_ = true;
+    cv_.notify_all();
+  }
+
+  // Waits until Notify() is called, if it wasn't since the last wait,
+  // or until |deadline|.
+  template <class Clock, class Duration>
+  void WaitUntil(const std::chrono::time_point<Clock, Duration>& deadline) {
+    unique_lock<mutex> lock(mutex_);
+    cv_.wait_until(lock, deadline, [this]() { return notified_; });
+    notified_ = false;
+  }
+
+ private:
+  mutex mutex_;
+  condition_variable cv_;
+  bool notified_ = false;
+};
+
+
+// Wakes the signer up when the sequencer added entries to the local
+// database.
+Waker* signer_waker(new Waker);
+
+
+// Keeps track, from the updates to the pending entries, of when they
+// will be old enough to be sequenced, and wakes the sequencer up when
+// enough of them are.
+class PendingEntriesTracker {
+ public:
+  PendingEntriesTracker(const std::chrono::duration<double>& guard_window)
+      : guard_window_(std::chrono::duration_cast<system_clock::duration>(
+            guard_window)) {
+  }
+
+  void OnPendingEntriesUpdated(
+      const vector<cert_trans::Update<cert_trans::LoggedEntry>>& updates) {
+    bool added(false);
+    {
+      lock_guard<mutex> lock(mutex_);
+      for (const auto& update : updates) {
+        // Entries are only ever added, and then removed once they are
+        // sequenced and signed.
+        if (update.exists_) {
+          ready_at_.insert(
+              system_clock::time_point(
+                  milliseconds(update.handle_.Entry().timestamp())) +
+              guard_window_);
+          added = true;
+        }
+      }
+    }
+    if (added) {
+      waker_.Notify();
+    }
+  }
+
+  // Waits until a batch of entries is ready to be sequenced, or one
+  // has been ready for long enough, or until |deadline|.
+  void Wait(const system_clock::time_point& deadline) {
+    while (true) {
+      const system_clock::time_point now(system_clock::now());
+      system_clock::time_point wake_at(deadline);
+      {
+        lock_guard<mutex> lock(mutex_);
+        if (!ready_at_.empty()) {
+          int num_ready(0);
+          for (auto it(ready_at_.begin());
+               it != ready_at_.end() && *it <= now &&
+               num_ready < FLAGS_sequencing_batch_size;
+               ++it) {
+            ++num_ready;
+          }
+          const system_clock::time_point oldest_due(
+              *ready_at_.begin() + milliseconds(FLAGS_sequencing_max_delay_ms));
+          if (num_ready >= FLAGS_sequencing_batch_size || oldest_due <= now) {
+            return;
+          }
+          wake_at = min(wake_at, oldest_due);
+        }
+      }
+      if (now >= deadline) {
+        return;
+      }
+      waker_.WaitUntil(wake_at);
+    }
+  }
+
+  // Forgets the entries which were old enough to be sequenced at
+  // |when|.
+  void Sequenced(const system_clock::time_point& when) {
+    lock_guard<mutex> lock(mutex_);
+    ready_at_.erase(ready_at_.begin(), ready_at_.upper_bound(when));
+  }
+
+ private:
+  const system_clock::duration guard_window_;
+  Waker waker_;
+  mutex mutex_;
+  // When each known pending entry is old enough to be sequenced.
+  multiset<system_clock::time_point> ready_at_;
+};
+
+
+}  // namespace
 
 namespace cert_trans {
 
@@ -73,10 +223,18 @@ void SignMerkleTree(TreeSigner* tree_signer, ConsistentStore* store,
   CHECK_NOTNULL(controller);
   const steady_clock::duration period(
       (seconds(FLAGS_tree_signing_frequency_seconds)));
-  steady_clock::time_point target_run_time(steady_clock::now());
+  const steady_clock::duration min_poll_interval(
+      min<steady_clock::duration>(
+          milliseconds(std::max(FLAGS_tree_signing_poll_interval_ms, 1)),
+          period));
+  steady_clock::duration poll_interval(min_poll_interval);
+  // Sign straight away, the first time around.
+  bool sign(true);
+  steady_clock::time_point last_run_time;
 
   while (true) {
-    {
+    if (sign) {
+      last_run_time = steady_clock::now();
       ScopedLatency signer_run_latency(
           signer_run_latency_ms.GetScopedLatency());
       const TreeSigner::UpdateResult result(tree_signer->UpdateTree());
@@ -96,19 +254,36 @@ void SignMerkleTree(TreeSigner* tree_signer, ConsistentStore* store,
         default:
           LOG(FATAL) << "Error updating tree: " << result;
       }
+      poll_interval = min_poll_interval;
     }
 
+    // Sign once enough new entries are in, or once the oldest of them
+    // waited long enough, but at least every |period|. While there are
+    // none, check less and less often.
+    const steady_clock::time_point signing_due(last_run_time + period);
+    signer_waker->WaitUntil(
+        min(steady_clock::now() + poll_interval, signing_due));
     const steady_clock::time_point now(steady_clock::now());
-    while (target_run_time <= now) {
-      target_run_time += period;
+    const int64_t num_unsigned(tree_signer->NumUnsignedEntries());
+    sign = now >= signing_due ||
+           num_unsigned >= FLAGS_tree_signing_min_new_entries ||
+           (num_unsigned > 0 &&
+            now - last_run_time >=
+                seconds(FLAGS_tree_signing_max_delay_seconds));
+    if (num_unsigned == 0) {
+      poll_interval = min(2 * poll_interval, period);
+    } else {
+      poll_interval = min_poll_interval;
     }
-    std::this_thread::sleep_for(target_run_time - now);
   }
 }
 
-void CleanUpEntries(ConsistentStore* store,
+void CleanUpEntries(ConsistentStore* store, PendingEntryBodies* bodies,
+                    const ReadOnlyDatabase* db,
                     const function<bool()>& is_master) {
   CHECK_NOTNULL(store);
+  CHECK_NOTNULL(bodies);
+  CHECK_NOTNULL(db);
   CHECK(is_master);
   const steady_clock::duration period(
       (seconds(FLAGS_cleanup_frequency_seconds)));
@@ -132,6 +307,22 @@ void CleanUpEntries(ConsistentStore* store,
       }
     }
 
+    // Every node keeps copies of pending entry bodies, which no node
+    // needs once they are served.
+    if (bodies->KeepsBodies()) {
+      const util::StatusOr<ct::SignedTreeHead> serving_sth(
+          store->GetServingSTH());
+      if (serving_sth.ok()) {
+        const int64_t num_removed(bodies->RemoveSequenced(
+            *db, serving_sth.ValueOrDie().tree_size()));
+        VLOG(1) << "Removed " << num_removed << " pending entry bodies.";
+      } else if (serving_sth.status().CanonicalCode() !=
+                 util::error::NOT_FOUND) {
+        LOG(WARNING) << "Problem getting the serving STH: "
+                     << serving_sth.status();
+      }
+    }
+
     const steady_clock::time_point now(steady_clock::now());
     while (target_run_time <= now) {
       target_run_time += period;
@@ -142,31 +333,68 @@ void CleanUpEntries(ConsistentStore* store,
 }
 
 
-void SequenceEntries(TreeSigner* tree_signer,
+void SequenceEntries(TreeSigner* tree_signer, ConsistentStore* store,
+                     util::Executor* executor,
                      const function<bool()>& is_master) {
   CHECK_NOTNULL(tree_signer);
+  CHECK_NOTNULL(store);
+  CHECK_NOTNULL(executor);
   CHECK(is_master);
-  const steady_clock::duration period(
+  const system_clock::duration period(
       (seconds(FLAGS_sequencing_frequency_seconds)));
-  steady_clock::time_point target_run_time(steady_clock::now());
 
+  PendingEntriesTracker tracker(tree_signer->GuardWindow());
+  util::SyncTask watch_task(executor);
+  store->WatchPendingEntries(
+      std::bind(&PendingEntriesTracker::OnPendingEntriesUpdated, &tracker,
+                std::placeholders::_1),
+      watch_task.task());
+
+  system_clock::time_point last_run_time(system_clock::now());
+  bool was_master(false);
   while (true) {
-    if (is_master()) {
+    // Runs as soon as there are pending entries to sequence, but at
+    // least every |period|, in case some were missed. Standby nodes
+    // also wake up often enough to notice they became master.
+    if (was_master) {
+      tracker.Wait(last_run_time + period);
+    } else {
+      tracker.Wait(
+          min(last_run_time + period,
+              system_clock::now() +
+                  milliseconds(std::max(FLAGS_sequencing_standby_poll_ms,
+                                        1))));
+    }
+    last_run_time = system_clock::now();
+
+    if (!is_master()) {
+      // Whichever node is master sequences them. The entries which are
+      // not ready yet are still tracked, so that this node knows when
+      // they are, should it become master.
+      was_master = false;
+      tracker.Sequenced(last_run_time);
+      continue;
+    }
+    if (!was_master) {
+      // Whatever the previous master left unsequenced goes straight
+      // away, rather than at the next period.
+      LOG(INFO) << "Became master, sequencing pending entries.";
+      was_master = true;
+    }
+
+    {
       const ScopedLatency sequencer_sequence_latency(
           sequencer_sequence_latency_ms.GetScopedLatency());
       util::Status status(tree_signer->SequenceNewEntries());
       if (!status.ok()) {
         LOG(WARNING) << "Problem sequencing new entries: " << status;
+      } else {
+        signer_waker->Notify();
       }
       sequencer_total_runs->Increment(status.ok());
     }
-
-    const steady_clock::time_point now(steady_clock::now());
-    while (target_run_time <= now) {
-      target_run_time += period;
-    }
-
-    std::this_thread::sleep_for(target_run_time - now);
+    // Those which failed are tried again in a period.
+    tracker.Sequenced(last_run_time);
   }
 }
 
@@ -3,8 +3,11 @@
 
 #include <functional>
 
+#include "log/database.h"
 #include "log/logged_entry.h"
+#include "log/pending_entry_bodies.h"
 #include "log/tree_signer.h"
+#include "util/executor.h"
 
 namespace cert_trans {
 
@@ -12,12 +15,24 @@ namespace cert_trans {
 // code is shared by binaries that write to logs, currently ct-server
 // (all versions) and xjson-server.
 
-void CleanUpEntries(ConsistentStore* store,
+// Cleans up the entries of |store| in the serving STH, if this node is
+// the master, and, on every node, removes the pending entry bodies
+// kept in |bodies| which are in the serving STH, looking them up in
+// |db|.
+void CleanUpEntries(ConsistentStore* store, PendingEntryBodies* bodies,
+                    const ReadOnlyDatabase* db,
                     const std::function<bool()>& is_master);
 
-void SequenceEntries(TreeSigner* tree_signer,
+// Sequences pending entries when there are enough of them old enough
+// to be sequenced, or the oldest have waited long enough, watching
+// |store| on |executor| to know about them.
+void SequenceEntries(TreeSigner* tree_signer, ConsistentStore* store,
+                     util::Executor* executor,
                      const std::function<bool()>& is_master);
 
+// Signs a new tree head when there are enough new entries in the local
+// database, or the oldest have waited long enough, and otherwise every
+// --tree_signing_frequency_seconds.
 void SignMerkleTree(TreeSigner* tree_signer, ConsistentStore* store,
                     ClusterStateController* controller);
 }
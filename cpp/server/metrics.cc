@@ -1,14 +1,36 @@
+#include "config.h"
 #include "server/metrics.h"
 
 #include <event2/buffer.h>
 #include <event2/http.h>
+#include <glog/logging.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <atomic>
+#include <chrono>
 #include <cstring>
+#include <memory>
 #include <sstream>
+#include <string>
+
+#ifdef HAVE_LIBPROFILER
+#include <gperftools/profiler.h>
+#endif
+#if defined(HAVE_LIBTCMALLOC) && defined(HAVE_GPERFTOOLS_MALLOC_EXTENSION_H)
+#include <gperftools/malloc_extension.h>
+#endif
 
 #include "monitoring/prometheus/exporter.h"
+#include "util/libevent_wrapper.h"
+#include "util/task.h"
+#include "util/tracing.h"
+#include "util/util.h"
 
+using std::chrono::seconds;
 using std::ostringstream;
+using std::string;
 using std::strncmp;
+using std::unique_ptr;
 
 namespace cert_trans {
 namespace {
@@ -18,17 +40,65 @@ const char kPrometheusProtoContentType[] =
     "proto=io.prometheus.client.MetricFamily;encoding=delimited";
 const size_t kPrometheusProtoContentTypeLen =
     std::strlen(kPrometheusProtoContentType);
+const char kPrometheusTextContentType[] = "text/plain; version=0.0.4";
 
-}  // namespace
+const int kDefaultProfileSeconds = 30;
+const int kMaxProfileSeconds = 600;
 
 
-void ExportPrometheusMetrics(evhttp_request* req) {
+bool CheckGet(evhttp_request* req) {
   if (evhttp_request_get_command(req) != EVHTTP_REQ_GET) {
     evhttp_send_reply(req, HTTP_BADMETHOD, /*reason*/ nullptr,
                       /*databuf*/ nullptr);
+    return false;
+  }
+  return true;
+}
+
+
+void SendProfile(evhttp_request* req, const string& profile) {
+  evhttp_add_header(evhttp_request_get_output_headers(req), "Content-Type",
+                    "application/octet-stream");
+  evbuffer_add(evhttp_request_get_output_buffer(req), profile.data(),
+               profile.size());
+  evhttp_send_reply(req, HTTP_OK, /*reason*/ nullptr, /*databuf*/ nullptr);
+}
+
+
+#ifdef HAVE_LIBPROFILER
+
+// Whether a CPU profile is being taken.
+std::atomic<bool> profiling(false);
+
+
+void FinishCpuProfile(evhttp_request* req, const string& path,
+                      util::Task* task) {
+  const unique_ptr<util::Task> task_deleter(task);
+  ProfilerStop();
+  string profile;
+  const bool read(util::ReadBinaryFile(path, &profile));
+  unlink(path.c_str());
+  profiling = false;
+
+  if (!read) {
+    LOG(WARNING) << "could not read the CPU profile from " << path;
+    evhttp_send_error(req, HTTP_INTERNAL, "could not read the profile");
     return;
   }
-  ostringstream oss;
+  SendProfile(req, profile);
+}
+
+#endif  // HAVE_LIBPROFILER
+
+
+}  // namespace
+
+
+void ExportPrometheusMetrics(evhttp_request* req) {
+  if (!CheckGet(req)) {
+    return;
+  }
+  string body;
   const char* req_accept(
       evhttp_find_header(evhttp_request_get_input_headers(req), "Accept"));
   if (req_accept &&
@@ -36,17 +106,105 @@ void ExportPrometheusMetrics(evhttp_request* req) {
                    kPrometheusProtoContentTypeLen) == 0) {
     evhttp_add_header(evhttp_request_get_output_headers(req), "Content-Type",
                       kPrometheusProtoContentType);
+    ostringstream oss;
     ExportMetricsToPrometheus(&oss);
+    body = oss.str();
+  } else if (req_accept && std::strstr(req_accept, "text/plain")) {
+    // What Prometheus asks for when it doesn't want protobufs.
+    evhttp_add_header(evhttp_request_get_output_headers(req), "Content-Type",
+                      kPrometheusTextContentType);
+    ExportMetricsToPrometheusText(&body);
   } else {
     evhttp_add_header(evhttp_request_get_output_headers(req), "Content-Type",
                       "text/html");
+    ostringstream oss;
     ExportMetricsToHtml(&oss);
+    body = oss.str();
   }
 
+  evbuffer_add(evhttp_request_get_output_buffer(req), body.data(),
+               body.size());
+  evhttp_send_reply(req, HTTP_OK, /*reason*/ nullptr, /*databuf*/ nullptr);
+}
+
+
+void ExportTraces(evhttp_request* req) {
+  if (!CheckGet(req)) {
+    return;
+  }
+  ostringstream oss;
+  ExportTracesAsOtlpJson(&oss);
+  evhttp_add_header(evhttp_request_get_output_headers(req), "Content-Type",
+                    "application/json");
   evbuffer_add(evhttp_request_get_output_buffer(req), oss.str().data(),
                oss.str().size());
   evhttp_send_reply(req, HTTP_OK, /*reason*/ nullptr, /*databuf*/ nullptr);
 }
 
 
+void ExportCpuProfile(evhttp_request* req) {
+  if (!CheckGet(req)) {
+    return;
+  }
+#ifdef HAVE_LIBPROFILER
+  libevent::Base* const base(CHECK_NOTNULL(libevent::Base::ForRequest(req)));
+  const libevent::QueryParams query(libevent::ParseQuery(req));
+  int secs(kDefaultProfileSeconds);
+  if (query.count("seconds") > 0) {
+    secs = libevent::GetIntParam(query, "seconds");
+  }
+  if (secs <= 0 || secs > kMaxProfileSeconds) {
+    evhttp_send_error(req, HTTP_BADREQUEST, "bad seconds parameter");
+    return;
+  }
+
+  if (profiling.exchange(true)) {
+    evhttp_send_error(req, HTTP_SERVUNAVAIL,
+                      "another CPU profile is being taken");
+    return;
+  }
+  char path[] = "/tmp/ct-cpu-profile-XXXXXX";
+  const int fd(mkstemp(path));
+  if (fd < 0) {
+    PLOG(WARNING) << "could not create a file for the CPU profile";
+    profiling = false;
+    evhttp_send_error(req, HTTP_INTERNAL, "could not start the profiler");
+    return;
+  }
+  close(fd);
+  if (ProfilerStart(path) == 0) {
+    unlink(path);
+    profiling = false;
+    evhttp_send_error(req, HTTP_INTERNAL, "could not start the profiler");
+    return;
+  }
+  LOG(INFO) << "taking a CPU profile for " << secs << " seconds";
+
+  // The profile is collected and sent from the event loop, which keeps
+  // serving requests meanwhile.
+  base->Delay(seconds(secs),
+              new util::Task(std::bind(FinishCpuProfile, req, string(path),
+                                       std::placeholders::_1),
+                             base));
+#else
+  evhttp_send_error(req, HTTP_NOTIMPLEMENTED,
+                    "built without the gperftools CPU profiler");
+#endif
+}
+
+
+void ExportHeapProfile(evhttp_request* req) {
+  if (!CheckGet(req)) {
+    return;
+  }
+#if defined(HAVE_LIBTCMALLOC) && defined(HAVE_GPERFTOOLS_MALLOC_EXTENSION_H)
+  string profile;
+  MallocExtension::instance()->GetHeapSample(&profile);
+  SendProfile(req, profile);
+#else
+  evhttp_send_error(req, HTTP_NOTIMPLEMENTED, "built without tcmalloc");
+#endif
+}
+
+
 }  // namespace cert_trans
@@ -8,6 +8,22 @@ namespace cert_trans {
 
 void ExportPrometheusMetrics(evhttp_request* req);
 
+// Replies with the recently sampled traces (see --trace_sample_rate),
+// in OpenTelemetry's OTLP/JSON format.
+void ExportTraces(evhttp_request* req);
+
+// Profiles the whole process with the gperftools CPU profiler for the
+// number of seconds given by the "seconds" parameter (30 by default),
+// then replies with the profile, which pprof reads. Only one profile
+// is taken at a time, and the event loop is not held up meanwhile.
+void ExportCpuProfile(evhttp_request* req);
+
+// Replies with a sample of the memory in use, by where it was
+// allocated, from tcmalloc, for pprof. The sample is empty unless the
+// process was started with TCMALLOC_SAMPLE_PARAMETER set (e.g. to
+// 524288, for a sample every 512kB allocated).
+void ExportHeapProfile(evhttp_request* req);
+
 
 }  // namespace cert_trans
 
@@ -18,13 +18,19 @@
 
 using ct::ClusterNodeState;
 using std::bind;
+using std::chrono::duration_cast;
+using std::chrono::microseconds;
+using std::chrono::steady_clock;
 using std::getline;
+using std::lock_guard;
 using std::make_pair;
+using std::mutex;
 using std::pair;
 using std::placeholders::_1;
 using std::rand;
 using std::string;
 using std::stringstream;
+using std::to_string;
 using std::unique_ptr;
 using std::unordered_set;
 using std::vector;
@@ -44,36 +50,60 @@ static Counter<string, int>* total_proxied_responses(
                               "and status code."));
 
 
-void ProxyRequestDone(libevent::Base* base, evhttp_request* request,
-                      const string& path, UrlFetcher::Response* response,
-                      Task* task) {
-  CHECK_NOTNULL(request);
-  CHECK_NOTNULL(task);
-  unique_ptr<UrlFetcher::Response> response_deleter(CHECK_NOTNULL(response));
+static Counter<string>* total_coalesced_proxied_requests(
+    Counter<string>::New("total_coalesced_proxied_requests", "path",
+                         "Number of proxied API requests by path that were "
+                         "served by joining an identical request already "
+                         "in flight."));
 
-  total_proxied_requests->Increment(path);
-  total_proxied_responses->Increment(path, response->status_code);
+// Request headers that responses vary with, so that GETs coalesce only
+// with those asking for the same representation.
+const char* const kVaryHeaders[] = {"Accept-Encoding", "If-None-Match"};
+
+// Weight of the latest response time in the moving average kept for
+// each node.
+const double kLatencyWeight = 0.3;
+// The response time counted for a failed request.
+const double kFailureLatencyMs = 5000;
 
-  if (!task->status().ok()) {
+
+// The key under which |request|, a GET, is coalesced with others: its
+// URI and the headers its response varies with, none of which can
+// contain a newline.
+string CoalescingKey(evhttp_request* request) {
+  string key(evhttp_request_uri(request));
+  for (const char* const header : kVaryHeaders) {
+    const char* const value(
+        evhttp_find_header(evhttp_request_get_input_headers(request), header));
+    key.append("\n").append(value ? value : "");
+  }
+  return key;
+}
+
+
+// Sends the (already filtered) |response| to |request|, or an error if
+// the proxied request failed.
+void SendProxiedResponse(libevent::Base* base, evhttp_request* request,
+                         const UrlFetcher::Response& response, bool ok) {
+  CHECK_NOTNULL(request);
+  if (!ok) {
     return SendJsonError(base, request, HTTP_INTERNAL,
                          "Proxied request failed.");
   }
 
-  // TODO(alcutter): Consider retrying the proxied request some number of times
-  // in the case where the request fails.
-  FilterHeaders(&response->headers);
-  for (auto it(response->headers.begin()); it != response->headers.end();
+  for (auto it(response.headers.begin()); it != response.headers.end();
        ++it) {
     CHECK_EQ(evhttp_add_header(evhttp_request_get_output_headers(request),
                                it->first.c_str(), it->second.c_str()),
              0);
   }
-  CHECK_GT(evbuffer_add_printf(evhttp_request_get_output_buffer(request), "%s",
-                               response->body.c_str()),
-           -1);
+  CHECK_EQ(evbuffer_add(evhttp_request_get_output_buffer(request),
+                        response.body.data(), response.body.size()),
+           0);
 
-  const int response_code(response->status_code);
-  base->Add([request, response_code]() {
+  const int response_code(response.status_code);
+  libevent::Base* const owner(libevent::Base::ForRequest(request));
+  (owner ? owner : base)->Add([request, response_code]() {
     evhttp_send_reply(request, response_code, /*reason*/ NULL,
                       /*databuf*/ NULL);
   });
@@ -130,7 +160,7 @@ void Proxy::ProxyRequest(evhttp_request* req) const {
     return SendJsonError(base_, req, HTTP_SERVUNAVAIL,
                          "No node able to serve request.");
   }
-  const ClusterNodeState& target(fresh_nodes[rand() % fresh_nodes.size()]);
+  const ClusterNodeState& target(PickNode(fresh_nodes));
 
   URL url(evhttp_request_uri(req));
   url.SetProtocol("http");
@@ -158,6 +188,20 @@ void Proxy::ProxyRequest(evhttp_request* req) const {
       break;
   }
 
+  // Identical GETs (which nodes catching up tend to get a lot of) share
+  // the one request upstream.
+  string key;
+  if (fetcher_req.verb == UrlFetcher::Verb::GET) {
+    key = CoalescingKey(req);
+    lock_guard<mutex> lock(lock_);
+    vector<evhttp_request*>* const waiting(&in_flight_[key]);
+    waiting->push_back(req);
+    if (waiting->size() > 1) {
+      total_coalesced_proxied_requests->Increment(url.Path());
+      return;
+    }
+  }
+
   for (evkeyval* ptr = evhttp_request_get_input_headers(req)->tqh_first; ptr;
        ptr = ptr->next.tqe_next) {
     fetcher_req.headers.insert(make_pair(ptr->key, ptr->value));
@@ -177,9 +221,86 @@ void Proxy::ProxyRequest(evhttp_request* req) const {
   VLOG(1) << "Proxying request to " << url.Host() << ":" << url.Port()
           << url.PathQuery();
   UrlFetcher::Response* resp(new UrlFetcher::Response);
-  fetcher_->Fetch(fetcher_req, resp, new Task(bind(&ProxyRequestDone, base_,
-                                                   req, url.Path(), resp, _1),
-                                              executor_));
+  fetcher_->Fetch(fetcher_req, resp,
+                  new Task(bind(&Proxy::FetchDone, this, req, key,
+                                NodeKey(target), url.Path(),
+                                steady_clock::now(), resp, _1),
+                           executor_));
+}
+
+
+const ClusterNodeState& Proxy::PickNode(
+    const vector<ClusterNodeState>& nodes) const {
+  // Of two nodes picked at random, go for the one that has been
+  // answering faster. Nodes not tried yet count as the fastest, and
+  // slow ones still get picked now and then, so that they get a chance
+  // to show they have recovered.
+  const ClusterNodeState& first(nodes[rand() % nodes.size()]);
+  const ClusterNodeState& second(nodes[rand() % nodes.size()]);
+
+  lock_guard<mutex> lock(lock_);
+  const auto first_latency(latency_ms_.find(NodeKey(first)));
+  if (first_latency == latency_ms_.end()) {
+    return first;
+  }
+  const auto second_latency(latency_ms_.find(NodeKey(second)));
+  if (second_latency == latency_ms_.end() ||
+      second_latency->second < first_latency->second) {
+    return second;
+  }
+  return first;
+}
+
+
+void Proxy::FetchDone(evhttp_request* req, const string& key,
+                      const string& node, const string& path,
+                      const steady_clock::time_point& start,
+                      UrlFetcher::Response* response, Task* task) const {
+  CHECK_NOTNULL(task);
+  unique_ptr<UrlFetcher::Response> response_deleter(CHECK_NOTNULL(response));
+
+  total_proxied_requests->Increment(path);
+  total_proxied_responses->Increment(path, response->status_code);
+
+  const bool ok(task->status().ok());
+  const double latency_ms(
+      ok && response->status_code < 500
+          ? duration_cast<microseconds>(steady_clock::now() - start).count() /
+                1000.0
+          : kFailureLatencyMs);
+
+  vector<evhttp_request*> waiting;
+  {
+    lock_guard<mutex> lock(lock_);
+    const auto it(latency_ms_.find(node));
+    if (it == latency_ms_.end()) {
+      latency_ms_.emplace(node, latency_ms);
+    } else {
+      it->second += kLatencyWeight * (latency_ms - it->second);
+    }
+
+    if (key.empty()) {
+      waiting.push_back(req);
+    } else {
+      const auto waiters(in_flight_.find(key));
+      CHECK(waiters != in_flight_.end());
+      waiting.swap(waiters->second);
+      in_flight_.erase(waiters);
+    }
+  }
+
+  // TODO(alcutter): Consider retrying the proxied request some number of times
+  // in the case where the request fails.
+  FilterHeaders(&response->headers);
+  for (evhttp_request* const request : waiting) {
+    SendProxiedResponse(base_, request, *response, ok);
+  }
+}
+
+
+// static
+string Proxy::NodeKey(const ClusterNodeState& node) {
+  return node.hostname() + ":" + to_string(node.log_port());
 }
 
 
@@ -1,7 +1,11 @@
 #ifndef CERT_TRANS_SERVER_PROXY_H_
 #define CERT_TRANS_SERVER_PROXY_H_
 
+#include <chrono>
 #include <functional>
+#include <mutex>
+#include <string>
+#include <unordered_map>
 #include <vector>
 
 #include "net/url_fetcher.h"
@@ -30,6 +34,9 @@ class Base;
 void FilterHeaders(UrlFetcher::Headers* headers);
 
 
+// Forwards requests to the fresh nodes of the cluster. Identical GET
+// requests in flight at the same time are sent on only once, and nodes
+// that have been answering faster are preferred.
 class Proxy {
  public:
   typedef std::function<std::vector<ct::ClusterNodeState>()>
@@ -44,10 +51,28 @@ class Proxy {
   virtual void ProxyRequest(evhttp_request* req) const;
 
  private:
+  const ct::ClusterNodeState& PickNode(
+      const std::vector<ct::ClusterNodeState>& nodes) const;
+  // Replies to |req|, or if |key| is not empty, to all the requests
+  // waiting on it.
+  void FetchDone(evhttp_request* req, const std::string& key,
+                 const std::string& node, const std::string& path,
+                 const std::chrono::steady_clock::time_point& start,
+                 UrlFetcher::Response* response, util::Task* task) const;
+  static std::string NodeKey(const ct::ClusterNodeState& node);
+
   libevent::Base* const base_;
   const GetFreshNodesFunction get_fresh_nodes_;
   UrlFetcher* const fetcher_;
   util::Executor* const executor_;
+
+  mutable std::mutex lock_;
+  // The requests waiting on each GET sent upstream, by URI.
+  mutable std::unordered_map<std::string, std::vector<evhttp_request*>>
+      in_flight_;
+  // Moving average of the response times of each node, in milliseconds,
+  // by "host:port".
+  mutable std::unordered_map<std::string, double> latency_ms_;
 };
 
 
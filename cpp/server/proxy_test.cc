@@ -2,14 +2,46 @@
 
 #include <gmock/gmock.h>
 #include <gtest/gtest.h>
+#include <condition_variable>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
 
+#include "net/mock_url_fetcher.h"
+#include "proto/ct.pb.h"
+#include "util/libevent_wrapper.h"
+#include "util/task.h"
 #include "util/testing.h"
+#include "util/thread_pool.h"
 
 using cert_trans::FilterHeaders;
+using cert_trans::IsUrlFetchRequest;
+using cert_trans::MockUrlFetcher;
+using cert_trans::Proxy;
+using cert_trans::ThreadPool;
+using cert_trans::URL;
 using cert_trans::UrlFetcher;
+using ct::ClusterNodeState;
+using std::condition_variable;
+using std::lock_guard;
 using std::make_pair;
+using std::make_shared;
+using std::mutex;
 using std::shared_ptr;
 using std::string;
+using std::thread;
+using std::unique_lock;
+using std::vector;
+using testing::DoAll;
+using testing::SaveArg;
+using testing::_;
+using util::Task;
+
+namespace libevent = cert_trans::libevent;
+
+const char kUpstreamUrl[] = "http://upstream:8080/ct/v1/get-sth";
 
 class ProxyTest : public ::testing::Test {};
 
@@ -98,6 +130,139 @@ TEST_F(ProxyTest, TestFilterHeadersHandlesMultipleConnectionHeaders) {
 }
 
 
+class ProxyServingTest : public ::testing::Test {
+ protected:
+  ProxyServingTest()
+      : base_(make_shared<libevent::Base>()),
+        pump_(base_),
+        server_(*base_),
+        pool_(2),
+        proxy_(base_.get(), [this]() { return FreshNodes(); }, &fetcher_,
+               &pool_),
+        port_(0),
+        received_(0) {
+  }
+
+  void SetUp() override {
+    ASSERT_TRUE(server_.AddHandler("/ct/v1/get-sth", [this](
+                                                        evhttp_request* req) {
+      proxy_.ProxyRequest(req);
+      lock_guard<mutex> lock(lock_);
+      ++received_;
+      received_changed_.notify_all();
+    }));
+    port_ = server_.Bind("127.0.0.1", 0);
+  }
+
+  vector<ClusterNodeState> FreshNodes() const {
+    ClusterNodeState node;
+    node.set_hostname("upstream");
+    node.set_log_port(8080);
+    return vector<ClusterNodeState>{node};
+  }
+
+  void WaitForRequests(int count) {
+    unique_lock<mutex> lock(lock_);
+    received_changed_.wait(lock, [this, count]() {
+      return received_ >= count;
+    });
+  }
+
+  // Makes |count| requests at once, each on its own connection.
+  vector<thread> StartRequests(int count, vector<string>* responses) {
+    responses->resize(count);
+    vector<thread> clients;
+    for (int i = 0; i < count; ++i) {
+      clients.emplace_back([this, responses, i]() {
+        (*responses)[i] = cert_trans::test::HttpGet(port_, "/ct/v1/get-sth");
+      });
+    }
+    return clients;
+  }
+
+  const shared_ptr<libevent::Base> base_;
+  libevent::EventPumpThread pump_;
+  libevent::HttpServer server_;
+  ThreadPool pool_;
+  MockUrlFetcher fetcher_;
+  Proxy proxy_;
+  uint16_t port_;
+
+  mutex lock_;
+  condition_variable received_changed_;
+  int received_;
+};
+
+
+TEST_F(ProxyServingTest, CoalescesIdenticalGets) {
+  UrlFetcher::Response* response(nullptr);
+  Task* task(nullptr);
+  EXPECT_CALL(fetcher_,
+              Fetch(IsUrlFetchRequest(UrlFetcher::Verb::GET, URL(kUpstreamUrl),
+                                      _, ""),
+                    _, _))
+      .Times(2)
+      .WillRepeatedly(DoAll(SaveArg<1>(&response), SaveArg<2>(&task)));
+
+  for (int round = 1; round <= 2; ++round) {
+    vector<string> responses;
+    vector<thread> clients(StartRequests(3, &responses));
+    // All three are in before the single upstream request completes.
+    WaitForRequests(3 * round);
+    ASSERT_NE(nullptr, task);
+    response->status_code = 200;
+    response->body = "{\"tree_size\":" + std::to_string(round) + "}";
+    task->Return();
+    task = nullptr;
+
+    for (auto& client : clients) {
+      client.join();
+    }
+    for (const string& reply : responses) {
+      EXPECT_EQ(0U, reply.find("HTTP/1.0 200")) << reply;
+      EXPECT_NE(string::npos,
+                reply.find("{\"tree_size\":" + std::to_string(round) + "}"))
+          << reply;
+    }
+  }
+}
+
+
+TEST_F(ProxyServingTest, DoesNotCoalesceGetsForOtherEncodings) {
+  UrlFetcher::Response* responses[2] = {nullptr, nullptr};
+  Task* tasks[2] = {nullptr, nullptr};
+  EXPECT_CALL(fetcher_,
+              Fetch(IsUrlFetchRequest(UrlFetcher::Verb::GET, URL(kUpstreamUrl),
+                                      _, ""),
+                    _, _))
+      .WillOnce(DoAll(SaveArg<1>(&responses[0]), SaveArg<2>(&tasks[0])))
+      .WillOnce(DoAll(SaveArg<1>(&responses[1]), SaveArg<2>(&tasks[1])));
+
+  string plain;
+  thread plain_client([this, &plain]() {
+    plain = cert_trans::test::HttpGet(port_, "/ct/v1/get-sth");
+  });
+  WaitForRequests(1);
+  string gzipped;
+  thread gzip_client([this, &gzipped]() {
+    gzipped = cert_trans::test::HttpGet(port_, "/ct/v1/get-sth",
+                                        "Accept-Encoding: gzip\r\n");
+  });
+  WaitForRequests(2);
+
+  for (int i = 0; i < 2; ++i) {
+    ASSERT_NE(nullptr, tasks[i]);
+    responses[i]->status_code = 200;
+    responses[i]->body = "{\"tree_size\":" + std::to_string(i) + "}";
+    tasks[i]->Return();
+  }
+  plain_client.join();
+  gzip_client.join();
+  EXPECT_NE(string::npos, plain.find("{\"tree_size\":0}")) << plain;
+  EXPECT_NE(string::npos, gzipped.find("{\"tree_size\":1}")) << gzipped;
+}
+
+
 int main(int argc, char** argv) {
   cert_trans::test::InitTesting(argv[0], &argc, &argv, true);
   return RUN_ALL_TESTS();
@@ -0,0 +1,75 @@
+#include "server/rate_limiter.h"
+
+#include <glog/logging.h>
+#include <algorithm>
+
+using std::chrono::duration;
+using std::lock_guard;
+using std::min;
+using std::mutex;
+using std::string;
+
+namespace cert_trans {
+
+
+RateLimiter::RateLimiter(double rate, double burst, size_t max_clients)
+    : rate_(rate), burst_(std::max(burst, 1.0)), max_clients_(max_clients) {
+}
+
+
+bool RateLimiter::Refill(const Clock::time_point& now, Bucket* bucket) const {
+  if (now > bucket->updated) {
+    const duration<double> elapsed(now - bucket->updated);
+    bucket->tokens = min(burst_, bucket->tokens + elapsed.count() * rate_);
+    bucket->updated = now;
+  }
+  return bucket->tokens >= burst_;
+}
+
+
+void RateLimiter::ForgetIdleClients(const Clock::time_point& now) {
+  for (auto it = buckets_.begin(); it != buckets_.end();) {
+    if (Refill(now, &it->second)) {
+      it = buckets_.erase(it);
+    } else {
+      ++it;
+    }
+  }
+}
+
+
+bool RateLimiter::Admit(const string& client, const Clock::time_point& now) {
+  if (rate_ <= 0) {
+    return true;
+  }
+
+  lock_guard<mutex> lock(lock_);
+  auto it(buckets_.find(client));
+  if (it == buckets_.end()) {
+    if (buckets_.size() >= max_clients_) {
+      ForgetIdleClients(now);
+      if (buckets_.size() >= max_clients_) {
+        LOG_EVERY_N(WARNING, 1000) << "Too many clients to rate limit";
+        return true;
+      }
+    }
+    it = buckets_.emplace(client, Bucket{burst_, now}).first;
+  } else {
+    Refill(now, &it->second);
+  }
+
+  if (it->second.tokens < 1) {
+    return false;
+  }
+  it->second.tokens -= 1;
+  return true;
+}
+
+
+size_t RateLimiter::NumClients() const {
+  lock_guard<mutex> lock(lock_);
+  return buckets_.size();
+}
+
+
+}  // namespace cert_trans
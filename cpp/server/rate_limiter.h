@@ -0,0 +1,63 @@
+#ifndef CERT_TRANS_SERVER_RATE_LIMITER_H_
+#define CERT_TRANS_SERVER_RATE_LIMITER_H_
+
+#include <stddef.h>
+#include <chrono>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <utility>
+
+namespace cert_trans {
+
+
+// Limits the rate of requests of each client with a token bucket per
+// client, refilled at |rate| tokens per second up to |burst| tokens,
+// each request taking one token. Idle clients, whose buckets are full,
+// are forgotten, so that memory use stays bounded.
+//
+// This class is thread-safe.
+class RateLimiter {
+ public:
+  typedef std::chrono::steady_clock Clock;
+
+  // A |rate| of 0 or less means no limit. At most |max_clients| are
+  // tracked; past that, requests from new clients are not limited
+  // until idle clients have been forgotten.
+  RateLimiter(double rate, double burst, size_t max_clients);
+  RateLimiter(const RateLimiter&) = delete;
+  RateLimiter& operator=(const RateLimiter&) = delete;
+
+  // Takes a token from the bucket of |client|, returning false if it
+  // has none left.
+  bool Admit(const std::string& client) {
+    return Admit(client, Clock::now());
+  }
+  bool Admit(const std::string& client, const Clock::time_point& now);
+
+  // Number of clients currently tracked.
+  size_t NumClients() const;
+
+ private:
+  struct Bucket {
+    double tokens;
+    Clock::time_point updated;
+  };
+
+  // Refills |bucket| up to |now|, returning whether it is full.
+  bool Refill(const Clock::time_point& now, Bucket* bucket) const;
+  // Forgets the clients whose buckets are full by |now|.
+  void ForgetIdleClients(const Clock::time_point& now);
+
+  const double rate_;
+  const double burst_;
+  const size_t max_clients_;
+
+  mutable std::mutex lock_;
+  std::unordered_map<std::string, Bucket> buckets_;
+};
+
+
+}  // namespace cert_trans
+
+#endif  // CERT_TRANS_SERVER_RATE_LIMITER_H_
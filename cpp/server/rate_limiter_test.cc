@@ -0,0 +1,79 @@
+#include "server/rate_limiter.h"
+
+#include <gtest/gtest.h>
+#include <chrono>
+
+#include "util/testing.h"
+
+namespace cert_trans {
+namespace {
+
+using std::chrono::milliseconds;
+using std::chrono::seconds;
+
+
+const RateLimiter::Clock::time_point kStart(RateLimiter::Clock::now());
+
+
+TEST(RateLimiterTest, AllowsBurstThenRate) {
+  RateLimiter limiter(2, 3, 100);
+  EXPECT_TRUE(limiter.Admit("a", kStart));
+  EXPECT_TRUE(limiter.Admit("a", kStart));
+  EXPECT_TRUE(limiter.Admit("a", kStart));
+  EXPECT_FALSE(limiter.Admit("a", kStart));
+
+  // Half a second gives one more token.
+  EXPECT_FALSE(limiter.Admit("a", kStart + milliseconds(400)));
+  EXPECT_TRUE(limiter.Admit("a", kStart + milliseconds(500)));
+  EXPECT_FALSE(limiter.Admit("a", kStart + milliseconds(500)));
+
+  // The bucket does not fill past the burst.
+  for (int i = 0; i < 3; ++i) {
+    EXPECT_TRUE(limiter.Admit("a", kStart + seconds(10)));
+  }
+  EXPECT_FALSE(limiter.Admit("a", kStart + seconds(10)));
+}
+
+
+TEST(RateLimiterTest, ClientsAreLimitedSeparately) {
+  RateLimiter limiter(1, 1, 100);
+  EXPECT_TRUE(limiter.Admit("a", kStart));
+  EXPECT_FALSE(limiter.Admit("a", kStart));
+  EXPECT_TRUE(limiter.Admit("b", kStart));
+  EXPECT_EQ(2U, limiter.NumClients());
+}
+
+
+TEST(RateLimiterTest, NoLimit) {
+  RateLimiter limiter(0, 1, 100);
+  for (int i = 0; i < 100; ++i) {
+    EXPECT_TRUE(limiter.Admit("a", kStart));
+  }
+  EXPECT_EQ(0U, limiter.NumClients());
+}
+
+
+TEST(RateLimiterTest, ForgetsIdleClients) {
+  RateLimiter limiter(1, 1, 2);
+  EXPECT_TRUE(limiter.Admit("a", kStart));
+  EXPECT_TRUE(limiter.Admit("b", kStart + milliseconds(500)));
+  // Too many clients to track, so "c" is not limited.
+  EXPECT_TRUE(limiter.Admit("c", kStart + milliseconds(500)));
+  EXPECT_TRUE(limiter.Admit("c", kStart + milliseconds(500)));
+  EXPECT_EQ(2U, limiter.NumClients());
+
+  // By then, "a" is idle and makes room for "c".
+  EXPECT_TRUE(limiter.Admit("c", kStart + seconds(1)));
+  EXPECT_FALSE(limiter.Admit("c", kStart + seconds(1)));
+  EXPECT_EQ(2U, limiter.NumClients());
+}
+
+
+}  // namespace
+}  // namespace cert_trans
+
+
+int main(int argc, char** argv) {
+  cert_trans::test::InitTesting(argv[0], &argc, &argv, true);
+  return RUN_ALL_TESTS();
+}
@@ -2,30 +2,48 @@
 
 #include <gflags/gflags.h>
 #include <chrono>
+#include <condition_variable>
 #include <csignal>
 #include <functional>
+#include <mutex>
 
 #include "log/cluster_state_controller.h"
 #include "log/etcd_consistent_store.h"
+#include "log/file_storage.h"
 #include "log/frontend.h"
 #include "log/log_lookup.h"
 #include "log/log_verifier.h"
+#include "log/logged_entry.h"
+#include "log/pending_entry_bodies.h"
 #include "monitoring/gcm/exporter.h"
 #include "monitoring/monitoring.h"
 #include "server/metrics.h"
 #include "server/proxy.h"
+#include "util/request_capture.h"
 #include "util/thread_pool.h"
 #include "util/uuid.h"
 
 using std::bind;
+using std::chrono::milliseconds;
 using std::chrono::seconds;
 using std::chrono::steady_clock;
+using std::condition_variable;
+using std::function;
+using std::lock_guard;
+using std::max;
+using std::min;
+using std::mutex;
 using std::placeholders::_1;
+using std::placeholders::_2;
+using std::placeholders::_3;
 using std::shared_ptr;
 using std::signal;
 using std::string;
 using std::this_thread::sleep_for;
 using std::thread;
+using std::unique_lock;
+using std::unique_ptr;
+using std::vector;
 
 // These flags are DEFINEd in server_helper to keep the validation logic
 // related to server startup options in one place.
@@ -40,6 +58,61 @@ DEFINE_int32(watchdog_seconds, 120,
              "before firing the watchdog timer.");
 DEFINE_bool(watchdog_timeout_is_fatal, true,
             "Exit if the watchdog timer fires.");
+DEFINE_string(log_lookup_checkpoint_file, "",
+              "If set, periodically checkpoint the in-memory Merkle tree to "
+              "this file, and load it back on startup instead of rebuilding "
+              "the tree from the whole database.");
+DEFINE_string(fetch_checkpoint_file, "",
+              "If set, keep track in this file of the entries fetched from "
+              "peers past those the database has contiguously, so that "
+              "they are not fetched again after a restart.");
+DEFINE_string(pending_bodies_dir, "",
+              "If set, the pending entries added by this node are kept in "
+              "this directory, and copied to enough of the other nodes up "
+              "for a majority to have them, and only their hash and SCT "
+              "are put in etcd. The other nodes get them from those when "
+              "they need them. Entries are removed once in the serving "
+              "STH. Should be set on all the nodes, or none.");
+DEFINE_int32(http_reactors, 1,
+             "Number of event loops serving HTTP requests, each one "
+             "listening on --port with its own socket (using SO_REUSEPORT).");
+DEFINE_int32(http_connection_timeout_seconds, 0,
+             "How long HTTP connections may stay idle before they are "
+             "closed, 0 for the libevent default (50 seconds). Front-end "
+             "proxies which keep connections to the servers open, such as "
+             "those serving HTTP/2 to clients, should close them sooner "
+             "than this.");
+DEFINE_string(http_capture_file, "",
+              "If set, a sample of the requests served is recorded to this "
+              "file, to be replayed with tools/replay_requests.");
+DEFINE_double(http_capture_sample_rate, 0.01,
+              "Fraction of the requests recorded to --http_capture_file.");
+DEFINE_int32(http_capture_max_mb, 1024,
+             "Size past which no more requests are recorded to "
+             "--http_capture_file.");
+DEFINE_string(node_region, "",
+              "Region (or zone) this node runs in. Entries are replicated "
+              "from nodes in the same region when they have them.");
+DEFINE_int32(peer_max_conn_per_host_port, 16,
+             "Number of idle connections kept to each other node of the "
+             "cluster, for replication and proxied requests.");
+DEFINE_int32(peer_warm_conns_per_host_port, 2,
+             "Number of connections opened to each other node of the "
+             "cluster as it joins, ahead of any request to it.");
+DEFINE_int32(replication_check_ms, 100,
+             "How often to check whether the local database has caught up "
+             "with the serving STH on startup, on top of the checks made "
+             "as it gets new tree heads.");
+DEFINE_int64(warmup_entries, 100000,
+             "Number of the newest entries read from the database on "
+             "startup, before the node reports itself ready, so that the "
+             "first requests for them do not all go to disk.");
+DEFINE_int32(warmup_audit_proofs, 10000,
+             "Number of the newest entries whose audit proofs are worked "
+             "out on startup, before the node reports itself ready.");
+DEFINE_bool(enable_pprof, false,
+            "Serve CPU and heap profiles at /debug/pprof/profile and "
+            "/debug/pprof/heap, for pprof.");
 
 namespace cert_trans {
 
@@ -56,6 +129,22 @@ Gauge<>* latest_local_tree_size_gauge() {
 namespace {
 
 
+// Number of levels of directories the pending entries are spread over
+// in --pending_bodies_dir, see FileStorage.
+const int kPendingBodiesStorageDepth = 3;
+
+// Number of entries or proofs warmed up between checks of the deadline.
+const int64_t kWarmUpChunkSize = 1000;
+
+
+UrlFetcher::Options PeerFetcherOptions() {
+  UrlFetcher::Options options;
+  options.max_idle_conns_per_host_port = FLAGS_peer_max_conn_per_host_port;
+  options.warm_conns_per_host_port = FLAGS_peer_warm_conns_per_host_port;
+  return options;
+}
+
+
 void RefreshNodeState(ClusterStateController* controller, util::Task* task) {
   CHECK_NOTNULL(task);
   const steady_clock::duration period(
@@ -91,6 +180,14 @@ void WatchdogTimeout(int) {
 }
 
 
+// The storage for the pending entries of this node, or null if they
+// are not kept out of etcd.
+FileStorage* PendingBodiesStorage(const string& dir) {
+  return dir.empty() ? nullptr
+                     : new FileStorage(dir, kPendingBodiesStorageDepth);
+}
+
+
 string GetNodeId(Database* db) {
   string node_id;
   if (db->NodeId(&node_id) != Database::LOOKUP_OK) {
@@ -117,36 +214,95 @@ Server::Server(const shared_ptr<libevent::Base>& event_base,
                ThreadPool* internal_pool, ThreadPool* http_pool, Database* db,
                EtcdClient* etcd_client, UrlFetcher* url_fetcher,
                const LogVerifier* log_verifier)
+    : Server(event_base, internal_pool, http_pool, db, etcd_client,
+             url_fetcher, log_verifier, Options()) {
+}
+
+
+Server::Server(const shared_ptr<libevent::Base>& event_base,
+               ThreadPool* internal_pool, ThreadPool* http_pool, Database* db,
+               EtcdClient* etcd_client, UrlFetcher* url_fetcher,
+               const LogVerifier* log_verifier, const Options& options)
     : event_base_(event_base),
-      event_pump_(new libevent::EventPumpThread(event_base_)),
-      http_server_(*event_base_),
+      // The event loop is already pumped by the server that owns the
+      // HTTP server.
+      event_pump_(options.http_server
+                      ? nullptr
+                      : new libevent::EventPumpThread(
+                            event_base_, options.event_pump_placement)),
+      request_capture_(options.http_server || FLAGS_http_capture_file.empty()
+                           ? nullptr
+                           : new RequestCapture(
+                                 FLAGS_http_capture_file,
+                                 FLAGS_http_capture_sample_rate,
+                                 static_cast<int64_t>(
+                                     FLAGS_http_capture_max_mb) << 20)),
+      own_http_server_(options.http_server
+                           ? nullptr
+                           : new libevent::HttpServer(*event_base_,
+                                                      FLAGS_http_reactors)),
+      http_server_(options.http_server ? options.http_server
+                                       : own_http_server_.get()),
+      etcd_root_(options.etcd_root.empty() ? FLAGS_etcd_root
+                                           : options.etcd_root),
+      log_lookup_checkpoint_file_(options.log_lookup_checkpoint_file.empty()
+                                      ? FLAGS_log_lookup_checkpoint_file
+                                      : options.log_lookup_checkpoint_file),
+      fetch_checkpoint_file_(options.fetch_checkpoint_file.empty()
+                                 ? FLAGS_fetch_checkpoint_file
+                                 : options.fetch_checkpoint_file),
       db_(CHECK_NOTNULL(db)),
       log_verifier_(CHECK_NOTNULL(log_verifier)),
       node_id_(GetNodeId(db_)),
       url_fetcher_(CHECK_NOTNULL(url_fetcher)),
+      peer_fetcher_(new UrlFetcher(event_base_.get(), internal_pool,
+                                   PeerFetcherOptions())),
       etcd_client_(CHECK_NOTNULL(etcd_client)),
-      election_(event_base_, etcd_client_, FLAGS_etcd_root + "/election",
+      election_(event_base_, etcd_client_, etcd_root_ + "/election",
                 node_id_),
       internal_pool_(CHECK_NOTNULL(internal_pool)),
       server_task_(internal_pool_),
+      pending_bodies_(new PendingEntryBodies(
+          node_id_, PendingBodiesStorage(options.pending_bodies_dir.empty()
+                                             ? FLAGS_pending_bodies_dir
+                                             : options.pending_bodies_dir),
+          peer_fetcher_.get(), internal_pool_, options.path_prefix)),
       consistent_store_(&election_,
                         new EtcdConsistentStore(event_base_.get(),
                                                 internal_pool_, etcd_client_,
-                                                &election_, FLAGS_etcd_root,
-                                                node_id_)),
+                                                &election_, etcd_root_,
+                                                node_id_,
+                                                pending_bodies_.get())),
       http_pool_(CHECK_NOTNULL(http_pool)) {
   CHECK_LT(0, FLAGS_port);
 
-  if (FLAGS_monitoring == kPrometheus) {
-    http_server_.AddHandler("/metrics", ExportPrometheusMetrics);
-  } else if (FLAGS_monitoring == kGcm) {
-    gcm_exporter_.reset(
-        new GCMExporter(FLAGS_server, url_fetcher_, internal_pool_));
-  } else {
-    LOG(FATAL) << "Please set --monitoring to one of the supported values.";
-  }
+  // The process-wide handlers and exporters come with the HTTP server.
+  if (own_http_server_) {
+    if (FLAGS_monitoring == kPrometheus) {
+      http_server_->AddHandler("/metrics", ExportPrometheusMetrics);
+    } else if (FLAGS_monitoring == kGcm) {
+      gcm_exporter_.reset(
+          new GCMExporter(FLAGS_server, url_fetcher_, internal_pool_));
+    } else {
+      LOG(FATAL) << "Please set --monitoring to one of the supported values.";
+    }
+    http_server_->AddHandler("/traces", ExportTraces);
+    if (FLAGS_enable_pprof) {
+      http_server_->AddHandler("/debug/pprof/profile", ExportCpuProfile);
+      http_server_->AddHandler("/debug/pprof/heap", ExportHeapProfile);
+    }
 
-  http_server_.Bind(nullptr, FLAGS_port);
+    if (request_capture_) {
+      RequestCapture* const capture(request_capture_.get());
+      http_server_->SetObserver(
+          [capture](evhttp_request* req) { capture->MaybeRecord(req); });
+    }
+    if (FLAGS_http_connection_timeout_seconds > 0) {
+      http_server_->SetTimeout(
+          seconds(FLAGS_http_connection_timeout_seconds));
+    }
+    http_server_->Bind(nullptr, FLAGS_port);
+  }
   election_.StartElection();
 }
 
@@ -188,28 +344,63 @@ ContinuousFetcher* Server::continuous_fetcher() {
 }
 
 
+PendingEntryBodies* Server::pending_entry_bodies() {
+  return pending_bodies_.get();
+}
+
+
 Proxy* Server::proxy() {
   return proxy_.get();
 }
 
 
 libevent::HttpServer* Server::http_server() {
-  return &http_server_;
+  return http_server_;
 }
 
 
-void Server::WaitForReplication() const {
+void Server::WaitForReplication(const ReplicationProgress& progress) const {
   // If we're joining an existing cluster, this node needs to get its database
   // up-to-date with the serving_sth before we can do anything, so we'll wait
   // here for that:
   util::StatusOr<ct::SignedTreeHead> serving_sth(
       consistent_store_.GetServingSTH());
   if (serving_sth.ok()) {
-    while (db_->TreeSize() < serving_sth.ValueOrDie().tree_size()) {
-      LOG(WARNING) << "Waiting for local database to catch up to serving_sth ("
-                   << db_->TreeSize() << " of "
-                   << serving_sth.ValueOrDie().tree_size() << ")";
-      sleep(1);
+    const int64_t serving_size(serving_sth.ValueOrDie().tree_size());
+    // Checked again whenever the local database gets a new tree head,
+    // and every --replication_check_ms, as entries are added in
+    // between.
+    mutex changed_lock;
+    condition_variable changed_cv;
+    bool changed(false);
+    const function<void()> on_change([&changed_lock, &changed_cv,
+                                      &changed]() {
+      lock_guard<mutex> lock(changed_lock);
+      changed = true;
+      changed_cv.notify_all();
+    });
+    cluster_controller_->AddStalenessCallback(&on_change);
+
+    int64_t local_size;
+    steady_clock::time_point next_log;
+    while ((local_size = db_->TreeSize()) < serving_size) {
+      if (steady_clock::now() >= next_log) {
+        LOG(WARNING) << "Waiting for local database to catch up to "
+                     << "serving_sth (" << local_size << " of "
+                     << serving_size << ")";
+        next_log = steady_clock::now() + seconds(1);
+      }
+      if (progress) {
+        progress(local_size, serving_size);
+      }
+      unique_lock<mutex> lock(changed_lock);
+      changed_cv.wait_for(lock, milliseconds(FLAGS_replication_check_ms),
+                          [&changed]() { return changed; });
+      changed = false;
+    }
+    cluster_controller_->RemoveStalenessCallback(&on_change);
+    if (progress) {
+      progress(local_size, serving_size);
     }
   }
 }
@@ -217,17 +408,29 @@ void Server::WaitForReplication() const {
 
 void Server::Initialise(bool is_mirror) {
   fetcher_ = ContinuousFetcher::New(event_base_.get(), internal_pool_, db_,
-                                    log_verifier_, !is_mirror);
+                                    log_verifier_, !is_mirror,
+                                    FLAGS_node_region, fetch_checkpoint_file_);
 
-  log_lookup_.reset(new LogLookup(db_));
+  log_lookup_.reset(new LogLookup(db_, log_lookup_checkpoint_file_));
 
   cluster_controller_.reset(
-      new ClusterStateController(internal_pool_, event_base_, url_fetcher_,
-                                 db_, &consistent_store_, &election_,
-                                 fetcher_.get()));
+      new ClusterStateController(internal_pool_, event_base_,
+                                 peer_fetcher_.get(), db_, &consistent_store_,
+                                 &election_, fetcher_.get()));
 
   // Publish this node's hostname:port info
   cluster_controller_->SetNodeHostPort(FLAGS_server, FLAGS_port);
+  pending_bodies_->SetNodes(
+      bind(&ClusterStateController::GetNodeHostPort, cluster_controller_.get(),
+           _1, _2, _3),
+      [this]() {
+        vector<string> node_ids;
+        for (const auto& node : cluster_controller_->GetFreshNodes()) {
+          node_ids.push_back(node.node_id());
+        }
+        return node_ids;
+      });
+  cluster_controller_->SetNodeRegion(FLAGS_node_region);
   {
     ct::SignedTreeHead db_sth;
     if (db_->LatestTreeHead(&db_sth) == Database::LOOKUP_OK) {
@@ -248,11 +451,66 @@ void Server::Initialise(bool is_mirror) {
   proxy_.reset(new Proxy(event_base_.get(),
                          bind(&ClusterStateController::GetFreshNodes,
                               cluster_controller_.get()),
-                         url_fetcher_, http_pool_));
+                         peer_fetcher_.get(), http_pool_));
+}
+
+
+bool Server::WarmUp(const steady_clock::time_point& deadline,
+                    const WarmUpProgress& progress) const {
+  CHECK(log_lookup_) << "WarmUp() called before Initialise()";
+  const int64_t tree_size(log_lookup_->GetSTH().tree_size());
+  const int64_t num_entries(
+      min(tree_size, max<int64_t>(0, FLAGS_warmup_entries)));
+  const int64_t num_proofs(
+      min(tree_size, max<int64_t>(0, FLAGS_warmup_audit_proofs)));
+  const int64_t total(num_entries + num_proofs);
+  LOG(INFO) << "Warming up " << num_entries << " entries and " << num_proofs
+            << " audit proofs, at tree size " << tree_size;
+
+  const unique_ptr<Database::Iterator> it(
+      db_->ScanEntries(tree_size - num_entries));
+  vector<LoggedEntry> entries;
+  int64_t done(0);
+  while (done < num_entries) {
+    if (steady_clock::now() >= deadline) {
+      return false;
+    }
+    const size_t got(it->GetNextEntries(
+        min(num_entries - done, kWarmUpChunkSize), &entries));
+    if (got == 0) {
+      LOG(WARNING) << "Only " << done << " of the newest " << num_entries
+                   << " entries are in the database";
+      break;
+    }
+    done += got;
+    if (progress) {
+      progress(done, total);
+    }
+  }
+
+  done = num_entries;
+  ct::ShortMerkleAuditProof proof;
+  for (int64_t i = tree_size - num_proofs; i < tree_size; ++i, ++done) {
+    if (done % kWarmUpChunkSize == 0) {
+      if (steady_clock::now() >= deadline) {
+        return false;
+      }
+      if (progress) {
+        progress(done, total);
+      }
+    }
+    log_lookup_->AuditProof(i, tree_size, &proof);
+  }
+  if (progress) {
+    progress(total, total);
+  }
+  return true;
 }
 
 
 void Server::Run() {
+  CHECK(own_http_server_) << "Run() must be called on the server that owns "
+                             "the HTTP server";
   // Ding the temporary event pump because we're about to enter the event loop
   event_pump_.reset();
   event_base_->Dispatch();
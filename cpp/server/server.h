@@ -2,6 +2,8 @@
 #define CERT_TRANS_SERVER_SERVER_H_
 
 #include <stdint.h>
+#include <chrono>
+#include <functional>
 #include <memory>
 #include <string>
 #include <thread>
@@ -11,6 +13,7 @@
 #include "util/libevent_wrapper.h"
 #include "util/masterelection.h"
 #include "util/sync_task.h"
+#include "util/thread_placement.h"
 
 class Frontend;
 class LogVerifier;
@@ -27,7 +30,9 @@ class GCMExporter;
 class LogLookup;
 class LogSigner;
 class LoggedEntry;
+class PendingEntryBodies;
 class Proxy;
+class RequestCapture;
 class ThreadPool;
 class UrlFetcher;
 
@@ -39,11 +44,37 @@ class Server {
  public:
   static void StaticInit();
 
+  // What differs between the logs served by one process. Empty
+  // strings stand for the values of the flags of the same names.
+  struct Options {
+    Options() : http_server(nullptr) {
+    }
+
+    // If set, the server handles its requests on this HTTP server,
+    // owned by another Server, rather than binding one of its own.
+    // Run() must then be called on that other Server instead.
+    libevent::HttpServer* http_server;
+    std::string etcd_root;
+    std::string log_lookup_checkpoint_file;
+    std::string fetch_checkpoint_file;
+    std::string pending_bodies_dir;
+    // The prefix of the paths of the log, see HttpHandler::Add(), for
+    // the requests made to other nodes serving it.
+    std::string path_prefix;
+    // Where the thread pumping the events of |event_base| runs, unless
+    // |http_server| is set.
+    ThreadPlacement event_pump_placement;
+  };
+
   // Doesn't take ownership of anything.
   Server(const std::shared_ptr<libevent::Base>& event_base,
          ThreadPool* internal_pool, ThreadPool* http_pool, Database* db,
          EtcdClient* etcd_client, UrlFetcher* url_fetcher,
          const LogVerifier* log_verifier);
+  Server(const std::shared_ptr<libevent::Base>& event_base,
+         ThreadPool* internal_pool, ThreadPool* http_pool, Database* db,
+         EtcdClient* etcd_client, UrlFetcher* url_fetcher,
+         const LogVerifier* log_verifier, const Options& options);
   ~Server();
   Server(const Server&) = delete;
   Server& operator=(const Server&) = delete;
@@ -54,25 +85,56 @@ class Server {
   ClusterStateController* cluster_state_controller();
   LogLookup* log_lookup();
   ContinuousFetcher* continuous_fetcher();
+  PendingEntryBodies* pending_entry_bodies();
   Proxy* proxy();
   libevent::HttpServer* http_server();
 
+  // Called with the size of the local database and that of the
+  // serving STH while waiting for the former to catch up.
+  typedef std::function<void(int64_t local_size, int64_t serving_size)>
+      ReplicationProgress;
+
   void Initialise(bool is_mirror);
-  void WaitForReplication() const;
+  void WaitForReplication(
+      const ReplicationProgress& progress = ReplicationProgress()) const;
+
+  // Called with the number of entries warmed up so far, and the
+  // number to warm up in all.
+  typedef std::function<void(int64_t done, int64_t total)> WarmUpProgress;
+
+  // Reads the newest --warmup_entries entries of the database, so that
+  // they are in its caches and those of the OS, and works out the audit
+  // proofs of the newest --warmup_audit_proofs ones, which brings in
+  // the parts of the tree most proofs need. Returns false if it was
+  // cut short by |deadline|. To be called once Initialise() is done,
+  // and preferably WaitForReplication() too.
+  bool WarmUp(const std::chrono::steady_clock::time_point& deadline,
+              const WarmUpProgress& progress = WarmUpProgress()) const;
+
   void Run();
 
  private:
   const std::shared_ptr<libevent::Base> event_base_;
   std::unique_ptr<libevent::EventPumpThread> event_pump_;
-  libevent::HttpServer http_server_;
+  // Records requests to the HTTP server, which it must outlive.
+  const std::unique_ptr<RequestCapture> request_capture_;
+  // Null if serving on the HTTP server of another Server.
+  const std::unique_ptr<libevent::HttpServer> own_http_server_;
+  libevent::HttpServer* const http_server_;
+  const std::string etcd_root_;
+  const std::string log_lookup_checkpoint_file_;
+  const std::string fetch_checkpoint_file_;
   Database* const db_;
   const LogVerifier* const log_verifier_;
   const std::string node_id_;
   UrlFetcher* const url_fetcher_;
+  // For the other nodes of the cluster, with connections kept warm.
+  const std::unique_ptr<UrlFetcher> peer_fetcher_;
   EtcdClient* const etcd_client_;
   MasterElection election_;
   ThreadPool* const internal_pool_;
   util::SyncTask server_task_;
+  const std::unique_ptr<PendingEntryBodies> pending_bodies_;
   StrictConsistentStore consistent_store_;
   const std::unique_ptr<Frontend> frontend_;
   std::unique_ptr<LogLookup> log_lookup_;
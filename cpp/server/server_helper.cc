@@ -1,3 +1,5 @@
+#include "log/caching_db.h"
+#include "log/snapshot.h"
 #include "log/strict_consistent_store.h"
 #include "server/server.h"
 #include "server/server_helper.h"
@@ -5,6 +7,7 @@
 
 using cert_trans::Server;
 using google::RegisterFlagValidator;
+using std::move;
 using std::string;
 using std::unique_ptr;
 
@@ -14,6 +17,11 @@ DEFINE_int32(port, 6962, "Server port");
 DEFINE_string(etcd_root, "/root", "Root of cluster entries in etcd.");
 DEFINE_string(etcd_servers, "",
               "Comma separated list of 'hostname:port' of the etcd server(s)");
+DEFINE_int32(etcd_max_conn_per_host_port, 16,
+             "if positive, the etcd client gets its own URL fetchers, one "
+             "for watches and one for other requests, each keeping this "
+             "many idle connections per etcd server; 0 to share the "
+             "server's URL fetcher");
 DEFINE_bool(i_know_stand_alone_mode_can_lose_data, false,
             "Set this to allow stand-alone mode, even though it will lose "
             "submissions in the case of a crash.");
@@ -27,6 +35,11 @@ DEFINE_string(sqlite_db, "",
               "SQLite database for certificate and tree storage");
 DEFINE_string(leveldb_db, "",
               "LevelDB database for certificate and tree storage");
+DEFINE_string(rocksdb_db, "",
+              "RocksDB database for certificate and tree storage");
+DEFINE_string(segmented_db, "",
+              "Directory of a segmented database for certificate and tree "
+              "storage");
 // TODO(ekasper): sanity-check these against the directory structure.
 DEFINE_int32(cert_storage_depth, 0,
              "Subdirectory depth for certificates; if the directory is not "
@@ -34,6 +47,14 @@ DEFINE_int32(cert_storage_depth, 0,
 DEFINE_int32(tree_storage_depth, 0,
              "Subdirectory depth for tree signatures; if the directory is not "
              "empty, must match the existing depth");
+DEFINE_string(import_snapshot_dir, "",
+              "Snapshot of the log, as written by db_tool export_snapshot, "
+              "to import when the database is empty, so that only the "
+              "entries that came after it have to be fetched from peers");
+DEFINE_int32(database_entry_cache_mb, 0,
+             "size of a cache of the entries most recently written or "
+             "looked up, in front of the database, in megabytes; 0 "
+             "disables it");
 
 // Basic sanity checks on flag values.
 static bool ValidateWrite(const char* flagname, const string& path) {
@@ -75,6 +96,14 @@ static const bool c_st_dummy =
 static const bool t_st_dummy =
     RegisterFlagValidator(&FLAGS_tree_storage_depth, &ValidateIsNonNegative);
 
+static const bool etcd_conn_dummy =
+    RegisterFlagValidator(&FLAGS_etcd_max_conn_per_host_port,
+                          &ValidateIsNonNegative);
+
+static const bool entry_cache_dummy =
+    RegisterFlagValidator(&FLAGS_database_entry_cache_mb,
+                          &ValidateIsNonNegative);
+
 namespace cert_trans {
 
 void EnsureValidatorsRegistered() {
@@ -100,41 +129,102 @@ bool IsStandalone(bool warn_data_loss) {
 }
 
 
-unique_ptr<Database> ProvideDatabase() {
-  if (!FLAGS_sqlite_db.empty() + !FLAGS_leveldb_db.empty() +
-          (!FLAGS_cert_dir.empty() | !FLAGS_tree_dir.empty()) !=
+// Opens the database given by exactly one of the arguments, the file
+// database counting as one.
+static unique_ptr<Database> OpenDatabase(const string& sqlite_db,
+                                         const string& leveldb_db,
+                                         const string& rocksdb_db,
+                                         const string& segmented_db,
+                                         const string& cert_dir,
+                                         const string& tree_dir,
+                                         const string& meta_dir) {
+  if (!sqlite_db.empty() + !leveldb_db.empty() + !rocksdb_db.empty() +
+          !segmented_db.empty() + (!cert_dir.empty() | !tree_dir.empty()) !=
       1) {
     LOG(FATAL) << "Must specify exactly one database type. Check flags.";
   }
 
-  if (FLAGS_sqlite_db.empty() && FLAGS_leveldb_db.empty()) {
-    CHECK_NE(FLAGS_cert_dir, FLAGS_tree_dir)
+  if (sqlite_db.empty() && leveldb_db.empty() && rocksdb_db.empty() &&
+      segmented_db.empty()) {
+    CHECK_NE(cert_dir, tree_dir)
         << "Certificate directory and tree directory must differ";
   }
 
-  if (!FLAGS_sqlite_db.empty()) {
-    return unique_ptr<Database>(new SQLiteDB(FLAGS_sqlite_db));
-  } else if (!FLAGS_leveldb_db.empty()) {
-    return unique_ptr<Database>(new LevelDB(FLAGS_leveldb_db));
+  if (!sqlite_db.empty()) {
+    return unique_ptr<Database>(new SQLiteDB(sqlite_db));
+  } else if (!leveldb_db.empty()) {
+    return unique_ptr<Database>(new LevelDB(leveldb_db));
+  } else if (!segmented_db.empty()) {
+    return unique_ptr<Database>(new SegmentedDB(segmented_db));
+  } else if (!rocksdb_db.empty()) {
+#ifdef HAVE_ROCKSDB
+    return unique_ptr<Database>(new RocksDB(rocksdb_db));
+#else
+    LOG(FATAL) << "--rocksdb_db given, but built without RocksDB support.";
+#endif
   } else {
     return unique_ptr<Database>(
-        new FileDB(new FileStorage(FLAGS_cert_dir, FLAGS_cert_storage_depth),
-                   new FileStorage(FLAGS_tree_dir, FLAGS_tree_storage_depth),
-                   new FileStorage(FLAGS_meta_dir, 0)));
+        new FileDB(new FileStorage(cert_dir, FLAGS_cert_storage_depth),
+                   new FileStorage(tree_dir, FLAGS_tree_storage_depth),
+                   new FileStorage(meta_dir, 0)));
   }
 
   LOG(FATAL) << "No usable database is configured by flags";
 }
 
 
+// Puts |db| behind a cache if --database_entry_cache_mb says so.
+static unique_ptr<Database> MaybeCacheDatabase(unique_ptr<Database> db) {
+  if (FLAGS_database_entry_cache_mb == 0) {
+    return db;
+  }
+  return unique_ptr<Database>(new CachingDatabase(
+      move(db), static_cast<size_t>(FLAGS_database_entry_cache_mb) << 20));
+}
+
+
+unique_ptr<Database> ProvideDatabase() {
+  unique_ptr<Database> db(OpenDatabase(FLAGS_sqlite_db, FLAGS_leveldb_db,
+                                       FLAGS_rocksdb_db, FLAGS_segmented_db,
+                                       FLAGS_cert_dir, FLAGS_tree_dir,
+                                       FLAGS_meta_dir));
+  // A node that has entries is already past its snapshot.
+  if (!FLAGS_import_snapshot_dir.empty() && db->TreeSize() == 0) {
+    const util::Status status(
+        ImportSnapshot(FLAGS_import_snapshot_dir, db.get()));
+    CHECK(status.ok()) << "Failed to import snapshot from "
+                       << FLAGS_import_snapshot_dir << ": " << status;
+  }
+  return MaybeCacheDatabase(move(db));
+}
+
+
+unique_ptr<Database> ProvideShardDatabase(const ct::LogShardConfig& shard) {
+  return MaybeCacheDatabase(OpenDatabase(shard.sqlite_db(), shard.leveldb_db(),
+                                        shard.rocksdb_db(),
+                                        shard.segmented_db(), "", "", ""));
+}
+
+
 unique_ptr<EtcdClient> ProvideEtcdClient(libevent::Base* event_base,
                                          ThreadPool* pool,
                                          UrlFetcher* fetcher) {
   // No need to enforce --warn-data-loss here as it will already have been
   // done if required
-  return unique_ptr<EtcdClient>(
-      IsStandalone(false)
-          ? new FakeEtcdClient(event_base)
-          : new EtcdClient(pool, fetcher, SplitHosts(FLAGS_etcd_servers)));
+  if (IsStandalone(false)) {
+    return unique_ptr<EtcdClient>(new FakeEtcdClient(event_base));
+  }
+  if (FLAGS_etcd_max_conn_per_host_port == 0) {
+    return unique_ptr<EtcdClient>(
+        new EtcdClient(pool, fetcher, SplitHosts(FLAGS_etcd_servers)));
+  }
+  // Keep etcd traffic on persistent connections of its own, with the
+  // long-polling watches apart from everything else.
+  UrlFetcher::Options options;
+  options.max_idle_conns_per_host_port = FLAGS_etcd_max_conn_per_host_port;
+  return unique_ptr<EtcdClient>(new EtcdClient(
+      pool, unique_ptr<UrlFetcher>(new UrlFetcher(event_base, pool, options)),
+      unique_ptr<UrlFetcher>(new UrlFetcher(event_base, pool, options)),
+      SplitHosts(FLAGS_etcd_servers)));
 }
 }  // namespace cert_trans
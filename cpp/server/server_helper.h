@@ -15,7 +15,12 @@
 #include "log/file_db.h"
 #include "log/file_storage.h"
 #include "log/leveldb_db.h"
+#ifdef HAVE_ROCKSDB
+#include "log/rocksdb_db.h"
+#endif
+#include "log/segmented_db.h"
 #include "log/sqlite_db.h"
+#include "proto/ct.pb.h"
 #include "util/etcd.h"
 #include "util/executor.h"
 #include "util/libevent_wrapper.h"
@@ -47,6 +52,11 @@ bool IsStandalone(bool warn_data_loss);
 // Create one of the supported database types based on flags settings
 std::unique_ptr<Database> ProvideDatabase();
 
+// Create the database of |shard|, one of several logs served by the
+// same process.
+std::unique_ptr<Database> ProvideShardDatabase(
+    const ct::LogShardConfig& shard);
+
 // Create an EtcdClient implementation, either fake or real based on flags
 std::unique_ptr<EtcdClient> ProvideEtcdClient(libevent::Base* event_base,
                                               ThreadPool* pool,
@@ -14,12 +14,18 @@ namespace libevent = cert_trans::libevent;
 using cert_trans::StalenessTracker;
 using cert_trans::LoggedEntry;
 using std::bind;
+using std::chrono::milliseconds;
 using std::chrono::seconds;
+using std::chrono::steady_clock;
 using std::lock_guard;
 using std::mutex;
 
 DEFINE_int32(staleness_check_delay_secs, 5,
-             "number of seconds between node staleness checks");
+             "number of seconds between node staleness checks, on top of "
+             "those made as the local and serving STHs change");
+DEFINE_int32(staleness_grace_ms, 500,
+             "How long this node can be behind the serving STH before it "
+             "is considered stale, and its requests proxied to others.");
 
 
 StalenessTracker::StalenessTracker(const ClusterStateController* controller,
@@ -29,7 +35,11 @@ StalenessTracker::StalenessTracker(const ClusterStateController* controller,
       pool_(CHECK_NOTNULL(pool)),
       event_base_(CHECK_NOTNULL(event_base)),
       task_(pool_),
-      node_is_stale_(controller_->NodeIsStale()) {
+      on_staleness_change_(
+          bind(&StalenessTracker::CheckNodeStaleness, this)),
+      node_is_stale_(controller_->NodeIsStale()),
+      grace_check_pending_(false) {
+  controller_->AddStalenessCallback(&on_staleness_change_);
   event_base_->Delay(seconds(FLAGS_staleness_check_delay_secs),
                      task_.task()->AddChild(
                          bind(&StalenessTracker::UpdateNodeStaleness, this)));
@@ -37,6 +47,7 @@ StalenessTracker::StalenessTracker(const ClusterStateController* controller,
 
 
 StalenessTracker::~StalenessTracker() {
+  controller_->RemoveStalenessCallback(&on_staleness_change_);
   task_.task()->Return();
   task_.Wait();
 }
@@ -54,13 +65,52 @@ void StalenessTracker::UpdateNodeStaleness() {
     return;
   }
 
-  const bool node_is_stale(controller_->NodeIsStale());
-  {
-    lock_guard<mutex> lock(mutex_);
-    node_is_stale_ = node_is_stale;
-  }
+  CheckNodeStaleness();
 
   event_base_->Delay(seconds(FLAGS_staleness_check_delay_secs),
                      task_.task()->AddChild(
                          bind(&StalenessTracker::UpdateNodeStaleness, this)));
 }
+
+
+void StalenessTracker::CheckNodeStaleness() {
+  if (!task_.task()->IsActive()) {
+    // We're shutting down, just return.
+    return;
+  }
+
+  const bool behind(controller_->NodeIsStale());
+  const steady_clock::time_point now(steady_clock::now());
+  const milliseconds grace(FLAGS_staleness_grace_ms);
+  lock_guard<mutex> lock(mutex_);
+  if (!behind) {
+    node_is_stale_ = false;
+    behind_since_ = steady_clock::time_point();
+    return;
+  }
+  if (node_is_stale_) {
+    return;
+  }
+
+  if (behind_since_ == steady_clock::time_point()) {
+    behind_since_ = now;
+  }
+  if (now - behind_since_ >= grace) {
+    node_is_stale_ = true;
+  } else if (!grace_check_pending_) {
+    // Nothing might happen to tell us that we are still behind by then.
+    grace_check_pending_ = true;
+    event_base_->Delay(behind_since_ + grace - now,
+                       task_.task()->AddChild(
+                           bind(&StalenessTracker::EndGracePeriod, this)));
+  }
+}
+
+
+void StalenessTracker::EndGracePeriod() {
+  {
+    lock_guard<mutex> lock(mutex_);
+    grace_check_pending_ = false;
+  }
+  CheckNodeStaleness();
+}
@@ -1,6 +1,8 @@
 #ifndef CERT_TRANS_SERVER_STALENESS_TRACKER_H_
 #define CERT_TRANS_SERVER_STALENESS_TRACKER_H_
 
+#include <chrono>
+#include <functional>
 #include <memory>
 #include <mutex>
 #include <string>
@@ -16,6 +18,13 @@ class ClusterStateController;
 class ThreadPool;
 
 
+// Keeps track of whether this node is stale, that is, whether its
+// database is behind the serving STH of the cluster. It is checked
+// whenever the ClusterStateController says that may have changed, and
+// every --staleness_check_delay_secs in case something was missed. A
+// node becomes fresh as soon as it catches up, but only becomes stale
+// once it has been behind for --staleness_grace_ms, so that it does
+// not flap when it is briefly behind a new serving STH.
 class StalenessTracker {
  public:
   // Does not take ownership of its parameters, which must outlive
@@ -33,13 +42,26 @@ class StalenessTracker {
   void UpdateNodeStaleness();
 
  private:
+  // Update our view of node staleness from the controller.
+  void CheckNodeStaleness();
+  // Check again at the end of the grace period of a node that is
+  // behind.
+  void EndGracePeriod();
+
   const ClusterStateController* const controller_;
   ThreadPool* const pool_;
   libevent::Base* const event_base_;
 
   util::SyncTask task_;
+  // Registered with |controller_|.
+  const std::function<void()> on_staleness_change_;
   mutable std::mutex mutex_;
   bool node_is_stale_;
+  // When the node was first seen behind, while it is not stale yet, or
+  // the epoch if it is not behind.
+  std::chrono::steady_clock::time_point behind_since_;
+  // Whether a check is scheduled for the end of the grace period.
+  bool grace_check_pending_;
 };
 
 
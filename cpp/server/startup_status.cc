@@ -0,0 +1,149 @@
+#include "server/startup_status.h"
+
+#include <glog/logging.h>
+
+#include "util/json_wrapper.h"
+
+using std::chrono::duration_cast;
+using std::chrono::milliseconds;
+using std::function;
+using std::lock_guard;
+using std::mutex;
+using std::string;
+using std::thread;
+using std::unique_lock;
+
+namespace cert_trans {
+
+
+StartupStatus::StartupStatus() {
+}
+
+
+void StartupStatus::AddStage(const string& name) {
+  lock_guard<mutex> lock(lock_);
+  for (const Stage& stage : stages_) {
+    CHECK_NE(name, stage.name) << "Duplicate startup stage";
+  }
+  stages_.push_back(Stage{name, State::PENDING, 0, 0, Clock::time_point(),
+                          Clock::time_point()});
+}
+
+
+void StartupStatus::Start(const string& name) {
+  lock_guard<mutex> lock(lock_);
+  Stage* const stage(&stages_[StageIndex(name)]);
+  CHECK(stage->state == State::PENDING) << name << " already started";
+  stage->state = State::RUNNING;
+  stage->started = Clock::now();
+  LOG(INFO) << "Startup stage " << name << " started";
+}
+
+
+void StartupStatus::SetProgress(const string& name, int64_t done,
+                                int64_t total) {
+  lock_guard<mutex> lock(lock_);
+  Stage* const stage(&stages_[StageIndex(name)]);
+  stage->done = done;
+  stage->total = total;
+}
+
+
+void StartupStatus::Finish(const string& name) {
+  {
+    lock_guard<mutex> lock(lock_);
+    Stage* const stage(&stages_[StageIndex(name)]);
+    CHECK(stage->state == State::RUNNING) << name << " not running";
+    stage->state = State::DONE;
+    stage->finished = Clock::now();
+    LOG(INFO) << "Startup stage " << name << " done in "
+              << duration_cast<milliseconds>(stage->finished -
+                                             stage->started).count()
+              << " ms";
+  }
+  finished_.notify_all();
+}
+
+
+thread StartupStatus::Run(const string& name, const function<void()>& work) {
+  return thread([this, name, work]() {
+    Start(name);
+    work();
+    Finish(name);
+  });
+}
+
+
+void StartupStatus::WaitFor(const string& name) const {
+  unique_lock<mutex> lock(lock_);
+  const size_t index(StageIndex(name));
+  finished_.wait(lock, [this, index]() {
+    return stages_[index].state == State::DONE;
+  });
+}
+
+
+bool StartupStatus::Ready() const {
+  lock_guard<mutex> lock(lock_);
+  for (const Stage& stage : stages_) {
+    if (stage.state != State::DONE) {
+      return false;
+    }
+  }
+  return true;
+}
+
+
+bool StartupStatus::ToJson(JsonObject* json) const {
+  CHECK_NOTNULL(json);
+  const Clock::time_point now(Clock::now());
+  lock_guard<mutex> lock(lock_);
+  bool ready(true);
+  JsonArray json_stages;
+  for (const Stage& stage : stages_) {
+    ready = ready && stage.state == State::DONE;
+    JsonObject json_stage;
+    json_stage.Add("name", stage.name);
+    switch (stage.state) {
+      case State::PENDING:
+        json_stage.Add("state", string("pending"));
+        break;
+      case State::RUNNING:
+        json_stage.Add("state", string("running"));
+        break;
+      case State::DONE:
+        json_stage.Add("state", string("done"));
+        break;
+    }
+    if (stage.total > 0) {
+      json_stage.Add("done", stage.done);
+      json_stage.Add("total", stage.total);
+    }
+    if (stage.state != State::PENDING) {
+      const Clock::time_point end(stage.state == State::DONE ? stage.finished
+                                                             : now);
+      json_stage.Add("elapsed_ms",
+                     static_cast<int64_t>(
+                         duration_cast<milliseconds>(end - stage.started)
+                             .count()));
+    }
+    json_stages.Add(&json_stage);
+  }
+  json->AddBoolean("ready", ready);
+  json->Add("stages", json_stages);
+  return ready;
+}
+
+
+size_t StartupStatus::StageIndex(const string& name) const {
+  for (size_t i = 0; i < stages_.size(); ++i) {
+    if (stages_[i].name == name) {
+      return i;
+    }
+  }
+  LOG(FATAL) << "Unknown startup stage " << name;
+  return stages_.size();
+}
+
+
+}  // namespace cert_trans
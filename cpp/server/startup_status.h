@@ -0,0 +1,91 @@
+#ifndef CERT_TRANS_SERVER_STARTUP_STATUS_H_
+#define CERT_TRANS_SERVER_STARTUP_STATUS_H_
+
+#include <stddef.h>
+#include <stdint.h>
+#include <chrono>
+#include <condition_variable>
+#include <functional>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+class JsonObject;
+
+namespace cert_trans {
+
+
+// Keeps track of the stages a server goes through as it starts, such
+// as opening its database or loading its Merkle tree, several of which
+// may be running at once, so that it can report how far along it is.
+// The server is ready once all its stages are done.
+//
+// This class is thread-safe.
+class StartupStatus {
+ public:
+  typedef std::chrono::steady_clock Clock;
+
+  StartupStatus();
+  StartupStatus(const StartupStatus&) = delete;
+  StartupStatus& operator=(const StartupStatus&) = delete;
+
+  // Adds a stage called |name|, which must not have been added
+  // already. Stages should be added before the ones already there are
+  // all done, lest the server look ready in between.
+  void AddStage(const std::string& name);
+
+  // Marks stage |name| as running.
+  void Start(const std::string& name);
+
+  // Records that stage |name| has gone through |done| of the |total|
+  // items (entries, leaves...) it has to.
+  void SetProgress(const std::string& name, int64_t done, int64_t total);
+
+  // Marks stage |name| as done.
+  void Finish(const std::string& name);
+
+  // Runs |work| as stage |name| on a thread of its own, which the
+  // caller must join.
+  std::thread Run(const std::string& name, const std::function<void()>& work);
+
+  // Waits for stage |name| to be done.
+  void WaitFor(const std::string& name) const;
+
+  // Whether all the stages are done.
+  bool Ready() const;
+
+  // Adds "ready", and "stages" with the state and progress of each
+  // stage, in the order they were added, to |json|. Returns whether
+  // all the stages are done, as of then.
+  bool ToJson(JsonObject* json) const;
+
+ private:
+  enum class State {
+    PENDING,
+    RUNNING,
+    DONE,
+  };
+
+  struct Stage {
+    std::string name;
+    State state;
+    int64_t done;
+    int64_t total;
+    Clock::time_point started;
+    Clock::time_point finished;
+  };
+
+  // The position of stage |name| in |stages_|. Must be called with
+  // |lock_| held.
+  size_t StageIndex(const std::string& name) const;
+
+  mutable std::mutex lock_;
+  mutable std::condition_variable finished_;
+  std::vector<Stage> stages_;
+};
+
+
+}  // namespace cert_trans
+
+#endif  // CERT_TRANS_SERVER_STARTUP_STATUS_H_
@@ -0,0 +1,89 @@
+#include "server/startup_status.h"
+
+#include <gtest/gtest.h>
+#include <thread>
+
+#include "util/json_wrapper.h"
+#include "util/testing.h"
+
+namespace cert_trans {
+namespace {
+
+using std::string;
+using std::thread;
+
+
+TEST(StartupStatusTest, ReadyOnceAllStagesAreDone) {
+  StartupStatus status;
+  EXPECT_TRUE(status.Ready());
+
+  status.AddStage("index");
+  status.AddStage("tree");
+  EXPECT_FALSE(status.Ready());
+
+  status.Start("index");
+  status.Start("tree");
+  status.Finish("tree");
+  EXPECT_FALSE(status.Ready());
+  status.Finish("index");
+  EXPECT_TRUE(status.Ready());
+}
+
+
+TEST(StartupStatusTest, ToJson) {
+  StartupStatus status;
+  status.AddStage("roots");
+  status.AddStage("tree");
+  status.AddStage("replication");
+  status.Start("roots");
+  status.Finish("roots");
+  status.Start("tree");
+  status.SetProgress("tree", 5, 10);
+
+  JsonObject json;
+  EXPECT_FALSE(status.ToJson(&json));
+  const JsonBoolean ready(json, "ready");
+  ASSERT_TRUE(ready.Ok());
+  EXPECT_FALSE(ready.Value());
+
+  const JsonArray stages(json, "stages");
+  ASSERT_TRUE(stages.Ok());
+  ASSERT_EQ(3, stages.Length());
+
+  const JsonObject roots(stages, 0, json_type_object);
+  EXPECT_EQ("roots", string(JsonString(roots, "name").Value()));
+  EXPECT_EQ("done", string(JsonString(roots, "state").Value()));
+  EXPECT_FALSE(JsonInt(roots, "total").Ok());
+  EXPECT_TRUE(JsonInt(roots, "elapsed_ms").Ok());
+
+  const JsonObject tree(stages, 1, json_type_object);
+  EXPECT_EQ("running", string(JsonString(tree, "state").Value()));
+  EXPECT_EQ(5, JsonInt(tree, "done").Value());
+  EXPECT_EQ(10, JsonInt(tree, "total").Value());
+
+  const JsonObject replication(stages, 2, json_type_object);
+  EXPECT_EQ("pending", string(JsonString(replication, "state").Value()));
+  EXPECT_FALSE(JsonInt(replication, "elapsed_ms").Ok());
+}
+
+
+TEST(StartupStatusTest, RunAndWaitFor) {
+  StartupStatus status;
+  status.AddStage("roots");
+  bool ran(false);
+  thread stage(status.Run("roots", [&ran]() { ran = true; }));
+  status.WaitFor("roots");
+  EXPECT_TRUE(ran);
+  EXPECT_TRUE(status.Ready());
+  stage.join();
+}
+
+
+}  // namespace
+}  // namespace cert_trans
+
+
+int main(int argc, char** argv) {
+  cert_trans::test::InitTesting(argv[0], &argc, &argv, true);
+  return RUN_ALL_TESTS();
+}
@@ -0,0 +1,136 @@
+#include "server/sth_long_poll.h"
+
+#include <event2/http.h>
+#include <glog/logging.h>
+
+#include "log/log_lookup.h"
+
+using std::bind;
+using std::chrono::duration;
+using std::lock_guard;
+using std::move;
+using std::mutex;
+using std::placeholders::_1;
+using std::unique_ptr;
+
+namespace cert_trans {
+
+
+struct STHLongPoll::Waiter {
+  Waiter(STHLongPoll* owner, uint64_t id, evhttp_request* req,
+         libevent::Base* base, uint64_t newer_than)
+      : owner(owner),
+        id(id),
+        req(req),
+        base(base),
+        newer_than(newer_than),
+        // Completing from the timer callback would free the timer
+        // while it runs, so this goes through the event loop.
+        timer(*base, -1, 0, [owner, base, id](evutil_socket_t, short) {
+          base->Add([owner, id]() { owner->Complete(id, false); });
+        }) {
+  }
+
+  STHLongPoll* const owner;
+  const uint64_t id;
+  evhttp_request* const req;
+  libevent::Base* const base;
+  const uint64_t newer_than;
+  libevent::Event timer;
+};
+
+
+STHLongPoll::STHLongPoll(LogLookup* log_lookup, libevent::Base* default_base,
+                         const duration<double>& timeout,
+                         const ReplyCallback& reply)
+    : log_lookup_(CHECK_NOTNULL(log_lookup)),
+      default_base_(CHECK_NOTNULL(default_base)),
+      timeout_(timeout),
+      reply_(reply),
+      on_new_sth_(bind(&STHLongPoll::OnNewSTH, this, _1)),
+      next_id_(0) {
+  log_lookup_->AddNotifySTHCallback(&on_new_sth_);
+}
+
+
+STHLongPoll::~STHLongPoll() {
+  log_lookup_->RemoveNotifySTHCallback(&on_new_sth_);
+}
+
+
+void STHLongPoll::Wait(evhttp_request* req, uint64_t newer_than) {
+  libevent::Base* base(libevent::Base::ForRequest(req));
+  if (!base) {
+    base = default_base_;
+  }
+  CHECK(base->OnThisEventThread());
+
+  evhttp_connection* const conn(evhttp_request_get_connection(req));
+  {
+    // The STH is checked under the lock, so that a new one either is
+    // seen here or sees the waiter in OnNewSTH().
+    lock_guard<mutex> lock(lock_);
+    if (conn && static_cast<uint64_t>(log_lookup_->GetSTH().timestamp()) <=
+                    newer_than) {
+      const uint64_t id(next_id_++);
+      Waiter* const waiter(new Waiter(this, id, req, base, newer_than));
+      waiters_[id].reset(waiter);
+      evhttp_connection_set_closecb(conn, &STHLongPoll::Closed, waiter);
+      waiter->timer.Add(timeout_);
+      return;
+    }
+  }
+
+  reply_(req);
+}
+
+
+void STHLongPoll::OnNewSTH(const ct::SignedTreeHead& sth) {
+  const uint64_t timestamp(sth.timestamp());
+  lock_guard<mutex> lock(lock_);
+  for (const auto& it : waiters_) {
+    if (it.second->newer_than < timestamp) {
+      const uint64_t id(it.first);
+      it.second->base->Add([this, id]() { Complete(id, false); });
+    }
+  }
+}
+
+
+void STHLongPoll::Complete(uint64_t id, bool closed) {
+  unique_ptr<Waiter> waiter;
+  {
+    lock_guard<mutex> lock(lock_);
+    const auto it(waiters_.find(id));
+    // The timeout, a new STH and the client going away can each
+    // complete it, whichever comes first.
+    if (it == waiters_.end()) {
+      return;
+    }
+    waiter = move(it->second);
+    waiters_.erase(it);
+  }
+  CHECK(waiter->base->OnThisEventThread());
+
+  evhttp_connection* const conn(evhttp_request_get_connection(waiter->req));
+  if (conn) {
+    evhttp_connection_set_closecb(conn, nullptr, nullptr);
+  }
+  if (!closed) {
+    reply_(waiter->req);
+  } else if (!conn) {
+    // The request was detached from its connection, leaving it to us
+    // to free.
+    evhttp_request_free(waiter->req);
+  }
+}
+
+
+// static
+void STHLongPoll::Closed(evhttp_connection* /*conn*/, void* waiter) {
+  const Waiter* const self(static_cast<Waiter*>(waiter));
+  self->owner->Complete(self->id, true);
+}
+
+
+}  // namespace cert_trans
@@ -0,0 +1,72 @@
+#ifndef CERT_TRANS_SERVER_STH_LONG_POLL_H_
+#define CERT_TRANS_SERVER_STH_LONG_POLL_H_
+
+#include <stdint.h>
+#include <chrono>
+#include <functional>
+#include <map>
+#include <memory>
+#include <mutex>
+
+#include "log/database.h"
+#include "util/libevent_wrapper.h"
+
+struct evhttp_connection;
+struct evhttp_request;
+
+namespace cert_trans {
+
+class LogLookup;
+
+
+// Holds get-sth requests until an STH newer than the one the client
+// already has is served, so that monitors and mirrors learn about new
+// STHs as soon as they are out, without polling for them.
+class STHLongPoll {
+ public:
+  // Sends the current STH in reply to the request.
+  typedef std::function<void(evhttp_request*)> ReplyCallback;
+
+  // Requests are answered with |reply| once there is a new STH, or
+  // after |timeout| regardless. |default_base| is the event loop of
+  // the requests that do not say which one they came in on. Does not
+  // take ownership of |log_lookup| or |default_base|, which must
+  // outlive this instance.
+  STHLongPoll(LogLookup* log_lookup, libevent::Base* default_base,
+              const std::chrono::duration<double>& timeout,
+              const ReplyCallback& reply);
+  // Requests still waiting are not answered, so this should only be
+  // destroyed once the event loops are stopped.
+  ~STHLongPoll();
+  STHLongPoll(const STHLongPoll&) = delete;
+  STHLongPoll& operator=(const STHLongPoll&) = delete;
+
+  // Answers |req| once the STH served has a timestamp later than
+  // |newer_than|, which may be right away. Must be called from the
+  // event loop |req| came in on.
+  void Wait(evhttp_request* req, uint64_t newer_than);
+
+ private:
+  struct Waiter;
+
+  void OnNewSTH(const ct::SignedTreeHead& sth);
+  // Runs on the event loop of the waiter, which is answered if it is
+  // still waiting. The request is only freed if the client went away.
+  void Complete(uint64_t id, bool closed);
+  static void Closed(evhttp_connection* conn, void* waiter);
+
+  LogLookup* const log_lookup_;
+  libevent::Base* const default_base_;
+  const std::chrono::duration<double> timeout_;
+  const ReplyCallback reply_;
+  const Database::NotifySTHCallback on_new_sth_;
+
+  std::mutex lock_;
+  uint64_t next_id_;
+  std::map<uint64_t, std::unique_ptr<Waiter>> waiters_;
+};
+
+
+}  // namespace cert_trans
+
+#endif  // CERT_TRANS_SERVER_STH_LONG_POLL_H_
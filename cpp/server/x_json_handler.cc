@@ -1,11 +1,24 @@
 #include "server/x_json_handler.h"
 
+#include <event2/buffer.h>
+#include <gflags/gflags.h>
+#include <string.h>
 #include <functional>
+#include <memory>
+#include <vector>
 
 #include "log/frontend.h"
 #include "server/json_output.h"
+#include "util/json_canonicalizer.h"
 #include "util/statusor.h"
+#include "util/task.h"
 #include "util/thread_pool.h"
+#include "util/tracing.h"
+
+DEFINE_int32(max_json_per_batch_submission, 0,
+             "if positive, also accept add-jsons requests, whose body is "
+             "up to this many JSON objects, one per line, each logged as "
+             "its own entry and getting its own SCT");
 
 namespace cert_trans {
 
@@ -19,32 +32,152 @@ using std::multimap;
 using std::placeholders::_1;
 using std::shared_ptr;
 using std::string;
+using std::unique_ptr;
+using std::vector;
 using util::Status;
 
 
 namespace {
 
 
-shared_ptr<JsonObject> ExtractJson(libevent::Base* base, evhttp_request* req) {
-  CHECK_NOTNULL(base);
-  CHECK_NOTNULL(req);
+// Replies with an error and returns false if |req| is not a POST.
+bool CheckPost(libevent::Base* base, evhttp_request* req) {
   if (evhttp_request_get_command(req) != EVHTTP_REQ_POST) {
     SendJsonError(base, req, HTTP_BADMETHOD, "Method not allowed.");
-    return nullptr;
+    return false;
+  }
+  return true;
+}
+
+
+// Sets |*json| to the canonical form of |object|, if it is a JSON
+// object at all.
+bool CanonicalForm(const JsonObject& object, string* json) {
+  if (!object.Ok() || !object.IsType(json_type_object)) {
+    return false;
+  }
+  json->assign(object.ToString());
+  return true;
+}
+
+
+// Sets |*json| to the canonical form of the JSON object in the body of
+// |req|, or replies with an error and returns false.
+bool ExtractJson(libevent::Base* base, evhttp_request* req, string* json) {
+  CHECK_NOTNULL(base);
+  CHECK_NOTNULL(req);
+  if (!CheckPost(base, req)) {
+    return false;
   }
 
   // TODO(pphaneuf): Should we check that Content-Type says
   // "application/json", as recommended by RFC4627?
-  shared_ptr<JsonObject> json_body(
-      make_shared<JsonObject>(evhttp_request_get_input_buffer(req)));
-  if (!json_body->Ok() || !json_body->IsType(json_type_object)) {
+  evbuffer* const body(evhttp_request_get_input_buffer(req));
+  JsonCanonicalizer canonicalizer;
+  evbuffer_ptr ptr;
+  evbuffer_ptr_set(body, &ptr, 0, EVBUFFER_PTR_SET);
+  bool canonical(true);
+  evbuffer_iovec chunk;
+  while (canonical && evbuffer_peek(body, -1, &ptr, &chunk, 1) > 0) {
+    canonical = canonicalizer.Read(static_cast<const char*>(chunk.iov_base),
+                                   chunk.iov_len);
+    evbuffer_ptr_set(body, &ptr, chunk.iov_len, EVBUFFER_PTR_ADD);
+  }
+  if (!(canonical && canonicalizer.Finish(json)) &&
+      !CanonicalForm(JsonObject(body), json)) {
     SendJsonError(base, req, HTTP_BADREQUEST,
                   "Unable to parse provided JSON.");
-    return nullptr;
+    return false;
+  }
+
+  VLOG(2) << "ExtractJson:\n" << *json;
+  return true;
+}
+
+
+// Sets |*jsons| to the canonical forms of the JSON objects in the body
+// of |req|, one per line, skipping blank lines, or replies with an
+// error and returns false. The body is read as it is, without copying
+// it into a single string first.
+bool ExtractJsonLines(libevent::Base* base, evhttp_request* req,
+                      vector<string>* jsons) {
+  ScopedSpan span("parse-jsons");
+  if (!CheckPost(base, req)) {
+    return false;
   }
 
-  VLOG(2) << "ExtractJson:\n" << json_body->DebugString();
-  return json_body;
+  evbuffer* const body(evhttp_request_get_input_buffer(req));
+  vector<evbuffer_iovec> chunks(evbuffer_peek(body, -1, nullptr, nullptr, 0));
+  evbuffer_peek(body, -1, nullptr, chunks.data(), chunks.size());
+
+  unique_ptr<JsonCanonicalizer> canonicalizer(new JsonCanonicalizer);
+  // Whether |canonicalizer| has managed with the line so far, and
+  // whether the line is blank so far.
+  bool canonical(true), blank(true);
+  size_t line_start(0), offset(0);
+  // Ends the line between |line_start| and |offset|.
+  const auto end_line([&]() -> bool {
+    if (blank) {
+      return true;
+    }
+    if (jsons->size() >= static_cast<size_t>(
+                             FLAGS_max_json_per_batch_submission)) {
+      SendJsonError(base, req, HTTP_BADREQUEST, "Too many JSON objects.");
+      return false;
+    }
+    jsons->emplace_back();
+    if (!(canonical && canonicalizer->Finish(&jsons->back()))) {
+      // Leave it to json-c.
+      string line(offset - line_start, '\0');
+      evbuffer_ptr ptr;
+      evbuffer_ptr_set(body, &ptr, line_start, EVBUFFER_PTR_SET);
+      CHECK_EQ(static_cast<ssize_t>(line.size()),
+               evbuffer_copyout_from(body, &ptr, &line[0], line.size()));
+      if (!CanonicalForm(JsonObject(line), &jsons->back())) {
+        SendJsonError(base, req, HTTP_BADREQUEST,
+                      "Unable to parse provided JSON object " +
+                          std::to_string(jsons->size()) + ".");
+        return false;
+      }
+    }
+    canonicalizer.reset(new JsonCanonicalizer);
+    canonical = blank = true;
+    return true;
+  });
+
+  for (const auto& chunk : chunks) {
+    const char* p(static_cast<const char*>(chunk.iov_base));
+    const char* const end(p + chunk.iov_len);
+    while (p < end) {
+      const char* const newline(
+          static_cast<const char*>(memchr(p, '\n', end - p)));
+      const char* const line_end(newline ? newline : end);
+      for (const char* q(p); blank && q < line_end; ++q) {
+        blank = *q == ' ' || *q == '\t' || *q == '\r';
+      }
+      if (canonical) {
+        canonical = canonicalizer->Read(p, line_end - p);
+      }
+      offset += line_end - p;
+      p = line_end;
+      if (newline) {
+        if (!end_line()) {
+          return false;
+        }
+        ++p;
+        line_start = ++offset;
+      }
+    }
+  }
+  if (!end_line()) {
+    return false;
+  }
+
+  if (jsons->empty()) {
+    SendJsonError(base, req, HTTP_BADREQUEST, "Missing JSON objects.");
+    return false;
+  }
+  return true;
 }
 
 
@@ -69,29 +202,51 @@ void XJsonHttpHandler::AddHandlers(libevent::HttpServer* server) {
     // more up-to-date node will have a better chance of handling dupes
     // correctly, rather than bloating the tree.
     AddProxyWrappedHandler(server, "/ct/v1/add-json",
-                           bind(&XJsonHttpHandler::AddJson, this, _1));
+                           bind(&XJsonHttpHandler::AddJson, this, _1),
+                           LocalDataCheck(), RequestClass::WRITE);
+  }
+  if (frontend_ && FLAGS_max_json_per_batch_submission > 0) {
+    AddProxyWrappedHandler(server, "/ct/v1/add-jsons",
+                           bind(&XJsonHttpHandler::AddJsons, this, _1),
+                           LocalDataCheck(), RequestClass::WRITE);
   }
 }
 
 
 void XJsonHttpHandler::AddJson(evhttp_request* req) {
-  shared_ptr<JsonObject> json(ExtractJson(event_base_, req));
-  if (!json) {
+  string json;
+  if (!ExtractJson(event_base_, req, &json)) {
     return;
   }
 
-  pool_->Add(bind(&XJsonHttpHandler::BlockingAddJson, this, req, json));
+  pool_->Add(bind(&XJsonHttpHandler::BlockingAddJson, this, req, move(json)));
+}
+
+
+void XJsonHttpHandler::AddJsons(evhttp_request* req) {
+  const shared_ptr<vector<string>> jsons(make_shared<vector<string>>());
+  if (!ExtractJsonLines(event_base_, req, jsons.get())) {
+    return;
+  }
+
+  pool_->Add(bind(&XJsonHttpHandler::BlockingAddJsons, this, req, jsons));
 }
 
 
 void XJsonHttpHandler::BlockingAddJson(evhttp_request* req,
-                                       shared_ptr<JsonObject> json) const {
+                                       const string& json) const {
   SignedCertificateTimestamp sct;
+  if (util::DeadlineExceeded()) {
+    return AddEntryReply(req,
+                         Status(util::error::DEADLINE_EXCEEDED,
+                                "Request deadline exceeded."),
+                         sct);
+  }
 
   LogEntry entry;
   // do this here for now
   entry.set_type(X_JSON_ENTRY);
-  entry.mutable_x_json_entry()->set_json(json->ToString());
+  entry.mutable_x_json_entry()->set_json(json);
 
   AddEntryReply(req, CHECK_NOTNULL(frontend_)
                          ->QueueProcessedEntry(::util::OkStatus(), entry, &sct),
@@ -99,4 +254,26 @@ void XJsonHttpHandler::BlockingAddJson(evhttp_request* req,
 }
 
 
+void XJsonHttpHandler::BlockingAddJsons(
+    evhttp_request* req, const shared_ptr<vector<string>>& jsons) const {
+  const Status pre_status(util::DeadlineExceeded()
+                              ? Status(util::error::DEADLINE_EXCEEDED,
+                                       "Request deadline exceeded.")
+                              : ::util::OkStatus());
+  vector<Status> pre_statuses(jsons->size(), pre_status);
+  vector<LogEntry> entries(jsons->size());
+  for (size_t i = 0; i < jsons->size(); ++i) {
+    entries[i].set_type(X_JSON_ENTRY);
+    entries[i].mutable_x_json_entry()->mutable_json()->swap((*jsons)[i]);
+  }
+
+  // Submitted together, so that they are signed and stored together.
+  vector<SignedCertificateTimestamp> scts;
+  vector<Status> statuses;
+  CHECK_NOTNULL(frontend_)
+      ->QueueProcessedEntries(pre_statuses, entries, &scts, &statuses);
+  AddEntriesReply(req, statuses, scts);
+}
+
+
 }  // namespace cert_trans
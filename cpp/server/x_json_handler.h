@@ -2,6 +2,8 @@
 #define CERT_TRANS_SERVER_X_JSON_HANDLER_H_
 
 #include <memory>
+#include <string>
+#include <vector>
 
 #include "log/logged_entry.h"
 #include "server/handler.h"
@@ -32,9 +34,15 @@ class XJsonHttpHandler : public HttpHandler {
   Frontend* const frontend_;
 
   void AddJson(evhttp_request* req);
-
-  void BlockingAddJson(evhttp_request* req,
-                       std::shared_ptr<JsonObject> json) const;
+  // Non-standard: several JSON objects at once, see
+  // --max_json_per_batch_submission.
+  void AddJsons(evhttp_request* req);
+
+  // |json| is in canonical form already.
+  void BlockingAddJson(evhttp_request* req, const std::string& json) const;
+  void BlockingAddJsons(
+      evhttp_request* req,
+      const std::shared_ptr<std::vector<std::string>>& jsons) const;
 };
 
 
@@ -0,0 +1,349 @@
+// Measures how a Database implementation performs at a given size, so
+// that the choice of backend and its tuning can be made on data. It
+// creates a new database of --num_entries entries, e.g. 1M, 10M and
+// 100M, in --db_dir, and times these phases:
+//
+//   write            CreateSequencedEntries() in batches, as the
+//                    signer and mirror do.
+//   reopen           opening the database again, which includes
+//                    rebuilding its in-memory index (BuildIndex()).
+//   lookup-by-hash   LookupByHash() of random entries.
+//   lookup-by-index  LookupByIndex() of random entries.
+//   scan             ScanEntries() over the whole database, as
+//                    get-entries and the tree signer do.
+//
+// Then reports their throughput in entries per second, the latency of
+// their operations (of a whole batch, for write and scan), the size of
+// the database on disk, and the peak RSS of the process after each
+// phase. Entries are about --entry_size bytes each, so make sure there
+// is enough disk space.
+
+#include <ftw.h>
+#include <gflags/gflags.h>
+#include <glog/logging.h>
+#include <stdint.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <chrono>
+#include <iomanip>
+#include <iostream>
+#include <memory>
+#include <random>
+#include <string>
+#include <vector>
+
+#include "config.h"
+#include "log/database.h"
+#include "log/file_db.h"
+#include "log/file_storage.h"
+#include "log/leveldb_db.h"
+#include "log/logged_entry.h"
+#ifdef HAVE_ROCKSDB
+#include "log/rocksdb_db.h"
+#endif
+#include "log/segmented_db.h"
+#include "log/sqlite_db.h"
+#include "monitoring/histogram.h"
+#include "proto/cert_serializer.h"
+#include "util/init.h"
+
+DEFINE_string(backend, "leveldb",
+              "Database to benchmark: file, sqlite, leveldb, rocksdb or "
+              "segmented");
+DEFINE_string(db_dir, "",
+              "Directory to create the database in, which must be empty");
+DEFINE_int64(num_entries, 1000000, "Number of entries to write");
+DEFINE_int32(write_batch_size, 1000,
+             "Number of entries written by each CreateSequencedEntries() "
+             "call");
+DEFINE_bool(bulk_load, true,
+            "Whether to write the entries between BeginBulkLoad() and "
+            "EndBulkLoad()");
+DEFINE_int32(entry_size, 1500,
+             "Size of the leaf certificate of each entry, in bytes");
+DEFINE_int32(chain_size, 2,
+             "Number of certificates in the chain of each entry, which are "
+             "the same for every entry, as intermediates mostly are");
+DEFINE_int64(num_lookups, 100000,
+             "Number of lookups by hash and by index to time");
+DEFINE_uint64(seed, 0, "Seed for choosing the entries to look up");
+
+using cert_trans::Database;
+using cert_trans::FileDB;
+using cert_trans::FileStorage;
+using cert_trans::Histogram;
+using cert_trans::LevelDB;
+using cert_trans::LoggedEntry;
+using cert_trans::ReadOnlyDatabase;
+#ifdef HAVE_ROCKSDB
+using cert_trans::RocksDB;
+#endif
+using cert_trans::SQLiteDB;
+using cert_trans::SegmentedDB;
+using std::chrono::duration;
+using std::chrono::steady_clock;
+using std::cout;
+using std::string;
+using std::unique_ptr;
+using std::vector;
+
+namespace {
+
+
+Histogram<string>* latency_us(Histogram<string>::New(
+    "db_bench_latency_us", "phase",
+    "Latency of each operation of a phase, in microseconds."));
+
+
+unique_ptr<Database> OpenDatabase() {
+  const string& dir(FLAGS_db_dir);
+  if (FLAGS_backend == "file") {
+    return unique_ptr<Database>(
+        new FileDB(new FileStorage(dir + "/certs", 3),
+                   new FileStorage(dir + "/tree", 8),
+                   new FileStorage(dir + "/meta", 0)));
+  } else if (FLAGS_backend == "sqlite") {
+    return unique_ptr<Database>(new SQLiteDB(dir + "/sqlite"));
+  } else if (FLAGS_backend == "leveldb") {
+    return unique_ptr<Database>(new LevelDB(dir + "/leveldb"));
+  } else if (FLAGS_backend == "rocksdb") {
+#ifdef HAVE_ROCKSDB
+    return unique_ptr<Database>(new RocksDB(dir + "/rocksdb"));
+#else
+    LOG(FATAL) << "--backend=rocksdb, but built without RocksDB support.";
+#endif
+  } else if (FLAGS_backend == "segmented") {
+    return unique_ptr<Database>(new SegmentedDB(dir + "/segmented"));
+  }
+  LOG(FATAL) << "unknown --backend " << FLAGS_backend;
+}
+
+
+// splitmix64, so that entry |index| has the same contents every time.
+uint64_t Mix(uint64_t x) {
+  x += 0x9e3779b97f4a7c15ULL;
+  x = (x ^ (x >> 30)) * 0xbf58476d1ce4e5b9ULL;
+  x = (x ^ (x >> 27)) * 0x94d049bb133111ebULL;
+  return x ^ (x >> 31);
+}
+
+
+string Bytes(uint64_t seed, size_t size) {
+  string ret(size, '\0');
+  for (size_t i = 0; i < size; i += 8) {
+    const uint64_t r(Mix(seed + i));
+    for (size_t j = 0; j < 8 && i + j < size; ++j) {
+      ret[i + j] = static_cast<char>(r >> (8 * j));
+    }
+  }
+  return ret;
+}
+
+
+// Fills |logged| with entry |index|, whose certificate is unique to it.
+void MakeEntry(int64_t index, LoggedEntry* logged) {
+  logged->Clear();
+  logged->set_sequence_number(index);
+
+  ct::SignedCertificateTimestamp* const sct(logged->mutable_sct());
+  sct->set_version(ct::V1);
+  sct->mutable_id()->set_key_id(Bytes(1, 32));
+  sct->set_timestamp(1469000000000ULL + index);
+  sct->mutable_signature()->set_hash_algorithm(ct::DigitallySigned::SHA256);
+  sct->mutable_signature()->set_sig_algorithm(ct::DigitallySigned::ECDSA);
+  sct->mutable_signature()->set_signature(Bytes(Mix(index) ^ 2, 72));
+
+  ct::LogEntry* const entry(logged->mutable_entry());
+  entry->set_type(ct::X509_ENTRY);
+  entry->mutable_x509_entry()->set_leaf_certificate(
+      Bytes(Mix(index), FLAGS_entry_size));
+  for (int i = 0; i < FLAGS_chain_size; ++i) {
+    entry->mutable_x509_entry()->add_certificate_chain(Bytes(3 + i, 1200));
+  }
+}
+
+
+// Adds up the space used by the files under |dir|.
+uint64_t disk_usage;
+
+int AddDiskUsage(const char*, const struct stat* st, int type, FTW*) {
+  if (type == FTW_F) {
+    disk_usage += static_cast<uint64_t>(st->st_blocks) * 512;
+  }
+  return 0;
+}
+
+uint64_t DiskUsage(const string& dir) {
+  disk_usage = 0;
+  PCHECK(nftw(dir.c_str(), &AddDiskUsage, 64, FTW_PHYS) == 0) << dir;
+  return disk_usage;
+}
+
+
+int64_t PeakRssKb() {
+  struct rusage usage;
+  PCHECK(getrusage(RUSAGE_SELF, &usage) == 0);
+  return usage.ru_maxrss;
+}
+
+
+// Times a phase of |ops| operations, and prints how it went.
+class Phase {
+ public:
+  Phase(const char* name, int64_t ops)
+      : name_(name),
+        ops_(ops),
+        cell_(latency_us->WithLabels(name)),
+        start_(steady_clock::now()),
+        op_start_(start_) {
+    LOG(INFO) << "starting " << name_;
+  }
+
+  ~Phase() {
+    const double secs(
+        duration<double>(steady_clock::now() - start_).count());
+    const cert_trans::Metric::Distribution distribution(
+        cell_->GetDistribution());
+    cout << std::left << std::setw(16) << name_ << std::right << std::fixed
+         << std::setprecision(1) << std::setw(12) << ops_ << std::setw(10)
+         << secs << std::setw(12) << ops_ / secs << std::setw(10)
+         << Quantile(distribution, 0.5) << std::setw(10)
+         << Quantile(distribution, 0.9) << std::setw(10)
+         << Quantile(distribution, 0.99) << std::setw(12) << PeakRssKb()
+         << std::endl;
+  }
+
+  // Starts timing an operation which does not follow on from the
+  // previous one.
+  void OpStart() {
+    op_start_ = steady_clock::now();
+  }
+
+  // Records the time since OpStart() or the previous OpDone(), or
+  // since the start, as the latency of one operation.
+  void OpDone() {
+    const steady_clock::time_point now(steady_clock::now());
+    cell_->Record(duration<double, std::micro>(now - op_start_).count());
+    op_start_ = now;
+  }
+
+ private:
+  const char* const name_;
+  const int64_t ops_;
+  cert_trans::HistogramCell* const cell_;
+  const steady_clock::time_point start_;
+  steady_clock::time_point op_start_;
+};
+
+
+void Write(Database* db) {
+  Phase phase("write", FLAGS_num_entries);
+  if (FLAGS_bulk_load) {
+    db->BeginBulkLoad();
+  }
+  vector<LoggedEntry> batch;
+  for (int64_t first = 0; first < FLAGS_num_entries;
+       first += FLAGS_write_batch_size) {
+    const int64_t size(
+        std::min<int64_t>(FLAGS_write_batch_size, FLAGS_num_entries - first));
+    batch.resize(size);
+    for (int64_t i = 0; i < size; ++i) {
+      MakeEntry(first + i, &batch[i]);
+    }
+    phase.OpStart();
+    CHECK_EQ(Database::OK, db->CreateSequencedEntries(batch));
+    phase.OpDone();
+  }
+  if (FLAGS_bulk_load) {
+    db->EndBulkLoad();
+  }
+}
+
+
+void LookupByHash(const ReadOnlyDatabase* db, std::mt19937_64* random) {
+  std::uniform_int_distribution<int64_t> pick(0, FLAGS_num_entries - 1);
+  Phase phase("lookup-by-hash", FLAGS_num_lookups);
+  LoggedEntry logged;
+  LoggedEntry found;
+  for (int64_t i = 0; i < FLAGS_num_lookups; ++i) {
+    MakeEntry(pick(*random), &logged);
+    const string hash(logged.Hash());
+    phase.OpStart();
+    CHECK_EQ(ReadOnlyDatabase::LOOKUP_OK, db->LookupByHash(hash, &found));
+    phase.OpDone();
+  }
+}
+
+
+void LookupByIndex(const ReadOnlyDatabase* db, std::mt19937_64* random) {
+  std::uniform_int_distribution<int64_t> pick(0, FLAGS_num_entries - 1);
+  Phase phase("lookup-by-index", FLAGS_num_lookups);
+  LoggedEntry found;
+  for (int64_t i = 0; i < FLAGS_num_lookups; ++i) {
+    CHECK_EQ(ReadOnlyDatabase::LOOKUP_OK,
+             db->LookupByIndex(pick(*random), &found));
+    phase.OpDone();
+  }
+}
+
+
+void Scan(const ReadOnlyDatabase* db) {
+  // Latencies are of batches of this many entries.
+  const size_t kBatchSize = 1000;
+  Phase phase("scan", FLAGS_num_entries);
+  const unique_ptr<ReadOnlyDatabase::Iterator> it(db->ScanEntries(0));
+  vector<LoggedEntry> entries;
+  int64_t count(0);
+  size_t got;
+  while ((got = it->GetNextEntries(kBatchSize, &entries)) > 0) {
+    count += got;
+    phase.OpDone();
+  }
+  CHECK_EQ(FLAGS_num_entries, count);
+}
+
+
+}  // namespace
+
+
+int main(int argc, char* argv[]) {
+  util::InitCT(&argc, &argv);
+  ConfigureSerializerForV1CT();
+
+  CHECK(!FLAGS_db_dir.empty()) << "--db_dir is required";
+  CHECK_GT(FLAGS_num_entries, 0);
+  CHECK_GT(FLAGS_write_batch_size, 0);
+  if (FLAGS_backend == "file") {
+    for (const char* sub : {"/certs", "/tree", "/meta"}) {
+      PCHECK(mkdir((FLAGS_db_dir + sub).c_str(), 0700) == 0);
+    }
+  }
+
+  cout << std::left << std::setw(16) << "phase" << std::right
+       << std::setw(12) << "ops" << std::setw(10) << "secs" << std::setw(12)
+       << "ops/s" << std::setw(10) << "p50 us" << std::setw(10) << "p90 us"
+       << std::setw(10) << "p99 us" << std::setw(12) << "peak RSS kB"
+       << std::endl;
+
+  unique_ptr<Database> db(OpenDatabase());
+  CHECK_EQ(0, db->TreeSize()) << FLAGS_db_dir << " is not empty";
+  Write(db.get());
+
+  db.reset();
+  {
+    Phase phase("reopen", 1);
+    db = OpenDatabase();
+    phase.OpDone();
+  }
+  CHECK_EQ(FLAGS_num_entries, db->TreeSize());
+
+  std::mt19937_64 random(FLAGS_seed);
+  LookupByHash(db.get(), &random);
+  LookupByIndex(db.get(), &random);
+  Scan(db.get());
+
+  cout << "backend " << FLAGS_backend << ", " << FLAGS_num_entries
+       << " entries, " << DiskUsage(FLAGS_db_dir) << " bytes on disk"
+       << std::endl;
+  return 0;
+}
@@ -1,16 +1,31 @@
 #include <gflags/gflags.h>
 #include <glog/logging.h>
 #include <limits.h>
+#include <stdio.h>
+#include <algorithm>
+#include <fstream>
 #include <functional>
 #include <iostream>
 #include <memory>
+#include <thread>
+#include <vector>
 
 #include "log/database.h"
 #include "log/file_db.h"
 #include "log/file_storage.h"
 #include "log/leveldb_db.h"
 #include "log/logged_entry.h"
+#ifdef HAVE_ROCKSDB
+#include "log/rocksdb_db.h"
+#endif
+#include "log/segmented_db.h"
+#include "log/snapshot.h"
 #include "log/sqlite_db.h"
+#include "merkletree/compact_merkle_tree.h"
+#include "merkletree/serial_hasher.h"
+#include "merkletree/tree_hasher.h"
+#include "proto/cert_serializer.h"
+#include "proto/ct.pb.h"
 #include "proto/serializer.h"
 #include "util/init.h"
 #include "util/util.h"
@@ -28,23 +43,59 @@ DEFINE_string(sqlite_db, "",
               "SQLite database for certificate and tree storage");
 DEFINE_string(leveldb_db, "",
               "LevelDB database for certificate and tree storage");
+DEFINE_string(rocksdb_db, "",
+              "RocksDB database for certificate and tree storage");
+DEFINE_string(segmented_db, "",
+              "Directory of a segmented database for certificate and tree "
+              "storage");
 
 DEFINE_int64(start, 0, "Starting sequence number (inclusive).");
 DEFINE_int64(end, std::numeric_limits<int64_t>::max(),
              "Ending sequence number (inclusive).");
+DEFINE_string(snapshot_dir, "",
+              "Directory of the snapshot for export_snapshot and "
+              "import_snapshot.");
+DEFINE_int32(threads, 4, "Number of threads reading entries.");
+DEFINE_int32(chunk_size, 10000,
+             "Number of consecutive entries each thread reads at a time.");
+DEFINE_string(checkpoint_file, "",
+              "File recording the progress of copy and verify, which then "
+              "resume from where they were when started again.");
 
+// The database copy writes to, with the same meaning as the flags of
+// the source database above.
+DEFINE_string(dest_cert_dir, "", "Destination certificate directory");
+DEFINE_string(dest_tree_dir, "", "Destination tree directory");
+DEFINE_string(dest_meta_dir, "", "Destination meta info directory");
+DEFINE_string(dest_sqlite_db, "", "Destination SQLite database");
+DEFINE_string(dest_leveldb_db, "", "Destination LevelDB database");
+DEFINE_string(dest_rocksdb_db, "", "Destination RocksDB database");
+DEFINE_string(dest_segmented_db, "", "Destination segmented database");
+
+using cert_trans::Database;
 using cert_trans::FileDB;
 using cert_trans::FileStorage;
 using cert_trans::LevelDB;
 using cert_trans::LoggedEntry;
 using cert_trans::ReadOnlyDatabase;
+#ifdef HAVE_ROCKSDB
+using cert_trans::RocksDB;
+#endif
 using cert_trans::SQLiteDB;
+using cert_trans::SegmentedDB;
 using cert_trans::serialization::SerializeResult;
+using ct::CompactTreeFrontier;
+using ct::SignedTreeHead;
 using std::cerr;
 using std::cout;
 using std::function;
+using std::min;
+using std::move;
+using std::pair;
 using std::string;
+using std::thread;
 using std::unique_ptr;
+using std::vector;
 using util::InitCT;
 using util::ToBase64;
 
@@ -52,78 +103,642 @@ using util::ToBase64;
 void Usage() {
   cerr << "Usage: db_tool [flags] <command>\n"
        << "Where <command> is one of:\n"
-       << "  dump_leaf_inputs\n";
+       << "  dump_leaf_inputs\n"
+       << "  verify\n"
+       << "  audit [<sth file>...]\n"
+       << "  copy\n"
+       << "  export_snapshot\n"
+       << "  import_snapshot\n"
+       << "  upgrade_leveldb\n";
 }
 
 
-void ForEachLeaf(const ReadOnlyDatabase* db,
-                 const function<void(const LoggedEntry& cert)>& f) {
-  unique_ptr<ReadOnlyDatabase::Iterator> it(db->ScanEntries(FLAGS_start));
-  LoggedEntry cert;
-  while (it->GetNextEntry(&cert)) {
-    if (cert.sequence_number() > FLAGS_end) {
+// Consecutive entries, read by one thread.
+struct Chunk {
+  int64_t first;
+  vector<LoggedEntry> entries;
+  // The Merkle leaf hash of each entry, if asked for.
+  vector<string> leaf_hashes;
+  bool ok;
+};
+
+
+void ReadChunk(const ReadOnlyDatabase* db, int64_t end, bool hash_leaves,
+               Chunk* chunk) {
+  unique_ptr<ReadOnlyDatabase::Iterator> it(db->ScanEntries(chunk->first));
+  it->GetNextEntries(min<int64_t>(FLAGS_chunk_size, end - chunk->first),
+                     &chunk->entries);
+  chunk->ok = true;
+  for (size_t i = 0; i < chunk->entries.size(); ++i) {
+    if (chunk->entries[i].sequence_number() !=
+        chunk->first + static_cast<int64_t>(i)) {
+      chunk->entries.resize(i);
       break;
     }
-    f(cert);
   }
+  if (chunk->first + static_cast<int64_t>(chunk->entries.size()) <
+      min<int64_t>(chunk->first + FLAGS_chunk_size, end)) {
+    LOG(ERROR) << "Missing entry "
+               << chunk->first + chunk->entries.size();
+    chunk->ok = false;
+  }
+
+  if (hash_leaves) {
+    const TreeHasher hasher(unique_ptr<SerialHasher>(new Sha256Hasher));
+    string leaf;
+    for (const auto& entry : chunk->entries) {
+      if (!entry.SerializeForLeaf(&leaf)) {
+        LOG(ERROR) << "Failed to serialize the leaf of entry "
+                   << entry.sequence_number();
+        chunk->ok = false;
+        return;
+      }
+      chunk->leaf_hashes.emplace_back(hasher.HashLeaf(leaf));
+    }
+  }
+}
+
+
+// Reads the entries from |start| up to |end| (exclusive), with
+// --threads threads each reading --chunk_size entries at a time, and
+// calls |f| from this thread with each chunk, in order. Stops at the
+// first chunk with missing entries, or when |f| returns false, and
+// returns whether all the entries were processed.
+bool ForEachChunk(const ReadOnlyDatabase* db, int64_t start, int64_t end,
+                  bool hash_leaves, const function<bool(Chunk*)>& f) {
+  CHECK_GT(FLAGS_threads, 0);
+  CHECK_GT(FLAGS_chunk_size, 0);
+  vector<Chunk> chunks(FLAGS_threads);
+  vector<thread> threads;
+  for (int64_t first = start; first < end;) {
+    // Each round of reads is handed over before starting the next, so
+    // that only a bounded number of entries is in memory.
+    size_t num_chunks(0);
+    for (; num_chunks < chunks.size() && first < end; ++num_chunks) {
+      Chunk* const chunk(&chunks[num_chunks]);
+      chunk->first = first;
+      chunk->leaf_hashes.clear();
+      threads.emplace_back(&ReadChunk, db, end, hash_leaves, chunk);
+      first += FLAGS_chunk_size;
+    }
+    for (auto& t : threads) {
+      t.join();
+    }
+    threads.clear();
+
+    for (size_t i = 0; i < num_chunks; ++i) {
+      if (!f(&chunks[i]) || !chunks[i].ok) {
+        return false;
+      }
+    }
+  }
+  return true;
+}
+
+
+// Returns the sequence number to resume from, along with the tree
+// built until then for verify.
+int64_t ReadCheckpoint(unique_ptr<CompactMerkleTree>* tree) {
+  string data;
+  CompactTreeFrontier checkpoint;
+  if (FLAGS_checkpoint_file.empty() ||
+      !util::ReadBinaryFile(FLAGS_checkpoint_file, &data)) {
+    return -1;
+  }
+  CHECK(checkpoint.ParseFromString(data)) << "Bad checkpoint in "
+                                          << FLAGS_checkpoint_file;
+  if (tree) {
+    *tree = CompactMerkleTree::FromFrontier(
+        checkpoint.tree_size(),
+        vector<string>(checkpoint.node().begin(), checkpoint.node().end()),
+        unique_ptr<SerialHasher>(new Sha256Hasher));
+    CHECK(*tree) << "Bad checkpoint in " << FLAGS_checkpoint_file;
+  }
+  LOG(INFO) << "Resuming from entry " << checkpoint.tree_size();
+  return checkpoint.tree_size();
+}
+
+
+// Records that everything before |next| was processed, along with
+// |tree| if there is one.
+void WriteCheckpoint(int64_t next, const CompactMerkleTree* tree) {
+  if (FLAGS_checkpoint_file.empty()) {
+    return;
+  }
+  CompactTreeFrontier checkpoint;
+  checkpoint.set_tree_size(next);
+  if (tree) {
+    for (const auto& node : tree->Frontier()) {
+      checkpoint.add_node(node);
+    }
+  }
+  string data;
+  CHECK(checkpoint.SerializeToString(&data));
+  const string tmp_file(FLAGS_checkpoint_file + ".tmp");
+  std::ofstream out(tmp_file.c_str(), std::ios::binary | std::ios::trunc);
+  out.write(data.data(), data.size());
+  out.close();
+  PCHECK(out.good() &&
+         rename(tmp_file.c_str(), FLAGS_checkpoint_file.c_str()) == 0)
+      << "Failed to write " << FLAGS_checkpoint_file;
 }
 
 
 int DumpLeafInputs(const ReadOnlyDatabase* db) {
   CHECK_NOTNULL(db);
-  ForEachLeaf(db, [](const LoggedEntry& cert) {
+  const int64_t end(FLAGS_end < std::numeric_limits<int64_t>::max()
+                        ? min(FLAGS_end + 1, db->TreeSize())
+                        : db->TreeSize());
+  ForEachChunk(db, FLAGS_start, end, false, [](Chunk* chunk) {
     string serialized;
-    const SerializeResult r(Serializer::SerializeSCTSignatureInput(
-        cert.contents().sct(), cert.contents().entry(), &serialized));
-    if (r != SerializeResult::OK) {
-      LOG(FATAL) << "Failed to serialize entry with seq# "
-                 << cert.sequence_number() << " : " << r;
-    }
+    for (const auto& cert : chunk->entries) {
+      const SerializeResult r(Serializer::SerializeSCTSignatureInput(
+          cert.contents().sct(), cert.contents().entry(), &serialized));
+      if (r != SerializeResult::OK) {
+        LOG(FATAL) << "Failed to serialize entry with seq# "
+                   << cert.sequence_number() << " : " << r;
+      }
 
-    cout << cert.sequence_number() << " " << ToBase64(serialized) << "\n";
+      cout << cert.sequence_number() << " " << ToBase64(serialized) << "\n";
+    }
+    return true;
   });
   return 0;
 }
 
 
-int main(int argc, char* argv[]) {
-  InitCT(&argc, &argv);
+// Checks the leaf hashes stored with the entries, and that the tree
+// they make up has the root hash of the latest STH.
+int Verify(const ReadOnlyDatabase* db) {
+  CHECK_NOTNULL(db);
+  SignedTreeHead sth;
+  if (db->LatestTreeHead(&sth) != Database::LOOKUP_OK) {
+    LOG(ERROR) << "No tree head to verify against";
+    return 1;
+  }
 
-  if (argc != 2) {
-    Usage();
+  unique_ptr<CompactMerkleTree> tree;
+  int64_t start(ReadCheckpoint(&tree));
+  if (start < 0) {
+    start = 0;
+    tree.reset(
+        new CompactMerkleTree(unique_ptr<SerialHasher>(new Sha256Hasher)));
+  }
+
+  int64_t num_bad_hashes(0);
+  const bool complete(ForEachChunk(
+      db, start, sth.tree_size(), true,
+      [&tree, &num_bad_hashes](Chunk* chunk) {
+        for (size_t i = 0; i < chunk->leaf_hashes.size(); ++i) {
+          const LoggedEntry& entry(chunk->entries[i]);
+          if (!entry.merkle_leaf_hash().empty() &&
+              entry.merkle_leaf_hash() != chunk->leaf_hashes[i]) {
+            LOG(ERROR) << "Bad leaf hash for entry "
+                       << entry.sequence_number();
+            ++num_bad_hashes;
+          }
+          tree->AddLeafHash(chunk->leaf_hashes[i]);
+        }
+        WriteCheckpoint(tree->LeafCount(), tree.get());
+        return true;
+      }));
+  if (!complete) {
     return 1;
   }
 
-  // ------8<----------8<---------8<-----------
+  if (tree->CurrentRoot() != sth.sha256_root_hash()) {
+    LOG(ERROR) << "Root hash mismatch for the tree head of size "
+               << sth.tree_size();
+    return 1;
+  }
+  LOG(INFO) << "Verified " << sth.tree_size() << " entries";
+  return num_bad_hashes == 0 ? 0 : 1;
+}
+
+
+// Appends to |ranges| the leaf ranges [first, second) whose Merkle
+// tree hashes make up the consistency proof from the tree of size
+// |old_size| to the subtree of leaves |lo| to |hi|, following
+// SUBPROOF in RFC 6962, section 2.1.2.
+void ConsistencyProofRanges(int64_t old_size, int64_t lo, int64_t hi,
+                            bool complete_subtree,
+                            vector<pair<int64_t, int64_t>>* ranges) {
+  if (old_size == hi - lo) {
+    if (!complete_subtree) {
+      ranges->emplace_back(lo, hi);
+    }
+    return;
+  }
+  int64_t split(1);
+  while (split * 2 < hi - lo) {
+    split *= 2;
+  }
+  if (old_size <= split) {
+    ConsistencyProofRanges(old_size, lo, lo + split, complete_subtree,
+                           ranges);
+    ranges->emplace_back(lo + split, hi);
+  } else {
+    ConsistencyProofRanges(old_size - split, lo + split, hi, false, ranges);
+    ranges->emplace_back(lo, lo + split);
+  }
+}
+
+
+// Checks tree heads against the entries of a database as their leaf
+// hashes are added in order, and builds the consistency proofs between
+// them, while only keeping compact trees. The nodes of a consistency
+// proof from size m to size n are either complete subtrees that end by
+// m, which are in the frontier of the tree of size m, complete
+// subtrees after m, which are hashed as their leaves go by, or an
+// incomplete subtree that ends at n, which is made up of the frontier
+// of the tree of size n. The complete subtrees after m do not overlap,
+// so only one of them is built at a time.
+class TreeHeadAuditor {
+ public:
+  // |sths| can be in any order.
+  explicit TreeHeadAuditor(const vector<SignedTreeHead>& sths);
+
+  int64_t MaxTreeSize() const {
+    return sizes_.empty() ? 0 : sizes_.back().tree_size;
+  }
+
+  // Adds the next leaf, checking the tree heads of the new tree size.
+  void AddLeafHash(const string& hash);
+
+  // Number of tree heads that turned out to be wrong so far.
+  int64_t num_errors() const {
+    return num_errors_;
+  }
+
+ private:
+  // The tree heads of one tree size, and the consistency proof from
+  // the previous tree size.
+  struct TreeSize {
+    int64_t tree_size;
+    vector<SignedTreeHead> sths;
+    vector<pair<int64_t, int64_t>> proof_ranges;
+    vector<string> proof;
+  };
+
+  // A complete subtree of a consistency proof that starts at or after
+  // the old tree size, which is hashed as its leaves go by.
+  struct PendingNode {
+    int64_t first;
+    int64_t end;
+    string* node;
+  };
+
+  void ReachedTreeSize(size_t i);
+
+  const TreeHasher hasher_;
+  CompactMerkleTree tree_;
+  // In increasing order of tree size.
+  vector<TreeSize> sizes_;
+  size_t next_size_;
+  // In increasing order.
+  vector<PendingNode> pending_;
+  size_t next_pending_;
+  unique_ptr<CompactMerkleTree> pending_tree_;
+  int64_t num_errors_;
+};
+
+
+TreeHeadAuditor::TreeHeadAuditor(const vector<SignedTreeHead>& sths)
+    : hasher_(unique_ptr<SerialHasher>(new Sha256Hasher)),
+      tree_(unique_ptr<SerialHasher>(new Sha256Hasher)),
+      next_size_(0),
+      next_pending_(0),
+      num_errors_(0) {
+  vector<SignedTreeHead> sorted(sths);
+  std::sort(sorted.begin(), sorted.end(),
+            [](const SignedTreeHead& a, const SignedTreeHead& b) {
+              return a.tree_size() < b.tree_size() ||
+                     (a.tree_size() == b.tree_size() &&
+                      a.timestamp() < b.timestamp());
+            });
+  for (const auto& sth : sorted) {
+    if (sizes_.empty() || sizes_.back().tree_size != sth.tree_size()) {
+      if (!sizes_.empty() &&
+          sizes_.back().sths.back().timestamp() >= sth.timestamp()) {
+        LOG(ERROR) << "Tree head of size " << sth.tree_size()
+                   << " is not newer than one of size "
+                   << sizes_.back().tree_size;
+        ++num_errors_;
+      }
+      sizes_.emplace_back();
+      sizes_.back().tree_size = sth.tree_size();
+    }
+    sizes_.back().sths.push_back(sth);
+  }
+
+  for (size_t i = 1; i < sizes_.size(); ++i) {
+    TreeSize* const size(&sizes_[i]);
+    const int64_t old_size(sizes_[i - 1].tree_size);
+    if (old_size == 0) {
+      continue;
+    }
+    ConsistencyProofRanges(old_size, 0, size->tree_size, true,
+                           &size->proof_ranges);
+    size->proof.resize(size->proof_ranges.size());
+    for (size_t j = 0; j < size->proof_ranges.size(); ++j) {
+      const pair<int64_t, int64_t>& range(size->proof_ranges[j]);
+      const int64_t leaves(range.second - range.first);
+      if (range.first >= old_size &&
+          (range.second < size->tree_size || (leaves & (leaves - 1)) == 0)) {
+        pending_.push_back(
+            PendingNode{range.first, range.second, &size->proof[j]});
+      }
+    }
+  }
+  std::sort(pending_.begin(), pending_.end(),
+            [](const PendingNode& a, const PendingNode& b) {
+              return a.first < b.first;
+            });
+
+  // The empty tree is reached before any leaf is added.
+  if (!sizes_.empty() && sizes_.front().tree_size == 0) {
+    ReachedTreeSize(next_size_++);
+  }
+}
+
+
+void TreeHeadAuditor::AddLeafHash(const string& hash) {
+  const int64_t index(tree_.LeafCount());
+  if (next_pending_ < pending_.size() &&
+      pending_[next_pending_].first == index) {
+    pending_tree_.reset(
+        new CompactMerkleTree(unique_ptr<SerialHasher>(new Sha256Hasher)));
+  }
+  if (pending_tree_) {
+    pending_tree_->AddLeafHash(hash);
+    if (pending_[next_pending_].end == index + 1) {
+      *pending_[next_pending_].node = pending_tree_->CurrentRoot();
+      pending_tree_.reset();
+      ++next_pending_;
+    }
+  }
+
+  tree_.AddLeafHash(hash);
+  if (next_size_ < sizes_.size() &&
+      sizes_[next_size_].tree_size == index + 1) {
+    ReachedTreeSize(next_size_++);
+  }
+}
+
+
+void TreeHeadAuditor::ReachedTreeSize(size_t i) {
+  TreeSize* const size(&sizes_[i]);
+  const string root(tree_.CurrentRoot());
+  for (const auto& sth : size->sths) {
+    if (sth.sha256_root_hash() != root) {
+      LOG(ERROR) << "Root hash mismatch for the tree head of size "
+                 << sth.tree_size() << " and timestamp " << sth.timestamp();
+      ++num_errors_;
+    }
+  }
+
+  const vector<string>& frontier(tree_.Frontier());
+  // Finish the consistency proof to this tree size, with the
+  // incomplete subtree that ends here.
+  for (size_t i = 0; i < size->proof_ranges.size(); ++i) {
+    const pair<int64_t, int64_t>& range(size->proof_ranges[i]);
+    if (range.second != size->tree_size || !size->proof[i].empty()) {
+      continue;
+    }
+    const int64_t leaves(range.second - range.first);
+    string node;
+    for (size_t level = 0; leaves >> level > 0; ++level) {
+      if ((leaves >> level) & 1) {
+        node = node.empty() ? frontier[level]
+                            : hasher_.HashChildren(frontier[level], node);
+      }
+    }
+    size->proof[i] = node;
+  }
+  if (!size->proof.empty()) {
+    cout << sizes_[i - 1].tree_size << " " << size->tree_size;
+    for (const auto& node : size->proof) {
+      CHECK(!node.empty());
+      cout << " " << ToBase64(node);
+    }
+    cout << "\n";
+    size->proof_ranges.clear();
+    size->proof.clear();
+  }
+
+  // Start the consistency proof from this tree size, with the
+  // complete subtrees that end by here.
+  if (i + 1 == sizes_.size()) {
+    return;
+  }
+  TreeSize* const next(&sizes_[i + 1]);
+  for (size_t j = 0; j < next->proof_ranges.size(); ++j) {
+    const pair<int64_t, int64_t>& range(next->proof_ranges[j]);
+    if (range.second <= size->tree_size) {
+      size_t level(0);
+      while (int64_t{1} << level < range.second - range.first) {
+        ++level;
+      }
+      CHECK_LT(level, frontier.size());
+      CHECK(!frontier[level].empty());
+      next->proof[j] = frontier[level];
+    }
+  }
+}
+
+
+// Checks the tree heads in |sth_files| and the latest tree head of
+// |db| against its entries, and outputs the consistency proofs from
+// each tree size to the next, one per line, as the two tree sizes
+// followed by the nodes of the proof in base64.
+int Audit(const ReadOnlyDatabase* db, const vector<string>& sth_files) {
+  CHECK_NOTNULL(db);
+  vector<SignedTreeHead> sths;
+  for (const auto& file : sth_files) {
+    string data;
+    sths.emplace_back();
+    if (!util::ReadBinaryFile(file, &data) ||
+        !sths.back().ParseFromString(data)) {
+      LOG(ERROR) << "Failed to read a tree head from " << file;
+      return 1;
+    }
+  }
+  SignedTreeHead latest;
+  if (db->LatestTreeHead(&latest) == Database::LOOKUP_OK) {
+    sths.push_back(latest);
+  }
+  if (sths.empty()) {
+    LOG(ERROR) << "No tree head to audit";
+    return 1;
+  }
+
+  TreeHeadAuditor auditor(sths);
+  if (!ForEachChunk(db, 0, auditor.MaxTreeSize(), true,
+                    [&auditor](Chunk* chunk) {
+                      for (const auto& hash : chunk->leaf_hashes) {
+                        auditor.AddLeafHash(hash);
+                      }
+                      return true;
+                    })) {
+    return 1;
+  }
+  LOG(INFO) << "Audited " << sths.size() << " tree heads over "
+            << auditor.MaxTreeSize() << " entries";
+  return auditor.num_errors() == 0 ? 0 : 1;
+}
+
+
+// Copies the entries to |dest|, and then the latest tree head and tree
+// frontier once it has the entries they cover.
+int Copy(const ReadOnlyDatabase* db, Database* dest) {
+  CHECK_NOTNULL(db);
+  CHECK_NOTNULL(dest);
+  const int64_t resume(ReadCheckpoint(nullptr));
+  const int64_t start(resume >= 0 ? resume : FLAGS_start);
+  const int64_t end(FLAGS_end < std::numeric_limits<int64_t>::max()
+                        ? min(FLAGS_end + 1, db->TreeSize())
+                        : db->TreeSize());
+
+  dest->BeginBulkLoad();
+  const bool complete(
+      ForEachChunk(db, start, end, false, [dest](Chunk* chunk) {
+        if (!chunk->entries.empty() &&
+            dest->CreateSequencedEntries(chunk->entries) != Database::OK) {
+          LOG(ERROR) << "Entries from " << chunk->first
+                     << " conflict with those of the destination";
+          return false;
+        }
+        WriteCheckpoint(chunk->first + chunk->entries.size(), nullptr);
+        return true;
+      }));
+  dest->EndBulkLoad();
+  if (!complete) {
+    return 1;
+  }
+
+  SignedTreeHead sth;
+  if (db->LatestTreeHead(&sth) == Database::LOOKUP_OK &&
+      sth.tree_size() <= dest->TreeSize() &&
+      dest->WriteTreeHead(sth) != Database::OK) {
+    LOG(ERROR) << "Failed to copy the tree head";
+    return 1;
+  }
+  CompactTreeFrontier frontier;
+  if (db->LatestTreeFrontier(&frontier) == Database::LOOKUP_OK &&
+      frontier.tree_size() <= dest->TreeSize()) {
+    dest->WriteTreeFrontier(frontier);
+  }
+  LOG(INFO) << "Copied entries " << start << " to " << end;
+  return 0;
+}
+
+
+int ExportSnapshot(const ReadOnlyDatabase* db) {
+  CHECK(!FLAGS_snapshot_dir.empty()) << "--snapshot_dir is required";
+  const util::Status status(
+      cert_trans::ExportSnapshot(CHECK_NOTNULL(db), FLAGS_snapshot_dir));
+  if (!status.ok()) {
+    LOG(ERROR) << "Failed to export snapshot: " << status;
+    return 1;
+  }
+  return 0;
+}
+
+
+int ImportSnapshot(Database* db) {
+  CHECK(!FLAGS_snapshot_dir.empty()) << "--snapshot_dir is required";
+  const util::Status status(
+      cert_trans::ImportSnapshot(FLAGS_snapshot_dir, CHECK_NOTNULL(db)));
+  if (!status.ok()) {
+    LOG(ERROR) << "Failed to import snapshot: " << status;
+    return 1;
+  }
+  return 0;
+}
+
+
+// Returns nullptr if none of the databases is given.
+unique_ptr<Database> OpenDatabase(const string& sqlite_db,
+                                  const string& leveldb_db,
+                                  const string& rocksdb_db,
+                                  const string& segmented_db,
+                                  const string& cert_dir,
+                                  const string& tree_dir,
+                                  const string& meta_dir) {
   // TODO(alcutter): Refactor this out into a common CreateDatabase() call
   // somewhere.
-  if (!FLAGS_sqlite_db.empty() + !FLAGS_leveldb_db.empty() +
-          (!FLAGS_cert_dir.empty() | !FLAGS_tree_dir.empty()) !=
+  if (!sqlite_db.empty() + !leveldb_db.empty() + !rocksdb_db.empty() +
+          !segmented_db.empty() + (!cert_dir.empty() | !tree_dir.empty()) >
       1) {
     LOG(FATAL) << "Must only specify one database type.";
   }
 
-  if (FLAGS_sqlite_db.empty() && FLAGS_leveldb_db.empty()) {
-    CHECK_NE(FLAGS_cert_dir, FLAGS_tree_dir)
+  if (!sqlite_db.empty()) {
+    return unique_ptr<Database>(new SQLiteDB(sqlite_db));
+  } else if (!leveldb_db.empty()) {
+    return unique_ptr<Database>(new LevelDB(leveldb_db));
+  } else if (!segmented_db.empty()) {
+    return unique_ptr<Database>(new SegmentedDB(segmented_db));
+  } else if (!rocksdb_db.empty()) {
+#ifdef HAVE_ROCKSDB
+    return unique_ptr<Database>(new RocksDB(rocksdb_db));
+#else
+    LOG(FATAL) << "RocksDB database given, but built without RocksDB "
+                  "support.";
+#endif
+  } else if (!cert_dir.empty() || !tree_dir.empty()) {
+    CHECK_NE(cert_dir, tree_dir)
         << "Certificate directory and tree directory must differ";
+    return unique_ptr<Database>(
+        new FileDB(new FileStorage(cert_dir, FLAGS_cert_storage_depth),
+                   new FileStorage(tree_dir, FLAGS_tree_storage_depth),
+                   new FileStorage(meta_dir, 0)));
   }
 
-  unique_ptr<ReadOnlyDatabase> db;
+  return nullptr;
+}
+
 
-  if (!FLAGS_sqlite_db.empty()) {
-    db.reset(new SQLiteDB(FLAGS_sqlite_db));
-  } else if (!FLAGS_leveldb_db.empty()) {
-    db.reset(new LevelDB(FLAGS_leveldb_db));
-  } else {
-    db.reset(
-        new FileDB(new FileStorage(FLAGS_cert_dir, FLAGS_cert_storage_depth),
-                   new FileStorage(FLAGS_tree_dir, FLAGS_tree_storage_depth),
-                   new FileStorage(FLAGS_meta_dir, 0)));
+int main(int argc, char* argv[]) {
+  InitCT(&argc, &argv);
+  // Hashing the leaves of the entries needs it, when verifying or
+  // writing them.
+  ConfigureSerializerForV1CT();
+
+  if (argc < 2 || (argc > 2 && strcmp(argv[1], "audit") != 0)) {
+    Usage();
+    return 1;
+  }
+
+  // This one is done with the database closed.
+  if (strcmp(argv[1], "upgrade_leveldb") == 0) {
+    CHECK(!FLAGS_leveldb_db.empty()) << "Must specify --leveldb_db.";
+    LevelDB::UpgradeSchema(FLAGS_leveldb_db);
+    return 0;
   }
-  // ------8<----------8<---------8<-----------
+
+  unique_ptr<Database> db(OpenDatabase(
+      FLAGS_sqlite_db, FLAGS_leveldb_db, FLAGS_rocksdb_db, FLAGS_segmented_db,
+      FLAGS_cert_dir, FLAGS_tree_dir, FLAGS_meta_dir));
+  CHECK(db) << "Must specify a database.";
 
   if (strcmp(argv[1], "dump_leaf_inputs") == 0) {
     return DumpLeafInputs(db.get());
+  } else if (strcmp(argv[1], "verify") == 0) {
+    return Verify(db.get());
+  } else if (strcmp(argv[1], "audit") == 0) {
+    return Audit(db.get(), vector<string>(argv + 2, argv + argc));
+  } else if (strcmp(argv[1], "copy") == 0) {
+    unique_ptr<Database> dest(OpenDatabase(
+        FLAGS_dest_sqlite_db, FLAGS_dest_leveldb_db, FLAGS_dest_rocksdb_db,
+        FLAGS_dest_segmented_db, FLAGS_dest_cert_dir, FLAGS_dest_tree_dir,
+        FLAGS_dest_meta_dir));
+    CHECK(dest) << "Must specify a destination database.";
+    return Copy(db.get(), dest.get());
+  } else if (strcmp(argv[1], "export_snapshot") == 0) {
+    return ExportSnapshot(db.get());
+  } else if (strcmp(argv[1], "import_snapshot") == 0) {
+    return ImportSnapshot(db.get());
   } else {
     Usage();
     return 1;
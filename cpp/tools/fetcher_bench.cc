@@ -0,0 +1,577 @@
+// Measures how quickly the fetcher (FetchLogEntries(), the core of
+// ContinuousFetcher) copies a log from its peers, so that its tuning
+// (--fetcher_batch_size, --fetcher_concurrent_fetches, ...) and
+// changes to it can be judged on data rather than on a live cluster.
+//
+// The peers are simulated in-process: each answers binary get-entries
+// requests for deterministic entries, after --peer_latency_ms and the
+// time to send the response at --peer_bandwidth_mbps, serving at most
+// --peer_max_batch entries at a time and failing --peer_error_rate of
+// the requests. Those flags take a comma-separated list, one value per
+// peer, the last one applying to the peers left, so that a mix of fast
+// and slow peers can be simulated.
+//
+// The entries are written to a new --backend database in --db_dir,
+// until it has --num_entries of them. If --growth_rate is set, the
+// peers start with --initial_entries and gain that many entries per
+// second, and the fetcher has to keep up with them.
+//
+// Then reports the throughput in entries per second, the time it took
+// to catch up with the peers once they had all their entries, the peak
+// RSS of the process, and the requests each peer answered.
+
+#include <gflags/gflags.h>
+#include <glog/logging.h>
+#include <openssl/ec.h>
+#include <openssl/evp.h>
+#include <openssl/obj_mac.h>
+#include <openssl/x509.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cinttypes>
+#include <iomanip>
+#include <iostream>
+#include <memory>
+#include <mutex>
+#include <random>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "client/async_log_client.h"
+#include "config.h"
+#include "fetcher/fetcher.h"
+#include "fetcher/peer.h"
+#include "fetcher/peer_group.h"
+#include "log/database.h"
+#include "log/file_db.h"
+#include "log/file_storage.h"
+#include "log/leveldb_db.h"
+#include "log/log_signer.h"
+#include "log/log_verifier.h"
+#include "log/logged_entry.h"
+#ifdef HAVE_ROCKSDB
+#include "log/rocksdb_db.h"
+#endif
+#include "log/segmented_db.h"
+#include "log/sqlite_db.h"
+#include "merkletree/merkle_verifier.h"
+#include "merkletree/serial_hasher.h"
+#include "net/url_fetcher.h"
+#include "proto/binary_entries.h"
+#include "proto/cert_serializer.h"
+#include "util/init.h"
+#include "util/libevent_wrapper.h"
+#include "util/sync_task.h"
+#include "util/task.h"
+#include "util/thread_pool.h"
+
+DEFINE_string(backend, "leveldb",
+              "Database to write to: file, sqlite, leveldb, rocksdb or "
+              "segmented");
+DEFINE_string(db_dir, "",
+              "Directory to create the database in, which must be empty");
+DEFINE_int64(num_entries, 1000000, "Number of entries to fetch");
+DEFINE_int64(initial_entries, -1,
+             "Number of entries the peers have at the start, if "
+             "--growth_rate is set (-1 for all of them)");
+DEFINE_double(growth_rate, 0,
+              "Entries per second the peers gain, up to --num_entries");
+DEFINE_int32(num_peers, 3, "Number of simulated peers");
+DEFINE_string(peer_latency_ms, "20",
+              "Round-trip latency of each peer, in milliseconds");
+DEFINE_string(peer_bandwidth_mbps, "100",
+              "Bandwidth of each peer, in megabits per second (0 for "
+              "unlimited)");
+DEFINE_string(peer_max_batch, "1000",
+              "Most entries each peer returns at once (0 for no limit)");
+DEFINE_string(peer_error_rate, "0",
+              "Fraction of the requests each peer fails");
+DEFINE_bool(fetch_scts, true,
+            "Whether to fetch the SCTs of the entries, and so verify them, "
+            "as the nodes of a cluster do");
+DEFINE_int32(entry_size, 1500,
+             "Size of the leaf certificate of each entry, in bytes");
+DEFINE_int32(chain_size, 2,
+             "Number of certificates in the chain of each entry");
+DEFINE_int32(num_threads, 8, "Threads handling the responses");
+DEFINE_int32(num_verify_threads, 4, "Threads verifying the SCTs");
+DEFINE_uint64(seed, 0, "Seed for the errors of the peers");
+
+using cert_trans::AsyncLogClient;
+using cert_trans::Database;
+using cert_trans::FileDB;
+using cert_trans::FileStorage;
+using cert_trans::LevelDB;
+using cert_trans::LoggedEntry;
+using cert_trans::Peer;
+using cert_trans::PeerGroup;
+#ifdef HAVE_ROCKSDB
+using cert_trans::RocksDB;
+#endif
+using cert_trans::SQLiteDB;
+using cert_trans::SegmentedDB;
+using cert_trans::ThreadPool;
+using cert_trans::URL;
+using cert_trans::UrlFetcher;
+using cert_trans::WriteBinaryEntry;
+using std::atomic;
+using std::chrono::duration;
+using std::chrono::milliseconds;
+using std::chrono::steady_clock;
+using std::cout;
+using std::lock_guard;
+using std::make_shared;
+using std::mutex;
+using std::shared_ptr;
+using std::string;
+using std::unique_ptr;
+using std::vector;
+using util::SyncTask;
+
+namespace libevent = cert_trans::libevent;
+
+namespace {
+
+
+unique_ptr<Database> OpenDatabase() {
+  const string& dir(FLAGS_db_dir);
+  if (FLAGS_backend == "file") {
+    for (const char* sub : {"/certs", "/tree", "/meta"}) {
+      PCHECK(mkdir((dir + sub).c_str(), 0700) == 0);
+    }
+    return unique_ptr<Database>(
+        new FileDB(new FileStorage(dir + "/certs", 3),
+                   new FileStorage(dir + "/tree", 8),
+                   new FileStorage(dir + "/meta", 0)));
+  } else if (FLAGS_backend == "sqlite") {
+    return unique_ptr<Database>(new SQLiteDB(dir + "/sqlite"));
+  } else if (FLAGS_backend == "leveldb") {
+    return unique_ptr<Database>(new LevelDB(dir + "/leveldb"));
+  } else if (FLAGS_backend == "rocksdb") {
+#ifdef HAVE_ROCKSDB
+    return unique_ptr<Database>(new RocksDB(dir + "/rocksdb"));
+#else
+    LOG(FATAL) << "--backend=rocksdb, but built without RocksDB support.";
+#endif
+  } else if (FLAGS_backend == "segmented") {
+    return unique_ptr<Database>(new SegmentedDB(dir + "/segmented"));
+  }
+  LOG(FATAL) << "unknown --backend " << FLAGS_backend;
+}
+
+
+// Parses a comma-separated list of numbers, and returns the one for
+// peer |index|, or the last one if there are fewer.
+double PeerValue(const string& flag, int index) {
+  std::istringstream input(flag);
+  string item;
+  double value(0);
+  for (int i = 0; i <= index && std::getline(input, item, ','); ++i) {
+    CHECK(!item.empty()) << "invalid list: " << flag;
+    value = std::stod(item);
+  }
+  return value;
+}
+
+
+// splitmix64, so that entry |index| has the same contents every time.
+uint64_t Mix(uint64_t x) {
+  x += 0x9e3779b97f4a7c15ULL;
+  x = (x ^ (x >> 30)) * 0xbf58476d1ce4e5b9ULL;
+  x = (x ^ (x >> 27)) * 0x94d049bb133111ebULL;
+  return x ^ (x >> 31);
+}
+
+
+string Bytes(uint64_t seed, size_t size) {
+  string ret(size, '\0');
+  for (size_t i = 0; i < size; i += 8) {
+    const uint64_t r(Mix(seed + i));
+    for (size_t j = 0; j < 8 && i + j < size; ++j) {
+      ret[i + j] = static_cast<char>(r >> (8 * j));
+    }
+  }
+  return ret;
+}
+
+
+// Fills |logged| with entry |index|, whose certificate is unique to
+// it, but without the signature of its SCT.
+void MakeEntry(int64_t index, LoggedEntry* logged) {
+  logged->Clear();
+
+  ct::SignedCertificateTimestamp* const sct(logged->mutable_sct());
+  sct->set_version(ct::V1);
+  sct->set_timestamp(1469000000000ULL + index);
+
+  ct::LogEntry* const entry(logged->mutable_entry());
+  entry->set_type(ct::X509_ENTRY);
+  entry->mutable_x509_entry()->set_leaf_certificate(
+      Bytes(Mix(index), FLAGS_entry_size));
+  for (int i = 0; i < FLAGS_chain_size; ++i) {
+    entry->mutable_x509_entry()->add_certificate_chain(Bytes(3 + i, 1200));
+  }
+}
+
+
+// The SCTs of all the entries, signed ahead of time with a key made up
+// for the occasion, so that the peers do not spend the time the
+// fetcher is measured on signing them.
+class SignedSCTs {
+ public:
+  SignedSCTs();
+
+  const LogVerifier& verifier() const {
+    return *verifier_;
+  }
+
+  // Empty if --fetch_scts is false.
+  const string& sct(int64_t index) const {
+    static const string kNone;
+    return FLAGS_fetch_scts ? scts_[index] : kNone;
+  }
+
+ private:
+  unique_ptr<LogVerifier> verifier_;
+  vector<string> scts_;
+};
+
+
+SignedSCTs::SignedSCTs() {
+  EC_KEY* const key(
+      CHECK_NOTNULL(EC_KEY_new_by_curve_name(NID_X9_62_prime256v1)));
+  CHECK_EQ(1, EC_KEY_generate_key(key));
+  EVP_PKEY* const private_key(CHECK_NOTNULL(EVP_PKEY_new()));
+  CHECK_EQ(1, EVP_PKEY_assign_EC_KEY(private_key, key));
+
+  // The signer and verifier each own their key.
+  unsigned char* der(nullptr);
+  const int der_length(i2d_PUBKEY(private_key, &der));
+  CHECK_GT(der_length, 0);
+  const unsigned char* p(der);
+  EVP_PKEY* const public_key(CHECK_NOTNULL(d2i_PUBKEY(nullptr, &p,
+                                                      der_length)));
+  OPENSSL_free(der);
+  const LogSigner signer(private_key);
+  verifier_.reset(new LogVerifier(
+      new LogSigVerifier(public_key),
+      new MerkleVerifier(unique_ptr<Sha256Hasher>(new Sha256Hasher))));
+
+  if (!FLAGS_fetch_scts) {
+    return;
+  }
+  LOG(INFO) << "signing " << FLAGS_num_entries << " SCTs";
+  scts_.resize(FLAGS_num_entries);
+  vector<std::thread> threads;
+  const int num_threads(std::max(1U, std::thread::hardware_concurrency()));
+  for (int t = 0; t < num_threads; ++t) {
+    threads.emplace_back([this, &signer, t, num_threads]() {
+      LoggedEntry logged;
+      for (int64_t i = t; i < FLAGS_num_entries; i += num_threads) {
+        MakeEntry(i, &logged);
+        CHECK_EQ(LogSigner::OK,
+                 signer.SignCertificateTimestamp(logged.entry(),
+                                                 logged.mutable_sct()));
+        CHECK_EQ(cert_trans::serialization::SerializeResult::OK,
+                 Serializer::SerializeSCT(logged.sct(), &scts_[i]));
+      }
+    });
+  }
+  for (std::thread& thread : threads) {
+    thread.join();
+  }
+}
+
+
+// The entries the peers have, which may grow over time.
+class SimulatedLog {
+ public:
+  explicit SimulatedLog(const SignedSCTs* scts)
+      : scts_(CHECK_NOTNULL(scts)), start_(steady_clock::now()) {
+  }
+
+  int64_t TreeSize() const {
+    if (FLAGS_growth_rate <= 0 || FLAGS_initial_entries < 0) {
+      return FLAGS_num_entries;
+    }
+    const double elapsed(
+        duration<double>(steady_clock::now() - start_).count());
+    return std::min<int64_t>(FLAGS_num_entries,
+                             FLAGS_initial_entries +
+                                 static_cast<int64_t>(elapsed *
+                                                      FLAGS_growth_rate));
+  }
+
+  // When the peers have all their entries.
+  steady_clock::time_point complete_time() const {
+    if (FLAGS_growth_rate <= 0 || FLAGS_initial_entries < 0) {
+      return start_;
+    }
+    return start_ +
+           std::chrono::duration_cast<steady_clock::duration>(duration<double>(
+               (FLAGS_num_entries - FLAGS_initial_entries) /
+               FLAGS_growth_rate));
+  }
+
+  // Appends the binary get-entries records of the entries from |start|
+  // to |end| inclusive to |body|.
+  void AppendEntries(int64_t start, int64_t end, bool include_scts,
+                     string* body) const {
+    LoggedEntry logged;
+    string leaf_input;
+    string extra_data;
+    for (int64_t i = start; i <= end; ++i) {
+      MakeEntry(i, &logged);
+      CHECK(logged.SerializeForLeaf(&leaf_input));
+      CHECK(logged.SerializeExtraData(&extra_data));
+      CHECK_EQ(cert_trans::serialization::SerializeResult::OK,
+               WriteBinaryEntry(leaf_input, extra_data,
+                                include_scts ? scts_->sct(i) : string(),
+                                body));
+    }
+  }
+
+ private:
+  const SignedSCTs* const scts_;
+  const steady_clock::time_point start_;
+};
+
+
+// Answers the binary get-entries requests of an AsyncLogClient as a
+// peer with the given link and limits would.
+class SimulatedPeerFetcher : public UrlFetcher {
+ public:
+  SimulatedPeerFetcher(libevent::Base* base, const SimulatedLog* log,
+                       int index)
+      : base_(CHECK_NOTNULL(base)),
+        log_(CHECK_NOTNULL(log)),
+        latency_(PeerValue(FLAGS_peer_latency_ms, index) / 1000),
+        bytes_per_second_(PeerValue(FLAGS_peer_bandwidth_mbps, index) *
+                          1000000 / 8),
+        max_batch_(PeerValue(FLAGS_peer_max_batch, index)),
+        error_rate_(PeerValue(FLAGS_peer_error_rate, index)),
+        random_(FLAGS_seed + index),
+        link_free_(steady_clock::now()),
+        num_requests_(0),
+        num_errors_(0),
+        num_entries_(0) {
+  }
+
+  void Fetch(const Request& req, Response* resp, util::Task* task) override {
+    resp->status_code = 404;
+    task->Return();
+  }
+
+  void FetchStreaming(const Request& req, Response* resp,
+                      const BodyCallback& body_cb,
+                      util::Task* task) override;
+
+  void WarmUp(const URL& url) override {
+  }
+
+  int64_t num_requests() const {
+    return num_requests_.load();
+  }
+
+  int64_t num_errors() const {
+    return num_errors_.load();
+  }
+
+  int64_t num_entries() const {
+    return num_entries_.load();
+  }
+
+ private:
+  libevent::Base* const base_;
+  const SimulatedLog* const log_;
+  const double latency_;
+  const double bytes_per_second_;
+  const int64_t max_batch_;
+  const double error_rate_;
+
+  mutex lock_;
+  std::mt19937_64 random_;
+  // When the responses sent so far will have gone through the link.
+  steady_clock::time_point link_free_;
+
+  atomic<int64_t> num_requests_;
+  atomic<int64_t> num_errors_;
+  atomic<int64_t> num_entries_;
+};
+
+
+void SimulatedPeerFetcher::FetchStreaming(const Request& req, Response* resp,
+                                          const BodyCallback& body_cb,
+                                          util::Task* task) {
+  ++num_requests_;
+  int64_t start, end;
+  if (req.url.Path().find("get-entries-binary") == string::npos ||
+      sscanf(req.url.Query().c_str(), "start=%" SCNd64 "&end=%" SCNd64,
+             &start, &end) != 2) {
+    resp->status_code = 404;
+    task->Return();
+    return;
+  }
+  end = std::min(end, log_->TreeSize() - 1);
+  if (max_batch_ > 0) {
+    end = std::min(end, start + max_batch_ - 1);
+  }
+
+  bool fail;
+  {
+    lock_guard<mutex> lock(lock_);
+    fail = std::uniform_real_distribution<double>()(random_) < error_rate_;
+  }
+  const shared_ptr<string> body(make_shared<string>());
+  if (fail || start > end) {
+    ++num_errors_;
+    resp->status_code = fail ? 503 : 400;
+  } else {
+    resp->status_code = 200;
+    log_->AppendEntries(
+        start, end, req.url.Query().find("include_scts=true") != string::npos,
+        body.get());
+    num_entries_ += end - start + 1;
+  }
+
+  steady_clock::time_point done;
+  {
+    lock_guard<mutex> lock(lock_);
+    const steady_clock::time_point now(steady_clock::now());
+    link_free_ = std::max(link_free_, now);
+    if (bytes_per_second_ > 0) {
+      link_free_ += std::chrono::duration_cast<steady_clock::duration>(
+          duration<double>(body->size() / bytes_per_second_));
+    }
+    done = link_free_ +
+           std::chrono::duration_cast<steady_clock::duration>(
+               duration<double>(latency_));
+  }
+  base_->Delay(done - steady_clock::now(),
+               task->AddChildWithExecutor(
+                   [body, body_cb, task](util::Task*) {
+                     if (!body->empty() &&
+                         !body_cb(body->data(), body->size())) {
+                       task->Return(util::Status(util::error::ABORTED,
+                                                 "body callback aborted"));
+                       return;
+                     }
+                     task->Return();
+                   },
+                   base_));
+}
+
+
+class SimulatedPeer : public Peer {
+ public:
+  SimulatedPeer(util::Executor* executor, int index,
+                unique_ptr<SimulatedPeerFetcher> fetcher,
+                const SimulatedLog* log)
+      : Peer(unique_ptr<AsyncLogClient>(
+            new AsyncLogClient(executor, fetcher.get(),
+                               "http://peer" + std::to_string(index)))),
+        fetcher_(std::move(fetcher)),
+        log_(CHECK_NOTNULL(log)) {
+  }
+
+  int64_t TreeSize() const override {
+    return log_->TreeSize();
+  }
+
+  const SimulatedPeerFetcher& fetcher() const {
+    return *fetcher_;
+  }
+
+ private:
+  const unique_ptr<SimulatedPeerFetcher> fetcher_;
+  const SimulatedLog* const log_;
+};
+
+
+int64_t PeakRssKb() {
+  struct rusage usage;
+  PCHECK(getrusage(RUSAGE_SELF, &usage) == 0);
+  return usage.ru_maxrss;
+}
+
+
+}  // namespace
+
+
+int main(int argc, char* argv[]) {
+  util::InitCT(&argc, &argv);
+  ConfigureSerializerForV1CT();
+
+  CHECK(!FLAGS_db_dir.empty()) << "--db_dir is required";
+  CHECK_GT(FLAGS_num_entries, 0);
+  CHECK_GT(FLAGS_num_peers, 0);
+  CHECK_LE(FLAGS_initial_entries, FLAGS_num_entries);
+
+  const shared_ptr<libevent::Base> base(make_shared<libevent::Base>());
+  libevent::EventPumpThread pump(base);
+  ThreadPool pool(FLAGS_num_threads);
+  ThreadPool verify_pool(FLAGS_num_verify_threads);
+
+  const SignedSCTs scts;
+  const SimulatedLog log(&scts);
+  const shared_ptr<PeerGroup> peer_group(make_shared<PeerGroup>(
+      FLAGS_fetch_scts));
+  vector<shared_ptr<SimulatedPeer>> peers;
+  for (int i = 0; i < FLAGS_num_peers; ++i) {
+    peers.emplace_back(make_shared<SimulatedPeer>(
+        &pool, i, unique_ptr<SimulatedPeerFetcher>(
+                   new SimulatedPeerFetcher(base.get(), &log, i)),
+        &log));
+    peer_group->Add(peers.back());
+  }
+
+  const unique_ptr<Database> db(OpenDatabase());
+  CHECK_EQ(0, db->TreeSize()) << FLAGS_db_dir << " is not empty";
+  const int64_t start_rss_kb(PeakRssKb());
+  const steady_clock::time_point start(steady_clock::now());
+  int num_rounds(0);
+  while (db->TreeSize() < FLAGS_num_entries) {
+    // As ContinuousFetcher does, fetch again a little after catching
+    // up with the peers, if they are still growing.
+    if (num_rounds++ > 0 && db->TreeSize() >= log.TreeSize()) {
+      std::this_thread::sleep_for(milliseconds(100));
+      continue;
+    }
+    SyncTask task(&pool);
+    FetchLogEntries(db.get(), peer_group, &scts.verifier(), &verify_pool,
+                    task.task());
+    task.Wait();
+    LOG_IF(WARNING, !task.status().ok()) << "fetch: " << task.status();
+    LOG(INFO) << "fetched " << db->TreeSize() << " entries";
+  }
+  const steady_clock::time_point end(steady_clock::now());
+
+  const double secs(duration<double>(end - start).count());
+  const double catch_up_secs(
+      duration<double>(end - std::max(start, log.complete_time())).count());
+  cout << std::fixed << std::setprecision(1) << FLAGS_num_entries
+       << " entries from " << FLAGS_num_peers << " peers into "
+       << FLAGS_backend << ": " << secs << " secs, "
+       << FLAGS_num_entries / secs << " entries/s, caught up "
+       << catch_up_secs << " secs after the peers were complete, peak RSS "
+       << PeakRssKb() << " kB (" << start_rss_kb << " kB before fetching)"
+       << std::endl;
+
+  cout << std::left << std::setw(8) << "peer" << std::right << std::setw(12)
+       << "requests" << std::setw(12) << "errors" << std::setw(14)
+       << "entries" << std::endl;
+  for (size_t i = 0; i < peers.size(); ++i) {
+    const SimulatedPeerFetcher& fetcher(peers[i]->fetcher());
+    cout << std::left << std::setw(8) << i << std::right << std::setw(12)
+         << fetcher.num_requests() << std::setw(12) << fetcher.num_errors()
+         << std::setw(14) << fetcher.num_entries() << std::endl;
+  }
+  return 0;
+}
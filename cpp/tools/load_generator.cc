@@ -0,0 +1,551 @@
+// Offers a configurable mix of requests to a log (ct-server or
+// ct-mirror) at a target rate, and reports their latency and error
+// rates, to check a deployment's capacity before rolling it out.
+//
+// Requests are started on schedule whether or not earlier ones have
+// finished, so that a slow server shows up as latency rather than as
+// a lower offered load. Those which would exceed --max_in_flight are
+// not sent, and are reported as "skipped".
+
+#include <dirent.h>
+#include <gflags/gflags.h>
+#include <glog/logging.h>
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <iomanip>
+#include <iostream>
+#include <memory>
+#include <mutex>
+#include <random>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "client/async_log_client.h"
+#include "log/cert.h"
+#include "log/logged_entry.h"
+#include "merkletree/serial_hasher.h"
+#include "merkletree/tree_hasher.h"
+#include "monitoring/counter.h"
+#include "monitoring/histogram.h"
+#include "net/url_fetcher.h"
+#include "proto/cert_serializer.h"
+#include "proto/ct.pb.h"
+#include "util/init.h"
+#include "util/libevent_wrapper.h"
+#include "util/thread_pool.h"
+#include "util/util.h"
+
+DEFINE_string(log_server, "http://localhost:8888",
+              "Base URL of the log to send requests to");
+DEFINE_double(qps, 100, "Requests to start per second, of all kinds");
+DEFINE_int32(duration_secs, 60, "How long to generate load for");
+DEFINE_int32(max_in_flight, 1000,
+             "Requests due while this many are outstanding are skipped");
+DEFINE_int32(report_interval_secs, 10,
+             "How often to log the results so far (0 to only report at the "
+             "end)");
+DEFINE_int32(num_threads, 8, "Threads handling the responses");
+DEFINE_string(chains_dir, "",
+              "Directory of PEM files, each holding a certificate chain to "
+              "submit with add-chain");
+DEFINE_string(pre_chains_dir, "",
+              "Directory of PEM files, each holding a precertificate chain "
+              "to submit with add-pre-chain");
+DEFINE_int32(add_chain_weight, 0, "Relative share of add-chain requests");
+DEFINE_int32(add_pre_chain_weight, 0,
+             "Relative share of add-pre-chain requests");
+DEFINE_int32(get_entries_weight, 1,
+             "Relative share of get-entries requests, which sweep the tree "
+             "from start to end and around again");
+DEFINE_int32(get_entries_batch_size, 256,
+             "Number of entries asked for by each get-entries request");
+DEFINE_int32(get_proof_weight, 1,
+             "Relative share of get-proof-by-hash requests, for leaves "
+             "returned by earlier get-entries requests");
+DEFINE_int32(get_consistency_weight, 1,
+             "Relative share of get-sth-consistency requests, between a "
+             "random earlier tree size and the latest STH");
+DEFINE_int32(sth_refresh_secs, 1,
+             "How often to fetch the latest STH, which is what the other "
+             "requests are made against");
+DEFINE_uint64(seed, 0, "Seed for choosing the requests");
+
+using cert_trans::AsyncLogClient;
+using cert_trans::CertChain;
+using cert_trans::Counter;
+using cert_trans::Histogram;
+using cert_trans::LoggedEntry;
+using cert_trans::PreCertChain;
+using cert_trans::ThreadPool;
+using cert_trans::UrlFetcher;
+using std::chrono::duration;
+using std::chrono::duration_cast;
+using std::chrono::seconds;
+using std::chrono::steady_clock;
+using std::condition_variable;
+using std::deque;
+using std::lock_guard;
+using std::make_shared;
+using std::mutex;
+using std::shared_ptr;
+using std::string;
+using std::unique_lock;
+using std::unique_ptr;
+using std::vector;
+
+namespace libevent = cert_trans::libevent;
+
+namespace {
+
+
+const char kAddChain[] = "add-chain";
+const char kAddPreChain[] = "add-pre-chain";
+const char kGetEntries[] = "get-entries";
+const char kGetProof[] = "get-proof-by-hash";
+const char kGetConsistency[] = "get-sth-consistency";
+const char kGetSTH[] = "get-sth";
+
+// How many leaf hashes to keep for get-proof-by-hash requests.
+const size_t kMaxLeafHashes = 100000;
+
+
+Histogram<string>* latency_ms(
+    Histogram<string>::New("load_generator_latency_ms", "request",
+                           "Latency of the requests sent, in milliseconds."));
+
+Counter<string, string>* requests(Counter<string, string>::New(
+    "load_generator_requests", "request", "result",
+    "Number of requests due, by result."));
+
+
+const char* ResultName(AsyncLogClient::Status status) {
+  switch (status) {
+    case AsyncLogClient::OK:
+      return "ok";
+    case AsyncLogClient::BAD_RESPONSE:
+      return "bad-response";
+    case AsyncLogClient::UNKNOWN_ERROR:
+      return "unknown-error";
+    case AsyncLogClient::INVALID_INPUT:
+      return "invalid-input";
+  }
+  LOG(FATAL) << "unknown status " << status;
+}
+
+
+// Reads every regular file in |dir|, which must not be empty, as a
+// chain of type |ChainType|.
+template <class ChainType>
+vector<unique_ptr<ChainType>> ReadChains(const string& dir) {
+  vector<unique_ptr<ChainType>> chains;
+  if (dir.empty()) {
+    return chains;
+  }
+  DIR* const handle(opendir(dir.c_str()));
+  PCHECK(handle) << "could not open " << dir;
+  while (const dirent* const ent = readdir(handle)) {
+    const string path(dir + "/" + ent->d_name);
+    string pem;
+    if (ent->d_name[0] == '.' || !util::ReadTextFile(path, &pem)) {
+      continue;
+    }
+    unique_ptr<ChainType> chain(new ChainType(pem));
+    if (!chain->IsLoaded()) {
+      LOG(WARNING) << "skipping " << path << ", which is not a valid chain";
+      continue;
+    }
+    chains.emplace_back(std::move(chain));
+  }
+  closedir(handle);
+  CHECK(!chains.empty()) << "no chains in " << dir;
+  LOG(INFO) << "read " << chains.size() << " chains from " << dir;
+  return chains;
+}
+
+
+class LoadGenerator {
+ public:
+  LoadGenerator(AsyncLogClient* client,
+                vector<unique_ptr<CertChain>> chains,
+                vector<unique_ptr<PreCertChain>> pre_chains)
+      : client_(CHECK_NOTNULL(client)),
+        chains_(std::move(chains)),
+        pre_chains_(std::move(pre_chains)),
+        random_(FLAGS_seed),
+        kinds_({{kAddChain, &LoadGenerator::AddChain},
+                {kAddPreChain, &LoadGenerator::AddPreChain},
+                {kGetEntries, &LoadGenerator::GetEntries},
+                {kGetProof, &LoadGenerator::GetProof},
+                {kGetConsistency, &LoadGenerator::GetConsistency}}),
+        in_flight_(0),
+        next_chain_(0),
+        next_entry_(0) {
+    CHECK(FLAGS_add_chain_weight == 0 || !chains_.empty())
+        << "--add_chain_weight needs --chains_dir";
+    CHECK(FLAGS_add_pre_chain_weight == 0 || !pre_chains_.empty())
+        << "--add_pre_chain_weight needs --pre_chains_dir";
+    const vector<int> weights{FLAGS_add_chain_weight,
+                              FLAGS_add_pre_chain_weight,
+                              FLAGS_get_entries_weight, FLAGS_get_proof_weight,
+                              FLAGS_get_consistency_weight};
+    for (size_t i = 0; i < weights.size(); ++i) {
+      CHECK_GE(weights[i], 0) << kinds_[i].first;
+    }
+    pick_kind_ = std::discrete_distribution<size_t>(weights.begin(),
+                                                    weights.end());
+  }
+
+  // Fetches the STH the first requests are made against.
+  void Init();
+
+  // Starts requests at --qps for --duration_secs, then waits for the
+  // outstanding ones to finish.
+  void Run();
+
+ private:
+  typedef std::function<void(AsyncLogClient::Status)> Callback;
+  // Sends a request against the STH given.
+  typedef void (LoadGenerator::*Sender)(const ct::SignedTreeHead& sth);
+
+  // Returns a callback which records the outcome of |request|, then
+  // calls |done|, if any, with its status.
+  Callback Start(const char* request, const Callback& done = Callback());
+
+  void Skip(const char* request);
+  void SendNext();
+  void RefreshSTH();
+  void AddChain(const ct::SignedTreeHead& sth);
+  void AddPreChain(const ct::SignedTreeHead& sth);
+  void GetEntries(const ct::SignedTreeHead& sth);
+  void GetProof(const ct::SignedTreeHead& sth);
+  void GetConsistency(const ct::SignedTreeHead& sth);
+
+  void AddLeafHashes(const vector<AsyncLogClient::Entry>& entries);
+  void WaitForRequests();
+
+  AsyncLogClient* const client_;
+  const vector<unique_ptr<CertChain>> chains_;
+  const vector<unique_ptr<PreCertChain>> pre_chains_;
+
+  // Only used by the thread calling Run().
+  std::mt19937_64 random_;
+  const vector<std::pair<const char*, Sender>> kinds_;
+  std::discrete_distribution<size_t> pick_kind_;
+
+  mutex lock_;
+  condition_variable finished_;
+  int in_flight_;
+  ct::SignedTreeHead sth_;
+  size_t next_chain_;
+  int64_t next_entry_;
+  deque<string> leaf_hashes_;
+};
+
+
+void LoadGenerator::Init() {
+  ct::SignedTreeHead sth;
+  AsyncLogClient::Status status(AsyncLogClient::UNKNOWN_ERROR);
+  mutex done_lock;
+  condition_variable done_cv;
+  bool done(false);
+  client_->GetSTH(&sth, [&](AsyncLogClient::Status s) {
+    lock_guard<mutex> lock(done_lock);
+    status = s;
+    done = true;
+    done_cv.notify_all();
+  });
+  unique_lock<mutex> lock(done_lock);
+  done_cv.wait(lock, [&done]() { return done; });
+  CHECK_EQ(AsyncLogClient::OK, status) << "could not get the STH of "
+                                       << FLAGS_log_server;
+  LOG(INFO) << "starting at tree size " << sth.tree_size();
+
+  lock_guard<mutex> state_lock(lock_);
+  sth_.Swap(&sth);
+}
+
+
+LoadGenerator::Callback LoadGenerator::Start(const char* request,
+                                             const Callback& done) {
+  {
+    lock_guard<mutex> lock(lock_);
+    ++in_flight_;
+  }
+  const steady_clock::time_point start(steady_clock::now());
+  return [this, request, done, start](AsyncLogClient::Status status) {
+    latency_ms->Record(request,
+                       duration<double, std::milli>(steady_clock::now() -
+                                                    start).count());
+    requests->Increment(request, ResultName(status));
+    if (done) {
+      done(status);
+    }
+
+    lock_guard<mutex> lock(lock_);
+    --in_flight_;
+    finished_.notify_all();
+  };
+}
+
+
+void LoadGenerator::Skip(const char* request) {
+  requests->Increment(request, "skipped");
+}
+
+
+void LoadGenerator::RefreshSTH() {
+  const shared_ptr<ct::SignedTreeHead> sth(make_shared<ct::SignedTreeHead>());
+  client_->GetSTH(sth.get(), Start(kGetSTH, [this, sth](
+                                               AsyncLogClient::Status status) {
+    if (status != AsyncLogClient::OK) {
+      return;
+    }
+    lock_guard<mutex> lock(lock_);
+    if (sth->tree_size() >= sth_.tree_size()) {
+      sth_.Swap(sth.get());
+    }
+  }));
+}
+
+
+void LoadGenerator::AddChain(const ct::SignedTreeHead&) {
+  size_t index;
+  {
+    lock_guard<mutex> lock(lock_);
+    index = next_chain_++ % chains_.size();
+  }
+  const shared_ptr<ct::SignedCertificateTimestamp> sct(
+      make_shared<ct::SignedCertificateTimestamp>());
+  // The SCT is kept until the request is done.
+  client_->AddCertChain(*chains_[index], sct.get(),
+                        Start(kAddChain, [sct](AsyncLogClient::Status) {}));
+}
+
+
+void LoadGenerator::AddPreChain(const ct::SignedTreeHead&) {
+  size_t index;
+  {
+    lock_guard<mutex> lock(lock_);
+    index = next_chain_++ % pre_chains_.size();
+  }
+  const shared_ptr<ct::SignedCertificateTimestamp> sct(
+      make_shared<ct::SignedCertificateTimestamp>());
+  client_->AddPreCertChain(*pre_chains_[index], sct.get(),
+                           Start(kAddPreChain,
+                                 [sct](AsyncLogClient::Status) {}));
+}
+
+
+void LoadGenerator::GetEntries(const ct::SignedTreeHead& sth) {
+  const int64_t tree_size(sth.tree_size());
+  if (tree_size == 0) {
+    Skip(kGetEntries);
+    return;
+  }
+  int64_t first;
+  {
+    lock_guard<mutex> lock(lock_);
+    if (next_entry_ >= tree_size) {
+      next_entry_ = 0;
+    }
+    first = next_entry_;
+    next_entry_ += FLAGS_get_entries_batch_size;
+  }
+  const int64_t last(
+      std::min(first + FLAGS_get_entries_batch_size, tree_size) - 1);
+  const shared_ptr<vector<AsyncLogClient::Entry>> entries(
+      make_shared<vector<AsyncLogClient::Entry>>());
+  client_->GetEntries(first, last, entries.get(),
+                      Start(kGetEntries, [this, entries](
+                                             AsyncLogClient::Status status) {
+                        if (status == AsyncLogClient::OK) {
+                          AddLeafHashes(*entries);
+                        }
+                      }));
+}
+
+
+void LoadGenerator::AddLeafHashes(
+    const vector<AsyncLogClient::Entry>& entries) {
+  const TreeHasher hasher(unique_ptr<SerialHasher>(new Sha256Hasher));
+  vector<string> hashes;
+  LoggedEntry logged;
+  string leaf;
+  for (const auto& entry : entries) {
+    if (logged.CopyFromClientLogEntry(entry) &&
+        logged.SerializeForLeaf(&leaf)) {
+      hashes.emplace_back(hasher.HashLeaf(leaf));
+    }
+  }
+
+  lock_guard<mutex> lock(lock_);
+  for (auto& hash : hashes) {
+    leaf_hashes_.emplace_back(std::move(hash));
+  }
+  while (leaf_hashes_.size() > kMaxLeafHashes) {
+    leaf_hashes_.pop_front();
+  }
+}
+
+
+void LoadGenerator::GetProof(const ct::SignedTreeHead& sth) {
+  string leaf_hash;
+  {
+    lock_guard<mutex> lock(lock_);
+    if (leaf_hashes_.empty()) {
+      // Until a get-entries request has returned some.
+      Skip(kGetProof);
+      return;
+    }
+    leaf_hash = leaf_hashes_[std::uniform_int_distribution<size_t>(
+        0, leaf_hashes_.size() - 1)(random_)];
+  }
+  const shared_ptr<ct::MerkleAuditProof> proof(
+      make_shared<ct::MerkleAuditProof>());
+  client_->QueryInclusionProof(sth, leaf_hash, proof.get(),
+                               Start(kGetProof,
+                                     [proof](AsyncLogClient::Status) {}));
+}
+
+
+void LoadGenerator::GetConsistency(const ct::SignedTreeHead& sth) {
+  const int64_t tree_size(sth.tree_size());
+  if (tree_size < 2) {
+    Skip(kGetConsistency);
+    return;
+  }
+  const int64_t first(
+      std::uniform_int_distribution<int64_t>(1, tree_size - 1)(random_));
+  const shared_ptr<vector<string>> proof(make_shared<vector<string>>());
+  client_->GetSTHConsistency(first, tree_size, proof.get(),
+                             Start(kGetConsistency,
+                                   [proof](AsyncLogClient::Status) {}));
+}
+
+
+void LoadGenerator::SendNext() {
+  const auto& kind(kinds_[pick_kind_(random_)]);
+  ct::SignedTreeHead sth;
+  {
+    lock_guard<mutex> lock(lock_);
+    if (in_flight_ >= FLAGS_max_in_flight) {
+      Skip(kind.first);
+      return;
+    }
+    sth.CopyFrom(sth_);
+  }
+  (this->*kind.second)(sth);
+}
+
+
+void Report(std::ostream* out) {
+  const auto distributions(latency_ms->CurrentDistributions());
+  const auto counts(requests->CurrentValues());
+
+  *out << std::left << std::setw(20) << "request" << std::right
+       << std::setw(10) << "sent" << std::setw(10) << "errors"
+       << std::setw(10) << "skipped" << std::setw(10) << "p50 ms"
+       << std::setw(10) << "p90 ms" << std::setw(10) << "p99 ms"
+       << std::setw(10) << "max ms" << "\n";
+  for (const char* request : {kAddChain, kAddPreChain, kGetEntries,
+                              kGetProof, kGetConsistency, kGetSTH}) {
+    double sent(0), errors(0), skipped(0);
+    for (const auto& count : counts) {
+      if (count.first[0] != request) {
+        continue;
+      }
+      if (count.first[1] == "skipped") {
+        skipped += count.second.second;
+      } else {
+        sent += count.second.second;
+        if (count.first[1] != "ok") {
+          errors += count.second.second;
+        }
+      }
+    }
+    if (sent == 0 && skipped == 0) {
+      continue;
+    }
+    const auto it(distributions.find({request}));
+    const cert_trans::Metric::Distribution distribution(
+        it != distributions.end() ? it->second
+                                  : cert_trans::Metric::Distribution());
+    *out << std::left << std::setw(20) << request << std::right
+         << std::setw(10) << sent << std::setw(10) << errors << std::setw(10)
+         << skipped << std::fixed << std::setprecision(1) << std::setw(10)
+         << Quantile(distribution, 0.5) << std::setw(10)
+         << Quantile(distribution, 0.9) << std::setw(10)
+         << Quantile(distribution, 0.99) << std::setw(10)
+         << Quantile(distribution, 1) << "\n";
+    out->unsetf(std::ios::floatfield);
+  }
+}
+
+
+void LoadGenerator::WaitForRequests() {
+  unique_lock<mutex> lock(lock_);
+  if (!finished_.wait_for(lock, seconds(60),
+                          [this]() { return in_flight_ == 0; })) {
+    LOG(WARNING) << in_flight_ << " requests still outstanding, giving up";
+  }
+}
+
+
+void LoadGenerator::Run() {
+  CHECK_GT(FLAGS_qps, 0);
+  CHECK_GT(FLAGS_duration_secs, 0);
+  const steady_clock::duration interval(
+      duration_cast<steady_clock::duration>(duration<double>(1 / FLAGS_qps)));
+  const steady_clock::time_point start(steady_clock::now());
+  const steady_clock::time_point end(start + seconds(FLAGS_duration_secs));
+  steady_clock::time_point next_sth(start + seconds(FLAGS_sth_refresh_secs));
+  steady_clock::time_point next_report(
+      start + seconds(FLAGS_report_interval_secs));
+
+  for (steady_clock::time_point next(start); next < end; next += interval) {
+    std::this_thread::sleep_until(next);
+    SendNext();
+
+    if (next >= next_sth) {
+      RefreshSTH();
+      next_sth += seconds(FLAGS_sth_refresh_secs);
+    }
+    if (FLAGS_report_interval_secs > 0 && next >= next_report) {
+      std::ostringstream report;
+      Report(&report);
+      LOG(INFO) << "after "
+                << duration_cast<seconds>(next - start).count() << "s:\n"
+                << report.str();
+      next_report += seconds(FLAGS_report_interval_secs);
+    }
+  }
+
+  WaitForRequests();
+}
+
+
+}  // namespace
+
+
+int main(int argc, char* argv[]) {
+  util::InitCT(&argc, &argv);
+  ConfigureSerializerForV1CT();
+
+  const shared_ptr<libevent::Base> base(make_shared<libevent::Base>());
+  libevent::EventPumpThread pump(base);
+  ThreadPool pool(FLAGS_num_threads);
+  UrlFetcher fetcher(base.get(), &pool);
+  AsyncLogClient client(&pool, &fetcher, FLAGS_log_server);
+
+  LoadGenerator generator(&client,
+                          ReadChains<CertChain>(FLAGS_chains_dir),
+                          ReadChains<PreCertChain>(FLAGS_pre_chains_dir));
+  generator.Init();
+  generator.Run();
+
+  Report(&std::cout);
+  return 0;
+}
@@ -0,0 +1,529 @@
+// Measures how a Merkle tree structure scales with the number of
+// leaves, so that capacity planning can extrapolate to the sizes the
+// logs will reach. The --structure is grown to each of --sizes in
+// turn, e.g. 1e6,1e7,1e8,1e9, and at each size these phases are
+// timed:
+//
+//   append       adding the leaves up to that size, in batches of
+//                --append_batch_size, then getting the root (and, for
+//                the on-disk structures, syncing them).
+//   audit-proof  --num_proofs audit (or, for a sparse tree, inclusion)
+//                proofs of random leaves.
+//   consistency  --num_proofs consistency proofs from random earlier
+//                tree sizes.
+//   build        for merkle and merkle-mmap, building a new tree of
+//                that size from its leaf hashes at once, on
+//                --build_threads threads, as a node does at start-up.
+//
+// The leaf hashes are made up rather than hashed from leaves, so that
+// only the work of the tree is measured.
+//
+// For each phase, it reports the throughput, the latency of its
+// operations (of a whole batch, for append), and the resident memory
+// of the process afterwards. With --csv_output, the same is appended
+// to a CSV file, labelled with --label (the build version by
+// default), so that runs of successive commits can be plotted
+// together.
+
+#include <gflags/gflags.h>
+#include <glog/logging.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <algorithm>
+#include <chrono>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <memory>
+#include <random>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include "merkletree/compact_merkle_tree.h"
+#include "merkletree/merkle_tree.h"
+#include "merkletree/mmap_node_store.h"
+#include "merkletree/serial_hasher.h"
+#include "merkletree/sparse_merkle_tree.h"
+#include "merkletree/tiled_merkle_tree.h"
+#include "monitoring/histogram.h"
+#include "util/init.h"
+#include "util/thread_pool.h"
+#include "version.h"
+
+DEFINE_string(structure, "merkle",
+              "Structure to benchmark: merkle, merkle-mmap, tiled, compact "
+              "or sparse");
+DEFINE_string(sizes, "1e6,1e7",
+              "Comma-separated, increasing numbers of leaves to measure at");
+DEFINE_string(dir, "",
+              "Directory to keep the on-disk structures (merkle-mmap and "
+              "tiled) in, which must be empty");
+DEFINE_int32(append_batch_size, 10000,
+             "Number of leaves added between latency measurements");
+DEFINE_int32(num_proofs, 10000, "Number of proofs of each kind to time");
+DEFINE_bool(build, true,
+            "Whether to time building a tree at once, for merkle and "
+            "merkle-mmap");
+DEFINE_int32(build_threads, 8, "Threads to build a tree at once with");
+DEFINE_int32(tile_cache, 1024, "Tiles cached in memory, for tiled");
+DEFINE_string(csv_output, "",
+              "File to append the results to, in CSV, if not empty");
+DEFINE_string(label, "",
+              "Label of the results in --csv_output, such as a commit id "
+              "(the build version if empty)");
+DEFINE_uint64(seed, 0, "Seed for choosing the leaves to prove");
+
+using cert_trans::Histogram;
+using cert_trans::MmapNodeStore;
+using cert_trans::ThreadPool;
+using cert_trans::TiledMerkleTree;
+using std::chrono::duration;
+using std::chrono::steady_clock;
+using std::cout;
+using std::string;
+using std::unique_ptr;
+using std::vector;
+
+namespace {
+
+
+Histogram<string, string>* latency_us(Histogram<string, string>::New(
+    "merkle_bench_latency_us", "phase", "size",
+    "Latency of each operation of a phase, in microseconds."));
+
+
+// splitmix64, so that leaf |index| has the same hash every time.
+uint64_t Mix(uint64_t x) {
+  x += 0x9e3779b97f4a7c15ULL;
+  x = (x ^ (x >> 30)) * 0xbf58476d1ce4e5b9ULL;
+  x = (x ^ (x >> 27)) * 0x94d049bb133111ebULL;
+  return x ^ (x >> 31);
+}
+
+
+string LeafHash(int64_t index) {
+  string ret(32, '\0');
+  for (size_t i = 0; i < ret.size(); i += 8) {
+    const uint64_t r(Mix(index * 4 + i / 8));
+    for (size_t j = 0; j < 8; ++j) {
+      ret[i + j] = static_cast<char>(r >> (8 * j));
+    }
+  }
+  return ret;
+}
+
+
+int64_t ResidentKb() {
+  FILE* const statm(fopen("/proc/self/statm", "r"));
+  PCHECK(statm != nullptr);
+  long size, resident;
+  CHECK_EQ(2, fscanf(statm, "%ld %ld", &size, &resident));
+  fclose(statm);
+  return resident * (sysconf(_SC_PAGESIZE) / 1024);
+}
+
+
+// The operations of the phases, for each structure. Leaves are
+// numbered from 0.
+class Structure {
+ public:
+  virtual ~Structure() = default;
+
+  virtual void Append(const vector<string>& leaf_hashes) = 0;
+
+  // Brings the structure up to date after a series of Append(), and
+  // returns its root.
+  virtual string Root() = 0;
+
+  virtual bool HasAuditProofs() const {
+    return false;
+  }
+
+  virtual void AuditProof(int64_t leaf, int64_t tree_size) {
+    LOG(FATAL) << "no audit proofs";
+  }
+
+  virtual bool HasConsistencyProofs() const {
+    return false;
+  }
+
+  virtual void ConsistencyProof(int64_t old_size, int64_t tree_size) {
+    LOG(FATAL) << "no consistency proofs";
+  }
+};
+
+
+class MerkleStructure : public Structure {
+ public:
+  // Keeps the nodes in an MmapNodeStore in |dir| if it is not empty.
+  explicit MerkleStructure(const string& dir)
+      : mmap_nodes_(dir.empty() ? nullptr : new MmapNodeStore(dir, 32)),
+        tree_(mmap_nodes_
+                  ? new MerkleTree(unique_ptr<Sha256Hasher>(new Sha256Hasher),
+                                   unique_ptr<MmapNodeStore>(mmap_nodes_))
+                  : new MerkleTree(
+                        unique_ptr<Sha256Hasher>(new Sha256Hasher))) {
+  }
+
+  void Append(const vector<string>& leaf_hashes) override {
+    for (const string& hash : leaf_hashes) {
+      tree_->AddLeafHash(hash);
+    }
+  }
+
+  string Root() override {
+    const string root(tree_->CurrentRoot());
+    if (mmap_nodes_) {
+      mmap_nodes_->Sync();
+    }
+    return root;
+  }
+
+  bool HasAuditProofs() const override {
+    return true;
+  }
+
+  void AuditProof(int64_t leaf, int64_t tree_size) override {
+    tree_->PathToRootAtSnapshot(leaf + 1, tree_size);
+  }
+
+  bool HasConsistencyProofs() const override {
+    return true;
+  }
+
+  void ConsistencyProof(int64_t old_size, int64_t tree_size) override {
+    tree_->SnapshotConsistency(old_size, tree_size);
+  }
+
+ private:
+  // Owned by |tree_|.
+  MmapNodeStore* const mmap_nodes_;
+  const unique_ptr<MerkleTree> tree_;
+};
+
+
+class TiledStructure : public Structure {
+ public:
+  explicit TiledStructure(const string& dir)
+      : tree_(unique_ptr<Sha256Hasher>(new Sha256Hasher), dir,
+              FLAGS_tile_cache) {
+  }
+
+  void Append(const vector<string>& leaf_hashes) override {
+    for (const string& hash : leaf_hashes) {
+      tree_.AddLeafHash(hash);
+    }
+  }
+
+  string Root() override {
+    tree_.Sync();
+    return tree_.CurrentRoot();
+  }
+
+  bool HasAuditProofs() const override {
+    return true;
+  }
+
+  void AuditProof(int64_t leaf, int64_t tree_size) override {
+    tree_.PathToRootAtSnapshot(leaf + 1, tree_size);
+  }
+
+  bool HasConsistencyProofs() const override {
+    return true;
+  }
+
+  void ConsistencyProof(int64_t old_size, int64_t tree_size) override {
+    tree_.SnapshotConsistency(old_size, tree_size);
+  }
+
+ private:
+  TiledMerkleTree tree_;
+};
+
+
+class CompactStructure : public Structure {
+ public:
+  CompactStructure() : tree_(unique_ptr<Sha256Hasher>(new Sha256Hasher)) {
+  }
+
+  void Append(const vector<string>& leaf_hashes) override {
+    for (const string& hash : leaf_hashes) {
+      tree_.AddLeafHash(hash);
+    }
+  }
+
+  string Root() override {
+    return tree_.CurrentRoot();
+  }
+
+ private:
+  CompactMerkleTree tree_;
+};
+
+
+// The leaves are at random paths, as the entries of a map keyed by a
+// hash would be.
+class SparseStructure : public Structure {
+ public:
+  SparseStructure()
+      : pool_(FLAGS_build_threads), tree_(new Sha256Hasher, &pool_) {
+  }
+
+  void Append(const vector<string>& leaf_hashes) override {
+    // The leaf hashes are only used to place and fill the leaves.
+    vector<std::pair<SparseMerkleTree::Path, string>> leaves;
+    leaves.reserve(leaf_hashes.size());
+    for (const string& hash : leaf_hashes) {
+      leaves.emplace_back(PathFor(hash), hash);
+    }
+    tree_.SetLeaves(leaves);
+  }
+
+  string Root() override {
+    return tree_.CurrentRoot();
+  }
+
+  bool HasAuditProofs() const override {
+    return true;
+  }
+
+  void AuditProof(int64_t leaf, int64_t tree_size) override {
+    tree_.InclusionProof(PathFor(LeafHash(leaf)));
+  }
+
+ private:
+  static SparseMerkleTree::Path PathFor(const string& hash) {
+    return PathFromBytes(hash);
+  }
+
+  ThreadPool pool_;
+  SparseMerkleTree tree_;
+};
+
+
+unique_ptr<Structure> NewStructure() {
+  if (FLAGS_structure == "merkle") {
+    return unique_ptr<Structure>(new MerkleStructure(""));
+  } else if (FLAGS_structure == "merkle-mmap") {
+    const string dir(FLAGS_dir + "/mmap");
+    PCHECK(mkdir(dir.c_str(), 0700) == 0) << dir;
+    return unique_ptr<Structure>(new MerkleStructure(dir));
+  } else if (FLAGS_structure == "tiled") {
+    const string dir(FLAGS_dir + "/tiled");
+    PCHECK(mkdir(dir.c_str(), 0700) == 0) << dir;
+    return unique_ptr<Structure>(new TiledStructure(dir));
+  } else if (FLAGS_structure == "compact") {
+    return unique_ptr<Structure>(new CompactStructure);
+  } else if (FLAGS_structure == "sparse") {
+    return unique_ptr<Structure>(new SparseStructure);
+  }
+  LOG(FATAL) << "unknown --structure " << FLAGS_structure;
+}
+
+
+vector<int64_t> ParseSizes(const string& sizes) {
+  vector<int64_t> ret;
+  std::istringstream input(sizes);
+  string item;
+  while (std::getline(input, item, ',')) {
+    // std::stod, so that sizes can be given as 1e9.
+    ret.push_back(static_cast<int64_t>(std::stod(item)));
+    CHECK_GT(ret.back(), ret.size() > 1 ? ret[ret.size() - 2] : 0)
+        << "--sizes must be increasing";
+  }
+  CHECK(!ret.empty()) << "--sizes is required";
+  return ret;
+}
+
+
+// Times a phase of |ops| operations at |size| leaves, and prints how
+// it went.
+class Phase {
+ public:
+  Phase(const char* name, int64_t size, int64_t ops)
+      : name_(name),
+        size_(size),
+        ops_(ops),
+        cell_(latency_us->WithLabels(name, std::to_string(size))),
+        start_(steady_clock::now()),
+        op_start_(start_) {
+    LOG(INFO) << "starting " << name_ << " at " << size_;
+  }
+
+  ~Phase();
+
+  // Starts timing an operation which does not follow on from the
+  // previous one.
+  void OpStart() {
+    op_start_ = steady_clock::now();
+  }
+
+  // Records the time since OpStart() or the previous OpDone(), or
+  // since the start, as the latency of one operation.
+  void OpDone() {
+    const steady_clock::time_point now(steady_clock::now());
+    cell_->Record(duration<double, std::micro>(now - op_start_).count());
+    op_start_ = now;
+  }
+
+ private:
+  const char* const name_;
+  const int64_t size_;
+  const int64_t ops_;
+  cert_trans::HistogramCell* const cell_;
+  const steady_clock::time_point start_;
+  steady_clock::time_point op_start_;
+};
+
+
+Phase::~Phase() {
+  const double secs(duration<double>(steady_clock::now() - start_).count());
+  const cert_trans::Metric::Distribution distribution(
+      cell_->GetDistribution());
+  const double p50(Quantile(distribution, 0.5));
+  const double p90(Quantile(distribution, 0.9));
+  const double p99(Quantile(distribution, 0.99));
+  const int64_t rss_kb(ResidentKb());
+  cout << std::left << std::setw(14) << name_ << std::right
+       << std::setw(12) << size_ << std::setw(12) << ops_ << std::fixed
+       << std::setprecision(1) << std::setw(10) << secs << std::setw(12)
+       << ops_ / secs << std::setw(12) << p50 << std::setw(12) << p90
+       << std::setw(12) << p99 << std::setw(12) << rss_kb << std::endl;
+
+  if (!FLAGS_csv_output.empty()) {
+    std::ofstream csv(FLAGS_csv_output, std::ios::app);
+    csv << (FLAGS_label.empty() ? cert_trans::kBuildVersion : FLAGS_label)
+        << "," << FLAGS_structure << "," << size_ << "," << name_ << ","
+        << ops_ << "," << secs << "," << ops_ / secs << "," << p50 << ","
+        << p90 << "," << p99 << "," << rss_kb << "\n";
+    CHECK(csv) << "could not write to " << FLAGS_csv_output;
+  }
+}
+
+
+void Append(Structure* structure, int64_t from, int64_t to) {
+  Phase phase("append", to, to - from);
+  vector<string> batch;
+  for (int64_t first = from; first < to; first += FLAGS_append_batch_size) {
+    const int64_t size(
+        std::min<int64_t>(FLAGS_append_batch_size, to - first));
+    batch.resize(size);
+    for (int64_t i = 0; i < size; ++i) {
+      batch[i] = LeafHash(first + i);
+    }
+    phase.OpStart();
+    structure->Append(batch);
+    phase.OpDone();
+  }
+  phase.OpStart();
+  CHECK(!structure->Root().empty());
+  phase.OpDone();
+}
+
+
+void AuditProofs(Structure* structure, int64_t size,
+                 std::mt19937_64* random) {
+  std::uniform_int_distribution<int64_t> pick(0, size - 1);
+  Phase phase("audit-proof", size, FLAGS_num_proofs);
+  for (int i = 0; i < FLAGS_num_proofs; ++i) {
+    const int64_t leaf(pick(*random));
+    phase.OpStart();
+    structure->AuditProof(leaf, size);
+    phase.OpDone();
+  }
+}
+
+
+void ConsistencyProofs(Structure* structure, int64_t size,
+                       std::mt19937_64* random) {
+  if (size < 2) {
+    return;
+  }
+  std::uniform_int_distribution<int64_t> pick(1, size - 1);
+  Phase phase("consistency", size, FLAGS_num_proofs);
+  for (int i = 0; i < FLAGS_num_proofs; ++i) {
+    const int64_t old_size(pick(*random));
+    phase.OpStart();
+    structure->ConsistencyProof(old_size, size);
+    phase.OpDone();
+  }
+}
+
+
+void Build(int64_t size, ThreadPool* pool) {
+  string leaves;
+  leaves.reserve(size * 32);
+  for (int64_t i = 0; i < size; ++i) {
+    leaves.append(LeafHash(i));
+  }
+
+  unique_ptr<MerkleTree> tree;
+  if (FLAGS_structure == "merkle-mmap") {
+    const string dir(FLAGS_dir + "/build-" + std::to_string(size));
+    PCHECK(mkdir(dir.c_str(), 0700) == 0) << dir;
+    tree.reset(new MerkleTree(
+        unique_ptr<Sha256Hasher>(new Sha256Hasher),
+        unique_ptr<MmapNodeStore>(new MmapNodeStore(dir, 32))));
+  } else {
+    tree.reset(new MerkleTree(unique_ptr<Sha256Hasher>(new Sha256Hasher)));
+  }
+
+  Phase phase("build", size, 1);
+  CHECK(tree->BuildFromLeafHashes(&leaves, pool));
+  phase.OpDone();
+}
+
+
+}  // namespace
+
+
+int main(int argc, char* argv[]) {
+  util::InitCT(&argc, &argv);
+
+  const vector<int64_t> sizes(ParseSizes(FLAGS_sizes));
+  CHECK_GT(FLAGS_append_batch_size, 0);
+  CHECK_GE(FLAGS_num_proofs, 0);
+  const bool on_disk(FLAGS_structure == "merkle-mmap" ||
+                     FLAGS_structure == "tiled");
+  CHECK(!on_disk || !FLAGS_dir.empty()) << "--dir is required for "
+                                        << FLAGS_structure;
+  const bool build(FLAGS_build && (FLAGS_structure == "merkle" ||
+                                   FLAGS_structure == "merkle-mmap"));
+
+  cout << std::left << std::setw(14) << "phase" << std::right
+       << std::setw(12) << "size" << std::setw(12) << "ops"
+       << std::setw(10) << "secs" << std::setw(12) << "ops/s"
+       << std::setw(12) << "p50 us" << std::setw(12) << "p90 us"
+       << std::setw(12) << "p99 us" << std::setw(12) << "RSS kB"
+       << std::endl;
+
+  struct stat st;
+  if (!FLAGS_csv_output.empty() && stat(FLAGS_csv_output.c_str(), &st) != 0) {
+    std::ofstream csv(FLAGS_csv_output);
+    csv << "label,structure,size,phase,ops,secs,ops_per_sec,p50_us,p90_us,"
+        << "p99_us,rss_kb\n";
+    CHECK(csv) << "could not write to " << FLAGS_csv_output;
+  }
+
+  ThreadPool pool(FLAGS_build_threads);
+  std::mt19937_64 random(FLAGS_seed);
+  const unique_ptr<Structure> structure(NewStructure());
+  int64_t tree_size(0);
+  for (const int64_t size : sizes) {
+    Append(structure.get(), tree_size, size);
+    tree_size = size;
+    if (structure->HasAuditProofs()) {
+      AuditProofs(structure.get(), size, &random);
+    }
+    if (structure->HasConsistencyProofs()) {
+      ConsistencyProofs(structure.get(), size, &random);
+    }
+    if (build) {
+      Build(size, &pool);
+    }
+  }
+  return 0;
+}
@@ -0,0 +1,325 @@
+// Sends the requests a server recorded with --http_capture_file to a
+// log again, at the pace they were recorded at (or faster), and
+// reports their latency by endpoint, to check a change against real
+// traffic before rolling it out.
+//
+// With --compare_log_server, each request is also sent to a second
+// log at the same time, for instance one running the previous build,
+// so that the two sets of latencies are measured under the same
+// conditions.
+//
+// As with load_generator, requests are sent on schedule whether or not
+// earlier ones have finished. Those which would exceed --max_in_flight
+// are not sent, and are reported as "skipped".
+
+#include <gflags/gflags.h>
+#include <glog/logging.h>
+#include <chrono>
+#include <condition_variable>
+#include <iomanip>
+#include <iostream>
+#include <memory>
+#include <mutex>
+#include <set>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "monitoring/counter.h"
+#include "monitoring/histogram.h"
+#include "net/url.h"
+#include "net/url_fetcher.h"
+#include "util/init.h"
+#include "util/libevent_wrapper.h"
+#include "util/request_capture.h"
+#include "util/task.h"
+#include "util/thread_pool.h"
+
+DEFINE_string(capture_file, "",
+              "File of requests recorded with a server's "
+              "--http_capture_file");
+DEFINE_string(log_server, "http://localhost:8888",
+              "Base URL of the log to send the requests to");
+DEFINE_string(compare_log_server, "",
+              "Base URL of a second log to send each request to as well, "
+              "to compare the latencies of the two");
+DEFINE_double(speed, 1,
+              "How many times faster than recorded to send the requests");
+DEFINE_int32(max_in_flight, 1000,
+             "Requests due while this many are outstanding are skipped");
+DEFINE_int32(report_interval_secs, 10,
+             "How often to log the results so far (0 to only report at the "
+             "end)");
+DEFINE_int32(num_threads, 8, "Threads handling the responses");
+
+using cert_trans::Counter;
+using cert_trans::Histogram;
+using cert_trans::RequestCapture;
+using cert_trans::ThreadPool;
+using cert_trans::URL;
+using cert_trans::UrlFetcher;
+using std::chrono::duration;
+using std::chrono::duration_cast;
+using std::chrono::seconds;
+using std::chrono::steady_clock;
+using std::condition_variable;
+using std::lock_guard;
+using std::make_shared;
+using std::mutex;
+using std::set;
+using std::shared_ptr;
+using std::string;
+using std::unique_lock;
+using std::unique_ptr;
+using std::vector;
+
+namespace libevent = cert_trans::libevent;
+
+namespace {
+
+
+Histogram<string, string>* latency_ms(Histogram<string, string>::New(
+    "replay_latency_ms", "server", "endpoint",
+    "Latency of the requests replayed, in milliseconds."));
+
+Counter<string, string, string>* requests(Counter<string, string, string>::New(
+    "replay_requests", "server", "endpoint", "result",
+    "Number of requests due, by result."));
+
+
+bool ParseVerb(const string& method, UrlFetcher::Verb* verb) {
+  if (method == "GET") {
+    *verb = UrlFetcher::Verb::GET;
+  } else if (method == "POST") {
+    *verb = UrlFetcher::Verb::POST;
+  } else if (method == "PUT") {
+    *verb = UrlFetcher::Verb::PUT;
+  } else if (method == "DELETE") {
+    *verb = UrlFetcher::Verb::DELETE;
+  } else {
+    return false;
+  }
+  return true;
+}
+
+
+// "ok" for 2xx responses, "http-<code>" for other responses, and
+// "error" if there was none.
+string ResultName(const util::Status& status, int status_code) {
+  if (!status.ok()) {
+    return "error";
+  }
+  if (status_code >= 200 && status_code < 300) {
+    return "ok";
+  }
+  return "http-" + std::to_string(status_code);
+}
+
+
+class Replayer {
+ public:
+  Replayer(UrlFetcher* fetcher, ThreadPool* pool,
+           const vector<string>& servers)
+      : fetcher_(CHECK_NOTNULL(fetcher)),
+        pool_(CHECK_NOTNULL(pool)),
+        servers_(servers),
+        in_flight_(0) {
+    for (string& server : servers_) {
+      while (!server.empty() && server.back() == '/') {
+        server.pop_back();
+      }
+    }
+  }
+
+  // Sends the requests in |reader|, then waits for the outstanding
+  // ones to finish.
+  void Run(RequestCapture::Reader* reader);
+
+  // Writes a table of the results so far to |out|.
+  void Report(std::ostream* out) const;
+
+ private:
+  void Send(size_t server, const RequestCapture::Request& request,
+            const string& endpoint);
+  void WaitForRequests();
+
+  UrlFetcher* const fetcher_;
+  ThreadPool* const pool_;
+  vector<string> servers_;
+
+  mutable mutex lock_;
+  condition_variable finished_;
+  int in_flight_;
+  set<string> endpoints_;
+};
+
+
+void Replayer::Send(size_t server, const RequestCapture::Request& request,
+                    const string& endpoint) {
+  const string& server_name(servers_[server]);
+  UrlFetcher::Request req(URL(server_name + request.uri));
+  if (!ParseVerb(request.method, &req.verb)) {
+    requests->Increment(server_name, endpoint, "unsupported");
+    return;
+  }
+  req.body = request.body;
+  {
+    lock_guard<mutex> lock(lock_);
+    if (in_flight_ >= FLAGS_max_in_flight) {
+      requests->Increment(server_name, endpoint, "skipped");
+      return;
+    }
+    ++in_flight_;
+  }
+
+  UrlFetcher::Response* const resp(new UrlFetcher::Response);
+  const steady_clock::time_point start(steady_clock::now());
+  fetcher_->Fetch(
+      req, resp,
+      new util::Task(
+          [this, server_name, endpoint, resp, start](util::Task* task) {
+            unique_ptr<UrlFetcher::Response> resp_deleter(resp);
+            unique_ptr<util::Task> task_deleter(task);
+            latency_ms->Record(server_name, endpoint,
+                               duration<double, std::milli>(
+                                   steady_clock::now() - start).count());
+            requests->Increment(server_name, endpoint,
+                                ResultName(task->status(),
+                                           resp->status_code));
+
+            lock_guard<mutex> lock(lock_);
+            --in_flight_;
+            finished_.notify_all();
+          },
+          pool_));
+}
+
+
+void Replayer::Report(std::ostream* out) const {
+  set<string> endpoints;
+  {
+    lock_guard<mutex> lock(lock_);
+    endpoints = endpoints_;
+  }
+  const auto distributions(latency_ms->CurrentDistributions());
+  const auto counts(requests->CurrentValues());
+
+  *out << std::left << std::setw(30) << "endpoint" << std::setw(30)
+       << "server" << std::right << std::setw(10) << "sent"
+       << std::setw(10) << "errors" << std::setw(10) << "skipped"
+       << std::setw(10) << "p50 ms" << std::setw(10) << "p90 ms"
+       << std::setw(10) << "p99 ms" << std::setw(10) << "max ms" << "\n";
+  for (const string& endpoint : endpoints) {
+    for (const string& server : servers_) {
+      double sent(0), errors(0), skipped(0);
+      for (const auto& count : counts) {
+        if (count.first[0] != server || count.first[1] != endpoint) {
+          continue;
+        }
+        if (count.first[2] == "skipped" || count.first[2] == "unsupported") {
+          skipped += count.second.second;
+        } else {
+          sent += count.second.second;
+          if (count.first[2] != "ok") {
+            errors += count.second.second;
+          }
+        }
+      }
+      const auto it(distributions.find({server, endpoint}));
+      const cert_trans::Metric::Distribution distribution(
+          it != distributions.end() ? it->second
+                                    : cert_trans::Metric::Distribution());
+      *out << std::left << std::setw(30) << endpoint << std::setw(30)
+           << server << std::right << std::setw(10) << sent << std::setw(10)
+           << errors << std::setw(10) << skipped << std::fixed
+           << std::setprecision(1) << std::setw(10)
+           << Quantile(distribution, 0.5) << std::setw(10)
+           << Quantile(distribution, 0.9) << std::setw(10)
+           << Quantile(distribution, 0.99) << std::setw(10)
+           << Quantile(distribution, 1) << "\n";
+      out->unsetf(std::ios::floatfield);
+    }
+  }
+}
+
+
+void Replayer::WaitForRequests() {
+  unique_lock<mutex> lock(lock_);
+  if (!finished_.wait_for(lock, seconds(60),
+                          [this]() { return in_flight_ == 0; })) {
+    LOG(WARNING) << in_flight_ << " requests still outstanding, giving up";
+  }
+}
+
+
+void Replayer::Run(RequestCapture::Reader* reader) {
+  CHECK_GT(FLAGS_speed, 0);
+  const steady_clock::time_point start(steady_clock::now());
+  steady_clock::time_point next_report(
+      start + seconds(FLAGS_report_interval_secs));
+  RequestCapture::Request request;
+  bool first(true);
+  std::chrono::microseconds first_offset(0);
+  int64_t num_requests(0);
+
+  while (reader->Next(&request)) {
+    if (first) {
+      first_offset = request.offset;
+      first = false;
+    }
+    // Requests recorded at the same time by different threads can be
+    // slightly out of order, in which case they are sent right away.
+    std::this_thread::sleep_until(
+        start + duration_cast<steady_clock::duration>(
+                    (request.offset - first_offset) / FLAGS_speed));
+
+    const string endpoint(request.uri.substr(0, request.uri.find('?')));
+    {
+      lock_guard<mutex> lock(lock_);
+      endpoints_.insert(endpoint);
+    }
+    for (size_t i = 0; i < servers_.size(); ++i) {
+      Send(i, request, endpoint);
+    }
+    ++num_requests;
+
+    const steady_clock::time_point now(steady_clock::now());
+    if (FLAGS_report_interval_secs > 0 && now >= next_report) {
+      std::ostringstream report;
+      Report(&report);
+      LOG(INFO) << "after " << num_requests << " requests, "
+                << duration_cast<seconds>(now - start).count() << "s:\n"
+                << report.str();
+      next_report += seconds(FLAGS_report_interval_secs);
+    }
+  }
+  CHECK(reader->ok()) << "could not read all of " << FLAGS_capture_file;
+
+  WaitForRequests();
+}
+
+
+}  // namespace
+
+
+int main(int argc, char* argv[]) {
+  util::InitCT(&argc, &argv);
+  CHECK(!FLAGS_capture_file.empty()) << "Must specify --capture_file";
+
+  const shared_ptr<libevent::Base> base(make_shared<libevent::Base>());
+  libevent::EventPumpThread pump(base);
+  ThreadPool pool(FLAGS_num_threads);
+  UrlFetcher fetcher(base.get(), &pool);
+
+  vector<string> servers{FLAGS_log_server};
+  if (!FLAGS_compare_log_server.empty()) {
+    servers.emplace_back(FLAGS_compare_log_server);
+  }
+  Replayer replayer(&fetcher, &pool, servers);
+  RequestCapture::Reader reader(FLAGS_capture_file);
+  replayer.Run(&reader);
+
+  replayer.Report(&std::cout);
+  return 0;
+}
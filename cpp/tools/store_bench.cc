@@ -0,0 +1,302 @@
+// Measures how the frontends and the sequencer fare against etcd, by
+// running them on top of a FakeEtcdClient slowed down to look like a
+// real cluster (see --etcd_latency_us, --etcd_max_concurrent_requests
+// and --etcd_max_requests_per_second). This makes it possible to see
+// what batching and group commits buy, without an etcd cluster. It
+// times these phases:
+//
+//   queue            FrontendSigner::QueueEntry() of --num_entries new
+//                    entries, from --num_frontend_threads threads
+//                    sharing one FrontendSigner, as the server does.
+//   sequence         TreeSigner::SequenceNewEntries(), until all the
+//                    entries are sequenced.
+//   update-tree      TreeSigner::UpdateTree() of all the entries.
+//
+// Then reports their throughput in entries per second, the latency of
+// their operations, and the number of etcd requests they made. The
+// entries are written to a LevelDB database in --db_dir, which must be
+// empty.
+
+#include <gflags/gflags.h>
+#include <glog/logging.h>
+#include <stdint.h>
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <iomanip>
+#include <iostream>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "config.h"
+#include "log/etcd_consistent_store.h"
+#include "log/frontend_signer.h"
+#include "log/leveldb_db.h"
+#include "log/log_signer.h"
+#include "log/tree_signer.h"
+#include "merkletree/compact_merkle_tree.h"
+#include "merkletree/serial_hasher.h"
+#include "proto/cert_serializer.h"
+#include "util/fake_etcd.h"
+#include "util/init.h"
+#include "util/libevent_wrapper.h"
+#include "util/masterelection.h"
+#include "util/read_key.h"
+#include "util/sync_task.h"
+#include "util/thread_pool.h"
+
+DEFINE_string(db_dir, "",
+              "Directory to create the database in, which must be empty");
+DEFINE_string(key, TEST_SRCDIR "/test/testdata/ct-server-key.pem",
+              "PEM-encoded private key to sign with");
+DEFINE_int64(num_entries, 10000, "Number of entries to queue");
+DEFINE_int32(num_frontend_threads, 16,
+             "Number of threads queueing entries at once");
+DEFINE_int32(entry_size, 1500,
+             "Size of the leaf certificate of each entry, in bytes");
+DEFINE_int32(etcd_latency_us, 2000,
+             "How long each etcd request takes, in microseconds");
+DEFINE_int32(etcd_max_concurrent_requests, 0,
+             "How many etcd requests can be in progress at once, 0 for no "
+             "limit");
+DEFINE_int32(etcd_max_requests_per_second, 0,
+             "How many etcd requests can be started per second, 0 for no "
+             "limit");
+DEFINE_int32(num_store_threads, 4,
+             "Number of threads of the pool used by the store");
+
+namespace libevent = cert_trans::libevent;
+
+using cert_trans::EtcdClient;
+using cert_trans::EtcdConsistentStore;
+using cert_trans::FakeEtcdClient;
+using cert_trans::LevelDB;
+using cert_trans::MasterElection;
+using cert_trans::ReadPrivateKey;
+using cert_trans::ThreadPool;
+using cert_trans::TreeSigner;
+using ct::LogEntry;
+using ct::SignedCertificateTimestamp;
+using ct::SignedTreeHead;
+using std::atomic;
+using std::chrono::duration;
+using std::chrono::microseconds;
+using std::chrono::steady_clock;
+using std::cout;
+using std::make_shared;
+using std::shared_ptr;
+using std::string;
+using std::thread;
+using std::unique_ptr;
+using std::vector;
+using util::SyncTask;
+
+namespace {
+
+
+// The benchmark is the only node, so it is always the master.
+class AlwaysMaster : public MasterElection {
+ public:
+  void StartElection() override {
+  }
+
+  void StopElection() override {
+  }
+
+  bool WaitToBecomeMaster() const override {
+    return true;
+  }
+
+  bool IsMaster() const override {
+    return true;
+  }
+};
+
+
+// splitmix64, so that entry |index| has the same contents every time.
+uint64_t Mix(uint64_t x) {
+  x += 0x9e3779b97f4a7c15ULL;
+  x = (x ^ (x >> 30)) * 0xbf58476d1ce4e5b9ULL;
+  x = (x ^ (x >> 27)) * 0x94d049bb133111ebULL;
+  return x ^ (x >> 31);
+}
+
+
+void MakeEntry(int64_t index, LogEntry* entry) {
+  string leaf(FLAGS_entry_size, '\0');
+  for (size_t i = 0; i < leaf.size(); i += 8) {
+    const uint64_t r(Mix(index * FLAGS_entry_size + i));
+    for (size_t j = 0; j < 8 && i + j < leaf.size(); ++j) {
+      leaf[i + j] = static_cast<char>(r >> (8 * j));
+    }
+  }
+  entry->Clear();
+  entry->set_type(ct::X509_ENTRY);
+  entry->mutable_x509_entry()->set_leaf_certificate(leaf);
+}
+
+
+// The number of requests |etcd| has served so far.
+int64_t EtcdRequests(FakeEtcdClient* etcd, libevent::Base* base) {
+  SyncTask task(base);
+  EtcdClient::StatsResponse resp;
+  etcd->GetStoreStats(&resp, task.task());
+  task.Wait();
+  CHECK_EQ(::util::OkStatus(), task.status());
+  int64_t total(0);
+  for (const auto& stat : resp.stats) {
+    if (stat.first != "watchers" && stat.first != "expireCount") {
+      total += stat.second;
+    }
+  }
+  return total;
+}
+
+
+// Times a phase of |ops| operations, and prints how it went.
+class Phase {
+ public:
+  Phase(const char* name, int64_t ops, FakeEtcdClient* etcd,
+        libevent::Base* base)
+      : name_(name),
+        ops_(ops),
+        etcd_(etcd),
+        base_(base),
+        start_(steady_clock::now()),
+        start_requests_(EtcdRequests(etcd_, base_)) {
+    LOG(INFO) << "starting " << name_;
+  }
+
+  ~Phase() {
+    const double secs(
+        duration<double>(steady_clock::now() - start_).count());
+    const int64_t requests(EtcdRequests(etcd_, base_) - start_requests_);
+    std::sort(latencies_ms_.begin(), latencies_ms_.end());
+    cout << std::left << std::setw(16) << name_ << std::right << std::fixed
+         << std::setprecision(1) << std::setw(12) << ops_ << std::setw(10)
+         << secs << std::setw(12) << ops_ / secs << std::setw(10)
+         << Quantile(0.5) << std::setw(10) << Quantile(0.99) << std::setw(14)
+         << requests << std::endl;
+  }
+
+  // Records the latency of one operation, which started at |start|.
+  // Can be called from several threads.
+  void OpDone(const steady_clock::time_point& start) {
+    const double ms(
+        duration<double, std::milli>(steady_clock::now() - start).count());
+    std::lock_guard<std::mutex> lock(lock_);
+    latencies_ms_.push_back(ms);
+  }
+
+ private:
+  double Quantile(double q) const {
+    if (latencies_ms_.empty()) {
+      return 0;
+    }
+    return latencies_ms_[static_cast<size_t>(q * (latencies_ms_.size() - 1))];
+  }
+
+  const char* const name_;
+  const int64_t ops_;
+  FakeEtcdClient* const etcd_;
+  libevent::Base* const base_;
+  const steady_clock::time_point start_;
+  const int64_t start_requests_;
+  std::mutex lock_;
+  vector<double> latencies_ms_;
+};
+
+
+}  // namespace
+
+
+int main(int argc, char* argv[]) {
+  util::InitCT(&argc, &argv);
+  ConfigureSerializerForV1CT();
+
+  CHECK(!FLAGS_db_dir.empty()) << "--db_dir is required";
+  CHECK_GT(FLAGS_num_entries, 0);
+  CHECK_GT(FLAGS_num_frontend_threads, 0);
+
+  const shared_ptr<libevent::Base> base(make_shared<libevent::Base>());
+  libevent::EventPumpThread pump(base);
+  FakeEtcdClient::Options options;
+  options.request_latency = microseconds(FLAGS_etcd_latency_us);
+  options.max_concurrent_requests = FLAGS_etcd_max_concurrent_requests;
+  options.max_requests_per_second = FLAGS_etcd_max_requests_per_second;
+  FakeEtcdClient etcd(base.get(), options);
+  ThreadPool pool(FLAGS_num_store_threads);
+  AlwaysMaster election;
+  EtcdConsistentStore store(base.get(), &pool, &etcd, &election, "/root",
+                            "id");
+
+  // What a new log starts with.
+  CHECK_EQ(::util::OkStatus(), store.SetServingSTH(SignedTreeHead()));
+  {
+    SyncTask task(&pool);
+    EtcdClient::Response resp;
+    etcd.ForceSet("/root/sequence_mapping", "", &resp, task.task());
+    task.Wait();
+    CHECK_EQ(::util::OkStatus(), task.status());
+  }
+
+  util::StatusOr<EVP_PKEY*> pkey(ReadPrivateKey(FLAGS_key));
+  CHECK_EQ(::util::OkStatus(), pkey.status());
+  LogSigner log_signer(pkey.ValueOrDie());
+  LevelDB db(FLAGS_db_dir + "/leveldb");
+  CHECK_EQ(0, db.TreeSize()) << FLAGS_db_dir << " is not empty";
+  FrontendSigner frontend(&db, &store, &log_signer);
+  TreeSigner tree_signer(
+      duration<double>(0), &db,
+      unique_ptr<CompactMerkleTree>(
+          new CompactMerkleTree(unique_ptr<Sha256Hasher>(new Sha256Hasher))),
+      &store, &log_signer);
+
+  cout << std::left << std::setw(16) << "phase" << std::right
+       << std::setw(12) << "ops" << std::setw(10) << "secs" << std::setw(12)
+       << "ops/s" << std::setw(10) << "p50 ms" << std::setw(10) << "p99 ms"
+       << std::setw(14) << "etcd requests" << std::endl;
+
+  {
+    Phase phase("queue", FLAGS_num_entries, &etcd, base.get());
+    atomic<int64_t> next_entry(0);
+    vector<thread> threads;
+    for (int i = 0; i < FLAGS_num_frontend_threads; ++i) {
+      threads.emplace_back([&frontend, &next_entry, &phase]() {
+        LogEntry entry;
+        SignedCertificateTimestamp sct;
+        for (int64_t index = next_entry++; index < FLAGS_num_entries;
+             index = next_entry++) {
+          MakeEntry(index, &entry);
+          const steady_clock::time_point start(steady_clock::now());
+          CHECK_EQ(::util::OkStatus(), frontend.QueueEntry(entry, &sct));
+          phase.OpDone(start);
+        }
+      });
+    }
+    for (auto& t : threads) {
+      t.join();
+    }
+  }
+
+  {
+    Phase phase("sequence", FLAGS_num_entries, &etcd, base.get());
+    while (db.TreeSize() < FLAGS_num_entries) {
+      const steady_clock::time_point start(steady_clock::now());
+      CHECK_EQ(::util::OkStatus(), tree_signer.SequenceNewEntries());
+      phase.OpDone(start);
+    }
+  }
+
+  {
+    Phase phase("update-tree", FLAGS_num_entries, &etcd, base.get());
+    const steady_clock::time_point start(steady_clock::now());
+    CHECK_EQ(TreeSigner::OK, tree_signer.UpdateTree());
+    phase.OpDone(start);
+  }
+
+  return 0;
+}
@@ -0,0 +1,241 @@
+#include "util/async_log.h"
+
+#include <chrono>
+#include <condition_variable>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "monitoring/monitoring.h"
+
+using cert_trans::Counter;
+using std::atomic;
+using std::chrono::duration_cast;
+using std::chrono::milliseconds;
+using std::chrono::seconds;
+using std::chrono::steady_clock;
+using std::condition_variable;
+using std::lock_guard;
+using std::mutex;
+using std::string;
+using std::thread;
+using std::unique_lock;
+using std::vector;
+
+namespace util {
+
+namespace {
+
+
+Counter<string>* DroppedMessages() {
+  static Counter<string>* const dropped_messages(Counter<string>::New(
+      "logging_dropped_messages", "reason",
+      "Number of log messages dropped, broken down by whether the queue "
+      "of messages to write was full, or they were rate limited."));
+  return dropped_messages;
+}
+
+
+// The queue of the messages to write, and the thread writing them.
+//
+// glog holds its own lock when it hands messages to the loggers, so
+// there is only ever one thread pushing to the ring at a time, which
+// is all it needs to be safe without a lock of its own.
+class AsyncLogWriter {
+ public:
+  explicit AsyncLogWriter(size_t capacity);
+
+  // Queues |message|, for |logger| to write, or drops it if the queue
+  // is full. Must only be called with glog's lock held.
+  void Push(google::base::Logger* logger, bool force_flush,
+            time_t timestamp, const char* message, int length);
+
+  // Writes the messages queued so far.
+  void Drain();
+
+ private:
+  struct Entry {
+    google::base::Logger* logger;
+    bool force_flush;
+    time_t timestamp;
+    // Kept between uses, to avoid allocating for every message.
+    string message;
+  };
+
+  void Run();
+  // Writes the messages queued, if any, and returns whether there were
+  // any. Must be called with |drain_lock_| held.
+  bool WriteQueued();
+
+  // One more than the capacity, so that full and empty can be told
+  // apart.
+  vector<Entry> ring_;
+  // The next entry to push, and the next to write.
+  atomic<size_t> head_;
+  atomic<size_t> tail_;
+
+  // Held while writing, to keep Drain() and the writer thread apart.
+  mutex drain_lock_;
+
+  mutex wake_lock_;
+  condition_variable wake_;
+  atomic<bool> sleeping_;
+
+  thread thread_;
+};
+
+
+AsyncLogWriter::AsyncLogWriter(size_t capacity)
+    : ring_(capacity + 1),
+      head_(0),
+      tail_(0),
+      sleeping_(false),
+      thread_(&AsyncLogWriter::Run, this) {
+  CHECK_GT(capacity, 0U);
+}
+
+
+void AsyncLogWriter::Push(google::base::Logger* logger, bool force_flush,
+                          time_t timestamp, const char* message,
+                          int length) {
+  const size_t head(head_.load(std::memory_order_relaxed));
+  const size_t next((head + 1) % ring_.size());
+  if (next == tail_.load(std::memory_order_acquire)) {
+    DroppedMessages()->Increment("queue_full");
+    return;
+  }
+
+  Entry* const entry(&ring_[head]);
+  entry->logger = logger;
+  entry->force_flush = force_flush;
+  entry->timestamp = timestamp;
+  entry->message.assign(message, length);
+  head_.store(next, std::memory_order_release);
+
+  if (sleeping_.load()) {
+    wake_.notify_one();
+  }
+}
+
+
+void AsyncLogWriter::Drain() {
+  lock_guard<mutex> lock(drain_lock_);
+  WriteQueued();
+}
+
+
+void AsyncLogWriter::Run() {
+  while (true) {
+    {
+      lock_guard<mutex> lock(drain_lock_);
+      if (WriteQueued()) {
+        continue;
+      }
+    }
+
+    // A message pushed just as this goes to sleep may not wake it up,
+    // so it does not sleep for long.
+    unique_lock<mutex> lock(wake_lock_);
+    sleeping_ = true;
+    if (tail_.load() == head_.load()) {
+      wake_.wait_for(lock, milliseconds(10));
+    }
+    sleeping_ = false;
+  }
+}
+
+
+bool AsyncLogWriter::WriteQueued() {
+  size_t tail(tail_.load(std::memory_order_relaxed));
+  const size_t head(head_.load(std::memory_order_acquire));
+  if (tail == head) {
+    return false;
+  }
+  while (tail != head) {
+    const Entry& entry(ring_[tail]);
+    entry.logger->Write(entry.force_flush, entry.timestamp,
+                        entry.message.data(), entry.message.size());
+    tail = (tail + 1) % ring_.size();
+    tail_.store(tail, std::memory_order_release);
+  }
+  return true;
+}
+
+
+// Stands in for the logger of one severity, queueing the messages for
+// the logger it replaced.
+class AsyncLogger : public google::base::Logger {
+ public:
+  // For FATAL messages, |sync| has the queued messages written, and the
+  // message itself, straight away, as the process is about to end.
+  AsyncLogger(AsyncLogWriter* writer, google::base::Logger* logger,
+              bool sync)
+      : writer_(writer), logger_(logger), sync_(sync) {
+  }
+
+  void Write(bool force_flush, time_t timestamp, const char* message,
+             int length) override {
+    if (sync_) {
+      writer_->Drain();
+      logger_->Write(force_flush, timestamp, message, length);
+    } else {
+      writer_->Push(logger_, force_flush, timestamp, message, length);
+    }
+  }
+
+  void Flush() override {
+    writer_->Drain();
+    logger_->Flush();
+  }
+
+  google::uint32 LogSize() override {
+    return logger_->LogSize();
+  }
+
+ private:
+  AsyncLogWriter* const writer_;
+  google::base::Logger* const logger_;
+  const bool sync_;
+};
+
+
+}  // namespace
+
+
+void StartAsyncLogging(size_t capacity) {
+  // These stay around for as long as glog does, that is, for good.
+  AsyncLogWriter* const writer(new AsyncLogWriter(capacity));
+  for (int severity = google::GLOG_INFO; severity < google::NUM_SEVERITIES;
+       ++severity) {
+    google::base::SetLogger(severity,
+                            new AsyncLogger(writer,
+                                            google::base::GetLogger(severity),
+                                            severity == google::GLOG_FATAL));
+  }
+}
+
+
+LogRateLimiter::LogRateLimiter(int max_per_second)
+    : max_per_second_(max_per_second), second_(0), count_(0) {
+  CHECK_GT(max_per_second_, 0);
+}
+
+
+bool LogRateLimiter::Allow() {
+  const int64_t now(
+      duration_cast<seconds>(steady_clock::now().time_since_epoch())
+          .count());
+  int64_t second(second_.load());
+  if (second != now && second_.compare_exchange_strong(second, now)) {
+    count_ = 0;
+  }
+  if (++count_ <= max_per_second_) {
+    return true;
+  }
+  DroppedMessages()->Increment("rate_limited");
+  return false;
+}
+
+
+}  // namespace util
@@ -0,0 +1,59 @@
+#ifndef CERT_TRANS_UTIL_ASYNC_LOG_H_
+#define CERT_TRANS_UTIL_ASYNC_LOG_H_
+
+#include <glog/logging.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <atomic>
+
+namespace util {
+
+
+// Has glog write its log files from a background thread, so that the
+// threads logging, on request paths for instance, only have to queue
+// their messages rather than wait for the files (and each other).
+//
+// Up to |capacity| messages are queued, past which they are dropped,
+// and counted in the "logging_dropped_messages" metric. Messages of
+// severity FATAL are still written straight away, after those queued.
+// Messages to stderr are not affected.
+void StartAsyncLogging(size_t capacity);
+
+
+// Lets through at most |max_per_second| messages a second, see
+// LOG_RATE_LIMITED().
+//
+// This class is thread-safe.
+class LogRateLimiter {
+ public:
+  explicit LogRateLimiter(int max_per_second);
+  LogRateLimiter(const LogRateLimiter&) = delete;
+  LogRateLimiter& operator=(const LogRateLimiter&) = delete;
+
+  // Whether the next message may be logged. Those that may not are
+  // counted in the "logging_dropped_messages" metric.
+  bool Allow();
+
+ private:
+  const int max_per_second_;
+  // The second the messages in |count_| were logged in.
+  std::atomic<int64_t> second_;
+  std::atomic<int> count_;
+};
+
+
+}  // namespace util
+
+
+// Like LOG(severity), but logs at most |max_per_second| messages a
+// second from this call site, dropping the others, so that a burst of
+// errors does not hold up the threads reporting them. |max_per_second|
+// must be a constant.
+#define LOG_RATE_LIMITED(severity, max_per_second)              \
+  LOG_IF(severity, ([]() -> ::util::LogRateLimiter* {           \
+           static ::util::LogRateLimiter limiter(max_per_second); \
+           return &limiter;                                     \
+         })()->Allow())
+
+
+#endif  // CERT_TRANS_UTIL_ASYNC_LOG_H_
@@ -0,0 +1,88 @@
+#include "util/async_log.h"
+
+#include <glog/logging.h>
+#include <gtest/gtest.h>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include "util/testing.h"
+
+namespace util {
+namespace {
+
+using std::lock_guard;
+using std::mutex;
+using std::string;
+using std::vector;
+
+
+// Keeps the messages it is given.
+class FakeLogger : public google::base::Logger {
+ public:
+  void Write(bool, time_t, const char* message, int length) override {
+    lock_guard<mutex> lock(lock_);
+    messages_.emplace_back(message, length);
+  }
+
+  void Flush() override {
+  }
+
+  google::uint32 LogSize() override {
+    return 0;
+  }
+
+  vector<string> messages() {
+    lock_guard<mutex> lock(lock_);
+    return messages_;
+  }
+
+ private:
+  mutex lock_;
+  vector<string> messages_;
+};
+
+
+TEST(AsyncLogTest, WritesQueuedMessages) {
+  FLAGS_logtostderr = false;
+  // glog keeps using it until the end.
+  FakeLogger* const logger(new FakeLogger);
+  google::base::SetLogger(google::GLOG_WARNING, logger);
+  StartAsyncLogging(100);
+
+  for (int i = 0; i < 10; ++i) {
+    LOG(WARNING) << "message " << i;
+  }
+  google::FlushLogFiles(google::GLOG_WARNING);
+
+  const vector<string> messages(logger->messages());
+  ASSERT_EQ(10U, messages.size());
+  for (int i = 0; i < 10; ++i) {
+    EXPECT_NE(string::npos,
+              messages[i].find("message " + std::to_string(i)));
+  }
+}
+
+
+TEST(AsyncLogTest, RateLimiter) {
+  LogRateLimiter limiter(3);
+  int allowed(0);
+  for (int i = 0; i < 10; ++i) {
+    if (limiter.Allow()) {
+      ++allowed;
+    }
+  }
+  // Unless the second ended in between.
+  EXPECT_LE(3, allowed);
+  EXPECT_GT(10, allowed);
+}
+
+
+}  // namespace
+}  // namespace util
+
+
+int main(int argc, char** argv) {
+  cert_trans::test::InitTesting(argv[0], &argc, &argv, true);
+  return RUN_ALL_TESTS();
+}
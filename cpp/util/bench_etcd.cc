@@ -1,8 +1,40 @@
+// Runs a workload like that of a CT log cluster against an etcd
+// cluster, so that it can be sized before a log is launched. Under a
+// new directory of --test_key, it has:
+//
+//   --num_threads frontends, each adding --requests_per_thread
+//   pending entries of --bytes_per_request bytes (about the size of a
+//   serialized LoggedEntry) one after the other.
+//
+//   A sequencer, which every --sequence_interval_ms lists the pending
+//   entries, adds them to the sequence mapping with a
+//   read-modify-write cycle, and deletes those it had sequenced in its
+//   previous round, as the cleanup does.
+//
+//   --num_nodes nodes, each setting its node state with a TTL every
+//   --heartbeat_interval_ms.
+//
+//   --num_watchers watchers of the pending entries, as the controllers
+//   of the frontends and the sequencer have.
+//
+// Once the frontends are done, it reports the throughput and latency
+// percentiles of each type of operation, and how long the watchers
+// took to hear of new entries.
+
 #include <event2/thread.h>
 #include <gflags/gflags.h>
 #include <glog/logging.h>
+#include <stdint.h>
+#include <time.h>
+#include <algorithm>
+#include <chrono>
+#include <condition_variable>
 #include <functional>
+#include <iomanip>
+#include <iostream>
+#include <map>
 #include <memory>
+#include <mutex>
 #include <string>
 #include <thread>
 #include <vector>
@@ -18,86 +50,323 @@ using cert_trans::EtcdClient;
 using cert_trans::ThreadPool;
 using cert_trans::UrlFetcher;
 using std::bind;
+using std::chrono::duration;
+using std::chrono::milliseconds;
+using std::chrono::seconds;
+using std::chrono::steady_clock;
+using std::condition_variable;
+using std::cout;
+using std::lock_guard;
 using std::make_shared;
+using std::map;
+using std::mutex;
 using std::placeholders::_1;
 using std::shared_ptr;
 using std::string;
 using std::thread;
 using std::to_string;
+using std::unique_lock;
+using std::unique_ptr;
 using std::vector;
 using util::Status;
 using util::SyncTask;
-using util::Task;
 
 DEFINE_string(etcd, "127.0.0.1", "etcd server address");
 DEFINE_int32(etcd_port, 4001, "etcd server port");
-DEFINE_int32(requests_per_thread, 10, "number of requests per thread");
-DEFINE_int32(bytes_per_request, 10, "number of bytes per requests");
-DEFINE_int32(num_threads, 1, "number of threads");
+DEFINE_int32(requests_per_thread, 10,
+             "number of pending entries added by each frontend");
+DEFINE_int32(bytes_per_request, 2500,
+             "size of each pending entry, in bytes (a serialized "
+             "LoggedEntry with its chain is typically 2-5kB)");
+DEFINE_int32(num_threads, 1, "number of frontends");
+DEFINE_int32(num_nodes, 3, "number of nodes setting their node state");
+DEFINE_int32(heartbeat_interval_ms, 1000,
+             "how often each node sets its node state");
+DEFINE_int32(node_state_ttl_seconds, 10, "TTL of the node states");
+DEFINE_int32(num_watchers, 3, "number of watchers of the pending entries");
+DEFINE_int32(sequence_interval_ms, 1000,
+             "how often the sequencer runs, 0 to not run it");
+DEFINE_int32(mapping_bytes_per_entry, 48,
+             "size of each entry of the sequence mapping, in bytes");
 DEFINE_string(test_key, "/bench_etcd", "base etcd key for testing");
 
 namespace {
 
 
-struct State {
-  State(EtcdClient* etcd, int thread_num, Task* task)
-      : etcd_(CHECK_NOTNULL(etcd)),
-        key_prefix_(FLAGS_test_key + "/" + to_string(thread_num) + "/"),
-        task_(CHECK_NOTNULL(task)),
-        data_(FLAGS_bytes_per_request, 'x'),
-        next_key_(0),
-        num_left_(FLAGS_requests_per_thread) {
-    CHECK_GT(num_left_, 0);
+const char kEntriesDir[] = "/entries";
+const char kSequenceMapping[] = "/sequence_mapping";
+const char kNodesDir[] = "/nodes";
+
+
+// Latencies of one type of operation.
+class OpStats {
+ public:
+  void Record(const steady_clock::time_point& start, const Status& status) {
+    const double ms(
+        duration<double, std::milli>(steady_clock::now() - start).count());
+    lock_guard<mutex> lock(lock_);
+    if (status.ok()) {
+      latencies_ms_.push_back(ms);
+    } else {
+      VLOG(1) << "request failed: " << status;
+      ++num_errors_;
+    }
+  }
+
+  void Print(const string& name, double secs) {
+    lock_guard<mutex> lock(lock_);
+    std::sort(latencies_ms_.begin(), latencies_ms_.end());
+    cout << std::left << std::setw(16) << name << std::right << std::fixed
+         << std::setprecision(1) << std::setw(10) << latencies_ms_.size()
+         << std::setw(8) << num_errors_ << std::setw(10)
+         << latencies_ms_.size() / secs << std::setw(10) << Quantile(0.5)
+         << std::setw(10) << Quantile(0.9) << std::setw(10) << Quantile(0.99)
+         << std::setw(10) << Quantile(1) << std::endl;
+  }
+
+ private:
+  double Quantile(double q) const {
+    if (latencies_ms_.empty()) {
+      return 0;
+    }
+    return latencies_ms_[static_cast<size_t>(q * (latencies_ms_.size() - 1))];
+  }
+
+  mutex lock_;
+  vector<double> latencies_ms_;
+  int64_t num_errors_ = 0;
+};
+
+
+class Benchmark {
+ public:
+  Benchmark(EtcdClient* etcd, libevent::Base* base)
+      : etcd_(etcd),
+        base_(base),
+        // Each run has keys of its own, so that it does not trip on
+        // what previous ones left behind.
+        root_(FLAGS_test_key + "/" + to_string(time(nullptr))),
+        frontends_done_(false) {
+  }
+
+  void Run();
+
+ private:
+  OpStats* Stats(const string& op) {
+    lock_guard<mutex> lock(stats_lock_);
+    return &stats_[op];
   }
 
-  void MakeRequest();
-  void RequestDone(Task* child_task);
+  // Sleeps for |interval|, returning false if the frontends finished
+  // in the meantime.
+  bool Sleep(const milliseconds& interval) {
+    unique_lock<mutex> lock(done_lock_);
+    return !done_cv_.wait_for(lock, interval,
+                              [this]() { return frontends_done_; });
+  }
+
+  void Frontend(int thread_num);
+  void Sequencer();
+  void Node(int node_num);
+  void OnEntriesUpdated(const vector<EtcdClient::Node>& updates);
 
   EtcdClient* const etcd_;
-  const string key_prefix_;
-  Task* const task_;
-  const string data_;
+  libevent::Base* const base_;
+  const string root_;
 
-  int64_t next_key_;
-  EtcdClient::Response resp_;
-  int num_left_;
+  mutex stats_lock_;
+  map<string, OpStats> stats_;
+
+  mutex done_lock_;
+  condition_variable done_cv_;
+  bool frontends_done_;
 };
 
 
-void State::MakeRequest() {
-  etcd_->Create(key_prefix_ + to_string(next_key_), "value", &resp_,
-                task_->AddChild(bind(&State::RequestDone, this, _1)));
+void Benchmark::Frontend(int thread_num) {
+  OpStats* const stats(Stats("create_entry"));
+  const string prefix(root_ + kEntriesDir + "/" +
+                      to_string(thread_num) + "-");
+  const string padding(FLAGS_bytes_per_request, 'x');
+  for (int i = 0; i < FLAGS_requests_per_thread; ++i) {
+    // The creation time goes first, so that watchers can tell how long
+    // the entry took to reach them.
+    const steady_clock::time_point start(steady_clock::now());
+    string value(to_string(start.time_since_epoch().count()) + ";");
+    value.append(padding, 0, padding.size() - std::min(padding.size(),
+                                                        value.size()));
+
+    SyncTask task(base_);
+    EtcdClient::Response resp;
+    etcd_->Create(prefix + to_string(i), value, &resp, task.task());
+    task.Wait();
+    stats->Record(start, task.status());
+  }
 }
 
 
-void State::RequestDone(Task* child_task) {
-  CHECK_EQ(::util::OkStatus(), child_task->status());
-  --num_left_;
-  next_key_ = resp_.etcd_index;
+void Benchmark::Sequencer() {
+  OpStats* const list_stats(Stats("list_entries"));
+  OpStats* const get_stats(Stats("get_mapping"));
+  OpStats* const update_stats(Stats("update_mapping"));
+  OpStats* const delete_stats(Stats("delete_entry"));
+  const string mapping_key(root_ + kSequenceMapping);
+  map<string, int64_t> to_delete;
+  bool last_round(false);
+
+  while (!last_round) {
+    last_round = !Sleep(milliseconds(FLAGS_sequence_interval_ms));
+
+    steady_clock::time_point start(steady_clock::now());
+    EtcdClient::GetResponse entries;
+    {
+      SyncTask task(base_);
+      etcd_->Get(root_ + kEntriesDir, &entries, task.task());
+      task.Wait();
+      // There are no entries yet on the first rounds.
+      if (task.status().CanonicalCode() != util::error::NOT_FOUND) {
+        list_stats->Record(start, task.status());
+      }
+    }
+
+    start = steady_clock::now();
+    EtcdClient::GetResponse mapping;
+    {
+      SyncTask task(base_);
+      etcd_->Get(mapping_key, &mapping, task.task());
+      task.Wait();
+      get_stats->Record(start, task.status());
+      if (!task.status().ok()) {
+        continue;
+      }
+    }
 
-  if (num_left_ > 0) {
-    MakeRequest();
-  } else {
-    task_->Return();
+    // The mapping loses the entries deleted in the previous round, and
+    // gains those that are new.
+    size_t num_mapped(mapping.node.value_.size() /
+                      FLAGS_mapping_bytes_per_entry);
+    num_mapped -= std::min(num_mapped, to_delete.size());
+    map<string, int64_t> sequenced;
+    for (const auto& node : entries.node.nodes_) {
+      if (to_delete.find(node.key_) == to_delete.end()) {
+        sequenced[node.key_] = node.modified_index_;
+      }
+    }
+    num_mapped += sequenced.size();
+
+    start = steady_clock::now();
+    {
+      SyncTask task(base_);
+      EtcdClient::Response resp;
+      etcd_->Update(mapping_key,
+                    string(num_mapped * FLAGS_mapping_bytes_per_entry, 'm'),
+                    mapping.node.modified_index_, &resp, task.task());
+      task.Wait();
+      update_stats->Record(start, task.status());
+      if (!task.status().ok()) {
+        continue;
+      }
+    }
+
+    for (const auto& entry : to_delete) {
+      start = steady_clock::now();
+      SyncTask task(base_);
+      etcd_->Delete(entry.first, entry.second, task.task());
+      task.Wait();
+      delete_stats->Record(start, task.status());
+    }
+    to_delete.swap(sequenced);
   }
 }
 
 
-void test_etcd(int thread_num) {
-  const shared_ptr<libevent::Base> event_base(make_shared<libevent::Base>());
-  libevent::EventPumpThread pump(event_base);
-  ThreadPool pool;
-  UrlFetcher fetcher(event_base.get(), &pool);
-  EtcdClient etcd(&pool, &fetcher, FLAGS_etcd, FLAGS_etcd_port);
-  SyncTask task(event_base.get());
-  State state(&etcd, thread_num, task.task());
+void Benchmark::Node(int node_num) {
+  OpStats* const stats(Stats("node_heartbeat"));
+  const string key(root_ + kNodesDir + "/" + to_string(node_num));
+  const string value(256, 'n');
+  do {
+    const steady_clock::time_point start(steady_clock::now());
+    SyncTask task(base_);
+    EtcdClient::Response resp;
+    etcd_->ForceSetWithTTL(key, value, seconds(FLAGS_node_state_ttl_seconds),
+                           &resp, task.task());
+    task.Wait();
+    stats->Record(start, task.status());
+  } while (Sleep(milliseconds(FLAGS_heartbeat_interval_ms)));
+}
+
+
+void Benchmark::OnEntriesUpdated(const vector<EtcdClient::Node>& updates) {
+  OpStats* const stats(Stats("watch_delivery"));
+  for (const auto& node : updates) {
+    const string::size_type end(node.value_.find(';'));
+    if (node.deleted_ || end == string::npos) {
+      continue;
+    }
+    const steady_clock::time_point created(
+        steady_clock::duration(std::stoll(node.value_.substr(0, end))));
+    stats->Record(created, ::util::OkStatus());
+  }
+}
+
+
+void Benchmark::Run() {
+  LOG(INFO) << "using keys under " << root_;
+  {
+    SyncTask task(base_);
+    EtcdClient::Response resp;
+    etcd_->Create(root_ + kSequenceMapping, "", &resp, task.task());
+    task.Wait();
+    CHECK_EQ(::util::OkStatus(), task.status());
+  }
+
+  vector<unique_ptr<SyncTask>> watches;
+  for (int i = 0; i < FLAGS_num_watchers; ++i) {
+    watches.emplace_back(new SyncTask(base_));
+    etcd_->Watch(root_ + kEntriesDir,
+                 bind(&Benchmark::OnEntriesUpdated, this, _1),
+                 watches.back()->task());
+  }
+
+  const steady_clock::time_point start(steady_clock::now());
+  vector<thread> threads;
+  for (int i = 0; i < FLAGS_num_nodes; ++i) {
+    threads.emplace_back(bind(&Benchmark::Node, this, i));
+  }
+  if (FLAGS_sequence_interval_ms > 0) {
+    threads.emplace_back(bind(&Benchmark::Sequencer, this));
+  }
+  vector<thread> frontends;
+  for (int i = 0; i < FLAGS_num_threads; ++i) {
+    frontends.emplace_back(bind(&Benchmark::Frontend, this, i));
+  }
 
-  // Get the ball rolling...
-  state.MakeRequest();
+  for (auto& frontend : frontends) {
+    frontend.join();
+  }
+  const double secs(duration<double>(steady_clock::now() - start).count());
+  {
+    lock_guard<mutex> lock(done_lock_);
+    frontends_done_ = true;
+  }
+  done_cv_.notify_all();
+  for (auto& t : threads) {
+    t.join();
+  }
+  for (auto& watch : watches) {
+    watch->Cancel();
+    watch->Wait();
+  }
 
-  LOG(INFO) << "waiting for test completion";
-  task.Wait();
-  LOG(INFO) << "test complete";
+  cout << std::left << std::setw(16) << "operation" << std::right
+       << std::setw(10) << "ok" << std::setw(8) << "errors" << std::setw(10)
+       << "ok/s" << std::setw(10) << "p50 ms" << std::setw(10) << "p90 ms"
+       << std::setw(10) << "p99 ms" << std::setw(10) << "max ms"
+       << std::endl;
+  lock_guard<mutex> lock(stats_lock_);
+  for (auto& stats : stats_) {
+    stats.second.Print(stats.first, secs);
+  }
 }
 
 
@@ -112,16 +381,19 @@ int main(int argc, char* argv[]) {
   CHECK_GT(FLAGS_requests_per_thread, 0);
   CHECK_GE(FLAGS_bytes_per_request, 0);
   CHECK_GT(FLAGS_num_threads, 0);
+  CHECK_GE(FLAGS_num_nodes, 0);
+  CHECK_GT(FLAGS_heartbeat_interval_ms, 0);
+  CHECK_GE(FLAGS_num_watchers, 0);
+  CHECK_GE(FLAGS_sequence_interval_ms, 0);
+  CHECK_GT(FLAGS_mapping_bytes_per_entry, 0);
 
-  vector<thread> threads;
-  for (int i = 0; i < FLAGS_num_threads; ++i) {
-    threads.emplace_back(bind(test_etcd, i));
-  }
+  const shared_ptr<libevent::Base> event_base(make_shared<libevent::Base>());
+  libevent::EventPumpThread pump(event_base);
+  ThreadPool pool;
+  UrlFetcher fetcher(event_base.get(), &pool);
+  EtcdClient etcd(&pool, &fetcher, FLAGS_etcd, FLAGS_etcd_port);
 
-  for (vector<thread>::iterator it = threads.begin(); it != threads.end();
-       ++it) {
-    it->join();
-  }
+  Benchmark(&etcd, event_base.get()).Run();
 
   return 0;
 }
@@ -0,0 +1,284 @@
+// Microbenchmarks for the hot paths of the log: Merkle tree hashing and
+// proofs, serialization of SCTs and leaves, certificate chain checking
+// and JSON encoding.
+//
+// For results that are stable enough to compare between builds, pin
+// the process to a core and ask for repetitions, e.g. (on one line):
+//
+//   taskset -c 2 cpp/util/bench_hot_paths --benchmark_repetitions=10
+//       --benchmark_report_aggregates_only=true
+//       --benchmark_out=bench.json --benchmark_out_format=json
+//
+// The JSON output can be compared with the compare.py tool which comes
+// with Google Benchmark.
+
+#include <benchmark/benchmark.h>
+#include <gflags/gflags.h>
+#include <glog/logging.h>
+#include <openssl/err.h>
+#include <openssl/evp.h>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "config.h"
+#include "log/cert.h"
+#include "log/cert_checker.h"
+#include "log/ct_extensions.h"
+#include "log/logged_entry.h"
+#include "merkletree/compact_merkle_tree.h"
+#include "merkletree/merkle_tree.h"
+#include "merkletree/serial_hasher.h"
+#include "merkletree/sparse_merkle_tree.h"
+#include "merkletree/tree_hasher.h"
+#include "proto/cert_serializer.h"
+#include "proto/serializer.h"
+#include "util/json_wrapper.h"
+#include "util/util.h"
+
+DEFINE_string(testdata_dir, TEST_SRCDIR "/test/testdata",
+              "directory holding the test certificates");
+
+using cert_trans::CertChain;
+using cert_trans::CertChecker;
+using cert_trans::LoggedEntry;
+using cert_trans::serialization::SerializeResult;
+using std::string;
+using std::unique_ptr;
+using std::vector;
+
+namespace {
+
+
+// Deterministic contents, so that every run hashes the same bytes.
+string Leaf(int64_t index, size_t size) {
+  string ret(size, '\0');
+  for (size_t i = 0; i < size; ++i) {
+    ret[i] = static_cast<char>((index * 131 + i * 7) & 0xff);
+  }
+  return ret;
+}
+
+
+unique_ptr<SerialHasher> NewHasher() {
+  return unique_ptr<SerialHasher>(new Sha256Hasher);
+}
+
+
+void BM_TreeHasherHashLeaf(benchmark::State& state) {
+  const TreeHasher hasher(NewHasher());
+  const string data(Leaf(0, state.range(0)));
+  for (auto _ : state) {
+    benchmark::DoNotOptimize(hasher.HashLeaf(data));
+  }
+  state.SetBytesProcessed(state.iterations() * data.size());
+}
+BENCHMARK(BM_TreeHasherHashLeaf)->Arg(64)->Arg(1024)->Arg(4096);
+
+
+void BM_TreeHasherHashChildren(benchmark::State& state) {
+  const TreeHasher hasher(NewHasher());
+  const string left(hasher.HashLeaf("left"));
+  const string right(hasher.HashLeaf("right"));
+  for (auto _ : state) {
+    benchmark::DoNotOptimize(hasher.HashChildren(left, right));
+  }
+}
+BENCHMARK(BM_TreeHasherHashChildren);
+
+
+void BM_TreeHasherHashChildrenBatch(benchmark::State& state) {
+  const TreeHasher hasher(NewHasher());
+  const size_t count(state.range(0));
+  const string children(Leaf(0, 2 * count * hasher.DigestSize()));
+  string parents(count * hasher.DigestSize(), '\0');
+  for (auto _ : state) {
+    hasher.HashChildrenBatch(children.data(), count, &parents[0]);
+    benchmark::ClobberMemory();
+  }
+  state.SetItemsProcessed(state.iterations() * count);
+}
+BENCHMARK(BM_TreeHasherHashChildrenBatch)->Arg(16)->Arg(1024);
+
+
+void BM_MerkleTreeAddLeafHash(benchmark::State& state) {
+  const TreeHasher hasher(NewHasher());
+  vector<string> hashes;
+  for (int i = 0; i < 1024; ++i) {
+    hashes.emplace_back(hasher.HashLeaf(Leaf(i, 32)));
+  }
+  unique_ptr<MerkleTree> tree(new MerkleTree(NewHasher()));
+  size_t next(0);
+  for (auto _ : state) {
+    tree->AddLeafHash(hashes[next++ % hashes.size()]);
+    // Keep the tree, and so the cost of growing its levels, bounded.
+    if (tree->LeafCount() == 1 << 20) {
+      state.PauseTiming();
+      tree.reset(new MerkleTree(NewHasher()));
+      state.ResumeTiming();
+    }
+  }
+  state.SetItemsProcessed(state.iterations());
+}
+BENCHMARK(BM_MerkleTreeAddLeafHash);
+
+
+void BM_MerkleTreePathToRootAtSnapshot(benchmark::State& state) {
+  const size_t size(state.range(0));
+  MerkleTree tree(NewHasher());
+  for (size_t i = 0; i < size; ++i) {
+    tree.AddLeaf(Leaf(i, 32));
+  }
+  tree.CurrentRoot();
+  // Walks the leaves with a stride coprime to the tree size, so that
+  // successive paths share little.
+  size_t leaf(0);
+  for (auto _ : state) {
+    benchmark::DoNotOptimize(tree.PathToRootAtSnapshot(leaf + 1, size));
+    leaf = (leaf + 7919) % size;
+  }
+}
+BENCHMARK(BM_MerkleTreePathToRootAtSnapshot)->Arg(1 << 10)->Arg(1 << 20);
+
+
+void BM_CompactMerkleTreeAddLeaf(benchmark::State& state) {
+  vector<string> leaves;
+  for (int i = 0; i < 1024; ++i) {
+    leaves.emplace_back(Leaf(i, 256));
+  }
+  CompactMerkleTree tree(NewHasher());
+  size_t next(0);
+  for (auto _ : state) {
+    tree.AddLeaf(leaves[next++ % leaves.size()]);
+  }
+  benchmark::DoNotOptimize(tree.CurrentRoot());
+  state.SetItemsProcessed(state.iterations());
+}
+BENCHMARK(BM_CompactMerkleTreeAddLeaf);
+
+
+void BM_SparseMerkleTreeSetLeaf(benchmark::State& state) {
+  const TreeHasher hasher(NewHasher());
+  vector<SparseMerkleTree::Path> paths;
+  for (int i = 0; i < 1024; ++i) {
+    paths.emplace_back(PathFromBytes(hasher.HashLeaf(Leaf(i, 8))));
+  }
+  const string value(Leaf(0, 64));
+  SparseMerkleTree tree(new Sha256Hasher);
+  size_t next(0);
+  for (auto _ : state) {
+    tree.SetLeaf(paths[next++ % paths.size()], value);
+  }
+  state.SetItemsProcessed(state.iterations());
+}
+BENCHMARK(BM_SparseMerkleTreeSetLeaf);
+
+
+void SetEntry(LoggedEntry* logged) {
+  ct::SignedCertificateTimestamp* const sct(logged->mutable_sct());
+  sct->set_version(ct::V1);
+  sct->mutable_id()->set_key_id(string(32, 'k'));
+  sct->set_timestamp(1469000000000ULL);
+  sct->mutable_signature()->set_hash_algorithm(ct::DigitallySigned::SHA256);
+  sct->mutable_signature()->set_sig_algorithm(ct::DigitallySigned::ECDSA);
+  sct->mutable_signature()->set_signature(Leaf(1, 72));
+
+  ct::LogEntry* const entry(logged->mutable_entry());
+  entry->set_type(ct::X509_ENTRY);
+  entry->mutable_x509_entry()->set_leaf_certificate(Leaf(2, 1200));
+  entry->mutable_x509_entry()->add_certificate_chain(Leaf(3, 1100));
+  entry->mutable_x509_entry()->add_certificate_chain(Leaf(4, 900));
+}
+
+
+void BM_SerializeSCT(benchmark::State& state) {
+  LoggedEntry logged;
+  SetEntry(&logged);
+  string result;
+  for (auto _ : state) {
+    CHECK_EQ(SerializeResult::OK,
+             Serializer::SerializeSCT(logged.sct(), &result));
+  }
+}
+BENCHMARK(BM_SerializeSCT);
+
+
+void BM_LoggedEntrySerializeForLeaf(benchmark::State& state) {
+  LoggedEntry logged;
+  SetEntry(&logged);
+  // Whether the entry has its serving data stored already.
+  if (state.range(0)) {
+    CHECK(logged.StoreServingData());
+  }
+  string result;
+  for (auto _ : state) {
+    CHECK(logged.SerializeForLeaf(&result));
+  }
+}
+BENCHMARK(BM_LoggedEntrySerializeForLeaf)->Arg(0)->Arg(1);
+
+
+void BM_CertCheckerCheckCertChain(benchmark::State& state) {
+  CertChecker checker;
+  CHECK(checker.LoadTrustedCertificates(FLAGS_testdata_dir + "/ca-cert.pem"))
+      << "Wrong --testdata_dir?";
+  string pem;
+  CHECK(util::ReadTextFile(FLAGS_testdata_dir + "/test-intermediate-cert.pem",
+                           &pem));
+  string intermediate_pem;
+  CHECK(util::ReadTextFile(FLAGS_testdata_dir + "/intermediate-cert.pem",
+                           &intermediate_pem));
+  pem.append(intermediate_pem);
+
+  for (auto _ : state) {
+    // Checking may complete the chain, so use a fresh one each time,
+    // which also counts parsing the submission.
+    CertChain chain(pem);
+    CHECK(checker.CheckCertChain(&chain).ok());
+  }
+}
+BENCHMARK(BM_CertCheckerCheckCertChain);
+
+
+void BM_JsonObjectEncode(benchmark::State& state) {
+  LoggedEntry logged;
+  SetEntry(&logged);
+  string leaf_input;
+  CHECK(logged.SerializeForLeaf(&leaf_input));
+  string extra_data;
+  CHECK(logged.SerializeExtraData(&extra_data));
+
+  for (auto _ : state) {
+    // The shape of a get-entries response with |state.range(0)| entries.
+    JsonArray entries;
+    for (int i = 0; i < state.range(0); ++i) {
+      JsonObject entry;
+      entry.AddBase64("leaf_input", leaf_input);
+      entry.AddBase64("extra_data", extra_data);
+      entries.Add(&entry);
+    }
+    JsonObject response;
+    response.Add("entries", entries);
+    benchmark::DoNotOptimize(response.ToString());
+  }
+  state.SetItemsProcessed(state.iterations() * state.range(0));
+}
+BENCHMARK(BM_JsonObjectEncode)->Arg(1)->Arg(100);
+
+
+}  // namespace
+
+
+int main(int argc, char* argv[]) {
+  // Google Benchmark takes its own flags out first.
+  benchmark::Initialize(&argc, argv);
+  google::ParseCommandLineFlags(&argc, &argv, true);
+  google::InitGoogleLogging(argv[0]);
+  OpenSSL_add_all_algorithms();
+  ERR_load_crypto_strings();
+  cert_trans::LoadCtExtensions();
+  ConfigureSerializerForV1CT();
+
+  benchmark::RunSpecifiedBenchmarks();
+  return 0;
+}
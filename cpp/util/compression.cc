@@ -0,0 +1,295 @@
+#include "config.h"
+#include "util/compression.h"
+
+#include <glog/logging.h>
+#include <memory>
+
+#ifdef HAVE_BROTLI
+#include <brotli/encode.h>
+#endif
+#ifdef HAVE_ZLIB
+#include <zlib.h>
+#endif
+#ifdef HAVE_ZSTD
+#include <zstd.h>
+#endif
+
+using std::string;
+using std::unique_ptr;
+
+namespace cert_trans {
+namespace {
+
+
+// Levels used by Compress(), which favour speed, as responses are
+// compressed as they are served.
+const int kGzipLevel = 6;
+const int kBrotliQuality = 5;
+const int kZstdLevel = 3;
+
+
+}  // namespace
+
+
+const char* ContentEncodingName(ContentEncoding encoding) {
+  switch (encoding) {
+    case ContentEncoding::IDENTITY:
+      return "identity";
+    case ContentEncoding::GZIP:
+      return "gzip";
+    case ContentEncoding::BROTLI:
+      return "br";
+    case ContentEncoding::ZSTD:
+      return "zstd";
+  }
+  LOG(FATAL) << "unknown content encoding " << static_cast<int>(encoding);
+}
+
+
+bool ContentEncodingSupported(ContentEncoding encoding) {
+  switch (encoding) {
+    case ContentEncoding::IDENTITY:
+      return true;
+    case ContentEncoding::GZIP:
+#ifdef HAVE_ZLIB
+      return true;
+#else
+      return false;
+#endif
+    case ContentEncoding::BROTLI:
+#ifdef HAVE_BROTLI
+      return true;
+#else
+      return false;
+#endif
+    case ContentEncoding::ZSTD:
+      return ZstdSupported();
+  }
+  LOG(FATAL) << "unknown content encoding " << static_cast<int>(encoding);
+}
+
+
+bool Compress(ContentEncoding encoding, const string& input, string* output) {
+  switch (encoding) {
+    case ContentEncoding::IDENTITY:
+      CHECK_NOTNULL(output)->assign(input);
+      return true;
+    case ContentEncoding::GZIP:
+      return GzipCompress(input, kGzipLevel, output);
+    case ContentEncoding::BROTLI:
+      return BrotliCompress(input, kBrotliQuality, output);
+    case ContentEncoding::ZSTD:
+      return ZstdCompress(input, kZstdLevel, output);
+  }
+  LOG(FATAL) << "unknown content encoding " << static_cast<int>(encoding);
+}
+
+
+#ifdef HAVE_ZLIB
+
+bool GzipCompress(const string& input, int level, string* output) {
+  CHECK_NOTNULL(output);
+  z_stream stream{};
+  // The extra 16 in the window bits asks for a gzip wrapper, rather
+  // than zlib's own.
+  if (deflateInit2(&stream, level, Z_DEFLATED, 15 + 16, 8,
+                   Z_DEFAULT_STRATEGY) != Z_OK) {
+    LOG(WARNING) << "gzip compression failed to initialise";
+    return false;
+  }
+  output->resize(deflateBound(&stream, input.size()));
+  stream.next_in = reinterpret_cast<Bytef*>(const_cast<char*>(input.data()));
+  stream.avail_in = input.size();
+  stream.next_out = reinterpret_cast<Bytef*>(&(*output)[0]);
+  stream.avail_out = output->size();
+  // With an output buffer of deflateBound() bytes, this does it all.
+  const int ret(deflate(&stream, Z_FINISH));
+  deflateEnd(&stream);
+  if (ret != Z_STREAM_END) {
+    LOG(WARNING) << "gzip compression failed: " << ret;
+    output->clear();
+    return false;
+  }
+  output->resize(stream.total_out);
+  return true;
+}
+
+#else  // HAVE_ZLIB
+
+bool GzipCompress(const string&, int, string*) {
+  return false;
+}
+
+#endif  // HAVE_ZLIB
+
+
+#ifdef HAVE_BROTLI
+
+bool BrotliCompress(const string& input, int quality, string* output) {
+  CHECK_NOTNULL(output);
+  size_t size(BrotliEncoderMaxCompressedSize(input.size()));
+  output->resize(size);
+  if (size == 0 ||
+      !BrotliEncoderCompress(
+          quality, BROTLI_DEFAULT_WINDOW, BROTLI_MODE_GENERIC, input.size(),
+          reinterpret_cast<const uint8_t*>(input.data()), &size,
+          reinterpret_cast<uint8_t*>(&(*output)[0]))) {
+    LOG(WARNING) << "brotli compression failed";
+    output->clear();
+    return false;
+  }
+  output->resize(size);
+  return true;
+}
+
+#else  // HAVE_BROTLI
+
+bool BrotliCompress(const string&, int, string*) {
+  return false;
+}
+
+#endif  // HAVE_BROTLI
+
+
+#ifdef HAVE_ZSTD
+
+bool ZstdSupported() {
+  return true;
+}
+
+
+bool ZstdCompress(const string& input, int level, string* output) {
+  CHECK_NOTNULL(output);
+  output->resize(ZSTD_compressBound(input.size()));
+  const size_t size(ZSTD_compress(&(*output)[0], output->size(), input.data(),
+                                  input.size(), level));
+  if (ZSTD_isError(size)) {
+    LOG(WARNING) << "zstd compression failed: " << ZSTD_getErrorName(size);
+    output->clear();
+    return false;
+  }
+  output->resize(size);
+  return true;
+}
+
+
+struct ZstdDecompressor::Impl {
+  explicit Impl(size_t max)
+      : stream(CHECK_NOTNULL(ZSTD_createDStream()), &ZSTD_freeDStream),
+        max_size(max),
+        output_size(0),
+        pending(1),
+        chunk(ZSTD_DStreamOutSize(), '\0') {
+  }
+
+  const unique_ptr<ZSTD_DStream, size_t (*)(ZSTD_DStream*)> stream;
+  const size_t max_size;
+  size_t output_size;
+  // What ZSTD_decompressStream() last returned, zero once the last
+  // frame is complete.
+  size_t pending;
+  string chunk;
+};
+
+
+ZstdDecompressor::ZstdDecompressor(size_t max_size)
+    : impl_(new Impl(max_size)) {
+  // Decompress() fails from the start if this fails.
+  const size_t ret(ZSTD_initDStream(impl_->stream.get()));
+  if (ZSTD_isError(ret)) {
+    impl_->pending = ret;
+  }
+}
+
+
+ZstdDecompressor::~ZstdDecompressor() {
+}
+
+
+bool ZstdDecompressor::Decompress(const char* data, size_t size,
+                                  string* output) {
+  CHECK_NOTNULL(output);
+  if (ZSTD_isError(impl_->pending)) {
+    return false;
+  }
+
+  ZSTD_inBuffer in{data, size, 0};
+  while (true) {
+    ZSTD_outBuffer out{&impl_->chunk[0], impl_->chunk.size(), 0};
+    impl_->pending = ZSTD_decompressStream(impl_->stream.get(), &out, &in);
+    if (ZSTD_isError(impl_->pending)) {
+      VLOG(1) << "zstd decompression failed: "
+              << ZSTD_getErrorName(impl_->pending);
+      return false;
+    }
+    if (out.pos > impl_->max_size - impl_->output_size) {
+      VLOG(1) << "zstd input decompresses to more than " << impl_->max_size
+              << " bytes";
+      return false;
+    }
+    output->append(impl_->chunk.data(), out.pos);
+    impl_->output_size += out.pos;
+
+    // Unless it filled |chunk|, the decoder has nothing left to flush.
+    if (in.pos == in.size && out.pos < out.size) {
+      return true;
+    }
+  }
+}
+
+
+bool ZstdDecompressor::AtFrameEnd() const {
+  return impl_->pending == 0;
+}
+
+
+bool ZstdDecompress(const string& input, size_t max_size, string* output) {
+  CHECK_NOTNULL(output);
+  output->clear();
+  ZstdDecompressor decompressor(max_size);
+  // Also catches truncated input.
+  return decompressor.Decompress(input.data(), input.size(), output) &&
+         decompressor.AtFrameEnd();
+}
+
+#else  // HAVE_ZSTD
+
+bool ZstdSupported() {
+  return false;
+}
+
+
+bool ZstdCompress(const string&, int, string*) {
+  return false;
+}
+
+
+bool ZstdDecompress(const string&, size_t, string*) {
+  return false;
+}
+
+
+struct ZstdDecompressor::Impl {};
+
+
+ZstdDecompressor::ZstdDecompressor(size_t) {
+}
+
+
+ZstdDecompressor::~ZstdDecompressor() {
+}
+
+
+bool ZstdDecompressor::Decompress(const char*, size_t, string*) {
+  return false;
+}
+
+
+bool ZstdDecompressor::AtFrameEnd() const {
+  return false;
+}
+
+#endif  // HAVE_ZSTD
+
+
+}  // namespace cert_trans
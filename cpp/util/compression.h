@@ -0,0 +1,88 @@
+#ifndef CERT_TRANS_UTIL_COMPRESSION_H_
+#define CERT_TRANS_UTIL_COMPRESSION_H_
+
+#include <stddef.h>
+#include <memory>
+#include <string>
+
+namespace cert_trans {
+
+
+// The content codings HTTP responses can be compressed with.
+enum class ContentEncoding {
+  IDENTITY,
+  GZIP,
+  BROTLI,
+  ZSTD,
+};
+
+// The name of |encoding| in Accept-Encoding and Content-Encoding
+// headers.
+const char* ContentEncodingName(ContentEncoding encoding);
+
+// Whether support for |encoding| was built in (they are all optional,
+// except IDENTITY).
+bool ContentEncodingSupported(ContentEncoding encoding);
+
+// Encodes |input| into |output| with |encoding|, at a default level
+// suited to compressing responses on the fly, replacing the contents
+// of |output|.
+bool Compress(ContentEncoding encoding, const std::string& input,
+              std::string* output);
+
+
+// Compresses |input| into a gzip member in |output|, replacing its
+// contents.
+bool GzipCompress(const std::string& input, int level, std::string* output);
+
+// Compresses |input| into a brotli stream in |output|, replacing its
+// contents.
+bool BrotliCompress(const std::string& input, int quality,
+                    std::string* output);
+
+
+// Whether zstd support was built in (it is optional). When it was not,
+// the functions below always fail.
+bool ZstdSupported();
+
+// Compresses |input| into a single zstd frame in |output|, replacing
+// its contents.
+bool ZstdCompress(const std::string& input, int level, std::string* output);
+
+// Decompresses the zstd frames in |input| into |output|, replacing its
+// contents. Fails if |input| is not valid, or if it would decompress
+// to more than |max_size| bytes, so that a small malicious input
+// cannot use up all our memory.
+bool ZstdDecompress(const std::string& input, size_t max_size,
+                    std::string* output);
+
+
+// Decompresses zstd frames given a piece at a time, such as the body of
+// an HTTP response as it arrives, so that the whole compressed input
+// does not have to be held at once.
+class ZstdDecompressor {
+ public:
+  // Fails once the input decompresses to more than |max_size| bytes,
+  // like ZstdDecompress().
+  explicit ZstdDecompressor(size_t max_size);
+  ~ZstdDecompressor();
+  ZstdDecompressor(const ZstdDecompressor&) = delete;
+  ZstdDecompressor& operator=(const ZstdDecompressor&) = delete;
+
+  // Appends what the next |size| bytes of input at |data| decompress
+  // to to |output|. Always fails when zstd support was not built in.
+  bool Decompress(const char* data, size_t size, std::string* output);
+
+  // Whether the input so far ends with a complete frame (otherwise, it
+  // was truncated).
+  bool AtFrameEnd() const;
+
+ private:
+  struct Impl;
+  const std::unique_ptr<Impl> impl_;
+};
+
+
+}  // namespace cert_trans
+
+#endif  // CERT_TRANS_UTIL_COMPRESSION_H_
@@ -0,0 +1,207 @@
+#include "config.h"
+#include "util/compression.h"
+
+#include <glog/logging.h>
+#include <gtest/gtest.h>
+#include <algorithm>
+#include <string>
+
+#ifdef HAVE_BROTLI
+#include <brotli/decode.h>
+#endif
+#ifdef HAVE_ZLIB
+#include <zlib.h>
+#endif
+
+#include "util/testing.h"
+#include "util/util.h"
+
+namespace cert_trans {
+namespace {
+
+using std::string;
+
+
+const size_t kMaxSize(1 << 20);
+
+
+string CompressibleString() {
+  string input;
+  for (int i = 0; i < 100; ++i) {
+    input.append(util::RandomString(100, 100));
+    input.append(5000, 'a' + i % 26);
+  }
+  return input;
+}
+
+
+TEST(CompressionTest, ZstdRoundTrip) {
+  if (!ZstdSupported()) {
+    LOG(WARNING) << "Built without zstd, skipping.";
+    return;
+  }
+
+  // Large enough for the decompressor to need several output chunks.
+  const string input(CompressibleString());
+
+  string compressed;
+  ASSERT_TRUE(ZstdCompress(input, 3, &compressed));
+  EXPECT_LT(compressed.size(), input.size() / 10);
+
+  string output("garbage");
+  ASSERT_TRUE(ZstdDecompress(compressed, kMaxSize, &output));
+  EXPECT_EQ(input, output);
+
+  ASSERT_TRUE(ZstdCompress(string(), 3, &compressed));
+  ASSERT_TRUE(ZstdDecompress(compressed, kMaxSize, &output));
+  EXPECT_TRUE(output.empty());
+}
+
+
+TEST(CompressionTest, ZstdRejectsBadInput) {
+  if (!ZstdSupported()) {
+    LOG(WARNING) << "Built without zstd, skipping.";
+    return;
+  }
+
+  const string input(10000, 'x');
+  string compressed;
+  ASSERT_TRUE(ZstdCompress(input, 3, &compressed));
+
+  string output;
+  EXPECT_FALSE(ZstdDecompress(string(), kMaxSize, &output));
+  EXPECT_FALSE(ZstdDecompress("not zstd", kMaxSize, &output));
+  EXPECT_FALSE(ZstdDecompress(compressed.substr(0, compressed.size() - 1),
+                              kMaxSize, &output));
+  EXPECT_FALSE(ZstdDecompress(compressed, input.size() - 1, &output));
+  EXPECT_TRUE(ZstdDecompress(compressed, input.size(), &output));
+}
+
+
+TEST(CompressionTest, ZstdDecompressesPieces) {
+  if (!ZstdSupported()) {
+    LOG(WARNING) << "Built without zstd, skipping.";
+    return;
+  }
+
+  const string input(CompressibleString());
+  string compressed;
+  ASSERT_TRUE(ZstdCompress(input, 3, &compressed));
+  // Two frames, given a few bytes at a time.
+  compressed.append(compressed);
+
+  ZstdDecompressor decompressor(kMaxSize);
+  string output;
+  for (size_t i = 0; i < compressed.size(); i += 7) {
+    EXPECT_FALSE(decompressor.AtFrameEnd());
+    ASSERT_TRUE(decompressor.Decompress(compressed.data() + i,
+                                        std::min<size_t>(
+                                            7, compressed.size() - i),
+                                        &output));
+  }
+  EXPECT_TRUE(decompressor.AtFrameEnd());
+  EXPECT_EQ(input + input, output);
+
+  ZstdDecompressor too_small(input.size());
+  output.clear();
+  EXPECT_FALSE(too_small.Decompress(compressed.data(), compressed.size(),
+                                    &output));
+
+  ZstdDecompressor bad(kMaxSize);
+  EXPECT_FALSE(bad.Decompress("not zstd", 8, &output));
+  EXPECT_FALSE(bad.Decompress(compressed.data(), compressed.size(), &output));
+}
+
+
+TEST(CompressionTest, ZstdUnsupported) {
+  if (ZstdSupported()) {
+    return;
+  }
+
+  string output;
+  EXPECT_FALSE(ZstdCompress("foo", 3, &output));
+  EXPECT_FALSE(ZstdDecompress("foo", kMaxSize, &output));
+}
+
+
+TEST(CompressionTest, ContentEncodings) {
+  EXPECT_STREQ("identity", ContentEncodingName(ContentEncoding::IDENTITY));
+  EXPECT_STREQ("gzip", ContentEncodingName(ContentEncoding::GZIP));
+  EXPECT_STREQ("br", ContentEncodingName(ContentEncoding::BROTLI));
+  EXPECT_STREQ("zstd", ContentEncodingName(ContentEncoding::ZSTD));
+
+  EXPECT_TRUE(ContentEncodingSupported(ContentEncoding::IDENTITY));
+  EXPECT_EQ(ZstdSupported(), ContentEncodingSupported(ContentEncoding::ZSTD));
+
+  string output("garbage");
+  EXPECT_TRUE(Compress(ContentEncoding::IDENTITY, "foo", &output));
+  EXPECT_EQ("foo", output);
+
+  for (const ContentEncoding encoding :
+       {ContentEncoding::GZIP, ContentEncoding::BROTLI,
+        ContentEncoding::ZSTD}) {
+    const string input(CompressibleString());
+    EXPECT_EQ(ContentEncodingSupported(encoding),
+              Compress(encoding, input, &output))
+        << ContentEncodingName(encoding);
+    if (ContentEncodingSupported(encoding)) {
+      EXPECT_LT(output.size(), input.size() / 10)
+          << ContentEncodingName(encoding);
+    }
+  }
+}
+
+
+#ifdef HAVE_ZLIB
+TEST(CompressionTest, GzipRoundTrip) {
+  const string input(CompressibleString());
+  string compressed;
+  ASSERT_TRUE(GzipCompress(input, 6, &compressed));
+  // The gzip magic number.
+  ASSERT_LE(2U, compressed.size());
+  EXPECT_EQ("\x1f\x8b", compressed.substr(0, 2));
+
+  z_stream stream{};
+  // Gzip only, no zlib wrapper.
+  ASSERT_EQ(Z_OK, inflateInit2(&stream, 15 + 16));
+  string output(input.size() + 1, '\0');
+  stream.next_in = reinterpret_cast<Bytef*>(&compressed[0]);
+  stream.avail_in = compressed.size();
+  stream.next_out = reinterpret_cast<Bytef*>(&output[0]);
+  stream.avail_out = output.size();
+  EXPECT_EQ(Z_STREAM_END, inflate(&stream, Z_FINISH));
+  inflateEnd(&stream);
+  output.resize(stream.total_out);
+  EXPECT_EQ(input, output);
+}
+#endif  // HAVE_ZLIB
+
+
+#ifdef HAVE_BROTLI
+TEST(CompressionTest, BrotliRoundTrip) {
+  for (const string& input : {CompressibleString(), string()}) {
+    string compressed;
+    ASSERT_TRUE(BrotliCompress(input, 5, &compressed));
+
+    string output(input.size() + 1, '\0');
+    size_t size(output.size());
+    ASSERT_EQ(BROTLI_DECODER_RESULT_SUCCESS,
+              BrotliDecoderDecompress(
+                  compressed.size(),
+                  reinterpret_cast<const uint8_t*>(compressed.data()), &size,
+                  reinterpret_cast<uint8_t*>(&output[0])));
+    output.resize(size);
+    EXPECT_EQ(input, output);
+  }
+}
+#endif  // HAVE_BROTLI
+
+
+}  // namespace
+}  // namespace cert_trans
+
+
+int main(int argc, char** argv) {
+  cert_trans::test::InitTesting(argv[0], &argc, &argv, true);
+  return RUN_ALL_TESTS();
+}
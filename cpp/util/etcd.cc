@@ -3,6 +3,7 @@
 #include <gflags/gflags.h>
 #include <glog/logging.h>
 #include <ctime>
+#include <deque>
 #include <utility>
 #include <event2/http.h>
 
@@ -17,6 +18,7 @@ using std::bind;
 using std::chrono::seconds;
 using std::chrono::system_clock;
 using std::ctime;
+using std::deque;
 using std::list;
 using std::lock_guard;
 using std::make_pair;
@@ -32,6 +34,7 @@ using std::stoi;
 using std::string;
 using std::time_t;
 using std::to_string;
+using std::unique_lock;
 using std::unique_ptr;
 using std::vector;
 using util::Executor;
@@ -42,6 +45,10 @@ using util::Task;
 
 DEFINE_int32(etcd_watch_error_retry_delay_seconds, 5,
              "delay between retrying etcd watch requests");
+DEFINE_int32(etcd_watch_catch_up_lag, 1000,
+             "When a watch falls this many etcd indices behind, catch up "
+             "with a single listing of the watched key, rather than a "
+             "request for each change. 0 disables this.");
 DEFINE_bool(etcd_consistent, true,
             "Add consistent=true param to all requests. Do not turn this off "
             "unless you *know* what you're doing.");
@@ -212,7 +219,7 @@ StatusOr<EtcdClient::Node> ParseNodeFromJson(const JsonObject& json_node) {
                         "Deleted sub-node " + string(key.Value()));
         }
 
-        nodes.emplace_back(entry.ValueOrDie());
+        nodes.emplace_back(move(entry.ValueOrDie()));
       }
     }
   }
@@ -252,7 +259,7 @@ void GetRequestDone(const string& keyname, EtcdClient::GetResponse* resp,
     return;
   }
 
-  resp->node = node.ValueOrDie();
+  resp->node = move(node.ValueOrDie());
   parent_task->Return();
 }
 
@@ -403,12 +410,13 @@ static const EtcdClient::Node kInvalidNode(-1, -1, "", false, "", {}, true);
 }  // namespace
 
 
-struct EtcdClient::RequestState {
+struct EtcdClient::RequestState : public util::Pooled {
   RequestState(UrlFetcher::Verb verb, const string& key,
                const string& key_space, map<string, string> params,
-               const HostPortPair& host_port, GenericResponse* gen_resp,
-               Task* parent_task)
-      : gen_resp_(CHECK_NOTNULL(gen_resp)),
+               const HostPortPair& host_port, UrlFetcher* fetcher,
+               GenericResponse* gen_resp, Task* parent_task)
+      : fetcher_(CHECK_NOTNULL(fetcher)),
+        gen_resp_(CHECK_NOTNULL(gen_resp)),
         parent_task_(CHECK_NOTNULL(parent_task)) {
     CHECK(!key.empty());
     CHECK_EQ(key[0], '/');
@@ -458,6 +466,7 @@ struct EtcdClient::RequestState {
     req_.url.SetPort(host_port.second);
   }
 
+  UrlFetcher* const fetcher_;
   GenericResponse* const gen_resp_;
   Task* const parent_task_;
 
@@ -466,24 +475,72 @@ struct EtcdClient::RequestState {
 };
 
 
+// A caller of Watch(), of which there can be several sharing the same
+// WatchState. All the fields are guarded by |watch_lock_|.
+struct EtcdClient::WatchSubscriber {
+  WatchSubscriber(const WatchCallback& cb, Task* task)
+      : cb_(cb),
+        task_(CHECK_NOTNULL(task)),
+        delivering_(false),
+        cancelled_(false) {
+  }
+
+  const WatchCallback cb_;
+  Task* const task_;
+
+  // The updates not delivered yet, oldest first. They are shared with
+  // the other subscribers.
+  deque<shared_ptr<const vector<Node>>> queue_;
+  // Whether a closure delivering |queue_| is on the executor of
+  // |task_|, which then has a hold on the watch task.
+  bool delivering_;
+  // Set once the subscriber is cancelled while |delivering_|, for the
+  // delivery to return |task_| when done.
+  bool cancelled_;
+};
+
+
+// The single request loop for a watched key, which stops once its
+// last subscriber is cancelled. It deletes itself (and |task_|) when
+// |task_| is done.
 struct EtcdClient::WatchState {
-  WatchState(const string& key, const WatchCallback& cb, Task* task)
+  WatchState(const string& key, Executor* executor, EtcdClient* client)
       : key_(key),
-        cb_(cb),
-        task_(CHECK_NOTNULL(task)),
-        highest_index_seen_(-1) {
+        task_(new Task(
+            [client, this](Task*) { client->WatchDone(this); },
+            CHECK_NOTNULL(executor))),
+        highest_index_seen_(-1),
+        has_snapshot_(false),
+        num_delivering_(0),
+        waiting_for_delivery_(false) {
   }
 
   ~WatchState() {
     VLOG(1) << "EtcdClient::Watch: no longer watching " << key_;
+    delete task_;
   }
 
   const string key_;
-  const WatchCallback cb_;
   Task* const task_;
 
+  // Only used by the request loop.
   int64_t highest_index_seen_;
-  map<string, int64_t> known_keys_;
+
+  // The rest is guarded by |watch_lock_|.
+
+  // The latest state of the keys seen so far, which new subscribers
+  // start from once |has_snapshot_|.
+  map<string, Node> known_nodes_;
+  bool has_snapshot_;
+  list<shared_ptr<WatchSubscriber>> subscribers_;
+  // The last subscriber, once cancelled, which is returned when
+  // |task_| is done, so that nothing runs after it.
+  shared_ptr<WatchSubscriber> last_subscriber_;
+  // The number of subscribers which are |delivering_|, the next
+  // request being started once there are none, if
+  // |waiting_for_delivery_|.
+  int num_delivering_;
+  bool waiting_for_delivery_;
 };
 
 
@@ -516,13 +573,14 @@ void EtcdClient::WatchInitialGetDone(WatchState* state, GetResponse* resp,
   if (resp->node.is_dir_) {
     nodes = move(resp->node.nodes_);
   } else {
-    nodes.push_back(resp->node);
+    nodes.push_back(move(resp->node));
   }
 
   vector<Node> updates;
-  map<string, int64_t> new_known_keys;
+  map<string, Node> new_known_nodes;
   VLOG(1) << "WatchGet " << state << " : num updates = " << nodes.size();
-  for (const auto& node : nodes) {
+  unique_lock<mutex> lock(watch_lock_);
+  for (auto& node : nodes) {
     // This simply shouldn't happen, but since I think it shouldn't
     // prevent us from continuing processing, CHECKing on this would
     // just be mean...
@@ -531,34 +589,42 @@ void EtcdClient::WatchInitialGetDone(WatchState* state, GetResponse* resp,
         << ") smaller than node modifiedIndex (" << node.modified_index_
         << ") for key \"" << node.key_ << "\"";
 
-    map<string, int64_t>::iterator it(state->known_keys_.find(node.key_));
-    if (it == state->known_keys_.end() || it->second < node.modified_index_) {
+    map<string, Node>::iterator it(state->known_nodes_.find(node.key_));
+    const bool updated(it == state->known_nodes_.end() ||
+                       it->second.modified_index_ < node.modified_index_);
+    if (it != state->known_nodes_.end()) {
+      VLOG_IF(1, !updated) << "WatchGet " << state << " : stale update "
+                           << node.key_ << " @ " << node.modified_index_;
+      state->known_nodes_.erase(it);
+    }
+
+    if (updated) {
       VLOG(1) << "WatchGet " << state << " : updated node " << node.key_
               << " @ " << node.modified_index_;
       // Nodes received in an initial get should *always* exist!
       CHECK(!node.deleted_);
-      updates.emplace_back(node);
-    }
-
-    new_known_keys[node.key_] = node.modified_index_;
-    if (it != state->known_keys_.end()) {
-      VLOG(1) << "WatchGet " << state << " : stale update " << node.key_
-              << " @ " << node.modified_index_;
-      state->known_keys_.erase(it);
+      updates.push_back(node);
     }
+    const string key(node.key_);
+    new_known_nodes.emplace(key, move(node));
   }
 
-  // The keys still in known_keys_ at this point have been deleted.
-  for (const auto& key : state->known_keys_) {
+  // The keys still in known_nodes_ at this point have been deleted.
+  for (const auto& key : state->known_nodes_) {
     // TODO(pphaneuf): Passing in -1 for the created and modified
     // indices, is that a problem? We do have a "last known" modified
     // index in key.second...
     updates.emplace_back(Node(-1, -1, key.first, false, "", {}, true));
   }
 
-  state->known_keys_.swap(new_known_keys);
+  state->known_nodes_.swap(new_known_nodes);
+  state->has_snapshot_ = true;
 
-  SendWatchUpdates(state, move(updates));
+  const bool start_request(SendWatchUpdatesLocked(state, move(updates)));
+  lock.unlock();
+  if (start_request) {
+    StartWatchRequest(state);
+  }
 }
 
 
@@ -601,33 +667,169 @@ void EtcdClient::WatchRequestDone(WatchState* state, GetResponse* get_resp,
     return;
   }
 
+  // The etcd index of a watch response is that of when the request
+  // was made, so this is how far behind the watch is. Past some point,
+  // a listing gets the changes since in one go, with only the latest
+  // value of each key, which the initial get logic then turns into
+  // updates against |known_nodes_|.
+  if (FLAGS_etcd_watch_catch_up_lag > 0 &&
+      get_resp->etcd_index - get_resp->node.modified_index_ >=
+          FLAGS_etcd_watch_catch_up_lag) {
+    VLOG(1) << "Watch " << state << " is behind, at "
+            << get_resp->node.modified_index_ << " of "
+            << get_resp->etcd_index << ", catching up";
+    GetResponse* const resp(new GetResponse);
+    Get(state->key_, resp,
+        state->task_->AddChild(
+            bind(&EtcdClient::WatchInitialGetDone, this, state, resp, _1)));
+    return;
+  }
+
   vector<Node> updates;
   state->highest_index_seen_ =
       max(state->highest_index_seen_, get_resp->node.modified_index_);
-  updates.emplace_back(get_resp->node);
 
+  unique_lock<mutex> lock(watch_lock_);
   if (!get_resp->node.deleted_) {
-    state->known_keys_[get_resp->node.key_] = get_resp->node.modified_index_;
+    state->known_nodes_[get_resp->node.key_] = get_resp->node;
   } else {
     VLOG(1) << "erased key: " << get_resp->node.key_;
-    state->known_keys_.erase(get_resp->node.key_);
+    state->known_nodes_.erase(get_resp->node.key_);
   }
+  updates.emplace_back(move(get_resp->node));
 
-  SendWatchUpdates(state, move(updates));
+  const bool start_request(SendWatchUpdatesLocked(state, move(updates)));
+  lock.unlock();
+  if (start_request) {
+    StartWatchRequest(state);
+  }
 }
 
 
 // This method should always be called on the executor of
-// state->task_.
-void EtcdClient::SendWatchUpdates(WatchState* state,
-                                  const vector<Node>& updates) {
-  if (!updates.empty() || state->highest_index_seen_ == -1) {
-    state->cb_(updates);
+// state->task_. Returns whether the next request can be started right
+// away, which must be done without holding |watch_lock_|.
+bool EtcdClient::SendWatchUpdatesLocked(WatchState* state,
+                                        vector<Node>&& updates) {
+  if (!updates.empty()) {
+    // Decoded once, for all the subscribers.
+    const shared_ptr<const vector<Node>> shared_updates(
+        make_shared<vector<Node>>(move(updates)));
+    for (const auto& subscriber : state->subscribers_) {
+      QueueWatchUpdatesLocked(state, subscriber, shared_updates);
+    }
+  }
+
+  // Only start the next request once the callbacks have returned, to
+  // make sure they are always delivered in order, and that a slow
+  // subscriber does not have updates pile up.
+  if (state->num_delivering_ > 0) {
+    state->waiting_for_delivery_ = true;
+    return false;
+  }
+  return true;
+}
+
+
+void EtcdClient::QueueWatchUpdatesLocked(
+    WatchState* state, const shared_ptr<WatchSubscriber>& subscriber,
+    const shared_ptr<const vector<Node>>& updates) {
+  subscriber->queue_.push_back(updates);
+  if (subscriber->delivering_) {
+    return;
   }
 
-  // Only start the next request once the callback has return, to make
-  // sure they are always delivered in order.
-  StartWatchRequest(state);
+  subscriber->delivering_ = true;
+  ++state->num_delivering_;
+  state->task_->AddHold();
+  subscriber->task_->executor()->Add(
+      bind(&EtcdClient::DeliverWatchUpdates, this, state, subscriber));
+}
+
+
+// This method is called on the executor of subscriber->task_, and is
+// the only one to call its callback.
+void EtcdClient::DeliverWatchUpdates(
+    WatchState* state, const shared_ptr<WatchSubscriber>& subscriber) {
+  bool start_request(false);
+  bool return_subscriber(false);
+  while (true) {
+    shared_ptr<const vector<Node>> updates;
+    {
+      lock_guard<mutex> lock(watch_lock_);
+      if (subscriber->queue_.empty() || subscriber->cancelled_) {
+        subscriber->queue_.clear();
+        subscriber->delivering_ = false;
+        // The last subscriber is returned once the watch is done.
+        return_subscriber = subscriber->cancelled_ &&
+                            state->last_subscriber_ != subscriber;
+        --state->num_delivering_;
+        if (state->num_delivering_ == 0 && state->waiting_for_delivery_) {
+          state->waiting_for_delivery_ = false;
+          start_request = true;
+        }
+        break;
+      }
+      updates = move(subscriber->queue_.front());
+      subscriber->queue_.pop_front();
+    }
+    subscriber->cb_(*updates);
+  }
+
+  if (return_subscriber) {
+    subscriber->task_->Return(Status::CANCELLED);
+  }
+  if (start_request) {
+    StartWatchRequest(state);
+  }
+  // Must be last, as |state| can be deleted once this is done.
+  state->task_->RemoveHold();
+}
+
+
+void EtcdClient::CancelWatchSubscriber(
+    WatchState* state, const shared_ptr<WatchSubscriber>& subscriber) {
+  bool cancel_watch(false);
+  bool return_subscriber(false);
+  {
+    lock_guard<mutex> lock(watch_lock_);
+    state->subscribers_.remove(subscriber);
+    if (state->subscribers_.empty()) {
+      // No new subscriber can join a watch that is stopping.
+      const auto it(watches_.find(state->key_));
+      if (it != watches_.end() && it->second == state) {
+        watches_.erase(it);
+      }
+      subscriber->cancelled_ = true;
+      state->last_subscriber_ = subscriber;
+      cancel_watch = true;
+    } else if (subscriber->delivering_) {
+      subscriber->cancelled_ = true;
+    } else {
+      return_subscriber = true;
+    }
+  }
+
+  if (cancel_watch) {
+    state->task_->Cancel();
+  } else if (return_subscriber) {
+    subscriber->task_->Return(Status::CANCELLED);
+  }
+}
+
+
+void EtcdClient::WatchDone(WatchState* state) {
+  shared_ptr<WatchSubscriber> last_subscriber;
+  {
+    lock_guard<mutex> lock(watch_lock_);
+    CHECK(state->subscribers_.empty());
+    last_subscriber.swap(state->last_subscriber_);
+  }
+  const Status status(state->task_->status());
+  delete state;
+  if (last_subscriber) {
+    last_subscriber->task_->Return(status);
+  }
 }
 
 
@@ -702,6 +904,28 @@ EtcdClient::EtcdClient(Executor* executor, UrlFetcher* fetcher,
     : executor_(CHECK_NOTNULL(executor)),
       log_version_task_(new SyncTask(executor_)),
       fetcher_(CHECK_NOTNULL(fetcher)),
+      watch_fetcher_(fetcher_),
+      etcds_(etcds),
+      logged_version_(false) {
+  CHECK(!etcds_.empty()) << "No etcd hosts provided.";
+  VLOG(1) << "EtcdClient: " << this;
+
+  for (const auto& e : etcds_) {
+    CHECK(!e.first.empty()) << "Empty host specified";
+    CHECK_GT(e.second, 0) << "Invalid port specified";
+  }
+}
+
+
+EtcdClient::EtcdClient(Executor* executor, unique_ptr<UrlFetcher> fetcher,
+                       unique_ptr<UrlFetcher> watch_fetcher,
+                       const list<HostPortPair>& etcds)
+    : executor_(CHECK_NOTNULL(executor)),
+      log_version_task_(new SyncTask(executor_)),
+      owned_fetcher_(move(fetcher)),
+      owned_watch_fetcher_(move(watch_fetcher)),
+      fetcher_(CHECK_NOTNULL(owned_fetcher_.get())),
+      watch_fetcher_(CHECK_NOTNULL(owned_watch_fetcher_.get())),
       etcds_(etcds),
       logged_version_(false) {
   CHECK(!etcds_.empty()) << "No etcd hosts provided.";
@@ -727,7 +951,10 @@ EtcdClient::HostPortPair EtcdClient::ChooseNextServer() {
 
 
 EtcdClient::EtcdClient()
-    : executor_(nullptr), log_version_task_(nullptr), fetcher_(nullptr) {
+    : executor_(nullptr),
+      log_version_task_(nullptr),
+      fetcher_(nullptr),
+      watch_fetcher_(nullptr) {
 }
 
 
@@ -740,6 +967,18 @@ EtcdClient::~EtcdClient() {
 }
 
 
+void EtcdClient::StartFetch(RequestState* etcd_req) {
+  // Every etcd request goes through here, so this uses a lambda
+  // rather than std::bind(), as it is small enough for std::function
+  // to hold without an allocation.
+  etcd_req->fetcher_->Fetch(etcd_req->req_, &etcd_req->resp_,
+                            etcd_req->parent_task_->AddChild(
+                                [this, etcd_req](Task* child_task) {
+                                  FetchDone(etcd_req, child_task);
+                                }));
+}
+
+
 void EtcdClient::FetchDone(RequestState* etcd_req, Task* task) {
   VLOG(2) << "EtcdClient::FetchDone: " << task->status();
 
@@ -749,9 +988,7 @@ void EtcdClient::FetchDone(RequestState* etcd_req, Task* task) {
       LOG(WARNING) << "Etcd fetch failed: " << task->status() << ", retrying "
                    << "on next etcd server.";
       etcd_req->SetHostPort(ChooseNextServer());
-      fetcher_->Fetch(etcd_req->req_, &etcd_req->resp_,
-                      etcd_req->parent_task_->AddChild(
-                          bind(&EtcdClient::FetchDone, this, etcd_req, _1)));
+      StartFetch(etcd_req);
       return;
     }
     // Otherwise just let the requestor know.
@@ -785,9 +1022,7 @@ void EtcdClient::FetchDone(RequestState* etcd_req, Task* task) {
 
     MaybeLogEtcdVersion();
 
-    fetcher_->Fetch(etcd_req->req_, &etcd_req->resp_,
-                    etcd_req->parent_task_->AddChild(
-                        bind(&EtcdClient::FetchDone, this, etcd_req, _1)));
+    StartFetch(etcd_req);
     return;
   }
 
@@ -940,6 +1175,19 @@ void EtcdClient::ForceSetWithTTL(const string& key, const string& value,
 }
 
 
+void EtcdClient::RefreshTTL(const string& key, const seconds& ttl,
+                            Response* resp, Task* task) {
+  map<string, string> params;
+  params["ttl"] = to_string(ttl.count());
+  params["refresh"] = "true";
+  params["prevExist"] = "true";
+  GenericResponse* const gen_resp(new GenericResponse);
+  task->DeleteWhenDone(gen_resp);
+  Generic(key, kKeysSpace, params, UrlFetcher::Verb::PUT, gen_resp,
+          task->AddChild(bind(&UpdateRequestDone, resp, task, gen_resp, _1)));
+}
+
+
 void EtcdClient::Delete(const string& key, const int64_t current_index,
                         Task* task) {
   map<string, string> params;
@@ -975,11 +1223,41 @@ void EtcdClient::Watch(const string& key, const WatchCallback& cb,
                        Task* task) {
   VLOG(1) << "EtcdClient::Watch: " << key;
 
-  WatchState* const state(new WatchState(key, cb, task));
-  task->DeleteWhenDone(state);
+  const shared_ptr<WatchSubscriber> subscriber(
+      make_shared<WatchSubscriber>(cb, task));
+  WatchState* state;
+  bool new_watch(false);
+  {
+    lock_guard<mutex> lock(watch_lock_);
+    WatchState*& watch(watches_[key]);
+    if (!watch) {
+      watch = new WatchState(key, executor_, this);
+      new_watch = true;
+    }
+    state = watch;
+    state->subscribers_.push_back(subscriber);
+
+    // Joining a running watch, start from what it has seen so far, as
+    // if from an initial get of its own.
+    if (state->has_snapshot_) {
+      VLOG(1) << "EtcdClient::Watch: sharing watch " << state;
+      const shared_ptr<vector<Node>> snapshot(make_shared<vector<Node>>());
+      snapshot->reserve(state->known_nodes_.size());
+      for (const auto& node : state->known_nodes_) {
+        snapshot->push_back(node.second);
+      }
+      if (!snapshot->empty()) {
+        QueueWatchUpdatesLocked(state, subscriber, snapshot);
+      }
+    }
+  }
+  task->WhenCancelled(
+      bind(&EtcdClient::CancelWatchSubscriber, this, state, subscriber));
 
-  // This will kick off the watch logic, with an initial get request.
-  WatchRequestDone(state, nullptr, nullptr);
+  if (new_watch) {
+    // This will kick off the watch logic, with an initial get request.
+    WatchRequestDone(state, nullptr, nullptr);
+  }
 }
 
 
@@ -988,13 +1266,15 @@ void EtcdClient::Generic(const string& key, const string& key_space,
                          UrlFetcher::Verb verb, GenericResponse* resp,
                          Task* task) {
   MaybeLogEtcdVersion();
+  // Long-polling watch requests go on their own connections.
+  UrlFetcher* const fetcher(params.count("wait") > 0 ? watch_fetcher_
+                                                     : fetcher_);
   RequestState* const etcd_req(new RequestState(verb, key, key_space, params,
-                                                GetEndpoint(), resp, task));
+                                                GetEndpoint(), fetcher, resp,
+                                                task));
   task->DeleteWhenDone(etcd_req);
 
-  fetcher_->Fetch(etcd_req->req_, &etcd_req->resp_,
-                  etcd_req->parent_task_->AddChild(
-                      bind(&EtcdClient::FetchDone, this, etcd_req, _1)));
+  StartFetch(etcd_req);
 }
 
 list<EtcdClient::HostPortPair> SplitHosts(const string& hosts_string) {
@@ -12,6 +12,7 @@
 #include <vector>
 
 #include "net/url_fetcher.h"
+#include "util/pool_allocator.h"
 #include "util/status.h"
 #include "util/sync_task.h"
 #include "util/task.h"
@@ -22,6 +23,9 @@ class JsonObject;
 namespace cert_trans {
 
 
+// Requests are not sent once the deadline of their task (see
+// util/task.h) has passed, nor retried on another server, the task
+// returns DEADLINE_EXCEEDED instead.
 class EtcdClient {
  public:
   typedef std::pair<std::string, uint16_t> HostPortPair;
@@ -71,7 +75,9 @@ class EtcdClient {
     Node node;
   };
 
-  struct GenericResponse : public Response {
+  // Allocated from the per-thread pools (see util/pool_allocator.h),
+  // as there is one per request.
+  struct GenericResponse : public Response, public util::Pooled {
     std::shared_ptr<JsonObject> json_body;
   };
 
@@ -87,6 +93,13 @@ class EtcdClient {
   EtcdClient(util::Executor* executir, UrlFetcher* fetcher,
              const std::list<HostPortPair>& etcds);
 
+  // Takes ownership of |fetcher| and |watch_fetcher|, using the latter
+  // only for the long-polling requests of Watch(), so that those do not
+  // tie up the connections used by other requests.
+  EtcdClient(util::Executor* executor, std::unique_ptr<UrlFetcher> fetcher,
+             std::unique_ptr<UrlFetcher> watch_fetcher,
+             const std::list<HostPortPair>& etcds);
+
   virtual ~EtcdClient();
   EtcdClient(const EtcdClient&) = delete;
   EtcdClient& operator=(const EtcdClient&) = delete;
@@ -117,6 +130,13 @@ class EtcdClient {
                                const std::chrono::seconds& ttl, Response* resp,
                                util::Task* task);
 
+  // Sets the TTL of the existing "key" without sending its value again,
+  // and without waking up watchers (etcd 2.3 and up). Fails with
+  // NOT_FOUND if "key" is gone.
+  virtual void RefreshTTL(const std::string& key,
+                          const std::chrono::seconds& ttl, Response* resp,
+                          util::Task* task);
+
   virtual void Delete(const std::string& key, const int64_t current_index,
                       util::Task* task);
 
@@ -127,7 +147,16 @@ class EtcdClient {
   // The "cb" will be called on the "task" executor. Also, only one
   // will be sent to the executor at a time (for a given call to this
   // method, not for all of them), to make sure they are received in
-  // order.
+  // order. A watch that falls far behind catches up with a listing
+  // of "key", delivering the latest state of the keys that changed in
+  // a single callback (see --etcd_watch_catch_up_lag).
+  //
+  // The calls for the same "key" share a single series of requests to
+  // etcd, with the updates decoded once for all of them. A call made
+  // while another is already watching "key" starts from the latest
+  // state of the keys that one has seen, rather than from an initial
+  // get of its own. The requests stop once the last "task" watching
+  // "key" is cancelled, which returns only after that.
   virtual void Watch(const std::string& key, const WatchCallback& cb,
                      util::Task* task);
 
@@ -138,10 +167,13 @@ class EtcdClient {
  private:
   struct RequestState;
   struct WatchState;
+  struct WatchSubscriber;
 
   HostPortPair ChooseNextServer();
   HostPortPair GetEndpoint() const;
   HostPortPair UpdateEndpoint(HostPortPair&& new_endpoint);
+  // Sends |etcd_req| to its current endpoint.
+  void StartFetch(RequestState* etcd_req);
   void FetchDone(RequestState* etcd_req, util::Task* task);
   void Generic(const std::string& key, const std::string& key_space,
                const std::map<std::string, std::string>& params,
@@ -149,7 +181,16 @@ class EtcdClient {
 
   void WatchInitialGetDone(WatchState* state, GetResponse* resp,
                            util::Task* task);
-  void SendWatchUpdates(WatchState* state, const std::vector<Node>& updates);
+  bool SendWatchUpdatesLocked(WatchState* state,
+                              std::vector<Node>&& updates);
+  void QueueWatchUpdatesLocked(
+      WatchState* state, const std::shared_ptr<WatchSubscriber>& subscriber,
+      const std::shared_ptr<const std::vector<Node>>& updates);
+  void DeliverWatchUpdates(WatchState* state,
+                           const std::shared_ptr<WatchSubscriber>& subscriber);
+  void CancelWatchSubscriber(
+      WatchState* state, const std::shared_ptr<WatchSubscriber>& subscriber);
+  void WatchDone(WatchState* state);
   void StartWatchRequest(WatchState* state);
   void WatchRequestDone(WatchState* state, GetResponse* gen_resp,
                         util::Task* child_task);
@@ -158,11 +199,19 @@ class EtcdClient {
 
   util::Executor* const executor_;
   std::unique_ptr<util::SyncTask> log_version_task_;
+  const std::unique_ptr<UrlFetcher> owned_fetcher_;
+  const std::unique_ptr<UrlFetcher> owned_watch_fetcher_;
   UrlFetcher* const fetcher_;
+  UrlFetcher* const watch_fetcher_;
 
   mutable std::mutex lock_;
   std::list<HostPortPair> etcds_;
   bool logged_version_;
+
+  // Guards |watches_| and the state of the watches.
+  std::mutex watch_lock_;
+  // The watches that can still be joined, by key.
+  std::map<std::string, WatchState*> watches_;
 };
 
 
@@ -2,10 +2,19 @@
 
 #include <gflags/gflags.h>
 #include <glog/logging.h>
+#include <algorithm>
+#include <chrono>
 #include <functional>
 #include <mutex>
 
+#include "monitoring/latency.h"
+#include "monitoring/monitoring.h"
+
 using std::bind;
+using std::chrono::milliseconds;
+using std::chrono::steady_clock;
+using std::max;
+using std::min;
 using std::move;
 using std::mutex;
 using std::placeholders::_1;
@@ -18,20 +27,46 @@ using util::TaskHold;
 
 DEFINE_int32(etcd_delete_concurrency, 4,
              "number of etcd keys to delete at a time");
+DEFINE_int32(etcd_delete_max_concurrency, 32,
+             "upper bound on the number of etcd keys to delete at a time, "
+             "when adapting to etcd latency");
+DEFINE_int32(etcd_delete_target_latency_ms, 50,
+             "while deletes complete within this many milliseconds, the "
+             "number of keys deleted at a time grows slowly from "
+             "--etcd_delete_concurrency, and it is halved when they are "
+             "slower; 0 to always use --etcd_delete_concurrency");
 
 namespace cert_trans {
 namespace {
 
 
+static Counter<>* etcd_keys_deleted =
+    Counter<>::New("etcd_keys_deleted",
+                   "Number of keys removed by batch deletes.");
+
+static Gauge<>* etcd_delete_concurrency_limit =
+    Gauge<>::New("etcd_delete_concurrency_limit",
+                 "Number of keys the latest batch delete was allowed to "
+                 "delete at a time.");
+
+static Latency<milliseconds> etcd_delete_latency_ms(
+    "etcd_delete_latency_ms", "Latency of batch delete requests in ms.");
+
+
 class DeleteState {
  public:
   DeleteState(EtcdClient* client, vector<string>&& keys, Task* task)
       : client_(CHECK_NOTNULL(client)),
         task_(CHECK_NOTNULL(task)),
         outstanding_(0),
+        limit_(FLAGS_etcd_delete_concurrency),
+        max_limit_(max(FLAGS_etcd_delete_concurrency,
+                       FLAGS_etcd_delete_max_concurrency)),
+        next_decrease_(steady_clock::now()),
         keys_(move(keys)),
         it_(keys_.begin()) {
     CHECK_GT(FLAGS_etcd_delete_concurrency, 0);
+    etcd_delete_concurrency_limit->Set(limit_);
 
     if (it_ == keys_.end()) {
       // Nothing to do!
@@ -46,19 +81,36 @@ class DeleteState {
   }
 
  private:
-  void RequestDone(Task* child_task);
+  void RequestDone(const steady_clock::time_point& started, Task* child_task);
   void StartNextRequest(unique_lock<mutex>&& lock);
+  // Adjusts |limit_| (additive increase, multiplicative decrease)
+  // according to how long a request took.
+  void AdaptConcurrency(const unique_lock<mutex>& lock,
+                        const steady_clock::duration& latency);
 
   EtcdClient* const client_;
   Task* const task_;
   mutex mutex_;
   int outstanding_;
+  // How many requests may be outstanding at once.
+  double limit_;
+  const double max_limit_;
+  // Don't halve |limit_| again for requests which were already in
+  // flight when it was last halved.
+  steady_clock::time_point next_decrease_;
   const vector<string> keys_;
   vector<string>::const_iterator it_;
 };
 
 
-void DeleteState::RequestDone(Task* child_task) {
+void DeleteState::RequestDone(const steady_clock::time_point& started,
+                              Task* child_task) {
+  const steady_clock::duration latency(steady_clock::now() - started);
+  etcd_delete_latency_ms.RecordLatency(latency);
+  if (child_task->status().ok()) {
+    etcd_keys_deleted->Increment();
+  }
+
   unique_lock<mutex> lock(mutex_);
   --outstanding_;
 
@@ -72,6 +124,8 @@ void DeleteState::RequestDone(Task* child_task) {
     return;
   }
 
+  AdaptConcurrency(lock, latency);
+
   if (it_ != keys_.end()) {
     StartNextRequest(move(lock));
   } else {
@@ -94,7 +148,7 @@ void DeleteState::StartNextRequest(unique_lock<mutex>&& lock) {
     return;
   }
 
-  while (outstanding_ < FLAGS_etcd_delete_concurrency && it_ != keys_.end() &&
+  while (outstanding_ < static_cast<int>(limit_) && it_ != keys_.end() &&
          task_->IsActive()) {
     CHECK(lock.owns_lock());
     const string& key(*it_);
@@ -104,8 +158,9 @@ void DeleteState::StartNextRequest(unique_lock<mutex>&& lock) {
     // In case the task uses an inline executor.
     lock.unlock();
 
-    client_->ForceDelete(key, task_->AddChild(
-                                  bind(&DeleteState::RequestDone, this, _1)));
+    client_->ForceDelete(key,
+                         task_->AddChild(bind(&DeleteState::RequestDone, this,
+                                              steady_clock::now(), _1)));
 
     // We must be holding the lock to evaluate the loop condition.
     lock.lock();
@@ -113,6 +168,28 @@ void DeleteState::StartNextRequest(unique_lock<mutex>&& lock) {
 }
 
 
+void DeleteState::AdaptConcurrency(const unique_lock<mutex>& lock,
+                                   const steady_clock::duration& latency) {
+  CHECK(lock.owns_lock());
+  if (FLAGS_etcd_delete_target_latency_ms <= 0) {
+    return;
+  }
+
+  if (latency <= milliseconds(FLAGS_etcd_delete_target_latency_ms)) {
+    // About one more request per round trip.
+    limit_ = min(max_limit_, limit_ + 1 / limit_);
+  } else {
+    const steady_clock::time_point now(steady_clock::now());
+    if (now < next_decrease_) {
+      return;
+    }
+    limit_ = max(1.0, limit_ / 2);
+    next_decrease_ = now + latency;
+  }
+  etcd_delete_concurrency_limit->Set(limit_);
+}
+
+
 }  // namespace
 
 
@@ -12,6 +12,8 @@ namespace cert_trans {
 
 // Force delete keys in batches (implemented using concurrent
 // requests). The "keys" argument are pairs of key and modified index.
+// The number of concurrent requests adapts to how quickly etcd answers
+// (see --etcd_delete_target_latency_ms).
 void EtcdForceDeleteKeys(EtcdClient* client, std::vector<std::string>&& keys,
                          util::Task* task);
 
@@ -1,5 +1,7 @@
 #include <gflags/gflags.h>
 #include <gtest/gtest.h>
+#include <atomic>
+#include <thread>
 
 #include "util/etcd_delete.h"
 #include "util/mock_etcd.h"
@@ -9,6 +11,7 @@
 #include "util/thread_pool.h"
 
 using std::bind;
+using std::chrono::milliseconds;
 using std::chrono::seconds;
 using std::move;
 using std::placeholders::_2;
@@ -32,6 +35,7 @@ using util::Task;
 using util::testing::StatusIs;
 
 DECLARE_int32(etcd_delete_concurrency);
+DECLARE_int32(etcd_delete_target_latency_ms);
 
 namespace cert_trans {
 namespace {
@@ -41,6 +45,7 @@ class EtcdDeleteTest : public ::testing::Test {
  protected:
   EtcdDeleteTest() : pool_(1) {
     FLAGS_etcd_delete_concurrency = 2;
+    FLAGS_etcd_delete_target_latency_ms = 50;
   }
 
   ThreadPool pool_;
@@ -179,6 +184,98 @@ TEST_F(EtcdDeleteTest, WithinConcurrency) {
 }
 
 
+TEST_F(EtcdDeleteTest, ConcurrencyGrowsWhenFast) {
+  FLAGS_etcd_delete_concurrency = 1;
+  FLAGS_etcd_delete_target_latency_ms = 60000;
+  vector<string> keys{"/one", "/two", "/three"};
+  SyncTask sync(&pool_);
+
+  Task* first_task(nullptr);
+  Notification first;
+  EXPECT_CALL(client_, ForceDelete("/one", _))
+      .WillOnce(DoAll(SaveArg<1>(&first_task),
+                      InvokeWithoutArgs(&first, &Notification::Notify)));
+  EtcdForceDeleteKeys(&client_, move(keys), sync.task());
+
+  ASSERT_TRUE(first.WaitForNotificationWithTimeout(seconds(1)));
+  ASSERT_TRUE(first_task);
+  Mock::VerifyAndClearExpectations(&client_);
+
+  // Once a request came back quickly, two can be outstanding.
+  Task* second_task(nullptr);
+  Notification second;
+  Task* third_task(nullptr);
+  Notification third;
+  EXPECT_CALL(client_, ForceDelete("/two", _))
+      .WillOnce(DoAll(SaveArg<1>(&second_task),
+                      InvokeWithoutArgs(&second, &Notification::Notify)));
+  EXPECT_CALL(client_, ForceDelete("/three", _))
+      .WillOnce(DoAll(SaveArg<1>(&third_task),
+                      InvokeWithoutArgs(&third, &Notification::Notify)));
+  first_task->Return();
+
+  ASSERT_TRUE(second.WaitForNotificationWithTimeout(seconds(1)));
+  ASSERT_TRUE(second_task);
+  ASSERT_TRUE(third.WaitForNotificationWithTimeout(seconds(1)));
+  ASSERT_TRUE(third_task);
+
+  second_task->Return();
+  third_task->Return();
+
+  sync.Wait();
+  EXPECT_OK(sync.status());
+}
+
+
+TEST_F(EtcdDeleteTest, ConcurrencyShrinksWhenSlow) {
+  FLAGS_etcd_delete_target_latency_ms = 1;
+  vector<string> keys{"/one", "/two", "/three"};
+  SyncTask sync(&pool_);
+
+  Task* first_task(nullptr);
+  Notification first;
+  Task* second_task(nullptr);
+  Notification second;
+  EXPECT_CALL(client_, ForceDelete("/one", _))
+      .WillOnce(DoAll(SaveArg<1>(&first_task),
+                      InvokeWithoutArgs(&first, &Notification::Notify)));
+  EXPECT_CALL(client_, ForceDelete("/two", _))
+      .WillOnce(DoAll(SaveArg<1>(&second_task),
+                      InvokeWithoutArgs(&second, &Notification::Notify)));
+  EtcdForceDeleteKeys(&client_, move(keys), sync.task());
+
+  ASSERT_TRUE(first.WaitForNotificationWithTimeout(seconds(1)));
+  ASSERT_TRUE(first_task);
+  ASSERT_TRUE(second.WaitForNotificationWithTimeout(seconds(1)));
+  ASSERT_TRUE(second_task);
+  Mock::VerifyAndClearExpectations(&client_);
+
+  // The third request must wait for the second one, since the first
+  // one was slow, and only one may be outstanding now.
+  std::atomic<bool> second_returned(false);
+  Task* third_task(nullptr);
+  Notification third;
+  EXPECT_CALL(client_, ForceDelete("/three", _))
+      .WillOnce(DoAll(SaveArg<1>(&third_task),
+                      InvokeWithoutArgs([&second_returned, &third]() {
+                        EXPECT_TRUE(second_returned);
+                        third.Notify();
+                      })));
+  std::this_thread::sleep_for(milliseconds(10));
+  first_task->Return();
+  std::this_thread::sleep_for(milliseconds(100));
+  second_returned = true;
+  second_task->Return();
+
+  ASSERT_TRUE(third.WaitForNotificationWithTimeout(seconds(1)));
+  ASSERT_TRUE(third_task);
+  third_task->Return();
+
+  sync.Wait();
+  EXPECT_OK(sync.status());
+}
+
+
 TEST_F(EtcdDeleteTest, ErrorHandling) {
   vector<string> keys{"/one", "/two", "/three"};
   ASSERT_LT(static_cast<size_t>(FLAGS_etcd_delete_concurrency), keys.size());
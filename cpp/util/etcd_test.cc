@@ -12,6 +12,7 @@
 #include "util/sync_task.h"
 #include "util/testing.h"
 
+DECLARE_int32(etcd_watch_catch_up_lag);
 DECLARE_int32(etcd_watch_error_retry_delay_seconds);
 
 namespace cert_trans {
@@ -84,6 +85,27 @@ const char kGetAllJson[] =
     "  }"
     "}";
 
+// The state of kGetAllJson after /some/key1 was updated and
+// /some/key2 deleted.
+const char kCatchUpJson[] =
+    "{"
+    "  \"action\": \"get\","
+    "  \"node\": {"
+    "    \"createdIndex\": 1,"
+    "    \"dir\": true,"
+    "    \"key\": \"/some\","
+    "    \"modifiedIndex\": 2,"
+    "    \"nodes\": ["
+    "      {"
+    "        \"createdIndex\": 6,"
+    "        \"key\": \"/some/key1\","
+    "        \"modifiedIndex\": 1500,"
+    "        \"value\": \"789\""
+    "      },"
+    "    ]"
+    "  }"
+    "}";
+
 const char kCreateJson[] =
     "{"
     "  \"action\": \"set\","
@@ -220,7 +242,7 @@ class EtcdTest : public ::testing::Test {
   void ExpectVersionCalls(MockUrlFetcher& fetcher, const string& host,
                           uint16_t port) {
     EXPECT_CALL(
-        url_fetcher_,
+        fetcher,
         Fetch(IsUrlFetchRequest(UrlFetcher::Verb::GET,
                                 URL(GetEtcdUrl("/version", "", host, port)),
                                 IsEmpty(), ""),
@@ -545,6 +567,29 @@ TEST_F(EtcdTest, UpdateWithTTLFails) {
 }
 
 
+TEST_F(EtcdTest, RefreshTTL) {
+  EXPECT_CALL(
+      url_fetcher_,
+      Fetch(IsUrlFetchRequest(
+                UrlFetcher::Verb::PUT, URL(GetEtcdUrl(kEntryKey)),
+                ElementsAre(Pair(StrCaseEq("content-type"),
+                                 "application/x-www-form-urlencoded")),
+                "consistent=true&prevExist=true&quorum=true&refresh=true&"
+                "ttl=100"),
+            _, _))
+      .WillOnce(
+          Invoke(bind(HandleFetch, ::util::OkStatus(), 200,
+                      UrlFetcher::Headers{make_pair("x-etcd-index", "1")},
+                      kUpdateJson, _1, _2, _3)));
+  SyncTask task(base_.get());
+  EtcdClient::Response resp;
+  client_.RefreshTTL(kEntryKey, seconds(100), &resp, task.task());
+  task.Wait();
+  EXPECT_OK(task);
+  EXPECT_EQ(6, resp.etcd_index);
+}
+
+
 TEST_F(EtcdTest, ForceSetForPreexistingKey) {
   EXPECT_CALL(url_fetcher_,
               Fetch(IsUrlFetchRequest(
@@ -826,6 +871,195 @@ TEST_F(EtcdTest, WatchHangingGetTimeoutCausesRetry) {
 }
 
 
+TEST_F(EtcdTest, WatchCatchesUpWithListing) {
+  FLAGS_etcd_watch_catch_up_lag = 1000;
+  SyncTask task(base_.get());
+
+  {
+    InSequence s;
+    EXPECT_CALL(url_fetcher_,
+                Fetch(IsUrlFetchRequest(UrlFetcher::Verb::GET,
+                                        URL(GetEtcdUrl(kDirKey) +
+                                            "?consistent=true&quorum=true"),
+                                        IsEmpty(), ""),
+                      _, _))
+        .WillOnce(
+            Invoke(bind(HandleFetch, ::util::OkStatus(), 200,
+                        UrlFetcher::Headers{make_pair("x-etcd-index", "9")},
+                        kGetAllJson, _1, _2, _3)));
+    // A change from long ago, which is not delivered on its own.
+    EXPECT_CALL(url_fetcher_,
+                Fetch(IsUrlFetchRequest(UrlFetcher::Verb::GET,
+                                        URL(GetEtcdUrl(kDirKey) +
+                                            "?consistent=true&quorum=false" +
+                                            "&recursive=true&wait=true" +
+                                            "&waitIndex=10"),
+                                        IsEmpty(), ""),
+                      _, _))
+        .WillOnce(
+            Invoke(bind(HandleFetch, ::util::OkStatus(), 200,
+                        UrlFetcher::Headers{make_pair("x-etcd-index", "2000")},
+                        kCreateJson, _1, _2, _3)));
+    EXPECT_CALL(url_fetcher_,
+                Fetch(IsUrlFetchRequest(UrlFetcher::Verb::GET,
+                                        URL(GetEtcdUrl(kDirKey) +
+                                            "?consistent=true&quorum=true"),
+                                        IsEmpty(), ""),
+                      _, _))
+        .WillOnce(
+            Invoke(bind(HandleFetch, ::util::OkStatus(), 200,
+                        UrlFetcher::Headers{make_pair("x-etcd-index", "2000")},
+                        kCatchUpJson, _1, _2, _3)));
+    EXPECT_CALL(url_fetcher_,
+                Fetch(IsUrlFetchRequest(UrlFetcher::Verb::GET,
+                                        URL(GetEtcdUrl(kDirKey) +
+                                            "?consistent=true&quorum=false" +
+                                            "&recursive=true&wait=true" +
+                                            "&waitIndex=2001"),
+                                        IsEmpty(), ""),
+                      _, _))
+        .WillOnce(Invoke([&task](const UrlFetcher::Request& req,
+                                 UrlFetcher::Response* resp, Task* t) {
+          task.Cancel();
+          HandleFetch(Status(util::error::DEADLINE_EXCEEDED, ""), 0,
+                      UrlFetcher::Headers{}, "", req, resp, t);
+        }));
+  }
+
+  int num_updates(0);
+  client_.Watch(kDirKey,
+                [&num_updates](const vector<EtcdClient::Node>& updates) {
+                  if (num_updates == 0) {
+                    EXPECT_EQ(static_cast<size_t>(2), updates.size());
+                  } else {
+                    ASSERT_EQ(static_cast<size_t>(2), updates.size());
+                    EXPECT_EQ("/some/key1", updates[0].key_);
+                    EXPECT_EQ("789", updates[0].value_);
+                    EXPECT_FALSE(updates[0].deleted_);
+                    EXPECT_EQ("/some/key2", updates[1].key_);
+                    EXPECT_TRUE(updates[1].deleted_);
+                  }
+                  ++num_updates;
+                },
+                task.task());
+  task.Wait();
+  EXPECT_EQ(2, num_updates);
+}
+
+
+TEST_F(EtcdTest, WatchUsesWatchFetcher) {
+  MockUrlFetcher* const fetcher(new MockUrlFetcher);
+  MockUrlFetcher* const watch_fetcher(new MockUrlFetcher);
+  ExpectVersionCalls(*fetcher, kEtcdHost, kEtcdPort);
+  EtcdClient client(base_.get(), unique_ptr<UrlFetcher>(fetcher),
+                    unique_ptr<UrlFetcher>(watch_fetcher),
+                    {EtcdClient::HostPortPair(kEtcdHost, kEtcdPort)});
+
+  // The initial get is an ordinary request, only the long-polling one
+  // goes to the watch fetcher.
+  EXPECT_CALL(*fetcher,
+              Fetch(IsUrlFetchRequest(UrlFetcher::Verb::GET,
+                                      URL(GetEtcdUrl(kEntryKey) +
+                                          "?consistent=true&quorum=true"),
+                                      IsEmpty(), ""),
+                    _, _))
+      .WillOnce(
+          Invoke(bind(HandleFetch, ::util::OkStatus(), 200,
+                      UrlFetcher::Headers{make_pair("x-etcd-index", "9")},
+                      kGetJson, _1, _2, _3)));
+  EXPECT_CALL(*watch_fetcher,
+              Fetch(IsUrlFetchRequest(UrlFetcher::Verb::GET,
+                                      URL(GetEtcdUrl(kEntryKey) +
+                                          "?consistent=true&quorum=false" +
+                                          "&recursive=true&wait=true" +
+                                          "&waitIndex=10"),
+                                      IsEmpty(), ""),
+                    _, _))
+      .WillOnce(
+          Invoke(bind(HandleFetch, ::util::OkStatus(), 200,
+                      UrlFetcher::Headers{make_pair("x-etcd-index", "9")},
+                      kGetJson, _1, _2, _3)));
+
+  SyncTask task(base_.get());
+  int num_updates(0);
+  client.Watch(kEntryKey,
+               [&task, &num_updates](const vector<EtcdClient::Node>& updates) {
+                 EXPECT_EQ(static_cast<size_t>(1), updates.size());
+                 if (num_updates == 1) {
+                   task.Cancel();
+                 }
+                 ++num_updates;
+               },
+               task.task());
+  task.Wait();
+  EXPECT_EQ(2, num_updates);
+}
+
+
+TEST_F(EtcdTest, WatchesOfSameKeyShareRequests) {
+  SyncTask task(base_.get());
+  SyncTask other_task(base_.get());
+
+  // A single initial get and watch request, for both watches.
+  {
+    InSequence s;
+    EXPECT_CALL(url_fetcher_,
+                Fetch(IsUrlFetchRequest(UrlFetcher::Verb::GET,
+                                        URL(GetEtcdUrl(kEntryKey) +
+                                            "?consistent=true&quorum=true"),
+                                        IsEmpty(), ""),
+                      _, _))
+        .WillOnce(
+            Invoke(bind(HandleFetch, ::util::OkStatus(), 200,
+                        UrlFetcher::Headers{make_pair("x-etcd-index", "9")},
+                        kGetJson, _1, _2, _3)));
+    EXPECT_CALL(url_fetcher_,
+                Fetch(IsUrlFetchRequest(UrlFetcher::Verb::GET,
+                                        URL(GetEtcdUrl(kEntryKey) +
+                                            "?consistent=true&quorum=false" +
+                                            "&recursive=true&wait=true" +
+                                            "&waitIndex=10"),
+                                        IsEmpty(), ""),
+                      _, _))
+        .WillOnce(Invoke([&task, &other_task](const UrlFetcher::Request& req,
+                                              UrlFetcher::Response* resp,
+                                              Task* t) {
+          task.Cancel();
+          other_task.Cancel();
+          HandleFetch(Status(util::error::DEADLINE_EXCEEDED, ""), 0,
+                      UrlFetcher::Headers{}, "", req, resp, t);
+        }));
+  }
+
+  int num_updates(0);
+  int num_other_updates(0);
+  const EtcdClient::WatchCallback other_cb(
+      [&num_other_updates](const vector<EtcdClient::Node>& updates) {
+        // Starts from what the first watch has seen.
+        ASSERT_EQ(static_cast<size_t>(1), updates.size());
+        EXPECT_EQ(9, updates[0].modified_index_);
+        EXPECT_EQ("123", updates[0].value_);
+        ++num_other_updates;
+      });
+  client_.Watch(kEntryKey,
+                [this, &num_updates, &other_cb,
+                 &other_task](const vector<EtcdClient::Node>& updates) {
+                  ASSERT_EQ(static_cast<size_t>(1), updates.size());
+                  EXPECT_EQ("123", updates[0].value_);
+                  if (num_updates == 0) {
+                    client_.Watch(kEntryKey, other_cb, other_task.task());
+                  }
+                  ++num_updates;
+                },
+                task.task());
+  task.Wait();
+  other_task.Wait();
+  EXPECT_EQ(1, num_updates);
+  EXPECT_EQ(1, num_other_updates);
+  EXPECT_THAT(other_task.status(), StatusIs(util::error::CANCELLED));
+}
+
+
 TEST_F(EtcdTest, UnavailableEtcdRetriesOnNewServer) {
   EtcdClient multi_client(base_.get(), &url_fetcher_,
                           {EtcdClient::HostPortPair(kEtcdHost, kEtcdPort),
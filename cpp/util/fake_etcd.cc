@@ -1,11 +1,15 @@
 #include "util/fake_etcd.h"
 
 #include <glog/logging.h>
+#include <algorithm>
 
 #include "util/json_wrapper.h"
 
 using std::bind;
+using std::chrono::duration;
+using std::chrono::duration_cast;
 using std::chrono::seconds;
+using std::chrono::steady_clock;
 using std::chrono::system_clock;
 using std::function;
 using std::get;
@@ -13,6 +17,7 @@ using std::lock_guard;
 using std::make_shared;
 using std::make_tuple;
 using std::map;
+using std::max;
 using std::move;
 using std::multimap;
 using std::mutex;
@@ -105,7 +110,19 @@ const char* kStoreStats[] = {"setsFail",
 
 
 FakeEtcdClient::FakeEtcdClient(libevent::Base* base)
-    : base_(CHECK_NOTNULL(base)), parent_task_(base_), index_(1) {
+    : FakeEtcdClient(base, Options()) {
+}
+
+
+FakeEtcdClient::FakeEtcdClient(libevent::Base* base, const Options& options)
+    : base_(CHECK_NOTNULL(base)),
+      options_(options),
+      parent_task_(base_),
+      num_running_requests_(0),
+      index_(1) {
+  CHECK_GE(options_.request_latency.count(), 0);
+  CHECK_GE(options_.max_concurrent_requests, 0);
+  CHECK_GE(options_.max_requests_per_second, 0);
   for (const auto& s : kStoreStats) {
     stats_[s] = 0;
   }
@@ -209,15 +226,71 @@ void FakeEtcdClient::NotifyForPath(const unique_lock<mutex>& lock,
 }
 
 
+void FakeEtcdClient::RunRequest(const function<void()>& request) {
+  if (options_.request_latency.count() == 0 &&
+      options_.max_concurrent_requests == 0 &&
+      options_.max_requests_per_second == 0) {
+    request();
+    return;
+  }
+
+  unique_lock<mutex> lock(requests_mutex_);
+  queued_requests_.emplace_back(request);
+  StartQueuedRequests(lock);
+}
+
+
+void FakeEtcdClient::StartQueuedRequests(const unique_lock<mutex>& lock) {
+  CHECK(lock.owns_lock());
+  while (!queued_requests_.empty() &&
+         (options_.max_concurrent_requests == 0 ||
+          num_running_requests_ < options_.max_concurrent_requests)) {
+    const steady_clock::time_point now(steady_clock::now());
+    steady_clock::time_point start(now);
+    if (options_.max_requests_per_second > 0) {
+      start = max(now, next_request_start_);
+      next_request_start_ =
+          start + duration_cast<steady_clock::duration>(duration<double>(
+                      1.0 / options_.max_requests_per_second));
+    }
+
+    ++num_running_requests_;
+    base_->Delay(start - now + options_.request_latency,
+                 parent_task_.task()->AddChild(
+                     bind(&FakeEtcdClient::FinishRequest, this,
+                          move(queued_requests_.front()))));
+    queued_requests_.pop_front();
+  }
+}
+
+
+void FakeEtcdClient::FinishRequest(const function<void()>& request) {
+  request();
+
+  unique_lock<mutex> lock(requests_mutex_);
+  --num_running_requests_;
+  StartQueuedRequests(lock);
+}
+
+
 void FakeEtcdClient::Get(const Request& req, GetResponse* resp, Task* task) {
+  task->CleanupWhenDone(
+      bind(&FakeEtcdClient::UpdateOperationStats, this, "gets", task));
+  if (req.wait_index > 0) {
+    InternalGet(req, resp, task);
+  } else {
+    RunRequest(bind(&FakeEtcdClient::InternalGet, this, req, resp, task));
+  }
+}
+
+
+void FakeEtcdClient::InternalGet(const Request& req, GetResponse* resp,
+                                 Task* task) {
   VLOG(1) << "GET " << req.key;
   const string key(NormalizeKey(req.key));
 
   CHECK_NE(key, "/") << "not implemented";
 
-  task->CleanupWhenDone(
-      bind(&FakeEtcdClient::UpdateOperationStats, this, "gets", task));
-
   unique_lock<mutex> lock(mutex_);
   PurgeExpiredEntriesWithLock(lock);
   resp->etcd_index = index_;
@@ -356,6 +429,32 @@ void FakeEtcdClient::InternalPut(const string& rawkey, const string& value,
 }
 
 
+void FakeEtcdClient::InternalRefresh(const string& rawkey,
+                                     const system_clock::time_point& expires,
+                                     Response* resp, Task* task) {
+  const string key(NormalizeKey(rawkey));
+  *resp = EtcdClient::Response();
+  unique_lock<mutex> lock(mutex_);
+  PurgeExpiredEntriesWithLock(lock);
+  const map<string, Node>::iterator entry(entries_.find(key));
+  if (entry == entries_.end() || entry->second.is_dir_) {
+    task->Return(Status(util::error::NOT_FOUND, "Node doesn't exist: " + key));
+    return;
+  }
+
+  // Like etcd, this does not notify the watchers.
+  ++index_;
+  entry->second.modified_index_ = index_;
+  entry->second.expires_ = expires;
+  resp->etcd_index = index_;
+  task->Return();
+  DumpEntries(lock);
+  const std::chrono::duration<double> delay(expires - system_clock::now());
+  base_->Delay(delay, parent_task_.task()->AddChild(
+                          bind(&FakeEtcdClient::PurgeExpiredEntries, this)));
+}
+
+
 void FakeEtcdClient::InternalDelete(const string& key,
                                     const int64_t current_index, Task* task) {
   VLOG(1) << "DELETE " << key;
@@ -405,8 +504,8 @@ void FakeEtcdClient::Create(const string& key, const string& value,
                             Response* resp, Task* task) {
   task->CleanupWhenDone(
       bind(&FakeEtcdClient::UpdateOperationStats, this, "create", task));
-  InternalPut(key, value, system_clock::time_point::max(), true, -1, resp,
-              task);
+  RunRequest(bind(&FakeEtcdClient::InternalPut, this, key, value,
+                  system_clock::time_point::max(), true, -1, resp, task));
 }
 
 
@@ -415,7 +514,8 @@ void FakeEtcdClient::CreateWithTTL(const string& key, const string& value,
                                    Task* task) {
   task->CleanupWhenDone(
       bind(&FakeEtcdClient::UpdateOperationStats, this, "create", task));
-  InternalPut(key, value, system_clock::now() + ttl, true, -1, resp, task);
+  RunRequest(bind(&FakeEtcdClient::InternalPut, this, key, value,
+                  system_clock::now() + ttl, true, -1, resp, task));
 }
 
 
@@ -424,8 +524,9 @@ void FakeEtcdClient::Update(const string& key, const string& value,
                             Task* task) {
   task->CleanupWhenDone(bind(&FakeEtcdClient::UpdateOperationStats, this,
                              "compareAndSwap", task));
-  InternalPut(key, value, system_clock::time_point::max(), false,
-              previous_index, resp, task);
+  RunRequest(bind(&FakeEtcdClient::InternalPut, this, key, value,
+                  system_clock::time_point::max(), false, previous_index,
+                  resp, task));
 }
 
 
@@ -435,8 +536,9 @@ void FakeEtcdClient::UpdateWithTTL(const string& key, const string& value,
                                    Response* resp, Task* task) {
   task->CleanupWhenDone(bind(&FakeEtcdClient::UpdateOperationStats, this,
                              "compareAndSwap", task));
-  InternalPut(key, value, system_clock::now() + ttl, false, previous_index,
-              resp, task);
+  RunRequest(bind(&FakeEtcdClient::InternalPut, this, key, value,
+                  system_clock::now() + ttl, false, previous_index, resp,
+                  task));
 }
 
 
@@ -444,8 +546,8 @@ void FakeEtcdClient::ForceSet(const string& key, const string& value,
                               Response* resp, Task* task) {
   task->CleanupWhenDone(
       bind(&FakeEtcdClient::UpdateOperationStats, this, "sets", task));
-  InternalPut(key, value, system_clock::time_point::max(), false, -1, resp,
-              task);
+  RunRequest(bind(&FakeEtcdClient::InternalPut, this, key, value,
+                  system_clock::time_point::max(), false, -1, resp, task));
 }
 
 
@@ -455,19 +557,30 @@ void FakeEtcdClient::ForceSetWithTTL(const std::string& key,
                                      Response* resp, util::Task* task) {
   task->CleanupWhenDone(
       bind(&FakeEtcdClient::UpdateOperationStats, this, "sets", task));
-  InternalPut(key, value, system_clock::now() + ttl, false, -1, resp, task);
+  RunRequest(bind(&FakeEtcdClient::InternalPut, this, key, value,
+                  system_clock::now() + ttl, false, -1, resp, task));
+}
+
+
+void FakeEtcdClient::RefreshTTL(const string& key, const seconds& ttl,
+                                Response* resp, Task* task) {
+  task->CleanupWhenDone(
+      bind(&FakeEtcdClient::UpdateOperationStats, this, "update", task));
+  RunRequest(bind(&FakeEtcdClient::InternalRefresh, this, key,
+                  system_clock::now() + ttl, resp, task));
 }
 
 
 void FakeEtcdClient::Delete(const string& key, const int64_t current_index,
                             Task* task) {
   CHECK_GT(current_index, 0);
-  InternalDelete(key, current_index, task);
+  RunRequest(
+      bind(&FakeEtcdClient::InternalDelete, this, key, current_index, task));
 }
 
 
 void FakeEtcdClient::ForceDelete(const string& key, Task* task) {
-  InternalDelete(key, 0, task);
+  RunRequest(bind(&FakeEtcdClient::InternalDelete, this, key, 0, task));
 }
 
 
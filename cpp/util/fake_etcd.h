@@ -1,8 +1,11 @@
 #ifndef CERT_TRANS_UTIL_FAKE_ETCD_H_
 #define CERT_TRANS_UTIL_FAKE_ETCD_H_
 
+#include <chrono>
 #include <deque>
+#include <functional>
 #include <map>
+#include <mutex>
 #include <queue>
 #include <string>
 #include <tuple>
@@ -18,7 +21,27 @@ namespace cert_trans {
 
 class FakeEtcdClient : public EtcdClient {
  public:
+  // How requests are slowed down, to get an idea of how the code using
+  // the client fares against a real etcd cluster. The defaults leave
+  // requests to complete immediately, as the tests expect.
+  struct Options {
+    Options()
+        : request_latency(0),
+          max_concurrent_requests(0),
+          max_requests_per_second(0) {
+    }
+
+    // How long each request takes, once started.
+    std::chrono::microseconds request_latency;
+    // How many requests can be in progress at once, the others waiting
+    // for their turn. 0 for no limit.
+    int max_concurrent_requests;
+    // How many requests can be started per second. 0 for no limit.
+    int max_requests_per_second;
+  };
+
   explicit FakeEtcdClient(libevent::Base* base);
+  FakeEtcdClient(libevent::Base* base, const Options& options);
 
   virtual ~FakeEtcdClient();
 
@@ -47,6 +70,9 @@ class FakeEtcdClient : public EtcdClient {
                        const std::chrono::seconds& ttl, Response* resp,
                        util::Task* task) override;
 
+  void RefreshTTL(const std::string& key, const std::chrono::seconds& ttl,
+                  Response* resp, util::Task* task) override;
+
   void Delete(const std::string& key, const int64_t current_index,
               util::Task* task) override;
 
@@ -69,11 +95,24 @@ class FakeEtcdClient : public EtcdClient {
   void NotifyForPath(const std::unique_lock<std::mutex>& lock,
                      const std::string& path);
 
+  // Runs |request| now, or after it was slowed down as per |options_|.
+  // Waiting gets are not subject to this, as they are not waiting on
+  // etcd itself.
+  void RunRequest(const std::function<void()>& request);
+  void StartQueuedRequests(const std::unique_lock<std::mutex>& lock);
+  void FinishRequest(const std::function<void()>& request);
+
+  void InternalGet(const Request& req, GetResponse* resp, util::Task* task);
+
   void InternalPut(const std::string& rawkey, const std::string& value,
                    const std::chrono::system_clock::time_point& expires,
                    bool create, int64_t prev_index, Response* resp,
                    util::Task* task);
 
+  void InternalRefresh(const std::string& rawkey,
+                       const std::chrono::system_clock::time_point& expires,
+                       Response* resp, util::Task* task);
+
   void InternalDelete(const std::string& key, const int64_t current_index,
                       util::Task* task);
 
@@ -90,7 +129,15 @@ class FakeEtcdClient : public EtcdClient {
   void RunWatchCallback();
 
   libevent::Base* const base_;
+  const Options options_;
   util::SyncTask parent_task_;
+
+  // Protects the requests slowed down as per |options_|.
+  std::mutex requests_mutex_;
+  std::deque<std::function<void()>> queued_requests_;
+  int num_running_requests_;
+  std::chrono::steady_clock::time_point next_request_start_;
+
   std::mutex mutex_;
   int64_t index_;
   std::map<std::string, Node> entries_;
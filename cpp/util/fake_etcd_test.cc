@@ -27,7 +27,9 @@ namespace cert_trans {
 
 using std::bind;
 using std::chrono::duration;
+using std::chrono::milliseconds;
 using std::chrono::seconds;
+using std::chrono::steady_clock;
 using std::deque;
 using std::function;
 using std::lock_guard;
@@ -151,6 +153,16 @@ class FakeEtcdTest : public ::testing::Test {
     return task.status();
   }
 
+  Status BlockingRefreshTTL(const string& key, const seconds& ttl,
+                            int64_t* modified_index) {
+    SyncTask task(base_.get());
+    EtcdClient::Response resp;
+    client_->RefreshTTL(key, ttl, &resp, task.task());
+    task.Wait();
+    *modified_index = resp.etcd_index;
+    return task.status();
+  }
+
   Status BlockingDelete(const string& key, int64_t previous_index) {
     SyncTask task(base_.get());
     client_->Delete(key, previous_index, task.task());
@@ -354,6 +366,31 @@ TEST_F(FakeEtcdTest, UpdateWithTTLExpires) {
 }
 
 
+TEST_F(FakeEtcdTest, RefreshTTLExpires) {
+  seconds kTtl(3);
+
+  int64_t created_index;
+  EXPECT_OK(BlockingCreate(key_prefix_, kValue, &created_index));
+
+  int64_t modified_index;
+  EXPECT_OK(BlockingRefreshTTL(key_prefix_, kTtl, &modified_index));
+  EXPECT_LT(created_index, modified_index);
+
+  EtcdClient::Node node;
+  EXPECT_OK(BlockingGet(key_prefix_, &node));
+  EXPECT_EQ(kValue, node.value_);
+  EXPECT_EQ(created_index, node.created_index_);
+  EXPECT_EQ(modified_index, node.modified_index_);
+  EXPECT_TRUE(node.HasExpiry());
+
+  sleep_for(kTtl + seconds(1));
+  EXPECT_THAT(BlockingGet(key_prefix_, &node),
+              StatusIs(util::error::NOT_FOUND));
+  EXPECT_THAT(BlockingRefreshTTL(key_prefix_, kTtl, &modified_index),
+              StatusIs(util::error::NOT_FOUND));
+}
+
+
 TEST_F(FakeEtcdTest, ForceSet) {
   map<string, int64_t> expected_stats;
   ASSERT_OK(BlockingGetStats(&expected_stats));
@@ -955,6 +992,46 @@ TEST_F(FakeEtcdTest, GetWaitRecursive) {
 }
 
 
+TEST_F(FakeEtcdTest, SlowedDownRequests) {
+  if (!FLAGS_etcd.empty()) {
+    return;
+  }
+  FakeEtcdClient::Options options;
+  options.request_latency = milliseconds(100);
+  options.max_concurrent_requests = 1;
+  FakeEtcdClient client(base_.get(), options);
+
+  const steady_clock::time_point start(steady_clock::now());
+  const int kNumRequests = 3;
+  vector<unique_ptr<SyncTask>> tasks;
+  vector<EtcdClient::Response> resps(kNumRequests);
+  for (int i = 0; i < kNumRequests; ++i) {
+    tasks.emplace_back(new SyncTask(base_.get()));
+    client.Create(key_prefix_ + "/" + std::to_string(i), kValue, &resps[i],
+                  tasks.back()->task());
+  }
+  // Nothing completes before its latency is up.
+  EXPECT_TRUE(tasks[0]->task()->IsActive());
+
+  for (int i = 0; i < kNumRequests; ++i) {
+    tasks[i]->Wait();
+    EXPECT_OK(tasks[i]->status());
+    if (i > 0) {
+      EXPECT_LT(resps[i - 1].etcd_index, resps[i].etcd_index);
+    }
+  }
+  // The requests went one at a time.
+  EXPECT_GE(steady_clock::now() - start, kNumRequests * milliseconds(100));
+
+  SyncTask task(base_.get());
+  EtcdClient::GetResponse resp;
+  client.Get(key_prefix_ + "/0", &resp, task.task());
+  task.Wait();
+  EXPECT_OK(task.status());
+  EXPECT_EQ(kValue, resp.node.value_);
+}
+
+
 }  // namespace cert_trans
 
 
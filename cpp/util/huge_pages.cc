@@ -0,0 +1,119 @@
+#include "util/huge_pages.h"
+
+#include <errno.h>
+#include <gflags/gflags.h>
+#include <glog/logging.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <string>
+
+using std::string;
+
+DEFINE_string(huge_pages, "none",
+              "How the large structures of logs (Merkle tree levels, leaf "
+              "indexes) are backed: \"none\", \"transparent\" (transparent "
+              "huge pages), \"2mb\" or \"1gb\" (reserved huge pages of that "
+              "size, or transparent ones once they run out).");
+
+namespace util {
+
+namespace {
+
+
+const size_t k2MB = 2 << 20;
+const size_t k1GB = 1 << 30;
+
+#ifndef MAP_HUGE_SHIFT
+#define MAP_HUGE_SHIFT 26
+#endif
+
+
+bool ValidateHugePages(const char* flagname, const string& value) {
+  if (value != "none" && value != "transparent" && value != "2mb" &&
+      value != "1gb") {
+    LOG(ERROR) << "Invalid " << flagname << ": " << value;
+    return false;
+  }
+  return true;
+}
+
+
+const bool huge_pages_dummy =
+    google::RegisterFlagValidator(&FLAGS_huge_pages, &ValidateHugePages);
+
+
+// Blocks are rounded up to what the largest pages that may back them
+// need, whatever --huge_pages is, so that they are freed with the same
+// size even if it changes in between.
+size_t MappedSize(size_t size) {
+  const size_t unit(size >= k1GB ? k1GB : k2MB);
+  return (size + unit - 1) / unit * unit;
+}
+
+
+// Maps |size| bytes from the pool of reserved pages of |page_size|,
+// or returns null if there are not enough left.
+void* MapReservedPages(size_t size, size_t page_size) {
+#ifdef MAP_HUGETLB
+  const int log2_page_size(page_size == k1GB ? 30 : 21);
+  void* const data(mmap(nullptr, size, PROT_READ | PROT_WRITE,
+                        MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB |
+                            (log2_page_size << MAP_HUGE_SHIFT),
+                        -1, 0));
+  if (data != MAP_FAILED) {
+    return data;
+  }
+  LOG_FIRST_N(WARNING, 1) << "No reserved huge pages of " << page_size
+                          << " bytes left, using transparent ones: "
+                          << strerror(errno);
+#endif
+  return nullptr;
+}
+
+
+}  // namespace
+
+
+void* HugePageAllocate(size_t size) {
+  if (size < kHugePageMinimumSize) {
+    return ::operator new(size);
+  }
+
+  const size_t mapped_size(MappedSize(size));
+  void* data(nullptr);
+  if (FLAGS_huge_pages == "1gb" && mapped_size % k1GB == 0) {
+    data = MapReservedPages(mapped_size, k1GB);
+  } else if (FLAGS_huge_pages == "1gb" || FLAGS_huge_pages == "2mb") {
+    data = MapReservedPages(mapped_size, k2MB);
+  }
+  if (!data) {
+    data = mmap(nullptr, mapped_size, PROT_READ | PROT_WRITE,
+                MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    PCHECK(data != MAP_FAILED) << "Failed to map " << mapped_size
+                               << " bytes";
+    AdviseHugePages(data, mapped_size);
+  }
+  return data;
+}
+
+
+void HugePageFree(void* ptr, size_t size) {
+  if (size < kHugePageMinimumSize) {
+    ::operator delete(ptr);
+    return;
+  }
+  PCHECK(munmap(ptr, MappedSize(size)) == 0);
+}
+
+
+void AdviseHugePages(void* addr, size_t size) {
+#ifdef MADV_HUGEPAGE
+  if (FLAGS_huge_pages != "none" && madvise(addr, size, MADV_HUGEPAGE) != 0) {
+    LOG_FIRST_N(WARNING, 1) << "Transparent huge pages unavailable: "
+                            << strerror(errno);
+  }
+#endif
+}
+
+
+}  // namespace util
@@ -0,0 +1,79 @@
+#ifndef CERT_TRANS_UTIL_HUGE_PAGES_H_
+#define CERT_TRANS_UTIL_HUGE_PAGES_H_
+
+#include <stddef.h>
+
+namespace util {
+
+
+// Memory for the large, randomly accessed structures of a log (the
+// levels of its Merkle tree, its leaf index), which spend much of
+// their time waiting on TLB misses when backed by 4 kB pages.
+//
+// Blocks of at least kHugePageMinimumSize bytes are mapped on their
+// own, rounded up to a multiple of 2 MB, and backed as per
+// --huge_pages: not at all specially ("none"), by transparent huge
+// pages ("transparent"), or by the pools of 2 MB or 1 GB pages the
+// kernel reserves ("2mb" and "1gb", 1 GB pages only being used for
+// blocks of at least 1 GB). When a pool has no pages left, transparent
+// huge pages are used instead. Smaller blocks come from the global
+// allocator.
+const size_t kHugePageMinimumSize = 2 << 20;
+
+// Returns a block of at least |size| bytes, suitably aligned for any
+// object.
+void* HugePageAllocate(size_t size);
+
+// Frees |ptr|, which HugePageAllocate() returned for |size|.
+void HugePageFree(void* ptr, size_t size);
+
+// Asks for the |size| bytes mapped at |addr| (by mmap(), for instance
+// of a file) to be backed by transparent huge pages, unless
+// --huge_pages is "none". This is only a hint, which the kernel
+// ignores for files it cannot back by huge pages.
+void AdviseHugePages(void* addr, size_t size);
+
+
+// Allocator using HugePageAllocate(), for containers of large,
+// contiguous buffers.
+template <class T>
+class HugePageAllocator {
+ public:
+  typedef T value_type;
+
+  template <class U>
+  struct rebind {
+    typedef HugePageAllocator<U> other;
+  };
+
+  HugePageAllocator() = default;
+
+  template <class U>
+  HugePageAllocator(const HugePageAllocator<U>&) {
+  }
+
+  T* allocate(size_t n) {
+    return static_cast<T*>(HugePageAllocate(n * sizeof(T)));
+  }
+
+  void deallocate(T* ptr, size_t n) {
+    HugePageFree(ptr, n * sizeof(T));
+  }
+};
+
+
+template <class T, class U>
+bool operator==(const HugePageAllocator<T>&, const HugePageAllocator<U>&) {
+  return true;
+}
+
+
+template <class T, class U>
+bool operator!=(const HugePageAllocator<T>&, const HugePageAllocator<U>&) {
+  return false;
+}
+
+
+}  // namespace util
+
+#endif  // CERT_TRANS_UTIL_HUGE_PAGES_H_
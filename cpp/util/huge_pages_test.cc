@@ -0,0 +1,75 @@
+#include "util/huge_pages.h"
+
+#include <gflags/gflags.h>
+#include <gtest/gtest.h>
+#include <stdint.h>
+#include <string.h>
+#include <string>
+#include <vector>
+
+#include "util/testing.h"
+
+DECLARE_string(huge_pages);
+
+namespace util {
+namespace {
+
+using std::basic_string;
+using std::char_traits;
+using std::string;
+using std::vector;
+
+
+class HugePagesTest : public ::testing::TestWithParam<string> {
+ protected:
+  void SetUp() override {
+    FLAGS_huge_pages = GetParam();
+  }
+};
+
+
+TEST_P(HugePagesTest, SmallBlocks) {
+  void* const block(HugePageAllocate(100));
+  memset(block, 0xaa, 100);
+  HugePageFree(block, 100);
+}
+
+
+TEST_P(HugePagesTest, LargeBlocks) {
+  // Reserved huge pages are unlikely to be available here, which tests
+  // the fallback.
+  const size_t size(kHugePageMinimumSize + 1);
+  char* const block(static_cast<char*>(HugePageAllocate(size)));
+  EXPECT_EQ(0U, reinterpret_cast<uintptr_t>(block) % 16);
+  memset(block, 0xaa, size);
+  EXPECT_EQ('\xaa', block[size - 1]);
+  HugePageFree(block, size);
+}
+
+
+TEST_P(HugePagesTest, Containers) {
+  basic_string<char, char_traits<char>, HugePageAllocator<char>> level;
+  for (int i = 0; i < 100000; ++i) {
+    level.append(32, static_cast<char>(i));
+  }
+  EXPECT_EQ(3200000U, level.size());
+  EXPECT_EQ(static_cast<char>(99999), level.back());
+
+  vector<uint64_t, HugePageAllocator<uint64_t>> slots(1 << 20, 7);
+  EXPECT_EQ(7U, slots.back());
+}
+
+
+INSTANTIATE_TEST_CASE_P(Modes, HugePagesTest,
+                        ::testing::Values("none", "transparent", "2mb",
+                                          "1gb"));
+
+
+}  // namespace
+}  // namespace util
+
+
+int main(int argc, char** argv) {
+  cert_trans::test::InitTesting(argv[0], &argc, &argv, true);
+  return RUN_ALL_TESTS();
+}
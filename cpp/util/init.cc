@@ -13,8 +13,16 @@
 #include "config.h"
 #include "log/ct_extensions.h"
 #include "proto/cert_serializer.h"
+#include "util/async_log.h"
 #include "version.h"
 
+DEFINE_bool(async_logging, true,
+            "Write the log files from a background thread, so that "
+            "logging does not hold up the threads serving requests.");
+DEFINE_int32(async_logging_queue_size, 10000,
+             "Number of log messages queued for the background thread, "
+             "past which they are dropped.");
+
 using std::string;
 
 namespace util {
@@ -53,6 +61,9 @@ void InitCT(int* argc, char** argv[]) {
   google::ParseCommandLineFlags(argc, argv, true);
   google::InitGoogleLogging(*argv[0]);
   google::InstallFailureSignalHandler();
+  if (FLAGS_async_logging) {
+    StartAsyncLogging(FLAGS_async_logging_queue_size);
+  }
 
   event_set_log_callback(&LibEventLog);
 
@@ -0,0 +1,214 @@
+#include "util/json_canonicalizer.h"
+
+#include <errno.h>
+#include <glog/logging.h>
+#include <stdlib.h>
+
+using std::string;
+
+namespace cert_trans {
+namespace {
+
+
+// The deepest nesting json-c accepts by default.
+const size_t kMaxDepth = 32;
+
+
+bool IsInteger(const string& text) {
+  return text.find_first_of(".eE") == string::npos;
+}
+
+
+}  // namespace
+
+
+JsonCanonicalizer::JsonCanonicalizer()
+    : after_key_(false), reader_(this, kMaxDepth) {
+}
+
+
+bool JsonCanonicalizer::Read(const char* data, size_t size) {
+  return reader_.Read(data, size);
+}
+
+
+bool JsonCanonicalizer::Finish(string* canonical) {
+  if (!reader_.Finish()) {
+    return false;
+  }
+  CHECK_NOTNULL(canonical)->swap(canonical_);
+  canonical_.clear();
+  return true;
+}
+
+
+bool JsonCanonicalizer::BeginObject() {
+  if (!containers_.empty() && !BeginValue()) {
+    return false;
+  }
+  canonical_.push_back('{');
+  containers_.emplace_back(true);
+  return true;
+}
+
+
+bool JsonCanonicalizer::EndObject() {
+  return EndContainer(true);
+}
+
+
+bool JsonCanonicalizer::BeginArray() {
+  if (!BeginValue()) {
+    return false;
+  }
+  canonical_.push_back('[');
+  containers_.emplace_back(false);
+  return true;
+}
+
+
+bool JsonCanonicalizer::EndArray() {
+  return EndContainer(false);
+}
+
+
+bool JsonCanonicalizer::Key(const string& key) {
+  DCHECK(!containers_.empty() && containers_.back().object);
+  // json-c keeps the first position but the last value of a duplicate
+  // key, and cuts keys short at a NUL.
+  if (key.find('\0') != string::npos ||
+      !containers_.back().keys.insert(key).second) {
+    return false;
+  }
+  BeginElement();
+  AppendEscaped(key);
+  canonical_.append(": ");
+  after_key_ = true;
+  return true;
+}
+
+
+bool JsonCanonicalizer::String(const string& value) {
+  if (!BeginValue()) {
+    return false;
+  }
+  AppendEscaped(value);
+  return true;
+}
+
+
+bool JsonCanonicalizer::Number(const string& text) {
+  if (!BeginValue()) {
+    return false;
+  }
+  // json-c writes other numbers as they were given, but converts
+  // integers, which turns "-0" into "0".
+  if (!IsInteger(text)) {
+    canonical_.append(text);
+    return true;
+  }
+  errno = 0;
+  const long long value(strtoll(text.c_str(), nullptr, 10));
+  if (errno == ERANGE) {
+    return false;
+  }
+  canonical_.append(std::to_string(value));
+  return true;
+}
+
+
+bool JsonCanonicalizer::Boolean(bool value) {
+  if (!BeginValue()) {
+    return false;
+  }
+  canonical_.append(value ? "true" : "false");
+  return true;
+}
+
+
+bool JsonCanonicalizer::Null() {
+  if (!BeginValue()) {
+    return false;
+  }
+  canonical_.append("null");
+  return true;
+}
+
+
+bool JsonCanonicalizer::BeginValue() {
+  // Only objects are accepted at the top, see BeginObject().
+  if (containers_.empty()) {
+    return false;
+  }
+  if (after_key_) {
+    after_key_ = false;
+  } else {
+    BeginElement();
+  }
+  return true;
+}
+
+
+void JsonCanonicalizer::BeginElement() {
+  Container* const container(&containers_.back());
+  if (container->elements++ > 0) {
+    canonical_.push_back(',');
+  }
+  canonical_.push_back(' ');
+}
+
+
+bool JsonCanonicalizer::EndContainer(bool object) {
+  DCHECK(!containers_.empty() && containers_.back().object == object);
+  canonical_.append(object ? " }" : " ]");
+  containers_.pop_back();
+  return true;
+}
+
+
+void JsonCanonicalizer::AppendEscaped(const string& value) {
+  static const char kHexDigits[] = "0123456789abcdef";
+  canonical_.push_back('"');
+  const char* run(value.data());
+  const char* const end(value.data() + value.size());
+  for (const char* p(run); p < end; ++p) {
+    const unsigned char c(*p);
+    if (c >= 0x20 && c != '"' && c != '\\' && c != '/') {
+      continue;
+    }
+    canonical_.append(run, p - run);
+    run = p + 1;
+    canonical_.push_back('\\');
+    switch (c) {
+      case '"':
+      case '\\':
+      case '/':
+        canonical_.push_back(c);
+        break;
+      case '\b':
+        canonical_.push_back('b');
+        break;
+      case '\f':
+        canonical_.push_back('f');
+        break;
+      case '\n':
+        canonical_.push_back('n');
+        break;
+      case '\r':
+        canonical_.push_back('r');
+        break;
+      case '\t':
+        canonical_.push_back('t');
+        break;
+      default:
+        canonical_.append("u00");
+        canonical_.push_back(kHexDigits[c >> 4]);
+        canonical_.push_back(kHexDigits[c & 0xf]);
+    }
+  }
+  canonical_.append(run, end - run);
+  canonical_.push_back('"');
+}
+
+
+}  // namespace cert_trans
@@ -0,0 +1,88 @@
+#ifndef CERT_TRANS_UTIL_JSON_CANONICALIZER_H_
+#define CERT_TRANS_UTIL_JSON_CANONICALIZER_H_
+
+#include <stddef.h>
+#include <string>
+#include <unordered_set>
+#include <vector>
+
+#include "util/json_stream_reader.h"
+
+namespace cert_trans {
+
+
+// Writes the canonical form of a JSON object given a piece at a time,
+// as it is parsed, without building a json-c object tree. The
+// canonical form is the one JsonObject::ToString() gives for the same
+// object, so that the entries of an XJSON log do not depend on which
+// of the two made them.
+//
+// Only strictly valid JSON is accepted, and some of it is not either,
+// where json-c has ways of its own with it: duplicate keys, integers
+// out of the range of an int64_t, and keys with a NUL in them. Finish()
+// fails for those, and the caller should then fall back to JsonObject,
+// which decides whether the document is acceptable at all.
+//
+// Example:
+//   JsonCanonicalizer canonicalizer;
+//   for (each piece of the document) {
+//     if (!canonicalizer.Read(data, size)) { /* fall back */ }
+//   }
+//   string canonical;
+//   if (!canonicalizer.Finish(&canonical)) { /* fall back */ }
+class JsonCanonicalizer : private JsonStreamReader::Handler {
+ public:
+  JsonCanonicalizer();
+  JsonCanonicalizer(const JsonCanonicalizer&) = delete;
+  JsonCanonicalizer& operator=(const JsonCanonicalizer&) = delete;
+
+  // Parses the next |size| bytes of the document. Returns false if it
+  // cannot be canonicalized, after which it always does.
+  bool Read(const char* data, size_t size);
+
+  // Returns true, with the canonical form in |*canonical|, if the input
+  // so far is exactly one JSON object that could be canonicalized
+  // (possibly surrounded by whitespace).
+  bool Finish(std::string* canonical);
+
+ private:
+  struct Container {
+    explicit Container(bool o) : object(o), elements(0) {
+    }
+
+    const bool object;
+    size_t elements;
+    // The keys seen so far, for objects.
+    std::unordered_set<std::string> keys;
+  };
+
+  bool BeginObject() override;
+  bool EndObject() override;
+  bool BeginArray() override;
+  bool EndArray() override;
+  bool Key(const std::string& key) override;
+  bool String(const std::string& value) override;
+  bool Number(const std::string& text) override;
+  bool Boolean(bool value) override;
+  bool Null() override;
+
+  // Writes what comes before a value, and returns whether one is
+  // allowed here.
+  bool BeginValue();
+  // Writes what comes before a new element of the innermost container.
+  void BeginElement();
+  bool EndContainer(bool object);
+  void AppendEscaped(const std::string& value);
+
+  std::string canonical_;
+  // The open objects and arrays, innermost last.
+  std::vector<Container> containers_;
+  // Whether a key was just written, so the next value belongs to it.
+  bool after_key_;
+  JsonStreamReader reader_;
+};
+
+
+}  // namespace cert_trans
+
+#endif  // CERT_TRANS_UTIL_JSON_CANONICALIZER_H_
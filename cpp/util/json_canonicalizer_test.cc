@@ -0,0 +1,101 @@
+#include "util/json_canonicalizer.h"
+
+#include <glog/logging.h>
+#include <gtest/gtest.h>
+#include <string>
+#include <vector>
+
+#include "util/json_wrapper.h"
+#include "util/testing.h"
+
+namespace cert_trans {
+namespace {
+
+using std::string;
+using std::vector;
+
+
+// Canonicalizes |json| in one go.
+bool Canonicalize(const string& json, string* canonical) {
+  JsonCanonicalizer canonicalizer;
+  return canonicalizer.Read(json.data(), json.size()) &&
+         canonicalizer.Finish(canonical);
+}
+
+
+// What the entries were made of before, and must still be.
+string JsonCToString(const string& json) {
+  const JsonObject object(json);
+  CHECK(object.Ok()) << json;
+  return object.ToString();
+}
+
+
+TEST(JsonCanonicalizerTest, MatchesJsonC) {
+  const vector<string> documents{
+      "{}",
+      " {\"a\" : 1 }\n",
+      "{\"a\":1,\"b\":\"x/y\",\"c\":[],\"d\":{},\"e\":[1,2,{\"f\":null}],"
+      "\"g\":true,\"h\":false}",
+      "{\"s\":\"\\u0001\\b\\f\\n\\r\\t\\\"\\\\\\u00e9\\u20ac\\ud83d\\ude00"
+      "\\u007f\\u0000\"}",
+      "{\"k/\\u0001\":1}",
+      "{\"n\":1.50,\"m\":1e3,\"k\":-0,\"j\":-0.0,\"o\":1E+2,\"p\":0.1e-2}",
+      "{\"min\":-9223372036854775808,\"max\":9223372036854775807}",
+      "{\"zzz\":1,\"aaa\":2,\"mmm\":[[[]]]}",
+  };
+  for (const auto& document : documents) {
+    string canonical;
+    EXPECT_TRUE(Canonicalize(document, &canonical)) << document;
+    EXPECT_EQ(JsonCToString(document), canonical) << document;
+  }
+}
+
+
+TEST(JsonCanonicalizerTest, Unsupported) {
+  string canonical;
+  // Not objects.
+  EXPECT_FALSE(Canonicalize("[]", &canonical));
+  EXPECT_FALSE(Canonicalize("\"a\"", &canonical));
+  EXPECT_FALSE(Canonicalize("{} {}", &canonical));
+  // Not strictly valid.
+  EXPECT_FALSE(Canonicalize("{'a': 1}", &canonical));
+  EXPECT_FALSE(Canonicalize("{\"a\": 1,}", &canonical));
+  EXPECT_FALSE(Canonicalize("{\"a\": 01}", &canonical));
+  EXPECT_FALSE(Canonicalize("{\"a\": ", &canonical));
+  // Left to json-c.
+  EXPECT_FALSE(Canonicalize("{\"a\": 1, \"a\": 2}", &canonical));
+  EXPECT_FALSE(Canonicalize("{\"a\": 18446744073709551615}", &canonical));
+  EXPECT_FALSE(Canonicalize("{\"a\\u0000b\": 1}", &canonical));
+  string deep("{\"a\":");
+  for (int i = 0; i < 32; ++i) {
+    deep.append("[");
+  }
+  deep.append(32, ']').append("}");
+  EXPECT_FALSE(Canonicalize(deep, &canonical));
+}
+
+
+TEST(JsonCanonicalizerTest, ByteAtATime) {
+  const string json("{\"a\": [1, \"two\", {\"three\": 3.0}], \"b\": null}");
+  string whole;
+  ASSERT_TRUE(Canonicalize(json, &whole));
+
+  JsonCanonicalizer canonicalizer;
+  for (char c : json) {
+    ASSERT_TRUE(canonicalizer.Read(&c, 1));
+  }
+  string pieces;
+  EXPECT_TRUE(canonicalizer.Finish(&pieces));
+  EXPECT_EQ(whole, pieces);
+}
+
+
+}  // namespace
+}  // namespace cert_trans
+
+
+int main(int argc, char** argv) {
+  cert_trans::test::InitTesting(argv[0], &argc, &argv, true);
+  return RUN_ALL_TESTS();
+}
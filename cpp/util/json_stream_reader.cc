@@ -0,0 +1,418 @@
+#include "util/json_stream_reader.h"
+
+#include <glog/logging.h>
+
+using std::string;
+
+namespace cert_trans {
+
+namespace {
+
+
+bool IsWhitespace(char c) {
+  return c == ' ' || c == '\t' || c == '\n' || c == '\r';
+}
+
+
+bool IsLiteralChar(char c) {
+  return (c >= '0' && c <= '9') || (c >= 'a' && c <= 'z') || c == '-' ||
+         c == '+' || c == '.' || c == 'E';
+}
+
+
+int HexValue(char c) {
+  if (c >= '0' && c <= '9') {
+    return c - '0';
+  }
+  if (c >= 'a' && c <= 'f') {
+    return c - 'a' + 10;
+  }
+  if (c >= 'A' && c <= 'F') {
+    return c - 'A' + 10;
+  }
+  return -1;
+}
+
+
+void AppendUtf8(uint32_t code_point, string* out) {
+  if (code_point < 0x80) {
+    out->push_back(static_cast<char>(code_point));
+  } else if (code_point < 0x800) {
+    out->push_back(static_cast<char>(0xc0 | (code_point >> 6)));
+    out->push_back(static_cast<char>(0x80 | (code_point & 0x3f)));
+  } else if (code_point < 0x10000) {
+    out->push_back(static_cast<char>(0xe0 | (code_point >> 12)));
+    out->push_back(static_cast<char>(0x80 | ((code_point >> 6) & 0x3f)));
+    out->push_back(static_cast<char>(0x80 | (code_point & 0x3f)));
+  } else {
+    out->push_back(static_cast<char>(0xf0 | (code_point >> 18)));
+    out->push_back(static_cast<char>(0x80 | ((code_point >> 12) & 0x3f)));
+    out->push_back(static_cast<char>(0x80 | ((code_point >> 6) & 0x3f)));
+    out->push_back(static_cast<char>(0x80 | (code_point & 0x3f)));
+  }
+}
+
+
+// Whether |text| is a number as the JSON grammar has it.
+bool IsNumber(const string& text) {
+  size_t i(0);
+  if (i < text.size() && text[i] == '-') {
+    ++i;
+  }
+  if (i >= text.size()) {
+    return false;
+  }
+  if (text[i] == '0') {
+    ++i;
+  } else if (text[i] >= '1' && text[i] <= '9') {
+    while (i < text.size() && text[i] >= '0' && text[i] <= '9') {
+      ++i;
+    }
+  } else {
+    return false;
+  }
+  if (i < text.size() && text[i] == '.') {
+    ++i;
+    const size_t digits(i);
+    while (i < text.size() && text[i] >= '0' && text[i] <= '9') {
+      ++i;
+    }
+    if (i == digits) {
+      return false;
+    }
+  }
+  if (i < text.size() && (text[i] == 'e' || text[i] == 'E')) {
+    ++i;
+    if (i < text.size() && (text[i] == '+' || text[i] == '-')) {
+      ++i;
+    }
+    const size_t digits(i);
+    while (i < text.size() && text[i] >= '0' && text[i] <= '9') {
+      ++i;
+    }
+    if (i == digits) {
+      return false;
+    }
+  }
+  return i == text.size();
+}
+
+
+}  // namespace
+
+
+JsonStreamReader::JsonStreamReader(Handler* handler, size_t max_depth)
+    : handler_(CHECK_NOTNULL(handler)),
+      max_depth_(max_depth),
+      state_(State::VALUE),
+      in_key_(false),
+      unicode_(0),
+      unicode_digits_(0),
+      high_surrogate_(0) {
+}
+
+
+bool JsonStreamReader::Read(const char* data, size_t size) {
+  const char* const end(data + size);
+  const char* p(data);
+
+  while (p < end) {
+    switch (state_) {
+      case State::FAILED:
+        return false;
+
+      case State::STRING: {
+        // The bulk of a get-entries response is in long base64
+        // strings, so copy the plain runs in one go.
+        const char* run(p);
+        while (run < end && *run != '"' && *run != '\\' &&
+               static_cast<unsigned char>(*run) >= 0x20) {
+          ++run;
+        }
+        if (run != p) {
+          if (high_surrogate_ != 0) {
+            return Fail();
+          }
+          string_.append(p, run - p);
+          p = run;
+          continue;
+        }
+        const char c(*p++);
+        if (c == '"') {
+          if (!EndString()) {
+            return false;
+          }
+        } else if (c == '\\') {
+          state_ = State::STRING_ESCAPE;
+        } else {
+          // Unescaped control character.
+          return Fail();
+        }
+        continue;
+      }
+
+      case State::STRING_ESCAPE: {
+        const char c(*p++);
+        if (c == 'u') {
+          unicode_ = 0;
+          unicode_digits_ = 0;
+          state_ = State::STRING_UNICODE;
+          continue;
+        }
+        if (high_surrogate_ != 0) {
+          return Fail();
+        }
+        switch (c) {
+          case '"':
+          case '\\':
+          case '/':
+            string_.push_back(c);
+            break;
+          case 'b':
+            string_.push_back('\b');
+            break;
+          case 'f':
+            string_.push_back('\f');
+            break;
+          case 'n':
+            string_.push_back('\n');
+            break;
+          case 'r':
+            string_.push_back('\r');
+            break;
+          case 't':
+            string_.push_back('\t');
+            break;
+          default:
+            return Fail();
+        }
+        state_ = State::STRING;
+        continue;
+      }
+
+      case State::STRING_UNICODE: {
+        const int value(HexValue(*p++));
+        if (value < 0) {
+          return Fail();
+        }
+        unicode_ = (unicode_ << 4) | value;
+        if (++unicode_digits_ == 4) {
+          if (!AddCodePoint()) {
+            return false;
+          }
+          state_ = State::STRING;
+        }
+        continue;
+      }
+
+      case State::LITERAL:
+        if (IsLiteralChar(*p)) {
+          literal_.push_back(*p++);
+          continue;
+        }
+        if (!EndLiteral()) {
+          return false;
+        }
+        // Look at this character again in the new state.
+        continue;
+
+      default:
+        break;
+    }
+
+    const char c(*p++);
+    if (IsWhitespace(c)) {
+      continue;
+    }
+
+    switch (state_) {
+      case State::VALUE:
+      case State::ARRAY_START:
+        if (c == ']' && state_ == State::ARRAY_START) {
+          if (!EndContainer('[')) {
+            return false;
+          }
+        } else if (c == '{' || c == '[') {
+          if (!BeginContainer(c)) {
+            return false;
+          }
+        } else if (c == '"') {
+          in_key_ = false;
+          string_.clear();
+          state_ = State::STRING;
+        } else if (c == '-' || (c >= '0' && c <= '9') || c == 't' ||
+                   c == 'f' || c == 'n') {
+          literal_.assign(1, c);
+          state_ = State::LITERAL;
+        } else {
+          return Fail();
+        }
+        break;
+
+      case State::ARRAY_NEXT:
+        if (c == ',') {
+          state_ = State::VALUE;
+        } else if (c == ']') {
+          if (!EndContainer('[')) {
+            return false;
+          }
+        } else {
+          return Fail();
+        }
+        break;
+
+      case State::OBJECT_START:
+      case State::OBJECT_KEY:
+        if (c == '}' && state_ == State::OBJECT_START) {
+          if (!EndContainer('{')) {
+            return false;
+          }
+        } else if (c == '"') {
+          in_key_ = true;
+          string_.clear();
+          state_ = State::STRING;
+        } else {
+          return Fail();
+        }
+        break;
+
+      case State::OBJECT_COLON:
+        if (c != ':') {
+          return Fail();
+        }
+        state_ = State::VALUE;
+        break;
+
+      case State::OBJECT_NEXT:
+        if (c == ',') {
+          state_ = State::OBJECT_KEY;
+        } else if (c == '}') {
+          if (!EndContainer('{')) {
+            return false;
+          }
+        } else {
+          return Fail();
+        }
+        break;
+
+      case State::DONE:
+        // Only whitespace may follow the document.
+        return Fail();
+
+      default:
+        LOG(FATAL) << "unexpected state " << static_cast<int>(state_);
+    }
+  }
+
+  return state_ != State::FAILED;
+}
+
+
+bool JsonStreamReader::Finish() {
+  // A number at the very end of the input is only complete now.
+  if (state_ == State::LITERAL && containers_.empty() && !EndLiteral()) {
+    return false;
+  }
+  return state_ == State::DONE;
+}
+
+
+bool JsonStreamReader::Fail() {
+  state_ = State::FAILED;
+  return false;
+}
+
+
+void JsonStreamReader::EndValue() {
+  if (containers_.empty()) {
+    state_ = State::DONE;
+  } else if (containers_.back() == '[') {
+    state_ = State::ARRAY_NEXT;
+  } else {
+    state_ = State::OBJECT_NEXT;
+  }
+}
+
+
+bool JsonStreamReader::BeginContainer(char type) {
+  if (containers_.size() >= max_depth_) {
+    return Fail();
+  }
+  containers_.push_back(type);
+  if (type == '{') {
+    state_ = State::OBJECT_START;
+    return handler_->BeginObject() || Fail();
+  }
+  state_ = State::ARRAY_START;
+  return handler_->BeginArray() || Fail();
+}
+
+
+bool JsonStreamReader::EndContainer(char type) {
+  DCHECK(!containers_.empty());
+  DCHECK_EQ(type, containers_.back());
+  containers_.pop_back();
+  EndValue();
+  if (type == '{') {
+    return handler_->EndObject() || Fail();
+  }
+  return handler_->EndArray() || Fail();
+}
+
+
+bool JsonStreamReader::EndString() {
+  if (high_surrogate_ != 0) {
+    return Fail();
+  }
+  if (in_key_) {
+    state_ = State::OBJECT_COLON;
+    return handler_->Key(string_) || Fail();
+  }
+  EndValue();
+  return handler_->String(string_) || Fail();
+}
+
+
+bool JsonStreamReader::EndLiteral() {
+  EndValue();
+  if (literal_ == "true") {
+    return handler_->Boolean(true) || Fail();
+  }
+  if (literal_ == "false") {
+    return handler_->Boolean(false) || Fail();
+  }
+  if (literal_ == "null") {
+    return handler_->Null() || Fail();
+  }
+  if (!IsNumber(literal_)) {
+    return Fail();
+  }
+  return handler_->Number(literal_) || Fail();
+}
+
+
+bool JsonStreamReader::AddCodePoint() {
+  if (high_surrogate_ != 0) {
+    if (unicode_ < 0xdc00 || unicode_ > 0xdfff) {
+      return Fail();
+    }
+    AppendUtf8(0x10000 + ((high_surrogate_ - 0xd800) << 10) +
+                   (unicode_ - 0xdc00),
+               &string_);
+    high_surrogate_ = 0;
+    return true;
+  }
+  if (unicode_ >= 0xd800 && unicode_ <= 0xdbff) {
+    high_surrogate_ = unicode_;
+    return true;
+  }
+  if (unicode_ >= 0xdc00 && unicode_ <= 0xdfff) {
+    // A lone low surrogate.
+    return Fail();
+  }
+  AppendUtf8(unicode_, &string_);
+  return true;
+}
+
+
+}  // namespace cert_trans
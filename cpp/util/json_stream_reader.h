@@ -0,0 +1,126 @@
+#ifndef CERT_TRANS_UTIL_JSON_STREAM_READER_H_
+#define CERT_TRANS_UTIL_JSON_STREAM_READER_H_
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string>
+#include <vector>
+
+namespace cert_trans {
+
+
+// Parses JSON text given a piece at a time (such as an HTTP response
+// body as it arrives), reporting what it finds to a Handler as it
+// goes, without building a json-c object tree. This is meant for large
+// responses (such as get-entries), the reading counterpart of
+// JsonStreamWriter.
+//
+// Example:
+//   class EntriesHandler : public JsonStreamReader::Handler { ... };
+//   EntriesHandler handler;
+//   JsonStreamReader reader(&handler);
+//   for (each piece of the body) {
+//     if (!reader.Read(data, size)) { /* invalid */ }
+//   }
+//   if (!reader.Finish()) { /* invalid or truncated */ }
+class JsonStreamReader {
+ public:
+  // Returning false from any of these stops the parsing, and makes
+  // Read() and Finish() fail.
+  class Handler {
+   public:
+    virtual ~Handler() = default;
+
+    virtual bool BeginObject() = 0;
+    virtual bool EndObject() = 0;
+    virtual bool BeginArray() = 0;
+    virtual bool EndArray() = 0;
+
+    // Inside an object, comes before each value.
+    virtual bool Key(const std::string& key) = 0;
+
+    // |value| has had its escape sequences decoded.
+    virtual bool String(const std::string& value) = 0;
+    // |text| is the number as it was written, for the handler to
+    // convert as it sees fit.
+    virtual bool Number(const std::string& text) = 0;
+    virtual bool Boolean(bool value) = 0;
+    virtual bool Null() = 0;
+  };
+
+  // Documents nesting objects and arrays more than |max_depth| deep
+  // are refused.
+  explicit JsonStreamReader(Handler* handler, size_t max_depth = 64);
+  JsonStreamReader(const JsonStreamReader&) = delete;
+  JsonStreamReader& operator=(const JsonStreamReader&) = delete;
+
+  // Parses the next |size| bytes of the document. Returns false if the
+  // document is invalid (or the handler stopped the parsing), after
+  // which it always does.
+  bool Read(const char* data, size_t size);
+
+  // Returns whether the input so far is exactly one complete document
+  // (possibly surrounded by whitespace).
+  bool Finish();
+
+ private:
+  enum class State {
+    // Expecting a value (at the top, after a key, or in an array
+    // after a comma).
+    VALUE,
+    // Right after "[", expecting a value or "]".
+    ARRAY_START,
+    // After a value in an array, expecting "," or "]".
+    ARRAY_NEXT,
+    // Right after "{", expecting a key or "}".
+    OBJECT_START,
+    // After a comma in an object, expecting a key.
+    OBJECT_KEY,
+    // After a key, expecting ":".
+    OBJECT_COLON,
+    // After a value in an object, expecting "," or "}".
+    OBJECT_NEXT,
+    // Within a string (key or value).
+    STRING,
+    // After a backslash in a string.
+    STRING_ESCAPE,
+    // Within the four hex digits of a \u escape.
+    STRING_UNICODE,
+    // Within a number, true, false or null.
+    LITERAL,
+    // After the complete document.
+    DONE,
+    // After an error.
+    FAILED,
+  };
+
+  bool Fail();
+  // Called once a value is complete, to move on to what may follow it.
+  void EndValue();
+  bool BeginContainer(char type);
+  bool EndContainer(char type);
+  bool EndString();
+  bool EndLiteral();
+  // Appends the code point in |unicode_| to |string_|, pairing
+  // surrogates.
+  bool AddCodePoint();
+
+  Handler* const handler_;
+  const size_t max_depth_;
+  State state_;
+  // The open objects ('{') and arrays ('['), innermost last.
+  std::vector<char> containers_;
+  // Whether the string being read is a key.
+  bool in_key_;
+  std::string string_;
+  uint32_t unicode_;
+  int unicode_digits_;
+  // The first half of a surrogate pair, waiting for the second.
+  uint32_t high_surrogate_;
+  std::string literal_;
+};
+
+
+}  // namespace cert_trans
+
+#endif  // CERT_TRANS_UTIL_JSON_STREAM_READER_H_
@@ -0,0 +1,198 @@
+#include "util/json_stream_reader.h"
+
+#include <gtest/gtest.h>
+#include <string>
+#include <vector>
+
+#include "util/testing.h"
+
+namespace cert_trans {
+namespace {
+
+using std::string;
+using std::vector;
+
+
+// Records what it is told as a flat list of events.
+class RecordingHandler : public JsonStreamReader::Handler {
+ public:
+  bool BeginObject() override {
+    return Add("{");
+  }
+  bool EndObject() override {
+    return Add("}");
+  }
+  bool BeginArray() override {
+    return Add("[");
+  }
+  bool EndArray() override {
+    return Add("]");
+  }
+  bool Key(const string& key) override {
+    return Add("key:" + key);
+  }
+  bool String(const string& value) override {
+    return Add("string:" + value);
+  }
+  bool Number(const string& text) override {
+    return Add("number:" + text);
+  }
+  bool Boolean(bool value) override {
+    return Add(value ? "true" : "false");
+  }
+  bool Null() override {
+    return Add("null");
+  }
+
+  vector<string> events;
+  // Stop the parsing after this many events, if not negative.
+  int stop_after = -1;
+
+ private:
+  bool Add(const string& event) {
+    events.push_back(event);
+    return stop_after < 0 || events.size() < static_cast<size_t>(stop_after);
+  }
+};
+
+
+// Parses |json| in one go.
+bool Parse(const string& json, RecordingHandler* handler) {
+  JsonStreamReader reader(handler);
+  return reader.Read(json.data(), json.size()) && reader.Finish();
+}
+
+
+TEST(JsonStreamReaderTest, Document) {
+  RecordingHandler handler;
+  EXPECT_TRUE(Parse(
+      " {\"a\": [1, -2.5e+3, true, false, null], \"o\": {}, \"e\": [],"
+      " \"s\": \"x\\/y\\n\"}\n",
+      &handler));
+  const vector<string> expected{"{",
+                                "key:a",
+                                "[",
+                                "number:1",
+                                "number:-2.5e+3",
+                                "true",
+                                "false",
+                                "null",
+                                "]",
+                                "key:o",
+                                "{",
+                                "}",
+                                "key:e",
+                                "[",
+                                "]",
+                                "key:s",
+                                "string:x/y\n",
+                                "}"};
+  EXPECT_EQ(expected, handler.events);
+}
+
+
+TEST(JsonStreamReaderTest, TopLevelScalars) {
+  RecordingHandler number;
+  EXPECT_TRUE(Parse("42", &number));
+  EXPECT_EQ(vector<string>{"number:42"}, number.events);
+
+  RecordingHandler str;
+  EXPECT_TRUE(Parse("\"abc\"", &str));
+  EXPECT_EQ(vector<string>{"string:abc"}, str.events);
+}
+
+
+TEST(JsonStreamReaderTest, ByteAtATime) {
+  const string json(
+      "{\"entries\":[{\"leaf_input\":\"AAEC\",\"extra_data\":\"\\u00e9\"},"
+      "{\"n\":123}]}");
+  RecordingHandler whole;
+  ASSERT_TRUE(Parse(json, &whole));
+
+  RecordingHandler pieces;
+  JsonStreamReader reader(&pieces);
+  for (char c : json) {
+    ASSERT_TRUE(reader.Read(&c, 1));
+  }
+  EXPECT_TRUE(reader.Finish());
+  EXPECT_EQ(whole.events, pieces.events);
+}
+
+
+TEST(JsonStreamReaderTest, Unicode) {
+  RecordingHandler handler;
+  EXPECT_TRUE(Parse("[\"\\u0041\\u00e9\\u20ac\\ud83d\\ude00\"]", &handler));
+  ASSERT_EQ(3U, handler.events.size());
+  EXPECT_EQ("string:A\xc3\xa9\xe2\x82\xac\xf0\x9f\x98\x80",
+            handler.events[1]);
+
+  RecordingHandler lone_high;
+  EXPECT_FALSE(Parse("[\"\\ud83d\"]", &lone_high));
+  RecordingHandler lone_low;
+  EXPECT_FALSE(Parse("[\"\\ude00\"]", &lone_low));
+  RecordingHandler bad_hex;
+  EXPECT_FALSE(Parse("[\"\\u00g0\"]", &bad_hex));
+}
+
+
+TEST(JsonStreamReaderTest, Invalid) {
+  const vector<string> invalid{"",
+                               "{",
+                               "[1,]",
+                               "[1 2]",
+                               "{\"a\" 1}",
+                               "{\"a\":1,}",
+                               "{1:2}",
+                               "[01]",
+                               "[1.]",
+                               "[-]",
+                               "[tru]",
+                               "[nulll]",
+                               "[\"a\\x\"]",
+                               "[\"a\nb\"]",
+                               "[1]]",
+                               "[1] [2]",
+                               "{\"a\":1]"};
+  for (const string& json : invalid) {
+    RecordingHandler handler;
+    EXPECT_FALSE(Parse(json, &handler)) << json;
+  }
+}
+
+
+TEST(JsonStreamReaderTest, MaxDepth) {
+  RecordingHandler ok;
+  JsonStreamReader ok_reader(&ok, 3);
+  const string three("[[[]]]");
+  EXPECT_TRUE(ok_reader.Read(three.data(), three.size()));
+  EXPECT_TRUE(ok_reader.Finish());
+
+  RecordingHandler too_deep;
+  JsonStreamReader too_deep_reader(&too_deep, 3);
+  const string four("[[[[]]]]");
+  EXPECT_FALSE(too_deep_reader.Read(four.data(), four.size()));
+  EXPECT_FALSE(too_deep_reader.Finish());
+}
+
+
+TEST(JsonStreamReaderTest, HandlerStops) {
+  RecordingHandler handler;
+  handler.stop_after = 3;
+  JsonStreamReader reader(&handler);
+  const string json("[1, 2, 3, 4]");
+  EXPECT_FALSE(reader.Read(json.data(), json.size()));
+  EXPECT_EQ(3U, handler.events.size());
+  // Stays failed.
+  EXPECT_FALSE(reader.Read("", 0));
+  EXPECT_FALSE(reader.Finish());
+}
+
+
+}  // namespace
+}  // namespace cert_trans
+
+
+int main(int argc, char** argv) {
+  cert_trans::test::InitTesting(argv[0], &argc, &argv, true);
+  return RUN_ALL_TESTS();
+}
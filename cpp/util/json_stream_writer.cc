@@ -0,0 +1,111 @@
+#include "util/json_stream_writer.h"
+
+#include <event2/buffer.h>
+#include <glog/logging.h>
+
+#include "util/util.h"
+
+using std::string;
+
+namespace cert_trans {
+
+
+JsonStreamWriter::JsonStreamWriter()
+    : buffer_(CHECK_NOTNULL(evbuffer_new())), after_key_(false) {
+}
+
+
+JsonStreamWriter::~JsonStreamWriter() {
+  evbuffer_free(buffer_);
+}
+
+
+void JsonStreamWriter::BeginObject() {
+  BeginElement();
+  CHECK_EQ(0, evbuffer_add(buffer_, "{", 1));
+  element_counts_.push_back(0);
+}
+
+
+void JsonStreamWriter::EndObject() {
+  CHECK(!element_counts_.empty());
+  CHECK(!after_key_) << "Key without a value";
+  element_counts_.pop_back();
+  CHECK_EQ(0, evbuffer_add(buffer_, "}", 1));
+}
+
+
+void JsonStreamWriter::BeginArray() {
+  BeginElement();
+  CHECK_EQ(0, evbuffer_add(buffer_, "[", 1));
+  element_counts_.push_back(0);
+}
+
+
+void JsonStreamWriter::EndArray() {
+  CHECK(!element_counts_.empty());
+  element_counts_.pop_back();
+  CHECK_EQ(0, evbuffer_add(buffer_, "]", 1));
+}
+
+
+void JsonStreamWriter::Key(const char* key) {
+  CHECK(!after_key_) << "Two keys in a row";
+  BeginElement();
+  CHECK_GE(evbuffer_add_printf(buffer_, "\"%s\":", key), 0);
+  // The value that follows is part of the same element.
+  after_key_ = true;
+}
+
+
+void JsonStreamWriter::AddBase64(const string& value) {
+  BeginElement();
+  // Encode straight into the buffer, between the quotes.
+  const size_t encoded_length(util::Base64Length(value.size()));
+  evbuffer_iovec iov;
+  CHECK_EQ(1, evbuffer_reserve_space(buffer_, encoded_length + 2, &iov, 1));
+  char* const out(static_cast<char*>(iov.iov_base));
+  out[0] = '"';
+  CHECK_EQ(encoded_length,
+           util::ToBase64(value.data(), value.size(), out + 1));
+  out[encoded_length + 1] = '"';
+  iov.iov_len = encoded_length + 2;
+  CHECK_EQ(0, evbuffer_commit_space(buffer_, &iov, 1));
+}
+
+
+void JsonStreamWriter::AddInt(int64_t value) {
+  BeginElement();
+  CHECK_GE(evbuffer_add_printf(buffer_, "%lld",
+                               static_cast<long long>(value)),
+           0);
+}
+
+
+void JsonStreamWriter::AddBoolean(bool value) {
+  BeginElement();
+  CHECK_EQ(0, value ? evbuffer_add(buffer_, "true", 4)
+                    : evbuffer_add(buffer_, "false", 5));
+}
+
+
+size_t JsonStreamWriter::ElementCount() const {
+  CHECK(!element_counts_.empty());
+  return element_counts_.back();
+}
+
+
+void JsonStreamWriter::BeginElement() {
+  if (after_key_) {
+    after_key_ = false;
+    return;
+  }
+  if (element_counts_.empty())
+    return;
+  if (element_counts_.back()++ > 0) {
+    CHECK_EQ(0, evbuffer_add(buffer_, ",", 1));
+  }
+}
+
+
+}  // namespace cert_trans
@@ -0,0 +1,75 @@
+#ifndef CERT_TRANS_UTIL_JSON_STREAM_WRITER_H_
+#define CERT_TRANS_UTIL_JSON_STREAM_WRITER_H_
+
+#include <stdint.h>
+#include <string>
+#include <vector>
+
+struct evbuffer;
+
+namespace cert_trans {
+
+
+// Writes JSON text directly into an evbuffer, without building a
+// json-c object tree first. This is meant for large responses (such as
+// get-entries), where the JsonObject wrappers would spend most of their
+// time allocating small objects and copying strings around.
+//
+// Only what those responses need is supported. Keys are written as-is,
+// so they must not need escaping, and string values are always base64
+// encoded (which never needs escaping either).
+//
+// Example:
+//   JsonStreamWriter writer;
+//   writer.BeginObject();
+//   writer.Key("entries");
+//   writer.BeginArray();
+//   ...
+//   writer.EndArray();
+//   writer.EndObject();
+//   SendJsonReply(base, req, HTTP_OK, writer.buffer());
+class JsonStreamWriter {
+ public:
+  JsonStreamWriter();
+  ~JsonStreamWriter();
+  JsonStreamWriter(const JsonStreamWriter&) = delete;
+  JsonStreamWriter& operator=(const JsonStreamWriter&) = delete;
+
+  void BeginObject();
+  void EndObject();
+  void BeginArray();
+  void EndArray();
+
+  // Inside an object, must come before each value.
+  void Key(const char* key);
+
+  // Base64 encodes |value| straight into the buffer.
+  void AddBase64(const std::string& value);
+  void AddInt(int64_t value);
+  void AddBoolean(bool value);
+
+  // The JSON written so far. Only a complete document once every
+  // object and array has been closed.
+  evbuffer* buffer() const {
+    return buffer_;
+  }
+
+  // The number of elements in the innermost open object or array.
+  size_t ElementCount() const;
+
+ private:
+  // Writes the separator needed before a new element, if any.
+  void BeginElement();
+
+  evbuffer* const buffer_;
+  // Number of elements written so far, for every open object or array,
+  // innermost last.
+  std::vector<size_t> element_counts_;
+  // Whether a key was just written, so the next value belongs to it.
+  bool after_key_;
+};
+
+
+}  // namespace cert_trans
+
+#endif  // CERT_TRANS_UTIL_JSON_STREAM_WRITER_H_
@@ -0,0 +1,115 @@
+#include "util/json_stream_writer.h"
+
+#include <event2/buffer.h>
+#include <gtest/gtest.h>
+#include <string>
+
+#include "util/json_wrapper.h"
+#include "util/testing.h"
+#include "util/util.h"
+
+namespace cert_trans {
+namespace {
+
+using std::string;
+
+
+string Contents(evbuffer* buffer) {
+  return string(reinterpret_cast<const char*>(evbuffer_pullup(buffer, -1)),
+                evbuffer_get_length(buffer));
+}
+
+
+TEST(JsonStreamWriterTest, EmptyContainers) {
+  JsonStreamWriter writer;
+  writer.BeginObject();
+  writer.Key("a");
+  writer.BeginArray();
+  EXPECT_EQ(0U, writer.ElementCount());
+  writer.EndArray();
+  writer.Key("o");
+  writer.BeginObject();
+  writer.EndObject();
+  EXPECT_EQ(2U, writer.ElementCount());
+  writer.EndObject();
+  EXPECT_EQ("{\"a\":[],\"o\":{}}", Contents(writer.buffer()));
+}
+
+
+TEST(JsonStreamWriterTest, Values) {
+  JsonStreamWriter writer;
+  writer.BeginArray();
+  writer.AddInt(-42);
+  writer.AddInt(0x123456789aLL);
+  writer.AddBoolean(true);
+  writer.AddBoolean(false);
+  writer.AddBase64("");
+  writer.AddBase64("f");
+  writer.AddBase64("fo");
+  writer.AddBase64("foo");
+  EXPECT_EQ(8U, writer.ElementCount());
+  writer.EndArray();
+  EXPECT_EQ("[-42,78187493530,true,false,\"\",\"Zg==\",\"Zm8=\",\"Zm9v\"]",
+            Contents(writer.buffer()));
+}
+
+
+TEST(JsonStreamWriterTest, ParsesLikeJsonObject) {
+  const string binary("\x00\x01\xff\xfe\"\\ binary", 12);
+
+  JsonStreamWriter writer;
+  writer.BeginObject();
+  writer.Key("entries");
+  writer.BeginArray();
+  for (int i = 0; i < 3; ++i) {
+    writer.BeginObject();
+    writer.Key("leaf_input");
+    writer.AddBase64(binary + std::to_string(i));
+    writer.Key("index");
+    writer.AddInt(i);
+    writer.EndObject();
+  }
+  writer.EndArray();
+  writer.EndObject();
+
+  JsonObject parsed(writer.buffer());
+  ASSERT_TRUE(parsed.Ok());
+  JsonArray entries(parsed, "entries");
+  ASSERT_TRUE(entries.Ok());
+  ASSERT_EQ(3, entries.Length());
+  for (int i = 0; i < 3; ++i) {
+    JsonObject entry(entries, i);
+    ASSERT_TRUE(entry.Ok());
+    JsonString leaf_input(entry, "leaf_input");
+    ASSERT_TRUE(leaf_input.Ok());
+    EXPECT_EQ(binary + std::to_string(i), leaf_input.FromBase64());
+    JsonInt index(entry, "index");
+    ASSERT_TRUE(index.Ok());
+    EXPECT_EQ(i, index.Value());
+  }
+}
+
+
+TEST(JsonStreamWriterTest, LargeValue) {
+  // Bigger than the chunks evbuffer allocates by default.
+  const string value(100000, 'x');
+  JsonStreamWriter writer;
+  writer.AddBase64(value);
+
+  const string contents(Contents(writer.buffer()));
+  ASSERT_EQ(2 + ((value.size() + 2) / 3) * 4, contents.size());
+  EXPECT_EQ('"', contents.front());
+  EXPECT_EQ('"', contents.back());
+  EXPECT_EQ(value, util::FromBase64(
+                       contents.substr(1, contents.size() - 2).c_str()));
+}
+
+
+}  // namespace
+}  // namespace cert_trans
+
+
+int main(int argc, char** argv) {
+  cert_trans::test::InitTesting(argv[0], &argc, &argv, true);
+  return RUN_ALL_TESTS();
+}
@@ -166,7 +166,9 @@ class JsonString : public JsonObject {
   }
 
   std::string FromBase64() {
-    return util::FromBase64(Value());
+    std::string ret;
+    util::FromBase64(Value(), json_object_get_string_len(obj_), &ret);
+    return ret;
   }
 };
 
@@ -189,6 +191,10 @@ class JsonArray : public JsonObject {
       : JsonObject(from, field, json_type_array) {
   }
 
+  JsonArray(const JsonArray& from, int offset)
+      : JsonObject(from, offset, json_type_array) {
+  }
+
   JsonArray() : JsonObject(json_object_new_array()) {
   }
 
@@ -9,9 +9,13 @@
 #include <event2/keyvalq_struct.h>
 #include <event2/thread.h>
 #include <evhtp.h>
+#include <gflags/gflags.h>
 #include <glog/logging.h>
 #include <math.h>
+#include <algorithm>
 #include <climits>
+#include <future>
+#include <map>
 #ifdef HAVE_NETDB_H
 #include <netdb.h>
 #endif
@@ -25,6 +29,9 @@
 #include <sys/types.h>
 #endif
 #include <signal.h>
+#include <stdlib.h>
+#include <strings.h>
+#include <unistd.h>
 
 using std::bind;
 using std::chrono::duration;
@@ -32,20 +39,32 @@ using std::chrono::duration_cast;
 using std::chrono::microseconds;
 using std::chrono::milliseconds;
 using std::chrono::seconds;
+using std::chrono::steady_clock;
 using std::chrono::system_clock;
 using std::function;
 using std::lock_guard;
 using std::make_pair;
+using std::map;
 using std::multimap;
 using std::mutex;
+using std::promise;
 using std::placeholders::_1;
 using std::recursive_mutex;
 using std::shared_ptr;
 using std::string;
+using std::to_string;
 using std::unique_ptr;
 using std::vector;
 using util::TaskHold;
 
+DEFINE_int32(dns_cache_ttl_seconds, 60,
+             "How long the address a host name resolved to is used for "
+             "new connections, when its DNS TTL is not known. 0 disables "
+             "caching resolved host names.");
+DEFINE_int32(dns_negative_cache_ttl_seconds, 5,
+             "How long a host name that did not resolve is not tried "
+             "again for.");
+
 namespace {
 
 void FreeEvDns(evdns_base* dns) {
@@ -55,6 +74,12 @@ void FreeEvDns(evdns_base* dns) {
 }
 
 
+// The most closures RunClosures() runs before letting the event loop
+// see to other events, so that they are not held up when closures are
+// added faster than they can be run.
+const size_t kMaxClosuresPerRun = 1024;
+
+
 static void Handler_ExitLoop(evutil_socket_t, short, void* base) {
   event_base_loopexit((event_base*)base, NULL);
 }
@@ -82,24 +107,99 @@ void DelayDispatch(evutil_socket_t, short, void* userdata) {
 
 #ifdef HAVE_THREAD_LOCAL
 thread_local bool on_event_thread = false;
+thread_local const cert_trans::libevent::Base* current_base = nullptr;
 #elif HAVE___THREAD
 __thread bool on_event_thread = false;
+__thread const cert_trans::libevent::Base* current_base = nullptr;
 #else
 #error No suitable thread local storage available
 #endif
 
 
+// All the live Bases, by their event_base, so that the one a request
+// came in on can be found.
+mutex bases_lock;
+map<const event_base*, cert_trans::libevent::Base*>* const bases(
+    new map<const event_base*, cert_trans::libevent::Base*>);
+
+
+// Returns a non-blocking socket listening on |address| and |port|,
+// which can share that port with other sockets if |reuse_port| is
+// true.
+evutil_socket_t ListenSocket(const char* address, ev_uint16_t port,
+                             bool reuse_port) {
+  addrinfo hints;
+  memset(&hints, 0, sizeof(hints));
+  hints.ai_family = AF_UNSPEC;
+  hints.ai_socktype = SOCK_STREAM;
+  hints.ai_flags = AI_PASSIVE;
+  addrinfo* info;
+  const int resolved(
+      getaddrinfo(address, to_string(port).c_str(), &hints, &info));
+  CHECK_EQ(resolved, 0) << "getaddrinfo: " << gai_strerror(resolved);
+
+  const evutil_socket_t fd(
+      socket(info->ai_family, info->ai_socktype, info->ai_protocol));
+  PCHECK(fd >= 0) << "socket";
+  CHECK_EQ(evutil_make_listen_socket_reuseable(fd), 0);
+  if (reuse_port) {
+#ifdef SO_REUSEPORT
+    const int on(1);
+    PCHECK(setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, &on, sizeof(on)) == 0)
+        << "setsockopt(SO_REUSEPORT)";
+#else
+    LOG(FATAL) << "SO_REUSEPORT is not supported on this platform";
+#endif
+  }
+  PCHECK(bind(fd, info->ai_addr, info->ai_addrlen) == 0) << "bind";
+  freeaddrinfo(info);
+  PCHECK(listen(fd, 128) == 0) << "listen";
+  CHECK_EQ(evutil_make_socket_nonblocking(fd), 0);
+  CHECK_EQ(evutil_make_socket_closeonexec(fd), 0);
+
+  return fd;
+}
+
+
+ev_uint16_t LocalPort(evutil_socket_t fd) {
+  sockaddr_storage addr;
+  socklen_t len(sizeof(addr));
+  PCHECK(getsockname(fd, reinterpret_cast<sockaddr*>(&addr), &len) == 0)
+      << "getsockname";
+  switch (addr.ss_family) {
+    case AF_INET:
+      return ntohs(reinterpret_cast<sockaddr_in*>(&addr)->sin_port);
+    case AF_INET6:
+      return ntohs(reinterpret_cast<sockaddr_in6*>(&addr)->sin6_port);
+  }
+  LOG(FATAL) << "unexpected address family " << addr.ss_family;
+  return 0;
+}
+
+
 }  // namespace
 
 namespace cert_trans {
 namespace libevent {
 
 
+struct Base::Closure {
+  Closure(const function<void()>& _cb, Closure* _next)
+      : cb(_cb), next(_next) {
+  }
+
+  const function<void()> cb;
+  Closure* next;
+};
+
+
 struct HttpServer::Handler {
-  Handler(const string& _path, const HandlerCallback& _cb)
-      : path(_path), cb(_cb) {
+  Handler(const HttpServer* _server, const string& _path,
+          const HandlerCallback& _cb)
+      : server(_server), path(_path), cb(_cb) {
   }
 
+  const HttpServer* const server;
   const string path;
   const HandlerCallback cb;
 };
@@ -120,7 +220,7 @@ class ResolverImpl : public Base::Resolver {
     if (resolved != 0) {
       LOG(WARNING) << "Failed to resolve HTTPS hostname " << host << ": "
                    << gai_strerror(resolved);
-      return nullptr;
+      return "";
     }
 
     struct addrinfo* res(info);
@@ -144,7 +244,8 @@ class ResolverImpl : public Base::Resolver {
 
     if (!addr) {
       LOG(WARNING) << "Got no usable address for " << host;
-      return nullptr;
+      freeaddrinfo(info);
+      return "";
     }
 
     char addr_str[INET6_ADDRSTRLEN];
@@ -164,9 +265,15 @@ Base::Base(unique_ptr<Resolver> resolver)
       dns_(nullptr, FreeEvDns),
       wake_closures_(event_new(base_.get(), -1, 0, &Base::RunClosures, this),
                      &event_free),
+      new_closures_(nullptr),
       resolver_(std::move(resolver)) {
   evthread_make_base_notifiable(base_.get());
 
+  {
+    lock_guard<mutex> lock(bases_lock);
+    CHECK(bases->emplace(base_.get(), this).second);
+  }
+
   // So much stuff breaks if there's not a Dns client around to keep the
   // event loop doing stuff that we may as well just have one from the get go.
   GetDns();
@@ -174,6 +281,17 @@ Base::Base(unique_ptr<Resolver> resolver)
 
 
 Base::~Base() {
+  {
+    lock_guard<mutex> lock(bases_lock);
+    bases->erase(base_.get());
+  }
+
+  Closure* closure(new_closures_.exchange(nullptr));
+  while (closure) {
+    Closure* const next(closure->next);
+    delete closure;
+    closure = next;
+  }
 }
 
 
@@ -189,10 +307,34 @@ void Base::CheckNotOnEventThread() {
 }
 
 
+// static
+Base* Base::ForRequest(evhttp_request* req) {
+  evhttp_connection* const conn(evhttp_request_get_connection(req));
+  if (!conn) {
+    return nullptr;
+  }
+
+  lock_guard<mutex> lock(bases_lock);
+  const auto it(bases->find(evhttp_connection_get_base(conn)));
+  return it == bases->end() ? nullptr : it->second;
+}
+
+
+bool Base::OnThisEventThread() const {
+  return current_base == this;
+}
+
+
 void Base::Add(const function<void()>& cb) {
-  lock_guard<mutex> lock(closures_lock_);
-  closures_.push_back(cb);
-  event_active(wake_closures_.get(), 0, 0);
+  Closure* const closure(new Closure(cb, new_closures_.load()));
+  while (!new_closures_.compare_exchange_weak(closure->next, closure)) {
+  }
+
+  // If there were closures already, the event loop has been woken up
+  // for them, and will take this one along.
+  if (!closure->next) {
+    event_active(wake_closures_.get(), 0, 0);
+  }
 }
 
 
@@ -233,16 +375,23 @@ void Base::Dispatch() {
   SetExitLoopHandler(base_.get(), SIGHUP);
   SetExitLoopHandler(base_.get(), SIGINT);
   SetExitLoopHandler(base_.get(), SIGTERM);
+  DispatchWithoutSignals();
+}
 
+
+void Base::DispatchWithoutSignals() {
   // There should /never/ be more than 1 thread trying to call Dispatch(), so
   // we should expect to always own the lock here.
   CHECK(dispatch_lock_.try_lock());
   LOG_IF(WARNING, on_event_thread)
       << "Huh?, Are you calling Dispatch() from a libevent thread?";
   const bool old_on_event_thread(on_event_thread);
+  const Base* const old_current_base(current_base);
   on_event_thread = true;
+  current_base = this;
   CHECK_EQ(event_base_dispatch(base_.get()), 0);
   on_event_thread = old_on_event_thread;
+  current_base = old_current_base;
   dispatch_lock_.unlock();
 }
 
@@ -253,9 +402,12 @@ void Base::DispatchOnce() {
   LOG_IF(WARNING, on_event_thread)
       << "Huh?, Are you calling Dispatch() from a libevent thread?";
   const bool old_on_event_thread(on_event_thread);
+  const Base* const old_current_base(current_base);
   on_event_thread = true;
+  current_base = this;
   CHECK_EQ(event_base_loop(base_.get(), EVLOOP_ONCE), 0);
   on_event_thread = old_on_event_thread;
+  current_base = old_current_base;
 }
 
 
@@ -292,8 +444,129 @@ evdns_base* Base::GetDns() {
 }
 
 
+// Background resolution of a host name through evdns.
+struct Base::RefreshHostRequest {
+  RefreshHostRequest(Base* b, const string& h) : base(b), host(h) {
+  }
+
+  Base* const base;
+  const string host;
+};
+
+
+string Base::ResolveHost(const string& host, bool may_block) {
+  // Addresses need no resolving.
+  in_addr addr;
+  if (inet_pton(AF_INET, host.c_str(), &addr) == 1) {
+    return host;
+  }
+  if (FLAGS_dns_cache_ttl_seconds <= 0) {
+    return may_block ? resolver_->Resolve(host) : "";
+  }
+
+  {
+    lock_guard<mutex> lock(dns_lock_);
+    ResolvedHost* const resolved(&resolved_hosts_[host]);
+    const steady_clock::time_point now(steady_clock::now());
+    if (now < resolved->expires) {
+      if (!resolved->address.empty() && now >= resolved->refresh_after &&
+          !resolved->refreshing) {
+        RefreshHostLocked(host, resolved);
+      }
+      return resolved->address;
+    }
+    if (!may_block) {
+      if (!resolved->refreshing) {
+        RefreshHostLocked(host, resolved);
+      }
+      return "";
+    }
+  }
+
+  // Not holding the lock, as this blocks.
+  const string address(resolver_->Resolve(host));
+  lock_guard<mutex> lock(dns_lock_);
+  SetResolvedHostLocked(host, address, FLAGS_dns_cache_ttl_seconds);
+  return address;
+}
+
+
+void Base::SetResolvedHostLocked(const string& host, const string& address,
+                                 int ttl_seconds) {
+  ResolvedHost* const resolved(&resolved_hosts_[host]);
+  const steady_clock::time_point now(steady_clock::now());
+  resolved->address = address;
+  if (address.empty()) {
+    resolved->expires = now + seconds(FLAGS_dns_negative_cache_ttl_seconds);
+    resolved->refresh_after = resolved->expires;
+  } else {
+    resolved->expires = now + seconds(ttl_seconds);
+    resolved->refresh_after = now + seconds(ttl_seconds) * 3 / 4;
+  }
+}
+
+
+void Base::RefreshHostLocked(const string& host, ResolvedHost* resolved) {
+  VLOG(1) << "Resolving " << host << " in the background";
+  resolved->refreshing = true;
+  // Created in the constructor, which GetDns() cannot be used here
+  // for, as it takes |dns_lock_|.
+  CHECK(dns_);
+  // The callback can be run before this returns, if it fails right
+  // away, and it takes |dns_lock_|, so this is done from the event
+  // loop.
+  RefreshHostRequest* const request(new RefreshHostRequest(this, host));
+  evdns_base* const dns(dns_.get());
+  Add([dns, request]() {
+    evdns_base_resolve_ipv4(dns, request->host.c_str(), 0,
+                            &Base::RefreshHostDone, request);
+  });
+}
+
+
+// static
+void Base::RefreshHostDone(int result, char type, int count, int ttl,
+                           void* addresses, void* arg) {
+  unique_ptr<RefreshHostRequest> request(
+      static_cast<RefreshHostRequest*>(CHECK_NOTNULL(arg)));
+  // The Base is going away.
+  if (result == DNS_ERR_SHUTDOWN) {
+    return;
+  }
+
+  Base* const self(request->base);
+  lock_guard<mutex> lock(self->dns_lock_);
+  ResolvedHost* const resolved(&self->resolved_hosts_[request->host]);
+  resolved->refreshing = false;
+  if (result == DNS_ERR_NONE && type == DNS_IPv4_A && count > 0) {
+    char addr_str[INET_ADDRSTRLEN];
+    inet_ntop(AF_INET, addresses, addr_str, INET_ADDRSTRLEN);
+    VLOG(1) << "Resolved " << request->host << " to " << addr_str
+            << " for " << ttl << " second(s)";
+    self->SetResolvedHostLocked(request->host, addr_str,
+                                ttl > 0 ? ttl : FLAGS_dns_cache_ttl_seconds);
+    return;
+  }
+
+  LOG(WARNING) << "Failed to resolve " << request->host << ": "
+               << evdns_err_to_string(result);
+  // What it resolved to before is still used until it expires, as this
+  // may not be the last word (evdns does not look in /etc/hosts, for
+  // one).
+  if (steady_clock::now() >= resolved->expires) {
+    self->SetResolvedHostLocked(request->host, "", 0);
+  }
+}
+
+
 evhtp_connection_t* Base::HttpConnectionNew(const string& host,
                                             unsigned short port) {
+  // Hosts not resolved yet are resolved asynchronously by evhtp.
+  const string address(ResolveHost(host, false /* may_block */));
+  if (!address.empty()) {
+    return CHECK_NOTNULL(
+        evhtp_connection_new(base_.get(), address.c_str(), port));
+  }
   return CHECK_NOTNULL(
       evhtp_connection_new_dns(base_.get(), GetDns(), host.c_str(), port));
 }
@@ -306,7 +579,7 @@ evhtp_connection_t* Base::HttpsConnectionNew(const string& host,
 
   // TODO(alcutter): remove this all temporary name resolution stuff when this
   // PR is merged: https://github.com/ellzey/libevhtp/pull/163
-  const string addr_str(resolver_->Resolve(host));
+  const string addr_str(ResolveHost(host, true /* may_block */));
   VLOG(1) << "Got addr: " << addr_str << ":" << port;
   evhtp_connection_t* ret(CHECK_NOTNULL(
       evhtp_connection_ssl_new(base_.get(), addr_str.c_str(), port, ssl_ctx)));
@@ -317,14 +590,38 @@ evhtp_connection_t* Base::HttpsConnectionNew(const string& host,
 void Base::RunClosures(evutil_socket_t, short, void* userdata) {
   Base* self(static_cast<Base*>(CHECK_NOTNULL(userdata)));
 
-  vector<function<void()>> closures;
-  {
-    lock_guard<mutex> lock(self->closures_lock_);
-    closures.swap(self->closures_);
+  // Take all the new closures at once, putting them back in the order
+  // they were added.
+  Closure* closure(self->new_closures_.exchange(nullptr));
+  const size_t old_size(self->pending_closures_.size());
+  while (closure) {
+    self->pending_closures_.emplace_back(closure->cb);
+    Closure* const next(closure->next);
+    delete closure;
+    closure = next;
+  }
+  std::reverse(self->pending_closures_.begin() + old_size,
+               self->pending_closures_.end());
+
+  const size_t batch_size(
+      std::min(self->pending_closures_.size(), kMaxClosuresPerRun));
+  vector<function<void()>> batch(
+      std::make_move_iterator(self->pending_closures_.begin()),
+      std::make_move_iterator(self->pending_closures_.begin() + batch_size));
+  self->pending_closures_.erase(self->pending_closures_.begin(),
+                                self->pending_closures_.begin() + batch_size);
+
+  // If there are any left, come back for them on the next iteration of
+  // the event loop, once the other events have been seen to (activating
+  // the event again would run it again in this same iteration).
+  if (!self->pending_closures_.empty()) {
+    const timeval next_iteration = {0, 0};
+    CHECK_EQ(event_add(self->wake_closures_.get(), &next_iteration), 0);
   }
 
-  for (const auto& closure : closures) {
-    closure();
+  // Nothing of |self| is used past here, closures could destroy it.
+  for (const auto& cb : batch) {
+    cb();
   }
 }
 
@@ -360,12 +657,32 @@ void Event::Dispatch(evutil_socket_t sock, short events, void* userdata) {
 }
 
 
-HttpServer::HttpServer(const Base& base) : http_(base.HttpNew()) {
+HttpServer::HttpServer(const Base& base) : HttpServer(base, 1) {
+}
+
+
+HttpServer::HttpServer(const Base& base, int num_reactors) {
+  CHECK_GT(num_reactors, 0);
+  https_.push_back(base.HttpNew());
+  for (int i = 1; i < num_reactors; ++i) {
+    reactor_bases_.emplace_back(std::make_shared<Base>());
+    https_.push_back(reactor_bases_.back()->HttpNew());
+    reactor_threads_.emplace_back(&Base::DispatchWithoutSignals,
+                                  reactor_bases_.back().get());
+  }
 }
 
 
 HttpServer::~HttpServer() {
-  evhttp_free(http_);
+  // Stop the other event loops first, so that they are not using their
+  // evhttp while it is freed.
+  for (size_t i = 0; i < reactor_threads_.size(); ++i) {
+    reactor_bases_[i]->LoopExit();
+    reactor_threads_[i].join();
+  }
+  for (evhttp* http : https_) {
+    evhttp_free(http);
+  }
   for (vector<Handler*>::iterator it = handlers_.begin();
        it != handlers_.end(); ++it) {
     delete *it;
@@ -373,21 +690,75 @@ HttpServer::~HttpServer() {
 }
 
 
-void HttpServer::Bind(const char* address, ev_uint16_t port) {
-  CHECK_EQ(evhttp_bind_socket(http_, address, port), 0);
+ev_uint16_t HttpServer::Bind(const char* address, ev_uint16_t port) {
+  const bool reuse_port(https_.size() > 1);
+  for (evhttp* http : https_) {
+    const evutil_socket_t fd(ListenSocket(address, port, reuse_port));
+    // If the system picked the port, the other sockets have to share
+    // that same one.
+    port = LocalPort(fd);
+    CHECK_EQ(evhttp_accept_socket(http, fd), 0);
+  }
+
+  return port;
 }
 
 
 bool HttpServer::AddHandler(const string& path, const HandlerCallback& cb) {
-  Handler* handler(new Handler(path, cb));
+  lock_guard<mutex> lock(handlers_lock_);
+  Handler* handler(new Handler(this, path, cb));
   handlers_.push_back(handler);
 
-  return evhttp_set_cb(http_, path.c_str(), &HandleRequest, handler) == 0;
+  bool ok(evhttp_set_cb(https_[0], path.c_str(), &HandleRequest, handler) ==
+          0);
+  // The other event loops are already running, so their evhttp has to
+  // be changed from their own thread.
+  for (size_t i = 1; i < https_.size(); ++i) {
+    evhttp* const http(https_[i]);
+    promise<bool> done;
+    reactor_bases_[i - 1]->Add([http, &path, handler, &done]() {
+      done.set_value(
+          evhttp_set_cb(http, path.c_str(), &HandleRequest, handler) == 0);
+    });
+    ok = done.get_future().get() && ok;
+  }
+
+  return ok;
+}
+
+
+void HttpServer::SetObserver(const HandlerCallback& observer) {
+  observer_ = observer;
+}
+
+
+void HttpServer::SetTimeout(const duration<double>& timeout) {
+  CHECK_GT(timeout.count(), 0);
+  const seconds sec(duration_cast<seconds>(timeout));
+  timeval tv;
+  tv.tv_sec = sec.count();
+  tv.tv_usec = duration_cast<microseconds>(timeout - sec).count();
+
+  evhttp_set_timeout_tv(https_[0], &tv);
+  // As in AddHandler(), from the threads of the other event loops.
+  for (size_t i = 1; i < https_.size(); ++i) {
+    evhttp* const http(https_[i]);
+    promise<void> done;
+    reactor_bases_[i - 1]->Add([http, &tv, &done]() {
+      evhttp_set_timeout_tv(http, &tv);
+      done.set_value();
+    });
+    done.get_future().wait();
+  }
 }
 
 
 void HttpServer::HandleRequest(evhttp_request* req, void* userdata) {
-  static_cast<Handler*>(userdata)->cb(req);
+  const Handler* const handler(static_cast<Handler*>(userdata));
+  if (handler->server->observer_) {
+    handler->server->observer_(req);
+  }
+  handler->cb(req);
 }
 
 
@@ -464,8 +835,53 @@ bool GetBoolParam(const QueryParams& query, const string& param) {
 }
 
 
+bool AcceptsEncoding(const string& accept_encoding, const string& coding) {
+  static const char kWhitespace[] = " \t";
+  size_t begin(0);
+  while (begin < accept_encoding.size()) {
+    size_t end(accept_encoding.find(',', begin));
+    if (end == string::npos) {
+      end = accept_encoding.size();
+    }
+    // Each element is "coding[;q=value]".
+    const string element(accept_encoding.substr(begin, end - begin));
+    begin = end + 1;
+
+    const size_t params(element.find(';'));
+    string name(element.substr(0, params));
+    name.erase(0, name.find_first_not_of(kWhitespace));
+    name.erase(name.find_last_not_of(kWhitespace) + 1);
+    if (strcasecmp(name.c_str(), coding.c_str()) != 0) {
+      continue;
+    }
+
+    const size_t q(params == string::npos ? string::npos
+                                          : element.find("q=", params));
+    return q == string::npos || strtod(element.c_str() + q + 2, NULL) > 0;
+  }
+
+  return false;
+}
+
+
+bool AcceptsEncoding(evhttp_request* req, const string& coding) {
+  const char* const accept_encoding(evhttp_find_header(
+      evhttp_request_get_input_headers(CHECK_NOTNULL(req)),
+      "Accept-Encoding"));
+  return accept_encoding && AcceptsEncoding(accept_encoding, coding);
+}
+
+
 EventPumpThread::EventPumpThread(const shared_ptr<Base>& base)
-    : base_(base), pump_thread_(bind(&EventPumpThread::Pump, this)) {
+    : EventPumpThread(base, ThreadPlacement()) {
+}
+
+
+EventPumpThread::EventPumpThread(const shared_ptr<Base>& base,
+                                 const ThreadPlacement& placement)
+    : base_(base),
+      placement_(placement),
+      pump_thread_(bind(&EventPumpThread::Pump, this)) {
 }
 
 
@@ -476,6 +892,7 @@ EventPumpThread::~EventPumpThread() {
 
 
 void EventPumpThread::Pump() {
+  placement_.Apply(0);
   base_->Dispatch();
 }
 
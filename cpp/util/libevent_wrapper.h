@@ -5,6 +5,7 @@
 #include <event2/event.h>
 #include <atomic>
 #include <chrono>
+#include <deque>
 // TODO(alcutter): Use evhtp for the HttpServer too.
 #include <event2/http.h>
 #include <evhtp.h>
@@ -17,6 +18,7 @@
 #include <vector>
 
 #include "util/executor.h"
+#include "util/thread_placement.h"
 #include "util/task.h"
 
 namespace cert_trans {
@@ -30,12 +32,18 @@ class Base : public util::Executor {
  public:
   class Resolver {
    public:
+    // Returns the address |host| resolves to, or "" if it does not.
+    // May block.
     virtual std::string Resolve(const std::string& host) = 0;
   };
 
   static bool OnEventThread();
   static void CheckNotOnEventThread();
 
+  // Returns the Base whose event loop |req| came in on, which is the
+  // one its reply has to be sent from, or nullptr if there is none.
+  static Base* ForRequest(evhttp_request* req);
+
   Base();
   Base(std::unique_ptr<Resolver> resolver);
   ~Base();
@@ -50,11 +58,25 @@ class Base : public util::Executor {
 
   void Dispatch();
   void DispatchOnce();
+  // Like Dispatch(), but does not exit on SIGHUP, SIGINT or SIGTERM,
+  // leaving those to the event loop of another Base.
+  void DispatchWithoutSignals();
   void LoopExit();
 
+  // Whether this is called from the event loop of this Base.
+  bool OnThisEventThread() const;
+
   event* EventNew(evutil_socket_t& sock, short events, Event* event) const;
   evhttp* HttpNew() const;
   evdns_base* GetDns();
+  // Returns the address |host| resolves to, or "" if it does not, as
+  // last found out, for as long as its DNS TTL (or --dns_cache_ttl
+  // when not known) allows. Otherwise, resolves it with the Resolver
+  // if |may_block|, or returns "" and resolves it in the background
+  // through GetDns(). Hosts looked up close to their expiry are
+  // resolved again in the background, so that those in use are not
+  // left to expire.
+  std::string ResolveHost(const std::string& host, bool may_block);
   evhtp_connection_t* HttpConnectionNew(const std::string& host,
                                         unsigned short port);
   evhtp_connection_t* HttpsConnectionNew(const std::string& host,
@@ -62,20 +84,50 @@ class Base : public util::Executor {
                                          SSL_CTX* ssl_ctx);
 
  private:
+  struct Closure;
+  struct RefreshHostRequest;
+
+  // What a host name was last found to resolve to.
+  struct ResolvedHost {
+    ResolvedHost() : refreshing(false) {
+    }
+
+    // Empty if it did not resolve.
+    std::string address;
+    std::chrono::steady_clock::time_point expires;
+    // Past this, a lookup starts resolving it again in the background.
+    std::chrono::steady_clock::time_point refresh_after;
+    bool refreshing;
+  };
+
   static void RunClosures(evutil_socket_t sock, short flag, void* userdata);
 
+  void SetResolvedHostLocked(const std::string& host,
+                             const std::string& address, int ttl_seconds);
+  void RefreshHostLocked(const std::string& host, ResolvedHost* resolved);
+  static void RefreshHostDone(int result, char type, int count, int ttl,
+                              void* addresses, void* arg);
+
   const std::unique_ptr<event_base, void (*)(event_base*)> base_;
   std::mutex dispatch_lock_;
 
   std::mutex dns_lock_;
+  // Guarded by |dns_lock_|. It should be before "dns_", so that the
+  // pending background resolutions are failed before it is destroyed.
+  std::map<std::string, ResolvedHost> resolved_hosts_;
   // "dns_" should be after base_, so that it gets destroyed first.
   std::unique_ptr<evdns_base, void (*)(evdns_base*)> dns_;
 
-  std::mutex closures_lock_;
   // "wake_closures_" should be after base_, so that it gets destroyed
   // first.
   const std::unique_ptr<event, void (*)(event*)> wake_closures_;
-  std::vector<std::function<void()>> closures_;
+  // The closures added since the event loop last took them, newest
+  // first. Add() pushes onto this without a lock, and only wakes up the
+  // event loop if it was empty.
+  std::atomic<Closure*> new_closures_;
+  // The closures taken from new_closures_ that have yet to run, in
+  // order. Only used from the event loop.
+  std::deque<std::function<void()>> pending_closures_;
   std::unique_ptr<Resolver> resolver_;
 };
 
@@ -105,21 +157,49 @@ class HttpServer {
   typedef std::function<void(evhttp_request*)> HandlerCallback;
 
   explicit HttpServer(const Base& base);
+  // Serves from |num_reactors| event loops: that of |base|, and
+  // |num_reactors - 1| more that are run on their own threads. Each
+  // one accepts connections on its own listening socket, all of them
+  // bound to the same port with SO_REUSEPORT, so that the kernel
+  // spreads the connections between them. Handlers are shared.
+  HttpServer(const Base& base, int num_reactors);
   ~HttpServer();
   HttpServer(const HttpServer&) = delete;
   HttpServer& operator=(const HttpServer&) = delete;
 
-  void Bind(const char* address, ev_uint16_t port);
+  // Returns the port listened on, which is |port| unless it is 0, in
+  // which case the system picks one.
+  ev_uint16_t Bind(const char* address, ev_uint16_t port);
 
-  // Returns false if there was an error adding the handler.
+  // Returns false if there was an error adding the handler. Can be
+  // called from several threads at once.
   bool AddHandler(const std::string& path, const HandlerCallback& cb);
 
+  // Has |observer| called with each request before the handler for it,
+  // on the same thread, for instance to record it. Must be called
+  // before Bind().
+  void SetObserver(const HandlerCallback& observer);
+
+  // Sets how long connections may stay idle (between requests, or
+  // while a request or response is stalled) before they are closed,
+  // instead of the libevent default of 50 seconds. Only applies to the
+  // connections accepted afterwards.
+  void SetTimeout(const std::chrono::duration<double>& timeout);
+
  private:
   struct Handler;
 
   static void HandleRequest(evhttp_request* req, void* userdata);
 
-  evhttp* const http_;
+  // The event loops other than that of the Base given to the
+  // constructor, and the threads running them.
+  std::vector<std::shared_ptr<Base>> reactor_bases_;
+  std::vector<std::thread> reactor_threads_;
+  // One for each event loop, starting with that of the Base given to
+  // the constructor.
+  std::vector<evhttp*> https_;
+  HandlerCallback observer_;
+  std::mutex handlers_lock_;
   // Could have been a vector<Handler>, but it is important that
   // pointers to entries remain valid.
   std::vector<Handler*> handlers_;
@@ -136,10 +216,20 @@ int64_t GetIntParam(const QueryParams& query, const std::string& param);
 
 bool GetBoolParam(const QueryParams& query, const std::string& param);
 
+// Whether the Accept-Encoding header value |accept_encoding| lists the
+// content coding |coding|, without giving it a q-value of zero.
+bool AcceptsEncoding(const std::string& accept_encoding,
+                     const std::string& coding);
+
+// As above, for the Accept-Encoding header of |req|, if it has one.
+bool AcceptsEncoding(evhttp_request* req, const std::string& coding);
+
 
 class EventPumpThread {
  public:
   EventPumpThread(const std::shared_ptr<Base>& base);
+  EventPumpThread(const std::shared_ptr<Base>& base,
+                  const ThreadPlacement& placement);
   ~EventPumpThread();
   EventPumpThread(const EventPumpThread&) = delete;
   EventPumpThread& operator=(const EventPumpThread&) = delete;
@@ -148,6 +238,7 @@ class EventPumpThread {
   void Pump();
 
   const std::shared_ptr<Base> base_;
+  const ThreadPlacement placement_;
   std::thread pump_thread_;
 };
 
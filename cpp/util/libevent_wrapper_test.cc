@@ -1,9 +1,26 @@
 #include "util/libevent_wrapper.h"
 
+#include <arpa/inet.h>
+#include <gflags/gflags.h>
+#include <glog/logging.h>
 #include <gtest/gtest.h>
+#include <netinet/in.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <unistd.h>
+#include <chrono>
+#include <condition_variable>
+#include <mutex>
+#include <set>
+#include <string>
+#include <thread>
+#include <vector>
 
 #include "util/testing.h"
 
+DECLARE_int32(dns_cache_ttl_seconds);
+DECLARE_int32(dns_negative_cache_ttl_seconds);
+
 namespace cert_trans {
 namespace libevent {
 
@@ -26,6 +43,22 @@ class LibEventWrapperTest : public ::testing::Test {
 typedef class LibEventWrapperTest LibEventWrapperDeathTest;
 
 
+// Resolves "good" and nothing else, counting its calls.
+class CountingResolver : public Base::Resolver {
+ public:
+  explicit CountingResolver(int* num_calls) : num_calls_(num_calls) {
+  }
+
+  std::string Resolve(const std::string& host) override {
+    ++*num_calls_;
+    return host == "good" ? "10.0.0.1" : "";
+  }
+
+ private:
+  int* const num_calls_;
+};
+
+
 TEST_F(LibEventWrapperTest, TestOnEventThread) {
   ExpectToBeOnEventThread(false);
   std::shared_ptr<Base> base(std::make_shared<Base>());
@@ -43,6 +76,83 @@ TEST_F(LibEventWrapperTest, TestTurtlesAllTheWayDown) {
 }
 
 
+TEST_F(LibEventWrapperTest, TestClosuresRunInOrder) {
+  std::shared_ptr<Base> base(std::make_shared<Base>());
+  std::vector<int> order;
+  for (int i = 0; i < 100; ++i) {
+    base->Add([&order, i]() { order.push_back(i); });
+  }
+  base->DispatchOnce();
+
+  ASSERT_EQ(100U, order.size());
+  for (int i = 0; i < 100; ++i) {
+    EXPECT_EQ(i, order[i]);
+  }
+}
+
+
+TEST_F(LibEventWrapperTest, TestClosuresRunInBoundedBatches) {
+  std::shared_ptr<Base> base(std::make_shared<Base>());
+  const int kClosures(3000);
+  int run(0);
+  for (int i = 0; i < kClosures; ++i) {
+    base->Add([&run, i]() { EXPECT_EQ(i, run++); });
+  }
+
+  // Each iteration of the event loop only runs some of them.
+  base->DispatchOnce();
+  EXPECT_LT(0, run);
+  EXPECT_GT(kClosures, run);
+  int iterations(1);
+  while (run < kClosures) {
+    base->DispatchOnce();
+    ++iterations;
+  }
+  EXPECT_EQ(kClosures, run);
+  EXPECT_LT(2, iterations);
+}
+
+
+TEST_F(LibEventWrapperTest, TestAddFromManyThreads) {
+  std::shared_ptr<Base> base(std::make_shared<Base>());
+  EventPumpThread pump(base);
+  const int kThreads(8);
+  const int kClosuresPerThread(10000);
+  std::mutex lock;
+  std::condition_variable all_run;
+  int run(0);
+  // The closures added by each thread, in the order they ran.
+  std::vector<std::vector<int>> seen(kThreads);
+
+  std::vector<std::thread> adders;
+  for (int t = 0; t < kThreads; ++t) {
+    adders.emplace_back([&, t]() {
+      for (int i = 0; i < kClosuresPerThread; ++i) {
+        base->Add([&, t, i]() {
+          seen[t].push_back(i);
+          std::lock_guard<std::mutex> guard(lock);
+          if (++run == kThreads * kClosuresPerThread) {
+            all_run.notify_all();
+          }
+        });
+      }
+    });
+  }
+  for (auto& adder : adders) {
+    adder.join();
+  }
+
+  std::unique_lock<std::mutex> guard(lock);
+  all_run.wait(guard, [&]() { return run == kThreads * kClosuresPerThread; });
+  for (int t = 0; t < kThreads; ++t) {
+    ASSERT_EQ(static_cast<size_t>(kClosuresPerThread), seen[t].size());
+    for (int i = 0; i < kClosuresPerThread; ++i) {
+      EXPECT_EQ(i, seen[t][i]);
+    }
+  }
+}
+
+
 TEST_F(LibEventWrapperDeathTest, TestCheckNotOnEventThread) {
   // Should be fine:
   Base::CheckNotOnEventThread();
@@ -57,6 +167,121 @@ TEST_F(LibEventWrapperDeathTest, TestCheckNotOnEventThread) {
 }
 
 
+TEST_F(LibEventWrapperTest, TestHttpServerReactors) {
+  std::shared_ptr<Base> base(std::make_shared<Base>());
+  EventPumpThread pump(base);
+  HttpServer server(*base, 3);
+
+  std::mutex lock;
+  std::set<Base*> bases;
+  EXPECT_TRUE(server.AddHandler("/test", [&](evhttp_request* req) {
+    Base* const owner(Base::ForRequest(req));
+    ASSERT_NE(nullptr, owner);
+    EXPECT_TRUE(owner->OnThisEventThread());
+    {
+      std::lock_guard<std::mutex> guard(lock);
+      bases.insert(owner);
+    }
+    evbuffer_add_printf(evhttp_request_get_output_buffer(req), "hello");
+    evhttp_send_reply(req, HTTP_OK, /*reason*/ nullptr, /*databuf*/ nullptr);
+  }));
+  const ev_uint16_t port(server.Bind("127.0.0.1", 0));
+  ASSERT_NE(0, port);
+
+  // Every connection picks one of the listening sockets, at random.
+  for (int i = 0; i < 50; ++i) {
+    const std::string response(test::HttpGet(port, "/test"));
+    EXPECT_EQ(0, response.find("HTTP/1.0 200")) << response;
+    EXPECT_EQ(response.size() - 5, response.rfind("hello")) << response;
+  }
+
+  std::lock_guard<std::mutex> guard(lock);
+  EXPECT_LT(1, bases.size());
+  EXPECT_GE(3, bases.size());
+}
+
+
+TEST_F(LibEventWrapperTest, TestHttpServerTimeout) {
+  std::shared_ptr<Base> base(std::make_shared<Base>());
+  EventPumpThread pump(base);
+  HttpServer server(*base, 2);
+  server.SetTimeout(std::chrono::milliseconds(100));
+  const ev_uint16_t port(server.Bind("127.0.0.1", 0));
+  ASSERT_NE(0, port);
+
+  // A request that never completes is given up on well before the
+  // default timeout, whichever event loop gets it.
+  for (int i = 0; i < 4; ++i) {
+    const int fd(socket(AF_INET, SOCK_STREAM, 0));
+    ASSERT_LE(0, fd);
+    const timeval read_timeout{10, 0};
+    ASSERT_EQ(0, setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &read_timeout,
+                            sizeof(read_timeout)));
+    sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(port);
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    ASSERT_EQ(0,
+              connect(fd, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)));
+    const std::string partial("GET /test HTTP/1.1\r\n");
+    ASSERT_EQ(static_cast<ssize_t>(partial.size()),
+              write(fd, partial.data(), partial.size()));
+
+    char buf[1024];
+    ssize_t got;
+    while ((got = read(fd, buf, sizeof(buf))) > 0) {
+    }
+    EXPECT_EQ(0, got) << strerror(errno);
+    close(fd);
+  }
+}
+
+
+TEST_F(LibEventWrapperTest, TestResolveHostCaches) {
+  FLAGS_dns_cache_ttl_seconds = 60;
+  FLAGS_dns_negative_cache_ttl_seconds = 60;
+  int num_calls(0);
+  Base base(std::unique_ptr<Base::Resolver>(new CountingResolver(&num_calls)));
+
+  // Not known yet, and not to block.
+  EXPECT_EQ("", base.ResolveHost("good", false));
+  EXPECT_EQ(0, num_calls);
+
+  EXPECT_EQ("10.0.0.1", base.ResolveHost("good", true));
+  EXPECT_EQ("10.0.0.1", base.ResolveHost("good", true));
+  EXPECT_EQ("10.0.0.1", base.ResolveHost("good", false));
+  EXPECT_EQ(1, num_calls);
+
+  // Failures are remembered too.
+  EXPECT_EQ("", base.ResolveHost("bad", true));
+  EXPECT_EQ("", base.ResolveHost("bad", true));
+  EXPECT_EQ(2, num_calls);
+
+  // Addresses are left alone.
+  EXPECT_EQ("127.0.0.1", base.ResolveHost("127.0.0.1", true));
+  EXPECT_EQ(2, num_calls);
+
+  FLAGS_dns_cache_ttl_seconds = 0;
+  EXPECT_EQ("10.0.0.1", base.ResolveHost("good", true));
+  EXPECT_EQ(3, num_calls);
+}
+
+
+TEST(AcceptsEncodingTest, ParsesHeader) {
+  EXPECT_FALSE(AcceptsEncoding("", "zstd"));
+  EXPECT_TRUE(AcceptsEncoding("zstd", "zstd"));
+  EXPECT_TRUE(AcceptsEncoding("ZSTD", "zstd"));
+  EXPECT_TRUE(AcceptsEncoding("gzip, zstd", "zstd"));
+  EXPECT_TRUE(AcceptsEncoding("gzip;q=0.5 , zstd ;q=1.0", "zstd"));
+  EXPECT_TRUE(AcceptsEncoding("zstd;q=0.001", "zstd"));
+  EXPECT_FALSE(AcceptsEncoding("zstd;q=0", "zstd"));
+  EXPECT_FALSE(AcceptsEncoding("zstd; q=0.000", "zstd"));
+  EXPECT_FALSE(AcceptsEncoding("gzip, deflate", "zstd"));
+  EXPECT_FALSE(AcceptsEncoding("zstdx, xzstd", "zstd"));
+}
+
+
 }  // namespace libevent
 }  // namespace cert_trans
 
@@ -2,6 +2,7 @@
 
 #include <gflags/gflags.h>
 #include <glog/logging.h>
+#include <algorithm>
 #include <climits>
 #include <functional>
 
@@ -12,6 +13,8 @@ namespace cert_trans {
 
 using cert_trans::Gauge;
 using std::bind;
+using std::chrono::duration_cast;
+using std::chrono::milliseconds;
 using std::chrono::seconds;
 using std::mutex;
 using std::placeholders::_1;
@@ -25,6 +28,17 @@ using util::Task;
 
 DEFINE_int32(master_keepalive_interval_seconds, 60,
              "Interval between refreshing mastership proposal.");
+DEFINE_int32(master_keepalive_interval_ms, 0,
+             "If set, the interval between refreshing the mastership "
+             "proposal, in milliseconds, overriding "
+             "--master_keepalive_interval_seconds. Along with a short "
+             "--master_proposal_ttl_seconds, this lets the other nodes see "
+             "quickly that the master has gone.");
+DEFINE_int32(master_proposal_ttl_seconds, 0,
+             "How long a mastership proposal lasts without being refreshed, "
+             "after which another node can become master. If zero, twice "
+             "the keepalive interval, rounded up to a whole second, which "
+             "is as fine as etcd expires them.");
 DEFINE_int32(masterelection_retry_delay_seconds, 5,
              "Seconds to delay before retrying a failed attempt to create a "
              "proposal file.");
@@ -50,6 +64,24 @@ static Counter<>* proposal_creation_failures(
 const char kNoBacking[] = "";
 
 
+milliseconds KeepAliveInterval() {
+  if (FLAGS_master_keepalive_interval_ms > 0) {
+    return milliseconds(FLAGS_master_keepalive_interval_ms);
+  }
+  return seconds(FLAGS_master_keepalive_interval_seconds);
+}
+
+
+seconds ProposalTTL() {
+  if (FLAGS_master_proposal_ttl_seconds > 0) {
+    return seconds(FLAGS_master_proposal_ttl_seconds);
+  }
+  const milliseconds ttl(2 * KeepAliveInterval());
+  return std::max(seconds(1), duration_cast<seconds>(ttl + seconds(1) -
+                                                     milliseconds(1)));
+}
+
+
 // Returns |s| with a '/' appended if the last char is not already a '/'
 string EnsureEndsWithSlash(const string& s) {
   if (s.empty() || s.back() != '/') {
@@ -267,7 +299,7 @@ void MasterElection::CreateProposal() {
   EtcdClient::Response* const resp(new EtcdClient::Response);
   client_->CreateWithTTL(
       my_proposal_path_, kNoBacking,
-      seconds(FLAGS_master_keepalive_interval_seconds * 2), resp,
+      ProposalTTL(), resp,
       new Task(bind(&MasterElection::ProposalCreateDone, this, resp, _1),
                base_.get()));
 }
@@ -301,7 +333,7 @@ void MasterElection::ProposalCreateDone(EtcdClient::Response* resp,
   CHECK(!proposal_refresh_callback_);
   VLOG(1) << my_proposal_path_ << ": Creating refresh Callback";
   proposal_refresh_callback_.reset(new PeriodicClosure(
-      base_, seconds(FLAGS_master_keepalive_interval_seconds),
+      base_, KeepAliveInterval(),
       bind(&MasterElection::ProposalKeepAliveCallback, this)));
 
   // Watch the proposal directory so we're aware of other proposals
@@ -345,8 +377,7 @@ void MasterElection::UpdateProposal(const string& backed) {
 
   // TODO(alcutter): Set the HTTP timeout inside here to something sensible.
   EtcdClient::Response* const resp(new EtcdClient::Response);
-  client_->UpdateWithTTL(my_proposal_path_, backed,
-                         seconds(FLAGS_master_keepalive_interval_seconds * 2),
+  client_->UpdateWithTTL(my_proposal_path_, backed, ProposalTTL(),
                          my_proposal_modified_index_, resp,
                          new Task(bind(&MasterElection::ProposalUpdateDone,
                                        this, resp, _1),
@@ -0,0 +1,102 @@
+#include "config.h"
+#include "util/pool_allocator.h"
+
+namespace util {
+namespace {
+
+
+const size_t kGranularity = 16;
+const size_t kMaxPooledSize = 512;
+const size_t kNumSizes = kMaxPooledSize / kGranularity;
+// How many freed blocks of each size a thread keeps.
+const int kMaxFreeBlocks = 256;
+
+
+struct FreeBlock {
+  FreeBlock* next;
+};
+
+
+// Blocks are only pooled where thread-local objects can have
+// destructors, to give them back when the thread exits.
+#ifdef HAVE_THREAD_LOCAL
+thread_local FreeBlock* free_lists[kNumSizes];
+thread_local int free_counts[kNumSizes];
+thread_local bool thread_exiting = false;
+
+
+// Gives the blocks of the thread back when it exits. Blocks freed
+// after that, by the destructors of other thread-local objects, go
+// straight back to the global allocator.
+struct FreeListsReleaser {
+  ~FreeListsReleaser() {
+    thread_exiting = true;
+    for (size_t i = 0; i < kNumSizes; ++i) {
+      while (free_lists[i]) {
+        FreeBlock* const block(free_lists[i]);
+        free_lists[i] = block->next;
+        ::operator delete(block);
+      }
+      free_counts[i] = 0;
+    }
+  }
+};
+
+
+thread_local FreeListsReleaser releaser;
+#endif
+
+
+// Returns the index of the free list for blocks of |size| bytes,
+// which must be at most kMaxPooledSize.
+size_t SizeIndex(size_t size) {
+  return size == 0 ? 0 : (size - 1) / kGranularity;
+}
+
+
+}  // namespace
+
+
+void* PoolAllocate(size_t size) {
+#ifdef HAVE_THREAD_LOCAL
+  if (size <= kMaxPooledSize) {
+    const size_t index(SizeIndex(size));
+    FreeBlock* const block(free_lists[index]);
+    if (block) {
+      free_lists[index] = block->next;
+      --free_counts[index];
+      return block;
+    }
+    // Allocate the whole size of the list, so that the block can go
+    // on it when freed.
+    return ::operator new((index + 1) * kGranularity);
+  }
+#endif
+  return ::operator new(size);
+}
+
+
+void PoolFree(void* ptr, size_t size) {
+  if (!ptr) {
+    return;
+  }
+#ifdef HAVE_THREAD_LOCAL
+  if (size <= kMaxPooledSize && !thread_exiting) {
+    const size_t index(SizeIndex(size));
+    if (free_counts[index] < kMaxFreeBlocks) {
+      // Makes sure that the blocks are given back when the thread
+      // exits.
+      (void)&releaser;
+      FreeBlock* const block(static_cast<FreeBlock*>(ptr));
+      block->next = free_lists[index];
+      free_lists[index] = block;
+      ++free_counts[index];
+      return;
+    }
+  }
+#endif
+  ::operator delete(ptr);
+}
+
+
+}  // namespace util
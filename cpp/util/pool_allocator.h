@@ -0,0 +1,93 @@
+#ifndef CERT_TRANS_UTIL_POOL_ALLOCATOR_H_
+#define CERT_TRANS_UTIL_POOL_ALLOCATOR_H_
+
+#include <stddef.h>
+#include <new>
+
+namespace util {
+
+
+// Per-thread pools of small blocks, for the objects that are created
+// and destroyed for every request (tasks, request states, responses),
+// so that these do not contend on the lock of the global allocator.
+//
+// Freed blocks go to a list kept by the freeing thread for their size
+// (rounded up to 16 bytes, up to 512 bytes), which later allocations
+// of that size on the thread take from. The lists are bounded, past
+// which blocks go back to the global allocator, as do larger ones.
+// Blocks can be freed on a different thread than they were allocated
+// on.
+
+// Returns a block of at least |size| bytes, suitably aligned for any
+// object.
+void* PoolAllocate(size_t size);
+
+// Frees |ptr|, which PoolAllocate() returned for |size|.
+void PoolFree(void* ptr, size_t size);
+
+
+// Base class giving a class the pool's operator new and delete. The
+// object must be deleted through its own type, or a base with a
+// virtual destructor, for the right size to be passed.
+class Pooled {
+ public:
+  static void* operator new(size_t size) {
+    return PoolAllocate(size);
+  }
+
+  static void operator delete(void* ptr, size_t size) {
+    PoolFree(ptr, size);
+  }
+};
+
+
+// Allocator using the pool for single objects, such as those
+// std::allocate_shared() makes.
+template <class T>
+class PoolAllocator {
+ public:
+  typedef T value_type;
+
+  template <class U>
+  struct rebind {
+    typedef PoolAllocator<U> other;
+  };
+
+  PoolAllocator() = default;
+
+  template <class U>
+  PoolAllocator(const PoolAllocator<U>&) {
+  }
+
+  T* allocate(size_t n) {
+    if (n != 1) {
+      return static_cast<T*>(::operator new(n * sizeof(T)));
+    }
+    return static_cast<T*>(PoolAllocate(sizeof(T)));
+  }
+
+  void deallocate(T* ptr, size_t n) {
+    if (n != 1) {
+      ::operator delete(ptr);
+      return;
+    }
+    PoolFree(ptr, sizeof(T));
+  }
+};
+
+
+template <class T, class U>
+bool operator==(const PoolAllocator<T>&, const PoolAllocator<U>&) {
+  return true;
+}
+
+
+template <class T, class U>
+bool operator!=(const PoolAllocator<T>&, const PoolAllocator<U>&) {
+  return false;
+}
+
+
+}  // namespace util
+
+#endif  // CERT_TRANS_UTIL_POOL_ALLOCATOR_H_
@@ -0,0 +1,94 @@
+#include "util/pool_allocator.h"
+
+#include <gtest/gtest.h>
+#include <stdint.h>
+#include <string.h>
+#include <cstddef>
+#include <memory>
+#include <set>
+#include <thread>
+#include <vector>
+
+#include "util/testing.h"
+
+namespace util {
+namespace {
+
+using std::allocate_shared;
+using std::set;
+using std::shared_ptr;
+using std::thread;
+using std::vector;
+
+
+struct PooledObject : public Pooled {
+  char data[40];
+};
+
+
+TEST(PoolAllocatorTest, ReusesFreedBlocks) {
+  void* const block(PoolAllocate(40));
+  memset(block, 0xaa, 40);
+  PoolFree(block, 40);
+  // Same size class.
+  EXPECT_EQ(block, PoolAllocate(48));
+  PoolFree(block, 48);
+}
+
+
+TEST(PoolAllocatorTest, Alignment) {
+  vector<void*> blocks;
+  for (size_t size = 0; size <= 1024; size += 7) {
+    blocks.push_back(PoolAllocate(size));
+    EXPECT_EQ(0U, reinterpret_cast<uintptr_t>(blocks.back()) %
+                      alignof(std::max_align_t));
+  }
+  size_t size(0);
+  for (void* block : blocks) {
+    PoolFree(block, size);
+    size += 7;
+  }
+}
+
+
+TEST(PoolAllocatorTest, DistinctBlocks) {
+  vector<PooledObject*> objects;
+  set<PooledObject*> seen;
+  for (int i = 0; i < 1000; ++i) {
+    objects.push_back(new PooledObject);
+    EXPECT_TRUE(seen.insert(objects.back()).second);
+  }
+  for (PooledObject* object : objects) {
+    delete object;
+  }
+}
+
+
+TEST(PoolAllocatorTest, FreedOnOtherThread) {
+  vector<PooledObject*> objects;
+  for (int i = 0; i < 1000; ++i) {
+    objects.push_back(new PooledObject);
+  }
+  thread([&objects]() {
+    for (PooledObject* object : objects) {
+      delete object;
+    }
+  }).join();
+}
+
+
+TEST(PoolAllocatorTest, AllocateShared) {
+  const shared_ptr<int> value(
+      allocate_shared<int>(PoolAllocator<int>(), 42));
+  EXPECT_EQ(42, *value);
+}
+
+
+}  // namespace
+}  // namespace util
+
+
+int main(int argc, char** argv) {
+  cert_trans::test::InitTesting(argv[0], &argc, &argv, true);
+  return RUN_ALL_TESTS();
+}
@@ -0,0 +1,75 @@
+#ifndef CERT_TRANS_UTIL_READ_WRITE_LOCK_H_
+#define CERT_TRANS_UTIL_READ_WRITE_LOCK_H_
+
+#include <glog/logging.h>
+#include <pthread.h>
+
+namespace cert_trans {
+
+
+// A lock that can be held by any number of readers at once, or by a
+// single writer. Writers are given priority, where supported, so that
+// a steady stream of readers cannot keep them out forever.
+//
+// It has the same lock()/unlock() as std::mutex, so the exclusive side
+// can be used with std::lock_guard and std::unique_lock, and the shared
+// side is taken with a ReaderLock.
+class ReadWriteLock {
+ public:
+  ReadWriteLock() {
+    pthread_rwlockattr_t attr;
+    CHECK_EQ(0, pthread_rwlockattr_init(&attr));
+#ifdef __GLIBC__
+    CHECK_EQ(0, pthread_rwlockattr_setkind_np(
+                    &attr, PTHREAD_RWLOCK_PREFER_WRITER_NONRECURSIVE_NP));
+#endif
+    CHECK_EQ(0, pthread_rwlock_init(&lock_, &attr));
+    CHECK_EQ(0, pthread_rwlockattr_destroy(&attr));
+  }
+  ~ReadWriteLock() {
+    CHECK_EQ(0, pthread_rwlock_destroy(&lock_));
+  }
+  ReadWriteLock(const ReadWriteLock&) = delete;
+  ReadWriteLock& operator=(const ReadWriteLock&) = delete;
+
+  void lock() {
+    CHECK_EQ(0, pthread_rwlock_wrlock(&lock_));
+  }
+
+  void unlock() {
+    CHECK_EQ(0, pthread_rwlock_unlock(&lock_));
+  }
+
+  void lock_shared() {
+    CHECK_EQ(0, pthread_rwlock_rdlock(&lock_));
+  }
+
+  void unlock_shared() {
+    CHECK_EQ(0, pthread_rwlock_unlock(&lock_));
+  }
+
+ private:
+  pthread_rwlock_t lock_;
+};
+
+
+// Holds |lock| shared for as long as it is in scope.
+class ReaderLock {
+ public:
+  explicit ReaderLock(ReadWriteLock* lock) : lock_(CHECK_NOTNULL(lock)) {
+    lock_->lock_shared();
+  }
+  ~ReaderLock() {
+    lock_->unlock_shared();
+  }
+  ReaderLock(const ReaderLock&) = delete;
+  ReaderLock& operator=(const ReaderLock&) = delete;
+
+ private:
+  ReadWriteLock* const lock_;
+};
+
+
+}  // namespace cert_trans
+
+#endif  // CERT_TRANS_UTIL_READ_WRITE_LOCK_H_
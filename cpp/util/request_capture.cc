@@ -0,0 +1,216 @@
+#include "util/request_capture.h"
+
+#include <event2/buffer.h>
+#include <event2/http.h>
+#include <glog/logging.h>
+#include <math.h>
+
+using std::chrono::duration_cast;
+using std::chrono::microseconds;
+using std::chrono::steady_clock;
+using std::lock_guard;
+using std::mutex;
+using std::string;
+
+namespace cert_trans {
+namespace {
+
+
+const char* MethodName(evhttp_cmd_type type) {
+  switch (type) {
+    case EVHTTP_REQ_GET:
+      return "GET";
+    case EVHTTP_REQ_POST:
+      return "POST";
+    case EVHTTP_REQ_HEAD:
+      return "HEAD";
+    case EVHTTP_REQ_PUT:
+      return "PUT";
+    case EVHTTP_REQ_DELETE:
+      return "DELETE";
+    case EVHTTP_REQ_OPTIONS:
+      return "OPTIONS";
+    case EVHTTP_REQ_TRACE:
+      return "TRACE";
+    case EVHTTP_REQ_CONNECT:
+      return "CONNECT";
+    case EVHTTP_REQ_PATCH:
+      return "PATCH";
+  }
+  return nullptr;
+}
+
+
+void AppendUint(uint64_t value, size_t bytes, string* output) {
+  for (size_t i = bytes; i > 0; --i) {
+    output->push_back(static_cast<char>((value >> ((i - 1) * 8)) & 0xff));
+  }
+}
+
+
+bool ReadUint(FILE* file, size_t bytes, uint64_t* value) {
+  unsigned char buf[8];
+  CHECK_LE(bytes, sizeof(buf));
+  if (fread(buf, 1, bytes, file) != bytes) {
+    return false;
+  }
+  *value = 0;
+  for (size_t i = 0; i < bytes; ++i) {
+    *value = (*value << 8) | buf[i];
+  }
+  return true;
+}
+
+
+bool ReadVarBytes(FILE* file, size_t prefix_bytes, string* value) {
+  uint64_t length;
+  if (!ReadUint(file, prefix_bytes, &length)) {
+    return false;
+  }
+  value->resize(length);
+  return length == 0 || fread(&(*value)[0], 1, length, file) == length;
+}
+
+
+}  // namespace
+
+
+RequestCapture::Reader::Reader(const string& path)
+    : file_(fopen(path.c_str(), "rb")), ok_(file_ != nullptr) {
+  PLOG_IF(WARNING, !file_) << "could not open " << path;
+}
+
+
+RequestCapture::Reader::~Reader() {
+  if (file_) {
+    fclose(file_);
+  }
+}
+
+
+bool RequestCapture::Reader::Next(Request* request) {
+  CHECK_NOTNULL(request);
+  if (!ok_) {
+    return false;
+  }
+  // Only the end of the file before a record is the end of the capture.
+  const int first(fgetc(file_));
+  if (first == EOF) {
+    ok_ = !ferror(file_);
+    return false;
+  }
+  CHECK_EQ(first, ungetc(first, file_));
+
+  uint64_t offset;
+  if (!ReadUint(file_, 8, &offset) ||
+      !ReadVarBytes(file_, 1, &request->method) ||
+      !ReadVarBytes(file_, 2, &request->uri) ||
+      !ReadVarBytes(file_, 4, &request->body)) {
+    ok_ = false;
+    return false;
+  }
+  request->offset = microseconds(offset);
+  return true;
+}
+
+
+RequestCapture::RequestCapture(const string& path, double sample_rate,
+                               int64_t max_bytes)
+    : sample_rate_(sample_rate),
+      max_bytes_(max_bytes),
+      start_(steady_clock::now()),
+      num_seen_(0),
+      file_(fopen(path.c_str(), "wb")),
+      bytes_written_(0),
+      num_recorded_(0) {
+  CHECK_GE(sample_rate_, 0);
+  CHECK_GT(max_bytes_, 0);
+  PCHECK(file_) << "could not open " << path;
+}
+
+
+RequestCapture::~RequestCapture() {
+  lock_guard<mutex> lock(lock_);
+  if (file_) {
+    PCHECK(fclose(file_) == 0);
+  }
+}
+
+
+void RequestCapture::MaybeRecord(evhttp_request* req) {
+  // Request number n is in the sample if it brings the number of
+  // requests that should have been recorded up by one.
+  const uint64_t n(num_seen_.fetch_add(1, std::memory_order_relaxed));
+  if (floor((n + 1) * sample_rate_) <= floor(n * sample_rate_)) {
+    return;
+  }
+
+  Request request;
+  const char* const method(MethodName(evhttp_request_get_command(req)));
+  const char* const uri(evhttp_request_get_uri(req));
+  if (!method || !uri) {
+    return;
+  }
+  request.method = method;
+  request.uri = uri;
+  evbuffer* const input(evhttp_request_get_input_buffer(req));
+  request.body.resize(evbuffer_get_length(input));
+  if (!request.body.empty()) {
+    CHECK_EQ(static_cast<ev_ssize_t>(request.body.size()),
+             evbuffer_copyout(input, &request.body[0], request.body.size()));
+  }
+  Record(request);
+}
+
+
+void RequestCapture::Record(const Request& request) {
+  if (request.method.empty() || request.method.size() > 0xff ||
+      request.uri.empty() || request.uri.size() > 0xffff ||
+      request.body.size() > 0xffffffffULL) {
+    LOG(WARNING) << "not recording a request too large to encode: "
+                 << request.method << " " << request.uri.substr(0, 100);
+    return;
+  }
+
+  string record;
+  record.reserve(8 + 1 + request.method.size() + 2 + request.uri.size() +
+                 4 + request.body.size());
+  AppendUint(duration_cast<microseconds>(steady_clock::now() - start_)
+                 .count(),
+             8, &record);
+  AppendUint(request.method.size(), 1, &record);
+  record.append(request.method);
+  AppendUint(request.uri.size(), 2, &record);
+  record.append(request.uri);
+  AppendUint(request.body.size(), 4, &record);
+  record.append(request.body);
+
+  lock_guard<mutex> lock(lock_);
+  if (!file_) {
+    return;
+  }
+  if (bytes_written_ + static_cast<int64_t>(record.size()) > max_bytes_) {
+    LOG(INFO) << "recorded " << num_recorded_ << " requests, the most that "
+              << "fit in " << max_bytes_ << " bytes";
+    PCHECK(fclose(file_) == 0);
+    file_ = nullptr;
+    return;
+  }
+  if (fwrite(record.data(), 1, record.size(), file_) != record.size()) {
+    PLOG(WARNING) << "could not write a request, no longer recording";
+    fclose(file_);
+    file_ = nullptr;
+    return;
+  }
+  bytes_written_ += record.size();
+  ++num_recorded_;
+}
+
+
+int64_t RequestCapture::num_recorded() const {
+  lock_guard<mutex> lock(lock_);
+  return num_recorded_;
+}
+
+
+}  // namespace cert_trans
@@ -0,0 +1,101 @@
+#ifndef CERT_TRANS_UTIL_REQUEST_CAPTURE_H_
+#define CERT_TRANS_UTIL_REQUEST_CAPTURE_H_
+
+#include <stdint.h>
+#include <stdio.h>
+#include <atomic>
+#include <chrono>
+#include <mutex>
+#include <string>
+
+struct evhttp_request;
+
+namespace cert_trans {
+
+
+// Records a sample of the HTTP requests a server receives to a file,
+// so that they can be sent again later, with their original timing,
+// to a test deployment (see tools/replay_requests.cc).
+//
+// The file is a sequence of records, one per request, of the form:
+//
+//   struct {
+//     uint64 offset_micros;
+//     opaque method<1..2^8-1>;
+//     opaque uri<1..2^16-1>;
+//     opaque body<0..2^32-1>;
+//   } CapturedRequest;
+//
+// where |offset_micros| is the time since the capture started, and
+// |uri| is the path and query of the request.
+class RequestCapture {
+ public:
+  struct Request {
+    std::chrono::microseconds offset;
+    std::string method;
+    std::string uri;
+    std::string body;
+  };
+
+  // Reads the records of a capture file in order.
+  class Reader {
+   public:
+    explicit Reader(const std::string& path);
+    ~Reader();
+    Reader(const Reader&) = delete;
+    Reader& operator=(const Reader&) = delete;
+
+    // Returns false at the end of the file, or if it could not be read
+    // (see ok()).
+    bool Next(Request* request);
+
+    // False if the file could not be opened, or ends with a truncated
+    // record.
+    bool ok() const {
+      return ok_;
+    }
+
+   private:
+    FILE* const file_;
+    bool ok_;
+  };
+
+  // Records every request with a probability of |sample_rate|, or
+  // rather, records them so that the fraction recorded so far is
+  // always within one request of it, which is deterministic. Stops
+  // at the first request that would take the file past |max_bytes|.
+  // The file at |path| is overwritten.
+  RequestCapture(const std::string& path, double sample_rate,
+                 int64_t max_bytes);
+  ~RequestCapture();
+  RequestCapture(const RequestCapture&) = delete;
+  RequestCapture& operator=(const RequestCapture&) = delete;
+
+  // Records |req|, if it is one of the sample. Its body must have been
+  // received in full, as it has when it is handed to a handler. Can be
+  // called from several threads at once.
+  void MaybeRecord(evhttp_request* req);
+
+  // Records |request|, regardless of the sample rate (but not of
+  // |max_bytes|). Its offset is ignored and set to the current time.
+  void Record(const Request& request);
+
+  // The number of requests recorded so far.
+  int64_t num_recorded() const;
+
+ private:
+  const double sample_rate_;
+  const int64_t max_bytes_;
+  const std::chrono::steady_clock::time_point start_;
+  std::atomic<uint64_t> num_seen_;
+
+  mutable std::mutex lock_;
+  FILE* file_;
+  int64_t bytes_written_;
+  int64_t num_recorded_;
+};
+
+
+}  // namespace cert_trans
+
+#endif  // CERT_TRANS_UTIL_REQUEST_CAPTURE_H_
@@ -0,0 +1,145 @@
+#include "util/request_capture.h"
+
+#include <event2/http.h>
+#include <gtest/gtest.h>
+#include <stdio.h>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "util/libevent_wrapper.h"
+#include "util/testing.h"
+#include "util/util.h"
+
+namespace cert_trans {
+namespace {
+
+using std::make_shared;
+using std::shared_ptr;
+using std::string;
+using std::to_string;
+using std::vector;
+
+
+class RequestCaptureTest : public ::testing::Test {
+ protected:
+  RequestCaptureTest()
+      : path_(util::CreateTemporaryDirectory("/tmp/capture_testXXXXXX") +
+              "/capture") {
+  }
+
+  vector<RequestCapture::Request> ReadAll() {
+    RequestCapture::Reader reader(path_);
+    vector<RequestCapture::Request> requests;
+    RequestCapture::Request request;
+    while (reader.Next(&request)) {
+      requests.push_back(request);
+    }
+    EXPECT_TRUE(reader.ok());
+    return requests;
+  }
+
+  const string path_;
+};
+
+
+RequestCapture::Request MakeRequest(const string& method, const string& uri,
+                                    const string& body) {
+  RequestCapture::Request request;
+  request.method = method;
+  request.uri = uri;
+  request.body = body;
+  return request;
+}
+
+
+TEST_F(RequestCaptureTest, RoundTrip) {
+  {
+    RequestCapture capture(path_, 1, 1 << 20);
+    capture.Record(MakeRequest("GET", "/ct/v1/get-sth", ""));
+    capture.Record(MakeRequest("POST", "/ct/v1/add-chain",
+                               string("{\"chain\": []}\0", 14)));
+    EXPECT_EQ(2, capture.num_recorded());
+  }
+
+  const vector<RequestCapture::Request> requests(ReadAll());
+  ASSERT_EQ(2U, requests.size());
+  EXPECT_EQ("GET", requests[0].method);
+  EXPECT_EQ("/ct/v1/get-sth", requests[0].uri);
+  EXPECT_EQ("", requests[0].body);
+  EXPECT_EQ("POST", requests[1].method);
+  EXPECT_EQ("/ct/v1/add-chain", requests[1].uri);
+  EXPECT_EQ(string("{\"chain\": []}\0", 14), requests[1].body);
+  EXPECT_LE(requests[0].offset, requests[1].offset);
+}
+
+
+TEST_F(RequestCaptureTest, StopsAtMaxBytes) {
+  {
+    // Room for two records of 8 + 1 + 3 + 2 + 2 + 4 bytes.
+    RequestCapture capture(path_, 1, 45);
+    for (int i = 0; i < 5; ++i) {
+      capture.Record(MakeRequest("GET", "/" + to_string(i), ""));
+    }
+    EXPECT_EQ(2, capture.num_recorded());
+  }
+
+  const vector<RequestCapture::Request> requests(ReadAll());
+  ASSERT_EQ(2U, requests.size());
+  EXPECT_EQ("/1", requests[1].uri);
+}
+
+
+TEST_F(RequestCaptureTest, TruncatedFile) {
+  {
+    RequestCapture capture(path_, 1, 1 << 20);
+    capture.Record(MakeRequest("GET", "/a", ""));
+    capture.Record(MakeRequest("GET", "/b", ""));
+  }
+  string contents;
+  ASSERT_TRUE(util::ReadBinaryFile(path_, &contents));
+  FILE* const file(fopen(path_.c_str(), "wb"));
+  ASSERT_NE(nullptr, file);
+  fwrite(contents.data(), 1, contents.size() - 1, file);
+  fclose(file);
+
+  RequestCapture::Reader reader(path_);
+  RequestCapture::Request request;
+  EXPECT_TRUE(reader.Next(&request));
+  EXPECT_EQ("/a", request.uri);
+  EXPECT_FALSE(reader.Next(&request));
+  EXPECT_FALSE(reader.ok());
+}
+
+
+TEST_F(RequestCaptureTest, SamplesServedRequests) {
+  RequestCapture capture(path_, 0.5, 1 << 20);
+  {
+    const shared_ptr<libevent::Base> base(make_shared<libevent::Base>());
+    libevent::EventPumpThread pump(base);
+    libevent::HttpServer server(*base);
+    server.SetObserver(
+        [&capture](evhttp_request* req) { capture.MaybeRecord(req); });
+    ASSERT_TRUE(server.AddHandler("/test", [](evhttp_request* req) {
+      evhttp_send_reply(req, HTTP_OK, /*reason*/ nullptr,
+                        /*databuf*/ nullptr);
+    }));
+    const ev_uint16_t port(server.Bind("127.0.0.1", 0));
+    for (int i = 0; i < 10; ++i) {
+      test::HttpGet(port, "/test?i=" + to_string(i));
+    }
+  }
+
+  // Every other request.
+  EXPECT_EQ(5, capture.num_recorded());
+}
+
+
+}  // namespace
+}  // namespace cert_trans
+
+
+int main(int argc, char** argv) {
+  cert_trans::test::InitTesting(argv[0], &argc, &argv, true);
+  return RUN_ALL_TESTS();
+}
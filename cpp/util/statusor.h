@@ -49,6 +49,9 @@ class StatusOr {
   // Assignment operator.
   inline const StatusOr& operator=(const StatusOr& other);
 
+  // Move assignment operator.
+  inline const StatusOr& operator=(StatusOr&& other);
+
   // Conversion assignment operator, T must be assignable from U
   template <typename U>
   inline const StatusOr& operator=(const StatusOr<U>& other);
@@ -63,15 +66,21 @@ class StatusOr {
     return status_.ok();
   }
 
-  // Returns value or crashes if ok() is false.
-  inline const T& ValueOrDie() const {
+  // Returns value or crashes if ok() is false. On an rvalue, such as
+  // the result of a function, the value is moved out rather than
+  // copied.
+  inline const T& ValueOrDie() const & {
     CHECK(ok()) << "Attempting to fetch value of non-OK StatusOr";
     return value_;
   }
-  inline T& ValueOrDie() {
+  inline T& ValueOrDie() & {
     CHECK(ok()) << "Attempting to fetch value of non-OK StatusOr";
     return value_;
   }
+  inline T&& ValueOrDie() && {
+    CHECK(ok()) << "Attempting to fetch value of non-OK StatusOr";
+    return std::move(value_);
+  }
 
   template <typename U>
   friend class StatusOr;
@@ -125,6 +134,15 @@ inline const StatusOr<T>& StatusOr<T>::operator=(const StatusOr& other) {
   return *this;
 }
 
+template <typename T>
+inline const StatusOr<T>& StatusOr<T>::operator=(StatusOr&& other) {
+  status_ = other.status_;
+  if (status_.ok()) {
+    value_ = std::move(other.value_);
+  }
+  return *this;
+}
+
 template <typename T>
 template <typename U>
 inline const StatusOr<T>& StatusOr<T>::operator=(const StatusOr<U>& other) {
@@ -0,0 +1,66 @@
+#include "util/statusor.h"
+
+#include <gtest/gtest.h>
+#include <memory>
+#include <string>
+#include <utility>
+
+#include "util/testing.h"
+
+namespace util {
+namespace {
+
+using std::move;
+using std::string;
+using std::unique_ptr;
+
+
+StatusOr<unique_ptr<int>> MakeValue(int value) {
+  return unique_ptr<int>(new int(value));
+}
+
+
+TEST(StatusOrTest, MovesValueOutOfRvalue) {
+  const unique_ptr<int> value(MakeValue(42).ValueOrDie());
+  ASSERT_TRUE(value);
+  EXPECT_EQ(42, *value);
+}
+
+
+TEST(StatusOrTest, MoveAssignment) {
+  StatusOr<unique_ptr<int>> result;
+  EXPECT_FALSE(result.ok());
+
+  result = MakeValue(1);
+  ASSERT_TRUE(result.ok());
+  EXPECT_EQ(1, *result.ValueOrDie());
+
+  StatusOr<unique_ptr<int>> other(MakeValue(2));
+  result = move(other);
+  ASSERT_TRUE(result.ok());
+  EXPECT_EQ(2, *result.ValueOrDie());
+
+  result = StatusOr<unique_ptr<int>>(Status(error::NOT_FOUND, "gone"));
+  EXPECT_EQ(error::NOT_FOUND, result.status().CanonicalCode());
+}
+
+
+TEST(StatusOrTest, LvalueKeepsValue) {
+  StatusOr<string> result(string("value"));
+  const string copy(result.ValueOrDie());
+  EXPECT_EQ("value", copy);
+  EXPECT_EQ("value", result.ValueOrDie());
+
+  const string moved(move(result).ValueOrDie());
+  EXPECT_EQ("value", moved);
+}
+
+
+}  // namespace
+}  // namespace util
+
+
+int main(int argc, char** argv) {
+  cert_trans::test::InitTesting(argv[0], &argc, &argv, true);
+  return RUN_ALL_TESTS();
+}
@@ -1,26 +1,90 @@
+#include "config.h"
 #include "util/task.h"
 
 #include <glog/logging.h>
+#include <algorithm>
+#include <limits>
 
+#include "util/pool_allocator.h"
+
+using std::allocate_shared;
 using std::bind;
+using std::chrono::steady_clock;
 using std::function;
 using std::lock_guard;
-using std::make_shared;
 using std::mutex;
 using std::ostream;
-using std::placeholders::_1;
 using std::shared_ptr;
 using std::unique_lock;
 using std::vector;
 
 namespace util {
+namespace {
+
+
+// The current deadline is kept as a count of ticks, as __thread
+// needs a constant initialiser.
+#ifdef HAVE_THREAD_LOCAL
+thread_local steady_clock::rep current_deadline(
+    std::numeric_limits<steady_clock::rep>::max());
+#elif HAVE___THREAD
+__thread steady_clock::rep current_deadline(
+    std::numeric_limits<steady_clock::rep>::max());
+#else
+#error No suitable thread local storage available
+#endif
+
+
+bool Expired(const steady_clock::time_point& deadline) {
+  return deadline != steady_clock::time_point::max() &&
+         steady_clock::now() >= deadline;
+}
+
+
+}  // namespace
+
+
+steady_clock::time_point CurrentDeadline() {
+  return steady_clock::time_point(steady_clock::duration(current_deadline));
+}
+
+
+bool DeadlineExceeded() {
+  return Expired(CurrentDeadline());
+}
+
+
+ScopedDeadline::ScopedDeadline(const steady_clock::time_point& deadline)
+    : previous_(CurrentDeadline()) {
+  current_deadline = deadline.time_since_epoch().count();
+}
+
+
+ScopedDeadline::~ScopedDeadline() {
+  current_deadline = previous_.time_since_epoch().count();
+}
+
+
+function<void()> DeadlineClosure(const function<void()>& closure) {
+  const steady_clock::time_point deadline(CurrentDeadline());
+  if (deadline == steady_clock::time_point::max()) {
+    return closure;
+  }
+  return [deadline, closure]() {
+    ScopedDeadline scoped_deadline(deadline);
+    closure();
+  };
+}
 
 
 Task::Task(const function<void(Task*)>& done_callback, Executor* executor)
     : done_callback_(done_callback),
       executor_(CHECK_NOTNULL(executor)),
+      parent_(nullptr),
+      trace_context_(cert_trans::CurrentTraceContext()),
       state_(ACTIVE),
       cancelled_(false),
+      deadline_(CurrentDeadline()),
       holds_(0) {
 }
 
@@ -146,6 +210,23 @@ bool Task::CancelRequested() const {
 }
 
 
+steady_clock::time_point Task::deadline() const {
+  lock_guard<mutex> lock(lock_);
+  return deadline_;
+}
+
+
+void Task::SetDeadline(const steady_clock::time_point& deadline) {
+  lock_guard<mutex> lock(lock_);
+  deadline_ = std::min(deadline_, deadline);
+}
+
+
+bool Task::DeadlineExceeded() const {
+  return Expired(deadline());
+}
+
+
 void Task::WhenCancelled(const std::function<void()>& cancel_cb) {
   unique_lock<mutex> lock(lock_);
 
@@ -167,15 +248,22 @@ void Task::WhenCancelled(const std::function<void()>& cancel_cb) {
 
 Task* Task::AddChildWithExecutor(const function<void(Task*)>& done_callback,
                                  Executor* executor) {
-  const shared_ptr<Task> child_task(make_shared<Task>(
-      bind(&Task::RunChildDoneCallback, this, done_callback, _1),
-      CHECK_NOTNULL(executor)));
+  // The child task keeps |done_callback| as is, rather than wrapped
+  // in another function object, and comes from the per-thread pools,
+  // as this is done for every step of many operations.
+  const shared_ptr<Task> child_task(allocate_shared<Task>(
+      PoolAllocator<Task>(), done_callback, CHECK_NOTNULL(executor)));
+  child_task->parent_ = this;
   bool cancel;
 
   {
     lock_guard<mutex> lock(lock_);
     CHECK_NE(state_, DONE);
 
+    // Nothing else has the child task yet, so there is no need for
+    // its lock.
+    child_task->deadline_ = std::min(child_task->deadline_, deadline_);
+
     child_tasks_.emplace_back(child_task);
     ++holds_;
 
@@ -219,8 +307,10 @@ void Task::TryDoneTransition(unique_lock<mutex>* lock) {
   // executor is synchronous.
   lock->unlock();
 
-  // Once this is called, the task might get deleted.
-  executor_->Add(bind(&Task::RunCleanupAndDoneCallbacks, this));
+  // Once this is called, the task might get deleted. A lambda only
+  // capturing |this| fits in std::function without an allocation,
+  // unlike the equivalent std::bind().
+  executor_->Add([this]() { RunCleanupAndDoneCallbacks(); });
 }
 
 
@@ -248,13 +338,22 @@ void Task::RunCleanupAndDoneCallbacks() {
   }
 
   // Once this is called, the task might get deleted.
+  if (parent_) {
+    parent_->RunChildDoneCallback(this);
+    return;
+  }
+  cert_trans::ScopedTraceContext trace_context(trace_context_);
+  ScopedDeadline deadline(deadline_);
   done_callback_(this);
 }
 
 
-void Task::RunChildDoneCallback(const function<void(Task*)>& done_callback,
-                                Task* child_task) {
-  done_callback(child_task);
+void Task::RunChildDoneCallback(Task* child_task) {
+  {
+    cert_trans::ScopedTraceContext trace_context(child_task->trace_context_);
+    ScopedDeadline deadline(child_task->deadline_);
+    child_task->done_callback_(child_task);
+  }
 
   unique_lock<mutex> lock(lock_);
   vector<shared_ptr<Task>>::iterator it;
@@ -17,11 +17,13 @@
 // callback has started.
 //
 // Once util::Task::Return() is called, the done callback is run on
-// the executor.
+// the executor, in the trace context (see util/tracing.h) the task was
+// created in, and with its deadline (see below) as the current one.
 
 #ifndef CERT_TRANS_UTIL_TASK_H_
 #define CERT_TRANS_UTIL_TASK_H_
 
+#include <chrono>
 #include <functional>
 #include <memory>
 #include <mutex>
@@ -29,9 +31,52 @@
 
 #include "util/executor.h"
 #include "util/status.h"
+#include "util/tracing.h"
 
 namespace util {
 
+
+// Work can have a deadline, past which it is better dropped than
+// started, as whoever wanted it has given up on it (a client that
+// timed out, for example). Each thread has a current deadline, which
+// tasks created on it take, and which follows work to other threads
+// through util::Task callbacks and ThreadPool closures. Elsewhere,
+// capture CurrentDeadline() and use a ScopedDeadline.
+//
+// Deadlines are not enforced: the implementation of an operation
+// checks them before starting on something expensive (a request to
+// another server, for example), and returns DEADLINE_EXCEEDED. As
+// they are inherited, long-lived tasks (such as watches) should not
+// be started while a deadline is current.
+
+// Returns the current thread's deadline, which is
+// steady_clock::time_point::max() if it has none.
+std::chrono::steady_clock::time_point CurrentDeadline();
+
+// Returns true if the current thread's deadline has passed.
+bool DeadlineExceeded();
+
+
+// Makes |deadline| the current thread's deadline for its lifetime.
+class ScopedDeadline {
+ public:
+  explicit ScopedDeadline(
+      const std::chrono::steady_clock::time_point& deadline);
+  ~ScopedDeadline();
+
+  ScopedDeadline(const ScopedDeadline&) = delete;
+  ScopedDeadline& operator=(const ScopedDeadline&) = delete;
+
+ private:
+  const std::chrono::steady_clock::time_point previous_;
+};
+
+
+// Returns a closure that runs |closure| with the current thread's
+// deadline, for handing it to another thread.
+std::function<void()> DeadlineClosure(const std::function<void()>& closure);
+
+
 // The task can be in one of three states: ACTIVE (the initial state),
 // PREPARED (the task has a status), or DONE (the done callback can
 // run).
@@ -101,6 +146,18 @@ class Task {
   // Returns true once Cancel() is called.
   bool CancelRequested() const;
 
+  // Returns the deadline of the task, which is the one current when it
+  // was created, or that of its parent for a child task, whichever is
+  // earlier.
+  std::chrono::steady_clock::time_point deadline() const;
+
+  // Brings the deadline of the task forward to |deadline|, if that is
+  // earlier. Child tasks added before this keep their deadline.
+  void SetDeadline(const std::chrono::steady_clock::time_point& deadline);
+
+  // Returns true once the deadline of the task has passed.
+  bool DeadlineExceeded() const;
+
   // The "cancel_cb" callback will be called the first time Cancel()
   // is called. If Cancel() is never called, then it will just be
   // destroyed without being called. So this function could be called
@@ -166,16 +223,21 @@ class Task {
   void TryDoneTransition(std::unique_lock<std::mutex>* lock);
   void RunCancelCallback(const std::function<void()>& cb);
   void RunCleanupAndDoneCallbacks();
-  void RunChildDoneCallback(const std::function<void(Task*)>& done_callback,
-                            Task* child_task);
+  void RunChildDoneCallback(Task* child_task);
 
   const std::function<void(Task*)> done_callback_;
   Executor* const executor_;
+  // Set for child tasks, whose done callback is run through their
+  // parent. Not protected by lock_, as it is set before the child task
+  // is handed out.
+  Task* parent_;
+  const cert_trans::TraceContext trace_context_;
 
   mutable std::mutex lock_;
   State state_;
   Status status_;  // not protected by lock_
   bool cancelled_;
+  std::chrono::steady_clock::time_point deadline_;
   int holds_;
   // References to child tasks are kept as shared pointers to avoid
   // some races.
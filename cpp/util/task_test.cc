@@ -17,7 +17,10 @@ using cert_trans::ThreadPool;
 using std::atomic_fetch_add;
 using std::atomic_int;
 using std::bind;
+using std::chrono::hours;
 using std::chrono::milliseconds;
+using std::chrono::seconds;
+using std::chrono::steady_clock;
 using std::placeholders::_1;
 using std::this_thread::sleep_for;
 using std::unique_ptr;
@@ -456,6 +459,92 @@ TYPED_TEST(TaskTest, ChildReturn) {
 }
 
 
+TEST(TaskDeadlineTest, NoDeadline) {
+  InlineExecutor executor;
+  util::Task task(DoNothing, &executor);
+
+  EXPECT_EQ(steady_clock::time_point::max(), util::CurrentDeadline());
+  EXPECT_FALSE(util::DeadlineExceeded());
+  EXPECT_EQ(steady_clock::time_point::max(), task.deadline());
+  EXPECT_FALSE(task.DeadlineExceeded());
+
+  task.Return();
+}
+
+
+TEST(TaskDeadlineTest, Inherited) {
+  InlineExecutor executor;
+  const steady_clock::time_point deadline(steady_clock::now() + hours(1));
+  unique_ptr<util::Task> task;
+  util::Task* child_task;
+  {
+    util::ScopedDeadline scoped_deadline(deadline);
+    EXPECT_EQ(deadline, util::CurrentDeadline());
+    task.reset(new util::Task(DoNothing, &executor));
+  }
+  EXPECT_EQ(steady_clock::time_point::max(), util::CurrentDeadline());
+  EXPECT_EQ(deadline, task->deadline());
+
+  child_task = task->AddChild(DoNothing);
+  EXPECT_EQ(deadline, child_task->deadline());
+  EXPECT_FALSE(child_task->DeadlineExceeded());
+
+  // Only an earlier deadline is taken.
+  child_task->SetDeadline(deadline + hours(1));
+  EXPECT_EQ(deadline, child_task->deadline());
+  child_task->SetDeadline(steady_clock::now() - seconds(1));
+  EXPECT_TRUE(child_task->DeadlineExceeded());
+  EXPECT_FALSE(task->DeadlineExceeded());
+
+  child_task->Return();
+  task->Return();
+}
+
+
+TEST(TaskDeadlineTest, Exceeded) {
+  InlineExecutor executor;
+  util::ScopedDeadline scoped_deadline(steady_clock::now() - seconds(1));
+  EXPECT_TRUE(util::DeadlineExceeded());
+
+  util::Task task(DoNothing, &executor);
+  EXPECT_TRUE(task.DeadlineExceeded());
+  task.Return();
+}
+
+
+TEST(TaskDeadlineTest, FollowsCallbacks) {
+  // Declared first, so that the pool is done with it when it goes.
+  unique_ptr<util::Task> task;
+  ThreadPool pool;
+  const steady_clock::time_point deadline(steady_clock::now() + hours(1));
+  steady_clock::time_point closure_deadline;
+  steady_clock::time_point done_deadline;
+  Notification closure_done;
+  Notification task_done;
+  {
+    util::ScopedDeadline scoped_deadline(deadline);
+    pool.Add([&closure_deadline, &closure_done]() {
+      closure_deadline = util::CurrentDeadline();
+      closure_done.Notify();
+    });
+    task.reset(new util::Task(
+        [&done_deadline, &task_done](util::Task*) {
+          done_deadline = util::CurrentDeadline();
+          task_done.Notify();
+        },
+        &pool));
+  }
+
+  task->Return();
+  ASSERT_TRUE(closure_done.WaitForNotificationWithTimeout(
+      milliseconds(FLAGS_task_test_jiffy_ms)));
+  ASSERT_TRUE(task_done.WaitForNotificationWithTimeout(
+      milliseconds(FLAGS_task_test_jiffy_ms)));
+  EXPECT_EQ(deadline, closure_deadline);
+  EXPECT_EQ(deadline, done_deadline);
+}
+
+
 }  // namespace
 
 
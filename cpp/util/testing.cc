@@ -1,9 +1,13 @@
 #include "util/testing.h"
 
+#include <arpa/inet.h>
 #include <event2/thread.h>
 #include <evhtp.h>
 #include <glog/logging.h>
 #include <gtest/gtest.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <unistd.h>
 
 #include "config.h"
 
@@ -30,5 +34,33 @@ void InitTesting(const char* name, int* argc, char*** argv,
   SSL_library_init();
 }
 
+
+std::string HttpGet(uint16_t port, const std::string& path,
+                    const std::string& headers) {
+  const int fd(socket(AF_INET, SOCK_STREAM, 0));
+  PCHECK(fd >= 0);
+  sockaddr_in addr;
+  memset(&addr, 0, sizeof(addr));
+  addr.sin_family = AF_INET;
+  addr.sin_port = htons(port);
+  addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  PCHECK(connect(fd, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) == 0);
+
+  const std::string request("GET " + path + " HTTP/1.0\r\n" + headers +
+                            "\r\n");
+  PCHECK(write(fd, request.data(), request.size()) ==
+         static_cast<ssize_t>(request.size()));
+  std::string response;
+  char buf[1024];
+  ssize_t got;
+  while ((got = read(fd, buf, sizeof(buf))) > 0) {
+    response.append(buf, got);
+  }
+  PCHECK(got == 0);
+  close(fd);
+
+  return response;
+}
+
 }  // namespace test
 }  // namespace cert_trans
@@ -2,6 +2,8 @@
 #define CERT_TRANS_UTIL_TESTING_H_
 
 #include <gflags/gflags.h>
+#include <stdint.h>
+#include <string>
 
 DECLARE_string(test_srcdir);
 
@@ -10,6 +12,13 @@ namespace test {
 
 void InitTesting(const char* name, int* argc, char*** argv, bool remove_flags);
 
+// Makes an HTTP/1.0 GET request for |path| to |port| on the loopback
+// interface, on a new connection, and returns the whole response,
+// headers included. |headers| are added to the request as is, so each
+// of them must end with "\r\n".
+std::string HttpGet(uint16_t port, const std::string& path,
+                    const std::string& headers = "");
+
 }  // namespace test
 }  // namespace cert_trans
 
@@ -0,0 +1,148 @@
+#include "util/thread_placement.h"
+
+#include <glog/logging.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdlib.h>
+#include <string.h>
+#include <algorithm>
+#include <fstream>
+#include <sstream>
+
+using std::ifstream;
+using std::string;
+using std::vector;
+using util::Status;
+using util::StatusOr;
+
+namespace cert_trans {
+
+namespace {
+
+
+const char kNodeDir[] = "/sys/devices/system/node/node";
+
+
+// Parses a non-negative number that makes up all of |str|.
+bool ParseNumber(const string& str, int* number) {
+  if (str.empty() || str.find_first_not_of("0123456789") != string::npos) {
+    return false;
+  }
+  *number = atoi(str.c_str());
+  return true;
+}
+
+
+StatusOr<vector<int>> NodeCpus(const string& node) {
+  int number;
+  if (!ParseNumber(node, &number)) {
+    return Status(util::error::INVALID_ARGUMENT, "invalid NUMA node: " + node);
+  }
+  const string path(kNodeDir + node + "/cpulist");
+  ifstream file(path);
+  string list;
+  if (!std::getline(file, list)) {
+    return Status(util::error::NOT_FOUND, "cannot read " + path);
+  }
+  return ThreadPlacement::ParseCpuList(list);
+}
+
+
+}  // namespace
+
+
+ThreadPlacement::ThreadPlacement() : policy_(Policy::NONE) {
+}
+
+
+ThreadPlacement::ThreadPlacement(Policy policy, const vector<int>& cpus)
+    : policy_(policy), cpus_(cpus) {
+  CHECK(policy_ == Policy::NONE || !cpus_.empty());
+}
+
+
+// static
+StatusOr<ThreadPlacement> ThreadPlacement::Parse(const string& spec) {
+  if (spec.empty() || spec == "none") {
+    return ThreadPlacement();
+  }
+
+  const size_t colon(spec.find(':'));
+  if (colon == string::npos) {
+    return Status(util::error::INVALID_ARGUMENT,
+                  "thread placement without a policy: " + spec);
+  }
+  const string policy_name(spec.substr(0, colon));
+  Policy policy;
+  if (policy_name == "shared") {
+    policy = Policy::SHARED;
+  } else if (policy_name == "spread") {
+    policy = Policy::SPREAD;
+  } else {
+    return Status(util::error::INVALID_ARGUMENT,
+                  "unknown thread placement policy: " + policy_name);
+  }
+
+  const string cpus_spec(spec.substr(colon + 1));
+  const StatusOr<vector<int>> cpus(
+      cpus_spec.compare(0, 4, "node") == 0 ? NodeCpus(cpus_spec.substr(4))
+                                            : ParseCpuList(cpus_spec));
+  if (!cpus.ok()) {
+    return cpus.status();
+  }
+  return ThreadPlacement(policy, cpus.ValueOrDie());
+}
+
+
+// static
+StatusOr<vector<int>> ThreadPlacement::ParseCpuList(const string& list) {
+  vector<int> cpus;
+  std::istringstream items(list);
+  string item;
+  while (std::getline(items, item, ',')) {
+    const size_t dash(item.find('-'));
+    int first, last;
+    if (!ParseNumber(item.substr(0, dash), &first) ||
+        !ParseNumber(dash == string::npos ? item.substr(0, dash)
+                                          : item.substr(dash + 1),
+                     &last) ||
+        last < first || last >= CPU_SETSIZE) {
+      return Status(util::error::INVALID_ARGUMENT,
+                    "invalid CPU list: " + list);
+    }
+    for (int cpu = first; cpu <= last; ++cpu) {
+      cpus.push_back(cpu);
+    }
+  }
+  if (cpus.empty()) {
+    return Status(util::error::INVALID_ARGUMENT, "empty CPU list");
+  }
+  std::sort(cpus.begin(), cpus.end());
+  cpus.erase(std::unique(cpus.begin(), cpus.end()), cpus.end());
+  return cpus;
+}
+
+
+void ThreadPlacement::Apply(size_t index) const {
+  if (policy_ == Policy::NONE) {
+    return;
+  }
+
+  cpu_set_t set;
+  CPU_ZERO(&set);
+  if (policy_ == Policy::SPREAD) {
+    CPU_SET(cpus_[index % cpus_.size()], &set);
+  } else {
+    for (const int cpu : cpus_) {
+      CPU_SET(cpu, &set);
+    }
+  }
+  const int err(pthread_setaffinity_np(pthread_self(), sizeof(set), &set));
+  if (err != 0) {
+    LOG(WARNING) << "Failed to set the CPU affinity of a thread: "
+                 << strerror(err);
+  }
+}
+
+
+}  // namespace cert_trans
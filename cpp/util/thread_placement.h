@@ -0,0 +1,69 @@
+#ifndef CERT_TRANS_UTIL_THREAD_PLACEMENT_H_
+#define CERT_TRANS_UTIL_THREAD_PLACEMENT_H_
+
+#include <stddef.h>
+#include <string>
+#include <vector>
+
+#include "util/statusor.h"
+
+namespace cert_trans {
+
+
+// Where the threads of a group (the workers of a ThreadPool, an
+// EventPumpThread...) may run.
+//
+// Placements are written as "<policy>:<cpus>", where <cpus> is a list
+// of CPUs and ranges of CPUs such as "0-7,16-23", or "node<N>" for the
+// CPUs of NUMA node N, and <policy> is either:
+//   - "shared", to let every thread of the group run on any of the
+//     CPUs, or
+//   - "spread", to pin the threads of the group to one of the CPUs
+//     each, in turn.
+// "none" (or an empty string) leaves the threads where the kernel puts
+// them.
+//
+// On Linux, memory is allocated on the NUMA node of the thread that
+// first touches it, so placing the threads that build large structures
+// also places those structures.
+class ThreadPlacement {
+ public:
+  enum class Policy {
+    NONE,
+    SHARED,
+    SPREAD,
+  };
+
+  // Leaves the threads where the kernel puts them.
+  ThreadPlacement();
+  ThreadPlacement(Policy policy, const std::vector<int>& cpus);
+
+  static util::StatusOr<ThreadPlacement> Parse(const std::string& spec);
+
+  // Parses a list of CPUs such as "0-3,8", in increasing order and
+  // without duplicates.
+  static util::StatusOr<std::vector<int>> ParseCpuList(
+      const std::string& list);
+
+  // Places the calling thread, which is the |index|th of its group.
+  // Failures are logged, but otherwise ignored, as they only cost
+  // performance.
+  void Apply(size_t index) const;
+
+  Policy policy() const {
+    return policy_;
+  }
+
+  const std::vector<int>& cpus() const {
+    return cpus_;
+  }
+
+ private:
+  Policy policy_;
+  std::vector<int> cpus_;
+};
+
+
+}  // namespace cert_trans
+
+#endif  // CERT_TRANS_UTIL_THREAD_PLACEMENT_H_
@@ -0,0 +1,68 @@
+#include "util/thread_placement.h"
+
+#include <gtest/gtest.h>
+#include <pthread.h>
+#include <sched.h>
+#include <thread>
+
+#include "util/testing.h"
+
+namespace cert_trans {
+namespace {
+
+using std::thread;
+using std::vector;
+
+
+TEST(ThreadPlacementTest, ParseCpuList) {
+  const util::StatusOr<vector<int>> cpus(
+      ThreadPlacement::ParseCpuList("4,0-2,2-3"));
+  ASSERT_TRUE(cpus.ok());
+  EXPECT_EQ(vector<int>({0, 1, 2, 3, 4}), cpus.ValueOrDie());
+
+  EXPECT_FALSE(ThreadPlacement::ParseCpuList("").ok());
+  EXPECT_FALSE(ThreadPlacement::ParseCpuList("3-1").ok());
+  EXPECT_FALSE(ThreadPlacement::ParseCpuList("1,,2").ok());
+  EXPECT_FALSE(ThreadPlacement::ParseCpuList("-1").ok());
+  EXPECT_FALSE(ThreadPlacement::ParseCpuList("a").ok());
+}
+
+
+TEST(ThreadPlacementTest, Parse) {
+  util::StatusOr<ThreadPlacement> placement(ThreadPlacement::Parse(""));
+  ASSERT_TRUE(placement.ok());
+  EXPECT_EQ(ThreadPlacement::Policy::NONE, placement.ValueOrDie().policy());
+
+  placement = ThreadPlacement::Parse("spread:0-1");
+  ASSERT_TRUE(placement.ok());
+  EXPECT_EQ(ThreadPlacement::Policy::SPREAD,
+            placement.ValueOrDie().policy());
+  EXPECT_EQ(vector<int>({0, 1}), placement.ValueOrDie().cpus());
+
+  EXPECT_FALSE(ThreadPlacement::Parse("0-1").ok());
+  EXPECT_FALSE(ThreadPlacement::Parse("packed:0-1").ok());
+  EXPECT_FALSE(ThreadPlacement::Parse("shared:nodeX").ok());
+}
+
+
+TEST(ThreadPlacementTest, Apply) {
+  const ThreadPlacement placement(ThreadPlacement::Policy::SPREAD, {0});
+  thread pinned([&placement]() {
+    placement.Apply(3);
+    cpu_set_t set;
+    ASSERT_EQ(0, pthread_getaffinity_np(pthread_self(), sizeof(set), &set));
+    EXPECT_EQ(1, CPU_COUNT(&set));
+    EXPECT_TRUE(CPU_ISSET(0, &set));
+  });
+  pinned.join();
+}
+
+
+}  // namespace
+}  // namespace cert_trans
+
+
+int main(int argc, char** argv) {
+  cert_trans::test::InitTesting(argv[0], &argc, &argv, true);
+  return RUN_ALL_TESTS();
+}
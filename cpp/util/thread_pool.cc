@@ -1,37 +1,58 @@
+#include "config.h"
 #include "util/thread_pool.h"
 #include "util/task.h"
 
 #include <glog/logging.h>
+#include <atomic>
 #include <condition_variable>
+#include <deque>
 #include <mutex>
 #include <queue>
 #include <thread>
 #include <vector>
 
+#include "util/tracing.h"
+
+using std::atomic;
 using std::chrono::duration;
 using std::chrono::duration_cast;
 using std::chrono::seconds;
 using std::chrono::steady_clock;
 using std::condition_variable;
+using std::deque;
 using std::function;
 using std::get;
 using std::lock_guard;
+using std::make_tuple;
 using std::mutex;
 using std::priority_queue;
 using std::thread;
 using std::tuple;
 using std::unique_lock;
+using std::unique_ptr;
 using std::vector;
 
 namespace cert_trans {
 namespace {
 
-typedef tuple<steady_clock::time_point, function<void()>, util::Task*>
-    QueueEntry;
+typedef tuple<steady_clock::time_point, util::Task*> DelayedEntry;
+
+
+// The pool, and the index of the worker, of the current thread, if it
+// is one of a ThreadPool.
+#ifdef HAVE_THREAD_LOCAL
+thread_local const void* current_pool = nullptr;
+thread_local size_t current_worker = 0;
+#elif HAVE___THREAD
+__thread const void* current_pool = nullptr;
+__thread size_t current_worker = 0;
+#else
+#error No suitable thread local storage available
+#endif
 
 
-struct QueueOrdering {
-  bool operator()(const QueueEntry& lhs, const QueueEntry& rhs) const {
+struct DelayedOrdering {
+  bool operator()(const DelayedEntry& lhs, const DelayedEntry& rhs) const {
     return get<0>(lhs) > get<0>(rhs);
   }
 };
@@ -40,112 +61,241 @@ struct QueueOrdering {
 }  // namespace
 
 
+// Each worker thread has its own queue, with its own lock, so that
+// adding and taking closures does not make every thread in the pool
+// contend on the same lock. Closures added from a worker go on its own
+// queue, others are spread over the queues in turn, and a worker that
+// runs out of closures takes them from the queues of the others.
+//
+// Delayed tasks are kept apart, by a thread that only adds them to the
+// queues once they are due.
 class ThreadPool::Impl {
  public:
+  Impl(size_t num_threads, const ThreadPlacement& placement);
   ~Impl();
 
-  void Worker();
+  void Add(const function<void()>& closure);
+  void Delay(const steady_clock::time_point& when, util::Task* task);
+
+  int64_t NumQueued() const {
+    return queued_;
+  }
+
+ private:
+  struct Queue {
+    mutex lock_;
+    deque<function<void()>> queue_;
+  };
+
+  void Worker(size_t index);
+  // Takes the next closure, from the queue of worker |index| if it has
+  // any, or else from one of the others. Returns false if there are
+  // none at all.
+  bool Take(size_t index, function<void()>* closure);
+  void Timer();
+
+  const ThreadPlacement placement_;
+  // One for each worker thread.
+  vector<unique_ptr<Queue>> queues_;
+  // Where the next closure that is not added by a worker goes.
+  atomic<size_t> next_queue_;
+  // The number of closures in all the queues.
+  atomic<int64_t> queued_;
+
+  // Workers with nothing to do wait on this.
+  mutex idle_lock_;
+  condition_variable idle_cond_var_;
+  atomic<int> idle_;
+  bool exiting_;
+
+  mutex delayed_lock_;
+  condition_variable delayed_cond_var_;
+  priority_queue<DelayedEntry, vector<DelayedEntry>, DelayedOrdering>
+      delayed_;
+  bool timer_exiting_;
 
   // TODO(pphaneuf): I'd like this to be const, but it required
   // jumping through a few more hoops, keeping it simple for now.
   vector<thread> threads_;
-
-  mutex queue_lock_;
-  condition_variable queue_cond_var_;
-  priority_queue<QueueEntry, vector<QueueEntry>, QueueOrdering> queue_;
+  thread timer_thread_;
 };
 
 
+ThreadPool::Impl::Impl(size_t num_threads,
+                       const ThreadPlacement& placement)
+    : placement_(placement),
+      next_queue_(0),
+      queued_(0),
+      idle_(0),
+      exiting_(false),
+      timer_exiting_(false) {
+  CHECK_GT(num_threads, static_cast<size_t>(0));
+  for (size_t i = 0; i < num_threads; ++i) {
+    queues_.emplace_back(new Queue);
+  }
+  for (size_t i = 0; i < num_threads; ++i) {
+    threads_.emplace_back(&Impl::Worker, this, i);
+  }
+  timer_thread_ = thread(&Impl::Timer, this);
+}
+
+
 ThreadPool::Impl::~Impl() {
-  // Start by sending an empty closure to every thread (and notify
-  // them), to have them exit cleanly.
+  // Stop the timer first, so that it does not add anything once the
+  // workers are gone.
   {
-    lock_guard<mutex> lock(queue_lock_);
-    for (int i = threads_.size(); i > 0; --i)
-      queue_.emplace(
-          make_tuple(steady_clock::time_point(), function<void()>(), nullptr));
+    lock_guard<mutex> lock(delayed_lock_);
+    timer_exiting_ = true;
   }
-  // Notify all the threads *after* adding all the empty closures, to
-  // avoid any races.
-  queue_cond_var_.notify_all();
+  delayed_cond_var_.notify_all();
+  timer_thread_.join();
 
-  // Wait for the threads to exit.
+  // Have the workers exit cleanly, once the queues are empty.
+  {
+    lock_guard<mutex> lock(idle_lock_);
+    exiting_ = true;
+  }
+  idle_cond_var_.notify_all();
   for (auto& thread : threads_) {
     thread.join();
   }
 
-  // Workers should've drained everything from the queue.
-  CHECK(queue_.empty());
+  // Cancel the delayed tasks that are left. This is outside of the lock
+  // to avoid deadlocking anyone who tries to Add() more stuff when
+  // they're cancelled. Anyone who does that is going to cause a CHECK
+  // fail below anyway, but at least they'll know about it that way.
+  VLOG(1) << "Cancelling delayed tasks...";
+  vector<util::Task*> to_be_cancelled;
+  {
+    lock_guard<mutex> lock(delayed_lock_);
+    while (!delayed_.empty()) {
+      to_be_cancelled.push_back(get<1>(delayed_.top()));
+      delayed_.pop();
+    }
+  }
+  for (const auto& t : to_be_cancelled) {
+    t->Return(util::Status::CANCELLED);
+  }
+  VLOG(1) << "Cancelled " << to_be_cancelled.size() << " delayed tasks.";
+
+  // Workers should've drained everything from the queues.
+  for (const auto& queue : queues_) {
+    lock_guard<mutex> lock(queue->lock_);
+    CHECK(queue->queue_.empty());
+  }
+}
+
+
+void ThreadPool::Impl::Add(const function<void()>& closure) {
+  const size_t index(current_pool == this
+                         ? current_worker
+                         : next_queue_.fetch_add(1) % queues_.size());
+  {
+    Queue* const queue(queues_[index].get());
+    lock_guard<mutex> lock(queue->lock_);
+    queue->queue_.push_back(closure);
+  }
+  ++queued_;
+
+  // This is seen by a worker about to wait, unless it already counts
+  // itself as idle, in which case it is woken up.
+  if (idle_ > 0) {
+    lock_guard<mutex> lock(idle_lock_);
+    idle_cond_var_.notify_one();
+  }
+}
+
+
+void ThreadPool::Impl::Delay(const steady_clock::time_point& when,
+                             util::Task* task) {
+  {
+    lock_guard<mutex> lock(delayed_lock_);
+    delayed_.emplace(make_tuple(when, task));
+  }
+  delayed_cond_var_.notify_one();
 }
 
 
-void ThreadPool::Impl::Worker() {
+void ThreadPool::Impl::Worker(size_t index) {
+  current_pool = this;
+  current_worker = index;
+  placement_.Apply(index);
+
   while (true) {
-    QueueEntry entry;
-
-    {
-      unique_lock<mutex> lock(queue_lock_);
-      while (queue_.empty() || get<0>(queue_.top()) > steady_clock::now()) {
-        if (queue_.empty()) {
-          // If there's nothing to do, wait until there is.
-          queue_cond_var_.wait(lock);
-        } else {
-          // Otherwise, wait until the next thing we currently know about is
-          // ready.
-          const steady_clock::duration duration(get<0>(queue_.top()) -
-                                                steady_clock::now());
-          queue_cond_var_.wait_for(lock, duration);
-        }
-      }
+    function<void()> closure;
+    if (Take(index, &closure)) {
+      closure();
+      continue;
+    }
 
-      entry = queue_.top();
-      queue_.pop();
-
-      // If we received an empty entry, exit cleanly.
-      if (!get<1>(entry)) {
-        // Anything left in the queue must be either other exit sentinels, or
-        // future (delayed) tasks, so we'll cancel anything we find, up until
-        // either the next exit sentinel, or the end of the queue.
-        VLOG(1) << "Cancelling delayed tasks...";
-        vector<util::Task*> to_be_cancelled;
-        while (!queue_.empty() && get<2>(queue_.top())) {
-          to_be_cancelled.push_back(CHECK_NOTNULL(get<2>(queue_.top())));
-          queue_.pop();
-        }
-
-        // Cancel the callbacks below outside of the lock to avoid deadlocking
-        // anyone who tries to Add() more stuff when they're cancelled.
-        // Anyone who does that is going to cause a CHECK fail in the d'tor of
-        // the pool anyway, but at least they'll know about it that way.
-        lock.unlock();
-
-        for (const auto& t : to_be_cancelled) {
-          t->Return(util::Status::CANCELLED);
-        }
-
-        VLOG(1) << "Cancelled " << to_be_cancelled.size() << " delayed tasks.";
-        return;
-      }
+    unique_lock<mutex> lock(idle_lock_);
+    if (exiting_) {
+      return;
     }
+    ++idle_;
+    idle_cond_var_.wait(lock, [this]() { return queued_ > 0 || exiting_; });
+    --idle_;
+  }
+}
+
 
-    // Make sure not to hold the lock while calling the closure.
-    get<1>(entry)();
+bool ThreadPool::Impl::Take(size_t index, function<void()>* closure) {
+  for (size_t i = 0; i < queues_.size(); ++i) {
+    Queue* const queue(queues_[(index + i) % queues_.size()].get());
+    lock_guard<mutex> lock(queue->lock_);
+    if (!queue->queue_.empty()) {
+      closure->swap(queue->queue_.front());
+      queue->queue_.pop_front();
+      --queued_;
+      return true;
+    }
   }
+
+  return false;
+}
+
+
+void ThreadPool::Impl::Timer() {
+  unique_lock<mutex> lock(delayed_lock_);
+  while (!timer_exiting_) {
+    if (delayed_.empty()) {
+      // If there's nothing to do, wait until there is.
+      delayed_cond_var_.wait(lock);
+    } else if (get<0>(delayed_.top()) > steady_clock::now()) {
+      // Otherwise, wait until the next thing we currently know about is
+      // ready.
+      delayed_cond_var_.wait_until(lock, get<0>(delayed_.top()));
+    } else {
+      util::Task* const task(get<1>(delayed_.top()));
+      delayed_.pop();
+      lock.unlock();
+      Add([task]() { task->Return(); });
+      lock.lock();
+    }
+  }
+}
+
+
+ThreadPool::ThreadPool() : ThreadPool(ThreadPlacement()) {
 }
 
 
-ThreadPool::ThreadPool()
+ThreadPool::ThreadPool(const ThreadPlacement& placement)
     : ThreadPool(thread::hardware_concurrency() > 0
                      ? thread::hardware_concurrency()
-                     : 1) {
+                     : 1,
+                 placement) {
 }
 
 
-ThreadPool::ThreadPool(size_t num_threads) : impl_(new Impl) {
-  CHECK_GT(num_threads, static_cast<size_t>(0));
+ThreadPool::ThreadPool(size_t num_threads)
+    : ThreadPool(num_threads, ThreadPlacement()) {
+}
+
+
+ThreadPool::ThreadPool(size_t num_threads, const ThreadPlacement& placement)
+    : impl_(new Impl(num_threads, placement)) {
   LOG(INFO) << "ThreadPool starting with " << num_threads << " threads";
-  for (int i = 0; i < static_cast<int64_t>(num_threads); ++i)
-    impl_->threads_.emplace_back(thread(&Impl::Worker, impl_.get()));
 }
 
 
@@ -156,29 +306,47 @@ ThreadPool::~ThreadPool() {
 
 
 void ThreadPool::Add(const function<void()>& closure) {
-  // Empty closures signal a thread to exit, don't allow that (also,
-  // it doesn't make sense).
+  // Empty closures don't make sense.
   if (!closure) {
     return;
   }
 
-  {
-    lock_guard<mutex> lock(impl_->queue_lock_);
-    impl_->queue_.emplace(make_tuple(steady_clock::now(), closure, nullptr));
-  }
-  impl_->queue_cond_var_.notify_one();
+  // Keeps any sampled trace, and the deadline, going on the pool.
+  impl_->Add(TraceClosure(util::DeadlineClosure(closure)));
 }
 
 
 void ThreadPool::Delay(const duration<double>& delay, util::Task* task) {
   CHECK_NOTNULL(task);
-  {
-    lock_guard<mutex> lock(impl_->queue_lock_);
-    impl_->queue_.emplace(make_tuple(
-        steady_clock::now() + duration_cast<std::chrono::microseconds>(delay),
-        [task]() { task->Return(); }, task));
+  impl_->Delay(
+      steady_clock::now() + duration_cast<std::chrono::microseconds>(delay),
+      task);
+}
+
+
+int64_t ThreadPool::NumQueued() const {
+  return impl_->NumQueued();
+}
+
+
+void RunAll(ThreadPool* pool, size_t count,
+            const function<void(size_t)>& task) {
+  mutex lock;
+  condition_variable done;
+  size_t remaining(count);
+  for (size_t i(0); i < count; ++i) {
+    pool->Add([&task, &lock, &done, &remaining, i]() {
+      task(i);
+
+      lock_guard<mutex> guard(lock);
+      if (--remaining == 0) {
+        done.notify_one();
+      }
+    });
   }
-  impl_->queue_cond_var_.notify_one();
+
+  unique_lock<mutex> guard(lock);
+  done.wait(guard, [&remaining]() { return remaining == 0; });
 }
 
 
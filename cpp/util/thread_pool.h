@@ -1,12 +1,14 @@
 #ifndef CERT_TRANS_UTIL_THREAD_POOL_H_
 #define CERT_TRANS_UTIL_THREAD_POOL_H_
 
+#include <stdint.h>
 #include <chrono>
 #include <functional>
 #include <map>
 #include <memory>
 
 #include "util/executor.h"
+#include "util/thread_placement.h"
 
 namespace cert_trans {
 
@@ -18,9 +20,16 @@ class ThreadPool : public util::Executor {
   // Creates the threads.
   ThreadPool();
 
+  // Creates the threads, one per core, placing worker i as the ith
+  // of |placement|.
+  explicit ThreadPool(const ThreadPlacement& placement);
+
   // Creates the threads.
   ThreadPool(size_t num_threads);
 
+  // Creates the threads, placing worker i as the ith of |placement|.
+  ThreadPool(size_t num_threads, const ThreadPlacement& placement);
+
   // The destructor will wait for any outstanding closures to finish.
   ~ThreadPool();
 
@@ -28,18 +37,31 @@ class ThreadPool : public util::Executor {
   ThreadPool& operator=(const ThreadPool&) = delete;
 
   // Arranges for "closure" to be called in the thread pool. The
-  // function must not be empty.
+  // function must not be empty. It runs with the trace context and
+  // deadline (see util/task.h) current when it was added, and is run
+  // even if that deadline passes while it is queued, so closures that
+  // can be dropped should check util::DeadlineExceeded() first.
   void Add(const std::function<void()>& closure) override;
 
   void Delay(const std::chrono::duration<double>& delay,
              util::Task* task) override;
 
+  // Number of closures waiting for a thread, not counting delayed
+  // tasks that are not due yet.
+  int64_t NumQueued() const;
+
  private:
   class Impl;
   const std::unique_ptr<Impl> impl_;
 };
 
 
+// Calls |task| with each of [0, count) on |pool|, and waits for all of
+// them to be done. Must not be called from |pool|.
+void RunAll(ThreadPool* pool, size_t count,
+            const std::function<void(size_t)>& task);
+
+
 }  // namespace cert_trans
 
 #endif  // CERT_TRANS_UTIL_THREAD_POOL_H_
@@ -4,6 +4,8 @@
 #include <gtest/gtest.h>
 #include <atomic>
 #include <memory>
+#include <thread>
+#include <vector>
 
 #include "base/notification.h"
 #include "util/sync_task.h"
@@ -13,7 +15,9 @@ namespace cert_trans {
 
 using std::chrono::milliseconds;
 using std::chrono::system_clock;
+using std::thread;
 using std::unique_ptr;
+using std::vector;
 using util::SyncTask;
 
 class ThreadPoolTest : public ::testing::Test {
@@ -89,6 +93,64 @@ TEST_F(ThreadPoolTest, CancelsDelayTasks) {
 }
 
 
+TEST_F(ThreadPoolTest, RunsClosuresAddedFromAnywhere) {
+  const int kAdders(8);
+  const int kClosuresPerAdder(2000);
+  std::atomic<int> run(0);
+  {
+    ThreadPool pool(4);
+    vector<thread> adders;
+    for (int i = 0; i < kAdders; ++i) {
+      adders.emplace_back([&pool, &run]() {
+        for (int j = 0; j < kClosuresPerAdder; ++j) {
+          // Every other closure adds another one, from a worker thread.
+          pool.Add([&pool, &run, j]() {
+            ++run;
+            if (j % 2 == 0) {
+              pool.Add([&run]() { ++run; });
+            }
+          });
+        }
+      });
+    }
+    for (auto& adder : adders) {
+      adder.join();
+    }
+    // The destructor waits for everything queued to have run.
+  }
+
+  EXPECT_EQ(kAdders * kClosuresPerAdder * 3 / 2, run);
+}
+
+
+TEST_F(ThreadPoolTest, IdleWorkersTakeOverQueuedClosures) {
+  ThreadPool pool(2);
+  Notification blocker_started;
+  Notification release_blocker;
+  Notification others_done;
+  std::atomic<int> run(0);
+
+  // Keep one worker busy, and queue work from it: the other worker has
+  // to pick it up.
+  pool.Add([&]() {
+    blocker_started.Notify();
+    for (int i = 0; i < 10; ++i) {
+      pool.Add([&]() {
+        if (++run == 10) {
+          others_done.Notify();
+        }
+      });
+    }
+    release_blocker.WaitForNotification();
+  });
+
+  blocker_started.WaitForNotification();
+  others_done.WaitForNotification();
+  EXPECT_EQ(10, run);
+  release_blocker.Notify();
+}
+
+
 }  // namespace cert_trans
 
 
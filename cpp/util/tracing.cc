@@ -0,0 +1,295 @@
+#include "config.h"
+#include "util/tracing.h"
+
+#include <glog/logging.h>
+#include <chrono>
+#include <deque>
+#include <iomanip>
+#include <mutex>
+#include <random>
+#include <vector>
+
+DEFINE_double(trace_sample_rate, 0,
+              "Fraction of requests to trace (0 to trace none)");
+DEFINE_int32(trace_max_spans, 10000,
+             "Maximum number of finished spans to keep for export, the "
+             "oldest are dropped first");
+
+using std::chrono::nanoseconds;
+using std::chrono::duration_cast;
+using std::chrono::system_clock;
+using std::deque;
+using std::function;
+using std::lock_guard;
+using std::mutex;
+using std::ostream;
+using std::string;
+using std::vector;
+
+namespace cert_trans {
+namespace {
+
+
+struct FinishedSpan {
+  TraceContext context;
+  uint64_t parent_span_id;
+  string name;
+  int64_t start_ns;
+  int64_t end_ns;
+};
+
+
+// Spans finished by a thread are only handed over once this many have
+// built up, or once the thread is done with the trace.
+const size_t kSpanBufferSize = 64;
+
+
+// The recently finished spans of all threads.
+class Collector {
+ public:
+  void Add(vector<FinishedSpan>* spans) {
+    lock_guard<mutex> lock(lock_);
+    for (auto& span : *spans) {
+      spans_.emplace_back(std::move(span));
+    }
+    spans->clear();
+    while (spans_.size() >
+           static_cast<size_t>(std::max(FLAGS_trace_max_spans, 0))) {
+      spans_.pop_front();
+    }
+  }
+
+  deque<FinishedSpan> Spans() const {
+    lock_guard<mutex> lock(lock_);
+    return spans_;
+  }
+
+  void Clear() {
+    lock_guard<mutex> lock(lock_);
+    spans_.clear();
+  }
+
+ private:
+  mutable mutex lock_;
+  deque<FinishedSpan> spans_;
+};
+
+
+Collector* GetCollector() {
+  static Collector* const collector(new Collector);
+  return collector;
+}
+
+
+#ifdef HAVE_THREAD_LOCAL
+thread_local TraceContext current_context;
+thread_local vector<FinishedSpan>* span_buffer = nullptr;
+thread_local uint64_t random_state = 0;
+#elif HAVE___THREAD
+__thread TraceContext current_context;
+__thread vector<FinishedSpan>* span_buffer = nullptr;
+__thread uint64_t random_state = 0;
+#else
+#error No suitable thread local storage available
+#endif
+
+
+// splitmix64, seeded per thread, which is plenty for sampling and for
+// identifiers.
+uint64_t Random() {
+  if (random_state == 0) {
+    std::random_device device;
+    random_state = (static_cast<uint64_t>(device()) << 32) ^ device() ^
+                   reinterpret_cast<uintptr_t>(&random_state);
+  }
+  uint64_t z(random_state += 0x9e3779b97f4a7c15ULL);
+  z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+  z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+  return z ^ (z >> 31);
+}
+
+
+uint64_t NonZeroRandom() {
+  uint64_t ret;
+  do {
+    ret = Random();
+  } while (ret == 0);
+  return ret;
+}
+
+
+int64_t NowNanos() {
+  return duration_cast<nanoseconds>(system_clock::now().time_since_epoch())
+      .count();
+}
+
+
+void FlushSpans() {
+  if (span_buffer && !span_buffer->empty()) {
+    GetCollector()->Add(span_buffer);
+  }
+}
+
+
+void SetCurrentContext(const TraceContext& context) {
+  current_context = context;
+  // The thread is done with the trace, for now at least.
+  if (!context.sampled()) {
+    FlushSpans();
+  }
+}
+
+
+void WriteHex(ostream* os, uint64_t value) {
+  *os << std::hex << std::setw(16) << std::setfill('0') << value << std::dec;
+}
+
+
+void WriteJsonString(ostream* os, const string& value) {
+  *os << '"';
+  for (const char c : value) {
+    if (c == '"' || c == '\\') {
+      *os << '\\' << c;
+    } else if (static_cast<unsigned char>(c) < 0x20) {
+      *os << ' ';
+    } else {
+      *os << c;
+    }
+  }
+  *os << '"';
+}
+
+
+}  // namespace
+
+
+TraceContext CurrentTraceContext() {
+  return current_context;
+}
+
+
+ScopedTraceContext::ScopedTraceContext(const TraceContext& context)
+    : previous_(current_context) {
+  current_context = context;
+}
+
+
+ScopedTraceContext::~ScopedTraceContext() {
+  SetCurrentContext(previous_);
+}
+
+
+ScopedSpan::ScopedSpan(const char* name)
+    : parent_(), span_id_(0), start_ns_(0) {
+  if (current_context.sampled()) {
+    Start(name, current_context);
+  }
+}
+
+
+ScopedSpan::ScopedSpan(const char* name, bool new_trace)
+    : parent_(), span_id_(0), start_ns_(0) {
+  if (current_context.sampled()) {
+    Start(name, current_context);
+  } else if (new_trace && FLAGS_trace_sample_rate > 0 &&
+             Random() < FLAGS_trace_sample_rate * 18446744073709551615.0) {
+    TraceContext root = TraceContext();
+    root.trace_id_high = Random();
+    root.trace_id_low = NonZeroRandom();
+    Start(name, root);
+  }
+}
+
+
+void ScopedSpan::Start(const char* name, const TraceContext& parent) {
+  parent_ = parent;
+  span_id_ = NonZeroRandom();
+  name_ = name;
+  current_context.trace_id_high = parent.trace_id_high;
+  current_context.trace_id_low = parent.trace_id_low;
+  current_context.span_id = span_id_;
+  start_ns_ = NowNanos();
+}
+
+
+ScopedSpan::~ScopedSpan() {
+  if (span_id_ == 0) {
+    return;
+  }
+  if (!span_buffer) {
+    span_buffer = new vector<FinishedSpan>;
+    span_buffer->reserve(kSpanBufferSize);
+  }
+  FinishedSpan span;
+  span.context = current_context;
+  span.parent_span_id = parent_.span_id;
+  span.name = std::move(name_);
+  span.start_ns = start_ns_;
+  span.end_ns = NowNanos();
+  span_buffer->emplace_back(std::move(span));
+  if (span_buffer->size() >= kSpanBufferSize) {
+    FlushSpans();
+  }
+
+  // A root span's parent is not sampled, so this hands its spans over.
+  SetCurrentContext(parent_.span_id != 0 ? parent_ : TraceContext());
+}
+
+
+function<void()> TraceClosure(const function<void()>& closure) {
+  const TraceContext context(current_context);
+  if (!context.sampled()) {
+    return closure;
+  }
+  return [context, closure]() {
+    ScopedTraceContext scoped_context(context);
+    closure();
+  };
+}
+
+
+void ExportTracesAsOtlpJson(ostream* os) {
+  CHECK_NOTNULL(os);
+  // Include what this thread has not handed over yet.
+  FlushSpans();
+  const deque<FinishedSpan> spans(GetCollector()->Spans());
+
+  *os << "{\"resourceSpans\":[{\"resource\":{\"attributes\":["
+      << "{\"key\":\"service.name\",\"value\":{\"stringValue\":"
+      << "\"certificate-transparency\"}}]},"
+      << "\"scopeSpans\":[{\"scope\":{\"name\":\"cert_trans\"},\"spans\":[";
+  bool first(true);
+  for (const FinishedSpan& span : spans) {
+    if (!first) {
+      *os << ',';
+    }
+    first = false;
+    *os << "{\"traceId\":\"";
+    WriteHex(os, span.context.trace_id_high);
+    WriteHex(os, span.context.trace_id_low);
+    *os << "\",\"spanId\":\"";
+    WriteHex(os, span.context.span_id);
+    *os << '"';
+    if (span.parent_span_id != 0) {
+      *os << ",\"parentSpanId\":\"";
+      WriteHex(os, span.parent_span_id);
+      *os << '"';
+    }
+    *os << ",\"name\":";
+    WriteJsonString(os, span.name);
+    // SPAN_KIND_INTERNAL, or SPAN_KIND_SERVER for the root of a trace.
+    *os << ",\"kind\":" << (span.parent_span_id == 0 ? 2 : 1)
+        << ",\"startTimeUnixNano\":\"" << span.start_ns
+        << "\",\"endTimeUnixNano\":\"" << span.end_ns << "\"}";
+  }
+  *os << "]}]}]}";
+}
+
+
+void ClearTracesForTesting() {
+  FlushSpans();
+  GetCollector()->Clear();
+}
+
+
+}  // namespace cert_trans
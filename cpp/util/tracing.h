@@ -0,0 +1,111 @@
+#ifndef CERT_TRANS_UTIL_TRACING_H_
+#define CERT_TRANS_UTIL_TRACING_H_
+
+#include <gflags/gflags.h>
+#include <stdint.h>
+#include <functional>
+#include <ostream>
+#include <string>
+
+DECLARE_double(trace_sample_rate);
+
+namespace cert_trans {
+
+
+// Sampled tracing of requests, to see where the time goes in a single
+// request without attaching a profiler.
+//
+// A ScopedTrace at the start of a request decides whether to sample
+// it. If it does, the ScopedSpan objects created while it is current,
+// on whichever thread, record a span each. Spans are buffered per
+// thread, and collected into a bounded buffer of recent spans, which
+// can be exported with ExportTracesAsOtlpJson(). If it does not, they
+// cost one thread-local read each.
+//
+// The current trace follows work across threads through util::Task
+// callbacks and ThreadPool closures. Elsewhere, capture
+// CurrentTraceContext() and use a ScopedTraceContext.
+
+
+// Identifies a sampled trace, and the span in it which new spans are
+// children of. Value initialised, it is not sampled.
+struct TraceContext {
+  bool sampled() const {
+    return trace_id_high != 0 || trace_id_low != 0;
+  }
+
+  uint64_t trace_id_high;
+  uint64_t trace_id_low;
+  uint64_t span_id;
+};
+
+
+// Returns the trace context of the current thread.
+TraceContext CurrentTraceContext();
+
+
+// Makes |context| the current thread's trace context for its lifetime,
+// e.g. while running work for a request on another thread.
+class ScopedTraceContext {
+ public:
+  explicit ScopedTraceContext(const TraceContext& context);
+  ~ScopedTraceContext();
+
+  ScopedTraceContext(const ScopedTraceContext&) = delete;
+  ScopedTraceContext& operator=(const ScopedTraceContext&) = delete;
+
+ private:
+  const TraceContext previous_;
+};
+
+
+// Records a span called |name| from its construction to its
+// destruction, if the current trace is sampled, as a child of the
+// current span, which it becomes for its lifetime.
+class ScopedSpan {
+ public:
+  explicit ScopedSpan(const char* name);
+  ~ScopedSpan();
+
+  ScopedSpan(const ScopedSpan&) = delete;
+  ScopedSpan& operator=(const ScopedSpan&) = delete;
+
+ protected:
+  // Starts a new trace, with probability --trace_sample_rate, unless
+  // the current one is sampled already.
+  ScopedSpan(const char* name, bool new_trace);
+
+ private:
+  void Start(const char* name, const TraceContext& parent);
+
+  TraceContext parent_;
+  uint64_t span_id_;
+  int64_t start_ns_;
+  std::string name_;
+};
+
+
+// The span of a whole request, at the root of its trace.
+class ScopedTrace : public ScopedSpan {
+ public:
+  explicit ScopedTrace(const char* name) : ScopedSpan(name, true) {
+  }
+};
+
+
+// Returns |closure|, wrapped so that it runs in the current trace
+// context, if it is sampled.
+std::function<void()> TraceClosure(const std::function<void()>& closure);
+
+
+// Writes the spans collected so far as an OpenTelemetry (OTLP/JSON)
+// ExportTraceServiceRequest.
+void ExportTracesAsOtlpJson(std::ostream* os);
+
+// Drops the spans collected so far.
+void ClearTracesForTesting();
+
+
+}  // namespace cert_trans
+
+#endif  // CERT_TRANS_UTIL_TRACING_H_
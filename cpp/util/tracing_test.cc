@@ -0,0 +1,138 @@
+#include "util/tracing.h"
+
+#include <gflags/gflags.h>
+#include <glog/logging.h>
+#include <gtest/gtest.h>
+#include <sstream>
+#include <string>
+
+#include "base/notification.h"
+#include "util/sync_task.h"
+#include "util/testing.h"
+#include "util/thread_pool.h"
+
+namespace cert_trans {
+namespace {
+
+using std::ostringstream;
+using std::string;
+using util::SyncTask;
+using util::Task;
+
+
+class TracingTest : public ::testing::Test {
+ protected:
+  void SetUp() override {
+    ClearTracesForTesting();
+  }
+
+  void TearDown() override {
+    FLAGS_trace_sample_rate = 0;
+  }
+
+  string Export() {
+    ostringstream oss;
+    ExportTracesAsOtlpJson(&oss);
+    return oss.str();
+  }
+
+  static int Count(const string& haystack, const string& needle) {
+    int ret(0);
+    for (size_t pos(haystack.find(needle)); pos != string::npos;
+         pos = haystack.find(needle, pos + 1)) {
+      ++ret;
+    }
+    return ret;
+  }
+};
+
+
+TEST_F(TracingTest, NotSampled) {
+  FLAGS_trace_sample_rate = 0;
+  {
+    ScopedTrace trace("root");
+    EXPECT_FALSE(CurrentTraceContext().sampled());
+    ScopedSpan span("child");
+  }
+  EXPECT_EQ(0, Count(Export(), "\"spanId\""));
+}
+
+
+TEST_F(TracingTest, SpansOutsideTracesAreIgnored) {
+  FLAGS_trace_sample_rate = 1;
+  {
+    ScopedSpan span("orphan");
+    EXPECT_FALSE(CurrentTraceContext().sampled());
+  }
+  EXPECT_EQ(0, Count(Export(), "\"spanId\""));
+}
+
+
+TEST_F(TracingTest, RecordsNestedSpans) {
+  FLAGS_trace_sample_rate = 1;
+  TraceContext root_context;
+  {
+    ScopedTrace trace("root");
+    root_context = CurrentTraceContext();
+    EXPECT_TRUE(root_context.sampled());
+    {
+      ScopedSpan span("child");
+      const TraceContext child_context(CurrentTraceContext());
+      EXPECT_EQ(root_context.trace_id_low, child_context.trace_id_low);
+      EXPECT_NE(root_context.span_id, child_context.span_id);
+    }
+    EXPECT_EQ(root_context.span_id, CurrentTraceContext().span_id);
+  }
+  EXPECT_FALSE(CurrentTraceContext().sampled());
+
+  const string json(Export());
+  EXPECT_EQ(2, Count(json, "\"spanId\""));
+  EXPECT_NE(string::npos, json.find("\"name\":\"root\""));
+  EXPECT_NE(string::npos, json.find("\"name\":\"child\""));
+  // Only the child has a parent.
+  EXPECT_EQ(1, Count(json, "parentSpanId"));
+}
+
+
+TEST_F(TracingTest, FollowsThreadPoolAndTasks) {
+  FLAGS_trace_sample_rate = 1;
+  ThreadPool pool(2);
+  TraceContext root_context;
+  TraceContext closure_context;
+  TraceContext callback_context;
+  {
+    ScopedTrace trace("root");
+    root_context = CurrentTraceContext();
+
+    Notification done;
+    pool.Add([&closure_context, &done]() {
+      ScopedSpan span("on-pool");
+      closure_context = CurrentTraceContext();
+      done.Notify();
+    });
+    done.WaitForNotification();
+
+    SyncTask task(&pool);
+    Task* const child(task.task()->AddChild([&callback_context](Task*) {
+      callback_context = CurrentTraceContext();
+    }));
+    child->Return();
+    task.task()->Return();
+    task.Wait();
+  }
+
+  EXPECT_EQ(root_context.trace_id_low, closure_context.trace_id_low);
+  EXPECT_NE(root_context.span_id, closure_context.span_id);
+  EXPECT_EQ(root_context.trace_id_low, callback_context.trace_id_low);
+  EXPECT_EQ(root_context.span_id, callback_context.span_id);
+}
+
+
+}  // namespace
+}  // namespace cert_trans
+
+
+int main(int argc, char** argv) {
+  cert_trans::test::InitTesting(argv[0], &argc, &argv, true);
+  return RUN_ALL_TESTS();
+}
@@ -43,6 +43,116 @@ char ByteValue(char high, char low) {
   return ret;
 }
 
+const char kBase64Chars[] =
+    "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+
+// The value of each base 64 character, 0xff for the others.
+const uint8_t kBase64Values[256] = {
+    0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+    0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+    0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+    0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0x3e, 0xff, 0xff, 0xff, 0x3f,
+    0x34, 0x35, 0x36, 0x37, 0x38, 0x39, 0x3a, 0x3b, 0x3c, 0x3d, 0xff, 0xff,
+    0xff, 0xff, 0xff, 0xff, 0xff, 0x00, 0x01, 0x02, 0x03, 0x04, 0x05, 0x06,
+    0x07, 0x08, 0x09, 0x0a, 0x0b, 0x0c, 0x0d, 0x0e, 0x0f, 0x10, 0x11, 0x12,
+    0x13, 0x14, 0x15, 0x16, 0x17, 0x18, 0x19, 0xff, 0xff, 0xff, 0xff, 0xff,
+    0xff, 0x1a, 0x1b, 0x1c, 0x1d, 0x1e, 0x1f, 0x20, 0x21, 0x22, 0x23, 0x24,
+    0x25, 0x26, 0x27, 0x28, 0x29, 0x2a, 0x2b, 0x2c, 0x2d, 0x2e, 0x2f, 0x30,
+    0x31, 0x32, 0x33, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+    0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+    0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+    0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+    0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+    0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+    0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+    0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+    0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+    0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+    0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+    0xff, 0xff, 0xff, 0xff,
+};
+
+// Every pair of base 64 characters, indexed by the 12 bits they encode,
+// so that the encoder does half the lookups.
+struct Base64PairTable {
+  Base64PairTable() {
+    for (int i = 0; i < 4096; ++i) {
+      chars[i * 2] = kBase64Chars[i >> 6];
+      chars[i * 2 + 1] = kBase64Chars[i & 0x3f];
+    }
+  }
+
+  char chars[4096 * 2];
+};
+
+const Base64PairTable& Base64Pairs() {
+  static const Base64PairTable* const table(new Base64PairTable);
+  return *table;
+}
+
+// Decodes |b64| to the end of |out| if it is in the canonical form
+// (padded, with no whitespace and no stray bits in the padding), which
+// is what is found in practice. Returns false otherwise, leaving
+// whatever was decoded at the end of |out|.
+bool DecodeBase64(const char* b64, size_t size, string* out) {
+  if (size % 4 != 0) {
+    return false;
+  }
+  const size_t offset(out->size());
+  out->resize(offset + size / 4 * 3);
+  if (size == 0) {
+    return true;
+  }
+
+  const unsigned char* in(reinterpret_cast<const unsigned char*>(b64));
+  const unsigned char* const last(in + size - 4);
+  char* o(&(*out)[offset]);
+
+  for (; in < last; in += 4, o += 3) {
+    const uint32_t a(kBase64Values[in[0]]), b(kBase64Values[in[1]]),
+        c(kBase64Values[in[2]]), d(kBase64Values[in[3]]);
+    if ((a | b | c | d) & 0x80) {
+      return false;
+    }
+    const uint32_t group((a << 18) | (b << 12) | (c << 6) | d);
+    o[0] = static_cast<char>(group >> 16);
+    o[1] = static_cast<char>(group >> 8);
+    o[2] = static_cast<char>(group);
+  }
+
+  // The last group may be padded.
+  const uint32_t a(kBase64Values[in[0]]), b(kBase64Values[in[1]]);
+  if ((a | b) & 0x80) {
+    return false;
+  }
+  o[0] = static_cast<char>((a << 2) | (b >> 4));
+  if (in[2] == '=') {
+    if (in[3] != '=' || (b & 0x0f) != 0) {
+      return false;
+    }
+    out->resize(out->size() - 2);
+    return true;
+  }
+  const uint32_t c(kBase64Values[in[2]]);
+  if (c & 0x80) {
+    return false;
+  }
+  o[1] = static_cast<char>((b << 4) | (c >> 2));
+  if (in[3] == '=') {
+    if ((c & 0x03) != 0) {
+      return false;
+    }
+    out->resize(out->size() - 1);
+    return true;
+  }
+  const uint32_t d(kBase64Values[in[3]]);
+  if (d & 0x80) {
+    return false;
+  }
+  o[2] = static_cast<char>((c << 6) | d);
+  return true;
+}
+
 }  // namespace
 
 string HexString(const string& data) {
@@ -175,28 +285,95 @@ string RandomString(size_t min_length, size_t max_length) {
   return ret;
 }
 
+size_t Base64Length(size_t size) {
+  // base 64 is 4 output bytes for every 3 input bytes (rounded up).
+  return ((size + 2) / 3) * 4;
+}
+
+size_t ToBase64(const char* data, size_t size, char* out) {
+  const char* const pairs(Base64Pairs().chars);
+  const unsigned char* in(reinterpret_cast<const unsigned char*>(data));
+  const unsigned char* const end(in + size - size % 3);
+  char* o(out);
+
+  // Each group of three bytes is two 12 bit halves, each looked up as
+  // a pair of characters.
+  for (; in < end; in += 3, o += 4) {
+    const uint32_t group((in[0] << 16) | (in[1] << 8) | in[2]);
+    memcpy(o, pairs + (group >> 12) * 2, 2);
+    memcpy(o + 2, pairs + (group & 0xfff) * 2, 2);
+  }
+
+  switch (size % 3) {
+    case 1:
+      o[0] = kBase64Chars[in[0] >> 2];
+      o[1] = kBase64Chars[(in[0] & 0x03) << 4];
+      o[2] = '=';
+      o[3] = '=';
+      o += 4;
+      break;
+    case 2:
+      o[0] = kBase64Chars[in[0] >> 2];
+      o[1] = kBase64Chars[((in[0] & 0x03) << 4) | (in[1] >> 4)];
+      o[2] = kBase64Chars[(in[1] & 0x0f) << 2];
+      o[3] = '=';
+      o += 4;
+      break;
+  }
+
+  return o - out;
+}
+
+string ToBase64(const string& from) {
+  // Encode straight into the result.
+  string ret(Base64Length(from.size()), '\0');
+  if (!ret.empty()) {
+    ToBase64(from.data(), from.size(), &ret[0]);
+  }
+  return ret;
+}
+
+bool FromBase64(const char* b64, size_t size, string* out) {
+  CHECK_NOTNULL(out)->clear();
+  return AppendFromBase64(b64, size, out);
+}
+
+bool AppendFromBase64(const char* b64, size_t size, string* out) {
+  CHECK_NOTNULL(out);
+  const size_t offset(out->size());
+  if (DecodeBase64(b64, size, out)) {
+    return true;
+  }
+
+  // Not in the canonical form (such as with whitespace, which b64_pton
+  // skips), let b64_pton have the final word. It wants a NUL terminated
+  // string, and base 64 encoding is always >= in length to the decoded
+  // value.
+  const string terminated(b64, size);
+  out->resize(offset + size);
+  const int length(
+      size == 0 ? 0 : b64_pton(terminated.c_str(),
+                               reinterpret_cast<u_char*>(&(*out)[offset]),
+                               size));
+  if (length < 0) {
+    out->resize(offset);
+    return false;
+  }
+  out->resize(offset + length);
+  return true;
+}
+
 string FromBase64(const char* b64) {
-  size_t length = strlen(b64);
-  // Lazy: base 64 encoding is always >= in length to decoded value
-  // (equality occurs for zero length).
-  u_char* buf = new u_char[length];
-  int rlength = b64_pton(b64, buf, length);
-  // Treat decode errors as empty strings.
-  if (rlength < 0)
-    rlength = 0;
-  string ret(reinterpret_cast<char*>(buf), rlength);
-  delete[] buf;
+  // Decode straight into the result, as values read from etcd can be
+  // large. Treat decode errors as empty strings.
+  string ret;
+  FromBase64(b64, strlen(b64), &ret);
   return ret;
 }
 
-string ToBase64(const string& from) {
-  // base 64 is 4 output bytes for every 3 input bytes (rounded up).
-  size_t length = ((from.size() + 2) / 3) * 4;
-  char* buf = new char[length + 1];
-  length =
-      b64_ntop((const u_char*)from.data(), from.length(), buf, length + 1);
-  string ret(buf, length);
-  delete[] buf;
+string FromBase64(const string& b64) {
+  string ret;
+  FromBase64(b64.data(), b64.size(), &ret);
   return ret;
 }
 
@@ -1,6 +1,7 @@
 #ifndef CERT_TRANS_UTIL_UTIL_H_
 #define CERT_TRANS_UTIL_UTIL_H_
 
+#include <stddef.h>
 #include <stdint.h>
 #include <string>
 #include <vector>
@@ -32,7 +33,26 @@ uint64_t TimeInMilliseconds();
 // srand() is called if needed.
 std::string RandomString(size_t min_length, size_t max_length);
 
+// Decodes the |size| characters of base 64 at |b64| into |out|,
+// replacing its contents (and reusing its storage). Returns false, and
+// leaves |out| empty, if they are not valid base 64.
+bool FromBase64(const char* b64, size_t size, std::string* out);
+
+// As above, but appends to |out|, which is left as it was if the
+// characters are not valid base 64.
+bool AppendFromBase64(const char* b64, size_t size, std::string* out);
+
+// Decode errors are returned as empty strings.
 std::string FromBase64(const char* b64);
+std::string FromBase64(const std::string& b64);
+
+// Returns the length of the base 64 encoding of |size| bytes.
+size_t Base64Length(size_t size);
+
+// Writes the base 64 encoding of the |size| bytes at |data| to |out|,
+// which must have room for Base64Length(size) characters (it is not
+// NUL terminated). Returns the number of characters written.
+size_t ToBase64(const char* data, size_t size, char* out);
 
 std::string ToBase64(const std::string& from);
 
@@ -0,0 +1,107 @@
+#include "util/util.h"
+
+#include <gtest/gtest.h>
+#include <netinet/in.h>  // for resolv.h
+#include <resolv.h>      // for b64_ntop
+#include <cstring>
+#include <string>
+
+#include "util/testing.h"
+
+namespace util {
+namespace {
+
+using std::string;
+
+
+// The reference encoding.
+string NtopBase64(const string& from) {
+  string ret(Base64Length(from.size()) + 1, '\0');
+  ret.resize(b64_ntop(reinterpret_cast<const u_char*>(from.data()),
+                      from.size(), &ret[0], ret.size()));
+  return ret;
+}
+
+
+TEST(UtilTest, Base64KnownValues) {
+  EXPECT_EQ("", ToBase64(""));
+  EXPECT_EQ("Zg==", ToBase64("f"));
+  EXPECT_EQ("Zm8=", ToBase64("fo"));
+  EXPECT_EQ("Zm9v", ToBase64("foo"));
+  EXPECT_EQ("Zm9vYg==", ToBase64("foob"));
+  EXPECT_EQ("Zm9vYmE=", ToBase64("fooba"));
+  EXPECT_EQ("Zm9vYmFy", ToBase64("foobar"));
+
+  EXPECT_EQ("", FromBase64(""));
+  EXPECT_EQ("f", FromBase64("Zg=="));
+  EXPECT_EQ("fo", FromBase64("Zm8="));
+  EXPECT_EQ("foobar", FromBase64("Zm9vYmFy"));
+}
+
+
+TEST(UtilTest, Base64RoundTrip) {
+  string data;
+  for (int size = 0; size < 300; ++size) {
+    const string encoded(ToBase64(data));
+    EXPECT_EQ(NtopBase64(data), encoded) << size;
+
+    string decoded("left over");
+    EXPECT_TRUE(FromBase64(encoded.data(), encoded.size(), &decoded));
+    EXPECT_EQ(data, decoded) << size;
+
+    data.push_back(static_cast<char>(size * 37 + 11));
+  }
+}
+
+
+TEST(UtilTest, Base64ToBuffer) {
+  const string data("\x00\xff\x10 buffer", 10);
+  string out(Base64Length(data.size()) + 1, '#');
+  EXPECT_EQ(Base64Length(data.size()),
+            ToBase64(data.data(), data.size(), &out[0]));
+  // Nothing is written past the encoding.
+  EXPECT_EQ('#', out.back());
+  out.pop_back();
+  EXPECT_EQ(ToBase64(data), out);
+}
+
+
+TEST(UtilTest, Base64Invalid) {
+  string out("left over");
+  for (const char* invalid :
+       {"Zg", "Zg=", "Zm9", "Z===", "Zh==", "Zm9=", "Zm!v", "Zm9v=", "=Zm9",
+        "Zg==Zg=="}) {
+    EXPECT_FALSE(FromBase64(invalid, strlen(invalid), &out)) << invalid;
+    EXPECT_EQ("", out) << invalid;
+    EXPECT_EQ("", FromBase64(invalid)) << invalid;
+  }
+}
+
+
+TEST(UtilTest, AppendFromBase64) {
+  string out("foo");
+  EXPECT_TRUE(AppendFromBase64("YmFy", 4, &out));
+  EXPECT_EQ("foobar", out);
+  EXPECT_TRUE(AppendFromBase64(" Zg = = ", 8, &out));
+  EXPECT_EQ("foobarf", out);
+  // Nothing is appended if it is not valid.
+  EXPECT_FALSE(AppendFromBase64("Zm9=", 4, &out));
+  EXPECT_EQ("foobarf", out);
+}
+
+
+TEST(UtilTest, Base64Whitespace) {
+  // Whitespace is skipped, as b64_pton does.
+  EXPECT_EQ("foobar", FromBase64("Zm9v\nYmFy\n"));
+  EXPECT_EQ("fo", FromBase64(" Zm8 = "));
+}
+
+
+}  // namespace
+}  // namespace util
+
+
+int main(int argc, char** argv) {
+  cert_trans::test::InitTesting(argv[0], &argc, &argv, true);
+  return RUN_ALL_TESTS();
+}